@@ -12,6 +12,8 @@
  */
 
 #include <math.h>
+#include <ctype.h>
+#include <stdint.h>
 
 #include "slaxinternals.h"
 #include <libslax/slax.h>
@@ -23,50 +25,228 @@
 
 #define URI_BIT  "http://xml.libslax.org/bit"
 
-static xmlChar *
-extBitStringVal (xmlXPathParserContextPtr ctxt, xmlXPathObjectPtr xop)
+/*
+ * Bit strings are parsed into words so the operators can work on 64
+ * bits at a time.  Bit zero is the low bit of bv_words[0], which is the
+ * last character of the string form.  bv_width is the width of the
+ * string form, which is kept since results are as wide as the widest
+ * operand, leading zeros included.
+ */
+typedef struct bit_value_s {
+    unsigned bv_width;		/* Width in bits */
+    unsigned bv_nwords;		/* Number of words in bv_words */
+    uint64_t *bv_words;		/* The bits, low word first */
+    uint64_t bv_word;		/* Storage for values that fit in a word */
+} bit_value_t;
+
+#define BIT_WORD_BITS	64
+#define BIT_NWORDS(_w)	(((_w) + BIT_WORD_BITS - 1) / BIT_WORD_BITS)
+
+static inline uint64_t
+extBitWord (bit_value_t *bvp, unsigned i)
+{
+    return (i < bvp->bv_nwords) ? bvp->bv_words[i] : 0;
+}
+
+static inline int
+extBitTest (bit_value_t *bvp, unsigned bit)
+{
+    return (extBitWord(bvp, bit / BIT_WORD_BITS)
+	    >> (bit % BIT_WORD_BITS)) & 1;
+}
+
+static void
+extBitValueClean (bit_value_t *bvp)
+{
+    if (bvp->bv_words && bvp->bv_words != &bvp->bv_word)
+	xmlFree(bvp->bv_words);
+    bvp->bv_words = NULL;
+}
+
+/*
+ * Make room for "width" bits, all clear
+ */
+static int
+extBitValueAlloc (bit_value_t *bvp, unsigned width)
+{
+    unsigned nwords = BIT_NWORDS(width) ?: 1;
+
+    bvp->bv_width = width;
+    bvp->bv_nwords = nwords;
+
+    if (nwords == 1) {
+	bvp->bv_words = &bvp->bv_word;
+    } else {
+	bvp->bv_words = xmlMalloc(nwords * sizeof(uint64_t));
+	if (bvp->bv_words == NULL)
+	    return -1;
+    }
+
+    memset(bvp->bv_words, 0, nwords * sizeof(uint64_t));
+    return 0;
+}
+
+/*
+ * Return the number of significant bits in a value
+ */
+static unsigned
+extBitSignificant (bit_value_t *bvp)
+{
+    unsigned i;
+
+    for (i = bvp->bv_nwords; i > 0; i--)
+	if (bvp->bv_words[i - 1])
+	    return (i - 1) * BIT_WORD_BITS
+		+ BIT_WORD_BITS - __builtin_clzll(bvp->bv_words[i - 1]);
+
+    return 0;
+}
+
+/*
+ * Parse a string of hex digits, stopping at the first non-digit
+ */
+static int
+extBitFromHexString (bit_value_t *bvp, const char *str)
+{
+    size_t len = strspn(str, "0123456789abcdefABCDEF");
+    unsigned i, bit, width;
+    int digit;
+
+    if (extBitValueAlloc(bvp, len * 4) < 0)
+	return -1;
+
+    for (i = 0, bit = 0; i < len; i++, bit += 4) {
+	digit = str[len - 1 - i];
+	if (digit >= '0' && digit <= '9')
+	    digit -= '0';
+	else if (digit >= 'a' && digit <= 'f')
+	    digit -= 'a' - 10;
+	else
+	    digit -= 'A' - 10;
+
+	bvp->bv_words[bit / BIT_WORD_BITS]
+	    |= (uint64_t) digit << (bit % BIT_WORD_BITS);
+    }
+
+    /* Like bit:from-hex(), use only the significant bits */
+    width = extBitSignificant(bvp);
+    bvp->bv_width = width ?: 1;
+    return 0;
+}
+
+/*
+ * Turn an argument into a bit value.  Numbers are used as integers,
+ * strings starting with "0x" as hex values, and other strings as bit
+ * strings.  The object is freed.
+ */
+static int
+extBitValue (xmlXPathParserContextPtr ctxt, xmlXPathObjectPtr xop,
+	     bit_value_t *bvp)
 {
+    xmlChar *str;
+    const xmlChar *cp;
+    unsigned width, i;
+    int rc;
+
+    bzero(bvp, sizeof(*bvp));
+
     if (xop->type == XPATH_NUMBER) {
-	xmlChar *res;
-	int width;
-	unsigned long long val = xop->floatval, v2;
+	unsigned long long val = xop->floatval;
 
 	if (xop->floatval >= pow(2, 64))
 	    val = (unsigned long long) -1;
 
 	xmlXPathFreeObject(xop);
 
-	for (width = 0, v2 = val; v2; width++, v2 /= 2)
-	    continue;
+	extBitValueAlloc(bvp, BIT_WORD_BITS);
+	bvp->bv_word = val;
+	width = extBitSignificant(bvp);
+	bvp->bv_width = width ?: 1; /* Gotta have one zero */
+	return 0;
+    }
 
-	if (width == 0)		/* Gotta have one zero */
-	    width = 1;
+    if (xop->type == XPATH_STRING) {
+	str = xop->stringval;
+	xop->stringval = NULL;
+	xmlXPathFreeObject(xop);
+    } else {
+	/* Make libxml do the work for us */
+	valuePush(ctxt, xop);
+	str = xmlXPathPopString(ctxt);
+    }
 
-	res = xmlMalloc(width + 1);
-	if (res == NULL)
-	    return NULL;
+    if (str == NULL)
+	return -1;
 
-	res[width] = '\0';
-	for (width--, v2 = val; width >= 0; width--, v2 /= 2)
-	    res[width] = (v2 & 1) ? '1' : '0';
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+	rc = extBitFromHexString(bvp, (const char *) str + 2);
+	xmlFree(str);
+	return rc;
+    }
 
-	return res;
+    width = xmlStrlen(str);
+    if (extBitValueAlloc(bvp, width) < 0) {
+	xmlFree(str);
+	return -1;
     }
 
-    /* Make libxml do the work for us */
-    valuePush(ctxt, xop);
-    return xmlXPathPopString(ctxt);
+    for (i = 0, cp = str + width - 1; i < width; i++, cp--)
+	if (*cp == '1')
+	    bvp->bv_words[i / BIT_WORD_BITS] |= (uint64_t) 1 << (i % BIT_WORD_BITS);
+
+    xmlFree(str);
+    return 0;
+}
+
+static int
+extBitPopValue (xmlXPathParserContextPtr ctxt, bit_value_t *bvp)
+{
+    xmlXPathObjectPtr xop;
+
+    xop = valuePop(ctxt);
+    if (xop == NULL || xmlXPathCheckError(ctxt))
+	return -1;
+
+    return extBitValue(ctxt, xop, bvp);
 }
 
-typedef xmlChar (*slax_bit_callback_t)(xmlChar, xmlChar);
+/*
+ * Render the low "width" bits of a value as a bit string
+ */
+static xmlChar *
+extBitString (bit_value_t *bvp, unsigned width)
+{
+    xmlChar *res, *cp;
+    uint64_t word;
+    unsigned i, bit;
+
+    res = xmlMalloc(width + 1);
+    if (res == NULL)
+	return NULL;
+
+    cp = res + width;
+    *cp = '\0';
+
+    for (i = 0; i < width; i += BIT_WORD_BITS) {
+	word = extBitWord(bvp, i / BIT_WORD_BITS);
+	for (bit = 0; bit < BIT_WORD_BITS && i + bit < width; bit++) {
+	    *--cp = (word & 1) ? '1' : '0';
+	    word >>= 1;
+	}
+    }
+
+    return res;
+}
+
+typedef uint64_t (*slax_bit_callback_t)(uint64_t, uint64_t);
 
 static void
 extBitOperation (xmlXPathParserContextPtr ctxt, int nargs,
 		 slax_bit_callback_t func, const char *name)
 {
-    xmlChar *lv, *rv, *res;
-    int llen, rlen, width, i;
-    xmlXPathObjectPtr xop;
+    bit_value_t lv, rv, res;
+    xmlChar *str = NULL;
+    unsigned width, i;
 
     if (nargs != 2) {
 	xmlXPathSetArityError(ctxt);
@@ -74,48 +254,45 @@ extBitOperation (xmlXPathParserContextPtr ctxt, int nargs,
     }
 
     /* Pop args in reverse order */
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    rv = extBitStringVal(ctxt, xop);
-    if (rv == NULL)
+    if (extBitPopValue(ctxt, &rv) < 0)
 	return;
 
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    lv = extBitStringVal(ctxt, xop);
-    if (lv == NULL) {
-	xmlFree(rv);
+    if (extBitPopValue(ctxt, &lv) < 0) {
+	extBitValueClean(&rv);
 	return;
     }
 
-    llen = xmlStrlen(lv);
-    rlen = xmlStrlen(rv);
-    width = (llen > rlen) ? llen : rlen;
+    width = (lv.bv_width > rv.bv_width) ? lv.bv_width : rv.bv_width;
 
-    res = xmlMalloc(width + 1);
-    if (res) {
-	res[width] = '\0';
-	for (i = 0; i < width; i++) {
-	    xmlChar lb = (i >= width - llen) ? lv[i - (width - llen)] : '0';
-	    xmlChar rb = (i >= width - rlen) ? rv[i - (width - rlen)] : '0';
-	    res[i] = (*func)(lb, rb);
+    if (extBitValueAlloc(&res, width) == 0) {
+	for (i = 0; i < res.bv_nwords; i++)
+	    res.bv_words[i] = (*func)(extBitWord(&lv, i), extBitWord(&rv, i));
+
+	str = extBitString(&res, width);
+
+	if (slaxLogIsEnabled) {
+	    xmlChar *ls = extBitString(&lv, lv.bv_width);
+	    xmlChar *rs = extBitString(&rv, rv.bv_width);
+
+	    slaxLog("bit:%s:: %d [%s] -> [%s] == [%s]",
+		    name, width, ls, rs, str);
+	    xmlFree(ls);
+	    xmlFree(rs);
 	}
-    }
 
-    slaxLog("bit:%s:: %d [%s] -> [%s] == [%s]", name, width, lv, rv, res);
+	extBitValueClean(&res);
+    }
 
-    xmlFree(lv);
-    xmlFree(rv);
+    extBitValueClean(&lv);
+    extBitValueClean(&rv);
 
-    xmlXPathReturnString(ctxt, res);
+    xmlXPathReturnString(ctxt, str);
 }
 
-static xmlChar
-extBitOpAnd (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpAnd (uint64_t lb, uint64_t rb)
 {
-    return (lb == '1' && rb == '1') ? '1' : '0';
+    return lb & rb;
 }
 
 static void
@@ -124,10 +301,10 @@ extBitAnd (xmlXPathParserContextPtr ctxt, int nargs)
     extBitOperation(ctxt, nargs, extBitOpAnd, "and");
 }
 
-static xmlChar
-extBitOpOr (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpOr (uint64_t lb, uint64_t rb)
 {
-    return (lb == '1' || rb == '1') ? '1' : '0';
+    return lb | rb;
 }
 
 static void
@@ -136,10 +313,10 @@ extBitOr (xmlXPathParserContextPtr ctxt, int nargs)
     extBitOperation(ctxt, nargs, extBitOpOr, "or");
 }
 
-static xmlChar
-extBitOpNand (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpNand (uint64_t lb, uint64_t rb)
 {
-    return (lb == '1' && rb == '1') ? '0' : '1';
+    return ~(lb & rb);
 }
 
 static void
@@ -148,10 +325,10 @@ extBitNand (xmlXPathParserContextPtr ctxt, int nargs)
     extBitOperation(ctxt, nargs, extBitOpNand, "nand");
 }
 
-static xmlChar
-extBitOpNor (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpNor (uint64_t lb, uint64_t rb)
 {
-    return (lb == '1' || rb == '1') ? '0' : '1';
+    return ~(lb | rb);
 }
 
 static void
@@ -160,10 +337,10 @@ extBitNor (xmlXPathParserContextPtr ctxt, int nargs)
     extBitOperation(ctxt, nargs, extBitOpNor, "nor");
 }
 
-static xmlChar
-extBitOpXor (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpXor (uint64_t lb, uint64_t rb)
 {
-    return (lb != rb) ? '1' : '0';
+    return lb ^ rb;
 }
 
 static void
@@ -172,10 +349,10 @@ extBitXor (xmlXPathParserContextPtr ctxt, int nargs)
     extBitOperation(ctxt, nargs, extBitOpXor, "xor");
 }
 
-static xmlChar
-extBitOpXnor (xmlChar lb, xmlChar rb)
+static uint64_t
+extBitOpXnor (uint64_t lb, uint64_t rb)
 {
-    return (lb == rb) ? '1' : '0';
+    return ~(lb ^ rb);
 }
 
 static void
@@ -187,28 +364,23 @@ extBitXnor (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 extBitNot (xmlXPathParserContextPtr ctxt, int nargs)
 {
+    bit_value_t bv;
     xmlChar *res;
-    int width, i;
-    xmlXPathObjectPtr xop;
+    unsigned i;
 
     if (nargs != 1) {
 	xmlXPathSetArityError(ctxt);
 	return;
     }
 
-    /* Pop args in reverse order */
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res = extBitStringVal(ctxt, xop);
-    if (res == NULL)
+    if (extBitPopValue(ctxt, &bv) < 0)
 	return;
 
-    width = xmlStrlen(res);
-    for (i = 0; i < width; i++) {
-	xmlChar lb = res[i];
-	res[i] = (lb == '0') ? '1' : '0';
-    }
+    for (i = 0; i < bv.bv_nwords; i++)
+	bv.bv_words[i] = ~bv.bv_words[i];
+
+    res = extBitString(&bv, bv.bv_width);
+    extBitValueClean(&bv);
 
     xmlXPathReturnString(ctxt, res);
 }
@@ -254,41 +426,29 @@ extBitMask (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 extBitToInt (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    xmlChar *res;
-    xmlXPathObjectPtr xop;
-    unsigned long long val;
-    int i;
+    bit_value_t bv;
+    double val;
 
     if (nargs != 1) {
 	xmlXPathSetArityError(ctxt);
 	return;
     }
 
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res = extBitStringVal(ctxt, xop);
-    if (res == NULL)
+    if (extBitPopValue(ctxt, &bv) < 0)
 	return;
 
-    for (i = 0, val = 0; i <= 64 && res[i]; i++) {
-	val <<= 1;
-	if (res[i] == '1')
-	    val += 1;
-    }
+    val = (bv.bv_width > BIT_WORD_BITS) ? -1 : (double) bv.bv_words[0];
+    extBitValueClean(&bv);
 
-    if (i > 64)
-	xmlXPathReturnNumber(ctxt, (double) -1);
-    else
-	xmlXPathReturnNumber(ctxt, (double) val);
+    xmlXPathReturnNumber(ctxt, val);
 }
 
 static void
 extBitFromInt (xmlXPathParserContextPtr ctxt, int nargs)
 {
     xmlChar *res;
-    xmlXPathObjectPtr xop;
-    int width = 0, len;
+    bit_value_t bv;
+    int width = 0;
 
     if (nargs != 1 && nargs != 2) {
 	xmlXPathSetArityError(ctxt);
@@ -302,22 +462,14 @@ extBitFromInt (xmlXPathParserContextPtr ctxt, int nargs)
 	    return;
     }
 
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res = extBitStringVal(ctxt, xop);
-    if (res == NULL)
+    if (extBitPopValue(ctxt, &bv) < 0)
 	return;
 
-    len = xmlStrlen(res);
-    if (width > len) {
-	res = xmlRealloc(res, width + 1);
-	if (res) {
-	    int count = width - len;
-	    memmove(res + count, res, len + 1);
-	    memset(res, '0', count);
-	}
-    }
+    if ((unsigned) width < bv.bv_width)
+	width = bv.bv_width;
+
+    res = extBitString(&bv, width);
+    extBitValueClean(&bv);
 
     xmlXPathReturnString(ctxt, res);
 }
@@ -325,51 +477,35 @@ extBitFromInt (xmlXPathParserContextPtr ctxt, int nargs)
 static void
 extBitToHex (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    xmlChar *res;
-    xmlXPathObjectPtr xop;
-    unsigned long long val;
-    int i, len1, len2;
+    char buf[2 + BIT_WORD_BITS / 4 + 1];
+    bit_value_t bv;
 
     if (nargs != 1) {
 	xmlXPathSetArityError(ctxt);
 	return;
     }
 
-    /* Pop args in reverse order */
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
+    if (extBitPopValue(ctxt, &bv) < 0)
 	return;
-    res = extBitStringVal(ctxt, xop);
-    if (res == NULL)
-	return;
-
-    for (i = 0, val = 0; i <= 64 && res[i]; i++) {
-	val <<= 1;
-	if (res[i] == '1')
-	    val += 1;
-    }
 
-    if (i > 64)
+    if (bv.bv_width > BIT_WORD_BITS)
 	xmlXPathReturnNumber(ctxt, (double) -1);
     else {
-	len1 = xmlStrlen(res);
-	len2 = snprintf((char *) res, len1 + 1, "0x%qx", val);
-	if (len2 > len1) {
-	    res = xmlRealloc(res, len2 + 1);
-	    if (res)
-		snprintf((char *) res, len2 + 1, "0x%qx", val);
-	}
-
-	xmlXPathReturnString(ctxt, res);
+	snprintf(buf, sizeof(buf), "0x%llx",
+		 (unsigned long long) bv.bv_words[0]);
+	xmlXPathReturnString(ctxt, xmlStrdup((const xmlChar *) buf));
     }
+
+    extBitValueClean(&bv);
 }
 
 static void
 extBitFromHex (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    xmlChar *res;
-    int maxw = 0, width = 0, i;
-    unsigned long long val, v2;
+    xmlChar *str, *res;
+    const char *cp;
+    bit_value_t bv;
+    int maxw = 0;
 
     if (nargs != 1 && nargs != 2) {
 	xmlXPathSetArityError(ctxt);
@@ -383,44 +519,39 @@ extBitFromHex (xmlXPathParserContextPtr ctxt, int nargs)
 	    return;
     }
 
-    res = xmlXPathPopString(ctxt);
-    if (res == NULL || xmlXPathCheckError(ctxt))
+    str = xmlXPathPopString(ctxt);
+    if (str == NULL || xmlXPathCheckError(ctxt))
 	return;
 
-    val = strtoull((char *) res, 0, 0x10);
-    
-    for (width = 0, v2 = val; v2; width++, v2 /= 2)
+    /* Accept what strtoull(3) would: white space and an optional "0x" */
+    for (cp = (const char *) str; isspace((int) *cp); cp++)
 	continue;
+    if (cp[0] == '0' && (cp[1] == 'x' || cp[1] == 'X'))
+	cp += 2;
 
-    if (width == 0)		/* Gotta have one zero */
-	width = 1;
-
-    if (maxw < width)
-	maxw = width;
+    if (extBitFromHexString(&bv, cp) < 0) {
+	xmlFree(str);
+	return;
+    }
+    xmlFree(str);
 
-    res = xmlRealloc(res, maxw + 1);
-    if (res) {
-	res[maxw] = '\0';
+    if ((unsigned) maxw < bv.bv_width)
+	maxw = bv.bv_width;
 
-	for (i = maxw - 1, v2 = val; i >= 0; i--) {
-	    if (width-- <= 0)
-		res[i] = '0';
-	    else {
-		res[i] = (v2 & 1) ? '1' : '0';
-		v2 /= 2;
-	    }
-	}
-    }
+    res = extBitString(&bv, maxw);
+    extBitValueClean(&bv);
 
     xmlXPathReturnString(ctxt, res);
 }
 
 static void
-extBitClearOrSet (xmlXPathParserContextPtr ctxt, int nargs, xmlChar value)
+extBitClearOrSet (xmlXPathParserContextPtr ctxt, int nargs, int value)
 {
     xmlChar *res;
-    int width, bitnum = 0, delta;
-    xmlXPathObjectPtr xop;
+    bit_value_t bv, nv;
+    int bitnum = 0;
+    unsigned width;
+    uint64_t *wp, mask;
 
     if (nargs != 1 && nargs != 2) {
 	xmlXPathSetArityError(ctxt);
@@ -434,52 +565,58 @@ extBitClearOrSet (xmlXPathParserContextPtr ctxt, int nargs, xmlChar value)
 	    return;
     }
 
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res = extBitStringVal(ctxt, xop);
-    if (res == NULL)
+    if (extBitPopValue(ctxt, &bv) < 0)
 	return;
 
-    width = xmlStrlen(res);
-    delta = width - bitnum - 1;
-
-    if (delta < 0) {
-	xmlChar *newp = xmlRealloc(res, bitnum + 2);
-	if (newp == NULL)
-	    return;
+    /* Setting or clearing a bit past the end widens the string */
+    width = bv.bv_width;
+    if ((unsigned) bitnum >= width) {
+	width = bitnum + 1;
 
-	delta = -delta;
-	memmove(newp + delta, newp, width + 1);
-	newp[0] = value;
-	memset(newp + 1, '0', delta - 1);
-	res = newp;
+	if (BIT_NWORDS(width) > bv.bv_nwords) {
+	    if (extBitValueAlloc(&nv, width) < 0) {
+		extBitValueClean(&bv);
+		return;
+	    }
 
-    } else {
-	res[delta] = value;
+	    memcpy(nv.bv_words, bv.bv_words, bv.bv_nwords * sizeof(uint64_t));
+	    extBitValueClean(&bv);
+	    bv = nv;		/* Multiple words, so nothing points into nv */
+	}
     }
 
+    wp = &bv.bv_words[bitnum / BIT_WORD_BITS];
+    mask = (uint64_t) 1 << (bitnum % BIT_WORD_BITS);
+    if (value)
+	*wp |= mask;
+    else
+	*wp &= ~mask;
+
+    res = extBitString(&bv, width);
+    extBitValueClean(&bv);
+
     xmlXPathReturnString(ctxt, res);
 }
 
 static void
 extBitClear (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    extBitClearOrSet(ctxt, nargs, '0');
+    extBitClearOrSet(ctxt, nargs, 0);
 }
 
 static void
 extBitSet (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    extBitClearOrSet(ctxt, nargs, '1');
+    extBitClearOrSet(ctxt, nargs, 1);
 }
 
 static void
 extBitCompare (xmlXPathParserContextPtr ctxt, int nargs)
 {
-    xmlChar *res1, *res2;
-    xmlXPathObjectPtr xop;
-    int width1, width2, off1, off2, rc, delta;
+    bit_value_t bv1, bv2;
+    uint64_t w1, w2;
+    unsigned i;
+    int rc = 0;
 
     if (nargs != 2) {
 	xmlXPathSetArityError(ctxt);
@@ -487,48 +624,27 @@ extBitCompare (xmlXPathParserContextPtr ctxt, int nargs)
     }
 
     /* Pop args in reverse order */
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res2 = extBitStringVal(ctxt, xop);
-    if (res2 == NULL)
+    if (extBitPopValue(ctxt, &bv2) < 0)
 	return;
 
-    xop = valuePop(ctxt);
-    if (xop == NULL || xmlXPathCheckError(ctxt))
-	return;
-    res1 = extBitStringVal(ctxt, xop);
-    if (res1 == NULL)
+    if (extBitPopValue(ctxt, &bv1) < 0) {
+	extBitValueClean(&bv2);
 	return;
+    }
 
-    width1 = xmlStrlen(res1);
-    width2 = xmlStrlen(res2);
-    delta = width1 - width2;
-
-    rc = 0;
-    off1 = off2 = 0;
-    if (delta < 0) {
-	for ( ; delta < 0; delta++, off2++) {
-	    if (res2[off2] != '0') {
-		rc = -1;
-		goto done;
-	    }
-	}
-
-    } else if (delta > 0) {
-	for ( ; delta > 0; delta--, off1++) {
-	    if (res1[off1] != '0') {
-		rc = 1;
-		goto done;
-	    }
+    /* Leading zeros don't count, so compare from the top word down */
+    i = (bv1.bv_nwords > bv2.bv_nwords) ? bv1.bv_nwords : bv2.bv_nwords;
+    while (i-- > 0) {
+	w1 = extBitWord(&bv1, i);
+	w2 = extBitWord(&bv2, i);
+	if (w1 != w2) {
+	    rc = (w1 > w2) ? 1 : -1;
+	    break;
 	}
     }
 
-    rc = xmlStrcmp(res1 + off1, res2 + off2);
-
- done:
-    xmlFree(res1);
-    xmlFree(res2);
+    extBitValueClean(&bv1);
+    extBitValueClean(&bv2);
 
     xmlXPathReturnNumber(ctxt, rc);
 }
@@ -13,10 +13,15 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include <sys/queue.h>
 #include <curl/curl.h>
@@ -34,13 +39,21 @@
 #include <libslax/slaxdyn.h>
 #include <libslax/slaxio.h>
 #include <libslax/xmlsoft.h>
+#include <libslax/slaxinternals.h>
+#include <libpsu/psubase64.h>
 #include <libpsu/psulog.h>
 #include <libpsu/psutime.h>
+#include <libpsu/psuzio.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/pammap.h>
 
+#include "jsonlexer.h"
 #include "ext_curl.h"
 
 #define CURL_FULL_NS "http://xml.libslax.org/curl"
 #define CURL_NAME_SIZE 12
+#define CURL_MULTI_LIMIT 16	/* Default concurrency for perform-many */
+#define CURL_CACHE_MAX 64	/* Cached replies kept in memory */
 
 /*
  * Defines the set of options we which to control the next request.
@@ -54,15 +67,20 @@ typedef struct curl_opts_s {
     u_int8_t co_verbose;	/* Verbose (debug) output */
     u_int8_t co_insecure;	/* Allow insecure SSL certs  */
     u_int8_t co_secure;		/* Use SSL-enabled version of protocol */
+    u_int8_t co_stream;		/* Parse the body as it arrives */
+    u_int8_t co_base64;		/* Decode the body from base64 */
+    u_int8_t co_cache;		/* Cache replies (<cache>) */
     int co_errors;		/* How to handle errors (SLAX_ERROR_*) */
     long co_timeout;		/* Operation timeout */
     long co_connect_timeout;	/* Connect timeout */
+    unsigned co_concurrency;	/* Transfers at once (curl:perform-many) */
     char *co_username;		/* Value for CURLOPT_USERNAME */
     char *co_password;		/* Value for CURLOPT_PASSWORD */
     slax_data_list_t co_headers; /* Headers for CURLOPT_HTTPHEADER */
     slax_data_list_t co_params; /* Parameters for GET or POST */
     char *co_content_type;	 /* Content-Type header */
     char *co_contents;		 /* Contents for a post */
+    char *co_cache_file;	 /* File to keep cached replies in */
 
     /* Email-specific fields */
     char *co_format;		 /* Format of the response */
@@ -90,10 +108,127 @@ typedef struct curl_handle_s {
     unsigned ch_code;		/* Most recent return code */
     curl_opts_t ch_opts;	/* Options set for this handle */
     char ch_error[CURL_ERROR_SIZE]; /* Error buffer for CURLOPT_ERRORBUFFER */
+    struct curl_stream_s *ch_stream; /* Streaming transfer (<stream>) */
+    struct curl_cache_s *ch_revalidate; /* Cached reply we're revalidating */
+    u_int8_t ch_decode;		/* State of base64 decoding (CURL_DECODE_*) */
+    psu_base64_decoder_t ch_decoder; /* Decoder for <base64> replies */
 } curl_handle_t;
 
+/* Values for ch_decode */
+#define CURL_DECODE_OFF		0 /* Body is recorded as is */
+#define CURL_DECODE_PENDING	1 /* Decode once we know the reply is good */
+#define CURL_DECODE_ON		2 /* Body is being decoded */
+#define CURL_DECODE_FAILED	3 /* Body wasn't valid base64 */
+
+#define CURL_DECODE_CHUNK	4096 /* Base64 bytes decoded at a time */
+
+/*
+ * A streaming transfer: the parser pulls the body through
+ * extCurlStreamRead(), which runs the transfer (on a "multi" handle
+ * of its own) only until the next chunk of the body arrives.  Only
+ * the chunks the parser hasn't yet consumed are buffered.
+ */
+typedef struct curl_stream_s {
+    CURLM *cs_multi;		/* Multi handle running the transfer */
+    char *cs_buf;		/* Body data not yet read by the parser */
+    size_t cs_size;		/* Size of cs_buf */
+    size_t cs_len;		/* Bytes of data in cs_buf */
+    size_t cs_off;		/* Bytes of cs_buf already read */
+    CURLcode cs_result;		/* Result of the transfer */
+    u_int8_t cs_done;		/* Transfer is complete */
+    u_int8_t cs_body;		/* Body data has started to arrive */
+    u_int8_t cs_streaming;	/* Body is going to the parser */
+    struct curl_handle_s *cs_handle; /* Handle doing the transfer */
+} curl_stream_t;
+
+/*
+ * A cached reply.  We keep the <results> we built, parsed data and
+ * all, so a hit costs neither a round trip nor a parse.  Entries are
+ * shared between threads, so they are reference counted; one that's
+ * been replaced is freed when the last user lets go of it.
+ */
+typedef struct curl_cache_s {
+    TAILQ_ENTRY(curl_cache_s) cc_link; /* Next entry (most recent first) */
+    char *cc_key;		/* Method, URL and request headers */
+    char *cc_etag;		/* ETag of the reply (or NULL) */
+    char *cc_last_modified;	/* Last-Modified of the reply (or NULL) */
+    time_t cc_expires;		/* Fresh until (zero means revalidate) */
+    xmlDocPtr cc_doc;		/* Holds a copy of the <results> */
+    unsigned cc_refs;		/* References (including the list's) */
+} curl_cache_t;
+
 TAILQ_HEAD(curl_session_s, curl_handle_s) extCurlSessions;
 
+/*
+ * Every handle is attached to a single, process-wide libcurl "share"
+ * object, so DNS lookups, TLS sessions and open connections are
+ * reused across handles, across curl:single() calls and across
+ * script runs in a long-lived process (such as slaxproc --server).
+ * Each type of shared data has its own lock, since handles may be
+ * used from more than one thread.
+ */
+static CURLSH *extCurlShare;
+static pid_t extCurlSharePid;	/* Process that made extCurlShare */
+static pthread_mutex_t extCurlShareInitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t extCurlShareLocks[CURL_LOCK_DATA_LAST];
+
+static void
+extCurlShareLock (CURL *handle UNUSED, curl_lock_data data,
+		  curl_lock_access access UNUSED, void *userp UNUSED)
+{
+    pthread_mutex_lock(&extCurlShareLocks[data]);
+}
+
+static void
+extCurlShareUnlock (CURL *handle UNUSED, curl_lock_data data,
+		    void *userp UNUSED)
+{
+    pthread_mutex_unlock(&extCurlShareLocks[data]);
+}
+
+/*
+ * Return the share object, making it on first use.  A forked child
+ * must not use its parent's connections (or TLS state), so it
+ * abandons the parent's share, without cleaning it up, and makes
+ * its own.
+ */
+static CURLSH *
+extCurlShareGet (void)
+{
+    CURLSH *share;
+    int i;
+
+    pthread_mutex_lock(&extCurlShareInitLock);
+
+    if (extCurlShare && extCurlSharePid != getpid())
+	extCurlShare = NULL;
+
+    if (extCurlShare == NULL) {
+	share = curl_share_init();
+	if (share) {
+	    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&extCurlShareLocks[i], NULL);
+
+	    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, extCurlShareLock);
+	    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, extCurlShareUnlock);
+	    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	    curl_share_setopt(share, CURLSHOPT_SHARE,
+			      CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif /* LIBCURL_VERSION_NUM */
+
+	    extCurlShare = share;
+	    extCurlSharePid = getpid();
+	}
+    }
+
+    share = extCurlShare;
+    pthread_mutex_unlock(&extCurlShareInitLock);
+
+    return share;
+}
+
 /*
  * Discard any transient data in the handle, particularly data
  * read from the peer.
@@ -123,6 +258,7 @@ extCurlOptionsRelease (curl_opts_t *opts)
     xmlFreeAndEasy(opts->co_local);
     xmlFreeAndEasy(opts->co_from);
     xmlFreeAndEasy(opts->co_subject);
+    xmlFreeAndEasy(opts->co_cache_file);
 
     slaxDataListClean(&opts->co_headers);
     slaxDataListClean(&opts->co_params);
@@ -150,6 +286,10 @@ extCurlOptionsCopy (curl_opts_t *top, curl_opts_t *fromp)
     COPY_FIELD(co_verbose);
     COPY_FIELD(co_insecure);
     COPY_FIELD(co_secure);
+    COPY_FIELD(co_stream);
+    COPY_FIELD(co_base64);
+    COPY_FIELD(co_cache);
+    COPY_STRING(co_cache_file);
     COPY_FIELD(co_errors);
     COPY_STRING(co_username);
     COPY_STRING(co_password);
@@ -162,6 +302,7 @@ extCurlOptionsCopy (curl_opts_t *top, curl_opts_t *fromp)
     COPY_STRING(co_subject);
     COPY_FIELD(co_timeout);
     COPY_FIELD(co_connect_timeout);
+    COPY_FIELD(co_concurrency);
 
     slaxDataListInit(&top->co_headers);
     slaxDataListCopy(&top->co_headers, &fromp->co_headers);
@@ -293,12 +434,25 @@ extCurlParseNode (curl_opts_t *opts, xmlNodePtr nodep)
 	opts->co_insecure = TRUE;
     else if (streq(key, "secure"))
 	opts->co_secure = TRUE;
+    else if (streq(key, "stream"))
+	opts->co_stream = TRUE;
+    else if (streq(key, "base64"))
+	opts->co_base64 = TRUE;
+    else if (streq(key, "cache")) {
+	const char *value = xmlNodeValue(nodep);
+
+	opts->co_cache = TRUE;
+	if (value && *value)
+	    CURL_SET_STRING(opts->co_cache_file);
+    }
     else if (streq(key, "errors"))
 	opts->co_errors = slaxErrorValue(xmlNodeValue(nodep));
     else if (streq(key, "timeout"))
 	opts->co_timeout = atoi(xmlNodeValue(nodep));
     else if (streq(key, "connect-timeout"))
 	opts->co_connect_timeout = atoi(xmlNodeValue(nodep));
+    else if (streq(key, "concurrency"))
+	opts->co_concurrency = atoi(xmlNodeValue(nodep));
 
     else if (streq(key, "to"))
 	slaxDataListAdd(&opts->co_to, xmlNodeValue(nodep));
@@ -387,6 +541,89 @@ extCurlRecordData (curl_handle_t *curlp UNUSED, void *buf, size_t bufsiz,
     return bufsiz;
 }
 
+/*
+ * Record (or queue for the parser) a piece of the reply body
+ */
+static size_t
+extCurlWriteBody (curl_handle_t *curlp, const char *buf, size_t bufsiz)
+{
+    curl_stream_t *csp = curlp->ch_stream;
+    long code = 0;
+    char *newp;
+
+    if (csp == NULL) {
+	extCurlRecordData(curlp, (void *) buf, bufsiz,
+			  &curlp->ch_reply_data);
+	return bufsiz;
+    }
+
+    /*
+     * The headers are complete when the body starts, so now we know
+     * if this is a body we want to parse.  An error page is recorded
+     * as normal.
+     */
+    if (!csp->cs_body) {
+	csp->cs_body = TRUE;
+	curl_easy_getinfo(curlp->ch_handle, CURLINFO_RESPONSE_CODE, &code);
+	csp->cs_streaming = (code < 300);
+    }
+
+    if (!csp->cs_streaming) {
+	extCurlRecordData(curlp, (void *) buf, bufsiz,
+			  &curlp->ch_reply_data);
+	return bufsiz;
+    }
+
+    if (csp->cs_off == csp->cs_len)
+	csp->cs_off = csp->cs_len = 0;
+
+    if (csp->cs_len + bufsiz > csp->cs_size) {
+	size_t size = csp->cs_size ? csp->cs_size : CURL_MAX_WRITE_SIZE;
+
+	while (size < csp->cs_len + bufsiz)
+	    size <<= 1;
+
+	newp = xmlRealloc(csp->cs_buf, size);
+	if (newp == NULL)
+	    return 0;		/* Fails the transfer */
+
+	csp->cs_buf = newp;
+	csp->cs_size = size;
+    }
+
+    memcpy(csp->cs_buf + csp->cs_len, buf, bufsiz);
+    csp->cs_len += bufsiz;
+
+    return bufsiz;
+}
+
+/*
+ * Decode a piece of a <base64> reply body, a chunk at a time so we
+ * need only a small buffer
+ */
+static size_t
+extCurlWriteDecoded (curl_handle_t *curlp, const char *buf, size_t bufsiz)
+{
+    char out[PSU_BASE64_DECODE_LEN(CURL_DECODE_CHUNK)];
+    size_t left, len;
+    ssize_t olen;
+
+    for (left = bufsiz; left > 0; left -= len, buf += len) {
+	len = (left < CURL_DECODE_CHUNK) ? left : CURL_DECODE_CHUNK;
+
+	olen = psu_base64_decode_update(&curlp->ch_decoder, buf, len, out);
+	if (olen < 0) {
+	    curlp->ch_decode = CURL_DECODE_FAILED;
+	    return 0;		/* Fails the transfer */
+	}
+
+	if (olen > 0 && extCurlWriteBody(curlp, out, olen) != (size_t) olen)
+	    return 0;
+    }
+
+    return bufsiz;
+}
+
 /*
  * The callback we give libcurl to write data that has been received from
  * a transfer request.
@@ -396,10 +633,46 @@ extCurlWriteData (void *buf, size_t membsize, size_t nmemb, void *userp)
 {
     curl_handle_t *curlp = userp;
     size_t bufsiz = membsize * nmemb;
+    long code = 0;
 
-    extCurlRecordData(curlp, buf, bufsiz, &curlp->ch_reply_data);
+    /* Only a successful reply is decoded; an error page is left alone */
+    if (curlp->ch_decode == CURL_DECODE_PENDING) {
+	curl_easy_getinfo(curlp->ch_handle, CURLINFO_RESPONSE_CODE, &code);
+	curlp->ch_decode = (code < 300) ? CURL_DECODE_ON : CURL_DECODE_OFF;
+    }
 
-    return bufsiz;
+    if (curlp->ch_decode == CURL_DECODE_ON)
+	return extCurlWriteDecoded(curlp, buf, bufsiz);
+
+    return extCurlWriteBody(curlp, buf, bufsiz);
+}
+
+/*
+ * A transfer is complete; write whatever the base64 decoder is still
+ * holding and turn a decoding failure into the transfer's result
+ */
+static CURLcode
+extCurlDecodeDone (curl_handle_t *curlp, CURLcode result)
+{
+    char out[2];
+    ssize_t olen;
+
+    if (curlp->ch_decode == CURL_DECODE_ON) {
+	olen = psu_base64_decode_final(&curlp->ch_decoder, out);
+	if (olen < 0)
+	    curlp->ch_decode = CURL_DECODE_FAILED;
+	else if (olen > 0)
+	    extCurlWriteBody(curlp, out, olen);
+    }
+
+    if (curlp->ch_decode == CURL_DECODE_FAILED) {
+	snprintf(curlp->ch_error, sizeof(curlp->ch_error),
+		 "reply is not valid base64 data");
+	result = CURLE_BAD_CONTENT_ENCODING;
+    }
+
+    curlp->ch_decode = CURL_DECODE_OFF;
+    return result;
 }
 
 /*
@@ -448,6 +721,9 @@ extCurlHandleAlloc (void)
 
 	/* Create and populate the real libcurl handle */
 	curlp->ch_handle = curl_easy_init();
+	if (curlp->ch_handle)
+	    curl_easy_setopt(curlp->ch_handle, CURLOPT_SHARE,
+			     extCurlShareGet());
 
 	/* Add it to the list of curl handles */
 	TAILQ_INSERT_TAIL(&extCurlSessions, curlp, ch_link);
@@ -617,6 +893,20 @@ struct cr_data {
     size_t cr_offset;
 };
 
+/*
+ * The parts of a transfer that must live until it's complete
+ */
+typedef struct curl_xfer_s {
+    struct curl_slist *cx_headers; /* Header list (CURLOPT_HTTPHEADER) */
+    char *cx_param_data;	/* Encoded parameters */
+    struct cr_data cx_cr;	/* Contents for an upload */
+} curl_xfer_t;
+
+/* Results from extCurlSetup() */
+#define CXS_READY	0	/* Ready for curl_easy_perform() */
+#define CXS_EMAIL	1	/* Email, which extCurlDoEmail() handles */
+#define CXS_FAIL	2	/* Can't be performed */
+
 static size_t
 extCurlReadContents (char *buf, size_t isize, size_t nitems, void *userp)
 {
@@ -745,25 +1035,30 @@ extCurlDoEmail (curl_handle_t *curlp, curl_opts_t *opts UNUSED)
 }
 
 /*
- * Perform a libcurl transfer but setting up all the options which
- * we've been provided with, and then calling curl_easy_perform().
- * Since options are normally _very_ sticky to libcurl, we'd like to
- * explicitly set all values to the ones we've been asked for.  But
- * due to the nature of the curl_easy_setopt interface we are forced
- * use curl_easy_reset instead.
+ * Set up a libcurl transfer, setting all the options which we've
+ * been provided with.  Since options are normally _very_ sticky to
+ * libcurl, we'd like to explicitly set all values to the ones we've
+ * been asked for.  But due to the nature of the curl_easy_setopt
+ * interface we are forced use curl_easy_reset instead.  Anything
+ * the transfer needs until it completes is kept in "cxp", and is
+ * released by extCurlFinish().
  */
-static CURLcode
-extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
+static int
+extCurlSetup (curl_handle_t *curlp, curl_opts_t *opts, curl_xfer_t *cxp)
 {
-    CURLcode success;
     long putv = 0, postv = 0, getv = 0, deletev = 0, headv = 0, emailv = 0,
 	    uploadv = 0;
     struct curl_slist *headers = NULL;
     char *param_data = NULL;
 
+    bzero(cxp, sizeof(*cxp));
+
     curl_easy_reset(curlp->ch_handle);
     extCurlHandleClean(curlp); /* Shouldn't be needed */
 
+    /* A reset keeps the share, but a forked child needs its own */
+    CURL_SET(CURLOPT_SHARE, extCurlShareGet());
+
     if (opts->co_method) {
 	if (strceq(opts->co_method, "delete")) {
 	    deletev = 1;
@@ -795,6 +1090,9 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
     CURL_SET(CURLOPT_ERRORBUFFER, curlp->ch_error); /* Get real errors */
     CURL_SET(CURLOPT_NETRC, CURL_NETRC_OPTIONAL); /* Allow .netrc */
 
+    curlp->ch_decode = opts->co_base64 ? CURL_DECODE_PENDING : CURL_DECODE_OFF;
+    psu_base64_decode_init(&curlp->ch_decoder);
+
     /* Register callbacks */
     CURL_SET(CURLOPT_WRITEFUNCTION, extCurlWriteData);
     CURL_SET(CURLOPT_WRITEDATA, curlp);
@@ -831,7 +1129,7 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
      * a unique route.
      */
     if (emailv)
-	return extCurlDoEmail(curlp, opts);
+	return CXS_EMAIL;
 
     if (opts->co_secure)
 	CURL_SET(CURLOPT_USE_SSL, (long) CURLUSESSL_ALL);
@@ -839,7 +1137,7 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
     /* A missing URL is fatal */
     if (opts->co_url == NULL) {
 	LX_ERR("curl: missing URL\n");
-	return FALSE;
+	return CXS_FAIL;
     }
 
     CURL_SET(CURLOPT_URL, opts->co_url);
@@ -872,6 +1170,25 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
     if (opts != &curlp->ch_opts)
 	headers = extCurlBuildSlist(&curlp->ch_opts.co_headers, headers);
     headers = extCurlBuildSlist(&opts->co_headers, headers);
+
+    /* Ask the server if our cached copy is still good */
+    if (curlp->ch_revalidate) {
+	curl_cache_t *ccp = curlp->ch_revalidate;
+	char *buf;
+
+	if (ccp->cc_etag) {
+	    buf = alloca(strlen(ccp->cc_etag) + 16);
+	    sprintf(buf, "If-None-Match: %s", ccp->cc_etag);
+	    headers = curl_slist_append(headers, buf);
+	}
+
+	if (ccp->cc_last_modified) {
+	    buf = alloca(strlen(ccp->cc_last_modified) + 20);
+	    sprintf(buf, "If-Modified-Since: %s", ccp->cc_last_modified);
+	    headers = curl_slist_append(headers, buf);
+	}
+    }
+
     CURL_SET(CURLOPT_HTTPHEADER, headers);
 
     if (postv || putv) {
@@ -879,15 +1196,14 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
 	CURL_SET(CURLOPT_POSTFIELDSIZE, len);
 	CURL_SET(CURLOPT_POSTFIELDS, opts->co_contents ?: "");
     } else if (uploadv && opts->co_contents) {
-	struct cr_data cr;
+	struct cr_data *crp = &cxp->cx_cr;
 
-	bzero(&cr, sizeof(cr));
-	cr.cr_data = opts->co_contents;
-	cr.cr_len = strlen(opts->co_contents);
+	crp->cr_data = opts->co_contents;
+	crp->cr_len = strlen(opts->co_contents);
 
-	CURL_SET(CURLOPT_INFILESIZE, (long) cr.cr_len);
+	CURL_SET(CURLOPT_INFILESIZE, (long) crp->cr_len);
 	CURL_SET(CURLOPT_READFUNCTION, extCurlReadContents);
-	CURL_SET(CURLOPT_READDATA, &cr);
+	CURL_SET(CURLOPT_READDATA, crp);
     }
 
     slax_data_list_t *param_data_lists[] = {
@@ -918,31 +1234,201 @@ extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
 	}
     }
 
-    success = curl_easy_perform(curlp->ch_handle);
+    cxp->cx_headers = headers;
+    cxp->cx_param_data = param_data;
+
+    return CXS_READY;
+}
 
+/*
+ * Release what a transfer needed, once it's complete
+ */
+static void
+extCurlFinish (curl_handle_t *curlp, curl_xfer_t *cxp)
+{
     /*
      * Remove our data to avoid dangling references.  We do
      * this for headers and post data.
      */
-    if (headers) {		/* Free the header list */
+    if (cxp->cx_headers) {	/* Free the header list */
 	CURL_SET(CURLOPT_HTTPHEADER, NULL);
-	curl_slist_free_all(headers);
+	curl_slist_free_all(cxp->cx_headers);
+	cxp->cx_headers = NULL;
     }
 
-    if (param_data)
-	xmlFree(param_data);
+    if (cxp->cx_param_data) {
+	xmlFree(cxp->cx_param_data);
+	cxp->cx_param_data = NULL;
+    }
 
     /* Clear it on the way out, just to be absolutely certain */
     curl_easy_reset(curlp->ch_handle);
+}
+
+/*
+ * Perform a libcurl transfer, blocking until it's complete
+ */
+static CURLcode
+extCurlDoPerform (curl_handle_t *curlp, curl_opts_t *opts)
+{
+    CURLcode success;
+    curl_xfer_t cx;
+
+    switch (extCurlSetup(curlp, opts, &cx)) {
+    case CXS_EMAIL:
+	return extCurlDoEmail(curlp, opts);
+
+    case CXS_FAIL:
+	return FALSE;
+    }
+
+    success = curl_easy_perform(curlp->ch_handle);
+    success = extCurlDecodeDone(curlp, success);
+    extCurlFinish(curlp, &cx);
 
     return success;
 }
 
+/*
+ * Run the transfer until there's more body data, or it's complete
+ */
+static void
+extCurlStreamPump (curl_stream_t *csp)
+{
+    CURLMsg *msg;
+    int running, left;
+    size_t len = csp->cs_len;
+
+    for (;;) {
+	curl_multi_perform(csp->cs_multi, &running);
+
+	while ((msg = curl_multi_info_read(csp->cs_multi, &left)) != NULL) {
+	    if (msg->msg == CURLMSG_DONE) {
+		/* Decoded data may still arrive, before we say we're done */
+		csp->cs_result = extCurlDecodeDone(csp->cs_handle,
+						   msg->data.result);
+		csp->cs_done = TRUE;
+	    }
+	}
+
+	if (csp->cs_done || csp->cs_len != len || (csp->cs_body
+						   && !csp->cs_streaming))
+	    return;
+
+	curl_multi_wait(csp->cs_multi, NULL, 0, 1000, NULL);
+    }
+}
+
+/*
+ * Give the parser the next piece of the body; returns like read(2)
+ */
+static ssize_t
+extCurlStreamRead (void *opaque, char *buf, size_t len)
+{
+    curl_stream_t *csp = opaque;
+
+    while (csp->cs_off == csp->cs_len && !csp->cs_done)
+	extCurlStreamPump(csp);
+
+    if (csp->cs_off == csp->cs_len)
+	return (csp->cs_result == CURLE_OK) ? 0 : -1;
+
+    if (len > csp->cs_len - csp->cs_off)
+	len = csp->cs_len - csp->cs_off;
+
+    memcpy(buf, csp->cs_buf + csp->cs_off, len);
+    csp->cs_off += len;
+
+    return len;
+}
+
+/*
+ * The same, as an xmlInputReadCallback
+ */
+static int
+extCurlStreamReadIO (void *opaque, char *buf, int len)
+{
+    return extCurlStreamRead(opaque, buf, len);
+}
+
+/*
+ * Start a streaming transfer, running it until the body starts (or
+ * the transfer is complete).  Returns the extCurlSetup() status; if
+ * we can't get a multi handle, the transfer is simply run to
+ * completion, as if it weren't streamed.
+ */
+static int
+extCurlStreamStart (curl_handle_t *curlp, curl_opts_t *opts,
+		    curl_stream_t *csp, curl_xfer_t *cxp)
+{
+    int rc;
+
+    bzero(csp, sizeof(*csp));
+
+    rc = extCurlSetup(curlp, opts, cxp);
+    if (rc != CXS_READY)
+	return rc;
+
+    csp->cs_handle = curlp;
+
+    csp->cs_multi = curl_multi_init();
+    if (csp->cs_multi
+	    && curl_multi_add_handle(csp->cs_multi,
+				     curlp->ch_handle) != CURLM_OK) {
+	curl_multi_cleanup(csp->cs_multi);
+	csp->cs_multi = NULL;
+    }
+
+    if (csp->cs_multi == NULL) {
+	csp->cs_result = extCurlDecodeDone(curlp,
+				curl_easy_perform(curlp->ch_handle));
+	csp->cs_done = TRUE;
+	return CXS_READY;
+    }
+
+    curlp->ch_stream = csp;
+
+    while (!csp->cs_body && !csp->cs_done)
+	extCurlStreamPump(csp);
+
+    return CXS_READY;
+}
+
+/*
+ * Finish a streaming transfer, discarding any body data the parser
+ * didn't want, and return the result of the transfer
+ */
+static CURLcode
+extCurlStreamFinish (curl_handle_t *curlp, curl_stream_t *csp,
+		     curl_xfer_t *cxp)
+{
+    while (!csp->cs_done) {
+	csp->cs_off = csp->cs_len = 0;
+	extCurlStreamPump(csp);
+    }
+
+    if (csp->cs_multi) {
+	curl_multi_remove_handle(csp->cs_multi, curlp->ch_handle);
+	curl_multi_cleanup(csp->cs_multi);
+    }
+    extCurlFinish(curlp, cxp);
+
+    curlp->ch_stream = NULL;
+    xmlFreeAndEasy(csp->cs_buf);
+
+    return csp->cs_result;
+}
+
+/*
+ * Parse the body, either from the raw data we recorded or, for a
+ * streaming transfer, as it arrives ("raw_data" is NULL)
+ */
 static void
-extCurlBuildDataParsed (curl_handle_t *curlp UNUSED, curl_opts_t *opts,
+extCurlBuildDataParsed (curl_handle_t *curlp, curl_opts_t *opts,
 			    xmlDocPtr docp, xmlNodePtr parent,
 			    const char *raw_data)
 {
+    curl_stream_t *csp = curlp->ch_stream;
     const char *cp, *ep, *sp;
     char *nbuf = NULL, *vbuf = NULL;
     ssize_t nbufsiz = 0, vbufsiz = 0;
@@ -1048,8 +1534,12 @@ extCurlBuildDataParsed (curl_handle_t *curlp UNUSED, curl_opts_t *opts,
     } else if (streq(opts->co_format, "xml")) {
 	xmlDocPtr xmlp;
 
-	xmlp = xmlReadMemory(raw_data, strlen(raw_data), "raw_data", NULL,
+	if (csp)
+	    xmlp = xmlReadIO(extCurlStreamReadIO, NULL, csp, "raw_data", NULL,
 			     XML_PARSE_NOENT);
+	else
+	    xmlp = xmlReadMemory(raw_data, strlen(raw_data), "raw_data", NULL,
+				 XML_PARSE_NOENT);
 	if (xmlp == NULL)
 	    goto bail;
 
@@ -1065,8 +1555,36 @@ extCurlBuildDataParsed (curl_handle_t *curlp UNUSED, curl_opts_t *opts,
     } else if (streq(opts->co_format, "html")) {
 	xmlDocPtr xmlp;
 
-	xmlp = htmlReadMemory(raw_data, strlen(raw_data), "raw_data", NULL,
-			     XML_PARSE_NOENT);
+	if (csp)
+	    xmlp = htmlReadIO(extCurlStreamReadIO, NULL, csp, "raw_data", NULL,
+			      XML_PARSE_NOENT);
+	else
+	    xmlp = htmlReadMemory(raw_data, strlen(raw_data), "raw_data", NULL,
+				  XML_PARSE_NOENT);
+	if (xmlp == NULL)
+	    goto bail;
+
+	xmlNodePtr childp = xmlDocGetRootElement(xmlp);
+	if (childp) {
+	    xmlNodePtr newp = xmlDocCopyNode(childp, docp, 1);
+	    if (newp)
+		xmlAddChild(nodep, newp);
+	}
+
+	xmlFreeDoc(xmlp);
+
+    } else if (streq(opts->co_format, "json")) {
+	xmlDocPtr xmlp;
+
+	if (csp) {
+	    FILE *fp = psu_zio_reader(extCurlStreamRead, csp);
+	    if (fp == NULL)
+		goto bail;
+
+	    xmlp = slaxJsonFileToXmlFp(fp, "raw_data", NULL, 0);
+	    fclose(fp);
+	} else
+	    xmlp = slaxJsonDataToXml(raw_data, NULL, 0);
 	if (xmlp == NULL)
 	    goto bail;
 
@@ -1285,77 +1803,876 @@ extCurlBuildResults (xmlDocPtr docp, curl_handle_t *curlp,
 }
 
 /*
- * Parse a set of option values and store them in an options structure
+ * Perform the transfer and build its results.  For a <stream>
+ * transfer of a format we can parse incrementally, the successful
+ * body goes straight into the parser as it arrives, and is never
+ * recorded as "raw-data".
  */
-static void
-extCurlOptionsParse (curl_handle_t *curlp UNUSED, curl_opts_t *opts,
-			xmlXPathObject *ostack[], int nargs)
+static xmlNodePtr
+extCurlFetch (xmlDocPtr docp, curl_handle_t *curlp, curl_opts_t *opts)
 {
-    int osi;
+    curl_stream_t cs;
+    curl_xfer_t cx;
+    CURLcode success;
+    xmlNodePtr nodep, xp;
 
-    for (osi = nargs - 1; osi >= 0; osi--) {
-	xmlXPathObject *xop = ostack[osi];
+    if (!opts->co_stream || opts->co_format == NULL
+	    || !(streq(opts->co_format, "xml") || streq(opts->co_format, "html")
+		 || streq(opts->co_format, "json")))
+	return extCurlBuildResults(docp, curlp, opts,
+				   extCurlDoPerform(curlp, opts));
 
-	if (xop->stringval) {
-	    if (opts->co_url)
-		xmlFree(opts->co_url);
-	    opts->co_url = (char *) xmlStrdup(xop->stringval);
+    switch (extCurlStreamStart(curlp, opts, &cs, &cx)) {
+    case CXS_EMAIL:
+	return extCurlBuildResults(docp, curlp, opts,
+				   extCurlDoEmail(curlp, opts));
 
-	} else if (xop->nodesetval) {
-	    xmlNodeSetPtr nodeset;
-	    xmlNodePtr nop, cop;
-	    int i;
+    case CXS_FAIL:
+	return extCurlBuildResults(docp, curlp, opts, FALSE);
+    }
 
-	    nodeset = xop->nodesetval;
-	    for (i = 0; i < nodeset->nodeNr; i++) {
-		nop = nodeset->nodeTab[i];
+    /* No body, or not one we want to parse */
+    if (!cs.cs_streaming) {
+	success = extCurlStreamFinish(curlp, &cs, &cx);
+	return extCurlBuildResults(docp, curlp, opts, success);
+    }
+
+    nodep = xmlNewDocNode(docp, NULL, (const xmlChar *) "results", NULL);
+    xmlAddChildContent(docp, nodep, (const xmlChar *) "url",
+		       (const xmlChar *) opts->co_url);
 
-		if (nop->type == XML_ELEMENT_NODE)
-		    extCurlParseNode(opts, nop);
+    xp = xmlNewDocNode(docp, NULL, (const xmlChar *) "curl-success", NULL);
+    if (xp)
+	xmlAddChild(nodep, xp);
 
-		if (nop->children == NULL)
-		    continue;
+    extCurlBuildData(curlp, docp, nodep,
+		     &curlp->ch_reply_headers, "raw-headers");
+    extCurlBuildReplyHeaders(curlp, docp, nodep);
 
-		for (cop = nop->children; cop; cop = cop->next) {
-		    if (cop->type != XML_ELEMENT_NODE)
-			continue;
+    extCurlBuildDataParsed(curlp, opts, docp, nodep, NULL);
 
-		    extCurlParseNode(opts, cop);
-		}
-	    }
-	}
+    /* If the transfer failed part way, report it the normal way */
+    success = extCurlStreamFinish(curlp, &cs, &cx);
+    if (success != CURLE_OK) {
+	xmlFreeNode(nodep);
+	nodep = extCurlBuildResults(docp, curlp, opts, success);
     }
+
+    return nodep;
 }
 
 /*
- * Set parameters for a curl handle
- * Usage:
-      var $handle = curl:open();
-      expr curl:set($handle, $opts, $more-opts);
+ * The reply cache (<cache>).  Replies are kept in memory, in a small
+ * LRU list, and optionally in a parrotdb segment, so that other
+ * processes (and later runs) can use them.  A segment has a single
+ * writer: the first process to open it.  Any others open it read
+ * only, and use what the writer has stored.
  */
-static void
-extCurlSet (xmlXPathParserContext *ctxt, int nargs)
+TAILQ_HEAD(curl_cache_head_s, curl_cache_s) extCurlCache
+    = TAILQ_HEAD_INITIALIZER(extCurlCache);
+static unsigned extCurlCacheCount; /* Number of entries in extCurlCache */
+static pthread_mutex_t extCurlCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CURL_CACHE_MAGIC 0x43434331 /* 'CCC1' */
+#define CURL_CACHE_SLOTS 1024	/* Slots in a segment's index */
+#define CURL_CACHE_PROBE 8	/* Slots we'll look at for a key */
+
+/* The named header in the segment */
+typedef struct curl_cache_seg_s {
+    uint32_t ccg_magic;		/* CURL_CACHE_MAGIC (zero if new) */
+    uint32_t ccg_slots;		/* Number of slots in the index */
+    pa_mmap_atom_t ccg_index;	/* Index (array of curl_cache_slot_t) */
+} curl_cache_seg_t;
+
+typedef struct curl_cache_slot_s {
+    uint32_t ccl_hash;		/* Hash of the key (zero if empty) */
+    uint32_t ccl_size;		/* Size of the record (bytes) */
+    pa_mmap_atom_t ccl_atom;	/* The record (curl_cache_rec_t) */
+} curl_cache_slot_t;
+
+/* A stored reply; the lengths include the trailing NULs */
+typedef struct curl_cache_rec_s {
+    uint32_t ccr_key_len;	/* Length of the key */
+    uint32_t ccr_etag_len;	/* Length of the ETag (zero if none) */
+    uint32_t ccr_lm_len;	/* Length of Last-Modified (zero if none) */
+    uint32_t ccr_data_len;	/* Length of the serialized <results> */
+    int64_t ccr_expires;	/* Fresh until */
+    char ccr_data[];		/* Key, ETag, Last-Modified, results */
+} curl_cache_rec_t;
+
+typedef struct curl_cache_store_s {
+    struct curl_cache_store_s *ccs_next; /* Next open store */
+    char *ccs_path;		/* Filename */
+    pa_mmap_t *ccs_mmap;	/* Segment (NULL if it can't be opened) */
+    int ccs_writer;		/* We're the writer */
+} curl_cache_store_t;
+
+static curl_cache_store_t *extCurlCacheStores;
+
+static uint32_t
+extCurlCacheHash (const char *key)
 {
-    xmlXPathObject *ostack[nargs];	/* Stack for objects */
-    curl_handle_t *curlp;
-    char *name;
-    int osi;
+    uint32_t hash = 2166136261U; /* FNV-1a */
 
-    if (nargs < 1) {
-	LX_ERR("curl:execute: too few arguments error\n");
-	return;
-    }
+    for ( ; *key; key++)
+	hash = (hash ^ (uint8_t) *key) * 16777619U;
 
-    for (osi = nargs - 1; osi >= 0; osi--)
-	ostack[osi] = valuePop(ctxt);
+    return hash ? hash : 1;	/* Zero marks an empty slot */
+}
 
-    name = (char *) xmlXPathCastToString(ostack[0]);
-    if (name == NULL) {
-	LX_ERR("curl:set: no argument\n");
-	goto fail;
+/*
+ * Build the cache key for a request, or return NULL if the request
+ * can't be cached.  Only GETs are cached.  The key holds everything
+ * that can change the results: the URL, parameters, request headers,
+ * and how we're handling the reply.
+ */
+static char *
+extCurlCacheKey (curl_handle_t *curlp, curl_opts_t *opts)
+{
+    slax_data_list_t *lists[] = {
+	&curlp->ch_opts.co_params, &curlp->ch_opts.co_headers,
+	NULL, NULL, NULL
+    };
+    slax_data_list_t **listp;
+    slax_data_node_t *dnp;
+    size_t len;
+    char *key, *cp;
+
+    if (opts->co_method && !strceq(opts->co_method, "get"))
+	return NULL;
+    if (opts->co_url == NULL)
+	return NULL;
+
+    if (opts != &curlp->ch_opts) {
+	lists[2] = &opts->co_params;
+	lists[3] = &opts->co_headers;
     }
 
-    curlp = extCurlHandleFind(name);
+    len = strlen(opts->co_url) + 2;
+    if (opts->co_format)
+	len += strlen(opts->co_format);
+    for (listp = lists; *listp; listp++) {
+	SLAXDATALIST_FOREACH(dnp, *listp) {
+	    len += dnp->dn_len + 1;
+	}
+    }
+    len += 5;			/* "\nS", "\nB", and NUL */
+
+    key = xmlMalloc(len);
+    if (key == NULL)
+	return NULL;
+
+    cp = key + sprintf(key, "%s\n%s", opts->co_url, opts->co_format ?: "");
+    for (listp = lists; *listp; listp++) {
+	SLAXDATALIST_FOREACH(dnp, *listp) {
+	    *cp++ = '\n';
+	    memcpy(cp, dnp->dn_data, dnp->dn_len);
+	    cp += dnp->dn_len;
+	}
+    }
+    sprintf(cp, "%s%s", opts->co_stream ? "\nS" : "",
+	    opts->co_base64 ? "\nB" : "");
+
+    return key;
+}
+
+static void
+extCurlCacheFree (curl_cache_t *ccp)
+{
+    xmlFreeAndEasy(ccp->cc_key);
+    xmlFreeAndEasy(ccp->cc_etag);
+    xmlFreeAndEasy(ccp->cc_last_modified);
+    if (ccp->cc_doc)
+	xmlFreeDoc(ccp->cc_doc);
+    xmlFree(ccp);
+}
+
+/* Drop a reference; the lock must be held */
+static void
+extCurlCacheUnref (curl_cache_t *ccp)
+{
+    if (--ccp->cc_refs == 0)
+	extCurlCacheFree(ccp);
+}
+
+static void
+extCurlCacheRelease (curl_cache_t *ccp)
+{
+    if (ccp == NULL)
+	return;
+
+    pthread_mutex_lock(&extCurlCacheLock);
+    extCurlCacheUnref(ccp);
+    pthread_mutex_unlock(&extCurlCacheLock);
+}
+
+/*
+ * Add an entry to the memory cache, replacing any with the same key
+ * and trimming the least recently used
+ */
+static void
+extCurlCacheInsert (curl_cache_t *ccp)
+{
+    curl_cache_t *oldp;
+
+    pthread_mutex_lock(&extCurlCacheLock);
+
+    TAILQ_FOREACH(oldp, &extCurlCache, cc_link) {
+	if (streq(oldp->cc_key, ccp->cc_key)) {
+	    TAILQ_REMOVE(&extCurlCache, oldp, cc_link);
+	    extCurlCacheCount -= 1;
+	    extCurlCacheUnref(oldp);
+	    break;
+	}
+    }
+
+    ccp->cc_refs += 1;
+    TAILQ_INSERT_HEAD(&extCurlCache, ccp, cc_link);
+    extCurlCacheCount += 1;
+
+    while (extCurlCacheCount > CURL_CACHE_MAX) {
+	oldp = TAILQ_LAST(&extCurlCache, curl_cache_head_s);
+	TAILQ_REMOVE(&extCurlCache, oldp, cc_link);
+	extCurlCacheCount -= 1;
+	extCurlCacheUnref(oldp);
+    }
+
+    pthread_mutex_unlock(&extCurlCacheLock);
+}
+
+/*
+ * Find (or open) the store for a file
+ */
+static curl_cache_store_t *
+extCurlCacheStore (const char *path)
+{
+    curl_cache_store_t *ccsp;
+    curl_cache_seg_t *segp;
+    pa_mmap_t *pmp;
+    int fd, writer = TRUE;
+
+    for (ccsp = extCurlCacheStores; ccsp; ccsp = ccsp->ccs_next)
+	if (streq(ccsp->ccs_path, path))
+	    return ccsp;
+
+    ccsp = xmlMalloc(sizeof(*ccsp));
+    if (ccsp == NULL)
+	return NULL;
+
+    bzero(ccsp, sizeof(*ccsp));
+    ccsp->ccs_path = xmlStrdup2(path);
+    ccsp->ccs_next = extCurlCacheStores;
+    extCurlCacheStores = ccsp;
+
+    /*
+     * See if someone else is already the writer, so we can open the
+     * segment read-only, rather than having pa_mmap_open() complain.
+     */
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+	    writer = FALSE;
+	close(fd);		/* Drops our lock */
+    }
+
+    pmp = pa_mmap_open(path, "curl-cache",
+		       writer ? PMF_SHARED : (PMF_SHARED | PMF_READ_ONLY), 0);
+    if (pmp == NULL) {
+	slaxLog("curl: cannot open cache file: %s", path);
+	return ccsp;
+    }
+
+    /*
+     * The writer sets up the index.  A reader may get here before
+     * that's happened, but it looks for the header on every lookup.
+     */
+    segp = pa_mmap_header(pmp, "curl-cache", PA_TYPE_OPAQUE, 0,
+			  writer ? sizeof(*segp) : 0);
+    if (writer && segp && segp->ccg_magic != CURL_CACHE_MAGIC) {
+	size_t size = CURL_CACHE_SLOTS * sizeof(curl_cache_slot_t);
+	pa_mmap_atom_t atom;
+
+	pa_mmap_write_begin(pmp);
+	atom = pa_mmap_alloc(pmp, size);
+	if (!pa_mmap_is_null(atom)) {
+	    segp = pa_mmap_header(pmp, "curl-cache", PA_TYPE_OPAQUE, 0, 0);
+	    bzero(pa_mmap_addr(pmp, atom), size);
+	    segp->ccg_index = atom;
+	    segp->ccg_slots = CURL_CACHE_SLOTS;
+	    segp->ccg_magic = CURL_CACHE_MAGIC;
+	}
+	pa_mmap_write_end(pmp);
+    }
+
+    ccsp->ccs_mmap = pmp;
+    ccsp->ccs_writer = writer;
+
+    return ccsp;
+}
+
+/*
+ * Is [addr, addr + size) inside the mapped segment?  A reader can see
+ * a half-written index, so everything it follows gets checked.
+ */
+static int
+extCurlCacheInside (pa_mmap_t *pmp, const void *addr, size_t size)
+{
+    const psu_byte_t *cp = addr;
+
+    return (cp >= pmp->pm_addr && size <= pmp->pm_len
+	    && cp <= pmp->pm_addr + pmp->pm_len - size);
+}
+
+/*
+ * Return the slot holding this key, or NULL
+ */
+static curl_cache_slot_t *
+extCurlCacheSlot (pa_mmap_t *pmp, const char *key, uint32_t hash,
+		  curl_cache_rec_t **recpp)
+{
+    curl_cache_seg_t *segp;
+    curl_cache_slot_t *slots, *slotp;
+    curl_cache_rec_t *recp;
+    size_t klen = strlen(key) + 1;
+    unsigned i;
+
+    segp = pa_mmap_header(pmp, "curl-cache", PA_TYPE_OPAQUE, 0, 0);
+    if (segp == NULL || segp->ccg_magic != CURL_CACHE_MAGIC
+	    || segp->ccg_slots == 0)
+	return NULL;
+
+    slots = pa_mmap_addr(pmp, segp->ccg_index);
+    if (!extCurlCacheInside(pmp, slots,
+			    segp->ccg_slots * sizeof(curl_cache_slot_t)))
+	return NULL;
+
+    for (i = 0; i < CURL_CACHE_PROBE; i++) {
+	slotp = &slots[(hash + i) % segp->ccg_slots];
+	if (slotp->ccl_hash != hash)
+	    continue;
+
+	recp = pa_mmap_addr(pmp, slotp->ccl_atom);
+	if (!extCurlCacheInside(pmp, recp, slotp->ccl_size)
+		|| slotp->ccl_size < sizeof(*recp) + klen)
+	    continue;
+
+	if (recp->ccr_key_len == klen
+		&& memcmp(recp->ccr_data, key, klen) == 0) {
+	    *recpp = recp;
+	    return slotp;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * Look for a key in a store, returning a new entry if we find it
+ */
+static curl_cache_t *
+extCurlCacheLoad (curl_cache_store_t *ccsp, const char *key)
+{
+    pa_mmap_t *pmp = ccsp->ccs_mmap;
+    uint32_t hash = extCurlCacheHash(key), seq, size = 0;
+    curl_cache_rec_t *recp, *copyp = NULL;
+    curl_cache_slot_t *slotp;
+    curl_cache_t *ccp;
+    const char *cp;
+
+    do {
+	seq = pa_mmap_read_begin(pmp);
+	if (!ccsp->ccs_writer)
+	    pa_mmap_refresh(pmp);
+
+	xmlFreeAndEasy(copyp);
+	copyp = NULL;
+
+	slotp = extCurlCacheSlot(pmp, key, hash, &recp);
+	if (slotp) {
+	    size = slotp->ccl_size;
+	    copyp = xmlMalloc(size);
+	    if (copyp)
+		memcpy(copyp, recp, size);
+	}
+    } while (pa_mmap_read_retry(pmp, seq));
+
+    if (copyp == NULL)
+	return NULL;
+
+    /* Check the copy holds together */
+    if (size < sizeof(*copyp) || (uint64_t) copyp->ccr_key_len
+	    + copyp->ccr_etag_len + copyp->ccr_lm_len + copyp->ccr_data_len
+	    > size - sizeof(*copyp) || copyp->ccr_data_len == 0)
+	goto fail;
+
+    ccp = xmlMalloc(sizeof(*ccp));
+    if (ccp == NULL)
+	goto fail;
+    bzero(ccp, sizeof(*ccp));
+
+    cp = copyp->ccr_data;
+    ccp->cc_key = xmlStrdup2(key);
+    cp += copyp->ccr_key_len;
+    if (copyp->ccr_etag_len)
+	ccp->cc_etag = (char *) xmlStrndup((const xmlChar *) cp,
+					   copyp->ccr_etag_len - 1);
+    cp += copyp->ccr_etag_len;
+    if (copyp->ccr_lm_len)
+	ccp->cc_last_modified = (char *) xmlStrndup((const xmlChar *) cp,
+						    copyp->ccr_lm_len - 1);
+    cp += copyp->ccr_lm_len;
+    ccp->cc_expires = copyp->ccr_expires;
+
+    ccp->cc_doc = xmlReadMemory(cp, copyp->ccr_data_len - 1, "curl-cache",
+				NULL, XML_PARSE_NOENT);
+    xmlFree(copyp);
+
+    if (ccp->cc_doc == NULL || xmlDocGetRootElement(ccp->cc_doc) == NULL) {
+	extCurlCacheFree(ccp);
+	return NULL;
+    }
+
+    return ccp;
+
+ fail:
+    xmlFree(copyp);
+    return NULL;
+}
+
+/*
+ * Write an entry to a store (if we're its writer)
+ */
+static void
+extCurlCacheSave (curl_cache_store_t *ccsp, curl_cache_t *ccp)
+{
+    pa_mmap_t *pmp = ccsp->ccs_mmap;
+    uint32_t hash = extCurlCacheHash(ccp->cc_key);
+    curl_cache_seg_t *segp;
+    curl_cache_slot_t *slots, *slotp;
+    curl_cache_rec_t *recp;
+    xmlBufferPtr buf;
+    size_t klen, elen, llen, dlen, size;
+    pa_mmap_atom_t atom;
+    char *cp;
+    unsigned i;
+
+    if (pmp == NULL || !ccsp->ccs_writer)
+	return;
+
+    buf = xmlBufferCreate();
+    if (buf == NULL)
+	return;
+
+    if (xmlNodeDump(buf, ccp->cc_doc, xmlDocGetRootElement(ccp->cc_doc),
+		    0, 0) < 0)
+	goto done;
+
+    klen = strlen(ccp->cc_key) + 1;
+    elen = ccp->cc_etag ? strlen(ccp->cc_etag) + 1 : 0;
+    llen = ccp->cc_last_modified ? strlen(ccp->cc_last_modified) + 1 : 0;
+    dlen = xmlBufferLength(buf) + 1;
+    size = sizeof(*recp) + klen + elen + llen + dlen;
+    if (size > UINT32_MAX)
+	goto done;
+
+    pa_mmap_write_begin(pmp);
+
+    /* Replace the key if it's there, else take an empty slot */
+    slotp = extCurlCacheSlot(pmp, ccp->cc_key, hash, &recp);
+    if (slotp == NULL) {
+	segp = pa_mmap_header(pmp, "curl-cache", PA_TYPE_OPAQUE, 0, 0);
+	if (segp == NULL || segp->ccg_magic != CURL_CACHE_MAGIC)
+	    goto end;
+
+	slots = pa_mmap_addr(pmp, segp->ccg_index);
+	for (i = 0; i < CURL_CACHE_PROBE; i++) {
+	    slotp = &slots[(hash + i) % segp->ccg_slots];
+	    if (slotp->ccl_hash == 0)
+		break;
+	}
+
+	if (i == CURL_CACHE_PROBE) /* All full; evict the first */
+	    slotp = &slots[hash % segp->ccg_slots];
+    }
+
+    if (slotp->ccl_hash) {
+	pa_mmap_free(pmp, slotp->ccl_atom, slotp->ccl_size);
+	slotp->ccl_hash = 0;
+    }
+
+    /* The segment grows in place, so slotp stays good */
+    atom = pa_mmap_alloc(pmp, size);
+    if (pa_mmap_is_null(atom))
+	goto end;
+
+    recp = pa_mmap_addr(pmp, atom);
+    recp->ccr_key_len = klen;
+    recp->ccr_etag_len = elen;
+    recp->ccr_lm_len = llen;
+    recp->ccr_data_len = dlen;
+    recp->ccr_expires = ccp->cc_expires;
+
+    cp = recp->ccr_data;
+    memcpy(cp, ccp->cc_key, klen);
+    cp += klen;
+    if (elen)
+	memcpy(cp, ccp->cc_etag, elen);
+    cp += elen;
+    if (llen)
+	memcpy(cp, ccp->cc_last_modified, llen);
+    cp += llen;
+    memcpy(cp, xmlBufferContent(buf), dlen);
+
+    slotp->ccl_atom = atom;
+    slotp->ccl_size = size;
+    slotp->ccl_hash = hash;
+
+ end:
+    pa_mmap_write_end(pmp);
+ done:
+    xmlBufferFree(buf);
+}
+
+/*
+ * Find a cached reply, looking in memory and then in the store.  We
+ * return a reference that the caller must release.
+ */
+static curl_cache_t *
+extCurlCacheFind (const char *key, const char *path)
+{
+    curl_cache_store_t *ccsp;
+    curl_cache_t *ccp;
+    int loaded = FALSE;
+
+    pthread_mutex_lock(&extCurlCacheLock);
+
+    TAILQ_FOREACH(ccp, &extCurlCache, cc_link) {
+	if (streq(ccp->cc_key, key)) {
+	    TAILQ_REMOVE(&extCurlCache, ccp, cc_link);
+	    TAILQ_INSERT_HEAD(&extCurlCache, ccp, cc_link);
+	    ccp->cc_refs += 1;
+	    break;
+	}
+    }
+
+    if (ccp == NULL && path) {
+	ccsp = extCurlCacheStore(path);
+	if (ccsp && ccsp->ccs_mmap)
+	    ccp = extCurlCacheLoad(ccsp, key);
+	if (ccp) {
+	    ccp->cc_refs = 1;
+	    loaded = TRUE;
+	}
+    }
+
+    pthread_mutex_unlock(&extCurlCacheLock);
+
+    /* Something from the store goes into memory, for next time */
+    if (loaded)
+	extCurlCacheInsert(ccp);
+
+    return ccp;
+}
+
+/*
+ * Return the named child of a node, or NULL
+ */
+static xmlNodePtr
+extCurlChild (xmlNodePtr nodep, const char *name)
+{
+    for (nodep = nodep ? nodep->children : NULL; nodep; nodep = nodep->next)
+	if (nodep->type == XML_ELEMENT_NODE && streq(xmlNodeName(nodep), name))
+	    return nodep;
+
+    return NULL;
+}
+
+/*
+ * Return the value of a reply header from our <results>, as a new
+ * string (or NULL)
+ */
+static char *
+extCurlReplyHeader (xmlNodePtr nodep, const char *name)
+{
+    xmlNodePtr hp = extCurlChild(nodep, "headers");
+    char *attr;
+
+    for (hp = hp ? hp->children : NULL; hp; hp = hp->next) {
+	if (hp->type != XML_ELEMENT_NODE || !streq(xmlNodeName(hp), "header"))
+	    continue;
+
+	attr = (char *) xmlGetProp(hp, (const xmlChar *) "name");
+	if (attr && strcasecmp(attr, name) == 0) {
+	    xmlFree(attr);
+	    return (char *) xmlNodeGetContent(hp);
+	}
+	xmlFreeAndEasy(attr);
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the HTTP code of the (last) reply in our <results>
+ */
+static unsigned
+extCurlReplyCode (xmlNodePtr nodep)
+{
+    xmlNodePtr hp = extCurlChild(nodep, "headers"), cp, last = NULL;
+    const char *value;
+
+    if (extCurlChild(nodep, "curl-success") == NULL)
+	return 0;
+
+    for (cp = hp ? hp->children : NULL; cp; cp = cp->next)
+	if (cp->type == XML_ELEMENT_NODE && streq(xmlNodeName(cp), "code"))
+	    last = cp;
+
+    value = last ? xmlNodeValue(last) : NULL;
+    return value ? strtoul(value, NULL, 10) : 0;
+}
+
+/*
+ * Work out how long a reply stays fresh, from Cache-Control or
+ * Expires.  Returns -1 if the reply mustn't be stored and zero if it
+ * must be revalidated before each use.
+ */
+static time_t
+extCurlCacheExpires (xmlNodePtr nodep)
+{
+    char *value, *cp;
+    time_t expires = 0;
+
+    value = extCurlReplyHeader(nodep, "cache-control");
+    if (value) {
+	for (cp = value; *cp; cp++)
+	    *cp = tolower((int) *cp);
+
+	if (strstr(value, "no-store"))
+	    expires = -1;
+	else if (strstr(value, "no-cache"))
+	    expires = 0;
+	else if ((cp = strstr(value, "max-age=")) != NULL)
+	    expires = time(NULL) + strtol(cp + 8, NULL, 10);
+	xmlFree(value);
+	return expires;
+    }
+
+    value = extCurlReplyHeader(nodep, "expires");
+    if (value) {
+	expires = curl_getdate(value, NULL);
+	if (expires < 0)
+	    expires = 0;
+	xmlFree(value);
+    }
+
+    return expires;
+}
+
+/*
+ * Copy a cached <results> into the caller's document, marking how
+ * we got it
+ */
+static xmlNodePtr
+extCurlCacheCopy (xmlDocPtr docp, curl_cache_t *ccp, const char *how)
+{
+    xmlNodePtr nodep;
+
+    nodep = xmlDocCopyNode(xmlDocGetRootElement(ccp->cc_doc), docp, 1);
+    if (nodep)
+	xmlAddChildContent(docp, nodep, (const xmlChar *) "cached",
+			   (const xmlChar *) how);
+
+    return nodep;
+}
+
+/*
+ * Perform a transfer through the reply cache.  A fresh entry is used
+ * as is.  A stale one is revalidated with If-None-Match and
+ * If-Modified-Since, and used if the server says "304 Not Modified".
+ * Otherwise a successful reply replaces it.
+ */
+static xmlNodePtr
+extCurlCacheTransfer (xmlDocPtr docp, curl_handle_t *curlp,
+		      curl_opts_t *opts)
+{
+    curl_cache_store_t *ccsp = NULL;
+    curl_cache_t *ccp, *newp;
+    xmlNodePtr nodep, copyp;
+    unsigned code;
+    time_t expires;
+    char *key;
+
+    key = extCurlCacheKey(curlp, opts);
+    if (key == NULL)
+	return extCurlFetch(docp, curlp, opts);
+
+    ccp = extCurlCacheFind(key, opts->co_cache_file);
+    if (ccp && ccp->cc_expires > time(NULL)) {
+	nodep = extCurlCacheCopy(docp, ccp, "fresh");
+	goto done;
+    }
+
+    curlp->ch_revalidate = (ccp && (ccp->cc_etag || ccp->cc_last_modified))
+	? ccp : NULL;
+    nodep = extCurlFetch(docp, curlp, opts);
+    curlp->ch_revalidate = NULL;
+
+    code = extCurlReplyCode(nodep);
+    if (code != 200 && !(code == 304 && ccp))
+	goto done;
+
+    expires = extCurlCacheExpires(nodep);
+    if (expires < 0)		/* no-store */
+	goto done;
+
+    newp = xmlMalloc(sizeof(*newp));
+    if (newp == NULL)
+	goto done;
+    bzero(newp, sizeof(*newp));
+    newp->cc_expires = expires;
+
+    if (code == 304) {
+	/* Still good; keep the old results and validators */
+	newp->cc_etag = xmlStrdup2(ccp->cc_etag);
+	newp->cc_last_modified = xmlStrdup2(ccp->cc_last_modified);
+	newp->cc_doc = xmlCopyDoc(ccp->cc_doc, 1);
+
+	xmlFreeNode(nodep);
+	nodep = extCurlCacheCopy(docp, ccp, "revalidated");
+
+    } else {
+	newp->cc_etag = extCurlReplyHeader(nodep, "etag");
+	newp->cc_last_modified = extCurlReplyHeader(nodep, "last-modified");
+
+	/* Nothing to revalidate with and already stale: don't bother */
+	if (newp->cc_etag == NULL && newp->cc_last_modified == NULL
+		&& expires <= time(NULL)) {
+	    extCurlCacheFree(newp);
+	    goto done;
+	}
+
+	newp->cc_doc = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
+	if (newp->cc_doc) {
+	    copyp = xmlDocCopyNode(nodep, newp->cc_doc, 1);
+	    if (copyp)
+		xmlDocSetRootElement(newp->cc_doc, copyp);
+	}
+    }
+
+    if (newp->cc_doc == NULL || xmlDocGetRootElement(newp->cc_doc) == NULL) {
+	extCurlCacheFree(newp);
+	goto done;
+    }
+
+    newp->cc_key = key;
+    key = NULL;
+
+    if (opts->co_cache_file) {
+	pthread_mutex_lock(&extCurlCacheLock);
+	ccsp = extCurlCacheStore(opts->co_cache_file);
+	if (ccsp)
+	    extCurlCacheSave(ccsp, newp);
+	pthread_mutex_unlock(&extCurlCacheLock);
+    }
+
+    extCurlCacheInsert(newp);
+
+ done:
+    extCurlCacheRelease(ccp);
+    xmlFreeAndEasy(key);
+
+    return nodep;
+}
+
+/*
+ * Perform the transfer, through the cache if the options ask for it
+ */
+static xmlNodePtr
+extCurlTransfer (xmlDocPtr docp, curl_handle_t *curlp, curl_opts_t *opts)
+{
+    if (opts->co_cache)
+	return extCurlCacheTransfer(docp, curlp, opts);
+
+    return extCurlFetch(docp, curlp, opts);
+}
+
+/*
+ * Parse an option node, along with any option nodes under it
+ */
+static void
+extCurlParseNodes (curl_opts_t *opts, xmlNodePtr nop)
+{
+    xmlNodePtr cop;
+
+    if (nop->type == XML_ELEMENT_NODE)
+	extCurlParseNode(opts, nop);
+
+    for (cop = nop->children; cop; cop = cop->next) {
+	if (cop->type != XML_ELEMENT_NODE)
+	    continue;
+
+	extCurlParseNode(opts, cop);
+    }
+}
+
+/*
+ * Parse a set of option values and store them in an options structure
+ */
+static void
+extCurlOptionsParse (curl_handle_t *curlp UNUSED, curl_opts_t *opts,
+			xmlXPathObject *ostack[], int nargs)
+{
+    int osi;
+
+    for (osi = nargs - 1; osi >= 0; osi--) {
+	xmlXPathObject *xop = ostack[osi];
+
+	if (xop->stringval) {
+	    if (opts->co_url)
+		xmlFree(opts->co_url);
+	    opts->co_url = (char *) xmlStrdup(xop->stringval);
+
+	} else if (xop->nodesetval) {
+	    xmlNodeSetPtr nodeset;
+	    int i;
+
+	    nodeset = xop->nodesetval;
+	    for (i = 0; i < nodeset->nodeNr; i++)
+		extCurlParseNodes(opts, nodeset->nodeTab[i]);
+	}
+    }
+}
+
+/*
+ * Set parameters for a curl handle
+ * Usage:
+      var $handle = curl:open();
+      expr curl:set($handle, $opts, $more-opts);
+ */
+static void
+extCurlSet (xmlXPathParserContext *ctxt, int nargs)
+{
+    xmlXPathObject *ostack[nargs];	/* Stack for objects */
+    curl_handle_t *curlp;
+    char *name;
+    int osi;
+
+    if (nargs < 1) {
+	LX_ERR("curl:execute: too few arguments error\n");
+	return;
+    }
+
+    for (osi = nargs - 1; osi >= 0; osi--)
+	ostack[osi] = valuePop(ctxt);
+
+    name = (char *) xmlXPathCastToString(ostack[0]);
+    if (name == NULL) {
+	LX_ERR("curl:set: no argument\n");
+	goto fail;
+    }
+
+    curlp = extCurlHandleFind(name);
     if (curlp == NULL) {
 	slaxLog("curl:set: unknown handle: %s", name);
 	xmlFree(name);
@@ -1388,7 +2705,6 @@ extCurlPerform (xmlXPathParserContext *ctxt, int nargs)
     xmlXPathObject *ostack[nargs];	/* Stack for objects */
     curl_handle_t *curlp;
     char *name;
-    CURLcode success;
     int osi;
     xmlNodePtr nodep;
     xmlXPathObjectPtr ret;
@@ -1424,8 +2740,6 @@ extCurlPerform (xmlXPathParserContext *ctxt, int nargs)
 
     extCurlOptionsParse(curlp, &co, ostack + 1, nargs - 1);
 
-    success = extCurlDoPerform(curlp, &co);
-
     /*
      * Create a Result Value Tree container, and register it with RVT garbage
      * collector.
@@ -1434,7 +2748,7 @@ extCurlPerform (xmlXPathParserContext *ctxt, int nargs)
     if (container == NULL)
 	goto fail;
 
-    nodep = extCurlBuildResults(container, curlp, &co, success);
+    nodep = extCurlTransfer(container, curlp, &co);
 
     xmlAddChild((xmlNodePtr) container, nodep);
     xmlNodeSet *results = xmlXPathNodeSetCreate(NULL);
@@ -1453,12 +2767,192 @@ extCurlPerform (xmlXPathParserContext *ctxt, int nargs)
 	    xmlXPathFreeObject(ostack[osi]);
 }
 
+/*
+ * Run a set of transfers concurrently using a libcurl "multi" handle,
+ * keeping at most "limit" of them in flight.  Email transfers don't
+ * fit this model, so they're simply performed in turn.
+ */
+static void
+extCurlMultiPerform (curl_handle_t **handles, CURLcode *codes,
+		     unsigned count, unsigned limit)
+{
+    curl_xfer_t *xfers;
+    CURLM *multi;
+    CURLMsg *msg;
+    CURL *easy;
+    unsigned next = 0, active = 0, i;
+    int running, left;
+    char *priv;
+
+    xfers = xmlMalloc(count * sizeof(*xfers));
+    multi = curl_multi_init();
+    if (xfers == NULL || multi == NULL) {
+	for (i = 0; i < count; i++)
+	    codes[i] = CURLE_OUT_OF_MEMORY;
+	goto done;
+    }
+
+    while (next < count || active > 0) {
+	/* Start transfers until we're at the limit */
+	while (active < limit && next < count) {
+	    curl_handle_t *curlp = handles[i = next++];
+
+	    switch (extCurlSetup(curlp, &curlp->ch_opts, &xfers[i])) {
+	    case CXS_EMAIL:
+		codes[i] = extCurlDoEmail(curlp, &curlp->ch_opts);
+		continue;
+
+	    case CXS_FAIL:
+		codes[i] = FALSE;
+		continue;
+	    }
+
+	    /* CURLOPT_PRIVATE leads us back to this transfer's slot */
+	    CURL_SET(CURLOPT_PRIVATE, &codes[i]);
+	    if (curl_multi_add_handle(multi, curlp->ch_handle) != CURLM_OK) {
+		codes[i] = extCurlDecodeDone(curlp,
+					curl_easy_perform(curlp->ch_handle));
+		extCurlFinish(curlp, &xfers[i]);
+		continue;
+	    }
+
+	    active += 1;
+	}
+
+	if (active == 0)
+	    continue;
+
+	curl_multi_perform(multi, &running);
+
+	while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+	    if (msg->msg != CURLMSG_DONE)
+		continue;
+
+	    easy = msg->easy_handle;
+	    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &priv);
+	    i = (CURLcode *) priv - codes;
+	    codes[i] = extCurlDecodeDone(handles[i], msg->data.result);
+
+	    curl_multi_remove_handle(multi, easy);
+	    extCurlFinish(handles[i], &xfers[i]);
+	    active -= 1;
+	}
+
+	if (running > 0)
+	    curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+
+ done:
+    if (multi)
+	curl_multi_cleanup(multi);
+    xmlFreeAndEasy(xfers);
+}
+
+/*
+ * Perform a set of transfers concurrently.  Each request is an
+ * element holding the options for one transfer (as for curl:single);
+ * any further arguments are options common to all of them.  Results
+ * are returned in the order of the requests.
+ * Usage:
+      var $res = curl:perform-many($requests, $opts, $more-opts);
+ */
+static void
+extCurlPerformMany (xmlXPathParserContext *ctxt, int nargs)
+{
+    xmlXPathObject *ostack[nargs];	/* Stack for objects */
+    curl_handle_t **handles = NULL;
+    CURLcode *codes = NULL;
+    xmlNodeSetPtr requests, results = NULL;
+    xmlNodePtr nop;
+    xmlDocPtr container;
+    curl_opts_t common;
+    unsigned count = 0, limit, i;
+    int osi;
+
+    if (nargs < 1) {
+	LX_ERR("curl:perform-many: too few arguments error\n");
+	return;
+    }
+
+    for (osi = nargs - 1; osi >= 0; osi--)
+	ostack[osi] = valuePop(ctxt);
+
+    requests = ostack[0] ? ostack[0]->nodesetval : NULL;
+    if (requests == NULL) {
+	LX_ERR("curl:perform-many: requests must be a node-set\n");
+	goto fail;
+    }
+
+    bzero(&common, sizeof(common));
+    slaxDataListInit(&common.co_headers);
+    slaxDataListInit(&common.co_params);
+    slaxDataListInit(&common.co_to);
+    slaxDataListInit(&common.co_cc);
+    extCurlOptionsParse(NULL, &common, ostack + 1, nargs - 1);
+
+    limit = common.co_concurrency ?: CURL_MULTI_LIMIT;
+
+    handles = xmlMalloc(requests->nodeNr * sizeof(*handles));
+    codes = xmlMalloc(requests->nodeNr * sizeof(*codes));
+    if (handles == NULL || codes == NULL)
+	goto done;
+
+    for (i = 0; i < (unsigned) requests->nodeNr; i++) {
+	nop = requests->nodeTab[i];
+	if (nop->type != XML_ELEMENT_NODE)
+	    continue;
+
+	curl_handle_t *curlp = extCurlHandleAlloc();
+	if (curlp == NULL) {
+	    slaxLog("curl:perform-many: alloc failed");
+	    goto done;
+	}
+
+	handles[count++] = curlp;
+	extCurlOptionsRelease(&curlp->ch_opts);
+	extCurlOptionsCopy(&curlp->ch_opts, &common);
+	extCurlParseNodes(&curlp->ch_opts, nop);
+    }
+
+    extCurlMultiPerform(handles, codes, count, limit);
+
+    /*
+     * Create a Result Value Tree container, and register it with RVT garbage
+     * collector.
+     */
+    container = slaxMakeRtf(ctxt);
+    if (container == NULL)
+	goto done;
+
+    results = xmlXPathNodeSetCreate(NULL);
+    for (i = 0; i < count; i++) {
+	nop = extCurlBuildResults(container, handles[i],
+				  &handles[i]->ch_opts, codes[i]);
+	xmlAddChild((xmlNodePtr) container, nop);
+	xmlXPathNodeSetAdd(results, nop);
+    }
+
+    valuePush(ctxt, xmlXPathNewNodeSetList(results));
+    xmlXPathFreeNodeSet(results);
+
+ done:
+    for (i = 0; i < count; i++)
+	extCurlHandleFree(handles[i]);
+    xmlFreeAndEasy(handles);
+    xmlFreeAndEasy(codes);
+    extCurlOptionsRelease(&common);
+
+ fail:
+    for (osi = nargs - 1; osi >= 0; osi--)
+	if (ostack[osi])
+	    xmlXPathFreeObject(ostack[osi]);
+}
+
 static void
 extCurlSingle (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 {
     xmlXPathObject *ostack[nargs];	/* Stack for objects */
     curl_handle_t *curlp;
-    CURLcode success;
     int osi;
     xmlNodePtr nodep;
     xmlXPathObjectPtr ret;
@@ -1480,8 +2974,6 @@ extCurlSingle (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 
     extCurlOptionsParse(curlp, &curlp->ch_opts, ostack, nargs);
 
-    success = extCurlDoPerform(curlp, &curlp->ch_opts);
-
     /*
      * Create a Result Value Tree container, and register it with RVT garbage
      * collector.
@@ -1490,7 +2982,7 @@ extCurlSingle (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
     if (container == NULL)
 	goto fail;
 
-    nodep = extCurlBuildResults(container, curlp, &curlp->ch_opts, success);
+    nodep = extCurlTransfer(container, curlp, &curlp->ch_opts);
 
     xmlAddChild((xmlNodePtr) container, nodep);
     xmlNodeSet *results = xmlXPathNodeSetCreate(NULL);
@@ -1519,6 +3011,11 @@ slax_function_table_t slaxCurlTable[] = {
 	"Perform a CURL transfer",
 	"(handle, options*)", XPATH_XSLT_TREE,
     },
+    {
+	"perform-many", extCurlPerformMany,
+	"Perform a set of CURL transfers concurrently",
+	"(requests, options*)", XPATH_XSLT_TREE,
+    },
     {
 	"single", extCurlSingle,
 	"Perform a CURL transfer",
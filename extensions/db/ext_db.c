@@ -16,6 +16,7 @@
 #include <sys/time.h>
 #include <sys/param.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 
 #include <sys/queue.h>
@@ -51,6 +52,11 @@
 #endif /* HAVE_DLFCN_H */
 
 
+/*
+ * Default number of seconds an idle pooled handle is kept open
+ */
+#define DB_POOL_IDLE 300
+
 /*
  * Function pointer for driver initialization function
  */
@@ -132,10 +138,105 @@ db_handle_free (db_handle_t *dbhp)
 {
     if (dbhp) {
 	TAILQ_REMOVE(&extDbSessions, dbhp, dh_link);
+	xmlFreeAndEasy(dbhp->dh_pool);
 	xmlFree(dbhp);
     }
 }
 
+/*
+ * Closes a handle in the driver and frees it
+ */
+static void
+db_handle_close (db_handle_t *dbhp, xmlXPathParserContext *ctxt, int nargs)
+{
+    if (dbhp->dh_driver->dd_close) {
+	(dbhp->dh_driver->dd_close)(dbhp, ctxt, nargs);
+    }
+
+    db_handle_free(dbhp);
+}
+
+/*
+ * Puts a pooled handle back in the pool, to be picked up by a later
+ * db:open() with the same pool key
+ */
+static void
+db_handle_release (db_handle_t *dbhp)
+{
+    if (dbhp->dh_driver->dd_release) {
+	(dbhp->dh_driver->dd_release)(dbhp);
+    }
+
+    slaxLog("db: handle %s back in pool '%s'", dbhp->dh_name, dbhp->dh_pool);
+    dbhp->dh_run = NULL;
+    dbhp->dh_last = time(NULL);
+}
+
+/*
+ * Closes pooled handles that have been idle for longer than their
+ * timeout
+ */
+static void
+db_pool_reap (void)
+{
+    db_handle_t *dbhp, *nextp;
+    time_t now = time(NULL);
+
+    for (dbhp = TAILQ_FIRST(&extDbSessions); dbhp; dbhp = nextp) {
+	nextp = TAILQ_NEXT(dbhp, dh_link);
+
+	if (dbhp->dh_pool && dbhp->dh_run == NULL
+		&& now - dbhp->dh_last >= (time_t) dbhp->dh_idle) {
+	    slaxLog("db: closing idle handle %s", dbhp->dh_name);
+	    db_handle_close(dbhp, NULL, 0);
+	}
+    }
+}
+
+/*
+ * Finds an idle pooled handle for the given key
+ */
+static db_handle_t *
+db_pool_find (const char *key, db_driver_t *driver)
+{
+    db_handle_t *dbhp;
+
+    TAILQ_FOREACH(dbhp, &extDbSessions, dh_link) {
+	if (dbhp->dh_pool && dbhp->dh_run == NULL
+		&& dbhp->dh_driver == driver && streq(dbhp->dh_pool, key)) {
+	    return dbhp;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * The transform module hooks.  The module data stands for one run of a
+ * script; pooled handles opened by that run point to it, and go back to
+ * the pool when the run ends, whether or not the script closed them.
+ */
+static void *
+extDbRunInit (xsltTransformContextPtr tctxt UNUSED, const xmlChar *uri UNUSED)
+{
+    return xmlMalloc(1);
+}
+
+static void
+extDbRunShutdown (xsltTransformContextPtr tctxt UNUSED,
+		  const xmlChar *uri UNUSED, void *data)
+{
+    db_handle_t *dbhp;
+
+    TAILQ_FOREACH(dbhp, &extDbSessions, dh_link) {
+	if (dbhp->dh_pool && dbhp->dh_run == data) {
+	    db_handle_release(dbhp);
+	}
+    }
+
+    xmlFree(data);
+}
+
 /*
  * Given name of database engine, return driver structure. If we don't have a
  * drive available with that name, try loading it and return the loaded
@@ -170,6 +271,11 @@ db_get_handle_by_name (const char *name)
     db_handle_t *dbhp;
 
     TAILQ_FOREACH(dbhp, &extDbSessions, dh_link) {
+	/* Idle handles in the pool belong to no one */
+	if (dbhp->dh_pool && dbhp->dh_run == NULL) {
+	    continue;
+	}
+
 	if (streq(dbhp->dh_name, name)) {
 	    return dbhp;
 	}
@@ -234,6 +340,10 @@ db_parse_node (db_input_t *input, xmlNodePtr nodep)
 	DB_XML_NODE_SET(input->di_retrieve);
     else if (streq(key, "update"))
 	DB_XML_NODE_SET(input->di_update);
+    else if (streq(key, "pool"))
+	DB_STRING_SET(input->di_pool);
+    else if (streq(key, "idle-timeout"))
+	input->di_idle = atoi(xmlNodeValue(nodep));
     else if (streq(key, "access"))
 	DB_XML_NODE_SET(input->di_access);
 }
@@ -259,6 +369,8 @@ db_input_copy (db_input_t *top, db_input_t *fromp)
     COPY_STRING(di_engine);
     COPY_STRING(di_database);
     COPY_STRING(di_collection);
+    COPY_STRING(di_pool);
+    top->di_idle = fromp->di_idle;
 
     fromp->di_limit = top->di_limit;
     fromp->di_skip = top->di_skip;
@@ -351,6 +463,7 @@ db_input_free (db_input_t *input)
     DB_STRING_FREE(input->di_engine);
     DB_STRING_FREE(input->di_database);
     DB_STRING_FREE(input->di_collection);
+    DB_STRING_FREE(input->di_pool);
 
     DB_XML_NODE_FREE(input->di_access);
     DB_XML_NODE_FREE(input->di_fields);
@@ -389,7 +502,12 @@ extDbClose (xmlXPathParserContext *ctxt UNUSED, int nargs)
 
     dbhp = db_get_handle_by_name(name);
 
-    if (dbhp) {
+    if (dbhp && dbhp->dh_pool) {
+	/* Pooled handles stay open for the next run */
+	db_handle_release(dbhp);
+	db_pool_reap();
+
+    } else if (dbhp) {
 	/* Call driver close callback */
 	if (dbhp->dh_driver->dd_close) {
 	    rc = (dbhp->dh_driver->dd_close)(dbhp, ctxt, nargs);
@@ -420,12 +538,13 @@ extDbOperate (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED,
     xmlXPathObjectPtr ret;
     xmlDocPtr container;
     xmlNodeSet *results;
+    xmlNodeSetPtr rows = NULL;
     db_handle_t *dbhp;
     db_ret_t rc = DB_FAIL;
-    char *name;
-    int osi;
+    char *name = NULL;
+    int osi, many = streq(operation, "insert-many");
 
-    if (nargs < 2) {
+    if (nargs < (many ? 3 : 2)) {
 	LX_ERR("db:%s: too few arguments\n", operation);
 	return;
     }
@@ -433,19 +552,36 @@ extDbOperate (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED,
     for (osi = nargs - 1; osi >= 0; osi--)
 	ostack[osi] = valuePop(ctxt);
 
+    bzero(&pb, sizeof(pb));
+
     name = (char *)xmlXPathCastToString(ostack[0]);
     if (name == NULL) {
 	LX_ERR("db:%s: missing handle\n", operation);
 	goto fail;
     }
 
-    in = db_input_parse(ostack + 1, nargs - 1);
+    /*
+     * For insert-many, the last argument is the node-set of rows, which
+     * we hand to the driver as is rather than parsing it
+     */
+    if (many) {
+	rows = ostack[nargs - 1]->nodesetval;
+	if (rows == NULL) {
+	    LX_ERR("db:%s: rows must be a node-set\n", operation);
+	    goto fail;
+	}
+    }
+
+    in = db_input_parse(ostack + 1, nargs - (many ? 2 : 1));
     if (in ==  NULL) {
 	LX_ERR("db:%s: unable to parse data\n", operation);
 	goto fail;
     }
 
-    bzero(&pb, sizeof(pb));
+    /* The collection can be given as a plain string */
+    if (many && in->di_collection == NULL && in->di_buf.pb_buf) {
+	in->di_collection = xmlStrdup2(in->di_buf.pb_buf);
+    }
 
     /*
      * Get database handle and invoke insert callback on it
@@ -460,6 +596,9 @@ extDbOperate (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED,
 	    rc = (*dbhp->dh_driver->dd_update)(dbhp, in, ctxt, nargs, &pb);
 	} else if (streq(operation, "delete")) {
 	    rc = (*dbhp->dh_driver->dd_delete)(dbhp, in, ctxt, nargs, &pb);
+	} else if (many && dbhp->dh_driver->dd_insertMany) {
+	    rc = (*dbhp->dh_driver->dd_insertMany)(dbhp, in, rows, ctxt,
+						   nargs, &pb);
 	}
 
 	if (rc == DB_OK) {
@@ -526,6 +665,15 @@ extDbInsert (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
     extDbOperate(ctxt, nargs, "insert");
 }
 
+/*
+ * Inserts a node-set of rows into a collection, in one transaction
+ */
+static void
+extDbInsertMany (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
+{
+    extDbOperate(ctxt, nargs, "insert-many");
+}
+
 /*
  * Given handle and schema, creates a collection/table
  */
@@ -560,10 +708,11 @@ extDbUpdate (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
  * statement. Our final cursor will look like xxxxdbxxxx.
  */
 static void
-extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
+extDbFetchCommon (xmlXPathParserContext *ctxt, int nargs, const char *fname,
+		  int many)
 {
     xmlXPathObject *ostack[nargs];
-    char *name, *cp;
+    char *name = NULL, *cp;
     char buf[BUFSIZ];
     db_handle_t *dbhp;
     db_ret_t rc;
@@ -573,10 +722,11 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
     xmlXPathObject *input = NULL;
     xmlDocPtr container;
     xmlNodeSet *results;
-    int osi;
+    unsigned count = 1;
+    int osi, argi = 1, direct = FALSE;
 
-    if (nargs < 1) {
-	LX_ERR("db:fetch: too few arguments\n");
+    if (nargs < (many ? 2 : 1)) {
+	LX_ERR("db:%s: too few arguments\n", fname);
 	return;
     }
 
@@ -587,17 +737,27 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 
     name = (char *)xmlXPathCastToString(ostack[0]);
     if (name == NULL) {
-	LX_ERR("db:fetch: missing cursor\n");
+	LX_ERR("db:%s: missing cursor\n", fname);
 	goto fail;
     }
 
+    if (many) {
+	double d = xmlXPathCastToNumber(ostack[argi++]);
+
+	if (!(d >= 1)) {
+	    LX_ERR("db:%s: invalid count\n", fname);
+	    goto fail;
+	}
+	count = (d > UINT_MAX) ? UINT_MAX : (unsigned) d;
+    }
+
     /*
      * If input data is provided with fetch, we use it to bind to prepared
      * statement and execute it. This will be useful when we want to reuse a
      * prepared statement to insert multiple instances
      */
-    if (nargs > 1) {
-	input = ostack[1];
+    if (nargs > argi) {
+	input = ostack[argi];
     }
 
     /*
@@ -610,13 +770,13 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 
 	dbhp = db_get_handle_by_name(buf);
 	if (dbhp == NULL || dbhp->dh_driver == NULL) {
-	    LX_ERR("db:fetch: invalid curosr\n");
+	    LX_ERR("db:%s: invalid curosr\n", fname);
 	    goto fail;
 	}
 
 	container = slaxMakeRtf(ctxt);
 	if (container == NULL) {
-	    LX_ERR("db:fetch: failed to create result container\n");
+	    LX_ERR("db:%s: failed to create result container\n", fname);
 	    goto fail;
 	}
 
@@ -627,20 +787,41 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 				NULL);
 
 	if (resultp == NULL || statusp == NULL) {
-	    LX_ERR("db:fetch: failed to create result/status nodes\n");
+	    LX_ERR("db:%s: failed to create result/status nodes\n", fname);
 	    goto fail;
 	}
 
-	rc = (*dbhp->dh_driver->dd_fetch)(dbhp, cp + 1, input, ctxt, nargs, 
-					  &pb);
-	if (rc == DB_DATA) {
+	/*
+	 * Drivers that can build the rows as nodes do so directly, which
+	 * saves formatting them as text and parsing that back in
+	 */
+	if (dbhp->dh_driver->dd_fetchRows) {
+	    rc = (*dbhp->dh_driver->dd_fetchRows)(dbhp, cp + 1, count, input,
+						  resultp, ctxt, nargs, &pb);
+	    direct = TRUE;
+
+	} else if (many) {
+	    LX_ERR("db:%s: not supported by the %s driver\n", fname,
+		   dbhp->dh_driver->dd_name);
+	    goto fail;
+
+	} else {
+	    rc = (*dbhp->dh_driver->dd_fetch)(dbhp, cp + 1, input, ctxt,
+					      nargs, &pb);
+	}
+
+	if (rc == DB_DATA && direct) {
+	    /* The rows are already in place */
+	    childp = xmlNewDocNode(container, NULL, (const xmlChar *) "data",
+				   NULL);
+	} else if (rc == DB_DATA) {
 	    xmlDocPtr xmlp;
 	    xmlNodePtr newp;
 
 	    xmlp = xmlReadMemory(pb.pb_buf, strlen(pb.pb_buf), "raw_data", 
 				 NULL, XML_PARSE_NOENT);
 	    if (xmlp == NULL) {
-		slaxLog("db:fetch: failed to read raw data from result");
+		slaxLog("db:%s: failed to read raw data from result", fname);
 		goto fail;
 	    }
 
@@ -684,7 +865,7 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 	valuePush(ctxt, ret);
 	xmlXPathFreeNodeSet(results);
      } else {
-	LX_ERR("db:fetch: invalid cursor\n");
+	LX_ERR("db:%s: invalid cursor\n", fname);
 	goto fail;
      }
 
@@ -704,6 +885,25 @@ extDbFetch (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
     }
 }
 
+/*
+ * Returns the next row from the cursor
+ */
+static void
+extDbFetch (xmlXPathParserContext *ctxt, int nargs)
+{
+    extDbFetchCommon(ctxt, nargs, "fetch", FALSE);
+}
+
+/*
+ * Returns up to the given number of rows from the cursor, so large
+ * results can be paged through a batch at a time
+ */
+static void
+extDbFetchMany (xmlXPathParserContext *ctxt, int nargs)
+{
+    extDbFetchCommon(ctxt, nargs, "fetch-many", TRUE);
+}
+
 /*
  * Finds instances matching given conditions
  */
@@ -951,6 +1151,9 @@ extDbOpen (xmlXPathParserContext *ctxt, int nargs)
     db_handle_t *handle;
     db_ret_t rc;
     db_input_t *in;
+    xsltTransformContextPtr tctxt;
+    void *run = NULL;
+    char key[BUFSIZ];
 
     if (nargs < 1) {
 	LX_ERR("db:open: too few arguments\n");
@@ -986,6 +1189,39 @@ extDbOpen (xmlXPathParserContext *ctxt, int nargs)
 	goto fail;
     }
 
+    /*
+     * A pooled handle is kept open after the run that opened it ends,
+     * and handed to a later run that asks for the same pool.  An empty
+     * pool name means the engine and database are the key.
+     */
+    if (in->di_pool) {
+	tctxt = xsltXPathGetTransformContext(ctxt);
+	if (tctxt)
+	    run = xsltGetExtData(tctxt, (const xmlChar *) DB_FULL_NS);
+
+	if (run == NULL) {
+	    slaxLog("db:open: no transform context; not pooling");
+	} else {
+	    if (*in->di_pool)
+		snprintf(key, sizeof(key), "%s", in->di_pool);
+	    else
+		snprintf(key, sizeof(key), "%s:%s",
+			 in->di_engine, in->di_database);
+
+	    db_pool_reap();
+
+	    handle = db_pool_find(key, driver);
+	    if (handle) {
+		slaxLog("db:open: reusing handle %s from pool '%s'",
+			handle->dh_name, key);
+		handle->dh_run = run;
+		xmlXPathReturnString(ctxt,
+			     xmlStrdup((const xmlChar *) handle->dh_name));
+		goto fail;
+	    }
+	}
+    }
+
     /* Create a session and call open on the database driver with this id */
     handle = db_handle_alloc(driver);
 
@@ -999,8 +1235,15 @@ extDbOpen (xmlXPathParserContext *ctxt, int nargs)
     switch (rc) {
 	case DB_FAIL:
 	    LX_ERR("db:open: failed to open database\n");
+	    db_handle_free(handle);
 	    goto fail;
 	default:
+	    if (run) {
+		handle->dh_pool = xmlStrdup2(key);
+		handle->dh_idle = in->di_idle ?: DB_POOL_IDLE;
+		handle->dh_run = run;
+	    }
+
 	    xmlXPathReturnString(ctxt, 
 				 xmlStrdup((const xmlChar *) handle->dh_name));
     }
@@ -1118,6 +1361,11 @@ slax_function_table_t slaxDbTable[] = {
 	"Fetches data from given cursor",
 	"(handle, cursor)", XPATH_XSLT_TREE,
     },
+    {
+	"fetch-many", extDbFetchMany,
+	"Fetches up to the given number of rows from a cursor",
+	"(cursor, count, input?)", XPATH_XSLT_TREE,
+    },
     {
 	"find", extDbFind,
 	"Finds data that matches given input",
@@ -1133,6 +1381,11 @@ slax_function_table_t slaxDbTable[] = {
 	"Inserts given data into the database",
 	"(handle, data)", XPATH_NODESET,
     },
+    {
+	"insert-many", extDbInsertMany,
+	"Inserts a node-set of rows into a collection in one transaction",
+	"(handle, collection, rows)", XPATH_NODESET,
+    },
     {
 	"open", extDbOpen,
 	"Opens database and returns the handle. Creates if possible",
@@ -1158,6 +1411,8 @@ extDbInit (void)
     TAILQ_INIT(&extDbDrivers);
 
     slaxRegisterFunctionTable(DB_FULL_NS, slaxDbTable);
+    xsltRegisterExtModule((const xmlChar *) DB_FULL_NS,
+			  extDbRunInit, extDbRunShutdown);
 }
 
 SLAX_DYN_FUNC(slaxDynLibInit)
@@ -1167,5 +1422,24 @@ SLAX_DYN_FUNC(slaxDynLibInit)
 
     arg->da_functions = slaxDbTable; /* Fill in our function table */
 
+    /* Lets us see when each run ends, for pooled handles */
+    xsltRegisterExtModule((const xmlChar *) DB_FULL_NS,
+			  extDbRunInit, extDbRunShutdown);
+
+    return SLAX_DYN_VERSION;
+}
+
+/*
+ * Close whatever is left in the pool before we're unloaded
+ */
+SLAX_DYN_FUNC(slaxDynLibClean)
+{
+    db_handle_t *dbhp;
+
+    xsltUnregisterExtModule((const xmlChar *) DB_FULL_NS);
+
+    while ((dbhp = TAILQ_FIRST(&extDbSessions)) != NULL)
+	db_handle_close(dbhp, NULL, 0);
+
     return SLAX_DYN_VERSION;
 }
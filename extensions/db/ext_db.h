@@ -46,6 +46,8 @@ typedef struct db_input_s {
     xmlNodePtr di_sort;         /* Result sorting order */
     xmlNodePtr di_retrieve;     /* Subset of fields to retrieve */
     xmlNodePtr di_update;       /* New data to update instances with */
+    char *di_pool;              /* Pool name (db:open) */
+    unsigned int di_idle;       /* Pool idle timeout, in seconds */
     slax_printf_buffer_t di_buf;/* Hold a string buffer */
 } db_input_t;
 
@@ -90,6 +92,14 @@ typedef struct db_driver_s {
                            xmlXPathParserContext *, int, 
                            slax_printf_buffer_t *);
     db_ret_t (* dd_close) (db_handle_t *, xmlXPathParserContext *, int);
+    db_ret_t (* dd_insertMany) (db_handle_t *, db_input_t *, 
+                                xmlNodeSetPtr, xmlXPathParserContext *, 
+                                int, slax_printf_buffer_t *);
+    db_ret_t (* dd_fetchRows) (db_handle_t *, const char *, unsigned,
+                               xmlXPathObject *, xmlNodePtr,
+                               xmlXPathParserContext *, int,
+                               slax_printf_buffer_t *);
+    db_ret_t (* dd_release) (db_handle_t *);
 } db_driver_t;
 
 /*
@@ -99,6 +109,10 @@ struct db_handle_s {
     TAILQ_ENTRY(db_handle_s) dh_link;   /* Link to next session */
     char dh_name[DB_NAME_SIZE];         /* Unique ID for this handle */
     db_driver_t *dh_driver;             /* Backend database engine driver */
+    char *dh_pool;                      /* Pool key, if pooled */
+    unsigned dh_idle;                   /* Seconds to keep it when idle */
+    time_t dh_last;                     /* When it went back to the pool */
+    void *dh_run;                       /* Transform using it (NULL: idle) */
 };
 
 /*
@@ -171,6 +185,31 @@ void db_input_free (db_input_t *input);
                        xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED, \
                        slax_printf_buffer_t *out UNUSED)
 
+#define DB_DRIVER_INSERT_MANY(x) \
+    static db_ret_t x (db_handle_t *db_handle, db_input_t *in, \
+                       xmlNodeSetPtr rows, \
+                       xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED, \
+                       slax_printf_buffer_t *out UNUSED)
+
+/*
+ * Fetches up to "count" rows, adding an <instance> node for each to
+ * "parent".  Returns DB_DATA if the count was reached and DB_DONE if
+ * the cursor ran out first.
+ */
+#define DB_DRIVER_FETCH_ROWS(x) \
+    static db_ret_t x (db_handle_t *db_handle UNUSED, const char *name, \
+                       unsigned count, xmlXPathObject *in UNUSED, \
+                       xmlNodePtr parent, \
+                       xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED, \
+                       slax_printf_buffer_t *out UNUSED)
+
+/*
+ * A pooled handle is going idle: drop per-run state such as cursors,
+ * but keep the connection and anything worth reusing
+ */
+#define DB_DRIVER_RELEASE(x) \
+    static db_ret_t x (db_handle_t *db_handle)
+
 #define DB_DRIVER_CLOSE(x) \
     static db_ret_t x (db_handle_t *db_handle, \
                        xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
@@ -13,9 +13,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
 
 #include <sys/queue.h>
 
@@ -40,6 +42,26 @@
 
 #include "sqlite3.h"
 
+/*
+ * Number of prepared statements kept for each handle
+ */
+#define DB_SQLITE_CACHE_MAX 32
+
+/*
+ * A prepared statement in a handle's statement cache, keyed by its
+ * SQL text.  Cursors reference the statement while they are open;
+ * the most recent user is the owner, whose values are bound.
+ */
+typedef struct db_sqlite_cache_s {
+    TAILQ_ENTRY(db_sqlite_cache_s) dsc_link; /* Link to next statement */
+    char *dsc_sql;			    /* SQL text (the key) */
+    sqlite3_stmt *dsc_stmt;		    /* Prepared sqlite3 statement */
+    void *dsc_owner;			    /* Whose values are bound */
+    unsigned dsc_refs;			    /* Cursors using this */
+} db_sqlite_cache_t;
+
+TAILQ_HEAD(db_sqlite_caches_s, db_sqlite_cache_s);
+
 /*
  * Sqlite driver specific handler
  */
@@ -47,15 +69,38 @@ typedef struct db_sqlite_handle_s {
     TAILQ_ENTRY(db_sqlite_handle_s) dsh_link;	/* Link to next session */
     db_handle_t *dsh_db_handle;			/* External database handle */
     sqlite3 *dsh_sqlite_handle;			/* Sqlite3 database handle */
+    struct db_sqlite_caches_s dsh_cache;	/* Statement cache (LRU) */
+    unsigned dsh_cache_count;			/* Statements in dsh_cache */
 } db_sqlite_handle_t;
 
+/*
+ * A value to bind to a parameter of a statement
+ */
+typedef struct db_sqlite_bind_s {
+    int dsb_type;			/* SQLITE_TEXT, _INTEGER, _FLOAT, _NULL */
+    char *dsb_text;			/* Value (SQLITE_TEXT) */
+    sqlite3_int64 dsb_int;		/* Value (SQLITE_INTEGER) */
+    double dsb_real;			/* Value (SQLITE_FLOAT) */
+} db_sqlite_bind_t;
+
+/*
+ * The values for the parameters of a statement, in order
+ */
+typedef struct db_sqlite_binds_s {
+    db_sqlite_bind_t *dsbs_list;	/* Values */
+    unsigned dsbs_count;		/* Number of values */
+    unsigned dsbs_max;			/* Size of dsbs_list */
+} db_sqlite_binds_t;
+
 /*
  * Structure to hold prepared statement
  */
 typedef struct db_sqlite_stmt_s {
     TAILQ_ENTRY(db_sqlite_stmt_s) dss_link; /* Link to next statement */
     char dss_name[DB_NAME_SIZE];	    /* Unique ID for this statement */
-    sqlite3_stmt *dss_stmt;		    /* Prepared sqlite3 statement */
+    sqlite3_stmt *dss_stmt;		    /* Private statement, if any */
+    db_sqlite_cache_t *dss_cache;	    /* Cached statement, if any */
+    db_sqlite_binds_t dss_binds;	    /* Values for its parameters */
     db_sqlite_handle_t *dss_handle;	    /* Sqlite3 handler */
     db_input_t *dss_in;			    /* Input structure used to 
 					       prepare this statement */
@@ -82,6 +127,7 @@ db_sqlite_handle_alloc (db_handle_t *db_handle)
 	bzero(dbsp, sizeof(*dbsp));
 
 	dbsp->dsh_db_handle = db_handle;
+	TAILQ_INIT(&dbsp->dsh_cache);
 
 	TAILQ_INSERT_TAIL(&db_sqlite_sessions, dbsp, dsh_link);
     }
@@ -132,17 +178,350 @@ db_sqlite_stmt_find (const char *name)
 }
 
 /*
- * Given sqlite driver handle, finalizes all the prepared statements
- * associated with it
+ * Adds a value to a list of values to be bound
  */
+static db_sqlite_bind_t *
+db_sqlite_bind_add (db_sqlite_binds_t *bp, int type)
+{
+    db_sqlite_bind_t *bindp;
+
+    if (bp->dsbs_count == bp->dsbs_max) {
+	unsigned max = bp->dsbs_max ? bp->dsbs_max * 2 : 8;
+
+	bindp = xmlRealloc(bp->dsbs_list, max * sizeof(*bindp));
+	if (bindp == NULL) {
+	    return NULL;
+	}
+
+	bp->dsbs_list = bindp;
+	bp->dsbs_max = max;
+    }
+
+    bindp = &bp->dsbs_list[bp->dsbs_count++];
+    bzero(bindp, sizeof(*bindp));
+    bindp->dsb_type = type;
+
+    return bindp;
+}
+
 static void
-db_sqlite_stmt_free_by_handle (db_sqlite_handle_t *dbsp)
+db_sqlite_bind_text (db_sqlite_binds_t *bp, const char *value)
 {
-    db_sqlite_stmt_t *dbssp;
-    
-    TAILQ_FOREACH(dbssp, &db_sqlite_stmts, dss_link) {
+    db_sqlite_bind_t *bindp;
+
+    bindp = db_sqlite_bind_add(bp, value ? SQLITE_TEXT : SQLITE_NULL);
+    if (bindp && value) {
+	bindp->dsb_text = xmlStrdup2(value);
+    }
+}
+
+static void
+db_sqlite_bind_int (db_sqlite_binds_t *bp, sqlite3_int64 value)
+{
+    db_sqlite_bind_t *bindp;
+
+    bindp = db_sqlite_bind_add(bp, SQLITE_INTEGER);
+    if (bindp) {
+	bindp->dsb_int = value;
+    }
+}
+
+/*
+ * Frees the values in a list of values
+ */
+static void
+db_sqlite_binds_clean (db_sqlite_binds_t *bp)
+{
+    unsigned i;
+
+    for (i = 0; i < bp->dsbs_count; i++) {
+	xmlFreeAndEasy(bp->dsbs_list[i].dsb_text);
+    }
+
+    xmlFreeAndEasy(bp->dsbs_list);
+    bzero(bp, sizeof(*bp));
+}
+
+/*
+ * Binds a list of values to the parameters of a statement, after
+ * clearing out whatever was there before
+ */
+static int
+db_sqlite_binds_apply (sqlite3_stmt *stmt, db_sqlite_binds_t *bp)
+{
+    db_sqlite_bind_t *bindp;
+    unsigned i;
+    int rc;
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    for (i = 0; i < bp->dsbs_count; i++) {
+	bindp = &bp->dsbs_list[i];
+
+	switch (bindp->dsb_type) {
+	case SQLITE_TEXT:
+	    rc = sqlite3_bind_text(stmt, i + 1, bindp->dsb_text, -1,
+				   SQLITE_STATIC);
+	    break;
+
+	case SQLITE_INTEGER:
+	    rc = sqlite3_bind_int64(stmt, i + 1, bindp->dsb_int);
+	    break;
+
+	case SQLITE_FLOAT:
+	    rc = sqlite3_bind_double(stmt, i + 1, bindp->dsb_real);
+	    break;
+
+	default:
+	    rc = sqlite3_bind_null(stmt, i + 1);
+	    break;
+	}
+
+	if (rc != SQLITE_OK) {
+	    return rc;
+	}
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+ * Frees a cached statement
+ */
+static void
+db_sqlite_cache_free (db_sqlite_cache_t *dscp)
+{
+    sqlite3_finalize(dscp->dsc_stmt);
+    xmlFree(dscp->dsc_sql);
+    xmlFree(dscp);
+}
+
+/*
+ * Drops the least recently used statements that no cursor is using,
+ * until the cache is back to its limit
+ */
+static void
+db_sqlite_cache_trim (db_sqlite_handle_t *dbsp)
+{
+    db_sqlite_cache_t *dscp, *prevp;
+
+    dscp = TAILQ_LAST(&dbsp->dsh_cache, db_sqlite_caches_s);
+    for ( ; dscp && dbsp->dsh_cache_count > DB_SQLITE_CACHE_MAX;
+	  dscp = prevp) {
+	prevp = TAILQ_PREV(dscp, db_sqlite_caches_s, dsc_link);
+	if (dscp->dsc_refs == 0) {
+	    TAILQ_REMOVE(&dbsp->dsh_cache, dscp, dsc_link);
+	    dbsp->dsh_cache_count -= 1;
+	    db_sqlite_cache_free(dscp);
+	}
+    }
+}
+
+/*
+ * Returns the cached statement for the given SQL, preparing it if it
+ * isn't in the cache.  The caller has a reference to the statement,
+ * and must give it back with db_sqlite_cache_release().
+ */
+static db_sqlite_cache_t *
+db_sqlite_cache_get (db_sqlite_handle_t *dbsp, const char *sql)
+{
+    db_sqlite_cache_t *dscp;
+    sqlite3_stmt *stmt;
+
+    TAILQ_FOREACH(dscp, &dbsp->dsh_cache, dsc_link) {
+	if (streq(dscp->dsc_sql, sql)) {
+	    /* Move it to the front of the list */
+	    TAILQ_REMOVE(&dbsp->dsh_cache, dscp, dsc_link);
+	    TAILQ_INSERT_HEAD(&dbsp->dsh_cache, dscp, dsc_link);
+	    dscp->dsc_refs += 1;
+	    return dscp;
+	}
+    }
+
+    slaxLog("db:sqlite: preparing - %s", sql);
+
+    if (sqlite3_prepare_v2(dbsp->dsh_sqlite_handle, sql, -1,
+			   &stmt, NULL) != SQLITE_OK) {
+	return NULL;
+    }
+
+    dscp = xmlMalloc(sizeof(*dscp));
+    if (dscp == NULL) {
+	sqlite3_finalize(stmt);
+	return NULL;
+    }
+
+    bzero(dscp, sizeof(*dscp));
+    dscp->dsc_sql = xmlStrdup2(sql);
+    dscp->dsc_stmt = stmt;
+    dscp->dsc_refs = 1;
+
+    TAILQ_INSERT_HEAD(&dbsp->dsh_cache, dscp, dsc_link);
+    dbsp->dsh_cache_count += 1;
+
+    if (dbsp->dsh_cache_count > DB_SQLITE_CACHE_MAX) {
+	db_sqlite_cache_trim(dbsp);
+    }
+
+    return dscp;
+}
+
+static void
+db_sqlite_cache_release (db_sqlite_cache_t *dscp)
+{
+    if (dscp && dscp->dsc_refs > 0) {
+	dscp->dsc_refs -= 1;
+    }
+}
+
+/*
+ * Runs a statement that returns no rows (insert, update or delete)
+ * with the given values.  If the cached statement is in the middle of
+ * a query for some cursor, we use a private copy, so we don't disturb
+ * it.
+ */
+static int
+db_sqlite_cache_run (db_sqlite_handle_t *dbsp, const char *sql,
+		     db_sqlite_binds_t *bp)
+{
+    db_sqlite_cache_t *dscp;
+    sqlite3_stmt *stmt = NULL;
+    int rc;
+
+    dscp = db_sqlite_cache_get(dbsp, sql);
+    if (dscp == NULL) {
+	return SQLITE_ERROR;
+    }
+
+    if (sqlite3_stmt_busy(dscp->dsc_stmt)) {
+	rc = sqlite3_prepare_v2(dbsp->dsh_sqlite_handle, sql, -1,
+				&stmt, NULL);
+	if (rc != SQLITE_OK) {
+	    db_sqlite_cache_release(dscp);
+	    return rc;
+	}
+    } else {
+	stmt = dscp->dsc_stmt;
+	dscp->dsc_owner = NULL;
+    }
+
+    rc = db_sqlite_binds_apply(stmt, bp);
+    if (rc == SQLITE_OK) {
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_DONE || rc == SQLITE_ROW) {
+	    rc = SQLITE_OK;
+	}
+    }
+
+    if (stmt == dscp->dsc_stmt) {
+	sqlite3_reset(stmt);
+    } else {
+	sqlite3_finalize(stmt);
+    }
+
+    db_sqlite_cache_release(dscp);
+    return rc;
+}
+
+/*
+ * Returns the statement a cursor should step, with the cursor's values
+ * bound.  If another cursor has been using the cached statement, we
+ * bind our values again, which restarts our query; if the other
+ * cursor is still in the middle of its query, we leave it alone and
+ * take a private copy of the statement.
+ */
+static sqlite3_stmt *
+db_sqlite_stmt_ready (db_sqlite_stmt_t *dbssp)
+{
+    db_sqlite_cache_t *dscp = dbssp->dss_cache;
+
+    if (dscp == NULL || dscp->dsc_owner == dbssp) {
+	return dbssp->dss_stmt ?: (dscp ? dscp->dsc_stmt : NULL);
+    }
+
+    if (sqlite3_stmt_busy(dscp->dsc_stmt)) {
+	if (sqlite3_prepare_v2(dbssp->dss_handle->dsh_sqlite_handle,
+			       dscp->dsc_sql, -1, &dbssp->dss_stmt,
+			       NULL) != SQLITE_OK) {
+	    return NULL;
+	}
+
+	db_sqlite_cache_release(dscp);
+	dbssp->dss_cache = NULL;
+	db_sqlite_binds_apply(dbssp->dss_stmt, &dbssp->dss_binds);
+	return dbssp->dss_stmt;
+    }
+
+    db_sqlite_binds_apply(dscp->dsc_stmt, &dbssp->dss_binds);
+    dscp->dsc_owner = dbssp;
+
+    return dscp->dsc_stmt;
+}
+
+/*
+ * Makes a cursor for the given SQL, using the cached statement for it.
+ * The values are bound when the cursor is first fetched from.
+ */
+static db_sqlite_stmt_t *
+db_sqlite_stmt_alloc (db_sqlite_handle_t *dbsp, db_input_t *in,
+		      const char *sql, db_sqlite_binds_t *bp)
+{
+    db_sqlite_stmt_t *stmtp;
+    db_input_t *inc;
+
+    stmtp = xmlMalloc(sizeof(*stmtp));
+    if (stmtp == NULL) {
+	return NULL;
+    }
+
+    bzero(stmtp, sizeof(*stmtp));
+
+    stmtp->dss_cache = db_sqlite_cache_get(dbsp, sql);
+    if (stmtp->dss_cache == NULL) {
+	xmlFree(stmtp);
+	return NULL;
+    }
+
+    /*
+     * Save a copy of input data for future use
+     */
+    inc = xmlMalloc(sizeof(*inc));
+    if (inc) {
+	db_input_copy(inc, in);
+    }
+
+    if (bp) {
+	stmtp->dss_binds = *bp;
+	bzero(bp, sizeof(*bp));
+    }
+
+    stmtp->dss_handle = dbsp;
+    stmtp->dss_in = inc;
+    snprintf(stmtp->dss_name, sizeof(stmtp->dss_name), "%u", seed++);
+
+    TAILQ_INSERT_TAIL(&db_sqlite_stmts, stmtp, dss_link);
+
+    return stmtp;
+}
+
+/*
+ * Given sqlite driver handle, frees all of its cursors
+ */
+static void
+db_sqlite_cursor_free_by_handle (db_sqlite_handle_t *dbsp)
+{
+    db_sqlite_stmt_t *dbssp, *nextp;
+
+    for (dbssp = TAILQ_FIRST(&db_sqlite_stmts); dbssp; dbssp = nextp) {
+	nextp = TAILQ_NEXT(dbssp, dss_link);
+
 	if (dbssp->dss_handle == dbsp) {
-	    sqlite3_finalize(dbssp->dss_stmt);
+	    if (dbssp->dss_stmt) {
+		sqlite3_finalize(dbssp->dss_stmt);
+	    }
+	    db_sqlite_cache_release(dbssp->dss_cache);
+	    db_sqlite_binds_clean(&dbssp->dss_binds);
 	    TAILQ_REMOVE(&db_sqlite_stmts, dbssp, dss_link);
 	    
 	    if (dbssp->dss_in) {
@@ -150,9 +529,92 @@ db_sqlite_stmt_free_by_handle (db_sqlite_handle_t *dbsp)
 	    }
 
 	    xmlFree(dbssp);
+	}
+    }
+}
+
+/*
+ * Given sqlite driver handle, finalizes all the prepared statements
+ * associated with it
+ */
+static void
+db_sqlite_stmt_free_by_handle (db_sqlite_handle_t *dbsp)
+{
+    db_sqlite_cache_t *dscp;
+
+    db_sqlite_cursor_free_by_handle(dbsp);
+
+    while ((dscp = TAILQ_FIRST(&dbsp->dsh_cache)) != NULL) {
+	TAILQ_REMOVE(&dbsp->dsh_cache, dscp, dsc_link);
+	db_sqlite_cache_free(dscp);
+    }
+    dbsp->dsh_cache_count = 0;
+}
+
+/*
+ * Appends the value of a condition.  Strings for like, match and
+ * regexp and plain numbers are bound as parameters, so the SQL text
+ * (and the cached statement) is the same whatever the value.  Anything
+ * else, like a list for "in" or a column name, is part of the SQL.
+ */
+static void
+db_sqlite_build_value (slax_printf_buffer_t *pb, db_sqlite_binds_t *bp,
+		       const char *operator, const char *value)
+{
+    db_sqlite_bind_t *bindp;
+    sqlite3_int64 ival;
+    double dval;
+    char *ep;
+
+    if (strlen(operator) > 2) {
+	db_sqlite_bind_text(bp, value);
+	slaxExtPrintAppend(pb, (const xmlChar *) "?", 1);
+	return;
+    }
+
+    if (*value) {
+	errno = 0;
+	ival = strtoll(value, &ep, 10);
+	if (*ep == '\0' && errno == 0) {
+	    db_sqlite_bind_int(bp, ival);
+	    slaxExtPrintAppend(pb, (const xmlChar *) "?", 1);
+	    return;
+	}
+
+	dval = strtod(value, &ep);
+	if (*ep == '\0' && errno == 0) {
+	    bindp = db_sqlite_bind_add(bp, SQLITE_FLOAT);
+	    if (bindp) {
+		bindp->dsb_real = dval;
+	    }
+	    slaxExtPrintAppend(pb, (const xmlChar *) "?", 1);
 	    return;
 	}
     }
+
+    slaxExtPrintAppend(pb, (const xmlChar *) value, strlen(value));
+}
+
+/*
+ * Appends limit and offset clauses
+ */
+static void
+db_sqlite_build_limit (slax_printf_buffer_t *pb, db_sqlite_binds_t *bp,
+		       db_input_t *in)
+{
+    if (in->di_limit) {
+	slaxExtPrintAppend(pb, (const xmlChar *) " LIMIT ?", 8);
+	db_sqlite_bind_int(bp, in->di_limit);
+    }
+
+    if (in->di_skip) {
+	/* sqlite wants a limit before an offset; -1 means no limit */
+	if (in->di_limit == 0) {
+	    slaxExtPrintAppend(pb, (const xmlChar *) " LIMIT -1", 9);
+	}
+	slaxExtPrintAppend(pb, (const xmlChar *) " OFFSET ?", 9);
+	db_sqlite_bind_int(bp, in->di_skip);
+    }
 }
 
 /*
@@ -160,7 +622,7 @@ db_sqlite_stmt_free_by_handle (db_sqlite_handle_t *dbsp)
  */
 static void
 db_sqlite_build_conditions (xmlNodePtr conditions, slax_printf_buffer_t *pb,
-			   const char *op)
+			    db_sqlite_binds_t *bp, const char *op)
 {
     xmlNodePtr cur, childp;
     const char *selector, *operator, *value, *key;
@@ -188,7 +650,8 @@ db_sqlite_build_conditions (xmlNodePtr conditions, slax_printf_buffer_t *pb,
 	     */
 	    if (streq(xmlNodeName(cur), "or") 
 		|| streq(xmlNodeName(cur), "and")) {
-		db_sqlite_build_conditions(cur->children, pb, xmlNodeName(cur));
+		db_sqlite_build_conditions(cur->children, pb, bp,
+					   xmlNodeName(cur));
 	    } else if (streq(xmlNodeName(cur), "condition")) {
 		childp = cur->children;
 		selector = NULL;
@@ -219,21 +682,7 @@ db_sqlite_build_conditions (xmlNodePtr conditions, slax_printf_buffer_t *pb,
 		slaxExtPrintAppend(pb, (const xmlChar *) operator, 
 				   strlen(operator));
 		slaxExtPrintAppend(pb, (const xmlChar *) " ", 1);
-
-		/*
-		 * Operator is mostly like, match, regexp and has to be
-		 * enclosed in quotes
-		 */
-		if (strlen(operator) > 2) {
-		    slaxExtPrintAppend(pb, (const xmlChar *) "\"", 1);
-		}
-
-		slaxExtPrintAppend(pb, (const xmlChar *) value, 
-				   strlen(value));
-
-		if (strlen(operator) > 2) {
-		    slaxExtPrintAppend(pb, (const xmlChar *) "\"", 1);
-		}
+		db_sqlite_build_value(pb, bp, operator, value);
 
 		/*
 		 * If we don't have an operator, we can process only one
@@ -258,14 +707,15 @@ db_sqlite_build_conditions (xmlNodePtr conditions, slax_printf_buffer_t *pb,
  * Given conditions node and print buffer, appends where clause
  */
 static void
-db_sqlite_build_where (xmlNodePtr conditions, slax_printf_buffer_t *pb)
+db_sqlite_build_where (xmlNodePtr conditions, slax_printf_buffer_t *pb,
+		       db_sqlite_binds_t *bp)
 {
     if (conditions && conditions->type == XML_ELEMENT_NODE 
 	&& conditions->children) {
 	slaxExtPrintAppend(pb, (const xmlChar *) " WHERE", 6);
 
 	/* Build and append conditions */
-	db_sqlite_build_conditions(conditions->children, pb, NULL);
+	db_sqlite_build_conditions(conditions->children, pb, bp, NULL);
     }
 }
 
@@ -316,75 +766,52 @@ db_sqlite_build_sort (xmlNodePtr sort, slax_printf_buffer_t *pb)
 }
 
 /*
- * Deletes rows filtered with given conditions
+ * Builds a statement that deletes rows filtered with given conditions
  */
-static slax_printf_buffer_t
-db_sqlite_build_delete (db_input_t *in)
+static void
+db_sqlite_build_delete (slax_printf_buffer_t *pbp, db_sqlite_binds_t *bp,
+			db_input_t *in)
 {
-    char buf[BUFSIZ];
-    slax_printf_buffer_t pb;
-    
-    bzero(&pb, sizeof(pb));
-
     if (in && in->di_collection) {
-	slaxExtPrintAppend(&pb, (const xmlChar *) "DELETE FROM ", 12);
-	slaxExtPrintAppend(&pb, (const xmlChar *) in->di_collection,
+	slaxExtPrintAppend(pbp, (const xmlChar *) "DELETE FROM ", 12);
+	slaxExtPrintAppend(pbp, (const xmlChar *) in->di_collection,
 			   strlen(in->di_collection));
 
 	/*
-	 * Add conditions to the update statement
+	 * Add conditions to the delete statement
 	 */
 	if (in->di_conditions) {
-	    db_sqlite_build_where(in->di_conditions, &pb);
+	    db_sqlite_build_where(in->di_conditions, pbp, bp);
 	}
 
 	/*
 	 * Take care of sorting if any
 	 */
 	if (in->di_sort) {
-	    db_sqlite_build_sort(in->di_sort, &pb);
-	}
-
-	/*
-	 * Handle limit
-	 */
-	if (in->di_limit) {
-	    snprintf(buf, sizeof(buf), " LIMIT %u", in->di_limit);
-	    slaxExtPrintAppend(&pb, (const xmlChar *) buf, strlen(buf));
+	    db_sqlite_build_sort(in->di_sort, pbp);
 	}
 
-	/*
-	 * Handle offset
-	 */
-	if (in->di_skip) {
-	    snprintf(buf, sizeof(buf), " OFFSET %u", in->di_skip);
-	    slaxExtPrintAppend(&pb, (const xmlChar *) buf, strlen(buf));
-	}
+	db_sqlite_build_limit(pbp, bp, in);
     }
-
-    return pb;
 }
 
 /*
- * Updates matching rows with given data
+ * Builds a statement that updates matching rows with given data
  */
-static slax_printf_buffer_t
-db_sqlite_build_update (db_input_t *in)
+static void
+db_sqlite_build_update (slax_printf_buffer_t *pbp, db_sqlite_binds_t *bp,
+			db_input_t *in)
 {
-    char buf[BUFSIZ];
-    slax_printf_buffer_t pb;
     xmlNodePtr cur;
     const char *key, *value;
     int count = 0;
     
-    bzero(&pb, sizeof(pb));
-
     if (in && in->di_collection && in->di_update 
 	&& in->di_update->type == XML_ELEMENT_NODE) {
-	slaxExtPrintAppend(&pb, (const xmlChar *) "UPDATE ", 7);
-	slaxExtPrintAppend(&pb, (const xmlChar *) in->di_collection,
+	slaxExtPrintAppend(pbp, (const xmlChar *) "UPDATE ", 7);
+	slaxExtPrintAppend(pbp, (const xmlChar *) in->di_collection,
 			   strlen(in->di_collection));
-	slaxExtPrintAppend(&pb, (const xmlChar *) " SET ", 5);
+	slaxExtPrintAppend(pbp, (const xmlChar *) " SET ", 5);
 
 	cur = in->di_update->children;
 	while (cur) {
@@ -401,17 +828,15 @@ db_sqlite_build_update (db_input_t *in)
 		value = xmlNodeValue(cur);
 
 		if (key && value) {
-		    slaxExtPrintAppend(&pb, (const xmlChar *) key, strlen(key));
-		    slaxExtPrintAppend(&pb, (const xmlChar *) " = \"", 4);
-		    slaxExtPrintAppend(&pb, (const xmlChar *) value, 
-				       strlen(value));
-		    slaxExtPrintAppend(&pb, (const xmlChar *) "\"", 1);
+		    slaxExtPrintAppend(pbp, (const xmlChar *) key, strlen(key));
+		    slaxExtPrintAppend(pbp, (const xmlChar *) " = ?", 4);
+		    db_sqlite_bind_text(bp, value);
 		}
 		count--;
 	    }
 
 	    if (count > 0) {
-		slaxExtPrintAppend(&pb, (const xmlChar *) ", ", 2);
+		slaxExtPrintAppend(pbp, (const xmlChar *) ", ", 2);
 	    }
 
 	    cur = cur->next;
@@ -421,136 +846,66 @@ db_sqlite_build_update (db_input_t *in)
 	 * Add conditions to the update statement
 	 */
 	if (in->di_conditions) {
-	    db_sqlite_build_where(in->di_conditions, &pb);
+	    db_sqlite_build_where(in->di_conditions, pbp, bp);
 	}
 
 	/*
 	 * Take care of sorting if any
 	 */
 	if (in->di_sort) {
-	    db_sqlite_build_sort(in->di_sort, &pb);
-	}
-
-	/*
-	 * Handle limit
-	 */
-	if (in->di_limit) {
-	    snprintf(buf, sizeof(buf), " LIMIT %u", in->di_limit);
-	    slaxExtPrintAppend(&pb, (const xmlChar *) buf, strlen(buf));
+	    db_sqlite_build_sort(in->di_sort, pbp);
 	}
 
-	/*
-	 * Handle offset
-	 */
-	if (in->di_skip) {
-	    snprintf(buf, sizeof(buf), " OFFSET %u", in->di_skip);
-	    slaxExtPrintAppend(&pb, (const xmlChar *) buf, strlen(buf));
-	}
+	db_sqlite_build_limit(pbp, bp, in);
     }
-
-    return pb;
 }
 
 /*
- * Builds and returns sqlite3 insert statement
+ * Builds a statement that inserts one instance into the collection.
+ * Instances with the same fields give the same statement, so the
+ * prepared statement is reused for each of them.
  */
-static slax_printf_buffer_t
-db_sqlite_build_insert (db_input_t *in)
+static void
+db_sqlite_build_insert (slax_printf_buffer_t *pbp, db_sqlite_binds_t *bp,
+			const char *collection, xmlNodePtr instance)
 {
-    xmlNodePtr cur, childp;
-    slax_printf_buffer_t pb;
+    xmlNodePtr childp;
     int count = 0, i;
-    const char *value, *key;
-
-    bzero(&pb, sizeof(pb));
-
-    if (in && in->di_collection) {
-	slaxExtPrintAppend(&pb, (const xmlChar *) "BEGIN TRANSACTION;", 18);
-
-	if (in->di_instance || in->di_instances) {
-	    if (in->di_instance && in->di_instance->type == XML_ELEMENT_NODE) {
-		cur = in->di_instance;
-	    } else {
-		cur = in->di_instances->children;
-	    }
-
-	    while (cur) {
-		/*
-		 * Extract instance values and build insert statements
-		 */
-		if (cur->type == XML_ELEMENT_NODE) {
-		    slaxExtPrintAppend(&pb, (const xmlChar *) " INSERT INTO ", 
-				       13);
-		    slaxExtPrintAppend(&pb, (const xmlChar *) in->di_collection,
-				       strlen(in->di_collection));
-		    slaxExtPrintAppend(&pb, (const xmlChar *) " (", 2);
-		    childp = cur->children;
-		    count = 0;
-		    while (childp) {
-			if (childp->type == XML_ELEMENT_NODE) count++;
-			childp = childp->next;
-		    }
+    const char *key;
 
-		    /*
-		     * Get all column names
-		     */
-		    childp = cur->children;
-		    i = count;
-		    while (childp) {
-			if (childp->type == XML_ELEMENT_NODE) {
-			    key = xmlNodeName(childp);
-			    i--;
+    slaxExtPrintAppend(pbp, (const xmlChar *) "INSERT INTO ", 12);
+    slaxExtPrintAppend(pbp, (const xmlChar *) collection, strlen(collection));
+    slaxExtPrintAppend(pbp, (const xmlChar *) " (", 2);
 
-			    slaxExtPrintAppend(&pb, (const xmlChar *) key,
-					       strlen(key));
-
-			    if (i > 0) {
-				slaxExtPrintAppend(&pb, 
-						   (const xmlChar *) ", ", 2);
-			    } else {
-				slaxExtPrintAppend(&pb, 
-					(const xmlChar *) ") VALUES (", 10);
-			    }
-			}
-			childp = childp->next;
-		    }
+    for (childp = instance->children; childp; childp = childp->next) {
+	if (childp->type == XML_ELEMENT_NODE)
+	    count++;
+    }
 
-		    /*
-		     * Get values assigned to each of these columns
-		     */
-		    childp = cur->children;
-		    i = count;
-		    while (childp) {
-			if (childp->type == XML_ELEMENT_NODE) {
-			    value = xmlNodeValue(childp);
-			    i--;
-			    if (value) {
-				slaxExtPrintAppend(&pb, 
-						   (const xmlChar *) "\"", 1);
-				slaxExtPrintAppend(&pb, (const xmlChar *) value,
-						   strlen(value));
-				slaxExtPrintAppend(&pb, 
-						   (const xmlChar *) "\"", 1);
-			    }
+    /*
+     * Get all column names, and the values assigned to them
+     */
+    i = count;
+    for (childp = instance->children; childp; childp = childp->next) {
+	if (childp->type == XML_ELEMENT_NODE) {
+	    key = xmlNodeName(childp);
+	    i--;
 
-			    if (i > 0) {
-				slaxExtPrintAppend(&pb, 
-						   (const xmlChar *) ", ", 2);
-			    } else {
-				slaxExtPrintAppend(&pb, 
-						   (const xmlChar *) ");", 2);
-			    }
-			}
-			childp = childp->next;
-		    }
-		}
-		cur = cur->next;
+	    slaxExtPrintAppend(pbp, (const xmlChar *) key, strlen(key));
+	    db_sqlite_bind_text(bp, xmlNodeValue(childp));
+
+	    if (i > 0) {
+		slaxExtPrintAppend(pbp, (const xmlChar *) ", ", 2);
 	    }
 	}
-	slaxExtPrintAppend(&pb, (const xmlChar *) " COMMIT TRANSACTION;", 20);
     }
 
-    return pb;
+    slaxExtPrintAppend(pbp, (const xmlChar *) ") VALUES (", 10);
+    for (i = 0; i < count; i++) {
+	slaxExtPrintAppend(pbp, (const xmlChar *) (i ? ", ?" : "?"),
+			   i ? 3 : 1);
+    }
+    slaxExtPrintAppend(pbp, (const xmlChar *) ")", 1);
 }
 
 /*
@@ -690,9 +1045,9 @@ db_sqlite_build_create (db_input_t *in)
  * Given input structure, forms and returns select statement
  */
 static void
-db_sqlite_build_select (slax_printf_buffer_t *pbp, db_input_t *in)
+db_sqlite_build_select (slax_printf_buffer_t *pbp, db_sqlite_binds_t *bp,
+			db_input_t *in)
 {
-    char buf[BUFSIZ];
     xmlNodePtr cur;
 
     if (in && in->di_collection) {
@@ -734,7 +1089,7 @@ db_sqlite_build_select (slax_printf_buffer_t *pbp, db_input_t *in)
 	 * Add conditions if any
 	 */
 	if (in->di_conditions) {
-	    db_sqlite_build_where(in->di_conditions, pbp);
+	    db_sqlite_build_where(in->di_conditions, pbp, bp);
 	}
 
 	/*
@@ -745,21 +1100,93 @@ db_sqlite_build_select (slax_printf_buffer_t *pbp, db_input_t *in)
 	}
 
 	/*
-	 * Limit the number of results
+	 * Limit the number of results, and skip over some of them
 	 */
-	if (in->di_limit) {
-	    snprintf(buf, sizeof(buf), " LIMIT %u", in->di_limit);
-	    slaxExtPrintAppend(pbp, (const xmlChar *) buf, strlen(buf));
+	db_sqlite_build_limit(pbp, bp, in);
+    }
+}
+
+/*
+ * Inserts one instance, using the cached statement for its fields
+ */
+static int
+db_sqlite_insert_one (db_sqlite_handle_t *dbsp, const char *collection,
+		      xmlNodePtr instance)
+{
+    slax_printf_buffer_t pb;
+    db_sqlite_binds_t binds;
+    int rc = SQLITE_OK;
+
+    bzero(&pb, sizeof(pb));
+    bzero(&binds, sizeof(binds));
+
+    db_sqlite_build_insert(&pb, &binds, collection, instance);
+    if (pb.pb_buf) {
+	rc = db_sqlite_cache_run(dbsp, pb.pb_buf, &binds);
+	xmlFree(pb.pb_buf);
+    }
+
+    db_sqlite_binds_clean(&binds);
+    return rc;
+}
+
+/*
+ * Ends the transaction around a set of inserts, committing it if they
+ * all worked and rolling it back if not.  The error message is saved
+ * in "out" before the rollback replaces it.
+ */
+static int
+db_sqlite_insert_end (db_sqlite_handle_t *dbsp, int rc,
+		      slax_printf_buffer_t *out)
+{
+    const char *error;
+
+    if (rc == SQLITE_OK) {
+	rc = sqlite3_exec(dbsp->dsh_sqlite_handle, "COMMIT TRANSACTION",
+			  0, 0, 0);
+	if (rc == SQLITE_OK) {
+	    return rc;
 	}
+    }
 
-	/*
-	 * Skip over result set
-	 */
-	if (in->di_skip) {
-	    snprintf(buf, sizeof(buf), " OFFSET %u", in->di_skip);
-	    slaxExtPrintAppend(pbp, (const xmlChar *) buf, strlen(buf));
+    error = sqlite3_errmsg(dbsp->dsh_sqlite_handle);
+    if (error) {
+	slaxExtPrintAppend(out, (const xmlChar *) error, strlen(error));
+    }
+
+    sqlite3_exec(dbsp->dsh_sqlite_handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+    return rc;
+}
+
+/*
+ * Inserts each instance with its own (cached) statement, all inside
+ * one transaction
+ */
+static int
+db_sqlite_insert_all (db_sqlite_handle_t *dbsp, db_input_t *in,
+		      slax_printf_buffer_t *out)
+{
+    xmlNodePtr cur = NULL;
+    int rc;
+
+    if (in->di_instance && in->di_instance->type == XML_ELEMENT_NODE) {
+	cur = in->di_instance;
+    } else if (in->di_instances) {
+	cur = in->di_instances->children;
+    }
+
+    rc = sqlite3_exec(dbsp->dsh_sqlite_handle, "BEGIN TRANSACTION", 0, 0, 0);
+    if (rc != SQLITE_OK) {
+	return db_sqlite_insert_end(dbsp, rc, out);
+    }
+
+    for ( ; cur && rc == SQLITE_OK; cur = cur->next) {
+	if (cur->type == XML_ELEMENT_NODE) {
+	    rc = db_sqlite_insert_one(dbsp, in->di_collection, cur);
 	}
     }
+
+    return db_sqlite_insert_end(dbsp, rc, out);
 }
 
 /*
@@ -773,33 +1200,52 @@ db_sqlite_operate (db_handle_t *db_handle, db_input_t *in,
 {
     db_sqlite_handle_t *dbsp;
     slax_printf_buffer_t pb;
-    int rc;
+    db_sqlite_binds_t binds;
+    int rc = SQLITE_OK, built = 0;
     const char *error = NULL;
 
     bzero(&pb, sizeof(pb));
+    bzero(&binds, sizeof(binds));
 
     if (db_handle) {
     	dbsp = db_sqlite_handle_find(db_handle->dh_name);
 
 	if (dbsp) {
 	    if (in && in->di_collection) {
+		/*
+		 * Create can't use parameters, so it's run as is; the
+		 * others are built with parameters and run from the
+		 * statement cache
+		 */
 		if (streq(operation, "create")) {
 		    pb = db_sqlite_build_create(in);
+		    if (pb.pb_buf) {
+			slaxLog("db:sqlite: running - %s", pb.pb_buf);
+			rc = sqlite3_exec(dbsp->dsh_sqlite_handle,
+					  pb.pb_buf, 0, 0, 0);
+			built = 1;
+		    }
 		} else if (streq(operation, "insert")) {
-		    pb = db_sqlite_build_insert(in);
-		} else if (streq(operation, "delete")) {
-		    pb = db_sqlite_build_delete(in);
-		} else if (streq(operation, "update")) {
-		    pb = db_sqlite_build_update(in);
-		}
+		    /* Errors are reported before the rollback */
+		    rc = db_sqlite_insert_all(dbsp, in, out);
+		    return (rc == SQLITE_OK) ? DB_OK : DB_ERROR;
+		} else {
+		    if (streq(operation, "delete")) {
+			db_sqlite_build_delete(&pb, &binds, in);
+		    } else if (streq(operation, "update")) {
+			db_sqlite_build_update(&pb, &binds, in);
+		    }
 
-		if (pb.pb_buf) {
-		    slaxLog("db:sqlite: preparing - %s", pb.pb_buf);
-		    rc = sqlite3_exec(dbsp->dsh_sqlite_handle, 
-				      pb.pb_buf, 0, 0, 0);
+		    if (pb.pb_buf) {
+			rc = db_sqlite_cache_run(dbsp, pb.pb_buf, &binds);
+			built = 1;
+		    }
+		}
 
-		    xmlFree(pb.pb_buf);
+		xmlFreeAndEasy(pb.pb_buf);
+		db_sqlite_binds_clean(&binds);
 
+		if (built) {
 		    if (rc == SQLITE_OK) {
 			return DB_OK;
 		    } else {
@@ -818,11 +1264,87 @@ db_sqlite_operate (db_handle_t *db_handle, db_input_t *in,
 	}
     }
 
-    if (pb.pb_buf) {
-	xmlFree(pb.pb_buf);
+    return DB_FAIL;
+}
+
+/*
+ * Is the value one of a NULL-terminated list of choices?
+ */
+static int
+db_sqlite_choice (const char *value, const char **choices)
+{
+    for ( ; *choices; choices++) {
+	if (strcasecmp(value, *choices) == 0) {
+	    return TRUE;
+	}
     }
 
-    return DB_FAIL;
+    return FALSE;
+}
+
+/*
+ * Applies the tuning options given in <access>: journal-mode,
+ * synchronous and cache-size.  Values are checked against what each
+ * pragma accepts, since pragmas can't take bound parameters.
+ */
+static void
+db_sqlite_tune (db_sqlite_handle_t *dbsp, xmlNodePtr access)
+{
+    static const char *journal_modes[] = {
+	"delete", "truncate", "persist", "memory", "wal", "off", NULL
+    };
+    static const char *sync_modes[] = {
+	"off", "normal", "full", "extra", "0", "1", "2", "3", NULL
+    };
+    const char *key, *value, *pragma;
+    xmlNodePtr cur;
+    char buf[BUFSIZ];
+    char *ep;
+
+    for (cur = access ? access->children : NULL; cur; cur = cur->next) {
+	if (cur->type != XML_ELEMENT_NODE) {
+	    continue;
+	}
+
+	key = xmlNodeName(cur);
+	value = xmlNodeValue(cur);
+	if (key == NULL || value == NULL) {
+	    continue;
+	}
+
+	if (streq(key, "journal-mode")) {
+	    pragma = "journal_mode";
+	    if (!db_sqlite_choice(value, journal_modes)) {
+		pragma = NULL;
+	    }
+	} else if (streq(key, "synchronous")) {
+	    pragma = "synchronous";
+	    if (!db_sqlite_choice(value, sync_modes)) {
+		pragma = NULL;
+	    }
+	} else if (streq(key, "cache-size")) {
+	    pragma = "cache_size";
+	    strtol(value, &ep, 10);
+	    if (*value == '\0' || *ep != '\0') {
+		pragma = NULL;
+	    }
+	} else {
+	    continue;
+	}
+
+	if (pragma == NULL) {
+	    slaxLog("sqlite:open: invalid value for %s: '%s'", key, value);
+	    continue;
+	}
+
+	snprintf(buf, sizeof(buf), "PRAGMA %s = %s", pragma, value);
+	slaxLog("db:sqlite: running - %s", buf);
+
+	if (sqlite3_exec(dbsp->dsh_sqlite_handle, buf, 0, 0, 0) != SQLITE_OK) {
+	    slaxLog("sqlite:open: %s failed - %s", buf,
+		    sqlite3_errmsg(dbsp->dsh_sqlite_handle));
+	}
+    }
 }
 
 DB_DRIVER_OPEN (db_sqlite_open)
@@ -868,6 +1390,8 @@ DB_DRIVER_OPEN (db_sqlite_open)
 		    }
 		}
 #endif
+		/* The key has to come first, before anything is read */
+		db_sqlite_tune(dbsp, in->di_access);
 		return DB_OK;
 	    } else {
 		slaxLog("sqlite:open: db handle creation failed - %s",
@@ -889,6 +1413,51 @@ DB_DRIVER_INSERT (db_sqlite_insert)
     return db_sqlite_operate(db_handle, in, ctxt, nargs, out, "insert");
 }
 
+/*
+ * Inserts a node-set of rows in a single transaction.  Rows with the
+ * same fields share one prepared statement, so a bulk load is one
+ * prepare and one commit.  A node that isn't an element (such as the
+ * root of a result tree fragment) stands for its child elements.
+ */
+DB_DRIVER_INSERT_MANY (db_sqlite_insert_many)
+{
+    db_sqlite_handle_t *dbsp;
+    xmlNodePtr nodep, cur;
+    int rc, i;
+
+    if (db_handle == NULL || in == NULL || in->di_collection == NULL) {
+	slaxExtPrintAppend(out, (const xmlChar *) "invalid input", 13);
+	return DB_FAIL;
+    }
+
+    dbsp = db_sqlite_handle_find(db_handle->dh_name);
+    if (dbsp == NULL) {
+	slaxExtPrintAppend(out, (const xmlChar *) "invalid handle", 14);
+	return DB_FAIL;
+    }
+
+    rc = sqlite3_exec(dbsp->dsh_sqlite_handle, "BEGIN TRANSACTION", 0, 0, 0);
+
+    for (i = 0; rows && i < rows->nodeNr && rc == SQLITE_OK; i++) {
+	nodep = rows->nodeTab[i];
+
+	if (nodep->type == XML_ELEMENT_NODE) {
+	    rc = db_sqlite_insert_one(dbsp, in->di_collection, nodep);
+	    continue;
+	}
+
+	for (cur = nodep->children; cur && rc == SQLITE_OK; cur = cur->next) {
+	    if (cur->type == XML_ELEMENT_NODE) {
+		rc = db_sqlite_insert_one(dbsp, in->di_collection, cur);
+	    }
+	}
+    }
+
+    rc = db_sqlite_insert_end(dbsp, rc, out);
+
+    return (rc == SQLITE_OK) ? DB_OK : DB_ERROR;
+}
+
 DB_DRIVER_DELETE (db_sqlite_delete)
 {
     return db_sqlite_operate(db_handle, in, ctxt, nargs, out, "delete");
@@ -900,16 +1469,13 @@ DB_DRIVER_UPDATE (db_sqlite_update)
 }
 
 /*
- * Steps through given cursor, appends rows if any to buffer and returns
- * result code
+ * Binds the values in input (from db:fetch) to the named parameters of
+ * a statement, restarting it
  */
 static int
-db_sqlite_step (sqlite3_stmt *stmt, slax_printf_buffer_t *out, 
-		xmlXPathObjectPtr input)
+db_sqlite_bind_input (sqlite3_stmt *stmt, xmlXPathObjectPtr input)
 {
-    int rc, cols, i, idx;
-    const char *colName;
-    unsigned const char *colVal;
+    int rc, idx;
     char buf[BUFSIZ];
     xmlNodeSetPtr nodeset;
     xmlNodePtr nop;
@@ -976,6 +1542,27 @@ db_sqlite_step (sqlite3_stmt *stmt, slax_printf_buffer_t *out,
 	}
     }
 
+    return SQLITE_OK;
+}
+
+/*
+ * Steps through given cursor, appends rows if any to buffer and returns
+ * result code
+ */
+static int
+db_sqlite_step (sqlite3_stmt *stmt, slax_printf_buffer_t *out, 
+		xmlXPathObjectPtr input)
+{
+    int rc, cols, i;
+    const char *colName;
+    unsigned const char *colVal;
+    char buf[BUFSIZ];
+
+    rc = db_sqlite_bind_input(stmt, input);
+    if (rc != SQLITE_OK) {
+	return rc;
+    }
+
     /*
      * Execute the statement
      */
@@ -1012,9 +1599,12 @@ db_sqlite_step (sqlite3_stmt *stmt, slax_printf_buffer_t *out,
 DB_DRIVER_FIND (db_sqlite_find)
 {
     db_sqlite_handle_t *dbsp;
+    db_sqlite_stmt_t *stmtp;
     slax_printf_buffer_t pb;
+    db_sqlite_binds_t binds;
 
     bzero(&pb, sizeof(pb));
+    bzero(&binds, sizeof(binds));
 
     if (db_handle) {
     	dbsp = db_sqlite_handle_find(db_handle->dh_name);
@@ -1022,60 +1612,34 @@ DB_DRIVER_FIND (db_sqlite_find)
 	if (dbsp) {
 	    if (in && in->di_collection) {
 		/*
-		 * Build, prepare sqlite statement and return sqlite cursor
-		 * identifier
+		 * Build sqlite statement and return a cursor for it; the
+		 * values are bound on the first fetch
 		 */
-		db_sqlite_build_select(&pb, in);
+		db_sqlite_build_select(&pb, &binds, in);
 		if (pb.pb_buf) {
-		    db_sqlite_stmt_t *stmtp = xmlMalloc(sizeof(*stmtp));
-		    int rc;
+		    stmtp = db_sqlite_stmt_alloc(dbsp, in, pb.pb_buf, &binds);
 
-		    slaxLog("db:sqlite: preparing - %s", pb.pb_buf);
+		    xmlFree(pb.pb_buf);
+		    db_sqlite_binds_clean(&binds);
 
 		    if (stmtp) {
-			bzero(stmtp, sizeof(*stmtp));
-
-			rc = sqlite3_prepare_v2(dbsp->dsh_sqlite_handle,
-						pb.pb_buf, -1, 
-						&stmtp->dss_stmt, NULL);
-
-			xmlFree(pb.pb_buf);
-
-			if (rc == SQLITE_OK) {
-			    /*
-			     * Save a copy of input data for future use
-			     */
-			    db_input_t *inc;
-			    inc = xmlMalloc(sizeof(*inc));
-			    db_input_copy(inc, in);
-
-			    stmtp->dss_handle = dbsp;
-			    stmtp->dss_in = inc;
-			    snprintf(stmtp->dss_name, sizeof(stmtp->dss_name), 
-				     "%u", seed++);
-
-			    TAILQ_INSERT_TAIL(&db_sqlite_stmts, stmtp, dss_link);
-			    slaxExtPrintAppend(out, (const xmlChar *)stmtp->dss_name,
-					       strlen(stmtp->dss_name));
-			    return DB_DATA;
-			} else {
-			    const char *errstr =
-				sqlite3_errmsg(dbsp->dsh_sqlite_handle);
-			    slaxExtPrintAppend(out, (const xmlChar *) errstr,
-				    strlen(errstr));
-			    return DB_ERROR;
-			}
+			slaxExtPrintAppend(out, (const xmlChar *)stmtp->dss_name,
+					   strlen(stmtp->dss_name));
+			return DB_DATA;
+		    } else {
+			const char *errstr =
+			    sqlite3_errmsg(dbsp->dsh_sqlite_handle);
+			slaxExtPrintAppend(out, (const xmlChar *) errstr,
+				strlen(errstr));
+			return DB_ERROR;
 		    }
 		}
-	    } else {
 	    }
-	} else {
 	}
     }
     
-    if (pb.pb_buf) {
-	xmlFree(pb.pb_buf);
-    }
+    xmlFreeAndEasy(pb.pb_buf);
+    db_sqlite_binds_clean(&binds);
 
     return DB_FAIL;
 }
@@ -1091,7 +1655,9 @@ DB_DRIVER_FETCH (db_sqlite_fetch)
     if (name && *name) {
 	stmtp = db_sqlite_stmt_find(name);
 	if (stmtp) {
-	    rc = db_sqlite_step(stmtp->dss_stmt, out, in);
+	    sqlite3_stmt *stmt = db_sqlite_stmt_ready(stmtp);
+
+	    rc = stmt ? db_sqlite_step(stmt, out, in) : SQLITE_ERROR;
 	    if (rc == SQLITE_ROW) {
 		return DB_DATA;
 	    } else if (rc == SQLITE_OK) {
@@ -1115,13 +1681,91 @@ DB_DRIVER_FETCH (db_sqlite_fetch)
     return DB_FAIL;
 }
 
+/*
+ * Steps through given cursor for up to "count" rows, building an
+ * <instance> under parent for each, straight from the column values
+ */
+DB_DRIVER_FETCH_ROWS (db_sqlite_fetch_rows)
+{
+    db_sqlite_stmt_t *stmtp;
+    sqlite3_stmt *stmt;
+    xmlNodePtr instp, colp;
+    const char *colName;
+    const xmlChar *colVal;
+    unsigned got;
+    int rc, cols, i;
+
+    if (name == NULL || *name == '\0') {
+	return DB_FAIL;
+    }
+
+    stmtp = db_sqlite_stmt_find(name);
+    if (stmtp == NULL) {
+	slaxLog("db:sqlite:fetch: invalid statement id");
+	return DB_FAIL;
+    }
+
+    stmt = db_sqlite_stmt_ready(stmtp);
+    rc = stmt ? db_sqlite_bind_input(stmt, in) : SQLITE_ERROR;
+
+    for (got = 0; rc == SQLITE_OK && got < count; got++) {
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW) {
+	    break;
+	}
+
+	instp = xmlNewDocNode(parent->doc, NULL,
+			      (const xmlChar *) "instance", NULL);
+	if (instp == NULL) {
+	    rc = SQLITE_NOMEM;
+	    break;
+	}
+	xmlAddChild(parent, instp);
+
+	cols = sqlite3_column_count(stmt);
+	for (i = 0; i < cols; i++) {
+	    colName = sqlite3_column_name(stmt, i);
+	    if (colName == NULL) {
+		continue;
+	    }
+
+	    /* A raw node takes the value as text, not as markup */
+	    colVal = sqlite3_column_text(stmt, i);
+	    colp = xmlNewDocRawNode(parent->doc, NULL,
+				    (const xmlChar *) colName, colVal);
+	    if (colp) {
+		xmlAddChild(instp, colp);
+	    }
+	}
+
+	rc = SQLITE_OK;
+    }
+
+    if (rc == SQLITE_OK) {
+	return DB_DATA;
+    } else if (rc == SQLITE_DONE) {
+	return DB_DONE;
+    } else {
+	const char *errstr =
+	    sqlite3_errmsg(stmtp->dss_handle->dsh_sqlite_handle);
+	slaxLog("db:sqlite:fetch: Unexpected return status - %s", errstr);
+	slaxExtPrintAppend(out, (const xmlChar *) errstr, strlen(errstr));
+	return DB_ERROR;
+    }
+}
+
 DB_DRIVER_FIND_FETCH (db_sqlite_find_fetch)
 {
     db_sqlite_handle_t *dbsp;
+    db_sqlite_stmt_t *stmtp;
+    sqlite3_stmt *stmt;
     slax_printf_buffer_t pb;
+    db_sqlite_binds_t binds;
     char buf[BUFSIZ];
+    int rc = SQLITE_DONE;
 
     bzero(&pb, sizeof(pb));
+    bzero(&binds, sizeof(binds));
 
     if (db_handle) {
     	dbsp = db_sqlite_handle_find(db_handle->dh_name);
@@ -1129,88 +1773,67 @@ DB_DRIVER_FIND_FETCH (db_sqlite_find_fetch)
 	if (dbsp) {
 	    if (in && in->di_collection) {
 		/*
-		 * Build, prepare sqlite statement and return sqlite cursor
+		 * Build sqlite statement and return sqlite cursor
 		 * identifier
 		 */
-		db_sqlite_build_select(&pb, in);
+		db_sqlite_build_select(&pb, &binds, in);
 		if (pb.pb_buf) {
-		    db_sqlite_stmt_t *stmtp = xmlMalloc(sizeof(*stmtp));
-		    int rc;
+		    stmtp = db_sqlite_stmt_alloc(dbsp, in, pb.pb_buf, &binds);
 
-		    slaxLog("db:sqlite: preparing - %s", pb.pb_buf);
+		    xmlFree(pb.pb_buf);
+		    db_sqlite_binds_clean(&binds);
 
-		    if (stmtp) {
-			bzero(stmtp, sizeof(*stmtp));
+		    stmt = stmtp ? db_sqlite_stmt_ready(stmtp) : NULL;
+		    if (stmt) {
+			/*
+			 * Emit cursor if it needs used in further
+			 * fetches. Also wraps the content in output tags
+			 */
+			snprintf(buf, sizeof(buf), 
+				 "<output><cursor>%s%s</cursor>",
+				 stmtp->dss_handle->dsh_db_handle->dh_name,
+				 stmtp->dss_name);
+			slaxExtPrintAppend(out, (const xmlChar *) buf, 
+					   strlen(buf));
 
-			rc = sqlite3_prepare_v2(dbsp->dsh_sqlite_handle,
-						pb.pb_buf, -1, 
-						&stmtp->dss_stmt, NULL);
+			/*
+			 * Fetch all the available rows
+			 */
+			do {
+			    if (stmtp->dss_in->di_buf.pb_buf == NULL) {
+				rc = db_sqlite_step(stmt, out, NULL);
+			    }
+			} while (rc == SQLITE_ROW);
 
-			xmlFree(pb.pb_buf);
+			slaxExtPrintAppend(out, 
+					   (const xmlChar *) "</output>", 
+					   9);
 
 			if (rc == SQLITE_OK) {
-			    db_input_t *inc;
-			    inc = xmlMalloc(sizeof(*inc));
-			    db_input_copy(inc, in);
-
-			    stmtp->dss_handle = dbsp;
-			    stmtp->dss_in = inc;
-			    snprintf(stmtp->dss_name, sizeof(stmtp->dss_name), 
-				     "%u", seed++);
-
-			    TAILQ_INSERT_TAIL(&db_sqlite_stmts, stmtp, dss_link);
-			    /*
-			     * Emit cursor if it needs used in further
-			     * fetches. Also wraps the content in output tags
-			     */
-			    snprintf(buf, sizeof(buf), 
-				     "<output><cursor>%s%s</cursor>",
-				     stmtp->dss_handle->dsh_db_handle->dh_name,
-				     stmtp->dss_name);
-			    slaxExtPrintAppend(out, (const xmlChar *) buf, 
-					       strlen(buf));
-
-			    /*
-			     * Fetch all the available rows
-			     */
-			    do {
-				if (stmtp->dss_in->di_buf.pb_buf == NULL) {
-				    rc = db_sqlite_step(stmtp->dss_stmt, out,
-							NULL);
-				}
-			    } while (rc == SQLITE_ROW);
-
-			    slaxExtPrintAppend(out, 
-					       (const xmlChar *) "</output>", 
-					       9);
-
-			    if (rc == SQLITE_OK) {
-				return DB_OK;
-			    } else if (rc == SQLITE_DONE) {
-				return DB_DATA;
-			    } else {
-				const char *errstr =
-				    sqlite3_errmsg(dbsp->dsh_sqlite_handle);
-				slaxExtPrintAppend(out, (const xmlChar *)
-					errstr, strlen(errstr));
-				return DB_ERROR;
-			    }
+			    return DB_OK;
+			} else if (rc == SQLITE_DONE) {
+			    return DB_DATA;
 			} else {
 			    const char *errstr =
 				sqlite3_errmsg(dbsp->dsh_sqlite_handle);
-			    slaxExtPrintAppend(out, (const xmlChar *) errstr,
-				    strlen(errstr));
+			    slaxExtPrintAppend(out, (const xmlChar *)
+				    errstr, strlen(errstr));
 			    return DB_ERROR;
 			}
+		    } else {
+			const char *errstr =
+			    sqlite3_errmsg(dbsp->dsh_sqlite_handle);
+			slaxExtPrintAppend(out, (const xmlChar *) errstr,
+				strlen(errstr));
+			return DB_ERROR;
 		    }
 		}
 	    }
 	}
     }
 
-    if (pb.pb_buf) {
-	xmlFree(pb.pb_buf);
-    }
+    xmlFreeAndEasy(pb.pb_buf);
+    db_sqlite_binds_clean(&binds);
 
     return DB_FAIL;
 }
@@ -1218,58 +1841,31 @@ DB_DRIVER_FIND_FETCH (db_sqlite_find_fetch)
 DB_DRIVER_QUERY (db_sqlite_query)
 {
     db_sqlite_handle_t *dbsp;
-    slax_printf_buffer_t pb;
-
-    bzero(&pb, sizeof(pb));
+    db_sqlite_stmt_t *stmtp;
 
     if (db_handle) {
     	dbsp = db_sqlite_handle_find(db_handle->dh_name);
 
 	if (dbsp) {
-	    if (in && in->di_buf.pb_buf) {
+	    if (in && in->di_buf.pb_buf && *in->di_buf.pb_buf) {
 		/*
-		 * prepare query statement and return sqlite cursor
-		 * identifier
+		 * Return a cursor for the query statement; its
+		 * parameters are bound by each fetch
 		 */
-		if (*in->di_buf.pb_buf) {
-		    db_sqlite_stmt_t *stmtp = xmlMalloc(sizeof(*stmtp));
-		    int rc;
-
-		    slaxLog("db:sqlite: preparing - %s", in->di_buf.pb_buf);
-
-		    if (stmtp) {
-			bzero(stmtp, sizeof(*stmtp));
-
-			rc = sqlite3_prepare_v2(dbsp->dsh_sqlite_handle,
-						in->di_buf.pb_buf, -1, 
-						&stmtp->dss_stmt, NULL);
-			if (rc == SQLITE_OK) {
-			    db_input_t *inc;
-			    inc = xmlMalloc(sizeof(*inc));
-			    db_input_copy(inc, in);
-
-			    stmtp->dss_handle = dbsp;
-			    stmtp->dss_in = inc;
-			    snprintf(stmtp->dss_name, sizeof(stmtp->dss_name), 
-				     "%u", seed++);
-
-			    TAILQ_INSERT_TAIL(&db_sqlite_stmts, stmtp, dss_link);
-			    slaxExtPrintAppend(out, 
-					(const xmlChar *) stmtp->dss_name,
-					strlen(stmtp->dss_name));
-			    return DB_DATA;
-			} else {
-			    const char *errstr =
-				sqlite3_errmsg(dbsp->dsh_sqlite_handle);
-			    slaxExtPrintAppend(out, (const xmlChar *) errstr,
-				    strlen(errstr));
-			    return DB_ERROR;
-			}
-		    }
+		stmtp = db_sqlite_stmt_alloc(dbsp, in, in->di_buf.pb_buf, NULL);
+		if (stmtp) {
+		    slaxExtPrintAppend(out, 
+				(const xmlChar *) stmtp->dss_name,
+				strlen(stmtp->dss_name));
+		    return DB_DATA;
+		} else {
+		    const char *errstr =
+			sqlite3_errmsg(dbsp->dsh_sqlite_handle);
+		    slaxExtPrintAppend(out, (const xmlChar *) errstr,
+			    strlen(errstr));
+		    return DB_ERROR;
 		}
-	    } else {
 	    }
-	} else {
 	}
     }
     return DB_FAIL;
@@ -1299,6 +1895,30 @@ DB_DRIVER_CLOSE (db_sqlite_close)
     return DB_FAIL;
 }
 
+/*
+ * The handle is going back to the pool.  Its cursors die with the run,
+ * but the cached statements stay prepared for the next one.
+ */
+DB_DRIVER_RELEASE (db_sqlite_release)
+{
+    db_sqlite_handle_t *dbsp;
+    db_sqlite_cache_t *dscp;
+
+    dbsp = db_sqlite_handle_find(db_handle->dh_name);
+    if (dbsp == NULL) {
+	return DB_FAIL;
+    }
+
+    db_sqlite_cursor_free_by_handle(dbsp);
+
+    TAILQ_FOREACH(dscp, &dbsp->dsh_cache, dsc_link) {
+	sqlite3_reset(dscp->dsc_stmt);
+	dscp->dsc_owner = NULL;
+    }
+
+    return DB_OK;
+}
+
 void 
 db_driver_init (db_driver_t *driver)
 {
@@ -1314,6 +1934,9 @@ db_driver_init (db_driver_t *driver)
     driver->dd_findAndFetch = db_sqlite_find_fetch;
     driver->dd_query = db_sqlite_query;
     driver->dd_close = db_sqlite_close;
+    driver->dd_insertMany = db_sqlite_insert_many;
+    driver->dd_fetchRows = db_sqlite_fetch_rows;
+    driver->dd_release = db_sqlite_release;
 
     TAILQ_INIT(&db_sqlite_sessions);
     TAILQ_INIT(&db_sqlite_stmts);
@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A document store for scripts.  A reference document (an inventory,
+ * a config snapshot) is parsed once by libxi into a parrotdb segment
+ * in a cache file, and scripts query it with libxi's xpath engine,
+ * getting back libxml2 copies of just the matching subtrees.  Later
+ * runs, and other scripts running at the same time, find the tree in
+ * the cache and skip the parse entirely.
+ *
+ * Queries write into the segment (node sets, name lookups), so each
+ * process maps the cache file with PMF_PRIVATE: the parsed document
+ * is shared through the page cache, and our scribbles stay our own.
+ * The file is only written while refreshing the cache, under an
+ * exclusive flock; users hold a shared lock while they have it open.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <stdlib.h>
+
+#include <libxml/xpathInternals.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "slaxconfig.h"
+
+#include <libxslt/extensions.h>
+#include <libslax/slaxdata.h>
+#include <libslax/slaxdyn.h>
+#include <libslax/xmlsoft.h>
+#include <libslax/slaxinternals.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xinodeset.h>
+#include <libxi/xixpath.h>
+#include <libxi/xixml.h>
+
+#define DOCSTORE_FULL_NS "http://xml.libslax.org/docstore"
+
+#define DOCSTORE_BASE	"docstore" /* Config base for pa_mmap_open */
+#define DOCSTORE_WS	"doc"	/* Name of the workspace in the cache */
+#define DOCSTORE_EXT	".xi"	/* Default cache is the source plus this */
+#define DOCSTORE_XPATHS	32	/* Compiled expressions kept per document */
+
+/* A compiled expression, kept for reuse */
+typedef struct docstore_xpath_s {
+    struct docstore_xpath_s *dsx_next; /* Next (most recently used first) */
+    char *dsx_expr;		/* Expression text */
+    xi_xpath_t *dsx_xpath;	/* Compiled expression */
+} docstore_xpath_t;
+
+typedef struct docstore_s {
+    struct docstore_s *ds_next;	/* Next loaded document */
+    char *ds_name;		/* Name scripts use for it */
+    char *ds_source;		/* Filename of the XML source */
+    int ds_fd;			/* Cache file (holding our shared lock) */
+    pa_mmap_t *ds_mmap;		/* Our (private) view of the segment */
+    xi_workspace_t *ds_workspace; /* Workspace holding the tree */
+    xi_parse_t *ds_parse;	/* Parser that found (or built) the tree */
+    docstore_xpath_t *ds_xpaths; /* Compiled expressions */
+    unsigned ds_xpath_count;	/* Number of those */
+} docstore_t;
+
+static docstore_t *extDocStores;
+
+static docstore_t *
+extDocFind (const char *name)
+{
+    docstore_t *dsp;
+
+    for (dsp = extDocStores; dsp; dsp = dsp->ds_next)
+	if (streq(dsp->ds_name, name))
+	    return dsp;
+
+    return NULL;
+}
+
+static void
+extDocFree (docstore_t *dsp)
+{
+    docstore_xpath_t *dsxp;
+
+    while ((dsxp = dsp->ds_xpaths) != NULL) {
+	dsp->ds_xpaths = dsxp->dsx_next;
+	xi_xpath_free(dsxp->dsx_xpath);
+	xmlFree(dsxp->dsx_expr);
+	xmlFree(dsxp);
+    }
+
+    if (dsp->ds_parse)
+	xi_parse_destroy(dsp->ds_parse);
+    if (dsp->ds_workspace)
+	xi_workspace_close(dsp->ds_workspace);
+    if (dsp->ds_mmap)
+	pa_mmap_close(dsp->ds_mmap);
+    if (dsp->ds_fd >= 0)
+	close(dsp->ds_fd);	/* Drops our lock */
+
+    xmlFreeAndEasy(dsp->ds_name);
+    xmlFreeAndEasy(dsp->ds_source);
+    xmlFree(dsp);
+}
+
+/*
+ * Forget a loaded document, if we have it
+ */
+static void
+extDocRelease (const char *name)
+{
+    docstore_t *dsp, **prevp;
+
+    for (prevp = &extDocStores; (dsp = *prevp); prevp = &dsp->ds_next) {
+	if (streq(dsp->ds_name, name)) {
+	    *prevp = dsp->ds_next;
+	    extDocFree(dsp);
+	    return;
+	}
+    }
+}
+
+/*
+ * Open a workspace on a segment and a parser for our source, looking
+ * for the tree in the cache.  Returns the parser, or NULL.
+ */
+static xi_parse_t *
+extDocParseOpen (pa_mmap_t *pmp, const char *source, xi_workspace_t **xwpp)
+{
+    xi_workspace_t *xwp;
+    xi_parse_t *parsep;
+
+    xwp = xi_workspace_open(pmp, DOCSTORE_WS);
+    if (xwp == NULL)
+	return NULL;
+
+    parsep = xi_parse_open(pmp, xwp, DOCSTORE_WS, source, 0);
+    if (parsep == NULL) {
+	xi_workspace_close(xwp);
+	return NULL;
+    }
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    parsep->xp_flags |= XI_PF_CACHE;
+
+    *xwpp = xwp;
+    return parsep;
+}
+
+/*
+ * Bring the cache file up to date with the source.  We hold the
+ * exclusive lock, so nobody else has the file mapped.  A stale tree
+ * would never be reclaimed, so we start the file over instead.
+ */
+static void
+extDocRefresh (const char *cache, int fd, const char *source)
+{
+    pa_mmap_t *pmp;
+    xi_workspace_t *xwp;
+    xi_parse_t *parsep;
+    struct stat st;
+    int current;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+	pmp = pa_mmap_open(cache, DOCSTORE_BASE, 0, 0);
+	if (pmp == NULL)
+	    current = FALSE;
+	else {
+	    parsep = extDocParseOpen(pmp, source, &xwp);
+	    current = parsep ? xi_parse_cache_current(parsep) : FALSE;
+	    if (parsep) {
+		xi_parse_destroy(parsep);
+		xi_workspace_close(xwp);
+	    }
+	    pa_mmap_close(pmp);
+	}
+
+	if (current)
+	    return;
+
+	if (ftruncate(fd, 0) < 0) {
+	    slaxLog("docstore: cannot reset cache '%s': %s",
+		    cache, strerror(errno));
+	    return;
+	}
+    }
+
+    pmp = pa_mmap_open(cache, DOCSTORE_BASE, 0, 0644);
+    if (pmp == NULL)
+	return;
+
+    parsep = extDocParseOpen(pmp, source, &xwp);
+    if (parsep) {
+	if (xi_parse(parsep) != 0) {
+	    /* Leave nothing half-made for others to find */
+	    slaxLog("docstore: parse failed: %s", source);
+	    if (ftruncate(fd, 0) < 0)
+		slaxLog("docstore: cannot reset cache '%s'", cache);
+	}
+
+	xi_parse_destroy(parsep);
+	xi_workspace_close(xwp);
+    }
+
+    pa_mmap_close(pmp);
+}
+
+/*
+ * Load a document: refresh the cache if we're the only user, then
+ * map it privately and find the tree.  If the cache can't be used
+ * (or someone else is using a stale one) we parse the source into
+ * our own view, so the caller always gets a current tree.
+ */
+static docstore_t *
+extDocLoad (const char *name, const char *source, const char *cache)
+{
+    docstore_t *dsp;
+    struct stat st;
+    int fd;
+
+    dsp = xmlMalloc(sizeof(*dsp));
+    if (dsp == NULL)
+	return NULL;
+
+    bzero(dsp, sizeof(*dsp));
+    dsp->ds_fd = -1;
+    dsp->ds_name = xmlStrdup2(name);
+    dsp->ds_source = xmlStrdup2(source);
+    if (dsp->ds_name == NULL || dsp->ds_source == NULL)
+	goto fail;
+
+    fd = open(cache, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+	fd = open(cache, O_RDONLY); /* Someone else's; we can still read it */
+
+    if (fd >= 0) {
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+	    extDocRefresh(cache, fd, source);
+
+	/* Downgrade (or wait for whoever is refreshing it) */
+	if (flock(fd, LOCK_SH) < 0) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+	dsp->ds_fd = fd;
+	dsp->ds_mmap = pa_mmap_open(cache, DOCSTORE_BASE, PMF_PRIVATE, 0);
+    } else if (fd >= 0) {
+	close(fd);
+    }
+
+    if (dsp->ds_mmap == NULL) {
+	slaxLog("docstore: not using cache for '%s'", source);
+	dsp->ds_mmap = pa_mmap_open(NULL, DOCSTORE_BASE, 0, 0);
+	if (dsp->ds_mmap == NULL)
+	    goto fail;
+    }
+
+    dsp->ds_parse = extDocParseOpen(dsp->ds_mmap, source, &dsp->ds_workspace);
+    if (dsp->ds_parse == NULL || xi_parse(dsp->ds_parse) != 0) {
+	LX_ERR("docstore:load: cannot parse '%s'\n", source);
+	goto fail;
+    }
+
+    slaxLog("docstore: loaded '%s' as '%s' (%s)", source, name,
+	    xi_parse_is_cached(dsp->ds_parse) ? "cached" : "parsed");
+
+    dsp->ds_next = extDocStores;
+    extDocStores = dsp;
+    return dsp;
+
+ fail:
+    extDocFree(dsp);
+    return NULL;
+}
+
+/*
+ * Find the compiled form of an expression, compiling it if needed
+ */
+static xi_xpath_t *
+extDocXpath (docstore_t *dsp, const char *expr)
+{
+    docstore_xpath_t *dsxp, **prevp;
+    xi_xpath_t *xpp;
+
+    for (prevp = &dsp->ds_xpaths; (dsxp = *prevp);
+	 prevp = &dsxp->dsx_next) {
+	if (streq(dsxp->dsx_expr, expr)) {
+	    /* Move it to the front, so the oldest falls off the end */
+	    *prevp = dsxp->dsx_next;
+	    dsxp->dsx_next = dsp->ds_xpaths;
+	    dsp->ds_xpaths = dsxp;
+	    return dsxp->dsx_xpath;
+	}
+
+	/* Drop the last one, if we're full */
+	if (dsxp->dsx_next == NULL
+		&& dsp->ds_xpath_count >= DOCSTORE_XPATHS) {
+	    *prevp = NULL;
+	    xi_xpath_free(dsxp->dsx_xpath);
+	    xmlFree(dsxp->dsx_expr);
+	    xmlFree(dsxp);
+	    dsp->ds_xpath_count -= 1;
+	    break;
+	}
+    }
+
+    xpp = xi_xpath_compile(dsp->ds_workspace, expr);
+    if (xpp == NULL)
+	return NULL;
+
+    dsxp = xmlMalloc(sizeof(*dsxp));
+    if (dsxp == NULL) {
+	xi_xpath_free(xpp);
+	return NULL;
+    }
+
+    dsxp->dsx_expr = xmlStrdup2(expr);
+    if (dsxp->dsx_expr == NULL) {
+	xmlFree(dsxp);
+	xi_xpath_free(xpp);
+	return NULL;
+    }
+
+    dsxp->dsx_xpath = xpp;
+    dsxp->dsx_next = dsp->ds_xpaths;
+    dsp->ds_xpaths = dsxp;
+    dsp->ds_xpath_count += 1;
+
+    return xpp;
+}
+
+/*
+ * Load a document, under a name that later calls use:
+ *     expr docstore:load("inventory", "/var/db/inventory.xml");
+ * The cache file defaults to the source's name plus ".xi"; a third
+ * argument gives another.  Returns true on success.
+ */
+static void
+extDocstoreLoad (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *name = NULL, *source = NULL, *cache = NULL, *buf = NULL;
+    size_t len;
+    int rc = FALSE;
+
+    if (nargs < 2 || nargs > 3) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    if (nargs > 2)
+	cache = (char *) xmlXPathPopString(ctxt);
+    source = (char *) xmlXPathPopString(ctxt);
+    name = (char *) xmlXPathPopString(ctxt);
+
+    if (name == NULL || *name == '\0' || source == NULL || *source == '\0') {
+	LX_ERR("docstore:load: missing name or source\n");
+	goto done;
+    }
+
+    /* Loading the same name again gives the current contents */
+    extDocRelease(name);
+
+    if (cache == NULL || *cache == '\0') {
+	len = strlen(source) + sizeof(DOCSTORE_EXT);
+	buf = xmlMalloc(len);
+	if (buf == NULL)
+	    goto done;
+	snprintf(buf, len, "%s%s", source, DOCSTORE_EXT);
+    }
+
+    if (extDocLoad(name, source, buf ?: cache))
+	rc = TRUE;
+
+ done:
+    valuePush(ctxt, xmlXPathNewBoolean(rc));
+    xmlFreeAndEasy(buf);
+    xmlFreeAndEasy(cache);
+    xmlFreeAndEasy(source);
+    xmlFreeAndEasy(name);
+}
+
+/*
+ * Evaluate an expression against a loaded document:
+ *     var $ports = docstore:query("inventory", "//port[speed = '100g']");
+ * Node sets are returned as copies of the matching subtrees (with
+ * attributes and text matches copied as text); other results are
+ * returned as strings, numbers, or booleans.
+ */
+static void
+extDocstoreQuery (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *name, *expr;
+    docstore_t *dsp;
+    xi_xpath_t *xpp;
+    xi_xpath_result_t res;
+    xi_nodeset_iter_t iter;
+    xmlXPathObjectPtr ret = NULL;
+    xmlDocPtr container;
+    xmlNodePtr last, node;
+    pa_atom_t atom;
+
+    if (nargs != 2) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    expr = (char *) xmlXPathPopString(ctxt);
+    name = (char *) xmlXPathPopString(ctxt);
+
+    dsp = name ? extDocFind(name) : NULL;
+    if (dsp == NULL) {
+	LX_ERR("docstore:query: unknown document: %s\n", name ?: "");
+	goto done;
+    }
+
+    xpp = extDocXpath(dsp, expr ?: "");
+    if (xpp == NULL) {
+	LX_ERR("docstore:query: invalid expression: %s\n", expr ?: "");
+	goto done;
+    }
+
+    bzero(&res, sizeof(res));
+    if (xi_xpath_eval(xpp, xi_parse_root(dsp->ds_parse), &res)) {
+	LX_ERR("docstore:query: evaluation failed: %s\n", expr);
+	goto done;
+    }
+
+    switch (res.xpr_type) {
+    case XI_XPR_STRING:
+	ret = xmlXPathNewString((const xmlChar *) (res.xpr_string ?: ""));
+	break;
+
+    case XI_XPR_NUMBER:
+	ret = xmlXPathNewFloat(res.xpr_number);
+	break;
+
+    case XI_XPR_BOOLEAN:
+	ret = xmlXPathNewBoolean(res.xpr_boolean);
+	break;
+
+    case XI_XPR_NODESET:
+	ret = xmlXPathNewNodeSet(NULL);
+	if (ret == NULL || res.xpr_nodeset == NULL)
+	    break;
+
+	container = slaxMakeRtf(ctxt);
+	if (container == NULL)
+	    break;
+
+	/* Each member may become several nodes (an attribute's text) */
+	xi_nodeset_iter_init(res.xpr_nodeset, &iter);
+	while ((atom = xi_nodeset_iter_next(res.xpr_nodeset, &iter))
+	       != PA_NULL_ATOM) {
+	    last = container->last;
+	    if (xi_xml_build_node(dsp->ds_workspace, container,
+				  (xmlNodePtr) container, atom)) {
+		LX_ERR("docstore:query: cannot copy results\n");
+		break;
+	    }
+
+	    for (node = last ? last->next : container->children; node;
+		 node = node->next)
+		xmlXPathNodeSetAdd(ret->nodesetval, node);
+	}
+	break;
+    }
+
+    xi_xpath_result_clean(&res);
+
+ done:
+    if (ret)
+	valuePush(ctxt, ret);
+    else
+	valuePush(ctxt, xmlXPathNewNodeSet(NULL));
+
+    xmlFreeAndEasy(expr);
+    xmlFreeAndEasy(name);
+}
+
+/*
+ * Release a loaded document:
+ *     expr docstore:close("inventory");
+ */
+static void
+extDocstoreClose (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *name;
+
+    if (nargs != 1) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    name = (char *) xmlXPathPopString(ctxt);
+    if (name)
+	extDocRelease(name);
+
+    xmlFreeAndEasy(name);
+    xmlXPathReturnEmptyString(ctxt);
+}
+
+slax_function_table_t slaxDocstoreTable[] = {
+    {
+	"close", extDocstoreClose,
+	"Release a loaded document",
+	"(name)", XPATH_STRING,
+    },
+    {
+	"load", extDocstoreLoad,
+	"Load a document, using its parsed copy in the cache if current",
+	"(name, source, cache?)", XPATH_BOOLEAN,
+    },
+    {
+	"query", extDocstoreQuery,
+	"Return the result of an expression against a loaded document",
+	"(name, expression)", XPATH_XSLT_TREE,
+    },
+    { NULL, NULL, NULL, NULL, XPATH_UNDEFINED }
+};
+
+SLAX_DYN_FUNC(slaxDynLibInit)
+{
+    arg->da_functions = slaxDocstoreTable; /* Fill in our function table */
+
+    return SLAX_DYN_VERSION;
+}
+
+/*
+ * Drop our mappings (and locks) before we're unloaded
+ */
+SLAX_DYN_FUNC(slaxDynLibClean)
+{
+    docstore_t *dsp;
+
+    while ((dsp = extDocStores) != NULL) {
+	extDocStores = dsp->ds_next;
+	extDocFree(dsp);
+    }
+
+    return SLAX_DYN_VERSION;
+}
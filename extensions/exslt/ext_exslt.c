@@ -45,13 +45,16 @@ static int extExsltInited;
 /*
  * libexslt lacks an unregister function, so we cannot unregister.  There's
  * no point in defining a slaxDynLibClean() function.
+ *
+ * slaxExsltRegisterAll() registers the stock libraries, then puts our
+ * hashed versions of the set functions and str:tokenize over them.
  */
 
 SLAX_DYN_FUNC(slaxDynLibInit)
 {
     if (!extExsltInited) {
 	slaxLog("exslt: registering exslt library");
-	exsltRegisterAll();
+	slaxExsltRegisterAll();
 	extExsltInited = TRUE;
     }
 	
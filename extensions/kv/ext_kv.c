@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A persistent key/value store for scripts, kept in a parrotdb
+ * segment: values are pa_arb allocations and a pa_pat tree indexes
+ * them by key.  Since the segment is a mapped file, state survives
+ * across runs and lookups need no parsing.  As with the curl cache,
+ * the first process to open a store is its writer; others open it
+ * read only, and see the writer's changes as they are made.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+#include <libxml/xpathInternals.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "slaxconfig.h"
+
+#include <libxslt/extensions.h>
+#include <libslax/slaxdata.h>
+#include <libslax/slaxdyn.h>
+#include <libslax/xmlsoft.h>
+#include <libslax/slaxinternals.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/papat.h>
+
+#define KV_FULL_NS	"http://xml.libslax.org/kv"
+
+#define ELT_ENTRY	"entry"
+#define ELT_KEY		"key"
+#define ELT_VALUE	"value"
+
+#define KV_MAGIC	0x4b565331 /* 'KVS1' */
+#define KV_HEADER	"kv"	/* Our header, made once the rest is set up */
+#define KV_DATA		"kv.data" /* pa_arb of records */
+#define KV_INDEX	"kv.index" /* pa_pat over the records' keys */
+#define KV_SHIFT	10	/* Index nodes per page (as a shift) */
+#define KV_MAX_KEYS	(1 << 24) /* Most keys a store can hold */
+
+/* The named header in the segment */
+typedef struct kv_seg_s {
+    uint32_t kvg_magic;		/* KV_MAGIC */
+    uint32_t kvg_count;		/* Number of keys */
+} kv_seg_t;
+
+/* A record; the lengths include the trailing NULs */
+typedef struct kv_rec_s {
+    uint32_t kvr_value_len;	/* Length of the value */
+    uint16_t kvr_key_len;	/* Length of the key */
+    uint16_t kvr_pad;		/* Unused */
+    char kvr_data[];		/* Key, then value */
+} kv_rec_t;
+
+typedef struct kv_store_s {
+    struct kv_store_s *kvs_next; /* Next open store */
+    char *kvs_path;		/* Filename */
+    pa_mmap_t *kvs_mmap;	/* Segment */
+    pa_arb_t *kvs_data;		/* Records (NULL until the writer's done) */
+    pa_pat_t *kvs_index;	/* Index of records, by key */
+    int kvs_writer;		/* We're the writer */
+} kv_store_t;
+
+static kv_store_t *extKvStores;
+
+/* A key that matches nothing real, for records we can't trust */
+static const psu_byte_t extKvNoKey[PA_PAT_MAXKEY];
+
+/*
+ * Return the record for a data atom, if it lies entirely inside the
+ * mapping.  A reader can see a half-made change (which it will
+ * retry), so anything it follows gets checked.
+ */
+static kv_rec_t *
+extKvRecord (kv_store_t *kvsp, pa_pat_data_atom_t datom)
+{
+    pa_mmap_t *pmp = kvsp->kvs_mmap;
+    kv_rec_t *recp;
+    psu_byte_t *cp, *endp = pmp->pm_addr + pmp->pm_len;
+
+    recp = pa_arb_atom_addr(kvsp->kvs_data,
+			    pa_arb_atom(pa_pat_data_atom_of(datom)));
+    cp = (psu_byte_t *) recp;
+    if (cp == NULL || cp < pmp->pm_addr || cp + sizeof(*recp) > endp)
+	return NULL;
+
+    if (recp->kvr_key_len == 0 || recp->kvr_key_len > PA_PAT_MAXKEY
+	    || recp->kvr_value_len == 0
+	    || (size_t) (endp - cp) < sizeof(*recp) + recp->kvr_key_len
+					+ recp->kvr_value_len)
+	return NULL;
+
+    return recp;
+}
+
+static const psu_byte_t *
+extKvKeyFunc (pa_pat_t *ppp, pa_pat_data_atom_t datom)
+{
+    kv_rec_t *recp = extKvRecord(ppp->pp_data, datom);
+
+    return recp ? (const psu_byte_t *) recp->kvr_data : extKvNoKey;
+}
+
+/*
+ * Attach to the data and index, once the writer has made them
+ */
+static int
+extKvAttach (kv_store_t *kvsp)
+{
+    pa_mmap_t *pmp = kvsp->kvs_mmap;
+    kv_seg_t *segp;
+
+    if (kvsp->kvs_index)
+	return 0;
+    if (pmp == NULL)
+	return -1;
+
+    segp = pa_mmap_header(pmp, KV_HEADER, PA_TYPE_OPAQUE, 0, 0);
+    if (segp == NULL || segp->kvg_magic != KV_MAGIC)
+	return -1;
+
+    kvsp->kvs_data = pa_arb_open(pmp, KV_DATA);
+    if (kvsp->kvs_data == NULL)
+	return -1;
+
+    /* The key function finds the store through pp_data */
+    kvsp->kvs_index = pa_pat_open(pmp, KV_INDEX, kvsp, extKvKeyFunc,
+				  PA_PAT_MAXKEY, KV_SHIFT, KV_MAX_KEYS);
+    if (kvsp->kvs_index == NULL) {
+	pa_arb_close(kvsp->kvs_data);
+	kvsp->kvs_data = NULL;
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+extKvDetach (kv_store_t *kvsp)
+{
+    if (kvsp->kvs_index) {
+	pa_pat_close(kvsp->kvs_index);
+	kvsp->kvs_index = NULL;
+    }
+
+    if (kvsp->kvs_data) {
+	pa_arb_close(kvsp->kvs_data);
+	kvsp->kvs_data = NULL;
+    }
+
+    if (kvsp->kvs_mmap) {
+	pa_mmap_close(kvsp->kvs_mmap);
+	kvsp->kvs_mmap = NULL;
+    }
+}
+
+/*
+ * Map the segment, as the writer if nobody else is
+ */
+static void
+extKvMap (kv_store_t *kvsp)
+{
+    pa_mmap_t *pmp;
+    kv_seg_t *segp;
+    int fd, writer = TRUE;
+
+    /*
+     * See if someone else is already the writer, so we can open the
+     * segment read-only, rather than having pa_mmap_open() complain.
+     */
+    fd = open(kvsp->kvs_path, O_RDONLY);
+    if (fd >= 0) {
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+	    writer = FALSE;
+	close(fd);		/* Drops our lock */
+    }
+
+    pmp = pa_mmap_open(kvsp->kvs_path, "kv",
+		       writer ? PMF_SHARED : (PMF_SHARED | PMF_READ_ONLY),
+		       0644);
+    if (pmp == NULL) {
+	slaxLog("kv: cannot open store: %s", kvsp->kvs_path);
+	return;
+    }
+
+    kvsp->kvs_mmap = pmp;
+    kvsp->kvs_writer = writer;
+
+    if (!writer) {
+	extKvAttach(kvsp);	/* If it's not ready, we'll try later */
+	return;
+    }
+
+    /* A new store gets its data and index, then our header last */
+    segp = pa_mmap_header(pmp, KV_HEADER, PA_TYPE_OPAQUE, 0, 0);
+    if (segp == NULL) {
+	pa_mmap_write_begin(pmp);
+
+	kvsp->kvs_data = pa_arb_open(pmp, KV_DATA);
+	if (kvsp->kvs_data)
+	    kvsp->kvs_index = pa_pat_open(pmp, KV_INDEX, kvsp, extKvKeyFunc,
+					  PA_PAT_MAXKEY, KV_SHIFT,
+					  KV_MAX_KEYS);
+	if (kvsp->kvs_index) {
+	    segp = pa_mmap_header(pmp, KV_HEADER, PA_TYPE_OPAQUE, 0,
+				  sizeof(*segp));
+	    if (segp) {
+		segp->kvg_magic = KV_MAGIC;
+		segp->kvg_count = 0;
+	    }
+	}
+
+	pa_mmap_write_end(pmp);
+    }
+
+    if (extKvAttach(kvsp) < 0)
+	slaxLog("kv: store is not usable: %s", kvsp->kvs_path);
+}
+
+/*
+ * Find (or open) the store for a file
+ */
+static kv_store_t *
+extKvStore (const char *path)
+{
+    kv_store_t *kvsp;
+
+    for (kvsp = extKvStores; kvsp; kvsp = kvsp->kvs_next)
+	if (streq(kvsp->kvs_path, path))
+	    return kvsp;
+
+    kvsp = xmlMalloc(sizeof(*kvsp));
+    if (kvsp == NULL)
+	return NULL;
+
+    bzero(kvsp, sizeof(*kvsp));
+    kvsp->kvs_path = xmlStrdup2(path);
+    if (kvsp->kvs_path == NULL) {
+	xmlFree(kvsp);
+	return NULL;
+    }
+
+    kvsp->kvs_next = extKvStores;
+    extKvStores = kvsp;
+
+    extKvMap(kvsp);
+
+    return kvsp;
+}
+
+/*
+ * Make sure we can write to a store.  If we're a reader but the
+ * writer has gone away, we take over.
+ */
+static int
+extKvWritable (kv_store_t *kvsp, const char *fname)
+{
+    int fd;
+
+    if (!kvsp->kvs_writer) {
+	fd = open(kvsp->kvs_path, O_RDONLY);
+	if (fd >= 0) {
+	    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		close(fd);
+		extKvDetach(kvsp);
+		extKvMap(kvsp);
+	    } else {
+		close(fd);
+	    }
+	}
+    }
+
+    if (!kvsp->kvs_writer) {
+	LX_ERR("kv:%s: store has another writer: %s\n",
+	       fname, kvsp->kvs_path);
+	return FALSE;
+    }
+
+    if (kvsp->kvs_index == NULL) {
+	LX_ERR("kv:%s: cannot open store: %s\n", fname, kvsp->kvs_path);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Check a key, returning its length (with the NUL), or zero
+ */
+static size_t
+extKvKeyLen (const char *key, const char *fname)
+{
+    size_t len = key ? strlen(key) + 1 : 0;
+
+    if (len <= 1) {
+	LX_ERR("kv:%s: empty key\n", fname);
+	return 0;
+    }
+
+    if (len > PA_PAT_MAXKEY) {
+	LX_ERR("kv:%s: key is too long (%u bytes max): %.40s...\n",
+	       fname, PA_PAT_MAXKEY - 1, key);
+	return 0;
+    }
+
+    return len;
+}
+
+/*
+ * Pop the arguments, which are strings, with the store's path first
+ */
+static int
+extKvArgs (xmlXPathParserContext *ctxt, int nargs, int min, int max,
+	   char **argv, kv_store_t **kvspp, const char *fname)
+{
+    int i;
+
+    if (nargs < min || nargs > max) {
+	xmlXPathSetArityError(ctxt);
+	return -1;
+    }
+
+    bzero(argv, max * sizeof(argv[0]));
+    for (i = nargs - 1; i >= 0; i--)
+	argv[i] = (char *) xmlXPathPopString(ctxt);
+
+    if (argv[0] == NULL || *argv[0] == '\0') {
+	LX_ERR("kv:%s: missing store filename\n", fname);
+	*kvspp = NULL;
+	return 0;
+    }
+
+    *kvspp = extKvStore(argv[0]);
+    return 0;
+}
+
+static void
+extKvArgsFree (char **argv, int max)
+{
+    int i;
+
+    for (i = 0; i < max; i++)
+	xmlFreeAndEasy(argv[i]);
+}
+
+/*
+ * Return the value for a key, or an empty string if it's not there:
+ *     var $value = kv:get($file, $key);
+ */
+static void
+extKvGet (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *argv[2];
+    kv_store_t *kvsp;
+    pa_pat_node_t *node;
+    kv_rec_t *recp;
+    xmlChar *value = NULL;
+    size_t klen;
+    uint32_t seq;
+
+    if (extKvArgs(ctxt, nargs, 2, 2, argv, &kvsp, "get") < 0)
+	return;
+
+    klen = extKvKeyLen(argv[1], "get");
+    if (kvsp == NULL || klen == 0 || extKvAttach(kvsp) < 0)
+	goto done;
+
+    do {
+	seq = pa_mmap_read_begin(kvsp->kvs_mmap);
+
+	xmlFreeAndEasy(value);
+	value = NULL;
+
+	node = pa_pat_get(kvsp->kvs_index, klen, argv[1]);
+	if (node) {
+	    recp = extKvRecord(kvsp, node->ppn_data);
+	    if (recp)
+		value = xmlStrndup((const xmlChar *) recp->kvr_data
+				   + recp->kvr_key_len,
+				   recp->kvr_value_len - 1);
+	}
+    } while (pa_mmap_read_retry(kvsp->kvs_mmap, seq));
+
+ done:
+    if (value)
+	xmlXPathReturnString(ctxt, value);
+    else
+	xmlXPathReturnEmptyString(ctxt);
+
+    extKvArgsFree(argv, 2);
+}
+
+/*
+ * Store a value, replacing any the key already has:
+ *     expr kv:put($file, $key, $value);
+ * Returns true on success.
+ */
+static void
+extKvPut (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *argv[3];
+    kv_store_t *kvsp;
+    pa_mmap_t *pmp;
+    pa_pat_node_t *node;
+    pa_arb_atom_t atom;
+    pa_pat_data_atom_t datom, old;
+    kv_rec_t *recp;
+    kv_seg_t *segp;
+    size_t klen, vlen;
+    int rc = FALSE;
+
+    if (extKvArgs(ctxt, nargs, 3, 3, argv, &kvsp, "put") < 0)
+	return;
+
+    klen = extKvKeyLen(argv[1], "put");
+    if (kvsp == NULL || klen == 0 || !extKvWritable(kvsp, "put"))
+	goto done;
+
+    vlen = strlen(argv[2]) + 1;
+    if (vlen > UINT32_MAX - sizeof(*recp) - klen) {
+	LX_ERR("kv:put: value is too large\n");
+	goto done;
+    }
+
+    pmp = kvsp->kvs_mmap;
+    pa_mmap_write_begin(pmp);
+
+    /* Build the new record before touching the index */
+    atom = pa_arb_alloc(kvsp->kvs_data, sizeof(*recp) + klen + vlen);
+    recp = pa_arb_atom_addr(kvsp->kvs_data, atom);
+    if (recp == NULL) {
+	LX_ERR("kv:put: out of space: %s\n", kvsp->kvs_path);
+	goto end;
+    }
+
+    recp->kvr_key_len = klen;
+    recp->kvr_value_len = vlen;
+    recp->kvr_pad = 0;
+    memcpy(recp->kvr_data, argv[1], klen);
+    memcpy(recp->kvr_data + klen, argv[2], vlen);
+    datom = pa_pat_data_atom(pa_arb_atom_of(atom));
+
+    /*
+     * The key is the same, so an existing node can just point at
+     * the new record
+     */
+    node = pa_pat_get(kvsp->kvs_index, klen, argv[1]);
+    if (node) {
+	old = node->ppn_data;
+	node->ppn_data = datom;
+	pa_arb_free_atom(kvsp->kvs_data,
+			 pa_arb_atom(pa_pat_data_atom_of(old)));
+	rc = TRUE;
+
+    } else if (pa_pat_add(kvsp->kvs_index, datom, klen)) {
+	segp = pa_mmap_header(pmp, KV_HEADER, PA_TYPE_OPAQUE, 0, 0);
+	if (segp)
+	    segp->kvg_count += 1;
+	rc = TRUE;
+
+    } else {
+	LX_ERR("kv:put: cannot add key: %s\n", argv[1]);
+	pa_arb_free_atom(kvsp->kvs_data, atom);
+    }
+
+ end:
+    pa_mmap_write_end(pmp);
+ done:
+    valuePush(ctxt, xmlXPathNewBoolean(rc));
+    extKvArgsFree(argv, 3);
+}
+
+/*
+ * Remove a key, returning true if it was there:
+ *     expr kv:delete($file, $key);
+ */
+static void
+extKvDelete (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *argv[2];
+    kv_store_t *kvsp;
+    pa_mmap_t *pmp;
+    pa_pat_node_t *node;
+    pa_pat_data_atom_t datom;
+    kv_seg_t *segp;
+    size_t klen;
+    int rc = FALSE;
+
+    if (extKvArgs(ctxt, nargs, 2, 2, argv, &kvsp, "delete") < 0)
+	return;
+
+    klen = extKvKeyLen(argv[1], "delete");
+    if (kvsp == NULL || klen == 0 || !extKvWritable(kvsp, "delete"))
+	goto done;
+
+    pmp = kvsp->kvs_mmap;
+    pa_mmap_write_begin(pmp);
+
+    node = pa_pat_get(kvsp->kvs_index, klen, argv[1]);
+    if (node) {
+	datom = node->ppn_data;
+
+	/* The range delete frees the index node for us */
+	if (pa_pat_delete_range(kvsp->kvs_index, klen, argv[1],
+				klen, argv[1]) == 1) {
+	    pa_arb_free_atom(kvsp->kvs_data,
+			     pa_arb_atom(pa_pat_data_atom_of(datom)));
+
+	    segp = pa_mmap_header(pmp, KV_HEADER, PA_TYPE_OPAQUE, 0, 0);
+	    if (segp && segp->kvg_count)
+		segp->kvg_count -= 1;
+	    rc = TRUE;
+	}
+    }
+
+    pa_mmap_write_end(pmp);
+ done:
+    valuePush(ctxt, xmlXPathNewBoolean(rc));
+    extKvArgsFree(argv, 2);
+}
+
+/*
+ * Return the entries whose keys start with a prefix, in key order:
+ *     for-each (kv:scan($file, "user.")) {
+ *         message key _ " = " _ value;
+ *     }
+ * Without a prefix, every entry is returned.  Each is returned as:
+ *     <entry> { <key> $key; <value> $value; }
+ */
+static void
+extKvScan (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *argv[2];
+    kv_store_t *kvsp;
+    pa_pat_t *ppp;
+    pa_pat_node_t *node;
+    kv_rec_t *recp;
+    slax_data_list_t list;
+    slax_data_node_t *dnp;
+    xmlXPathObjectPtr ret = NULL;
+    xmlDocPtr container;
+    xmlNodePtr entp;
+    const char *key;
+    uint16_t plen = 0;
+    uint32_t seq;
+
+    if (extKvArgs(ctxt, nargs, 1, 2, argv, &kvsp, "scan") < 0)
+	return;
+
+    slaxDataListInit(&list);
+
+    if (kvsp == NULL || extKvAttach(kvsp) < 0)
+	goto done;
+
+    if (argv[1] && *argv[1]) {
+	if (strlen(argv[1]) >= PA_PAT_MAXKEY)
+	    goto done;		/* Nothing can match */
+	plen = strlen(argv[1]) * PA_NBBY;
+    }
+
+    /* Copy out keys and values, alternately, then build the nodes */
+    ppp = kvsp->kvs_index;
+    do {
+	seq = pa_mmap_read_begin(kvsp->kvs_mmap);
+	slaxDataListClean(&list);
+
+	node = plen ? pa_pat_subtree_match(ppp, plen, argv[1])
+	    : pa_pat_find_next(ppp, NULL);
+
+	for ( ; node; node = plen ? pa_pat_subtree_next(ppp, node, plen)
+		  : pa_pat_find_next(ppp, node)) {
+	    recp = extKvRecord(kvsp, node->ppn_data);
+	    if (recp == NULL)
+		continue;
+
+	    slaxDataListAddLen(&list, recp->kvr_data, recp->kvr_key_len - 1);
+	    slaxDataListAddLen(&list, recp->kvr_data + recp->kvr_key_len,
+			       recp->kvr_value_len - 1);
+	}
+    } while (pa_mmap_read_retry(kvsp->kvs_mmap, seq));
+
+ done:
+    ret = xmlXPathNewNodeSet(NULL);
+    container = ret ? slaxMakeRtf(ctxt) : NULL;
+
+    key = NULL;
+    if (container) {
+	SLAXDATALIST_FOREACH(dnp, &list) {
+	    if (key == NULL) {
+		key = dnp->dn_data;
+		continue;
+	    }
+
+	    entp = xmlNewDocNode(container, NULL,
+				 (const xmlChar *) ELT_ENTRY, NULL);
+	    if (entp) {
+		xmlAddChild((xmlNodePtr) container, entp);
+		xmlXPathNodeSetAdd(ret->nodesetval, entp);
+		xmlAddChildContent(container, entp, (const xmlChar *) ELT_KEY,
+				   (const xmlChar *) key);
+		xmlAddChildContent(container, entp,
+				   (const xmlChar *) ELT_VALUE,
+				   (const xmlChar *) dnp->dn_data);
+	    }
+	    key = NULL;
+	}
+    }
+
+    if (ret)
+	valuePush(ctxt, ret);
+    else
+	valuePush(ctxt, xmlXPathNewNodeSet(NULL));
+
+    slaxDataListClean(&list);
+    extKvArgsFree(argv, 2);
+}
+
+/*
+ * Return the number of keys in a store:
+ *     var $count = kv:count($file);
+ */
+static void
+extKvCount (xmlXPathParserContext *ctxt, int nargs)
+{
+    char *argv[1];
+    kv_store_t *kvsp;
+    kv_seg_t *segp;
+    uint32_t count = 0;
+
+    if (extKvArgs(ctxt, nargs, 1, 1, argv, &kvsp, "count") < 0)
+	return;
+
+    if (kvsp && extKvAttach(kvsp) == 0) {
+	segp = pa_mmap_header(kvsp->kvs_mmap, KV_HEADER, PA_TYPE_OPAQUE, 0, 0);
+	if (segp)
+	    count = __atomic_load_n(&segp->kvg_count, __ATOMIC_ACQUIRE);
+    }
+
+    xmlXPathReturnNumber(ctxt, count);
+    extKvArgsFree(argv, 1);
+}
+
+/*
+ * Close a store, giving up the writer's role if we had it:
+ *     expr kv:close($file);
+ */
+static void
+extKvClose (xmlXPathParserContext *ctxt, int nargs)
+{
+    kv_store_t *kvsp, **prevp;
+    char *path;
+
+    if (nargs != 1) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    path = (char *) xmlXPathPopString(ctxt);
+
+    for (prevp = &extKvStores; (kvsp = *prevp); prevp = &kvsp->kvs_next) {
+	if (path && streq(kvsp->kvs_path, path)) {
+	    *prevp = kvsp->kvs_next;
+	    extKvDetach(kvsp);
+	    xmlFree(kvsp->kvs_path);
+	    xmlFree(kvsp);
+	    break;
+	}
+    }
+
+    xmlFreeAndEasy(path);
+    xmlXPathReturnEmptyString(ctxt);
+}
+
+slax_function_table_t slaxKvTable[] = {
+    {
+	"close", extKvClose,
+	"Close a store",
+	"(file)", XPATH_STRING,
+    },
+    {
+	"count", extKvCount,
+	"Return the number of keys in a store",
+	"(file)", XPATH_NUMBER,
+    },
+    {
+	"delete", extKvDelete,
+	"Remove a key from a store",
+	"(file, key)", XPATH_BOOLEAN,
+    },
+    {
+	"get", extKvGet,
+	"Return the value of a key",
+	"(file, key)", XPATH_STRING,
+    },
+    {
+	"put", extKvPut,
+	"Set the value of a key",
+	"(file, key, value)", XPATH_BOOLEAN,
+    },
+    {
+	"scan", extKvScan,
+	"Return the entries whose keys start with a prefix",
+	"(file, prefix?)", XPATH_XSLT_TREE,
+    },
+    { NULL, NULL, NULL, NULL, XPATH_UNDEFINED }
+};
+
+SLAX_DYN_FUNC(slaxDynLibInit)
+{
+    arg->da_functions = slaxKvTable; /* Fill in our function table */
+
+    return SLAX_DYN_VERSION;
+}
+
+/*
+ * Unmap our stores before we're unloaded
+ */
+SLAX_DYN_FUNC(slaxDynLibClean)
+{
+    kv_store_t *kvsp;
+
+    while ((kvsp = extKvStores) != NULL) {
+	extKvStores = kvsp->kvs_next;
+	extKvDetach(kvsp);
+	xmlFree(kvsp->kvs_path);
+	xmlFree(kvsp);
+    }
+
+    return SLAX_DYN_VERSION;
+}
@@ -23,6 +23,10 @@
 #include <pwd.h>
 #include <grp.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <libxml/xpathInternals.h>
 #include <libxml/parser.h>
@@ -39,14 +43,58 @@
 #include <libslax/slaxnames.h>
 #include <libpsu/psucommon.h>
 #include <libpsu/psulog.h>
+#include <libpsu/psutime.h>
 
 #define XML_FULL_NS "http://xml.libslax.org/os"
 
+/* Fields that os:stat can emit (see <field>) */
+#define SOF_TYPE	(1<<0)
+#define SOF_EXECUTABLE	(1<<1)
+#define SOF_SYMLINK	(1<<2)
+#define SOF_SYMLINK_TARGET (1<<3)
+#define SOF_PERMISSIONS	(1<<4)
+#define SOF_OWNER	(1<<5)
+#define SOF_GROUP	(1<<6)
+#define SOF_LINKS	(1<<7)
+#define SOF_SIZE	(1<<8)
+#define SOF_DATE	(1<<9)
+
+#define SOF_BRIEF	(SOF_TYPE | SOF_EXECUTABLE | SOF_SYMLINK)
+#define SOF_ALL		((1<<10) - 1)
+
+/* Names for <field>, in output order */
+static struct {
+    const char *osf_name;	/* Element name */
+    unsigned osf_bit;		/* SOF_* flag */
+} extOsStatFields[] = {
+    { ELT_TYPE, SOF_TYPE },
+    { ELT_EXECUTABLE, SOF_EXECUTABLE },
+    { ELT_SYMLINK, SOF_SYMLINK },
+    { ELT_SYMLINK_TARGET, SOF_SYMLINK_TARGET },
+    { ELT_PERMISSIONS, SOF_PERMISSIONS },
+    { ELT_OWNER, SOF_OWNER },
+    { ELT_GROUP, SOF_GROUP },
+    { ELT_LINKS, SOF_LINKS },
+    { ELT_SIZE, SOF_SIZE },
+    { ELT_DATE, SOF_DATE },
+    { NULL, 0 }
+};
+
+#define SO_THREADS	4	/* Default number of threads for recursion */
+#define SO_THREADS_MAX	64	/* Limit on <threads> */
+
 typedef struct statOptions_s {
     int so_brief;		/* Skip most fields */
     int so_depth;		/* Depth limit */
     int so_hidden;		/* Show hidden files */
     int so_recurse;		/* Should we recurse? */
+    unsigned so_fields;		/* Fields to emit (SOF_*) */
+    const char *so_match;	/* Only show names matching this pattern */
+    int so_threads;		/* Threads for walking directories */
+    uid_t so_uid;		/* Last uid looked up */
+    gid_t so_gid;		/* Last gid looked up */
+    char so_owner[64];		/* Name for so_uid ("" if not looked up) */
+    char so_group[64];		/* Name for so_gid ("" if not looked up) */
 } statOptions_t;
 
 /*
@@ -1074,10 +1122,45 @@ extOsStatTime (char *buf, int bufsiz, struct timespec *tvp)
 	     month_names[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min);
 }
 
+/*
+ * Return the names for the owner and group of a file.  Files in a tree
+ * mostly share an owner, so remembering the last one saves most of the
+ * passwd and group lookups.
+ */
 static void
-extOsStatPath (xmlNodeSet *results, xmlDocPtr docp, xmlNodePtr parent,
-	       const char *path, const char *name, int recurse,
-	       statOptions_t *sop);
+extOsStatNames (statOptions_t *sop, struct stat *stp,
+		const char **ownerp, const char **groupp)
+{
+    struct passwd *pwd;
+    struct group *grp;
+
+    if (sop->so_owner[0] == '\0' || sop->so_uid != stp->st_uid) {
+	pwd = getpwuid(stp->st_uid);
+	if (pwd)
+	    snprintf(sop->so_owner, sizeof(sop->so_owner), "%s", pwd->pw_name);
+	else
+	    snprintf(sop->so_owner, sizeof(sop->so_owner), "%d",
+		     (int) stp->st_uid);
+	sop->so_uid = stp->st_uid;
+    }
+
+    if (sop->so_group[0] == '\0' || sop->so_gid != stp->st_gid) {
+	grp = getgrgid(stp->st_gid);
+	if (grp)
+	    snprintf(sop->so_group, sizeof(sop->so_group), "%s", grp->gr_name);
+	else
+	    snprintf(sop->so_group, sizeof(sop->so_group), "%d",
+		     (int) stp->st_gid);
+	sop->so_gid = stp->st_gid;
+    }
+
+    *ownerp = sop->so_owner;
+    *groupp = sop->so_group;
+}
+
+static void
+extOsWalk (xmlDocPtr docp, xmlNodePtr parent, const char *path,
+	   int recurse, statOptions_t *sop);
 
 static void
 extOsStatInfo (xmlDocPtr docp, xmlNodePtr parent,
@@ -1086,23 +1169,26 @@ extOsStatInfo (xmlDocPtr docp, xmlNodePtr parent,
 {
     char buf[BUFSIZ];
     char buf2[BUFSIZ/4];
-    struct passwd *pwd = getpwuid(stp->st_uid);
-    struct group *grp = getgrgid(stp->st_gid);
+    const char *owner, *group;
+    unsigned fields = sop->so_fields;
     int isdir = ((stp->st_mode & S_IFMT) == S_IFDIR);
     struct timespec mtime;
 
     slaxMakeNode(docp, parent, ELT_NAME, path, NULL, NULL);
 
-    slaxMakeNode(docp, parent, ELT_TYPE, extOsModeToType(stp->st_mode),
-		 NULL, NULL);
+    if (fields & SOF_TYPE)
+	slaxMakeNode(docp, parent, ELT_TYPE, extOsModeToType(stp->st_mode),
+		     NULL, NULL);
 
-    if ((stp->st_mode & S_IXUSR) && (stp->st_mode & S_IFMT) == S_IFREG)
-	slaxMakeNode(docp, parent, ELT_EXECUTABLE, NULL, NULL, NULL);
+    if ((stp->st_mode & S_IXUSR) && (stp->st_mode & S_IFMT) == S_IFREG) {
+	if (fields & SOF_EXECUTABLE)
+	    slaxMakeNode(docp, parent, ELT_EXECUTABLE, NULL, NULL, NULL);
 
-    else if ((stp->st_mode & S_IFMT) == S_IFLNK) {
-	slaxMakeNode(docp, parent, ELT_SYMLINK, "@", NULL, NULL);
+    } else if ((stp->st_mode & S_IFMT) == S_IFLNK) {
+	if (fields & SOF_SYMLINK)
+	    slaxMakeNode(docp, parent, ELT_SYMLINK, "@", NULL, NULL);
 
-	if (!sop->so_brief) {
+	if (fields & SOF_SYMLINK_TARGET) {
 	    ssize_t len = readlink(path, buf, sizeof(buf));
 
 	    if (len < 0)
@@ -1118,26 +1204,38 @@ extOsStatInfo (xmlDocPtr docp, xmlNodePtr parent,
 	}
     }
 
-    if (!sop->so_brief) {
+    if (fields & SOF_PERMISSIONS) {
 	extOsModeToPerm(buf, sizeof(buf), stp->st_mode);
 	snprintf(buf2, sizeof(buf2), "%o", stp->st_mode & 0777);
 	slaxMakeNode(docp, parent, ELT_PERMISSIONS, buf2,
 		     ATT_MODE, buf);
+    }
+
+    if (fields & (SOF_OWNER | SOF_GROUP)) {
+	extOsStatNames(sop, stp, &owner, &group);
 
-	snprintf(buf, sizeof(buf), "%d", (int) stp->st_uid);
-	slaxMakeNode(docp, parent, ELT_OWNER,
-		     pwd ? pwd->pw_name : buf, ATT_UID, buf);
+	if (fields & SOF_OWNER) {
+	    snprintf(buf, sizeof(buf), "%d", (int) stp->st_uid);
+	    slaxMakeNode(docp, parent, ELT_OWNER, owner, ATT_UID, buf);
+	}
 
-	snprintf(buf, sizeof(buf), "%d", (int) stp->st_gid);
-	slaxMakeNode(docp, parent, ELT_GROUP,
-		     grp ? grp->gr_name : buf, ATT_GID, buf);
+	if (fields & SOF_GROUP) {
+	    snprintf(buf, sizeof(buf), "%d", (int) stp->st_gid);
+	    slaxMakeNode(docp, parent, ELT_GROUP, group, ATT_GID, buf);
+	}
+    }
 
+    if (fields & SOF_LINKS) {
 	snprintf(buf, sizeof(buf), "%d", (int) stp->st_nlink);
 	slaxMakeNode(docp, parent, ELT_LINKS, buf, NULL, NULL);
+    }
 
+    if (fields & SOF_SIZE) {
 	snprintf(buf, sizeof(buf), "%llu", (long long unsigned) stp->st_size);
 	slaxMakeNode(docp, parent, ELT_SIZE, buf, NULL, NULL);
+    }
 
+    if (fields & SOF_DATE) {
 #if HAVE_MTIMESPEC
 	mtime = stp->st_mtimespec;
 #else /* HAVE_MTIMESPEC */
@@ -1150,33 +1248,271 @@ extOsStatInfo (xmlDocPtr docp, xmlNodePtr parent,
 	slaxMakeNode(docp, parent, ELT_DATE, buf2, ATT_DATE, buf);
     }
 
-    if (isdir && recurse) {
-	DIR *dirp = opendir(path);
+    if (isdir && recurse)
+	extOsWalk(docp, parent, path, recurse, sop);
+}
 
-	if (dirp) {
-	    struct dirent *dp;
+/*
+ * The directory walker.  A small pool of threads reads directories
+ * and stats their contents (with fstatat() against the open directory,
+ * so each name is looked up once), building a tree of plain entries.
+ * None of this touches libxml2, which isn't safe to share between
+ * threads; the calling thread turns the finished tree into nodes.
+ */
+typedef struct os_walk_entry_s {
+    struct os_walk_entry_s *owe_next;	  /* Next entry in the directory */
+    struct os_walk_entry_s *owe_children; /* Contents, for a directory */
+    struct os_walk_entry_s *owe_qnext;	  /* Next directory in the queue */
+    struct stat owe_stat;		  /* Status from fstatat() */
+    int owe_recurse;			  /* Levels left to descend */
+    int owe_keep;			  /* Emit this entry? */
+    char owe_path[];			  /* Path to the entry */
+} os_walk_entry_t;
+
+typedef struct os_walk_s {
+    pthread_mutex_t ow_lock;	/* Protects the rest */
+    pthread_cond_t ow_cond;	/* Signalled when the queue changes */
+    os_walk_entry_t *ow_head;	/* Directories waiting to be read */
+    os_walk_entry_t *ow_tail;	/* Last directory in the queue */
+    unsigned ow_active;		/* Directories being read */
+    statOptions_t *ow_sop;	/* Options (read only) */
+} os_walk_t;
+
+static os_walk_entry_t *
+extOsWalkEntry (const char *path, const char *name)
+{
+    size_t plen = strlen(path), nlen = name ? strlen(name) : 0;
+    os_walk_entry_t *owep;
 
-	    for (;;) {
-		dp = readdir(dirp);
-		if (dp == NULL)
-		    break;
+    /* Avoid double slashes */
+    if (name && plen > 0 && path[plen - 1] == '/')
+	plen -= 1;
 
-		if (dp->d_name[0] == '.') {
-		    if (!sop->so_hidden)
-			continue; /* Ignore hidden files */
-		    if (dp->d_name[1] == '\0')
-			continue; /* Don't follow self */
-		    if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
-			continue; /* Don't follow parent */
-		}
+    owep = malloc(sizeof(*owep) + plen + nlen + 2);
+    if (owep == NULL)
+	return NULL;
 
-		extOsStatPath(NULL, docp, parent, path, dp->d_name,
-			      recurse - 1, sop);
-	    }
+    bzero(owep, sizeof(*owep));
+    memcpy(owep->owe_path, path, plen);
+    if (name) {
+	owep->owe_path[plen] = '/';
+	memcpy(owep->owe_path + plen + 1, name, nlen + 1);
+    } else {
+	owep->owe_path[plen] = '\0';
+    }
+
+    return owep;
+}
+
+static void
+extOsWalkFree (os_walk_entry_t *owep)
+{
+    os_walk_entry_t *nextp;
+
+    for ( ; owep; owep = nextp) {
+	nextp = owep->owe_next;
+	extOsWalkFree(owep->owe_children);
+	free(owep);
+    }
+}
 
-	    closedir(dirp);
+/*
+ * Read one directory, stat'ing each entry.  Subdirectories that need
+ * reading are returned as a list, linked by owe_qnext.
+ */
+static os_walk_entry_t *
+extOsWalkRead (os_walk_entry_t *dirp, statOptions_t *sop)
+{
+    os_walk_entry_t *owep, **tailp = &dirp->owe_children;
+    os_walk_entry_t *subdirs = NULL, **subtailp = &subdirs;
+    struct dirent *dp;
+    DIR *dir;
+    int fd;
+
+    fd = open(dirp->owe_path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+	return NULL;
+
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+	close(fd);
+	return NULL;
+    }
+
+    while ((dp = readdir(dir)) != NULL) {
+	if (dp->d_name[0] == '.') {
+	    if (!sop->so_hidden)
+		continue; /* Ignore hidden files */
+	    if (dp->d_name[1] == '\0')
+		continue; /* Don't follow self */
+	    if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
+		continue; /* Don't follow parent */
+	}
+
+	owep = extOsWalkEntry(dirp->owe_path, dp->d_name);
+	if (owep == NULL)
+	    break;
+
+	if (fstatat(fd, dp->d_name, &owep->owe_stat, AT_SYMLINK_NOFOLLOW)) {
+	    free(owep);
+	    continue;
+	}
+
+	owep->owe_recurse = dirp->owe_recurse - 1;
+	*tailp = owep;
+	tailp = &owep->owe_next;
+
+	if (owep->owe_recurse && S_ISDIR(owep->owe_stat.st_mode)) {
+	    *subtailp = owep;
+	    subtailp = &owep->owe_qnext;
+	}
+    }
+
+    closedir(dir);
+    return subdirs;
+}
+
+/*
+ * Each thread (including the caller) takes directories off the queue
+ * until it's empty and no one is still reading one
+ */
+static void *
+extOsWalkWorker (void *arg)
+{
+    os_walk_t *owp = arg;
+    os_walk_entry_t *dirp, *subdirs, *lastp;
+
+    pthread_mutex_lock(&owp->ow_lock);
+
+    for (;;) {
+	while (owp->ow_head == NULL && owp->ow_active > 0)
+	    pthread_cond_wait(&owp->ow_cond, &owp->ow_lock);
+
+	dirp = owp->ow_head;
+	if (dirp == NULL)
+	    break;		/* Queue is empty and no one can add to it */
+
+	owp->ow_head = dirp->owe_qnext;
+	owp->ow_active += 1;
+	pthread_mutex_unlock(&owp->ow_lock);
+
+	subdirs = extOsWalkRead(dirp, owp->ow_sop);
+
+	pthread_mutex_lock(&owp->ow_lock);
+	owp->ow_active -= 1;
+
+	if (subdirs) {
+	    for (lastp = subdirs; lastp->owe_qnext; lastp = lastp->owe_qnext)
+		continue;
+
+	    if (owp->ow_head)
+		owp->ow_tail->owe_qnext = subdirs;
+	    else
+		owp->ow_head = subdirs;
+	    owp->ow_tail = lastp;
 	}
+
+	if (owp->ow_head || owp->ow_active == 0)
+	    pthread_cond_broadcast(&owp->ow_cond);
     }
+
+    pthread_mutex_unlock(&owp->ow_lock);
+    return NULL;
+}
+
+/*
+ * Decide which entries to emit: with <match>, an entry is kept if its
+ * name matches or if it holds something that does.  Without one (a
+ * NULL pattern), everything is kept.
+ */
+static int
+extOsWalkKeep (os_walk_entry_t *owep, const char *pattern)
+{
+    const char *name;
+    int any = FALSE;
+
+    for ( ; owep; owep = owep->owe_next) {
+	owep->owe_keep = extOsWalkKeep(owep->owe_children, pattern);
+
+	if (pattern == NULL)
+	    owep->owe_keep = TRUE;
+	else if (!owep->owe_keep) {
+	    name = strrchr(owep->owe_path, '/');
+	    name = name ? name + 1 : owep->owe_path;
+	    owep->owe_keep = (fnmatch(pattern, name, 0) == 0);
+	}
+
+	any |= owep->owe_keep;
+    }
+
+    return any;
+}
+
+static void
+extOsWalkBuild (xmlDocPtr docp, xmlNodePtr parent, os_walk_entry_t *owep,
+		statOptions_t *sop)
+{
+    xmlNodePtr nodep;
+
+    for ( ; owep; owep = owep->owe_next) {
+	if (!owep->owe_keep)
+	    continue;
+
+	nodep = xmlNewDocNode(docp, NULL, (const xmlChar *) ELT_ENTRY, NULL);
+	if (nodep == NULL)
+	    return;
+
+	xmlAddChild(parent, nodep);
+	extOsStatInfo(docp, nodep, owep->owe_path, &owep->owe_stat, 0, sop);
+	extOsWalkBuild(docp, nodep, owep->owe_children, sop);
+    }
+}
+
+/*
+ * Walk the directory at "path", adding an entry under "parent" for
+ * each thing in it, "recurse" levels deep
+ */
+static void
+extOsWalk (xmlDocPtr docp, xmlNodePtr parent, const char *path,
+	   int recurse, statOptions_t *sop)
+{
+    pthread_t tids[SO_THREADS_MAX];
+    os_walk_entry_t *top;
+    os_walk_t ow;
+    int i, nthreads = 0;
+
+    top = extOsWalkEntry(path, NULL);
+    if (top == NULL)
+	return;
+
+    top->owe_recurse = recurse;
+
+    bzero(&ow, sizeof(ow));
+    pthread_mutex_init(&ow.ow_lock, NULL);
+    pthread_cond_init(&ow.ow_cond, NULL);
+    ow.ow_head = ow.ow_tail = top;
+    ow.ow_sop = sop;
+
+    /* Only a real recursion is worth the threads */
+    if (recurse != 1) {
+	for (i = 1; i < sop->so_threads; i++) {
+	    if (pthread_create(&tids[nthreads], NULL, extOsWalkWorker, &ow))
+		break;
+	    nthreads += 1;
+	}
+    }
+
+    extOsWalkWorker(&ow);
+
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+
+    pthread_cond_destroy(&ow.ow_cond);
+    pthread_mutex_destroy(&ow.ow_lock);
+
+    extOsWalkKeep(top->owe_children, sop->so_match);
+    extOsWalkBuild(docp, parent, top->owe_children, sop);
+    extOsWalkFree(top);
 }
 
 static void
@@ -1228,7 +1564,7 @@ extOsStat (xmlXPathParserContext *ctxt, int nargs)
     xmlXPathObject *stack[nargs];	/* Stack for args as objects */
     xmlXPathObject *xop;
     char **cpp;
-    int ndx, rc, i, recurse;
+    int ndx, rc, i, f, recurse;
     glob_t gl;
     int gflags = GLOB_APPEND | GLOB_TILDE | GLOB_NOCHECK;
     statOptions_t so;
@@ -1280,9 +1616,25 @@ extOsStat (xmlXPathParserContext *ctxt, int nargs)
 		    } else if (streq(key, ELT_DEPTH)) {
 			so.so_depth = strtol(value, NULL, 0);
 
+		    } else if (streq(key, ELT_FIELD)) {
+			for (f = 0; extOsStatFields[f].osf_name; f++) {
+			    if (value && streq(value, extOsStatFields[f].osf_name))
+				break;
+			}
+
+			if (extOsStatFields[f].osf_name)
+			    so.so_fields |= extOsStatFields[f].osf_bit;
+			else
+			    LX_ERR("os:stat: unknown field: %s\n",
+				   value ?: "");
+
 		    } else if (streq(key, ELT_HIDDEN)) {
 			so.so_hidden = TRUE;
 
+		    } else if (streq(key, ELT_MATCH)) {
+			if (value && so.so_match == NULL)
+			    so.so_match = (char *) xmlStrdup((const xmlChar *) value);
+
 		    } else if (streq(key, ELT_NAME)) {
 			rc = glob(value, gflags, NULL, &gl);
 			if (rc) {
@@ -1293,6 +1645,13 @@ extOsStat (xmlXPathParserContext *ctxt, int nargs)
 
 		    } else if (streq(key, ELT_RECURSE)) {
 			so.so_recurse = TRUE;
+
+		    } else if (streq(key, ELT_THREADS)) {
+			so.so_threads = value ? strtol(value, NULL, 0) : 0;
+			if (so.so_threads < 1)
+			    so.so_threads = 1;
+			else if (so.so_threads > SO_THREADS_MAX)
+			    so.so_threads = SO_THREADS_MAX;
 		    }
 		}
 	    }
@@ -1302,12 +1661,496 @@ extOsStat (xmlXPathParserContext *ctxt, int nargs)
     }
 
     recurse = so.so_depth ?: so.so_recurse ? -1 : 1;
+    if (so.so_fields == 0)
+	so.so_fields = so.so_brief ? SOF_BRIEF : SOF_ALL;
+    if (so.so_threads == 0)
+	so.so_threads = SO_THREADS;
+
     for (cpp = gl.gl_pathv; *cpp; cpp++)
 	extOsStatPath(results, container, NULL, *cpp, NULL, recurse, &so);
 
+    if (so.so_match)
+	xmlFree((char *) so.so_match);
+
     valuePush(ctxt, xmlXPathWrapNodeSet(results));
 }
 
+/*
+ * os:watch: wait for changes to files and directories.  A watcher is
+ * kept for each distinct set of paths, so a script that calls os:watch
+ * in a loop sees the changes that happened between its calls.  The
+ * kernel does the watching (inotify(7) or kqueue(2)); nothing polls.
+ */
+#if defined(HAVE_SYS_INOTIFY_H) || defined(HAVE_SYS_EVENT_H)
+
+#define OS_WATCH_MAX	16	/* Watchers kept open at once */
+#define OS_WATCH_RETRY	1000	/* Milliseconds between looks for missing paths */
+
+typedef struct os_watch_path_s {
+    int owp_id;			/* Watch descriptor (inotify) or fd (kqueue) */
+    char *owp_path;		/* Path being watched */
+} os_watch_path_t;
+
+typedef struct os_watch_s {
+    TAILQ_ENTRY(os_watch_s) osw_link; /* Next watcher, most recent first */
+    char *osw_key;		/* Our paths, joined with newlines */
+    int osw_fd;			/* inotify or kqueue descriptor */
+    int osw_missing;		/* Number of paths not being watched */
+    unsigned osw_count;		/* Number of paths */
+    os_watch_path_t osw_paths[]; /* Paths */
+} os_watch_t;
+
+static TAILQ_HEAD(os_watch_list_s, os_watch_s) extOsWatchers
+    = TAILQ_HEAD_INITIALIZER(extOsWatchers);
+static unsigned extOsWatchCount;
+
+static void
+extOsWatchEvent (xmlDocPtr docp, xmlNodeSet *results, const char *path,
+		 const char *name, const char *type)
+{
+    xmlNodePtr nodep;
+    char *full = NULL;
+
+    nodep = xmlNewDocNode(docp, NULL, (const xmlChar *) ELT_EVENT, NULL);
+    if (nodep == NULL)
+	return;
+
+    if (name && *name) {
+	size_t plen = strlen(path), nlen = strlen(name);
+
+	if (plen > 0 && path[plen - 1] == '/')
+	    plen -= 1;
+
+	full = alloca(plen + nlen + 2);
+	memcpy(full, path, plen);
+	full[plen] = '/';
+	memcpy(full + plen + 1, name, nlen + 1);
+	path = full;
+    }
+
+    slaxMakeNode(docp, nodep, ELT_NAME, path, NULL, NULL);
+    slaxMakeNode(docp, nodep, ELT_TYPE, type, NULL, NULL);
+
+    xmlAddChild((xmlNodePtr) docp, nodep);
+    xmlXPathNodeSetAdd(results, nodep);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+
+#define OS_WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+	| IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM \
+	| IN_MOVED_TO)
+
+static int
+extOsWatchOpen (void)
+{
+    return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+static int
+extOsWatchAdd (os_watch_t *oswp, os_watch_path_t *owpp)
+{
+    owpp->owp_id = inotify_add_watch(oswp->osw_fd, owpp->owp_path,
+				     OS_WATCH_MASK);
+    return (owpp->owp_id < 0) ? -1 : 0;
+}
+
+static void
+extOsWatchRemove (os_watch_t *oswp UNUSED, os_watch_path_t *owpp)
+{
+    owpp->owp_id = -1;		/* Closing the inotify fd drops the rest */
+}
+
+static const char *
+extOsWatchType (uint32_t mask)
+{
+    if (mask & IN_CREATE)
+	return "created";
+    if (mask & (IN_DELETE | IN_DELETE_SELF))
+	return "deleted";
+    if (mask & (IN_MOVED_FROM | IN_MOVE_SELF))
+	return "moved-from";
+    if (mask & IN_MOVED_TO)
+	return "moved-to";
+    if (mask & IN_ATTRIB)
+	return "attributes";
+    return "modified";
+}
+
+/*
+ * Read whatever events are pending, returning the number seen
+ */
+static int
+extOsWatchRead (os_watch_t *oswp, xmlDocPtr docp, xmlNodeSet *results)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *iep;
+    os_watch_path_t *owpp;
+    ssize_t len;
+    char *cp;
+    unsigned i;
+    int count = 0;
+
+    for (;;) {
+	len = read(oswp->osw_fd, buf, sizeof(buf));
+	if (len <= 0)
+	    break;
+
+	for (cp = buf; cp < buf + len; cp += sizeof(*iep) + iep->len) {
+	    iep = (const struct inotify_event *) cp;
+
+	    for (i = 0, owpp = oswp->osw_paths; i < oswp->osw_count;
+		 i++, owpp++)
+		if (owpp->owp_id == iep->wd)
+		    break;
+	    if (i == oswp->osw_count)
+		continue;
+
+	    if (iep->mask & IN_IGNORED) {
+		/* The path is gone; look for it to come back */
+		owpp->owp_id = -1;
+		oswp->osw_missing += 1;
+		continue;
+	    }
+
+	    /* IN_CLOSE_WRITE follows the IN_MODIFYs it would repeat */
+	    if ((iep->mask & OS_WATCH_MASK) == IN_CLOSE_WRITE)
+		continue;
+
+	    extOsWatchEvent(docp, results, owpp->owp_path,
+			    iep->len ? iep->name : NULL,
+			    extOsWatchType(iep->mask));
+	    count += 1;
+	}
+    }
+
+    return count;
+}
+
+#else /* HAVE_SYS_INOTIFY_H */
+#include <sys/event.h>
+
+#ifndef O_EVTONLY
+#define O_EVTONLY O_RDONLY
+#endif /* O_EVTONLY */
+
+static int
+extOsWatchOpen (void)
+{
+    return kqueue();
+}
+
+static int
+extOsWatchAdd (os_watch_t *oswp, os_watch_path_t *owpp)
+{
+    struct kevent kev;
+    int fd;
+
+    fd = open(owpp->owp_path, O_EVTONLY | O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+
+    EV_SET(&kev, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+	   NOTE_ATTRIB | NOTE_DELETE | NOTE_EXTEND | NOTE_LINK
+	   | NOTE_RENAME | NOTE_WRITE, 0, owpp);
+    if (kevent(oswp->osw_fd, &kev, 1, NULL, 0, NULL) < 0) {
+	close(fd);
+	return -1;
+    }
+
+    owpp->owp_id = fd;
+    return 0;
+}
+
+static void
+extOsWatchRemove (os_watch_t *oswp UNUSED, os_watch_path_t *owpp)
+{
+    if (owpp->owp_id >= 0)
+	close(owpp->owp_id);	/* Closing the fd drops the kevent */
+    owpp->owp_id = -1;
+}
+
+static const char *
+extOsWatchType (unsigned fflags)
+{
+    if (fflags & NOTE_DELETE)
+	return "deleted";
+    if (fflags & NOTE_RENAME)
+	return "moved-from";
+    if (fflags & (NOTE_WRITE | NOTE_EXTEND | NOTE_LINK))
+	return "modified";
+    return "attributes";
+}
+
+static int
+extOsWatchRead (os_watch_t *oswp, xmlDocPtr docp, xmlNodeSet *results)
+{
+    struct kevent kevs[64];
+    struct timespec zero = { 0, 0 };
+    os_watch_path_t *owpp;
+    int i, rc, count = 0;
+
+    for (;;) {
+	rc = kevent(oswp->osw_fd, NULL, 0, kevs, 64, &zero);
+	if (rc <= 0)
+	    break;
+
+	for (i = 0; i < rc; i++) {
+	    owpp = kevs[i].udata;
+	    extOsWatchEvent(docp, results, owpp->owp_path, NULL,
+			    extOsWatchType(kevs[i].fflags));
+	    count += 1;
+
+	    if (kevs[i].fflags & (NOTE_DELETE | NOTE_RENAME)) {
+		/* Watch for whatever appears at this path next */
+		extOsWatchRemove(oswp, owpp);
+		oswp->osw_missing += 1;
+	    }
+	}
+    }
+
+    return count;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static void
+extOsWatchFree (os_watch_t *oswp)
+{
+    unsigned i;
+
+    TAILQ_REMOVE(&extOsWatchers, oswp, osw_link);
+    extOsWatchCount -= 1;
+
+    for (i = 0; i < oswp->osw_count; i++) {
+	extOsWatchRemove(oswp, &oswp->osw_paths[i]);
+	xmlFree(oswp->osw_paths[i].owp_path);
+    }
+
+    if (oswp->osw_fd >= 0)
+	close(oswp->osw_fd);
+    xmlFree(oswp->osw_key);
+    xmlFree(oswp);
+}
+
+/*
+ * Find the watcher for a set of paths, making one if needed
+ */
+static os_watch_t *
+extOsWatchFind (char **paths, unsigned count)
+{
+    os_watch_t *oswp;
+    size_t len = 0;
+    unsigned i;
+    char *key, *cp;
+
+    for (i = 0; i < count; i++)
+	len += strlen(paths[i]) + 1;
+
+    key = xmlMalloc(len + 1);
+    if (key == NULL)
+	return NULL;
+
+    for (i = 0, cp = key; i < count; i++) {
+	len = strlen(paths[i]);
+	memcpy(cp, paths[i], len);
+	cp += len;
+	*cp++ = '\n';
+    }
+    *cp = '\0';
+
+    TAILQ_FOREACH(oswp, &extOsWatchers, osw_link) {
+	if (streq(oswp->osw_key, key)) {
+	    xmlFree(key);
+
+	    /* Move to the front, so the least recently used gets closed */
+	    TAILQ_REMOVE(&extOsWatchers, oswp, osw_link);
+	    TAILQ_INSERT_HEAD(&extOsWatchers, oswp, osw_link);
+	    return oswp;
+	}
+    }
+
+    oswp = xmlMalloc(sizeof(*oswp) + count * sizeof(oswp->osw_paths[0]));
+    if (oswp == NULL) {
+	xmlFree(key);
+	return NULL;
+    }
+
+    bzero(oswp, sizeof(*oswp) + count * sizeof(oswp->osw_paths[0]));
+    oswp->osw_key = key;
+    oswp->osw_fd = extOsWatchOpen();
+    if (oswp->osw_fd < 0) {
+	LX_ERR("os:watch: cannot start watching: %s\n", strerror(errno));
+	xmlFree(key);
+	xmlFree(oswp);
+	return NULL;
+    }
+
+    if (extOsWatchCount >= OS_WATCH_MAX)
+	extOsWatchFree(TAILQ_LAST(&extOsWatchers, os_watch_list_s));
+
+    TAILQ_INSERT_HEAD(&extOsWatchers, oswp, osw_link);
+    extOsWatchCount += 1;
+
+    for (i = 0; i < count; i++) {
+	os_watch_path_t *owpp = &oswp->osw_paths[i];
+
+	oswp->osw_count += 1;
+	owpp->owp_path = (char *) xmlStrdup((const xmlChar *) paths[i]);
+	if (owpp->owp_path == NULL || extOsWatchAdd(oswp, owpp) < 0) {
+	    owpp->owp_id = -1;
+	    oswp->osw_missing += 1;
+	}
+    }
+
+    return oswp;
+}
+
+/*
+ * Try again to watch paths that didn't exist; report any that now do
+ */
+static int
+extOsWatchRetry (os_watch_t *oswp, xmlDocPtr docp, xmlNodeSet *results,
+		 int report)
+{
+    os_watch_path_t *owpp;
+    unsigned i;
+    int count = 0;
+
+    for (i = 0, owpp = oswp->osw_paths; i < oswp->osw_count; i++, owpp++) {
+	if (owpp->owp_id >= 0 || owpp->owp_path == NULL)
+	    continue;
+
+	if (extOsWatchAdd(oswp, owpp) < 0) {
+	    owpp->owp_id = -1;
+	    continue;
+	}
+
+	oswp->osw_missing -= 1;
+	if (report) {
+	    extOsWatchEvent(docp, results, owpp->owp_path, NULL, "created");
+	    count += 1;
+	}
+    }
+
+    return count;
+}
+
+static void
+extOsWatch (xmlXPathParserContext *ctxt, int nargs)
+{
+    xmlXPathObject *stack[nargs];	/* Stack for args as objects */
+    xmlXPathObject *xop;
+    glob_t gl;
+    int gflags = GLOB_APPEND | GLOB_TILDE | GLOB_NOCHECK;
+    int ndx, i, rc, count, wait;
+    long timeout = -1;		/* Milliseconds; -1 means forever */
+    struct timespec now, end;
+    struct pollfd pfd;
+    os_watch_t *oswp;
+
+    for (ndx = 0; ndx < nargs; ndx++)
+	stack[nargs - 1 - ndx] = valuePop(ctxt);
+
+    bzero(&gl, sizeof(gl));
+
+    xmlDocPtr container = slaxMakeRtf(ctxt);
+    xmlNodeSet *results = xmlXPathNodeSetCreate(NULL);
+
+    for (ndx = 0; ndx < nargs; ndx++) {
+	xop = stack[ndx];
+	if (xop == NULL)	/* Should not occur */
+	    continue;
+
+	if (xop->stringval) {
+	    glob((const char *) xop->stringval, gflags, NULL, &gl);
+
+	} else if (xop->nodesetval) {
+	    for (i = 0; i < xop->nodesetval->nodeNr; i++) {
+		xmlNodePtr nop, cop;
+		const char *value, *key;
+
+		nop = xop->nodesetval->nodeTab[i];
+		for (cop = nop->children; cop; cop = cop->next) {
+		    if (cop->type != XML_ELEMENT_NODE)
+			continue;
+
+		    key = xmlNodeName(cop);
+		    if (!key)
+			continue;
+		    value = xmlNodeValue(cop);
+
+		    if (streq(key, ELT_NAME)) {
+			if (value)
+			    glob(value, gflags, NULL, &gl);
+
+		    } else if (streq(key, ELT_TIMEOUT)) {
+			timeout = value ? strtod(value, NULL) * MSEC_PER_SEC : 0;
+			if (timeout < 0)
+			    timeout = 0;
+		    }
+		}
+	    }
+	}
+
+	xmlXPathFreeObject(xop);
+    }
+
+    if (gl.gl_pathc == 0 || container == NULL) {
+	LX_ERR("os:watch: no paths to watch\n");
+	goto done;
+    }
+
+    oswp = extOsWatchFind(gl.gl_pathv, gl.gl_pathc);
+    if (oswp == NULL)
+	goto done;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout / MSEC_PER_SEC;
+    end.tv_nsec += (timeout % MSEC_PER_SEC) * NSEC_PER_MSEC;
+    if (end.tv_nsec >= (long) NSEC_PER_SEC) {
+	end.tv_sec += 1;
+	end.tv_nsec -= NSEC_PER_SEC;
+    }
+
+    for (;;) {
+	count = extOsWatchRead(oswp, container, results);
+	if (oswp->osw_missing)
+	    count += extOsWatchRetry(oswp, container, results, TRUE);
+	if (count)
+	    break;
+
+	wait = -1;
+	if (timeout >= 0) {
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    wait = (end.tv_sec - now.tv_sec) * MSEC_PER_SEC
+		+ (end.tv_nsec - now.tv_nsec) / (long) NSEC_PER_MSEC;
+	    if (wait <= 0)
+		break;
+	}
+
+	/* Missing paths can't be watched, so we have to look for them */
+	if (oswp->osw_missing && (wait < 0 || wait > OS_WATCH_RETRY))
+	    wait = OS_WATCH_RETRY;
+
+	pfd.fd = oswp->osw_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, wait);
+	if (rc < 0 && errno != EINTR) {
+	    LX_ERR("os:watch: %s\n", strerror(errno));
+	    break;
+	}
+    }
+
+ done:
+    globfree(&gl);
+    valuePush(ctxt, xmlXPathWrapNodeSet(results));
+}
+
+#endif /* HAVE_SYS_INOTIFY_H || HAVE_SYS_EVENT_H */
+
 static void
 extUserInfo (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 {
@@ -1386,6 +2229,13 @@ slax_function_table_t slaxOsTable[] = {
 	"Change ownership of a file",
 	"(ownership, file-spec, ...)", XPATH_UNDEFINED,
     },
+#if defined(HAVE_SYS_INOTIFY_H) || defined(HAVE_SYS_EVENT_H)
+    {
+	"watch", extOsWatch,
+	"Wait for files to change",
+	"(file-spec, ...)", XPATH_XSLT_TREE,
+    },
+#endif /* HAVE_SYS_INOTIFY_H || HAVE_SYS_EVENT_H */
     {
 	"user-info", extUserInfo,
 	"Return information about user running the script",
@@ -1401,3 +2251,15 @@ SLAX_DYN_FUNC(slaxDynLibInit)
 
     return SLAX_DYN_VERSION;
 }
+
+SLAX_DYN_FUNC(slaxDynLibClean)
+{
+#if defined(HAVE_SYS_INOTIFY_H) || defined(HAVE_SYS_EVENT_H)
+    os_watch_t *oswp;
+
+    while ((oswp = TAILQ_FIRST(&extOsWatchers)) != NULL)
+	extOsWatchFree(oswp);
+#endif /* HAVE_SYS_INOTIFY_H || HAVE_SYS_EVENT_H */
+
+    return SLAX_DYN_VERSION;
+}
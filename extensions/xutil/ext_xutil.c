@@ -34,6 +34,10 @@
 #include <libslax/slaxinternals.h>
 #include <libpsu/psucommon.h>
 #include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xixml.h>
 
 #include "jsonlexer.h"
 #include "jsonwriter.h"
@@ -45,28 +49,95 @@
 #define ELT_CLEAN_NAMES	"clean-names"
 #define VAL_NO		"no"
 #define VAL_YES		"yes"
+#define ELT_PARSER	"parser"
+#define VAL_XI		"xi"
+#define VAL_LIBXML2	"libxml2"
+#define ELT_MAX_BYTES	"max-bytes"
+
+/*
+ * Is this argument a set of string-to-xml options?  It must be a
+ * node-set holding nothing but our option elements, so an ordinary
+ * node-set argument still has its string value parsed.
+ */
+static int
+extXutilStringToXmlOptions (xmlXPathObjectPtr xop, int *use_xi)
+{
+    xmlNodePtr nop, cop;
+    const char *key, *value;
+    int i, seen = FALSE, xi = FALSE;
+
+    if (xop == NULL || xop->nodesetval == NULL
+	    || xop->nodesetval->nodeNr == 0)
+	return FALSE;
+
+    for (i = 0; i < xop->nodesetval->nodeNr; i++) {
+	nop = xop->nodesetval->nodeTab[i];
+
+	for (cop = nop->children; cop; cop = cop->next) {
+	    if (cop->type == XML_TEXT_NODE && xmlIsBlankNode(cop))
+		continue;
+	    if (cop->type != XML_ELEMENT_NODE)
+		return FALSE;
+
+	    key = xmlNodeName(cop);
+	    if (key == NULL || !streq(key, ELT_PARSER))
+		return FALSE;
+
+	    value = xmlNodeValue(cop);
+	    if (value && streq(value, VAL_XI))
+		xi = TRUE;
+	    else if (value && streq(value, VAL_LIBXML2))
+		xi = FALSE;
+	    else
+		return FALSE;
+	    seen = TRUE;
+	}
+    }
+
+    if (seen)
+	*use_xi = xi;
+    return seen;
+}
 
 /*
  * Parse a string into an XML hierarchy:
  *     var $xml = xutil:string-to-xml($string);
  * Multiple strings can be passed in and they are automatically concatenated:
  *     var $xml = xutil:string-to-xml($string1, $string2, $string3);
+ * A final node-set argument can hold options:
+ *     var $xml = xutil:string-to-xml($string, { <parser> "xi"; });
+ * The "xi" parser builds nodes straight from libxi's tokenizer, which
+ * is much quicker for small, simple fragments; anything it doesn't
+ * handle goes to libxml2 as usual.
  */
 static void
 extXutilStringToXml (xmlXPathParserContext *ctxt, int nargs)
 {
     xmlXPathObjectPtr ret = NULL;
+    xmlXPathObjectPtr objstack[nargs]; /* Stack for arguments */
     xmlDocPtr xmlp = NULL;
     xmlDocPtr container = NULL;
     xmlNodePtr childp;
     xmlChar *strstack[nargs];	/* Stack for strings */
-    int ndx;
+    int ndx, use_xi = FALSE;
     int bufsiz;
-    char *buf;
+    char *buf, *xibuf;
+
+    for (ndx = nargs - 1; ndx >= 0; ndx--)
+	objstack[ndx] = valuePop(ctxt);
+
+    if (nargs > 1
+	    && extXutilStringToXmlOptions(objstack[nargs - 1], &use_xi)) {
+	xmlXPathFreeObject(objstack[nargs - 1]);
+	nargs -= 1;
+    }
 
     bzero(strstack, sizeof(strstack));
-    for (ndx = nargs - 1; ndx >= 0; ndx--) {
-	strstack[ndx] = xmlXPathPopString(ctxt);
+    for (ndx = 0; ndx < nargs; ndx++) {
+	if (objstack[ndx]) {
+	    strstack[ndx] = xmlXPathCastToString(objstack[ndx]);
+	    xmlXPathFreeObject(objstack[ndx]);
+	}
     }
 
     for (bufsiz = 0, ndx = 0; ndx < nargs; ndx++)
@@ -84,18 +155,45 @@ extXutilStringToXml (xmlXPathParserContext *ctxt, int nargs)
     }
 
     /* buf now has the complete string */
+
+    if (use_xi) {
+	/* The tokenizer writes into its buffer, so give it a copy */
+	xibuf = xmlMalloc(bufsiz + 1);
+	container = slaxMakeRtf(ctxt);
+	ret = xmlXPathNewNodeSet(NULL);
+
+	if (xibuf && container && ret) {
+	    memcpy(xibuf, buf, bufsiz + 1);
+	    childp = xi_xml_parse_fragment(container, xibuf, bufsiz);
+	    if (childp) {
+		xmlAddChild((xmlNodePtr) container, childp);
+		xmlXPathNodeSetAdd(ret->nodesetval, childp);
+		xmlFree(xibuf);
+		goto bail;
+	    }
+	}
+
+	if (xibuf)
+	    xmlFree(xibuf);
+	/* Otherwise let libxml2 have a go */
+    }
+
     xmlp = xmlReadMemory(buf, bufsiz, "raw_data", NULL, XML_PARSE_NOENT);
     if (xmlp == NULL)
 	goto bail;
 
-    ret = xmlXPathNewNodeSet(NULL);
-    if (ret == NULL)
-	goto bail;
+    if (ret == NULL) {
+	ret = xmlXPathNewNodeSet(NULL);
+	if (ret == NULL)
+	    goto bail;
+    }
 
     /* Fake an RVT to hold the output of the template */
-    container = slaxMakeRtf(ctxt);
-    if (container == NULL)
-	goto bail;
+    if (container == NULL) {
+	container = slaxMakeRtf(ctxt);
+	if (container == NULL)
+	    goto bail;
+    }
 
     /*
      * XXX There should be a way to read the xml input directly
@@ -125,43 +223,271 @@ bail:
     }
 }
 
+/*
+ * Output for xml-to-string and xml-to-json goes into a single buffer,
+ * sized up front from an estimate of the content.  A non-zero xo_max
+ * bounds the output; once it's reached, the callbacks return -1 so
+ * the serializer stops producing anything more.
+ */
+typedef struct xutil_output_s {
+    char *xo_buf;		/* Output buffer */
+    size_t xo_len;		/* Bytes used in xo_buf */
+    size_t xo_size;		/* Bytes allocated for xo_buf */
+    size_t xo_max;		/* Maximum output length (or zero) */
+    int xo_full;		/* Hit xo_max; output is truncated */
+} xutil_output_t;
+
+#define XUTIL_OUTPUT_MIN	256 /* Smallest buffer we'll allocate */
+#define XUTIL_ELT_XML		8 /* Estimated markup per XML element */
+#define XUTIL_ELT_JSON		10 /* Estimated markup per JSON member */
+
+/*
+ * Guess how many bytes the serialized form of a node will take, by
+ * adding up names and content plus "per_elt" bytes of markup for
+ * each element.  We stop counting once we pass "limit", since the
+ * guess is only used to size the output buffer.
+ */
+static size_t
+extXutilEstimate (xmlNodePtr top, size_t per_elt, size_t limit)
+{
+    xmlNodePtr nop = top;
+    xmlAttrPtr attr;
+    size_t total = 0, depth = 0;
+
+    if (top == NULL || top->type == XML_NAMESPACE_DECL)
+	return 0;
+
+    for (;;) {
+	switch (nop->type) {
+	case XML_ELEMENT_NODE:
+	    total += 2 * xmlStrlen(nop->name) + per_elt + 2 * depth;
+	    for (attr = nop->properties; attr; attr = attr->next) {
+		total += xmlStrlen(attr->name) + 4;
+		if (attr->children && attr->children->content)
+		    total += xmlStrlen(attr->children->content);
+	    }
+	    break;
+
+	case XML_TEXT_NODE:
+	case XML_CDATA_SECTION_NODE:
+	case XML_COMMENT_NODE:
+	case XML_PI_NODE:
+	    total += xmlStrlen(nop->content) + per_elt;
+	    break;
+
+	default:
+	    break;
+	}
+
+	if (limit && total >= limit)
+	    return limit;
+
+	/* Descend into anything that can have real children */
+	if (nop->children && (nop->type == XML_ELEMENT_NODE
+			      || nop->type == XML_ATTRIBUTE_NODE
+			      || nop->type == XML_DOCUMENT_NODE
+			      || nop->type == XML_DOCUMENT_FRAG_NODE)) {
+	    nop = nop->children;
+	    depth += 1;
+	    continue;
+	}
+
+	while (nop != top && nop->next == NULL) {
+	    nop = nop->parent;
+	    depth -= 1;
+	}
+
+	if (nop == top)
+	    break;
+	nop = nop->next;
+    }
+
+    return total;
+}
+
+/*
+ * Estimate the output for the nodes in a node-set
+ */
+static size_t
+extXutilEstimateSet (xmlNodeSetPtr nodeset, size_t per_elt, size_t limit)
+{
+    size_t size = 0;
+    int i;
+
+    if (nodeset == NULL)
+	return 0;
+
+    for (i = 0; i < nodeset->nodeNr; i++) {
+	size += extXutilEstimate(nodeset->nodeTab[i], per_elt,
+				 limit ? limit - size : 0);
+	if (limit && size >= limit)
+	    break;
+    }
+
+    return size;
+}
+
+/*
+ * Allocate our buffer, based on the estimated output size
+ */
+static int
+extXutilOutputInit (xutil_output_t *xop, size_t size, size_t max)
+{
+    bzero(xop, sizeof(*xop));
+    xop->xo_max = max;
+
+    size += size / 8 + 1;	/* A bit of slack for escapes */
+    if (max && size > max + 1)
+	size = max + 1;
+    if (size < XUTIL_OUTPUT_MIN)
+	size = XUTIL_OUTPUT_MIN;
+
+    xop->xo_buf = xmlMalloc(size);
+    if (xop->xo_buf == NULL)
+	return -1;
+
+    xop->xo_size = size;
+    return 0;
+}
+
+/*
+ * Add data to our output buffer, honoring the size limit.  Returns
+ * the number of bytes added, or -1 if the output is full.
+ */
+static int
+extXutilOutputAdd (xutil_output_t *xop, const char *buf, size_t len)
+{
+    size_t size;
+    char *cp;
+
+    if (xop->xo_full)
+	return -1;
+
+    if (xop->xo_max && xop->xo_len + len > xop->xo_max) {
+	len = xop->xo_max - xop->xo_len;
+
+	/* Don't leave part of a UTF-8 character behind */
+	while (len > 0 && (buf[len] & 0xc0) == 0x80)
+	    len -= 1;
+
+	xop->xo_full = TRUE;
+    }
+
+    if (xop->xo_len + len + 1 > xop->xo_size) {
+	/* Our estimate was short; this should be rare */
+	size = xop->xo_size * 2;
+	if (size < xop->xo_len + len + 1)
+	    size = xop->xo_len + len + 1;
+
+	cp = xmlRealloc(xop->xo_buf, size);
+	if (cp == NULL) {
+	    xop->xo_full = TRUE;
+	    return -1;
+	}
+
+	xop->xo_buf = cp;
+	xop->xo_size = size;
+    }
+
+    memcpy(xop->xo_buf + xop->xo_len, buf, len);
+    xop->xo_len += len;
+
+    return xop->xo_full ? -1 : (int) len;
+}
+
+/*
+ * Push our output buffer as the function's return value, handing
+ * the buffer over to the XPath object
+ */
+static void
+extXutilOutputReturn (xmlXPathParserContext *ctxt, xutil_output_t *xop)
+{
+    char *cp;
+
+    if (xop->xo_buf == NULL || xop->xo_len == 0) {
+	if (xop->xo_buf)
+	    xmlFree(xop->xo_buf);
+	xmlXPathReturnEmptyString(ctxt);
+	return;
+    }
+
+    xop->xo_buf[xop->xo_len] = '\0';
+
+    /* Give back the space if we overestimated by a lot */
+    if (xop->xo_size > 2 * (xop->xo_len + 1) + XUTIL_OUTPUT_MIN) {
+	cp = xmlRealloc(xop->xo_buf, xop->xo_len + 1);
+	if (cp)
+	    xop->xo_buf = cp;
+    }
+
+    valuePush(ctxt, xmlXPathWrapCString(xop->xo_buf));
+    xop->xo_buf = NULL;
+}
+
+/*
+ * Turn a <max-bytes> value into a size, with zero meaning no limit
+ */
+static size_t
+extXutilMaxBytes (const char *value)
+{
+    unsigned long val;
+    char *ep;
+
+    if (value == NULL)
+	return 0;
+
+    val = strtoul(value, &ep, 10);
+    if (ep == value || val == 0) {
+	LX_ERR("invalid max-bytes value: %s\n", value);
+	return 0;
+    }
+
+    return val;
+}
+
+/*
+ * Hitting our size limit makes libxml2 think the write failed; we
+ * don't want that reported, so errors are ignored while we save.
+ * The error type varies between libxml2 versions, hence the cast.
+ */
+static void
+extXutilQuietError (void *opaque UNUSED, void *err UNUSED)
+{
+    return;
+}
+
 /*
  * Callback from the libxml2 IO mechanism to build the output string
  */
 static int
 extXutilRawwriteCallback (void *opaque, const char *buf, int len)
 {
-    slax_data_list_t *listp = opaque;
+    xutil_output_t *xop = opaque;
 
-    if (listp == NULL)
+    if (xop == NULL)
 	return 0;
 
-    slaxDataListAddLen(listp, buf, len);
-
-    return len;
+    return extXutilOutputAdd(xop, buf, len);
 }
 
 /*
- * Encode an XML hierarchy into a string:
- *     var $string = xutil:xml-to-string($xml);
- * Multiple XML hierarchies can be passed in:
- *     var $string = xutil:xml-to-string($xml1, $xml2, $xml3);
+ * Common code for xml-to-string and xml-to-string-limit; when
+ * "limited" is set, the first argument is the most bytes to write.
  */
 static void
-extXutilXmlToString (xmlXPathParserContext *ctxt, int nargs)
+extXutilXmlToStringCommon (xmlXPathParserContext *ctxt, int nargs,
+			   int limited)
 {
     xmlSaveCtxtPtr handle;
-    slax_data_list_t list;
-    slax_data_node_t *dnp;
+    xutil_output_t out;
     xmlXPathObjectPtr xop;
     xmlXPathObjectPtr objstack[nargs];	/* Stack for objects */
+    xmlStructuredErrorFunc old_func = NULL;
+    void *old_data = NULL;
+    size_t max = 0, size;
     int ndx;
-    char *buf;
-    int bufsiz;
     int hit = 0;
 
-    slaxDataListInit(&list);
-
     bzero(objstack, sizeof(objstack));
     for (ndx = nargs - 1; ndx >= 0; ndx--) {
 	objstack[ndx] = valuePop(ctxt);
@@ -169,21 +495,57 @@ extXutilXmlToString (xmlXPathParserContext *ctxt, int nargs)
 	    hit += 1;
     }
 
+    if (limited && objstack[0]) {
+	xmlChar *str = xmlXPathCastToString(objstack[0]);
+
+	max = extXutilMaxBytes((const char *) str);
+	xmlFree(str);
+
+	xmlXPathFreeObject(objstack[0]);
+	objstack[0] = NULL;
+	hit -= 1;
+    }
+
     /* If the args are empty, let's get out now */
     if (hit == 0) {
 	xmlXPathReturnEmptyString(ctxt);
-	return;
+	goto bail;
     }
 
-    /* We make a custom IO handler to save content into a list of strings */
-    handle = xmlSaveToIO(extXutilRawwriteCallback, NULL, &list, NULL,
+    /* Size the buffer once, from all the arguments together */
+    for (size = 0, ndx = 0; ndx < nargs; ndx++) {
+	xop = objstack[ndx];
+	if (xop == NULL || xop->nodesetval == NULL)
+	    continue;
+
+	size += extXutilEstimateSet(xop->nodesetval, XUTIL_ELT_XML,
+				    max ? max - size : 0);
+	if (max && size >= max)
+	    break;
+    }
+
+    if (extXutilOutputInit(&out, size, max) < 0) {
+	xmlXPathReturnEmptyString(ctxt);
+	goto bail;
+    }
+
+    /* We make a custom IO handler to save content into our buffer */
+    handle = xmlSaveToIO(extXutilRawwriteCallback, NULL, &out, NULL,
                  XML_SAVE_FORMAT | XML_SAVE_NO_DECL | XML_SAVE_NO_XHTML);
     if (handle == NULL) {
+	xmlFree(out.xo_buf);
 	xmlXPathReturnEmptyString(ctxt);
 	goto bail;
     }
 
-    for (ndx = 0; ndx < nargs; ndx++) {
+    if (max) {
+	old_func = xmlStructuredError;
+	old_data = xmlStructuredErrorContext;
+	xmlSetStructuredErrorFunc(NULL,
+				  (xmlStructuredErrorFunc) extXutilQuietError);
+    }
+
+    for (ndx = 0; ndx < nargs && !out.xo_full; ndx++) {
 	xop = objstack[ndx];
 	if (xop == NULL)
 	    continue;
@@ -191,7 +553,7 @@ extXutilXmlToString (xmlXPathParserContext *ctxt, int nargs)
 	if (xop->nodesetval) {
 	    xmlNodeSetPtr tab = xop->nodesetval;
 	    int i;
-	    for (i = 0; i < tab->nodeNr; i++) {
+	    for (i = 0; i < tab->nodeNr && !out.xo_full; i++) {
 		xmlNodePtr node = tab->nodeTab[i];
 
 		xmlSaveTree(handle, node);
@@ -202,56 +564,69 @@ extXutilXmlToString (xmlXPathParserContext *ctxt, int nargs)
 
     xmlSaveClose(handle);	/* This frees is also */
 
-    /* Now we turn the saved data from a linked list into a single string */
-    bufsiz = 0;
-    SLAXDATALIST_FOREACH(dnp, &list) {
-	bufsiz += dnp->dn_len;
-    }
-
-    /* If the objects are empty, let's get out now */
-    if (bufsiz == 0) {
-	xmlXPathReturnEmptyString(ctxt);
-	goto bail;
-    }
-
-    buf = xmlMalloc(bufsiz + 1);
-    if (buf == NULL) {
-	xmlXPathReturnEmptyString(ctxt);
-	goto bail;
-    }
-	
-    bufsiz = 0;
-    SLAXDATALIST_FOREACH(dnp, &list) {
-	memcpy(buf + bufsiz, dnp->dn_data, dnp->dn_len);
-	bufsiz += dnp->dn_len;
-    }
-    buf[bufsiz] = '\0';
+    if (max)
+	xmlSetStructuredErrorFunc(old_data, old_func);
 
-    valuePush(ctxt, xmlXPathWrapCString(buf));
+    extXutilOutputReturn(ctxt, &out);
 
  bail:
-    slaxDataListClean(&list);
-
     for (ndx = 0; ndx < nargs; ndx++)
 	xmlXPathFreeObject(objstack[ndx]);
 }
 
 /*
- * Callback from the libxml2 IO mechanism to build the output string
+ * Encode an XML hierarchy into a string:
+ *     var $string = xutil:xml-to-string($xml);
+ * Multiple XML hierarchies can be passed in:
+ *     var $string = xutil:xml-to-string($xml1, $xml2, $xml3);
+ */
+static void
+extXutilXmlToString (xmlXPathParserContext *ctxt, int nargs)
+{
+    extXutilXmlToStringCommon(ctxt, nargs, FALSE);
+}
+
+/*
+ * Encode XML hierarchies into a string of at most max-bytes bytes:
+ *     var $string = xutil:xml-to-string-limit(1024, $xml1, $xml2);
+ */
+static void
+extXutilXmlToStringLimit (xmlXPathParserContext *ctxt, int nargs)
+{
+    if (nargs < 1) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    extXutilXmlToStringCommon(ctxt, nargs, TRUE);
+}
+
+/*
+ * Callback from the JSON writer to build the output string
  */
 static int
 extXutilWriteCallback (void *opaque, const char *fmt, ...)
 {
-    slax_data_list_t *listp = opaque;
+    xutil_output_t *xop = opaque;
     char buf[BUFSIZ];
     char *cp = buf;
     size_t len;
     va_list vap;
+    int rc;
 
-    if (listp == NULL)
+    if (xop == NULL)
 	return 0;
 
     va_start(vap, fmt);
+
+    /* The JSON writer hands us whole chunks; skip the formatting */
+    if (streq(fmt, "%.*s")) {
+	len = va_arg(vap, int);
+	cp = va_arg(vap, char *);
+	va_end(vap);
+	return extXutilOutputAdd(xop, cp, len);
+    }
+
     len = vsnprintf(buf, sizeof(buf), fmt, vap);
     if (len >= sizeof(buf)) {
 	va_end(vap);
@@ -261,12 +636,12 @@ extXutilWriteCallback (void *opaque, const char *fmt, ...)
     }
     va_end(vap);
 
-    slaxDataListAddLen(listp, cp, len);
+    rc = extXutilOutputAdd(xop, cp, len);
 
     if (cp != buf)
 	free(cp);   /* Allocated by vasprintf() */
 
-    return len;
+    return rc;
 }
 
 static void
@@ -275,11 +650,9 @@ extXutilXmlToJson (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
     int i;
     xmlXPathObject *xop;
     const char *value, *key;
-    slax_data_list_t list;
-    slax_data_node_t *dnp;
-    char *buf;
-    int bufsiz;
+    xutil_output_t out;
     unsigned flags = 0;
+    size_t max = 0;
 
     if (nargs < 1 || nargs > 2) {
 	xmlXPathSetArityError(ctxt);
@@ -315,6 +688,8 @@ extXutilXmlToJson (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 		} else if (streq(key, ELT_QUOTES)) {
 		    if (streq(value, VAL_OPTIONAL))
 			flags |= JWF_OPTIONAL_QUOTES;
+		} else if (streq(key, ELT_MAX_BYTES)) {
+		    max = extXutilMaxBytes(value);
 		}
 	    }
 	}
@@ -330,9 +705,14 @@ extXutilXmlToJson (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 	return;
     }
 
-    slaxDataListInit(&list);
+    if (extXutilOutputInit(&out, extXutilEstimateSet(xop->nodesetval,
+						     XUTIL_ELT_JSON, max),
+			   max) < 0) {
+	xmlXPathReturnEmptyString(ctxt);
+	goto bail;
+    }
 
-    for (i = 0; i < xop->nodesetval->nodeNr; i++) {
+    for (i = 0; i < xop->nodesetval->nodeNr && !out.xo_full; i++) {
 	xmlNodePtr nop;
 
 	nop = xop->nodesetval->nodeTab[i];
@@ -341,35 +721,10 @@ extXutilXmlToJson (xmlXPathParserContext *ctxt UNUSED, int nargs UNUSED)
 	if (nop->type != XML_ELEMENT_NODE)
 	    continue;
 
-	slaxJsonWriteNode(extXutilWriteCallback, &list, nop, flags);
+	slaxJsonWriteNode(extXutilWriteCallback, &out, nop, flags);
     }
 
-    /* Now we turn the saved data from a linked list into a single string */
-    bufsiz = 0;
-    SLAXDATALIST_FOREACH(dnp, &list) {
-	bufsiz += dnp->dn_len;
-    }
-
-    /* If the objects are empty, let's get out now */
-    if (bufsiz == 0) {
-	xmlXPathReturnEmptyString(ctxt);
-	goto bail;
-    }
-
-    buf = xmlMalloc(bufsiz + 1);
-    if (buf == NULL) {
-	xmlXPathReturnEmptyString(ctxt);
-	goto bail;
-    }
-	
-    bufsiz = 0;
-    SLAXDATALIST_FOREACH(dnp, &list) {
-	memcpy(buf + bufsiz, dnp->dn_data, dnp->dn_len);
-	bufsiz += dnp->dn_len;
-    }
-    buf[bufsiz] = '\0';
-
-    valuePush(ctxt, xmlXPathWrapCString(buf));
+    extXutilOutputReturn(ctxt, &out);
 
  bail:
     xmlXPathFreeObject(xop);
@@ -517,10 +872,15 @@ slax_function_table_t slaxXutilTable[] = {
 	"Encodes XML hierarchies as text strings",
 	"(xml-data)", XPATH_STRING,
     },
+    {
+	"xml-to-string-limit", extXutilXmlToStringLimit,
+	"Encodes XML hierarchies as a string of limited length",
+	"(max-bytes, xml-data)", XPATH_STRING,
+    },
     {
 	"string-to-xml", extXutilStringToXml,
 	"Decodes data from strings into XML nodes",
-	"(string)", XPATH_XSLT_TREE,
+	"(string, ..., options?)", XPATH_XSLT_TREE,
     },
     {
 	"xml-to-json", extXutilXmlToJson,
@@ -26,3 +26,81 @@ psu_set_allocator (psu_realloc_func_t realloc_func, psu_free_func_t free_func)
     psu_realloc = realloc_func;
     psu_free = free_func;
 }
+
+/*
+ * Counting wraps whatever allocator was in place, so it works over
+ * arenas and the like.  The counters are shared by all threads.
+ */
+static psu_realloc_func_t psu_alloc_count_realloc_func;
+static psu_free_func_t psu_alloc_count_free_func;
+static psu_alloc_stats_t psu_alloc_counters;
+
+#define PSU_ALLOC_INC(_field, _val) \
+    __atomic_add_fetch(&psu_alloc_counters._field, (_val), __ATOMIC_RELAXED)
+
+static void *
+psu_alloc_count_realloc (void *ptr, size_t size)
+{
+    if (ptr == NULL)
+	PSU_ALLOC_INC(pas_allocs, 1);
+    else
+	PSU_ALLOC_INC(pas_reallocs, 1);
+    PSU_ALLOC_INC(pas_bytes, size);
+
+    return psu_alloc_count_realloc_func(ptr, size);
+}
+
+static void
+psu_alloc_count_free (void *ptr)
+{
+    if (ptr != NULL)
+	PSU_ALLOC_INC(pas_frees, 1);
+
+    psu_alloc_count_free_func(ptr);
+}
+
+void
+psu_alloc_count (void)
+{
+    if (psu_realloc == psu_alloc_count_realloc)
+	return;			/* Already counting */
+
+    psu_alloc_count_realloc_func = psu_realloc;
+    psu_alloc_count_free_func = psu_free;
+    psu_set_allocator(psu_alloc_count_realloc, psu_alloc_count_free);
+}
+
+void
+psu_alloc_stats (psu_alloc_stats_t *statsp)
+{
+    statsp->pas_allocs = __atomic_load_n(&psu_alloc_counters.pas_allocs,
+					 __ATOMIC_RELAXED);
+    statsp->pas_reallocs = __atomic_load_n(&psu_alloc_counters.pas_reallocs,
+					   __ATOMIC_RELAXED);
+    statsp->pas_frees = __atomic_load_n(&psu_alloc_counters.pas_frees,
+					__ATOMIC_RELAXED);
+    statsp->pas_bytes = __atomic_load_n(&psu_alloc_counters.pas_bytes,
+					__ATOMIC_RELAXED);
+}
+
+/*
+ * The default allocator object just hands off to psu_realloc and
+ * psu_free, so psu_set_allocator() still applies to it
+ */
+static void *
+psu_allocator_default_realloc (psu_allocator_t *pap UNUSED,
+			       void *ptr, size_t size)
+{
+    return psu_realloc(ptr, size);
+}
+
+static void
+psu_allocator_default_free (psu_allocator_t *pap UNUSED, void *ptr)
+{
+    psu_free(ptr);
+}
+
+psu_allocator_t psu_allocator_default = {
+    .pal_realloc = psu_allocator_default_realloc,
+    .pal_free = psu_allocator_default_free,
+};
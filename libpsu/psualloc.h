@@ -14,6 +14,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef void *(*psu_realloc_func_t)(void *, size_t);
 typedef void (*psu_free_func_t)(void *);
@@ -57,7 +58,7 @@ psu_reallocf (void *ptr, size_t size)
     void *newptr = psu_realloc(ptr, size);
 
     if (ptr != NULL && newptr == NULL)
-	free(ptr);
+	psu_free(ptr);
 
     return newptr;
 }
@@ -65,6 +66,127 @@ psu_reallocf (void *ptr, size_t size)
 void
 psu_set_allocator (psu_realloc_func_t realloc_func, psu_free_func_t free_func);
 
+/*
+ * Allocation counters, kept once psu_alloc_count() is called.  The
+ * counts are for calls made through psu_realloc and psu_free, so
+ * they see whatever allocator those are set to.
+ */
+typedef struct psu_alloc_stats_s {
+    uint64_t pas_allocs;	/* New allocations */
+    uint64_t pas_reallocs;	/* Resizes of existing memory */
+    uint64_t pas_frees;		/* Frees of non-NULL pointers */
+    uint64_t pas_bytes;		/* Bytes asked for (allocs and resizes) */
+} psu_alloc_stats_t;
+
+/**
+ * Start counting allocations, by wrapping the current psu_realloc and
+ * psu_free.  Call psu_set_allocator() first, if you're going to.
+ */
+void
+psu_alloc_count (void);
+
+/**
+ * Return the allocation counters (all zero if we're not counting)
+ * @param[out] statsp Where to put the counters
+ */
+void
+psu_alloc_stats (psu_alloc_stats_t *statsp);
+
+/*
+ * An allocator object.  Code that wants its caller to choose where
+ * memory comes from takes a psu_allocator_t pointer and uses the
+ * psu_allocator_* functions below; a NULL pointer means the default
+ * allocator, which uses psu_realloc/psu_free.  The bump arenas
+ * (psubump.h) and object pools (psupool.h) embed one of these as
+ * their first member, so they can be handed to such code directly.
+ */
+typedef struct psu_allocator_s psu_allocator_t;
+
+typedef void *(*psu_allocator_realloc_func_t)(psu_allocator_t *,
+					      void *, size_t);
+typedef void (*psu_allocator_free_func_t)(psu_allocator_t *, void *);
+
+struct psu_allocator_s {
+    psu_allocator_realloc_func_t pal_realloc; /* realloc(3)-like function */
+    psu_allocator_free_func_t pal_free; /* free(3)-like function */
+};
+
+extern psu_allocator_t psu_allocator_default;
+
+/**
+ * realloc-like allocation from an allocator object
+ * @param[in] pap Allocator (or NULL for the default)
+ * @param[in] ptr Existing memory (or NULL)
+ * @param[in] size Number of bytes needed
+ * @return a pointer to the memory, or NULL
+ */
+static inline void *
+psu_allocator_realloc (psu_allocator_t *pap, void *ptr, size_t size)
+{
+    if (pap == NULL)
+	pap = &psu_allocator_default;
+    return pap->pal_realloc(pap, ptr, size);
+}
+
+/**
+ * malloc-like allocation from an allocator object
+ * @param[in] pap Allocator (or NULL for the default)
+ * @param[in] size Number of bytes to allocate
+ * @return a pointer to newly allocated memory, or NULL
+ */
+static inline void *
+psu_allocator_malloc (psu_allocator_t *pap, size_t size)
+{
+    return psu_allocator_realloc(pap, NULL, size);
+}
+
+/**
+ * calloc-like allocation of zeroed memory from an allocator object
+ * @param[in] pap Allocator (or NULL for the default)
+ * @param[in] size Number of bytes to allocate
+ * @return a pointer to newly allocated and zeroed memory, or NULL
+ */
+static inline void *
+psu_allocator_calloc (psu_allocator_t *pap, size_t size)
+{
+    void *ptr = psu_allocator_realloc(pap, NULL, size);
+    if (ptr != NULL)
+	memset(ptr, 0, size);
+    return ptr;
+}
+
+/**
+ * free-like release of memory back to an allocator object
+ * @param[in] pap Allocator (or NULL for the default)
+ * @param[in] ptr Memory to release (or NULL)
+ */
+static inline void
+psu_allocator_free (psu_allocator_t *pap, void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    if (pap == NULL)
+	pap = &psu_allocator_default;
+    pap->pal_free(pap, ptr);
+}
+
+/**
+ * strdup-like string copy, allocated from an allocator object
+ * @param[in] pap Allocator (or NULL for the default)
+ * @param[in] str String to copy
+ * @return the copy, or NULL
+ */
+static inline char *
+psu_allocator_strdup (psu_allocator_t *pap, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *cp = psu_allocator_realloc(pap, NULL, len);
+
+    if (cp)
+	memcpy(cp, str, len);
+    return cp;
+}
+
 #ifndef HAVE_ALLOCADUP
 /*
  * Helper function for ALLOCADUP
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuarena.c -- a whole-process arena allocator
+ *
+ * Blocks carry a 16-byte header holding their size class.  Small
+ * classes (up to 1k, in 16 byte steps) and mid-sized ones are bumped
+ * out of a per-thread slab; larger ones are carved directly from the
+ * reservation.  Above 1k, classes are powers of two, so a buffer that
+ * grows by doubling is reallocated in place.  The only lock is taken
+ * when a slab or large block is carved, which is rare.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psuthread.h>
+#include <libpsu/psuarena.h>
+
+#define PSU_ARENA_HDR	16	/* Size of the block header */
+#define PSU_ARENA_SMALL	1024	/* Largest block in a 16-byte class */
+#define PSU_ARENA_NSMALL (PSU_ARENA_SMALL / PSU_ARENA_HDR)
+#define PSU_ARENA_MIN_BITS 11	/* First power-of-two class (2k) */
+#define PSU_ARENA_MAX_BITS 34	/* Last power-of-two class (16g) */
+#define PSU_ARENA_NCLASS \
+    (PSU_ARENA_NSMALL + PSU_ARENA_MAX_BITS - PSU_ARENA_MIN_BITS + 1)
+
+#define PSU_ARENA_SLAB	(1 << 20) /* Per-thread slab for smaller blocks */
+#define PSU_ARENA_BIG	(1 << 15) /* Largest block taken from a slab */
+#define PSU_ARENA_COMMIT (4 << 20) /* Commit memory in chunks this big */
+
+/* Largest request we'll satisfy from the arena */
+#define PSU_ARENA_MAX_SIZE \
+    (((size_t) 1 << PSU_ARENA_MAX_BITS) - PSU_ARENA_HDR)
+
+/*
+ * The header at the start of each block; pab_next is only valid
+ * while the block is on a free list
+ */
+typedef struct psu_arena_block_s {
+    unsigned pab_class;		/* Size class of this block */
+    struct psu_arena_block_s *pab_next; /* Next free block */
+} psu_arena_block_t;
+
+/*
+ * Each thread bumps its own slab and keeps its own free lists.  A
+ * block freed by a different thread than allocated it simply moves
+ * to that thread's list, since all blocks live until the arena does.
+ */
+typedef struct psu_arena_thread_s {
+    unsigned pat_gen;		/* Arena generation this state is for */
+    char *pat_next;		/* Next free byte in our slab */
+    char *pat_end;		/* End of our slab */
+    psu_arena_block_t *pat_free[PSU_ARENA_NCLASS]; /* Free lists */
+} psu_arena_thread_t;
+
+static THREAD_LOCAL(psu_arena_thread_t) psu_arena_thread;
+
+static psu_mutex_t psu_arena_lock = PSU_MUTEX_INITIALIZER;
+static char *psu_arena_base;	/* Start of our reservation */
+static char *psu_arena_top;	/* End of the memory carved so far */
+static char *psu_arena_commit;	/* End of committed memory */
+static char *psu_arena_limit;	/* End of our reservation */
+static unsigned psu_arena_gen;	/* Bumped by init and release */
+
+static inline unsigned
+psu_arena_class (size_t total)
+{
+    unsigned bits;
+
+    if (total <= PSU_ARENA_SMALL)
+	return (total + PSU_ARENA_HDR - 1) / PSU_ARENA_HDR - 1;
+
+    bits = sizeof(unsigned long) * 8
+	- __builtin_clzl((unsigned long) (total - 1));
+    return PSU_ARENA_NSMALL + bits - PSU_ARENA_MIN_BITS;
+}
+
+static inline size_t
+psu_arena_class_size (unsigned cls)
+{
+    if (cls < PSU_ARENA_NSMALL)
+	return (cls + 1) * PSU_ARENA_HDR;
+
+    return (size_t) 1 << (cls - PSU_ARENA_NSMALL + PSU_ARENA_MIN_BITS);
+}
+
+static inline psu_arena_block_t *
+psu_arena_block (void *ptr)
+{
+    return (psu_arena_block_t *) ((char *) ptr - PSU_ARENA_HDR);
+}
+
+static inline psu_arena_thread_t *
+psu_arena_thread_get (void)
+{
+    psu_arena_thread_t *patp = &psu_arena_thread;
+
+    /* Drop anything left over from an arena that has been released */
+    if (patp->pat_gen != psu_arena_gen) {
+	memset(patp, 0, sizeof(*patp));
+	patp->pat_gen = psu_arena_gen;
+    }
+
+    return patp;
+}
+
+/*
+ * Take "size" bytes off the top of the reservation, committing more
+ * memory if needed
+ */
+static void *
+psu_arena_carve (size_t size)
+{
+    char *ptr = NULL;
+    size_t need;
+
+    psu_mutex_lock(&psu_arena_lock);
+
+    if (psu_arena_base == NULL
+	    || size > (size_t) (psu_arena_limit - psu_arena_top))
+	goto done;
+
+    if (psu_arena_top + size > psu_arena_commit) {
+	need = psu_arena_top + size - psu_arena_commit;
+	need = (need + PSU_ARENA_COMMIT - 1) & ~((size_t) PSU_ARENA_COMMIT - 1);
+	if (need > (size_t) (psu_arena_limit - psu_arena_commit))
+	    need = psu_arena_limit - psu_arena_commit;
+
+	if (mprotect(psu_arena_commit, need, PROT_READ | PROT_WRITE) < 0)
+	    goto done;
+	psu_arena_commit += need;
+    }
+
+    ptr = psu_arena_top;
+    psu_arena_top += size;
+
+ done:
+    psu_mutex_unlock(&psu_arena_lock);
+    return ptr;
+}
+
+int
+psu_arena_init (size_t reserve)
+{
+    void *base;
+    int rc = 0;
+
+    if (reserve == 0)
+	reserve = (sizeof(void *) > 4) ? ((size_t) 64 << 30) : (512 << 20);
+
+    psu_mutex_lock(&psu_arena_lock);
+    if (psu_arena_base)
+	goto done;
+
+    /*
+     * Reserve the range without committing it.  If the system won't
+     * give us that much address space, settle for less.
+     */
+    for (;;) {
+	base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (base != MAP_FAILED)
+	    break;
+
+	reserve /= 2;
+	if (reserve < PSU_ARENA_COMMIT * 4) {
+	    rc = -1;
+	    goto done;
+	}
+    }
+
+    psu_arena_top = psu_arena_commit = base;
+    psu_arena_limit = (char *) base + reserve;
+    psu_arena_gen += 1;
+    psu_arena_base = base;
+
+ done:
+    psu_mutex_unlock(&psu_arena_lock);
+    return rc;
+}
+
+int
+psu_arena_owns (const void *ptr)
+{
+    /* Nothing else can live inside our reservation */
+    return (psu_arena_base && (const char *) ptr >= psu_arena_base
+	    && (const char *) ptr < psu_arena_limit);
+}
+
+void *
+psu_arena_malloc (size_t size)
+{
+    psu_arena_thread_t *patp;
+    psu_arena_block_t *pabp;
+    size_t csize;
+    unsigned cls;
+    char *slab;
+
+    if (psu_arena_base == NULL || size > PSU_ARENA_MAX_SIZE)
+	return malloc(size);
+
+    patp = psu_arena_thread_get();
+    cls = psu_arena_class(size + PSU_ARENA_HDR);
+
+    pabp = patp->pat_free[cls];
+    if (pabp) {
+	patp->pat_free[cls] = pabp->pab_next;
+	return (char *) pabp + PSU_ARENA_HDR;
+    }
+
+    csize = psu_arena_class_size(cls);
+    if (csize <= PSU_ARENA_BIG) {
+	if ((size_t) (patp->pat_end - patp->pat_next) < csize) {
+	    slab = psu_arena_carve(PSU_ARENA_SLAB);
+	    if (slab == NULL)
+		return malloc(size); /* Arena is full */
+
+	    patp->pat_next = slab;
+	    patp->pat_end = slab + PSU_ARENA_SLAB;
+	}
+
+	pabp = (psu_arena_block_t *) patp->pat_next;
+	patp->pat_next += csize;
+
+    } else {
+	pabp = psu_arena_carve(csize);
+	if (pabp == NULL)
+	    return malloc(size);
+    }
+
+    pabp->pab_class = cls;
+    return (char *) pabp + PSU_ARENA_HDR;
+}
+
+void
+psu_arena_free (void *ptr)
+{
+    psu_arena_thread_t *patp;
+    psu_arena_block_t *pabp;
+
+    if (ptr == NULL)
+	return;
+
+    if (!psu_arena_owns(ptr)) {
+	free(ptr);
+	return;
+    }
+
+    patp = psu_arena_thread_get();
+    pabp = psu_arena_block(ptr);
+    pabp->pab_next = patp->pat_free[pabp->pab_class];
+    patp->pat_free[pabp->pab_class] = pabp;
+}
+
+void *
+psu_arena_realloc (void *ptr, size_t size)
+{
+    size_t cap;
+    void *newp;
+
+    if (ptr == NULL)
+	return psu_arena_malloc(size);
+
+    if (!psu_arena_owns(ptr))
+	return realloc(ptr, size);
+
+    if (size == 0) {
+	psu_arena_free(ptr);
+	return NULL;
+    }
+
+    cap = psu_arena_class_size(psu_arena_block(ptr)->pab_class)
+	- PSU_ARENA_HDR;
+    if (size <= cap)
+	return ptr;
+
+    newp = psu_arena_malloc(size);
+    if (newp == NULL)
+	return NULL;
+
+    memcpy(newp, ptr, cap);
+    psu_arena_free(ptr);
+    return newp;
+}
+
+char *
+psu_arena_strdup (const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *cp = psu_arena_malloc(len);
+
+    if (cp)
+	memcpy(cp, str, len);
+    return cp;
+}
+
+size_t
+psu_arena_used (void)
+{
+    size_t used;
+
+    psu_mutex_lock(&psu_arena_lock);
+    used = psu_arena_top - psu_arena_base;
+    psu_mutex_unlock(&psu_arena_lock);
+
+    return used;
+}
+
+void
+psu_arena_release (void)
+{
+    psu_mutex_lock(&psu_arena_lock);
+
+    if (psu_arena_base) {
+	munmap(psu_arena_base, psu_arena_limit - psu_arena_base);
+	psu_arena_base = psu_arena_top = NULL;
+	psu_arena_commit = psu_arena_limit = NULL;
+	psu_arena_gen += 1;
+    }
+
+    psu_mutex_unlock(&psu_arena_lock);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuarena.h -- a whole-process arena allocator
+ *
+ * The arena is a single reserved range of address space, carved into
+ * blocks of a few size classes.  Freed blocks go on a per-thread free
+ * list for their class and are reused, but nothing is ever returned
+ * to the system until psu_arena_release(), so callers that are about
+ * to exit can skip their per-object frees entirely.  Pointers that
+ * did not come from the arena (memory allocated before the arena was
+ * set up, or after it filled) are handed to realloc(3) and free(3),
+ * so the arena functions can replace malloc and friends at any time.
+ */
+
+#ifndef LIBPSU_PSUARENA_H
+#define LIBPSU_PSUARENA_H
+
+#include <stddef.h>
+
+/**
+ * Reserve address space for the arena.  Memory is committed as the
+ * arena grows into the reservation.
+ *
+ * @param[in] reserve Bytes to reserve (zero for the default)
+ * @return zero on success, -1 (with errno set) on failure
+ */
+int
+psu_arena_init (size_t reserve);
+
+/**
+ * malloc(3)-compatible allocation from the arena
+ */
+void *
+psu_arena_malloc (size_t size);
+
+/**
+ * realloc(3)-compatible reallocation; a zero size frees the block
+ */
+void *
+psu_arena_realloc (void *ptr, size_t size);
+
+/**
+ * free(3)-compatible release of a block
+ */
+void
+psu_arena_free (void *ptr);
+
+/**
+ * strdup(3)-compatible string copy
+ */
+char *
+psu_arena_strdup (const char *str);
+
+/**
+ * Is this pointer from the arena?
+ */
+int
+psu_arena_owns (const void *ptr);
+
+/**
+ * Return the number of bytes carved from the arena so far
+ */
+size_t
+psu_arena_used (void);
+
+/**
+ * Give all arena memory back to the system.  Every block becomes
+ * invalid, in every thread; later allocations fall back to malloc(3)
+ * until psu_arena_init() is called again.
+ */
+void
+psu_arena_release (void);
+
+#endif /* LIBPSU_PSUARENA_H */
@@ -7,6 +7,14 @@
  * LICENSE.
  *
  * Base64 encode/decode functions
+ *
+ * The heavy lifting is done by block kernels that turn whole
+ * triplets into quads (and back), chosen at first use by
+ * psudispatch.  The vector kernels follow Wojciech Mula's pshufb
+ * approach: a byte's two nibbles index small tables that both
+ * validate it and give the offset that turns it into its sextet.
+ * Each kernel stops at the first block it can't handle (whitespace,
+ * padding, junk), and the byte-at-a-time code takes it from there.
  */
 
 #include <sys/types.h>
@@ -14,9 +22,17 @@
 
 #include <libpsu/psucommon.h>
 #include <libpsu/psualloc.h>
+#include <libpsu/psudispatch.h>
 #include <libpsu/psubase64.h>
 
-static char encoder[] = {
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__GNUC__)
+#define PSU_BASE64_HAVE_X86 1
+#include <immintrin.h>
+#endif /* __GNUC__ */
+#endif /* _X86_ */
+
+static const char encoder[] = {
     'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
     'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
     'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
@@ -27,7 +43,520 @@ static char encoder[] = {
     '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
-static char decoder[256];	/* Filled in on-demand */
+#define DEC_BAD	0xff		/* Not base64 */
+#define DEC_WS	0xfe		/* Whitespace (ignored) */
+#define DEC_PAD	0xfd		/* Padding ('=') */
+
+/* Sextet value for each byte, or one of the DEC_* values */
+static const uint8_t decoder[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+    0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfd, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+    0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+    0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+typedef size_t (*psu_base64_enc_func_t)(const uint8_t *in, size_t len,
+					char *out);
+typedef size_t (*psu_base64_dec_func_t)(const uint8_t *in, size_t len,
+					uint8_t *out);
+
+/*
+ * Encode whole triplets; returns the number of input bytes consumed
+ */
+static size_t
+psu_base64_encode_scalar (const uint8_t *in, size_t len, char *out)
+{
+    size_t done;
+    uint32_t bits;
+
+    for (done = 0; len - done >= 3; done += 3, in += 3, out += 4) {
+	bits = (in[0] << 16) | (in[1] << 8) | in[2];
+
+	out[0] = encoder[(bits >> 3 * 6) & 0x3F];
+	out[1] = encoder[(bits >> 2 * 6) & 0x3F];
+	out[2] = encoder[(bits >> 1 * 6) & 0x3F];
+	out[3] = encoder[(bits >> 0 * 6) & 0x3F];
+    }
+
+    return done;
+}
+
+/*
+ * Decode whole quads of base64 characters, stopping at the first one
+ * holding anything else; returns the number of input bytes consumed
+ */
+static size_t
+psu_base64_decode_scalar (const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t done;
+    uint32_t a, b, c, d;
+
+    for (done = 0; len - done >= 4; done += 4, in += 4, out += 3) {
+	a = decoder[in[0]];
+	b = decoder[in[1]];
+	c = decoder[in[2]];
+	d = decoder[in[3]];
+	if ((a | b | c | d) & 0xc0)
+	    break;
+
+	a = (a << 18) | (b << 12) | (c << 6) | d;
+	out[0] = (a >> 16) & 0xFF;
+	out[1] = (a >> 8) & 0xFF;
+	out[2] = a & 0xFF;
+    }
+
+    return done;
+}
+
+#ifdef PSU_BASE64_HAVE_X86
+/*
+ * Spread 12 bytes (bytes 1, 0, 2, 1 in each 32-bit word after the
+ * shuffle) into 16 sextets, one per byte
+ */
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i
+psu_base64_split_sse42 (__m128i v)
+{
+    __m128i t0, t1;
+
+    t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+			 _mm_set1_epi32(0x04000040));
+    t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+			 _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t0, t1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+psu_base64_split_avx2 (__m256i v)
+{
+    __m256i t0, t1;
+
+    t0 = _mm256_mulhi_epu16(_mm256_and_si256(v,
+					     _mm256_set1_epi32(0x0fc0fc00)),
+			    _mm256_set1_epi32(0x04000040));
+    t1 = _mm256_mullo_epi16(_mm256_and_si256(v,
+					     _mm256_set1_epi32(0x003f03f0)),
+			    _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t0, t1);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i
+psu_base64_enc_sse42_block (__m128i v)
+{
+    const __m128i shift = _mm_setr_epi8(
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0);
+    __m128i res, less;
+
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					  7, 6, 8, 7, 10, 9, 11, 10));
+    v = psu_base64_split_sse42(v);
+
+    /*
+     * Sextets 0-51 become 0, 52-63 become 1-12; then 0-25 become 13.
+     * That's an index for the offset to add.
+     */
+    res = _mm_subs_epu8(v, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), v);
+    res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+
+    return _mm_add_epi8(_mm_shuffle_epi8(shift, res), v);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t
+psu_base64_encode_sse42 (const uint8_t *in, size_t len, char *out)
+{
+    size_t done;
+    __m128i v;
+
+    /* We load 16 bytes to use 12 */
+    for (done = 0; len - done >= 16; done += 12, out += 16) {
+	v = _mm_loadu_si128((const __m128i *) (in + done));
+	_mm_storeu_si128((__m128i *) out, psu_base64_enc_sse42_block(v));
+    }
+
+    return done + psu_base64_encode_scalar(in + done, len - done, out);
+}
+
+__attribute__((target("avx2")))
+static size_t
+psu_base64_encode_avx2 (const uint8_t *in, size_t len, char *out)
+{
+    const __m256i shift = _mm256_setr_epi8(
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0,
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+	'/' - 63, 'A', 0, 0);
+    const __m256i spread = _mm256_setr_epi8(
+	1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+	1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t done;
+    __m256i v, res, less;
+
+    /* Each lane takes 12 bytes; the high lane's load reaches byte 28 */
+    for (done = 0; len - done >= 28; done += 24, out += 32) {
+	v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *) (in + done))),
+			_mm_loadu_si128((const __m128i *) (in + done + 12)), 1);
+
+	v = _mm256_shuffle_epi8(v, spread);
+	v = psu_base64_split_avx2(v);
+
+	res = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+	less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), v);
+	res = _mm256_or_si256(res, _mm256_and_si256(less,
+						    _mm256_set1_epi8(13)));
+	v = _mm256_add_epi8(_mm256_shuffle_epi8(shift, res), v);
+
+	_mm256_storeu_si256((__m256i *) out, v);
+    }
+
+    return done + psu_base64_encode_sse42(in + done, len - done, out);
+}
+
+/*
+ * Tables for decoding, indexed by nibble.  A byte is valid when the
+ * entries for its low and high nibbles have no bit in common; the
+ * "roll" entry (indexed by high nibble, with '/' moved down one)
+ * turns it into its sextet.
+ */
+#define PSU_BASE64_LUT_LO \
+	0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+	0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define PSU_BASE64_LUT_HI \
+	0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define PSU_BASE64_LUT_ROLL \
+	0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define PSU_BASE64_PACK \
+	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t
+psu_base64_decode_sse42 (const uint8_t *in, size_t len, uint8_t *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(PSU_BASE64_LUT_LO);
+    const __m128i lut_hi = _mm_setr_epi8(PSU_BASE64_LUT_HI);
+    const __m128i lut_roll = _mm_setr_epi8(PSU_BASE64_LUT_ROLL);
+    const __m128i pack = _mm_setr_epi8(PSU_BASE64_PACK);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t done;
+    __m128i v, hi_nib, lo, hi, roll;
+    uint32_t tail;
+
+    for (done = 0; len - done >= 16; done += 16, out += 12) {
+	v = _mm_loadu_si128((const __m128i *) (in + done));
+	hi_nib = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+	lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, nibble));
+	hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+	if (!_mm_testz_si128(lo, hi))
+	    break;
+
+	roll = _mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi_nib);
+	v = _mm_add_epi8(v, _mm_shuffle_epi8(lut_roll, roll));
+
+	/* Merge sextet pairs, then pairs of those, then pack the bytes */
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	v = _mm_shuffle_epi8(v, pack);
+
+	/* Store exactly 12 bytes; the caller's buffer may end there */
+	_mm_storel_epi64((__m128i *) out, v);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(out + 8, &tail, sizeof(tail));
+    }
+
+    return done + psu_base64_decode_scalar(in + done, len - done, out);
+}
+
+__attribute__((target("avx2")))
+static size_t
+psu_base64_decode_avx2 (const uint8_t *in, size_t len, uint8_t *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(PSU_BASE64_LUT_LO,
+					    PSU_BASE64_LUT_LO);
+    const __m256i lut_hi = _mm256_setr_epi8(PSU_BASE64_LUT_HI,
+					    PSU_BASE64_LUT_HI);
+    const __m256i lut_roll = _mm256_setr_epi8(PSU_BASE64_LUT_ROLL,
+					      PSU_BASE64_LUT_ROLL);
+    const __m256i pack = _mm256_setr_epi8(PSU_BASE64_PACK, PSU_BASE64_PACK);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t done;
+    __m256i v, hi_nib, lo, hi, roll;
+
+    for (done = 0; len - done >= 32; done += 32, out += 24) {
+	v = _mm256_loadu_si256((const __m256i *) (in + done));
+	hi_nib = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+	lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, nibble));
+	hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+	if (!_mm256_testz_si256(lo, hi))
+	    break;
+
+	roll = _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+			       hi_nib);
+	v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, roll));
+
+	v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, pack);
+
+	/* Bring the lanes' 12 bytes together, then store exactly 24 */
+	v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4,
+							     5, 6, 7, 7));
+	_mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(v));
+	_mm_storel_epi64((__m128i *) (out + 16),
+			 _mm256_extracti128_si256(v, 1));
+    }
+
+    return done + psu_base64_decode_sse42(in + done, len - done, out);
+}
+#endif /* PSU_BASE64_HAVE_X86 */
+
+/* Listed in order of preference; last one always works */
+static const psu_dispatch_variant_t psu_base64_enc_variants[] = {
+#ifdef PSU_BASE64_HAVE_X86
+    { "avx2", PSU_CPU_F_AVX2 | PSU_CPU_F_SSE42,
+      PSU_DISPATCH_FUNC(psu_base64_encode_avx2) },
+    { "sse42", PSU_CPU_F_SSE42, PSU_DISPATCH_FUNC(psu_base64_encode_sse42) },
+#endif /* PSU_BASE64_HAVE_X86 */
+    { "scalar", 0, PSU_DISPATCH_FUNC(psu_base64_encode_scalar) },
+    { NULL, 0, NULL }
+};
+
+static const psu_dispatch_variant_t psu_base64_dec_variants[] = {
+#ifdef PSU_BASE64_HAVE_X86
+    { "avx2", PSU_CPU_F_AVX2 | PSU_CPU_F_SSE42,
+      PSU_DISPATCH_FUNC(psu_base64_decode_avx2) },
+    { "sse42", PSU_CPU_F_SSE42, PSU_DISPATCH_FUNC(psu_base64_decode_sse42) },
+#endif /* PSU_BASE64_HAVE_X86 */
+    { "scalar", 0, PSU_DISPATCH_FUNC(psu_base64_decode_scalar) },
+    { NULL, 0, NULL }
+};
+
+static psu_dispatch_t psu_base64_enc_dispatch
+    = PSU_DISPATCH_INIT("base64-encode", psu_base64_enc_variants);
+static psu_dispatch_t psu_base64_dec_dispatch
+    = PSU_DISPATCH_INIT("base64-decode", psu_base64_dec_variants);
+
+static size_t psu_base64_encode_resolve (const uint8_t *, size_t, char *);
+static size_t psu_base64_decode_resolve (const uint8_t *, size_t, uint8_t *);
+
+/*
+ * The kernels in use.  Like xiscan's, these start as stubs that bind
+ * the real kernel on first use.
+ */
+static psu_base64_enc_func_t psu_base64_enc_func = psu_base64_encode_resolve;
+static psu_base64_dec_func_t psu_base64_dec_func = psu_base64_decode_resolve;
+
+static size_t
+psu_base64_encode_resolve (const uint8_t *in, size_t len, char *out)
+{
+    psu_base64_enc_func = (psu_base64_enc_func_t)
+	psu_dispatch_bind(&psu_base64_enc_dispatch);
+    return psu_base64_enc_func(in, len, out);
+}
+
+static size_t
+psu_base64_decode_resolve (const uint8_t *in, size_t len, uint8_t *out)
+{
+    psu_base64_dec_func = (psu_base64_dec_func_t)
+	psu_dispatch_bind(&psu_base64_dec_dispatch);
+    return psu_base64_dec_func(in, len, out);
+}
+
+void
+psu_base64_encode_init (psu_base64_encoder_t *pbep)
+{
+    bzero(pbep, sizeof(*pbep));
+}
+
+size_t
+psu_base64_encode_update (psu_base64_encoder_t *pbep, const char *buf,
+			  size_t blen, char *out)
+{
+    const uint8_t *cp = (const uint8_t *) buf;
+    const uint8_t *ep = cp + blen;
+    char *start = out;
+    size_t done;
+
+    /* Finish off any triplet we were holding from last time */
+    if (pbep->pbe_count) {
+	while (pbep->pbe_count < 3 && cp < ep)
+	    pbep->pbe_held[pbep->pbe_count++] = *cp++;
+
+	if (pbep->pbe_count < 3)
+	    return 0;
+
+	psu_base64_encode_scalar(pbep->pbe_held, 3, out);
+	out += 4;
+	pbep->pbe_count = 0;
+    }
+
+    done = psu_base64_enc_func(cp, ep - cp, out);
+    cp += done;
+    out += (done / 3) * 4;
+
+    while (cp < ep)
+	pbep->pbe_held[pbep->pbe_count++] = *cp++;
+
+    return out - start;
+}
+
+size_t
+psu_base64_encode_final (psu_base64_encoder_t *pbep, char *out)
+{
+    uint8_t held[3] = { 0, 0, 0 };
+    unsigned count = pbep->pbe_count;
+
+    if (count == 0)
+	return 0;
+
+    memcpy(held, pbep->pbe_held, count);
+    psu_base64_encode_scalar(held, 3, out);
+
+    out[3] = '=';
+    if (count == 1)
+	out[2] = '=';
+
+    pbep->pbe_count = 0;
+    return 4;
+}
+
+void
+psu_base64_decode_init (psu_base64_decoder_t *pbdp)
+{
+    bzero(pbdp, sizeof(*pbdp));
+}
+
+/*
+ * Emit the bytes held in a (possibly partial) quantum
+ */
+static inline uint8_t *
+psu_base64_decode_emit (psu_base64_decoder_t *pbdp, uint8_t *out)
+{
+    uint32_t bits = pbdp->pbd_bits << (6 * (4 - pbdp->pbd_count));
+
+    *out++ = (bits >> 16) & 0xFF;
+    if (pbdp->pbd_count > 2)
+	*out++ = (bits >> 8) & 0xFF;
+    if (pbdp->pbd_count > 3)
+	*out++ = bits & 0xFF;
+
+    pbdp->pbd_bits = 0;
+    pbdp->pbd_count = 0;
+
+    return out;
+}
+
+ssize_t
+psu_base64_decode_update (psu_base64_decoder_t *pbdp, const char *buf,
+			  size_t blen, char *obuf)
+{
+    const uint8_t *cp = (const uint8_t *) buf;
+    const uint8_t *ep = cp + blen;
+    uint8_t *out = (uint8_t *) obuf;
+    size_t done;
+    uint8_t val;
+
+    if (pbdp->pbd_error)
+	return -1;
+
+    while (cp < ep) {
+	/* On a quantum boundary, let the kernel run as far as it can */
+	if (pbdp->pbd_count == 0 && !pbdp->pbd_done) {
+	    done = psu_base64_dec_func(cp, ep - cp, out);
+	    cp += done;
+	    out += (done / 4) * 3;
+	    if (cp == ep)
+		break;
+	}
+
+	val = decoder[*cp++];
+
+	if (val < 64) {
+	    if (pbdp->pbd_done)	/* Nothing follows the padding */
+		goto fail;
+
+	    pbdp->pbd_bits = (pbdp->pbd_bits << 6) | val;
+	    if (++pbdp->pbd_count == 4)
+		out = psu_base64_decode_emit(pbdp, out);
+
+	} else if (val == DEC_PAD) {
+	    /* Only "xx==" and "xxx=" are allowed */
+	    if (!pbdp->pbd_done) {
+		if (pbdp->pbd_count < 2)
+		    goto fail;
+		pbdp->pbd_pad = 4 - pbdp->pbd_count;
+		pbdp->pbd_done = TRUE;
+		out = psu_base64_decode_emit(pbdp, out);
+	    }
+
+	    if (pbdp->pbd_pad == 0) /* One '=' too many */
+		goto fail;
+	    pbdp->pbd_pad -= 1;
+
+	} else if (val != DEC_WS) {
+	    goto fail;
+	}
+    }
+
+    return (char *) out - obuf;
+
+ fail:
+    pbdp->pbd_error = TRUE;
+    return -1;
+}
+
+ssize_t
+psu_base64_decode_final (psu_base64_decoder_t *pbdp, char *obuf)
+{
+    uint8_t *out = (uint8_t *) obuf;
+    int error = pbdp->pbd_error;
+
+    /* A lone sextet can't make a byte; otherwise padding is optional */
+    if (pbdp->pbd_count == 1)
+	error = TRUE;
+    else if (pbdp->pbd_count && !error)
+	out = psu_base64_decode_emit(pbdp, out);
+
+    psu_base64_decode_init(pbdp);
+
+    return error ? -1 : (char *) out - obuf;
+}
 
 /**
  * Encode data using base64 encoding.  Allocates a buffer and returns
@@ -43,37 +572,19 @@ static char decoder[256];	/* Filled in on-demand */
 char *
 psu_base64_encode (const char *buf, size_t blen, size_t *olenp)
 {
-    int olen = (size_t) ((blen  + 2) / 3) * 4;
-    char *data = psu_realloc(NULL, olen + 1);
-    const char *cp, *ep;
-    char *out;
-    uint32_t bits;
+    char *data = psu_realloc(NULL, PSU_BASE64_ENCODE_LEN(blen) + 1);
+    psu_base64_encoder_t pbe;
+    size_t olen;
 
     if (data == NULL)
 	return NULL;
 
-    out = data;
-    cp = buf;
-    ep = buf + blen;
-    while (cp < ep) {
-	bits = *cp++ << 16;
-	bits += cp < ep ? *cp++ << 8 : 0;
-	bits += cp < ep ? *cp++ : 0;
-
-        *out++ = encoder[(bits >> 3 * 6) & 0x3F];
-        *out++ = encoder[(bits >> 2 * 6) & 0x3F];
-        *out++ = encoder[(bits >> 1 * 6) & 0x3F];
-        *out++ = encoder[(bits >> 0 * 6) & 0x3F];
-    }
-
-    if (blen % 3 > 0) {
-	out[-1] = '=';
-	if (blen % 3 == 1)
-	    out[-2] = '=';
-    }
+    psu_base64_encode_init(&pbe);
+    olen = psu_base64_encode_update(&pbe, buf, blen, data);
+    olen += psu_base64_encode_final(&pbe, data + olen);
 
-    *out = '\0';
-    *olenp = out - data;
+    data[olen] = '\0';
+    *olenp = olen;
     return data;
 }
 
@@ -91,11 +602,14 @@ psu_base64_encode (const char *buf, size_t blen, size_t *olenp)
 char *
 psu_base64_decode (const char *buf, size_t blen, size_t *olenp)
 {
-    const char *cp, *ep;
-    uint32_t bits;
-    int i;
-    char *out, *data, *stop;
+    psu_base64_decoder_t pbd;
+    ssize_t len, tail;
+    char *data;
 
+    /*
+     * Whole buffers must come in quads, though we allow a trailing
+     * newline or NUL.  Callers rely on this to tell base64 from text.
+     */
     if (blen % 4 != 0) {
 	if ((blen - 1) % 4 == 0
 		&& (buf[blen - 1] == '\n' || buf[blen - 1] == '\0'))
@@ -104,56 +618,25 @@ psu_base64_decode (const char *buf, size_t blen, size_t *olenp)
 	    return NULL;
     }
 
-    /* If the decoder isn't initialized, fill it with reverse mappings */
-    if (decoder['A'] == 0) {
-	for (i = 0, cp = decoder; i < 0x40; i++)
-	    decoder[(uint) encoder[i]] = i;
-    }
-
-    int olen = (blen / 4) * 3;
-
-    cp = buf;
-    ep = buf + blen;
-
-    /* Trailing "="+ are ignored */
-    if (buf[blen - 1] == '=') {
-	olen -= 1;
-	ep -= 1;
-    }
-    if (buf[blen - 2] == '=') {
-	olen -= 1;
-	ep -= 1;
-    }
-
-    out = data = psu_realloc(NULL, olen + 1); /* Add 1 for NUL */
+    data = psu_realloc(NULL, PSU_BASE64_DECODE_LEN(blen) + 1);
     if (data == NULL)
 	return NULL;
-    stop = data + olen;
 
-    while (cp < ep) {
-	if (*cp == '\n' || *cp == '\r' || *cp == ' ' || *cp == '\t') {
-	    cp += 1;
-	    continue;
-	}
-
-	bits = decoder[(uint) *cp++] << 18;
-	bits += cp < ep ? decoder[(uint) *cp++] << 12 : 0;
-	bits += cp < ep ? decoder[(uint) *cp++] << 6 : 0;
-	bits += cp < ep ? decoder[(uint) *cp++] : 0;
-
-	*out++ = (bits >> 16) & 0xFF;
-	if (out < stop)
-	    *out++ = (bits >> 8) & 0xFF;
-	if (out < stop)
-	    *out++ = bits & 0xFF;
+    psu_base64_decode_init(&pbd);
+    len = psu_base64_decode_update(&pbd, buf, blen, data);
+    tail = psu_base64_decode_final(&pbd, data + (len > 0 ? len : 0));
+    if (len < 0 || tail < 0) {
+	psu_free(data);
+	return NULL;
     }
 
     /*
      * Our result is always NUL terminated, but that NUL is not part
      * of the length.
      */
-    *out = '\0';
-    *olenp = out - data;
+    len += tail;
+    data[len] = '\0';
+    *olenp = len;
 
     return data;
 }
@@ -7,12 +7,41 @@
  * LICENSE.
  *
  * Base64 encode/decode functions
+ *
+ * Besides the whole-buffer functions, there's an incremental API:
+ * an encoder or decoder carries partial triplets (or quads) from
+ * one chunk to the next, so data can be converted as it arrives.
+ * Whitespace in decoder input is ignored, padding is optional, and
+ * anything else that isn't base64 is an error.
  */
 
 #ifndef LIBPSU_PSUBASE64_H
 #define LIBPSU_PSUBASE64_H
 
 #include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Most output from encoding (or decoding) "_n" bytes through one
+ * update call.  For the encoder, psu_base64_encode_final() adds up
+ * to four more; the decoder's final call adds up to two.
+ */
+#define PSU_BASE64_ENCODE_LEN(_n) ((((_n) + 2) / 3) * 4)
+#define PSU_BASE64_DECODE_LEN(_n) ((((_n) + 3) / 4) * 3)
+
+typedef struct psu_base64_encoder_s {
+    uint8_t pbe_held[3];	/* Bytes waiting for a full triplet */
+    unsigned pbe_count;		/* Number of bytes in pbe_held */
+} psu_base64_encoder_t;
+
+typedef struct psu_base64_decoder_s {
+    uint32_t pbd_bits;		/* Sextets waiting for a full quad */
+    unsigned pbd_count;		/* Number of sextets in pbd_bits */
+    unsigned pbd_pad;		/* Padding characters still allowed */
+    int pbd_done;		/* Seen padding, so the data is over */
+    int pbd_error;		/* Seen something that isn't base64 */
+} psu_base64_decoder_t;
 
 /**
  * Encode data using base64 encoding.  Allocates a buffer and returns
@@ -37,9 +66,70 @@ psu_base64_encode (const char *buf, size_t blen, size_t *olenp);
  * @param[in] buf Input buffer
  * @param[in] blen Number of bytes available in destination buffer
  * @param[out] olenp Pointer to number of bytes used to encode data
- * @return Newly allocated buffer
+ * @return Newly allocated buffer, or NULL if the data isn't base64
+ *    (including data whose length isn't a multiple of four)
  */
 char *
 psu_base64_decode (const char *buf, size_t blen, size_t *olenp);
 
+/**
+ * Initialize an incremental encoder
+ */
+void
+psu_base64_encode_init (psu_base64_encoder_t *pbep);
+
+/**
+ * Encode the next chunk of data
+ *
+ * @param[in] pbep The encoder
+ * @param[in] buf Input data
+ * @param[in] blen Number of bytes of input
+ * @param[out] out Output buffer (at least PSU_BASE64_ENCODE_LEN(blen))
+ * @return Number of bytes written to "out"
+ */
+size_t
+psu_base64_encode_update (psu_base64_encoder_t *pbep, const char *buf,
+			  size_t blen, char *out);
+
+/**
+ * Write the last (padded) quad, if any, and reset the encoder
+ *
+ * @param[in] pbep The encoder
+ * @param[out] out Output buffer (at least four bytes)
+ * @return Number of bytes written to "out"
+ */
+size_t
+psu_base64_encode_final (psu_base64_encoder_t *pbep, char *out);
+
+/**
+ * Initialize an incremental decoder
+ */
+void
+psu_base64_decode_init (psu_base64_decoder_t *pbdp);
+
+/**
+ * Decode the next chunk of data
+ *
+ * @param[in] pbdp The decoder
+ * @param[in] buf Input data
+ * @param[in] blen Number of bytes of input
+ * @param[out] out Output buffer (at least PSU_BASE64_DECODE_LEN(blen))
+ * @return Number of bytes written to "out", or -1 if the input isn't
+ *    base64 (after which every call fails until the decoder is reset)
+ */
+ssize_t
+psu_base64_decode_update (psu_base64_decoder_t *pbdp, const char *buf,
+			  size_t blen, char *out);
+
+/**
+ * Write any bytes left from unpadded input, and reset the decoder
+ *
+ * @param[in] pbdp The decoder
+ * @param[out] out Output buffer (at least two bytes)
+ * @return Number of bytes written to "out", or -1 if the input was
+ *    bad or ended part way through a byte
+ */
+ssize_t
+psu_base64_decode_final (psu_base64_decoder_t *pbdp, char *out);
+
 #endif /* LIBPSU_PSUBASE64_H */
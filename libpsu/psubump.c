@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psubump.c -- bump-pointer arenas with mark/release
+ */
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psualloc.h>
+#include <libpsu/psubump.h>
+
+/*
+ * Allocations made through the allocator face carry this header, so
+ * realloc knows how much to copy
+ */
+typedef union psu_bump_hdr_s {
+    size_t pbh_size;		/* Bytes requested */
+    double pbh_align;		/* Keep the data aligned */
+} psu_bump_hdr_t;
+
+static inline size_t
+psu_bump_round (size_t size)
+{
+    return (size + PSU_BUMP_ALIGN - 1) & ~(PSU_BUMP_ALIGN - 1);
+}
+
+static inline size_t
+psu_bump_block_size (psu_bump_t *pbp)
+{
+    size_t size = pbp->pb_block_size ?: PSU_BUMP_BLOCK;
+
+    return size - sizeof(psu_bump_block_t);
+}
+
+static inline void
+psu_bump_block_free (psu_bump_t *pbp, psu_bump_block_t *pbbp)
+{
+    psu_allocator_free(pbp->pb_parent, pbbp);
+}
+
+void
+psu_bump_init (psu_bump_t *pbp, psu_allocator_t *parent, size_t block_size)
+{
+    memset(pbp, 0, sizeof(*pbp));
+    pbp->pb_parent = parent;
+
+    /* Anything smaller isn't worth the bother */
+    if (block_size && block_size < sizeof(psu_bump_block_t) * 16)
+	block_size = sizeof(psu_bump_block_t) * 16;
+    pbp->pb_block_size = block_size;
+}
+
+/**
+ * Carve memory from a new block.  Requests that would take more than
+ * a quarter of a normal block get a block of their own, which goes on
+ * the large list so we keep filling the current block.
+ *
+ * @param[in] pbp The arena
+ * @param[in] size Number of bytes needed (already rounded)
+ * @return pointer to the memory, or NULL
+ */
+static void *
+psu_bump_alloc_slow (psu_bump_t *pbp, size_t size)
+{
+    psu_bump_block_t *pbbp;
+    size_t bsize = psu_bump_block_size(pbp);
+
+    if (size > bsize / 4) {
+	pbbp = psu_allocator_malloc(pbp->pb_parent, sizeof(*pbbp) + size);
+	if (pbbp == NULL)
+	    return NULL;
+
+	pbbp->pbb_size = size;
+	pbbp->pbb_next = pbp->pb_large;
+	pbp->pb_large = pbbp;
+	return pbbp->pbb_data;
+    }
+
+    pbbp = pbp->pb_spare;
+    if (pbbp && pbbp->pbb_size == bsize) {
+	pbp->pb_spare = NULL;
+    } else {
+	pbbp = psu_allocator_malloc(pbp->pb_parent, sizeof(*pbbp) + bsize);
+	if (pbbp == NULL)
+	    return NULL;
+	pbbp->pbb_size = bsize;
+    }
+
+    pbbp->pbb_next = pbp->pb_blocks;
+    pbp->pb_blocks = pbbp;
+    pbp->pb_cur = (char *) pbbp->pbb_data + size;
+    pbp->pb_end = (char *) pbbp->pbb_data + bsize;
+
+    return pbbp->pbb_data;
+}
+
+void *
+psu_bump_alloc (psu_bump_t *pbp, size_t size)
+{
+    char *res;
+
+    size = psu_bump_round(size);
+
+    if (pbp->pb_cur && (size_t) (pbp->pb_end - pbp->pb_cur) >= size) {
+	res = pbp->pb_cur;
+	pbp->pb_cur += size;
+	return res;
+    }
+
+    return psu_bump_alloc_slow(pbp, size);
+}
+
+char *
+psu_bump_strdup (psu_bump_t *pbp, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *cp = psu_bump_alloc(pbp, len);
+
+    if (cp)
+	memcpy(cp, str, len);
+    return cp;
+}
+
+/**
+ * Unlink normal blocks down to (but not including) "stop".  The
+ * first one we see becomes our spare, if we don't have one, so a
+ * mark/release loop that keeps crossing a block boundary doesn't go
+ * back to the parent every time.
+ */
+static void
+psu_bump_trim (psu_bump_t *pbp, psu_bump_block_t *stop)
+{
+    psu_bump_block_t *pbbp, *next;
+
+    for (pbbp = pbp->pb_blocks; pbbp && pbbp != stop; pbbp = next) {
+	next = pbbp->pbb_next;
+	if (pbp->pb_spare == NULL)
+	    pbp->pb_spare = pbbp;
+	else
+	    psu_bump_block_free(pbp, pbbp);
+    }
+
+    pbp->pb_blocks = stop;
+}
+
+static void
+psu_bump_trim_large (psu_bump_t *pbp, psu_bump_block_t *stop)
+{
+    psu_bump_block_t *pbbp, *next;
+
+    for (pbbp = pbp->pb_large; pbbp && pbbp != stop; pbbp = next) {
+	next = pbbp->pbb_next;
+	psu_bump_block_free(pbp, pbbp);
+    }
+
+    pbp->pb_large = stop;
+}
+
+void
+psu_bump_release (psu_bump_t *pbp, const psu_bump_mark_t *markp)
+{
+    psu_bump_trim(pbp, markp->pbm_blocks);
+    psu_bump_trim_large(pbp, markp->pbm_large);
+
+    if (pbp->pb_blocks) {
+	pbp->pb_cur = markp->pbm_cur;
+	pbp->pb_end = (char *) pbp->pb_blocks->pbb_data
+	    + pbp->pb_blocks->pbb_size;
+    } else {
+	pbp->pb_cur = pbp->pb_end = NULL;
+    }
+}
+
+void
+psu_bump_reset (psu_bump_t *pbp)
+{
+    psu_bump_block_t *pbbp;
+
+    psu_bump_trim_large(pbp, NULL);
+    psu_bump_trim(pbp, NULL);
+
+    /* Make the spare our current block, ready to be filled again */
+    pbbp = pbp->pb_spare;
+    if (pbbp == NULL) {
+	pbp->pb_cur = pbp->pb_end = NULL;
+	return;
+    }
+
+    pbp->pb_spare = NULL;
+    pbbp->pbb_next = NULL;
+    pbp->pb_blocks = pbbp;
+    pbp->pb_cur = (char *) pbbp->pbb_data;
+    pbp->pb_end = pbp->pb_cur + pbbp->pbb_size;
+}
+
+void
+psu_bump_cleanup (psu_bump_t *pbp)
+{
+    psu_bump_trim_large(pbp, NULL);
+    psu_bump_trim(pbp, NULL);
+
+    if (pbp->pb_spare) {
+	psu_bump_block_free(pbp, pbp->pb_spare);
+	pbp->pb_spare = NULL;
+    }
+
+    pbp->pb_cur = pbp->pb_end = NULL;
+}
+
+size_t
+psu_bump_size (psu_bump_t *pbp)
+{
+    psu_bump_block_t *pbbp;
+    size_t size = 0;
+
+    for (pbbp = pbp->pb_blocks; pbbp; pbbp = pbbp->pbb_next)
+	size += sizeof(*pbbp) + pbbp->pbb_size;
+    for (pbbp = pbp->pb_large; pbbp; pbbp = pbbp->pbb_next)
+	size += sizeof(*pbbp) + pbbp->pbb_size;
+    if (pbp->pb_spare)
+	size += sizeof(*pbbp) + pbp->pb_spare->pbb_size;
+
+    return size;
+}
+
+/*
+ * Is this header the most recent allocation in the current block?
+ */
+static inline int
+psu_bump_is_last (psu_bump_t *pbp, psu_bump_hdr_t *hdrp)
+{
+    return ((char *) hdrp + sizeof(*hdrp) + psu_bump_round(hdrp->pbh_size)
+	    == pbp->pb_cur);
+}
+
+static void *
+psu_bump_allocator_realloc (psu_allocator_t *pap, void *ptr, size_t size)
+{
+    psu_bump_t *pbp = (psu_bump_t *) pap;
+    psu_bump_hdr_t *hdrp, *newp;
+
+    if (ptr == NULL) {
+	hdrp = psu_bump_alloc(pbp, sizeof(*hdrp) + size);
+	if (hdrp == NULL)
+	    return NULL;
+	hdrp->pbh_size = size;
+	return hdrp + 1;
+    }
+
+    hdrp = (psu_bump_hdr_t *) ptr - 1;
+
+    /* The most recent allocation can grow or shrink where it is */
+    if (psu_bump_is_last(pbp, hdrp)
+	    && (size_t) (pbp->pb_end - (char *) ptr) >= psu_bump_round(size)) {
+	hdrp->pbh_size = size;
+	pbp->pb_cur = (char *) ptr + psu_bump_round(size);
+	return ptr;
+    }
+
+    if (size <= hdrp->pbh_size)
+	return ptr;
+
+    newp = psu_bump_allocator_realloc(pap, NULL, size);
+    if (newp == NULL)
+	return NULL;
+
+    memcpy(newp, ptr, hdrp->pbh_size);
+    return newp;
+}
+
+static void
+psu_bump_allocator_free (psu_allocator_t *pap, void *ptr)
+{
+    psu_bump_t *pbp = (psu_bump_t *) pap;
+    psu_bump_hdr_t *hdrp = (psu_bump_hdr_t *) ptr - 1;
+
+    /* We can only take back the most recent allocation */
+    if (psu_bump_is_last(pbp, hdrp))
+	pbp->pb_cur = (char *) hdrp;
+}
+
+psu_allocator_t *
+psu_bump_allocator (psu_bump_t *pbp)
+{
+    /* Zeroed arenas get their allocator face on first use */
+    if (pbp->pb_allocator.pal_realloc == NULL) {
+	pbp->pb_allocator.pal_realloc = psu_bump_allocator_realloc;
+	pbp->pb_allocator.pal_free = psu_bump_allocator_free;
+    }
+
+    return &pbp->pb_allocator;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psubump.h -- bump-pointer arenas with mark/release
+ *
+ * A bump arena hands out memory by advancing a pointer through large
+ * blocks taken from a parent allocator.  Nothing is freed one piece
+ * at a time; instead a caller takes a mark, allocates freely, and
+ * releases back to the mark (or resets the arena) when the work is
+ * done.  Requests too big to share a block get a block of their own,
+ * kept on a separate list so the current block keeps filling.
+ *
+ * An arena can be zeroed instead of initialized, giving an arena of
+ * default-sized blocks from the default allocator.  The arena holds
+ * no pointers to itself, so it can be moved around by value.
+ */
+
+#ifndef LIBPSU_PSUBUMP_H
+#define LIBPSU_PSUBUMP_H
+
+#include <libpsu/psualloc.h>
+
+#define PSU_BUMP_BLOCK	(64 * 1024) /* Default block size */
+#define PSU_BUMP_ALIGN	sizeof(double) /* Alignment of each allocation */
+
+typedef struct psu_bump_block_s {
+    struct psu_bump_block_s *pbb_next; /* Next (older) block */
+    size_t pbb_size;		/* Usable bytes in pbb_data */
+    double pbb_data[0];		/* Start of data (aligned) */
+} psu_bump_block_t;
+
+typedef struct psu_bump_s {
+    psu_allocator_t pb_allocator; /* Allocator face (must be first) */
+    psu_allocator_t *pb_parent;	/* Where our blocks come from */
+    size_t pb_block_size;	/* Size of a normal block (or 0) */
+    psu_bump_block_t *pb_blocks; /* Normal blocks (newest first) */
+    psu_bump_block_t *pb_large; /* Oversized blocks (newest first) */
+    psu_bump_block_t *pb_spare;	/* A released block, kept for reuse */
+    char *pb_cur;		/* Next free byte in pb_blocks */
+    char *pb_end;		/* End of pb_blocks */
+} psu_bump_t;
+
+/*
+ * A position in an arena; releasing to a mark frees everything
+ * allocated after the mark was taken
+ */
+typedef struct psu_bump_mark_s {
+    psu_bump_block_t *pbm_blocks; /* Newest normal block at the mark */
+    psu_bump_block_t *pbm_large; /* Newest oversized block at the mark */
+    char *pbm_cur;		/* Bump pointer at the mark */
+} psu_bump_mark_t;
+
+/**
+ * Initialize an arena
+ *
+ * @param[in] pbp The arena
+ * @param[in] parent Allocator for blocks (NULL for the default)
+ * @param[in] block_size Size of a normal block (zero for the default)
+ */
+void
+psu_bump_init (psu_bump_t *pbp, psu_allocator_t *parent, size_t block_size);
+
+/**
+ * Allocate memory from the arena; the memory lives until the arena
+ * is released past it, reset, or cleaned up
+ *
+ * @param[in] pbp The arena
+ * @param[in] size Number of bytes needed
+ * @return pointer to the memory, or NULL if the parent allocator fails
+ */
+void *
+psu_bump_alloc (psu_bump_t *pbp, size_t size);
+
+/**
+ * Copy a string into the arena
+ */
+char *
+psu_bump_strdup (psu_bump_t *pbp, const char *str);
+
+/**
+ * Record the current position in the arena
+ */
+static inline psu_bump_mark_t
+psu_bump_mark (psu_bump_t *pbp)
+{
+    psu_bump_mark_t mark = {
+	.pbm_blocks = pbp->pb_blocks,
+	.pbm_large = pbp->pb_large,
+	.pbm_cur = pbp->pb_cur,
+    };
+
+    return mark;
+}
+
+/**
+ * Free everything allocated since the mark was taken.  Marks taken
+ * after this one become invalid.
+ *
+ * @param[in] pbp The arena
+ * @param[in] markp The mark
+ */
+void
+psu_bump_release (psu_bump_t *pbp, const psu_bump_mark_t *markp);
+
+/**
+ * Empty the arena for reuse, keeping one block around
+ */
+void
+psu_bump_reset (psu_bump_t *pbp);
+
+/**
+ * Free every block the arena holds
+ */
+void
+psu_bump_cleanup (psu_bump_t *pbp);
+
+/**
+ * Return the number of bytes the arena has taken from its parent
+ */
+size_t
+psu_bump_size (psu_bump_t *pbp);
+
+/**
+ * Return the arena as an allocator object.  Memory allocated this
+ * way carries a small header recording its size, so it can be
+ * reallocated; the most recent allocation is grown (or freed) in
+ * place, and freeing anything else is a no-op.
+ */
+psu_allocator_t *
+psu_bump_allocator (psu_bump_t *pbp);
+
+#endif /* LIBPSU_PSUBUMP_H */
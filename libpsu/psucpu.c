@@ -11,11 +11,16 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <libpsu/psucommon.h>
 #include <libpsu/psulog.h>
 #include <libpsu/psucpu.h>
 
+#ifdef HAVE_SCHED_GETAFFINITY
+#include <sched.h>
+#endif /* HAVE_SCHED_GETAFFINITY */
+
 typedef struct psu_cpu_flags_s {
     uint32_t cf_bit;
     const char *cf_name;
@@ -115,6 +120,171 @@ psu_cpu_get_info (uint32_t which, psu_cpuid_t *pcp)
 	    which, pcp->pc_ax, pcp->pc_bx, pcp->pc_cx, pcp->pc_dx);
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Which register state the OS saves for us (XCR0): bit 1 is xmm, bit
+ * 2 is ymm, and bits 5-7 are the AVX-512 opmask and zmm registers
+ */
+static uint32_t
+psu_cpu_xcr0 (void)
+{
+    uint32_t xcr0_lo, xcr0_hi;
+
+    asm volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    return xcr0_lo;
+}
+#endif /* _X86_ */
+
+static uint32_t
+psu_cpu_features_detect (void)
+{
+    uint32_t features = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    psu_cpuid_t pc;
+    uint32_t max_leaf, xcr0 = 0;
+
+    psu_cpu_get_info(0, &pc);
+    max_leaf = pc.pc_ax;
+    if (max_leaf < 1)
+	return features;
+
+    psu_cpu_get_info(1, &pc);
+    if (pc.pc_dx & CPU_DX_SSE2)
+	features |= PSU_CPU_F_SSE2;
+    if ((pc.pc_cx & (CPU_CX_SSSE3S | CPU_CX_SSE41 | CPU_CX_SSE42))
+	    == (CPU_CX_SSSE3S | CPU_CX_SSE41 | CPU_CX_SSE42))
+	features |= PSU_CPU_F_SSE42;
+    if (pc.pc_cx & CPU_CX_POPCNT)
+	features |= PSU_CPU_F_POPCNT;
+
+    if ((pc.pc_cx & (CPU_CX_OSXSAVE | CPU_CX_AVX))
+	    == (CPU_CX_OSXSAVE | CPU_CX_AVX))
+	xcr0 = psu_cpu_xcr0();
+
+    if (max_leaf < 7)		/* Max leaf doesn't reach extended features */
+	return features;
+
+    psu_cpu_get_info(7, &pc);
+    if (pc.pc_bx & CPU_7BX_BMI2)
+	features |= PSU_CPU_F_BMI2;
+
+    if ((xcr0 & 0x6) != 0x6)	/* No ymm state; nothing wider works */
+	return features;
+
+    if (pc.pc_bx & CPU_7BX_AVX2)
+	features |= PSU_CPU_F_AVX2;
+
+    if ((xcr0 & 0xe0) == 0xe0
+	    && (pc.pc_bx & (CPU_7BX_AVX512F | CPU_7BX_AVX512BW))
+	    == (CPU_7BX_AVX512F | CPU_7BX_AVX512BW))
+	features |= PSU_CPU_F_AVX512;
+
+#elif defined(__aarch64__)
+    features |= PSU_CPU_F_NEON;	/* Advanced SIMD is mandatory */
+#endif /* _X86_ */
+
+    return features;
+}
+
+uint32_t
+psu_cpu_features (void)
+{
+    /* Threads racing to fill this in will all get the same answer */
+    static int64_t features = -1;
+
+    if (features < 0)
+	features = psu_cpu_features_detect();
+
+    return (uint32_t) features;
+}
+
+static const char *psu_cpu_feature_names[] = {
+    "sse2", "sse42", "popcnt", "avx2", "bmi2", "avx512", "neon", NULL
+};
+
+const char *
+psu_cpu_feature_name (uint32_t feature)
+{
+    unsigned bit;
+
+    for (bit = 0; psu_cpu_feature_names[bit]; bit++)
+	if (feature == (1U << bit))
+	    return psu_cpu_feature_names[bit];
+
+    return NULL;
+}
+
+uint32_t
+psu_cpu_feature_find (const char *name)
+{
+    unsigned bit;
+
+    for (bit = 0; psu_cpu_feature_names[bit]; bit++)
+	if (strcmp(name, psu_cpu_feature_names[bit]) == 0)
+	    return 1U << bit;
+
+    return 0;
+}
+
+int
+psu_cpu_has_avx2 (void)
+{
+    return (psu_cpu_features() & PSU_CPU_F_AVX2) ? 1 : 0;
+}
+
+unsigned
+psu_cpu_list (unsigned *cpus, unsigned max)
+{
+    unsigned count = 0;
+
+#ifdef HAVE_SCHED_GETAFFINITY
+    cpu_set_t set;
+    unsigned cpu;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+	for (cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+	    if (CPU_ISSET(cpu, &set))
+		cpus[count++] = cpu;
+	if (count)
+	    return count;
+    }
+#endif /* HAVE_SCHED_GETAFFINITY */
+
+    /* Without an affinity mask, we can use anything that's online */
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (online < 1)
+	online = 1;
+    for (count = 0; count < (unsigned) online && count < max; count++)
+	cpus[count] = count;
+
+    return count;
+}
+
+unsigned
+psu_cpu_count (void)
+{
+    /* As with the features, racing threads get the same answer */
+    static unsigned count;
+
+    if (count == 0) {
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+	    count = CPU_COUNT(&set);
+#endif /* HAVE_SCHED_GETAFFINITY */
+
+	if (count == 0) {
+	    long online = sysconf(_SC_NPROCESSORS_ONLN);
+	    count = (online > 0) ? online : 1;
+	}
+    }
+
+    return count;
+}
+
 static void
 psu_cpu_print_bits (const char *title, int verbose, uint32_t flags,
 		    psu_cpu_flags_t *cfp)
@@ -107,9 +107,71 @@ typedef struct psu_cpuid_s {
 #define CPU_DX_IA64 (1<<30) /* IA64 processor emulating x86 */
 #define CPU_DX_PBE (1<<31) /* Pending Break Enable (PBE# pin) wakeup support */
 
+/* Flags for "pc_bx" after cpuid with eax=7 (extended features): */
+#define CPU_7BX_BMI1 (1<<3) /* Bit Manipulation Instruction Set 1 */
+#define CPU_7BX_AVX2 (1<<5) /* Advanced Vector Extensions 2 */
+#define CPU_7BX_BMI2 (1<<8) /* Bit Manipulation Instruction Set 2 */
+#define CPU_7BX_AVX512F (1<<16) /* AVX-512 Foundation */
+#define CPU_7BX_AVX512BW (1<<30) /* AVX-512 Byte and Word instructions */
+
 void
 psu_cpu_get_info (uint32_t which, psu_cpuid_t *pcp);
 
+/*
+ * Instruction set features that code paths can be chosen by.  A
+ * feature is only reported if both the CPU and the OS support it
+ * (for the vector extensions, the OS must save the wider registers).
+ */
+#define PSU_CPU_F_SSE2		(1<<0) /* SSE2 */
+#define PSU_CPU_F_SSE42		(1<<1) /* SSE4.2 (and SSSE3, SSE4.1) */
+#define PSU_CPU_F_POPCNT	(1<<2) /* POPCNT instruction */
+#define PSU_CPU_F_AVX2		(1<<3) /* AVX2 */
+#define PSU_CPU_F_BMI2		(1<<4) /* BMI2 (pdep, pext, ...) */
+#define PSU_CPU_F_AVX512	(1<<5) /* AVX-512 F and BW */
+#define PSU_CPU_F_NEON		(1<<6) /* ARM Advanced SIMD */
+
+/*
+ * Return the PSU_CPU_F_* features of the CPU we're running on.  The
+ * answer is computed once and cached.
+ */
+uint32_t
+psu_cpu_features (void);
+
+/*
+ * Return the name of a single PSU_CPU_F_* feature ("avx2"), or NULL
+ */
+const char *
+psu_cpu_feature_name (uint32_t feature);
+
+/*
+ * Return the PSU_CPU_F_* feature with the given name, or zero
+ */
+uint32_t
+psu_cpu_feature_find (const char *name);
+
+/*
+ * Return non-zero if the CPU and the OS both support AVX2; the OS
+ * must be saving the ymm registers (via XSAVE) for this to be usable.
+ */
+int
+psu_cpu_has_avx2 (void);
+
+/*
+ * Return the number of CPUs this process may run on (never zero).
+ * This honors the affinity mask we were started with, so a process
+ * under "taskset" or in a cpuset sizes itself to its share.  The
+ * answer is computed once and cached.
+ */
+unsigned
+psu_cpu_count (void);
+
+/*
+ * Fill "cpus" with the numbers of the CPUs this process may run on,
+ * lowest first, returning how many were filled in (at most "max")
+ */
+unsigned
+psu_cpu_list (unsigned *cpus, unsigned max);
+
 void
 psu_dump_cpu_info (int);
 
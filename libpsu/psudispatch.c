@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psudispatch.c -- choose between CPU-specific versions of a kernel
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psucpu.h>
+#include <libpsu/psudispatch.h>
+
+static pthread_mutex_t psu_dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static psu_dispatch_t *psu_dispatch_list; /* Registered kernels */
+
+/*
+ * Walk the PSU_DISPATCH override, calling "func" for each word.  We
+ * take the environment as we find it, rather than caching it, since
+ * binding only happens a handful of times.
+ */
+static void
+psu_dispatch_env (void (*func)(const char *word, size_t len, void *opaque),
+		  void *opaque)
+{
+    const char *cp = getenv(PSU_DISPATCH_ENV);
+    size_t len;
+
+    if (cp == NULL)
+	return;
+
+    for (;;) {
+	cp += strspn(cp, ", \t");
+	if (*cp == '\0')
+	    break;
+
+	len = strcspn(cp, ", \t");
+	func(cp, len, opaque);
+	cp += len;
+    }
+}
+
+static void
+psu_dispatch_env_features (const char *word, size_t len, void *opaque)
+{
+    uint32_t *featuresp = opaque;
+    char name[32];
+
+    if (len == 6 && strncmp(word, "scalar", len) == 0) {
+	*featuresp = 0;
+	return;
+    }
+
+    if (word[0] != '-' || len - 1 >= sizeof(name))
+	return;
+
+    memcpy(name, word + 1, len - 1);
+    name[len - 1] = '\0';
+    *featuresp &= ~psu_cpu_feature_find(name);
+}
+
+uint32_t
+psu_dispatch_features (void)
+{
+    uint32_t features = psu_cpu_features();
+
+    psu_dispatch_env(psu_dispatch_env_features, &features);
+    return features;
+}
+
+typedef struct psu_dispatch_want_s {
+    const char *pdw_kernel;	/* Kernel we're looking for */
+    char pdw_variant[32];	/* Variant it asks for (last one wins) */
+} psu_dispatch_want_t;
+
+static void
+psu_dispatch_env_variant (const char *word, size_t len, void *opaque)
+{
+    psu_dispatch_want_t *pdwp = opaque;
+    size_t klen = strlen(pdwp->pdw_kernel);
+
+    if (len <= klen + 1 || word[klen] != '='
+	    || strncmp(word, pdwp->pdw_kernel, klen) != 0)
+	return;
+
+    word += klen + 1;
+    len -= klen + 1;
+
+    if (len >= sizeof(pdwp->pdw_variant))
+	return;
+
+    memcpy(pdwp->pdw_variant, word, len);
+    pdwp->pdw_variant[len] = '\0';
+}
+
+static const psu_dispatch_variant_t *
+psu_dispatch_find (psu_dispatch_t *pdp, const char *name, uint32_t features)
+{
+    const psu_dispatch_variant_t *pdvp;
+
+    for (pdvp = pdp->pd_variants; pdvp->pdv_name; pdvp++)
+	if (strcmp(pdvp->pdv_name, name) == 0)
+	    return ((pdvp->pdv_needs & ~features) == 0) ? pdvp : NULL;
+
+    return NULL;
+}
+
+/*
+ * Make the normal choice for a kernel; the caller holds the lock
+ */
+static void
+psu_dispatch_choose (psu_dispatch_t *pdp)
+{
+    const psu_dispatch_variant_t *pdvp, *last = NULL;
+    uint32_t features = psu_dispatch_features();
+    psu_dispatch_want_t want = { .pdw_kernel = pdp->pd_name };
+
+    /* An override that names a variant we can't run is ignored */
+    psu_dispatch_env(psu_dispatch_env_variant, &want);
+    if (want.pdw_variant[0]) {
+	pdvp = psu_dispatch_find(pdp, want.pdw_variant, features);
+	if (pdvp) {
+	    pdp->pd_bound = pdvp;
+	    return;
+	}
+    }
+
+    for (pdvp = pdp->pd_variants; pdvp->pdv_name; pdvp++) {
+	if ((pdvp->pdv_needs & ~features) == 0) {
+	    pdp->pd_bound = pdvp;
+	    return;
+	}
+	last = pdvp;
+    }
+
+    /* The table is broken (the last variant should need nothing) */
+    pdp->pd_bound = last;
+}
+
+/*
+ * Add a kernel to the registry; the caller holds the lock
+ */
+static void
+psu_dispatch_register (psu_dispatch_t *pdp)
+{
+    psu_dispatch_t *cur;
+
+    for (cur = psu_dispatch_list; cur; cur = cur->pd_next)
+	if (cur == pdp)
+	    return;
+
+    pdp->pd_next = psu_dispatch_list;
+    psu_dispatch_list = pdp;
+}
+
+psu_dispatch_func_t
+psu_dispatch_bind (psu_dispatch_t *pdp)
+{
+    psu_dispatch_func_t func;
+
+    pthread_mutex_lock(&psu_dispatch_lock);
+
+    if (pdp->pd_bound == NULL) {
+	psu_dispatch_register(pdp);
+	psu_dispatch_choose(pdp);
+    }
+
+    func = pdp->pd_bound ? pdp->pd_bound->pdv_func : NULL;
+
+    pthread_mutex_unlock(&psu_dispatch_lock);
+
+    return func;
+}
+
+psu_dispatch_func_t
+psu_dispatch_select (psu_dispatch_t *pdp, const char *name)
+{
+    const psu_dispatch_variant_t *pdvp;
+    psu_dispatch_func_t func = NULL;
+
+    pthread_mutex_lock(&psu_dispatch_lock);
+
+    psu_dispatch_register(pdp);
+
+    if (name == NULL) {
+	psu_dispatch_choose(pdp);
+	func = pdp->pd_bound ? pdp->pd_bound->pdv_func : NULL;
+    } else {
+	pdvp = psu_dispatch_find(pdp, name, psu_cpu_features());
+	if (pdvp) {
+	    pdp->pd_bound = pdvp;
+	    func = pdvp->pdv_func;
+	}
+    }
+
+    pthread_mutex_unlock(&psu_dispatch_lock);
+
+    return func;
+}
+
+const char *
+psu_dispatch_name (psu_dispatch_t *pdp)
+{
+    if (pdp->pd_bound == NULL)
+	psu_dispatch_bind(pdp);
+
+    return pdp->pd_bound ? pdp->pd_bound->pdv_name : NULL;
+}
+
+void
+psu_dispatch_dump (FILE *fp)
+{
+    psu_dispatch_t *pdp;
+    const psu_dispatch_variant_t *pdvp;
+    uint32_t features = psu_dispatch_features();
+    uint32_t bit;
+    const char *name;
+    int hit = 0;
+
+    fprintf(fp, "dispatch features:");
+    for (bit = 1; bit; bit <<= 1) {
+	if (!(features & bit))
+	    continue;
+	name = psu_cpu_feature_name(bit);
+	if (name)
+	    fprintf(fp, "%s%s", hit++ ? ", " : " ", name);
+    }
+    fprintf(fp, "%s\n", hit ? "" : " none");
+
+    pthread_mutex_lock(&psu_dispatch_lock);
+
+    for (pdp = psu_dispatch_list; pdp; pdp = pdp->pd_next) {
+	fprintf(fp, "dispatch %s:", pdp->pd_name);
+	for (pdvp = pdp->pd_variants; pdvp->pdv_name; pdvp++)
+	    fprintf(fp, " %s%s%s", (pdvp == pdp->pd_bound) ? "[" : "",
+		    pdvp->pdv_name, (pdvp == pdp->pd_bound) ? "]" : "");
+	fprintf(fp, "\n");
+    }
+
+    pthread_mutex_unlock(&psu_dispatch_lock);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psudispatch.h -- choose between CPU-specific versions of a kernel
+ *
+ * A kernel (a hot function with scalar and vector implementations)
+ * describes its variants in a table, best first, each with the
+ * PSU_CPU_F_* features it needs; the last variant must need nothing.
+ * The first time the kernel is bound, we pick the best variant this
+ * CPU can run and add the kernel to a registry so it can be listed.
+ * Callers keep the bound function in their own (properly typed)
+ * pointer, so the hot path is a single indirect call.
+ *
+ * The PSU_DISPATCH environment variable overrides the choice, for
+ * testing and benchmarking.  It holds a comma-separated list of:
+ *     kernel=variant   use this variant of this kernel (if runnable)
+ *     -feature         pretend the CPU lacks this feature ("-avx2")
+ *     scalar           pretend the CPU has no features at all
+ */
+
+#ifndef LIBPSU_PSUDISPATCH_H
+#define LIBPSU_PSUDISPATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libpsu/psucpu.h>
+
+#define PSU_DISPATCH_ENV "PSU_DISPATCH" /* Override environment variable */
+
+/* A generic function pointer; callers cast to their real type */
+typedef void (*psu_dispatch_func_t)(void);
+
+#define PSU_DISPATCH_FUNC(_f) ((psu_dispatch_func_t) (_f))
+
+typedef struct psu_dispatch_variant_s {
+    const char *pdv_name;	/* Name of this variant ("avx2") */
+    uint32_t pdv_needs;		/* Features it needs (PSU_CPU_F_*) */
+    psu_dispatch_func_t pdv_func; /* The implementation */
+} psu_dispatch_variant_t;
+
+typedef struct psu_dispatch_s {
+    const char *pd_name;	/* Name of this kernel ("xi-scan") */
+    const psu_dispatch_variant_t *pd_variants; /* Best first, NULL ends */
+    const psu_dispatch_variant_t *pd_bound; /* Variant in use (or NULL) */
+    struct psu_dispatch_s *pd_next; /* Next registered kernel */
+} psu_dispatch_t;
+
+/*
+ * Initializer for a kernel's psu_dispatch_t
+ */
+#define PSU_DISPATCH_INIT(_name, _variants) \
+    { .pd_name = (_name), .pd_variants = (_variants) }
+
+/**
+ * Bind a kernel to its best variant, registering it on first use.
+ * Later calls return the same answer.
+ *
+ * @param[in] pdp The kernel
+ * @return the chosen function
+ */
+psu_dispatch_func_t
+psu_dispatch_bind (psu_dispatch_t *pdp);
+
+/**
+ * Force a kernel to use a particular variant, or (with NULL) go back
+ * to the normal choice
+ *
+ * @param[in] pdp The kernel
+ * @param[in] name Name of the variant, or NULL
+ * @return the chosen function, or NULL if the variant is unknown or
+ *    won't run on this CPU (in which case nothing changes)
+ */
+psu_dispatch_func_t
+psu_dispatch_select (psu_dispatch_t *pdp, const char *name);
+
+/**
+ * Return the name of the variant a kernel is bound to, binding it
+ * if needed
+ */
+const char *
+psu_dispatch_name (psu_dispatch_t *pdp);
+
+/**
+ * Return the features variants may use: those of the CPU, less any
+ * removed by PSU_DISPATCH
+ */
+uint32_t
+psu_dispatch_features (void);
+
+/**
+ * List each registered kernel, its variants, and the one in use
+ */
+void
+psu_dispatch_dump (FILE *fp);
+
+#endif /* LIBPSU_PSUDISPATCH_H */
@@ -10,11 +10,18 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include <libpsu/psucommon.h>
 #include <libpsu/psuthread.h>
 #include <libpsu/psulog.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+
 static THREAD_GLOBAL(int) psu_log_is_enabledp;
 static THREAD_GLOBAL(psu_log_callback_t) psu_log_callback;
 static THREAD_GLOBAL(void *) psu_log_callback_data;
@@ -62,6 +69,948 @@ psu_log_to_file (FILE *fp)
     psu_log_fp = fp;
 }
 
+/*
+ * Write formatted log data to the callback or the log file.  The
+ * drain thread flushes the file once per batch rather than once per
+ * message.
+ */
+static void
+psu_log_write (const char *fmt, int newline, int flush, va_list vap)
+{
+    if (psu_log_callback) {
+	psu_log_callback(psu_log_callback_data, fmt, vap);
+    } else {
+	vfprintf(psu_log_fp ?: stderr, fmt, vap);
+	if (newline)
+	    fprintf(psu_log_fp ?: stderr, "\n");
+	if (flush)
+	    fflush(psu_log_fp ?: stderr);
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Asynchronous logging.  Each thread that logs gets its own ring, in
+ * which it is the only producer: psu_logv() formats the message into
+ * the ring and bumps plg_head, and a drain thread writes records out
+ * and bumps plg_tail, so the thread running the code being logged
+ * never takes a lock or waits for the file.  psu_log_deferred() goes
+ * further and copies only the raw arguments, leaving the formatting
+ * to the drain thread as well.  Records carry a global sequence
+ * number, and the drain thread merges the rings in that order.  If a
+ * ring is full, the message is dropped and counted, rather than
+ * making the caller wait.
+ *
+ * As with slaxio's output ring, the mutex and condition variable are
+ * only used to let the drain thread sleep when it's caught up; a
+ * producer touches them only when plq_waiting says it's asleep.
+ */
+#define PSU_LOG_RING_SIZE (64 * 1024) /* Must be a power of two */
+#define PSU_LOG_ALIGN	8	/* Records start on this boundary */
+#define PSU_LOG_LINE_MAX 4096	/* Longest deferred message we'll format */
+#define PSU_LOG_MAX_ARGS 32	/* Most arguments for a deferred message */
+
+#define PSU_LOG_REC_PAD	0	/* Skip to the start of the ring */
+#define PSU_LOG_REC_TEXT 1	/* Preformatted text */
+#define PSU_LOG_REC_DEFER 2	/* Format string and raw arguments */
+
+typedef struct psu_log_rec_s {
+    uint32_t plr_len;		/* Length of the record (aligned) */
+    uint16_t plr_type;		/* Type of record (PSU_LOG_REC_*) */
+    uint16_t plr_newline;	/* Append a newline */
+    uint64_t plr_seq;		/* Global sequence number */
+    char plr_data[0];		/* Text, or deferred arguments */
+} psu_log_rec_t;
+
+/* The arguments of a deferred message, as psu_log_deferred saw them */
+typedef enum psu_log_arg_type_e {
+    PLA_INT,			/* Any signed integer, widened */
+    PLA_UINT,			/* Any unsigned integer, widened */
+    PLA_DOUBLE,			/* Any floating point, as a double */
+    PLA_PTR,			/* Pointer (%p) */
+    PLA_STRING,			/* String, copied after the arguments */
+} psu_log_arg_type_t;
+
+typedef struct psu_log_arg_s {
+    uint32_t pla_type;		/* Type of argument (PLA_*) */
+    union {
+	long long pla_int;
+	unsigned long long pla_uint;
+	double pla_double;
+	const void *pla_ptr;
+	size_t pla_offset;	/* PLA_STRING: offset in the record */
+    };
+} psu_log_arg_t;
+
+typedef struct psu_log_defer_s {
+    const char *pld_fmt;	/* Format (which must stay put) */
+    uint32_t pld_nargs;		/* Number of arguments */
+    psu_log_arg_t pld_args[0];	/* Arguments */
+} psu_log_defer_t;
+
+typedef struct psu_log_ring_s {
+    struct psu_log_ring_s *plg_next; /* Next ring (on plq_rings) */
+    struct psu_log_queue_s *plg_queue; /* Queue we belong to */
+    size_t plg_head;		/* Next byte to fill (producer) */
+    size_t plg_tail;		/* Next byte to drain (drain thread) */
+    int plg_dead;		/* Owning thread has exited */
+    char plg_buf[PSU_LOG_RING_SIZE]; /* Records */
+} psu_log_ring_t;
+
+typedef struct psu_log_queue_s {
+    pthread_mutex_t plq_mutex;	/* Protects plq_rings and sleeping */
+    pthread_cond_t plq_data;	/* Signaled when records are added */
+    pthread_cond_t plq_drained;	/* Signaled when caught up */
+    pthread_t plq_thread;	/* The drain thread */
+    pthread_key_t plq_key;	/* Marks rings dead at thread exit */
+    psu_log_ring_t *plq_rings;	/* Every thread's ring */
+    uint64_t plq_seq;		/* Next sequence number */
+    unsigned long plq_dropped;	/* Messages lost to full rings */
+    unsigned long plq_reported; /* Drops we've already reported */
+    unsigned plq_flushes;	/* Flush requests (and completions) */
+    unsigned plq_flushed;
+    int plq_waiting;		/* Drain thread is sleeping for data */
+    int plq_stop;		/* Drain thread should exit when empty */
+} psu_log_queue_t;
+
+static psu_log_queue_t *psu_log_queue; /* Queue (when async) */
+static THREAD_LOCAL(psu_log_ring_t *) psu_log_ring;
+
+#define PLQ_LOAD(_x) __atomic_load_n(&(_x), __ATOMIC_ACQUIRE)
+#define PLQ_STORE(_x, _v) __atomic_store_n(&(_x), (_v), __ATOMIC_RELEASE)
+
+static inline size_t
+psu_log_align (size_t len)
+{
+    return (len + PSU_LOG_ALIGN - 1) & ~((size_t) PSU_LOG_ALIGN - 1);
+}
+
+/*
+ * Call the writer with a variadic argument list of our own making
+ */
+static void
+psu_log_emit (int newline, const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    psu_log_write(fmt, newline, FALSE, vap);
+    va_end(vap);
+}
+
+static void
+psu_log_ring_dead (void *arg)
+{
+    psu_log_ring_t *plgp = arg;
+
+    PLQ_STORE(plgp->plg_dead, TRUE);
+}
+
+/*
+ * Find (or make) the calling thread's ring
+ */
+static psu_log_ring_t *
+psu_log_ring_get (psu_log_queue_t *plqp)
+{
+    psu_log_ring_t *plgp = psu_log_ring;
+
+    /* A ring left from an earlier psu_log_async_start() won't do */
+    if (plgp && plgp->plg_queue == plqp)
+	return plgp;
+
+    plgp = calloc(1, sizeof(*plgp));
+    if (plgp == NULL)
+	return NULL;
+
+    plgp->plg_queue = plqp;
+
+    pthread_mutex_lock(&plqp->plq_mutex);
+    plgp->plg_next = plqp->plq_rings;
+    plqp->plq_rings = plgp;
+    pthread_mutex_unlock(&plqp->plq_mutex);
+
+    pthread_setspecific(plqp->plq_key, plgp);
+    psu_log_ring = plgp;
+
+    return plgp;
+}
+
+/*
+ * Make room for a record of "len" bytes (header included) at the
+ * head of the ring, returning NULL if it won't fit.  Records don't
+ * wrap, so if there isn't room before the end of the ring, we pad to
+ * the end and start over at the beginning; "totalp" gets the number
+ * of bytes that psu_log_commit() needs to advance.
+ */
+static psu_log_rec_t *
+psu_log_reserve (psu_log_queue_t *plqp, psu_log_ring_t *plgp, size_t len,
+		 size_t *totalp)
+{
+    size_t head = plgp->plg_head, off, pad;
+    psu_log_rec_t *plrp;
+
+    len = psu_log_align(len);
+    off = head & (PSU_LOG_RING_SIZE - 1);
+    pad = (off + len > PSU_LOG_RING_SIZE) ? PSU_LOG_RING_SIZE - off : 0;
+
+    if (len > PSU_LOG_RING_SIZE / 2
+	    || head + pad + len - PLQ_LOAD(plgp->plg_tail) > PSU_LOG_RING_SIZE) {
+	__atomic_add_fetch(&plqp->plq_dropped, 1, __ATOMIC_RELAXED);
+	return NULL;
+    }
+
+    if (pad) {
+	plrp = (psu_log_rec_t *) (plgp->plg_buf + off);
+	plrp->plr_len = pad;
+	plrp->plr_type = PSU_LOG_REC_PAD;
+	off = 0;
+    }
+
+    plrp = (psu_log_rec_t *) (plgp->plg_buf + off);
+    plrp->plr_len = len;
+    *totalp = pad + len;
+    return plrp;
+}
+
+/*
+ * Publish a filled-in record to the drain thread
+ */
+static void
+psu_log_commit (psu_log_queue_t *plqp, psu_log_ring_t *plgp,
+		psu_log_rec_t *plrp, size_t total, int type, int newline)
+{
+    plrp->plr_type = type;
+    plrp->plr_newline = newline;
+    plrp->plr_seq = __atomic_fetch_add(&plqp->plq_seq, 1, __ATOMIC_RELAXED);
+
+    PLQ_STORE(plgp->plg_head, plgp->plg_head + total);
+
+    if (PLQ_LOAD(plqp->plq_waiting)) {
+	pthread_mutex_lock(&plqp->plq_mutex);
+	pthread_cond_broadcast(&plqp->plq_data);
+	pthread_mutex_unlock(&plqp->plq_mutex);
+    }
+}
+
+/*
+ * Push a message that's formatted here, in the caller's thread
+ */
+static int
+psu_log_push_text (psu_log_queue_t *plqp, const char *fmt,
+		   int newline, va_list vap)
+{
+    psu_log_ring_t *plgp = psu_log_ring_get(plqp);
+    psu_log_rec_t *plrp;
+    char buf[512];
+    va_list vap2;
+    size_t total;
+    int len;
+
+    if (plgp == NULL)
+	return -1;
+
+    va_copy(vap2, vap);
+    len = vsnprintf(buf, sizeof(buf), fmt, vap2);
+    va_end(vap2);
+    if (len < 0)
+	return 0;
+
+    plrp = psu_log_reserve(plqp, plgp, sizeof(*plrp) + len + 1, &total);
+    if (plrp == NULL)
+	return 0;
+
+    if ((size_t) len < sizeof(buf))
+	memcpy(plrp->plr_data, buf, len + 1);
+    else
+	vsnprintf(plrp->plr_data, len + 1, fmt, vap);
+
+    psu_log_commit(plqp, plgp, plrp, total, PSU_LOG_REC_TEXT, newline);
+    return 0;
+}
+
+/*
+ * Walk a printf format, calling "func" for each conversion that
+ * consumes an argument.  "spec" and "slen" give the conversion, and
+ * "type" says what sort of argument it takes.  Returns the number of
+ * arguments, or -1 if the format uses something we can't defer.
+ */
+typedef int (*psu_log_conv_func_t)(void *opaque, const char *spec,
+				   size_t slen, psu_log_arg_type_t type,
+				   int length);
+
+#define PLL_NONE	0	/* No length modifier */
+#define PLL_CHAR	1	/* hh */
+#define PLL_SHORT	2	/* h */
+#define PLL_LONG	3	/* l */
+#define PLL_LONGLONG	4	/* ll, j */
+#define PLL_SIZE	5	/* z, t */
+#define PLL_LDOUBLE	6	/* L */
+
+static int
+psu_log_scan (const char *fmt, psu_log_conv_func_t func, void *opaque)
+{
+    const char *cp, *spec;
+    int count = 0, length;
+
+    for (cp = fmt; *cp; cp++) {
+	if (*cp != '%')
+	    continue;
+
+	spec = cp++;
+	if (*cp == '%')
+	    continue;
+
+	/* Flags, width and precision; '*' takes an int argument */
+	for (; *cp && strchr("-+ #0'", *cp); cp++)
+	    continue;
+	for (; *cp == '*' || (*cp >= '0' && *cp <= '9') || *cp == '.'; cp++) {
+	    if (*cp == '*') {
+		if (func && func(opaque, NULL, 0, PLA_INT, PLL_NONE) < 0)
+		    return -1;
+		count += 1;
+	    }
+	}
+
+	length = PLL_NONE;
+	switch (*cp) {
+	case 'h':
+	    length = (cp[1] == 'h') ? PLL_CHAR : PLL_SHORT;
+	    cp += (cp[1] == 'h') ? 2 : 1;
+	    break;
+	case 'l':
+	    length = (cp[1] == 'l') ? PLL_LONGLONG : PLL_LONG;
+	    cp += (cp[1] == 'l') ? 2 : 1;
+	    break;
+	case 'j':
+	    length = PLL_LONGLONG;
+	    cp += 1;
+	    break;
+	case 'z':
+	case 't':
+	    length = PLL_SIZE;
+	    cp += 1;
+	    break;
+	case 'L':
+	    length = PLL_LDOUBLE;
+	    cp += 1;
+	    break;
+	}
+
+	psu_log_arg_type_t type;
+	switch (*cp) {
+	case 'd': case 'i': case 'c':
+	    type = PLA_INT;
+	    break;
+	case 'u': case 'x': case 'X': case 'o':
+	    type = PLA_UINT;
+	    break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+	    type = PLA_DOUBLE;
+	    break;
+	case 'p':
+	    type = PLA_PTR;
+	    break;
+	case 's':
+	    type = PLA_STRING;
+	    break;
+	default:		/* %n and other things we don't do */
+	    return -1;
+	}
+
+	/* Wide characters and strings aren't worth the bother */
+	if ((*cp == 's' || *cp == 'c') && length != PLL_NONE)
+	    return -1;
+
+	if (func && func(opaque, spec, cp - spec + 1, type, length) < 0)
+	    return -1;
+	count += 1;
+    }
+
+    return count;
+}
+
+/*
+ * State for copying deferred arguments out of a va_list
+ */
+typedef struct psu_log_gather_s {
+    va_list *plgr_vap;		/* Arguments */
+    psu_log_arg_t *plgr_args;	/* Where they go */
+    unsigned plgr_count;	/* Arguments so far */
+    size_t plgr_strings;	/* Bytes of string data so far */
+    const char *plgr_strs[PSU_LOG_MAX_ARGS]; /* The strings */
+} psu_log_gather_t;
+
+static int
+psu_log_gather (void *opaque, const char *spec UNUSED, size_t slen UNUSED,
+		psu_log_arg_type_t type, int length)
+{
+    psu_log_gather_t *plgrp = opaque;
+    psu_log_arg_t *plap;
+    const char *str;
+
+    if (plgrp->plgr_count >= PSU_LOG_MAX_ARGS)
+	return -1;
+
+    plap = &plgrp->plgr_args[plgrp->plgr_count];
+    plap->pla_type = type;
+
+    switch (type) {
+    case PLA_INT:
+	switch (length) {
+	case PLL_LONG:
+	    plap->pla_int = va_arg(*plgrp->plgr_vap, long);
+	    break;
+	case PLL_LONGLONG:
+	    plap->pla_int = va_arg(*plgrp->plgr_vap, long long);
+	    break;
+	case PLL_SIZE:
+	    plap->pla_int = va_arg(*plgrp->plgr_vap, ssize_t);
+	    break;
+	case PLL_CHAR:
+	    plap->pla_int = (signed char) va_arg(*plgrp->plgr_vap, int);
+	    break;
+	case PLL_SHORT:
+	    plap->pla_int = (short) va_arg(*plgrp->plgr_vap, int);
+	    break;
+	default:
+	    plap->pla_int = va_arg(*plgrp->plgr_vap, int);
+	}
+	break;
+
+    case PLA_UINT:
+	switch (length) {
+	case PLL_LONG:
+	    plap->pla_uint = va_arg(*plgrp->plgr_vap, unsigned long);
+	    break;
+	case PLL_LONGLONG:
+	    plap->pla_uint = va_arg(*plgrp->plgr_vap, unsigned long long);
+	    break;
+	case PLL_SIZE:
+	    plap->pla_uint = va_arg(*plgrp->plgr_vap, size_t);
+	    break;
+	case PLL_CHAR:
+	    plap->pla_uint = (unsigned char) va_arg(*plgrp->plgr_vap, unsigned);
+	    break;
+	case PLL_SHORT:
+	    plap->pla_uint = (unsigned short) va_arg(*plgrp->plgr_vap,
+						     unsigned);
+	    break;
+	default:
+	    plap->pla_uint = va_arg(*plgrp->plgr_vap, unsigned);
+	}
+	break;
+
+    case PLA_DOUBLE:
+	if (length == PLL_LDOUBLE)
+	    plap->pla_double = va_arg(*plgrp->plgr_vap, long double);
+	else
+	    plap->pla_double = va_arg(*plgrp->plgr_vap, double);
+	break;
+
+    case PLA_PTR:
+	plap->pla_ptr = va_arg(*plgrp->plgr_vap, void *);
+	break;
+
+    case PLA_STRING:
+	/* The string itself may not outlive the call, so we copy it */
+	str = va_arg(*plgrp->plgr_vap, const char *) ?: "(null)";
+	plgrp->plgr_strs[plgrp->plgr_count] = str;
+	plap->pla_offset = plgrp->plgr_strings;
+	plgrp->plgr_strings += strlen(str) + 1;
+	break;
+    }
+
+    plgrp->plgr_count += 1;
+    return 0;
+}
+
+/*
+ * Push a message whose formatting is left to the drain thread
+ */
+static int
+psu_log_push_deferred (psu_log_queue_t *plqp, const char *fmt,
+		       int newline, va_list vap)
+{
+    psu_log_ring_t *plgp = psu_log_ring_get(plqp);
+    psu_log_arg_t args[PSU_LOG_MAX_ARGS];
+    psu_log_gather_t gather;
+    psu_log_defer_t *pldp;
+    psu_log_rec_t *plrp;
+    size_t alen, len, total;
+    va_list vap2;
+    char *strs;
+    unsigned i;
+
+    if (plgp == NULL)
+	return -1;
+
+    bzero(&gather, sizeof(gather));
+    va_copy(vap2, vap);
+    gather.plgr_vap = &vap2;
+    gather.plgr_args = args;
+    i = psu_log_scan(fmt, psu_log_gather, &gather);
+    va_end(vap2);
+
+    if ((int) i < 0)		/* Can't defer this one; format it now */
+	return psu_log_push_text(plqp, fmt, newline, vap);
+
+    alen = sizeof(*pldp) + gather.plgr_count * sizeof(args[0]);
+    len = sizeof(*plrp) + alen + gather.plgr_strings;
+
+    plrp = psu_log_reserve(plqp, plgp, len, &total);
+    if (plrp == NULL)
+	return 0;
+
+    pldp = (psu_log_defer_t *) plrp->plr_data;
+    pldp->pld_fmt = fmt;
+    pldp->pld_nargs = gather.plgr_count;
+    memcpy(pldp->pld_args, args, gather.plgr_count * sizeof(args[0]));
+
+    strs = plrp->plr_data + alen;
+    for (i = 0; i < gather.plgr_count; i++) {
+	if (args[i].pla_type == PLA_STRING) {
+	    pldp->pld_args[i].pla_offset += alen;
+	    strcpy(strs, gather.plgr_strs[i]);
+	    strs += strlen(strs) + 1;
+	}
+    }
+
+    psu_log_commit(plqp, plgp, plrp, total, PSU_LOG_REC_DEFER, newline);
+    return 0;
+}
+
+/*
+ * State for formatting a deferred message in the drain thread: we
+ * hand each conversion and its argument to snprintf in turn
+ */
+typedef struct psu_log_format_s {
+    psu_log_rec_t *plf_rec;	/* Record being formatted */
+    psu_log_defer_t *plf_defer;	/* Its arguments */
+    unsigned plf_next;		/* Next argument to use */
+    const char *plf_fmt;	/* Where the last conversion ended */
+    char *plf_out;		/* Output so far */
+    size_t plf_used;		/* Bytes in plf_out */
+    size_t plf_size;		/* Size of plf_out */
+} psu_log_format_t;
+
+static void
+psu_log_format_literal (psu_log_format_t *plfp, const char *end)
+{
+    const char *cp;
+
+    /* Copy text (undoubling "%%") up to the next conversion */
+    for (cp = plfp->plf_fmt; cp < end; cp++) {
+	if (*cp == '%' && cp + 1 < end && cp[1] == '%')
+	    cp += 1;
+	if (plfp->plf_used + 1 < plfp->plf_size)
+	    plfp->plf_out[plfp->plf_used++] = *cp;
+    }
+
+    plfp->plf_fmt = end;
+}
+
+static int
+psu_log_format_conv (void *opaque, const char *spec, size_t slen,
+		     psu_log_arg_type_t type, int length UNUSED)
+{
+    psu_log_format_t *plfp = opaque;
+    psu_log_arg_t *plap, *stars[2];
+    char fbuf[32], *fp;
+    size_t left;
+    unsigned nstars = 0, i;
+    const char *cp;
+    int rc;
+
+    if (spec == NULL)
+	return 0;		/* A '*'; we pick these up with the conversion */
+
+    if (slen + 4 > sizeof(fbuf))
+	return -1;
+
+    /* Collect the '*' arguments that came before us */
+    for (cp = spec; cp < spec + slen; cp++)
+	if (*cp == '*' && nstars < 2)
+	    stars[nstars++] = &plfp->plf_defer->pld_args[plfp->plf_next++];
+
+    plap = &plfp->plf_defer->pld_args[plfp->plf_next++];
+
+    psu_log_format_literal(plfp, spec);
+    plfp->plf_fmt = spec + slen;
+
+    /*
+     * Rebuild the conversion with the length modifier that matches
+     * how we stored the argument
+     */
+    fp = fbuf;
+    for (cp = spec; cp < spec + slen - 1; cp++)
+	if (!strchr("hljztL", *cp))
+	    *fp++ = *cp;
+    if (type == PLA_INT || type == PLA_UINT) {
+	if (spec[slen - 1] != 'c') {
+	    *fp++ = 'l';
+	    *fp++ = 'l';
+	}
+    }
+    *fp++ = spec[slen - 1];
+    *fp = '\0';
+
+    left = plfp->plf_size - plfp->plf_used;
+    fp = plfp->plf_out + plfp->plf_used;
+
+    int w[2] = { 0, 0 };
+    for (i = 0; i < nstars; i++)
+	w[i] = (int) stars[i]->pla_int;
+
+#define PLF_PRINT(_arg) \
+    ((nstars == 2) ? snprintf(fp, left, fbuf, w[0], w[1], _arg) \
+     : (nstars == 1) ? snprintf(fp, left, fbuf, w[0], _arg) \
+     : snprintf(fp, left, fbuf, _arg))
+
+    switch (type) {
+    case PLA_INT:
+	if (spec[slen - 1] == 'c')
+	    rc = PLF_PRINT((int) plap->pla_int);
+	else
+	    rc = PLF_PRINT(plap->pla_int);
+	break;
+    case PLA_UINT:
+	rc = PLF_PRINT(plap->pla_uint);
+	break;
+    case PLA_DOUBLE:
+	rc = PLF_PRINT(plap->pla_double);
+	break;
+    case PLA_PTR:
+	rc = PLF_PRINT(plap->pla_ptr);
+	break;
+    case PLA_STRING:
+	rc = PLF_PRINT((const char *) plfp->plf_rec->plr_data
+		       + plap->pla_offset);
+	break;
+    default:
+	rc = 0;
+    }
+
+#undef PLF_PRINT
+
+    if (rc > 0) {
+	plfp->plf_used += rc;
+	if (plfp->plf_used >= plfp->plf_size)
+	    plfp->plf_used = plfp->plf_size - 1;
+    }
+
+    return 0;
+}
+
+static void
+psu_log_drain_one (psu_log_rec_t *plrp)
+{
+    static char out[PSU_LOG_LINE_MAX];	/* Only the drain thread uses this */
+    psu_log_format_t format;
+
+    if (plrp->plr_type == PSU_LOG_REC_TEXT) {
+	psu_log_emit(plrp->plr_newline, "%s", plrp->plr_data);
+	return;
+    }
+
+    bzero(&format, sizeof(format));
+    format.plf_rec = plrp;
+    format.plf_defer = (psu_log_defer_t *) plrp->plr_data;
+    format.plf_fmt = format.plf_defer->pld_fmt;
+    format.plf_out = out;
+    format.plf_size = sizeof(out);
+
+    psu_log_scan(format.plf_defer->pld_fmt, psu_log_format_conv, &format);
+    psu_log_format_literal(&format, format.plf_fmt + strlen(format.plf_fmt));
+    out[format.plf_used] = '\0';
+
+    psu_log_emit(plrp->plr_newline, "%s", out);
+}
+
+/*
+ * Return the next real record in a ring, skipping any padding
+ */
+static psu_log_rec_t *
+psu_log_ring_peek (psu_log_ring_t *plgp, size_t head)
+{
+    psu_log_rec_t *plrp;
+
+    while (plgp->plg_tail != head) {
+	plrp = (psu_log_rec_t *)
+	    (plgp->plg_buf + (plgp->plg_tail & (PSU_LOG_RING_SIZE - 1)));
+	if (plrp->plr_type != PSU_LOG_REC_PAD)
+	    return plrp;
+
+	PLQ_STORE(plgp->plg_tail, plgp->plg_tail + plrp->plr_len);
+    }
+
+    return NULL;
+}
+
+/*
+ * Write out everything that's in the rings now, in sequence order,
+ * and free the rings of threads that have exited.  Returns the
+ * number of records written.
+ */
+static unsigned
+psu_log_drain (psu_log_queue_t *plqp)
+{
+    psu_log_ring_t *plgp, *best, **prevp;
+    psu_log_rec_t *plrp, *best_rec;
+    unsigned count = 0;
+    unsigned long dropped;
+
+    pthread_mutex_lock(&plqp->plq_mutex);
+    psu_log_ring_t *rings = plqp->plq_rings;
+    pthread_mutex_unlock(&plqp->plq_mutex);
+
+    for (;;) {
+	best = NULL;
+	best_rec = NULL;
+
+	for (plgp = rings; plgp; plgp = plgp->plg_next) {
+	    plrp = psu_log_ring_peek(plgp, PLQ_LOAD(plgp->plg_head));
+	    if (plrp && (best_rec == NULL || plrp->plr_seq < best_rec->plr_seq)) {
+		best = plgp;
+		best_rec = plrp;
+	    }
+	}
+
+	if (best == NULL)
+	    break;
+
+	psu_log_drain_one(best_rec);
+	PLQ_STORE(best->plg_tail, best->plg_tail + best_rec->plr_len);
+	count += 1;
+    }
+
+    dropped = PLQ_LOAD(plqp->plq_dropped);
+    if (dropped != plqp->plq_reported) {
+	psu_log_emit(TRUE, "psulog: %lu message%s dropped",
+		     dropped - plqp->plq_reported,
+		     (dropped - plqp->plq_reported == 1) ? "" : "s");
+	plqp->plq_reported = dropped;
+	count += 1;
+    }
+
+    if (count && psu_log_callback == NULL)
+	fflush(psu_log_fp ?: stderr);
+
+    /* Rings whose threads are gone can go once they're empty */
+    pthread_mutex_lock(&plqp->plq_mutex);
+    for (prevp = &plqp->plq_rings; (plgp = *prevp) != NULL; ) {
+	if (PLQ_LOAD(plgp->plg_dead)
+		&& plgp->plg_tail == PLQ_LOAD(plgp->plg_head)) {
+	    *prevp = plgp->plg_next;
+	    free(plgp);
+	} else {
+	    prevp = &plgp->plg_next;
+	}
+    }
+    pthread_mutex_unlock(&plqp->plq_mutex);
+
+    return count;
+}
+
+static int
+psu_log_queue_empty (psu_log_queue_t *plqp)
+{
+    psu_log_ring_t *plgp;
+
+    for (plgp = plqp->plq_rings; plgp; plgp = plgp->plg_next)
+	if (plgp->plg_tail != PLQ_LOAD(plgp->plg_head))
+	    return FALSE;
+
+    return TRUE;
+}
+
+static void *
+psu_log_drainer (void *arg)
+{
+    psu_log_queue_t *plqp = arg;
+    struct timespec ts;
+    unsigned flushes;
+
+    for (;;) {
+	flushes = PLQ_LOAD(plqp->plq_flushes);
+	if (psu_log_drain(plqp))
+	    continue;
+
+	pthread_mutex_lock(&plqp->plq_mutex);
+
+	/* Tell anyone flushing that we've caught up */
+	plqp->plq_flushed = flushes;
+	pthread_cond_broadcast(&plqp->plq_drained);
+
+	PLQ_STORE(plqp->plq_waiting, TRUE);
+	if (psu_log_queue_empty(plqp) && !plqp->plq_stop
+		&& flushes == plqp->plq_flushes) {
+	    /* Wake up now and then to free the rings of dead threads */
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += 1;
+	    pthread_cond_timedwait(&plqp->plq_data, &plqp->plq_mutex, &ts);
+	}
+	PLQ_STORE(plqp->plq_waiting, FALSE);
+
+	if (plqp->plq_stop && psu_log_queue_empty(plqp)) {
+	    pthread_mutex_unlock(&plqp->plq_mutex);
+	    break;
+	}
+
+	pthread_mutex_unlock(&plqp->plq_mutex);
+    }
+
+    psu_log_drain(plqp);	/* Pick up the drop report, if any */
+    return NULL;
+}
+
+/*
+ * The child of a fork() gets our rings but not the drain thread, and
+ * whatever's left in them will be written by the parent, so it just
+ * goes back to writing directly
+ */
+static void
+psu_log_async_after_fork (void)
+{
+    PLQ_STORE(psu_log_queue, NULL);
+}
+
+int
+psu_log_async_start (void)
+{
+    static int registered;
+    psu_log_queue_t *plqp;
+
+    if (psu_log_queue)
+	return 0;
+
+    plqp = calloc(1, sizeof(*plqp));
+    if (plqp == NULL)
+	return -1;
+
+    pthread_mutex_init(&plqp->plq_mutex, NULL);
+    pthread_cond_init(&plqp->plq_data, NULL);
+    pthread_cond_init(&plqp->plq_drained, NULL);
+
+    if (pthread_key_create(&plqp->plq_key, psu_log_ring_dead))
+	goto fail;
+
+    if (pthread_create(&plqp->plq_thread, NULL, psu_log_drainer, plqp)) {
+	pthread_key_delete(plqp->plq_key);
+	goto fail;
+    }
+
+    PLQ_STORE(psu_log_queue, plqp);
+
+    if (!registered) {
+	registered = TRUE;
+	atexit(psu_log_async_stop);
+	pthread_atfork(NULL, NULL, psu_log_async_after_fork);
+    }
+
+    return 0;
+
+ fail:
+    pthread_mutex_destroy(&plqp->plq_mutex);
+    pthread_cond_destroy(&plqp->plq_data);
+    pthread_cond_destroy(&plqp->plq_drained);
+    free(plqp);
+    return -1;
+}
+
+void
+psu_log_async_flush (void)
+{
+    psu_log_queue_t *plqp = PLQ_LOAD(psu_log_queue);
+    unsigned want;
+
+    if (plqp == NULL)
+	return;
+
+    pthread_mutex_lock(&plqp->plq_mutex);
+    want = ++plqp->plq_flushes;
+    pthread_cond_broadcast(&plqp->plq_data);
+    while ((int) (plqp->plq_flushed - want) < 0)
+	pthread_cond_wait(&plqp->plq_drained, &plqp->plq_mutex);
+    pthread_mutex_unlock(&plqp->plq_mutex);
+}
+
+void
+psu_log_async_stop (void)
+{
+    psu_log_queue_t *plqp = PLQ_LOAD(psu_log_queue);
+    psu_log_ring_t *plgp, *next;
+
+    if (plqp == NULL)
+	return;
+
+    /* New messages are written directly from here on */
+    PLQ_STORE(psu_log_queue, NULL);
+
+    pthread_mutex_lock(&plqp->plq_mutex);
+    plqp->plq_stop = TRUE;
+    pthread_cond_broadcast(&plqp->plq_data);
+    pthread_mutex_unlock(&plqp->plq_mutex);
+
+    pthread_join(plqp->plq_thread, NULL);
+
+    /*
+     * Other threads may still have their ring pointers, so we leave
+     * the rings (and the key) alone unless we are the only thread
+     * that ever logged
+     */
+    if (plqp->plq_rings && plqp->plq_rings->plg_next == NULL
+	    && plqp->plq_rings == psu_log_ring) {
+	for (plgp = plqp->plq_rings; plgp; plgp = next) {
+	    next = plgp->plg_next;
+	    free(plgp);
+	}
+	psu_log_ring = NULL;
+	pthread_setspecific(plqp->plq_key, NULL);
+	pthread_key_delete(plqp->plq_key);
+	pthread_mutex_destroy(&plqp->plq_mutex);
+	pthread_cond_destroy(&plqp->plq_data);
+	pthread_cond_destroy(&plqp->plq_drained);
+	free(plqp);
+    }
+}
+
+unsigned long
+psu_log_async_dropped (void)
+{
+    psu_log_queue_t *plqp = PLQ_LOAD(psu_log_queue);
+
+    return plqp ? PLQ_LOAD(plqp->plq_dropped) : 0;
+}
+
+#else /* HAVE_PTHREAD_H */
+
+int
+psu_log_async_start (void)
+{
+    return -1;
+}
+
+void
+psu_log_async_flush (void)
+{
+    return;
+}
+
+void
+psu_log_async_stop (void)
+{
+    return;
+}
+
+unsigned long
+psu_log_async_dropped (void)
+{
+    return 0;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
 /**
  * Write formatted log data to log file
  *
@@ -72,14 +1021,43 @@ psu_log_to_file (FILE *fp)
 void
 psu_logv (const char *fmt, int newline, va_list vap)
 {
-    if (psu_log_callback) {
-	psu_log_callback(psu_log_callback_data, fmt, vap);
-    } else {
-	vfprintf(psu_log_fp ?: stderr, fmt, vap);
-	if (newline)
-	    fprintf(psu_log_fp ?: stderr, "\n");
-	fflush(psu_log_fp ?: stderr);
+#ifdef HAVE_PTHREAD_H
+    psu_log_queue_t *plqp = PLQ_LOAD(psu_log_queue);
+
+    if (plqp && psu_log_push_text(plqp, fmt, newline, vap) == 0)
+	return;
+#endif /* HAVE_PTHREAD_H */
+
+    psu_log_write(fmt, newline, TRUE, vap);
+}
+
+/**
+ * Log a message whose format string is a constant, leaving the
+ * formatting to the drain thread when logging asynchronously
+ *
+ * @param[in] fmt Printf-style format string (which must not change)
+ */
+void
+psu_log_deferred (const char *fmt, ...)
+{
+    va_list vap;
+
+    if (!psu_log_is_enabledp)
+	return;
+
+    va_start(vap, fmt);
+
+#ifdef HAVE_PTHREAD_H
+    psu_log_queue_t *plqp = PLQ_LOAD(psu_log_queue);
+
+    if (plqp && psu_log_push_deferred(plqp, fmt, TRUE, vap) == 0) {
+	va_end(vap);
+	return;
     }
+#endif /* HAVE_PTHREAD_H */
+
+    psu_log_write(fmt, TRUE, TRUE, vap);
+    va_end(vap);
 }
 
 /**
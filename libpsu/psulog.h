@@ -99,6 +99,54 @@ psu_log2 (void *ignore UNUSED, const char *fmt, ...);
 void
 psu_logv (const char *fmt, int newline, va_list vap);
 
+/**
+ * Log a message, leaving the formatting to the drain thread when
+ * logging asynchronously.  The format string itself is kept, so it
+ * must not change (a string literal is ideal); the arguments are
+ * copied, including the contents of any "%s" strings.  Formats that
+ * can't be deferred (%n, wide strings) are formatted immediately.
+ *
+ * @param[in] fmt Printf-style format string
+ */
+PSU_PRINTFLIKE(1, 2)
+void
+psu_log_deferred (const char *fmt, ...);
+
+/**
+ * Switch to asynchronous logging.  Each thread that logs writes its
+ * messages into a ring of its own, and a background thread writes
+ * them to the log file (or hands them to the callback), so the
+ * caller never waits for I/O or a lock.  If a thread's ring fills,
+ * messages are dropped (and the number dropped is logged) rather
+ * than making the thread wait.  Messages are written in the order
+ * they were logged, across all threads.  Anything still queued is
+ * written when the process exits.
+ *
+ * @return zero on success, -1 if the drain thread can't be started
+ */
+int
+psu_log_async_start (void);
+
+/**
+ * Wait until every message logged so far has been written
+ */
+void
+psu_log_async_flush (void);
+
+/**
+ * Write everything still queued and go back to logging directly.
+ * Other threads should be done logging by now; messages they log
+ * while this runs may be lost.
+ */
+void
+psu_log_async_stop (void);
+
+/**
+ * Return the number of messages dropped because a ring was full
+ */
+unsigned long
+psu_log_async_dropped (void);
+
 /* Avoid massive s/slaxLog/psu_log/ changes; too commmon (for now) */
 #define slaxLog psu_log
 #define slaxLog2 psu_log2
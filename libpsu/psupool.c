@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psupool.c -- fixed-size object pools and per-thread caches
+ */
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psualloc.h>
+#include <libpsu/psupool.h>
+
+static inline void
+psu_pool_lock (psu_pool_t *ppp)
+{
+    if (ppp->ppl_flags & PSU_POOLF_SHARED)
+	pthread_mutex_lock(&ppp->ppl_lock);
+}
+
+static inline void
+psu_pool_unlock (psu_pool_t *ppp)
+{
+    if (ppp->ppl_flags & PSU_POOLF_SHARED)
+	pthread_mutex_unlock(&ppp->ppl_lock);
+}
+
+static void *
+psu_pool_allocator_realloc (psu_allocator_t *pap, void *ptr, size_t size)
+{
+    psu_pool_t *ppp = (psu_pool_t *) pap;
+
+    if (size > ppp->ppl_size)
+	return NULL;
+
+    if (size == 0) {
+	if (ptr)
+	    psu_pool_put(ppp, ptr);
+	return NULL;
+    }
+
+    /* Every object is already as big as it can be */
+    return ptr ?: psu_pool_get(ppp);
+}
+
+static void
+psu_pool_allocator_free (psu_allocator_t *pap, void *ptr)
+{
+    psu_pool_put((psu_pool_t *) pap, ptr);
+}
+
+int
+psu_pool_init (psu_pool_t *ppp, psu_allocator_t *parent, size_t size,
+	       unsigned per_chunk, unsigned flags)
+{
+    memset(ppp, 0, sizeof(*ppp));
+
+    /* Objects must hold a free list pointer, and stay aligned */
+    if (size < sizeof(psu_pool_object_t))
+	size = sizeof(psu_pool_object_t);
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+
+    ppp->ppl_allocator.pal_realloc = psu_pool_allocator_realloc;
+    ppp->ppl_allocator.pal_free = psu_pool_allocator_free;
+    ppp->ppl_parent = parent;
+    ppp->ppl_size = size;
+    ppp->ppl_per_chunk = per_chunk ?: PSU_POOL_CHUNK;
+    ppp->ppl_flags = flags;
+
+    if ((flags & PSU_POOLF_SHARED)
+	    && pthread_mutex_init(&ppp->ppl_lock, NULL) != 0)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Take one object; the caller holds the lock
+ */
+static void *
+psu_pool_get_locked (psu_pool_t *ppp)
+{
+    psu_pool_object_t *ppop = ppp->ppl_free;
+    psu_pool_chunk_t *ppcp;
+    char *res;
+
+    if (ppop) {
+	ppp->ppl_free = ppop->ppo_next;
+	ppp->ppl_live += 1;
+	return ppop;
+    }
+
+    if (ppp->ppl_cur == ppp->ppl_end) {
+	ppcp = psu_allocator_malloc(ppp->ppl_parent, sizeof(*ppcp)
+				    + ppp->ppl_size * ppp->ppl_per_chunk);
+	if (ppcp == NULL)
+	    return NULL;
+
+	ppcp->ppc_next = ppp->ppl_chunks;
+	ppp->ppl_chunks = ppcp;
+	ppp->ppl_cur = (char *) ppcp->ppc_data;
+	ppp->ppl_end = ppp->ppl_cur + ppp->ppl_size * ppp->ppl_per_chunk;
+    }
+
+    res = ppp->ppl_cur;
+    ppp->ppl_cur += ppp->ppl_size;
+    ppp->ppl_live += 1;
+
+    return res;
+}
+
+static inline void
+psu_pool_put_locked (psu_pool_t *ppp, void *ptr)
+{
+    psu_pool_object_t *ppop = ptr;
+
+    ppop->ppo_next = ppp->ppl_free;
+    ppp->ppl_free = ppop;
+    ppp->ppl_live -= 1;
+}
+
+void *
+psu_pool_get (psu_pool_t *ppp)
+{
+    void *res;
+
+    psu_pool_lock(ppp);
+    res = psu_pool_get_locked(ppp);
+    psu_pool_unlock(ppp);
+
+    return res;
+}
+
+void
+psu_pool_put (psu_pool_t *ppp, void *ptr)
+{
+    if (ptr == NULL)
+	return;
+
+    psu_pool_lock(ppp);
+    psu_pool_put_locked(ppp, ptr);
+    psu_pool_unlock(ppp);
+}
+
+unsigned
+psu_pool_get_many (psu_pool_t *ppp, void **objects, unsigned count)
+{
+    unsigned i;
+
+    psu_pool_lock(ppp);
+
+    for (i = 0; i < count; i++) {
+	objects[i] = psu_pool_get_locked(ppp);
+	if (objects[i] == NULL)
+	    break;
+    }
+
+    psu_pool_unlock(ppp);
+
+    return i;
+}
+
+void
+psu_pool_put_many (psu_pool_t *ppp, void **objects, unsigned count)
+{
+    unsigned i;
+
+    psu_pool_lock(ppp);
+
+    for (i = 0; i < count; i++)
+	psu_pool_put_locked(ppp, objects[i]);
+
+    psu_pool_unlock(ppp);
+}
+
+unsigned long
+psu_pool_live (psu_pool_t *ppp)
+{
+    unsigned long live;
+
+    psu_pool_lock(ppp);
+    live = ppp->ppl_live;
+    psu_pool_unlock(ppp);
+
+    return live;
+}
+
+void
+psu_pool_cleanup (psu_pool_t *ppp)
+{
+    psu_pool_chunk_t *ppcp, *next;
+
+    for (ppcp = ppp->ppl_chunks; ppcp; ppcp = next) {
+	next = ppcp->ppc_next;
+	psu_allocator_free(ppp->ppl_parent, ppcp);
+    }
+
+    ppp->ppl_chunks = NULL;
+    ppp->ppl_free = NULL;
+    ppp->ppl_cur = ppp->ppl_end = NULL;
+    ppp->ppl_live = 0;
+
+    if (ppp->ppl_flags & PSU_POOLF_SHARED) {
+	pthread_mutex_destroy(&ppp->ppl_lock);
+	ppp->ppl_flags &= ~PSU_POOLF_SHARED;
+    }
+}
+
+psu_allocator_t *
+psu_pool_allocator (psu_pool_t *ppp)
+{
+    return &ppp->ppl_allocator;
+}
+
+static void *
+psu_tcache_allocator_realloc (psu_allocator_t *pap, void *ptr, size_t size)
+{
+    psu_tcache_t *ptcp = (psu_tcache_t *) pap;
+
+    if (size > ptcp->ptc_pool->ppl_size)
+	return NULL;
+
+    if (size == 0) {
+	if (ptr)
+	    psu_tcache_put(ptcp, ptr);
+	return NULL;
+    }
+
+    return ptr ?: psu_tcache_get(ptcp);
+}
+
+static void
+psu_tcache_allocator_free (psu_allocator_t *pap, void *ptr)
+{
+    psu_tcache_put((psu_tcache_t *) pap, ptr);
+}
+
+void
+psu_tcache_init (psu_tcache_t *ptcp, psu_pool_t *ppp, unsigned size)
+{
+    if (size == 0)
+	size = PSU_TCACHE_DEFAULT;
+    else if (size > PSU_TCACHE_MAX)
+	size = PSU_TCACHE_MAX;
+
+    ptcp->ptc_allocator.pal_realloc = psu_tcache_allocator_realloc;
+    ptcp->ptc_allocator.pal_free = psu_tcache_allocator_free;
+    ptcp->ptc_pool = ppp;
+    ptcp->ptc_size = size;
+    ptcp->ptc_count = 0;
+}
+
+/*
+ * The cache is empty; refill half of it from the pool
+ */
+void *
+psu_tcache_get_slow (psu_tcache_t *ptcp)
+{
+    unsigned want = ptcp->ptc_size / 2 ?: 1;
+
+    ptcp->ptc_count = psu_pool_get_many(ptcp->ptc_pool,
+					ptcp->ptc_objects, want);
+    if (ptcp->ptc_count == 0)
+	return NULL;
+
+    return ptcp->ptc_objects[--ptcp->ptc_count];
+}
+
+/*
+ * The cache is full; give the older half back to the pool
+ */
+void
+psu_tcache_put_slow (psu_tcache_t *ptcp, void *ptr)
+{
+    unsigned half = ptcp->ptc_size / 2;
+
+    if (half == 0) {		/* A cache of one object */
+	psu_pool_put(ptcp->ptc_pool, ptr);
+	return;
+    }
+
+    psu_pool_put_many(ptcp->ptc_pool, ptcp->ptc_objects, half);
+    memmove(ptcp->ptc_objects, ptcp->ptc_objects + half,
+	    (ptcp->ptc_count - half) * sizeof(ptcp->ptc_objects[0]));
+    ptcp->ptc_count -= half;
+
+    ptcp->ptc_objects[ptcp->ptc_count++] = ptr;
+}
+
+void
+psu_tcache_flush (psu_tcache_t *ptcp)
+{
+    if (ptcp->ptc_count == 0)
+	return;
+
+    psu_pool_put_many(ptcp->ptc_pool, ptcp->ptc_objects, ptcp->ptc_count);
+    ptcp->ptc_count = 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psupool.h -- fixed-size object pools and per-thread caches
+ *
+ * A pool hands out objects of a single size, carved from chunks taken
+ * from a parent allocator.  Freed objects go on a free list and are
+ * reused; chunks go back to the parent only when the pool is cleaned
+ * up.  A pool made with PSU_POOLF_SHARED takes a mutex around each
+ * operation, and can have any number of thread caches (psu_tcache_t)
+ * in front of it.  A cache keeps a small stack of objects that only
+ * its thread touches, going to the pool for half a stack at a time,
+ * just like pa_fixed's magazines.
+ */
+
+#ifndef LIBPSU_PSUPOOL_H
+#define LIBPSU_PSUPOOL_H
+
+#include <pthread.h>
+
+#include <libpsu/psualloc.h>
+
+#define PSU_POOL_CHUNK	64	/* Default number of objects per chunk */
+#define PSU_TCACHE_MAX	256	/* Largest thread cache */
+#define PSU_TCACHE_DEFAULT 32	/* Default thread cache size */
+
+typedef struct psu_pool_chunk_s {
+    struct psu_pool_chunk_s *ppc_next; /* Next (older) chunk */
+    double ppc_data[0];		/* Start of objects (aligned) */
+} psu_pool_chunk_t;
+
+typedef struct psu_pool_object_s {
+    struct psu_pool_object_s *ppo_next; /* Next free object */
+} psu_pool_object_t;
+
+typedef struct psu_pool_s {
+    psu_allocator_t ppl_allocator; /* Allocator face (must be first) */
+    psu_allocator_t *ppl_parent; /* Where our chunks come from */
+    size_t ppl_size;		/* Size of each object (rounded) */
+    unsigned ppl_per_chunk;	/* Objects in each chunk */
+    unsigned ppl_flags;		/* Flags for this pool (PSU_POOLF_*) */
+    psu_pool_chunk_t *ppl_chunks; /* Chunks (newest first) */
+    psu_pool_object_t *ppl_free; /* Free objects */
+    char *ppl_cur;		/* Next unused object in ppl_chunks */
+    char *ppl_end;		/* End of ppl_chunks */
+    unsigned long ppl_live;	/* Objects handed out (and not returned) */
+    pthread_mutex_t ppl_lock;	/* Guards all of the above (if SHARED) */
+} psu_pool_t;
+
+/* Flags for ppl_flags */
+#define PSU_POOLF_SHARED (1<<0)	/* Pool is used by multiple threads */
+
+/*
+ * A thread's cache of objects from a shared pool.  A cache belongs
+ * to one thread, which typically keeps it in THREAD_LOCAL storage
+ * or in its own worker state.
+ */
+typedef struct psu_tcache_s {
+    psu_allocator_t ptc_allocator; /* Allocator face (must be first) */
+    psu_pool_t *ptc_pool;	/* Pool we cache objects from */
+    unsigned ptc_size;		/* Most objects we'll hold */
+    unsigned ptc_count;		/* Objects we're holding now */
+    void *ptc_objects[PSU_TCACHE_MAX]; /* Stack of objects */
+} psu_tcache_t;
+
+/**
+ * Initialize a pool
+ *
+ * @param[in] ppp The pool
+ * @param[in] parent Allocator for chunks (NULL for the default)
+ * @param[in] size Size of each object
+ * @param[in] per_chunk Objects per chunk (zero for the default)
+ * @param[in] flags Flags (PSU_POOLF_*)
+ * @return zero on success, -1 on failure
+ */
+int
+psu_pool_init (psu_pool_t *ppp, psu_allocator_t *parent, size_t size,
+	       unsigned per_chunk, unsigned flags);
+
+/**
+ * Take an object from the pool
+ *
+ * @param[in] ppp The pool
+ * @return the object, or NULL if the parent allocator fails
+ */
+void *
+psu_pool_get (psu_pool_t *ppp);
+
+/**
+ * Return an object to the pool
+ */
+void
+psu_pool_put (psu_pool_t *ppp, void *ptr);
+
+/**
+ * Take up to "count" objects in one go (with the lock held once)
+ *
+ * @param[in] ppp The pool
+ * @param[out] objects Array to fill
+ * @param[in] count Number of objects wanted
+ * @return number of objects returned
+ */
+unsigned
+psu_pool_get_many (psu_pool_t *ppp, void **objects, unsigned count);
+
+/**
+ * Return "count" objects in one go
+ */
+void
+psu_pool_put_many (psu_pool_t *ppp, void **objects, unsigned count);
+
+/**
+ * Return the number of objects handed out and not yet returned
+ */
+unsigned long
+psu_pool_live (psu_pool_t *ppp);
+
+/**
+ * Free all the pool's chunks.  Every object becomes invalid.
+ */
+void
+psu_pool_cleanup (psu_pool_t *ppp);
+
+/**
+ * Return the pool as an allocator object.  Requests larger than the
+ * pool's object size fail.
+ */
+psu_allocator_t *
+psu_pool_allocator (psu_pool_t *ppp);
+
+/**
+ * Initialize a thread cache in front of a pool
+ *
+ * @param[in] ptcp The cache
+ * @param[in] ppp The pool (normally PSU_POOLF_SHARED)
+ * @param[in] size Most objects to cache (zero for the default)
+ */
+void
+psu_tcache_init (psu_tcache_t *ptcp, psu_pool_t *ppp, unsigned size);
+
+void *
+psu_tcache_get_slow (psu_tcache_t *ptcp);
+
+void
+psu_tcache_put_slow (psu_tcache_t *ptcp, void *ptr);
+
+/**
+ * Take an object, going to the pool only when the cache is empty
+ */
+static inline void *
+psu_tcache_get (psu_tcache_t *ptcp)
+{
+    if (ptcp->ptc_count)
+	return ptcp->ptc_objects[--ptcp->ptc_count];
+    return psu_tcache_get_slow(ptcp);
+}
+
+/**
+ * Return an object, going to the pool only when the cache is full
+ */
+static inline void
+psu_tcache_put (psu_tcache_t *ptcp, void *ptr)
+{
+    if (ptcp->ptc_count < ptcp->ptc_size)
+	ptcp->ptc_objects[ptcp->ptc_count++] = ptr;
+    else
+	psu_tcache_put_slow(ptcp, ptr);
+}
+
+/**
+ * Give every cached object back to the pool; call this before the
+ * thread exits
+ */
+void
+psu_tcache_flush (psu_tcache_t *ptcp);
+
+/**
+ * Return the cache as an allocator object
+ */
+static inline psu_allocator_t *
+psu_tcache_allocator (psu_tcache_t *ptcp)
+{
+    return &ptcp->ptc_allocator;
+}
+
+#endif /* LIBPSU_PSUPOOL_H */
@@ -15,8 +15,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <libpsu/psucommon.h>
+#include <libpsu/psucpu.h>
+#include <libpsu/psudispatch.h>
 #include <libpsu/psustring.h>
 
 /*
@@ -57,3 +60,436 @@ strndup (const char *str, size_t count)
     }
 }
 #endif /* HAVE_STRNDUP */
+
+/*
+ * Word-at-a-time fallback: a byte of "w" is zero iff its bit in
+ * psu_swar_zero(w) is set, and the lowest such bit is never a false
+ * positive (borrows only run upwards), which is all memchr needs.
+ */
+#define PSU_SWAR_ONES	0x0101010101010101ull
+#define PSU_SWAR_HIGHS	0x8080808080808080ull
+
+static inline uint64_t
+psu_swar_zero (uint64_t w)
+{
+    return (w - PSU_SWAR_ONES) & ~w & PSU_SWAR_HIGHS;
+}
+
+typedef const char *(*psu_memchr3_func_t)(const char *, size_t,
+					  uint8_t, uint8_t, uint8_t);
+typedef const char *(*psu_memchr_set_func_t)(const char *, size_t,
+					     const psu_charset_t *);
+
+static const char *
+psu_memchr3_scalar (const char *cp, size_t len,
+		    uint8_t c1, uint8_t c2, uint8_t c3)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t p1 = PSU_SWAR_ONES * c1;
+    uint64_t p2 = PSU_SWAR_ONES * c2;
+    uint64_t p3 = PSU_SWAR_ONES * c3;
+    uint64_t w, hits;
+
+    for ( ; len >= sizeof(w); cp += sizeof(w), len -= sizeof(w)) {
+	memcpy(&w, cp, sizeof(w));
+	hits = psu_swar_zero(w ^ p1) | psu_swar_zero(w ^ p2)
+	    | psu_swar_zero(w ^ p3);
+	if (hits)
+	    return cp + (__builtin_ctzll(hits) >> 3);
+    }
+#endif /* __ORDER_LITTLE_ENDIAN__ */
+
+    for ( ; len > 0; cp++, len--) {
+	uint8_t ch = *cp;
+	if (ch == c1 || ch == c2 || ch == c3)
+	    return cp;
+    }
+
+    return NULL;
+}
+
+static const char *
+psu_memchr_set_scalar (const char *cp, size_t len, const psu_charset_t *pcsp)
+{
+    for ( ; len > 0; cp++, len--)
+	if (psu_charset_has(pcsp, (uint8_t) *cp))
+	    return cp;
+
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__)
+#define PSU_MEMCHR_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#if defined(__GNUC__)
+#define PSU_MEMCHR_HAVE_SSSE3 1
+#define PSU_MEMCHR_HAVE_AVX2 1
+#include <immintrin.h>
+#endif /* __GNUC__ */
+#endif /* _X86_ */
+
+#ifdef PSU_MEMCHR_HAVE_SSE2
+static const char *
+psu_memchr3_sse2 (const char *cp, size_t len,
+		  uint8_t c1, uint8_t c2, uint8_t c3)
+{
+    __m128i v1 = _mm_set1_epi8(c1);
+    __m128i v2 = _mm_set1_epi8(c2);
+    __m128i v3 = _mm_set1_epi8(c3);
+    __m128i v, m;
+    unsigned bits;
+
+    for ( ; len >= 16; cp += 16, len -= 16) {
+	v = _mm_loadu_si128((const __m128i *) cp);
+	m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, v1),
+				      _mm_cmpeq_epi8(v, v2)),
+			 _mm_cmpeq_epi8(v, v3));
+	bits = _mm_movemask_epi8(m);
+	if (bits)
+	    return cp + __builtin_ctz(bits);
+    }
+
+    return psu_memchr3_scalar(cp, len, c1, c2, c3);
+}
+#endif /* PSU_MEMCHR_HAVE_SSE2 */
+
+#ifdef PSU_MEMCHR_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i
+psu_memchr3_match_avx2 (const char *cp, __m256i v1, __m256i v2, __m256i v3)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) cp);
+
+    return _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, v1),
+					   _mm256_cmpeq_epi8(v, v2)),
+			   _mm256_cmpeq_epi8(v, v3));
+}
+
+__attribute__((target("avx2")))
+static const char *
+psu_memchr3_avx2 (const char *cp, size_t len,
+		  uint8_t c1, uint8_t c2, uint8_t c3)
+{
+    __m256i v1 = _mm256_set1_epi8(c1);
+    __m256i v2 = _mm256_set1_epi8(c2);
+    __m256i v3 = _mm256_set1_epi8(c3);
+    __m256i m0, m1;
+    uint64_t bits;
+
+    /* Two vectors a turn, testing them together */
+    for ( ; len >= 64; cp += 64, len -= 64) {
+	m0 = psu_memchr3_match_avx2(cp, v1, v2, v3);
+	m1 = psu_memchr3_match_avx2(cp + 32, v1, v2, v3);
+	if (_mm256_testz_si256(_mm256_or_si256(m0, m1),
+			       _mm256_or_si256(m0, m1)))
+	    continue;
+
+	bits = (uint32_t) _mm256_movemask_epi8(m0)
+	    | ((uint64_t) (uint32_t) _mm256_movemask_epi8(m1) << 32);
+	return cp + __builtin_ctzll(bits);
+    }
+
+    if (len >= 32) {
+	bits = (uint32_t) _mm256_movemask_epi8(
+			psu_memchr3_match_avx2(cp, v1, v2, v3));
+	if (bits)
+	    return cp + __builtin_ctzll(bits);
+	cp += 32;
+	len -= 32;
+    }
+
+    return psu_memchr3_scalar(cp, len, c1, c2, c3);
+}
+#endif /* PSU_MEMCHR_HAVE_AVX2 */
+
+/*
+ * The set kernels look up each byte's low nibble in both tables
+ * (pshufb), pick the right table by the byte's top bit, and test
+ * the bit for the rest of the high nibble.
+ */
+#ifdef PSU_MEMCHR_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static const char *
+psu_memchr_set_sse42 (const char *cp, size_t len, const psu_charset_t *pcsp)
+{
+    const __m128i lo_table = _mm_loadu_si128((const __m128i *) pcsp->pcs_lo);
+    const __m128i hi_table = _mm_loadu_si128((const __m128i *) pcsp->pcs_hi);
+    const __m128i bit_table = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					    1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i v, lo, hi, rows, top, bits, m;
+    unsigned mask;
+
+    for ( ; len >= 16; cp += 16, len -= 16) {
+	v = _mm_loadu_si128((const __m128i *) cp);
+	lo = _mm_and_si128(v, nibble);
+	hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+
+	top = _mm_cmpgt_epi8(_mm_setzero_si128(), v); /* Top bit set */
+	rows = _mm_or_si128(_mm_and_si128(top, _mm_shuffle_epi8(hi_table, lo)),
+			    _mm_andnot_si128(top,
+					     _mm_shuffle_epi8(lo_table, lo)));
+	bits = _mm_shuffle_epi8(bit_table, hi);
+
+	m = _mm_cmpeq_epi8(_mm_and_si128(rows, bits), bits);
+	mask = _mm_movemask_epi8(m);
+	if (mask)
+	    return cp + __builtin_ctz(mask);
+    }
+
+    return psu_memchr_set_scalar(cp, len, pcsp);
+}
+#endif /* PSU_MEMCHR_HAVE_SSSE3 */
+
+#ifdef PSU_MEMCHR_HAVE_AVX2
+__attribute__((target("avx2")))
+static const char *
+psu_memchr_set_avx2 (const char *cp, size_t len, const psu_charset_t *pcsp)
+{
+    const __m256i lo_table = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) pcsp->pcs_lo));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) pcsp->pcs_hi));
+    const __m256i bit_table = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					       1, 2, 4, 8, 16, 32, 64, -128,
+					       1, 2, 4, 8, 16, 32, 64, -128,
+					       1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i v, lo, hi, rows, bits, m;
+    uint32_t mask;
+
+    for ( ; len >= 32; cp += 32, len -= 32) {
+	v = _mm256_loadu_si256((const __m256i *) cp);
+	lo = _mm256_and_si256(v, nibble);
+	hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+
+	/* blendv picks by each byte's top bit, which is what we want */
+	rows = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo_table, lo),
+				  _mm256_shuffle_epi8(hi_table, lo), v);
+	bits = _mm256_shuffle_epi8(bit_table, hi);
+
+	m = _mm256_cmpeq_epi8(_mm256_and_si256(rows, bits), bits);
+	mask = _mm256_movemask_epi8(m);
+	if (mask)
+	    return cp + __builtin_ctz(mask);
+    }
+
+    return psu_memchr_set_sse42(cp, len, pcsp);
+}
+#endif /* PSU_MEMCHR_HAVE_AVX2 */
+
+/* Listed in order of preference; last one always works */
+static const psu_dispatch_variant_t psu_memchr3_variants[] = {
+#ifdef PSU_MEMCHR_HAVE_AVX2
+    { "avx2", PSU_CPU_F_AVX2, PSU_DISPATCH_FUNC(psu_memchr3_avx2) },
+#endif /* PSU_MEMCHR_HAVE_AVX2 */
+#ifdef PSU_MEMCHR_HAVE_SSE2
+    { "sse2", PSU_CPU_F_SSE2, PSU_DISPATCH_FUNC(psu_memchr3_sse2) },
+#endif /* PSU_MEMCHR_HAVE_SSE2 */
+    { "scalar", 0, PSU_DISPATCH_FUNC(psu_memchr3_scalar) },
+    { NULL, 0, NULL }
+};
+
+static const psu_dispatch_variant_t psu_memchr_set_variants[] = {
+#ifdef PSU_MEMCHR_HAVE_AVX2
+    { "avx2", PSU_CPU_F_AVX2, PSU_DISPATCH_FUNC(psu_memchr_set_avx2) },
+#endif /* PSU_MEMCHR_HAVE_AVX2 */
+#ifdef PSU_MEMCHR_HAVE_SSSE3
+    { "sse42", PSU_CPU_F_SSE42, PSU_DISPATCH_FUNC(psu_memchr_set_sse42) },
+#endif /* PSU_MEMCHR_HAVE_SSSE3 */
+    { "scalar", 0, PSU_DISPATCH_FUNC(psu_memchr_set_scalar) },
+    { NULL, 0, NULL }
+};
+
+static psu_dispatch_t psu_memchr3_dispatch
+    = PSU_DISPATCH_INIT("memchr3", psu_memchr3_variants);
+static psu_dispatch_t psu_memchr_set_dispatch
+    = PSU_DISPATCH_INIT("memchr-set", psu_memchr_set_variants);
+
+static const char *psu_memchr3_resolve (const char *, size_t,
+					uint8_t, uint8_t, uint8_t);
+static const char *psu_memchr_set_resolve (const char *, size_t,
+					   const psu_charset_t *);
+
+/* Stubs bind the real kernels on first use, as in libxi's scanner */
+static psu_memchr3_func_t psu_memchr3_func = psu_memchr3_resolve;
+static psu_memchr_set_func_t psu_memchr_set_func = psu_memchr_set_resolve;
+
+static const char *
+psu_memchr3_resolve (const char *cp, size_t len,
+		     uint8_t c1, uint8_t c2, uint8_t c3)
+{
+    psu_memchr3_func
+	= (psu_memchr3_func_t) psu_dispatch_bind(&psu_memchr3_dispatch);
+    return psu_memchr3_func(cp, len, c1, c2, c3);
+}
+
+static const char *
+psu_memchr_set_resolve (const char *cp, size_t len, const psu_charset_t *pcsp)
+{
+    psu_memchr_set_func
+	= (psu_memchr_set_func_t) psu_dispatch_bind(&psu_memchr_set_dispatch);
+    return psu_memchr_set_func(cp, len, pcsp);
+}
+
+void *
+psu_memchr2 (const void *vsrc, int c1, int c2, size_t len)
+{
+    return (void *) psu_memchr3_func(vsrc, len, c1, c2, c2);
+}
+
+void *
+psu_memchr3 (const void *vsrc, int c1, int c2, int c3, size_t len)
+{
+    return (void *) psu_memchr3_func(vsrc, len, c1, c2, c3);
+}
+
+void *
+psu_memchr_set (const void *vsrc, const psu_charset_t *pcsp, size_t len)
+{
+    return (void *) psu_memchr_set_func(vsrc, len, pcsp);
+}
+
+void
+psu_strbuf_init (psu_strbuf_t *psbp, psu_allocator_t *pap, size_t hint)
+{
+    memset(psbp, 0, sizeof(*psbp));
+    psbp->psb_allocator = pap;
+
+    if (hint)
+	psu_strbuf_reserve(psbp, hint);
+}
+
+char *
+psu_strbuf_reserve (psu_strbuf_t *psbp, size_t more)
+{
+    size_t need, size;
+    char *newp;
+
+    if (psbp->psb_failed)
+	return NULL;
+
+    need = psbp->psb_len + more + 1; /* Plus the NUL */
+    if (need <= psbp->psb_size)
+	return psbp->psb_buf + psbp->psb_len;
+
+    if (need < psbp->psb_len) {	/* Overflow */
+	psbp->psb_failed = 1;
+	return NULL;
+    }
+
+    /* Double, so a string built a byte at a time costs O(n) */
+    size = psbp->psb_size * 2;
+    if (size < PSU_STRBUF_MIN)
+	size = PSU_STRBUF_MIN;
+    if (size < need)
+	size = need;
+
+    newp = psu_allocator_realloc(psbp->psb_allocator, psbp->psb_buf, size);
+    if (newp == NULL) {
+	psbp->psb_failed = 1;
+	return NULL;
+    }
+
+    if (psbp->psb_buf == NULL)
+	newp[0] = '\0';
+
+    psbp->psb_buf = newp;
+    psbp->psb_size = size;
+
+    return newp + psbp->psb_len;
+}
+
+int
+psu_strbuf_vprintf (psu_strbuf_t *psbp, const char *fmt, va_list vap)
+{
+    size_t room = psbp->psb_size - psbp->psb_len;
+    va_list copy;
+    char *cp;
+    int rc;
+
+    /* Try whatever room we have; it's usually enough */
+    if (psbp->psb_buf && !psbp->psb_failed) {
+	va_copy(copy, vap);
+	rc = vsnprintf(psbp->psb_buf + psbp->psb_len, room, fmt, copy);
+	va_end(copy);
+
+	if (rc < 0)
+	    return -1;
+
+	if ((size_t) rc < room) {
+	    psbp->psb_len += rc;
+	    return rc;
+	}
+
+	psbp->psb_buf[psbp->psb_len] = '\0'; /* Undo the partial write */
+    } else {
+	va_copy(copy, vap);
+	rc = vsnprintf(NULL, 0, fmt, copy);
+	va_end(copy);
+
+	if (rc < 0)
+	    return -1;
+    }
+
+    cp = psu_strbuf_reserve(psbp, rc);
+    if (cp == NULL)
+	return -1;
+
+    rc = vsnprintf(cp, rc + 1, fmt, vap);
+    if (rc < 0) {
+	*cp = '\0';
+	return -1;
+    }
+
+    psbp->psb_len += rc;
+    return rc;
+}
+
+int
+psu_strbuf_printf (psu_strbuf_t *psbp, const char *fmt, ...)
+{
+    va_list vap;
+    int rc;
+
+    va_start(vap, fmt);
+    rc = psu_strbuf_vprintf(psbp, fmt, vap);
+    va_end(vap);
+
+    return rc;
+}
+
+char *
+psu_strbuf_detach (psu_strbuf_t *psbp, size_t *lenp)
+{
+    char *res;
+
+    if (psbp->psb_failed) {
+	psu_strbuf_cleanup(psbp);
+	return NULL;
+    }
+
+    /* Even an empty string is the caller's to free */
+    if (psu_strbuf_reserve(psbp, 0) == NULL)
+	return NULL;
+
+    res = psbp->psb_buf;
+    if (lenp)
+	*lenp = psbp->psb_len;
+
+    psbp->psb_buf = NULL;
+    psbp->psb_len = psbp->psb_size = 0;
+
+    return res;
+}
+
+void
+psu_strbuf_cleanup (psu_strbuf_t *psbp)
+{
+    psu_allocator_free(psbp->psb_allocator, psbp->psb_buf);
+    psbp->psb_buf = NULL;
+    psbp->psb_len = psbp->psb_size = 0;
+    psbp->psb_failed = 0;
+}
@@ -11,6 +11,10 @@
 #define LIBPSU_PSUSTRING_H
 
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include <libpsu/psualloc.h>
 
 /**
  * @brief
@@ -107,4 +111,215 @@ strlcpy (char *dst, const char *src, size_t sz)
 }
 #endif /* HAVE_STRLCPY */
 
+/*
+ * Multi-character memchr.  psu_memchr2() and psu_memchr3() find the
+ * first byte matching any of two or three characters, so callers
+ * looking for several characters don't need to make several passes
+ * over the same bytes.  psu_memchr_set() does the same for any set
+ * of characters, described by a psu_charset_t.  The kernel (scalar,
+ * SSE2/SSE4.2, AVX2) is picked at first use by psudispatch, under
+ * the names "memchr3" and "memchr-set".
+ */
+void *
+psu_memchr2 (const void *vsrc, int c1, int c2, size_t len);
+
+void *
+psu_memchr3 (const void *vsrc, int c1, int c2, int c3, size_t len);
+
+/*
+ * A set of characters, kept as two 16-byte tables indexed by the low
+ * nibble of a character, with bit N of an entry meaning the character
+ * whose high nibble is N is in the set (pcs_lo for N below 8, pcs_hi
+ * for N of 8 and above).  This is the layout the vector kernels want,
+ * but it's cheap to test a single character too.
+ */
+typedef struct psu_charset_s {
+    uint8_t pcs_lo[16];		/* High nibbles 0-7, by low nibble */
+    uint8_t pcs_hi[16];		/* High nibbles 8-15, by low nibble */
+} psu_charset_t;
+
+static inline void
+psu_charset_add (psu_charset_t *pcsp, int ch)
+{
+    uint8_t *table = (ch & 0x80) ? pcsp->pcs_hi : pcsp->pcs_lo;
+
+    table[ch & 0x0f] |= 1 << ((ch >> 4) & 0x07);
+}
+
+/**
+ * Initialize a set to hold the characters in a string (which means
+ * NUL can only be added with psu_charset_add)
+ */
+static inline void
+psu_charset_init (psu_charset_t *pcsp, const char *chars)
+{
+    memset(pcsp, 0, sizeof(*pcsp));
+    for ( ; *chars; chars++)
+	psu_charset_add(pcsp, (uint8_t) *chars);
+}
+
+static inline int
+psu_charset_has (const psu_charset_t *pcsp, int ch)
+{
+    const uint8_t *table = (ch & 0x80) ? pcsp->pcs_hi : pcsp->pcs_lo;
+
+    return table[ch & 0x0f] & (1 << ((ch >> 4) & 0x07));
+}
+
+/**
+ * Return the first byte in (vsrc, len) that's in the set, or NULL
+ */
+void *
+psu_memchr_set (const void *vsrc, const psu_charset_t *pcsp, size_t len);
+
+/*
+ * A string builder.  The buffer grows geometrically, so appending is
+ * amortized constant time, and is always NUL-terminated once anything
+ * has been added.  Memory comes from an allocator object (psualloc.h);
+ * a zeroed psu_strbuf_t is an empty builder using the default one.
+ * When the string is done, psu_strbuf_detach() hands the buffer to
+ * the caller without copying it.
+ *
+ * If an allocation fails, the builder keeps what it had, ignores
+ * further additions, and sets psb_failed, so callers can check once
+ * at the end.
+ */
+typedef struct psu_strbuf_s {
+    char *psb_buf;		/* The string (or NULL) */
+    size_t psb_len;		/* Length of the string (without the NUL) */
+    size_t psb_size;		/* Bytes allocated for psb_buf */
+    psu_allocator_t *psb_allocator; /* Where psb_buf comes from (or NULL) */
+    int psb_failed;		/* An allocation failed */
+} psu_strbuf_t;
+
+#define PSU_STRBUF_MIN	64	/* Smallest buffer we'll allocate */
+
+/**
+ * Initialize a builder
+ *
+ * @param[in] psbp The builder
+ * @param[in] pap Allocator for the buffer (NULL for the default)
+ * @param[in] hint Expected length (zero to allocate on first use)
+ */
+void
+psu_strbuf_init (psu_strbuf_t *psbp, psu_allocator_t *pap, size_t hint);
+
+/**
+ * Make room for "more" bytes (plus the NUL), returning where they
+ * go; follow with psu_strbuf_commit() once they're written.
+ *
+ * @return pointer to the free space, or NULL if we can't get it
+ */
+char *
+psu_strbuf_reserve (psu_strbuf_t *psbp, size_t more);
+
+/**
+ * Add "len" bytes written into space from psu_strbuf_reserve()
+ */
+static inline void
+psu_strbuf_commit (psu_strbuf_t *psbp, size_t len)
+{
+    psbp->psb_len += len;
+    psbp->psb_buf[psbp->psb_len] = '\0';
+}
+
+/**
+ * Append bytes; returns zero on success, -1 on failure
+ */
+static inline int
+psu_strbuf_append (psu_strbuf_t *psbp, const char *data, size_t len)
+{
+    char *cp = psu_strbuf_reserve(psbp, len);
+
+    if (cp == NULL)
+	return -1;
+
+    memcpy(cp, data, len);
+    psu_strbuf_commit(psbp, len);
+    return 0;
+}
+
+static inline int
+psu_strbuf_append_string (psu_strbuf_t *psbp, const char *str)
+{
+    return psu_strbuf_append(psbp, str, strlen(str));
+}
+
+static inline int
+psu_strbuf_append_char (psu_strbuf_t *psbp, int ch)
+{
+    /* The fast path: room for the character and the NUL */
+    if (psbp->psb_len + 1 < psbp->psb_size) {
+	psbp->psb_buf[psbp->psb_len++] = ch;
+	psbp->psb_buf[psbp->psb_len] = '\0';
+	return 0;
+    }
+
+    char buf = ch;
+    return psu_strbuf_append(psbp, &buf, 1);
+}
+
+/**
+ * Append formatted output; returns the number of bytes added, or -1
+ */
+int
+psu_strbuf_printf (psu_strbuf_t *psbp, const char *fmt, ...)
+    PSU_PRINTFLIKE(2, 3);
+
+int
+psu_strbuf_vprintf (psu_strbuf_t *psbp, const char *fmt, va_list vap);
+
+/**
+ * Return the string so far (an empty string if there's nothing)
+ */
+static inline const char *
+psu_strbuf_string (const psu_strbuf_t *psbp)
+{
+    return psbp->psb_buf ? psbp->psb_buf : "";
+}
+
+static inline size_t
+psu_strbuf_len (const psu_strbuf_t *psbp)
+{
+    return psbp->psb_len;
+}
+
+/**
+ * Cut the string back to "len" bytes, keeping the buffer
+ */
+static inline void
+psu_strbuf_truncate (psu_strbuf_t *psbp, size_t len)
+{
+    if (len < psbp->psb_len) {
+	psbp->psb_len = len;
+	psbp->psb_buf[len] = '\0';
+    }
+}
+
+static inline void
+psu_strbuf_reset (psu_strbuf_t *psbp)
+{
+    psu_strbuf_truncate(psbp, 0);
+    psbp->psb_failed = 0;
+}
+
+/**
+ * Take the buffer away from the builder, which is left empty (but
+ * keeps its allocator).  The caller frees the string with
+ * psu_allocator_free() on the builder's allocator (which is plain
+ * psu_free() for the default).
+ *
+ * @param[in] psbp The builder
+ * @param[out] lenp Length of the string (may be NULL)
+ * @return the string, or NULL if the builder failed
+ */
+char *
+psu_strbuf_detach (psu_strbuf_t *psbp, size_t *lenp);
+
+/**
+ * Free the buffer
+ */
+void
+psu_strbuf_cleanup (psu_strbuf_t *psbp);
+
 #endif /* LIBPSU_PSUSTRING_H */
@@ -54,4 +54,60 @@
  */
 #define THREAD_GLOBAL(_x) _x
 
+/*
+ * Locks for state that is shared between threads.  These are thin
+ * wrappers around pthreads; without pthreads there's only one thread,
+ * so locks do nothing and a "once" function runs on the first call.
+ * Include <libslax/slaxconfig.h> (or psucommon.h) first, so we can
+ * see what configure found.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>
+
+typedef pthread_mutex_t psu_mutex_t;
+typedef pthread_once_t psu_once_t;
+typedef pthread_t psu_thread_t;
+
+#define PSU_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define PSU_ONCE_INIT PTHREAD_ONCE_INIT
+
+#define psu_mutex_lock(_mp) pthread_mutex_lock(_mp)
+#define psu_mutex_unlock(_mp) pthread_mutex_unlock(_mp)
+#define psu_once(_op, _func) pthread_once(_op, _func)
+#define psu_thread_self() pthread_self()
+#define psu_thread_equal(_a, _b) pthread_equal(_a, _b)
+
+/*
+ * Initialize a mutex that the owning thread can lock again
+ */
+static inline void
+psu_mutex_init_recursive (psu_mutex_t *mp)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mp, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#else /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+typedef int psu_mutex_t;
+typedef int psu_once_t;
+typedef int psu_thread_t;
+
+#define PSU_MUTEX_INITIALIZER 0
+#define PSU_ONCE_INIT 0
+
+#define psu_mutex_lock(_mp) ((void) (_mp))
+#define psu_mutex_unlock(_mp) ((void) (_mp))
+#define psu_once(_op, _func) \
+    do { if (*(_op) == 0) { *(_op) = 1; _func(); } } while (0)
+#define psu_thread_self() 0
+#define psu_thread_equal(_a, _b) ((_a) == (_b))
+#define psu_mutex_init_recursive(_mp) ((void) (_mp))
+
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
 #endif /* LIBPSU_PSUTHREAD_H */
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psutime.c -- tick counter calibration and histograms
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psucpu.h>
+#include <libpsu/psutime.h>
+
+#define PSU_TICKS_CALIBRATE_NSECS (5 * NSEC_PER_MSEC) /* Per attempt */
+#define PSU_TICKS_CALIBRATE_TRIES 3
+
+static pthread_once_t psu_ticks_once = PTHREAD_ONCE_INIT;
+static uint64_t psu_ticks_hz;	/* Ticks per second */
+static double psu_ticks_nsec_scale; /* Nanoseconds per tick */
+
+static uint64_t
+psu_time_nsecs (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Count ticks across a short sleep, against CLOCK_MONOTONIC.  Each
+ * clock read is bracketed by tick reads, and we keep the attempt
+ * whose brackets are tightest, since it's the least disturbed.
+ */
+static uint64_t
+psu_ticks_measure (void)
+{
+    struct timespec nap = { 0, PSU_TICKS_CALIBRATE_NSECS };
+    psu_ticks_t k0, k1, k2, k3, slop, best_slop = UINT64_MAX;
+    uint64_t t0, t1, hz, best = 0;
+    int i;
+
+    for (i = 0; i < PSU_TICKS_CALIBRATE_TRIES; i++) {
+	k0 = psu_ticks_fenced();
+	t0 = psu_time_nsecs();
+	k1 = psu_ticks_fenced();
+
+	nanosleep(&nap, NULL);
+
+	k2 = psu_ticks_fenced();
+	t1 = psu_time_nsecs();
+	k3 = psu_ticks_fenced();
+
+	if (t1 <= t0)
+	    continue;
+
+	slop = (k1 - k0) + (k3 - k2);
+	hz = (double) ((k2 + k3) / 2 - (k0 + k1) / 2) * NSEC_PER_SEC
+	    / (t1 - t0);
+
+	if (slop < best_slop) {
+	    best_slop = slop;
+	    best = hz;
+	}
+    }
+
+    return best;
+}
+#endif /* _X86_ */
+
+static void
+psu_ticks_calibrate (void)
+{
+    uint64_t hz = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+    psu_cpuid_t pc;
+
+    /*
+     * Leaf 0x15 gives the TSC's ratio to the crystal clock, and (on
+     * newer CPUs) the crystal's frequency, which beats measuring
+     */
+    psu_cpu_get_info(0, &pc);
+    if (pc.pc_ax >= 0x15) {
+	psu_cpu_get_info(0x15, &pc);
+	if (pc.pc_ax && pc.pc_bx && pc.pc_cx)
+	    hz = (uint64_t) pc.pc_cx * pc.pc_bx / pc.pc_ax;
+    }
+
+    if (hz == 0)
+	hz = psu_ticks_measure();
+
+#elif defined(__aarch64__)
+    asm volatile ("mrs %0, cntfrq_el0" : "=r" (hz));
+#endif /* _X86_ */
+
+    if (hz == 0)		/* We're counting nanoseconds */
+	hz = NSEC_PER_SEC;
+
+    psu_ticks_nsec_scale = (double) NSEC_PER_SEC / hz;
+    psu_ticks_hz = hz;
+}
+
+uint64_t
+psu_ticks_per_sec (void)
+{
+    pthread_once(&psu_ticks_once, psu_ticks_calibrate);
+    return psu_ticks_hz;
+}
+
+uint64_t
+psu_ticks_to_nsecs (psu_ticks_t ticks)
+{
+    pthread_once(&psu_ticks_once, psu_ticks_calibrate);
+    return (uint64_t) (ticks * psu_ticks_nsec_scale);
+}
+
+psu_time_usecs_t
+psu_ticks_to_usecs (psu_ticks_t ticks)
+{
+    return psu_ticks_to_nsecs(ticks) / NSEC_PER_USEC;
+}
+
+void
+psu_hist_init (psu_hist_t *php)
+{
+    bzero(php, sizeof(*php));
+    php->ph_min = UINT64_MAX;
+}
+
+void
+psu_hist_merge (psu_hist_t *dst, const psu_hist_t *src)
+{
+    unsigned i;
+
+    if (src->ph_count == 0)
+	return;
+
+    dst->ph_count += src->ph_count;
+    dst->ph_sum += src->ph_sum;
+    if (src->ph_min < dst->ph_min)
+	dst->ph_min = src->ph_min;
+    if (src->ph_max > dst->ph_max)
+	dst->ph_max = src->ph_max;
+
+    for (i = 0; i < PSU_HIST_BUCKETS; i++)
+	dst->ph_buckets[i] += src->ph_buckets[i];
+}
+
+/*
+ * Return the smallest value that lands in a bucket
+ */
+static uint64_t
+psu_hist_bucket_low (unsigned bucket)
+{
+    unsigned shift;
+
+    if (bucket < 2 * PSU_HIST_SUB)
+	return bucket;
+
+    shift = bucket / PSU_HIST_SUB - 1;
+    return (uint64_t) (PSU_HIST_SUB + bucket % PSU_HIST_SUB) << shift;
+}
+
+uint64_t
+psu_hist_percentile (const psu_hist_t *php, double pct)
+{
+    uint64_t rank, seen = 0, low, high, val;
+    unsigned i;
+
+    if (php->ph_count == 0)
+	return 0;
+
+    /* Nearest rank: the smallest value with pct% at or below it */
+    rank = (uint64_t) (pct * php->ph_count / 100.0 + 0.999999);
+    if (rank < 1)
+	rank = 1;
+    if (rank > php->ph_count)
+	rank = php->ph_count;
+
+    for (i = 0; i < PSU_HIST_BUCKETS; i++) {
+	seen += php->ph_buckets[i];
+	if (seen >= rank)
+	    break;
+    }
+
+    if (i >= PSU_HIST_BUCKETS)
+	return php->ph_max;
+
+    /* Report the middle of the bucket, but never outside min/max */
+    low = psu_hist_bucket_low(i);
+    high = (i + 1 < PSU_HIST_BUCKETS) ? psu_hist_bucket_low(i + 1) - 1
+	: UINT64_MAX;
+    val = low + (high - low) / 2;
+
+    if (val < php->ph_min)
+	val = php->ph_min;
+    if (val > php->ph_max)
+	val = php->ph_max;
+
+    return val;
+}
+
+void
+psu_hist_dump (FILE *fp, const char *name, const psu_hist_t *php,
+	       int ticks)
+{
+    uint64_t vals[6];
+    unsigned i;
+
+    if (php->ph_count == 0) {
+	fprintf(fp, "%s: count 0\n", name);
+	return;
+    }
+
+    vals[0] = php->ph_min;
+    vals[1] = php->ph_sum / php->ph_count;
+    vals[2] = psu_hist_percentile(php, 50);
+    vals[3] = psu_hist_percentile(php, 90);
+    vals[4] = psu_hist_percentile(php, 99);
+    vals[5] = php->ph_max;
+
+    if (ticks)
+	for (i = 0; i < 6; i++)
+	    vals[i] = psu_ticks_to_nsecs(vals[i]);
+
+    fprintf(fp, "%s: count %llu min %llu mean %llu p50 %llu p90 %llu "
+	    "p99 %llu max %llu%s\n", name,
+	    (unsigned long long) php->ph_count,
+	    (unsigned long long) vals[0], (unsigned long long) vals[1],
+	    (unsigned long long) vals[2], (unsigned long long) vals[3],
+	    (unsigned long long) vals[4], (unsigned long long) vals[5],
+	    ticks ? " (nsecs)" : "");
+}
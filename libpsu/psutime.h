@@ -12,6 +12,8 @@
 #ifndef LIBPSU_PSUTIME_H
 #define LIBPSU_PSUTIME_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -63,4 +65,176 @@ psu_iso_time (const time_t *t, char *buf, size_t bufsiz)
     return buf;
 }
 
+/*
+ * Ticks are the raw counts of the cheapest stable clock we have:
+ * the TSC on x86, the virtual counter (CNTVCT) on ARMv8, and
+ * CLOCK_MONOTONIC nanoseconds elsewhere.  Reading one costs a few
+ * nanoseconds, so they're good for timing single operations.  The
+ * counter runs at a fixed rate (calibrated on first use), but it's
+ * wall clock time, not CPU time: a thread that blocks keeps counting.
+ */
+typedef uint64_t psu_ticks_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PSU_TICKS_SOURCE "tsc"
+#elif defined(__aarch64__)
+#define PSU_TICKS_SOURCE "cntvct"
+#else /* _X86_ */
+#define PSU_TICKS_SOURCE "clock"
+#endif /* _X86_ */
+
+/**
+ * Read the tick counter.  The read isn't ordered against nearby
+ * instructions, which only matters for very short intervals; use
+ * psu_ticks_fenced() for those.
+ */
+static inline psu_ticks_t
+psu_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((psu_ticks_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+    psu_ticks_t val;
+
+    asm volatile ("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
+#else /* _X86_ */
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif /* _X86_ */
+}
+
+/**
+ * Read the tick counter once everything before it has finished, and
+ * before anything after it starts
+ */
+static inline psu_ticks_t
+psu_ticks_fenced (void)
+{
+    psu_ticks_t val;
+
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile ("lfence" ::: "memory");
+    val = psu_ticks();
+    asm volatile ("lfence" ::: "memory");
+#elif defined(__aarch64__)
+    asm volatile ("isb" ::: "memory");
+    val = psu_ticks();
+    asm volatile ("isb" ::: "memory");
+#else /* _X86_ */
+    val = psu_ticks();
+#endif /* _X86_ */
+
+    return val;
+}
+
+/**
+ * Return the tick rate, calibrating it the first time
+ */
+uint64_t
+psu_ticks_per_sec (void);
+
+/**
+ * Convert ticks to nanoseconds (or microseconds)
+ */
+uint64_t
+psu_ticks_to_nsecs (psu_ticks_t ticks);
+
+psu_time_usecs_t
+psu_ticks_to_usecs (psu_ticks_t ticks);
+
+/*
+ * A histogram of values (normally intervals in ticks).  Values below
+ * 16 each get a bucket; above that, each power of two is split into
+ * eight buckets, so a reported percentile is within 12.5% of the
+ * real value.  Adding a value is a handful of instructions and
+ * never allocates.  A histogram belongs to one thread; use
+ * psu_hist_merge() to combine them.
+ */
+#define PSU_HIST_SUB_BITS	3
+#define PSU_HIST_SUB		(1 << PSU_HIST_SUB_BITS) /* Buckets per power */
+#define PSU_HIST_BUCKETS	((64 - PSU_HIST_SUB_BITS + 1) * PSU_HIST_SUB)
+
+typedef struct psu_hist_s {
+    uint64_t ph_count;		/* Number of values */
+    uint64_t ph_sum;		/* Sum of values */
+    uint64_t ph_min;		/* Smallest value */
+    uint64_t ph_max;		/* Largest value */
+    uint64_t ph_buckets[PSU_HIST_BUCKETS]; /* Counts, by bucket */
+} psu_hist_t;
+
+/**
+ * Empty a histogram
+ */
+void
+psu_hist_init (psu_hist_t *php);
+
+static inline unsigned
+psu_hist_bucket (uint64_t value)
+{
+    unsigned shift;
+
+    if (value < 2 * PSU_HIST_SUB)
+	return value;
+
+    shift = 63 - __builtin_clzll(value) - PSU_HIST_SUB_BITS;
+    return (shift + 1) * PSU_HIST_SUB
+	+ ((value >> shift) & (PSU_HIST_SUB - 1));
+}
+
+/**
+ * Add a value to a histogram
+ */
+static inline void
+psu_hist_add (psu_hist_t *php, uint64_t value)
+{
+    php->ph_count += 1;
+    php->ph_sum += value;
+    if (value < php->ph_min)
+	php->ph_min = value;
+    if (value > php->ph_max)
+	php->ph_max = value;
+    php->ph_buckets[psu_hist_bucket(value)] += 1;
+}
+
+/**
+ * Add the contents of one histogram to another
+ */
+void
+psu_hist_merge (psu_hist_t *dst, const psu_hist_t *src);
+
+/**
+ * Return an estimate of the given percentile (0 to 100) of the
+ * values, or zero for an empty histogram
+ */
+uint64_t
+psu_hist_percentile (const psu_hist_t *php, double pct);
+
+/**
+ * Write a one-line summary: count, then min, mean, median, p90,
+ * p99 and max.  If "ticks" is set, values are intervals in ticks,
+ * and are reported in nanoseconds.
+ */
+void
+psu_hist_dump (FILE *fp, const char *name, const psu_hist_t *php,
+	       int ticks);
+
+/*
+ * Time the following statement (or block), adding the interval to
+ * a histogram.  Leaving the block with "break", "goto", or "return"
+ * skips the recording.
+ *
+ *     PSU_TIME_SCOPE(&parse_hist) {
+ *         parse_one(...);
+ *     }
+ */
+#define PSU_TIME_SCOPE(_histp) \
+    for (psu_ticks_t _pts_start = psu_ticks(), _pts_once = 1; _pts_once; \
+	 _pts_once = 0, psu_hist_add((_histp), psu_ticks() - _pts_start))
+
 #endif /* LIBPSU_PSUTIME_H */
@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuwork.c -- a work-stealing thread pool
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psuthread.h>
+#include <libpsu/psucpu.h>
+#include <libpsu/psuwork.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+
+#define PSU_WORK_DEQUE_MIN 64	/* Initial size of a deque */
+
+typedef struct psu_work_task_s {
+    psu_work_func_t pwt_func;	/* Function to call */
+    void *pwt_arg;		/* Argument to pass it */
+    psu_work_group_t *pwt_group; /* Group to tell when we're done */
+} psu_work_task_t;
+
+/*
+ * A deque is a ring of tasks, indexed by ever-increasing counters.
+ * The owner pushes and pops at the bottom; thieves take from the
+ * top.  Everything is done under the deque's lock, which is seldom
+ * contended, since thieves only come when they've run out of work
+ * of their own.  The counters are also read without the lock, as a
+ * hint that there's nothing worth stealing.
+ */
+typedef struct psu_work_deque_s {
+    pthread_mutex_t pwd_lock;	/* Guards the rest */
+    psu_work_task_t *pwd_tasks;	/* Ring of tasks */
+    unsigned long pwd_size;	/* Size of pwd_tasks (a power of two) */
+    unsigned long pwd_top;	/* Oldest task (where thieves take) */
+    unsigned long pwd_bottom;	/* Next free slot (where the owner works) */
+} psu_work_deque_t;
+
+typedef struct psu_work_worker_s {
+    psu_work_pool_t *pww_pool;	/* Pool we belong to */
+    unsigned pww_index;		/* Our worker number */
+    int pww_cpu;		/* CPU we're pinned to (or -1) */
+    unsigned pww_seed;		/* State for picking victims */
+    pthread_t pww_thread;	/* Our thread */
+    psu_work_deque_t pww_deque;	/* Our tasks */
+    unsigned long pww_run;	/* Tasks we've run */
+    unsigned long pww_stolen;	/* Tasks we've taken from others */
+} psu_work_worker_t;
+
+/*
+ * Idle threads (workers with nothing to do, and threads waiting on a
+ * group) sleep on pwp_wake.  A sleeper bumps pwp_sleeping before it
+ * looks at pwp_queued one last time, and a submitter bumps pwp_queued
+ * before it looks at pwp_sleeping, so one of them always sees the
+ * other, and the submitter only takes the mutex when someone might
+ * be asleep.
+ */
+struct psu_work_pool_s {
+    unsigned pwp_count;		/* Number of workers */
+    unsigned pwp_flags;		/* Flags (PSU_WORKF_*) */
+    psu_work_worker_t **pwp_workers; /* The workers */
+    psu_work_deque_t pwp_inject; /* Tasks from threads outside the pool */
+    pthread_mutex_t pwp_mutex;	/* Guards sleeping and waking */
+    pthread_cond_t pwp_wake;	/* Signaled for new work (or done groups) */
+    unsigned pwp_sleeping;	/* Threads waiting on pwp_wake */
+    unsigned long pwp_queued;	/* Tasks sitting in all the deques */
+    int pwp_stop;		/* Workers should exit when it's all done */
+};
+
+#define PWQ_LOAD(_x) __atomic_load_n(&(_x), __ATOMIC_SEQ_CST)
+#define PWQ_STORE(_x, _v) __atomic_store_n(&(_x), (_v), __ATOMIC_RELEASE)
+#define PWQ_ADD(_x, _v) __atomic_add_fetch(&(_x), (_v), __ATOMIC_SEQ_CST)
+#define PWQ_SUB(_x, _v) __atomic_sub_fetch(&(_x), (_v), __ATOMIC_SEQ_CST)
+
+static THREAD_LOCAL(psu_work_worker_t *) psu_work_current;
+static THREAD_LOCAL(unsigned) psu_work_seed; /* For non-workers */
+
+static psu_work_pool_t *psu_work_default;
+static pthread_once_t psu_work_default_once = PTHREAD_ONCE_INIT;
+
+static int
+psu_work_deque_init (psu_work_deque_t *dqp)
+{
+    dqp->pwd_tasks = calloc(PSU_WORK_DEQUE_MIN, sizeof(*dqp->pwd_tasks));
+    if (dqp->pwd_tasks == NULL)
+	return -1;
+
+    dqp->pwd_size = PSU_WORK_DEQUE_MIN;
+    dqp->pwd_top = dqp->pwd_bottom = 0;
+    pthread_mutex_init(&dqp->pwd_lock, NULL);
+    return 0;
+}
+
+static void
+psu_work_deque_cleanup (psu_work_deque_t *dqp)
+{
+    pthread_mutex_destroy(&dqp->pwd_lock);
+    free(dqp->pwd_tasks);
+    dqp->pwd_tasks = NULL;
+}
+
+/*
+ * Double the ring; the caller holds the lock
+ */
+static int
+psu_work_deque_grow (psu_work_deque_t *dqp)
+{
+    unsigned long size = dqp->pwd_size * 2, i;
+    psu_work_task_t *tasks = malloc(size * sizeof(*tasks));
+
+    if (tasks == NULL)
+	return -1;
+
+    /* Tasks keep their counters, so they land in new slots */
+    for (i = dqp->pwd_top; i != dqp->pwd_bottom; i++)
+	tasks[i & (size - 1)] = dqp->pwd_tasks[i & (dqp->pwd_size - 1)];
+
+    free(dqp->pwd_tasks);
+    dqp->pwd_tasks = tasks;
+    dqp->pwd_size = size;
+    return 0;
+}
+
+static int
+psu_work_deque_push (psu_work_deque_t *dqp, const psu_work_task_t *taskp)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&dqp->pwd_lock);
+
+    if (dqp->pwd_bottom - dqp->pwd_top == dqp->pwd_size)
+	rc = psu_work_deque_grow(dqp);
+
+    if (rc == 0) {
+	dqp->pwd_tasks[dqp->pwd_bottom & (dqp->pwd_size - 1)] = *taskp;
+	PWQ_STORE(dqp->pwd_bottom, dqp->pwd_bottom + 1);
+    }
+
+    pthread_mutex_unlock(&dqp->pwd_lock);
+    return rc;
+}
+
+/*
+ * Take the newest task (the owner's end)
+ */
+static int
+psu_work_deque_pop (psu_work_deque_t *dqp, psu_work_task_t *taskp)
+{
+    int found = FALSE;
+
+    pthread_mutex_lock(&dqp->pwd_lock);
+
+    if (dqp->pwd_bottom != dqp->pwd_top) {
+	PWQ_STORE(dqp->pwd_bottom, dqp->pwd_bottom - 1);
+	*taskp = dqp->pwd_tasks[dqp->pwd_bottom & (dqp->pwd_size - 1)];
+	found = TRUE;
+    }
+
+    pthread_mutex_unlock(&dqp->pwd_lock);
+    return found;
+}
+
+/*
+ * Take the oldest task (the thieves' end)
+ */
+static int
+psu_work_deque_steal (psu_work_deque_t *dqp, psu_work_task_t *taskp)
+{
+    int found = FALSE;
+
+    /* Don't bother with the lock for a deque that looks empty */
+    if (PWQ_LOAD(dqp->pwd_bottom) == PWQ_LOAD(dqp->pwd_top))
+	return FALSE;
+
+    pthread_mutex_lock(&dqp->pwd_lock);
+
+    if (dqp->pwd_bottom != dqp->pwd_top) {
+	*taskp = dqp->pwd_tasks[dqp->pwd_top & (dqp->pwd_size - 1)];
+	PWQ_STORE(dqp->pwd_top, dqp->pwd_top + 1);
+	found = TRUE;
+    }
+
+    pthread_mutex_unlock(&dqp->pwd_lock);
+    return found;
+}
+
+static inline unsigned
+psu_work_random (unsigned *seedp)
+{
+    unsigned x = *seedp;
+
+    if (x == 0)			/* Xorshift's one bad seed */
+	x = (unsigned) (uintptr_t) seedp | 1;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seedp = x;
+
+    return x;
+}
+
+/*
+ * Find a task to run: our own newest one, then one from outside the
+ * pool, then one stolen from a worker picked at random
+ */
+static int
+psu_work_find (psu_work_pool_t *pwpp, psu_work_worker_t *self,
+	       psu_work_task_t *taskp)
+{
+    unsigned start, i, victim;
+
+    if (self && psu_work_deque_pop(&self->pww_deque, taskp))
+	goto found;
+
+    if (psu_work_deque_steal(&pwpp->pwp_inject, taskp))
+	goto found;
+
+    start = psu_work_random(self ? &self->pww_seed : &psu_work_seed);
+    for (i = 0; i < pwpp->pwp_count; i++) {
+	victim = (start + i) % pwpp->pwp_count;
+	if (self && victim == self->pww_index)
+	    continue;
+
+	if (psu_work_deque_steal(&pwpp->pwp_workers[victim]->pww_deque,
+				 taskp)) {
+	    if (self)
+		__atomic_add_fetch(&self->pww_stolen, 1, __ATOMIC_RELAXED);
+	    goto found;
+	}
+    }
+
+    return FALSE;
+
+ found:
+    PWQ_SUB(pwpp->pwp_queued, 1);
+    return TRUE;
+}
+
+static void
+psu_work_run (psu_work_pool_t *pwpp, psu_work_worker_t *self,
+	      psu_work_task_t *taskp)
+{
+    psu_work_group_t *pwgp = taskp->pwt_group;
+
+    taskp->pwt_func(taskp->pwt_arg);
+
+    if (self)
+	__atomic_add_fetch(&self->pww_run, 1, __ATOMIC_RELAXED);
+
+    /* Once pending hits zero, the waiter can free the group */
+    if (pwgp && PWQ_SUB(pwgp->pwg_pending, 1) == 0
+	    && PWQ_LOAD(pwpp->pwp_sleeping)) {
+	pthread_mutex_lock(&pwpp->pwp_mutex);
+	pthread_cond_broadcast(&pwpp->pwp_wake);
+	pthread_mutex_unlock(&pwpp->pwp_mutex);
+    }
+}
+
+static void
+psu_work_pin (psu_work_worker_t *self UNUSED)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t set;
+
+    if (self->pww_cpu < 0)
+	return;
+
+    CPU_ZERO(&set);
+    CPU_SET(self->pww_cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+}
+
+static void *
+psu_work_worker (void *arg)
+{
+    psu_work_worker_t *self = arg;
+    psu_work_pool_t *pwpp = self->pww_pool;
+    psu_work_task_t task;
+    int done;
+
+    psu_work_current = self;
+    psu_work_pin(self);
+
+    for (;;) {
+	if (psu_work_find(pwpp, self, &task)) {
+	    psu_work_run(pwpp, self, &task);
+	    continue;
+	}
+
+	pthread_mutex_lock(&pwpp->pwp_mutex);
+	PWQ_ADD(pwpp->pwp_sleeping, 1);
+
+	while (PWQ_LOAD(pwpp->pwp_queued) == 0 && !pwpp->pwp_stop)
+	    pthread_cond_wait(&pwpp->pwp_wake, &pwpp->pwp_mutex);
+
+	PWQ_SUB(pwpp->pwp_sleeping, 1);
+	done = pwpp->pwp_stop && PWQ_LOAD(pwpp->pwp_queued) == 0;
+	pthread_mutex_unlock(&pwpp->pwp_mutex);
+
+	if (done)
+	    break;
+    }
+
+    psu_work_current = NULL;
+    return NULL;
+}
+
+/*
+ * Stop and free the first "count" workers
+ */
+static void
+psu_work_pool_stop (psu_work_pool_t *pwpp, unsigned count)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&pwpp->pwp_mutex);
+    pwpp->pwp_stop = TRUE;
+    pthread_cond_broadcast(&pwpp->pwp_wake);
+    pthread_mutex_unlock(&pwpp->pwp_mutex);
+
+    for (i = 0; i < count; i++) {
+	psu_work_worker_t *pwwp = pwpp->pwp_workers[i];
+
+	pthread_join(pwwp->pww_thread, NULL);
+	psu_work_deque_cleanup(&pwwp->pww_deque);
+	free(pwwp);
+    }
+}
+
+static void
+psu_work_pool_free (psu_work_pool_t *pwpp)
+{
+    psu_work_deque_cleanup(&pwpp->pwp_inject);
+    pthread_cond_destroy(&pwpp->pwp_wake);
+    pthread_mutex_destroy(&pwpp->pwp_mutex);
+    free(pwpp->pwp_workers);
+    free(pwpp);
+}
+
+psu_work_pool_t *
+psu_work_pool_create (unsigned workers, unsigned flags)
+{
+    psu_work_pool_t *pwpp;
+    psu_work_worker_t *pwwp;
+    unsigned cpus[PSU_WORK_MAX], ncpus = 0, made, started = 0, i;
+
+    if (workers == 0)
+	workers = psu_cpu_count();
+    if (workers > PSU_WORK_MAX)
+	workers = PSU_WORK_MAX;
+
+    if (flags & PSU_WORKF_PIN)
+	ncpus = psu_cpu_list(cpus, PSU_WORK_MAX);
+
+    pwpp = calloc(1, sizeof(*pwpp));
+    if (pwpp == NULL)
+	return NULL;
+
+    pwpp->pwp_workers = calloc(workers, sizeof(*pwpp->pwp_workers));
+    if (pwpp->pwp_workers == NULL || psu_work_deque_init(&pwpp->pwp_inject)) {
+	free(pwpp->pwp_workers);
+	free(pwpp);
+	return NULL;
+    }
+
+    pwpp->pwp_count = workers;
+    pwpp->pwp_flags = flags;
+    pthread_mutex_init(&pwpp->pwp_mutex, NULL);
+    pthread_cond_init(&pwpp->pwp_wake, NULL);
+
+    /* Make every worker before starting any, since they steal */
+    for (made = 0; made < workers; made++) {
+	pwwp = calloc(1, sizeof(*pwwp));
+	if (pwwp == NULL || psu_work_deque_init(&pwwp->pww_deque)) {
+	    free(pwwp);
+	    break;
+	}
+
+	pwwp->pww_pool = pwpp;
+	pwwp->pww_index = made;
+	pwwp->pww_cpu = ncpus ? (int) cpus[made % ncpus] : -1;
+	pwwp->pww_seed = (made + 1) * 2654435761U;
+	pwpp->pwp_workers[made] = pwwp;
+    }
+
+    if (made == workers) {
+	for (started = 0; started < workers; started++) {
+	    pwwp = pwpp->pwp_workers[started];
+	    if (pthread_create(&pwwp->pww_thread, NULL,
+			       psu_work_worker, pwwp) != 0)
+		break;
+	}
+
+	if (started == workers)
+	    return pwpp;
+    }
+
+    /* Stop the workers we started and free the ones we didn't */
+    psu_work_pool_stop(pwpp, started);
+    for (i = started; i < made; i++) {
+	psu_work_deque_cleanup(&pwpp->pwp_workers[i]->pww_deque);
+	free(pwpp->pwp_workers[i]);
+    }
+
+    psu_work_pool_free(pwpp);
+    return NULL;
+}
+
+void
+psu_work_pool_destroy (psu_work_pool_t *pwpp)
+{
+    if (pwpp == NULL)
+	return;
+
+    psu_work_pool_stop(pwpp, pwpp->pwp_count);
+    psu_work_pool_free(pwpp);
+}
+
+static void
+psu_work_default_create (void)
+{
+    const char *cp = getenv("PSU_WORKERS");
+    unsigned workers = cp ? strtoul(cp, NULL, 0) : 0;
+
+    psu_work_default = psu_work_pool_create(workers, 0);
+}
+
+psu_work_pool_t *
+psu_work_pool_default (void)
+{
+    pthread_once(&psu_work_default_once, psu_work_default_create);
+    return psu_work_default;
+}
+
+unsigned
+psu_work_pool_size (psu_work_pool_t *pwpp)
+{
+    return pwpp->pwp_count;
+}
+
+void
+psu_work_pool_dump (FILE *fp, psu_work_pool_t *pwpp)
+{
+    psu_work_worker_t *pwwp;
+    unsigned i;
+
+    fprintf(fp, "work pool: %u workers%s\n", pwpp->pwp_count,
+	    (pwpp->pwp_flags & PSU_WORKF_PIN) ? " (pinned)" : "");
+
+    for (i = 0; i < pwpp->pwp_count; i++) {
+	pwwp = pwpp->pwp_workers[i];
+	fprintf(fp, "    worker %u: run %lu, stolen %lu", i,
+		PWQ_LOAD(pwwp->pww_run), PWQ_LOAD(pwwp->pww_stolen));
+	if (pwwp->pww_cpu >= 0)
+	    fprintf(fp, ", cpu %d", pwwp->pww_cpu);
+	fprintf(fp, "\n");
+    }
+}
+
+int
+psu_work_self (psu_work_pool_t *pwpp)
+{
+    psu_work_worker_t *self = psu_work_current;
+
+    return (self && self->pww_pool == pwpp) ? (int) self->pww_index : -1;
+}
+
+int
+psu_work_submit (psu_work_pool_t *pwpp, psu_work_group_t *pwgp,
+		 psu_work_func_t func, void *arg)
+{
+    psu_work_worker_t *self = psu_work_current;
+    psu_work_task_t task = {
+	.pwt_func = func,
+	.pwt_arg = arg,
+	.pwt_group = pwgp,
+    };
+    psu_work_deque_t *dqp;
+
+    dqp = (self && self->pww_pool == pwpp)
+	? &self->pww_deque : &pwpp->pwp_inject;
+
+    /* Count the task before anyone can run (and finish) it */
+    if (pwgp)
+	PWQ_ADD(pwgp->pwg_pending, 1);
+
+    if (psu_work_deque_push(dqp, &task)) {
+	if (pwgp)
+	    PWQ_SUB(pwgp->pwg_pending, 1);
+	return -1;
+    }
+
+    PWQ_ADD(pwpp->pwp_queued, 1);
+
+    if (PWQ_LOAD(pwpp->pwp_sleeping)) {
+	pthread_mutex_lock(&pwpp->pwp_mutex);
+	pthread_cond_signal(&pwpp->pwp_wake);
+	pthread_mutex_unlock(&pwpp->pwp_mutex);
+    }
+
+    return 0;
+}
+
+void
+psu_work_group_wait (psu_work_pool_t *pwpp, psu_work_group_t *pwgp)
+{
+    psu_work_worker_t *self = psu_work_current;
+    psu_work_task_t task;
+
+    if (self && self->pww_pool != pwpp)
+	self = NULL;
+
+    while (PWQ_LOAD(pwgp->pwg_pending)) {
+	if (psu_work_find(pwpp, self, &task)) {
+	    psu_work_run(pwpp, self, &task);
+	    continue;
+	}
+
+	/* Nothing to do but wait for the group's running tasks */
+	pthread_mutex_lock(&pwpp->pwp_mutex);
+	PWQ_ADD(pwpp->pwp_sleeping, 1);
+
+	while (PWQ_LOAD(pwpp->pwp_queued) == 0
+	       && PWQ_LOAD(pwgp->pwg_pending) != 0)
+	    pthread_cond_wait(&pwpp->pwp_wake, &pwpp->pwp_mutex);
+
+	PWQ_SUB(pwpp->pwp_sleeping, 1);
+	pthread_mutex_unlock(&pwpp->pwp_mutex);
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuwork.h -- a work-stealing thread pool
+ *
+ * A pool runs small tasks (a function and an argument) on a fixed
+ * set of worker threads.  Each worker has its own deque: tasks it
+ * submits go on the bottom, it takes work from the bottom (so the
+ * most recent, cache-warm, task runs next), and idle workers steal
+ * from the top of someone else's.  Threads outside the pool submit
+ * to a shared queue that the workers drain.
+ *
+ * Tasks are put in a group, and a thread waits for a group to finish
+ * with psu_work_group_wait().  A waiting thread doesn't just sleep:
+ * it runs queued tasks (any task, not only the group's) until the
+ * group is done, so a task can submit subtasks and wait for them
+ * without tying up its worker, and waiting on a pool of one worker
+ * can't deadlock.
+ *
+ * Rather than have each subsystem start threads of its own, code
+ * should normally use psu_work_pool_default(), which is made on first
+ * use with one worker per CPU we're allowed to run on (or the number
+ * in the PSU_WORKERS environment variable).
+ */
+
+#ifndef LIBPSU_PSUWORK_H
+#define LIBPSU_PSUWORK_H
+
+#include <stdio.h>
+
+typedef struct psu_work_pool_s psu_work_pool_t; /* Opaque */
+
+typedef void (*psu_work_func_t)(void *arg);
+
+/*
+ * A set of tasks to be waited for together.  A group lives wherever
+ * its owner likes (typically on the stack of the waiting function);
+ * it must stay put until psu_work_group_wait() returns.
+ */
+typedef struct psu_work_group_s {
+    unsigned long pwg_pending;	/* Tasks submitted and not yet done */
+} psu_work_group_t;
+
+/* Flags for psu_work_pool_create() */
+#define PSU_WORKF_PIN	(1<<0)	/* Pin each worker to its own CPU */
+
+#define PSU_WORK_MAX	256	/* Most workers in a pool */
+
+/**
+ * Make a pool
+ *
+ * @param[in] workers Number of worker threads (zero for one per CPU)
+ * @param[in] flags Flags (PSU_WORKF_*)
+ * @return the pool, or NULL on failure
+ */
+psu_work_pool_t *
+psu_work_pool_create (unsigned workers, unsigned flags);
+
+/**
+ * Run every queued task, stop the workers, and free the pool.  No
+ * one may submit tasks to the pool once this is called.
+ */
+void
+psu_work_pool_destroy (psu_work_pool_t *pwpp);
+
+/**
+ * Return the process's shared pool, making it if need be
+ *
+ * @return the pool, or NULL if it can't be made
+ */
+psu_work_pool_t *
+psu_work_pool_default (void);
+
+/**
+ * Return the number of workers in the pool
+ */
+unsigned
+psu_work_pool_size (psu_work_pool_t *pwpp);
+
+/**
+ * Write each worker's counts (tasks run, tasks stolen) to "fp"
+ */
+void
+psu_work_pool_dump (FILE *fp, psu_work_pool_t *pwpp);
+
+/**
+ * Return the calling thread's worker number in the given pool, or
+ * -1 if it isn't one of the pool's workers
+ */
+int
+psu_work_self (psu_work_pool_t *pwpp);
+
+static inline void
+psu_work_group_init (psu_work_group_t *pwgp)
+{
+    pwgp->pwg_pending = 0;
+}
+
+/**
+ * Queue a task
+ *
+ * @param[in] pwpp The pool
+ * @param[in] pwgp Group the task belongs to (or NULL for none)
+ * @param[in] func Function to call
+ * @param[in] arg Argument to pass it
+ * @return zero on success, -1 if memory ran out (and nothing was queued)
+ */
+int
+psu_work_submit (psu_work_pool_t *pwpp, psu_work_group_t *pwgp,
+		 psu_work_func_t func, void *arg);
+
+/**
+ * Wait for every task in a group to finish, running queued tasks
+ * in the meantime.  The group can be reused afterwards.
+ */
+void
+psu_work_group_wait (psu_work_pool_t *pwpp, psu_work_group_t *pwgp);
+
+#endif /* LIBPSU_PSUWORK_H */
@@ -0,0 +1,957 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuzio.c -- compressed (gzip and zstd) file streams
+ *
+ * Streams are kept in a table indexed by file descriptor, so the
+ * psu_zio_* I/O functions cost a bounds check and a NULL test for
+ * descriptors that don't have one.  The table is only changed under
+ * a lock, and is never freed when it grows, so lookups need no lock;
+ * a stream itself is only used by the one thread doing its I/O.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* For fopencookie() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psuzio.h>
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#define PSU_ZIO_GZIP
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#define PSU_ZIO_ZSTD
+#include <zstd.h>
+#endif
+
+#define PSU_ZIO_BUFSIZ	(128 * 1024) /* Size of the compressed data buffer */
+#define PSU_ZIO_MAGIC	4	/* Bytes needed to recognize a format */
+
+typedef struct psu_zio_s {
+    int pz_fd;			/* File descriptor */
+    unsigned pz_flags;		/* Flags (PZIOF_*) */
+    psu_zio_format_t pz_format;	/* Format of the data */
+    unsigned char *pz_buf;	/* Compressed data (or pending plain data) */
+    size_t pz_off;		/* Offset of the unused data in pz_buf */
+    size_t pz_len;		/* End of the data in pz_buf */
+#ifdef PSU_ZIO_GZIP
+    z_stream pz_zs;		/* zlib state */
+#endif
+#ifdef PSU_ZIO_ZSTD
+    ZSTD_CCtx *pz_cctx;		/* zstd compression state */
+    ZSTD_DCtx *pz_dctx;		/* zstd decompression state */
+#endif
+} psu_zio_t;
+
+/* Flags for pz_flags */
+#define PZIOF_WRITE	(1<<0)	/* Stream is for writing */
+#define PZIOF_EOF	(1<<1)	/* Seen the end of the input */
+#define PZIOF_END	(1<<2)	/* Seen the end of a compressed member */
+#define PZIOF_ERROR	(1<<3)	/* Fatal error seen */
+
+static psu_zio_t **psu_zio_table; /* Streams, indexed by fd */
+static int psu_zio_table_size;	/* Number of entries in psu_zio_table */
+static pthread_mutex_t psu_zio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline psu_zio_t *
+psu_zio_find (int fd)
+{
+    psu_zio_t **table = __atomic_load_n(&psu_zio_table, __ATOMIC_ACQUIRE);
+
+    if (fd < 0 || fd >= __atomic_load_n(&psu_zio_table_size,
+					__ATOMIC_ACQUIRE))
+	return NULL;
+
+    return table[fd];
+}
+
+static int
+psu_zio_table_set (int fd, psu_zio_t *pzp)
+{
+    psu_zio_t **table;
+    int size;
+
+    pthread_mutex_lock(&psu_zio_lock);
+
+    if (fd >= psu_zio_table_size) {
+	size = psu_zio_table_size ? psu_zio_table_size : 64;
+	while (size <= fd)
+	    size *= 2;
+
+	/* Readers may still be looking at the old table, so we leak it */
+	table = calloc(size, sizeof(*table));
+	if (table == NULL) {
+	    pthread_mutex_unlock(&psu_zio_lock);
+	    errno = ENOMEM;
+	    return -1;
+	}
+
+	if (psu_zio_table)
+	    memcpy(table, psu_zio_table,
+		   psu_zio_table_size * sizeof(*table));
+
+	__atomic_store_n(&psu_zio_table, table, __ATOMIC_RELEASE);
+	__atomic_store_n(&psu_zio_table_size, size, __ATOMIC_RELEASE);
+    }
+
+    psu_zio_table[fd] = pzp;
+
+    pthread_mutex_unlock(&psu_zio_lock);
+    return 0;
+}
+
+psu_zio_format_t
+psu_zio_format_by_name (const char *filename)
+{
+    size_t len = filename ? strlen(filename) : 0;
+
+    if (len > 3 && strcmp(filename + len - 3, ".gz") == 0)
+	return PZF_GZIP;
+    if (len > 4 && strcmp(filename + len - 4, ".zst") == 0)
+	return PZF_ZSTD;
+
+    return PZF_NONE;
+}
+
+static const char *psu_zio_format_names[] = {
+    [PZF_NONE] = "none",
+    [PZF_GZIP] = "gzip",
+    [PZF_ZSTD] = "zstd",
+    [PZF_AUTO] = "auto",
+};
+
+int
+psu_zio_format_parse (const char *name, psu_zio_format_t *formatp)
+{
+    unsigned i;
+
+    for (i = 0; i < PSU_NUM_ELTS(psu_zio_format_names); i++) {
+	if (streq(name, psu_zio_format_names[i])) {
+	    *formatp = i;
+	    return 0;
+	}
+    }
+
+    /* Allow the file extensions too */
+    if (streq(name, "gz")) {
+	*formatp = PZF_GZIP;
+	return 0;
+    }
+    if (streq(name, "zst")) {
+	*formatp = PZF_ZSTD;
+	return 0;
+    }
+
+    return -1;
+}
+
+const char *
+psu_zio_format_name (psu_zio_format_t format)
+{
+    if ((unsigned) format < PSU_NUM_ELTS(psu_zio_format_names))
+	return psu_zio_format_names[format];
+    return "unknown";
+}
+
+int
+psu_zio_supported (psu_zio_format_t format)
+{
+    switch (format) {
+    case PZF_NONE:
+    case PZF_AUTO:
+	return TRUE;
+
+    case PZF_GZIP:
+#ifdef PSU_ZIO_GZIP
+	return TRUE;
+#else
+	return FALSE;
+#endif
+
+    case PZF_ZSTD:
+#ifdef PSU_ZIO_ZSTD
+	return TRUE;
+#else
+	return FALSE;
+#endif
+    }
+
+    return FALSE;
+}
+
+/*
+ * Look at the first bytes of the data to find its format
+ */
+static psu_zio_format_t
+psu_zio_sniff (const unsigned char *buf, size_t len)
+{
+    if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+	return PZF_GZIP;
+    if (len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5
+		&& buf[2] == 0x2f && buf[3] == 0xfd)
+	return PZF_ZSTD;
+
+    return PZF_NONE;
+}
+
+static void
+psu_zio_free (psu_zio_t *pzp)
+{
+#ifdef PSU_ZIO_GZIP
+    if (pzp->pz_format == PZF_GZIP) {
+	if (pzp->pz_flags & PZIOF_WRITE)
+	    deflateEnd(&pzp->pz_zs);
+	else
+	    inflateEnd(&pzp->pz_zs);
+    }
+#endif
+#ifdef PSU_ZIO_ZSTD
+    if (pzp->pz_cctx)
+	ZSTD_freeCCtx(pzp->pz_cctx);
+    if (pzp->pz_dctx)
+	ZSTD_freeDCtx(pzp->pz_dctx);
+#endif
+
+    free(pzp->pz_buf);
+    free(pzp);
+}
+
+/*
+ * Set up the (de)compressor for the stream's format
+ */
+static int
+psu_zio_init (psu_zio_t *pzp, int level)
+{
+    switch (pzp->pz_format) {
+    case PZF_NONE:
+	return 0;
+
+#ifdef PSU_ZIO_GZIP
+    case PZF_GZIP:
+	if (pzp->pz_flags & PZIOF_WRITE) {
+	    /* 16 + MAX_WBITS makes a gzip header and trailer */
+	    if (deflateInit2(&pzp->pz_zs,
+			     level ? level : Z_DEFAULT_COMPRESSION,
+			     Z_DEFLATED, 16 + MAX_WBITS, 8,
+			     Z_DEFAULT_STRATEGY) != Z_OK)
+		goto nomem;
+	    pzp->pz_zs.next_out = pzp->pz_buf;
+	    pzp->pz_zs.avail_out = PSU_ZIO_BUFSIZ;
+	} else {
+	    if (inflateInit2(&pzp->pz_zs, 16 + MAX_WBITS) != Z_OK)
+		goto nomem;
+	}
+	return 0;
+#endif
+
+#ifdef PSU_ZIO_ZSTD
+    case PZF_ZSTD:
+	if (pzp->pz_flags & PZIOF_WRITE) {
+	    pzp->pz_cctx = ZSTD_createCCtx();
+	    if (pzp->pz_cctx == NULL)
+		goto nomem;
+	    if (level)
+		ZSTD_CCtx_setParameter(pzp->pz_cctx,
+				       ZSTD_c_compressionLevel, level);
+	} else {
+	    pzp->pz_dctx = ZSTD_createDCtx();
+	    if (pzp->pz_dctx == NULL)
+		goto nomem;
+	}
+	return 0;
+#endif
+
+    default:
+	errno = EOPNOTSUPP;
+	return -1;
+    }
+
+ nomem: UNUSED
+    errno = ENOMEM;
+    return -1;
+}
+
+int
+psu_zio_attach (int fd, int oflags, psu_zio_format_t format, int level)
+{
+    unsigned char magic[PSU_ZIO_MAGIC];
+    ssize_t len = 0, rc;
+    psu_zio_t *pzp;
+    int writing = ((oflags & O_ACCMODE) != O_RDONLY);
+
+    if (psu_zio_find(fd)) {
+	errno = EBUSY;
+	return -1;
+    }
+
+    if (writing && (format == PZF_NONE || format == PZF_AUTO))
+	return 0;
+
+    if (!psu_zio_supported(format)) {
+	errno = EOPNOTSUPP;
+	return -1;
+    }
+
+    if (!writing && format == PZF_AUTO) {
+	/* Use pread() if we can, so seekable files needn't be rewound */
+	len = pread(fd, magic, sizeof(magic), 0);
+	if (len >= 0) {
+	    format = psu_zio_sniff(magic, len);
+	    if (format == PZF_NONE)
+		return 0;
+	    len = 0;
+
+	} else if (errno == ESPIPE) {
+	    /* A pipe: what we read has to be handed back later */
+	    for (len = 0; len < (ssize_t) sizeof(magic); len += rc) {
+		rc = read(fd, magic + len, sizeof(magic) - len);
+		if (rc < 0) {
+		    if (errno == EINTR) {
+			rc = 0;
+			continue;
+		    }
+		    return -1;
+		}
+		if (rc == 0)
+		    break;
+	    }
+	    format = psu_zio_sniff(magic, len);
+
+	} else {
+	    return -1;
+	}
+
+	if (!psu_zio_supported(format)) {
+	    errno = EOPNOTSUPP;
+	    return -1;
+	}
+    }
+
+    pzp = calloc(1, sizeof(*pzp));
+    if (pzp == NULL)
+	return -1;
+
+    pzp->pz_fd = fd;
+    pzp->pz_format = format;
+    if (writing)
+	pzp->pz_flags |= PZIOF_WRITE;
+
+    pzp->pz_buf = malloc(PSU_ZIO_BUFSIZ);
+    if (pzp->pz_buf == NULL) {
+	free(pzp);
+	return -1;
+    }
+
+    /* Anything we read while sniffing is the start of the input */
+    memcpy(pzp->pz_buf, magic, len);
+    pzp->pz_len = len;
+
+    if (psu_zio_init(pzp, level) < 0) {
+	psu_zio_free(pzp);
+	return -1;
+    }
+
+    if (psu_zio_table_set(fd, pzp) < 0) {
+	psu_zio_free(pzp);
+	return -1;
+    }
+
+    return 0;
+}
+
+int
+psu_zio_open (const char *filename, int oflags, psu_zio_format_t format,
+	      int level)
+{
+    int fd;
+
+    if ((oflags & O_ACCMODE) != O_RDONLY)
+	fd = open(filename, oflags | O_CREAT | O_TRUNC, 0666);
+    else
+	fd = open(filename, oflags);
+    if (fd < 0)
+	return -1;
+
+    if (psu_zio_attach(fd, oflags, format, level) < 0) {
+	int saved = errno;
+	close(fd);
+	errno = saved;
+	return -1;
+    }
+
+    return fd;
+}
+
+FILE *
+psu_zio_fopen (const char *filename, const char *mode,
+	       psu_zio_format_t format, int level)
+{
+    FILE *fp;
+    int fd, saved;
+
+    fd = psu_zio_open(filename, (*mode == 'r') ? O_RDONLY : O_WRONLY,
+		      format, level);
+    if (fd < 0)
+	return NULL;
+
+    if (psu_zio_active(fd))
+	fp = psu_zio_fdopen(fd, mode, TRUE);
+    else
+	fp = fdopen(fd, mode);
+
+    if (fp == NULL) {
+	saved = errno;
+	psu_zio_close(fd);
+	errno = saved;
+    }
+
+    return fp;
+}
+
+int
+psu_zio_active (int fd)
+{
+    return (psu_zio_find(fd) != NULL);
+}
+
+/*
+ * Get more compressed data into pz_buf; returns zero at end of file
+ */
+static ssize_t
+psu_zio_fill (psu_zio_t *pzp)
+{
+    ssize_t rc;
+
+    if (pzp->pz_off < pzp->pz_len)
+	return pzp->pz_len - pzp->pz_off;
+
+    pzp->pz_off = pzp->pz_len = 0;
+    if (pzp->pz_flags & PZIOF_EOF)
+	return 0;
+
+    do {
+	rc = read(pzp->pz_fd, pzp->pz_buf, PSU_ZIO_BUFSIZ);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0)
+	return -1;
+
+    if (rc == 0)
+	pzp->pz_flags |= PZIOF_EOF;
+    pzp->pz_len = rc;
+
+    return rc;
+}
+
+#ifdef PSU_ZIO_GZIP
+static ssize_t
+psu_zio_read_gzip (psu_zio_t *pzp, void *buf, size_t len)
+{
+    z_stream *zsp = &pzp->pz_zs;
+    ssize_t rc;
+    int zrc;
+
+    zsp->next_out = buf;
+    zsp->avail_out = len;
+
+    while (zsp->avail_out == len) {
+	rc = psu_zio_fill(pzp);
+	if (rc < 0)
+	    return -1;
+
+	if (rc == 0 && (pzp->pz_flags & PZIOF_END))
+	    break;		/* Clean end of file */
+
+	/* Concatenated members are one stream, as with gunzip */
+	if (rc > 0 && (pzp->pz_flags & PZIOF_END)) {
+	    if (inflateReset(zsp) != Z_OK)
+		goto corrupt;
+	    pzp->pz_flags &= ~PZIOF_END;
+	}
+
+	/* At end of file, this flushes anything zlib is holding */
+	zsp->next_in = pzp->pz_buf + pzp->pz_off;
+	zsp->avail_in = pzp->pz_len - pzp->pz_off;
+
+	zrc = inflate(zsp, Z_NO_FLUSH);
+	pzp->pz_off = pzp->pz_len - zsp->avail_in;
+
+	if (zrc == Z_STREAM_END)
+	    pzp->pz_flags |= PZIOF_END;
+	else if (zrc != Z_OK && zrc != Z_BUF_ERROR)
+	    goto corrupt;
+
+	/* The input ended in the middle of a member */
+	if (rc == 0 && zsp->avail_out == len && !(pzp->pz_flags & PZIOF_END))
+	    goto corrupt;
+    }
+
+    return len - zsp->avail_out;
+
+ corrupt:
+    pzp->pz_flags |= PZIOF_ERROR;
+    errno = EIO;
+    return -1;
+}
+#endif /* PSU_ZIO_GZIP */
+
+#ifdef PSU_ZIO_ZSTD
+static ssize_t
+psu_zio_read_zstd (psu_zio_t *pzp, void *buf, size_t len)
+{
+    ZSTD_outBuffer out = { buf, len, 0 };
+    ZSTD_inBuffer in;
+    ssize_t rc;
+    size_t zrc;
+
+    while (out.pos == 0) {
+	rc = psu_zio_fill(pzp);
+	if (rc < 0)
+	    return -1;
+
+	if (rc == 0 && (pzp->pz_flags & PZIOF_END))
+	    break;		/* Clean end of file */
+
+	/* At end of file, this flushes anything zstd is holding */
+	in.src = pzp->pz_buf;
+	in.size = pzp->pz_len;
+	in.pos = pzp->pz_off;
+
+	zrc = ZSTD_decompressStream(pzp->pz_dctx, &out, &in);
+	pzp->pz_off = in.pos;
+	if (ZSTD_isError(zrc))
+	    goto corrupt;
+
+	/* Zero means a frame is complete; more frames may follow */
+	if (zrc == 0)
+	    pzp->pz_flags |= PZIOF_END;
+	else
+	    pzp->pz_flags &= ~PZIOF_END;
+
+	/* The input ended in the middle of a frame */
+	if (rc == 0 && out.pos == 0 && zrc != 0)
+	    goto corrupt;
+    }
+
+    return out.pos;
+
+ corrupt:
+    pzp->pz_flags |= PZIOF_ERROR;
+    errno = EIO;
+    return -1;
+}
+#endif /* PSU_ZIO_ZSTD */
+
+ssize_t
+psu_zio_read (int fd, void *buf, size_t len)
+{
+    psu_zio_t *pzp = psu_zio_find(fd);
+    size_t avail;
+
+    if (pzp == NULL)
+	return read(fd, buf, len);
+
+    if (pzp->pz_flags & PZIOF_ERROR) {
+	errno = EIO;
+	return -1;
+    }
+
+    if (len == 0)
+	return 0;
+
+    switch (pzp->pz_format) {
+    case PZF_NONE:
+	/* Hand back whatever we read while sniffing the format */
+	avail = pzp->pz_len - pzp->pz_off;
+	if (avail == 0)
+	    return read(fd, buf, len);
+	if (avail > len)
+	    avail = len;
+	memcpy(buf, pzp->pz_buf + pzp->pz_off, avail);
+	pzp->pz_off += avail;
+	return avail;
+
+#ifdef PSU_ZIO_GZIP
+    case PZF_GZIP:
+	return psu_zio_read_gzip(pzp, buf, len);
+#endif
+
+#ifdef PSU_ZIO_ZSTD
+    case PZF_ZSTD:
+	return psu_zio_read_zstd(pzp, buf, len);
+#endif
+
+    default:
+	errno = EOPNOTSUPP;
+	return -1;
+    }
+}
+
+/*
+ * Write out all the compressed data in pz_buf
+ */
+static int
+psu_zio_drain (psu_zio_t *pzp, size_t len)
+{
+    size_t off;
+    ssize_t rc;
+
+    for (off = 0; off < len; off += rc) {
+	rc = write(pzp->pz_fd, pzp->pz_buf + off, len - off);
+	if (rc < 0) {
+	    if (errno == EINTR) {
+		rc = 0;
+		continue;
+	    }
+	    pzp->pz_flags |= PZIOF_ERROR;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Compress data, writing out compressed data as the buffer fills.
+ * With "finish", the stream is ended (and "len" is zero).
+ */
+static int
+psu_zio_compress (psu_zio_t *pzp, const void *buf, size_t len, int finish)
+{
+#ifdef PSU_ZIO_GZIP
+    if (pzp->pz_format == PZF_GZIP) {
+	z_stream *zsp = &pzp->pz_zs;
+	int zrc;
+
+	zsp->next_in = (Bytef *) buf;
+	zsp->avail_in = len;
+
+	for (;;) {
+	    zrc = deflate(zsp, finish ? Z_FINISH : Z_NO_FLUSH);
+	    if (zrc == Z_STREAM_ERROR)
+		break;
+
+	    if (zsp->avail_out == 0 || (finish && zrc == Z_STREAM_END)) {
+		if (psu_zio_drain(pzp, PSU_ZIO_BUFSIZ - zsp->avail_out) < 0)
+		    return -1;
+		zsp->next_out = pzp->pz_buf;
+		zsp->avail_out = PSU_ZIO_BUFSIZ;
+	    }
+
+	    if (finish ? (zrc == Z_STREAM_END) : (zsp->avail_in == 0))
+		return 0;
+	}
+
+	pzp->pz_flags |= PZIOF_ERROR;
+	errno = EIO;
+	return -1;
+    }
+#endif /* PSU_ZIO_GZIP */
+
+#ifdef PSU_ZIO_ZSTD
+    if (pzp->pz_format == PZF_ZSTD) {
+	ZSTD_inBuffer in = { buf, len, 0 };
+	ZSTD_outBuffer out;
+	size_t zrc;
+
+	for (;;) {
+	    out.dst = pzp->pz_buf + pzp->pz_len;
+	    out.size = PSU_ZIO_BUFSIZ - pzp->pz_len;
+	    out.pos = 0;
+
+	    zrc = ZSTD_compressStream2(pzp->pz_cctx, &out, &in,
+				       finish ? ZSTD_e_end : ZSTD_e_continue);
+	    if (ZSTD_isError(zrc))
+		break;
+
+	    pzp->pz_len += out.pos;
+	    if (pzp->pz_len == PSU_ZIO_BUFSIZ || (finish && zrc == 0)) {
+		if (psu_zio_drain(pzp, pzp->pz_len) < 0)
+		    return -1;
+		pzp->pz_len = 0;
+	    }
+
+	    if (finish ? (zrc == 0) : (in.pos == in.size))
+		return 0;
+	}
+
+	pzp->pz_flags |= PZIOF_ERROR;
+	errno = EIO;
+	return -1;
+    }
+#endif /* PSU_ZIO_ZSTD */
+
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+ssize_t
+psu_zio_write (int fd, const void *buf, size_t len)
+{
+    psu_zio_t *pzp = psu_zio_find(fd);
+
+    if (pzp == NULL)
+	return write(fd, buf, len);
+
+    if (pzp->pz_flags & PZIOF_ERROR) {
+	errno = EIO;
+	return -1;
+    }
+
+    if (psu_zio_compress(pzp, buf, len, FALSE) < 0)
+	return -1;
+
+    return len;
+}
+
+ssize_t
+psu_zio_writev (int fd, const struct iovec *iov, int iovcnt)
+{
+    psu_zio_t *pzp = psu_zio_find(fd);
+    ssize_t total = 0;
+    int i;
+
+    if (pzp == NULL)
+	return writev(fd, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+	if (psu_zio_write(fd, iov[i].iov_base, iov[i].iov_len) < 0)
+	    return -1;
+	total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+int
+psu_zio_detach (int fd)
+{
+    psu_zio_t *pzp = psu_zio_find(fd);
+    int rc = 0;
+
+    if (pzp == NULL)
+	return 0;
+
+    if ((pzp->pz_flags & PZIOF_WRITE) && !(pzp->pz_flags & PZIOF_ERROR))
+	rc = psu_zio_compress(pzp, NULL, 0, TRUE);
+    else if (pzp->pz_flags & PZIOF_ERROR) {
+	errno = EIO;
+	rc = -1;
+    }
+
+    psu_zio_table_set(fd, NULL);
+    psu_zio_free(pzp);
+
+    return rc;
+}
+
+int
+psu_zio_close (int fd)
+{
+    int rc = psu_zio_detach(fd);
+
+    if (close(fd) < 0)
+	rc = -1;
+
+    return rc;
+}
+
+/*
+ * stdio glue: cookies are the file descriptor, with a flag saying
+ * whether fclose() should close it
+ */
+#define PSU_ZIO_COOKIE_CLOSE	0x1 /* Low bit of the cookie: close the fd */
+
+static void *
+psu_zio_cookie_make (int fd, int close_fd)
+{
+    return (void *) (((long) fd << 1) | (close_fd ? PSU_ZIO_COOKIE_CLOSE : 0));
+}
+
+static int
+psu_zio_cookie_fd (void *cookie)
+{
+    return (int) ((long) cookie >> 1);
+}
+
+static int
+psu_zio_cookie_close (void *cookie)
+{
+    int fd = psu_zio_cookie_fd(cookie);
+
+    if ((long) cookie & PSU_ZIO_COOKIE_CLOSE)
+	return psu_zio_close(fd);
+    return psu_zio_detach(fd);
+}
+
+#if defined(HAVE_FOPENCOOKIE) || defined(HAVE_FUNOPEN)
+/*
+ * Cookie for psu_zio_reader()
+ */
+typedef struct psu_zio_reader_s {
+    psu_zio_read_func_t pzr_func; /* Function that supplies data */
+    void *pzr_opaque;		/* Argument for pzr_func */
+} psu_zio_reader_t;
+
+static psu_zio_reader_t *
+psu_zio_reader_make (psu_zio_read_func_t func, void *opaque)
+{
+    psu_zio_reader_t *pzrp = malloc(sizeof(*pzrp));
+
+    if (pzrp) {
+	pzrp->pzr_func = func;
+	pzrp->pzr_opaque = opaque;
+    }
+
+    return pzrp;
+}
+
+static int
+psu_zio_reader_close (void *cookie)
+{
+    free(cookie);
+    return 0;
+}
+#endif /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
+
+#if defined(HAVE_FOPENCOOKIE)
+
+static ssize_t
+psu_zio_reader_read (void *cookie, char *buf, size_t len)
+{
+    psu_zio_reader_t *pzrp = cookie;
+
+    return pzrp->pzr_func(pzrp->pzr_opaque, buf, len);
+}
+
+FILE *
+psu_zio_reader (psu_zio_read_func_t func, void *opaque)
+{
+    cookie_io_functions_t funcs = {
+	.read = psu_zio_reader_read,
+	.close = psu_zio_reader_close,
+    };
+    psu_zio_reader_t *pzrp = psu_zio_reader_make(func, opaque);
+    FILE *fp;
+
+    if (pzrp == NULL)
+	return NULL;
+
+    fp = fopencookie(pzrp, "r", funcs);
+    if (fp == NULL)
+	free(pzrp);
+    return fp;
+}
+
+static ssize_t
+psu_zio_cookie_read (void *cookie, char *buf, size_t len)
+{
+    return psu_zio_read(psu_zio_cookie_fd(cookie), buf, len);
+}
+
+static ssize_t
+psu_zio_cookie_write (void *cookie, const char *buf, size_t len)
+{
+    ssize_t rc = psu_zio_write(psu_zio_cookie_fd(cookie), buf, len);
+
+    /* fopencookie wants zero, not -1, for errors */
+    return (rc < 0) ? 0 : rc;
+}
+
+FILE *
+psu_zio_fdopen (int fd, const char *mode, int close_fd)
+{
+    cookie_io_functions_t funcs = {
+	.read = psu_zio_cookie_read,
+	.write = psu_zio_cookie_write,
+	.seek = NULL,
+	.close = psu_zio_cookie_close,
+    };
+
+    return fopencookie(psu_zio_cookie_make(fd, close_fd), mode, funcs);
+}
+
+#elif defined(HAVE_FUNOPEN)
+
+static int
+psu_zio_reader_read (void *cookie, char *buf, int len)
+{
+    psu_zio_reader_t *pzrp = cookie;
+
+    return pzrp->pzr_func(pzrp->pzr_opaque, buf, len);
+}
+
+FILE *
+psu_zio_reader (psu_zio_read_func_t func, void *opaque)
+{
+    psu_zio_reader_t *pzrp = psu_zio_reader_make(func, opaque);
+    FILE *fp;
+
+    if (pzrp == NULL)
+	return NULL;
+
+    fp = funopen(pzrp, psu_zio_reader_read, NULL, NULL,
+		 psu_zio_reader_close);
+    if (fp == NULL)
+	free(pzrp);
+    return fp;
+}
+
+static int
+psu_zio_cookie_read (void *cookie, char *buf, int len)
+{
+    return psu_zio_read(psu_zio_cookie_fd(cookie), buf, len);
+}
+
+static int
+psu_zio_cookie_write (void *cookie, const char *buf, int len)
+{
+    return psu_zio_write(psu_zio_cookie_fd(cookie), buf, len);
+}
+
+FILE *
+psu_zio_fdopen (int fd, const char *mode, int close_fd)
+{
+    int writing = (*mode != 'r');
+
+    return funopen(psu_zio_cookie_make(fd, close_fd),
+		   writing ? NULL : psu_zio_cookie_read,
+		   writing ? psu_zio_cookie_write : NULL,
+		   NULL, psu_zio_cookie_close);
+}
+
+#else /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
+
+FILE *
+psu_zio_reader (psu_zio_read_func_t func UNUSED, void *opaque UNUSED)
+{
+    errno = EOPNOTSUPP;
+    return NULL;
+}
+
+FILE *
+psu_zio_fdopen (int fd UNUSED, const char *mode UNUSED, int close_fd UNUSED)
+{
+    errno = EOPNOTSUPP;
+    return NULL;
+}
+
+#endif /* HAVE_FOPENCOOKIE || HAVE_FUNOPEN */
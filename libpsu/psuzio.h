@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * psuzio.h -- compressed (gzip and zstd) file streams
+ *
+ * A compressed stream is attached to a file descriptor, and code that
+ * reads and writes through psu_zio_read(), psu_zio_write() and
+ * psu_zio_writev() sees plain data.  For descriptors without a stream,
+ * these are simply read(), write() and writev(), so buffered readers
+ * and writers can call them unconditionally and get compression "for
+ * free" whenever the caller has attached a stream to their fd.
+ */
+
+#ifndef LIBPSU_PSUZIO_H
+#define LIBPSU_PSUZIO_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef enum psu_zio_format_e {
+    PZF_NONE = 0,		/* Plain data */
+    PZF_GZIP,			/* gzip (RFC 1952) */
+    PZF_ZSTD,			/* Zstandard (RFC 8878) */
+    PZF_AUTO,			/* Reading: decide by looking at the data */
+} psu_zio_format_t;
+
+/**
+ * Pick a format from a file name's extension (".gz" or ".zst")
+ *
+ * @param[in] filename Name of the file
+ * @return format, or PZF_NONE for other names
+ */
+psu_zio_format_t
+psu_zio_format_by_name (const char *filename);
+
+/**
+ * Parse a format name ("gzip", "zstd", "none" or "auto")
+ *
+ * @param[in] name Name of the format
+ * @param[out] formatp Format (returned)
+ * @return zero on success, -1 for an unknown name
+ */
+int
+psu_zio_format_parse (const char *name, psu_zio_format_t *formatp);
+
+/**
+ * Return the name of a format
+ */
+const char *
+psu_zio_format_name (psu_zio_format_t format);
+
+/**
+ * Was libpsu built with support for this format?
+ */
+int
+psu_zio_supported (psu_zio_format_t format);
+
+/**
+ * Attach a compressed stream to an open file descriptor.  "oflags"
+ * gives the direction (O_RDONLY or O_WRONLY).  Reading with PZF_AUTO
+ * looks at the first bytes of the data to find the format; plain data
+ * is then read as is (a seekable file is rewound and nothing is
+ * attached).  Writing with PZF_NONE attaches nothing.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] oflags Direction (O_RDONLY or O_WRONLY)
+ * @param[in] format Format of the data
+ * @param[in] level Compression level for writing (zero for the default)
+ * @return zero on success, -1 (with errno set) on failure
+ */
+int
+psu_zio_attach (int fd, int oflags, psu_zio_format_t format, int level);
+
+/**
+ * Open a file and attach a compressed stream to it.  For O_WRONLY,
+ * the file is created (or truncated).
+ *
+ * @param[in] filename Name of the file
+ * @param[in] oflags Direction (O_RDONLY or O_WRONLY)
+ * @param[in] format Format of the data
+ * @param[in] level Compression level for writing (zero for the default)
+ * @return file descriptor, or -1 (with errno set) on failure
+ */
+int
+psu_zio_open (const char *filename, int oflags, psu_zio_format_t format,
+	      int level);
+
+/**
+ * Open a file as a stdio stream, attaching a compressed stream to it.
+ * A plain file gives a normal stdio stream (with a real fileno()).
+ *
+ * @param[in] filename Name of the file
+ * @param[in] mode stdio mode ("r" or "w")
+ * @param[in] format Format of the data
+ * @param[in] level Compression level for writing (zero for the default)
+ * @return stdio stream, or NULL (with errno set) on failure
+ */
+FILE *
+psu_zio_fopen (const char *filename, const char *mode,
+	       psu_zio_format_t format, int level);
+
+/**
+ * Does this file descriptor have a stream attached?
+ */
+int
+psu_zio_active (int fd);
+
+/**
+ * Read plain data from a file descriptor; returns like read(2).
+ * Corrupt compressed data gives -1 with errno set to EIO.
+ */
+ssize_t
+psu_zio_read (int fd, void *buf, size_t len);
+
+/**
+ * Write plain data to a file descriptor; returns like write(2)
+ */
+ssize_t
+psu_zio_write (int fd, const void *buf, size_t len);
+
+/**
+ * Write plain data from an I/O vector; returns like writev(2)
+ */
+ssize_t
+psu_zio_writev (int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Finish the stream (writing any trailer), and detach it from the
+ * file descriptor, which is left open
+ *
+ * @return zero on success, -1 (with errno set) if the data could not
+ * be written
+ */
+int
+psu_zio_detach (int fd);
+
+/**
+ * Detach any stream from the file descriptor and close it
+ */
+int
+psu_zio_close (int fd);
+
+/**
+ * Make a stdio stream that reads or writes through psu_zio_read() or
+ * psu_zio_write().  fclose() will detach the stream, and will close
+ * the file descriptor if "close_fd" is set.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] mode stdio mode ("r" or "w")
+ * @param[in] close_fd Close the file descriptor with the stdio stream
+ * @return stdio stream, or NULL
+ */
+FILE *
+psu_zio_fdopen (int fd, const char *mode, int close_fd);
+
+/*
+ * A function that supplies data for psu_zio_reader(); returns like
+ * read(2)
+ */
+typedef ssize_t (*psu_zio_read_func_t)(void *opaque, char *buf, size_t len);
+
+/**
+ * Make a read-only stdio stream whose data comes from a function,
+ * for code that wants a FILE but whose data is produced on demand.
+ * fclose() frees the stream but does nothing to "opaque".
+ *
+ * @param[in] func Function that supplies the data
+ * @param[in] opaque Argument for func
+ * @return stdio stream, or NULL
+ */
+FILE *
+psu_zio_reader (psu_zio_read_func_t func, void *opaque);
+
+#endif /* LIBPSU_PSUZIO_H */
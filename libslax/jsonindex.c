@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * jsonindex.c -- fast path for turning JSON into XML
+ *
+ * The lexer and grammar handle JSON a token at a time, which is
+ * general (bare names, comments, trailing commas, JSON mixed with
+ * SLAX) but slow for large payloads.  Here we make one pass over the
+ * input, 64 bytes at a time, building a mask of quotes, backslashes
+ * and structural characters (with SSE2 where we have it), and turn
+ * those masks into an index of the structural characters that lie
+ * outside of strings.  We then walk the index to check that the
+ * input is plain JSON, and walk it again to build the tree, calling
+ * the same functions the grammar's actions do, so the results match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+
+#include <libslax/slax.h>
+#include "slaxinternals.h"
+#include "slaxparser.h"
+#include "jsonlexer.h"
+#include "jsonindex.h"
+
+#if defined(__SSE2__)
+#define SLAX_JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+
+#define SJI_BLOCK	64	/* Bytes per block (bits per mask) */
+#define SJI_MIN_SIZE	1024	/* Initial number of index entries */
+#define SJI_MIN_DEPTH	64	/* Initial depth of the container stack */
+
+/* Masks for one block of input */
+typedef struct slax_json_masks_s {
+    uint64_t sjm_quote;		/* '"' */
+    uint64_t sjm_backslash;	/* '\\' */
+    uint64_t sjm_ops;		/* '{', '}', '[', ']', ':', ',' */
+} slax_json_masks_t;
+
+#ifdef SLAX_JSON_HAVE_SSE2
+static inline void
+slaxJsonIndexMasks (const char *cp, slax_json_masks_t *sjmp)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i obrace = _mm_set1_epi8('{');
+    const __m128i cbrace = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    uint64_t q = 0, b = 0, o = 0;
+    __m128i v, lv, m;
+    int i;
+
+    for (i = 0; i < SJI_BLOCK; i += 16) {
+	v = _mm_loadu_si128((const __m128i *) (cp + i));
+
+	/* Folding 0x20 in maps '[' onto '{' and ']' onto '}' */
+	lv = _mm_or_si128(v, lower);
+	m = _mm_or_si128(_mm_cmpeq_epi8(lv, obrace),
+			 _mm_cmpeq_epi8(lv, cbrace));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, colon));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, comma));
+
+	q |= ((uint64_t) (uint16_t)
+	      _mm_movemask_epi8(_mm_cmpeq_epi8(v, quote))) << i;
+	b |= ((uint64_t) (uint16_t)
+	      _mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash))) << i;
+	o |= ((uint64_t) (uint16_t) _mm_movemask_epi8(m)) << i;
+    }
+
+    sjmp->sjm_quote = q;
+    sjmp->sjm_backslash = b;
+    sjmp->sjm_ops = o;
+}
+
+#else /* SLAX_JSON_HAVE_SSE2 */
+
+#define SJC_QUOTE	(1<<0)
+#define SJC_BACKSLASH	(1<<1)
+#define SJC_OPS		(1<<2)
+
+static const uint8_t slaxJsonIndexTable[256] = {
+    ['"'] = SJC_QUOTE,
+    ['\\'] = SJC_BACKSLASH,
+    ['{'] = SJC_OPS,
+    ['}'] = SJC_OPS,
+    ['['] = SJC_OPS,
+    [']'] = SJC_OPS,
+    [':'] = SJC_OPS,
+    [','] = SJC_OPS,
+};
+
+static inline void
+slaxJsonIndexMasks (const char *cp, slax_json_masks_t *sjmp)
+{
+    const uint8_t *up = (const uint8_t *) cp;
+    uint64_t q = 0, b = 0, o = 0, bit;
+    int i;
+
+    for (i = 0; i < SJI_BLOCK; i++) {
+	bit = ((uint64_t) 1) << i;
+	switch (slaxJsonIndexTable[up[i]]) {
+	case SJC_QUOTE:
+	    q |= bit;
+	    break;
+	case SJC_BACKSLASH:
+	    b |= bit;
+	    break;
+	case SJC_OPS:
+	    o |= bit;
+	    break;
+	}
+    }
+
+    sjmp->sjm_quote = q;
+    sjmp->sjm_backslash = b;
+    sjmp->sjm_ops = o;
+}
+#endif /* SLAX_JSON_HAVE_SSE2 */
+
+/*
+ * Return the mask of characters that are escaped by a backslash.
+ * Backslashes are rare enough that a walk over the set bits is fine.
+ * '*carryp' says the last block ended with an escaping backslash.
+ */
+static inline uint64_t
+slaxJsonIndexEscaped (uint64_t backslash, int *carryp)
+{
+    uint64_t escaped = *carryp ? 1 : 0;
+    int bit;
+
+    *carryp = 0;
+
+    while (backslash) {
+	bit = __builtin_ctzll(backslash);
+	backslash &= backslash - 1;
+
+	if (escaped & (((uint64_t) 1) << bit))
+	    continue;		/* Escaped backslash */
+
+	if (bit == SJI_BLOCK - 1)
+	    *carryp = 1;
+	else
+	    escaped |= ((uint64_t) 1) << (bit + 1);
+    }
+
+    return escaped;
+}
+
+/*
+ * Turn a mask of quotes into a mask of the bytes inside strings
+ * (including the opening quote, but not the closing one).
+ */
+static inline uint64_t
+slaxJsonIndexPrefixXor (uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+
+    return x;
+}
+
+static int
+slaxJsonIndexGrow (slax_json_index_t *sjip, unsigned need)
+{
+    unsigned size = sjip->sji_size ?: SJI_MIN_SIZE;
+    uint32_t *pos;
+
+    while (size < need)
+	size *= 2;
+
+    pos = xmlRealloc(sjip->sji_pos, size * sizeof(pos[0]));
+    if (pos == NULL)
+	return TRUE;
+
+    sjip->sji_pos = pos;
+    sjip->sji_size = size;
+    return FALSE;
+}
+
+int
+slaxJsonIndexBuild (slax_json_index_t *sjip, const char *buf, size_t len)
+{
+    slax_json_masks_t sjm;
+    char tail[SJI_BLOCK];
+    const char *cp;
+    uint64_t escaped, quotes, instr, bits;
+    uint64_t prev_instr = 0;
+    int carry = 0;
+    uint32_t off;
+
+    sjip->sji_count = 0;
+
+    if (len >= UINT32_MAX)
+	return TRUE;
+
+    for (off = 0; off < len; off += SJI_BLOCK) {
+	if (len - off >= SJI_BLOCK)
+	    cp = buf + off;
+	else {
+	    /* Pad the last block with spaces, which are never structural */
+	    memset(tail, ' ', sizeof(tail));
+	    memcpy(tail, buf + off, len - off);
+	    cp = tail;
+	}
+
+	slaxJsonIndexMasks(cp, &sjm);
+
+	escaped = (sjm.sjm_backslash || carry)
+	    ? slaxJsonIndexEscaped(sjm.sjm_backslash, &carry) : 0;
+	quotes = sjm.sjm_quote & ~escaped;
+
+	instr = slaxJsonIndexPrefixXor(quotes) ^ prev_instr;
+	prev_instr = (instr >> (SJI_BLOCK - 1)) ? ~((uint64_t) 0) : 0;
+
+	bits = (sjm.sjm_ops & ~instr) | quotes;
+	if (bits == 0)
+	    continue;
+
+	if (sjip->sji_count + SJI_BLOCK > sjip->sji_size
+		&& slaxJsonIndexGrow(sjip, sjip->sji_count + SJI_BLOCK))
+	    return TRUE;
+
+	while (bits) {
+	    sjip->sji_pos[sjip->sji_count++] = off + __builtin_ctzll(bits);
+	    bits &= bits - 1;
+	}
+    }
+
+    return FALSE;
+}
+
+void
+slaxJsonIndexFree (slax_json_index_t *sjip)
+{
+    if (sjip->sji_pos)
+	xmlFree(sjip->sji_pos);
+
+    bzero(sjip, sizeof(*sjip));
+}
+
+/*
+ * Return the token type of the scalar (number, true, false or null)
+ * in (cp, len), or zero if it isn't a plain JSON one.  The lexer turns
+ * each of these into exactly one token, so we can hand the same text
+ * to the same actions.
+ */
+int
+slaxJsonIndexScalar (const char *cp, unsigned len)
+{
+    const char *ep = cp + len;
+
+    switch (*cp) {
+    case 't':
+	return (len == 4 && memcmp(cp, "true", 4) == 0) ? K_TRUE : 0;
+    case 'f':
+	return (len == 5 && memcmp(cp, "false", 5) == 0) ? K_FALSE : 0;
+    case 'n':
+	return (len == 4 && memcmp(cp, "null", 4) == 0) ? K_NULL : 0;
+    }
+
+    if (*cp == '-' && ++cp == ep)
+	return 0;
+
+    if (*cp == '0')
+	cp += 1;
+    else if (isdigit((int) *cp)) {
+	while (cp < ep && isdigit((int) *cp))
+	    cp += 1;
+    } else
+	return 0;
+
+    if (cp < ep && *cp == '.') {
+	if (++cp == ep || !isdigit((int) *cp))
+	    return 0;
+	while (cp < ep && isdigit((int) *cp))
+	    cp += 1;
+    }
+
+    if (cp < ep && (*cp == 'e' || *cp == 'E')) {
+	if (++cp < ep && (*cp == '+' || *cp == '-'))
+	    cp += 1;
+	if (cp == ep || !isdigit((int) *cp))
+	    return 0;
+	while (cp < ep && isdigit((int) *cp))
+	    cp += 1;
+    }
+
+    return (cp == ep) ? T_NUMBER : 0;
+}
+
+/* States for slaxJsonIndexWalk */
+#define SJS_VALUE	1	/* Want a value */
+#define SJS_VALUE_CLOSE	2	/* Want a value or ']' */
+#define SJS_KEY		3	/* Want a member name */
+#define SJS_KEY_CLOSE	4	/* Want a member name or '}' */
+#define SJS_COLON	5	/* Want a ':' */
+#define SJS_NEXT	6	/* Want a ',' or the close */
+#define SJS_DONE	7	/* Seen the whole document */
+
+/* Contents of the container stack */
+#define SJC_OBJECT	1
+#define SJC_ARRAY	2
+
+typedef struct slax_json_walk_s {
+    slax_data_t *sjw_sdp;	/* Main slax data structure */
+    int sjw_build;		/* Build the tree (or just check) */
+    int sjw_state;		/* Current state (SJS_*) */
+    uint8_t *sjw_stack;		/* Container stack (SJC_*) */
+    unsigned sjw_depth;		/* Entries used in sjw_stack */
+    unsigned sjw_max;		/* Size of sjw_stack */
+} slax_json_walk_t;
+
+static inline int
+slaxJsonWalkWantValue (slax_json_walk_t *sjwp)
+{
+    return (sjwp->sjw_state == SJS_VALUE
+	    || sjwp->sjw_state == SJS_VALUE_CLOSE);
+}
+
+static inline int
+slaxJsonWalkTop (slax_json_walk_t *sjwp)
+{
+    return sjwp->sjw_depth ? sjwp->sjw_stack[sjwp->sjw_depth - 1] : 0;
+}
+
+static int
+slaxJsonWalkPush (slax_json_walk_t *sjwp, int type)
+{
+    if (sjwp->sjw_depth == sjwp->sjw_max) {
+	unsigned max = sjwp->sjw_max ? sjwp->sjw_max * 2 : SJI_MIN_DEPTH;
+	uint8_t *stack = xmlRealloc(sjwp->sjw_stack, max);
+
+	if (stack == NULL)
+	    return TRUE;
+
+	sjwp->sjw_stack = stack;
+	sjwp->sjw_max = max;
+    }
+
+    sjwp->sjw_stack[sjwp->sjw_depth++] = type;
+    return FALSE;
+}
+
+/*
+ * A value is complete; do what json_pair or json_element_item
+ * would do with it.
+ */
+static void
+slaxJsonWalkValueDone (slax_json_walk_t *sjwp)
+{
+    slax_data_t *sdp = sjwp->sjw_sdp;
+
+    switch (slaxJsonWalkTop(sjwp)) {
+    case 0:
+	sjwp->sjw_state = SJS_DONE;
+	return;
+
+    case SJC_OBJECT:
+	if (sjwp->sjw_build)
+	    slaxElementClose(sdp);
+	break;
+
+    case SJC_ARRAY:
+	if (sjwp->sjw_build) {
+	    slaxElementClose(sdp);
+	    slaxElementOpen(sdp, ELT_MEMBER);
+	    slaxJsonAddTypeInfo(sdp, VAL_MEMBER);
+	}
+	break;
+    }
+
+    sjwp->sjw_state = SJS_NEXT;
+}
+
+/*
+ * Add a simple value (string, number, true, false or null)
+ */
+static void
+slaxJsonWalkValue (slax_json_walk_t *sjwp, int ttype,
+		   const char *cp, unsigned len)
+{
+    slax_data_t *sdp = sjwp->sjw_sdp;
+    slax_string_t *ssp;
+
+    if (sjwp->sjw_build) {
+	ssp = slaxStringMake(sdp, ttype, cp, len);
+	if (ssp) {
+	    slaxJsonElementValue(sdp, ssp);
+	    slaxStringFree(ssp);
+	}
+
+	switch (ttype) {
+	case T_NUMBER:
+	    slaxJsonAddTypeInfo(sdp, VAL_NUMBER);
+	    break;
+	case K_TRUE:
+	    slaxJsonAddTypeInfo(sdp, VAL_TRUE);
+	    break;
+	case K_FALSE:
+	    slaxJsonAddTypeInfo(sdp, VAL_FALSE);
+	    break;
+	case K_NULL:
+	    slaxJsonAddTypeInfo(sdp, VAL_NULL);
+	    break;
+	}
+    }
+
+    slaxJsonWalkValueDone(sjwp);
+}
+
+/*
+ * Skip whitespace between tokens, counting lines the way the lexer
+ * does.  If we're building, the line number goes where the lexer
+ * would put it, so nodes get the same line numbers.
+ */
+static inline const char *
+slaxJsonWalkSpace (slax_json_walk_t *sjwp, const char *cp, const char *ep)
+{
+    slax_data_t *sdp = sjwp->sjw_sdp;
+
+    for ( ; cp < ep && isspace((int) *cp); cp++) {
+	if (*cp == '\n' && sjwp->sjw_build) {
+	    sdp->sd_line += 1;
+	    if (sdp->sd_ctxt->input)
+		sdp->sd_ctxt->input->line = sdp->sd_line;
+	}
+    }
+
+    return cp;
+}
+
+/*
+ * Walk the index, either checking that it's plain JSON or building
+ * the tree.  Returns TRUE if the input is (or was) good.
+ */
+static int
+slaxJsonIndexWalk (slax_json_walk_t *sjwp, slax_json_index_t *sjip)
+{
+    slax_data_t *sdp = sjwp->sjw_sdp;
+    const char *base = sdp->sd_buf + sdp->sd_cur;
+    const char *cp = base, *ep, *sp, *member;
+    slax_string_t *name = NULL;
+    unsigned i, end, len;
+    int ttype, rc = FALSE;
+
+    sjwp->sjw_state = SJS_VALUE;
+    sjwp->sjw_depth = 0;
+
+    for (i = 0; i <= sjip->sji_count; i++) {
+	end = (i < sjip->sji_count) ? sjip->sji_pos[i]
+	    : (unsigned) (sdp->sd_len - sdp->sd_cur);
+	ep = base + end;
+
+	/* The gap before the next structural character */
+	cp = slaxJsonWalkSpace(sjwp, cp, ep);
+	if (cp < ep) {
+	    for (sp = cp; cp < ep && !isspace((int) *cp); cp++)
+		continue;
+
+	    if (!slaxJsonWalkWantValue(sjwp) || sjwp->sjw_depth == 0)
+		goto done;
+
+	    ttype = slaxJsonIndexScalar(sp, cp - sp);
+	    if (ttype == 0)
+		goto done;
+
+	    slaxJsonWalkValue(sjwp, ttype, sp, cp - sp);
+
+	    cp = slaxJsonWalkSpace(sjwp, cp, ep);
+	    if (cp < ep)
+		goto done;
+	}
+
+	if (i == sjip->sji_count)
+	    break;
+
+	cp = ep + 1;
+
+	switch (*ep) {
+	case '"':
+	    if (i + 1 == sjip->sji_count)
+		goto done;	/* Unterminated string */
+
+	    sp = ep + 1;
+	    i += 1;
+	    cp = base + sjip->sji_pos[i] + 1;
+	    len = cp - sp - 1;
+
+	    if (sjwp->sjw_state == SJS_KEY
+			|| sjwp->sjw_state == SJS_KEY_CLOSE) {
+		if (sjwp->sjw_build) {
+		    if (name)
+			slaxStringFree(name);
+		    name = slaxStringMake(sdp, T_QUOTED, sp, len);
+		}
+		sjwp->sjw_state = SJS_COLON;
+
+	    } else if (slaxJsonWalkWantValue(sjwp) && sjwp->sjw_depth > 0) {
+		slaxJsonWalkValue(sjwp, T_QUOTED, sp, len);
+
+	    } else
+		goto done;
+	    break;
+
+	case ':':
+	    if (sjwp->sjw_state != SJS_COLON)
+		goto done;
+
+	    if (sjwp->sjw_build && name)
+		slaxJsonElementOpenName(sdp, name->ss_token);
+	    sjwp->sjw_state = SJS_VALUE;
+	    break;
+
+	case ',':
+	    if (sjwp->sjw_state != SJS_NEXT)
+		goto done;
+
+	    sjwp->sjw_state = (slaxJsonWalkTop(sjwp) == SJC_OBJECT)
+		? SJS_KEY : SJS_VALUE;
+	    break;
+
+	case '{':
+	    if (!slaxJsonWalkWantValue(sjwp)
+		    || slaxJsonWalkPush(sjwp, SJC_OBJECT))
+		goto done;
+
+	    sjwp->sjw_state = SJS_KEY_CLOSE;
+	    break;
+
+	case '}':
+	    if (slaxJsonWalkTop(sjwp) != SJC_OBJECT
+		    || (sjwp->sjw_state != SJS_KEY_CLOSE
+			&& sjwp->sjw_state != SJS_NEXT))
+		goto done;
+
+	    sjwp->sjw_depth -= 1;
+	    slaxJsonWalkValueDone(sjwp);
+	    break;
+
+	case '[':
+	    if (!slaxJsonWalkWantValue(sjwp)
+		    || slaxJsonWalkPush(sjwp, SJC_ARRAY))
+		goto done;
+
+	    if (sjwp->sjw_build) {
+		/* The same as json_array's opening action */
+		member = ELT_MEMBER;
+		if (sdp->sd_flags & SDF_JSON_NO_MEMBERS)
+		    member = (const char *) sdp->sd_ctxt->node->name;
+
+		slaxJsonAddTypeInfo(sdp, VAL_ARRAY);
+		slaxElementOpen(sdp, member);
+		slaxJsonAddTypeInfo(sdp, VAL_MEMBER);
+	    }
+
+	    sjwp->sjw_state = SJS_VALUE_CLOSE;
+	    break;
+
+	case ']':
+	    if (slaxJsonWalkTop(sjwp) != SJC_ARRAY
+		    || (sjwp->sjw_state != SJS_VALUE_CLOSE
+			&& sjwp->sjw_state != SJS_NEXT))
+		goto done;
+
+	    if (sjwp->sjw_build)
+		slaxJsonClearMember(sdp);
+
+	    sjwp->sjw_depth -= 1;
+	    slaxJsonWalkValueDone(sjwp);
+	    break;
+
+	default:
+	    goto done;
+	}
+    }
+
+    rc = (sjwp->sjw_state == SJS_DONE);
+
+ done:
+    if (name)
+	slaxStringFree(name);
+
+    return rc;
+}
+
+int
+slaxJsonIndexParse (slax_data_t *sdp)
+{
+    slax_json_index_t sji;
+    slax_json_walk_t sjw;
+    int rc = FALSE;
+
+    if (sdp->sd_flags & SDF_JSON_NO_INDEX)
+	return FALSE;
+
+    /* We need all the input in the buffer */
+    if (sdp->sd_buf == NULL || sdp->sd_cur >= sdp->sd_len
+	    || (sdp->sd_file && !(sdp->sd_flags & SDF_EOF)))
+	return FALSE;
+
+    bzero(&sji, sizeof(sji));
+    bzero(&sjw, sizeof(sjw));
+    sjw.sjw_sdp = sdp;
+
+    if (slaxJsonIndexBuild(&sji, sdp->sd_buf + sdp->sd_cur,
+			   sdp->sd_len - sdp->sd_cur))
+	goto done;
+
+    /* Check first, so we never leave a half-built tree behind */
+    if (!slaxJsonIndexWalk(&sjw, &sji))
+	goto done;
+
+    sjw.sjw_build = TRUE;
+    rc = slaxJsonIndexWalk(&sjw, &sji);
+
+    if (slaxLogIsEnabled)
+	slaxLog("slax: json: indexed %u structural characters",
+		sji.sji_count);
+
+ done:
+    slaxJsonIndexFree(&sji);
+    if (sjw.sjw_stack)
+	xmlFree(sjw.sjw_stack);
+
+    return rc;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * jsonindex.h -- fast path for turning JSON into XML
+ */
+
+#ifndef LIBSLAX_JSONINDEX_H
+#define LIBSLAX_JSONINDEX_H
+
+/*
+ * A structural index of a JSON buffer: the offsets of every quote
+ * that starts or ends a string, and every brace, bracket, colon and
+ * comma outside of strings, in order.
+ */
+typedef struct slax_json_index_s {
+    uint32_t *sji_pos;		/* Offsets of structural characters */
+    unsigned sji_count;		/* Number of entries used */
+    unsigned sji_size;		/* Number of entries allocated */
+} slax_json_index_t;
+
+/*
+ * Build the structural index for (buf, len).  Returns non-zero on
+ * failure (out of memory, or a buffer too large to index).
+ */
+int
+slaxJsonIndexBuild (slax_json_index_t *sjip, const char *buf, size_t len);
+
+/*
+ * Release the memory held by the index
+ */
+void
+slaxJsonIndexFree (slax_json_index_t *sjip);
+
+/*
+ * Return the token type (T_NUMBER, K_TRUE, K_FALSE or K_NULL) of the
+ * scalar in (cp, len), or zero if it isn't a plain JSON one
+ */
+int
+slaxJsonIndexScalar (const char *cp, unsigned len);
+
+/*
+ * Parse the JSON in sdp->sd_buf (from sd_cur to sd_len) into the
+ * document, using a structural index instead of the lexer and the
+ * grammar.  Only plain, well-formed JSON is handled here; if we see
+ * anything else (bare names, single quotes, comments, trailing
+ * commas or errors) we return FALSE without having touched the tree,
+ * and the caller should run the normal parser.
+ */
+int
+slaxJsonIndexParse (slax_data_t *sdp);
+
+#endif /* LIBSLAX_JSONINDEX_H */
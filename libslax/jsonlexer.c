@@ -40,10 +40,12 @@
 
 #include <libslax/slax.h>
 #include <libpsu/psustring.h>
+#include <libpsu/psuzio.h>
 #include "slaxinternals.h"
 #include "slaxparser.h"
 #include "jsonlexer.h"
 #include "jsonwriter.h"
+#include "jsonindex.h"
 
 static int slaxJsonDoTagging;
 
@@ -83,19 +85,24 @@ extXutilValidChar (int ch)
 }
 
 void
-slaxJsonElementOpenName (slax_data_t *sdp, char *name)
+slaxJsonCleanName (char *name)
 {
     char *s = name;
 
-    if (sdp->sd_flags & SDF_CLEAN_NAMES) {
-	if (!extXutilValidStartChar((int) *s))
-	    *s = '_';
+    if (!extXutilValidStartChar((int) *s))
+	*s = '_';
 
-	for (s = name; *s; s++) {
-	    if (!extXutilValidChar((int) *s))
-		*s = '_';
-	}
+    for (s = name; *s; s++) {
+	if (!extXutilValidChar((int) *s))
+	    *s = '_';
     }
+}
+
+void
+slaxJsonElementOpenName (slax_data_t *sdp, char *name)
+{
+    if (sdp->sd_flags & SDF_CLEAN_NAMES)
+	slaxJsonCleanName(name);
 
     slaxJsonElementOpen(sdp, name);
 }
@@ -278,7 +285,7 @@ slaxJsonDataToXml (const char *data, const char *root_name, unsigned flags)
     sd.sd_buf = xmlStrdup2(data);
     sd.sd_len = strlen(data);
     strncpy(sd.sd_filename, "json", sizeof(sd.sd_filename));
-    sd.sd_flags = flags | SDF_JSON_KEYWORDS;
+    sd.sd_flags = flags | SDF_JSON_KEYWORDS | SDF_ARENA;
     sd.sd_ctxt = ctxt;
     sd.sd_parse = sd.sd_ttype = M_JSON;
 
@@ -298,7 +305,8 @@ slaxJsonDataToXml (const char *data, const char *root_name, unsigned flags)
 
     sd.sd_docp->URL = (xmlChar *) xmlStrdup((const xmlChar *) "json.input");
 
-    slaxParse(&sd);
+    if (!slaxJsonIndexParse(&sd))
+	slaxParse(&sd);
 
     if (sd.sd_errors) {
 	slaxError("%s: %d error%s detected during parsing",
@@ -317,8 +325,8 @@ slaxJsonDataToXml (const char *data, const char *root_name, unsigned flags)
 }
 
 xmlDocPtr
-slaxJsonFileToXml (const char *fname, const char *root_name,
-		       unsigned flags)
+slaxJsonFileToXmlFp (FILE *fp, const char *fname, const char *root_name,
+		     unsigned flags)
 {
     slax_data_t sd;
     xmlDocPtr res;
@@ -338,18 +346,14 @@ slaxJsonFileToXml (const char *fname, const char *root_name,
     bzero(&sd, sizeof(sd));
 
     strlcpy(sd.sd_filename, fname, sizeof(sd.sd_filename));
-    sd.sd_flags = flags | SDF_JSON_KEYWORDS;
+    sd.sd_flags = flags | SDF_JSON_KEYWORDS | SDF_ARENA;
     sd.sd_ctxt = ctxt;
     sd.sd_parse = sd.sd_ttype = M_JSON;
 
     ctxt->version = xmlCharStrdup(XML_DEFAULT_VERSION);
     ctxt->userData = &sd;
 
-    sd.sd_file = fopen(fname, "r");
-    if (sd.sd_file == NULL) {
-	slaxError("%s: cannot open: %s", fname, strerror(errno));
-	return NULL;
-    }
+    sd.sd_file = fp;
 
     /*
      * Fake up an inputStream so the error mechanisms will work
@@ -364,7 +368,10 @@ slaxJsonFileToXml (const char *fname, const char *root_name,
 
     sd.sd_docp->URL = (xmlChar *) xmlStrdup((const xmlChar *) "json.input");
 
-    slaxParse(&sd);
+    /* Regular files are read whole, which lets us try the fast path */
+    slaxGetInput(&sd, 1);
+    if (!slaxJsonIndexParse(&sd))
+	slaxParse(&sd);
 
     if (sd.sd_errors) {
 	slaxError("%s: %d error%s detected during parsing",
@@ -379,11 +386,322 @@ slaxJsonFileToXml (const char *fname, const char *root_name,
     sd.sd_docp = NULL;
     slaxDataCleanup(&sd);
 
-    fclose(sd.sd_file);
+    return res;
+}
+
+xmlDocPtr
+slaxJsonFileToXml (const char *fname, const char *root_name,
+		       unsigned flags)
+{
+    xmlDocPtr res;
+    FILE *fp;
+
+    fp = psu_zio_fopen(fname, "r", PZF_AUTO, 0);
+    if (fp == NULL) {
+	slaxError("%s: cannot open: %s", fname, strerror(errno));
+	return NULL;
+    }
+
+    res = slaxJsonFileToXmlFp(fp, fname, root_name, flags);
+    fclose(fp);
 
     return res;
 }
 
+/*
+ * State for splitting a stream of JSON records (NDJSON, or just
+ * concatenated JSON values) into one record at a time.  We only track
+ * enough to find the end of each top-level value: bracket depth, and
+ * whether we're inside a string (or an escape in a string).  The
+ * contents are left for the real parser to check.
+ */
+typedef struct slax_json_records_s {
+    FILE *sjr_file;		/* Input file */
+    char *sjr_buf;		/* Input buffer */
+    size_t sjr_size;		/* Size of sjr_buf (less fudge) */
+    size_t sjr_len;		/* Bytes of data in sjr_buf */
+    size_t sjr_start;		/* Start of the current record */
+    size_t sjr_scan;		/* Next byte to scan */
+    unsigned sjr_depth;		/* Bracket depth */
+    int sjr_line;		/* Line number at sjr_scan */
+    int sjr_rec_line;		/* Line number at sjr_start */
+    unsigned sjr_flags;		/* Flags (SJRF_*) */
+} slax_json_records_t;
+
+#define SJRF_STRING	(1<<0)	/* Inside a string */
+#define SJRF_ESCAPE	(1<<1)	/* Just saw a backslash in a string */
+#define SJRF_INREC	(1<<2)	/* Seen the start of a record */
+#define SJRF_BARE	(1<<3)	/* Record isn't an object or array */
+#define SJRF_EOF	(1<<4)	/* Seen end of file */
+
+#define SJR_BUF_BLOCK	(64 * 1024) /* Read size */
+#define SJR_BUF_FUDGE	(BUFSIZ/8) /* Room for the lexer to peek */
+
+/*
+ * Scan for the end of the current record.  Returns TRUE when one is
+ * found, leaving sjr_scan just past it.
+ */
+static int
+slaxJsonRecordScan (slax_json_records_t *sjrp)
+{
+    char *buf = sjrp->sjr_buf;
+    size_t i;
+    unsigned flags = sjrp->sjr_flags;
+    int ch;
+
+    for (i = sjrp->sjr_scan; i < sjrp->sjr_len; i++) {
+	ch = buf[i];
+	if (ch == '\n')
+	    sjrp->sjr_line += 1;
+
+	if (!(flags & SJRF_INREC)) {
+	    if (isspace(ch))
+		continue;
+
+	    flags |= SJRF_INREC;
+	    sjrp->sjr_start = i;
+	    sjrp->sjr_rec_line = sjrp->sjr_line;
+	    if (ch != '{' && ch != '[')
+		flags |= SJRF_BARE;
+	}
+
+	if (flags & SJRF_STRING) {
+	    if (flags & SJRF_ESCAPE)
+		flags &= ~SJRF_ESCAPE;
+	    else if (ch == '\\')
+		flags |= SJRF_ESCAPE;
+	    else if (ch == '"')
+		flags &= ~SJRF_STRING;
+	    continue;
+	}
+
+	if (flags & SJRF_BARE) {
+	    /* Not something we understand; let the parser complain */
+	    if (ch == '\n') {
+		i += 1;
+		goto found;
+	    }
+	    continue;
+	}
+
+	switch (ch) {
+	case '"':
+	    flags |= SJRF_STRING;
+	    break;
+
+	case '{':
+	case '[':
+	    sjrp->sjr_depth += 1;
+	    break;
+
+	case '}':
+	case ']':
+	    if (sjrp->sjr_depth > 0 && --sjrp->sjr_depth == 0) {
+		i += 1;
+		goto found;
+	    }
+	    break;
+	}
+    }
+
+    sjrp->sjr_scan = i;
+    sjrp->sjr_flags = flags;
+    return FALSE;
+
+ found:
+    sjrp->sjr_scan = i;
+    sjrp->sjr_flags = flags & ~(SJRF_INREC | SJRF_BARE
+				| SJRF_STRING | SJRF_ESCAPE);
+    sjrp->sjr_depth = 0;
+    return TRUE;
+}
+
+/*
+ * Read more input, first sliding the current record down to the
+ * start of the buffer.  The buffer only grows when a single record
+ * won't fit.  Returns TRUE at end of file.
+ */
+static int
+slaxJsonRecordRead (slax_json_records_t *sjrp)
+{
+    size_t keep, got;
+    char *cp;
+
+    if (sjrp->sjr_flags & SJRF_EOF)
+	return TRUE;
+
+    keep = (sjrp->sjr_flags & SJRF_INREC) ? sjrp->sjr_start : sjrp->sjr_scan;
+    if (keep > 0) {
+	memmove(sjrp->sjr_buf, sjrp->sjr_buf + keep, sjrp->sjr_len - keep);
+	sjrp->sjr_len -= keep;
+	sjrp->sjr_scan -= keep;
+	sjrp->sjr_start = (sjrp->sjr_start > keep) ? sjrp->sjr_start - keep : 0;
+    }
+
+    if (sjrp->sjr_size - sjrp->sjr_len < SJR_BUF_BLOCK / 2) {
+	cp = xmlRealloc(sjrp->sjr_buf,
+			sjrp->sjr_size + SJR_BUF_BLOCK + SJR_BUF_FUDGE);
+	if (cp == NULL) {
+	    slaxError("%s: out of memory", "json");
+	    return TRUE;
+	}
+	sjrp->sjr_buf = cp;
+	sjrp->sjr_size += SJR_BUF_BLOCK;
+    }
+
+    got = fread(sjrp->sjr_buf + sjrp->sjr_len, 1,
+		sjrp->sjr_size - sjrp->sjr_len, sjrp->sjr_file);
+    if (got == 0) {
+	sjrp->sjr_flags |= SJRF_EOF;
+	return TRUE;
+    }
+
+    sjrp->sjr_len += got;
+    return FALSE;
+}
+
+/**
+ * Turn a stream of JSON records into a series of XML documents, one
+ * per record, handing each to a callback.  Records can be NDJSON
+ * (one per line) or simply concatenated JSON values.  Only one
+ * record is held in memory at a time, so inputs of any size can be
+ * converted; the parser context, string arena and dictionary are
+ * shared by all the records.
+ *
+ * The callback owns the document and must free it.  A record that
+ * fails to parse is reported and skipped.  If the callback returns
+ * non-zero, we stop.
+ *
+ * @param fname name of the input file ("-" for stdin)
+ * @param root_name name of each document's root element (or NULL)
+ * @param flags SDF_* flags
+ * @param func callback for each record
+ * @param opaque opaque data passed to func
+ * @return number of records that failed to parse, or -1 on error
+ */
+int
+slaxJsonFileToXmlRecords (const char *fname, const char *root_name,
+			  unsigned flags, slaxJsonRecordFunc_t func,
+			  void *opaque)
+{
+    slax_json_records_t sjr;
+    slax_data_t sd;
+    psu_bump_t arena;
+    xmlParserCtxtPtr ctxt;
+    xmlDocPtr docp;
+    unsigned recno = 0;
+    int errors = 0, found, save;
+    size_t end;
+
+    slaxSetupLexer();
+
+    psu_bump_init(&arena, slaxXmlAllocator(), SLAX_ARENA_BLOCK);
+    bzero(&sjr, sizeof(sjr));
+    if (slaxFilenameIsStd(fname))
+	sjr.sjr_file = stdin;
+    else {
+	sjr.sjr_file = psu_zio_fopen(fname, "r", PZF_AUTO, 0);
+	if (sjr.sjr_file == NULL) {
+	    slaxError("%s: cannot open: %s", fname, strerror(errno));
+	    return -1;
+	}
+    }
+
+    ctxt = xmlNewParserCtxt();
+    if (ctxt == NULL)
+	goto fail;
+
+    ctxt->linenumbers = 1;
+    ctxt->version = xmlCharStrdup(XML_DEFAULT_VERSION);
+    xmlSetupParserForBuffer(ctxt, (const xmlChar *) "", fname);
+
+    for (;;) {
+	found = slaxJsonRecordScan(&sjr);
+	if (!found) {
+	    if (!slaxJsonRecordRead(&sjr))
+		continue;
+
+	    /* End of file; whatever's left is the last record */
+	    if (!(sjr.sjr_flags & SJRF_INREC))
+		break;
+	    sjr.sjr_scan = sjr.sjr_len;
+	    sjr.sjr_flags = SJRF_EOF;
+	}
+
+	recno += 1;
+	end = sjr.sjr_scan;
+
+	/* Terminate the record in place, so the lexer sees its end */
+	save = sjr.sjr_buf[end];
+	sjr.sjr_buf[end] = '\0';
+
+	bzero(&sd, sizeof(sd));
+	strlcpy(sd.sd_filename, fname, sizeof(sd.sd_filename));
+	sd.sd_flags = flags | SDF_JSON_KEYWORDS | SDF_ARENA;
+	sd.sd_ctxt = ctxt;
+	sd.sd_parse = sd.sd_ttype = M_JSON;
+	sd.sd_arena = arena;
+	sd.sd_buf = sjr.sjr_buf;
+	sd.sd_cur = sd.sd_start = sjr.sjr_start;
+	sd.sd_len = end;
+	sd.sd_size = sjr.sjr_size;
+	sd.sd_line = sjr.sjr_rec_line;
+	ctxt->userData = &sd;
+
+	sd.sd_docp = slaxJsonBuildDoc(&sd, root_name, ctxt);
+	if (sd.sd_docp == NULL) {
+	    sjr.sjr_buf[end] = save;
+	    goto fail;
+	}
+
+	sd.sd_docp->URL = (xmlChar *) xmlStrdup((const xmlChar *) "json.input");
+
+	if (!slaxJsonIndexParse(&sd))
+	    slaxParse(&sd);
+
+	sjr.sjr_buf[end] = save;
+
+	/* Unwind whatever the parser left on the node stack */
+	while (ctxt->nodeNr > 0)
+	    nodePop(ctxt);
+
+	docp = sd.sd_docp;
+	sd.sd_docp = NULL;
+	arena = sd.sd_arena;
+	psu_bump_reset(&arena);
+
+	if (sd.sd_errors) {
+	    slaxError("%s: record %u: %d error%s detected during parsing",
+		      fname, recno, sd.sd_errors,
+		      (sd.sd_errors == 1) ? "" : "s");
+	    xmlFreeDoc(docp);
+	    errors += 1;
+	    continue;
+	}
+
+	if (func(opaque, docp, recno))
+	    break;
+    }
+
+    psu_bump_cleanup(&arena);
+    xmlFreeParserCtxt(ctxt);
+    xmlFree(sjr.sjr_buf);
+    if (sjr.sjr_file != stdin)
+	fclose(sjr.sjr_file);
+
+    return errors;
+
+ fail:
+    psu_bump_cleanup(&arena);
+    if (ctxt)
+	xmlFreeParserCtxt(ctxt);
+    xmlFree(sjr.sjr_buf);
+    if (sjr.sjr_file != stdin)
+	fclose(sjr.sjr_file);
+
+    return -1;
+}
+
 #ifdef UNIT_TEST
 int
 main (int argc UNUSED, char **argv)
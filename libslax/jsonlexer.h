@@ -70,5 +70,45 @@ xmlDocPtr
 slaxJsonFileToXml (const char *fname, const char *root_name,
 		       unsigned flags);
 
+/*
+ * Like slaxJsonFileToXml(), but read from an open stream, which the
+ * caller closes; 'fname' is used in error messages
+ */
+xmlDocPtr
+slaxJsonFileToXmlFp (FILE *fp, const char *fname, const char *root_name,
+		     unsigned flags);
+
+/*
+ * Callback for slaxJsonFileToXmlRecords; called with the document
+ * made from each record (which the callback must free) and the
+ * record's number (from one).  Return non-zero to stop.
+ */
+typedef int (*slaxJsonRecordFunc_t)(void *opaque, xmlDocPtr docp,
+				    unsigned recno);
+
+int
+slaxJsonFileToXmlRecords (const char *fname, const char *root_name,
+			  unsigned flags, slaxJsonRecordFunc_t func,
+			  void *opaque);
+
+/*
+ * Convert a JSON file to XML text on 'outfd' as it's read, without
+ * building a document.  The output is what slaxDumpToFd() would write
+ * for the document slaxJsonFileToXml() would build, for plain JSON;
+ * the parser's extensions to JSON are reported as errors.  With
+ * 'partial', the XML declaration and root element are left off.
+ * Returns zero on success, or -1 after reporting an error.
+ */
+int
+slaxJsonStreamToXml (const char *fname, int outfd, const char *root_name,
+		     unsigned flags, int partial);
+
+/*
+ * Turn characters that can't be in an element name into underscores
+ * (for SDF_CLEAN_NAMES)
+ */
+void
+slaxJsonCleanName (char *name);
+
 void
 slaxJsonElementValue (slax_data_t *sdp, slax_string_t *value);
@@ -0,0 +1,797 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * jsonstream.c -- turn JSON into XML text without building a document
+ *
+ * slaxJsonFileToXml() builds a document, which the caller then
+ * writes out.  For a multi-gigabyte file, that's a lot of memory and
+ * a long wait for the first byte of output.  Here we tokenize the
+ * input as it's read and write each element as soon as we know what
+ * it looks like, so memory is bounded by the nesting depth and the
+ * longest string.  The output is what slaxDumpToFd() would write for
+ * the document slaxJsonFileToXml() would build, but only for plain
+ * JSON; the grammar's extensions (bare names, single quotes, comments
+ * and trailing commas) are reported as errors, since we can't fall
+ * back to the parser once output has started.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include <libslax/slax.h>
+#include <libpsu/psustring.h>
+#include <libpsu/psuzio.h>
+#include "slaxinternals.h"
+#include "slaxparser.h"
+#include "jsonlexer.h"
+#include "jsonindex.h"
+
+#define JSS_BUFSIZ	(64 * 1024) /* Read size and output flush point */
+#define JSS_INDENT	2	/* Indent per level (as xmlSaveFormat) */
+
+/* States, as in slaxJsonIndexWalk() */
+#define JSS_VALUE	1	/* Want a value */
+#define JSS_VALUE_CLOSE	2	/* Want a value or ']' */
+#define JSS_KEY		3	/* Want a member name */
+#define JSS_KEY_CLOSE	4	/* Want a member name or '}' */
+#define JSS_COLON	5	/* Want a ':' */
+#define JSS_NEXT	6	/* Want a ',' or the close */
+#define JSS_DONE	7	/* Seen the whole document */
+
+/* Token types from slaxJsonStreamToken, other than the punctuation */
+#define JST_EOF		0	/* End of input */
+#define JST_FAIL	-1	/* Error (already reported) */
+#define JST_STRING	'"'	/* Quoted string (without the quotes) */
+#define JST_BARE	'a'	/* Number, true, false, null or junk */
+
+/*
+ * An open object or array, which becomes an element whose start tag
+ * is held back until we know whether it has any contents
+ */
+typedef struct json_stream_frame_s {
+    char *jsf_element;		/* Element name */
+    char *jsf_name;		/* "name" attribute (or NULL) */
+    const char *jsf_type;	/* "type" attribute (or NULL) */
+    uint8_t jsf_array;		/* Array (or object) */
+    uint8_t jsf_open;		/* Start tag has been written */
+} json_stream_frame_t;
+
+typedef struct json_stream_s {
+    slax_data_t js_sd;		/* For slaxStringMake() and errors */
+    int js_partial;		/* Skip the declaration and root */
+    int js_state;		/* Current state (JSS_*) */
+    int js_infd;		/* Input file descriptor */
+    int js_eof;			/* Seen end of input */
+    char *js_in;		/* Input buffer */
+    size_t js_in_len;		/* Bytes of data in js_in */
+    size_t js_in_cur;		/* Next byte to look at */
+    size_t js_in_size;		/* Size of js_in */
+    int js_outfd;		/* Output file descriptor */
+    char *js_out;		/* Output buffer */
+    size_t js_out_len;		/* Bytes used in js_out */
+    int js_errors;		/* Number of errors */
+    json_stream_frame_t *js_stack; /* Open objects and arrays */
+    unsigned js_depth;		/* Entries used in js_stack */
+    unsigned js_max;		/* Size of js_stack */
+    char *js_key_element;	/* Element for the current member */
+    char *js_key_name;		/* "name" attribute for it (or NULL) */
+} json_stream_t;
+
+static void
+slaxJsonStreamError (json_stream_t *jsp, const char *msg)
+{
+    slaxError("%s:%d: %s", jsp->js_sd.sd_filename, jsp->js_sd.sd_line, msg);
+    jsp->js_errors += 1;
+}
+
+static void
+slaxJsonStreamFlush (json_stream_t *jsp)
+{
+    size_t off = 0;
+    ssize_t rc;
+
+    while (off < jsp->js_out_len) {
+	rc = psu_zio_write(jsp->js_outfd, jsp->js_out + off, jsp->js_out_len - off);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    jsp->js_errors += 1;
+	    break;
+	}
+	off += rc;
+    }
+
+    jsp->js_out_len = 0;
+}
+
+static void
+slaxJsonStreamWrite (json_stream_t *jsp, const char *str, size_t len)
+{
+    size_t run;
+
+    while (len > 0) {
+	if (jsp->js_out_len == JSS_BUFSIZ)
+	    slaxJsonStreamFlush(jsp);
+
+	run = JSS_BUFSIZ - jsp->js_out_len;
+	if (run > len)
+	    run = len;
+
+	memcpy(jsp->js_out + jsp->js_out_len, str, run);
+	jsp->js_out_len += run;
+	str += run;
+	len -= run;
+    }
+}
+
+static inline void
+slaxJsonStreamWriteStr (json_stream_t *jsp, const char *str)
+{
+    slaxJsonStreamWrite(jsp, str, strlen(str));
+}
+
+/*
+ * Write text escaped the way libxml2 escapes it, either as content
+ * or as an attribute value
+ */
+static void
+slaxJsonStreamWriteEscaped (json_stream_t *jsp, const char *str, int attrib)
+{
+    const char *cp, *esc;
+
+    for (cp = str; *cp; cp++) {
+	switch (*cp) {
+	case '<':
+	    esc = "&lt;";
+	    break;
+	case '>':
+	    esc = "&gt;";
+	    break;
+	case '&':
+	    esc = "&amp;";
+	    break;
+	case '\r':
+	    esc = "&#13;";
+	    break;
+	case '"':
+	    esc = attrib ? "&quot;" : NULL;
+	    break;
+	case '\n':
+	    esc = attrib ? "&#10;" : NULL;
+	    break;
+	case '\t':
+	    esc = attrib ? "&#9;" : NULL;
+	    break;
+	default:
+	    esc = NULL;
+	}
+
+	if (esc) {
+	    slaxJsonStreamWrite(jsp, str, cp - str);
+	    slaxJsonStreamWriteStr(jsp, esc);
+	    str = cp + 1;
+	}
+    }
+
+    slaxJsonStreamWrite(jsp, str, cp - str);
+}
+
+static void
+slaxJsonStreamIndent (json_stream_t *jsp, unsigned level)
+{
+    static const char spaces[] = "                                ";
+    unsigned width = level * JSS_INDENT;
+
+    for ( ; width > sizeof(spaces) - 1; width -= sizeof(spaces) - 1)
+	slaxJsonStreamWrite(jsp, spaces, sizeof(spaces) - 1);
+    slaxJsonStreamWrite(jsp, spaces, width);
+}
+
+/*
+ * Write the start of a start tag, up to (but not including) the '>'
+ */
+static void
+slaxJsonStreamStartTag (json_stream_t *jsp, unsigned level,
+			const char *element, const char *name,
+			const char *type)
+{
+    slaxJsonStreamIndent(jsp, level);
+    slaxJsonStreamWrite(jsp, "<", 1);
+    slaxJsonStreamWriteStr(jsp, element);
+
+    if (name) {
+	slaxJsonStreamWriteStr(jsp, " " ATT_NAME "=\"");
+	slaxJsonStreamWriteEscaped(jsp, name, TRUE);
+	slaxJsonStreamWrite(jsp, "\"", 1);
+    }
+
+    if (type) {
+	slaxJsonStreamWriteStr(jsp, " " ATT_TYPE "=\"");
+	slaxJsonStreamWriteStr(jsp, type);
+	slaxJsonStreamWrite(jsp, "\"", 1);
+    }
+}
+
+/*
+ * The indent level for a child of the innermost frame.  In partial
+ * mode, the root isn't written, so everything moves left one level.
+ */
+static inline unsigned
+slaxJsonStreamLevel (json_stream_t *jsp, unsigned depth)
+{
+    return jsp->js_partial ? depth - 1 : depth;
+}
+
+/*
+ * The innermost frame is getting a child, so its start tag can be
+ * written
+ */
+static void
+slaxJsonStreamOpenParent (json_stream_t *jsp)
+{
+    json_stream_frame_t *jsfp;
+
+    if (jsp->js_depth == 0)
+	return;
+
+    jsfp = &jsp->js_stack[jsp->js_depth - 1];
+    if (jsfp->jsf_open)
+	return;
+
+    jsfp->jsf_open = TRUE;
+    if (jsp->js_partial && jsp->js_depth == 1)
+	return;
+
+    slaxJsonStreamStartTag(jsp, slaxJsonStreamLevel(jsp, jsp->js_depth - 1),
+			   jsfp->jsf_element, jsfp->jsf_name, jsfp->jsf_type);
+    slaxJsonStreamWrite(jsp, ">\n", 2);
+}
+
+static void
+slaxJsonStreamClearKey (json_stream_t *jsp)
+{
+    if (jsp->js_key_element)
+	xmlFree(jsp->js_key_element);
+    if (jsp->js_key_name)
+	xmlFree(jsp->js_key_name);
+    jsp->js_key_element = jsp->js_key_name = NULL;
+}
+
+/*
+ * Record a member name, cleaning and validating it the way
+ * slaxJsonElementOpenName() does
+ */
+static void
+slaxJsonStreamKey (json_stream_t *jsp, const char *cp, unsigned len)
+{
+    slax_data_t *sdp = &jsp->js_sd;
+    slax_string_t *ssp;
+    char *name;
+
+    slaxJsonStreamClearKey(jsp);
+
+    ssp = slaxStringMake(sdp, T_QUOTED, cp, len);
+    if (ssp == NULL) {
+	jsp->js_errors += 1;
+	return;
+    }
+
+    name = ssp->ss_token;
+    if (sdp->sd_flags & SDF_CLEAN_NAMES)
+	slaxJsonCleanName(name);
+
+    if (xmlValidateName((const xmlChar *) name, FALSE) == 0)
+	jsp->js_key_element = (char *) xmlStrdup((const xmlChar *) name);
+    else {
+	jsp->js_key_element = (char *) xmlStrdup((const xmlChar *) ELT_ELEMENT);
+	jsp->js_key_name = (char *) xmlStrdup((const xmlChar *) name);
+    }
+
+    slaxStringFree(ssp);
+}
+
+/*
+ * Find the element (and attributes) for the value we're starting.
+ * Returns NULL for a value at the top, which becomes the root.
+ */
+static json_stream_frame_t *
+slaxJsonStreamValueStart (json_stream_t *jsp, const char **elementp,
+			  const char **namep)
+{
+    json_stream_frame_t *jsfp;
+
+    if (jsp->js_depth == 0)
+	return NULL;
+
+    jsfp = &jsp->js_stack[jsp->js_depth - 1];
+    if (jsfp->jsf_array) {
+	*elementp = (jsp->js_sd.sd_flags & SDF_JSON_NO_MEMBERS)
+	    ? jsfp->jsf_element : ELT_MEMBER;
+	*namep = NULL;
+    } else {
+	*elementp = jsp->js_key_element;
+	*namep = jsp->js_key_name;
+    }
+
+    slaxJsonStreamOpenParent(jsp);
+    return jsfp;
+}
+
+/*
+ * A value is complete; see what comes next
+ */
+static void
+slaxJsonStreamValueDone (json_stream_t *jsp)
+{
+    slaxJsonStreamClearKey(jsp);
+    jsp->js_state = jsp->js_depth ? JSS_NEXT : JSS_DONE;
+}
+
+/*
+ * Write a simple value (string, number, true, false or null)
+ */
+static void
+slaxJsonStreamValue (json_stream_t *jsp, int ttype, const char *cp,
+		     unsigned len)
+{
+    const char *element = NULL, *name = NULL, *type = NULL;
+    json_stream_frame_t *parent;
+    slax_string_t *ssp;
+
+    parent = slaxJsonStreamValueStart(jsp, &element, &name);
+    if (parent == NULL || element == NULL) {
+	slaxJsonStreamError(jsp, "value must be inside an object or array");
+	return;
+    }
+
+    switch (ttype) {
+    case T_NUMBER:
+	type = VAL_NUMBER;
+	break;
+    case K_TRUE:
+	type = VAL_TRUE;
+	break;
+    case K_FALSE:
+	type = VAL_FALSE;
+	break;
+    case K_NULL:
+	type = VAL_NULL;
+	break;
+    default:
+	type = parent->jsf_array ? VAL_MEMBER : NULL;
+    }
+
+    if (jsp->js_sd.sd_flags & SDF_NO_TYPES)
+	type = NULL;
+
+    ssp = slaxStringMake(&jsp->js_sd, ttype, cp, len);
+    if (ssp == NULL) {
+	jsp->js_errors += 1;
+	return;
+    }
+
+    slaxJsonStreamStartTag(jsp, slaxJsonStreamLevel(jsp, jsp->js_depth),
+			   element, name, type);
+    slaxJsonStreamWrite(jsp, ">", 1);
+    slaxJsonStreamWriteEscaped(jsp, ssp->ss_token, FALSE);
+    slaxJsonStreamWrite(jsp, "</", 2);
+    slaxJsonStreamWriteStr(jsp, element);
+    slaxJsonStreamWrite(jsp, ">\n", 2);
+
+    slaxStringFree(ssp);
+    slaxJsonStreamValueDone(jsp);
+}
+
+/*
+ * Start an object or array
+ */
+static void
+slaxJsonStreamPush (json_stream_t *jsp, int array, const char *root_name)
+{
+    const char *element = NULL, *name = NULL, *type = NULL;
+    json_stream_frame_t *parent, *jsfp;
+
+    parent = slaxJsonStreamValueStart(jsp, &element, &name);
+    if (parent == NULL)
+	element = root_name;
+    else if (parent->jsf_array && !array)
+	type = VAL_MEMBER;
+
+    if (array)
+	type = VAL_ARRAY;
+    if (jsp->js_sd.sd_flags & SDF_NO_TYPES)
+	type = NULL;
+
+    if (element == NULL) {
+	slaxJsonStreamError(jsp, "missing member name");
+	return;
+    }
+
+    if (jsp->js_depth == jsp->js_max) {
+	unsigned max = jsp->js_max ? jsp->js_max * 2 : 32;
+	jsfp = xmlRealloc(jsp->js_stack, max * sizeof(*jsfp));
+	if (jsfp == NULL) {
+	    slaxJsonStreamError(jsp, "out of memory");
+	    return;
+	}
+
+	jsp->js_stack = jsfp;
+	jsp->js_max = max;
+    }
+
+    jsfp = &jsp->js_stack[jsp->js_depth++];
+    bzero(jsfp, sizeof(*jsfp));
+    jsfp->jsf_element = (char *) xmlStrdup((const xmlChar *) element);
+    jsfp->jsf_name = name ? (char *) xmlStrdup((const xmlChar *) name) : NULL;
+    jsfp->jsf_type = type;
+    jsfp->jsf_array = array;
+
+    slaxJsonStreamClearKey(jsp);
+    jsp->js_state = array ? JSS_VALUE_CLOSE : JSS_KEY_CLOSE;
+}
+
+/*
+ * Finish an object or array; without contents, it's an empty tag
+ */
+static void
+slaxJsonStreamPop (json_stream_t *jsp)
+{
+    json_stream_frame_t *jsfp = &jsp->js_stack[--jsp->js_depth];
+    unsigned level = slaxJsonStreamLevel(jsp, jsp->js_depth);
+
+    if (jsp->js_partial && jsp->js_depth == 0) {
+	/* The root isn't written */
+
+    } else if (jsfp->jsf_open) {
+	slaxJsonStreamIndent(jsp, level);
+	slaxJsonStreamWrite(jsp, "</", 2);
+	slaxJsonStreamWriteStr(jsp, jsfp->jsf_element);
+	slaxJsonStreamWrite(jsp, ">\n", 2);
+
+    } else {
+	slaxJsonStreamStartTag(jsp, level, jsfp->jsf_element,
+			       jsfp->jsf_name, jsfp->jsf_type);
+	slaxJsonStreamWrite(jsp, "/>\n", 3);
+    }
+
+    xmlFree(jsfp->jsf_element);
+    if (jsfp->jsf_name)
+	xmlFree(jsfp->jsf_name);
+
+    if (jsp->js_out_len >= JSS_BUFSIZ / 2)
+	slaxJsonStreamFlush(jsp);
+
+    slaxJsonStreamValueDone(jsp);
+}
+
+/*
+ * Read more input, keeping the bytes from js_in_cur on.  Returns the
+ * number of bytes read, zero at end of input, or -1 on error.
+ */
+static ssize_t
+slaxJsonStreamFill (json_stream_t *jsp)
+{
+    ssize_t rc;
+
+    if (jsp->js_eof)
+	return 0;
+
+    if (jsp->js_in_cur > 0) {
+	memmove(jsp->js_in, jsp->js_in + jsp->js_in_cur,
+		jsp->js_in_len - jsp->js_in_cur);
+	jsp->js_in_len -= jsp->js_in_cur;
+	jsp->js_in_cur = 0;
+    }
+
+    /* A token longer than our buffer means a bigger buffer */
+    if (jsp->js_in_size - jsp->js_in_len < JSS_BUFSIZ / 2) {
+	size_t size = jsp->js_in_size ? jsp->js_in_size * 2 : JSS_BUFSIZ;
+	char *cp = xmlRealloc(jsp->js_in, size);
+	if (cp == NULL) {
+	    slaxJsonStreamError(jsp, "out of memory");
+	    return -1;
+	}
+
+	jsp->js_in = cp;
+	jsp->js_in_size = size;
+    }
+
+    for (;;) {
+	rc = psu_zio_read(jsp->js_infd, jsp->js_in + jsp->js_in_len,
+		  jsp->js_in_size - jsp->js_in_len);
+	if (rc >= 0)
+	    break;
+	if (errno != EINTR) {
+	    slaxJsonStreamError(jsp, strerror(errno));
+	    return -1;
+	}
+    }
+
+    if (rc == 0)
+	jsp->js_eof = TRUE;
+    jsp->js_in_len += rc;
+
+    return rc;
+}
+
+/*
+ * Return the next token, with its contents in (*startp, *lenp).  The
+ * contents live in our input buffer, which the next call may move.
+ */
+static int
+slaxJsonStreamToken (json_stream_t *jsp, char **startp, unsigned *lenp)
+{
+    size_t scan, start;
+    char *cp;
+    int ch;
+
+    /* Skip whitespace, counting lines */
+    for (;;) {
+	for ( ; jsp->js_in_cur < jsp->js_in_len; jsp->js_in_cur++) {
+	    ch = jsp->js_in[jsp->js_in_cur];
+	    if (ch == '\n')
+		jsp->js_sd.sd_line += 1;
+	    else if (!isspace(ch))
+		break;
+	}
+
+	if (jsp->js_in_cur < jsp->js_in_len)
+	    break;
+
+	ssize_t rc = slaxJsonStreamFill(jsp);
+	if (rc <= 0)
+	    return rc ? JST_FAIL : JST_EOF;
+    }
+
+    ch = jsp->js_in[jsp->js_in_cur];
+    switch (ch) {
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+	jsp->js_in_cur += 1;
+	return ch;
+
+    case '"':
+	/* Look for a closing quote that isn't escaped */
+	scan = 1;
+	for (;;) {
+	    start = jsp->js_in_cur + scan;
+	    cp = (start < jsp->js_in_len)
+		? memchr(jsp->js_in + start, '"', jsp->js_in_len - start)
+		: NULL;
+	    if (cp) {
+		size_t bs = 0;
+		while (cp - bs - 1 > jsp->js_in + jsp->js_in_cur
+		       && cp[-bs - 1] == '\\')
+		    bs += 1;
+
+		scan = cp - (jsp->js_in + jsp->js_in_cur) + 1;
+		if ((bs & 1) == 0)
+		    break;
+		continue;
+	    }
+
+	    scan = jsp->js_in_len - jsp->js_in_cur;
+	    ssize_t rc = slaxJsonStreamFill(jsp);
+	    if (rc <= 0) {
+		if (rc == 0)
+		    slaxJsonStreamError(jsp, "unterminated string");
+		return JST_FAIL;
+	    }
+	}
+
+	*startp = jsp->js_in + jsp->js_in_cur + 1;
+	*lenp = scan - 2;
+
+	/* Newlines in strings count, as they do for the lexer */
+	for (cp = *startp; (cp = memchr(cp, '\n', *startp + *lenp - cp)); cp++)
+	    jsp->js_sd.sd_line += 1;
+
+	jsp->js_in_cur += scan;
+	return JST_STRING;
+    }
+
+    /* Anything else runs until whitespace or punctuation */
+    scan = 0;
+    for (;;) {
+	for ( ; jsp->js_in_cur + scan < jsp->js_in_len; scan++) {
+	    ch = jsp->js_in[jsp->js_in_cur + scan];
+	    if (isspace(ch) || strchr("{}[]:,\"", ch))
+		break;
+	}
+
+	if (jsp->js_in_cur + scan < jsp->js_in_len)
+	    break;
+
+	ssize_t rc = slaxJsonStreamFill(jsp);
+	if (rc < 0)
+	    return JST_FAIL;
+	if (rc == 0)
+	    break;
+    }
+
+    *startp = jsp->js_in + jsp->js_in_cur;
+    *lenp = scan;
+    jsp->js_in_cur += scan;
+    return JST_BARE;
+}
+
+static inline int
+slaxJsonStreamWantValue (json_stream_t *jsp)
+{
+    return (jsp->js_state == JSS_VALUE || jsp->js_state == JSS_VALUE_CLOSE);
+}
+
+static inline int
+slaxJsonStreamInArray (json_stream_t *jsp)
+{
+    return jsp->js_depth && jsp->js_stack[jsp->js_depth - 1].jsf_array;
+}
+
+int
+slaxJsonStreamToXml (const char *fname, int outfd, const char *root_name,
+		     unsigned flags, int partial)
+{
+    json_stream_t js;
+    char *cp = NULL;
+    unsigned len = 0;
+    int ttype, rc = -1;
+
+    bzero(&js, sizeof(js));
+    strlcpy(js.js_sd.sd_filename, fname, sizeof(js.js_sd.sd_filename));
+    js.js_sd.sd_flags = flags;
+    js.js_sd.sd_parse = M_JSON;
+    js.js_sd.sd_line = 1;
+    js.js_partial = partial;
+    js.js_outfd = outfd;
+    js.js_state = JSS_VALUE;
+
+    if (root_name == NULL)
+	root_name = ELT_JSON;
+
+    /* Compressed input is decompressed as we read it */
+    if (slaxFilenameIsStd(fname)) {
+	js.js_infd = 0;
+	if (psu_zio_attach(js.js_infd, O_RDONLY, PZF_AUTO, 0) < 0) {
+	    slaxError("%s: cannot read: %s", fname, strerror(errno));
+	    return -1;
+	}
+    } else {
+	js.js_infd = psu_zio_open(fname, O_RDONLY, PZF_AUTO, 0);
+	if (js.js_infd < 0) {
+	    slaxError("%s: cannot open: %s", fname, strerror(errno));
+	    return -1;
+	}
+    }
+
+    js.js_out = xmlMalloc(JSS_BUFSIZ);
+    if (js.js_out == NULL)
+	goto done;
+
+    if (!partial)
+	slaxJsonStreamWriteStr(&js, "<?xml version=\"1.0\" encoding=\"UTF-8\""
+			       " standalone=\"yes\"?>\n");
+
+    while (js.js_errors == 0) {
+	ttype = slaxJsonStreamToken(&js, &cp, &len);
+	if (ttype == JST_FAIL)
+	    break;
+
+	if (js.js_state == JSS_DONE) {
+	    if (ttype != JST_EOF)
+		slaxJsonStreamError(&js, "extra data after the JSON value");
+	    break;
+	}
+
+	switch (ttype) {
+	case JST_EOF:
+	    slaxJsonStreamError(&js, "unexpected end of input");
+	    break;
+
+	case JST_STRING:
+	    if (js.js_state == JSS_KEY || js.js_state == JSS_KEY_CLOSE) {
+		slaxJsonStreamKey(&js, cp, len);
+		js.js_state = JSS_COLON;
+	    } else if (slaxJsonStreamWantValue(&js))
+		slaxJsonStreamValue(&js, T_QUOTED, cp, len);
+	    else
+		slaxJsonStreamError(&js, "unexpected string");
+	    break;
+
+	case JST_BARE:
+	    ttype = slaxJsonIndexScalar(cp, len);
+	    if (ttype == 0 || !slaxJsonStreamWantValue(&js))
+		slaxJsonStreamError(&js, "unexpected token (streaming "
+				    "conversion handles only plain JSON)");
+	    else
+		slaxJsonStreamValue(&js, ttype, cp, len);
+	    break;
+
+	case ':':
+	    if (js.js_state != JSS_COLON)
+		slaxJsonStreamError(&js, "unexpected ':'");
+	    else
+		js.js_state = JSS_VALUE;
+	    break;
+
+	case ',':
+	    if (js.js_state != JSS_NEXT)
+		slaxJsonStreamError(&js, "unexpected ','");
+	    else
+		js.js_state = slaxJsonStreamInArray(&js) ? JSS_VALUE : JSS_KEY;
+	    break;
+
+	case '{':
+	case '[':
+	    if (!slaxJsonStreamWantValue(&js))
+		slaxJsonStreamError(&js, "unexpected object or array");
+	    else
+		slaxJsonStreamPush(&js, ttype == '[', root_name);
+	    break;
+
+	case '}':
+	    if (js.js_depth == 0 || slaxJsonStreamInArray(&js)
+		    || (js.js_state != JSS_KEY_CLOSE
+			&& js.js_state != JSS_NEXT))
+		slaxJsonStreamError(&js, "unexpected '}'");
+	    else
+		slaxJsonStreamPop(&js);
+	    break;
+
+	case ']':
+	    if (!slaxJsonStreamInArray(&js)
+		    || (js.js_state != JSS_VALUE_CLOSE
+			&& js.js_state != JSS_NEXT))
+		slaxJsonStreamError(&js, "unexpected ']'");
+	    else
+		slaxJsonStreamPop(&js);
+	    break;
+
+	default:
+	    slaxJsonStreamError(&js, "unexpected character");
+	}
+    }
+
+    slaxJsonStreamFlush(&js);
+    if (js.js_errors == 0)
+	rc = 0;
+
+ done:
+    slaxJsonStreamClearKey(&js);
+    while (js.js_depth > 0) {
+	js.js_depth -= 1;
+	xmlFree(js.js_stack[js.js_depth].jsf_element);
+	if (js.js_stack[js.js_depth].jsf_name)
+	    xmlFree(js.js_stack[js.js_depth].jsf_name);
+    }
+
+    if (js.js_stack)
+	xmlFree(js.js_stack);
+    if (js.js_in)
+	xmlFree(js.js_in);
+    if (js.js_out)
+	xmlFree(js.js_out);
+    if (js.js_infd > 0)
+	psu_zio_close(js.js_infd);
+    else
+	psu_zio_detach(js.js_infd);
+
+    return rc;
+}
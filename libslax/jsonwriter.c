@@ -21,13 +21,15 @@
 #include <libxml/xmlsave.h>
 
 #include <libslax/slax.h>
+#include <libpsu/psuzio.h>
 #include "slaxinternals.h"
 #include "jsonlexer.h"
 #include "jsonwriter.h"
 
-/* Forward declarations */
-static int
-jsonWriteChildren (slax_writer_t *swp, xmlNodePtr parent, unsigned flags);
+#if defined(__SSE2__)
+#define JSON_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 static const char *
 jsonAttribValue (xmlNodePtr nodep, const char *name)
@@ -97,48 +99,275 @@ jsonNeedsComma (xmlNodePtr nodep UNUSED)
     return "";
 }
 
+/*
+ * The JSON writer appends everything into one growable buffer, which
+ * is handed to the output (an fd or a slaxWriterFunc_t) in large
+ * chunks.  In pretty mode, indentation is written lazily at the
+ * start of each line, so closing braces must outdent before they're
+ * written.
+ */
+typedef struct json_buf_s {
+    char *jb_buf;		/* Output buffer */
+    size_t jb_len;		/* Bytes used in jb_buf */
+    size_t jb_size;		/* Bytes allocated for jb_buf */
+    int jb_indent;		/* Current indent level */
+    int jb_bol;			/* At beginning of line */
+    int jb_fd;			/* Output fd (or -1) */
+    slaxWriterFunc_t jb_func;	/* Output function (if no fd) */
+    void *jb_data;		/* Opaque data for jb_func */
+    int jb_errors;		/* Number of write errors */
+} json_buf_t;
+
+#define JSON_BUF_SIZE	(64 * 1024) /* Flush when we get this big */
+
+/* Forward declarations */
+static int
+jsonWriteChildren (json_buf_t *jbp, xmlNodePtr parent, unsigned flags);
+
+static void
+jsonBufInit (json_buf_t *jbp, int fd, slaxWriterFunc_t func, void *data)
+{
+    bzero(jbp, sizeof(*jbp));
+    jbp->jb_bol = TRUE;
+    jbp->jb_fd = fd;
+    jbp->jb_func = func;
+    jbp->jb_data = data;
+}
+
+static void
+jsonBufFlush (json_buf_t *jbp)
+{
+    size_t off = 0;
+    ssize_t rc;
+
+    if (jbp->jb_len == 0)
+	return;
+
+    if (jbp->jb_fd >= 0) {
+	while (off < jbp->jb_len) {
+	    rc = psu_zio_write(jbp->jb_fd, jbp->jb_buf + off, jbp->jb_len - off);
+	    if (rc < 0) {
+		if (errno == EINTR)
+		    continue;
+		jbp->jb_errors += 1;
+		break;
+	    }
+	    off += rc;
+	}
+
+    } else if (jbp->jb_func) {
+	if ((*jbp->jb_func)(jbp->jb_data, "%.*s",
+			    (int) jbp->jb_len, jbp->jb_buf) < 0)
+	    jbp->jb_errors += 1;
+    }
+
+    jbp->jb_len = 0;
+}
+
+static void
+jsonBufCleanup (json_buf_t *jbp)
+{
+    jsonBufFlush(jbp);
+
+    if (jbp->jb_buf) {
+	xmlFree(jbp->jb_buf);
+	jbp->jb_buf = NULL;
+    }
+}
+
+/*
+ * Make room for "need" more bytes, returning a pointer to them
+ */
+static char *
+jsonBufReserve (json_buf_t *jbp, size_t need)
+{
+    size_t size;
+    char *cp;
+
+    if (jbp->jb_len + need <= jbp->jb_size)
+	return jbp->jb_buf + jbp->jb_len;
+
+    size = jbp->jb_size ?: JSON_BUF_SIZE;
+    while (size < jbp->jb_len + need)
+	size *= 2;
+
+    cp = xmlRealloc(jbp->jb_buf, size);
+    if (cp == NULL)
+	return NULL;
+
+    jbp->jb_buf = cp;
+    jbp->jb_size = size;
+    return jbp->jb_buf + jbp->jb_len;
+}
+
+/*
+ * Start a line, if needed, by writing the indentation
+ */
+static inline void
+jsonBufIndent (json_buf_t *jbp)
+{
+    int width;
+    char *cp;
+
+    if (!jbp->jb_bol)
+	return;
+
+    jbp->jb_bol = FALSE;
+    width = jbp->jb_indent * slaxGetIndent();
+    if (width <= 0)
+	return;
+
+    cp = jsonBufReserve(jbp, width);
+    if (cp == NULL)
+	return;
+
+    memset(cp, ' ', width);
+    jbp->jb_len += width;
+}
+
 static void
-jsonEscape (char *buf, int bufsiz, const char *str)
+jsonBufAppend (json_buf_t *jbp, const char *str, size_t len)
 {
-    char esc;
+    char *cp;
+
+    jsonBufIndent(jbp);
+
+    cp = jsonBufReserve(jbp, len);
+    if (cp == NULL)
+	return;
+
+    memcpy(cp, str, len);
+    jbp->jb_len += len;
+}
 
-    for ( ; str && *str; str++) {
-	if (bufsiz < 1)
+static inline void
+jsonBufAppendStr (json_buf_t *jbp, const char *str)
+{
+    jsonBufAppend(jbp, str, strlen(str));
+}
+
+/*
+ * Find the next byte in (str, len) that might need escaping, which
+ * is anything below 0x20.  The caller checks the byte itself.
+ */
+static inline size_t
+jsonEscapeScan (const char *str, size_t len)
+{
+    size_t i = 0;
+
+#ifdef JSON_HAVE_SSE2
+    const __m128i limit = _mm_set1_epi8(0x1f);
+
+    for ( ; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (str + i));
+	/* max(v, 0x1f) == 0x1f means v <= 0x1f (unsigned) */
+	unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, limit),
+							 limit));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+#endif /* JSON_HAVE_SSE2 */
+
+    for ( ; i < len; i++)
+	if ((unsigned char) str[i] < 0x20)
 	    break;
-	if (*str == '\b')
-	    esc = 'b';
-	else if (*str == '\n')
-	    esc = 'n';
-	else if (*str == '\r')
-	    esc = 'r';
-	else if (*str == '\t')
-	    esc = 't';
-	else {
-	    *buf++ = *str;
-	    bufsiz -= 1;
-	    continue;
+
+    return i;
+}
+
+/*
+ * Append a string, escaping the control characters that JSON has
+ * short escapes for.  Runs of clean bytes are copied in bulk.
+ */
+static void
+jsonBufAppendEscaped (json_buf_t *jbp, const char *str)
+{
+    size_t len, run;
+    char esc[2] = { '\\', 0 };
+
+    if (str == NULL)
+	return;
+
+    len = strlen(str);
+    while (len > 0) {
+	run = jsonEscapeScan(str, len);
+	if (run > 0) {
+	    jsonBufAppend(jbp, str, run);
+	    str += run;
+	    len -= run;
+	    if (len == 0)
+		break;
 	}
 
-	*buf++ = '\\';
-	*buf++ = esc;
-	bufsiz -= 2;
+	switch (*str) {
+	case '\b':
+	    esc[1] = 'b';
+	    break;
+	case '\n':
+	    esc[1] = 'n';
+	    break;
+	case '\r':
+	    esc[1] = 'r';
+	    break;
+	case '\t':
+	    esc[1] = 't';
+	    break;
+	default:
+	    esc[1] = 0;
+	}
+
+	if (esc[1])
+	    jsonBufAppend(jbp, esc, 2);
+	else
+	    jsonBufAppend(jbp, str, 1);
+
+	str += 1;
+	len -= 1;
     }
+}
 
-    *buf = '\0';
+/*
+ * Write a member name, with its quotes and colon
+ */
+static void
+jsonWriteName (json_buf_t *jbp, const char *name, const char *quote)
+{
+    jsonBufAppendStr(jbp, quote);
+    jsonBufAppendEscaped(jbp, name);
+    jsonBufAppendStr(jbp, quote);
+    jsonBufAppend(jbp, ": ", 2);
 }
 
 static void
-jsonWriteNewline (slax_writer_t *swp, int delta, unsigned flags)
+jsonWriteNewline (json_buf_t *jbp, int delta, unsigned flags)
 {
-    if (flags & JWF_PRETTY)
-	slaxWriteNewline(swp, delta);
-    else
-	slaxWrite(swp, " ");
+    if (!(flags & JWF_PRETTY)) {
+	jsonBufAppend(jbp, " ", 1);
+
+    } else {
+	jsonBufIndent(jbp);	/* Even empty lines get indented */
+	jsonBufAppend(jbp, "\n", 1);
+	jbp->jb_bol = TRUE;
+	if (delta > 0)
+	    jbp->jb_indent += delta;
+    }
+
+    if (jbp->jb_len >= JSON_BUF_SIZE)
+	jsonBufFlush(jbp);
+}
+
+/*
+ * Outdent before a closing brace or bracket
+ */
+static inline void
+jsonWriteOutdent (json_buf_t *jbp, unsigned flags)
+{
+    if ((flags & JWF_PRETTY) && jbp->jb_indent > 0)
+	jbp->jb_indent -= 1;
 }
 
 static int
-jsonWriteNode (slax_writer_t *swp, xmlNodePtr nodep,
-		       unsigned flags)
+jsonWriteNode (json_buf_t *jbp, xmlNodePtr nodep, unsigned flags)
 {
     const char *type = jsonAttribValue(nodep, ATT_TYPE);
     const char *name = jsonName(nodep);
@@ -148,37 +377,29 @@ jsonWriteNode (slax_writer_t *swp, xmlNodePtr nodep,
     if (name == NULL)
 	return 0;
 
-    int nlen = strlen(name) + 1;
-    char ename[nlen * 2];
-    jsonEscape(ename, sizeof(ename), name);
-    name = ename;
-
     if (type) {
 	if (streq(type, VAL_NUMBER) || streq(type, VAL_TRUE)
 	        || streq(type, VAL_FALSE) || streq(type, VAL_NULL)) {
-	    const char *value = jsonValue(nodep);
-	    int vlen = strlen(value) + 1;
-	    char evalue[vlen * 2];
-	    jsonEscape(evalue, sizeof(evalue), value);
-	    value = evalue;
-
 	    if (!(flags & JWF_ARRAY))
-		slaxWrite(swp, "%s%s%s: ", quote, name, quote);
-	    slaxWrite(swp, "%s%s", value, comma);
+		jsonWriteName(jbp, name, quote);
+	    jsonBufAppendEscaped(jbp, jsonValue(nodep));
+	    jsonBufAppendStr(jbp, comma);
 
-	    jsonWriteNewline(swp, 0, flags);
+	    jsonWriteNewline(jbp, 0, flags);
 	    return 0;
 
 	} else if (streq(type, VAL_ARRAY)) {
 	    if (!(flags & JWF_ARRAY))
-		slaxWrite(swp, "%s%s%s: ", quote, name, quote);
-	    slaxWrite(swp, "[");
-	    jsonWriteNewline(swp, NEWL_INDENT, flags);
+		jsonWriteName(jbp, name, quote);
+	    jsonBufAppend(jbp, "[", 1);
+	    jsonWriteNewline(jbp, NEWL_INDENT, flags);
 
-	    jsonWriteChildren(swp, nodep, JWF_ARRAY | flags);
+	    jsonWriteChildren(jbp, nodep, JWF_ARRAY | flags);
 
-	    slaxWrite(swp, "]%s", comma );
-	    jsonWriteNewline(swp, NEWL_OUTDENT, flags);
+	    jsonWriteOutdent(jbp, flags);
+	    jsonBufAppend(jbp, "]", 1);
+	    jsonBufAppendStr(jbp, comma);
+	    jsonWriteNewline(jbp, 0, flags);
 	    return 0;
 
 	} else if (streq(type, VAL_MEMBER)) {
@@ -189,69 +410,80 @@ jsonWriteNode (slax_writer_t *swp, xmlNodePtr nodep,
 
     if (jsonHasChildNodes(nodep)) {
 	if (!(flags & JWF_ARRAY))
-	    slaxWrite(swp, "%s%s%s: ", quote, name, quote);
-	slaxWrite(swp, "{");
-	jsonWriteNewline(swp, NEWL_INDENT, flags);
+	    jsonWriteName(jbp, name, quote);
+	jsonBufAppend(jbp, "{", 1);
+	jsonWriteNewline(jbp, NEWL_INDENT, flags);
 
-	jsonWriteChildren(swp, nodep, flags & ~JWF_ARRAY);
+	jsonWriteChildren(jbp, nodep, flags & ~JWF_ARRAY);
 
-	slaxWrite(swp, "}%s", comma);
-	jsonWriteNewline(swp, NEWL_OUTDENT, flags);
+	jsonWriteOutdent(jbp, flags);
+	jsonBufAppend(jbp, "}", 1);
+	jsonBufAppendStr(jbp, comma);
+	jsonWriteNewline(jbp, 0, flags);
 
     } else {
-	const char *value = jsonValue(nodep);
-	int vlen = value ? strlen(value) + 1 : 0;
-	char evalue[vlen * 2 + 1];
-	if (value) {
-	    jsonEscape(evalue, sizeof(evalue), value);
-	    value = evalue;
-	}
-
 	if (!(flags & JWF_ARRAY))
-	    slaxWrite(swp, "%s%s%s: ", quote, name, quote);
+	    jsonWriteName(jbp, name, quote);
 
-	slaxWrite(swp, "\"%s\"%s", value ?: "", comma);
-	jsonWriteNewline(swp, 0, flags);
+	jsonBufAppend(jbp, "\"", 1);
+	jsonBufAppendEscaped(jbp, jsonValue(nodep));
+	jsonBufAppend(jbp, "\"", 1);
+	jsonBufAppendStr(jbp, comma);
+	jsonWriteNewline(jbp, 0, flags);
     }
 
     return 0;
 }
 
 static int
-jsonWriteChildren (slax_writer_t *swp UNUSED, xmlNodePtr parent,
-		   unsigned flags)
+jsonWriteChildren (json_buf_t *jbp, xmlNodePtr parent, unsigned flags)
 {
     xmlNodePtr nodep;
     int rc = 0;
 
     for (nodep = parent->children; nodep; nodep = nodep->next) {
+	/* Once output has failed (or the caller has had enough), stop */
+	if (jbp->jb_errors) {
+	    rc = -1;
+	    break;
+	}
+
 	if (nodep->type == XML_ELEMENT_NODE)
-	    jsonWriteNode(swp, nodep, flags);
+	    jsonWriteNode(jbp, nodep, flags);
     }
 
     return rc;
 }
 
-int
-slaxJsonWriteNode (slaxWriterFunc_t func, void *data, xmlNodePtr nodep,
-		       unsigned flags)
+static int
+jsonWriteTop (json_buf_t *jbp, xmlNodePtr nodep, unsigned flags)
 {
-    slax_writer_t *swp = slaxGetWriter(func, data);
     const char *type = jsonAttribValue(nodep, ATT_TYPE);
 
     if (type && streq(type, VAL_ARRAY))
 	flags |= JWF_ARRAY;
 
-    slaxWrite(swp, (flags & JWF_ARRAY) ? "[" : "{");
-    jsonWriteNewline(swp, NEWL_INDENT, flags);
+    jsonBufAppend(jbp, (flags & JWF_ARRAY) ? "[" : "{", 1);
+    jsonWriteNewline(jbp, NEWL_INDENT, flags);
 
-    int rc = jsonWriteChildren(swp, nodep, flags);
+    int rc = jsonWriteChildren(jbp, nodep, flags);
 
-    slaxWrite(swp, (flags & JWF_ARRAY) ? "]" : "}");
-    slaxWriteNewline(swp, (flags & JWF_PRETTY) ? NEWL_OUTDENT : 0);
+    jsonWriteOutdent(jbp, flags);
+    jsonBufAppend(jbp, (flags & JWF_ARRAY) ? "]" : "}", 1);
+    jsonWriteNewline(jbp, 0, flags | JWF_PRETTY);
 
-    slaxFreeWriter(swp);
-    return rc;
+    jsonBufCleanup(jbp);
+    return rc ?: (jbp->jb_errors ? -1 : 0);
+}
+
+int
+slaxJsonWriteNode (slaxWriterFunc_t func, void *data, xmlNodePtr nodep,
+		       unsigned flags)
+{
+    json_buf_t jb;
+
+    jsonBufInit(&jb, -1, func, data);
+    return jsonWriteTop(&jb, nodep, flags);
 }
 
 int
@@ -261,3 +493,342 @@ slaxJsonWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
     xmlNodePtr nodep = xmlDocGetRootElement(docp);
     return slaxJsonWriteNode(func, data, nodep, flags | JWF_ROOT);
 }
+
+int
+slaxJsonWriteNodeFd (int fd, xmlNodePtr nodep, unsigned flags)
+{
+    json_buf_t jb;
+
+    jsonBufInit(&jb, fd, NULL, NULL);
+    return jsonWriteTop(&jb, nodep, flags);
+}
+
+int
+slaxJsonWriteDocFd (int fd, xmlDocPtr docp, unsigned flags)
+{
+    xmlNodePtr nodep = xmlDocGetRootElement(docp);
+    return slaxJsonWriteNodeFd(fd, nodep, flags | JWF_ROOT);
+}
+
+/*
+ * The streaming writer produces the same JSON as slaxJsonWriteDoc()
+ * from a series of element events, so a document can be converted
+ * without ever being built.  The tree walk above peeks ahead (does
+ * this element have children?  is there a sibling after it?), so we
+ * defer what it doesn't yet know: an element's member name is held
+ * until we know whether it's an object or a string, and the comma
+ * after a value waits until we see another sibling or the parent's
+ * close.  Only the text of the innermost element is buffered.
+ */
+#define JSK_ROOT	1	/* The document's root element */
+#define JSK_PENDING	2	/* Object or string; not yet known */
+#define JSK_OBJECT	3	/* Element with children: an object */
+#define JSK_ARRAY	4	/* type="array" */
+#define JSK_SCALAR	5	/* Number, true, false or null */
+
+typedef struct json_writer_frame_s {
+    char *jwf_name;		/* Member name (for JSK_PENDING) */
+    unsigned jwf_flags;		/* JWF_* flags for this element */
+    uint8_t jwf_kind;		/* What we're writing (JSK_*) */
+    uint8_t jwf_children;	/* Seen a non-text child */
+    uint8_t jwf_comma;		/* A child is written; comma is owed */
+} json_writer_frame_t;
+
+struct slax_json_writer_s {
+    json_buf_t jw_buf;		/* Output buffer */
+    unsigned jw_flags;		/* Flags from the caller */
+    json_writer_frame_t *jw_stack; /* Open elements */
+    unsigned jw_depth;		/* Entries used in jw_stack */
+    unsigned jw_max;		/* Size of jw_stack */
+    unsigned jw_skip;		/* Depth of elements we're ignoring */
+    char *jw_text;		/* Text of the innermost element */
+    size_t jw_text_len;		/* Length of jw_text */
+    size_t jw_text_size;	/* Bytes allocated for jw_text */
+};
+
+slax_json_writer_t *
+slaxJsonWriterOpen (int fd, unsigned flags)
+{
+    slax_json_writer_t *jwp = xmlMalloc(sizeof(*jwp));
+
+    if (jwp == NULL)
+	return NULL;
+
+    bzero(jwp, sizeof(*jwp));
+    jsonBufInit(&jwp->jw_buf, fd, NULL, NULL);
+    jwp->jw_flags = flags | JWF_ROOT;
+
+    return jwp;
+}
+
+static inline json_writer_frame_t *
+jsonWriterTop (slax_json_writer_t *jwp)
+{
+    return jwp->jw_depth ? &jwp->jw_stack[jwp->jw_depth - 1] : NULL;
+}
+
+/*
+ * The text of an element is only its value if it comes before any
+ * other child, as in jsonValue(), so we stop collecting it when we
+ * see one
+ */
+static inline const char *
+jsonWriterValue (slax_json_writer_t *jwp)
+{
+    if (jwp->jw_text_len) {
+	jwp->jw_text[jwp->jw_text_len] = '\0';
+	return jwp->jw_text;
+    }
+
+    return NULL;
+}
+
+/*
+ * The parent is getting a non-text child.  An element that might
+ * have been a string becomes an object, and a comma is owed to the
+ * previous child.
+ */
+static void
+jsonWriterChild (slax_json_writer_t *jwp, json_writer_frame_t *jwfp)
+{
+    json_buf_t *jbp = &jwp->jw_buf;
+
+    if (jwfp->jwf_kind == JSK_PENDING) {
+	jwfp->jwf_kind = JSK_OBJECT;
+	if (!(jwfp->jwf_flags & JWF_ARRAY))
+	    jsonWriteName(jbp, jwfp->jwf_name,
+			  jsonNameNeedsQuotes(jwfp->jwf_name, jwfp->jwf_flags));
+	jsonBufAppend(jbp, "{", 1);
+	jsonWriteNewline(jbp, NEWL_INDENT, jwfp->jwf_flags);
+    }
+
+    if (jwfp->jwf_comma) {
+	jsonBufAppend(jbp, ",", 1);
+	jsonWriteNewline(jbp, 0, jwfp->jwf_flags);
+	jwfp->jwf_comma = FALSE;
+    }
+
+    jwfp->jwf_children = TRUE;
+    jwp->jw_text_len = 0;
+}
+
+void
+slaxJsonWriterElementOpen (slax_json_writer_t *jwp, const char *name,
+			   const char *type)
+{
+    json_buf_t *jbp = &jwp->jw_buf;
+    json_writer_frame_t *parent = jsonWriterTop(jwp), *jwfp;
+    unsigned flags;
+
+    if (jwp->jw_skip || (parent && parent->jwf_kind == JSK_SCALAR)) {
+	/* Scalars only look at their (leading) text */
+	if (jwp->jw_skip++ == 0)
+	    parent->jwf_children = TRUE;
+	return;
+    }
+
+    if (jwp->jw_depth == jwp->jw_max) {
+	unsigned max = jwp->jw_max ? jwp->jw_max * 2 : 32;
+	jwfp = xmlRealloc(jwp->jw_stack, max * sizeof(*jwfp));
+	if (jwfp == NULL) {
+	    jbp->jb_errors += 1;
+	    jwp->jw_skip += 1;
+	    return;
+	}
+
+	jwp->jw_stack = jwfp;
+	jwp->jw_max = max;
+    }
+
+    if (parent) {
+	jsonWriterChild(jwp, parent);
+
+	/* The flags our parent's jsonWriteChildren() would give us */
+	flags = parent->jwf_flags;
+	if (parent->jwf_kind == JSK_ARRAY)
+	    flags |= JWF_ARRAY;
+	else if (parent->jwf_kind != JSK_ROOT)
+	    flags &= ~JWF_ARRAY;
+    } else
+	flags = jwp->jw_flags;
+
+    jwfp = &jwp->jw_stack[jwp->jw_depth++];
+    bzero(jwfp, sizeof(*jwfp));
+    jwp->jw_text_len = 0;
+
+    if (parent == NULL) {
+	/* Just as jsonWriteTop() does */
+	if (type && streq(type, VAL_ARRAY))
+	    flags |= JWF_ARRAY;
+
+	jwfp->jwf_kind = JSK_ROOT;
+	jwfp->jwf_flags = flags;
+	jsonBufAppend(jbp, (flags & JWF_ARRAY) ? "[" : "{", 1);
+	jsonWriteNewline(jbp, NEWL_INDENT, flags);
+	return;
+    }
+
+    jwfp->jwf_kind = JSK_PENDING;
+
+    if (type) {
+	if (streq(type, VAL_NUMBER) || streq(type, VAL_TRUE)
+	        || streq(type, VAL_FALSE) || streq(type, VAL_NULL)) {
+	    jwfp->jwf_kind = JSK_SCALAR;
+
+	} else if (streq(type, VAL_ARRAY)) {
+	    jwfp->jwf_kind = JSK_ARRAY;
+	    if (!(flags & JWF_ARRAY))
+		jsonWriteName(jbp, name, jsonNameNeedsQuotes(name, flags));
+	    jsonBufAppend(jbp, "[", 1);
+	    jsonWriteNewline(jbp, NEWL_INDENT, flags);
+
+	} else if (streq(type, VAL_MEMBER)) {
+	    flags |= JWF_ARRAY;
+	}
+    }
+
+    jwfp->jwf_flags = flags;
+    if (!(flags & JWF_ARRAY) && jwfp->jwf_kind != JSK_ARRAY)
+	jwfp->jwf_name = (char *) xmlStrdup((const xmlChar *) name);
+}
+
+void
+slaxJsonWriterText (slax_json_writer_t *jwp, const char *text, size_t len)
+{
+    json_writer_frame_t *jwfp = jsonWriterTop(jwp);
+
+    /* Only an element with nothing but text can use it */
+    if (jwp->jw_skip || jwfp == NULL || jwfp->jwf_children
+	    || (jwfp->jwf_kind != JSK_PENDING && jwfp->jwf_kind != JSK_SCALAR))
+	return;
+
+    size_t need = jwp->jw_text_len + len + 1;
+    if (need > jwp->jw_text_size) {
+	size_t size = jwp->jw_text_size ?: BUFSIZ;
+	while (size < need)
+	    size *= 2;
+
+	char *cp = xmlRealloc(jwp->jw_text, size);
+	if (cp == NULL) {
+	    jwp->jw_buf.jb_errors += 1;
+	    return;
+	}
+
+	jwp->jw_text = cp;
+	jwp->jw_text_size = size;
+    }
+
+    memcpy(jwp->jw_text + jwp->jw_text_len, text, len);
+    jwp->jw_text_len += len;
+}
+
+void
+slaxJsonWriterMarkup (slax_json_writer_t *jwp)
+{
+    json_writer_frame_t *jwfp = jsonWriterTop(jwp);
+
+    /* Comments and PIs are children too, as far as the tree walk knows */
+    if (jwp->jw_skip || jwfp == NULL)
+	return;
+
+    if (jwfp->jwf_kind == JSK_SCALAR)
+	jwfp->jwf_children = TRUE;
+    else
+	jsonWriterChild(jwp, jwfp);
+}
+
+void
+slaxJsonWriterElementClose (slax_json_writer_t *jwp)
+{
+    json_buf_t *jbp = &jwp->jw_buf;
+    json_writer_frame_t *jwfp = jsonWriterTop(jwp);
+    const char *name;
+    unsigned flags;
+
+    if (jwp->jw_skip) {
+	jwp->jw_skip -= 1;
+	return;
+    }
+
+    if (jwfp == NULL)
+	return;
+
+    flags = jwfp->jwf_flags;
+    name = jwfp->jwf_name;
+
+    if (jwfp->jwf_comma)
+	jsonWriteNewline(jbp, 0, flags);
+
+    switch (jwfp->jwf_kind) {
+    case JSK_ROOT:
+	jsonWriteOutdent(jbp, flags);
+	jsonBufAppend(jbp, (flags & JWF_ARRAY) ? "]" : "}", 1);
+	jsonWriteNewline(jbp, 0, flags | JWF_PRETTY);
+	break;
+
+    case JSK_SCALAR:
+	if (!(flags & JWF_ARRAY))
+	    jsonWriteName(jbp, name, jsonNameNeedsQuotes(name, flags));
+	jsonBufAppendEscaped(jbp, jsonWriterValue(jwp));
+	break;
+
+    case JSK_PENDING:
+	if (!(flags & JWF_ARRAY))
+	    jsonWriteName(jbp, name, jsonNameNeedsQuotes(name, flags));
+	jsonBufAppend(jbp, "\"", 1);
+	jsonBufAppendEscaped(jbp, jsonWriterValue(jwp));
+	jsonBufAppend(jbp, "\"", 1);
+	break;
+
+    case JSK_OBJECT:
+	jsonWriteOutdent(jbp, flags);
+	jsonBufAppend(jbp, "}", 1);
+	break;
+
+    case JSK_ARRAY:
+	jsonWriteOutdent(jbp, flags);
+	jsonBufAppend(jbp, "]", 1);
+	break;
+    }
+
+    if (jwfp->jwf_name)
+	xmlFree(jwfp->jwf_name);
+
+    jwp->jw_depth -= 1;
+    jwp->jw_text_len = 0;
+
+    /* Our comma (and newline) wait to see if we have a next sibling */
+    jwfp = jsonWriterTop(jwp);
+    if (jwfp)
+	jwfp->jwf_comma = TRUE;
+}
+
+int
+slaxJsonWriterClose (slax_json_writer_t *jwp)
+{
+    int rc;
+
+    if (jwp == NULL)
+	return -1;
+
+    /* An unfinished document means the input was cut short */
+    rc = (jwp->jw_depth || jwp->jw_buf.jb_errors) ? -1 : 0;
+
+    while (jwp->jw_depth > 0) {
+	jwp->jw_depth -= 1;
+	if (jwp->jw_stack[jwp->jw_depth].jwf_name)
+	    xmlFree(jwp->jw_stack[jwp->jw_depth].jwf_name);
+    }
+
+    jsonBufCleanup(&jwp->jw_buf);
+    if (jwp->jw_buf.jb_errors)
+	rc = -1;
+
+    if (jwp->jw_stack)
+	xmlFree(jwp->jw_stack);
+    if (jwp->jw_text)
+	xmlFree(jwp->jw_text);
+    xmlFree(jwp);
+
+    return rc;
+}
@@ -17,6 +17,48 @@ int
 slaxJsonWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
 		      unsigned flags);
 
+/*
+ * Write JSON directly to a file descriptor, skipping the
+ * slaxWriterFunc_t callback
+ */
+int
+slaxJsonWriteNodeFd (int fd, xmlNodePtr nodep, unsigned flags);
+
+int
+slaxJsonWriteDocFd (int fd, xmlDocPtr docp, unsigned flags);
+
+/*
+ * Write JSON from a stream of element events instead of a document,
+ * giving the same output as slaxJsonWriteDocFd() would for the
+ * document those events describe.  The first element opened is the
+ * root.  'name' is the member name (the "name" attribute if there is
+ * one, otherwise the element's local name) and 'type' is the value
+ * of the "type" attribute (or NULL).  Text is passed as it arrives;
+ * comments and PIs must be reported via slaxJsonWriterMarkup() since
+ * the tree writer counts them as children.  slaxJsonWriterClose()
+ * returns -1 if there were write errors or the root wasn't closed.
+ */
+typedef struct slax_json_writer_s slax_json_writer_t;
+
+slax_json_writer_t *
+slaxJsonWriterOpen (int fd, unsigned flags);
+
+void
+slaxJsonWriterElementOpen (slax_json_writer_t *jwp, const char *name,
+			   const char *type);
+
+void
+slaxJsonWriterText (slax_json_writer_t *jwp, const char *text, size_t len);
+
+void
+slaxJsonWriterMarkup (slax_json_writer_t *jwp);
+
+void
+slaxJsonWriterElementClose (slax_json_writer_t *jwp);
+
+int
+slaxJsonWriterClose (slax_json_writer_t *jwp);
+
 #define JWF_ROOT	(1<<0)	/* Root node */
 #define JWF_ARRAY	(1<<1)	/* Inside array */
 #define JWF_NODESET	(1<<2)	/* Top of a nodeset */
@@ -48,6 +48,14 @@ int
 slaxWriteDoc(slaxWriterFunc_t func, void *data, struct _xmlDoc *docp,
 	     int partial, const char *vers);
 
+/*
+ * Write an XSLT document in SLAX format to a file descriptor, using
+ * large buffered writes rather than a callback per line.  Any stdio
+ * stream using the descriptor should be flushed first.
+ */
+int
+slaxWriteDocFd(int fd, struct _xmlDoc *docp, int partial, const char *vers);
+
 /*
  * Read a SLAX stylesheet from an open file descriptor.
  * Written as a clone of libxml2's xmlCtxtReadFd().
@@ -75,6 +83,15 @@ struct _xmlDoc *
 slaxLoadBuffer (const char *filename, char *input,
 		struct _xmlDict *dict, int partial);
 
+/*
+ * Restart the numbering of the variables generated while converting
+ * SLAX to XSLT, so the next file loaded gets the same names it would
+ * get as the first file loaded by a process.  Don't use this between
+ * a script and the files it includes.
+ */
+void
+slaxResetNames (void);
+
 /*
  * Prefer text expressions be stored in <xsl:text> elements
  * THIS FUNCTION IS DEPRECATED.
@@ -88,12 +105,91 @@ slaxSetTextAsElement (int enable);
 void
 slaxDumpToFd (int fd, struct _xmlDoc *docp, int);
 
+/*
+ * Make a libxml2 save context for a file descriptor, writing through
+ * any compressed stream (libpsu/psuzio.h) attached to it
+ */
+struct _xmlSaveCtxt *
+slaxSaveToFd (int fd, const char *encoding, int options);
+
 /*
  * Dump a formatted version of the XSL tree to stdout
  */
 void
 slaxDump (struct _xmlDoc *docp);
 
+/*
+ * Cache the XSLT trees built from SLAX files in the given directory,
+ * keyed by a hash of each file's contents, so loading an unchanged
+ * script (or include) skips the SLAX parser.  NULL turns the cache off.
+ */
+void
+slaxCacheSetDir (const char *dir);
+
+/*
+ * Keep slax:dampen() records in a shared-memory ring per tag instead
+ * of rewriting a file on every call
+ */
+void
+slaxDampenSetShared (int enable);
+
+/*
+ * Turn on the engine counters that cost something to collect
+ * (templates, xpath steps, nodes and extension function calls).
+ * Must be called before extension functions are registered.
+ */
+void
+slaxStatsEnable (void);
+
+/*
+ * Get ready to count a transform, and collect its numbers after it's run
+ */
+void
+slaxStatsStart (struct _xsltTransformContext *ctxt);
+
+void
+slaxStatsFinish (struct _xsltTransformContext *ctxt);
+
+/*
+ * Dump the engine counters as JSON
+ */
+void
+slaxStatsDump (FILE *fp);
+
+/*
+ * Report the number of loads found in the cache, and not found
+ */
+void
+slaxCacheStats (unsigned *hitsp, unsigned *missesp);
+
+/*
+ * Keep the trees of loaded SLAX files in memory, so that a file
+ * imported or included by several scripts is parsed only once per
+ * process.  This is on by default; turning it off frees the trees.
+ */
+void
+slaxCacheSetMemory (int enable);
+
+/*
+ * Report the number of loads found in the memory cache, and not found
+ */
+void
+slaxCacheMemoryStats (unsigned *hitsp, unsigned *missesp);
+
+/*
+ * Passes for the optimizer to run over each stylesheet after it's
+ * loaded; none are run by default
+ */
+#define SLAXOPT_FOLD	(1<<0)	/* Evaluate constant expressions */
+#define SLAXOPT_RTF	(1<<1)	/* Turn string-only RTF variables into strings */
+#define SLAXOPT_HOIST	(1<<2)	/* Move invariant variables out of loops */
+#define SLAXOPT_DEAD	(1<<3)	/* Drop named templates nothing calls */
+#define SLAXOPT_ALL	(SLAXOPT_FOLD | SLAXOPT_RTF | SLAXOPT_HOIST \
+			 | SLAXOPT_DEAD)
+
+void
+slaxOptimizeSetFlags (unsigned flags);
+
 void
 slaxSetIndent (int indent);
 
@@ -116,6 +212,34 @@ typedef void (*slaxTraceCallback_t)(void *, struct _xmlNode *,
 void
 slaxTraceEnable (slaxTraceCallback_t func, void *data);
 
+/**
+ * Enable tracing with a callback for the calling thread only,
+ * in place of the one given to slaxTraceEnable.  A NULL function
+ * removes the override.
+ */
+void
+slaxTraceEnableThread (slaxTraceCallback_t func, void *data);
+
+/**
+ * Record trace data in a binary in-memory ring (per thread) instead
+ * of formatting it as it's made.  The ring takes precedence over the
+ * callback.  Zero turns the ring off.
+ *
+ * @entries number of records kept (rounded up to a power of two)
+ * @return zero on success
+ */
+int
+slaxTraceRingEnable (unsigned entries);
+
+/**
+ * Format and write the contents of the trace ring (oldest first).
+ * Safe to call from a signal handler.
+ *
+ * @fd file descriptor to write to
+ */
+void
+slaxTraceRingDump (int fd);
+
 /* ----------------------------------------------------------------------
  * Progress messages
  */
@@ -131,6 +255,13 @@ typedef void (*slaxProgressCallback_t)(void *, const char *fmt, ...);
 void
 slaxProgressEnable (slaxProgressCallback_t func, void *data);
 
+/**
+ * Enable progress messages with a callback for the calling thread
+ * only; a NULL function removes the override
+ */
+void
+slaxProgressEnableThread (slaxProgressCallback_t func, void *data);
+
 /**
  * Determine if progress messages are written to user or trace file.
  */
@@ -143,6 +274,7 @@ slaxEmitProgressMessages (int);
 #define SIF_HISTORY	(1<<0)	/* Add input line to history */
 #define SIF_SECRET	(1<<1)	/* Secret/password text (do not echo) */
 #define SIF_NO_TTY	(1<<2)	/* Avoid the real terminal tty (use stdin) */
+#define SIF_ASYNC	(1<<3)	/* slaxIoUseStdio: write output in a thread */
 
 /*
  * IO hooks
@@ -157,9 +289,20 @@ slaxIoRegister (slaxInputCallback_t input_callback,
 		slaxOutputCallback_t output_callback,
 		xmlOutputWriteCallback raw_write,
 		slaxErrorCallback_t error_callback);
+
+/*
+ * Register callbacks for the calling thread, overriding the ones
+ * given to slaxIoRegister; all NULLs removes the override
+ */
+void
+slaxIoRegisterThread (slaxInputCallback_t input_callback,
+		      slaxOutputCallback_t output_callback,
+		      xmlOutputWriteCallback raw_write,
+		      slaxErrorCallback_t error_callback);
 #endif /* XMLCALL */
 
 void slaxIoUseStdio (unsigned flags);	/* Use the stock std{in,out} */
+void slaxIoFlush (void);		/* Wait for (SIF_ASYNC) output */
 void slaxTraceToFile (FILE *fp);
 
 /**
@@ -306,4 +449,12 @@ slaxDynMarkLoaded (const char *);
 void
 slaxDynMarkExslt (void);
 
+/*
+ * Register the EXSLT extension functions, with our own (faster)
+ * versions of set:distinct, set:intersection, set:difference and
+ * str:tokenize in place of libexslt's
+ */
+void
+slaxExsltRegisterAll (void);
+
 #endif /* LIBSLAX_SLAX_H */
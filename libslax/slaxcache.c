@@ -0,0 +1,1021 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxcache.c -- on-disk cache of compiled SLAX files
+ *
+ * Turning a SLAX file into its XSLT tree means running the lexer and
+ * parser, which is most of the cost of a short script run.  When a
+ * cache directory is set, we save the resulting tree in a compact
+ * binary form, in a file named for a hash of the SLAX file's name and
+ * contents (and our version).  Later loads of the same contents read
+ * the tree straight back.  Since imports and includes of SLAX files
+ * come through slaxLoadFile() as well, each of them is cached by its
+ * own contents, so changing any one of them only recompiles that one.
+ *
+ * The binary form is a walk of the tree.  Each node is a tag byte
+ * followed by its fields; a zero tag ends a list of children.  Strings
+ * are a 32-bit length and the bytes.  Namespaces are written where
+ * they are defined and referenced later by index, so the tree comes
+ * back with the same xmlNs layout.  Line numbers are kept, so errors
+ * and the debugger see the lines of the SLAX source.  All values are
+ * in host byte order; the magic number catches files from machines
+ * that disagree.
+ */
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <libpsu/psuthread.h>
+#include <libxml/parserInternals.h>
+
+#include "slaxcache.h"
+
+#define SLAX_CACHE_MAGIC	0x534c5843 /* "SLXC" */
+#define SLAX_CACHE_FORMAT	1	/* Bump when the layout changes */
+#define SLAX_CACHE_SUFFIX	".slaxc" /* Suffix for our files */
+
+/* Node tags */
+#define SCT_END		0	/* End of a list of children */
+#define SCT_ELEMENT	'E'	/* Element */
+#define SCT_TEXT	'T'	/* Text */
+#define SCT_COMMENT	'C'	/* Comment */
+#define SCT_CDATA	'D'	/* CDATA section */
+#define SCT_PI		'P'	/* Processing instruction */
+#define SCT_ENTITY_REF	'R'	/* Entity reference */
+
+#define SC_NULL_STRING	UINT32_MAX /* String length for a NULL string */
+#define SC_NS_NONE	0	/* Namespace reference: no namespace */
+#define SC_NS_OTHER	UINT32_MAX /* Namespace not defined in our tree */
+
+/* The header of a cache file */
+typedef struct slax_cache_header_s {
+    uint32_t sch_magic;		/* SLAX_CACHE_MAGIC */
+    uint32_t sch_format;	/* SLAX_CACHE_FORMAT */
+    uint64_t sch_hash;		/* Hash of the source (slaxCacheHash) */
+    uint64_t sch_len;		/* Length of the source */
+} slax_cache_header_t;
+
+/* State while writing a tree */
+typedef struct slax_cache_writer_s {
+    uint8_t *scw_buf;		/* Output buffer */
+    size_t scw_len;		/* Bytes used in scw_buf */
+    size_t scw_size;		/* Bytes allocated for scw_buf */
+    xmlNsPtr *scw_ns;		/* Namespaces we've written */
+    unsigned scw_ns_count;	/* Number of entries used in scw_ns */
+    unsigned scw_ns_max;	/* Number of entries allocated in scw_ns */
+    int scw_failed;		/* Something went wrong; toss the file */
+} slax_cache_writer_t;
+
+/* State while reading a tree */
+typedef struct slax_cache_reader_s {
+    const uint8_t *scr_cp;	/* Current position */
+    const uint8_t *scr_ep;	/* End of the data */
+    xmlDocPtr scr_docp;		/* Document we're building */
+    xmlNsPtr *scr_ns;		/* Namespaces we've read */
+    unsigned scr_ns_count;	/* Number of entries used in scr_ns */
+    unsigned scr_ns_max;	/* Number of entries allocated in scr_ns */
+    int scr_failed;		/* Data is truncated or malformed */
+} slax_cache_reader_t;
+
+static char *slaxCacheDir;	/* Directory for our files (or NULL) */
+static unsigned slaxCacheHits;	/* Number of loads found in the cache */
+static unsigned slaxCacheMisses; /* Number of loads not found */
+
+void
+slaxCacheSetDir (const char *dir)
+{
+    if (slaxCacheDir)
+	xmlFree(slaxCacheDir);
+
+    slaxCacheDir = (dir && *dir) ? (char *) xmlStrdup((const xmlChar *) dir)
+	: NULL;
+}
+
+int
+slaxCacheEnabled (void)
+{
+    return (slaxCacheDir != NULL);
+}
+
+void
+slaxCacheStats (unsigned *hitsp, unsigned *missesp)
+{
+    if (hitsp)
+	*hitsp = slaxCacheHits;
+    if (missesp)
+	*missesp = slaxCacheMisses;
+}
+
+char *
+slaxCacheReadFile (FILE *file, size_t *lenp)
+{
+    struct stat st;
+
+    if (fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode))
+	return NULL;
+
+    size_t len = st.st_size;
+    char *buf = xmlMalloc(len + 1);
+    if (buf == NULL)
+	return NULL;
+
+    if (fread(buf, 1, len, file) != len || fseek(file, 0, SEEK_SET) < 0) {
+	xmlFree(buf);
+	rewind(file);
+	return NULL;
+    }
+
+    buf[len] = '\0';
+    *lenp = len;
+    return buf;
+}
+
+/*
+ * FNV-1a, over our version, the filename and the contents.  The
+ * filename goes in since it's recorded in the tree (as the URL).
+ */
+static uint64_t
+slaxCacheHashAdd (uint64_t hash, const char *buf, size_t len)
+{
+    const uint8_t *cp = (const uint8_t *) buf, *ep = cp + len;
+
+    for ( ; cp < ep; cp++) {
+	hash ^= *cp;
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t
+slaxCacheHash (const char *filename, const char *buf, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = slaxCacheHashAdd(hash, LIBSLAX_VERSION,
+			    sizeof(LIBSLAX_VERSION));
+    hash = slaxCacheHashAdd(hash, filename, strlen(filename) + 1);
+    hash = slaxCacheHashAdd(hash, buf, len);
+
+    return hash;
+}
+
+static char *
+slaxCachePath (char *path, size_t size, uint64_t hash)
+{
+    snprintf(path, size, "%s/%016" PRIx64 "%s",
+	     slaxCacheDir, hash, SLAX_CACHE_SUFFIX);
+    return path;
+}
+
+/**
+ * Build the path of a file in the cache directory for something other
+ * than a compiled script, named by a hash of "name" plus a suffix
+ */
+char *
+slaxCacheNamePath (char *path, size_t size, const char *name,
+		   const char *suffix, int create)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    if (slaxCacheDir == NULL)
+	return NULL;
+
+    if (create && mkdir(slaxCacheDir, 0755) < 0 && errno != EEXIST)
+	return NULL;
+
+    hash = slaxCacheHashAdd(hash, LIBSLAX_VERSION, sizeof(LIBSLAX_VERSION));
+    hash = slaxCacheHashAdd(hash, name, strlen(name) + 1);
+
+    snprintf(path, size, "%s/%016" PRIx64 "%s", slaxCacheDir, hash, suffix);
+    return path;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+slaxCacheWriteData (slax_cache_writer_t *scwp, const void *data, size_t len)
+{
+    if (scwp->scw_failed)
+	return;
+
+    if (scwp->scw_len + len > scwp->scw_size) {
+	size_t size = scwp->scw_size ? scwp->scw_size : BUFSIZ;
+	while (size < scwp->scw_len + len)
+	    size *= 2;
+
+	uint8_t *newp = xmlRealloc(scwp->scw_buf, size);
+	if (newp == NULL) {
+	    scwp->scw_failed = TRUE;
+	    return;
+	}
+
+	scwp->scw_buf = newp;
+	scwp->scw_size = size;
+    }
+
+    memcpy(scwp->scw_buf + scwp->scw_len, data, len);
+    scwp->scw_len += len;
+}
+
+static void
+slaxCacheWrite8 (slax_cache_writer_t *scwp, uint8_t val)
+{
+    slaxCacheWriteData(scwp, &val, sizeof(val));
+}
+
+static void
+slaxCacheWrite16 (slax_cache_writer_t *scwp, uint16_t val)
+{
+    slaxCacheWriteData(scwp, &val, sizeof(val));
+}
+
+static void
+slaxCacheWrite32 (slax_cache_writer_t *scwp, uint32_t val)
+{
+    slaxCacheWriteData(scwp, &val, sizeof(val));
+}
+
+static void
+slaxCacheWriteString (slax_cache_writer_t *scwp, const xmlChar *str)
+{
+    if (str == NULL) {
+	slaxCacheWrite32(scwp, SC_NULL_STRING);
+	return;
+    }
+
+    uint32_t len = xmlStrlen(str);
+    slaxCacheWrite32(scwp, len);
+    slaxCacheWriteData(scwp, str, len);
+}
+
+static void
+slaxCacheWriteNsDef (slax_cache_writer_t *scwp, xmlNsPtr nsp)
+{
+    if (scwp->scw_ns_count >= scwp->scw_ns_max) {
+	unsigned max = scwp->scw_ns_max ? scwp->scw_ns_max * 2 : 32;
+	xmlNsPtr *newp = xmlRealloc(scwp->scw_ns, max * sizeof(*newp));
+	if (newp == NULL) {
+	    scwp->scw_failed = TRUE;
+	    return;
+	}
+
+	scwp->scw_ns = newp;
+	scwp->scw_ns_max = max;
+    }
+
+    scwp->scw_ns[scwp->scw_ns_count++] = nsp;
+    slaxCacheWriteString(scwp, nsp->prefix);
+    slaxCacheWriteString(scwp, nsp->href);
+}
+
+static void
+slaxCacheWriteNsRef (slax_cache_writer_t *scwp, xmlNsPtr nsp)
+{
+    unsigned i;
+
+    if (nsp == NULL) {
+	slaxCacheWrite32(scwp, SC_NS_NONE);
+	return;
+    }
+
+    for (i = 0; i < scwp->scw_ns_count; i++) {
+	if (scwp->scw_ns[i] == nsp) {
+	    slaxCacheWrite32(scwp, i + 1);
+	    return;
+	}
+    }
+
+    /* Defined outside the tree (e.g. the "xml" namespace) */
+    slaxCacheWrite32(scwp, SC_NS_OTHER);
+    slaxCacheWriteString(scwp, nsp->prefix);
+    slaxCacheWriteString(scwp, nsp->href);
+}
+
+static void
+slaxCacheWriteNodes (slax_cache_writer_t *scwp, xmlNodePtr nodep)
+{
+    xmlNsPtr nsp;
+    xmlAttrPtr attrp;
+    uint32_t count;
+
+    for ( ; nodep && !scwp->scw_failed; nodep = nodep->next) {
+	switch (nodep->type) {
+	case XML_ELEMENT_NODE:
+	    slaxCacheWrite8(scwp, SCT_ELEMENT);
+	    slaxCacheWrite16(scwp, nodep->line);
+	    slaxCacheWriteString(scwp, nodep->name);
+
+	    for (count = 0, nsp = nodep->nsDef; nsp; nsp = nsp->next)
+		count += 1;
+	    slaxCacheWrite32(scwp, count);
+	    for (nsp = nodep->nsDef; nsp; nsp = nsp->next)
+		slaxCacheWriteNsDef(scwp, nsp);
+
+	    slaxCacheWriteNsRef(scwp, nodep->ns);
+
+	    for (count = 0, attrp = nodep->properties; attrp;
+		 attrp = attrp->next)
+		count += 1;
+	    slaxCacheWrite32(scwp, count);
+	    for (attrp = nodep->properties; attrp; attrp = attrp->next) {
+		slaxCacheWriteNsRef(scwp, attrp->ns);
+		slaxCacheWriteString(scwp, attrp->name);
+		slaxCacheWriteNodes(scwp, attrp->children);
+	    }
+
+	    slaxCacheWriteNodes(scwp, nodep->children);
+	    break;
+
+	case XML_TEXT_NODE:
+	    slaxCacheWrite8(scwp, SCT_TEXT);
+	    slaxCacheWrite16(scwp, nodep->line);
+	    slaxCacheWrite8(scwp, (nodep->name == xmlStringTextNoenc));
+	    slaxCacheWriteString(scwp, nodep->content);
+	    break;
+
+	case XML_COMMENT_NODE:
+	    slaxCacheWrite8(scwp, SCT_COMMENT);
+	    slaxCacheWrite16(scwp, nodep->line);
+	    slaxCacheWriteString(scwp, nodep->content);
+	    break;
+
+	case XML_CDATA_SECTION_NODE:
+	    slaxCacheWrite8(scwp, SCT_CDATA);
+	    slaxCacheWrite16(scwp, nodep->line);
+	    slaxCacheWriteString(scwp, nodep->content);
+	    break;
+
+	case XML_PI_NODE:
+	    slaxCacheWrite8(scwp, SCT_PI);
+	    slaxCacheWrite16(scwp, nodep->line);
+	    slaxCacheWriteString(scwp, nodep->name);
+	    slaxCacheWriteString(scwp, nodep->content);
+	    break;
+
+	case XML_ENTITY_REF_NODE:
+	    slaxCacheWrite8(scwp, SCT_ENTITY_REF);
+	    slaxCacheWriteString(scwp, nodep->name);
+	    break;
+
+	default:
+	    /* Nothing the SLAX parser makes, so we don't cache it */
+	    scwp->scw_failed = TRUE;
+	}
+    }
+
+    slaxCacheWrite8(scwp, SCT_END);
+}
+
+void
+slaxCacheSave (const char *filename, const char *buf, size_t len,
+	       xmlDocPtr docp)
+{
+    char path[MAXPATHLEN], tmp[MAXPATHLEN + 16]; /* Room for ".<pid>" */
+    slax_cache_writer_t scw;
+    slax_cache_header_t sch;
+    FILE *file;
+
+    if (slaxCacheDir == NULL || filename == NULL || docp == NULL)
+	return;
+
+    bzero(&sch, sizeof(sch));
+    sch.sch_magic = SLAX_CACHE_MAGIC;
+    sch.sch_format = SLAX_CACHE_FORMAT;
+    sch.sch_hash = slaxCacheHash(filename, buf, len);
+    sch.sch_len = len;
+
+    slaxCachePath(path, sizeof(path), sch.sch_hash);
+    snprintf(tmp, sizeof(tmp), "%s.%u", path, (unsigned) getpid());
+
+    bzero(&scw, sizeof(scw));
+    slaxCacheWriteData(&scw, &sch, sizeof(sch));
+    slaxCacheWriteNodes(&scw, docp->children);
+    xmlFree(scw.scw_ns);
+
+    if (scw.scw_failed) {
+	slaxLog("slax: cache: cannot save '%s'", filename);
+	xmlFree(scw.scw_buf);
+	return;
+    }
+
+    /* Make the directory, in case it's our first time */
+    if (mkdir(slaxCacheDir, 0755) < 0 && errno != EEXIST) {
+	xmlFree(scw.scw_buf);
+	return;
+    }
+
+    file = fopen(tmp, "w");
+    if (file == NULL) {
+	slaxLog("slax: cache: cannot create '%s': %s", tmp, strerror(errno));
+	xmlFree(scw.scw_buf);
+	return;
+    }
+
+    if (fwrite(scw.scw_buf, 1, scw.scw_len, file) != scw.scw_len)
+	scw.scw_failed = TRUE;
+    if (fclose(file) != 0)
+	scw.scw_failed = TRUE;
+
+    /* Rename into place, so readers never see a partial file */
+    if (scw.scw_failed || rename(tmp, path) < 0) {
+	slaxLog("slax: cache: cannot save '%s'", filename);
+	unlink(tmp);
+    } else {
+	slaxLog("slax: cache: saved '%s' as '%s'", filename, path);
+    }
+
+    xmlFree(scw.scw_buf);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static const void *
+slaxCacheReadData (slax_cache_reader_t *scrp, size_t len)
+{
+    const uint8_t *cp = scrp->scr_cp;
+
+    if (scrp->scr_failed || (size_t) (scrp->scr_ep - cp) < len) {
+	scrp->scr_failed = TRUE;
+	return NULL;
+    }
+
+    scrp->scr_cp += len;
+    return cp;
+}
+
+static uint8_t
+slaxCacheRead8 (slax_cache_reader_t *scrp)
+{
+    const uint8_t *cp = slaxCacheReadData(scrp, sizeof(uint8_t));
+    return cp ? *cp : SCT_END;
+}
+
+static uint16_t
+slaxCacheRead16 (slax_cache_reader_t *scrp)
+{
+    uint16_t val = 0;
+    const void *cp = slaxCacheReadData(scrp, sizeof(val));
+    if (cp)
+	memcpy(&val, cp, sizeof(val));
+    return val;
+}
+
+static uint32_t
+slaxCacheRead32 (slax_cache_reader_t *scrp)
+{
+    uint32_t val = 0;
+    const void *cp = slaxCacheReadData(scrp, sizeof(val));
+    if (cp)
+	memcpy(&val, cp, sizeof(val));
+    return val;
+}
+
+/*
+ * Return a copy of the next string, which the caller must free.
+ * NULL strings (and failures) come back as NULL.
+ */
+static xmlChar *
+slaxCacheReadString (slax_cache_reader_t *scrp)
+{
+    uint32_t len = slaxCacheRead32(scrp);
+    if (len == SC_NULL_STRING || scrp->scr_failed)
+	return NULL;
+
+    const xmlChar *cp = slaxCacheReadData(scrp, len);
+    return cp ? xmlStrndup(cp, len) : NULL;
+}
+
+static xmlNsPtr
+slaxCacheReadNsRef (slax_cache_reader_t *scrp, xmlNodePtr nodep)
+{
+    uint32_t ref = slaxCacheRead32(scrp);
+    xmlNsPtr nsp = NULL;
+
+    if (ref == SC_NS_NONE)
+	return NULL;
+
+    if (ref == SC_NS_OTHER) {
+	xmlChar *prefix = slaxCacheReadString(scrp);
+	xmlChar *href = slaxCacheReadString(scrp);
+
+	if (href) {
+	    nsp = xmlSearchNsByHref(scrp->scr_docp, nodep, href);
+	    if (nsp == NULL)
+		nsp = xmlNewNs(nodep, href, prefix);
+	}
+
+	xmlFree(prefix);
+	xmlFree(href);
+
+	if (nsp == NULL)
+	    scrp->scr_failed = TRUE;
+	return nsp;
+    }
+
+    if (ref > scrp->scr_ns_count) {
+	scrp->scr_failed = TRUE;
+	return NULL;
+    }
+
+    return scrp->scr_ns[ref - 1];
+}
+
+static void
+slaxCacheReadNsDef (slax_cache_reader_t *scrp, xmlNodePtr nodep)
+{
+    xmlChar *prefix = slaxCacheReadString(scrp);
+    xmlChar *href = slaxCacheReadString(scrp);
+    xmlNsPtr nsp = NULL;
+
+    if (!scrp->scr_failed)
+	nsp = xmlNewNs(nodep, href, prefix);
+
+    xmlFree(prefix);
+    xmlFree(href);
+
+    if (nsp == NULL) {
+	scrp->scr_failed = TRUE;
+	return;
+    }
+
+    if (scrp->scr_ns_count >= scrp->scr_ns_max) {
+	unsigned max = scrp->scr_ns_max ? scrp->scr_ns_max * 2 : 32;
+	xmlNsPtr *newp = xmlRealloc(scrp->scr_ns, max * sizeof(*newp));
+	if (newp == NULL) {
+	    scrp->scr_failed = TRUE;
+	    return;
+	}
+
+	scrp->scr_ns = newp;
+	scrp->scr_ns_max = max;
+    }
+
+    scrp->scr_ns[scrp->scr_ns_count++] = nsp;
+}
+
+static void
+slaxCacheReadNodes (slax_cache_reader_t *scrp, xmlNodePtr parent);
+
+static xmlNodePtr
+slaxCacheReadElement (slax_cache_reader_t *scrp, xmlNodePtr parent)
+{
+    unsigned short line = slaxCacheRead16(scrp);
+    xmlChar *name = slaxCacheReadString(scrp);
+    xmlNodePtr nodep;
+    uint32_t i, count;
+
+    if (name == NULL) {
+	scrp->scr_failed = TRUE;
+	return NULL;
+    }
+
+    nodep = xmlNewDocNode(scrp->scr_docp, NULL, name, NULL);
+    xmlFree(name);
+    if (nodep == NULL) {
+	scrp->scr_failed = TRUE;
+	return NULL;
+    }
+
+    nodep->line = line;
+    xmlAddChild(parent, nodep);
+
+    count = slaxCacheRead32(scrp);
+    for (i = 0; i < count && !scrp->scr_failed; i++)
+	slaxCacheReadNsDef(scrp, nodep);
+
+    xmlSetNs(nodep, slaxCacheReadNsRef(scrp, nodep));
+
+    count = slaxCacheRead32(scrp);
+    for (i = 0; i < count && !scrp->scr_failed; i++) {
+	xmlNsPtr nsp = slaxCacheReadNsRef(scrp, nodep);
+	xmlChar *aname = slaxCacheReadString(scrp);
+	xmlAttrPtr attrp = aname ? xmlNewNsProp(nodep, nsp, aname, NULL)
+	    : NULL;
+
+	xmlFree(aname);
+	if (attrp == NULL) {
+	    scrp->scr_failed = TRUE;
+	    break;
+	}
+
+	slaxCacheReadNodes(scrp, (xmlNodePtr) attrp);
+    }
+
+    if (!scrp->scr_failed)
+	slaxCacheReadNodes(scrp, nodep);
+
+    return nodep;
+}
+
+static void
+slaxCacheReadNodes (slax_cache_reader_t *scrp, xmlNodePtr parent)
+{
+    xmlNodePtr nodep;
+    xmlChar *name, *content;
+    unsigned short line;
+    int noenc;
+
+    while (!scrp->scr_failed) {
+	uint8_t tag = slaxCacheRead8(scrp);
+	nodep = NULL;
+
+	switch (tag) {
+	case SCT_END:
+	    return;
+
+	case SCT_ELEMENT:
+	    slaxCacheReadElement(scrp, parent);
+	    continue;
+
+	case SCT_TEXT:
+	    line = slaxCacheRead16(scrp);
+	    noenc = slaxCacheRead8(scrp);
+	    content = slaxCacheReadString(scrp);
+	    nodep = xmlNewDocText(scrp->scr_docp, content);
+	    if (nodep) {
+		if (noenc)
+		    nodep->name = xmlStringTextNoenc;
+		nodep->line = line;
+	    }
+	    xmlFree(content);
+	    break;
+
+	case SCT_COMMENT:
+	    line = slaxCacheRead16(scrp);
+	    content = slaxCacheReadString(scrp);
+	    nodep = xmlNewDocComment(scrp->scr_docp, content);
+	    if (nodep)
+		nodep->line = line;
+	    xmlFree(content);
+	    break;
+
+	case SCT_CDATA:
+	    line = slaxCacheRead16(scrp);
+	    content = slaxCacheReadString(scrp);
+	    nodep = xmlNewCDataBlock(scrp->scr_docp, content,
+				     xmlStrlen(content));
+	    if (nodep)
+		nodep->line = line;
+	    xmlFree(content);
+	    break;
+
+	case SCT_PI:
+	    line = slaxCacheRead16(scrp);
+	    name = slaxCacheReadString(scrp);
+	    content = slaxCacheReadString(scrp);
+	    nodep = name ? xmlNewDocPI(scrp->scr_docp, name, content) : NULL;
+	    if (nodep)
+		nodep->line = line;
+	    xmlFree(name);
+	    xmlFree(content);
+	    break;
+
+	case SCT_ENTITY_REF:
+	    name = slaxCacheReadString(scrp);
+	    nodep = name ? xmlNewReference(scrp->scr_docp, name) : NULL;
+	    xmlFree(name);
+	    break;
+	}
+
+	if (nodep == NULL) {
+	    scrp->scr_failed = TRUE;
+	    return;
+	}
+
+	/* Don't let xmlAddChild merge our text nodes away */
+	if (parent->last && parent->last->type == XML_TEXT_NODE
+		&& nodep->type == XML_TEXT_NODE) {
+	    nodep->parent = parent;
+	    nodep->prev = parent->last;
+	    parent->last->next = nodep;
+	    parent->last = nodep;
+	} else {
+	    xmlAddChild(parent, nodep);
+	}
+    }
+}
+
+/*
+ * Read the whole cache file into memory
+ */
+static char *
+slaxCacheReadPath (const char *path, size_t *lenp)
+{
+    struct stat st;
+    char *buf = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+	    && (size_t) st.st_size >= sizeof(slax_cache_header_t)) {
+	buf = xmlMalloc(st.st_size);
+	if (buf && read(fd, buf, st.st_size) != st.st_size) {
+	    xmlFree(buf);
+	    buf = NULL;
+	}
+	*lenp = st.st_size;
+    }
+
+    close(fd);
+    return buf;
+}
+
+/*
+ * Build a document from a tree in our binary form (without the
+ * header), using the dictionary the way slaxBuildDoc() does
+ */
+static xmlDocPtr
+slaxCacheBuildDoc (const uint8_t *cp, size_t len, xmlDictPtr dict,
+		   const char *filename)
+{
+    slax_cache_reader_t scr;
+
+    bzero(&scr, sizeof(scr));
+    scr.scr_cp = cp;
+    scr.scr_ep = cp + len;
+
+    scr.scr_docp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
+    if (scr.scr_docp == NULL)
+	return NULL;
+
+    scr.scr_docp->standalone = 1;
+    if (dict) {
+	scr.scr_docp->dict = dict;
+	xmlDictReference(dict);
+    } else {
+	scr.scr_docp->dict = xmlDictCreate();
+    }
+
+    slaxCacheReadNodes(&scr, (xmlNodePtr) scr.scr_docp);
+    xmlFree(scr.scr_ns);
+
+    if (scr.scr_failed || xmlDocGetRootElement(scr.scr_docp) == NULL) {
+	xmlFreeDoc(scr.scr_docp);
+	return NULL;
+    }
+
+    scr.scr_docp->URL = xmlStrdup((const xmlChar *) filename);
+    return scr.scr_docp;
+}
+
+xmlDocPtr
+slaxCacheLoad (const char *filename, const char *buf, size_t len,
+	       xmlDictPtr dict)
+{
+    char path[MAXPATHLEN];
+    slax_cache_header_t sch;
+    xmlDocPtr docp;
+    size_t clen = 0;
+    char *cbuf;
+
+    if (slaxCacheDir == NULL || filename == NULL)
+	return NULL;
+
+    uint64_t hash = slaxCacheHash(filename, buf, len);
+    slaxCachePath(path, sizeof(path), hash);
+
+    cbuf = slaxCacheReadPath(path, &clen);
+    if (cbuf == NULL) {
+	slaxCacheMisses += 1;
+	return NULL;
+    }
+
+    memcpy(&sch, cbuf, sizeof(sch));
+    if (sch.sch_magic != SLAX_CACHE_MAGIC
+	    || sch.sch_format != SLAX_CACHE_FORMAT
+	    || sch.sch_hash != hash || sch.sch_len != len) {
+	slaxLog("slax: cache: ignoring stale '%s'", path);
+	xmlFree(cbuf);
+	slaxCacheMisses += 1;
+	return NULL;
+    }
+
+    docp = slaxCacheBuildDoc((const uint8_t *) cbuf + sizeof(sch),
+			     clen - sizeof(sch), dict, filename);
+    xmlFree(cbuf);
+
+    if (docp == NULL) {
+	slaxLog("slax: cache: ignoring bad '%s'", path);
+	slaxCacheMisses += 1;
+	return NULL;
+    }
+
+    slaxCacheHits += 1;
+    slaxLog("slax: cache: loaded '%s' from '%s'", filename, path);
+
+    return docp;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * The memory cache keeps the trees of the files we've loaded, in the
+ * same binary form, so a library that's imported or included by
+ * several scripts is only parsed once per process.  Entries are found
+ * by the name the file was loaded as (which is recorded in the tree)
+ * and are only used while the file looks the same: same inode, size,
+ * and change times.  Nothing is read from a file that we find here.
+ */
+#define SLAX_CACHE_MEM_BUCKETS	64 /* Hash buckets (a power of two) */
+#define SLAX_CACHE_MEM_MAX	(64 << 20) /* Most bytes of trees we keep */
+
+typedef struct slax_cache_mem_s {
+    struct slax_cache_mem_s *scm_next; /* Next entry in our bucket */
+    char *scm_filename;		/* Name the file was loaded as */
+    dev_t scm_dev;		/* Device holding the file */
+    ino_t scm_ino;		/* Inode of the file */
+    off_t scm_size;		/* Size of the file */
+    time_t scm_mtime;		/* Modification time of the file */
+    time_t scm_ctime;		/* Change time of the file */
+    uint8_t *scm_data;		/* Tree, in our binary form */
+    size_t scm_len;		/* Length of scm_data */
+} slax_cache_mem_t;
+
+static psu_mutex_t slaxCacheMemMutex = PSU_MUTEX_INITIALIZER;
+static slax_cache_mem_t *slaxCacheMem[SLAX_CACHE_MEM_BUCKETS];
+static int slaxCacheMemOff;	/* Memory cache is turned off */
+static size_t slaxCacheMemBytes; /* Bytes of trees we're holding */
+static unsigned slaxCacheMemHits; /* Loads found in the memory cache */
+static unsigned slaxCacheMemMisses; /* Loads not found */
+
+static unsigned
+slaxCacheMemBucket (const char *filename)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = slaxCacheHashAdd(hash, filename, strlen(filename));
+    return hash & (SLAX_CACHE_MEM_BUCKETS - 1);
+}
+
+/*
+ * Find the entry for a file; the caller holds slaxCacheMemMutex
+ */
+static slax_cache_mem_t *
+slaxCacheMemFind (const char *filename, struct stat *stp)
+{
+    slax_cache_mem_t *scmp;
+
+    for (scmp = slaxCacheMem[slaxCacheMemBucket(filename)]; scmp;
+	 scmp = scmp->scm_next) {
+	if (scmp->scm_ino == stp->st_ino && scmp->scm_dev == stp->st_dev
+		&& streq(scmp->scm_filename, filename))
+	    return scmp;
+    }
+
+    return NULL;
+}
+
+static int
+slaxCacheMemStat (FILE *file, struct stat *stp)
+{
+    if (fstat(fileno(file), stp) < 0 || !S_ISREG(stp->st_mode))
+	return -1;
+    return 0;
+}
+
+xmlDocPtr
+slaxCacheMemLoad (const char *filename, FILE *file, xmlDictPtr dict)
+{
+    slax_cache_mem_t *scmp;
+    xmlDocPtr docp = NULL;
+    struct stat st;
+
+    if (slaxCacheMemOff || filename == NULL
+	    || slaxCacheMemStat(file, &st) < 0)
+	return NULL;
+
+    psu_mutex_lock(&slaxCacheMemMutex);
+
+    scmp = slaxCacheMemFind(filename, &st);
+    if (scmp && scmp->scm_size == st.st_size
+	    && scmp->scm_mtime == st.st_mtime
+	    && scmp->scm_ctime == st.st_ctime)
+	docp = slaxCacheBuildDoc(scmp->scm_data, scmp->scm_len,
+				 dict, filename);
+
+    if (docp)
+	slaxCacheMemHits += 1;
+    else
+	slaxCacheMemMisses += 1;
+
+    psu_mutex_unlock(&slaxCacheMemMutex);
+
+    if (docp)
+	slaxLog("slax: cache: reused tree for '%s'", filename);
+
+    return docp;
+}
+
+void
+slaxCacheMemSave (const char *filename, FILE *file, xmlDocPtr docp)
+{
+    slax_cache_mem_t *scmp;
+    slax_cache_writer_t scw;
+    struct stat st;
+
+    if (slaxCacheMemOff || filename == NULL || docp == NULL
+	    || slaxCacheMemStat(file, &st) < 0)
+	return;
+
+    bzero(&scw, sizeof(scw));
+    slaxCacheWriteNodes(&scw, docp->children);
+    xmlFree(scw.scw_ns);
+
+    if (scw.scw_failed) {
+	xmlFree(scw.scw_buf);
+	return;
+    }
+
+    psu_mutex_lock(&slaxCacheMemMutex);
+
+    /* An entry for an older version of the file is updated in place */
+    scmp = slaxCacheMemFind(filename, &st);
+    if (scmp == NULL) {
+	if (slaxCacheMemBytes + scw.scw_len > SLAX_CACHE_MEM_MAX)
+	    goto done;
+
+	scmp = xmlMalloc(sizeof(*scmp));
+	if (scmp == NULL)
+	    goto done;
+
+	bzero(scmp, sizeof(*scmp));
+	scmp->scm_filename = (char *) xmlStrdup((const xmlChar *) filename);
+	if (scmp->scm_filename == NULL) {
+	    xmlFree(scmp);
+	    goto done;
+	}
+
+	unsigned bucket = slaxCacheMemBucket(filename);
+	scmp->scm_next = slaxCacheMem[bucket];
+	slaxCacheMem[bucket] = scmp;
+	scmp->scm_dev = st.st_dev;
+	scmp->scm_ino = st.st_ino;
+    }
+
+    slaxCacheMemBytes -= scmp->scm_len;
+    xmlFree(scmp->scm_data);
+
+    scmp->scm_size = st.st_size;
+    scmp->scm_mtime = st.st_mtime;
+    scmp->scm_ctime = st.st_ctime;
+    scmp->scm_data = scw.scw_buf;
+    scmp->scm_len = scw.scw_len;
+    slaxCacheMemBytes += scw.scw_len;
+    scw.scw_buf = NULL;
+
+ done:
+    psu_mutex_unlock(&slaxCacheMemMutex);
+    xmlFree(scw.scw_buf);
+}
+
+void
+slaxCacheMemFlush (void)
+{
+    slax_cache_mem_t *scmp, *nextp;
+    unsigned i;
+
+    psu_mutex_lock(&slaxCacheMemMutex);
+
+    for (i = 0; i < SLAX_CACHE_MEM_BUCKETS; i++) {
+	for (scmp = slaxCacheMem[i]; scmp; scmp = nextp) {
+	    nextp = scmp->scm_next;
+	    xmlFree(scmp->scm_filename);
+	    xmlFree(scmp->scm_data);
+	    xmlFree(scmp);
+	}
+	slaxCacheMem[i] = NULL;
+    }
+
+    slaxCacheMemBytes = 0;
+
+    psu_mutex_unlock(&slaxCacheMemMutex);
+}
+
+void
+slaxCacheSetMemory (int enable)
+{
+    slaxCacheMemOff = !enable;
+    if (!enable)
+	slaxCacheMemFlush();
+}
+
+void
+slaxCacheMemoryStats (unsigned *hitsp, unsigned *missesp)
+{
+    if (hitsp)
+	*hitsp = slaxCacheMemHits;
+    if (missesp)
+	*missesp = slaxCacheMemMisses;
+}
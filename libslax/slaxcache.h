@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxcache.h -- on-disk cache of compiled SLAX files
+ */
+
+#ifndef LIBSLAX_SLAXCACHE_H
+#define LIBSLAX_SLAXCACHE_H
+
+/**
+ * Is the cache turned on (via slaxCacheSetDir)?
+ */
+int
+slaxCacheEnabled (void);
+
+/**
+ * Read the whole contents of a SLAX file, leaving the file positioned
+ * back at the start.  Only regular files can be cached, so we return
+ * NULL for anything else.
+ *
+ * @param file File pointer for input
+ * @param lenp Length of the contents (returned)
+ * @return contents (caller must free) or NULL
+ */
+char *
+slaxCacheReadFile (FILE *file, size_t *lenp);
+
+/**
+ * Look for a cached copy of the XSLT tree for this SLAX file
+ *
+ * @param filename Name of the file
+ * @param buf Contents of the file
+ * @param len Length of the contents
+ * @param dict libxml2 dictionary (or NULL)
+ * @return xml document pointer, or NULL if not cached
+ */
+xmlDocPtr
+slaxCacheLoad (const char *filename, const char *buf, size_t len,
+	       xmlDictPtr dict);
+
+/**
+ * Record the XSLT tree for this SLAX file in the cache
+ *
+ * @param filename Name of the file
+ * @param buf Contents of the file
+ * @param len Length of the contents
+ * @param docp xml document built from those contents
+ */
+void
+slaxCacheSave (const char *filename, const char *buf, size_t len,
+	       xmlDocPtr docp);
+
+/**
+ * Look for the tree of a file we've already loaded in this process,
+ * which is only used if the file hasn't changed since
+ *
+ * @param filename Name of the file
+ * @param file File pointer for input (only used to fstat the file)
+ * @param dict libxml2 dictionary (or NULL)
+ * @return xml document pointer, or NULL if not found
+ */
+xmlDocPtr
+slaxCacheMemLoad (const char *filename, FILE *file, xmlDictPtr dict);
+
+/**
+ * Keep the tree of a file in memory, for later loads of the same file
+ *
+ * @param filename Name of the file
+ * @param file File pointer for input (only used to fstat the file)
+ * @param docp xml document built from the file
+ */
+void
+slaxCacheMemSave (const char *filename, FILE *file, xmlDocPtr docp);
+
+/**
+ * Throw away all the trees in the memory cache
+ */
+void
+slaxCacheMemFlush (void);
+
+/**
+ * Build the path of a file in the cache directory for something other
+ * than a compiled script
+ *
+ * @param path Buffer for the path
+ * @param size Size of the buffer
+ * @param name Name of the thing being cached (hashed into the path)
+ * @param suffix Suffix for the file
+ * @param create Make the cache directory if it doesn't exist
+ * @return path, or NULL if the cache is off
+ */
+char *
+slaxCacheNamePath (char *path, size_t size, const char *name,
+		   const char *suffix, int create);
+
+#endif /* LIBSLAX_SLAXCACHE_H */
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxdampen.c -- shared-memory store for slax:dampen()
+ *
+ * The file-based store rewrites and renames a file on every call,
+ * which is exactly the wrong thing to be doing in the middle of an
+ * event storm.  This store keeps each tag's recent hits in a small
+ * ring of timestamps in a file that every process maps shared.  An
+ * update is a scan of the ring and one slot write, done under a
+ * spinlock in the mapping itself, with no file I/O beyond the open.
+ *
+ * The ring is all zeros when created, which is a valid, empty ring,
+ * so there's no initialization step to race over.  The lock word
+ * holds the pid of its owner, so if a process dies holding it, the
+ * next caller can notice and take it over.
+ */
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <libpsu/psutime.h>
+
+#include "slaxext.h"
+#include "slaxdampen.h"
+
+#define SLAX_DAMPEN_SLOTS	256 /* Timestamps kept per tag */
+#define SLAX_DAMPEN_MAGIC	0x53444d31 /* 'SDM1' */
+#define SLAX_DAMPEN_SPINS	1000 /* Spins before we start yielding */
+#define SLAX_DAMPEN_STALE	(2 * USEC_PER_SEC) /* Lock is old news */
+
+typedef struct slax_dampen_ring_s {
+    uint32_t sdr_magic;		/* SLAX_DAMPEN_MAGIC (or zero if new) */
+    uint32_t sdr_lock;		/* Pid of the lock holder (or zero) */
+    uint32_t sdr_next;		/* Next slot to write */
+    uint32_t sdr_pad;		/* Unused (alignment) */
+    uint64_t sdr_slot[SLAX_DAMPEN_SLOTS]; /* Times (usecs), zero is empty */
+} slax_dampen_ring_t;
+
+static int slaxDampenShm;	/* Use the shared store */
+
+void
+slaxDampenSetShared (int enable)
+{
+    slaxDampenShm = enable;
+}
+
+int
+slaxDampenSharedEnabled (void)
+{
+    return slaxDampenShm;
+}
+
+static uint64_t
+slaxDampenNow (void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
+
+/*
+ * Take the ring's lock.  If the holder has gone away, or has held it
+ * for far longer than any update takes, we take it over.
+ */
+static void
+slaxDampenLock (slax_dampen_ring_t *sdrp)
+{
+    uint32_t me = (uint32_t) getpid(), owner;
+    uint64_t start = 0;
+    int spins = 0;
+
+    for (;;) {
+	owner = 0;
+	if (__atomic_compare_exchange_n(&sdrp->sdr_lock, &owner, me, FALSE,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    return;
+
+	if (++spins < SLAX_DAMPEN_SPINS)
+	    continue;
+
+	sched_yield();
+
+	if (start == 0) {
+	    start = slaxDampenNow();
+	    continue;
+	}
+
+	if ((kill((pid_t) owner, 0) < 0 && errno == ESRCH)
+		|| slaxDampenNow() - start > SLAX_DAMPEN_STALE) {
+	    if (__atomic_compare_exchange_n(&sdrp->sdr_lock, &owner, me,
+					    FALSE, __ATOMIC_ACQUIRE,
+					    __ATOMIC_RELAXED))
+		return;
+	    start = 0;
+	}
+    }
+}
+
+static void
+slaxDampenUnlock (slax_dampen_ring_t *sdrp)
+{
+    __atomic_store_n(&sdrp->sdr_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Map the ring for this tag, creating it if needed
+ */
+static slax_dampen_ring_t *
+slaxDampenMap (const char *filename)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+    void *addr;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s.ring", filename);
+
+    fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, &st) < 0)
+	goto fail;
+
+    if (st.st_size == 0) {
+	/* New ring; zeros are a valid empty ring */
+	if (ftruncate(fd, sizeof(slax_dampen_ring_t)) < 0)
+	    goto fail;
+
+    } else if (st.st_size != sizeof(slax_dampen_ring_t))
+	goto fail;		/* Not one of ours */
+
+    addr = mmap(NULL, sizeof(slax_dampen_ring_t), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (addr == MAP_FAILED) ? NULL : addr;
+
+ fail:
+    close(fd);
+    return NULL;
+}
+
+int
+slaxDampenShared (const char *filename, int max, long freq_secs,
+		  double freq_double)
+{
+    slax_dampen_ring_t *sdrp;
+    struct timeval tv, rec_tv, diff;
+    uint64_t now, when;
+    int i, count = 0, rc;
+
+    if (max > SLAX_DAMPEN_SLOTS)
+	return -1;		/* We can't hold that many */
+
+    sdrp = slaxDampenMap(filename);
+    if (sdrp == NULL)
+	return -1;
+
+    slaxDampenLock(sdrp);
+
+    /*
+     * Take the time while holding the lock, so the ring stays in time
+     * order even when processes race each other here.
+     */
+    gettimeofday(&tv, NULL);
+    now = (uint64_t) tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+
+    if (sdrp->sdr_magic != SLAX_DAMPEN_MAGIC) {
+	bzero(sdrp->sdr_slot, sizeof(sdrp->sdr_slot));
+	sdrp->sdr_next = 0;
+	sdrp->sdr_magic = SLAX_DAMPEN_MAGIC;
+    }
+
+    for (i = 0; i < SLAX_DAMPEN_SLOTS; i++) {
+	when = sdrp->sdr_slot[i];
+	if (when == 0)
+	    continue;
+
+	rec_tv.tv_sec = when / USEC_PER_SEC;
+	rec_tv.tv_usec = when % USEC_PER_SEC;
+
+	if (slaxExtTimeDiff(&tv, &rec_tv, &diff) < 0) {
+	    /*
+	     * A record from the future means a time warp (or someone
+	     * fiddling with the clock).  As with the files, we pretend
+	     * we have no meaningful records.
+	     */
+	    bzero(sdrp->sdr_slot, sizeof(sdrp->sdr_slot));
+	    sdrp->sdr_next = 0;
+	    count = 0;
+	    break;
+	}
+
+	if (diff.tv_sec < freq_secs
+		|| slaxExtTimeCompare(&diff, freq_double))
+	    count += 1;
+	else
+	    sdrp->sdr_slot[i] = 0; /* Expired */
+    }
+
+    if (count < max) {
+	/*
+	 * Records go in time order, so the slot we overwrite is the
+	 * oldest.  Since count < max <= slots, it has expired.
+	 */
+	sdrp->sdr_slot[sdrp->sdr_next] = now ?: 1;
+	sdrp->sdr_next = (sdrp->sdr_next + 1) % SLAX_DAMPEN_SLOTS;
+	rc = TRUE;
+    } else
+	rc = FALSE;
+
+    slaxDampenUnlock(sdrp);
+    munmap(sdrp, sizeof(*sdrp));
+
+    return rc;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxdampen.h -- shared-memory store for slax:dampen()
+ */
+
+#ifndef LIBSLAX_SLAXDAMPEN_H
+#define LIBSLAX_SLAXDAMPEN_H
+
+/**
+ * Is the shared-memory store turned on (via slaxDampenSetShared)?
+ */
+int
+slaxDampenSharedEnabled (void);
+
+/**
+ * Record a slax:dampen() hit in the shared ring for the given base
+ * filename, if there have been fewer than "max" hits in the window.
+ * The time of the hit is taken under the ring's lock.
+ * The window matches the file-based store: a record counts if it is
+ * less than freq_secs (rounded) or freq_double seconds old.
+ *
+ * @param filename Base filename for this tag (".ring" is appended)
+ * @param max Maximum number of hits in the window
+ * @param freq_secs Window size, rounded to seconds
+ * @param freq_double Window size, in seconds
+ * @return TRUE if recorded, FALSE if dampened, or -1 if the shared
+ * store can't be used (and the caller should use the files)
+ */
+int
+slaxDampenShared (const char *filename, int max, long freq_secs,
+		  double freq_double);
+
+#endif /* LIBSLAX_SLAXDAMPEN_H */
@@ -72,6 +72,7 @@
 #include <libxml/xmlIO.h>
 #include <libxslt/variables.h>
 #include <libxslt/transform.h>
+#include <libexslt/exslt.h>
 
 #include "slaxinternals.h"
 #include <libslax/slax.h>
@@ -183,12 +184,103 @@ typedef struct slaxDebugBreakpoint_s {
     char *dbp_where;		/* Text name as given by user */
     xmlNodePtr dbp_inst;	/* Node we are breaking on */
     uint dbp_num;		/* Breakpoint number */
+    struct slaxDebugBreakpoint_s *dbp_hash_next; /* Next in hash bucket */
+    char *dbp_cond;		/* Condition ("break <loc> if <cond>") */
+    xmlXPathCompExprPtr dbp_comp; /* Compiled condition */
+    xmlNsPtr *dbp_nslist;	/* Namespaces in scope at dbp_inst */
+    int dbp_nscount;		/* Number of namespaces in dbp_nslist */
+    unsigned long dbp_hits;	/* Times the condition was true */
 } slaxDebugBreakpoint_t;
 
 TAILQ_HEAD(slaxDebugBpList_s, slaxDebugBreakpoint_s) slaxDebugBreakpoints;
 
 static uint slaxDebugBreakpointNumber;
 
+/*
+ * Breakpoints are checked on every instruction, so we hash them by
+ * the node they're set on.  The list above keeps them in order for
+ * "info breakpoints" and "delete".
+ */
+#define SLAX_DEBUG_BP_BUCKETS 64 /* Must be a power of two */
+static slaxDebugBreakpoint_t *slaxDebugBpHash[SLAX_DEBUG_BP_BUCKETS];
+
+static inline slaxDebugBreakpoint_t **
+slaxDebugBpBucket (xmlNodePtr node)
+{
+    uintptr_t key = (uintptr_t) node;
+
+    key ^= key >> 12;
+    return &slaxDebugBpHash[(key >> 4) & (SLAX_DEBUG_BP_BUCKETS - 1)];
+}
+
+static void
+slaxDebugBpHashAdd (slaxDebugBreakpoint_t *dbp)
+{
+    slaxDebugBreakpoint_t **bucketp;
+
+    if (dbp->dbp_inst == NULL)
+	return;
+
+    bucketp = slaxDebugBpBucket(dbp->dbp_inst);
+    dbp->dbp_hash_next = *bucketp;
+    *bucketp = dbp;
+}
+
+static void
+slaxDebugBpHashRemove (slaxDebugBreakpoint_t *dbp)
+{
+    slaxDebugBreakpoint_t **dbpp;
+
+    if (dbp->dbp_inst == NULL)
+	return;
+
+    for (dbpp = slaxDebugBpBucket(dbp->dbp_inst); *dbpp;
+	 dbpp = &(*dbpp)->dbp_hash_next) {
+	if (*dbpp == dbp) {
+	    *dbpp = dbp->dbp_hash_next;
+	    break;
+	}
+    }
+
+    dbp->dbp_hash_next = NULL;
+}
+
+static slaxDebugBreakpoint_t *
+slaxDebugBpHashFind (xmlNodePtr node)
+{
+    slaxDebugBreakpoint_t *dbp;
+
+    for (dbp = *slaxDebugBpBucket(node); dbp; dbp = dbp->dbp_hash_next)
+	if (dbp->dbp_inst == node)
+	    return dbp;
+
+    return NULL;
+}
+
+/*
+ * Index of the nodes in a stylesheet document by line number, built
+ * the first time we look for a line in that document.  The index is
+ * sorted by line and holds the first node (in document order) for
+ * each line, which is what a walk of the tree would find.  The
+ * documents are freed when the script is reloaded, so
+ * slaxDebugSetStylesheet() drops all the indexes.
+ */
+typedef struct slaxDebugLineEntry_s {
+    long dle_line;		/* Line number */
+    unsigned dle_seq;		/* Position in document order */
+    xmlNodePtr dle_node;	/* First node on that line */
+} slaxDebugLineEntry_t;
+
+typedef struct slaxDebugLineIndex_s {
+    struct slaxDebugLineIndex_s *dli_next; /* Next index (linked list) */
+    xmlDocPtr dli_doc;		/* Document we index */
+    slaxDebugLineEntry_t *dli_entries; /* Entries, sorted by line */
+    unsigned dli_count;		/* Number of entries */
+    unsigned dli_size;		/* Number of entries allocated */
+} slaxDebugLineIndex_t;
+
+static slaxDebugLineIndex_t *slaxDebugLineIndexes;
+
 /*
  * Various display mode 
  */
@@ -306,21 +398,133 @@ slaxDebugGetTemplate (slaxDebugState_t *statep, xmlNodePtr inst)
     return NULL;
 }
 
-static xmlNodePtr
-slaxDebugGetNodeByLine (xmlNodePtr node, int lineno)
+static void
+slaxDebugLineIndexClear (void)
+{
+    slaxDebugLineIndex_t *dlip;
+
+    while ((dlip = slaxDebugLineIndexes) != NULL) {
+	slaxDebugLineIndexes = dlip->dli_next;
+	xmlFreeAndEasy(dlip->dli_entries);
+	xmlFree(dlip);
+    }
+}
+
+static int
+slaxDebugLineIndexAdd (slaxDebugLineIndex_t *dlip, xmlNodePtr node)
 {
     for ( ; node; node = node->next) {
-	if (lineno == xmlGetLineNo(node))
-	    return node;
+	long lineno = xmlGetLineNo(node);
 
-	if (node->children) {
-	    xmlNodePtr answer;
-	    answer = slaxDebugGetNodeByLine(node->children, lineno);
-	    if (answer)
-		return answer;
+	if (lineno > 0) {
+	    if (dlip->dli_count == dlip->dli_size) {
+		unsigned size = dlip->dli_size ? dlip->dli_size * 2 : 256;
+		slaxDebugLineEntry_t *entries;
+
+		entries = xmlRealloc(dlip->dli_entries,
+				     size * sizeof(*entries));
+		if (entries == NULL)
+		    return -1;
+
+		dlip->dli_entries = entries;
+		dlip->dli_size = size;
+	    }
+
+	    dlip->dli_entries[dlip->dli_count].dle_line = lineno;
+	    dlip->dli_entries[dlip->dli_count].dle_seq = dlip->dli_count;
+	    dlip->dli_entries[dlip->dli_count].dle_node = node;
+	    dlip->dli_count += 1;
 	}
+
+	if (node->children && slaxDebugLineIndexAdd(dlip, node->children))
+	    return -1;
     }
 
+    return 0;
+}
+
+static int
+slaxDebugLineEntryCompare (const void *av, const void *bv)
+{
+    const slaxDebugLineEntry_t *a = av, *b = bv;
+
+    if (a->dle_line != b->dle_line)
+	return (a->dle_line < b->dle_line) ? -1 : 1;
+
+    return (a->dle_seq < b->dle_seq) ? -1 : (a->dle_seq > b->dle_seq);
+}
+
+static slaxDebugLineIndex_t *
+slaxDebugLineIndexGet (xmlDocPtr docp)
+{
+    slaxDebugLineIndex_t *dlip;
+    unsigned i, j;
+
+    for (dlip = slaxDebugLineIndexes; dlip; dlip = dlip->dli_next)
+	if (dlip->dli_doc == docp)
+	    return dlip;
+
+    dlip = xmlMalloc(sizeof(*dlip));
+    if (dlip == NULL)
+	return NULL;
+
+    bzero(dlip, sizeof(*dlip));
+    dlip->dli_doc = docp;
+
+    if (slaxDebugLineIndexAdd(dlip, docp->children)) {
+	xmlFreeAndEasy(dlip->dli_entries);
+	xmlFree(dlip);
+	return NULL;
+    }
+
+    /* Sort by line, then keep only the first node for each line */
+    if (dlip->dli_count > 1)
+	qsort(dlip->dli_entries, dlip->dli_count,
+	      sizeof(dlip->dli_entries[0]), slaxDebugLineEntryCompare);
+
+    for (i = j = 0; i < dlip->dli_count; i++) {
+	if (j > 0 && dlip->dli_entries[j - 1].dle_line
+		== dlip->dli_entries[i].dle_line)
+	    continue;
+	dlip->dli_entries[j++] = dlip->dli_entries[i];
+    }
+    dlip->dli_count = j;
+
+    dlip->dli_next = slaxDebugLineIndexes;
+    slaxDebugLineIndexes = dlip;
+
+    return dlip;
+}
+
+/*
+ * Return the first node of a document on the given line
+ */
+static xmlNodePtr
+slaxDebugGetNodeByLine (xmlDocPtr docp, int lineno)
+{
+    slaxDebugLineIndex_t *dlip;
+    unsigned lo, hi, mid;
+
+    if (docp == NULL)
+	return NULL;
+
+    dlip = slaxDebugLineIndexGet(docp);
+    if (dlip == NULL)
+	return NULL;
+
+    lo = 0;
+    hi = dlip->dli_count;
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (dlip->dli_entries[mid].dle_line < lineno)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if (lo < dlip->dli_count && dlip->dli_entries[lo].dle_line == lineno)
+	return dlip->dli_entries[lo].dle_node;
+
     return NULL;
 }
 
@@ -338,7 +542,7 @@ slaxDebugGetNodeByFilename (slaxDebugState_t *statep,
     if (style == NULL)
 	return NULL;
 
-    node = slaxDebugGetNodeByLine(style->doc->children, lineno);
+    node = slaxDebugGetNodeByLine(style->doc, lineno);
 
     return node;
 }
@@ -371,7 +575,7 @@ slaxDebugGetScriptNode (slaxDebugState_t *statep, const char *arg)
     /*
      * Get the node for the given linenumber from the stylesheet
      */
-    node = slaxDebugGetNodeByLine((xmlNodePtr) style->doc, lineno);
+    node = slaxDebugGetNodeByLine(style->doc, lineno);
 
     return node;
 }
@@ -445,6 +649,94 @@ slaxDebugOutputXpath (xmlXPathObjectPtr xpath, const char *tag, int full)
     }
 }
  
+/*
+ * Drop the compiled condition of a breakpoint
+ */
+static void
+slaxDebugBreakpointUncompile (slaxDebugBreakpoint_t *dbp)
+{
+    if (dbp->dbp_comp) {
+	xmlXPathFreeCompExpr(dbp->dbp_comp);
+	dbp->dbp_comp = NULL;
+    }
+
+    xmlFreeAndEasy(dbp->dbp_nslist);
+    dbp->dbp_nslist = NULL;
+    dbp->dbp_nscount = 0;
+}
+
+/*
+ * Compile the condition of a breakpoint, once, so we only have to
+ * evaluate it when the breakpoint's instruction is reached.  The
+ * namespaces are those in scope at the instruction, as they would
+ * be for an expression written there.
+ */
+static int
+slaxDebugBreakpointCompile (slaxDebugState_t *statep,
+			    slaxDebugBreakpoint_t *dbp)
+{
+    slaxDebugBreakpointUncompile(dbp);
+
+    if (dbp->dbp_cond == NULL || dbp->dbp_inst == NULL)
+	return 0;
+
+    dbp->dbp_comp = slaxXpathCompile(statep->ds_script, dbp->dbp_cond);
+    if (dbp->dbp_comp == NULL)
+	return -1;
+
+    dbp->dbp_nslist = xmlGetNsList(dbp->dbp_inst->doc, dbp->dbp_inst);
+    while (dbp->dbp_nslist && dbp->dbp_nslist[dbp->dbp_nscount])
+	dbp->dbp_nscount += 1;
+
+    return 0;
+}
+
+static void
+slaxDebugBreakpointFree (slaxDebugBreakpoint_t *dbp)
+{
+    slaxDebugBreakpointUncompile(dbp);
+    xmlFreeAndEasy(dbp->dbp_cond);
+    xmlFreeAndEasy(dbp->dbp_where);
+    xmlFree(dbp);
+}
+
+/*
+ * Evaluate the condition for a breakpoint.  Errors count as true,
+ * so the user gets to see (and fix) them.
+ */
+static int
+slaxDebugBreakpointTest (slaxDebugState_t *statep,
+			 slaxDebugBreakpoint_t *dbp)
+{
+    xsltTransformContextPtr ctxt = statep->ds_ctxt;
+    xmlXPathObjectPtr res;
+    int rc;
+
+    if (dbp->dbp_comp == NULL)
+	return TRUE;
+
+    if (ctxt == NULL || ctxt->xpathCtxt == NULL)
+	return TRUE;
+
+    /* Functions in the condition must not re-enter the debugger */
+    statep->ds_flags |= DSF_INSHELL;
+    res = slaxXpathEvalCompiled(statep->ds_node, dbp->dbp_nslist,
+				dbp->dbp_nscount, ctxt->xpathCtxt,
+				dbp->dbp_comp);
+    statep->ds_flags &= ~DSF_INSHELL;
+
+    if (res == NULL) {
+	slaxOutput("Error in condition for breakpoint %d: %s",
+		   dbp->dbp_num, dbp->dbp_cond);
+	return TRUE;
+    }
+
+    rc = xmlXPathCastToBoolean(res);
+    xmlXPathFreeObject(res);
+
+    return rc;
+}
+
 /*
  * Clear all breakpoints
  */
@@ -457,10 +749,11 @@ slaxDebugClearBreakpoints (void)
 	dbp = TAILQ_FIRST(&slaxDebugBreakpoints);
 	if (dbp == NULL)
 	    break;
-	xmlFreeAndEasy(dbp->dbp_where);
 	TAILQ_REMOVE(&slaxDebugBreakpoints, dbp, dbp_link);
+	slaxDebugBreakpointFree(dbp);
     }
 
+    bzero(slaxDebugBpHash, sizeof(slaxDebugBpHash));
     slaxDebugBreakpointNumber = 0;
 }
 
@@ -698,16 +991,22 @@ slaxDebugCheckBreakpoint (slaxDebugState_t *statep,
 	return TRUE;
     }
 
-    TAILQ_FOREACH(dbp, &slaxDebugBreakpoints, dbp_link) {
-	if (dbp->dbp_inst && dbp->dbp_inst == node) {
-	    if (reached) {
-		slaxOutput("Reached breakpoint %d, at %s:%ld", 
-				dbp->dbp_num, node->doc->URL,
-				xmlGetLineNo(node));
-		xsltSetDebuggerStatus(XSLT_DEBUG_INIT);
-	    }
-	    return TRUE;
+    if (node == NULL)
+	return FALSE;
+
+    dbp = slaxDebugBpHashFind(node);
+    if (dbp) {
+	if (reached) {
+	    if (!slaxDebugBreakpointTest(statep, dbp))
+		return FALSE;
+	    dbp->dbp_hits += 1;
+
+	    slaxOutput("Reached breakpoint %d, at %s:%ld", 
+			    dbp->dbp_num, node->doc->URL,
+			    xmlGetLineNo(node));
+	    xsltSetDebuggerStatus(XSLT_DEBUG_INIT);
 	}
+	return TRUE;
     }
 
     return FALSE;
@@ -736,6 +1035,63 @@ slaxDebugTemplateInfo (xsltTemplatePtr template, char *buf, int bufsiz)
     return buf;
 }
 
+/*
+ * Name a stack frame for the profiler's call tree.  Besides template
+ * calls, libxslt pushes frames for things like variables with
+ * contents, and function calls only show up as frames like these.
+ * So for those we look up to the function or template holding the
+ * instruction, and return TRUE to say the frame is nested inside it.
+ */
+static int
+slaxDebugFrameName (xsltTemplatePtr template, xmlNodePtr inst,
+		    char *buf, int bufsiz, xmlNodePtr *defp)
+{
+    xmlNodePtr cur;
+    xmlChar *name, *match;
+
+    if (template && template->elem == inst) {
+	*defp = inst;
+	slaxDebugTemplateInfo(template, buf, bufsiz);
+	return FALSE;
+    }
+
+    for (cur = inst; cur && cur->type == XML_ELEMENT_NODE; cur = cur->parent) {
+	if (cur->ns == NULL || cur->ns->href == NULL)
+	    continue;
+
+	if (streq((const char *) cur->name, "function")
+		&& streq((const char *) cur->ns->href,
+			  (const char *) FUNC_URI)) {
+	    name = xmlGetProp(cur, (const xmlChar *) ATT_NAME);
+	    snprintf(buf, bufsiz, "function %s", name ? (char *) name : "");
+	    xmlFreeAndEasy(name);
+	    *defp = cur;
+	    return TRUE;
+	}
+
+	if (streq((const char *) cur->name, ELT_TEMPLATE)
+		&& streq((const char *) cur->ns->href, XSL_URI)) {
+	    /* Same format as slaxDebugTemplateInfo */
+	    name = xmlGetProp(cur, (const xmlChar *) ATT_NAME);
+	    match = xmlGetProp(cur, (const xmlChar *) ATT_MATCH);
+	    snprintf(buf, bufsiz, "%s%s%s%s%s",
+		     name ? "template " : "", name ? (char *) name : "",
+		     (name && match) ? " " : "",
+		     match ? "match " : "", match ? (char *) match : "");
+	    xmlFreeAndEasy(name);
+	    xmlFreeAndEasy(match);
+	    *defp = cur;
+	    return TRUE;
+	}
+    }
+
+    *defp = inst;
+    snprintf(buf, bufsiz, "<%s%s%s>",
+	     (inst->ns && inst->ns->prefix) ? (const char *) inst->ns->prefix : "",
+	     (inst->ns && inst->ns->prefix) ? ":" : "", NAME(inst));
+    return TRUE;
+}
+
 static void
 slaxDebugCallFlow (slaxDebugState_t *statep, xsltTemplatePtr template,
 		   xmlNodePtr inst, const char *tag)
@@ -802,13 +1158,22 @@ slaxDebugReloadBreakpoints (slaxDebugState_t *statep)
     slaxDebugBreakpoint_t *dbp;
     xmlNodePtr node;
 
+    bzero(slaxDebugBpHash, sizeof(slaxDebugBpHash));
+
     TAILQ_FOREACH(dbp, &slaxDebugBreakpoints, dbp_link) {
 	dbp->dbp_inst = NULL;	/* No dangling references */
+	dbp->dbp_hash_next = NULL;
 
 	node = slaxDebugGetNode(statep, dbp->dbp_where);
-	if (node)
+	if (node) {
 	    dbp->dbp_inst = node;
-	else
+	    slaxDebugBpHashAdd(dbp);
+
+	    /* The old compiled condition belongs to the old script */
+	    if (slaxDebugBreakpointCompile(statep, dbp))
+		slaxOutput("Breakpoint %d: invalid condition: %s",
+			   dbp->dbp_num, dbp->dbp_cond);
+	} else
 	    slaxOutput("Breakpoint target \"%s\" was not defined",
 		       dbp->dbp_where);
     }
@@ -841,10 +1206,47 @@ slaxDebugCmdBreak (DC_ARGS)
 {
     xmlNodePtr node = NULL;
     slaxDebugBreakpoint_t *bp;
+    const char *where = argv[1], *cond = NULL, *cp;
+
+    /*
+     * "break [loc] if <cond>": the condition is the rest of the
+     * command line, since it's likely to contain spaces
+     */
+    if (where && streq(where, "if"))
+	where = NULL;
+
+    if (where == NULL ? argv[1] != NULL : (argv[2] && streq(argv[2], "if"))) {
+	cp = commandline;
+	while (*cp && isspace((int) *cp)) /* Leading whitespace */
+	    cp += 1;
+	while (*cp && !isspace((int) *cp)) /* Command name */
+	    cp += 1;
+	while (*cp && isspace((int) *cp))
+	    cp += 1;
+	if (where) {
+	    while (*cp && !isspace((int) *cp)) /* Location */
+		cp += 1;
+	    while (*cp && isspace((int) *cp))
+		cp += 1;
+	}
+	cp += 2;		/* "if" */
+	while (*cp && isspace((int) *cp))
+	    cp += 1;
 
-    node = slaxDebugGetNode(statep, argv[1]);
+	if (*cp == '\0') {
+	    slaxOutput("Missing condition");
+	    return;
+	}
+	cond = cp;
+
+    } else if (where && argv[2]) {
+	slaxOutput("Junk at end of arguments");
+	return;
+    }
+
+    node = slaxDebugGetNode(statep, where);
     if (node == NULL) {
-	slaxOutput("Target \"%s\" is not defined", argv[1]);
+	slaxOutput("Target \"%s\" is not defined", where);
 	return;
     }
 
@@ -861,14 +1263,26 @@ slaxDebugCmdBreak (DC_ARGS)
 	return;
 
     bzero(bp, sizeof(*bp));
-    bp->dbp_where = xmlStrdup2(argv[1]);
-    bp->dbp_num = ++slaxDebugBreakpointNumber;
+    bp->dbp_where = xmlStrdup2(where);
     bp->dbp_inst = node;
+
+    if (cond) {
+	bp->dbp_cond = xmlStrdup2(cond);
+	if (slaxDebugBreakpointCompile(statep, bp)) {
+	    slaxOutput("Invalid condition: %s", cond);
+	    slaxDebugBreakpointFree(bp);
+	    return;
+	}
+    }
+
+    bp->dbp_num = ++slaxDebugBreakpointNumber;
     TAILQ_INSERT_TAIL(&slaxDebugBreakpoints, bp, dbp_link);
+    slaxDebugBpHashAdd(bp);
 
-    slaxOutput("Breakpoint %d at file %s, line %ld",
+    slaxOutput("Breakpoint %d at file %s, line %ld%s%s",
 		    bp->dbp_num, 
-		    node->doc->URL, xmlGetLineNo(node));  
+		    node->doc->URL, xmlGetLineNo(node),
+		    cond ? " if " : "", cond ?: "");
 }
 
 static int
@@ -967,6 +1381,8 @@ slaxDebugCmdDelete (DC_ARGS)
     TAILQ_FOREACH(dbpp, &slaxDebugBreakpoints, dbp_link) {
 	if (dbpp->dbp_num == num) {
 	    TAILQ_REMOVE(&slaxDebugBreakpoints, dbpp, dbp_link);
+	    slaxDebugBpHashRemove(dbpp);
+	    slaxDebugBreakpointFree(dbpp);
 	    slaxOutput("Deleted breakpoint '%d'", num);
 	    return;
 	}
@@ -1037,6 +1453,11 @@ slaxDebugInfoBreakpoints (slaxDebugState_t *statep)
 		       xmlGetLineNo(dbp->dbp_inst));
 	else
 	    slaxOutput("    #%d %s (orphaned)", dbp->dbp_num, dbp->dbp_where);
+
+	if (dbp->dbp_cond)
+	    slaxOutput("        stop only if %s (hit %lu time%s)",
+		       dbp->dbp_cond, dbp->dbp_hits,
+		       (dbp->dbp_hits == 1) ? "" : "s");
     }
 
     if (hit == 0)
@@ -1275,11 +1696,25 @@ slaxDebugCmdPrint (DC_ARGS)
     }
 }
 
+static void
+slaxDebugHelpBreak (DH_ARGS)
+{
+    slaxOutput("Usage:");
+    slaxOutput("  break [loc]     Add a breakpoint at [file:]line or template");
+    slaxOutput("  break [loc] if <xpath>  Stop only when <xpath> is true");
+    slaxOutput("The condition is evaluated at the breakpoint, "
+	       "using its context node.");
+}
+
 static void
 slaxDebugHelpProfile (DH_ARGS)
 {
     slaxOutput("List of commands:");
+    slaxOutput("  profile callgrind <file>  Write call tree in callgrind format");
     slaxOutput("  profile clear   Clear  profiling information");
+    slaxOutput("  profile folded <file>  Write call tree as folded stacks");
+    slaxOutput("  profile memory [on|off]  Account for memory allocations");
+    slaxOutput("  profile mode [timer|sample|count]  Set profiling mode");
     slaxOutput("  profile off     Disable profiling");
     slaxOutput("  profile on      Enable profiling");
     slaxOutput("  profile report [brief]  Report profiling information");
@@ -1308,11 +1743,70 @@ slaxDebugCmdProfiler (DC_ARGS)
 	    slaxProfClear();
 	    return;
 
+	} else if (slaxDebugIsAbbrev("mode", arg)) {
+	    static const char *modes[] = { "timer", "sample", "count" };
+	    const char *mode = argv[2];
+	    int i;
+
+	    if (mode == NULL) {
+		slaxOutput("Profiling mode is '%s'", modes[slaxProfGetMode()]);
+		return;
+	    }
+
+	    for (i = 0; i < (int) NUM_ARRAY(modes); i++) {
+		if (slaxDebugIsAbbrev(modes[i], mode)) {
+		    /* Counts from one mode make no sense in another */
+		    slaxProfClear();
+		    slaxProfSetMode(i);
+		    slaxOutput("Profiling mode is '%s'", modes[i]);
+		    return;
+		}
+	    }
+
+	    slaxOutput("invalid mode: %s", mode);
+	    return;
+
+	} else if (slaxDebugIsAbbrev("memory", arg)) {
+	    const char *val = argv[2];
+	    int on = !slaxProfGetMemory();
+
+	    if (val) {
+		if (streq("on", val) || slaxDebugIsAbbrev("yes", val))
+		    on = TRUE;
+		else if (streq("off", val) || slaxDebugIsAbbrev("no", val))
+		    on = FALSE;
+		else {
+		    slaxOutput("invalid setting: %s", val);
+		    return;
+		}
+	    }
+
+	    if (slaxProfSetMemory(on))
+		slaxOutput("could not change memory accounting");
+	    else
+		slaxOutput("Memory accounting is %s", on ? "on" : "off");
+	    return;
+
 	} else if (slaxDebugIsAbbrev("report", arg)) {
 	    int brief = (argv[2] && slaxDebugIsAbbrev("brief", argv[2]));
 	    slaxProfReport(brief, statep->ds_script_buffer);
 	    return;
 
+	} else if (slaxDebugIsAbbrev("callgrind", arg)
+		   || slaxDebugIsAbbrev("folded", arg)) {
+	    int callgrind = slaxDebugIsAbbrev("callgrind", arg);
+
+	    if (argv[2] == NULL) {
+		slaxOutput("missing file name");
+		return;
+	    }
+
+	    if (!(callgrind ? slaxProfCallgrind(argv[2])
+		  : slaxProfFolded(argv[2])))
+		slaxOutput("Wrote %s profile to %s",
+			   callgrind ? "callgrind" : "folded", argv[2]);
+	    return;
+
 	} else if (slaxDebugIsAbbrev("help", arg)) {
 	    slaxDebugHelpProfile(statep);
 	    return;
@@ -1635,7 +2129,7 @@ slaxDebugCmdQuit (DC_ARGS)
 static slaxDebugCommand_t slaxDebugCmdTable[] = {
     { "break",	       1, slaxDebugCmdBreak,
       "break [loc]     Add a breakpoint at [file:]line or template",
-      NULL,
+      slaxDebugHelpBreak,
     },
 
     { "bt",	       1, slaxDebugCmdWhere, NULL, NULL }, /* Hidden */
@@ -2091,6 +2585,13 @@ slaxDebugAddFrame (xsltTemplatePtr template, xmlNodePtr inst)
 
     statep->ds_flags |= DSF_FRESHADD;
 
+    /* Every frame we push is popped, so the call tree stays in step */
+    xmlNodePtr defp;
+    int nested = slaxDebugFrameName(template, inst, buf, sizeof(buf), &defp);
+    slaxProfCallEnter(buf, defp,
+		      stp->st_caller ? xmlGetLineNo(stp->st_caller) : 0,
+		      (statep->ds_flags & DSF_PROFILER) ? TRUE : FALSE, nested);
+
     /*
      * return value > 0 makes libxslt to call slaxDebugDropFrame()
      */
@@ -2142,6 +2643,8 @@ slaxDebugDropFrame (void)
     TAILQ_REMOVE(&slaxDebugStack, stp, st_link);
     statep->ds_stackdepth -= 1;	/* Reduce depth of stack */
 
+    slaxProfCallExit();
+
     if (statep->ds_flags & DSF_CALLFLOW)
 	slaxDebugCallFlow(statep, template, inst, "exit");
 
@@ -2178,6 +2681,9 @@ slaxDebugInit (void)
     xsltSetDebuggerCallbacksHelper(slaxDebugHandler, slaxDebugAddFrame,
 				   slaxDebugDropFrame);
 
+    /* The user can call any function, so don't put off loading them */
+    slaxDynLoadAll();
+
     slaxDebugDisplayMode = DEBUG_MODE_CLI;
 
     slaxOutput("sdb: The SLAX Debugger (version %s)", LIBSLAX_VERSION);
@@ -2196,6 +2702,8 @@ slaxDebugSetStylesheet (xsltStylesheetPtr script)
 {
     slaxDebugState_t *statep = slaxDebugGetState();
 
+    slaxDebugLineIndexClear();	/* Old documents are gone */
+
     if (statep) {
 	statep->ds_script = script;
 	statep->ds_inst = NULL;
@@ -2417,6 +2925,7 @@ slaxDebugApplyStylesheet (const char *scriptname, xsltStylesheetPtr style,
     /* Free our resources */
     slaxDebugClearBreakpoints();
     slaxDebugClearStacktrace();
+    slaxDebugLineIndexClear();
     slaxProfClose();
 
     if (save_style)
@@ -27,6 +27,22 @@
  * Errors, missing librarys, and missing namespaces are not considered
  * errors and are not reported.
  *
+ * Loading a library can be expensive (libcurl, libsqlite3, ...), and
+ * many of the scripts that reference a namespace won't call anything
+ * in it on a given run.  So unless a namespace is used for elements
+ * (which libxslt needs to see while compiling), we find the
+ * functions the script calls in it and register a stub for each.
+ * The first call to a stub loads the library, whose registrations
+ * replace the stubs, and then calls the real function.  Scripts
+ * that can evaluate expressions they build at run time (and the
+ * debugger) can call anything, so for them we load at parse time.
+ *
+ * Rather than probing each directory for each namespace (and each
+ * prefix), we list each directory once, and when there's a cache
+ * directory (see slaxCacheSetDir), we save that list there as a
+ * manifest, which is good as long as the directory's mtime hasn't
+ * changed.
+ *
  * The libxslt web pages consider this a "portability nightmare", and
  * they may well be correct.  This feature may be limited to platforms
  * that support dlopen() and dlsym().
@@ -35,15 +51,22 @@
 #include <sys/queue.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <libxml/uri.h>
 #include <libxml/tree.h>
+#include <libxml/xpathInternals.h>
 
 #include "slaxinternals.h"
 #include <libslax/slax.h>
 #include "slaxdata.h"
+#include <libpsu/psuthread.h>
 
 #include "slaxdyn.h"
+#include "slaxcache.h"
 
 #ifdef HAVE_DLFCN_H
 #include <dlfcn.h>
@@ -63,19 +86,90 @@ typedef struct slax_dyn_node_s {
 
 typedef TAILQ_HEAD(slax_dyn_list_s, slax_dyn_node_s) slax_dyn_list_t;
 
+/*
+ * A namespace whose library we haven't loaded yet, and the names of
+ * the functions we've registered stubs for
+ */
+typedef struct slax_dyn_pending_s {
+    TAILQ_ENTRY(slax_dyn_pending_s) dp_link; /* Next namespace */
+    char *dp_uri;		/* Namespace URI */
+    int dp_eager;		/* Load it now (used for elements) */
+    slax_data_list_t dp_names;	/* Functions called in the namespace */
+} slax_dyn_pending_t;
+
+typedef TAILQ_HEAD(slax_dyn_pending_list_s,
+		   slax_dyn_pending_s) slax_dyn_pending_list_t;
+
+/*
+ * What's in an extension directory: the names of the ".ext" files
+ * and the ".prefix" links, with their targets
+ */
+typedef struct slax_dyn_manifest_s {
+    TAILQ_ENTRY(slax_dyn_manifest_s) dm_link; /* Next directory */
+    char *dm_dir;		/* Directory */
+    int dm_probe;		/* Couldn't list it; probe as before */
+    slax_data_list_t dm_libraries; /* Names of ".ext" files */
+    slax_data_list_t dm_prefixes; /* "name\0target" for ".prefix" links */
+} slax_dyn_manifest_t;
+
+typedef TAILQ_HEAD(slax_dyn_manifest_list_s,
+		   slax_dyn_manifest_s) slax_dyn_manifest_list_t;
+
+#define SLAX_DYN_MANIFEST_SUFFIX ".manifest"
+#define SLAX_DYN_MANIFEST_VERSION 1
+
 static slax_data_list_t slaxDynDirList;
 static slax_data_list_t slaxDynLoaded;
 static slax_dyn_list_t slaxDynLibraries;
+static slax_dyn_pending_list_t slaxDynPending;
+static slax_dyn_manifest_list_t slaxDynManifests;
 
 static int slaxDynInited;
+static int slaxDynEager;	/* Load libraries as soon as they're seen */
+
+/*
+ * The lists above belong to the process, not to a thread: a library
+ * is loaded once, and its functions are registered with libxslt for
+ * everyone.  So threads take turns with them.  The lock is recursive
+ * since loading a library runs its init function, which can come
+ * back to us (slaxDynMarkLoaded), and slaxDynAdd calls slaxDynInit.
+ */
+static psu_once_t slaxDynOnce = PSU_ONCE_INIT;
+static psu_mutex_t slaxDynMutex;
+
+static void
+slaxDynMutexInit (void)
+{
+    psu_mutex_init_recursive(&slaxDynMutex);
+}
+
+static inline void
+slaxDynLock (void)
+{
+    psu_once(&slaxDynOnce, slaxDynMutexInit);
+    psu_mutex_lock(&slaxDynMutex);
+}
+
+static inline void
+slaxDynUnlock (void)
+{
+    psu_mutex_unlock(&slaxDynMutex);
+}
+
+static void
+slaxDynStub (xmlXPathParserContextPtr ctxt, int nargs);
 
 void
 slaxDynAdd (const char *dir)
 {
+    slaxDynLock();
+
     if (!slaxDynInited)
 	slaxDynInit();
 
     slaxDataListAddNul(&slaxDynDirList, dir);
+
+    slaxDynUnlock();
 }
 
 void
@@ -95,18 +189,313 @@ slaxDynAddPath (const char *path)
 }
 
 
+static const char slaxDynExtSuffix[] = ".ext";
+static const char slaxDynPrefixSuffix[] = ".prefix";
+
+static int
+slaxDynHasSuffix (const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return (len > slen && streq(name + len - slen, suffix));
+}
+
+/*
+ * Read the manifest for a directory from the cache, if it's there
+ * and the directory hasn't changed since it was written
+ */
+static int
+slaxDynManifestRead (slax_dyn_manifest_t *dmp, const char *path,
+		     struct stat *stp)
+{
+    FILE *fp;
+    char buf[MAXPATHLEN * 2 + 16], *cp, *tp;
+    unsigned version;
+    long sec, nsec;
+    int rc = -1;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+	return -1;
+
+    /* The header line has our version and the mtime of the directory */
+    if (fgets(buf, sizeof(buf), fp) == NULL
+	    || sscanf(buf, "slax-manifest %u %ld %ld", &version,
+		      &sec, &nsec) != 3
+	    || version != SLAX_DYN_MANIFEST_VERSION
+	    || sec != (long) stp->st_mtime
+#if HAVE_MTIMESPEC
+	    || nsec != (long) stp->st_mtimespec.tv_nsec
+#endif /* HAVE_MTIMESPEC */
+	)
+	goto done;
+
+    /* Then the directory, since different ones could hash the same */
+    if (fgets(buf, sizeof(buf), fp) == NULL)
+	goto done;
+    buf[strcspn(buf, "\n")] = '\0';
+    if (!streq(buf, dmp->dm_dir))
+	goto done;
+
+    while (fgets(buf, sizeof(buf), fp)) {
+	buf[strcspn(buf, "\n")] = '\0';
+
+	if (strncmp(buf, "ext ", 4) == 0) {
+	    slaxDataListAddNul(&dmp->dm_libraries, buf + 4);
+
+	} else if (strncmp(buf, "prefix ", 7) == 0) {
+	    cp = buf + 7;
+	    tp = strchr(cp, ' ');
+	    if (tp == NULL)
+		goto done;
+	    *tp = '\0';	/* Leaves "name\0target" in place */
+	    slaxDataListAddLenNul(&dmp->dm_prefixes, cp,
+				  strlen(cp) + 1 + strlen(tp + 1));
+	} else
+	    goto done;
+    }
+
+    rc = 0;
+
+ done:
+    fclose(fp);
+
+    if (rc < 0) {
+	slaxDataListClean(&dmp->dm_libraries);
+	slaxDataListClean(&dmp->dm_prefixes);
+    }
+
+    return rc;
+}
+
+/*
+ * List the directory's libraries and prefix links
+ */
+static int
+slaxDynManifestScan (slax_dyn_manifest_t *dmp)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    char path[MAXPATHLEN], target[MAXPATHLEN];
+    ssize_t len;
+    size_t nlen;
+
+    dirp = opendir(dmp->dm_dir);
+    if (dirp == NULL)
+	return -1;
+
+    while ((dp = readdir(dirp)) != NULL) {
+	if (strchr(dp->d_name, ' ') || strchr(dp->d_name, '\n'))
+	    continue;		/* Can't be in the manifest */
+
+	if (slaxDynHasSuffix(dp->d_name, slaxDynExtSuffix)) {
+	    slaxDataListAddNul(&dmp->dm_libraries, dp->d_name);
+
+	} else if (slaxDynHasSuffix(dp->d_name, slaxDynPrefixSuffix)) {
+	    snprintf(path, sizeof(path), "%s/%s", dmp->dm_dir, dp->d_name);
+	    len = readlink(path, target, sizeof(target) - 1);
+	    if (len <= 0)
+		continue;
+	    target[len] = '\0';
+	    if (strlen(target) != (size_t) len || strchr(target, '\n'))
+		continue;
+
+	    /* Store "name\0target", without the suffix on the name */
+	    nlen = strlen(dp->d_name) - strlen(slaxDynPrefixSuffix);
+	    char entry[nlen + 1 + len + 1];
+	    memcpy(entry, dp->d_name, nlen);
+	    entry[nlen] = '\0';
+	    memcpy(entry + nlen + 1, target, len + 1);
+	    slaxDataListAddLen(&dmp->dm_prefixes, entry, nlen + 1 + len);
+	}
+    }
+
+    closedir(dirp);
+    return 0;
+}
+
+/*
+ * Save the manifest in the cache.  If the directory changed in the
+ * last second, another change in the same second wouldn't change the
+ * mtime we record, so we wait for it to settle.
+ */
+static void
+slaxDynManifestWrite (slax_dyn_manifest_t *dmp, const char *path,
+		      struct stat *stp)
+{
+    slax_data_node_t *dnp;
+    char tmp[MAXPATHLEN];
+    FILE *fp;
+    long nsec = 0;
+
+    if (time(NULL) <= stp->st_mtime + 1)
+	return;
+
+#if HAVE_MTIMESPEC
+    nsec = stp->st_mtimespec.tv_nsec;
+#endif /* HAVE_MTIMESPEC */
+
+    snprintf(tmp, sizeof(tmp), "%s.%u", path, (unsigned) getpid());
+    fp = fopen(tmp, "w");
+    if (fp == NULL)
+	return;
+
+    fprintf(fp, "slax-manifest %u %ld %ld\n%s\n", SLAX_DYN_MANIFEST_VERSION,
+	    (long) stp->st_mtime, nsec, dmp->dm_dir);
+
+    SLAXDATALIST_FOREACH(dnp, &dmp->dm_libraries) {
+	fprintf(fp, "ext %s\n", dnp->dn_data);
+    }
+
+    SLAXDATALIST_FOREACH(dnp, &dmp->dm_prefixes) {
+	fprintf(fp, "prefix %s %s\n", dnp->dn_data,
+		dnp->dn_data + strlen(dnp->dn_data) + 1);
+    }
+
+    /* Rename into place, so readers never see a partial file */
+    if (fclose(fp) != 0 || rename(tmp, path) < 0)
+	unlink(tmp);
+    else
+	slaxLog("extension: saved manifest for %s", dmp->dm_dir);
+}
+
+/*
+ * Find the manifest for a directory, making it if we need to
+ */
+static slax_dyn_manifest_t *
+slaxDynManifest (const char *dir)
+{
+    slax_dyn_manifest_t *dmp;
+    struct stat st;
+    char path[MAXPATHLEN];
+    const char *pp;
+
+    if (slaxDynManifests.tqh_last == NULL)
+	TAILQ_INIT(&slaxDynManifests);
+
+    TAILQ_FOREACH(dmp, &slaxDynManifests, dm_link)
+	if (streq(dmp->dm_dir, dir))
+	    return dmp;
+
+    dmp = xmlMalloc(sizeof(*dmp));
+    if (dmp == NULL)
+	return NULL;
+
+    bzero(dmp, sizeof(*dmp));
+    dmp->dm_dir = xmlStrdup2(dir);
+    slaxDataListInit(&dmp->dm_libraries);
+    slaxDataListInit(&dmp->dm_prefixes);
+    TAILQ_INSERT_TAIL(&slaxDynManifests, dmp, dm_link);
+
+    if (stat(dir, &st) < 0) {
+	/* If it isn't there, there's nothing in it */
+	if (errno != ENOENT && errno != ENOTDIR)
+	    dmp->dm_probe = TRUE;
+	return dmp;
+    }
+
+    pp = slaxCacheNamePath(path, sizeof(path), dir,
+			   SLAX_DYN_MANIFEST_SUFFIX, FALSE);
+    if (pp && slaxDynManifestRead(dmp, pp, &st) == 0) {
+	slaxLog("extension: using manifest for %s", dir);
+	return dmp;
+    }
+
+    if (slaxDynManifestScan(dmp) < 0) {
+	dmp->dm_probe = TRUE;
+	return dmp;
+    }
+
+    pp = slaxCacheNamePath(path, sizeof(path), dir,
+			   SLAX_DYN_MANIFEST_SUFFIX, TRUE);
+    if (pp)
+	slaxDynManifestWrite(dmp, pp, &st);
+
+    return dmp;
+}
+
+/*
+ * Is there a library with this file name in the directory?
+ */
+static int
+slaxDynManifestHas (const char *dir, const char *file)
+{
+    slax_dyn_manifest_t *dmp = slaxDynManifest(dir);
+    slax_data_node_t *dnp;
+    char path[MAXPATHLEN];
+
+    if (dmp == NULL || dmp->dm_probe) {
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	return (access(path, R_OK) == 0);
+    }
+
+    SLAXDATALIST_FOREACH(dnp, &dmp->dm_libraries) {
+	if (streq(dnp->dn_data, file))
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Find the target of the "name.prefix" link in the directory,
+ * returning its length (or -1)
+ */
+static ssize_t
+slaxDynManifestPrefix (const char *dir, const char *name,
+		       char *buf, size_t bufsiz)
+{
+    slax_dyn_manifest_t *dmp = slaxDynManifest(dir);
+    slax_data_node_t *dnp;
+    char path[MAXPATHLEN];
+    const char *target;
+    size_t len;
+
+    if (dmp == NULL || dmp->dm_probe) {
+	snprintf(path, sizeof(path), "%s/%s%s", dir, name,
+		 slaxDynPrefixSuffix);
+	return readlink(path, buf, bufsiz - 1);
+    }
+
+    SLAXDATALIST_FOREACH(dnp, &dmp->dm_prefixes) {
+	if (streq(dnp->dn_data, name)) {
+	    target = dnp->dn_data + strlen(dnp->dn_data) + 1;
+	    len = strlen(target);
+	    if (len > bufsiz - 1)
+		len = bufsiz - 1;
+	    memcpy(buf, target, len); /* Like readlink, we don't terminate */
+	    return len;
+	}
+    }
+
+    return -1;
+}
+
+static void
+slaxDynManifestClean (void)
+{
+    slax_dyn_manifest_t *dmp;
+
+    if (slaxDynManifests.tqh_last == NULL)
+	return;
+
+    while ((dmp = TAILQ_FIRST(&slaxDynManifests)) != NULL) {
+	TAILQ_REMOVE(&slaxDynManifests, dmp, dm_link);
+	slaxDataListClean(&dmp->dm_libraries);
+	slaxDataListClean(&dmp->dm_prefixes);
+	xmlFree(dmp->dm_dir);
+	xmlFree(dmp);
+    }
+}
+
 static void
-slaxDynLoadNamespace (xmlDocPtr docp UNUSED, xmlNodePtr root UNUSED,
-		      const char *ns)
+slaxDynLoadNamespace (const char *ns)
 {
     slax_data_node_t *dnp;
     xmlChar *ret;
     void *dlp = NULL;
     char buf[MAXPATHLEN];
 
-    if (slaxDynMarkLoaded(ns))
-	return;
-
     ret = xmlURIEscapeStr((const xmlChar *) ns, (const xmlChar *) "-_.");
     if (ret == NULL)
 	return;
@@ -119,6 +508,9 @@ slaxDynLoadNamespace (xmlDocPtr docp UNUSED, xmlNodePtr root UNUSED,
 	if (len > sizeof(buf))	/* Should not occur */
 	    continue;
 
+	if (!slaxDynManifestHas(dir, buf + strlen(dir) + 1))
+	    continue;
+
 	slaxLog("extension: attempting %s", buf);
 	dlp = dlopen((const char *) buf, RTLD_NOW);
 	if (dlp)
@@ -171,6 +563,232 @@ slaxDynLoadNamespace (xmlDocPtr docp UNUSED, xmlNodePtr root UNUSED,
     xmlFree(ret);
 }
 
+/*
+ * Is there a library for this namespace?  This is far cheaper than
+ * opening it, which is the point.
+ */
+static int
+slaxDynLibraryExists (const char *ns)
+{
+    slax_data_node_t *dnp;
+    xmlChar *ret;
+    char buf[MAXPATHLEN];
+    int found = FALSE;
+
+    ret = xmlURIEscapeStr((const xmlChar *) ns, (const xmlChar *) "-_.");
+    if (ret == NULL)
+	return FALSE;
+
+    snprintf(buf, sizeof(buf), "%s%s", ret, slaxDynExtSuffix);
+
+    SLAXDATALIST_FOREACH(dnp, &slaxDynDirList) {
+	if (slaxDynManifestHas(dnp->dn_data, buf)) {
+	    found = TRUE;
+	    break;
+	}
+    }
+
+    xmlFree(ret);
+    return found;
+}
+
+static slax_dyn_pending_t *
+slaxDynFindPending (const char *ns)
+{
+    slax_dyn_pending_t *dpp;
+
+    TAILQ_FOREACH(dpp, &slaxDynPending, dp_link)
+	if (streq(ns, dpp->dp_uri))
+	    return dpp;
+
+    return NULL;
+}
+
+/*
+ * Load the library for a pending namespace.  Its registrations
+ * replace our stubs; any stubs left over are for functions the
+ * library doesn't have, so we drop them.
+ */
+static void
+slaxDynLoadPending (slax_dyn_pending_t *dpp)
+{
+    slax_data_node_t *dnp;
+
+    TAILQ_REMOVE(&slaxDynPending, dpp, dp_link);
+
+    slaxLog("extension: loading %s on demand", dpp->dp_uri);
+    slaxDynLoadNamespace(dpp->dp_uri);
+
+    SLAXDATALIST_FOREACH(dnp, &dpp->dp_names) {
+	if (xsltExtModuleFunctionLookup((const xmlChar *) dnp->dn_data,
+				(const xmlChar *) dpp->dp_uri) == slaxDynStub)
+	    slaxUnregisterFunction(dpp->dp_uri, dnp->dn_data);
+    }
+
+    slaxDataListClean(&dpp->dp_names);
+    xmlFree(dpp->dp_uri);
+    xmlFree(dpp);
+}
+
+/*
+ * The function registered for each function in a pending namespace.
+ * We load the library and hand the call to the real function.
+ * Compiled expressions cache the function pointer they found, so
+ * we'll still be called for them after the library is loaded.
+ */
+static void
+slaxDynStub (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    const xmlChar *name = ctxt->context->function;
+    const xmlChar *uri = ctxt->context->functionURI;
+    slax_dyn_pending_t *dpp;
+    xmlXPathFunction func;
+
+    if (name == NULL || uri == NULL) {
+	xmlXPathSetError(ctxt, XPATH_UNKNOWN_FUNC_ERROR);
+	return;
+    }
+
+    slaxDynLock();
+    dpp = slaxDynFindPending((const char *) uri);
+    if (dpp)
+	slaxDynLoadPending(dpp);
+    slaxDynUnlock();
+
+    func = xsltExtModuleFunctionLookup(name, uri);
+    if (func == NULL || func == slaxDynStub) {
+	xmlGenericError(xmlGenericErrorContext,
+			"xmlXPathCompOpEval: function %s not found\n", name);
+	xmlXPathSetError(ctxt, XPATH_UNKNOWN_FUNC_ERROR);
+	return;
+    }
+
+    func(ctxt, nargs);
+}
+
+/*
+ * Find the function calls in an xpath expression (or an attribute
+ * value template) whose prefix maps to a namespace we're looking
+ * for.  We're not parsing the expression, just looking for
+ * "prefix:name(", so a string that looks like a call costs us an
+ * unused stub, which is harmless.
+ */
+static void
+slaxDynFindCalls (slax_dyn_pending_list_t *listp, xmlDocPtr docp,
+		  xmlNodePtr nodep, const char *expr)
+{
+    const char *cp, *pp, *np, *ep;
+    slax_dyn_pending_t *dpp;
+    xmlNsPtr nsp;
+
+    for (cp = strchr(expr, ':'); cp; cp = strchr(cp + 1, ':')) {
+	if (cp[1] == ':')	/* Axis (child::) */
+	    continue;
+
+	/* Back up over the prefix */
+	for (pp = cp; pp > expr; pp--)
+	    if (!isalnum((int) pp[-1]) && pp[-1] != '_' && pp[-1] != '-'
+		    && pp[-1] != '.')
+		break;
+	if (pp == cp || !(isalpha((int) *pp) || *pp == '_'))
+	    continue;
+
+	/* Find the rest of the name, and make sure it's a call */
+	for (np = cp + 1; isalnum((int) *np) || *np == '_' || *np == '-'
+		 || *np == '.'; np++)
+	    continue;
+	if (np == cp + 1)
+	    continue;
+	for (ep = np; isspace((int) *ep); ep++)
+	    continue;
+	if (*ep != '(')
+	    continue;
+
+	char prefix[cp - pp + 1];
+	memcpy(prefix, pp, cp - pp);
+	prefix[cp - pp] = '\0';
+
+	nsp = xmlSearchNs(docp, nodep, (const xmlChar *) prefix);
+	if (nsp == NULL || nsp->href == NULL)
+	    continue;
+
+	TAILQ_FOREACH(dpp, listp, dp_link) {
+	    if (!streq((const char *) nsp->href, dpp->dp_uri))
+		continue;
+
+	    slax_data_node_t *dnp;
+	    size_t len = np - cp - 1;
+	    int found = FALSE;
+
+	    SLAXDATALIST_FOREACH(dnp, &dpp->dp_names) {
+		if (strlen(dnp->dn_data) == len
+			&& strncmp(dnp->dn_data, cp + 1, len) == 0) {
+		    found = TRUE;
+		    break;
+		}
+	    }
+
+	    if (!found)
+		slaxDataListAddLenNul(&dpp->dp_names, cp + 1, len);
+	    break;
+	}
+    }
+}
+
+/*
+ * Can this expression evaluate an expression it builds at run time?
+ */
+static int
+slaxDynIsDynamic (const char *expr)
+{
+    return (strstr(expr, "evaluate") != NULL
+	    || strstr(expr, "dyn:") != NULL);
+}
+
+/*
+ * Walk the document, noting the functions called in the namespaces
+ * we're looking at, and whether those namespaces are used for
+ * elements.  Returns TRUE if the script can build expressions and
+ * evaluate them, in which case anything could be called.
+ */
+static int
+slaxDynScan (slax_dyn_pending_list_t *listp, xmlDocPtr docp,
+	     xmlNodePtr nodep)
+{
+    slax_dyn_pending_t *dpp;
+    xmlAttrPtr attr;
+    xmlNodePtr childp;
+    int dynamic = FALSE;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	if (nodep->ns && nodep->ns->href) {
+	    TAILQ_FOREACH(dpp, listp, dp_link)
+		if (streq((const char *) nodep->ns->href, dpp->dp_uri))
+		    dpp->dp_eager = TRUE;
+	}
+
+	for (attr = nodep->properties; attr; attr = attr->next) {
+	    xmlNodePtr tp = attr->children;
+
+	    if (tp == NULL || tp->type != XML_TEXT_NODE || tp->content == NULL)
+		continue;
+
+	    if (slaxDynIsDynamic((const char *) tp->content))
+		dynamic = TRUE;
+	    slaxDynFindCalls(listp, docp, nodep, (const char *) tp->content);
+	}
+
+	childp = nodep->children;
+	if (childp && slaxDynScan(listp, docp, childp))
+	    dynamic = TRUE;
+    }
+
+    return dynamic;
+}
+
 static char *
 slaxDynExtensionPrefixes (xmlDocPtr docp UNUSED, xmlNodePtr nodep, int top)
 {
@@ -234,21 +852,19 @@ slaxDynFindNamespaces (slax_data_list_t *listp, xmlDocPtr docp,
 int
 slaxDynFindPrefix (char *uri, size_t urisiz, const char *name)
 {
-    char buf[MAXPATHLEN];
     slax_data_node_t *dnp;
+    int rc = -1;
+
+    slaxDynLock();
 
     SLAXDATALIST_FOREACH(dnp, &slaxDynDirList) {
-	static const char fmt[] = "%s/%s.prefix";
 	static const char ext[] = ".ext";
 
 	char *dir = dnp->dn_data;
-	size_t len = snprintf(buf, sizeof(buf) - 1, fmt, dir, name);
+	size_t len;
 
-	if (len > sizeof(buf))	/* Should not occur */
-	    continue;
-
-	len = readlink(buf, uri, urisiz - 1);
-	if (len > urisiz)	/* Should not occur */
+	len = slaxDynManifestPrefix(dir, name, uri, urisiz);
+	if (len > urisiz)	/* Not found (or should not occur) */
 	    continue;
 
 	uri[len] = '\0';
@@ -263,22 +879,27 @@ slaxDynFindPrefix (char *uri, size_t urisiz, const char *name)
 	if (len > sizeof(ext) && streq(uri + len - sizeof(ext) + 1, ext))
 	    uri[len - sizeof(ext) + 1] = '\0';
 
-	return 0; /* Success */
+	rc = 0; /* Success */
+	break;
     }
 
-    return -1; /* Failure */
+    slaxDynUnlock();
+    return rc;
 }
 
 /*
  * Load any extension libraries referenced in the given document.  The
  * implementation is fairly simple: find them and then load them.
  */
-void
-slaxDynLoad (xmlDocPtr docp)
+static void
+slaxDynLoadLocked (xmlDocPtr docp)
 {
     xmlNodePtr root;
     slax_data_list_t nslist;
     slax_data_node_t *dnp;
+    slax_dyn_pending_list_t scan;
+    slax_dyn_pending_t *dpp, *newp;
+    int eager = slaxDynEager;
 
     if (docp == NULL)
 	return;
@@ -291,28 +912,142 @@ slaxDynLoad (xmlDocPtr docp)
 
     slaxDynFindNamespaces(&nslist, docp, root, TRUE);
 
+    /*
+     * Make a list of the namespaces we'll need to look at: those
+     * whose libraries haven't been loaded yet.
+     */
+    TAILQ_INIT(&scan);
     SLAXDATALIST_FOREACH(dnp, &nslist) {
-	slaxDynLoadNamespace(docp, root, (const char *) dnp->dn_data);
+	const char *ns = dnp->dn_data;
+
+	if (slaxDynFindPending(ns) == NULL) {
+	    if (slaxDynMarkLoaded(ns))
+		continue;	/* Already loaded (or not there) */
+
+	    if (!slaxDynLibraryExists(ns))
+		continue;	/* Nothing to load */
+	}
+
+	newp = xmlMalloc(sizeof(*newp));
+	if (newp == NULL) {
+	    slaxDynLoadNamespace(ns);
+	    continue;
+	}
+
+	bzero(newp, sizeof(*newp));
+	newp->dp_uri = xmlStrdup2(ns);
+	slaxDataListInit(&newp->dp_names);
+	TAILQ_INSERT_TAIL(&scan, newp, dp_link);
     }
 
     slaxDataListClean(&nslist);
+
+    if (TAILQ_EMPTY(&scan))
+	return;
+
+    if (!eager && slaxDynScan(&scan, docp, root))
+	eager = TRUE;
+
+    while ((newp = TAILQ_FIRST(&scan)) != NULL) {
+	TAILQ_REMOVE(&scan, newp, dp_link);
+
+	/* Merge with the pending namespace, if we have one */
+	dpp = slaxDynFindPending(newp->dp_uri);
+	if (dpp == NULL) {
+	    dpp = newp;
+	    TAILQ_INSERT_TAIL(&slaxDynPending, dpp, dp_link);
+	} else {
+	    dpp->dp_eager |= newp->dp_eager;
+	}
+
+	SLAXDATALIST_FOREACH(dnp, &newp->dp_names) {
+	    if (dpp != newp) {
+		slax_data_node_t *xp;
+		int found = FALSE;
+
+		SLAXDATALIST_FOREACH(xp, &dpp->dp_names) {
+		    if (streq(xp->dn_data, dnp->dn_data)) {
+			found = TRUE;
+			break;
+		    }
+		}
+		if (found)
+		    continue;
+
+		slaxDataListAddNul(&dpp->dp_names, dnp->dn_data);
+	    }
+
+	    if (xsltExtModuleFunctionLookup((const xmlChar *) dnp->dn_data,
+				(const xmlChar *) dpp->dp_uri) == NULL)
+		xsltRegisterExtModuleFunction((const xmlChar *) dnp->dn_data,
+					      (const xmlChar *) dpp->dp_uri,
+					      slaxDynStub);
+	}
+
+	if (dpp != newp) {
+	    slaxDataListClean(&newp->dp_names);
+	    xmlFree(newp->dp_uri);
+	    xmlFree(newp);
+	}
+
+	if (eager || dpp->dp_eager)
+	    slaxDynLoadPending(dpp);
+    }
+}
+
+void
+slaxDynLoad (xmlDocPtr docp)
+{
+    slaxDynLock();
+    slaxDynLoadLocked(docp);
+    slaxDynUnlock();
+}
+
+/*
+ * Load every library we've put off loading, and from now on load
+ * them as soon as they're referenced.  The debugger needs this, since
+ * the user can call anything.
+ */
+void
+slaxDynLoadAll (void)
+{
+    slax_dyn_pending_t *dpp;
+
+    slaxDynLock();
+
+    slaxDynEager = TRUE;
+
+    if (slaxDynPending.tqh_last != NULL) {
+	while ((dpp = TAILQ_FIRST(&slaxDynPending)) != NULL)
+	    slaxDynLoadPending(dpp);
+    }
+
+    slaxDynUnlock();
 }
 
 int
 slaxDynMarkLoaded (const char *ns)
 {
     slax_data_node_t *dnp;
+    int rc = FALSE;
 
     if (streq(ns, SLAX_URI))
 	return TRUE;
 
+    slaxDynLock();
+
     SLAXDATALIST_FOREACH(dnp, &slaxDynLoaded) {
-	if (streq(ns, dnp->dn_data))
-	    return TRUE;		/* Already loaded */
+	if (streq(ns, dnp->dn_data)) {
+	    rc = TRUE;		/* Already loaded */
+	    break;
+	}
     }
 
-    slaxDataListAddNul(&slaxDynLoaded, ns);
-    return FALSE;
+    if (!rc)
+	slaxDataListAddNul(&slaxDynLoaded, ns);
+
+    slaxDynUnlock();
+    return rc;
 }
 
 void
@@ -330,26 +1065,32 @@ slaxDynMarkExslt (void)
 }
 
 /*
- * Initialize the entire dynamic extension loading mechanism.
+ * Initialize the entire dynamic extension loading mechanism.  Only
+ * the first call (after any slaxDynClean) does anything, so it's
+ * safe to make from each thread that embeds us.
  */
 void
 slaxDynInit (void)
 {
     char *cp;
 
+    slaxDynLock();
+
     if (!slaxDynInited) {
 	slaxDynInited = TRUE;
 	slaxDataListInit(&slaxDynDirList);
-    }
+	slaxDataListInit(&slaxDynLoaded);
+	TAILQ_INIT(&slaxDynLibraries);
+	TAILQ_INIT(&slaxDynPending);
 
-    slaxDataListInit(&slaxDynLoaded);
-    TAILQ_INIT(&slaxDynLibraries);
+	cp = getenv("SLAX_EXTDIR");
+	if (cp)
+	    slaxDynAddPath(cp);
 
-    cp = getenv("SLAX_EXTDIR");
-    if (cp)
-	slaxDynAddPath(cp);
+	slaxDataListAddNul(&slaxDynDirList, SLAX_EXTDIR);
+    }
 
-    slaxDataListAddNul(&slaxDynDirList, SLAX_EXTDIR);
+    slaxDynUnlock();
 }
 
 /*
@@ -359,10 +1100,30 @@ void
 slaxDynClean (void)
 {
     slax_dyn_node_t *dnp;
+    slax_dyn_pending_t *dpp;
+    slax_data_node_t *namep;
+
+    slaxDynLock();
 
     if (slaxDynInited)
 	slaxDataListClean(&slaxDynDirList);
     slaxDataListClean(&slaxDynLoaded);
+    slaxDynManifestClean();
+
+    /* Drop the stubs for libraries that were never needed */
+    if (slaxDynPending.tqh_last != NULL) {
+	while ((dpp = TAILQ_FIRST(&slaxDynPending)) != NULL) {
+	    TAILQ_REMOVE(&slaxDynPending, dpp, dp_link);
+
+	    SLAXDATALIST_FOREACH(namep, &dpp->dp_names) {
+		slaxUnregisterFunction(dpp->dp_uri, namep->dn_data);
+	    }
+
+	    slaxDataListClean(&dpp->dp_names);
+	    xmlFree(dpp->dp_uri);
+	    xmlFree(dpp);
+	}
+    }
 
     if (slaxDynLibraries.tqh_last != NULL) {
 	for (;;) {
@@ -400,4 +1161,7 @@ slaxDynClean (void)
 	    xmlFree(dnp);
 	}
     }
+
+    slaxDynInited = FALSE;
+    slaxDynUnlock();
 }
@@ -70,6 +70,14 @@ slaxDynLoad (xmlDocPtr docp);
 void
 slaxDynInit (void);
 
+/*
+ * Load every extension library we've put off loading until one of
+ * its functions is called, and load any others as soon as they're
+ * referenced.
+ */
+void
+slaxDynLoadAll (void);
+
 /*
  * Find the uri behind a "well-known" prefix
  */
@@ -0,0 +1,606 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxexslt.c -- replacements for some hot EXSLT functions
+ *
+ * libexslt's set:intersection and set:difference test each node of
+ * one set against the whole of the other, and str:tokenize compares
+ * each character against each delimiter, one UTF-8 character at a
+ * time.  We register our own versions over the stock ones: the set
+ * functions hash node identity (or string value, for set:distinct)
+ * and the tokenizer makes one pass using a table of delimiters.
+ * Results, including their order, match libexslt's.
+ */
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+
+#include <stdint.h>
+
+#include <libxslt/extensions.h>
+#include <libxslt/transform.h>
+#include <libxml/xpathInternals.h>
+#include <libexslt/exslt.h>
+
+#define EXSLT_DELIMITERS " \t\r\n" /* Default str:tokenize delimiters */
+#define SLAX_EXSLT_EMPTY	0 /* Hash slot is unused */
+
+/*
+ * An open-addressed hash of nodes, keyed either by identity or by
+ * string value.  Slots hold an index (plus one) into the node-set
+ * being hashed, so zero marks an empty slot.
+ */
+typedef struct slax_node_hash_s {
+    unsigned snh_mask;		/* Number of slots, less one */
+    unsigned *snh_slots;	/* Indexes (plus one) into snh_nodes */
+    uint64_t *snh_hashes;	/* Hash for each node (by index) */
+    xmlNodePtr *snh_nodes;	/* The nodes themselves */
+    xmlChar **snh_strings;	/* String values (by index), if keyed so */
+} slax_node_hash_t;
+
+/*
+ * FNV-1a, as used by the cache code
+ */
+static inline uint64_t
+slaxExsltHashString (const xmlChar *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for ( ; *str; str++) {
+	hash ^= *str;
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * Namespace nodes in a node-set are copies, made for that set, so two
+ * sets' copies of the same namespace node have different addresses.
+ * Like xmlXPathNodeSetContains(), we match them on their parent and
+ * prefix instead.
+ */
+static inline uint64_t
+slaxExsltHashNode (xmlNodePtr nodep)
+{
+    uint64_t hash;
+
+    if (nodep->type == XML_NAMESPACE_DECL) {
+	xmlNsPtr nsp = (xmlNsPtr) nodep;
+
+	hash = (uintptr_t) nsp->next;
+	if (nsp->prefix)
+	    hash ^= slaxExsltHashString(nsp->prefix);
+    } else {
+	hash = (uintptr_t) nodep;
+    }
+
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+static inline int
+slaxExsltSameNode (xmlNodePtr one, xmlNodePtr two)
+{
+    if (one == two)
+	return TRUE;
+
+    if (one->type != XML_NAMESPACE_DECL || two->type != XML_NAMESPACE_DECL)
+	return FALSE;
+
+    return (((xmlNsPtr) one)->next == ((xmlNsPtr) two)->next
+	    && xmlStrEqual(((xmlNsPtr) one)->prefix,
+			   ((xmlNsPtr) two)->prefix));
+}
+
+static void
+slaxExsltHashClean (slax_node_hash_t *snhp)
+{
+    unsigned i;
+
+    if (snhp->snh_strings) {
+	for (i = 0; i <= snhp->snh_mask; i++)
+	    if (snhp->snh_strings[i])
+		xmlFree(snhp->snh_strings[i]);
+	xmlFree(snhp->snh_strings);
+    }
+
+    if (snhp->snh_slots)
+	xmlFree(snhp->snh_slots);
+    if (snhp->snh_hashes)
+	xmlFree(snhp->snh_hashes);
+}
+
+/*
+ * Make an empty hash big enough for "count" nodes, keeping it at
+ * most half full.  "by_value" keys the hash on string value.
+ */
+static int
+slaxExsltHashInit (slax_node_hash_t *snhp, xmlNodePtr *nodes, int count,
+		   int by_value)
+{
+    unsigned size = 16;
+
+    bzero(snhp, sizeof(*snhp));
+
+    while (size < (unsigned) count * 2)
+	size <<= 1;
+
+    snhp->snh_mask = size - 1;
+    snhp->snh_nodes = nodes;
+    snhp->snh_slots = xmlMalloc(size * sizeof(snhp->snh_slots[0]));
+    snhp->snh_hashes = xmlMalloc(size * sizeof(snhp->snh_hashes[0]));
+    if (by_value)
+	snhp->snh_strings = xmlMalloc(size * sizeof(snhp->snh_strings[0]));
+
+    if (snhp->snh_slots == NULL || snhp->snh_hashes == NULL
+	    || (by_value && snhp->snh_strings == NULL)) {
+	slaxExsltHashClean(snhp);
+	return -1;
+    }
+
+    bzero(snhp->snh_slots, size * sizeof(snhp->snh_slots[0]));
+    if (by_value)
+	bzero(snhp->snh_strings, size * sizeof(snhp->snh_strings[0]));
+
+    return 0;
+}
+
+/*
+ * Look for the node at index "ndx" (whose hash the caller has stored
+ * in snh_hashes[ndx]), adding it if it's not there.  Returns TRUE if
+ * an equal node was already in the hash.
+ */
+static int
+slaxExsltHashAdd (slax_node_hash_t *snhp, int ndx)
+{
+    uint64_t hash = snhp->snh_hashes[ndx];
+    unsigned slot = hash & snhp->snh_mask;
+    unsigned other;
+
+    for (;;) {
+	other = snhp->snh_slots[slot];
+	if (other == SLAX_EXSLT_EMPTY)
+	    break;
+
+	other -= 1;
+	if (snhp->snh_hashes[other] == hash) {
+	    if (snhp->snh_strings) {
+		if (xmlStrEqual(snhp->snh_strings[other],
+				snhp->snh_strings[ndx]))
+		    return TRUE;
+	    } else if (slaxExsltSameNode(snhp->snh_nodes[other],
+					 snhp->snh_nodes[ndx])) {
+		return TRUE;
+	    }
+	}
+
+	slot = (slot + 1) & snhp->snh_mask;
+    }
+
+    snhp->snh_slots[slot] = ndx + 1;
+    return FALSE;
+}
+
+/*
+ * Is this node in the (identity-keyed) hash?
+ */
+static int
+slaxExsltHashContains (slax_node_hash_t *snhp, xmlNodePtr nodep)
+{
+    uint64_t hash = slaxExsltHashNode(nodep);
+    unsigned slot = hash & snhp->snh_mask;
+    unsigned other;
+
+    for (;;) {
+	other = snhp->snh_slots[slot];
+	if (other == SLAX_EXSLT_EMPTY)
+	    return FALSE;
+
+	other -= 1;
+	if (snhp->snh_hashes[other] == hash
+		&& slaxExsltSameNode(snhp->snh_nodes[other], nodep))
+	    return TRUE;
+
+	slot = (slot + 1) & snhp->snh_mask;
+    }
+}
+
+/*
+ * Build an identity hash of a node-set
+ */
+static int
+slaxExsltHashNodeSet (slax_node_hash_t *snhp, xmlNodeSetPtr set)
+{
+    int i;
+
+    if (slaxExsltHashInit(snhp, set->nodeTab, set->nodeNr, FALSE) < 0)
+	return -1;
+
+    /* snh_hashes is sized by slot, which is always more than nodeNr */
+    for (i = 0; i < set->nodeNr; i++) {
+	snhp->snh_hashes[i] = slaxExsltHashNode(set->nodeTab[i]);
+	slaxExsltHashAdd(snhp, i);
+    }
+
+    return 0;
+}
+
+/*
+ * Return the nodes of "set1" that are (or aren't, if "keep" is FALSE)
+ * in "set2", in the order of "set1"
+ */
+static xmlNodeSetPtr
+slaxExsltFilter (xmlNodeSetPtr set1, xmlNodeSetPtr set2, int keep)
+{
+    slax_node_hash_t hash;
+    xmlNodeSetPtr ret;
+    int i;
+
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL || xmlXPathNodeSetIsEmpty(set1))
+	return ret;
+
+    if (xmlXPathNodeSetIsEmpty(set2)) {
+	if (!keep)
+	    for (i = 0; i < set1->nodeNr; i++)
+		xmlXPathNodeSetAddUnique(ret, set1->nodeTab[i]);
+	return ret;
+    }
+
+    if (slaxExsltHashNodeSet(&hash, set2) < 0) {
+	xmlXPathFreeNodeSet(ret);
+	return NULL;
+    }
+
+    for (i = 0; i < set1->nodeNr; i++) {
+	if (slaxExsltHashContains(&hash, set1->nodeTab[i]) == keep)
+	    xmlXPathNodeSetAddUnique(ret, set1->nodeTab[i]);
+    }
+
+    slaxExsltHashClean(&hash);
+    return ret;
+}
+
+/*
+ * Pop two node-sets and push the result of filtering one by the other
+ */
+static void
+slaxExsltSetsFilter (xmlXPathParserContextPtr ctxt, int nargs, int keep)
+{
+    xmlNodeSetPtr set1, set2, ret;
+
+    if (nargs != 2) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    set2 = xmlXPathPopNodeSet(ctxt);
+    if (xmlXPathCheckError(ctxt))
+	return;
+
+    set1 = xmlXPathPopNodeSet(ctxt);
+    if (xmlXPathCheckError(ctxt)) {
+	xmlXPathFreeNodeSet(set2);
+	return;
+    }
+
+    ret = slaxExsltFilter(set1, set2, keep);
+
+    xmlXPathFreeNodeSet(set1);
+    xmlXPathFreeNodeSet(set2);
+
+    if (ret == NULL) {
+	xmlXPathSetError(ctxt, XPATH_MEMORY_ERROR);
+	return;
+    }
+
+    valuePush(ctxt, xmlXPathWrapNodeSet(ret));
+}
+
+/*
+ * set:intersection(set1, set2): nodes in both sets
+ */
+static void
+slaxExsltSetsIntersection (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    slaxExsltSetsFilter(ctxt, nargs, TRUE);
+}
+
+/*
+ * set:difference(set1, set2): nodes in set1 but not in set2
+ */
+static void
+slaxExsltSetsDifference (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    slaxExsltSetsFilter(ctxt, nargs, FALSE);
+}
+
+/*
+ * set:distinct(set): the first node in the set with each string value
+ */
+static void
+slaxExsltSetsDistinct (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    xmlXPathObjectPtr obj;
+    xmlNodeSetPtr set, ret;
+    slax_node_hash_t hash;
+    void *user = NULL;
+    int boolval = 0;
+    int i;
+
+    if (nargs != 1) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    /*
+     * libexslt passes along the result tree fragment bookkeeping
+     * that older libxslts keep in these fields, so we do too
+     */
+    if (ctxt->value != NULL) {
+	boolval = ctxt->value->boolval;
+	user = ctxt->value->user;
+	ctxt->value->boolval = 0;
+	ctxt->value->user = NULL;
+    }
+
+    set = xmlXPathPopNodeSet(ctxt);
+    if (xmlXPathCheckError(ctxt))
+	return;
+
+    if (xmlXPathNodeSetIsEmpty(set)) {
+	ret = set;
+
+    } else {
+	ret = xmlXPathNodeSetCreate(NULL);
+	if (ret == NULL
+		|| slaxExsltHashInit(&hash, set->nodeTab, set->nodeNr,
+				     TRUE) < 0) {
+	    if (ret)
+		xmlXPathFreeNodeSet(ret);
+	    xmlXPathFreeNodeSet(set);
+	    xmlXPathSetError(ctxt, XPATH_MEMORY_ERROR);
+	    return;
+	}
+
+	for (i = 0; i < set->nodeNr; i++) {
+	    hash.snh_strings[i] = xmlXPathCastNodeToString(set->nodeTab[i]);
+	    if (hash.snh_strings[i] == NULL)
+		continue;
+
+	    hash.snh_hashes[i] = slaxExsltHashString(hash.snh_strings[i]);
+	    if (!slaxExsltHashAdd(&hash, i))
+		xmlXPathNodeSetAddUnique(ret, set->nodeTab[i]);
+	}
+
+	slaxExsltHashClean(&hash);
+	xmlXPathFreeNodeSet(set);
+    }
+
+    obj = xmlXPathWrapNodeSet(ret);
+    if (obj == NULL) {
+	xmlXPathFreeNodeSet(ret);
+	xmlXPathSetError(ctxt, XPATH_MEMORY_ERROR);
+	return;
+    }
+
+    obj->user = user;
+    obj->boolval = boolval;
+    valuePush(ctxt, obj);
+}
+
+/*
+ * Add a <token> to our result
+ */
+static void
+slaxExsltAddToken (xmlDocPtr container, xmlNodeSetPtr set,
+		   const xmlChar *token, int len)
+{
+    xmlNodePtr nodep, textp;
+
+    nodep = xmlNewDocNode(container, NULL, (const xmlChar *) "token", NULL);
+    if (nodep == NULL)
+	return;
+
+    textp = xmlNewDocTextLen(container, token, len);
+    if (textp)
+	xmlAddChild(nodep, textp);
+
+    xmlAddChild((xmlNodePtr) container, nodep);
+    xmlXPathNodeSetAddUnique(set, nodep);
+}
+
+/*
+ * How long is the UTF-8 character at "cp"?  Like xmlUTF8Strsize(),
+ * we don't step past the end of the string on a short sequence.
+ */
+static inline int
+slaxExsltCharLen (const xmlChar *cp)
+{
+    int len, i;
+
+    if (*cp < 0xc0)
+	len = 1;
+    else if (*cp < 0xe0)
+	len = 2;
+    else if (*cp < 0xf0)
+	len = 3;
+    else
+	len = 4;
+
+    for (i = 1; i < len; i++)
+	if (cp[i] == '\0')
+	    return i;
+
+    return len;
+}
+
+/*
+ * Is the character at "cp" (of length "len") one of the multi-byte
+ * delimiters?
+ */
+static int
+slaxExsltIsWideDelimiter (const xmlChar *wide, const xmlChar *cp, int len)
+{
+    int wlen;
+
+    for ( ; *wide; wide += wlen) {
+	wlen = slaxExsltCharLen(wide);
+	if (wlen == len && memcmp(wide, cp, len) == 0)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * str:tokenize(string, delimiters?): split a string into <token>
+ * elements at any of the delimiter characters, or into single
+ * characters if the delimiters are empty
+ */
+static void
+slaxExsltStrTokenize (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    xmlChar *str, *delimiters, *wide = NULL, *wp = NULL;
+    const xmlChar *cp, *token;
+    unsigned char ascii[256];
+    xmlXPathObjectPtr ret = NULL;
+    xmlDocPtr container;
+    int clen, is_delim;
+
+    if (nargs < 1 || nargs > 2) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    if (nargs == 2) {
+	delimiters = xmlXPathPopString(ctxt);
+	if (xmlXPathCheckError(ctxt))
+	    return;
+    } else {
+	delimiters = xmlStrdup((const xmlChar *) EXSLT_DELIMITERS);
+    }
+    if (delimiters == NULL)
+	return;
+
+    str = xmlXPathPopString(ctxt);
+    if (xmlXPathCheckError(ctxt) || str == NULL) {
+	xmlFree(delimiters);
+	return;
+    }
+
+    /* Single-byte delimiters go in a table; the rest we list */
+    bzero(ascii, sizeof(ascii));
+    for (cp = delimiters; *cp; cp += clen) {
+	clen = slaxExsltCharLen(cp);
+	if (clen == 1) {
+	    ascii[*cp] = TRUE;
+	} else {
+	    if (wide == NULL) {
+		wide = xmlMalloc(xmlStrlen(delimiters) + 1);
+		if (wide == NULL)
+		    goto fail;
+		wp = wide;
+	    }
+	    memcpy(wp, cp, clen);
+	    wp += clen;
+	}
+    }
+    if (wide)
+	*wp = '\0';
+
+    container = slaxMakeRtf(ctxt);
+    if (container == NULL)
+	goto fail;
+
+    ret = xmlXPathNewNodeSet(NULL);
+    if (ret == NULL)
+	goto fail;
+
+    for (cp = token = str; *cp; cp += clen) {
+	clen = (*cp < 0x80) ? 1 : slaxExsltCharLen(cp);
+
+	if (*delimiters == '\0') {
+	    /* Empty delimiters means every character is a token */
+	    slaxExsltAddToken(container, ret->nodesetval, cp, clen);
+	    token = cp + clen;
+	    continue;
+	}
+
+	if (clen == 1)
+	    is_delim = ascii[*cp];
+	else
+	    is_delim = wide && slaxExsltIsWideDelimiter(wide, cp, clen);
+
+	if (is_delim) {
+	    if (cp != token)	/* Discard empty tokens */
+		slaxExsltAddToken(container, ret->nodesetval,
+				  token, cp - token);
+	    token = cp + clen;
+	}
+    }
+
+    if (token != cp)
+	slaxExsltAddToken(container, ret->nodesetval, token, cp - token);
+
+ fail:
+    if (ret)
+	valuePush(ctxt, ret);
+    else
+	valuePush(ctxt, xmlXPathNewNodeSet(NULL));
+
+    if (wide)
+	xmlFree(wide);
+    xmlFree(delimiters);
+    xmlFree(str);
+}
+
+static slax_function_table_t slaxExsltSetsTable[] = {
+    {
+	"difference", slaxExsltSetsDifference,
+	"Return the nodes of the first set that are not in the second",
+	"(node-set, node-set)", XPATH_NODESET,
+    },
+    {
+	"distinct", slaxExsltSetsDistinct,
+	"Return the first node with each distinct string value",
+	"(node-set)", XPATH_NODESET,
+    },
+    {
+	"intersection", slaxExsltSetsIntersection,
+	"Return the nodes that are in both sets",
+	"(node-set, node-set)", XPATH_NODESET,
+    },
+    { NULL, NULL, NULL, NULL, XPATH_UNDEFINED }
+};
+
+static slax_function_table_t slaxExsltStringsTable[] = {
+    {
+	"tokenize", slaxExsltStrTokenize,
+	"Split a string into <token> elements",
+	"(string, delimiters?)", XPATH_XSLT_TREE,
+    },
+    { NULL, NULL, NULL, NULL, XPATH_UNDEFINED }
+};
+
+/*
+ * Register the EXSLT libraries, replacing the stock versions of the
+ * functions we implement.  libxslt keeps one entry per name and URI,
+ * so registering ours second is all it takes.
+ */
+void
+slaxExsltRegisterAll (void)
+{
+    exsltRegisterAll();
+
+    slaxRegisterFunctionTable((const char *) EXSLT_SETS_NAMESPACE,
+			      slaxExsltSetsTable);
+    slaxRegisterFunctionTable((const char *) EXSLT_STRINGS_NAMESPACE,
+			      slaxExsltStringsTable);
+}
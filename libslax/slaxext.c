@@ -20,6 +20,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <paths.h>
 #include <regex.h>
@@ -29,6 +30,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
@@ -57,6 +59,9 @@
 #include <libpsu/psuthread.h>
 
 #include "slaxext.h"
+#include "slaxdampen.h"
+#include "slaxstats.h"
+#include "slaxtrace.h"
 
 #ifdef O_EXLOCK
 #define DAMPEN_O_FLAGS (O_CREAT | O_RDWR | O_EXLOCK)
@@ -168,6 +173,7 @@ slaxMakeRtf (xmlXPathParserContextPtr ctxt)
 	return NULL;
     
     xsltRegisterLocalRVT(tctxt, container);
+    SLAX_STATS_INC(ss_rtfs);
     return container;
 }
 
@@ -188,10 +194,22 @@ typedef struct trace_precomp_s {
 
 /*
  * This is the callback function that we use to pass trace data
- * up to the caller.
+ * up to the caller.  A thread can have its own, which it uses in
+ * place of the process's (slaxTraceEnableThread).
  */
-static THREAD_GLOBAL(slaxTraceCallback_t) slaxTraceCallback;
-static THREAD_GLOBAL(void *) slaxTraceCallbackData;
+typedef struct slax_trace_hook_s {
+    slaxTraceCallback_t sth_func; /* Callback function */
+    void *sth_data;		/* Opaque data passed to sth_func */
+} slax_trace_hook_t;
+
+static THREAD_GLOBAL(slax_trace_hook_t) slaxTraceHook;
+static THREAD_LOCAL(slax_trace_hook_t) slaxTraceThreadHook;
+
+static inline const slax_trace_hook_t *
+slaxTraceCurrent (void)
+{
+    return slaxTraceThreadHook.sth_func ? &slaxTraceThreadHook : &slaxTraceHook;
+}
 
 /**
  * Deallocates a trace_precomp_t
@@ -256,6 +274,45 @@ slaxTraceCompile (xsltStylesheetPtr style, xmlNodePtr inst,
     return &comp->tp_comp;
 }
 
+/**
+ * Record the value of a trace statement in the trace ring
+ *
+ * @inst the <trace> element
+ * @value the value to be traced
+ */
+static void
+slaxTraceElementRing (xmlNodePtr inst, xmlXPathObjectPtr value)
+{
+    int i;
+
+    switch (value->type) {
+    case XPATH_STRING:
+	if (value->stringval)
+	    slaxTraceRingString(inst, (const char *) value->stringval);
+	break;
+
+    case XPATH_NUMBER:
+	slaxTraceRingNumber(inst, value->floatval);
+	break;
+
+    case XPATH_XSLT_TREE:
+    case XPATH_NODESET:
+	if (value->nodesetval) {
+	    xmlNodeSetPtr tab = value->nodesetval;
+	    for (i = 0; i < tab->nodeNr; i++)
+		slaxTraceRingNode(inst, tab->nodeTab[i]);
+	}
+	break;
+
+    case XPATH_BOOLEAN:
+	slaxTraceRingString(inst, value->boolval ? "true" : "false");
+	break;
+
+    default:
+	;
+    }
+}
+
 /**
  * Handle a <trace> element, as manufactured by the "trace" statement
  *
@@ -270,9 +327,10 @@ slaxTraceElement (xsltTransformContextPtr ctxt,
 		  xsltElemPreCompPtr precomp)
 {
     trace_precomp_t *comp = (trace_precomp_t *) precomp;
+    const slax_trace_hook_t *hook = slaxTraceCurrent();
     xmlXPathObjectPtr value;
 
-    if (slaxTraceCallback == NULL)
+    if (hook->sth_func == NULL && !slaxTraceRingEnabled())
 	return;
 
     if (comp->tp_select) {
@@ -312,6 +370,7 @@ slaxTraceElement (xsltTransformContextPtr ctxt,
 	}
 
 	xsltRegisterLocalRVT(ctxt, container);	
+	SLAX_STATS_INC(ss_rtfs);
 
 	/* Set up the insertion point for new output */
 	save_insert = ctxt->insert;
@@ -336,15 +395,19 @@ slaxTraceElement (xsltTransformContextPtr ctxt,
      */
     xsltExtensionInstructionResultRegister(ctxt, value);
 
+    if (slaxTraceRingEnabled()) {
+	slaxTraceElementRing(inst, value);
+	return;
+    }
+
     switch (value->type) {
     case XPATH_STRING:
 	if (value->stringval)
-	    slaxTraceCallback(slaxTraceCallbackData, NULL,
-			      "%s", value->stringval);
+	    hook->sth_func(hook->sth_data, NULL, "%s", value->stringval);
 	break;
 
     case XPATH_NUMBER:
-	slaxTraceCallback(slaxTraceCallbackData, NULL, "%f", value->floatval);
+	hook->sth_func(hook->sth_data, NULL, "%f", value->floatval);
 	break;
 
     case XPATH_XSLT_TREE:
@@ -353,15 +416,14 @@ slaxTraceElement (xsltTransformContextPtr ctxt,
 	    int i;
 	    xmlNodeSetPtr tab = value->nodesetval;
 	    for (i = 0; i < tab->nodeNr; i++) {
-		slaxTraceCallback(slaxTraceCallbackData,
-				  tab->nodeTab[i], NULL);
+		hook->sth_func(hook->sth_data, tab->nodeTab[i], NULL);
 	    }
 	}
 	break;
 
     case XPATH_BOOLEAN:
-	slaxTraceCallback(slaxTraceCallbackData, NULL, "%s",
-			  value->boolval ? "true" : "false");
+	hook->sth_func(hook->sth_data, NULL, "%s",
+		       value->boolval ? "true" : "false");
 	break;
 
     case XPATH_UNDEFINED:
@@ -383,8 +445,22 @@ slaxTraceElement (xsltTransformContextPtr ctxt,
 void
 slaxTraceEnable (slaxTraceCallback_t func, void *data)
 {
-    slaxTraceCallback = func;
-    slaxTraceCallbackData = data;
+    slaxTraceHook.sth_func = func;
+    slaxTraceHook.sth_data = data;
+}
+
+/**
+ * Enable tracing with a callback for the calling thread only; a
+ * NULL function puts the thread back on the process's callback
+ *
+ * @func callback function
+ * @data opaque data passed to callback
+ */
+void
+slaxTraceEnableThread (slaxTraceCallback_t func, void *data)
+{
+    slaxTraceThreadHook.sth_func = func;
+    slaxTraceThreadHook.sth_data = data;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -546,12 +622,442 @@ slaxWhileElement (xsltTransformContextPtr ctxt,
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ * Sequences like "1 ... 10000000" and the lines of a huge string are
+ * cheap to describe but expensive to build, and most of the time
+ * they are only ever used as the select of a for-each (which is what
+ * the SLAX "for" statement makes).  When that's the case, we don't
+ * need to build the whole node-set: we can run the for-each's body
+ * ourselves, making each node just before its turn and freeing it
+ * just after, and hand the for-each an empty node-set.  The
+ * func:function code in libexslt runs template code from inside an
+ * XPath function in the same way.
+ *
+ * We only do this when the select is nothing but a single call to
+ * our function and the for-each has no sort, so the body sees the
+ * same nodes, positions and sizes in the same order as it would with
+ * the full node-set.  Each node sits alone in its container, so the
+ * body must also not be able to look past it: no parent, ancestor,
+ * sibling or absolute paths, and no calls to templates or functions
+ * that might.
+ */
+typedef xmlNodePtr (*slaxExtLazyNext_t)(xmlDocPtr container, void *opaque);
+
+/*
+ * Skip over an XPath string literal starting at cp
+ */
+static const char *
+slaxExtLazySkipQuote (const char *cp)
+{
+    int quote = *cp++;
+
+    while (*cp && *cp != quote)
+	cp += 1;
+
+    return *cp ? cp + 1 : NULL;
+}
+
+/*
+ * Axes that look outside the node they start from
+ */
+static const char *slaxExtLazyAxes[] = {
+    "ancestor", "ancestor-or-self", "following", "following-sibling",
+    "parent", "preceding", "preceding-sibling", NULL
+};
+
+/*
+ * Core functions that look at the node's document or ancestors
+ */
+static const char *slaxExtLazyFuncs[] = {
+    "id", "key", "lang", NULL
+};
+
+/*
+ * Our own functions that only look at their arguments
+ */
+static const char *slaxExtLazyOk[] = {
+    FUNC_BUILD_SEQUENCE, "break-lines", "break_lines", NULL
+};
+
+static int
+slaxExtLazyMember (const char *name, size_t len, const char **list)
+{
+    for ( ; *list; list++)
+	if (strlen(*list) == len && strncmp(*list, name, len) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * Is "prefix:name" (of length len) one of our lazy functions?
+ */
+static int
+slaxExtLazyOurs (xmlNodePtr nodep, const char *name, size_t len)
+{
+    const char *colon = memchr(name, ':', len);
+    char prefix[BUFSIZ];
+    size_t plen;
+    xmlNsPtr ns;
+
+    if (colon == NULL || (plen = colon - name) >= sizeof(prefix))
+	return FALSE;
+
+    memcpy(prefix, name, plen);
+    prefix[plen] = '\0';
+
+    ns = xmlSearchNs(nodep->doc, nodep, (const xmlChar *) prefix);
+    if (ns == NULL || !streq((const char *) ns->href, SLAX_URI))
+	return FALSE;
+
+    name = colon + 1;
+    len -= plen + 1;
+
+    return slaxExtLazyMember(name, len, slaxExtLazyOk);
+}
+
+/*
+ * Can this XPath expression only see the context node's own subtree?
+ * We're conservative: the expression is scanned, not parsed, so a
+ * few harmless ones (like "a / b") are refused too.  Calls to our
+ * own lazy functions only look at their arguments, so nested loops
+ * are fine.  Returns the end of the expression, or NULL if it's not
+ * safe.  With "avt", we stop at the closing brace of an attribute
+ * value template.  "nodep" is the node holding the expression, for
+ * namespace lookups.
+ */
+static const char *
+slaxExtLazyExprOk (xmlNodePtr nodep, const char *cp, int avt)
+{
+    const char *start;
+    size_t len;
+    int last = '(';		/* As if we're at the start of an argument */
+    int spaced = FALSE;
+
+    for ( ; *cp; cp++) {
+	if (isspace((int) *cp)) {
+	    spaced = TRUE;
+	    continue;
+	}
+
+	if (avt && *cp == '}')
+	    return cp;
+
+	if (*cp == '"' || *cp == '\'') {
+	    cp = slaxExtLazySkipQuote(cp);
+	    if (cp == NULL)
+		return NULL;
+	    cp -= 1;
+	    last = 'x';
+	    spaced = FALSE;
+	    continue;
+	}
+
+	if (*cp == '.' && cp[1] == '.')
+	    return NULL;
+
+	/*
+	 * A '/' that doesn't follow a step starts an absolute path,
+	 * which would reach our container.  A word before a space may
+	 * be an operator ("and", "div"), so that's refused too.
+	 */
+	if (*cp == '/') {
+	    if (strchr("([,|{=<>!+-", last)
+		    || (spaced && (isalnum(last) || last == '*')))
+		return NULL;
+	    if (cp[1] == '/')
+		cp += 1;
+	    last = '/';
+	    spaced = FALSE;
+	    continue;
+	}
+
+	if (isalpha((int) *cp) || *cp == '_') {
+	    start = cp;
+	    while (isalnum((int) cp[1]) || cp[1] == '_' || cp[1] == '-'
+		   || cp[1] == '.' || (cp[1] == ':' && cp[2] != ':'))
+		cp += 1;
+	    len = cp - start + 1;
+
+	    const char *np = cp + 1;
+	    while (isspace((int) *np))
+		np += 1;
+
+	    if (np[0] == ':' && np[1] == ':') {
+		if (slaxExtLazyMember(start, len, slaxExtLazyAxes))
+		    return NULL;
+	    } else if (*np == '(') {
+		/* Extension and user functions could do anything */
+		if (memchr(start, ':', len) != NULL) {
+		    if (!slaxExtLazyOurs(nodep, start, len))
+			return NULL;
+		} else if (slaxExtLazyMember(start, len, slaxExtLazyFuncs))
+		    return NULL;
+	    }
+
+	    last = 'x';
+	    spaced = FALSE;
+	    continue;
+	}
+
+	last = (unsigned char) *cp;
+	spaced = FALSE;
+    }
+
+    return avt ? NULL : cp;
+}
+
+/*
+ * Check the expressions inside an attribute value template
+ */
+static int
+slaxExtLazyAvtOk (xmlNodePtr nodep, const char *cp)
+{
+    for ( ; *cp; cp++) {
+	if (*cp != '{')
+	    continue;
+	if (cp[1] == '{') {	/* "{{" is a literal brace */
+	    cp += 1;
+	    continue;
+	}
+
+	cp = slaxExtLazyExprOk(nodep, cp + 1, TRUE);
+	if (cp == NULL)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Can this template code run with each node alone in its container?
+ */
+static int
+slaxExtLazyBodyOk (xmlNodePtr nodep)
+{
+    xmlAttrPtr attr;
+    xmlChar *value;
+    int ok;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	if (IS_XSLT_ELEM(nodep)) {
+	    /* Templates can't be checked from here */
+	    if (IS_XSLT_NAME(nodep, "apply-templates")
+		    || IS_XSLT_NAME(nodep, "call-template")
+		    || IS_XSLT_NAME(nodep, "apply-imports"))
+		return FALSE;
+
+	    /* Without a value, xsl:number counts preceding nodes */
+	    if (IS_XSLT_NAME(nodep, "number")
+		    && !xmlHasProp(nodep, (const xmlChar *) "value"))
+		return FALSE;
+	}
+
+	for (attr = nodep->properties; attr; attr = attr->next) {
+	    value = xmlNodeGetContent((xmlNodePtr) attr);
+	    if (value == NULL)
+		continue;
+
+	    if (streq((const char *) attr->name, ATT_SELECT)
+		    || streq((const char *) attr->name, ATT_TEST)
+		    || streq((const char *) attr->name, "value"))
+		ok = (slaxExtLazyExprOk(nodep, (const char *) value, FALSE)
+		      != NULL);
+	    else
+		ok = slaxExtLazyAvtOk(nodep, (const char *) value);
+
+	    xmlFree(value);
+	    if (!ok)
+		return FALSE;
+	}
+
+	if (!slaxExtLazyBodyOk(nodep->children))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Can the call we're in the middle of make its nodes lazily?  It has
+ * to be the whole of the select of the for-each being run.
+ */
+static int
+slaxExtLazyCheck (xmlXPathParserContextPtr ctxt, int nargs,
+		  const char *fname)
+{
+    xsltTransformContextPtr tctxt;
+    xmlNodePtr inst, cop;
+    char *select;
+    const char *cp;
+    size_t flen = strlen(fname);
+    int depth = 0, rc = FALSE;
+
+    /* Our arguments must be the only things on the value stack */
+    if (ctxt->valueNr != nargs)
+	return FALSE;
+
+    tctxt = xsltXPathGetTransformContext(ctxt);
+    if (tctxt == NULL || tctxt->state == XSLT_STATE_STOPPED)
+	return FALSE;
+
+    inst = tctxt->inst;
+    if (inst == NULL || !IS_XSLT_ELEM(inst) || !IS_XSLT_NAME(inst, "for-each"))
+	return FALSE;
+
+    /* A sort needs the whole node-set */
+    for (cop = inst->children; cop; cop = cop->next)
+	if (IS_XSLT_ELEM(cop) && IS_XSLT_NAME(cop, "sort"))
+	    return FALSE;
+
+    select = (char *) xmlGetProp(inst, (const xmlChar *) ATT_SELECT);
+    if (select == NULL)
+	return FALSE;
+
+    /* Look for "prefix:fname(...)", with nothing after it */
+    cp = select;
+    while (isspace((int) *cp))
+	cp += 1;
+    while (isalnum((int) *cp) || *cp == '_' || *cp == '-' || *cp == '.')
+	cp += 1;
+    if (*cp++ != ':' || strncmp(cp, fname, flen) != 0)
+	goto done;
+
+    /* Our name can't appear again (say, in one of our own arguments) */
+    cp += flen;
+    if (strstr(cp, fname) != NULL)
+	goto done;
+
+    while (isspace((int) *cp))
+	cp += 1;
+    if (*cp != '(')
+	goto done;
+
+    while (*cp) {
+	if (*cp == '"' || *cp == '\'') {
+	    cp = slaxExtLazySkipQuote(cp);
+	    if (cp == NULL)
+		goto done;
+	    continue;
+	}
+
+	if (*cp == '(')
+	    depth += 1;
+	else if (*cp == ')' && --depth == 0)
+	    break;
+	cp += 1;
+    }
+
+    if (*cp != ')')
+	goto done;
+
+    for (cp += 1; isspace((int) *cp); cp++)
+	continue;
+
+    rc = (*cp == '\0') && slaxExtLazyBodyOk(inst->children);
+
+ done:
+    xmlFree(select);
+    return rc;
+}
+
+/*
+ * Run the body of the current for-each over each node made by "func",
+ * freeing each one when its turn is over.  "count" is the number of
+ * nodes func will make, for last().
+ */
+static void
+slaxExtLazyForEach (xmlXPathParserContextPtr ctxt, unsigned long count,
+		    slaxExtLazyNext_t func, void *opaque)
+{
+    xsltTransformContextPtr tctxt = xsltXPathGetTransformContext(ctxt);
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlNodePtr inst = tctxt->inst, nodep;
+    xmlDocPtr container;
+    int pos;
+
+    container = slaxMakeRtf(ctxt);
+    if (container == NULL)
+	return;
+
+    /* Save what the for-each would save */
+    xmlNodePtr save_node = tctxt->node;
+    xmlNodePtr save_xpnode = xpctxt->node;
+    xmlDocPtr save_doc = xpctxt->doc;
+    xmlNsPtr *save_nslist = xpctxt->namespaces;
+    int save_nscount = xpctxt->nsNr;
+    int save_size = xpctxt->contextSize;
+    int save_pos = xpctxt->proximityPosition;
+
+    if (count > INT_MAX)
+	count = INT_MAX;
+
+    for (pos = 1; ; pos++) {
+	nodep = (*func)(container, opaque);
+	if (nodep == NULL)
+	    break;
+
+	xmlAddChild((xmlNodePtr) container, nodep);
+
+	tctxt->node = nodep;
+	xpctxt->doc = container;
+	xpctxt->proximityPosition = pos;
+	xpctxt->contextSize = count;
+
+	xsltApplyOneTemplate(tctxt, nodep, inst->children, NULL, NULL);
+	tctxt->inst = inst;
+
+	xmlUnlinkNode(nodep);
+	xmlFreeNode(nodep);
+
+	/* Stop on errors and when the debugger says 'quit' or 'run' */
+	if (tctxt->state == XSLT_STATE_STOPPED
+		|| tctxt->debugStatus == XSLT_DEBUG_QUIT
+		|| tctxt->debugStatus == XSLT_DEBUG_RUN_RESTART)
+	    break;
+    }
+
+    tctxt->node = save_node;
+    xpctxt->node = save_xpnode;
+    xpctxt->doc = save_doc;
+    xpctxt->namespaces = save_nslist;
+    xpctxt->nsNr = save_nscount;
+    xpctxt->contextSize = save_size;
+    xpctxt->proximityPosition = save_pos;
+}
+
+typedef struct slax_sequence_s {
+    long long ss_num;		/* Next number in the sequence */
+    long long ss_last;		/* Sentinel (one past the end) */
+    long long ss_step;		/* +1 or -1 */
+} slax_sequence_t;
+
+static xmlNodePtr
+slaxExtSequenceNext (xmlDocPtr container, void *opaque)
+{
+    slax_sequence_t *ssp = opaque;
+    char buf[BUFSIZ];
+
+    if (ssp->ss_num == ssp->ss_last)
+	return NULL;
+
+    snprintf(buf, sizeof(buf), "%qd", ssp->ss_num);
+    ssp->ss_num += ssp->ss_step;
+
+    return xmlNewDocRawNode(container, NULL,
+			    (const xmlChar *) "item", (xmlChar *) buf);
+}
+
 /*
  * Return a sequence of fictional nodes, based on the two arguments.
  * "1 .. 10" builds <item> 1, <item> 2, thru <item> 10, where
  * "44 .. 40" builds <item> 44, <item> 43, thur <item> 40.
  * These can be used to make cheap iterators, but have the sad side effect
- * of making all the nodes at one time.
+ * of making all the nodes at one time, unless we're the select of a
+ * for-each, where we make them one at a time (see slaxExtLazyForEach).
  */
 static void
 slaxExtBuildSequence (xmlXPathParserContextPtr ctxt, int nargs)
@@ -561,12 +1067,15 @@ slaxExtBuildSequence (xmlXPathParserContextPtr ctxt, int nargs)
     xmlDocPtr container;
     xmlXPathObjectPtr ret = NULL;
     char buf[BUFSIZ];
+    int lazy;
 
     if (nargs != 2) {
 	xmlXPathSetArityError(ctxt);
 	return;
     }
 
+    lazy = slaxExtLazyCheck(ctxt, nargs, FUNC_BUILD_SEQUENCE);
+
     /* Pop args in reverse order */
     last = xmlXPathPopNumber(ctxt);
     if (xmlXPathCheckError(ctxt))
@@ -585,6 +1094,15 @@ slaxExtBuildSequence (xmlXPathParserContextPtr ctxt, int nargs)
 
     slaxLog("build-sequence: %qd ... %qd + %qd", start, last, step);
 
+    if (lazy) {
+	slax_sequence_t seq = { start, last, step };
+
+	slaxExtLazyForEach(ctxt, (last - start) * step,
+			   slaxExtSequenceNext, &seq);
+	valuePush(ctxt, xmlXPathNewNodeSet(NULL));
+	return;
+    }
+
     /* Return a result tree fragment */
     container = slaxMakeRtf(ctxt);
     if (container == NULL)
@@ -600,7 +1118,7 @@ slaxExtBuildSequence (xmlXPathParserContextPtr ctxt, int nargs)
 				 (const xmlChar *) "item", (xmlChar *) buf);
 	if (nodep) {
 	    xmlAddChild((xmlNodePtr) container, nodep);
-	    xmlXPathNodeSetAdd(ret->nodesetval, nodep);
+	    xmlXPathNodeSetAddUnique(ret->nodesetval, nodep);
 	}
     }
 
@@ -786,63 +1304,118 @@ slaxExtPrintFreeArgs (int argc, xmlChar **argv)
 }
 
 /*
- * This is the brutal guts of the printf code.  We pull out each
- * field and format it into a buffer, which we then return.
+ * A format string, parsed once and cached.  Each segment is a run of
+ * literal text (with escapes already processed) followed by an
+ * optional field.  pf_estimate remembers how big the output was
+ * last time, so we can size the buffer up front.
  */
-char *
-slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
+typedef struct slax_printf_seg_s {
+    int psg_lit_off;		/* Offset of literal text in pf_lits */
+    int psg_lit_len;		/* Length of literal text */
+    char *psg_field;		/* Format for snprintf (NULL for none) */
+    char *psg_tag;		/* Tag for "%jt{TAG}" (or NULL) */
+    int psg_tlen;		/* Length of psg_tag */
+    int psg_args;		/* Number of arguments used (1..3) */
+    unsigned psg_flags;		/* Flags (PSGF_*) */
+} slax_printf_seg_t;
+
+#define PSGF_CAPITALIZE	(1<<0)	/* "%jc": capitalize the field */
+#define PSGF_ONCE	(1<<1)	/* "%j1": don't repeat the same value */
+
+typedef struct slax_printf_format_s {
+    xmlChar *pf_fmtstr;		/* Format string (our key) */
+    unsigned pf_hash;		/* Hash of pf_fmtstr */
+    char *pf_lits;		/* Literal text for all segments */
+    int pf_nsegs;		/* Number of segments */
+    int pf_estimate;		/* Output size estimate */
+    slax_printf_seg_t pf_segs[0]; /* Segments */
+} slax_printf_format_t;
+
+#define SLAX_PRINTF_CACHE_SIZE 32 /* Number of formats cached */
+
+static THREAD_LOCAL(slax_printf_format_t *)
+	slaxPrintfCache[SLAX_PRINTF_CACHE_SIZE];
+
+static void
+slaxExtPrintFormatFree (slax_printf_format_t *pfp)
 {
-    slax_printf_buffer_t pb;
+    int i;
+
+    if (pfp == NULL)
+	return;
+
+    for (i = 0; i < pfp->pf_nsegs; i++) {
+	xmlFreeAndEasy(pfp->pf_segs[i].psg_field);
+	xmlFreeAndEasy(pfp->pf_segs[i].psg_tag);
+    }
+
+    xmlFreeAndEasy(pfp->pf_lits);
+    xmlFree(pfp->pf_fmtstr);
+    xmlFree(pfp);
+}
+
+/*
+ * Parse a format string into literal runs and field descriptors.
+ */
+static slax_printf_format_t *
+slaxExtPrintCompile (const xmlChar *fmtstr, unsigned hash)
+{
+    slax_printf_format_t *pfp;
+    slax_printf_seg_t *psgp;
+    slax_printf_buffer_t lits;
     const xmlChar *fmt;
-    int arg_ndx = 1;
-    int save_argc = argc;
+    int nsegs = 1, lit_off = 0;
+
+    /* Each '%' makes at most one field; one more for the tail */
+    for (fmt = fmtstr; (fmt = xmlStrchr(fmt, '%')) != NULL; fmt++)
+	nsegs += 1;
+
+    pfp = xmlMalloc(sizeof(*pfp) + nsegs * sizeof(pfp->pf_segs[0]));
+    if (pfp == NULL)
+	return NULL;
+
+    bzero(pfp, sizeof(*pfp) + nsegs * sizeof(pfp->pf_segs[0]));
+    pfp->pf_fmtstr = xmlStrdup(fmtstr);
+    pfp->pf_hash = hash;
+    if (pfp->pf_fmtstr == NULL) {
+	xmlFree(pfp);
+	return NULL;
+    }
 
     /* Use this local buffer to extract the format for each field */
     int flen = xmlStrlen(fmtstr); /* Worst case */
     char *field = alloca(flen + 1);
     char *fp, *efp = field + flen;
 
-    bzero(&pb, sizeof(pb));
+    bzero(&lits, sizeof(lits));
     field[0] = '%';
-
-    /* 
-     * We keep the last set of arguments if any of the fields
-     * had "%j1" turned on.  But if this printf call uses a
-     * difference format string, we nuke them.
-     */
-    static THREAD_LOCAL(xmlChar **) last_argv;
-    static THREAD_LOCAL(int) last_argc;
-    xmlChar **new_argv = NULL;	/* Build new 'last' here */
-
-    if (last_argv && last_argv[0] && !xmlStrEqual(fmtstr, last_argv[0]))
-	last_argv = slaxExtPrintFreeArgs(last_argc, last_argv);
+    psgp = pfp->pf_segs;
 
     for (fmt = fmtstr; *fmt; ) {
 	const xmlChar *percent = xmlStrchr(fmt, '%');
 	if (percent == NULL) {
 	    /* No percent means that the string is dull.  Copy it */
-	    slaxExtPrintAppend(&pb, fmt, xmlStrlen(fmt));
+	    slaxExtPrintAppend(&lits, fmt, xmlStrlen(fmt));
 	    break;
 	}
 
 	if (percent != fmt) {
 	    /* Copy the leading portion of the string */
-	    slaxExtPrintAppend(&pb, fmt, percent - fmt);
+	    slaxExtPrintAppend(&lits, fmt, percent - fmt);
 	    fmt = percent;
 	}
 
 	if (percent[1] == '%') { /* Double percent */
-	    slaxExtPrintAppend(&pb, percent, 1);
+	    slaxExtPrintAppend(&lits, percent, 1);
 	    fmt = percent + 2;
 	    continue;
 	}
 
 	int args_used = 1;
 	int done = FALSE;
-	int capitalize = FALSE;
+	unsigned flags = 0;
 	char *tag = NULL;
 	int tlen = 0;
-	int once = FALSE;
 
 	fmt += 1;		/* Skip percent */
 
@@ -867,13 +1440,16 @@ slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
 		break;
 
 	    case 'j':
+		if (fmt[1] == '\0')
+		    break;	/* Don't run off the end of the format */
+
 		switch (*++fmt) {
 		case 'c':
 		    /*
 		     * "%jc" turns on the 'capitalize' flag, which
 		     * capitalizes the first letter of the field.
 		     */
-		    capitalize = TRUE;
+		    flags |= PSGF_CAPITALIZE;
 		    break;
 
 		case 't':
@@ -893,25 +1469,19 @@ slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
 		    tep -= 1;	/* Skip '}' */
 
 		    tlen = tep - fmt + 1;
-		    tag = alloca(tlen + 1);
-		    memcpy(tag, fmt, tlen);
-		    tag[tlen] = '\0';
+		    xmlFreeAndEasy(tag);
+		    tag = xmlMalloc(tlen + 1);
+		    if (tag) {
+			memcpy(tag, fmt, tlen);
+			tag[tlen] = '\0';
+		    } else
+			tlen = 0;
 
 		    fmt = tep + 1; /* More part the '}' */
 		    break;
 
 		case '1':
-		    once = TRUE;
-		    if (new_argv == NULL) {
-			/* 2 == one for fmtstr, one for NULL */
-			new_argv = xmlMalloc((save_argc + 2)
-					     * sizeof(*new_argv));
-			if (new_argv) {
-			    new_argv[0] = xmlStrdup(fmtstr);
-			    bzero(&new_argv[1], (save_argc + 1)
-				  * sizeof(*new_argv));
-			}
-		    }
+		    flags |= PSGF_ONCE;
 		    break;
 		}
 
@@ -936,16 +1506,150 @@ slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
 	    }
 	}
 
-	if (args_used > argc) {
-	    /*
-	     * Should do something more here, but ...
-	     */
-	    break;
-	}
-
 	*fp = '\0';
 
-	int width = (args_used > 1) ? xmlAtoi(*argv++) : 0;
+	/* Close off this segment */
+	psgp->psg_lit_off = lit_off;
+	psgp->psg_lit_len = (lits.pb_cur - lits.pb_buf) - lit_off;
+	psgp->psg_field = (char *) xmlStrdup((const xmlChar *) field);
+	psgp->psg_tag = tag;
+	psgp->psg_tlen = tlen;
+	psgp->psg_args = args_used;
+	psgp->psg_flags = flags;
+
+	lit_off += psgp->psg_lit_len;
+	psgp += 1;
+
+	if (psgp[-1].psg_field == NULL) { /* Out of memory */
+	    pfp->pf_nsegs = psgp - pfp->pf_segs;
+	    pfp->pf_lits = lits.pb_buf;
+	    slaxExtPrintFormatFree(pfp);
+	    return NULL;
+	}
+    }
+
+    /* The tail segment holds any trailing literal text */
+    psgp->psg_lit_off = lit_off;
+    psgp->psg_lit_len = (lits.pb_cur - lits.pb_buf) - lit_off;
+    psgp += 1;
+
+    pfp->pf_nsegs = psgp - pfp->pf_segs;
+    pfp->pf_lits = lits.pb_buf;
+    pfp->pf_estimate = lits.pb_cur - lits.pb_buf + 1;
+
+    return pfp;
+}
+
+/*
+ * Find the parsed version of a format string, parsing it if needed.
+ * The cache is direct-mapped; a collision simply replaces the older
+ * format.
+ */
+static slax_printf_format_t *
+slaxExtPrintFormat (const xmlChar *fmtstr)
+{
+    slax_printf_format_t *pfp, **slotp;
+    unsigned hash = 2166136261U;
+    const xmlChar *cp;
+
+    for (cp = fmtstr; *cp; cp++)
+	hash = (hash ^ *cp) * 16777619U;
+
+    slotp = &slaxPrintfCache[hash % SLAX_PRINTF_CACHE_SIZE];
+    pfp = *slotp;
+    if (pfp && pfp->pf_hash == hash && xmlStrEqual(pfp->pf_fmtstr, fmtstr))
+	return pfp;
+
+    pfp = slaxExtPrintCompile(fmtstr, hash);
+    if (pfp == NULL)
+	return NULL;
+
+    slaxExtPrintFormatFree(*slotp);
+    *slotp = pfp;
+
+    return pfp;
+}
+
+/*
+ * Append bytes to the buffer, without any escape processing
+ */
+static void
+slaxExtPrintAppendRaw (slax_printf_buffer_t *pbp, const char *str, int len)
+{
+    if (len == 0)
+	return;
+
+    if (pbp->pb_end - pbp->pb_cur >= len || !slaxExtPrintExpand(pbp, len)) {
+	memcpy(pbp->pb_cur, str, len);
+	pbp->pb_cur += len;
+	*pbp->pb_cur = '\0';
+    }
+}
+
+/*
+ * This is the brutal guts of the printf code.  We take the parsed
+ * format and format each field into a buffer, which we then return.
+ */
+char *
+slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
+{
+    slax_printf_buffer_t pb;
+    slax_printf_format_t *pfp;
+    slax_printf_seg_t *psgp;
+    int arg_ndx = 1;
+    int save_argc = argc;
+    int i;
+
+    bzero(&pb, sizeof(pb));
+
+    pfp = slaxExtPrintFormat(fmtstr);
+    if (pfp == NULL)
+	return NULL;
+
+    if (pfp->pf_estimate > 1)
+	slaxExtPrintExpand(&pb, pfp->pf_estimate);
+
+    /* 
+     * We keep the last set of arguments if any of the fields
+     * had "%j1" turned on.  But if this printf call uses a
+     * difference format string, we nuke them.
+     */
+    static THREAD_LOCAL(xmlChar **) last_argv;
+    static THREAD_LOCAL(int) last_argc;
+    xmlChar **new_argv = NULL;	/* Build new 'last' here */
+
+    if (last_argv && last_argv[0] && !xmlStrEqual(fmtstr, last_argv[0]))
+	last_argv = slaxExtPrintFreeArgs(last_argc, last_argv);
+
+    for (i = 0, psgp = pfp->pf_segs; i < pfp->pf_nsegs; i++, psgp++) {
+	slaxExtPrintAppendRaw(&pb, pfp->pf_lits + psgp->psg_lit_off,
+			      psgp->psg_lit_len);
+
+	if (psgp->psg_field == NULL)
+	    continue;
+
+	int args_used = psgp->psg_args;
+	int once = (psgp->psg_flags & PSGF_ONCE) ? TRUE : FALSE;
+	char *tag = psgp->psg_tag;
+	int tlen = psgp->psg_tlen;
+
+	if (once && new_argv == NULL) {
+	    /* 2 == one for fmtstr, one for NULL */
+	    new_argv = xmlMalloc((save_argc + 2) * sizeof(*new_argv));
+	    if (new_argv) {
+		new_argv[0] = xmlStrdup(fmtstr);
+		bzero(&new_argv[1], (save_argc + 1) * sizeof(*new_argv));
+	    }
+	}
+
+	if (args_used > argc) {
+	    /*
+	     * Should do something more here, but ...
+	     */
+	    break;
+	}
+
+	int width = (args_used > 1) ? xmlAtoi(*argv++) : 0;
 	int precision = (args_used > 2) ? xmlAtoi(*argv++) : 0;
 
 	xmlChar *arg = *argv++;
@@ -975,33 +1679,28 @@ slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
 		new_argv[arg_ndx] = xmlStrdup(arg);
 	}
 
-	int left = pb.pb_end - pb.pb_cur;
-
 	/*
 	 * Prepend the tag ("%jt{TAG}") if the argument is non-empty
 	 */
-	if (tag && arg && *arg) {
-	    if (left >= tlen || !slaxExtPrintExpand(&pb, tlen)) {
-		memcpy(pb.pb_cur, tag, tlen);
-		pb.pb_cur += tlen;
-	    }
-	    left = pb.pb_end - pb.pb_cur;
-	}
+	if (tag && arg && *arg)
+	    slaxExtPrintAppendRaw(&pb, tag, tlen);
 
-	int needed = slaxExtPrintfToBuf(&pb, field, arg,
+	int left = pb.pb_end - pb.pb_cur;
+	int needed = slaxExtPrintfToBuf(&pb, psgp->psg_field, arg,
 				       args_used, width, precision);
 
-	if (needed > left) {
+	/* snprintf needs room for the trailing NUL */
+	if (needed >= left) {
 	    if (slaxExtPrintExpand(&pb, needed + 1))
 		needed = 0;
 	    else {
 		left = pb.pb_end - pb.pb_cur;
-		needed = slaxExtPrintfToBuf(&pb, field, arg,
+		needed = slaxExtPrintfToBuf(&pb, psgp->psg_field, arg,
 					   args_used, width, precision);
 	    }
 	}
 
-	if (capitalize && islower((int) *pb.pb_cur))
+	if ((psgp->psg_flags & PSGF_CAPITALIZE) && islower((int) *pb.pb_cur))
 	    *pb.pb_cur = toupper((int) *pb.pb_cur);
 
 	pb.pb_cur += needed;
@@ -1023,10 +1722,13 @@ slaxExtPrintIt (const xmlChar *fmtstr, int argc, xmlChar **argv)
 	last_argc = 0;
     }
 
+    /* Remember how much room we needed, for next time */
+    if (pb.pb_buf && pb.pb_cur - pb.pb_buf + 1 > pfp->pf_estimate)
+	pfp->pf_estimate = pb.pb_cur - pb.pb_buf + 1;
+
     return pb.pb_buf;
 }
 
-
 /*
  * printf -- C-style printf functionality with some juniper-specific
  * extensions.
@@ -1173,7 +1875,7 @@ slaxExtBreakString (xmlDocPtr container, xmlNodeSet *results, char *content,
     if (content == NULL) {
 	clone = slaxExtMakeTextNode(container, nsp, name, NULL, 0);
 	if (clone) {
-	    xmlXPathNodeSetAdd(results, clone);
+	    xmlXPathNodeSetAddUnique(results, clone);
 	    xmlAddChild((xmlNodePtr) container, clone);
 	}
 	return;
@@ -1184,7 +1886,7 @@ slaxExtBreakString (xmlDocPtr container, xmlNodeSet *results, char *content,
 	clone = slaxExtMakeTextNode(container, nsp, name,
 				    content, strlen(content));
 	if (clone) {
-	    xmlXPathNodeSetAdd(results, clone);
+	    xmlXPathNodeSetAddUnique(results, clone);
 	    xmlAddChild((xmlNodePtr) container, clone);
 	}
 	return;
@@ -1203,7 +1905,7 @@ slaxExtBreakString (xmlDocPtr container, xmlNodeSet *results, char *content,
 	clone = slaxExtMakeTextNode(container, nsp, name,
 				    sp, cp - sp - dos_format);
 	if (clone) {
-	    xmlXPathNodeSetAdd(results, clone);
+	    xmlXPathNodeSetAddUnique(results, clone);
 	    if (last)
 		xmlAddSibling(last, clone);
 
@@ -1222,38 +1924,26 @@ slaxExtBreakString (xmlDocPtr container, xmlNodeSet *results, char *content,
 }
 
 /*
- * Break a simple element into multiple elements, delimited by
- * newlines.  This is especially useful for big <output> elements,
- * such as are produced by the "show pfe" commands.
- *
- * Usage:  var $lines = slax:break-lines($output);
+ * One piece of text given to slax:break-lines(), along with the name
+ * (and namespace) to give the elements made from its lines
  */
-static void
-slaxExtBreakLines (xmlXPathParserContext *ctxt, int nargs)
+typedef struct slax_break_seg_s {
+    char *sbs_content;		/* Text to break (or NULL) */
+    xmlNsPtr sbs_ns;		/* Namespace for our elements */
+    const char *sbs_name;	/* Name for our elements */
+} slax_break_seg_t;
+
+/*
+ * Walk the arguments to slax:break-lines(), finding the text to be
+ * broken.  The segments point into the arguments, so these must
+ * outlive them.
+ */
+static slax_break_seg_t *
+slaxExtBreakSegments (xmlXPathObject **stack, int nargs, int *countp)
 {
-    xmlXPathObject *stack[nargs];	/* Stack for args as objects */
+    slax_break_seg_t *segs = NULL, *newp;
+    int ndx, count = 0, size = 0;
     xmlXPathObject *obj;
-    xmlXPathObjectPtr ret;
-    xmlDocPtr container;
-
-    if (nargs == 0) {
-	xmlXPathSetArityError(ctxt);
-	return;
-    }
-
-    int ndx;
-    for (ndx = 0; ndx < nargs; ndx++)
-	stack[nargs - 1 - ndx] = valuePop(ctxt);
-
-    xmlNodeSet *results = xmlXPathNodeSetCreate(NULL);
-
-    /*
-     * Create a Result Value Tree container, and register it with RVT garbage 
-     * collector. 
-     */
-    container = slaxMakeRtf(ctxt);
-    if (container == NULL)
-	goto fail;
 
     for (ndx = 0; ndx < nargs; ndx++) {
 	if (stack[ndx] == NULL)	/* Should not occur */
@@ -1282,27 +1972,346 @@ slaxExtBreakLines (xmlXPathParserContext *ctxt, int nargs)
 		    if (cop->type != XML_TEXT_NODE)
 			continue;
 
-		    slaxExtBreakString(container, results,
-				       (char *) cop->content,
-				       nop->ns, (const char *) nop->name);
+		    if (count >= size) {
+			size = size ? size * 2 : 8;
+			newp = realloc(segs, size * sizeof(*segs));
+			if (newp == NULL)
+			    goto done;
+			segs = newp;
+		    }
+
+		    segs[count].sbs_content = (char *) cop->content;
+		    segs[count].sbs_ns = nop->ns;
+		    segs[count].sbs_name = (const char *) nop->name;
+		    count += 1;
 		}
 	    }
 
 	} else if (obj->stringval) {
-	    slaxExtBreakString(container, results, (char *) obj->stringval,
-			       NULL, ELT_TEXT);
+	    if (count >= size) {
+		size = size ? size * 2 : 8;
+		newp = realloc(segs, size * sizeof(*segs));
+		if (newp == NULL)
+		    goto done;
+		segs = newp;
+	    }
+
+	    segs[count].sbs_content = (char *) obj->stringval;
+	    segs[count].sbs_ns = NULL;
+	    segs[count].sbs_name = ELT_TEXT;
+	    count += 1;
+	}
+    }
+
+ done:
+    *countp = count;
+    return segs;
+}
+
+/*
+ * State for making the lines of slax:break-lines() one at a time
+ */
+typedef struct slax_break_lines_s {
+    slax_break_seg_t *sbl_segs;	/* Segments to break */
+    int sbl_count;		/* Number of segments */
+    int sbl_ndx;		/* Current segment */
+    int sbl_started;		/* Have we started the current segment? */
+    char *sbl_cp;		/* Rest of the current segment (or NULL) */
+} slax_break_lines_t;
+
+/*
+ * Find the next line, exactly as slaxExtBreakString() would.  Returns
+ * FALSE when there are no more lines.
+ */
+static int
+slaxExtBreakNextLine (slax_break_lines_t *sblp, slax_break_seg_t **segp,
+		      char **linep, int *lenp)
+{
+    slax_break_seg_t *sbsp;
+    char *cp, *sp;
+
+    for (;;) {
+	if (sblp->sbl_ndx >= sblp->sbl_count)
+	    return FALSE;
+
+	sbsp = &sblp->sbl_segs[sblp->sbl_ndx];
+
+	if (!sblp->sbl_started) {
+	    sblp->sbl_started = TRUE;
+	    cp = sbsp->sbs_content;
+
+	    /* No content or no newlines means one line */
+	    if (cp == NULL || strchr(cp, '\n') == NULL) {
+		sblp->sbl_ndx += 1;
+		sblp->sbl_started = FALSE;
+		*segp = sbsp;
+		*linep = cp;
+		*lenp = cp ? strlen(cp) : 0;
+		return TRUE;
+	    }
+
+	    sblp->sbl_cp = cp;
 	}
+
+	sp = sblp->sbl_cp;
+	if (sp == NULL) {
+	    sblp->sbl_ndx += 1;
+	    sblp->sbl_started = FALSE;
+	    continue;
+	}
+
+	cp = strchr(sp, '\n');
+	if (cp == NULL)
+	    cp = sp + strlen(sp);
+
+	/* Trim the CR from CRLF */
+	int dos_format = (cp <= sp) ? 0 : (cp[-1] == '\r') ? 1 : 0;
+
+	*segp = sbsp;
+	*linep = sp;
+	*lenp = cp - sp - dos_format;
+
+	sp = cp;
+	sblp->sbl_cp = (*sp == '\0' || *++sp == '\0') ? NULL : sp;
+	return TRUE;
+    }
+}
+
+static xmlNodePtr
+slaxExtBreakLinesNext (xmlDocPtr container, void *opaque)
+{
+    slax_break_lines_t *sblp = opaque;
+    slax_break_seg_t *sbsp;
+    char *line;
+    int len;
+
+    if (!slaxExtBreakNextLine(sblp, &sbsp, &line, &len))
+	return NULL;
+
+    return slaxExtMakeTextNode(container, sbsp->sbs_ns, sbsp->sbs_name,
+			       line, len);
+}
+
+/*
+ * Break a simple element into multiple elements, delimited by
+ * newlines.  This is especially useful for big <output> elements,
+ * such as are produced by the "show pfe" commands.  As the select
+ * of a for-each, the lines are made one at a time.
+ *
+ * Usage:  var $lines = slax:break-lines($output);
+ */
+static void
+slaxExtBreakLines (xmlXPathParserContext *ctxt, int nargs)
+{
+    xmlXPathObject *stack[nargs];	/* Stack for args as objects */
+    xmlXPathObjectPtr ret;
+    xmlDocPtr container;
+    slax_break_seg_t *segs;
+    int ndx, count, lazy;
+
+    if (nargs == 0) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    lazy = slaxExtLazyCheck(ctxt, nargs, "break-lines")
+	|| slaxExtLazyCheck(ctxt, nargs, "break_lines");
+
+    for (ndx = 0; ndx < nargs; ndx++)
+	stack[nargs - 1 - ndx] = valuePop(ctxt);
+
+    xmlNodeSet *results = xmlXPathNodeSetCreate(NULL);
+
+    segs = slaxExtBreakSegments(stack, nargs, &count);
+
+    if (lazy) {
+	slax_break_lines_t sbl = { segs, count, 0, FALSE, NULL };
+	slax_break_seg_t *sbsp;
+	unsigned long lines = 0;
+	char *line;
+	int len;
+
+	/* Count the lines first, for last() */
+	while (slaxExtBreakNextLine(&sbl, &sbsp, &line, &len))
+	    lines += 1;
+
+	sbl.sbl_ndx = 0;
+	sbl.sbl_started = FALSE;
+	slaxExtLazyForEach(ctxt, lines, slaxExtBreakLinesNext, &sbl);
+	goto done;
     }
 
+    /*
+     * Create a Result Value Tree container, and register it with RVT garbage 
+     * collector. 
+     */
+    container = slaxMakeRtf(ctxt);
+    if (container == NULL)
+	goto done;
+
+    for (ndx = 0; ndx < count; ndx++)
+	slaxExtBreakString(container, results, segs[ndx].sbs_content,
+			   segs[ndx].sbs_ns, segs[ndx].sbs_name);
+
+ done:
     for (ndx = 0; ndx < nargs; ndx++)
 	xmlXPathFreeObject(stack[ndx]);
+    free(segs);
 
- fail:
     ret = xmlXPathNewNodeSetList(results);
     valuePush(ctxt, ret);
     xmlXPathFreeNodeSet(results);
 }
 
+/*
+ * Compiling a regex can cost more than running it, and scripts tend
+ * to use the same handful of patterns over and over (often a
+ * constant inside a loop).  So each transform context gets a small
+ * LRU cache of compiled regexes, keyed by pattern and cflags.  The
+ * cache is hung off the context as libxslt "extension data", which
+ * gives us a hook to free it when the transform is done.
+ */
+#define SLAX_REGEX_CACHE_URI	SLAX_URI "/regex-cache" /* Private key */
+#define SLAX_REGEX_CACHE_SIZE	32 /* Number of compiled regexes kept */
+
+typedef struct slax_regex_entry_s {
+    char *sre_pattern;		/* Pattern (NULL if slot is unused) */
+    int sre_cflags;		/* Flags passed to regcomp() */
+    unsigned sre_hash;		/* Hash of pattern and cflags */
+    unsigned long sre_used;	/* Tick of last use (for LRU) */
+    regex_t sre_reg;		/* Compiled regex */
+} slax_regex_entry_t;
+
+typedef struct slax_regex_cache_s {
+    unsigned long src_tick;	/* Use counter */
+    unsigned long src_hits;	/* Number of cache hits */
+    unsigned long src_misses;	/* Number of cache misses */
+    slax_regex_entry_t src_entry[SLAX_REGEX_CACHE_SIZE];
+} slax_regex_cache_t;
+
+static void *
+slaxRegexCacheInit (xsltTransformContextPtr ctxt UNUSED,
+		    const xmlChar *uri UNUSED)
+{
+    slax_regex_cache_t *srcp = xmlMalloc(sizeof(*srcp));
+
+    if (srcp)
+	bzero(srcp, sizeof(*srcp));
+
+    return srcp;
+}
+
+static void
+slaxRegexCacheShutdown (xsltTransformContextPtr ctxt UNUSED,
+			const xmlChar *uri UNUSED, void *data)
+{
+    slax_regex_cache_t *srcp = data;
+    slax_regex_entry_t *srep;
+    int i;
+
+    if (srcp == NULL)
+	return;
+
+    slaxLog("regex cache: %lu hits, %lu misses",
+	    srcp->src_hits, srcp->src_misses);
+
+    for (i = 0, srep = srcp->src_entry; i < SLAX_REGEX_CACHE_SIZE;
+	 i++, srep++) {
+	if (srep->sre_pattern) {
+	    regfree(&srep->sre_reg);
+	    xmlFree(srep->sre_pattern);
+	}
+    }
+
+    xmlFree(srcp);
+}
+
+static unsigned
+slaxRegexHash (const char *pattern, int cflags)
+{
+    unsigned hash = 2166136261U ^ (unsigned) cflags;
+
+    for ( ; *pattern; pattern++)
+	hash = (hash ^ (unsigned char) *pattern) * 16777619U;
+
+    return hash;
+}
+
+/*
+ * Find a compiled regex for the pattern, compiling it if needed.  We
+ * return a pointer into the cache if we can, otherwise we compile
+ * into "local" and return that (and the caller must regfree() it).
+ * On failure we return NULL, with the error code in *rcp and local
+ * left ready for regerror().
+ */
+static regex_t *
+slaxRegexCompile (xmlXPathParserContext *ctxt, const char *pattern,
+		  int cflags, regex_t *local, int *rcp)
+{
+    xsltTransformContextPtr tctxt = xsltXPathGetTransformContext(ctxt);
+    slax_regex_cache_t *srcp = NULL;
+    slax_regex_entry_t *srep, *victim;
+    unsigned hash;
+    int i, rc;
+
+    if (tctxt)
+	srcp = xsltGetExtData(tctxt, (const xmlChar *) SLAX_REGEX_CACHE_URI);
+
+    if (srcp == NULL) {
+	rc = regcomp(local, pattern, cflags);
+	*rcp = rc;
+	return rc ? NULL : local;
+    }
+
+    hash = slaxRegexHash(pattern, cflags);
+    victim = &srcp->src_entry[0];
+    srcp->src_tick += 1;
+
+    for (i = 0, srep = srcp->src_entry; i < SLAX_REGEX_CACHE_SIZE;
+	 i++, srep++) {
+	if (srep->sre_pattern == NULL) {
+	    victim = srep;
+	    break;		/* Unused slots are always at the end */
+	}
+
+	if (srep->sre_hash == hash && srep->sre_cflags == cflags
+		&& streq(srep->sre_pattern, pattern)) {
+	    srcp->src_hits += 1;
+	    srep->sre_used = srcp->src_tick;
+	    *rcp = 0;
+	    return &srep->sre_reg;
+	}
+
+	if (srep->sre_used < victim->sre_used)
+	    victim = srep;
+    }
+
+    srcp->src_misses += 1;
+
+    /* Compile into local first, so failures don't cost us a slot */
+    rc = regcomp(local, pattern, cflags);
+    *rcp = rc;
+    if (rc)
+	return NULL;
+
+    char *copy = (char *) xmlStrdup((const xmlChar *) pattern);
+    if (copy == NULL)
+	return local;		/* Caller will free it */
+
+    if (victim->sre_pattern) {
+	regfree(&victim->sre_reg);
+	xmlFree(victim->sre_pattern);
+    }
+
+    victim->sre_pattern = copy;
+    victim->sre_cflags = cflags;
+    victim->sre_hash = hash;
+    victim->sre_used = srcp->src_tick;
+    victim->sre_reg = *local;	/* regex_t can be moved by value */
+
+    return &victim->sre_reg;
+}
+
 /*
  * Return the set of matches matched by the given regular expression.
  * This requires two arguments, the regex and the string to match on.
@@ -1337,7 +2346,7 @@ slaxExtRegex (xmlXPathParserContext *ctxt, int nargs)
     xmlChar *target_str, *pattern;
     char *target;
     xmlNodeSet *results = NULL;
-    regex_t reg;
+    regex_t reg, *regp = NULL;
     int nmatch = 10;
     regmatch_t pm[nmatch];
     int rc;
@@ -1384,12 +2393,13 @@ slaxExtRegex (xmlXPathParserContext *ctxt, int nargs)
 	return;
 
     bzero(&pm, sizeof(pm));
+    bzero(&reg, sizeof(reg));
 
-    rc = regcomp(&reg, (const char *) pattern, cflags);
-    if (rc)
+    regp = slaxRegexCompile(ctxt, (const char *) pattern, cflags, &reg, &rc);
+    if (regp == NULL)
 	goto fail;
 
-    rc = regexec(&reg, target, nmatch, pm, eflags);
+    rc = regexec(regp, target, nmatch, pm, eflags);
     if (rc && rc != REG_NOMATCH)
 	goto fail;
    
@@ -1398,7 +2408,8 @@ slaxExtRegex (xmlXPathParserContext *ctxt, int nargs)
 	xmlNode *last = NULL;
 
 	if (return_boolean) {
-	    regfree(&reg);
+	    if (regp == &reg)
+		regfree(&reg);
 	    xmlFree(target_str);
 	    xmlFree(pattern);
 	    xmlXPathReturnBoolean(ctxt, TRUE);
@@ -1433,7 +2444,8 @@ slaxExtRegex (xmlXPathParserContext *ctxt, int nargs)
     }
 
  done:
-    regfree(&reg);
+    if (regp == NULL || regp == &reg)
+	regfree(&reg);
     xmlFree(target_str);
     xmlFree(pattern);
 
@@ -1450,7 +2462,7 @@ slaxExtRegex (xmlXPathParserContext *ctxt, int nargs)
     return;
 
  fail:
-    regerror(rc, &reg, buf, sizeof(buf));
+    regerror(rc, regp ?: &reg, buf, sizeof(buf));
     xsltGenericError(xsltGenericErrorContext, "regex error: %s\n", buf);
     goto done;
 }
@@ -1571,7 +2583,7 @@ slaxExtSplit (xmlXPathParserContext *ctxt, int nargs)
     xmlNodeSet *results;
     xmlNode *newp, *last = NULL;
     char buf[BUFSIZ], *strp, *endp;
-    regex_t reg;
+    regex_t reg, *regp = NULL;
     regmatch_t pmatch[1];
     int rc, limit = -1;
 
@@ -1606,12 +2618,13 @@ slaxExtSplit (xmlXPathParserContext *ctxt, int nargs)
     if (container == NULL)
 	goto done;
 
-    rc = regcomp(&reg, (char *) pattern, REG_EXTENDED);
-    if (rc)
+    regp = slaxRegexCompile(ctxt, (const char *) pattern, REG_EXTENDED,
+			    &reg, &rc);
+    if (regp == NULL)
 	goto fail;
 
     while ((limit == -1 || limit > 1) && 
-	   !(rc = regexec(&reg, strp, 1, pmatch, 0))) {
+	   !(rc = regexec(regp, strp, 1, pmatch, 0))) {
 
 	if (pmatch[0].rm_so == 0 &&  pmatch[0].rm_eo == 0)
 	    goto done;
@@ -1655,7 +2668,8 @@ slaxExtSplit (xmlXPathParserContext *ctxt, int nargs)
     }
 
  done:
-    regfree(&reg);
+    if (regp == NULL || regp == &reg)
+	regfree(&reg);
     xmlFree(string);
     xmlFree(pattern);
 
@@ -1666,7 +2680,7 @@ slaxExtSplit (xmlXPathParserContext *ctxt, int nargs)
 
  fail:
 
-    regerror(rc, &reg, buf, sizeof(buf));
+    regerror(rc, regp ?: &reg, buf, sizeof(buf));
     xsltGenericError(xsltGenericErrorContext, "regex error: %s\n", buf);
     goto done;
 }
@@ -1922,6 +2936,19 @@ slaxExtDampen (xmlXPathParserContext *ctxt, int nargs)
 
     xmlFree(tag);
 
+    if (slaxDampenSharedEnabled()) {
+	rc = slaxDampenShared(filename, max, freq_in_secs,
+			      freq_double * SEC_PER_MIN);
+	if (rc >= 0) {
+	    if (rc)
+		xmlXPathReturnTrue(ctxt);
+	    else
+		xmlXPathReturnFalse(ctxt); /* Too many hits means failure */
+	    return;
+	}
+	/* Otherwise fall back to the files */
+    }
+
     rc = stat(filename, &sb);
     if (rc != -1) {
 	/* If the file is already present then open it in the read mode */
@@ -2278,6 +3305,8 @@ struct slaxDocumentOptions {
     xmlChar *sdo_non_xml;	/* Text to replace non-xml characters */
     xmlChar *sdo_rpath;		/* Relative path/base for document */
     int sdo_retain_returns;	/* Do not remove "\r" (keep DOS file hack) */
+    int sdo_xml;		/* Boolean: parse as XML, return the tree */
+    int sdo_no_cache;		/* Boolean: don't use the document cache */
 };
 
 static void
@@ -2294,6 +3323,8 @@ slaxExtDocumentOptionsSet (struct slaxDocumentOptions *sdop,
     if (streq((const char *) name, "format")) {
 	if (streq((const char *) value, "base64"))
 	    sdop->sdo_base64 = TRUE;
+	else if (streq((const char *) value, "xml"))
+	    sdop->sdo_xml = TRUE;
     } else if (streq((const char *) name, "encoding")) {
 	sdop->sdo_encoding = xmlParseCharEncoding((const char *) value);
 	if (sdop->sdo_encoding == XML_CHAR_ENCODING_NONE)
@@ -2304,6 +3335,8 @@ slaxExtDocumentOptionsSet (struct slaxDocumentOptions *sdop,
 	sdop->sdo_non_xml = xmlStrdup(value);
     } else if (streq((const char *) name, "retain-returns")) {
 	sdop->sdo_retain_returns = TRUE;
+    } else if (streq((const char *) name, "no-cache")) {
+	sdop->sdo_no_cache = TRUE;
     }
 }
 
@@ -2426,18 +3459,276 @@ slaxExtRemoveReturns (char *data, size_t *lenp)
     *lenp -= delta;		/* Mark the removed bytes */
 }
 
-static void
-slaxExtDocument (xmlXPathParserContext *ctxt, int nargs)
+/*
+ * Scripts often read the same lookup tables on every event, so we
+ * keep a small cache of the documents read by slax:document(), after
+ * their post-processing (and parsing, for format "xml").  Entries are
+ * checked against the file's stat information on every use, and
+ * files modified around the time we read them are not trusted, since
+ * a second write in the same second could leave the same stamp.
+ * Only local files are cached.
+ */
+#define SLAX_DOC_CACHE_SIZE	16 /* Number of documents kept */
+#define SLAX_DOC_CACHE_MAX	(8 * 1024 * 1024) /* Largest document kept */
+#define SLAX_DOC_MMAP_MIN	(64 * 1024) /* Use mmap for larger files */
+
+typedef struct slax_doc_cache_s {
+    char *sdc_key;		/* Options and filename (or NULL if unused) */
+    dev_t sdc_dev;		/* Device of the file */
+    ino_t sdc_ino;		/* Inode of the file */
+    off_t sdc_size;		/* Size of the file */
+    time_t sdc_mtime_sec;	/* Modification time of the file */
+    long sdc_mtime_nsec;	/* Modification time (nanoseconds) */
+    time_t sdc_loaded;		/* When we read the file */
+    char *sdc_data;		/* Processed contents */
+    size_t sdc_len;		/* Length of sdc_data */
+    xmlDocPtr sdc_docp;		/* Parsed contents (format "xml") */
+    unsigned long sdc_used;	/* Last use (for LRU) */
+} slax_doc_cache_t;
+
+static THREAD_LOCAL(slax_doc_cache_t) slaxDocCache[SLAX_DOC_CACHE_SIZE];
+static THREAD_LOCAL(unsigned long) slaxDocCacheClock;
+
+/*
+ * Return the local path for a filename or "file:" URL, or NULL if
+ * it's not a local file
+ */
+static const char *
+slaxExtDocumentPath (const char *filename)
+{
+    if (strncmp(filename, "file://", 7) == 0)
+	return filename + 7;
+    if (strncmp(filename, "file:/", 6) == 0)
+	return filename + 5;
+    if (strstr(filename, "://") != NULL)
+	return NULL;
+    return filename;
+}
+
+static void
+slaxExtDocumentCacheFree (slax_doc_cache_t *sdcp)
+{
+    free(sdcp->sdc_key);
+    xmlFreeAndEasy(sdcp->sdc_data);
+    if (sdcp->sdc_docp)
+	xmlFreeDoc(sdcp->sdc_docp);
+    bzero(sdcp, sizeof(*sdcp));
+}
+
+/*
+ * Make the cache key for a filename and set of options
+ */
+static char *
+slaxExtDocumentCacheKey (struct slaxDocumentOptions *sdop,
+			 const char *filename)
+{
+    char *key = NULL;
+
+    if (asprintf(&key, "%d:%d:%d:%d:%s:%s", sdop->sdo_base64,
+		 sdop->sdo_retain_returns, sdop->sdo_xml,
+		 sdop->sdo_non_xml ? 1 : 0,
+		 sdop->sdo_non_xml ? (const char *) sdop->sdo_non_xml : "",
+		 filename) < 0)
+	return NULL;
+
+    return key;
+}
+
+static void
+slaxExtDocumentStamp (slax_doc_cache_t *sdcp, struct stat *stp)
+{
+    sdcp->sdc_dev = stp->st_dev;
+    sdcp->sdc_ino = stp->st_ino;
+    sdcp->sdc_size = stp->st_size;
+#if HAVE_MTIMESPEC
+    sdcp->sdc_mtime_sec = stp->st_mtimespec.tv_sec;
+    sdcp->sdc_mtime_nsec = stp->st_mtimespec.tv_nsec;
+#else /* HAVE_MTIMESPEC */
+    sdcp->sdc_mtime_sec = stp->st_mtime;
+    sdcp->sdc_mtime_nsec = 0;
+#endif /* HAVE_MTIMESPEC */
+}
+
+/*
+ * Find a cache entry for this key that still matches the file
+ */
+static slax_doc_cache_t *
+slaxExtDocumentCacheFind (const char *key, struct stat *stp)
+{
+    slax_doc_cache_t *sdcp, stamp;
+    int i;
+
+    slaxExtDocumentStamp(&stamp, stp);
+
+    for (i = 0; i < SLAX_DOC_CACHE_SIZE; i++) {
+	sdcp = &slaxDocCache[i];
+	if (sdcp->sdc_key == NULL || !streq(sdcp->sdc_key, key))
+	    continue;
+
+	if (sdcp->sdc_dev != stamp.sdc_dev || sdcp->sdc_ino != stamp.sdc_ino
+		|| sdcp->sdc_size != stamp.sdc_size
+		|| sdcp->sdc_mtime_sec != stamp.sdc_mtime_sec
+		|| sdcp->sdc_mtime_nsec != stamp.sdc_mtime_nsec
+		|| sdcp->sdc_mtime_sec + 1 >= sdcp->sdc_loaded) {
+	    slaxExtDocumentCacheFree(sdcp);
+	    return NULL;
+	}
+
+	sdcp->sdc_used = ++slaxDocCacheClock;
+	return sdcp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Record a document in the cache, replacing the least recently used
+ * entry.  The key, data and tree become the cache's.
+ */
+static void
+slaxExtDocumentCacheAdd (char *key, struct stat *stp, time_t loaded,
+			 char *data, size_t len, xmlDocPtr docp)
+{
+    slax_doc_cache_t *sdcp = &slaxDocCache[0];
+    int i;
+
+    for (i = 1; i < SLAX_DOC_CACHE_SIZE && sdcp->sdc_key; i++)
+	if (slaxDocCache[i].sdc_key == NULL
+		|| slaxDocCache[i].sdc_used < sdcp->sdc_used)
+	    sdcp = &slaxDocCache[i];
+
+    slaxExtDocumentCacheFree(sdcp);
+
+    sdcp->sdc_key = key;
+    slaxExtDocumentStamp(sdcp, stp);
+    sdcp->sdc_loaded = loaded;
+    sdcp->sdc_data = data;
+    sdcp->sdc_len = len;
+    sdcp->sdc_docp = docp;
+    sdcp->sdc_used = ++slaxDocCacheClock;
+}
+
+/*
+ * Read a large local file via mmap, returning NULL if we can't (or
+ * if it's compressed, which the libxml2 input code would undo)
+ */
+static char *
+slaxExtDocumentMap (const char *path, size_t size, size_t *lenp)
+{
+    const unsigned char *addr;
+    char *data = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return NULL;
+
+    addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+	return NULL;
+
+    /* gzip and xz files are left to the libxml2 code */
+    if ((addr[0] == 0x1f && addr[1] == 0x8b)
+	    || (size > 6 && memcmp(addr, "\xfd" "7zXZ\0", 6) == 0))
+	goto done;
+
+    data = xmlMalloc(size + 1);
+    if (data == NULL)
+	goto done;
+
+    memcpy(data, addr, size);
+    data[size] = '\0';
+    *lenp = size;
+
+ done:
+    munmap((void *) addr, size);
+    return data;
+}
+
+/*
+ * Read the contents of a document via the libxml2 input code, which
+ * handles URLs and compressed files
+ */
+static char *
+slaxExtDocumentRead (const char *filename, xmlCharEncoding encoding,
+		     size_t *lenp)
+{
+    xmlParserInputBufferPtr input;
+    slax_data_list_t list;
+    size_t len;
+    char *data;
+    int rc;
+
+    input = xmlParserInputBufferCreateFilename(filename, encoding);
+    if (input == NULL) {
+	slaxLog("slax:document: failed to parse URI ('%s')", filename);
+	return NULL;
+    }
+
+    slaxDataListInit(&list);
+
+    for (;;) {
+	char buf[BUFSIZ];
+	
+        rc = input->readcallback(input->context, buf, sizeof(buf));
+	if (rc <= 0)
+	    break;
+	slaxDataListAddLen(&list, buf, rc);
+    }
+    xmlFreeParserInputBuffer(input);
+
+    /*
+     * At this point, we've read all our data into the list
+     * Now we turn it into a single blob of data
+     */
+    len = slaxDataListAsCharLen(&list, NULL);
+    data = xmlMalloc(len);
+    if (data) {
+	slaxDataListAsChar(data, len, &list, NULL);
+	*lenp = len - 1;	/* Remove trailing NUL */
+    }
+
+    slaxDataListClean(&list);
+    return data;
+}
+
+/*
+ * Return a copy of a parsed document, as an RTF
+ */
+static xmlXPathObjectPtr
+slaxExtDocumentTree (xmlXPathParserContext *ctxt, xmlDocPtr docp)
+{
+    xmlDocPtr container;
+    xmlNodePtr cur, newp;
+
+    container = slaxMakeRtf(ctxt);
+    if (container == NULL)
+	return NULL;
+
+    for (cur = docp->children; cur; cur = cur->next) {
+	newp = xmlDocCopyNode(cur, container, 1);
+	if (newp)
+	    xmlAddChild((xmlNodePtr) container, newp);
+    }
+
+    return xmlXPathNewNodeSet((xmlNodePtr) container);
+}
+
+static void
+slaxExtDocument (xmlXPathParserContext *ctxt, int nargs)
 {
     xmlXPathObjectPtr ret = NULL;
     xmlXPathObjectPtr xop = NULL;
     xmlChar *filename = NULL;
-    xmlParserInputBufferPtr input;
-    char *data;
+    char *data = NULL, *key = NULL;
+    const char *path;
     struct slaxDocumentOptions sdo;
+    slax_doc_cache_t *sdcp;
+    xmlDocPtr docp = NULL;
+    struct stat st;
+    time_t loaded = 0;
     size_t len = 0;
-    int rc;
-    slax_data_list_t list;
 
     bzero(&sdo, sizeof(sdo));
     sdo.sdo_encoding = XML_CHAR_ENCODING_UTF8;
@@ -2464,42 +3755,41 @@ slaxExtDocument (xmlXPathParserContext *ctxt, int nargs)
 	return;
     }
 
-    input = xmlParserInputBufferCreateFilename((char *) filename,
-					       sdo.sdo_encoding);
-    if (input == NULL) {
-	slaxLog("slax:document: failed to parse URI ('%s')", filename);
-        valuePush(ctxt, xmlXPathNewNodeSet(NULL));
-	xmlFree(filename);
-	slaxExtDocumentOptionsClear(&sdo);
-        return;
-    }
-
-    xmlFree(filename);
-
-    slaxDataListInit(&list);
+    /* Only local, regular files can be cached or mapped */
+    path = slaxExtDocumentPath((const char *) filename);
+    if (path && (stat(path, &st) < 0 || !S_ISREG(st.st_mode)))
+	path = NULL;
+
+    if (path && !sdo.sdo_no_cache) {
+	key = slaxExtDocumentCacheKey(&sdo, (const char *) filename);
+	sdcp = key ? slaxExtDocumentCacheFind(key, &st) : NULL;
+	if (sdcp) {
+	    slaxLog("slax:document: cached ('%s')", filename);
+	    if (sdcp->sdc_docp) {
+		ret = slaxExtDocumentTree(ctxt, sdcp->sdc_docp);
+	    } else {
+		data = xmlMalloc(sdcp->sdc_len + 1);
+		if (data) {
+		    memcpy(data, sdcp->sdc_data, sdcp->sdc_len + 1);
+		    ret = xmlXPathWrapString((xmlChar *) data);
+		    data = NULL;
+		}
+	    }
+	    goto fail;
+	}
 
-    for (;;) {
-	char buf[BUFSIZ];
-	
-        rc = input->readcallback(input->context, buf, sizeof(buf));
-	if (rc <= 0)
-	    break;
-	slaxDataListAddLen(&list, buf, rc);
+	loaded = time(NULL);
     }
-    xmlFreeParserInputBuffer(input);
 
-    /*
-     * At this point, we've read all our data into the list
-     * Now we turn it into a single blob of data
-     */
-    len = slaxDataListAsCharLen(&list, NULL);
-    data = xmlMalloc(len);
+    if (path && st.st_size >= SLAX_DOC_MMAP_MIN)
+	data = slaxExtDocumentMap(path, st.st_size, &len);
+
+    if (data == NULL)
+	data = slaxExtDocumentRead((const char *) filename,
+				   sdo.sdo_encoding, &len);
     if (data == NULL)
 	goto fail;
 
-    slaxDataListAsChar(data, len, &list, NULL);
-    len -= 1;			/* Remove trailing NUL */
-
     /*
      * Now we can apply any post-processing needed
      */
@@ -2524,12 +3814,42 @@ slaxExtDocument (xmlXPathParserContext *ctxt, int nargs)
     if (sdo.sdo_non_xml)
 	slaxExtRewriteNonXmlCharacters(&data, &len, sdo.sdo_non_xml);
 
-    /* Generate our returnable object */
-    ret = xmlXPathWrapString((xmlChar *) data);
+    if (sdo.sdo_xml) {
+	docp = xmlReadMemory(data, len, (const char *) filename, NULL, 0);
+	xmlFree(data);
+	data = NULL;
+	if (docp == NULL)
+	    goto fail;
 
-    slaxDataListClean(&list);
+	ret = slaxExtDocumentTree(ctxt, docp);
+
+    } else {
+	/* Generate our returnable object, keeping a copy if we can */
+	if (key && len <= SLAX_DOC_CACHE_MAX) {
+	    char *copy = xmlMalloc(len + 1);
+	    if (copy)
+		memcpy(copy, data, len + 1);
+	    ret = xmlXPathWrapString((xmlChar *) data);
+	    data = copy;
+	} else {
+	    ret = xmlXPathWrapString((xmlChar *) data);
+	    data = NULL;
+	}
+    }
+
+    if (key && (docp || data) && len <= SLAX_DOC_CACHE_MAX) {
+	slaxExtDocumentCacheAdd(key, &st, loaded, data, len, docp);
+	key = NULL;
+	data = NULL;
+	docp = NULL;
+    }
 
  fail:
+    xmlFreeAndEasy(data);
+    if (docp)
+	xmlFreeDoc(docp);
+    free(key);
+    xmlFreeAndEasy(filename);
     slaxExtDocumentOptionsClear(&sdo);
 
     if (ret != NULL)
@@ -2783,11 +4103,17 @@ slaxExtOutput (xmlXPathParserContextPtr ctxt, int nargs)
 }
 
 /*
- * This is the callback function that we use to pass trace data
- * up to the caller.
+ * This is the callback function that we use to pass progress
+ * messages up to the caller, with a per-thread override, as for
+ * tracing.
  */
-static THREAD_GLOBAL(slaxProgressCallback_t) slaxProgressCallback;
-static THREAD_GLOBAL(void *) slaxProgressCallbackData;
+typedef struct slax_progress_hook_s {
+    slaxProgressCallback_t sph_func; /* Callback function */
+    void *sph_data;		/* Opaque data passed to sph_func */
+} slax_progress_hook_t;
+
+static THREAD_GLOBAL(slax_progress_hook_t) slaxProgressHook;
+static THREAD_LOCAL(slax_progress_hook_t) slaxProgressThreadHook;
 static THREAD_GLOBAL(int) slaxExtEmitProgressMessages;
 
 int
@@ -2808,20 +4134,40 @@ void
 slaxProgressEnable (slaxProgressCallback_t func, void *data)
 {
     slaxExtEmitProgressMessages = (func != NULL);
-    slaxProgressCallback = func;
-    slaxProgressCallbackData = data;
+    slaxProgressHook.sph_func = func;
+    slaxProgressHook.sph_data = data;
+}
+
+/**
+ * Enable progress messages with a callback for the calling thread
+ * only; a NULL function puts the thread back on the process's setting
+ *
+ * @func callback function
+ * @data opaque data passed to callback
+ */
+void
+slaxProgressEnableThread (slaxProgressCallback_t func, void *data)
+{
+    slaxProgressThreadHook.sph_func = func;
+    slaxProgressThreadHook.sph_data = data;
 }
 
 void
 slaxExtProgressCallback (const char *str)
 {
-    if (slaxExtEmitProgressMessages) {
-	if (slaxProgressCallback)
-	    slaxProgressCallback(slaxProgressCallbackData,  "%s", str);
+    const slax_progress_hook_t *hook = slaxProgressThreadHook.sph_func
+	? &slaxProgressThreadHook : &slaxProgressHook;
+    const slax_trace_hook_t *trace = slaxTraceCurrent();
+
+    if (slaxExtEmitProgressMessages || hook == &slaxProgressThreadHook) {
+	if (hook->sph_func)
+	    hook->sph_func(hook->sph_data,  "%s", str);
 	else
 	    slaxOutput("%s", str);
-    } else if (slaxTraceCallback)
-	slaxTraceCallback(slaxTraceCallbackData, NULL, "%s", str);
+    } else if (slaxTraceRingEnabled())
+	slaxTraceRingString(NULL, str);
+    else if (trace->sth_func)
+	trace->sth_func(trace->sth_data, NULL, "%s", str);
     else
 	slaxLog("%s", str);
 }
@@ -2840,8 +4186,12 @@ slaxExtProgress (xmlXPathParserContextPtr ctxt, int nargs)
 void
 slaxExtTraceCallback (const char *str)
 {
-    if (slaxTraceCallback)
-	slaxTraceCallback(slaxTraceCallbackData, NULL, "%s", str);
+    const slax_trace_hook_t *hook = slaxTraceCurrent();
+
+    if (slaxTraceRingEnabled())
+	slaxTraceRingString(NULL, str);
+    else if (hook->sth_func)
+	hook->sth_func(hook->sth_data, NULL, "%s", str);
     else
 	slaxLog("%s", str);
 }
@@ -2886,6 +4236,574 @@ slaxInitRandomizer (void)
 #endif /* HAVE_SRAND */
 }
  
+/*
+ * A join written as "$table[name == $x]" inside a loop scans the
+ * whole table for every pass.  key() would do better, but it only
+ * sees the input document, and our tables are usually RTFs and mvars.
+ * So slax:build-index() hashes a node-set on the string value of an
+ * expression, and slax:lookup() finds nodes by that value:
+ *
+ *     var $ix = slax:build-index($table/row, "name");
+ *     for-each (item) {
+ *         var $row = slax:lookup($ix, .);
+ *     }
+ *
+ * Indexes belong to the transform context (as extension data, like
+ * the regex cache) and live until the transform is done.  Nodes in
+ * documents that live that long (the input and anything read by
+ * document()) are indexed as they are; other nodes (RTFs, mvars)
+ * can be freed while the index is still around, so they are copied
+ * into a persistent RTF and the index (and lookups) use the copies.
+ */
+#define SLAX_INDEX_URI		SLAX_URI "/index" /* Private key */
+#define SLAX_INDEX_PREFIX	"slax-index-" /* Handle prefix */
+#define SLAX_INDEX_MIN_BUCKETS	16 /* Smallest hash table */
+
+typedef struct slax_index_entry_s {
+    struct slax_index_entry_s *sie_next; /* Next entry in bucket */
+    unsigned sie_hash;		/* Hash of sie_key */
+    xmlChar *sie_key;		/* Key value */
+    xmlNodeSetPtr sie_nodes;	/* Nodes with this key (in set order) */
+} slax_index_entry_t;
+
+typedef struct slax_index_s {
+    struct slax_index_s *si_next; /* Next index for this transform */
+    unsigned si_id;		/* Id, used in the handle */
+    char *si_expr;		/* Key expression (as given) */
+    xmlNodePtr *si_nodes;	/* Nodes indexed (NULL if copied) */
+    int si_count;		/* Number of nodes indexed */
+    unsigned si_hash;		/* Hash of si_expr and si_nodes */
+    unsigned si_nbuckets;	/* Number of buckets (power of two) */
+    slax_index_entry_t **si_buckets; /* Hash table */
+} slax_index_t;
+
+typedef struct slax_index_cache_s {
+    slax_index_t *sic_list;	/* Indexes built in this transform */
+    unsigned sic_next_id;	/* Id for the next index */
+    unsigned long sic_builds;	/* Number of indexes built */
+    unsigned long sic_reused;	/* Builds answered by an existing index */
+    unsigned long sic_lookups;	/* Number of keys looked up */
+} slax_index_cache_t;
+
+static void *
+slaxIndexCacheInit (xsltTransformContextPtr ctxt UNUSED,
+		    const xmlChar *uri UNUSED)
+{
+    slax_index_cache_t *sicp = xmlMalloc(sizeof(*sicp));
+
+    if (sicp)
+	bzero(sicp, sizeof(*sicp));
+
+    return sicp;
+}
+
+static void
+slaxIndexFree (slax_index_t *sip)
+{
+    slax_index_entry_t *siep, *nextp;
+    unsigned i;
+
+    if (sip->si_buckets) {
+	for (i = 0; i < sip->si_nbuckets; i++) {
+	    for (siep = sip->si_buckets[i]; siep; siep = nextp) {
+		nextp = siep->sie_next;
+		xmlFree(siep->sie_key);
+		xmlXPathFreeNodeSet(siep->sie_nodes);
+		xmlFree(siep);
+	    }
+	}
+	xmlFree(sip->si_buckets);
+    }
+
+    xmlFreeAndEasy(sip->si_nodes);
+    xmlFreeAndEasy(sip->si_expr);
+    xmlFree(sip);
+}
+
+static void
+slaxIndexCacheShutdown (xsltTransformContextPtr ctxt UNUSED,
+			const xmlChar *uri UNUSED, void *data)
+{
+    slax_index_cache_t *sicp = data;
+    slax_index_t *sip;
+
+    if (sicp == NULL)
+	return;
+
+    slaxLog("index cache: %lu built, %lu reused, %lu lookups",
+	    sicp->sic_builds, sicp->sic_reused, sicp->sic_lookups);
+
+    while ((sip = sicp->sic_list) != NULL) {
+	sicp->sic_list = sip->si_next;
+	slaxIndexFree(sip);
+    }
+
+    xmlFree(sicp);
+}
+
+static slax_index_cache_t *
+slaxIndexCache (xmlXPathParserContextPtr ctxt)
+{
+    xsltTransformContextPtr tctxt = xsltXPathGetTransformContext(ctxt);
+    slax_index_cache_t *sicp;
+
+    sicp = tctxt ? xsltGetExtData(tctxt, (const xmlChar *) SLAX_INDEX_URI)
+	: NULL;
+    if (sicp == NULL)
+	slaxTransformError(ctxt, "slax: index cache is not available");
+
+    return sicp;
+}
+
+static unsigned
+slaxIndexHash (const xmlChar *str)
+{
+    unsigned hash = 2166136261U;
+
+    for ( ; *str; str++)
+	hash = (hash ^ *str) * 16777619U;
+
+    return hash;
+}
+
+/*
+ * Does this document live as long as the transform does?
+ */
+static int
+slaxIndexDocPersists (xsltTransformContextPtr tctxt, xmlDocPtr docp)
+{
+    xsltDocumentPtr xdp;
+
+    for (xdp = tctxt->docList; xdp; xdp = xdp->next)
+	if (xdp->doc == docp)
+	    return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * Copy a node into the index's container, returning the node to index
+ */
+static xmlNodePtr
+slaxIndexCopyNode (xsltTransformContextPtr tctxt, xmlDocPtr container,
+		   xmlNodePtr nodep)
+{
+    xmlNodePtr newp;
+    xmlDocPtr docp;
+
+    switch (nodep->type) {
+    case XML_DOCUMENT_NODE:
+    case XML_HTML_DOCUMENT_NODE:
+	/* A whole RTF gets an RTF of its own */
+	docp = xsltCreateRVT(tctxt);
+	if (docp == NULL)
+	    return NULL;
+	xsltRegisterPersistRVT(tctxt, docp);
+	SLAX_STATS_INC(ss_rtfs);
+
+	newp = xmlDocCopyNodeList(docp, nodep->children);
+	if (newp)
+	    xmlAddChildList((xmlNodePtr) docp, newp);
+	return (xmlNodePtr) docp;
+
+    case XML_ELEMENT_NODE:
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+    case XML_COMMENT_NODE:
+    case XML_PI_NODE:
+	newp = xmlDocCopyNode(nodep, container, 1);
+	if (newp)
+	    xmlAddChild((xmlNodePtr) container, newp);
+	return newp;
+
+    default:
+	slaxLog("slax:build-index: skipping %s node in a temporary tree",
+		(nodep->type == XML_ATTRIBUTE_NODE) ? "attribute" : "other");
+	return NULL;
+    }
+}
+
+static int
+slaxIndexAdd (slax_index_t *sip, const xmlChar *key, xmlNodePtr nodep)
+{
+    unsigned hash = slaxIndexHash(key);
+    slax_index_entry_t *siep, **bucketp;
+
+    bucketp = &sip->si_buckets[hash & (sip->si_nbuckets - 1)];
+    for (siep = *bucketp; siep; siep = siep->sie_next)
+	if (siep->sie_hash == hash && xmlStrEqual(siep->sie_key, key))
+	    break;
+
+    if (siep == NULL) {
+	siep = xmlMalloc(sizeof(*siep));
+	if (siep == NULL)
+	    return TRUE;
+
+	bzero(siep, sizeof(*siep));
+	siep->sie_hash = hash;
+	siep->sie_key = xmlStrdup(key);
+	siep->sie_nodes = xmlXPathNodeSetCreate(NULL);
+	if (siep->sie_key == NULL || siep->sie_nodes == NULL) {
+	    xmlFreeAndEasy(siep->sie_key);
+	    if (siep->sie_nodes)
+		xmlXPathFreeNodeSet(siep->sie_nodes);
+	    xmlFree(siep);
+	    return TRUE;
+	}
+
+	siep->sie_next = *bucketp;
+	*bucketp = siep;
+    }
+
+    /* A node whose key expression gives the same value twice */
+    if (siep->sie_nodes->nodeNr > 0
+	    && siep->sie_nodes->nodeTab[siep->sie_nodes->nodeNr - 1] == nodep)
+	return FALSE;
+
+    /* The set's order is the caller's order; skip the duplicate check */
+    return (xmlXPathNodeSetAddUnique(siep->sie_nodes, nodep) < 0);
+}
+
+/*
+ * Evaluate the key expression for a node and index the node under
+ * each value.  Like xsl:key, a node-set result gives a key for each
+ * of its nodes.
+ */
+static int
+slaxIndexNode (xmlXPathParserContextPtr ctxt, xmlXPathCompExprPtr comp,
+	       slax_index_t *sip, xmlNodePtr keyp, xmlNodePtr nodep,
+	       int position, int size)
+{
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlXPathObjectPtr objp;
+    xmlChar *key;
+    int i, rc = FALSE;
+
+    xpctxt->node = keyp;
+    xpctxt->doc = keyp->doc;
+    xpctxt->proximityPosition = position;
+    xpctxt->contextSize = size;
+
+    objp = xmlXPathCompiledEval(comp, xpctxt);
+    if (objp == NULL)
+	return TRUE;
+
+    if (objp->type == XPATH_NODESET || objp->type == XPATH_XSLT_TREE) {
+	if (objp->nodesetval) {
+	    for (i = 0; i < objp->nodesetval->nodeNr && !rc; i++) {
+		key = xmlXPathCastNodeToString(objp->nodesetval->nodeTab[i]);
+		if (key == NULL)
+		    rc = TRUE;
+		else {
+		    rc = slaxIndexAdd(sip, key, nodep);
+		    xmlFree(key);
+		}
+	    }
+	}
+
+    } else {
+	key = xmlXPathCastToString(objp);
+	if (key == NULL)
+	    rc = TRUE;
+	else {
+	    rc = slaxIndexAdd(sip, key, nodep);
+	    xmlFree(key);
+	}
+    }
+
+    xmlXPathFreeObject(objp);
+    return rc;
+}
+
+/*
+ * Find an existing index that was built from these very nodes.  Only
+ * indexes over persistent documents are candidates, since a freed
+ * RTF's memory can be reused for a new one at the same addresses.
+ */
+static slax_index_t *
+slaxIndexFind (slax_index_cache_t *sicp, const char *expr,
+	       xmlNodeSetPtr setp, unsigned hash)
+{
+    slax_index_t *sip;
+
+    for (sip = sicp->sic_list; sip; sip = sip->si_next) {
+	if (sip->si_nodes && sip->si_hash == hash
+		&& sip->si_count == setp->nodeNr
+		&& streq(sip->si_expr, expr)
+		&& memcmp(sip->si_nodes, setp->nodeTab,
+			  setp->nodeNr * sizeof(setp->nodeTab[0])) == 0)
+	    return sip;
+    }
+
+    return NULL;
+}
+
+static void
+slaxIndexReturnHandle (xmlXPathParserContextPtr ctxt, slax_index_t *sip)
+{
+    char buf[sizeof(SLAX_INDEX_PREFIX) + 16];
+
+    snprintf(buf, sizeof(buf), SLAX_INDEX_PREFIX "%u", sip->si_id);
+    xmlXPathReturnString(ctxt, xmlStrdup((const xmlChar *) buf));
+}
+
+/*
+ * Build an index over a node-set, keyed by the string value of a
+ * SLAX expression evaluated with each node as the context node.
+ * Returns a handle to pass to slax:lookup().
+ *
+ * Usage:
+ *     var $ix = slax:build-index($hosts/host, "name");
+ */
+static void
+slaxExtBuildIndex (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    xsltTransformContextPtr tctxt = xsltXPathGetTransformContext(ctxt);
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    slax_index_cache_t *sicp;
+    slax_index_t *sip = NULL;
+    xmlXPathObjectPtr setobj;
+    xmlXPathCompExprPtr comp = NULL;
+    xmlNodeSetPtr setp;
+    xmlDocPtr container = NULL;
+    xmlNodePtr nodep, keyp, saved_node;
+    xmlDocPtr saved_doc;
+    int saved_pos, saved_size;
+    xmlChar *expr;
+    char *sexpr = NULL;
+    unsigned hash;
+    int i, errors = 0, persists = TRUE, failed = FALSE;
+
+    if (nargs != 2) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    expr = xmlXPathPopString(ctxt);
+    if (expr == NULL || ctxt->value == NULL
+	    || (ctxt->value->type != XPATH_NODESET
+		&& ctxt->value->type != XPATH_XSLT_TREE)) {
+	xmlFreeAndEasy(expr);
+	xmlXPathSetTypeError(ctxt);
+	return;
+    }
+
+    setobj = valuePop(ctxt);
+    setp = setobj->nodesetval;
+
+    sicp = slaxIndexCache(ctxt);
+    if (sicp == NULL)
+	goto fail;
+
+    /* Hash the nodes, and see if they all live as long as we do */
+    hash = slaxIndexHash(expr);
+    for (i = 0; setp && i < setp->nodeNr; i++) {
+	nodep = setp->nodeTab[i];
+	hash = (hash ^ (unsigned) (uintptr_t) nodep) * 16777619U;
+	if (persists && !slaxIndexDocPersists(tctxt, nodep->doc))
+	    persists = FALSE;
+    }
+
+    if (persists && setp && setp->nodeNr > 0) {
+	sip = slaxIndexFind(sicp, (const char *) expr, setp, hash);
+	if (sip) {
+	    sicp->sic_reused += 1;
+	    slaxIndexReturnHandle(ctxt, sip);
+	    goto done;
+	}
+    }
+
+    sexpr = slaxSlaxToXpath("slax:build-index", 1, (const char *) expr,
+			    &errors);
+    if (sexpr == NULL || errors > 0) {
+	slaxTransformError(ctxt, "slax:build-index: invalid expression: %s",
+			   expr);
+	goto fail;
+    }
+
+    comp = xmlXPathCtxtCompile(xpctxt, (const xmlChar *) sexpr);
+    if (comp == NULL) {
+	slaxTransformError(ctxt, "slax:build-index: invalid expression: %s",
+			   expr);
+	goto fail;
+    }
+
+    sip = xmlMalloc(sizeof(*sip));
+    if (sip == NULL)
+	goto fail;
+    bzero(sip, sizeof(*sip));
+
+    sip->si_expr = (char *) xmlStrdup(expr);
+    sip->si_count = setp ? setp->nodeNr : 0;
+    sip->si_hash = hash;
+
+    sip->si_nbuckets = SLAX_INDEX_MIN_BUCKETS;
+    while (sip->si_nbuckets < (unsigned) sip->si_count)
+	sip->si_nbuckets <<= 1;
+
+    sip->si_buckets = xmlMalloc(sip->si_nbuckets * sizeof(*sip->si_buckets));
+    if (sip->si_expr == NULL || sip->si_buckets == NULL)
+	goto fail;
+    bzero(sip->si_buckets, sip->si_nbuckets * sizeof(*sip->si_buckets));
+
+    if (persists && sip->si_count > 0) {
+	sip->si_nodes = xmlMalloc(sip->si_count * sizeof(*sip->si_nodes));
+	if (sip->si_nodes == NULL)
+	    goto fail;
+	memcpy(sip->si_nodes, setp->nodeTab,
+	       sip->si_count * sizeof(*sip->si_nodes));
+
+    } else if (!persists) {
+	container = xsltCreateRVT(tctxt);
+	if (container == NULL)
+	    goto fail;
+	xsltRegisterPersistRVT(tctxt, container);
+	SLAX_STATS_INC(ss_rtfs);
+    }
+
+    saved_node = xpctxt->node;
+    saved_doc = xpctxt->doc;
+    saved_pos = xpctxt->proximityPosition;
+    saved_size = xpctxt->contextSize;
+
+    for (i = 0; i < sip->si_count && !failed; i++) {
+	keyp = setp->nodeTab[i];
+	nodep = persists ? keyp : slaxIndexCopyNode(tctxt, container, keyp);
+	if (nodep)
+	    failed = slaxIndexNode(ctxt, comp, sip, keyp, nodep,
+				   i + 1, sip->si_count);
+    }
+
+    xpctxt->node = saved_node;
+    xpctxt->doc = saved_doc;
+    xpctxt->proximityPosition = saved_pos;
+    xpctxt->contextSize = saved_size;
+
+    if (failed) {
+	slaxTransformError(ctxt, "slax:build-index: failed to index '%s'",
+			   expr);
+	goto fail;
+    }
+
+    sip->si_id = ++sicp->sic_next_id;
+    sip->si_next = sicp->sic_list;
+    sicp->sic_list = sip;
+    sicp->sic_builds += 1;
+
+    slaxLog("slax:build-index: index %u: %d nodes on '%s'%s",
+	    sip->si_id, sip->si_count, expr, persists ? "" : " (copied)");
+
+    slaxIndexReturnHandle(ctxt, sip);
+    goto done;
+
+ fail:
+    if (sip)
+	slaxIndexFree(sip);
+    valuePush(ctxt, xmlXPathNewCString(""));
+
+ done:
+    if (comp)
+	xmlXPathFreeCompExpr(comp);
+    xmlFreeAndEasy(sexpr);
+    xmlFree(expr);
+    xmlXPathFreeObject(setobj);
+}
+
+/*
+ * Look up nodes in an index made by slax:build-index().  If the key
+ * is a node-set, the nodes for each of its string values are
+ * returned, in document order.
+ *
+ * Usage:
+ *     var $host = slax:lookup($ix, $name);
+ */
+static void
+slaxExtLookup (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    slax_index_cache_t *sicp;
+    slax_index_t *sip = NULL;
+    slax_index_entry_t *siep;
+    xmlXPathObjectPtr keyobj;
+    xmlNodeSetPtr results = NULL;
+    xmlChar *handle, *key;
+    const char *cp;
+    char *ep;
+    unsigned long id = 0;
+    unsigned hash;
+    int i, count;
+
+    if (nargs != 2) {
+	xmlXPathSetArityError(ctxt);
+	return;
+    }
+
+    keyobj = valuePop(ctxt);
+    handle = xmlXPathPopString(ctxt);
+    if (keyobj == NULL || handle == NULL) {
+	if (keyobj)
+	    xmlXPathFreeObject(keyobj);
+	xmlFreeAndEasy(handle);
+	xmlXPathSetTypeError(ctxt);
+	return;
+    }
+
+    sicp = slaxIndexCache(ctxt);
+    if (sicp == NULL)
+	goto done;
+
+    cp = (const char *) handle;
+    if (strncmp(cp, SLAX_INDEX_PREFIX, sizeof(SLAX_INDEX_PREFIX) - 1) == 0) {
+	id = strtoul(cp + sizeof(SLAX_INDEX_PREFIX) - 1, &ep, 10);
+	if (*ep != '\0')
+	    id = 0;
+    }
+
+    for (sip = sicp->sic_list; sip; sip = sip->si_next)
+	if (sip->si_id == id)
+	    break;
+
+    if (sip == NULL) {
+	slaxTransformError(ctxt, "slax:lookup: unknown index '%s'", handle);
+	goto done;
+    }
+
+    count = (keyobj->type == XPATH_NODESET || keyobj->type == XPATH_XSLT_TREE)
+	? (keyobj->nodesetval ? keyobj->nodesetval->nodeNr : 0) : 1;
+
+    for (i = 0; i < count; i++) {
+	if (keyobj->type == XPATH_NODESET || keyobj->type == XPATH_XSLT_TREE)
+	    key = xmlXPathCastNodeToString(keyobj->nodesetval->nodeTab[i]);
+	else
+	    key = xmlXPathCastToString(keyobj);
+	if (key == NULL)
+	    continue;
+
+	sicp->sic_lookups += 1;
+	hash = slaxIndexHash(key);
+
+	for (siep = sip->si_buckets[hash & (sip->si_nbuckets - 1)];
+	     siep; siep = siep->sie_next) {
+	    if (siep->sie_hash == hash && xmlStrEqual(siep->sie_key, key)) {
+		results = xmlXPathNodeSetMerge(results, siep->sie_nodes);
+		break;
+	    }
+	}
+
+	xmlFree(key);
+    }
+
+    /* Nodes from several keys are merged, so put them back in order */
+    if (results && count > 1)
+	xmlXPathNodeSetSort(results);
+
+ done:
+    if (results == NULL)
+	results = xmlXPathNodeSetCreate(NULL);
+    valuePush(ctxt, xmlXPathWrapNodeSet(results));
+    xmlXPathFreeObject(keyobj);
+    xmlFree(handle);
+}
+
 /*
  * Register our extension functions.
  */
@@ -2938,11 +4856,18 @@ slaxExtRegister (void)
 
     slaxRegisterFunction(SLAX_URI, FUNC_BUILD_SEQUENCE, slaxExtBuildSequence);
 
+    xsltRegisterExtModule((const xmlChar *) SLAX_REGEX_CACHE_URI,
+			  slaxRegexCacheInit, slaxRegexCacheShutdown);
+    xsltRegisterExtModule((const xmlChar *) SLAX_INDEX_URI,
+			  slaxIndexCacheInit, slaxIndexCacheShutdown);
+
     slaxRegisterFunction(SLAX_URI, "base64-decode", slaxExtBase64Decode);
     slaxRegisterFunction(SLAX_URI, "base64-encode", slaxExtBase64Encode);
+    slaxRegisterFunction(SLAX_URI, "build-index", slaxExtBuildIndex);
     slaxRegisterFunction(SLAX_URI, "debug", slaxExtDebug);
     slaxRegisterFunction(SLAX_URI, "document", slaxExtDocument);
     slaxRegisterFunction(SLAX_URI, "evaluate", slaxExtEvaluate);
+    slaxRegisterFunction(SLAX_URI, "lookup", slaxExtLookup);
     slaxRegisterFunction(SLAX_URI, "value", slaxExtValue);
 
     slaxExtRegisterOther(NULL);
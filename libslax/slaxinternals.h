@@ -24,6 +24,7 @@
 
 #include <libpsu/psucommon.h>
 #include <libpsu/psualloc.h>
+#include <libpsu/psubump.h>
 #include <libpsu/psulog.h>
 
 #include "xmlsoft.h"
@@ -99,6 +100,12 @@ slaxWrite (slax_writer_t *swp, const char *fmt, ...);
 int
 slaxWriteNewline (slax_writer_t *swp, int change);
 
+/*
+ * Return the number of spaces per indent level (see slaxSetIndent)
+ */
+int
+slaxGetIndent (void);
+
 #define NEWL_INDENT 1
 #define NEWL_OUTDENT -1
 
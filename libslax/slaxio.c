@@ -19,6 +19,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/queue.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <libxml/xmlsave.h>
 #include <libxml/xmlIO.h>
@@ -27,6 +29,12 @@
 
 #include "slaxinternals.h"
 #include <libslax/slax.h>
+#include <libpsu/psuzio.h>
+#include <libpsu/psuthread.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 
 #if defined(HAVE_READLINE) || defined(HAVE_LIBEDIT)
 #if 0
@@ -49,11 +57,28 @@ extern FILE *rl_outstream;
 #endif /* 0 */
 #endif /* defined(HAVE_READLINE) || defined(HAVE_LIBEDIT) */
 
-/* Callback functions for input and output */
-static slaxInputCallback_t slaxInputCallback;
-static slaxOutputCallback_t slaxOutputCallback;
-static xmlOutputWriteCallback slaxWriteCallback;
-static slaxErrorCallback_t slaxErrorCallback;
+/*
+ * Callback functions for input and output.  slaxIoRegister sets the
+ * process's callbacks; a thread can use its own instead (with
+ * slaxIoRegisterThread), so transforms running in parallel can each
+ * send their output somewhere different.
+ */
+typedef struct slax_io_callbacks_s {
+    slaxInputCallback_t sic_input; /* Read input (slax:input) */
+    slaxOutputCallback_t sic_output; /* Write a line (slax:output) */
+    xmlOutputWriteCallback sic_write; /* Write raw data (nodes) */
+    slaxErrorCallback_t sic_error; /* Report an error */
+} slax_io_callbacks_t;
+
+static THREAD_GLOBAL(slax_io_callbacks_t) slaxIoCallbacks;
+static THREAD_LOCAL(slax_io_callbacks_t) slaxIoThreadCallbacks;
+static THREAD_LOCAL(int) slaxIoThreadRegistered;
+
+static inline const slax_io_callbacks_t *
+slaxIoCurrent (void)
+{
+    return slaxIoThreadRegistered ? &slaxIoThreadCallbacks : &slaxIoCallbacks;
+}
 
 static FILE *slaxIoTty;
 
@@ -64,11 +89,12 @@ static FILE *slaxIoTty;
 char *
 slaxInput (const char *prompt, unsigned flags)
 {
+    slaxInputCallback_t input = slaxIoCurrent()->sic_input;
     char *res, *cp;
     int count, len;
 
     /* slaxLog("slaxInput: -> [%s]", prompt); */
-    res = slaxInputCallback ? slaxInputCallback(prompt, flags) : NULL;
+    res = input ? input(prompt, flags) : NULL;
     /* slaxLog("slaxInput: <- [%s]", res ?: "null"); */
 
     for (cp = res, count = 0, len = 0; cp && *cp; cp++, len++)
@@ -117,7 +143,9 @@ slaxInput (const char *prompt, unsigned flags)
 void
 slaxOutput (const char *fmt, ...)
 {
-    if (slaxOutputCallback) {
+    slaxOutputCallback_t output = slaxIoCurrent()->sic_output;
+
+    if (output) {
 	char buf[BUFSIZ];
 	char *cp = buf;
 	size_t len;
@@ -133,7 +161,7 @@ slaxOutput (const char *fmt, ...)
 	}
 	va_end(vap);
 
-	slaxOutputCallback("%s\n", cp);
+	output("%s\n", cp);
 
 	if (cp != buf)
 	    free(cp);	/* Allocated by vasprintf() */
@@ -146,17 +174,18 @@ slaxOutput (const char *fmt, ...)
 void
 slaxOutputNode (xmlNodePtr node)
 {
+    xmlOutputWriteCallback raw_write = slaxIoCurrent()->sic_write;
     xmlSaveCtxtPtr handle;
 
-    if (slaxWriteCallback == NULL)
+    if (raw_write == NULL)
 	return;
 
-    handle = xmlSaveToIO(slaxWriteCallback, NULL, NULL, NULL,
+    handle = xmlSaveToIO(raw_write, NULL, NULL, NULL,
 		 XML_SAVE_FORMAT | XML_SAVE_NO_DECL | XML_SAVE_NO_XHTML);
     if (handle) {
         xmlSaveTree(handle, node);
         xmlSaveFlush(handle);
-	slaxWriteCallback(NULL, "\n", 1);
+	raw_write(NULL, "\n", 1);
 	xmlSaveClose(handle);
     }
 }
@@ -180,14 +209,15 @@ slaxOutputNodeset (xmlNodeSetPtr nodeset)
 int
 slaxError (const char *fmt, ...)
 {
+    slaxErrorCallback_t error = slaxIoCurrent()->sic_error;
     va_list vap;
     int rc;
 
-    if (slaxErrorCallback == NULL)
+    if (error == NULL)
 	return -1;
 
     va_start(vap, fmt);
-    rc = slaxErrorCallback(fmt, vap);
+    rc = error(fmt, vap);
     va_end(vap);
     return rc;
 }
@@ -201,10 +231,29 @@ slaxIoRegister (slaxInputCallback_t input_callback,
 		xmlOutputWriteCallback raw_write,
 		slaxErrorCallback_t error_callback)
 {
-    slaxInputCallback = input_callback;
-    slaxOutputCallback = output_callback;
-    slaxWriteCallback = raw_write;
-    slaxErrorCallback = error_callback;
+    slaxIoCallbacks.sic_input = input_callback;
+    slaxIoCallbacks.sic_output = output_callback;
+    slaxIoCallbacks.sic_write = raw_write;
+    slaxIoCallbacks.sic_error = error_callback;
+}
+
+/*
+ * Register callbacks for the calling thread only; passing all NULLs
+ * puts the thread back on the process's callbacks
+ */
+void
+slaxIoRegisterThread (slaxInputCallback_t input_callback,
+		      slaxOutputCallback_t output_callback,
+		      xmlOutputWriteCallback raw_write,
+		      slaxErrorCallback_t error_callback)
+{
+    slaxIoThreadCallbacks.sic_input = input_callback;
+    slaxIoThreadCallbacks.sic_output = output_callback;
+    slaxIoThreadCallbacks.sic_write = raw_write;
+    slaxIoThreadCallbacks.sic_error = error_callback;
+
+    slaxIoThreadRegistered = (input_callback || output_callback
+			      || raw_write || error_callback);
 }
 
 static char *
@@ -212,6 +261,8 @@ slaxIoStdioInputCallback (const char *prompt, unsigned flags UNUSED)
 {
     char *cp;
 
+    slaxIoFlush();		/* Let the user see what led to the prompt */
+
     if (flags & SIF_SECRET) {
 	cp = getpass(prompt);
 	return cp ? (char *) xmlStrdup((xmlChar *) cp) : NULL;
@@ -266,12 +317,297 @@ slaxIoStdioInputCallback (const char *prompt, unsigned flags UNUSED)
     }
 }
 
+/*
+ * With SIF_ASYNC, output to stderr goes into a ring buffer that a
+ * writer thread drains, so a slow terminal or pipe doesn't stall
+ * the transform.  There's one producer (the thread running the
+ * script), so the ring itself needs no lock: the producer owns
+ * sir_head and the writer owns sir_tail.  The mutex and condition
+ * variables are only used to sleep when the ring is empty (writer)
+ * or full (producer), with the sir_*_waiting flags telling the other
+ * side it needs to wake us.  Errors, prompts and exit flush the
+ * ring, so they're seen in order.
+ */
+#ifdef HAVE_PTHREAD_H
+
+#define SLAX_IO_RING_SIZE (64 * 1024) /* Must be a power of two */
+
+typedef struct slax_io_ring_s {
+    char sir_buf[SLAX_IO_RING_SIZE]; /* Data */
+    size_t sir_head;		/* Next byte to fill (producer) */
+    size_t sir_tail;		/* Next byte to write (writer) */
+    int sir_fd;			/* File descriptor to write to */
+    int sir_stop;		/* Writer should exit when empty */
+    int sir_writer_waiting;	/* Writer is sleeping for data */
+    int sir_producer_waiting;	/* Producer is sleeping for space */
+    pthread_mutex_t sir_mutex;	/* Protects sleeping and waking */
+    pthread_cond_t sir_data;	/* Signaled when data is added */
+    pthread_cond_t sir_space;	/* Signaled when data is written */
+    pthread_t sir_thread;	/* Writer thread */
+} slax_io_ring_t;
+
+static slax_io_ring_t *slaxIoRing;	/* Ring (when SIF_ASYNC) */
+
+#define SIR_LOAD(_x) __atomic_load_n(&(_x), __ATOMIC_SEQ_CST)
+#define SIR_STORE(_x, _v) __atomic_store_n(&(_x), (_v), __ATOMIC_SEQ_CST)
+
+static void
+slaxIoRingWake (slax_io_ring_t *sirp, int *waitingp, pthread_cond_t *condp)
+{
+    if (SIR_LOAD(*waitingp)) {
+	pthread_mutex_lock(&sirp->sir_mutex);
+	pthread_cond_broadcast(condp);
+	pthread_mutex_unlock(&sirp->sir_mutex);
+    }
+}
+
+static void *
+slaxIoRingWriter (void *arg)
+{
+    slax_io_ring_t *sirp = arg;
+    size_t head, tail, off, len;
+    ssize_t rc;
+
+    for (;;) {
+	tail = sirp->sir_tail;
+	head = SIR_LOAD(sirp->sir_head);
+
+	if (head == tail) {
+	    pthread_mutex_lock(&sirp->sir_mutex);
+	    SIR_STORE(sirp->sir_writer_waiting, TRUE);
+	    while (SIR_LOAD(sirp->sir_head) == tail && !sirp->sir_stop)
+		pthread_cond_wait(&sirp->sir_data, &sirp->sir_mutex);
+	    SIR_STORE(sirp->sir_writer_waiting, FALSE);
+	    if (SIR_LOAD(sirp->sir_head) == tail && sirp->sir_stop) {
+		pthread_mutex_unlock(&sirp->sir_mutex);
+		break;
+	    }
+	    pthread_mutex_unlock(&sirp->sir_mutex);
+	    continue;
+	}
+
+	/* Write up to the end of the buffer; the rest goes next time */
+	off = tail & (SLAX_IO_RING_SIZE - 1);
+	len = head - tail;
+	if (len > SLAX_IO_RING_SIZE - off)
+	    len = SLAX_IO_RING_SIZE - off;
+
+	rc = write(sirp->sir_fd, sirp->sir_buf + off, len);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    rc = len;		/* Nowhere to put it; drop it */
+
+	SIR_STORE(sirp->sir_tail, tail + rc);
+	slaxIoRingWake(sirp, &sirp->sir_producer_waiting, &sirp->sir_space);
+    }
+
+    return NULL;
+}
+
+/*
+ * Wait until the writer has written "upto" bytes (in total)
+ */
+static void
+slaxIoRingWait (slax_io_ring_t *sirp, size_t upto)
+{
+    if ((ssize_t) (SIR_LOAD(sirp->sir_tail) - upto) >= 0)
+	return;
+
+    pthread_mutex_lock(&sirp->sir_mutex);
+    SIR_STORE(sirp->sir_producer_waiting, TRUE);
+    while ((ssize_t) (SIR_LOAD(sirp->sir_tail) - upto) < 0)
+	pthread_cond_wait(&sirp->sir_space, &sirp->sir_mutex);
+    SIR_STORE(sirp->sir_producer_waiting, FALSE);
+    pthread_mutex_unlock(&sirp->sir_mutex);
+}
+
+static void
+slaxIoRingPut (slax_io_ring_t *sirp, const char *buf, size_t len)
+{
+    size_t head = sirp->sir_head, off, chunk;
+
+    while (len > 0) {
+	/* Wait for room */
+	if (head - SIR_LOAD(sirp->sir_tail) == SLAX_IO_RING_SIZE)
+	    slaxIoRingWait(sirp, head - SLAX_IO_RING_SIZE + 1);
+
+	chunk = SLAX_IO_RING_SIZE - (head - SIR_LOAD(sirp->sir_tail));
+	off = head & (SLAX_IO_RING_SIZE - 1);
+	if (chunk > SLAX_IO_RING_SIZE - off)
+	    chunk = SLAX_IO_RING_SIZE - off;
+	if (chunk > len)
+	    chunk = len;
+
+	memcpy(sirp->sir_buf + off, buf, chunk);
+	head += chunk;
+	buf += chunk;
+	len -= chunk;
+
+	SIR_STORE(sirp->sir_head, head);
+	slaxIoRingWake(sirp, &sirp->sir_writer_waiting, &sirp->sir_data);
+    }
+}
+
+static void
+slaxIoRingStop (void)
+{
+    slax_io_ring_t *sirp = slaxIoRing;
+
+    if (sirp == NULL)
+	return;
+
+    slaxIoRing = NULL;
+
+    pthread_mutex_lock(&sirp->sir_mutex);
+    sirp->sir_stop = TRUE;
+    pthread_cond_broadcast(&sirp->sir_data);
+    pthread_mutex_unlock(&sirp->sir_mutex);
+
+    pthread_join(sirp->sir_thread, NULL);
+
+    pthread_mutex_destroy(&sirp->sir_mutex);
+    pthread_cond_destroy(&sirp->sir_data);
+    pthread_cond_destroy(&sirp->sir_space);
+    free(sirp);
+}
+
+/*
+ * Empty the ring before fork(), so the child won't write it again
+ */
+static void
+slaxIoRingBeforeFork (void)
+{
+    if (slaxIoRing)
+	slaxIoRingWait(slaxIoRing, slaxIoRing->sir_head);
+}
+
+/*
+ * The child gets the ring but not the writer thread, so start one
+ */
+static void
+slaxIoRingAfterFork (void)
+{
+    slax_io_ring_t *sirp = slaxIoRing;
+
+    if (sirp == NULL)
+	return;
+
+    pthread_mutex_init(&sirp->sir_mutex, NULL);
+    pthread_cond_init(&sirp->sir_data, NULL);
+    pthread_cond_init(&sirp->sir_space, NULL);
+    sirp->sir_writer_waiting = sirp->sir_producer_waiting = FALSE;
+
+    if (pthread_create(&sirp->sir_thread, NULL, slaxIoRingWriter, sirp)) {
+	slaxIoRing = NULL;	/* Write directly */
+	free(sirp);
+    }
+}
+
+static int
+slaxIoRingStart (int fd)
+{
+    slax_io_ring_t *sirp;
+
+    if (slaxIoRing)
+	return 0;
+
+    sirp = calloc(1, sizeof(*sirp));
+    if (sirp == NULL)
+	return -1;
+
+    sirp->sir_fd = fd;
+    pthread_mutex_init(&sirp->sir_mutex, NULL);
+    pthread_cond_init(&sirp->sir_data, NULL);
+    pthread_cond_init(&sirp->sir_space, NULL);
+
+    if (pthread_create(&sirp->sir_thread, NULL, slaxIoRingWriter, sirp)) {
+	pthread_mutex_destroy(&sirp->sir_mutex);
+	pthread_cond_destroy(&sirp->sir_data);
+	pthread_cond_destroy(&sirp->sir_space);
+	free(sirp);
+	return -1;
+    }
+
+    slaxIoRing = sirp;
+    atexit(slaxIoRingStop);
+    pthread_atfork(slaxIoRingBeforeFork, NULL, slaxIoRingAfterFork);
+    return 0;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/*
+ * Wait until everything handed to the writer thread has been written
+ */
+void
+slaxIoFlush (void)
+{
+#ifdef HAVE_PTHREAD_H
+    slax_io_ring_t *sirp = slaxIoRing;
+
+    if (sirp)
+	slaxIoRingWait(sirp, sirp->sir_head);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*
+ * Write to stderr, or hand it to the writer thread
+ */
+static int
+slaxIoStdioWrite (const char *buf, size_t len)
+{
+#ifdef HAVE_PTHREAD_H
+    if (slaxIoRing) {
+	slaxIoRingPut(slaxIoRing, buf, len);
+	return len;
+    }
+#endif /* HAVE_PTHREAD_H */
+
+    return write(fileno(stderr), buf, len);
+}
+
+static int
+slaxIoStdioWritev (const char *fmt, va_list vap)
+{
+    char buf[BUFSIZ], *cp = buf;
+    va_list vap2;
+    int len;
+
+    va_copy(vap2, vap);
+    len = vsnprintf(buf, sizeof(buf), fmt, vap2);
+    va_end(vap2);
+
+    if (len < 0)
+	return len;
+
+    if ((size_t) len >= sizeof(buf)) {
+	if (vasprintf(&cp, fmt, vap) < 0 || cp == NULL)
+	    return -1;
+    }
+
+    len = slaxIoStdioWrite(cp, len);
+
+    if (cp != buf)
+	free(cp);		/* Allocated by vasprintf() */
+
+    return len;
+}
+
 static void
 slaxIoStdioOutputCallback (const char *fmt, ...)
 {
     va_list vap;
 
     va_start(vap, fmt);
+#ifdef HAVE_PTHREAD_H
+    if (slaxIoRing) {
+	slaxIoStdioWritev(fmt, vap);
+	va_end(vap);
+	return;
+    }
+#endif /* HAVE_PTHREAD_H */
+
     vfprintf(stderr, fmt, vap);
     fflush(stderr);
     va_end(vap);
@@ -280,7 +616,7 @@ slaxIoStdioOutputCallback (const char *fmt, ...)
 static int
 slaxIoStdioRawwriteCallback (void *opaque UNUSED, const char *buf, int len)
 {
-    return write(fileno(stderr), buf, len);
+    return slaxIoStdioWrite(buf, len);
 }
 
 static int
@@ -288,12 +624,42 @@ slaxIoStdioErrorCallback (const char *fmt, va_list vap)
 {
     size_t len = strlen(fmt);
     char *cp = alloca(len + 2);
+    int rc;
+
     memcpy(cp, fmt, len);
     cp[len] = '\n';
     cp[len + 1] = '\0';
 
-    return vfprintf(stderr, cp, vap);
+#ifdef HAVE_PTHREAD_H
+    if (slaxIoRing) {
+	rc = slaxIoStdioWritev(cp, vap);
+	slaxIoFlush();
+	return rc;
+    }
+#endif /* HAVE_PTHREAD_H */
+
+    rc = vfprintf(stderr, cp, vap);
+    return rc;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * libxml2 and libxslt write their errors straight to stderr, which
+ * would pass anything still in the ring, so we catch them and put
+ * them in line
+ */
+static void
+slaxIoAsyncGenericError (void *opaque UNUSED, const char *fmt, ...)
+{
+    va_list vap;
+
+    va_start(vap, fmt);
+    slaxIoStdioWritev(fmt, vap);
+    va_end(vap);
+
+    slaxIoFlush();
 }
+#endif /* HAVE_PTHREAD_H */
 
 void
 slaxIoUseStdio (unsigned flags)
@@ -316,6 +682,14 @@ slaxIoUseStdio (unsigned flags)
 
     slaxIoRegister(slaxIoStdioInputCallback, slaxIoStdioOutputCallback,
 		   slaxIoStdioRawwriteCallback, slaxIoStdioErrorCallback);
+
+#ifdef HAVE_PTHREAD_H
+    if ((flags & SIF_ASYNC) && slaxIoRingStart(fileno(stderr)) == 0) {
+	fflush(stderr);
+	xmlSetGenericErrorFunc(NULL, slaxIoAsyncGenericError);
+	xsltSetGenericErrorFunc(NULL, slaxIoAsyncGenericError);
+    }
+#endif /* HAVE_PTHREAD_H */
 }
 
 static void
@@ -366,6 +740,44 @@ slaxTraceToFile (FILE *fp)
     slaxTraceEnable(slaxProcTrace, fp);
 }
 
+static int
+slaxSaveWrite (void *opaque, const char *buf, int len)
+{
+    int fd = (int) (long) opaque;
+    ssize_t rc;
+    int off;
+
+    for (off = 0; off < len; off += rc) {
+	rc = psu_zio_write(fd, buf + off, len - off);
+	if (rc < 0) {
+	    if (errno == EINTR) {
+		rc = 0;
+		continue;
+	    }
+	    return -1;
+	}
+    }
+
+    return len;
+}
+
+/**
+ * Make a libxml2 save context for a file descriptor, like
+ * xmlSaveToFd(), but writing through psu_zio_write() so any
+ * compressed stream attached to the descriptor is honored
+ *
+ * @param fd file descriptor open for output
+ * @param encoding output encoding (or NULL)
+ * @param options xmlSaveOption flags
+ * @return save context (or NULL)
+ */
+xmlSaveCtxtPtr
+slaxSaveToFd (int fd, const char *encoding, int options)
+{
+    return xmlSaveToIO(slaxSaveWrite, NULL, (void *) (long) fd,
+		       encoding, options);
+}
+
 /**
  * Dump a formatted version of the XSL tree to a file
  *
@@ -378,7 +790,9 @@ slaxDumpToFd (int fd, xmlDocPtr docp, int partial)
 {
     xmlSaveCtxtPtr handle;
 
-    handle = xmlSaveToFd(fd, "UTF-8", XML_SAVE_FORMAT);
+    handle = slaxSaveToFd(fd, "UTF-8", XML_SAVE_FORMAT);
+    if (handle == NULL)
+	return;
 
     if (!partial)
 	xmlSaveDoc(handle, docp);
@@ -391,7 +805,7 @@ slaxDumpToFd (int fd, xmlDocPtr docp, int partial)
 	    if (nodep->type == XML_ELEMENT_NODE) {
 		xmlSaveTree(handle, nodep);
 		xmlSaveFlush(handle);
-		int rc = write(fd, "\n", 1);
+		int rc = psu_zio_write(fd, "\n", 1);
 		if (rc < 0)
 		    break;
 	    }
@@ -410,7 +824,7 @@ slaxDump (xmlDocPtr docp)
     slaxDumpToFd(1, docp, 0);
 }
 
-static int slaxExitCode;
+static THREAD_LOCAL(int) slaxExitCode; /* Each transform has its own */
 
 void
 slaxSetExitCode (int code)
@@ -429,7 +843,8 @@ typedef struct slax_error_data_s {
     xmlNodePtr sed_nodep;	/* Node to record into */
 } slax_error_data_t;
 
-static slax_error_data_t slax_error_data;
+/* libxml2's generic error function is per-thread, so this is too */
+static THREAD_LOCAL(slax_error_data_t) slax_error_data;
 
 static void
 slaxGenericError (void *opaque, const char *fmt, ...)
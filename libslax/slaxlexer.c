@@ -16,22 +16,31 @@
 #include "slaxparser.h"
 #include <ctype.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <libpsu/psuthread.h>
 
 #include <libxslt/extensions.h>
 #include <libexslt/exslt.h>
 
 #define SD_BUF_FUDGE (BUFSIZ/8)
 #define SD_BUF_INCR BUFSIZ
+#define SD_BUF_BLOCK (64 * 1024) /* Read size for whole files */
 
 #define SLAX_MAX_CHAR	128	/* Size of our character tables */
 
-static int slaxSetup;		/* Have we initialized? */
+static psu_once_t slaxSetup = PSU_ONCE_INIT; /* Tables are built */
 
 /*
- * These are lookup tables for one and two character literal tokens.
+ * These are lookup tables for one, two and three character literal
+ * tokens.  doubleWide[] gives the row of doubleWideToken[] for the
+ * first character, which is indexed by the second.  tripleWide[]
+ * gives the offset (plus one) of the entry in tripleWideData[].
  */
+#define SLAX_DOUBLE_ROWS	16	/* Max distinct first chars (+1) */
+
 static short singleWide[SLAX_MAX_CHAR];
 static char doubleWide[SLAX_MAX_CHAR];
+static short doubleWideToken[SLAX_DOUBLE_ROWS][SLAX_MAX_CHAR];
 static char tripleWide[SLAX_MAX_CHAR];
 
 /*
@@ -69,7 +78,6 @@ static int singleWideData[] = {
  * characters into a single slaxparser.y token.
  * N.B.:  These are not "double-wide" as in multi-byte characters,
  * but are two distinct characters.
- * See also: slaxDoubleWide(), where this list is unfortunately duplicated.
  */
 static int doubleWideData[] = {
     L_ASSIGN, ':', '=',
@@ -86,16 +94,15 @@ static int doubleWideData[] = {
     0
 };
 
-#if 0
 /*
  * Define all three character literal tokens, mapping three contiguous
- * characters into a single slaxparser.y token.
+ * characters into a single slaxparser.y token.  Only one entry may
+ * start with any given character.
  */
 static int tripleWideData[] = {
     L_DOTDOTDOT, '.', '.', '.',
     0
 };
-#endif
 
 /*
  * Define all keyword tokens, mapping the keywords into the slaxparser.y
@@ -212,6 +219,21 @@ static keyword_mapping_t keywordMap[] = {
     { 0, NULL, 0 }
 };
 
+/*
+ * Keywords are found with a perfect hash: at setup time, we look for
+ * a seed that gives each keyword a slot of its own, so recognizing a
+ * keyword (or rejecting an identifier) takes one probe and one
+ * compare.  Each slot holds the keywordMap index (plus one).
+ */
+#define SLAX_KW_SHIFT	11	/* Bits in the hash */
+#define SLAX_KW_SLOTS	(1 << SLAX_KW_SHIFT)
+#define SLAX_KW_MAX_LEN	32	/* Longer than any keyword */
+
+static uint8_t slaxKeywordSlot[SLAX_KW_SLOTS];
+static uint32_t slaxKeywordSeed;
+static unsigned slaxKeywordMinLen, slaxKeywordMaxLen;
+static uint8_t slaxKeywordLen[sizeof(keywordMap) / sizeof(keywordMap[0])];
+
 typedef struct slaxTtnameMap_s {
     int st_ttype;		/* Token number */
     const char *st_name;	/* Fancy, human-readable value */
@@ -352,24 +374,90 @@ slaxTtnameMap_t slaxTtnameMap[] = {
     { 0, NULL }
 };
 
+static inline unsigned
+slaxKeywordHash (uint32_t seed, const char *str, unsigned len)
+{
+    uint32_t hash = seed ^ (len * 0x9e3779b1);
+    unsigned i;
+
+    for (i = 0; i < len; i++) {
+	hash ^= (unsigned char) str[i];
+	hash *= 0x01000193;
+    }
+
+    /* Fold the high bits down, since FNV's low bits mix poorly */
+    return (hash ^ (hash >> SLAX_KW_SHIFT) ^ (hash >> (2 * SLAX_KW_SHIFT)))
+	& (SLAX_KW_SLOTS - 1);
+}
+
 /*
- * Set up the lexer's lookup tables
+ * Find a seed for which every keyword gets its own slot.  keywordMap
+ * has a duplicate ("else"), which keeps the first entry, just as the
+ * old linear search did.
  */
-void
-slaxSetupLexer (void)
+static void
+slaxSetupKeywords (void)
 {
-    int i, ttype;
+    uint32_t seed;
+    unsigned i, len, slot;
+
+    slaxKeywordMinLen = SLAX_KW_MAX_LEN;
+    for (i = 0; keywordMap[i].km_string; i++) {
+	len = strlen(keywordMap[i].km_string);
+	slaxKeywordLen[i] = len;
+	if (len < slaxKeywordMinLen)
+	    slaxKeywordMinLen = len;
+	if (len > slaxKeywordMaxLen)
+	    slaxKeywordMaxLen = len;
+    }
+
+    for (seed = 1; ; seed++) {
+	bzero(slaxKeywordSlot, sizeof(slaxKeywordSlot));
+
+	for (i = 0; keywordMap[i].km_string; i++) {
+	    slot = slaxKeywordHash(seed, keywordMap[i].km_string,
+				   slaxKeywordLen[i]);
+	    if (slaxKeywordSlot[slot] == 0) {
+		slaxKeywordSlot[slot] = i + 1;
+		continue;
+	    }
+
+	    /* The same string twice is fine; anything else isn't */
+	    if (strcmp(keywordMap[slaxKeywordSlot[slot] - 1].km_string,
+		       keywordMap[i].km_string) != 0)
+		break;
+	}
 
-    slaxSetup = 1;
+	if (keywordMap[i].km_string == NULL)
+	    break;		/* No collisions */
+    }
+
+    slaxKeywordSeed = seed;
+}
+
+/*
+ * Build the lexer's lookup tables; see slaxSetupLexer
+ */
+static void
+slaxSetupLexerTables (void)
+{
+    int i, ttype, rows = 0;
 
     for (i = 0; singleWideData[i]; i += 2)
 	singleWide[singleWideData[i + 1]] = singleWideData[i];
 
-    for (i = 0; doubleWideData[i]; i += 3)
-	doubleWide[doubleWideData[i + 1]] = i + 2;
+    for (i = 0; doubleWideData[i]; i += 3) {
+	int ch1 = doubleWideData[i + 1], ch2 = doubleWideData[i + 2];
+
+	if (doubleWide[ch1] == 0)
+	    doubleWide[ch1] = ++rows;
+	doubleWideToken[(int) doubleWide[ch1]][ch2] = doubleWideData[i];
+    }
 
-    /* There's only one triple wide, so optimize (for now) */
-    tripleWide['.'] = 1;
+    for (i = 0; tripleWideData[i]; i += 4)
+	tripleWide[tripleWideData[i + 1]] = i + 1;
+
+    slaxSetupKeywords();
 
     for (i = 0; keywordMap[i].km_ttype; i++)
 	slaxKeywordString[slaxTokenTranslate(keywordMap[i].km_ttype)]
@@ -381,6 +469,16 @@ slaxSetupLexer (void)
     }
 }
 
+/*
+ * Set up the lexer's lookup tables.  Any number of threads can call
+ * this; the first does the work and the rest wait for it.
+ */
+void
+slaxSetupLexer (void)
+{
+    psu_once(&slaxSetup, slaxSetupLexerTables);
+}
+
 /*
  * Does the given character end a token?
  */
@@ -391,62 +489,62 @@ slaxIsFinalChar (int ch)
 }
 
 /*
- * Does the input buffer start with the given keyword?
+ * Find the keyword at the start of the input buffer.  A keyword must
+ * be followed by something that can't continue a bare word, so we
+ * measure the bare word there and look that up.
  */
-static int
-slaxKeywordMatch (slax_data_t *sdp, const char *str)
+static keyword_mapping_t *
+slaxKeywordFind (slax_data_t *sdp)
 {
-    int len = strlen(str);
-    int ch;
+    const char *start = sdp->sd_buf + sdp->sd_start;
+    unsigned len, max = sdp->sd_len - sdp->sd_start;
+    unsigned slot;
 
-    if (sdp->sd_len - sdp->sd_start < len)
-	return FALSE;
+    if (max > slaxKeywordMaxLen + 1)
+	max = slaxKeywordMaxLen + 1;
 
-    if (memcmp(sdp->sd_buf + sdp->sd_start, str, len) != 0)
-	return FALSE;
+    for (len = 0; len < max && slaxIsBareChar(start[len]); len++)
+	continue;
 
-    ch = sdp->sd_buf[sdp->sd_start + len];
+    if (len < slaxKeywordMinLen || len > slaxKeywordMaxLen)
+	return NULL;
 
-    if (slaxIsBareChar(ch))
-	return FALSE;
+    slot = slaxKeywordSlot[slaxKeywordHash(slaxKeywordSeed, start, len)];
+    if (slot == 0 || slaxKeywordLen[slot - 1] != len
+	    || memcmp(start, keywordMap[slot - 1].km_string, len) != 0)
+	return NULL;
 
-    return TRUE;
+    return &keywordMap[slot - 1];
 }
 
 /*
  * Return the token type for the two character token given by
  * ch1 and ch2.  Returns zero if there is none.
  */
-static int
+static inline int
 slaxDoubleWide (slax_data_t *sdp UNUSED, int ch1, int ch2)
 {
-#define DOUBLE_WIDE(ch1, ch2) (((ch1) << 8) | (ch2))
-    switch (DOUBLE_WIDE(ch1, ch2)) {
-    case DOUBLE_WIDE(':', '='): return L_ASSIGN;
-    case DOUBLE_WIDE('&', '&'): return L_DAMPER;
-    case DOUBLE_WIDE(':', ':'): return L_DCOLON;
-    case DOUBLE_WIDE('=', '='): return L_DEQUALS;
-    case DOUBLE_WIDE('.', '.'): return L_DOTDOT;
-    case DOUBLE_WIDE('/', '/'): return L_DSLASH;
-    case DOUBLE_WIDE('|', '|'): return L_DVBAR;
-    case DOUBLE_WIDE('>', '='): return L_GRTREQ;
-    case DOUBLE_WIDE('<', '='): return L_LESSEQ;
-    case DOUBLE_WIDE('!', '='): return L_NOTEQUALS;
-    case DOUBLE_WIDE('+', '='): return L_PLUSEQUALS;
-    }
+    if (ch1 < 0 || ch1 >= SLAX_MAX_CHAR || ch2 < 0 || ch2 >= SLAX_MAX_CHAR)
+	return 0;
 
-    return 0;
+    return doubleWideToken[(int) doubleWide[ch1]][ch2];
 }
 
 /*
  * Return the token type for the triple character token given by
  * ch1, ch2 and ch3.  Returns zero if there is none.
  */
-static int
+static inline int
 slaxTripleWide (slax_data_t *sdp UNUSED, int ch1, int ch2, int ch3)
 {
-    if (ch1 == '.' && ch2 == '.' && ch3 == '.')
-	return L_DOTDOTDOT;	/* Only one (for now) */
+    int off;
+
+    if (ch1 < 0 || ch1 >= SLAX_MAX_CHAR || tripleWide[ch1] == 0)
+	return 0;
+
+    off = tripleWide[ch1] - 1;
+    if (tripleWideData[off + 2] == ch2 && tripleWideData[off + 3] == ch3)
+	return tripleWideData[off];
 
     return 0;
 }
@@ -458,8 +556,6 @@ slaxTripleWide (slax_data_t *sdp UNUSED, int ch1, int ch2, int ch3)
  * Ignore XPath keywords if they are not allowed.  Same for SLAX keywords.
  * For node test tokens, we look ahead for the open paren before
  * returning the token type.
- *
- * (Should this use a hash or something?)
  */
 static int
 slaxKeyword (slax_data_t *sdp)
@@ -470,81 +566,79 @@ slaxKeyword (slax_data_t *sdp)
     keyword_mapping_t *kmp;
     int ch;
 
-    for (kmp = keywordMap; kmp->km_string; kmp++) {
-	if (slaxKeywordMatch(sdp, kmp->km_string)) {
-	    if (json_kwa && (kmp->km_flags & KMF_JSON_KW))
-		return kmp->km_ttype;
+    kmp = slaxKeywordFind(sdp);
+    if (kmp == NULL)
+	return 0;
 
-	    if (slax_kwa && (kmp->km_flags & KMF_SLAX_KW))
-		return kmp->km_ttype;
+    if (json_kwa && (kmp->km_flags & KMF_JSON_KW))
+	return kmp->km_ttype;
 
-	    if (xpath_kwa && (kmp->km_flags & KMF_XPATH_KW))
-		return kmp->km_ttype;
+    if (slax_kwa && (kmp->km_flags & KMF_SLAX_KW))
+	return kmp->km_ttype;
 
-	    if ((sdp->sd_last == L_ASSIGN || sdp->sd_last == L_EQUALS)
-			&& (kmp->km_flags & KMF_STMT_KW)) {
-		int look = sdp->sd_cur + strlen(kmp->km_string);
+    if (xpath_kwa && (kmp->km_flags & KMF_XPATH_KW))
+	return kmp->km_ttype;
 
-		for ( ; look < sdp->sd_len; look++) {
-		    ch = sdp->sd_buf[look];
+    if ((sdp->sd_last == L_ASSIGN || sdp->sd_last == L_EQUALS)
+		&& (kmp->km_flags & KMF_STMT_KW)) {
+	int look = sdp->sd_cur + slaxKeywordLen[kmp - keywordMap];
 
-		    /*
-		     * An underscore here could be either the
-		     * concatenation operator or a bare word ("_foo")
-		     * or even just "_" as a bare word. Compare
-		     * 'var $a = call _;' and 'var $a = call _ call;'.
-		     */
-		    if (ch == '_') {
-			ch = sdp->sd_buf[++look];
-			if (slaxIsBareChar(ch))
-			    return kmp->km_ttype;
+	for ( ; look < sdp->sd_len; look++) {
+	    ch = sdp->sd_buf[look];
 
-			if (ch == 0 || ch == '(' || ch == ';')
-			    return kmp->km_ttype;
-
-			if (!isspace(ch))
-			    break;
-
-			for (;;) {
-			    if (look > sdp->sd_len)
-				return kmp->km_ttype;
+	    /*
+	     * An underscore here could be either the
+	     * concatenation operator or a bare word ("_foo")
+	     * or even just "_" as a bare word. Compare
+	     * 'var $a = call _;' and 'var $a = call _ call;'.
+	     */
+	    if (ch == '_') {
+		ch = sdp->sd_buf[++look];
+		if (slaxIsBareChar(ch))
+		    return kmp->km_ttype;
 
-			    ch = sdp->sd_buf[++look];
-			    if (ch == 0 || ch == '(' || ch == ';')
-				return kmp->km_ttype;
+		if (ch == 0 || ch == '(' || ch == ';')
+		    return kmp->km_ttype;
 
-			    if (isspace(ch))
-				continue;
+		if (!isspace(ch))
+		    break;
 
-			    if (slaxIsBareChar(ch))
-				break;
-			}
-			break;
+		for (;;) {
+		    if (look > sdp->sd_len)
+			return kmp->km_ttype;
 
-		    } else if (slaxIsBareChar(ch))
+		    ch = sdp->sd_buf[++look];
+		    if (ch == 0 || ch == '(' || ch == ';')
 			return kmp->km_ttype;
 
-		    if (!isspace(ch))
+		    if (isspace(ch))
+			continue;
+
+		    if (slaxIsBareChar(ch))
 			break;
 		}
-	    }
+		break;
 
-	    if (kmp->km_flags & KMF_NODE_TEST) {
-		int look = sdp->sd_cur + strlen(kmp->km_string);
+	    } else if (slaxIsBareChar(ch))
+		return kmp->km_ttype;
 
-		for ( ; look < sdp->sd_len; look++) {
-		    ch = sdp->sd_buf[look];
-		    if (ch == '(')
-			return kmp->km_ttype;
-		    if (ch != ' ' && ch != '\t')
-			break;
-		}
+	    if (!isspace(ch))
+		break;
+	}
+    }
 
-		/* Didn't see the open paren, so it's not a node test */
-	    }
+    if (kmp->km_flags & KMF_NODE_TEST) {
+	int look = sdp->sd_cur + slaxKeywordLen[kmp - keywordMap];
 
-	    return 0;
+	for ( ; look < sdp->sd_len; look++) {
+	    ch = sdp->sd_buf[look];
+	    if (ch == '(')
+		return kmp->km_ttype;
+	    if (ch != ' ' && ch != '\t')
+		break;
 	}
+
+	/* Didn't see the open paren, so it's not a node test */
     }
 
     return 0;
@@ -564,9 +658,93 @@ slaxParseIsXpath (slax_data_t *sdp)
     return (sdp->sd_parse == M_PARSE_XPATH);
 }
 
+/*
+ * Skip the things that can start a file but aren't part of the
+ * script: a UTF-8 BOM (0xefbbbf, which UTF-8 allows but doesn't
+ * recommend) and a "#!" line.
+ */
+static void
+slaxSkipPreamble (slax_data_t *sdp)
+{
+    if (sdp->sd_len >= 3 && (unsigned char) sdp->sd_buf[0] == 0xef
+	    && (unsigned char) sdp->sd_buf[1] == 0xbb
+	    && (unsigned char) sdp->sd_buf[2] == 0xbf)
+	sdp->sd_cur = sdp->sd_start = 3;
+
+    if (sdp->sd_buf[sdp->sd_cur] == '#' && sdp->sd_buf[sdp->sd_cur + 1] == '!') {
+	char *cp = memchr(sdp->sd_buf + sdp->sd_cur, '\n',
+			  sdp->sd_len - sdp->sd_cur);
+
+	sdp->sd_cur = sdp->sd_start = cp ? cp - sdp->sd_buf + 1 : sdp->sd_len;
+	sdp->sd_line += 1;
+    }
+}
+
+/*
+ * Read all of a regular file into the input buffer, in big blocks,
+ * so the lexer can scan one contiguous buffer instead of pulling in
+ * (and shuffling) a line at a time.  Returns TRUE if the file isn't
+ * one we can read this way.
+ */
+static int
+slaxGetInputFile (slax_data_t *sdp)
+{
+    struct stat st;
+    size_t len = 0, size, got;
+    char *buf, *cp;
+
+    if (fstat(fileno(sdp->sd_file), &st) < 0 || !S_ISREG(st.st_mode))
+	return TRUE;
+
+    /* Leave room past the end, so the lexer can peek without worry */
+    size = st.st_size + SD_BUF_BLOCK + SD_BUF_FUDGE;
+    buf = xmlMalloc(size);
+    if (buf == NULL)
+	return TRUE;
+
+    for (;;) {
+	got = fread(buf + len, 1, size - len - SD_BUF_FUDGE, sdp->sd_file);
+	len += got;
+	if (len < size - SD_BUF_FUDGE)
+	    break;		/* Short read means eof (or error) */
+
+	/* The file grew under us; make more room */
+	size += SD_BUF_BLOCK;
+	cp = xmlRealloc(buf, size);
+	if (cp == NULL) {
+	    xmlFree(buf);
+	    fprintf(stderr, "slax: lex: out of memory");
+	    return TRUE;
+	}
+	buf = cp;
+    }
+
+    if (ferror(sdp->sd_file)) {
+	/* Fall back to the line reader, which reports the failure */
+	xmlFree(buf);
+	return TRUE;
+    }
+
+    bzero(buf + len, size - len);
+
+    sdp->sd_buf = buf;
+    sdp->sd_size = size - SD_BUF_FUDGE;
+    sdp->sd_len = len;
+    sdp->sd_flags |= SDF_EOF;
+
+    if (slaxLogIsEnabled)
+	slaxLog("slax: lex: read %lu bytes", (unsigned long) len);
+
+    slaxSkipPreamble(sdp);
+
+    return FALSE;
+}
+
 /*
  * Fill the input buffer, shifting data forward if we need the room
  * and dynamically reallocating the buffer if we still need room.
+ * Regular files are read whole on the first call, so later calls
+ * just see eof.
  */
 int
 slaxGetInput (slax_data_t *sdp, int final)
@@ -581,6 +759,13 @@ slaxGetInput (slax_data_t *sdp, int final)
 		|| sdp->sd_file == NULL)
 	return TRUE;
 
+    if (first_read && !slaxGetInputFile(sdp))
+	return (sdp->sd_cur < sdp->sd_len) ? FALSE : TRUE;
+
+    /* Once we've seen eof, there's nothing more to read */
+    if (sdp->sd_flags & SDF_EOF)
+	return (sdp->sd_cur < sdp->sd_len) ? FALSE : TRUE;
+
     for (;;) {
 	if (sdp->sd_len + SD_BUF_FUDGE > sdp->sd_size) {
 	    if (sdp->sd_start > SD_BUF_FUDGE) {
@@ -1237,8 +1422,7 @@ slaxYylex (slax_data_t *sdp, YYSTYPE *yylvalp)
     int rc, look;
     slax_string_t *ssp = NULL;
 
-    if (!slaxSetup)
-	slaxSetupLexer();
+    slaxSetupLexer();
 
     /*
      * If we've saved a token type into sd_ttype, then we return
@@ -1568,7 +1752,7 @@ slaxYyerror (slax_data_t *sdp, const char *str, slax_string_t *value,
 
     slaxError("%s:%d: %s%s%s%s%s\n",
 	      sdp->sd_filename, sdp->sd_line, str,
-	      token ? " before " : "", token, token ? ": " : "", buf);
+	      token ? " before " : "", token ?: "", token ? ": " : "", buf);
 
     return 0;
 }
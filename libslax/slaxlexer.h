@@ -52,6 +52,7 @@ struct slax_data_s {
     xmlNodePtr sd_nodep;	/* Node for looking up ternary expressions */
     xmlNodePtr sd_insert;	/* List of nodes to be inserted shortly */
     void *sd_opaque;		/* Additional opaque data */
+    psu_bump_t sd_arena;	/* Token strings (if SDF_ARENA) */
 };
 
 /* Flags for sd_flags */
@@ -68,6 +69,8 @@ struct slax_data_s {
 #define SDF_SLSH_COMMENTS	(1<<8) /* Allow C++ style comments */
 #define SDF_SLSH_OPEN		(1<<9) /* C++ style comments is open */
 #define SDF_STRING		(1<<10) /* Parse a YANG string argument */
+#define SDF_ARENA		(1<<11) /* Allocate tokens from sd_arena */
+#define SDF_JSON_NO_INDEX	(1<<12) /* Don't use the JSON fast path */
 
 
 #define SDF_NO_KEYWORDS (SDF_NO_SLAX_KEYWORDS | SDF_NO_XPATH_KEYWORDS)
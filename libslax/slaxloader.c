@@ -22,35 +22,56 @@
 #include <errno.h>
 
 #include <libpsu/psustring.h>
+#include <libpsu/psuthread.h>
+#include <libpsu/psuzio.h>
 #include <libxslt/extensions.h>
 #include <libxslt/documents.h>
 #include <libexslt/exslt.h>
 #include <libslax/slaxdata.h>
 #include <libslax/slaxdyn.h>
+#include "slaxcache.h"
+#include "slaxoptimize.h"
 
 static xsltDocLoaderFunc slaxOriginalXsltDocDefaultLoader;
 xmlExternalEntityLoader slaxOriginalEntityLoader;
 
 static int slaxEnabled;		/* Global enable (SLAX_*) */
 
+/*
+ * Enabling (and disabling) sets process-wide libxslt hooks, so
+ * concurrent callers take turns; the include list shares the lock.
+ * Include directories should be added before threads start parsing,
+ * since lookups don't take the lock.
+ */
+static psu_mutex_t slaxEnableMutex = PSU_MUTEX_INITIALIZER;
+
 /* Stub to handle xmlChar strings in "?:" expressions */
 const xmlChar slaxNull[] = "";
 
+unsigned slaxNameCounters[SNC_MAX];
+
 static slax_data_list_t slaxIncludes;
 static int slaxIncludesInited;
 
+/* Set while libxslt has us loading an import or include */
+static THREAD_LOCAL(int) slaxLoadingLibrary;
+
 /*
  * Add a directory to the list of directories searched for files
  */
 void
 slaxIncludeAdd (const char *dir)
 {
+    psu_mutex_lock(&slaxEnableMutex);
+
     if (!slaxIncludesInited) {
 	slaxIncludesInited = TRUE;
 	slaxDataListInit(&slaxIncludes);
     }
 
     slaxDataListAddNul(&slaxIncludes, dir);
+
+    psu_mutex_unlock(&slaxEnableMutex);
 }
 
 /*
@@ -188,8 +209,6 @@ slaxAvoidRtf (slax_data_t *sdp)
     static const char node_value_format[] = EXT_PREFIX ":node-set(%s)";
     static const char temp_name_format[] = "%s-temp-%u";
 
-    static unsigned temp_count;
-
     xmlNodePtr nodep = sdp->sd_ctxt->node;
     xmlNodePtr newp;
     xmlChar *name;
@@ -234,7 +253,8 @@ slaxAvoidRtf (slax_data_t *sdp)
 	 */
 	vlen = clen + strlen(temp_name_format) + 10 + 1; /* 10 is max %u */
 	temp_name = alloca(vlen);
-	snprintf(temp_name, vlen, temp_name_format, name, ++temp_count);
+	snprintf(temp_name, vlen, temp_name_format, name,
+		 ++slaxNameCounters[SNC_TEMP]);
 
 	(void) xmlSetProp(sdp->sd_ctxt->node, (const xmlChar *) ATT_NAME,
 			  (xmlChar *) temp_name);
@@ -456,10 +476,10 @@ void
 slaxHandleEltArgPrep (slax_data_t *sdp)
 {
     static const char varfmt[] = SLAX_ELTARG_FORMAT;
-    static unsigned varcount;
     char varname[sizeof(varfmt) + SLAX_ELTARG_WIDTH];
 
-    snprintf(varname, sizeof(varname), varfmt, ++varcount);
+    snprintf(varname, sizeof(varname), varfmt,
+	     ++slaxNameCounters[SNC_ELTARG]);
 
     slaxLog("slaxHandleEltArgPrep: '%s'", varname);
 
@@ -655,6 +675,8 @@ slaxDataCleanup (slax_data_t *sdp)
 
     sdp->sd_ns = NULL;		/* We didn't allocate this */
 
+    psu_bump_cleanup(&sdp->sd_arena);
+
     if (sdp->sd_ctxt) {
 	xmlFreeParserCtxt(sdp->sd_ctxt);
 	sdp->sd_ctxt = NULL;
@@ -666,6 +688,29 @@ slaxDataCleanup (slax_data_t *sdp)
     }
 }
 
+/**
+ * Restart the numbering of generated variable names
+ */
+void
+slaxResetNames (void)
+{
+    bzero(slaxNameCounters, sizeof(slaxNameCounters));
+}
+
+/*
+ * Finish off a freshly loaded document.  The caches hold the tree as
+ * it was parsed, so the optimizer's work is redone on each load;
+ * that keeps them the same whatever passes are turned on.
+ */
+static void
+slaxLoadFinish (xmlDocPtr docp, int partial)
+{
+    if (!partial)
+	slaxOptimize(docp, slaxLoadingLibrary);
+
+    slaxDynLoad(docp);		/* Check dynamic extensions */
+}
+
 /**
  * Read a SLAX file from an open file pointer
  *
@@ -681,10 +726,38 @@ slaxLoadFile (const char *filename, FILE *file, xmlDictPtr dict, int partial)
     slax_data_t sd;
     xmlDocPtr res;
     int rc;
-    xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
+    xmlParserCtxtPtr ctxt;
+    char *cbuf = NULL;
+    size_t clen = 0;
+
+    /* If this process has loaded the file before, reuse that tree */
+    if (!partial && filename && file != stdin) {
+	res = slaxCacheMemLoad(filename, file, dict);
+	if (res) {
+	    slaxLoadFinish(res, partial);
+	    return res;
+	}
+    }
 
-    if (ctxt == NULL)
+    /* If we've compiled these contents before, use that tree */
+    if (!partial && filename && file != stdin && slaxCacheEnabled()) {
+	cbuf = slaxCacheReadFile(file, &clen);
+	if (cbuf) {
+	    res = slaxCacheLoad(filename, cbuf, clen, dict);
+	    if (res) {
+		xmlFree(cbuf);
+		slaxCacheMemSave(filename, file, res);
+		slaxLoadFinish(res, partial);
+		return res;
+	    }
+	}
+    }
+
+    ctxt = xmlNewParserCtxt();
+    if (ctxt == NULL) {
+	xmlFree(cbuf);
 	return NULL;
+    }
 
     /*
      * Turn on line number recording in each node
@@ -704,6 +777,7 @@ slaxLoadFile (const char *filename, FILE *file, xmlDictPtr dict, int partial)
 
     /* We want to parse SLAX, either full or partial */
     sd.sd_parse = sd.sd_ttype = partial ? M_PARSE_PARTIAL : M_PARSE_FULL;
+    sd.sd_flags |= SDF_ARENA;	/* Tokens die with the parse */
 
     strlcpy(sd.sd_filename, filename, sizeof(sd.sd_filename));
     sd.sd_file = file;
@@ -722,6 +796,7 @@ slaxLoadFile (const char *filename, FILE *file, xmlDictPtr dict, int partial)
     sd.sd_docp = slaxBuildDoc(&sd, ctxt);
     if (sd.sd_docp == NULL) {
 	slaxDataCleanup(&sd);
+	xmlFree(cbuf);
 	return NULL;
     }
 
@@ -735,6 +810,7 @@ slaxLoadFile (const char *filename, FILE *file, xmlDictPtr dict, int partial)
 	  sd.sd_filename, sd.sd_errors, (sd.sd_errors == 1) ? "" : "s", rc);
 
 	slaxDataCleanup(&sd);
+	xmlFree(cbuf);
 	return NULL;
     }
 
@@ -743,8 +819,15 @@ slaxLoadFile (const char *filename, FILE *file, xmlDictPtr dict, int partial)
     sd.sd_docp = NULL;
     slaxDataCleanup(&sd);
 
+    if (res && cbuf)
+	slaxCacheSave(filename, cbuf, clen, res);
+    xmlFree(cbuf);
+
+    if (res && !partial && filename && file != stdin)
+	slaxCacheMemSave(filename, file, res);
+
     if (res)
-	slaxDynLoad(res);	/* Check dynamic extensions */
+	slaxLoadFinish(res, partial);
 
     return res;
 }
@@ -788,6 +871,7 @@ slaxLoadBuffer (const char *filename, char *input,
 
     /* We want to parse SLAX, either full or partial */
     sd.sd_parse = sd.sd_ttype = partial ? M_PARSE_PARTIAL : M_PARSE_FULL;
+    sd.sd_flags |= SDF_ARENA;	/* Tokens die with the parse */
 
     strlcpy(sd.sd_filename, filename, sizeof(sd.sd_filename));
     sd.sd_ctxt = ctxt;
@@ -834,7 +918,7 @@ slaxLoadBuffer (const char *filename, char *input,
     slaxDataCleanup(&sd);
 
     if (res)
-	slaxDynLoad(res);	/* Check dynamic extensions */
+	slaxLoadFinish(res, partial);
 
     return res;
 }
@@ -984,7 +1068,7 @@ slaxFindIncludeFile (const char *url, char *buf, size_t bufsiz)
     if (strchr(url, ':'))	/* It's a real URL */
 	return NULL;
 
-    file = fopen((const char *) url, "r");
+    file = psu_zio_fopen((const char *) url, "r", PZF_AUTO, 0);
     if (file) {			/* Straight file name was found */
 	strlcpy(buf, url, bufsiz);
 	return file;
@@ -1007,7 +1091,7 @@ slaxFindIncludeFile (const char *url, char *buf, size_t bufsiz)
 	buf[dirlen] = '/';
 	memcpy(buf + dirlen + 1, lastsegment, lastlen + 1);
 
-	file = fopen((const char *) buf, "r");
+	file = psu_zio_fopen((const char *) buf, "r", PZF_AUTO, 0);
 	if (file) {
 	    return file;
 	}
@@ -1083,7 +1167,10 @@ slaxLoader (const xmlChar *url, xmlDictPtr dict, int options,
 	}
     }
 
+    /* Anything but the main stylesheet may have callers elsewhere */
+    slaxLoadingLibrary += (type != XSLT_LOAD_START);
     docp = slaxLoadFile((const char *) url, file, dict, 0);
+    slaxLoadingLibrary -= (type != XSLT_LOAD_START);
 
     if (file != stdin)
 	fclose(file);
@@ -1134,12 +1221,16 @@ slaxCtxtReadFd(xmlParserCtxtPtr ctxt, int fd, const char *URL,
 void
 slaxEnable (int enable)
 {
+    psu_mutex_lock(&slaxEnableMutex);
+
     if (enable == SLAX_CLEANUP) {
 	xsltSetLoaderFunc(NULL);
 	if (slaxIncludesInited)
 	    slaxDataListClean(&slaxIncludes);
+	slaxCacheMemFlush();
 
 	slaxEnabled = 0;
+	psu_mutex_unlock(&slaxEnableMutex);
 	return;
     }
 
@@ -1177,6 +1268,8 @@ slaxEnable (int enable)
     }
 
     slaxEnabled = enable;
+
+    psu_mutex_unlock(&slaxEnableMutex);
 }
 
 /*
@@ -10,6 +10,20 @@
 /* Stub to handle xmlChar strings in "?:" expressions */
 extern const xmlChar slaxNull[];
 
+/*
+ * Counters used to give unique names to the variables we generate
+ * while rewriting SLAX constructs into XSLT
+ */
+typedef enum slax_name_counter_e {
+    SNC_TEMP,			/* slaxAvoidRtf's "<var>-temp-<n>" */
+    SNC_ELTARG,			/* SLAX_ELTARG_FORMAT */
+    SNC_TERNARY,		/* SLAX_TERNARY_VAR_FORMAT */
+    SNC_FOR,			/* FOR_VARIABLE_PREFIX */
+    SNC_MAX			/* Number of counters */
+} slax_name_counter_t;
+
+extern unsigned slaxNameCounters[SNC_MAX];
+
 /**
  * Check the version string.  The only supported versions are "1.0" and "1.1".
  *
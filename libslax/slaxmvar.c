@@ -25,6 +25,7 @@
 #include "slaxinternals.h"
 #include <libslax/slax.h>
 #include "slaxparser.h"
+#include "slaxstats.h"
 #include <ctype.h>
 #include <errno.h>
 
@@ -361,6 +362,7 @@ slaxMvarGetSvarRoot (xsltTransformContextPtr ctxt, xsltStackElemPtr svar)
      * by having every mvar initialized (via slax:mvar-init()).
      */
     xsltRegisterPersistRVT(ctxt, container);
+    SLAX_STATS_INC(ss_rtfs);
 
     /*
      * We build value as a nodeset containing the RTF/RVT.  It's
@@ -398,6 +400,8 @@ slaxMvarNewContainer (xsltTransformContextPtr ctxt, xsltStackElemPtr svar)
     if (container == NULL)
 	return NULL;
 
+    SLAX_STATS_INC(ss_rtfs);
+
     /*
      * The garbage collection list is linked via the next/prev or
      * RTFs.
@@ -432,19 +436,102 @@ slaxMvarAdd (xmlDocPtr container, xmlNodeSetPtr res, xmlNodePtr cur)
 
     newp = xmlDocCopyNode(cur, container, 1);
     if (newp) {
+	SLAX_STATS_INC(ss_mvar_copies);
 	xmlAddChild((xmlNodePtr) container, newp);
 	if (res)
 	    xmlXPathNodeSetAdd(res, newp);
     }
 }
 
+/*
+ * Move the top-level nodes of a tree we own (a temporary RVT built
+ * by slaxMvarEvalBlock) into the container.  Since the tree is about
+ * to be freed, there's no reason to copy its contents; we just adopt
+ * them, which is far cheaper for big values.
+ */
+static void
+slaxMvarMove (xmlDocPtr container, xmlNodeSetPtr res, xmlDocPtr tree)
+{
+    xmlNodePtr cur, next, newp;
+
+    for (cur = tree->children; cur; cur = next) {
+	next = cur->next;
+
+	xmlUnlinkNode(cur);
+	if (xmlDOMWrapAdoptNode(NULL, tree, cur, container,
+				(xmlNodePtr) container, 0) != 0) {
+	    /* Couldn't adopt it; fall back to a copy */
+	    slaxMvarAdd(container, res, cur);
+	    xmlFreeNode(cur);
+	    continue;
+	}
+
+	/* xmlAddChild may merge text nodes, freeing cur */
+	newp = xmlAddChild((xmlNodePtr) container, cur);
+	if (newp && res)
+	    xmlXPathNodeSetAdd(res, newp);
+    }
+}
+
+/*
+ * Scalar mvars that are built by appending strings keep spare room at
+ * the end of their stringval, so a loop of appends runs in amortized
+ * linear time rather than copying the whole string each time.  The
+ * allocated size lives in the (otherwise unused) index2 field, and
+ * user2 records the buffer it belongs to.  xmlXPathObjectCopy()
+ * copies both fields but makes a new stringval, so a copy won't
+ * match and is treated as having no spare room.
+ */
+#define SLAX_MVAR_STRING_MIN	64 /* Smallest string we'll allocate */
+
+static int
+slaxMvarStringAppend (xsltStackElemPtr var, xmlXPathObjectPtr value)
+{
+    xmlXPathObjectPtr old = var->value;
+    xmlChar *new_str, *buf;
+    int old_len, new_len, size;
+
+    if (old == NULL || old->type != XPATH_STRING || old->stringval == NULL)
+	return TRUE;
+
+    new_str = xmlXPathCastToString(value);
+    if (new_str == NULL)
+	return TRUE;
+
+    old_len = xmlStrlen(old->stringval);
+    new_len = xmlStrlen(new_str);
+
+    size = (old->user2 == old->stringval) ? old->index2 : old_len + 1;
+    if (old_len + new_len + 1 > size) {
+	if (size < SLAX_MVAR_STRING_MIN)
+	    size = SLAX_MVAR_STRING_MIN;
+	while (old_len + new_len + 1 > size)
+	    size *= 2;
+
+	buf = xmlRealloc(old->stringval, size);
+	if (buf == NULL) {
+	    xmlFree(new_str);
+	    return TRUE;
+	}
+
+	old->stringval = buf;
+	old->user2 = buf;
+	old->index2 = size;
+    }
+
+    memcpy(old->stringval + old_len, new_str, new_len + 1);
+    xmlFree(new_str);
+
+    return FALSE;
+}
+
 /*
  * Set a mutable variable to the given value
  */
 static int
 slaxMvarSet (xsltTransformContextPtr ctxt, const xmlChar *name,
 	     const xmlChar *svarname, const xmlChar *uri UNUSED,
-	     xsltStackElemPtr var, xmlXPathObjectPtr value)
+	     xsltStackElemPtr var, xmlXPathObjectPtr value, xmlDocPtr tree)
 {
     xmlXPathObjectPtr old_value;
     int i;
@@ -485,17 +572,24 @@ slaxMvarSet (xsltTransformContextPtr ctxt, const xmlChar *name,
 	    return TRUE;
 	}
 
-	for (i = 0; nset && i < nset->nodeNr; i++) {
-	    xmlNodePtr cur = nset->nodeTab[i];
-	    if (cur == NULL)
-		continue;
+	if (tree) {
+	    /* The tree is ours, so we can take its nodes */
+	    slaxMvarMove(container, NULL, tree);
+	    xmlXPathNodeSetAdd(res, (xmlNodePtr) container);
 
-	    if (XSLT_IS_RES_TREE_FRAG(cur)) {
-		for (cur = cur->children; cur; cur = cur->next)
-		    slaxMvarAdd(container, NULL, cur);
-		xmlXPathNodeSetAdd(res, (xmlNodePtr) container);
-	    } else {
-		slaxMvarAdd(container, res, cur);
+	} else {
+	    for (i = 0; nset && i < nset->nodeNr; i++) {
+		xmlNodePtr cur = nset->nodeTab[i];
+		if (cur == NULL)
+		    continue;
+
+		if (XSLT_IS_RES_TREE_FRAG(cur)) {
+		    for (cur = cur->children; cur; cur = cur->next)
+			slaxMvarAdd(container, NULL, cur);
+		    xmlXPathNodeSetAdd(res, (xmlNodePtr) container);
+		} else {
+		    slaxMvarAdd(container, res, cur);
+		}
 	    }
 	}
 
@@ -553,6 +647,9 @@ slaxMvarAppend (xsltTransformContextPtr ctxt, const xmlChar *name,
 	    /*
 	     * case #1: [ scalar var / scalar value ] -> string concatenation
 	     */
+	    if (!slaxMvarStringAppend(var, value))
+		return FALSE;
+
 	    xmlChar *old_str = xmlXPathCastToString(var->value);
 	    xmlChar *new_str = xmlXPathCastToString(value);
 	    int old_len = old_str ? xmlStrlen(old_str) : 0;
@@ -665,8 +762,7 @@ slaxMvarAppend (xsltTransformContextPtr ctxt, const xmlChar *name,
 
     } else if (tree) {
 	/* Add all the nodes in a tree to the variable */
-	for (cur = tree->children; cur; cur = cur->next)
-	    slaxMvarAdd(container, NULL, cur);
+	slaxMvarMove(container, NULL, tree);
 
     } else if (nset) {
 	/* Add everything in the node set to the variable */
@@ -921,6 +1017,8 @@ slaxMvarEvalBlock (xsltTransformContextPtr ctxt, xmlNodePtr node,
 	return NULL;
     }
 
+    SLAX_STATS_INC(ss_rtfs);
+
     save_insert = ctxt->insert;
     ctxt->insert = (xmlNodePtr) container;
 
@@ -994,7 +1092,7 @@ slaxMvarElement (xsltTransformContextPtr ctxt,
 
 	/* slaxMvarSet() consumed value and/or table, so don't free them */
 	slaxMvarSet(ctxt, comp->mp_localname, comp->mp_svarname,
-		    comp->mp_uri, var, value);
+		    comp->mp_uri, var, value, tree);
     }
 }
 
@@ -88,7 +88,9 @@
 #define ELT_ENTRY	"entry"
 #define ELT_ERRNO	"errno"
 #define ELT_ERROR	"error"
+#define ELT_EVENT	"event"
 #define ELT_EXECUTABLE	"executable"
+#define ELT_FIELD	"field"
 #define ELT_FOR_EACH	"for-each"
 #define ELT_FUNCTION	"function"
 #define ELT_GROUP	"group"
@@ -98,6 +100,7 @@
 #define ELT_INCLUDE	"include"
 #define ELT_JSON	"json"
 #define ELT_LINKS	"links"
+#define ELT_MATCH	"match"
 #define ELT_MEMBER	"member"
 #define ELT_MESSAGE	"message"
 #define ELT_MODE	"mode"
@@ -122,6 +125,8 @@
 #define ELT_SYMLINK_TARGET "symlink-target"
 #define ELT_TEMPLATE	"template"
 #define ELT_TEXT	"text"
+#define ELT_THREADS	"threads"
+#define ELT_TIMEOUT	"timeout"
 #define ELT_TRACE	"trace"
 #define ELT_TRANSFORM	"transform"
 #define ELT_TYPE	"type"
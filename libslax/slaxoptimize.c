@@ -0,0 +1,1114 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxoptimize.c -- rewrite the XSLT built from a SLAX script
+ *
+ * The parser turns each statement into XSLT as it goes, with a few
+ * local rewrites (slaxConcatRewrite, slaxAvoidRtf); nothing looks at
+ * the stylesheet as a whole.  These passes do, after the tree is
+ * built, when turned on with slaxOptimizeSetFlags():
+ *
+ *  - SLAXOPT_FOLD: expressions made only of literals, operators and
+ *    core functions are evaluated now, and xsl:if/xsl:when branches
+ *    that can never (or must always) be taken are resolved.
+ *  - SLAXOPT_RTF: a local variable whose content is just text, or
+ *    one xsl:value-of, and which is only ever used as a string, is
+ *    given a string value instead of building a result tree fragment.
+ *  - SLAXOPT_HOIST: a variable inside xsl:for-each or slax:while
+ *    whose value doesn't depend on the loop is moved in front of it,
+ *    so it's evaluated once.
+ *  - SLAXOPT_DEAD: named templates that nothing calls are dropped.
+ *    Another file may call the templates of a file it imports, so
+ *    this is skipped for files that import or include anything and
+ *    for files being imported or included.
+ *
+ * All of these are conservative: we work from a scan of the XPath
+ * text (slaxOptScan), and anything we can't account for (extension
+ * functions, mutable variables, names we can't see the scope of)
+ * leaves the tree alone.
+ */
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+#include <math.h>
+#include <sys/queue.h>
+#include <libslax/slaxdata.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+
+#include "slaxoptimize.h"
+
+#define SLAX_OPT_MAX_VARS	32 /* Variable references we'll track */
+#define SLAX_OPT_MAX_DEPTH	64 /* Nesting of parens and predicates */
+
+static unsigned slaxOptFlags;	/* Passes turned on (SLAXOPT_*) */
+
+void
+slaxOptimizeSetFlags (unsigned flags)
+{
+    slaxOptFlags = flags;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* What we learn from scanning an XPath expression */
+typedef struct slax_opt_scan_s {
+    int sos_bad;		/* Couldn't make sense of it */
+    int sos_context;		/* Depends on the context node */
+    int sos_impure;		/* Calls something we don't know about */
+    unsigned sos_nvars;		/* Number of entries in sos_vars */
+    struct {
+	const char *sov_name;	/* Variable name (not NUL-terminated) */
+	size_t sov_len;		/* Length of the name */
+    } sos_vars[SLAX_OPT_MAX_VARS];
+} slax_opt_scan_t;
+
+/* Core functions, and whether they use the context when they're empty */
+typedef struct slax_opt_func_s {
+    const char *sof_name;	/* Function name */
+    int sof_context;		/* Without arguments, uses the context */
+} slax_opt_func_t;
+
+static const slax_opt_func_t slaxOptFuncs[] = {
+    { "boolean", FALSE },
+    { "ceiling", FALSE },
+    { "concat", FALSE },
+    { "contains", FALSE },
+    { "count", FALSE },
+    { "false", FALSE },
+    { "floor", FALSE },
+    { "local-name", TRUE },
+    { "name", TRUE },
+    { "namespace-uri", TRUE },
+    { "normalize-space", TRUE },
+    { "not", FALSE },
+    { "number", TRUE },
+    { "round", FALSE },
+    { "starts-with", FALSE },
+    { "string", TRUE },
+    { "string-length", TRUE },
+    { "substring", FALSE },
+    { "substring-after", FALSE },
+    { "substring-before", FALSE },
+    { "sum", FALSE },
+    { "translate", FALSE },
+    { "true", FALSE },
+    { NULL, FALSE }
+};
+
+static int
+slaxOptNameChar (int ch, int first)
+{
+    if (isalpha(ch) || ch == '_' || ch >= 0x80)
+	return TRUE;
+    return (!first && (isdigit(ch) || ch == '-' || ch == '.'));
+}
+
+/*
+ * Scan a QName, returning the end of it
+ */
+static const char *
+slaxOptQName (const char *cp)
+{
+    while (slaxOptNameChar((unsigned char) *cp, FALSE))
+	cp += 1;
+
+    /* A prefix, but not an axis ("child::") */
+    if (cp[0] == ':' && cp[1] != ':'
+	    && slaxOptNameChar((unsigned char) cp[1], TRUE)) {
+	cp += 1;
+	while (slaxOptNameChar((unsigned char) *cp, FALSE))
+	    cp += 1;
+    }
+
+    return cp;
+}
+
+static const char *
+slaxOptSkipSpace (const char *cp)
+{
+    while (isspace((unsigned char) *cp))
+	cp += 1;
+    return cp;
+}
+
+static int
+slaxOptNameIs (const char *name, size_t len, const char *want)
+{
+    return (strlen(want) == len && strncmp(name, want, len) == 0);
+}
+
+/*
+ * Scan an XPath expression, recording the variables it uses, and
+ * whether it depends on the context (relative paths, ".", position()
+ * and friends) or calls anything but the core functions above.  A
+ * path is context-free when it starts from a variable or a function
+ * call, and the predicates along such a path are evaluated against
+ * its nodes, so what's in them doesn't count against us either.
+ */
+static void
+slaxOptScan (const char *expr, slax_opt_scan_t *sosp)
+{
+    /* For each paren or predicate level: does "." mean the context? */
+    int free_ctx[SLAX_OPT_MAX_DEPTH];
+    int saved_chain[SLAX_OPT_MAX_DEPTH];
+    unsigned depth = 0;
+    const char *cp = expr, *start, *ep;
+    int operand = FALSE;	/* Last token ended an operand */
+    int chain_ok = FALSE;	/* Last operand was context-free */
+    int after_slash = FALSE;	/* Last token was "/" or "//" */
+    int slash_ok = FALSE;	/* ... and what it followed was free */
+    int in_step = FALSE;	/* After "@" or "::"; the test follows */
+    const slax_opt_func_t *sofp;
+
+    bzero(sosp, sizeof(*sosp));
+    free_ctx[0] = FALSE;
+
+/* Start a location step, checking where it's relative to */
+#define SLAX_OPT_STEP() \
+    do { \
+	int _ok = after_slash ? slash_ok : free_ctx[depth]; \
+	if (!_ok) \
+	    sosp->sos_context = TRUE; \
+	chain_ok = _ok; \
+	after_slash = FALSE; \
+    } while (0)
+
+    for (;;) {
+	cp = slaxOptSkipSpace(cp);
+	if (*cp == '\0')
+	    break;
+
+	start = cp;
+
+	if (*cp == '"' || *cp == '\'') {
+	    ep = strchr(cp + 1, *cp);
+	    if (ep == NULL) {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+	    cp = ep + 1;
+	    operand = TRUE;
+	    chain_ok = TRUE;
+	    continue;
+	}
+
+	if (isdigit((unsigned char) *cp)
+		|| (*cp == '.' && isdigit((unsigned char) cp[1]))) {
+	    while (isdigit((unsigned char) *cp) || *cp == '.')
+		cp += 1;
+	    operand = TRUE;
+	    chain_ok = TRUE;
+	    continue;
+	}
+
+	if (*cp == '$') {
+	    ep = slaxOptQName(cp + 1);
+	    if (ep == cp + 1 || sosp->sos_nvars >= SLAX_OPT_MAX_VARS) {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+
+	    sosp->sos_vars[sosp->sos_nvars].sov_name = cp + 1;
+	    sosp->sos_vars[sosp->sos_nvars].sov_len = ep - (cp + 1);
+	    sosp->sos_nvars += 1;
+
+	    cp = ep;
+	    operand = TRUE;
+	    chain_ok = TRUE;
+	    continue;
+	}
+
+	if (*cp == '/') {
+	    cp += (cp[1] == '/') ? 2 : 1;
+	    if (operand) {
+		slash_ok = chain_ok;
+	    } else {
+		/* An absolute path depends on the context's document */
+		sosp->sos_context = TRUE;
+		slash_ok = FALSE;
+	    }
+	    after_slash = TRUE;
+	    operand = FALSE;
+	    continue;
+	}
+
+	if (*cp == '[' || *cp == '(') {
+	    if (depth + 1 >= SLAX_OPT_MAX_DEPTH) {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+
+	    saved_chain[depth + 1] = chain_ok;
+	    free_ctx[depth + 1] = (*cp == '[') ? chain_ok : free_ctx[depth];
+	    depth += 1;
+	    cp += 1;
+	    operand = FALSE;
+	    continue;
+	}
+
+	if (*cp == ']' || *cp == ')') {
+	    if (depth == 0) {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+
+	    /* A predicate keeps its path's standing; a call is an operand */
+	    chain_ok = (*cp == ']') ? saved_chain[depth] : TRUE;
+	    depth -= 1;
+	    cp += 1;
+	    operand = TRUE;
+	    continue;
+	}
+
+	if (*cp == '@') {
+	    SLAX_OPT_STEP();
+	    in_step = TRUE;
+	    cp += 1;
+	    operand = FALSE;
+	    continue;
+	}
+
+	if (*cp == '.') {
+	    cp += (cp[1] == '.') ? 2 : 1;
+	    SLAX_OPT_STEP();
+	    operand = TRUE;
+	    continue;
+	}
+
+	if (*cp == '*') {
+	    cp += 1;
+	    if (operand && !in_step) {
+		operand = FALSE;	/* Multiply */
+		continue;
+	    }
+
+	    if (!in_step)
+		SLAX_OPT_STEP();
+	    in_step = FALSE;
+	    operand = TRUE;
+	    continue;
+	}
+
+	if (strchr(",|+-=<>!", *cp)) {
+	    if (*cp == '!' && cp[1] != '=') {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+	    cp += (cp[1] == '=') ? 2 : 1;
+	    operand = FALSE;
+	    continue;
+	}
+
+	if (!slaxOptNameChar((unsigned char) *cp, TRUE)) {
+	    sosp->sos_bad = TRUE;
+	    return;
+	}
+
+	ep = slaxOptQName(cp);
+	size_t len = ep - cp;
+	cp = slaxOptSkipSpace(ep);
+
+	/* After an operand, a name can only be an operator */
+	if (operand && !in_step) {
+	    if (!slaxOptNameIs(start, len, "and")
+		    && !slaxOptNameIs(start, len, "or")
+		    && !slaxOptNameIs(start, len, "div")
+		    && !slaxOptNameIs(start, len, "mod")) {
+		sosp->sos_bad = TRUE;
+		return;
+	    }
+	    operand = FALSE;
+	    continue;
+	}
+
+	/* An axis starts a step; its node test follows the "::" */
+	if (cp[0] == ':' && cp[1] == ':') {
+	    SLAX_OPT_STEP();
+	    in_step = TRUE;
+	    cp += 2;
+	    operand = FALSE;
+	    continue;
+	}
+
+	if (*cp == '(') {
+	    if (slaxOptNameIs(start, len, "node")
+		    || slaxOptNameIs(start, len, "text")
+		    || slaxOptNameIs(start, len, "comment")
+		    || slaxOptNameIs(start, len, "processing-instruction")) {
+		/* A node type test is a step; skip its argument */
+		if (!in_step)
+		    SLAX_OPT_STEP();
+		in_step = FALSE;
+
+		ep = strchr(cp, ')');
+		if (ep == NULL) {
+		    sosp->sos_bad = TRUE;
+		    return;
+		}
+		cp = ep + 1;
+		operand = TRUE;
+		continue;
+	    }
+
+	    int empty = (*slaxOptSkipSpace(cp + 1) == ')');
+
+	    if (slaxOptNameIs(start, len, "position")
+		    || slaxOptNameIs(start, len, "last")) {
+		if (!free_ctx[depth])
+		    sosp->sos_context = TRUE;
+
+	    } else if (slaxOptNameIs(start, len, "current")) {
+		sosp->sos_context = TRUE;
+
+	    } else {
+		for (sofp = slaxOptFuncs; sofp->sof_name; sofp++)
+		    if (slaxOptNameIs(start, len, sofp->sof_name))
+			break;
+
+		if (sofp->sof_name == NULL)
+		    sosp->sos_impure = TRUE;
+		else if (empty && sofp->sof_context && !free_ctx[depth])
+		    sosp->sos_context = TRUE;
+	    }
+
+	    /* The '(' itself is handled above, on the next pass */
+	    operand = FALSE;
+	    continue;
+	}
+
+	/* A name test */
+	if (!in_step)
+	    SLAX_OPT_STEP();
+	in_step = FALSE;
+	operand = TRUE;
+    }
+
+#undef SLAX_OPT_STEP
+
+    if (depth != 0 || after_slash || in_step)
+	sosp->sos_bad = TRUE;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Return the value of an unqualified attribute, without copying it
+ */
+static const char *
+slaxOptProp (xmlNodePtr nodep, const char *name)
+{
+    xmlAttrPtr attrp = xmlHasNsProp(nodep, (const xmlChar *) name, NULL);
+
+    if (attrp == NULL || attrp->children == NULL
+	    || attrp->children->type != XML_TEXT_NODE)
+	return NULL;
+
+    return (const char *) attrp->children->content;
+}
+
+static int
+slaxOptIsSlax (xmlNodePtr nodep, const char *name)
+{
+    return slaxNodeIs(nodep, SLAX_URI, name);
+}
+
+/*
+ * Free a node, after making sure libxml2 has let go of it
+ */
+static void
+slaxOptRemove (xmlNodePtr nodep)
+{
+    xmlUnlinkNode(nodep);
+    xmlFreeNode(nodep);
+}
+
+/*
+ * Can these children be moved into their parent's parent?  Not if
+ * that would widen the scope of a variable.
+ */
+static int
+slaxOptMovable (xmlNodePtr nodep)
+{
+    xmlNodePtr childp;
+
+    for (childp = nodep->children; childp; childp = childp->next)
+	if (slaxNodeIsXsl(childp, ELT_VARIABLE)
+		|| slaxNodeIsXsl(childp, ELT_PARAM))
+	    return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Replace a node with its children
+ */
+static void
+slaxOptUnwrap (xmlNodePtr nodep)
+{
+    xmlNodePtr childp;
+
+    while ((childp = nodep->children) != NULL) {
+	xmlUnlinkNode(childp);
+	xmlAddPrevSibling(nodep, childp);
+    }
+
+    slaxOptRemove(nodep);
+}
+
+/*
+ * Is the variable named in this list?  Names are from the set of
+ * mutable variables, or from a scan.
+ */
+static int
+slaxOptListHas (slax_data_list_t *listp, const char *name, size_t len)
+{
+    slax_data_node_t *dnp;
+
+    SLAXDATALIST_FOREACH(dnp, listp) {
+	if (strncmp(dnp->dn_data, name, len) == 0 && dnp->dn_data[len] == '\0')
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Collect the names of mutable variables (and their shadows), which
+ * can change underneath us, so we leave them alone
+ */
+static void
+slaxOptMutables (xmlNodePtr nodep, slax_data_list_t *listp)
+{
+    static const char *atts[] = { ATT_NAME, ATT_SVARNAME, ATT_MVARNAME,
+				  NULL };
+    const char **attp;
+    const char *name;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	if (slaxOptIsSlax(nodep, ELT_SET_VARIABLE)
+		|| slaxOptIsSlax(nodep, ELT_APPEND_TO_VARIABLE)
+		|| slaxOptProp(nodep, ATT_MUTABLE)
+		|| slaxOptProp(nodep, ATT_MVARNAME)) {
+	    for (attp = atts; *attp; attp++) {
+		name = slaxOptProp(nodep, *attp);
+		if (name && !slaxOptListHas(listp, name, strlen(name)))
+		    slaxDataListAddNul(listp, name);
+	    }
+	}
+
+	slaxOptMutables(nodep->children, listp);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+slaxOptNoError (void *data UNUSED, xmlErrorPtr err UNUSED)
+{
+    return;
+}
+
+/*
+ * Turn the value of a constant expression back into XPath, returning
+ * NULL if we can't write it exactly
+ */
+static char *
+slaxOptLiteral (xmlXPathObjectPtr objp, int as_boolean)
+{
+    char buf[BUFSIZ];
+    xmlChar *str;
+
+    if (as_boolean)
+	return (char *) xmlStrdup((const xmlChar *)
+		(xmlXPathCastToBoolean(objp) ? "true()" : "false()"));
+
+    switch (objp->type) {
+    case XPATH_BOOLEAN:
+	return (char *) xmlStrdup((const xmlChar *)
+				  (objp->boolval ? "true()" : "false()"));
+
+    case XPATH_NUMBER:
+	/* No literals for NaN, the infinities, or negative zero */
+	if (isnan(objp->floatval) || isinf(objp->floatval)
+		|| (objp->floatval == 0 && signbit(objp->floatval)))
+	    return NULL;
+
+	str = xmlXPathCastNumberToString(objp->floatval);
+	if (str == NULL)
+	    return NULL;
+
+	/* It has to read back as the same number, and not in "1e+21" */
+	if (strchr((char *) str, 'e')
+		|| strtod((char *) str, NULL) != objp->floatval) {
+	    xmlFree(str);
+	    return NULL;
+	}
+	return (char *) str;
+
+    case XPATH_STRING:
+	str = objp->stringval;
+	if (str == NULL || xmlStrlen(str) + 3 > (int) sizeof(buf))
+	    return NULL;
+
+	if (strchr((char *) str, '"') == NULL)
+	    snprintf(buf, sizeof(buf), "\"%s\"", str);
+	else if (strchr((char *) str, '\'') == NULL)
+	    snprintf(buf, sizeof(buf), "'%s'", str);
+	else
+	    return NULL;
+
+	return (char *) xmlStrdup((const xmlChar *) buf);
+
+    default:
+	return NULL;
+    }
+}
+
+/*
+ * If an attribute holds a constant expression, replace it with its
+ * value.  Returns the new value (which the node owns), or NULL.
+ */
+static const char *
+slaxOptFoldAttr (xmlNodePtr nodep, const char *att, int as_boolean)
+{
+    const char *expr = slaxOptProp(nodep, att);
+    xmlXPathContextPtr ctxt;
+    xmlXPathObjectPtr objp;
+    slax_opt_scan_t sos;
+    char *value;
+
+    if (expr == NULL)
+	return NULL;
+
+    slaxOptScan(expr, &sos);
+    if (sos.sos_bad || sos.sos_context || sos.sos_impure || sos.sos_nvars)
+	return NULL;
+
+    ctxt = xmlXPathNewContext(NULL);
+    if (ctxt == NULL)
+	return NULL;
+
+    /* It's not our place to complain about expressions that don't parse */
+    ctxt->error = slaxOptNoError;
+    objp = xmlXPathEval((const xmlChar *) expr, ctxt);
+    xmlXPathFreeContext(ctxt);
+
+    if (objp == NULL)
+	return NULL;
+
+    value = slaxOptLiteral(objp, as_boolean);
+    xmlXPathFreeObject(objp);
+
+    if (value == NULL)
+	return NULL;
+
+    if (!streq(value, expr)) {
+	slaxLog("optimize: line %ld: folded '%s' into '%s'",
+		xmlGetLineNo(nodep), expr, value);
+	xmlSetProp(nodep, (const xmlChar *) att, (const xmlChar *) value);
+    }
+
+    xmlFree(value);
+    return slaxOptProp(nodep, att);
+}
+
+/*
+ * Settle an xsl:choose whose branches have constant tests
+ */
+static void
+slaxOptFoldChoose (xmlNodePtr choosep)
+{
+    xmlNodePtr nodep, nextp, truep = NULL, otherp = NULL;
+    const char *test;
+    unsigned count = 0;
+
+    for (nodep = choosep->children; nodep; nodep = nextp) {
+	nextp = nodep->next;
+
+	/* Everything after a branch that's always taken is dead */
+	if (truep) {
+	    slaxOptRemove(nodep);
+	    continue;
+	}
+
+	if (slaxNodeIsXsl(nodep, ELT_OTHERWISE)) {
+	    otherp = nodep;
+	    continue;
+	}
+
+	if (!slaxNodeIsXsl(nodep, ELT_WHEN))
+	    continue;
+
+	test = slaxOptProp(nodep, ATT_TEST);
+	if (test && streq(test, "false()")) {
+	    slaxOptRemove(nodep);
+	    continue;
+	}
+
+	if (test && streq(test, "true()"))
+	    truep = nodep;
+	count += 1;
+    }
+
+    if (truep) {
+	if (count == 1) {
+	    /* The first branch is always taken */
+	    if (slaxOptMovable(truep)) {
+		slaxOptUnwrap(truep);
+		slaxOptUnwrap(choosep);
+	    }
+	    return;
+	}
+
+	/* Later branches are still needed; this one becomes the default */
+	xmlUnsetProp(truep, (const xmlChar *) ATT_TEST);
+	xmlNodeSetName(truep, (const xmlChar *) ELT_OTHERWISE);
+	return;
+    }
+
+    if (count != 0)
+	return;
+
+    /* No branch is ever taken, so only the default is left */
+    if (otherp == NULL) {
+	slaxOptRemove(choosep);
+
+    } else if (slaxOptMovable(otherp)) {
+	slaxOptUnwrap(otherp);
+	slaxOptUnwrap(choosep);
+
+    } else {
+	/* An xsl:choose needs an xsl:when */
+	xmlNodeSetName(otherp, (const xmlChar *) ELT_WHEN);
+	xmlSetProp(otherp, (const xmlChar *) ATT_TEST,
+		   (const xmlChar *) "true()");
+    }
+}
+
+static void
+slaxOptFold (xmlNodePtr nodep)
+{
+    xmlNodePtr nextp;
+    const char *test;
+
+    for ( ; nodep; nodep = nextp) {
+	nextp = nodep->next;
+
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	/* Children first, so a folded xsl:choose sees folded whens */
+	slaxOptFold(nodep->children);
+
+	if (!slaxNodeIsXsl(nodep, NULL))
+	    continue;
+
+	if (slaxNodeIsXsl(nodep, ELT_VARIABLE)
+		|| slaxNodeIsXsl(nodep, ELT_PARAM)
+		|| slaxNodeIsXsl(nodep, ELT_WITH_PARAM)
+		|| slaxNodeIsXsl(nodep, ELT_VALUE_OF)) {
+	    slaxOptFoldAttr(nodep, ATT_SELECT, FALSE);
+
+	} else if (slaxNodeIsXsl(nodep, ELT_WHEN)) {
+	    slaxOptFoldAttr(nodep, ATT_TEST, TRUE);
+
+	} else if (slaxNodeIsXsl(nodep, ELT_IF)) {
+	    test = slaxOptFoldAttr(nodep, ATT_TEST, TRUE);
+	    if (test && streq(test, "false()"))
+		slaxOptRemove(nodep);
+	    else if (test && streq(test, "true()") && slaxOptMovable(nodep))
+		slaxOptUnwrap(nodep);
+
+	} else if (slaxNodeIsXsl(nodep, ELT_CHOOSE)) {
+	    slaxOptFoldChoose(nodep);
+	}
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Find "$name" in the text of an expression, at a name boundary
+ */
+static const char *
+slaxOptFindVar (const char *cp, const char *name, size_t len)
+{
+    for ( ; (cp = strchr(cp, '$')) != NULL; cp++) {
+	if (strncmp(cp + 1, name, len) == 0
+		&& !slaxOptNameChar((unsigned char) cp[len + 1], FALSE)
+		&& cp[len + 1] != ':')
+	    return cp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Is every use of the variable under these nodes one that only wants
+ * its string value?  Those are "select='$name'" on xsl:value-of or
+ * xsl:copy-of, and an attribute value template of just "{$name}".
+ */
+static int
+slaxOptStringUses (xmlNodePtr nodep, const char *name)
+{
+    size_t len = strlen(name);
+    xmlAttrPtr attrp;
+    const char *value, *cp;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	for (attrp = nodep->properties; attrp; attrp = attrp->next) {
+	    if (attrp->children == NULL
+		    || attrp->children->type != XML_TEXT_NODE)
+		continue;
+
+	    value = (const char *) attrp->children->content;
+	    if (value == NULL || slaxOptFindVar(value, name, len) == NULL)
+		continue;
+
+	    cp = slaxOptSkipSpace(value);
+	    if (streq((const char *) attrp->name, ATT_SELECT)
+		    && (slaxNodeIsXsl(nodep, ELT_VALUE_OF)
+			|| slaxNodeIsXsl(nodep, ELT_COPY_OF))
+		    && *cp == '$' && strncmp(cp + 1, name, len) == 0
+		    && *slaxOptSkipSpace(cp + 1 + len) == '\0')
+		continue;
+
+	    if (cp[0] == '{' && cp[1] == '$'
+		    && strncmp(cp + 2, name, len) == 0
+		    && streq(cp + 2 + len, "}"))
+		continue;
+
+	    return FALSE;
+	}
+
+	if (!slaxOptStringUses(nodep->children, name))
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * If a variable's content is a constant string, or a single
+ * xsl:value-of, return the XPath for that string
+ */
+static char *
+slaxOptRtfString (xmlNodePtr varp)
+{
+    xmlNodePtr nodep, textp;
+    xmlChar *str = NULL;
+    const char *select;
+    char *value;
+
+    nodep = varp->children;
+    if (nodep && nodep->next == NULL && slaxNodeIsXsl(nodep, ELT_VALUE_OF)
+	    && nodep->children == NULL
+	    && slaxOptProp(nodep, ATT_DISABLE_OUTPUT_ESCAPING) == NULL) {
+	select = slaxOptProp(nodep, ATT_SELECT);
+	if (select == NULL)
+	    return NULL;
+
+	size_t len = strlen(select) + sizeof("string()");
+	value = xmlMalloc(len);
+	if (value)
+	    snprintf(value, len, "string(%s)", select);
+	return value;
+    }
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (slaxNodeIsXsl(nodep, ELT_TEXT)
+		&& slaxOptProp(nodep, ATT_DISABLE_OUTPUT_ESCAPING) == NULL) {
+	    for (textp = nodep->children; textp; textp = textp->next) {
+		if (textp->type != XML_TEXT_NODE)
+		    goto fail;
+		str = xmlStrcat(str, textp->content);
+	    }
+
+	} else if (nodep->type == XML_TEXT_NODE) {
+	    str = xmlStrcat(str, nodep->content);
+
+	} else {
+	    goto fail;
+	}
+    }
+
+    if (str == NULL)
+	return NULL;		/* An empty variable isn't worth it */
+
+    xmlXPathObject obj;
+    bzero(&obj, sizeof(obj));
+    obj.type = XPATH_STRING;
+    obj.stringval = str;
+
+    value = slaxOptLiteral(&obj, FALSE);
+    xmlFree(str);
+    return value;
+
+ fail:
+    xmlFreeAndEasy(str);
+    return NULL;
+}
+
+static void
+slaxOptRtf (xmlNodePtr nodep, slax_data_list_t *mutablep, int top)
+{
+    xmlNodePtr childp;
+    const char *name;
+    char *value;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	/* Global variables can be used by other files; leave them be */
+	if (!top && slaxNodeIsXsl(nodep, ELT_VARIABLE)
+		&& nodep->children != NULL
+		&& slaxOptProp(nodep, ATT_SELECT) == NULL
+		&& (name = slaxOptProp(nodep, ATT_NAME)) != NULL
+		&& !slaxOptListHas(mutablep, name, strlen(name))
+		&& slaxOptStringUses(nodep->next, name)) {
+	    value = slaxOptRtfString(nodep);
+	    if (value) {
+		slaxLog("optimize: line %ld: $%s is a string: '%s'",
+			xmlGetLineNo(nodep), name, value);
+
+		while ((childp = nodep->children) != NULL)
+		    slaxOptRemove(childp);
+
+		xmlSetProp(nodep, (const xmlChar *) ATT_SELECT,
+			   (const xmlChar *) value);
+		xmlFree(value);
+		continue;
+	    }
+	}
+
+	slaxOptRtf(nodep->children, mutablep, FALSE);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Count the variables and parameters with this name under nodep
+ */
+static unsigned
+slaxOptCountBindings (xmlNodePtr nodep, const char *name)
+{
+    unsigned count = 0;
+    const char *cp;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	if (slaxNodeIsXsl(nodep, ELT_VARIABLE)
+		|| slaxNodeIsXsl(nodep, ELT_PARAM)) {
+	    cp = slaxOptProp(nodep, ATT_NAME);
+	    if (cp && streq(cp, name))
+		count += 1;
+	}
+
+	count += slaxOptCountBindings(nodep->children, name);
+    }
+
+    return count;
+}
+
+/*
+ * Can this variable be evaluated before the loop starts?  Its value
+ * must not depend on the context, call anything with side effects,
+ * or use a variable bound inside the loop.  Its name must be unique
+ * in the template, since it'll now be in scope after the loop.
+ */
+static int
+slaxOptInvariant (xmlNodePtr varp, xmlNodePtr loopp, xmlNodePtr topp,
+		  slax_data_list_t *mutablep)
+{
+    const char *name = slaxOptProp(varp, ATT_NAME);
+    const char *select = slaxOptProp(varp, ATT_SELECT);
+    slax_opt_scan_t sos;
+    xmlNodePtr nodep;
+    const char *cp;
+    unsigned i;
+
+    if (name == NULL || select == NULL || varp->children != NULL
+	    || slaxOptListHas(mutablep, name, strlen(name)))
+	return FALSE;
+
+    slaxOptScan(select, &sos);
+    if (sos.sos_bad || sos.sos_context || sos.sos_impure)
+	return FALSE;
+
+    for (i = 0; i < sos.sos_nvars; i++) {
+	if (slaxOptListHas(mutablep, sos.sos_vars[i].sov_name,
+			   sos.sos_vars[i].sov_len))
+	    return FALSE;
+
+	/* Earlier variables in the loop body are out of bounds */
+	for (nodep = loopp->children; nodep != varp; nodep = nodep->next) {
+	    if (!slaxNodeIsXsl(nodep, ELT_VARIABLE))
+		continue;
+
+	    cp = slaxOptProp(nodep, ATT_NAME);
+	    if (cp && strlen(cp) == sos.sos_vars[i].sov_len
+		    && strncmp(cp, sos.sos_vars[i].sov_name,
+			       sos.sos_vars[i].sov_len) == 0)
+		return FALSE;
+	}
+    }
+
+    return (slaxOptCountBindings(topp->children, name) == 1);
+}
+
+static void
+slaxOptHoist (xmlNodePtr nodep, xmlNodePtr topp, slax_data_list_t *mutablep)
+{
+    xmlNodePtr childp, nextp;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	/* Inner loops first, so variables can move out more than once */
+	slaxOptHoist(nodep->children, topp ?: nodep, mutablep);
+
+	if (topp == NULL || !(slaxNodeIsXsl(nodep, ELT_FOR_EACH)
+			      || slaxOptIsSlax(nodep, ELT_WHILE)))
+	    continue;
+
+	for (childp = nodep->children; childp; childp = nextp) {
+	    nextp = childp->next;
+
+	    if (!slaxNodeIsXsl(childp, ELT_VARIABLE)
+		    || !slaxOptInvariant(childp, nodep, topp, mutablep))
+		continue;
+
+	    slaxLog("optimize: line %ld: moved $%s out of the loop",
+		    xmlGetLineNo(childp), slaxOptProp(childp, ATT_NAME));
+
+	    xmlUnlinkNode(childp);
+	    xmlAddPrevSibling(nodep, childp);
+	}
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Template names are compared without their prefix, which can only
+ * make us keep a template we could have dropped
+ */
+static const char *
+slaxOptLocalName (const char *name)
+{
+    const char *cp = strrchr(name, ':');
+    return cp ? cp + 1 : name;
+}
+
+static void
+slaxOptCalls (xmlNodePtr nodep, slax_data_list_t *listp)
+{
+    const char *name;
+
+    for ( ; nodep; nodep = nodep->next) {
+	if (nodep->type != XML_ELEMENT_NODE)
+	    continue;
+
+	if (slaxNodeIsXsl(nodep, ELT_CALL_TEMPLATE)) {
+	    name = slaxOptProp(nodep, ATT_NAME);
+	    if (name) {
+		name = slaxOptLocalName(name);
+		if (!slaxOptListHas(listp, name, strlen(name)))
+		    slaxDataListAddNul(listp, name);
+	    }
+	}
+
+	slaxOptCalls(nodep->children, listp);
+    }
+}
+
+static void
+slaxOptDead (xmlNodePtr rootp)
+{
+    slax_data_list_t calls;
+    xmlNodePtr nodep, nextp;
+    const char *name;
+    int removed;
+
+    for (nodep = rootp->children; nodep; nodep = nodep->next)
+	if (slaxNodeIsXsl(nodep, ELT_IMPORT)
+		|| slaxNodeIsXsl(nodep, ELT_INCLUDE))
+	    return;
+
+    /* Dropping one template can leave others uncalled */
+    do {
+	removed = FALSE;
+	slaxDataListInit(&calls);
+	slaxOptCalls(rootp->children, &calls);
+
+	for (nodep = rootp->children; nodep; nodep = nextp) {
+	    nextp = nodep->next;
+
+	    if (!slaxNodeIsXsl(nodep, ELT_TEMPLATE)
+		    || slaxOptProp(nodep, ATT_MATCH) != NULL
+		    || (name = slaxOptProp(nodep, ATT_NAME)) == NULL)
+		continue;
+
+	    name = slaxOptLocalName(name);
+	    if (slaxOptListHas(&calls, name, strlen(name)))
+		continue;
+
+	    slaxLog("optimize: line %ld: dropped unused template '%s'",
+		    xmlGetLineNo(nodep), name);
+	    slaxOptRemove(nodep);
+	    removed = TRUE;
+	}
+
+	slaxDataListClean(&calls);
+    } while (removed);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void
+slaxOptimize (xmlDocPtr docp, int library)
+{
+    slax_data_list_t mutables;
+    xmlNodePtr rootp;
+
+    if (slaxOptFlags == 0 || docp == NULL)
+	return;
+
+    rootp = xmlDocGetRootElement(docp);
+    if (rootp == NULL || !slaxNodeIsXsl(rootp, NULL))
+	return;
+
+    slaxDataListInit(&mutables);
+    slaxOptMutables(rootp, &mutables);
+
+    if (slaxOptFlags & SLAXOPT_FOLD)
+	slaxOptFold(rootp->children);
+
+    if (slaxOptFlags & SLAXOPT_RTF)
+	slaxOptRtf(rootp->children, &mutables, TRUE);
+
+    if (slaxOptFlags & SLAXOPT_HOIST)
+	slaxOptHoist(rootp->children, NULL, &mutables);
+
+    if ((slaxOptFlags & SLAXOPT_DEAD) && !library)
+	slaxOptDead(rootp);
+
+    slaxDataListClean(&mutables);
+}
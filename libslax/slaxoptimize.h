@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxoptimize.h -- rewrite the XSLT built from a SLAX script
+ */
+
+#ifndef LIBSLAX_SLAXOPTIMIZE_H
+#define LIBSLAX_SLAXOPTIMIZE_H
+
+/**
+ * Run the optimizer passes turned on by slaxOptimizeSetFlags() over
+ * a freshly loaded document
+ *
+ * @param docp The XSLT document to rewrite
+ * @param library TRUE if the document is being imported or included,
+ *        so its named templates may be called from another file
+ */
+void
+slaxOptimize (xmlDocPtr docp, int library);
+
+#endif /* LIBSLAX_SLAXOPTIMIZE_H */
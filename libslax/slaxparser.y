@@ -1914,12 +1914,12 @@ for_stmt :
 		     * }
 		     * This allows "." to remain unchanged.
 		     */
-		    static unsigned for_count;
 		    char buf[BUFSIZ];
 
 		    /* var $slax-dot-xxx = . */
 		    snprintf(buf, sizeof(buf), "%s%u",
-			     FOR_VARIABLE_PREFIX, ++for_count);
+			     FOR_VARIABLE_PREFIX,
+			     ++slaxNameCounters[SNC_FOR]);
 		    slaxElementPush(slax_data, ELT_VARIABLE,
 				    ATT_NAME, buf + 1);
 		    slaxAttribAddLiteral(slax_data, ATT_SELECT, ".");
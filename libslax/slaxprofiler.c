@@ -23,6 +23,9 @@
 #include <sys/queue.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #include <libxml/xmlsave.h>
 #include <libxml/xmlIO.h>
@@ -32,11 +35,16 @@
 #include "slaxinternals.h"
 #include <libslax/slax.h>
 #include <libpsu/psutime.h>
+#include <libpsu/psualloc.h>
+#include <libpsu/psuthread.h>
 
 typedef struct slax_prof_entry_s {
     unsigned long spe_count; /* Number of times we've hit this line */
     unsigned long spe_user; /* Total number of user cycles we've spent */
     unsigned long spe_system; /* Total number of system cycles we've spent */
+    unsigned long spe_samples; /* Number of samples taken on this line */
+    unsigned long spe_allocs; /* Number of allocations made on this line */
+    unsigned long spe_bytes; /* Number of bytes allocated on this line */
 } slax_prof_entry_t;
 
 /*
@@ -46,15 +54,542 @@ typedef struct slax_prof_entry_s {
  */
 typedef struct slax_prof_s {
     xmlDocPtr sp_docp;		/* Document pointer */
-    unsigned sp_inst_line;	/* Current instruction line number*/
+    volatile unsigned sp_inst_line; /* Current instruction line number*/
     unsigned sp_lines;		/* Number of lines in the file */
+    unsigned long sp_other;	/* Samples taken outside any instruction */
+    unsigned long sp_other_allocs; /* Allocations outside any instruction */
+    unsigned long sp_other_bytes; /* Bytes allocated outside any instruction */
     slax_prof_entry_t sp_data[0]; /* Raw data, indexed by line number */
 } slax_prof_t;
 
 slax_prof_t *slax_profile;	/* Profiling data */
+static psu_thread_t slax_profile_owner; /* Thread that called slaxProfOpen */
 psu_time_usecs_t slax_profile_time_user; /* Last user time from getrusage */
 unsigned long slax_profile_time_system; /* Last system time from getrusage */
 
+/*
+ * In sampling mode, a SIGPROF timer charges a sample to whatever
+ * instruction is current (sp_inst_line), so the cost per instruction
+ * is just recording the line number.  Samples are in CPU time, so a
+ * script sitting at the debugger prompt doesn't collect any.
+ */
+#define SLAX_PROF_INTERVAL	1000 /* Sampling interval (usecs) */
+
+/*
+ * The timer, the allocation hooks, and the debugger callbacks are
+ * all process-wide, so there's one profile, which belongs to the
+ * thread that opened it.  Other threads running scripts at the same
+ * time go uncounted rather than muddling its numbers.  We look at
+ * the owner instead of keeping the profile in thread-local storage
+ * because the signal handler can't safely touch the latter.
+ */
+static inline slax_prof_t *
+slaxProfMine (void)
+{
+    slax_prof_t *spp = slax_profile;
+
+    if (spp && psu_thread_equal(psu_thread_self(), slax_profile_owner))
+	return spp;
+    return NULL;
+}
+
+static int slax_profile_mode = SLAX_PROF_TIMER; /* SLAX_PROF_* */
+static int slax_profile_sampling; /* Timer is running */
+static struct sigaction slax_profile_old_action; /* Saved SIGPROF action */
+
+static void
+slaxProfSignal (int sig UNUSED)
+{
+    slax_prof_t *spp = slaxProfMine();
+    unsigned line;
+
+    if (spp == NULL)
+	return;
+
+    line = spp->sp_inst_line;
+    if (line && line <= spp->sp_lines)
+	spp->sp_data[line].spe_samples += 1;
+    else
+	spp->sp_other += 1;
+}
+
+static void
+slaxProfSampleStart (void)
+{
+    struct sigaction sa;
+    struct itimerval itv;
+
+    if (slax_profile_sampling)
+	return;
+
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = slaxProfSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &slax_profile_old_action) < 0)
+	return;
+
+    bzero(&itv, sizeof(itv));
+    itv.it_interval.tv_usec = itv.it_value.tv_usec = SLAX_PROF_INTERVAL;
+    if (setitimer(ITIMER_PROF, &itv, NULL) < 0) {
+	sigaction(SIGPROF, &slax_profile_old_action, NULL);
+	return;
+    }
+
+    slax_profile_sampling = TRUE;
+}
+
+static void
+slaxProfSampleStop (void)
+{
+    struct itimerval itv;
+
+    if (!slax_profile_sampling)
+	return;
+
+    bzero(&itv, sizeof(itv));
+    setitimer(ITIMER_PROF, &itv, NULL);
+    sigaction(SIGPROF, &slax_profile_old_action, NULL);
+
+    slax_profile_sampling = FALSE;
+}
+
+/**
+ * Set the profiling mode
+ *
+ * @mode one of the SLAX_PROF_* values
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfSetMode (int mode)
+{
+    if (mode != SLAX_PROF_TIMER && mode != SLAX_PROF_SAMPLE
+	    && mode != SLAX_PROF_COUNT)
+	return TRUE;
+
+    slax_profile_mode = mode;
+
+    if (mode == SLAX_PROF_SAMPLE && slax_profile)
+	slaxProfSampleStart();
+    else
+	slaxProfSampleStop();
+
+    return FALSE;
+}
+
+/**
+ * Return the current profiling mode
+ */
+int
+slaxProfGetMode (void)
+{
+    return slax_profile_mode;
+}
+
+/*
+ * Memory accounting.  We wrap libxml2's allocators (which libxslt
+ * and our extension functions use) and libpsu's, charging each
+ * allocation to the current instruction line.  The wrappers hand
+ * everything to the saved allocators, so memory allocated before
+ * we were turned on (or after we're turned off) can still be freed.
+ * A realloc is charged for its full new size, since we can't know
+ * the old one.
+ */
+static int slax_profile_memory;	/* Memory accounting is on */
+static xmlFreeFunc slax_profile_old_free;
+static xmlMallocFunc slax_profile_old_malloc;
+static xmlReallocFunc slax_profile_old_realloc;
+static xmlStrdupFunc slax_profile_old_strdup;
+static psu_realloc_func_t slax_profile_old_psu_realloc;
+static psu_free_func_t slax_profile_old_psu_free;
+
+static inline void
+slaxProfMemCharge (size_t size)
+{
+    slax_prof_t *spp = slaxProfMine();
+    unsigned line;
+
+    if (spp == NULL)
+	return;
+
+    line = spp->sp_inst_line;
+    if (line && line <= spp->sp_lines) {
+	spp->sp_data[line].spe_allocs += 1;
+	spp->sp_data[line].spe_bytes += size;
+    } else {
+	spp->sp_other_allocs += 1;
+	spp->sp_other_bytes += size;
+    }
+}
+
+static void *
+slaxProfMalloc (size_t size)
+{
+    slaxProfMemCharge(size);
+    return slax_profile_old_malloc(size);
+}
+
+static void *
+slaxProfRealloc (void *ptr, size_t size)
+{
+    slaxProfMemCharge(size);
+    return slax_profile_old_realloc(ptr, size);
+}
+
+static char *
+slaxProfStrdup (const char *str)
+{
+    slaxProfMemCharge(strlen(str) + 1);
+    return slax_profile_old_strdup(str);
+}
+
+static void
+slaxProfFree (void *ptr)
+{
+    slax_profile_old_free(ptr);
+}
+
+static void *
+slaxProfPsuRealloc (void *ptr, size_t size)
+{
+    if (size)
+	slaxProfMemCharge(size);
+    return slax_profile_old_psu_realloc(ptr, size);
+}
+
+/**
+ * Turn memory accounting on or off
+ *
+ * @enable TRUE to turn it on
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfSetMemory (int enable)
+{
+    if (enable == slax_profile_memory)
+	return FALSE;
+
+    if (enable) {
+	if (xmlMemGet(&slax_profile_old_free, &slax_profile_old_malloc,
+		      &slax_profile_old_realloc, &slax_profile_old_strdup))
+	    return TRUE;
+
+	if (xmlMemSetup(slaxProfFree, slaxProfMalloc,
+			slaxProfRealloc, slaxProfStrdup))
+	    return TRUE;
+
+	slax_profile_old_psu_realloc = psu_realloc;
+	slax_profile_old_psu_free = psu_free;
+	psu_set_allocator(slaxProfPsuRealloc, psu_free);
+
+    } else {
+	xmlMemSetup(slax_profile_old_free, slax_profile_old_malloc,
+		    slax_profile_old_realloc, slax_profile_old_strdup);
+	psu_set_allocator(slax_profile_old_psu_realloc,
+			  slax_profile_old_psu_free);
+    }
+
+    slax_profile_memory = enable;
+    return FALSE;
+}
+
+/**
+ * Is memory accounting turned on?
+ */
+int
+slaxProfGetMemory (void)
+{
+    return slax_profile_memory;
+}
+
+/*
+ * The call tree.  Each node is a template or function called from a
+ * given line of its parent, with the usecs of CPU time spent in it
+ * and in everthing it calls (inclusive).  Exclusive time is the
+ * difference between that and the inclusive time of its children.
+ * This is built from the stack frames the debugger keeps, which are
+ * far fewer than instructions, so we can afford reading the clock.
+ */
+typedef struct slax_prof_call_s {
+    struct slax_prof_call_s *spc_parent; /* Caller */
+    struct slax_prof_call_s *spc_child; /* First callee */
+    struct slax_prof_call_s *spc_next; /* Next sibling */
+    char *spc_name;		/* Name of template or function */
+    const char *spc_file;	/* File containing it */
+    unsigned spc_line;		/* Line number of its definition */
+    unsigned spc_caller_line;	/* Line number of the call */
+    unsigned long spc_calls;	/* Number of calls */
+    psu_time_usecs_t spc_inclusive; /* Time spent (inclusive) */
+} slax_prof_call_t;
+
+typedef struct slax_prof_frame_s {
+    slax_prof_call_t *spf_call;	/* Node in the call tree */
+    psu_time_usecs_t spf_start;	/* Time the call started */
+    int spf_record;		/* Record this call's time */
+} slax_prof_frame_t;
+
+static slax_prof_call_t slax_profile_root; /* Root of the call tree */
+static slax_prof_frame_t *slax_profile_frames; /* Stack of active calls */
+static unsigned slax_profile_depth; /* Number of active calls */
+static unsigned slax_profile_max_depth; /* Number of frames allocated */
+
+static psu_time_usecs_t
+slaxProfCpuTime (void)
+{
+#ifdef CLOCK_PROCESS_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+	return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / NSEC_PER_USEC;
+#endif /* CLOCK_PROCESS_CPUTIME_ID */
+    struct rusage ru;
+
+    if (getrusage(0, &ru) < 0)
+	return 0;
+
+    return psu_timeval_to_usecs(&ru.ru_utime)
+	+ psu_timeval_to_usecs(&ru.ru_stime);
+}
+
+static void
+slaxProfCallFree (slax_prof_call_t *spcp)
+{
+    slax_prof_call_t *child, *next;
+
+    for (child = spcp->spc_child; child; child = next) {
+	next = child->spc_next;
+	slaxProfCallFree(child);
+	xmlFree(child->spc_name);
+	xmlFree(child);
+    }
+
+    spcp->spc_child = NULL;
+}
+
+static void
+slaxProfCallClear (slax_prof_call_t *spcp)
+{
+    slax_prof_call_t *child;
+
+    spcp->spc_calls = 0;
+    spcp->spc_inclusive = 0;
+
+    for (child = spcp->spc_child; child; child = child->spc_next)
+	slaxProfCallClear(child);
+}
+
+void
+slaxProfCallEnter (const char *name, xmlNodePtr def, unsigned line,
+		   int record, int nested)
+{
+    slax_prof_call_t *parent, *spcp;
+    slax_prof_frame_t *spfp;
+
+    if (slax_profile && slaxProfMine() == NULL)
+	return;
+
+    if (slax_profile_depth >= slax_profile_max_depth) {
+	unsigned max = slax_profile_max_depth ? slax_profile_max_depth * 2 : 64;
+
+	spfp = xmlRealloc(slax_profile_frames, max * sizeof(*spfp));
+	if (spfp == NULL)
+	    return;
+
+	slax_profile_frames = spfp;
+	slax_profile_max_depth = max;
+    }
+
+    parent = slax_profile_depth
+	? slax_profile_frames[slax_profile_depth - 1].spf_call
+	: &slax_profile_root;
+
+    /*
+     * A nested frame inside the template or function that's already
+     * running isn't a call, just a frame; its time is already being
+     * counted by the frame for the call.
+     */
+    if (nested && parent != &slax_profile_root
+	    && streq(parent->spc_name, name)) {
+	spfp = &slax_profile_frames[slax_profile_depth++];
+	spfp->spf_call = parent;
+	spfp->spf_record = FALSE;
+	spfp->spf_start = 0;
+	return;
+    }
+
+    /* Find (or make) our node under our caller */
+    for (spcp = parent->spc_child; spcp; spcp = spcp->spc_next)
+	if (spcp->spc_caller_line == line && streq(spcp->spc_name, name))
+	    break;
+
+    if (spcp == NULL) {
+	spcp = xmlMalloc(sizeof(*spcp));
+	if (spcp == NULL)
+	    return;
+
+	bzero(spcp, sizeof(*spcp));
+	spcp->spc_name = (char *) xmlStrdup((const xmlChar *) name);
+	if (spcp->spc_name == NULL) {
+	    xmlFree(spcp);
+	    return;
+	}
+
+	spcp->spc_parent = parent;
+	spcp->spc_file = (def && def->doc && def->doc->URL)
+	    ? (const char *) def->doc->URL : "unknown";
+	spcp->spc_line = def ? xmlGetLineNo(def) : 0;
+	spcp->spc_caller_line = line;
+	spcp->spc_next = parent->spc_child;
+	parent->spc_child = spcp;
+    }
+
+    spfp = &slax_profile_frames[slax_profile_depth++];
+    spfp->spf_call = spcp;
+    spfp->spf_record = record;
+    spfp->spf_start = record ? slaxProfCpuTime() : 0;
+}
+
+void
+slaxProfCallExit (void)
+{
+    slax_prof_frame_t *spfp;
+    psu_time_usecs_t now;
+
+    if (slax_profile_depth == 0 || (slax_profile && slaxProfMine() == NULL))
+	return;
+
+    spfp = &slax_profile_frames[--slax_profile_depth];
+    if (!spfp->spf_record)
+	return;
+
+    now = slaxProfCpuTime();
+    spfp->spf_call->spc_calls += 1;
+    if (now > spfp->spf_start)
+	spfp->spf_call->spc_inclusive += now - spfp->spf_start;
+}
+
+static psu_time_usecs_t
+slaxProfCallExclusive (slax_prof_call_t *spcp)
+{
+    slax_prof_call_t *child;
+    psu_time_usecs_t children = 0;
+
+    for (child = spcp->spc_child; child; child = child->spc_next)
+	children += child->spc_inclusive;
+
+    return (spcp->spc_inclusive > children)
+	? spcp->spc_inclusive - children : 0;
+}
+
+/*
+ * Callgrind wants costs per function, not per call path, so we
+ * write a record for every node; the tools merge records with the
+ * same file/function, so a template called from many paths ends up
+ * with the sum of its costs.
+ */
+static void
+slaxProfCallgrindNode (FILE *fp, slax_prof_call_t *spcp)
+{
+    slax_prof_call_t *child;
+
+    if (spcp->spc_calls == 0 && spcp->spc_child == NULL)
+	return;
+
+    fprintf(fp, "fl=%s\nfn=%s\n%u %llu\n", spcp->spc_file, spcp->spc_name,
+	    spcp->spc_line,
+	    (unsigned long long) slaxProfCallExclusive(spcp));
+
+    for (child = spcp->spc_child; child; child = child->spc_next) {
+	if (child->spc_calls == 0)
+	    continue;
+
+	fprintf(fp, "cfl=%s\ncfn=%s\ncalls=%lu %u\n%u %llu\n",
+		child->spc_file, child->spc_name, child->spc_calls,
+		child->spc_line, child->spc_caller_line,
+		(unsigned long long) child->spc_inclusive);
+    }
+
+    fprintf(fp, "\n");
+
+    for (child = spcp->spc_child; child; child = child->spc_next)
+	slaxProfCallgrindNode(fp, child);
+}
+
+int
+slaxProfCallgrind (const char *filename)
+{
+    slax_prof_t *spp = slax_profile;
+    slax_prof_call_t *child;
+    FILE *fp;
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+	slaxOutput("could not open file: %s: %s", filename, strerror(errno));
+	return TRUE;
+    }
+
+    fprintf(fp, "# callgrind format\nversion: 1\ncreator: libslax\n");
+    if (spp && spp->sp_docp && spp->sp_docp->URL)
+	fprintf(fp, "cmd: %s\n", spp->sp_docp->URL);
+    fprintf(fp, "positions: line\nevents: usecs\n\n");
+
+    for (child = slax_profile_root.spc_child; child; child = child->spc_next)
+	slaxProfCallgrindNode(fp, child);
+
+    fclose(fp);
+    return FALSE;
+}
+
+static void
+slaxProfFoldedNode (FILE *fp, slax_prof_call_t *spcp, char *path,
+		    size_t len, size_t size)
+{
+    slax_prof_call_t *child;
+    psu_time_usecs_t self;
+    const char *cp;
+    size_t plen = len;
+
+    if (spcp->spc_calls == 0)
+	return;
+
+    /* Semi-colons separate frames, so we can't have any in a name */
+    if (plen && plen < size - 1)
+	path[plen++] = ';';
+    for (cp = spcp->spc_name; *cp && plen < size - 1; cp++)
+	path[plen++] = (*cp == ';') ? ',' : *cp;
+    path[plen] = '\0';
+
+    self = slaxProfCallExclusive(spcp);
+    if (self)
+	fprintf(fp, "%s %llu\n", path, (unsigned long long) self);
+
+    for (child = spcp->spc_child; child; child = child->spc_next)
+	slaxProfFoldedNode(fp, child, path, plen, size);
+
+    path[len] = '\0';
+}
+
+int
+slaxProfFolded (const char *filename)
+{
+    slax_prof_call_t *child;
+    char path[BUFSIZ * 4];
+    FILE *fp;
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+	slaxOutput("could not open file: %s: %s", filename, strerror(errno));
+	return TRUE;
+    }
+
+    path[0] = '\0';
+    for (child = slax_profile_root.spc_child; child; child = child->spc_next)
+	slaxProfFoldedNode(fp, child, path, 0, sizeof(path));
+
+    fclose(fp);
+    return FALSE;
+}
+
 static unsigned
 slaxProfCountLines (xmlDocPtr docp)
 {
@@ -97,7 +632,12 @@ slaxProfOpen (xmlDocPtr docp)
     spp->sp_docp = docp;
     spp->sp_lines = lines;
 
+    slax_profile_owner = psu_thread_self();
     slax_profile = spp;		/* Record as current document */
+
+    if (slax_profile_mode == SLAX_PROF_SAMPLE)
+	slaxProfSampleStart();
+
     return FALSE;
 }
 
@@ -110,10 +650,13 @@ slaxProfOpen (xmlDocPtr docp)
 void
 slaxProfEnter (xmlNodePtr inst)
 {
-    slax_prof_t *spp = slax_profile;
+    slax_prof_t *spp = slaxProfMine();
     unsigned line;
     struct rusage ru;
 
+    if (spp == NULL)
+	return;
+
     slaxLog("profile:enter for %s", inst->name);
 
     if (spp->sp_inst_line)
@@ -129,6 +672,13 @@ slaxProfEnter (xmlNodePtr inst)
     if (line == 0 || line > spp->sp_lines)
 	return;
 
+    /* Without the clock, we just count the hit and note the line */
+    if (slax_profile_mode != SLAX_PROF_TIMER) {
+	spp->sp_data[line].spe_count += 1;
+	spp->sp_inst_line = line;
+	return;
+    }
+
     if (getrusage(0, &ru) == 0) {
 	slax_profile_time_user = psu_timeval_to_usecs(&ru.ru_utime);
 	slax_profile_time_system = psu_timeval_to_usecs(&ru.ru_stime);
@@ -142,14 +692,19 @@ slaxProfEnter (xmlNodePtr inst)
 void
 slaxProfExit (void)
 {
-    slax_prof_t *spp = slax_profile;
+    slax_prof_t *spp = slaxProfMine();
     unsigned line;
     struct rusage ru;
     int rc;
 
-    if (spp->sp_inst_line == 0)
+    if (spp == NULL || spp->sp_inst_line == 0)
 	return;
 
+    if (slax_profile_mode != SLAX_PROF_TIMER) {
+	spp->sp_inst_line = 0;
+	return;
+    }
+
     /* Zero means no valid data, so don't record */
     if (slax_profile_time_user == 0)
 	return;
@@ -211,8 +766,41 @@ slaxProfReport (int brief, const char *buffer)
 	}
     }
 
-    slaxOutput("%5s %8s %8s %8s %8s %8s %s",
-	       "Line", "Hits", "User", "U/Hit", "System", "S/Hit", "Source");
+    unsigned long tot_samples = spp->sp_other;
+    int mode = slax_profile_mode;
+
+    unsigned long tot_allocs = spp->sp_other_allocs;
+    unsigned long tot_bytes = spp->sp_other_bytes;
+    char mem[32];
+
+    for (num = 1; num <= spp->sp_lines; num++) {
+	tot_samples += spp->sp_data[num].spe_samples;
+	tot_allocs += spp->sp_data[num].spe_allocs;
+	tot_bytes += spp->sp_data[num].spe_bytes;
+    }
+    num = 0;
+
+    /*
+     * Memory columns go between the CPU numbers and the source, and
+     * only appear if we've been accounting for memory
+     */
+    int memory = (slax_profile_memory || tot_allocs != 0);
+    const char *nomem = memory ? "        -          -" : "";
+
+    if (memory)
+	snprintf(mem, sizeof(mem), " %8s %10s", "Allocs", "Bytes");
+    else
+	mem[0] = '\0';
+
+    if (mode == SLAX_PROF_SAMPLE)
+	slaxOutput("%5s %8s %8s %8s%s %s",
+		   "Line", "Hits", "Samples", "Percent", mem, "Source");
+    else if (mode == SLAX_PROF_COUNT)
+	slaxOutput("%5s %8s%s %s", "Line", "Hits", mem, "Source");
+    else
+	slaxOutput("%5s %8s %8s %8s %8s %8s%s %s",
+		   "Line", "Hits", "User", "U/Hit", "System", "S/Hit",
+		   mem, "Source");
 
     for (;;) {
 	if (buffer) {
@@ -246,31 +834,90 @@ slaxProfReport (int brief, const char *buffer)
 
 	    count = spp->sp_data[num].spe_count;
 
-	    if (num <= spp->sp_lines && spp->sp_data[num].spe_count) {
-		slaxOutput("%5u %8u %8lu %8.2f %8lu %8.2f %.*s",
+	    if (memory && num <= spp->sp_lines)
+		snprintf(mem, sizeof(mem), " %8lu %10lu",
+			 spp->sp_data[num].spe_allocs,
+			 spp->sp_data[num].spe_bytes);
+
+	    if (num <= spp->sp_lines && spp->sp_data[num].spe_count
+		    && mode != SLAX_PROF_TIMER) {
+		unsigned long samples = spp->sp_data[num].spe_samples;
+
+		if (mode == SLAX_PROF_SAMPLE)
+		    slaxOutput("%5u %8u %8lu %7.2f%%%s %.*s",
+			       num, count, samples, tot_samples
+			       ? doublediv(samples * 100, tot_samples) : 0.0,
+			       mem, line_len, line);
+		else
+		    slaxOutput("%5u %8u%s %.*s", num, count, mem,
+			       line_len, line);
+
+		tot_count += count;
+
+	    } else if (num <= spp->sp_lines && spp->sp_data[num].spe_count) {
+		slaxOutput("%5u %8u %8lu %8.2f %8lu %8.2f%s %.*s",
 			   num, count,
 			   spp->sp_data[num].spe_user,
 			   doublediv(spp->sp_data[num].spe_user, count),
 			   spp->sp_data[num].spe_system,
 			   doublediv(spp->sp_data[num].spe_system, count),
-			   line_len, line);
+			   mem, line_len, line);
 
 		tot_count += spp->sp_data[num].spe_count;
 		tot_user += spp->sp_data[num].spe_user;
 		tot_system += spp->sp_data[num].spe_system;
 
-	    } else if (!brief) {
-		slaxOutput("%5u %8s %8s %8s %8s %8s %.*s",
-			   num, "-", "-", "-", "-", "-", line_len, line);
+	    } else if (brief) {
+		/* Nothing */
+	    } else if (mode == SLAX_PROF_SAMPLE) {
+		slaxOutput("%5u %8s %8s %8s%s %.*s",
+			   num, "-", "-", "-", nomem, line_len, line);
+	    } else if (mode == SLAX_PROF_COUNT) {
+		slaxOutput("%5u %8s%s %.*s", num, "-", nomem, line_len, line);
+	    } else {
+		slaxOutput("%5u %8s %8s %8s %8s %8s%s %.*s",
+			   num, "-", "-", "-", "-", "-", nomem, line_len, line);
 	    }
-	} else if (!brief) {
-	    slaxOutput("%5s %8s %8s %8s %8s %8s %.*s",
-		       "-", "-", "-", "-", "-", "-", line_len, line);
+	} else if (brief) {
+	    /* Nothing */
+	} else if (mode == SLAX_PROF_SAMPLE) {
+	    slaxOutput("%5s %8s %8s %8s%s %.*s",
+		       "-", "-", "-", "-", nomem, line_len, line);
+	} else if (mode == SLAX_PROF_COUNT) {
+	    slaxOutput("%5s %8s%s %.*s", "-", "-", nomem, line_len, line);
+	} else {
+	    slaxOutput("%5s %8s %8s %8s %8s %8s%s %.*s",
+		       "-", "-", "-", "-", "-", "-", nomem, line_len, line);
 	}
     }
 
-    slaxOutput("%5s %8lu %8lu %8s %8lu   %s", "Total", tot_count,
-	       tot_user, " ", tot_system, "Total");
+    if (memory)
+	snprintf(mem, sizeof(mem), " %8lu %10lu", tot_allocs, tot_bytes);
+
+    if (mode == SLAX_PROF_SAMPLE) {
+	slaxOutput("%5s %8lu %8lu %8s%s %s", "Total", tot_count,
+		   tot_samples, " ", mem, "Total");
+	slaxOutput("%5s %8s %8lu %7.2f%% %s", "Other", " ", spp->sp_other,
+		   tot_samples ? doublediv(spp->sp_other * 100, tot_samples)
+		   : 0.0, "(outside instructions)");
+	slaxOutput("Samples are taken every %u usecs of CPU time",
+		   SLAX_PROF_INTERVAL);
+    } else if (mode == SLAX_PROF_COUNT) {
+	slaxOutput("%5s %8lu%s %s", "Total", tot_count, mem, "Total");
+    } else if (memory) {
+	slaxOutput("%5s %8lu %8lu %8s %8lu %8s%s %s", "Total", tot_count,
+		   tot_user, " ", tot_system, " ", mem, "Total");
+    } else {
+	slaxOutput("%5s %8lu %8lu %8s %8lu   %s", "Total", tot_count,
+		   tot_user, " ", tot_system, "Total");
+    }
+
+    if (memory)
+	slaxOutput("Allocations outside instructions: %lu (%lu bytes)",
+		   spp->sp_other_allocs, spp->sp_other_bytes);
+
+    if (fp)
+	fclose(fp);
 
 }
 
@@ -284,6 +931,11 @@ slaxProfClear (void)
     slax_prof_t *spp = slax_profile;
 
     bzero(spp->sp_data, (spp->sp_lines + 1) * sizeof(spp->sp_data[0]));
+    spp->sp_other = 0;
+    spp->sp_other_allocs = spp->sp_other_bytes = 0;
+
+    /* Calls may be active, so we keep the nodes but zero their costs */
+    slaxProfCallClear(&slax_profile_root);
 }
 
 /**
@@ -294,7 +946,14 @@ slaxProfClose (void)
 {
     slax_prof_t *spp = slax_profile;
 
+    slaxProfSampleStop();
+    slax_profile = NULL;
     xmlFree(spp);
 
+    slaxProfCallFree(&slax_profile_root);
+    xmlFree(slax_profile_frames);
+    slax_profile_frames = NULL;
+    slax_profile_depth = slax_profile_max_depth = 0;
+
     slax_profile_time_user = slax_profile_time_system = 0; /* Not valid */
 }
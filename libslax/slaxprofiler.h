@@ -7,6 +7,45 @@
  * LICENSE.
  */
 
+/*
+ * Profiling modes.  Timing each instruction with getrusage() costs
+ * far more than most instructions do, so sampling and counting modes
+ * are available for profiling real workloads.
+ */
+#define SLAX_PROF_TIMER		0 /* Time each instruction (getrusage) */
+#define SLAX_PROF_SAMPLE	1 /* Sample the current instruction */
+#define SLAX_PROF_COUNT		2 /* Count hits only, with no clocks */
+
+/**
+ * Set the profiling mode
+ *
+ * @mode one of the SLAX_PROF_* values
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfSetMode (int mode);
+
+/**
+ * Return the current profiling mode
+ */
+int
+slaxProfGetMode (void);
+
+/**
+ * Turn accounting of memory allocations (per line) on or off
+ *
+ * @enable TRUE to turn it on
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfSetMemory (int enable);
+
+/**
+ * Is memory accounting turned on?
+ */
+int
+slaxProfGetMemory (void);
+
 /**
  * Called from the debugger when we want to profile a script.
  *
@@ -35,6 +74,46 @@ slaxProfExit (void);
 typedef int (*slaxProfCallback_t)(void *, const char *fmt, ...);
 #endif
 
+/**
+ * Called when the debugger pushes a stack frame (a template or
+ * function call), to build the call tree
+ *
+ * @name name of the template or function
+ * @def definition of the template or function
+ * @line line number of the caller
+ * @record TRUE if the time for this call should be recorded
+ * @nested TRUE if this frame is just part of the template or function
+ * named, and should be merged with its caller if that's the same
+ */
+void
+slaxProfCallEnter (const char *name, xmlNodePtr def, unsigned line,
+		   int record, int nested);
+
+/**
+ * Called when the debugger pops a stack frame
+ */
+void
+slaxProfCallExit (void);
+
+/**
+ * Write the call tree in callgrind format
+ *
+ * @filename file to write
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfCallgrind (const char *filename);
+
+/**
+ * Write the call tree as "folded" stacks (one "a;b;c usecs" line per
+ * call path), as used by flame graph tools
+ *
+ * @filename file to write
+ * @returns TRUE is there was a problem
+ */
+int
+slaxProfFolded (const char *filename);
+
 /**
  * Report the results
  */
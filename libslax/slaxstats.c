@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxstats.c -- runtime engine counters
+ *
+ * When a script regresses, the first question is usually "what is
+ * it doing more of?".  We count template entries, xpath steps, nodes
+ * made, extension function calls (per namespace), result tree
+ * fragments and mvar copies, and dump them as JSON.
+ *
+ * Function calls are counted by registering a wrapper in place of
+ * the real function (see slaxRegisterFunction in xmlsoft.h), so
+ * slaxStatsEnable() must be called before the extensions register
+ * their functions.  The wrapper finds the real function using the
+ * name and URI libxml2 sets in the xpath context for each call.
+ *
+ * Memory is counted the same way: we wrap libxml2's allocator (and
+ * psu's), so growth in allocations per transform shows up in the
+ * report.  For the counts to be complete, slaxStatsEnable() should
+ * be called before libxml2 is initialized.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+#include "slaxstats.h"
+
+#include <libxml/hash.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/xpathInternals.h>
+#include <libxslt/imports.h>
+#include <libpsu/psualloc.h>
+
+THREAD_LOCAL(slax_stats_t) slaxStats; /* Counters that are always kept */
+
+typedef struct slax_stats_ns_s {
+    struct slax_stats_ns_s *ssn_next; /* Next namespace (linked list) */
+    char *ssn_uri;		/* Namespace URI */
+    unsigned long ssn_calls;	/* Calls to functions in this namespace */
+} slax_stats_ns_t;
+
+typedef struct slax_stats_func_s {
+    xmlXPathFunction ssf_func;	/* Real function */
+    slax_stats_ns_t *ssf_nsp;	/* Namespace we're counted in */
+} slax_stats_func_t;
+
+static int slaxStatsEnabled;	/* slaxStatsEnable() was called */
+static xmlHashTablePtr slaxStatsFuncs; /* slax_stats_func_t by name+URI */
+static slax_stats_ns_t *slaxStatsNamespaces; /* Namespaces seen */
+static unsigned long slaxStatsNodes; /* Nodes made */
+static unsigned long slaxStatsTemplates; /* Templates entered */
+static unsigned long slaxStatsXpathOps; /* Xpath steps taken */
+static xmlRegisterNodeFunc slaxStatsOldRegister; /* Saved node callback */
+
+/* libxml2 allocations; workers share these, so they're atomic */
+static unsigned long slaxStatsXmlAllocs; /* Allocations (and strdups) */
+static unsigned long slaxStatsXmlBytes; /* Bytes asked for */
+static xmlFreeFunc slaxStatsOldFree;
+static xmlMallocFunc slaxStatsOldMalloc;
+static xmlReallocFunc slaxStatsOldRealloc;
+static xmlStrdupFunc slaxStatsOldStrdup;
+
+#define SLAX_STATS_MEM(_count, _bytes) \
+    do { \
+	__atomic_add_fetch(&slaxStatsXmlAllocs, (_count), __ATOMIC_RELAXED); \
+	__atomic_add_fetch(&slaxStatsXmlBytes, (_bytes), __ATOMIC_RELAXED); \
+    } while (0)
+
+static void *
+slaxStatsMalloc (size_t size)
+{
+    SLAX_STATS_MEM(1, size);
+    return slaxStatsOldMalloc(size);
+}
+
+static void *
+slaxStatsRealloc (void *ptr, size_t size)
+{
+    SLAX_STATS_MEM(ptr ? 0 : 1, size);
+    return slaxStatsOldRealloc(ptr, size);
+}
+
+static char *
+slaxStatsStrdup (const char *str)
+{
+    SLAX_STATS_MEM(1, str ? strlen(str) + 1 : 0);
+    return slaxStatsOldStrdup(str);
+}
+
+static void
+slaxStatsRegisterNode (xmlNodePtr node)
+{
+    slaxStatsNodes += 1;
+
+    if (slaxStatsOldRegister)
+	slaxStatsOldRegister(node);
+}
+
+/**
+ * Turn on the counters that cost something to collect
+ */
+void
+slaxStatsEnable (void)
+{
+    if (slaxStatsEnabled)
+	return;
+
+    slaxStatsFuncs = xmlHashCreate(256);
+    if (slaxStatsFuncs == NULL)
+	return;
+
+    slaxStatsOldRegister = xmlRegisterNodeDefault(slaxStatsRegisterNode);
+
+    /* Memory freed by the old functions is still freed by them */
+    if (xmlMemGet(&slaxStatsOldFree, &slaxStatsOldMalloc,
+		  &slaxStatsOldRealloc, &slaxStatsOldStrdup) == 0)
+	xmlMemSetup(slaxStatsOldFree, slaxStatsMalloc,
+		    slaxStatsRealloc, slaxStatsStrdup);
+    psu_alloc_count();
+
+    slaxStatsEnabled = TRUE;
+}
+
+/*
+ * Find (or make) the counter for a namespace
+ */
+static slax_stats_ns_t *
+slaxStatsFindNs (const char *uri)
+{
+    slax_stats_ns_t *ssnp;
+
+    for (ssnp = slaxStatsNamespaces; ssnp; ssnp = ssnp->ssn_next)
+	if (streq(ssnp->ssn_uri, uri))
+	    return ssnp;
+
+    ssnp = xmlMalloc(sizeof(*ssnp));
+    if (ssnp == NULL)
+	return NULL;
+
+    bzero(ssnp, sizeof(*ssnp));
+    ssnp->ssn_uri = xmlStrdup2(uri);
+    if (ssnp->ssn_uri == NULL) {
+	xmlFree(ssnp);
+	return NULL;
+    }
+
+    ssnp->ssn_next = slaxStatsNamespaces;
+    slaxStatsNamespaces = ssnp;
+
+    return ssnp;
+}
+
+/*
+ * The function we register in place of the real one
+ */
+static void
+slaxStatsFunction (xmlXPathParserContextPtr ctxt, int nargs)
+{
+    slax_stats_func_t *ssfp;
+
+    ssfp = xmlHashLookup2(slaxStatsFuncs, ctxt->context->function,
+			  ctxt->context->functionURI);
+    if (ssfp == NULL) {
+	xmlXPathSetError(ctxt, XPATH_UNKNOWN_FUNC_ERROR);
+	return;
+    }
+
+    ssfp->ssf_nsp->ssn_calls += 1;
+    ssfp->ssf_func(ctxt, nargs);
+}
+
+/**
+ * Return the function to register for (uri, name).  If the counters
+ * aren't on, this is the function itself; otherwise we record it and
+ * return our wrapper.
+ *
+ * @param uri Namespace URI of the function
+ * @param name Name of the function
+ * @param func Function
+ * @return function to register
+ */
+xmlXPathFunction
+slaxStatsWrapFunction (const char *uri, const char *name,
+		       xmlXPathFunction func)
+{
+    slax_stats_func_t *ssfp;
+
+    if (!slaxStatsEnabled || func == NULL)
+	return func;
+
+    ssfp = xmlHashLookup2(slaxStatsFuncs, (const xmlChar *) name,
+			  (const xmlChar *) uri);
+    if (ssfp == NULL) {
+	ssfp = xmlMalloc(sizeof(*ssfp));
+	if (ssfp == NULL)
+	    return func;
+
+	ssfp->ssf_nsp = slaxStatsFindNs(uri ?: "");
+	if (ssfp->ssf_nsp == NULL
+	    || xmlHashAddEntry2(slaxStatsFuncs, (const xmlChar *) name,
+				(const xmlChar *) uri, ssfp) < 0) {
+	    xmlFree(ssfp);
+	    return func;
+	}
+    }
+
+    ssfp->ssf_func = func;	/* Re-registering replaces the function */
+    return slaxStatsFunction;
+}
+
+/**
+ * Get ready to count a transform.  libxslt only counts template
+ * calls when profiling, and libxml2 only counts xpath steps when
+ * there's a limit on them, so we ask for both.
+ *
+ * @param ctxt Transform context (before the transform is run)
+ */
+void
+slaxStatsStart (xsltTransformContextPtr ctxt)
+{
+    if (!slaxStatsEnabled || ctxt == NULL)
+	return;
+
+    ctxt->profile = 1;
+    if (ctxt->xpathCtxt) {
+	ctxt->xpathCtxt->opLimit = (unsigned long) -1;
+	ctxt->xpathCtxt->opCount = 0;
+    }
+}
+
+/**
+ * Collect the numbers from a transform that's been run
+ *
+ * @param ctxt Transform context (after the transform is run)
+ */
+void
+slaxStatsFinish (xsltTransformContextPtr ctxt)
+{
+    xsltStylesheetPtr style;
+    xsltTemplatePtr templ;
+
+    if (!slaxStatsEnabled || ctxt == NULL)
+	return;
+
+    if (ctxt->xpathCtxt)
+	slaxStatsXpathOps += ctxt->xpathCtxt->opCount;
+
+    for (style = ctxt->style; style; style = xsltNextImport(style))
+	for (templ = style->templates; templ; templ = templ->next)
+	    slaxStatsTemplates += templ->nbCalls;
+}
+
+/*
+ * Write a string as JSON, with the needed escapes
+ */
+static void
+slaxStatsDumpString (FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for ( ; *str; str++) {
+	if (*str == '"' || *str == '\\')
+	    fprintf(fp, "\\%c", *str);
+	else if ((unsigned char) *str < 0x20)
+	    fprintf(fp, "\\u%04x", (unsigned char) *str);
+	else
+	    fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/**
+ * Dump the counters as JSON
+ *
+ * @param fp File to write to
+ */
+void
+slaxStatsDump (FILE *fp)
+{
+    slax_stats_ns_t *ssnp;
+    const char *sep = "";
+
+    fprintf(fp, "{\n");
+    if (slaxStatsEnabled) {
+	fprintf(fp, "    \"templates\": %lu,\n", slaxStatsTemplates);
+	fprintf(fp, "    \"xpath-steps\": %lu,\n", slaxStatsXpathOps);
+	fprintf(fp, "    \"nodes\": %lu,\n", slaxStatsNodes);
+
+	psu_alloc_stats_t pas;
+	psu_alloc_stats(&pas);
+
+	fprintf(fp, "    \"xml-allocs\": %lu,\n",
+		__atomic_load_n(&slaxStatsXmlAllocs, __ATOMIC_RELAXED));
+	fprintf(fp, "    \"xml-bytes\": %lu,\n",
+		__atomic_load_n(&slaxStatsXmlBytes, __ATOMIC_RELAXED));
+	fprintf(fp, "    \"psu-allocs\": %llu,\n",
+		(unsigned long long) pas.pas_allocs);
+	fprintf(fp, "    \"psu-bytes\": %llu,\n",
+		(unsigned long long) pas.pas_bytes);
+    }
+    fprintf(fp, "    \"rtfs\": %lu,\n", slaxStats.ss_rtfs);
+    fprintf(fp, "    \"mvar-copies\": %lu", slaxStats.ss_mvar_copies);
+
+    if (slaxStatsEnabled) {
+	fprintf(fp, ",\n    \"function-calls\": {");
+	for (ssnp = slaxStatsNamespaces; ssnp; ssnp = ssnp->ssn_next) {
+	    if (ssnp->ssn_calls == 0)
+		continue;
+
+	    fprintf(fp, "%s\n        ", sep);
+	    slaxStatsDumpString(fp, ssnp->ssn_uri);
+	    fprintf(fp, ": %lu", ssnp->ssn_calls);
+	    sep = ",";
+	}
+	fprintf(fp, "%s}", *sep ? "\n    " : "");
+    }
+
+    fprintf(fp, "\n}\n");
+}
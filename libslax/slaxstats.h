@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxstats.h -- runtime engine counters
+ */
+
+#ifndef LIBSLAX_SLAXSTATS_H
+#define LIBSLAX_SLAXSTATS_H
+
+#include <libpsu/psuthread.h>
+
+/*
+ * Counters that are always kept.  They're bumped in places that do
+ * far more work than an increment, so there's no reason to turn
+ * them off.  The rest of the numbers in the report (templates,
+ * xpath steps, nodes, function calls) cost something to gather and
+ * are only collected after slaxStatsEnable().
+ */
+typedef struct slax_stats_s {
+    unsigned long ss_rtfs;	/* Result tree fragments made by libslax */
+    unsigned long ss_mvar_copies; /* Nodes copied into mutable variables */
+} slax_stats_t;
+
+extern THREAD_LOCAL(slax_stats_t) slaxStats; /* Per-thread */
+
+#define SLAX_STATS_INC(_field) (slaxStats._field += 1)
+
+#endif /* LIBSLAX_SLAXSTATS_H */
@@ -98,6 +98,46 @@ slaxUtfWord (const char *cp, int width)
     return val;
 }
 
+static void *
+slaxXmlAllocatorRealloc (psu_allocator_t *pap UNUSED, void *ptr, size_t size)
+{
+    return xmlRealloc(ptr, size);
+}
+
+static void
+slaxXmlAllocatorFree (psu_allocator_t *pap UNUSED, void *ptr)
+{
+    xmlFree(ptr);
+}
+
+static psu_allocator_t slax_xml_allocator = {
+    .pal_realloc = slaxXmlAllocatorRealloc,
+    .pal_free = slaxXmlAllocatorFree,
+};
+
+psu_allocator_t *
+slaxXmlAllocator (void)
+{
+    return &slax_xml_allocator;
+}
+
+/**
+ * Allocate a token from the parse's arena, which is set up on first
+ * use since slax_data_t's are simply zeroed
+ *
+ * @param sdp main slax data structure
+ * @param size number of bytes needed
+ * @return pointer to the memory, or NULL if xmlMalloc fails
+ */
+static void *
+slaxStringArenaAlloc (slax_data_t *sdp, size_t size)
+{
+    if (sdp->sd_arena.pb_parent == NULL)
+	psu_bump_init(&sdp->sd_arena, &slax_xml_allocator, SLAX_ARENA_BLOCK);
+
+    return psu_bump_alloc(&sdp->sd_arena, size);
+}
+
 /**
  * Create a string.  Slax strings allow sections of strings (typically
  * tokens returned by the lexer) to be chained together to built
@@ -113,10 +153,8 @@ slaxUtfWord (const char *cp, int width)
 slax_string_t *
 slaxStringCreate (slax_data_t *sdp, int ttype)
 {
-    int len, i, width;
-    char *cp;
+    int len;
     const char *start;
-    slax_string_t *ssp;
 
     if (ttype == L_EOS)		/* Don't bother for ";" */
 	return NULL;
@@ -129,7 +167,32 @@ slaxStringCreate (slax_data_t *sdp, int ttype)
 	start += 1;
     }
 
-    ssp = xmlMalloc(sizeof(*ssp) + len + 1);
+    return slaxStringMake(sdp, ttype, start, len);
+}
+
+/**
+ * Create a string for a token found somewhere other than between
+ * sd_start and sd_cur.  Quoted strings (T_QUOTED) are passed without
+ * their quotes, and have their escapes expanded.
+ *
+ * @param sdp main slax data structure
+ * @param ttype token type for the string to be created
+ * @param start start of the token
+ * @param len length of the token
+ * @return newly allocated string structure
+ */
+slax_string_t *
+slaxStringMake (slax_data_t *sdp, int ttype, const char *start, int len)
+{
+    int i, width;
+    char *cp;
+    slax_string_t *ssp;
+
+    if (sdp->sd_flags & SDF_ARENA)
+	ssp = slaxStringArenaAlloc(sdp, sizeof(*ssp) + len + 1);
+    else
+	ssp = xmlMalloc(sizeof(*ssp) + len + 1);
+
     if (ssp) {
 	ssp->ss_token[len] = 0;
 	ssp->ss_ttype = ttype;
@@ -230,6 +293,8 @@ slaxStringCreate (slax_data_t *sdp, int ttype)
 	}
 
 	ssp->ss_flags = slaxStringQFlags(ssp);
+	if (sdp->sd_flags & SDF_ARENA)
+	    ssp->ss_flags |= SSF_ARENA;
     }
 
     return ssp;
@@ -901,11 +966,11 @@ slaxTernaryRewrite (slax_data_t *sdp UNUSED, slax_string_t *scond,
 		    slax_string_t *qsp, slax_string_t *strue,
 		    slax_string_t *csp, slax_string_t *sfalse)
 {
-    static unsigned varnumber;
     static char varfmt[] = SLAX_TERNARY_VAR_FORMAT;
     char varname[sizeof(varfmt) + SLAX_TERNARY_VAR_FORMAT_WIDTH];
 
-    snprintf(varname, sizeof(varname), varfmt, ++varnumber);
+    snprintf(varname, sizeof(varname), varfmt,
+	     ++slaxNameCounters[SNC_TERNARY]);
 
     slaxLog("slaxTernaryRewrite: %s/%s/%s", scond ? scond->ss_token : "",
 	    strue ? strue->ss_token : "", sfalse ? sfalse->ss_token : "");
@@ -964,6 +1029,9 @@ slaxStringFree (slax_string_t *ssp)
 	next = ssp->ss_next;
 	ssp->ss_next = NULL;
 
+	if (ssp->ss_flags & SSF_ARENA)
+	    continue;		/* Freed with the arena */
+
 	ssp->ss_ttype = 0;
 	ssp->ss_flags = 0;
 	xmlFree(ssp);
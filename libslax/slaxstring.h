@@ -34,9 +34,25 @@ struct slax_string_s {
 #define SSF_ESCAPE	(1<<7)	/* String uses escape ('\\') */
 
 #define SSF_XPATH	(1<<8)	/* Need an XPath expression */
+#define SSF_ARENA	(1<<9)	/* Allocated from sd_arena */
 
 #define SSF_QUOTE_MASK	(SSF_SINGLEQ | SSF_DOUBLEQ | SSF_BOTHQS)
 
+/*
+ * Token strings made while parsing are carved out of a bump arena
+ * (sd_arena) and freed together when the parse is done
+ * (slaxDataCleanup), rather than one by one.  slaxStringFree() leaves
+ * arena strings (SSF_ARENA) alone.
+ */
+#define SLAX_ARENA_BLOCK	(64 * 1024) /* Size of an arena block */
+
+/*
+ * Return an allocator object that uses xmlMalloc and friends, so
+ * memory taken through it shows up wherever libxml2's allocations do
+ */
+psu_allocator_t *
+slaxXmlAllocator (void);
+
 /* SLAX UTF-8 character conversions */
 #define SLAX_UTF_WIDTH4	4	/* '\u+xxxx' */
 #define SLAX_UTF_WIDTH6	6	/* '\u-xxxxxx' */
@@ -74,6 +90,14 @@ slaxStringFuse (slax_string_t *);
 slax_string_t *
 slaxStringCreate (struct slax_data_s *sdp, int token);
 
+/*
+ * Create a string from the given token text, rather than from the
+ * lexer's current token.
+ */
+slax_string_t *
+slaxStringMake (struct slax_data_s *sdp, int token,
+		const char *start, int len);
+
 /*
  * Build a single string out of the string segments hung off "start".
  */
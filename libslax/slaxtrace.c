@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxtrace.c -- binary trace ring
+ *
+ * Formatting each trace record as it's made (time stamp, printf,
+ * XML serialization, fflush) costs enough that tracing gets turned
+ * off, and then it's not there when it's needed.  The trace ring
+ * keeps the raw values instead: a time stamp, the file and line of
+ * the instruction and a copy of the value, in fixed-size records in
+ * a per-thread ring.  Nothing is formatted until the ring is dumped,
+ * on request (slaxTraceRingDump), which slaxproc does on SIGUSR1,
+ * when a script fails, or at exit when a trace file is given.
+ *
+ * Values that don't fit in a record are truncated.  Nodes are
+ * recorded by type and name, since the node itself may be long gone
+ * by the time we're dumped.
+ *
+ * Dumping uses only snprintf and write, so it can be done from a
+ * signal handler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "slaxinternals.h"
+#include <libslax/slax.h>
+#include <libpsu/psuthread.h>
+#include "slaxtrace.h"
+
+#define STE_DATA	96	/* Bytes of value kept per record */
+#define STR_FILES	32	/* Number of file names we remember */
+#define STR_NOFILE	0xff	/* ste_file when we don't know the file */
+
+/* Values for ste_type */
+#define STE_STRING	1	/* String value (in ste_data) */
+#define STE_NUMBER	2	/* Number (in ste_number) */
+#define STE_NODE	3	/* Node (name in ste_data) */
+
+typedef struct slax_trace_entry_s {
+    struct timeval ste_time;	/* When the record was made */
+    uint32_t ste_line;		/* Line number of the instruction */
+    uint32_t ste_len;		/* Length of the value (untruncated) */
+    uint8_t ste_file;		/* Index into str_files (or STR_NOFILE) */
+    uint8_t ste_type;		/* Type of the value (STE_*) */
+    uint16_t ste_node_type;	/* For STE_NODE: the xmlElementType */
+    union {
+	double ste_number;	/* STE_NUMBER: value */
+	char ste_data[STE_DATA]; /* STE_STRING, STE_NODE: value */
+    };
+} slax_trace_entry_t;
+
+typedef struct slax_trace_ring_s {
+    unsigned long str_next;	/* Number of records made (ever) */
+    unsigned long str_mask;	/* Number of records in the ring, less one */
+    long str_gmtoff;		/* Offset from UTC when we started */
+    const xmlChar *str_last_url; /* Last document URL seen */
+    unsigned str_last_file;	/* Index for str_last_url */
+    unsigned str_nfiles;	/* Number of names in str_files */
+    char *str_files[STR_FILES];	/* File names */
+    slax_trace_entry_t str_entries[]; /* The ring itself */
+} slax_trace_ring_t;
+
+static THREAD_LOCAL(slax_trace_ring_t *) slaxTraceRing;
+
+int
+slaxTraceRingEnabled (void)
+{
+    return (slaxTraceRing != NULL);
+}
+
+static void
+slaxTraceRingFree (slax_trace_ring_t *strp)
+{
+    unsigned i;
+
+    for (i = 0; i < strp->str_nfiles; i++)
+	free(strp->str_files[i]);
+    free(strp);
+}
+
+/**
+ * Turn on the trace ring for this thread, with room for the given
+ * number of records (rounded up to a power of two).  Zero turns the
+ * ring off.
+ *
+ * @param entries number of records to keep
+ * @return zero on success, non-zero on failure (no memory)
+ */
+int
+slaxTraceRingEnable (unsigned entries)
+{
+    slax_trace_ring_t *strp;
+    unsigned long size;
+    struct tm tm;
+    time_t now;
+
+    if (slaxTraceRing) {
+	slaxTraceRingFree(slaxTraceRing);
+	slaxTraceRing = NULL;
+    }
+
+    if (entries == 0)
+	return 0;
+
+    for (size = 1; size < entries; size <<= 1)
+	continue;
+
+    strp = calloc(1, sizeof(*strp) + size * sizeof(strp->str_entries[0]));
+    if (strp == NULL)
+	return -1;
+
+    strp->str_mask = size - 1;
+    strp->str_last_file = STR_NOFILE;
+
+    /* Save this now, so we don't need localtime() when dumping */
+    now = time(NULL);
+    if (localtime_r(&now, &tm))
+	strp->str_gmtoff = tm.tm_gmtoff;
+
+    slaxTraceRing = strp;
+    return 0;
+}
+
+/*
+ * Find the index of the file containing this instruction.  Scripts
+ * only have a few files, and consecutive records are normally from
+ * the same one, so we check the last one first.
+ */
+static unsigned
+slaxTraceRingFile (slax_trace_ring_t *strp, xmlNodePtr inst)
+{
+    const xmlChar *url;
+    unsigned i;
+
+    if (inst == NULL || inst->doc == NULL || inst->doc->URL == NULL)
+	return STR_NOFILE;
+
+    url = inst->doc->URL;
+    if (url == strp->str_last_url)
+	return strp->str_last_file;
+
+    for (i = 0; i < strp->str_nfiles; i++)
+	if (streq(strp->str_files[i], (const char *) url))
+	    break;
+
+    if (i == strp->str_nfiles) {
+	if (i == STR_FILES)
+	    return STR_NOFILE;
+
+	strp->str_files[i] = strdup((const char *) url);
+	if (strp->str_files[i] == NULL)
+	    return STR_NOFILE;
+	strp->str_nfiles += 1;
+    }
+
+    strp->str_last_url = url;
+    strp->str_last_file = i;
+
+    return i;
+}
+
+static slax_trace_entry_t *
+slaxTraceRingNext (xmlNodePtr inst, unsigned type)
+{
+    slax_trace_ring_t *strp = slaxTraceRing;
+    slax_trace_entry_t *step;
+
+    step = &strp->str_entries[strp->str_next & strp->str_mask];
+
+    gettimeofday(&step->ste_time, NULL);
+    step->ste_line = inst ? xmlGetLineNo(inst) : 0;
+    step->ste_file = slaxTraceRingFile(strp, inst);
+    step->ste_type = type;
+    step->ste_node_type = 0;
+    step->ste_len = 0;
+
+    strp->str_next += 1;
+
+    return step;
+}
+
+static void
+slaxTraceRingCopy (slax_trace_entry_t *step, const char *str)
+{
+    size_t len = str ? strlen(str) : 0;
+
+    step->ste_len = len;
+    if (len > sizeof(step->ste_data))
+	len = sizeof(step->ste_data);
+    memcpy(step->ste_data, str, len);
+}
+
+void
+slaxTraceRingString (xmlNodePtr inst, const char *str)
+{
+    if (slaxTraceRing)
+	slaxTraceRingCopy(slaxTraceRingNext(inst, STE_STRING), str);
+}
+
+void
+slaxTraceRingNumber (xmlNodePtr inst, double value)
+{
+    if (slaxTraceRing)
+	slaxTraceRingNext(inst, STE_NUMBER)->ste_number = value;
+}
+
+void
+slaxTraceRingNode (xmlNodePtr inst, xmlNodePtr nodep)
+{
+    slax_trace_entry_t *step;
+
+    if (slaxTraceRing == NULL || nodep == NULL)
+	return;
+
+    step = slaxTraceRingNext(inst, STE_NODE);
+    step->ste_node_type = nodep->type;
+
+    /* Text is more useful than its name ("text") */
+    if (nodep->type == XML_TEXT_NODE || nodep->type == XML_CDATA_SECTION_NODE)
+	slaxTraceRingCopy(step, (const char *) nodep->content);
+    else
+	slaxTraceRingCopy(step, (const char *) nodep->name);
+}
+
+static void
+slaxTraceRingWrite (int fd, const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = write(fd, buf, len);
+	if (rc <= 0)
+	    return;
+	buf += rc;
+	len -= rc;
+    }
+}
+
+/**
+ * Write the contents of the trace ring, oldest record first
+ *
+ * @param fd file descriptor to write to
+ */
+void
+slaxTraceRingDump (int fd)
+{
+    slax_trace_ring_t *strp = slaxTraceRing;
+    slax_trace_entry_t *step;
+    unsigned long i, first, size;
+    char buf[BUFSIZ];
+    const char *file;
+    long secs;
+    int len;
+
+    if (strp == NULL)
+	return;
+
+    size = strp->str_mask + 1;
+    first = (strp->str_next > size) ? strp->str_next - size : 0;
+
+    len = snprintf(buf, sizeof(buf), "trace ring: %lu records (%lu lost)\n",
+		   strp->str_next - first, first);
+    slaxTraceRingWrite(fd, buf, len);
+
+    for (i = first; i < strp->str_next; i++) {
+	step = &strp->str_entries[i & strp->str_mask];
+
+	secs = (long) step->ste_time.tv_sec + strp->str_gmtoff;
+	file = (step->ste_file < strp->str_nfiles)
+	    ? strp->str_files[step->ste_file] : "-";
+
+	len = snprintf(buf, sizeof(buf), "%02ld:%02ld:%02ld.%06ld: %s:%u: ",
+		       (secs / 3600) % 24, (secs / 60) % 60, secs % 60,
+		       (long) step->ste_time.tv_usec, file, step->ste_line);
+	if (len < 0 || (size_t) len >= sizeof(buf))
+	    len = sizeof(buf) - 1;
+
+	switch (step->ste_type) {
+	case STE_NUMBER:
+	    len += snprintf(buf + len, sizeof(buf) - len, "%f",
+			    step->ste_number);
+	    break;
+
+	case STE_NODE:
+	    len += snprintf(buf + len, sizeof(buf) - len,
+			    "XML Content (%u) ", step->ste_node_type);
+	    /* FALLTHROUGH */
+
+	case STE_STRING:
+	    /* The value may be truncated, so use the record length */
+	    len += snprintf(buf + len, sizeof(buf) - len, "%.*s%s",
+		    (int) ((step->ste_len > sizeof(step->ste_data))
+			   ? sizeof(step->ste_data) : step->ste_len),
+		    step->ste_data,
+		    (step->ste_len > sizeof(step->ste_data)) ? "..." : "");
+	    break;
+	}
+
+	if ((size_t) len >= sizeof(buf) - 1)
+	    len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+
+	slaxTraceRingWrite(fd, buf, len);
+    }
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * slaxtrace.h -- binary trace ring
+ */
+
+#ifndef LIBSLAX_SLAXTRACE_H
+#define LIBSLAX_SLAXTRACE_H
+
+/**
+ * Is the trace ring turned on (for this thread)?
+ */
+int
+slaxTraceRingEnabled (void);
+
+/*
+ * Record trace values in the ring.  "inst" is the instruction that
+ * made the value (or NULL); only its file and line are kept.
+ */
+void
+slaxTraceRingString (xmlNodePtr inst, const char *str);
+
+void
+slaxTraceRingNumber (xmlNodePtr inst, double value);
+
+void
+slaxTraceRingNode (xmlNodePtr inst, xmlNodePtr nodep);
+
+#endif /* LIBSLAX_SLAXTRACE_H */
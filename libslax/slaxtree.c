@@ -452,7 +452,7 @@ slaxAttribAdd (slax_data_t *sdp, int style,
     if (attr == NULL)
 	fprintf(stderr, "could not make attribute: @%s=%s\n", name, buf);
 
-    free(buf);
+    xmlFree(buf);
 }
 
 /*
@@ -1050,8 +1050,8 @@ slaxMoveImport (slax_data_t *sdp UNUSED, xmlNodePtr curp)
 }
 
 xmlXPathObjectPtr
-slaxXpathEval (xmlNodePtr node, xmlNodePtr inst, xmlXPathContextPtr xpctxt,
-	       xsltStylesheetPtr script, const char *expr)
+slaxXpathEvalCompiled (xmlNodePtr node, xmlNsPtr *nsList, int nscount,
+		       xmlXPathContextPtr xpctxt, xmlXPathCompExprPtr comp)
 {
     struct {
 	xmlDocPtr o_doc;
@@ -1062,28 +1062,8 @@ slaxXpathEval (xmlNodePtr node, xmlNodePtr inst, xmlXPathContextPtr xpctxt,
 	int o_nscount;
     } old;
 
-    xmlNsPtr *nsList;
-    int nscount;
-    xmlXPathCompExprPtr comp;
     xmlXPathObjectPtr res;
 
-    char *sexpr = NULL;
-
-    
-    sexpr = slaxSlaxToXpath("select", 1, (const char *) expr, NULL);
-    if (sexpr)
-	expr = sexpr;
-
-    comp = xsltXPathCompile(script, (const xmlChar *) expr);
-    if (comp == NULL) {
-	xmlFreeAndEasy(sexpr);
-	return NULL;
-    }
-
-    nsList = xmlGetNsList(inst->doc, inst);
-    for (nscount = 0; nsList && nsList[nscount]; nscount++)
-	continue;
-    
     /* Save old values */
     old.o_doc = xpctxt->doc;
     old.o_node = xpctxt->node;
@@ -1108,7 +1088,44 @@ slaxXpathEval (xmlNodePtr node, xmlNodePtr inst, xmlXPathContextPtr xpctxt,
     xpctxt->nsNr = old.o_nscount;
     xpctxt->namespaces = old.o_nslist;
 
+    return res;
+}
+
+xmlXPathCompExprPtr
+slaxXpathCompile (xsltStylesheetPtr script, const char *expr)
+{
+    xmlXPathCompExprPtr comp;
+    char *sexpr = NULL;
+
+    sexpr = slaxSlaxToXpath("select", 1, (const char *) expr, NULL);
+    if (sexpr)
+	expr = sexpr;
+
+    comp = xsltXPathCompile(script, (const xmlChar *) expr);
+
     xmlFreeAndEasy(sexpr);
+    return comp;
+}
+
+xmlXPathObjectPtr
+slaxXpathEval (xmlNodePtr node, xmlNodePtr inst, xmlXPathContextPtr xpctxt,
+	       xsltStylesheetPtr script, const char *expr)
+{
+    xmlNsPtr *nsList;
+    int nscount;
+    xmlXPathCompExprPtr comp;
+    xmlXPathObjectPtr res;
+
+    comp = slaxXpathCompile(script, expr);
+    if (comp == NULL)
+	return NULL;
+
+    nsList = xmlGetNsList(inst->doc, inst);
+    for (nscount = 0; nsList && nsList[nscount]; nscount++)
+	continue;
+
+    res = slaxXpathEvalCompiled(node, nsList, nscount, xpctxt, comp);
+
     xmlXPathFreeCompExpr(comp);
     xmlFree(nsList);
 
@@ -228,5 +228,19 @@ xmlXPathObjectPtr
 slaxXpathEval (xmlNodePtr node, xmlNodePtr inst, xmlXPathContextPtr xpctxt,
 	       xsltStylesheetPtr script, const char *expr);
 
+/*
+ * Compile a SLAX expression, for use with slaxXpathEvalCompiled
+ */
+xmlXPathCompExprPtr
+slaxXpathCompile (xsltStylesheetPtr script, const char *expr);
+
+/*
+ * Evaluate a compiled expression, using the given context node and
+ * namespaces
+ */
+xmlXPathObjectPtr
+slaxXpathEvalCompiled (xmlNodePtr node, xmlNsPtr *nsList, int nscount,
+		       xmlXPathContextPtr xpctxt, xmlXPathCompExprPtr comp);
+
 xmlNodeSetPtr
 slaxXpathSelect (xmlDocPtr docp, xmlNodePtr nodep, const char *expr);
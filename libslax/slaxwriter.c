@@ -18,10 +18,14 @@
 #include "slaxinternals.h"
 #include <libslax/slax.h>
 #include <libexslt/exslt.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <libpsu/psuzio.h>
+#include <libpsu/psustring.h>
 #include "slaxparser.h"
 #include "jsonlexer.h"
 
-#define BUF_EXTEND 2048		/* Bump the buffer by this amount */
+#define SLAX_WRITE_BUFSIZ (64 * 1024) /* Gathered output (SWF_FD) */
 
 struct slax_writer_s {
     const char *sw_filename;	/* Filename being parsed */
@@ -29,18 +33,20 @@ struct slax_writer_s {
     void *sw_data;		/* Client data */
     int sw_indent;		/* Indentation count */
     int sw_indent_extra;	/* Extra special indentation */
-    char *sw_buf;		/* Output buffer */
-    int sw_cur;			/* Current index in output buffer */
-    int sw_bufsiz;		/* Size of the buffer in sw_buf[] */
+    psu_strbuf_t sw_line;	/* The line we're building */
     int sw_errors;		/* Errors reading or writing data */
     int sw_vers;		/* Target SLAX version number times 10 */
     unsigned sw_flags;		/* Flags for this instance (SWF_*) */
+    int sw_fd;			/* Output descriptor (SWF_FD) */
+    char *sw_obuf;		/* Gathered output lines (SWF_FD) */
+    int sw_olen;		/* Bytes used in sw_obuf */
 };
 
 /* Flags for sw_flags */
 #define SWF_BLANKLINE	(1<<0)	/* Just wrote a blank line */
 #define SWF_FORLOOP	(1<<1)	/* Just wrote a "for" loop */
 #define SWF_LINENO	(1<<2)	/* Show line numbers */
+#define SWF_FD		(1<<3)	/* Write to sw_fd, not sw_write */
 
 /* Values for sw_vers */
 #define SWF_VERS_10	10	/* Version 1.0 features only */
@@ -84,28 +90,136 @@ slaxSetIndent (int indent)
     slaxIndent = indent;
 }
 
+int
+slaxGetIndent (void)
+{
+    return slaxIndent;
+}
+
 void
 slaxSetSpacesAroundAttributeEquals (int spaces)
 {
     slaxSpacesAroundAttributeEquals = spaces ? " " : "";
 }
 
+/*
+ * Write a vector to the descriptor, coping with short writes
+ */
+static int
+slaxWriteVec (int fd, struct iovec *iovp, int cnt)
+{
+    ssize_t rc;
+
+    while (cnt > 0) {
+	rc = psu_zio_writev(fd, iovp, cnt);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	while (cnt > 0 && (size_t) rc >= iovp->iov_len) {
+	    rc -= iovp->iov_len;
+	    iovp += 1;
+	    cnt -= 1;
+	}
+
+	if (cnt > 0) {
+	    iovp->iov_base = (char *) iovp->iov_base + rc;
+	    iovp->iov_len -= rc;
+	}
+    }
+
+    return 0;
+}
+
+static int
+slaxWriteFlushFd (slax_writer_t *swp)
+{
+    struct iovec iov;
+    int rc = 0;
+
+    if (swp->sw_olen > 0) {
+	iov.iov_base = swp->sw_obuf;
+	iov.iov_len = swp->sw_olen;
+	rc = slaxWriteVec(swp->sw_fd, &iov, 1);
+	swp->sw_olen = 0;
+    }
+
+    return rc;
+}
+
+/*
+ * Gather an indented line into sw_obuf.  A line too big to gather
+ * goes out in the same writev() as the lines before it.
+ */
+static int
+slaxWriteFdLine (slax_writer_t *swp, int indent, const char *line, int len)
+{
+    struct iovec iov[3];
+    int room;
+
+    if (swp->sw_obuf == NULL) {
+	swp->sw_obuf = xmlMalloc(SLAX_WRITE_BUFSIZ);
+	if (swp->sw_obuf == NULL)
+	    return -1;
+    }
+
+    while (indent > 0) {
+	room = SLAX_WRITE_BUFSIZ - swp->sw_olen;
+	if (room == 0) {
+	    if (slaxWriteFlushFd(swp) < 0)
+		return -1;
+	    continue;
+	}
+
+	if (room > indent)
+	    room = indent;
+	memset(swp->sw_obuf + swp->sw_olen, ' ', room);
+	swp->sw_olen += room;
+	indent -= room;
+    }
+
+    if (swp->sw_olen + len + 1 <= SLAX_WRITE_BUFSIZ) {
+	memcpy(swp->sw_obuf + swp->sw_olen, line, len);
+	swp->sw_olen += len;
+	swp->sw_obuf[swp->sw_olen++] = '\n';
+	return 0;
+    }
+
+    iov[0].iov_base = swp->sw_obuf;
+    iov[0].iov_len = swp->sw_olen;
+    iov[1].iov_base = (char *) line;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (char *) "\n";
+    iov[2].iov_len = 1;
+    swp->sw_olen = 0;
+
+    return slaxWriteVec(swp->sw_fd, iov, 3);
+}
+
 int
 slaxWriteNewline (slax_writer_t *swp, int change)
 {
     int rc;
 
-    if (swp->sw_buf == NULL)
+    if (swp->sw_line.psb_buf == NULL)
 	return 0;
 
-    if (swp->sw_cur == 0)
+    if (psu_strbuf_len(&swp->sw_line) == 0)
 	swp->sw_flags |= SWF_BLANKLINE;
     else swp->sw_flags &= ~SWF_BLANKLINE;
 
     if (change < 0)
 	swp->sw_indent += change;
-    rc = (*swp->sw_write)(swp->sw_data, "%*s%s\n",
-			  swp->sw_indent * slaxIndent, "", swp->sw_buf);
+    if (swp->sw_flags & SWF_FD)
+	rc = slaxWriteFdLine(swp, swp->sw_indent * slaxIndent,
+			     swp->sw_line.psb_buf,
+			     psu_strbuf_len(&swp->sw_line));
+    else
+	rc = (*swp->sw_write)(swp->sw_data, "%*s%s\n",
+			      swp->sw_indent * slaxIndent, "",
+			      swp->sw_line.psb_buf);
     if (rc < 0)
 	swp->sw_errors += 1;
 
@@ -118,8 +232,7 @@ slaxWriteNewline (slax_writer_t *swp, int change)
 	swp->sw_flags |= SWF_BLANKLINE; /* Indenting counts as a blank line */
     }
 
-    swp->sw_cur = 0;
-    swp->sw_buf[0] = '\0';
+    psu_strbuf_reset(&swp->sw_line);
     return rc;
 }
 
@@ -132,27 +245,6 @@ slaxWriteBlankline (slax_writer_t *swp)
     return slaxWriteNewline(swp, 0);
 }
 
-static char *
-slaxWriteRealloc (slax_writer_t *swp, int need)
-{
-    char *cp;
-
-    /* Make sure we're making enough room for the future */
-    if (need < 2 * swp->sw_bufsiz)
-	need = 2 * swp->sw_bufsiz;
-
-    cp = xmlRealloc(swp->sw_buf, need);
-    if (cp == NULL) {
-	slaxLog("memory allocation failure");
-	swp->sw_errors += 1;
-	return NULL;
-    }
-    
-    swp->sw_buf = cp;
-    swp->sw_bufsiz = need;
-    return cp;
-}
-
 static int
 slaxIsXsl (xmlNodePtr nodep)
 {
@@ -165,28 +257,16 @@ slaxIsXsl (xmlNodePtr nodep)
 void
 slaxWrite (slax_writer_t *swp, const char *fmt, ...)
 {
-    int rc = 0, len;
-    char *cp;
     va_list vap;
+    int rc;
 
-    for (;;) {
-	if (swp->sw_bufsiz != 0) {
-	    len = swp->sw_bufsiz - swp->sw_cur;
-	    cp = swp->sw_buf + swp->sw_cur;
-
-	    va_start(vap, fmt);
-	    rc = vsnprintf(cp, len, fmt, vap);
-	    va_end(vap);
-
-	    if (rc <= len) {
-		swp->sw_cur += rc;
-		break;
-	    }
-	}
+    va_start(vap, fmt);
+    rc = psu_strbuf_vprintf(&swp->sw_line, fmt, vap);
+    va_end(vap);
 
-	len = swp->sw_cur + rc + BUF_EXTEND;
-	if (slaxWriteRealloc(swp, len) == NULL)
-	    return;
+    if (rc < 0) {
+	slaxLog("memory allocation failure");
+	swp->sw_errors += 1;
     }
 }
 
@@ -332,11 +412,14 @@ slaxIsDisableOutputEscaping (xmlNodePtr nodep)
 static char *
 slaxWriteCheckRoom (slax_writer_t *swp, int space)
 {
-    if (swp->sw_cur + space >= swp->sw_bufsiz)
-	if (slaxWriteRealloc(swp, swp->sw_cur + space + BUF_EXTEND) == NULL)
-	    return NULL;
+    char *cp = psu_strbuf_reserve(&swp->sw_line, space);
 
-    return swp->sw_buf + swp->sw_cur;
+    if (cp == NULL) {
+	slaxLog("memory allocation failure");
+	swp->sw_errors += 1;
+    }
+
+    return cp;
 }
 
 #define SEF_NEWLINE	(1<<0)	/* Escape newlines */
@@ -379,7 +462,7 @@ slaxWriteEscapedChar (slax_writer_t *swp, const char *inp, unsigned flags)
 	    return NULL;
 	*outp++ = '\\';
 	*outp++ = ch;
-	swp->sw_cur += 2;
+	psu_strbuf_commit(&swp->sw_line, 2);
 	break;
 
     case '\'':
@@ -392,7 +475,7 @@ slaxWriteEscapedChar (slax_writer_t *swp, const char *inp, unsigned flags)
 	if (outp == NULL)
 	    return NULL;
 	*outp++ = ch;
-	swp->sw_cur += 1;
+	psu_strbuf_commit(&swp->sw_line, 1);
     }
 
     return inp;
@@ -401,15 +484,44 @@ slaxWriteEscapedChar (slax_writer_t *swp, const char *inp, unsigned flags)
 static void
 slaxWriteEscaped (slax_writer_t *swp, const char *str, unsigned flags)
 {
-    const char *inp;
+    /* '\n', '\r', '"', '\\' and '\'', laid out for psu_memchr_set */
+    static const psu_charset_t special = {
+	.pcs_lo = { [0x2] = 1 << 2, [0x7] = 1 << 2, [0xa] = 1 << 0,
+		    [0xc] = 1 << 5, [0xd] = 1 << 0 },
+    };
+    const char *inp, *sp;
     char *outp;
+    size_t len;
 
     outp = slaxWriteCheckRoom(swp, 1); /* Save room for trailing NUL */
-    if (outp == NULL)
+    if (outp == NULL || str == NULL)
 	return;
 
-    for (inp = str; inp && *inp; inp++)
-	inp = slaxWriteEscapedChar(swp, inp, flags);
+    /*
+     * Copy runs of ordinary characters in one go; only the ones
+     * slaxWriteEscapedChar might escape need looking at
+     */
+    for (inp = str, len = strlen(str); len > 0; inp = sp + 1) {
+	sp = psu_memchr_set(inp, &special, len);
+	if (sp == NULL)
+	    sp = inp + len;
+
+	if (sp > inp) {
+	    outp = slaxWriteCheckRoom(swp, sp - inp);
+	    if (outp == NULL)
+		return;
+	    memcpy(outp, inp, sp - inp);
+	    psu_strbuf_commit(&swp->sw_line, sp - inp);
+	}
+
+	len -= sp - inp;
+	if (len == 0)
+	    break;
+
+	if (slaxWriteEscapedChar(swp, sp, flags) == NULL)
+	    return;
+	len -= 1;
+    }
 }
 
 static void
@@ -654,7 +766,7 @@ slaxRewriteEltArg (slax_writer_t *swp UNUSED, xmlNodePtr nodep,
 	output = NULL;
 	val = &output;
 	sw.sw_data = &val;
-	sw.sw_cur = 0;
+	psu_strbuf_reset(&sw.sw_line);
 	sw.sw_errors = 0;
 	sw.sw_indent = 0;
 	sw.sw_indent_extra = swp->sw_indent;
@@ -670,7 +782,7 @@ slaxRewriteEltArg (slax_writer_t *swp UNUSED, xmlNodePtr nodep,
 	    slaxWrite(&sw, "}");
 
 	/* Make a string of anything left in the buffer */
-	if (sw.sw_cur) {
+	if (psu_strbuf_len(&sw.sw_line)) {
 	    if (sw.sw_indent) {
 		/*
 		 * We have to build an "indentation string" ourselves,
@@ -700,8 +812,7 @@ slaxRewriteEltArg (slax_writer_t *swp UNUSED, xmlNodePtr nodep,
 		}
 	    }
 
-	    sw.sw_buf[sw.sw_cur] = '\0';
-	    *val = slaxStringLiteral(sw.sw_buf, 0);
+	    *val = slaxStringLiteral(psu_strbuf_string(&sw.sw_line), 0);
 	    val = &(*val)->ss_next;
 	}
 
@@ -721,6 +832,7 @@ slaxRewriteEltArg (slax_writer_t *swp UNUSED, xmlNodePtr nodep,
 	slaxStringFree(trash);
     }
 
+    psu_strbuf_cleanup(&sw.sw_line);
     return results;
 }
 
@@ -3476,9 +3588,13 @@ slaxWriteChildren (slax_writer_t *swp, xmlDocPtr docp, xmlNodePtr nodep,
 static void
 slaxWriteCleanup (slax_writer_t *swp)
 {
-    if (swp->sw_buf) {
-	xmlFree(swp->sw_buf);
-	swp->sw_buf = NULL;
+    psu_strbuf_cleanup(&swp->sw_line);
+
+    if (swp->sw_obuf) {
+	if (slaxWriteFlushFd(swp) < 0)
+	    swp->sw_errors += 1;
+	xmlFree(swp->sw_obuf);
+	swp->sw_obuf = NULL;
     }
 }
 
@@ -3505,26 +3621,12 @@ slaxFreeWriter (slax_writer_t *swp)
     xmlFree(swp);
 }
 
-/**
- * slaxWriteDoc:
- * Write an XSLT document in SLAX format
- * @param func fprintf-like callback function to write data
- * @param data data passed to callback
- * @param docp source document (XSLT stylesheet)
- * @param partial Should we write partial (snippet) output?
- * @param version Version number to use
- */
-int
-slaxWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
-	      int partial,  const char *version)
+static int
+slaxWriteDocCommon (slax_writer_t *swp, xmlDocPtr docp,
+		    int partial,  const char *version)
 {
     xmlNodePtr nodep;
     xmlNodePtr childp;
-    slax_writer_t sw;
-
-    bzero(&sw, sizeof(sw));
-    sw.sw_write = func;
-    sw.sw_data = data;
 
     nodep = xmlDocGetRootElement(docp);
     if (nodep == NULL || nodep->name == NULL)
@@ -3533,17 +3635,17 @@ slaxWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
     /* If the user asked for version 1.0, we avoid 1.1 features */
     if (version) {
 	if (streq(version, "1.0"))
-	    sw.sw_vers = SWF_VERS_10;
+	    swp->sw_vers = SWF_VERS_10;
 	else if (streq(version, "1.1"))
-	    sw.sw_vers = SWF_VERS_11;
+	    swp->sw_vers = SWF_VERS_11;
 	else if (streq(version, "1.2"))
-	    sw.sw_vers = SWF_VERS_12;
+	    swp->sw_vers = SWF_VERS_12;
     }
 
     if (!partial) {
-	slaxWrite(&sw, "version %s;", version ?: SLAX_VERSION);
-	slaxWriteNewline(&sw, 0);
-	slaxWriteNewline(&sw, 0);
+	slaxWrite(swp, "version %s;", version ?: SLAX_VERSION);
+	slaxWriteNewline(swp, 0);
+	slaxWriteNewline(swp, 0);
     }
 
     /*
@@ -3551,16 +3653,16 @@ slaxWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
      */
     for (childp = docp->children; childp; childp = childp->next)
 	if (childp->type == XML_COMMENT_NODE)
-	    slaxWriteComment(&sw, docp, childp);
+	    slaxWriteComment(swp, docp, childp);
 
-    slaxWriteAllNs(&sw, docp, nodep);
+    slaxWriteAllNs(swp, docp, nodep);
 
     if (streq((const char *) nodep->name, ELT_STYLESHEET)
 		|| streq((const char *) nodep->name, ELT_TRANSFORM)) {
-	slaxWriteChildren(&sw, docp, nodep, FALSE, TRUE);
+	slaxWriteChildren(swp, docp, nodep, FALSE, TRUE);
 
     } else if (partial) {
-	slaxWriteElement(&sw, docp, nodep);
+	slaxWriteElement(swp, docp, nodep);
 
     } else {
 	/*
@@ -3568,18 +3670,62 @@ slaxWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
 	 * it must be a "iteral result element".  See the XSLT spec:
 	 * [7.1.1 Literal Result Elements]).
 	 */
-	slaxWrite(&sw, "match / {");
-	slaxWriteNewline(&sw, NEWL_INDENT);
+	slaxWrite(swp, "match / {");
+	slaxWriteNewline(swp, NEWL_INDENT);
 
-	slaxWriteElement(&sw, docp, nodep);
+	slaxWriteElement(swp, docp, nodep);
 
-	slaxWrite(&sw, "}");
-	slaxWriteNewline(&sw, NEWL_OUTDENT);
+	slaxWrite(swp, "}");
+	slaxWriteNewline(swp, NEWL_OUTDENT);
     }
 
-    slaxWriteCleanup(&sw);
+    slaxWriteCleanup(swp);
+
+    return (swp->sw_errors == 0);
+}
+
+/**
+ * slaxWriteDoc:
+ * Write an XSLT document in SLAX format
+ * @param func fprintf-like callback function to write data
+ * @param data data passed to callback
+ * @param docp source document (XSLT stylesheet)
+ * @param partial Should we write partial (snippet) output?
+ * @param version Version number to use
+ */
+int
+slaxWriteDoc (slaxWriterFunc_t func, void *data, xmlDocPtr docp,
+	      int partial,  const char *version)
+{
+    slax_writer_t sw;
+
+    bzero(&sw, sizeof(sw));
+    sw.sw_write = func;
+    sw.sw_data = data;
+
+    return slaxWriteDocCommon(&sw, docp, partial, version);
+}
+
+/**
+ * slaxWriteDocFd:
+ * Write an XSLT document in SLAX format directly to a file descriptor.
+ * Lines are gathered into large buffers and sent with writev(),
+ * avoiding a formatted callback per line.
+ * @param fd file descriptor
+ * @param docp source document (XSLT stylesheet)
+ * @param partial Should we write partial (snippet) output?
+ * @param version Version number to use
+ */
+int
+slaxWriteDocFd (int fd, xmlDocPtr docp, int partial, const char *version)
+{
+    slax_writer_t sw;
+
+    bzero(&sw, sizeof(sw));
+    sw.sw_fd = fd;
+    sw.sw_flags = SWF_FD;
 
-    return (sw.sw_errors == 0);
+    return slaxWriteDocCommon(&sw, docp, partial, version);
 }
 
 
@@ -99,9 +99,18 @@ xmlStrchru (xmlChar *str, xmlChar val)
     return NULL;
 }
 
+/*
+ * Returns the function to register (or a wrapper that counts calls
+ * to it, if the engine counters are on; see slaxstats.c)
+ */
+xmlXPathFunction
+slaxStatsWrapFunction (const char *uri, const char *name,
+		       xmlXPathFunction func);
+
 static inline void
 slaxRegisterFunction (const char *uri, const char *fn, xmlXPathFunction func)
 {
+    func = slaxStatsWrapFunction(uri, fn, func);
     if (xsltRegisterExtModuleFunction((const xmlChar *) fn,
 				      (const xmlChar *) uri,
 				      func))
@@ -24,6 +24,37 @@ typedef uint16_t xi_node_flags_t; /* Flags for a node (XNF_*) */
  */
 typedef pa_atom_t xi_name_id_t;	/* Element name identifier */
 typedef pa_atom_t xi_ns_id_t;	/* Namespace identifier */
+typedef pa_atom_t xi_node_id_t;	/* Node identifier (in xw_nodes) */
+
+/*
+ * Like PA_FIXED_FUNCTIONS, but for the raw pa_atom_t identifiers
+ * that we need for bitfields and on-disk structures.
+ */
+#define XI_FIXED_FUNCTIONS(_type, _base, _field,			\
+			   _alloc_fn, _free_fn, _addr_fn)		\
+static inline _type *							\
+_alloc_fn (_base *basep, pa_atom_t *atomp)				\
+{									\
+    pa_fixed_atom_t atom = pa_fixed_alloc_atom(basep->_field);		\
+									\
+    *atomp = pa_fixed_atom_of(atom);					\
+    return pa_fixed_atom_addr(basep->_field, atom);			\
+}									\
+									\
+static inline void							\
+_free_fn (_base *basep, pa_atom_t atom)					\
+{									\
+    if (atom == PA_NULL_ATOM)		/* Should not occur */		\
+	return;								\
+									\
+    pa_fixed_free_atom(basep->_field, pa_fixed_atom(atom));		\
+}									\
+									\
+static inline _type *							\
+_addr_fn (_base *basep, pa_atom_t atom)					\
+{									\
+    return pa_fixed_atom_addr(basep->_field, pa_fixed_atom(atom));	\
+}
 
 /* Wrapper for our "name" atom */
 PA_ATOM_TYPE(xi_name_atom_t, xi_name_atom_s, xna_atom,
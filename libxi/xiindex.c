@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Per-name posting lists, built as the parser inserts elements.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xinodeset.h>
+#include <libxi/xiindex.h>
+
+xi_name_index_t *
+xi_name_index_create (xi_workspace_t *xwp)
+{
+    xi_name_index_t *xnip = calloc(1, sizeof(*xnip));
+
+    if (xnip)
+	xnip->xni_workspace = xwp;
+
+    return xnip;
+}
+
+void
+xi_name_index_destroy (xi_name_index_t *xnip)
+{
+    xi_nodeset_t nodeset;
+    uint32_t i;
+
+    if (xnip == NULL)
+	return;
+
+    for (i = 0; i < xnip->xni_max; i++) {
+	if (!xi_name_index_lookup(xnip, i, &nodeset))
+	    continue;
+
+	/* xi_nodeset_free() frees the wrapper, so do the work here */
+	xi_nodeset_chunk_id_t id, next;
+	xi_nodeset_chunk_t *chunkp;
+
+	for (id = nodeset.xns_first; id != PA_NULL_ATOM; id = next) {
+	    chunkp = xi_nodeset_chunk_addr(&nodeset, id);
+	    if (chunkp == NULL)
+		break;		/* Should not occur */
+	    next = chunkp->xnsc_next;
+	    xi_nodeset_chunk_free(&nodeset, id);
+	}
+
+	xi_nodeset_info_free(xnip->xni_workspace, nodeset.xns_info_atom);
+    }
+
+    if (xnip->xni_lists)
+	free(xnip->xni_lists);
+    free(xnip);
+}
+
+int
+xi_name_index_add (xi_name_index_t *xnip, pa_atom_t name_atom,
+		   pa_atom_t node_atom)
+{
+    xi_workspace_t *xwp = xnip->xni_workspace;
+    xi_nodeset_t nodeset;
+
+    if (name_atom >= xnip->xni_max) {
+	uint32_t max = xnip->xni_max ? xnip->xni_max : 256;
+	while (max <= name_atom)
+	    max <<= 1;
+
+	xi_nodeset_info_atom_t *lists;
+	lists = realloc(xnip->xni_lists, max * sizeof(*lists));
+	if (lists == NULL)
+	    return -1;
+
+	bzero(lists + xnip->xni_max,
+	      (max - xnip->xni_max) * sizeof(*lists));
+	xnip->xni_lists = lists;
+	xnip->xni_max = max;
+    }
+
+    if (!xi_name_index_lookup(xnip, name_atom, &nodeset)) {
+	xi_nodeset_info_t *infop;
+	xi_nodeset_info_atom_t info_atom;
+
+	infop = xi_nodeset_info_alloc(xwp, &info_atom);
+	if (infop == NULL)
+	    return -1;
+
+	infop->xnsi_type = XI_NSTYPE_NORMAL;
+	infop->xnsi_flags = XI_NSF_SORTED;
+	infop->xnsi_chunk_size
+	    = XI_NODESET_CHUNK_ALLOC_COUNT(xwp->xw_nodeset_chunks->pf_atom_size);
+	xnip->xni_lists[name_atom] = info_atom;
+
+	nodeset.xns_workspace = xwp;
+	nodeset.xns_info_atom = info_atom;
+	nodeset.xns_infop = infop;
+    }
+
+    uint32_t count = nodeset.xns_count;
+    xi_nodeset_add(&nodeset, node_atom);
+
+    return (nodeset.xns_count == count) ? -1 : 0;
+}
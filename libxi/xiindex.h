@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A name index is a set of posting lists, one per element name,
+ * holding the atoms of the elements with that name.  The parser
+ * appends to them as it inserts nodes, so queries like "//name" can
+ * visit just the matching nodes instead of walking the whole tree.
+ *
+ * Since node atoms are allocated in document order, each list is
+ * sorted, and the descendants of a node are the atoms between it
+ * and its next "following" node, which makes scoping a lookup to a
+ * subtree a simple range test.
+ *
+ * The lists themselves are nodesets, living in the mmap'd workspace.
+ * The directory (name atom to list) is a plain array in user space,
+ * indexed by name atom and grown as names appear.
+ */
+
+#ifndef LIBXI_XIINDEX_H
+#define LIBXI_XIINDEX_H
+
+typedef struct xi_name_index_s {
+    xi_workspace_t *xni_workspace; /* Workspace holding the lists */
+    xi_nodeset_info_atom_t *xni_lists; /* Lists, indexed by name atom */
+    uint32_t xni_max;		/* Number of slots in xni_lists */
+    uint32_t xni_trees;		/* Number of trees indexed */
+    pa_atom_t xni_first_root;	/* Root of the first tree indexed */
+} xi_name_index_t;
+
+xi_name_index_t *
+xi_name_index_create (xi_workspace_t *xwp);
+
+void
+xi_name_index_destroy (xi_name_index_t *xnip);
+
+/*
+ * Record that a tree is being indexed.  Once a workspace has an
+ * index, every element inserted into any tree is recorded, so trees
+ * with roots from xni_first_root on are covered.
+ */
+static inline void
+xi_name_index_add_tree (xi_name_index_t *xnip, pa_atom_t root_atom)
+{
+    if (xnip->xni_trees++ == 0)
+	xnip->xni_first_root = root_atom;
+}
+
+/*
+ * Does the index cover the tree with the given root?
+ */
+static inline xi_boolean_t
+xi_name_index_covers (xi_name_index_t *xnip, pa_atom_t root_atom)
+{
+    return xnip->xni_trees != 0 && root_atom >= xnip->xni_first_root;
+}
+
+/*
+ * Record a new element; node atoms must be added in ascending order
+ */
+int
+xi_name_index_add (xi_name_index_t *xnip, pa_atom_t name_atom,
+		   pa_atom_t node_atom);
+
+/*
+ * Fill in 'nodeset' with the posting list for the given name,
+ * returning FALSE if there are no elements with that name.  The
+ * nodeset is borrowed from the index and must not be freed.
+ */
+static inline xi_boolean_t
+xi_name_index_lookup (xi_name_index_t *xnip, pa_atom_t name_atom,
+		      xi_nodeset_t *nodeset)
+{
+    if (name_atom >= xnip->xni_max || xnip->xni_lists[name_atom] == 0)
+	return FALSE;
+
+    nodeset->xns_workspace = xnip->xni_workspace;
+    nodeset->xns_info_atom = xnip->xni_lists[name_atom];
+    nodeset->xns_infop = xi_nodeset_info_addr(xnip->xni_workspace,
+					      nodeset->xns_info_atom);
+
+    return (nodeset->xns_infop != NULL);
+}
+
+#endif /* LIBXI_XIINDEX_H */
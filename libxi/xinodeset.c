@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Bulk and set operations on nodesets.  The simple add/iterate
+ * pieces are inline in xinodeset.h; the rest lives here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xinodeset.h>
+
+/*
+ * Return the index of the first member of nodes[start..count) that
+ * is >= atom (or count if there's none).
+ */
+static inline uint32_t
+xi_nodeset_lower_bound (const pa_atom_t *nodes, uint32_t start,
+			uint32_t count, pa_atom_t atom)
+{
+    uint32_t lo = start, hi = count, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (nodes[mid] < atom)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+int
+xi_nodeset_append (xi_nodeset_t *nodeset, const pa_atom_t *atoms,
+		   uint32_t count)
+{
+    xi_nodeset_chunk_t *chunkp = NULL, *newp;
+    uint32_t size = nodeset->xns_infop->xnsi_chunk_size, len;
+    pa_atom_t atom;
+
+    if (count == 0)
+	return 0;
+
+    if (nodeset->xns_last != PA_NULL_ATOM) {
+	chunkp = xi_nodeset_chunk_addr(nodeset, nodeset->xns_last);
+	if (chunkp == NULL)
+	    return -1;		/* Should not occur */
+    }
+
+    while (count > 0) {
+	if (chunkp == NULL || chunkp->xnsc_count == size) {
+	    newp = xi_nodeset_chunk_alloc(nodeset, &atom);
+	    if (newp == NULL)
+		return -1;
+
+	    if (chunkp)
+		chunkp->xnsc_next = atom;
+	    else
+		nodeset->xns_first = atom;
+	    nodeset->xns_last = atom;
+	    chunkp = newp;
+	}
+
+	len = size - chunkp->xnsc_count;
+	if (len > count)
+	    len = count;
+
+	memcpy(&chunkp->xnsc_nodes[chunkp->xnsc_count], atoms,
+	       len * sizeof(atoms[0]));
+	chunkp->xnsc_count += len;
+	nodeset->xns_count += len;
+	atoms += len;
+	count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Insert a node into the middle of a sorted nodeset, splitting the
+ * chunk if it's full.  xi_nodeset_add() has already handled the
+ * common case of appending at the end.
+ */
+void
+xi_nodeset_insert_sorted (xi_nodeset_t *nodeset, pa_atom_t node_atom)
+{
+    xi_nodeset_chunk_t *chunkp, *newp;
+    xi_nodeset_chunk_id_t id;
+    uint32_t size = nodeset->xns_infop->xnsi_chunk_size, pos, half;
+    pa_atom_t atom;
+
+    /* Find the first chunk whose last member is >= node_atom */
+    for (id = nodeset->xns_first; id != PA_NULL_ATOM; id = chunkp->xnsc_next) {
+	chunkp = xi_nodeset_chunk_addr(nodeset, id);
+	if (chunkp == NULL)
+	    return;		/* Should not occur */
+
+	if (chunkp->xnsc_count
+		&& chunkp->xnsc_nodes[chunkp->xnsc_count - 1] >= node_atom)
+	    break;
+    }
+
+    if (id == PA_NULL_ATOM) {	/* Past the end; shouldn't be here */
+	xi_nodeset_append(nodeset, &node_atom, 1);
+	return;
+    }
+
+    pos = xi_nodeset_lower_bound(chunkp->xnsc_nodes, 0,
+				 chunkp->xnsc_count, node_atom);
+    if (chunkp->xnsc_nodes[pos] == node_atom)
+	return;			/* Already a member */
+
+    if (chunkp->xnsc_count == size) {
+	/* Split the chunk, moving the top half into a new one */
+	newp = xi_nodeset_chunk_alloc(nodeset, &atom);
+	if (newp == NULL)
+	    return;
+
+	half = size / 2;
+	newp->xnsc_count = size - half;
+	memcpy(newp->xnsc_nodes, &chunkp->xnsc_nodes[half],
+	       newp->xnsc_count * sizeof(pa_atom_t));
+	chunkp->xnsc_count = half;
+
+	newp->xnsc_next = chunkp->xnsc_next;
+	chunkp->xnsc_next = atom;
+	if (nodeset->xns_last == id)
+	    nodeset->xns_last = atom;
+
+	if (pos > half) {
+	    chunkp = newp;
+	    pos -= half;
+	}
+    }
+
+    memmove(&chunkp->xnsc_nodes[pos + 1], &chunkp->xnsc_nodes[pos],
+	    (chunkp->xnsc_count - pos) * sizeof(pa_atom_t));
+    chunkp->xnsc_nodes[pos] = node_atom;
+    chunkp->xnsc_count += 1;
+    nodeset->xns_count += 1;
+}
+
+/*
+ * A position within a nodeset, for walking the chunks
+ */
+typedef struct xi_nodeset_cursor_s {
+    xi_nodeset_t *xnc_nodeset;	/* Nodeset we're walking */
+    xi_nodeset_chunk_t *xnc_chunk; /* Current chunk (NULL at end) */
+    uint32_t xnc_index;		/* Index of current member in chunk */
+} xi_nodeset_cursor_t;
+
+/*
+ * Make sure the cursor is on a member, moving to the next
+ * non-empty chunk if needed.  Returns FALSE at the end of the set.
+ */
+static inline xi_boolean_t
+xi_nodeset_cursor_valid (xi_nodeset_cursor_t *curp)
+{
+    while (curp->xnc_chunk
+	       && curp->xnc_index >= curp->xnc_chunk->xnsc_count) {
+	curp->xnc_chunk = xi_nodeset_chunk_addr(curp->xnc_nodeset,
+						curp->xnc_chunk->xnsc_next);
+	curp->xnc_index = 0;
+    }
+
+    return (curp->xnc_chunk != NULL);
+}
+
+static inline void
+xi_nodeset_cursor_init (xi_nodeset_cursor_t *curp, xi_nodeset_t *nodeset)
+{
+    curp->xnc_nodeset = nodeset;
+    curp->xnc_chunk = xi_nodeset_chunk_addr(nodeset, nodeset->xns_first);
+    curp->xnc_index = 0;
+    xi_nodeset_cursor_valid(curp);
+}
+
+static inline pa_atom_t
+xi_nodeset_cursor_atom (xi_nodeset_cursor_t *curp)
+{
+    return curp->xnc_chunk->xnsc_nodes[curp->xnc_index];
+}
+
+/*
+ * Advance past any members less than 'atom'.  Whole chunks below it
+ * are skipped by looking only at their last member.  If 'outp' is
+ * given, the skipped members are copied to it.
+ */
+static int
+xi_nodeset_cursor_skip (xi_nodeset_cursor_t *curp, pa_atom_t atom,
+			xi_nodeset_t *outp)
+{
+    xi_nodeset_chunk_t *chunkp;
+    uint32_t end;
+
+    while (xi_nodeset_cursor_valid(curp)) {
+	chunkp = curp->xnc_chunk;
+
+	if (chunkp->xnsc_nodes[chunkp->xnsc_count - 1] < atom) {
+	    end = chunkp->xnsc_count;
+	} else {
+	    end = xi_nodeset_lower_bound(chunkp->xnsc_nodes, curp->xnc_index,
+					 chunkp->xnsc_count, atom);
+	}
+
+	if (outp && xi_nodeset_append(outp,
+			&chunkp->xnsc_nodes[curp->xnc_index],
+			end - curp->xnc_index))
+	    return -1;
+
+	curp->xnc_index = end;
+	if (end < chunkp->xnsc_count)
+	    break;		/* Found a member >= atom */
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the rest of the nodeset into 'outp'
+ */
+static int
+xi_nodeset_cursor_rest (xi_nodeset_cursor_t *curp, xi_nodeset_t *outp)
+{
+    xi_nodeset_chunk_t *chunkp;
+
+    while (xi_nodeset_cursor_valid(curp)) {
+	chunkp = curp->xnc_chunk;
+	if (xi_nodeset_append(outp, &chunkp->xnsc_nodes[curp->xnc_index],
+			      chunkp->xnsc_count - curp->xnc_index))
+	    return -1;
+	curp->xnc_index = chunkp->xnsc_count;
+    }
+
+    return 0;
+}
+
+/* Set operations, for xi_nodeset_merge() */
+#define XI_NSOP_UNION		1
+#define XI_NSOP_INTERSECT	2
+#define XI_NSOP_DIFFERENCE	3
+
+static xi_nodeset_t *
+xi_nodeset_merge (xi_nodeset_t *left, xi_nodeset_t *right, unsigned op)
+{
+    xi_nodeset_cursor_t lcur, rcur;
+    pa_atom_t latom, ratom;
+    int rc = 0;
+
+    if (!(left->xns_flags & XI_NSF_SORTED)
+	    || !(right->xns_flags & XI_NSF_SORTED)) {
+	slaxLog("nodeset merge: unsorted nodeset");
+	return NULL;
+    }
+
+    xi_nodeset_t *outp = xi_nodeset_alloc(left->xns_workspace,
+					  left->xns_type, XI_NSF_SORTED);
+    if (outp == NULL)
+	return NULL;
+
+    xi_nodeset_cursor_init(&lcur, left);
+    xi_nodeset_cursor_init(&rcur, right);
+
+    while (rc == 0 && xi_nodeset_cursor_valid(&lcur)
+	       && xi_nodeset_cursor_valid(&rcur)) {
+	latom = xi_nodeset_cursor_atom(&lcur);
+	ratom = xi_nodeset_cursor_atom(&rcur);
+
+	if (latom < ratom) {
+	    rc = xi_nodeset_cursor_skip(&lcur, ratom,
+				(op == XI_NSOP_INTERSECT) ? NULL : outp);
+
+	} else if (ratom < latom) {
+	    rc = xi_nodeset_cursor_skip(&rcur, latom,
+				(op == XI_NSOP_UNION) ? outp : NULL);
+
+	} else {
+	    if (op != XI_NSOP_DIFFERENCE)
+		rc = xi_nodeset_append(outp, &latom, 1);
+	    lcur.xnc_index += 1;
+	    rcur.xnc_index += 1;
+	}
+    }
+
+    if (rc == 0 && op != XI_NSOP_INTERSECT)
+	rc = xi_nodeset_cursor_rest(&lcur, outp);
+    if (rc == 0 && op == XI_NSOP_UNION)
+	rc = xi_nodeset_cursor_rest(&rcur, outp);
+
+    if (rc) {
+	xi_nodeset_free(outp);
+	return NULL;
+    }
+
+    return outp;
+}
+
+xi_nodeset_t *
+xi_nodeset_union (xi_nodeset_t *left, xi_nodeset_t *right)
+{
+    return xi_nodeset_merge(left, right, XI_NSOP_UNION);
+}
+
+xi_nodeset_t *
+xi_nodeset_intersect (xi_nodeset_t *left, xi_nodeset_t *right)
+{
+    return xi_nodeset_merge(left, right, XI_NSOP_INTERSECT);
+}
+
+xi_nodeset_t *
+xi_nodeset_difference (xi_nodeset_t *left, xi_nodeset_t *right)
+{
+    return xi_nodeset_merge(left, right, XI_NSOP_DIFFERENCE);
+}
+
+xi_boolean_t
+xi_nodeset_contains (xi_nodeset_t *nodeset, pa_atom_t node_atom)
+{
+    xi_nodeset_cursor_t cur;
+
+    xi_nodeset_cursor_init(&cur, nodeset);
+    if (xi_nodeset_cursor_skip(&cur, node_atom, NULL))
+	return FALSE;
+
+    return xi_nodeset_cursor_valid(&cur)
+	&& xi_nodeset_cursor_atom(&cur) == node_atom;
+}
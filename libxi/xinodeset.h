@@ -35,6 +35,7 @@ typedef struct xi_nodeset_info_s {
     uint16_t xnsi_chunk_size;	   /* Size of chunk */
     xi_nodeset_chunk_id_t xnsi_first; /* Start of chain of chunks */
     xi_nodeset_chunk_id_t xnsi_last; /* End of chain of chunks */
+    uint32_t xnsi_count;	   /* Number of members */
 } xi_nodeset_info_t;
 
 #define XI_NSTYPE_NORMAL 0	/* Normal node set */
@@ -42,6 +43,9 @@ typedef struct xi_nodeset_info_s {
 #define XI_NSTYPE_VAR	2	/* Normal variable */
 #define XI_NSTYPE_MVAR	3	/* Mutable variable */
 
+/* Flags for xnsi_flags */
+#define XI_NSF_SORTED	(1<<0)	/* Members are unique, in ascending order */
+
 /*
  * The chunk is a page of nodes within a listed list.
  */
@@ -77,13 +81,13 @@ typedef struct xi_nodeset_s {
 #define xns_first xns_infop->xnsi_first
 #define xns_last xns_infop->xnsi_last
 
-PA_FIXED_FUNCTIONS(xi_nodeset_chunk_id_t, xi_nodeset_chunk_t, xi_nodeset_t,
+XI_FIXED_FUNCTIONS(xi_nodeset_chunk_t, xi_nodeset_t,
 		   xns_workspace->xw_nodeset_chunks,
 		   xi_nodeset_chunk_alloc, xi_nodeset_chunk_free,
 		   xi_nodeset_chunk_addr);
 
 typedef pa_atom_t xi_nodeset_info_id_t;
-PA_FIXED_FUNCTIONS(xi_nodeset_info_id_t, xi_nodeset_info_t, xi_workspace_t,
+XI_FIXED_FUNCTIONS(xi_nodeset_info_t, xi_workspace_t,
 		   xw_nodeset_info, xi_nodeset_info_alloc,
 		   xi_nodeset_info_free, xi_nodeset_info_addr);
 
@@ -130,8 +134,13 @@ xi_nodeset_alloc (xi_workspace_t *xwp, xi_nodeset_type_t type,
     return nodeset;
 }
 
+void
+xi_nodeset_insert_sorted (xi_nodeset_t *nodeset, pa_atom_t node_atom);
+
 /*
- * Add a node to a nodeset, allocating a new chunk if needed
+ * Add a node to a nodeset, allocating a new chunk if needed.  For
+ * XI_NSF_SORTED sets, adding in ascending order is just as cheap;
+ * duplicates are dropped and anything else is inserted in place.
  */
 static inline void
 xi_nodeset_add (xi_nodeset_t *nodeset, pa_atom_t node_atom)
@@ -157,6 +166,13 @@ xi_nodeset_add (xi_nodeset_t *nodeset, pa_atom_t node_atom)
 	if (chunkp == NULL)
 	    return;		/* Should not occur */
 
+	if ((nodeset->xns_flags & XI_NSF_SORTED) && chunkp->xnsc_count
+	        && node_atom <= chunkp->xnsc_nodes[chunkp->xnsc_count - 1]) {
+	    if (node_atom != chunkp->xnsc_nodes[chunkp->xnsc_count - 1])
+		xi_nodeset_insert_sorted(nodeset, node_atom);
+	    return;
+	}
+
 	if (chunkp->xnsc_count == nodeset->xns_infop->xnsi_chunk_size) {
 	    /* Full house; make a new chunk */
 	    xi_nodeset_chunk_t *newp = xi_nodeset_chunk_alloc(nodeset, &atom);
@@ -172,6 +188,16 @@ xi_nodeset_add (xi_nodeset_t *nodeset, pa_atom_t node_atom)
 
     /* Finally, add the node to the end of the last chunk */
     chunkp->xnsc_nodes[chunkp->xnsc_count++] = node_atom;
+    nodeset->xns_count += 1;
+}
+
+/*
+ * Return the number of members of a nodeset
+ */
+static inline uint32_t
+xi_nodeset_count (xi_nodeset_t *nodeset)
+{
+    return nodeset->xns_count;
 }
 
 /*
@@ -205,6 +231,73 @@ xi_nodeset_free (xi_nodeset_t *nodeset)
     free(nodeset);
 }
 
+/*
+ * An iterator over the members of a nodeset, in the order added
+ */
+typedef struct xi_nodeset_iter_s {
+    xi_nodeset_chunk_t *xnit_chunk; /* Current chunk */
+    uint32_t xnit_index;	/* Next member in that chunk */
+} xi_nodeset_iter_t;
+
+static inline void
+xi_nodeset_iter_init (xi_nodeset_t *nodeset, xi_nodeset_iter_t *iterp)
+{
+    iterp->xnit_chunk = xi_nodeset_chunk_addr(nodeset, nodeset->xns_first);
+    iterp->xnit_index = 0;
+}
+
+/*
+ * Return the next member of the nodeset, or PA_NULL_ATOM at the end
+ */
+static inline pa_atom_t
+xi_nodeset_iter_next (xi_nodeset_t *nodeset, xi_nodeset_iter_t *iterp)
+{
+    xi_nodeset_chunk_t *chunkp;
+
+    for (chunkp = iterp->xnit_chunk; chunkp; iterp->xnit_chunk = chunkp) {
+	if (iterp->xnit_index < chunkp->xnsc_count)
+	    return chunkp->xnsc_nodes[iterp->xnit_index++];
+
+	chunkp = xi_nodeset_chunk_addr(nodeset, chunkp->xnsc_next);
+	iterp->xnit_index = 0;
+    }
+
+    return PA_NULL_ATOM;
+}
+
+/*
+ * Append an array of atoms to a nodeset, filling chunks in bulk.
+ * For XI_NSF_SORTED sets, the caller must ensure the atoms are
+ * ascending, unique, and greater than the current members.  Returns
+ * zero on success.
+ */
+int
+xi_nodeset_append (xi_nodeset_t *nodeset, const pa_atom_t *atoms,
+		   uint32_t count);
+
+/*
+ * Set operations on XI_NSF_SORTED nodesets, each returning a new
+ * sorted nodeset (or NULL on failure).  These merge the chunk arrays
+ * directly: runs from one side that fall before the other's current
+ * member are found by binary search and copied in bulk, and chunks
+ * lying entirely before the other side are skipped without being
+ * examined, so the work is linear at worst and often much less.
+ */
+xi_nodeset_t *
+xi_nodeset_union (xi_nodeset_t *left, xi_nodeset_t *right);
+
+xi_nodeset_t *
+xi_nodeset_intersect (xi_nodeset_t *left, xi_nodeset_t *right);
+
+xi_nodeset_t *
+xi_nodeset_difference (xi_nodeset_t *left, xi_nodeset_t *right);
+
+/*
+ * Is the given node a member of a sorted nodeset?
+ */
+xi_boolean_t
+xi_nodeset_contains (xi_nodeset_t *nodeset, pa_atom_t node_atom);
+
 static inline void
 xi_nodeset_dump (xi_nodeset_t *nodeset)
 {
@@ -29,8 +29,8 @@
 #include <limits.h>
 
 #include "slaxconfig.h"
-#include <libslax/slaxdef.h>
-#include <libslax/slax.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
@@ -44,7 +44,12 @@
 #include <libxi/xirules.h>
 #include <libxi/xitree.h>
 #include <libxi/xiworkspace.h>
+#include <libxi/xinodeset.h>
+#include <libxi/xiindex.h>
 #include <libxi/xiparse.h>
+#include <libxi/xisplit.h>
+#include <libxi/xiscan.h>
+#include <libxi/xiwriter.h>
 
 xi_parse_t *
 xi_parse_open (pa_mmap_t *pmp, xi_workspace_t *workp, const char *name,
@@ -72,8 +77,15 @@ xi_parse_open (pa_mmap_t *pmp, xi_workspace_t *workp, const char *name,
     if (xtp == NULL)
 	goto fail;
 
-    xtp->xt_infop = pa_mmap_header(pmp, xi_mk_name(namebuf, name, "tree"),
-				   PA_TYPE_TREE, 0, sizeof(*xtp->xt_infop));
+    /* An unnamed tree (e.g. in an anonymous workspace) has no header */
+    if (name)
+	xtp->xt_infop = pa_mmap_header(pmp, xi_mk_name(namebuf, name, "tree"),
+				       PA_TYPE_TREE, 0,
+				       sizeof(*xtp->xt_infop));
+    else xtp->xt_infop = &xtp->xt_info;
+    if (xtp->xt_infop == NULL)
+	goto fail;
+
     xtp->xt_max_depth = 0;
     xtp->xt_workspace = workp;
 
@@ -101,8 +113,8 @@ xi_parse_open (pa_mmap_t *pmp, xi_workspace_t *workp, const char *name,
 	goto fail;
     nodep->xn_type = XI_TYPE_ROOT;
     nodep->xn_depth = 0;
-    nodep->xn_ns_map = PA_NULL_ATOM;
-    nodep->xn_name = PA_NULL_ATOM;
+    xi_node_set_ns_map(workp, nodep, PA_NULL_ATOM);
+    xi_node_set_name(workp, nodep, PA_NULL_ATOM);
     nodep->xn_next = PA_NULL_ATOM;
     nodep->xn_contents = PA_NULL_ATOM;
 
@@ -124,16 +136,66 @@ xi_parse_open (pa_mmap_t *pmp, xi_workspace_t *workp, const char *name,
     return NULL;
 }
 
+/*
+ * Release the parser.  The tree itself lives in the workspace, so
+ * it's still usable after we're gone.
+ */
 void
-xi_parse_destroy (xi_parse_t *parsep UNUSED)
+xi_parse_destroy (xi_parse_t *parsep)
+{
+    if (parsep == NULL)
+	return;
+
+    if (parsep->xp_split)
+	xi_split_destroy(parsep->xp_split);
+    if (parsep->xp_srcp)
+	xi_source_destroy(parsep->xp_srcp);
+    if (parsep->xp_insert) {
+	free(parsep->xp_insert->xi_tree);
+	free(parsep->xp_insert);
+    }
+
+    free(parsep);
+}
+
+pa_atom_t
+xi_parse_name_atom (xi_parse_t *parsep, const char *name,
+		    xi_boolean_t createp)
 {
-    return;
+    xi_workspace_t *xwp = xi_parse_workspace(parsep);
+    const unsigned char *cp = (const unsigned char *) name;
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    xi_name_cache_t *xncp;
+    const char *str;
+    pa_atom_t atom;
+
+    for ( ; *cp; cp++)
+	hash = (hash ^ *cp) * 16777619U;
+
+    uint32_t len = cp - (const unsigned char *) name;
+
+    xncp = &parsep->xp_name_cache[(hash ^ len) & (XI_NAME_CACHE_SIZE - 1)];
+    if (xncp->xnc_atom != PA_NULL_ATOM && xncp->xnc_hash == hash
+	    && xncp->xnc_len == len) {
+	str = xi_namepool_string(xwp, xncp->xnc_atom);
+	if (str && memcmp(str, name, len + 1) == 0)
+	    return xncp->xnc_atom;
+    }
+
+    atom = xi_namepool_atom(xwp, name, createp);
+    if (atom != PA_NULL_ATOM) {
+	xncp->xnc_hash = hash;
+	xncp->xnc_len = len;
+	xncp->xnc_atom = atom;
+    }
+
+    return atom;
 }
 
 pa_atom_t
 xi_parse_namepool_atom (xi_parse_t *parsep, const char *name)
 {
-    return xi_namepool_atom(xi_parse_workspace(parsep), name, TRUE);
+    return xi_parse_name_atom(parsep, name, TRUE);
 }
 
 const char *
@@ -170,15 +232,21 @@ xi_insert_node (xi_insert_t *xip, const char *msg,
 		const char *data, size_t len,
 		xi_node_type_t type, pa_atom_t name_atom, pa_atom_t contents)
 {
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
     pa_atom_t node_atom;
-    xi_node_t *nodep = xi_node_alloc(xip->xi_tree->xt_workspace, &node_atom);
+    xi_node_t *nodep = xi_node_alloc(xwp, &node_atom);
     if (nodep == NULL)
 	return PA_NULL_ATOM;
 
     /* Initialize our fields */
     nodep->xn_type = type;
-    nodep->xn_ns_map = PA_NULL_ATOM;
-    nodep->xn_name = name_atom;
+    xi_node_set_ns_map(xwp, nodep, PA_NULL_ATOM);
+    if (xi_node_set_name(xwp, nodep, name_atom)) {
+	pa_warning(0, "name atom %u too large for compact nodes "
+		   "(need XWF_WIDE_NODES)", name_atom);
+	xi_node_free(xwp, node_atom);
+	return PA_NULL_ATOM;
+    }
     nodep->xn_contents = contents;
 
     slaxLog("%s: [%.*s] %u / %u (depth %u)", msg, len, data,
@@ -204,6 +272,7 @@ xi_insert_node (xi_insert_t *xip, const char *msg,
     /* Mark the "last" as us */
     xsp->xs_last_atom = node_atom;
     xsp->xs_last_node = nodep;
+    xip->xi_last_atom = node_atom;
 
     /* Set our depth */
     nodep->xn_depth = xip->xi_depth + 1;
@@ -212,6 +281,12 @@ xi_insert_node (xi_insert_t *xip, const char *msg,
     if (nodep->xn_depth > xip->xi_maxdepth)
 	xip->xi_maxdepth = nodep->xn_depth;
 
+    /* Record elements in the name index, if we're building one */
+    xi_name_index_t *xnip = xip->xi_tree->xt_workspace->xw_name_index;
+    if (xnip && type == XI_TYPE_ELT
+	    && xi_name_index_add(xnip, name_atom, node_atom))
+	slaxLog("xi_insert_node: name index add failed");
+
     return node_atom;
 }
 
@@ -225,15 +300,21 @@ xi_insert_ns_node (xi_insert_t *xip, const char *msg,
 		   xi_node_type_t type, pa_atom_t name_atom,
 		   pa_atom_t contents)
 {
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
     pa_atom_t node_atom;
-    xi_node_t *nodep = xi_node_alloc(xip->xi_tree->xt_workspace, &node_atom);
+    xi_node_t *nodep = xi_node_alloc(xwp, &node_atom);
     if (nodep == NULL)
 	return NULL;
 
     /* Initialize our fields */
     nodep->xn_type = type;
-    nodep->xn_ns_map = PA_NULL_ATOM;
-    nodep->xn_name = name_atom;
+    xi_node_set_ns_map(xwp, nodep, PA_NULL_ATOM);
+    if (xi_node_set_name(xwp, nodep, name_atom)) {
+	pa_warning(0, "name atom %u too large for compact nodes "
+		   "(need XWF_WIDE_NODES)", name_atom);
+	xi_node_free(xwp, node_atom);
+	return NULL;
+    }
     nodep->xn_contents = contents;
 
     slaxLog("%s: [%.*s] %u / %u (depth %u)", msg, len, data,
@@ -242,11 +323,18 @@ xi_insert_ns_node (xi_insert_t *xip, const char *msg,
     nodep->xn_next = (*lastp == PA_NULL_ATOM) ? parent_atom : *lastp;
     *lastp = node_atom;
     lastp = &nodep->xn_next;
+    xip->xi_last_atom = node_atom;
 
-    /* Mark the "last" as us */
-    xi_istack_t *xsp = &xip->xi_stack[xip->xi_depth];
-    xsp->xs_last_atom = node_atom;
-    xsp->xs_last_node = nodep;
+    /*
+     * Mark the "last" as us, but only if we're at the end of the
+     * list.  If attributes were added before us, they're still
+     * after us and the last one is still the last one.
+     */
+    if (nodep->xn_next == parent_atom) {
+	xi_istack_t *xsp = &xip->xi_stack[xip->xi_depth];
+	xsp->xs_last_atom = node_atom;
+	xsp->xs_last_node = nodep;
+    }
 
     /* Set our depth */
     nodep->xn_depth = xip->xi_depth + 1;
@@ -280,31 +368,110 @@ xi_node_parent (xi_workspace_t *xwp, xi_node_t *nodep)
     return NULL;
 }
 
+/*
+ * Look for a namespace node for the prefix among an element's
+ * children, which list namespaces first.
+ */
+static pa_atom_t
+xi_parse_find_ns_local (xi_workspace_t *xwp, xi_node_t *nodep,
+			pa_atom_t pref_atom)
+{
+    xi_node_t *childp;
+    xi_ns_map_t *ns_map;
+
+    for (childp = xi_node_addr(xwp, nodep->xn_contents); childp;
+	 childp = xi_node_addr(xwp, childp->xn_next)) {
+	if (childp->xn_type != XI_TYPE_NS)
+	    break;		/* Done with namespaces */
+
+	/* The namespace mapping number is in the node's contents */
+	ns_map = xi_ns_map_addr(xwp, childp->xn_contents);
+	if (ns_map != NULL && ns_map->xnm_prefix == pref_atom)
+	    return childp->xn_contents; /* Match! */
+    }
+
+    return PA_NULL_ATOM;
+}
+
+/*
+ * A new namespace node for the prefix shadows anything we've cached
+ */
+static void
+xi_parse_prefix_cache_drop (xi_parse_t *parsep, pa_atom_t pref_atom)
+{
+    xi_prefix_cache_t *xpcp = parsep->xp_prefix_cache;
+    unsigned i;
+
+    for (i = 0; i < XI_PREFIX_CACHE_SIZE; i++, xpcp++)
+	if (xpcp->xpc_prefix == pref_atom)
+	    xpcp->xpc_prefix = PA_NULL_ATOM;
+}
+
 /*
  * We follow each node up the hierarchy, looking at each child.  When
  * we're past the namespace nodes, we move on.  Then we have follow
  * the chain of siblings to find our parent.  If we get to the root,
  * we're done.
+ *
+ * When the node is the one we're building, its ancestors are on the
+ * insertion stack, so we can walk that instead, and use (and fill)
+ * the prefix cache.
  */
 static pa_atom_t
 xi_parse_find_ns_atom (xi_parse_t *parsep, xi_node_t *nodep,
 		       pa_atom_t pref_atom)
 {
-    xi_workspace_t *xwp = parsep->xp_insert->xi_tree->xt_workspace;
-    xi_node_t *curp, *childp;
-    xi_ns_map_t *ns_map;
+    xi_insert_t *xip = parsep->xp_insert;
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
+    xi_prefix_cache_t *xpcp;
+    xi_node_t *curp;
+    pa_atom_t ns_atom;
+    int depth;
+    unsigned i;
+
+    if (pref_atom == PA_NULL_ATOM
+	    || nodep != xip->xi_stack[xip->xi_depth].xs_node) {
+	for (curp = nodep; curp; curp = xi_node_parent(xwp, curp)) {
+	    ns_atom = xi_parse_find_ns_local(xwp, curp, pref_atom);
+	    if (ns_atom != PA_NULL_ATOM)
+		return ns_atom;
+	}
+
+	return PA_NULL_ATOM;
+    }
+
+    xpcp = parsep->xp_prefix_cache;
+    for (i = 0; i < XI_PREFIX_CACHE_SIZE; i++, xpcp++) {
+	if (xpcp->xpc_prefix != pref_atom)
+	    continue;
 
-    for (curp = nodep; curp; curp = xi_node_parent(xwp, curp)) {
-	for (childp = xi_node_addr(xwp, curp->xn_contents); childp;
-	     childp = xi_node_addr(xwp, childp->xn_next)) {
-	    if (childp->xn_type != XI_TYPE_NS)
-		break;		/* Done with namespaces */
-
-	    /* The namespace mapping number is in the node's contents */
-	    ns_map = xi_ns_map_addr(xwp, childp->xn_contents);
-	    if (ns_map != NULL && ns_map->xnm_prefix == pref_atom)
-		return childp->xn_contents; /* Match! */
- 	}
+	/* Is the declaring element still open where we left it? */
+	if (xpcp->xpc_depth <= xip->xi_depth
+		&& xip->xi_stack[xpcp->xpc_depth].xs_atom == xpcp->xpc_owner)
+	    return xpcp->xpc_ns_map;
+
+	xpcp->xpc_prefix = PA_NULL_ATOM; /* Stale */
+    }
+
+    for (depth = xip->xi_depth; depth >= 0; depth--) {
+	curp = xip->xi_stack[depth].xs_node;
+	if (curp == NULL)
+	    continue;
+
+	ns_atom = xi_parse_find_ns_local(xwp, curp, pref_atom);
+	if (ns_atom == PA_NULL_ATOM)
+	    continue;
+
+	xpcp = &parsep->xp_prefix_cache[parsep->xp_prefix_next];
+	parsep->xp_prefix_next
+	    = (parsep->xp_prefix_next + 1) % XI_PREFIX_CACHE_SIZE;
+
+	xpcp->xpc_prefix = pref_atom;
+	xpcp->xpc_ns_map = ns_atom;
+	xpcp->xpc_owner = xip->xi_stack[depth].xs_atom;
+	xpcp->xpc_depth = depth;
+
+	return ns_atom;
     }
 
     return PA_NULL_ATOM;
@@ -320,7 +487,6 @@ xi_parse_find_ns_atom (xi_parse_t *parsep, xi_node_t *nodep,
 static pa_atom_t
 xi_parse_find_ns (xi_parse_t *parsep, xi_node_t *nodep, const char *prefix)
 {
-    xi_workspace_t *xwp = parsep->xp_insert->xi_tree->xt_workspace;
     pa_atom_t pref_atom;
 
     if (prefix == NULL) {
@@ -332,7 +498,7 @@ xi_parse_find_ns (xi_parse_t *parsep, xi_node_t *nodep, const char *prefix)
 	 * Find the atom for the prefix; if there isn't one, then it
 	 * cannot have been defined, which is likely a syntax error.
 	 */
-	pref_atom = xi_namepool_atom(xwp, prefix, FALSE);
+	pref_atom = xi_parse_name_atom(parsep, prefix, FALSE);
 	if (pref_atom == PA_NULL_ATOM)
 	    return PA_NULL_ATOM;
     }
@@ -353,22 +519,18 @@ static void
 xi_insert_attribs (xi_parse_t *parsep, xi_node_t *nodep, const char *data)
 {
     xi_insert_t *xip = parsep->xp_insert;
-    pa_arb_t *prp = xip->xi_tree->xt_workspace->xw_textpool;
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
     size_t len = strlen(data);
-    pa_atom_t data_atom = pa_arb_alloc(prp, len + 1);
-    char *cp = pa_arb_atom_addr(prp, data_atom);
+    pa_atom_t data_atom = xi_textpool_alloc(xwp, data, len);
 
-    if (cp == NULL)
+    if (data_atom == PA_NULL_ATOM)
 	return;
 
-    memcpy(cp, data, len);
-    cp[len] = '\0';
-
     pa_atom_t node_atom;
     node_atom = xi_insert_node(xip, "xi_insert_attribs", data, len,
 			       XI_TYPE_ATSTR, PA_NULL_ATOM, data_atom);
     if (node_atom == PA_NULL_ATOM) {
-	pa_arb_free_atom(prp, data_atom);
+	xi_textpool_free(xwp, data_atom);
 	return;
     }
 
@@ -376,55 +538,40 @@ xi_insert_attribs (xi_parse_t *parsep, xi_node_t *nodep, const char *data)
     nodep->xn_flags |= XNF_ATTRIBS_PRESENT;
 }
 
+#define XI_ATTRIB_PREFIX_MAX	16 /* Prefixed attributes we can defer */
+
+typedef struct xi_attrib_prefix_s {
+    pa_atom_t xap_atom;		/* Attribute node */
+    pa_atom_t xap_prefix;	/* Prefix (in the namepool) */
+} xi_attrib_prefix_t;
+
 /*
- * Returns NULL for success, or static error message text
+ * Give an attribute node the namespace mapping for its prefix
  */
-static const char *
-xi_parse_next_attrib (char **content, char *endp,
-		      char **namep, size_t *namelenp,
-		      char **valuep, size_t *valuelenp)
+static void
+xi_insert_attrib_ns (xi_parse_t *parsep, xi_node_t *nodep,
+		     pa_atom_t attrib_atom, pa_atom_t pref_atom)
 {
-    char *cp = *content;
+    xi_workspace_t *xwp = parsep->xp_insert->xi_tree->xt_workspace;
+    xi_node_t *attribp = xi_node_addr(xwp, attrib_atom);
+    pa_atom_t ns_atom;
 
-    if (cp == NULL)
-	return NULL;		/* Should not occur */
+    if (attribp == NULL)
+	return;			/* Should not occur */
 
-    char *name = xi_skipws(cp, endp - cp, 1);
-    if (name == NULL) {		/* End of attributes */
-	*content = NULL;	/* Mark end of attributes */
-	return NULL;
+    ns_atom = xi_parse_find_ns_atom(parsep, nodep, pref_atom);
+    if (ns_atom == PA_NULL_ATOM) {
+	const char *prefix = xi_namepool_string(xwp, pref_atom);
+	const char *name = xi_namepool_string(xwp,
+					      xi_node_name(xwp, attribp));
+	xi_source_failure(parsep->xp_srcp, 0,
+			  "namespace mapping not found for %s:%s",
+			  prefix ?: "", name ?: "");
     }
 
-    cp = memchr(name, '=', endp - name);
-    if (cp == NULL)
-	return "invalid attribute; missing '='";
-
-    /* Trim space off end of attribute name */
-    size_t namelen = cp - name;
-    char *sp = cp - 1;
-    sp = xi_skipws(sp, sp - name, -1); /* Trim trailing ws */
-    if (sp != NULL)
-	namelen = &sp[1] - name;
-
-    cp += 1;			/* Move over '=' */
-
-    char *value = xi_skipws(cp, cp - endp, 1);
-    if (value == NULL || value[1] == '\0')
-	return "invalid attribute; missing value";
-
-    char quote = *value++; /* Record and skip leading quote character */
-    cp = memchr(value, quote, value - endp);
-    if (cp == NULL)
-	return "invalid attribute; missing trailing quote";
-
-    /* Fill in the caller's value */
-    *valuelenp = cp - value;
-    *valuep = value;
-    *content = cp + 1;		/* Move over the closing quote */
-    *namep = name;
-    *namelenp = namelen;
-
-    return NULL;
+    if (xi_node_set_ns_map(xwp, attribp, ns_atom))
+	xi_source_failure(parsep->xp_srcp, 0,
+			  "too many namespace mappings for compact nodes");
 }
 
 /*
@@ -457,9 +604,13 @@ xi_parse_next_attrib (char **content, char *endp,
  *    <a b:foo="x" xmlns:b="b.org"/>
  *
  * So we're forced to whiffle thru the attributes twice, once to build
- * them and once to ns_map them.  Note: This is sad, since it means that
- * we have to allocate a node just to hold our prefix atom until we have
- * processed all attributes and can safely perform the prefix mapping.
+ * them and once to ns_map them.  We keep the prefixed attributes in a
+ * small list until we have processed all attributes and can safely
+ * perform the prefix mapping.  (We used to allocate a placeholder
+ * node for each, but freeing those let later nodes reuse their atoms,
+ * and we want atom order to stay document order.)  If the list fills,
+ * we map the prefix on the spot, which works unless the namespace is
+ * defined later in the same tag.
  *
  * With this long a comment, you're sure to realize this is a tricky
  * part, right?
@@ -471,18 +622,19 @@ xi_insert_attribs_extract (xi_parse_t *parsep, pa_atom_t node_atom,
 {
     xi_insert_t *xip = parsep->xp_insert;
     xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
-    pa_arb_t *prp = xwp->xw_textpool;
     size_t len = strlen(attrib);
     char *content = attrib, *endp = content + len, *name, *value;
     size_t namelen, valuelen;
-    pa_atom_t name_atom, value_atom, attrib_atom, stash_atom;
+    pa_atom_t name_atom, value_atom, attrib_atom;
     int hit = FALSE;
     const char *msg;
     pa_atom_t *last_nsp = &nodep->xn_contents; /* XXX For freshly made node */
+    xi_attrib_prefix_t pending[XI_ATTRIB_PREFIX_MAX];
+    unsigned i, num_pending = 0;
 
     for (;;) {
-	msg = xi_parse_next_attrib(&content, endp, &name, &namelen,
-				   &value, &valuelen);
+	msg = xi_source_next_attrib(&content, endp, &name, &namelen,
+				    &value, &valuelen);
 	if (msg) {
 	    xi_source_failure(parsep->xp_srcp, 0, msg);
 	    break;
@@ -525,35 +677,37 @@ xi_insert_attribs_extract (xi_parse_t *parsep, pa_atom_t node_atom,
 					 name, name ? strlen(name) : 0,
 					 node_atom, last_nsp,
 					 XI_TYPE_NS, PA_NULL_ATOM, ns_atom);
-	    if (last_nsp == PA_NULL_ATOM) {
+	    if (last_nsp == NULL) {
 		xi_source_failure(parsep->xp_srcp, 0,
 				  "attribute insert (ns) failed");
 		break;
 	    }
 
+	    /* This mapping shadows any we've cached for the prefix */
+	    xi_ns_map_t *ns_map = xi_ns_map_addr(xwp, ns_atom);
+	    if (ns_map && ns_map->xnm_prefix != PA_NULL_ATOM)
+		xi_parse_prefix_cache_drop(parsep, ns_map->xnm_prefix);
+
 	} else if (only_ns) {
 	    continue;		/* Skip other attributes */
 
 	} else {
-	    char *prefix;
 	    pa_atom_t pref_atom;
 	    char *localp = strchr(name, ':');
 	    if (localp) {
 		*localp++ = '\0';
-		prefix = name;
-		pref_atom = xi_namepool_atom(xwp, prefix, TRUE);
+		pref_atom = xi_parse_name_atom(parsep, name, TRUE);
 	    } else {
 		localp = name;
-		prefix = NULL;
 		pref_atom = PA_NULL_ATOM;
 	    }
 
 	    /* Normal attribute */
-	    name_atom = xi_namepool_atom(xwp, localp, TRUE);
+	    name_atom = xi_parse_name_atom(parsep, localp, TRUE);
 	    if (name_atom == PA_NULL_ATOM)
 		break;
 
-	    value_atom = pa_arb_alloc_string(prp, value);
+	    value_atom = xi_textpool_alloc(xwp, value, valuelen);
 	    if (value_atom == PA_NULL_ATOM)
 		break;
 
@@ -563,27 +717,17 @@ xi_insert_attribs_extract (xi_parse_t *parsep, pa_atom_t node_atom,
 	    if (attrib_atom == PA_NULL_ATOM) {
 		xi_source_failure(parsep->xp_srcp, 0,
 				  "attribute insert failed");
-		pa_arb_free_atom(prp, value_atom);
+		xi_textpool_free(xwp, value_atom);
 		break;
 	    }
 
 	    if (pref_atom != PA_NULL_ATOM) {
-		/*
-		 * We have to stash our prefix atom in a special
-		 * temporary node of type XI_TYPE_NSPREF.  After all
-		 * the attributes are processed and all namespaces
-		 * have been defined, we'll loop thru and set
-		 * real ns_map values.
-		 */
-		stash_atom = xi_insert_node(xip,
-				 "xi_insert_attribs_extract (stash)",
-				 name, strlen(name),
-				 XI_TYPE_NSPREF, PA_NULL_ATOM, pref_atom);
-		if (stash_atom == PA_NULL_ATOM) {
-		    xi_source_failure(parsep->xp_srcp, 0,
-				      "attribute (stash) insert failed");
-		    pa_arb_free_atom(prp, value_atom);
-		    break;
+		if (num_pending < XI_ATTRIB_PREFIX_MAX) {
+		    pending[num_pending].xap_atom = attrib_atom;
+		    pending[num_pending].xap_prefix = pref_atom;
+		    num_pending += 1;
+		} else {
+		    xi_insert_attrib_ns(parsep, nodep, attrib_atom, pref_atom);
 		}
 	    }
 	}
@@ -592,50 +736,12 @@ xi_insert_attribs_extract (xi_parse_t *parsep, pa_atom_t node_atom,
     }
 
     /*
-     * We've parse namespaces as part of the attribute handling, so
-     * now we have to use them.  When we find an XI_TYPE_NSPREF
-     * attribute, the xn_contents are the atom of a prefix string.  We
-     * finish that off, finding the real mapping and recording it,
-     * discarding the NSPREF node.
+     * We've parsed namespaces as part of the attribute handling, so
+     * now we can use them to map the prefixes we put aside.
      */
-    xi_node_t *childp, *prev = NULL;
-    pa_atom_t ns_atom;
-
-    for (childp = xi_node_addr(xwp, nodep->xn_contents); childp;
-	 childp = xi_node_addr(xwp, childp->xn_next)) {
-	if (nodep->xn_type == XI_TYPE_NS) {
-	    /* Skip namespace defs */
-
-	} else if (!xi_parse_is_attrib(nodep->xn_type)) {
-	    break;		/* End of attributes == done */
-
-	} else if (prev == NULL) {
-	    /* Can't handle not having a previous node */
-
-	} else if (childp->xn_type == XI_TYPE_NSPREF) {
-	    /*
-	     * An XI_TYPE_NSPREF node means the previous node needs an
-	     * accurate name mapping.  We'll find one and discard the
-	     * current node.
-	     */
-	    ns_atom = xi_parse_find_ns_atom(parsep, nodep, childp->xn_contents);
-	    if (ns_atom == PA_NULL_ATOM) {
-		const char *prefix = xi_namepool_string(xwp, childp->xn_contents);
-		xi_source_failure(parsep->xp_srcp, 0,
-				  "namespace mapping not found for %s:%s",
-				  prefix ?: "", name);
-	    }
-
-	    /* Set the namespace mapping */
-	    prev->xn_ns_map = ns_atom; /* Assign mapping */
-	    prev->xn_next = childp->xn_next; /* Remove node from list */
-
-	    xi_node_free(xwp, prev->xn_next); /* Free node */
-	    childp = prev;		   /* childp is dead; resume logic */
-	}
-
-	prev = childp;
-    }
+    for (i = 0; i < num_pending; i++)
+	xi_insert_attrib_ns(parsep, nodep, pending[i].xap_atom,
+			    pending[i].xap_prefix);
 
     /* Mark the attributes as present and extracted */
     if (hit)
@@ -659,7 +765,8 @@ xi_insert_open (xi_parse_t *parsep, pa_atom_t name_atom,
     if (node_atom == PA_NULL_ATOM)
 	return;
 
-    xi_node_t *nodep = xi_node_addr(xip->xi_tree->xt_workspace, node_atom);
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
+    xi_node_t *nodep = xi_node_addr(xwp, node_atom);
 
     /* Push our node on the stack */
     xi_insert_push(xip, node_atom, nodep);
@@ -698,11 +805,14 @@ xi_insert_open (xi_parse_t *parsep, pa_atom_t name_atom,
     }
 
     if (prefix != NULL) {
-	nodep->xn_ns_map = xi_parse_find_ns(parsep, nodep, prefix);
-	if (nodep->xn_ns_map == PA_NULL_ATOM)
+	pa_atom_t ns_map = xi_parse_find_ns(parsep, nodep, prefix);
+	if (ns_map == PA_NULL_ATOM)
 	    xi_source_failure(parsep->xp_srcp, 0,
 			      "namespace mapping not found for %s:%s",
 			      prefix, name);
+	else if (xi_node_set_ns_map(xwp, nodep, ns_map))
+	    xi_source_failure(parsep->xp_srcp, 0,
+			      "too many namespace mappings for compact nodes");
     }
 }
 
@@ -712,8 +822,8 @@ xi_insert_close (xi_parse_t *parsep, const char *prefix UNUSED, const char *name
     xi_insert_t *xip = parsep->xp_insert;
     pa_atom_t name_atom;
 
-    name_atom = xi_namepool_atom(xip->xi_tree->xt_workspace, name, FALSE);
-    
+    name_atom = xi_parse_name_atom(parsep, name, FALSE);
+
     slaxLog("xi_insert_close: [%s] %u (depth %u)", name, name_atom,
 	   xip->xi_depth);
 
@@ -734,11 +844,17 @@ xi_insert_close (xi_parse_t *parsep, const char *prefix UNUSED, const char *name
 			      "close doesn't match original: %s", name);
 	    return;
 	}
-    } else if (xsp->xs_node->xn_name != name_atom) {
+    } else if (xi_node_name(xip->xi_tree->xt_workspace,
+			    xsp->xs_node) != name_atom) {
 	xi_source_failure(parsep->xp_srcp, 0, "close doesn't match: %s", name);
 	return;
     }
 
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_EXTENTS)
+	    && xi_node_set_extent(xip->xi_tree->xt_workspace, xsp->xs_atom,
+				  xip->xi_last_atom))
+	slaxLog("xi_insert_close: extent failed");
+
     bzero(xsp, sizeof(*xsp));
     xi_insert_pop(xip);
 }
@@ -748,26 +864,27 @@ xi_insert_text (xi_parse_t *parsep, const char *data, size_t len,
 		xi_node_type_t type)
 {
     xi_insert_t *xip = parsep->xp_insert;
-    pa_arb_t *prp = xip->xi_tree->xt_workspace->xw_textpool;
-    pa_atom_t data_atom = pa_arb_alloc(prp, len + 1);
-    char *cp = pa_arb_atom_addr(prp, data_atom);
+    xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
+    pa_atom_t data_atom = xi_textpool_alloc(xwp, data, len);
 
-    if (cp == NULL)
+    if (data_atom == PA_NULL_ATOM)
 	return;
 
-    memcpy(cp, data, len);
-    cp[len] = '\0';
-
     pa_atom_t node_atom;
     node_atom = xi_insert_node(xip, "xi_insert_text", data, len,
 			       type, PA_NULL_ATOM, data_atom);
     if (node_atom == PA_NULL_ATOM) {
-	pa_arb_free_atom(prp, data_atom);
+	xi_textpool_free(xwp, data_atom);
 	return;
     }
 }
 
-static void
+/*
+ * Perform the action for a rule on an open tag.  Returns FALSE if
+ * the element was discarded (XIA_DISCARD), in which case nothing was
+ * pushed on the insertion stack.
+ */
+static xi_boolean_t
 xi_parse_handle_rule (xi_parse_t *parsep, pa_atom_t name_atom,
 		      const char *prefix UNUSED, const char *name,
 		      char *attribs, xi_rule_t *xrp)
@@ -782,21 +899,298 @@ xi_parse_handle_rule (xi_parse_t *parsep, pa_atom_t name_atom,
 	name_atom = use_tag;
 
     switch (act) {
+    case XIA_EMIT:
+	/*
+	 * When building a tree, the tree is our output, so an
+	 * element we'd emit is one we save, attributes and all.
+	 */
+	act = XIA_SAVE_ATTRIB;
+	/* FALLTHRU */
+
     case XIA_SAVE:
     case XIA_SAVE_ATSTR:
     case XIA_SAVE_ATTRIB:
 	xi_insert_open(parsep, name_atom, prefix, name, attribs, act);
 	break;
 
-    case XIA_EMIT:
     case XIA_DISCARD:
-	/* XXX */
-	break;
+	return FALSE;
     }
 
-    if (use_tag) {
-	xi_istack_t *xsp = &xip->xi_stack[xip->xi_depth];
+    xi_istack_t *xsp = &xip->xi_stack[xip->xi_depth];
+    if (use_tag)
 	xsp->xs_old_name = save_name_atom;
+
+    /* The rule can move our contents into a different state */
+    if (xrp->xr_new_state != XI_STATE_EOL && parsep->xp_rulebook)
+	xsp->xs_statep = xi_rulebook_state(parsep->xp_rulebook,
+					   xrp->xr_new_state);
+
+    return TRUE;
+}
+
+/*
+ * Skip a token inside a discarded element, tracking the nesting so
+ * we know when the discarded element closes.  Returns FALSE for the
+ * tokens (EOF and failures) that the main loop must still see.
+ */
+static inline xi_boolean_t
+xi_parse_discard_token (xi_parse_t *parsep, xi_node_type_t type)
+{
+    switch (type) {
+    case XI_TYPE_NONE:
+    case XI_TYPE_EOF:
+    case XI_TYPE_FAIL:
+	return FALSE;
+
+    case XI_TYPE_OPEN:
+	parsep->xp_discard += 1;
+	break;
+
+    case XI_TYPE_CLOSE:
+	parsep->xp_discard -= 1;
+	break;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Fetch the next token, either from the source or, for parallel
+ * parsing, from the chunks that were tokenized up front.  Building
+ * the tree stays serial, since the workspace allocators aren't
+ * thread-safe, but the tokenizing (which is most of the work) isn't.
+ */
+static inline xi_node_type_t
+xi_parse_next_token (xi_parse_t *parsep, char **datap, char **restp)
+{
+    if (parsep->xp_split)
+	return xi_split_next_token(parsep->xp_split, datap, restp);
+
+    return xi_source_next_token(parsep->xp_srcp, datap, restp);
+}
+
+/*
+ * Fill in a stamp describing our source file.  Returns FALSE if the
+ * source isn't something we can identify (a pipe, say).
+ */
+static xi_boolean_t
+xi_parse_stamp_source (xi_parse_t *parsep, xi_tree_stamp_t *stampp)
+{
+    xi_source_t *srcp = parsep->xp_srcp;
+    struct stat st;
+
+    if (srcp == NULL || fstat(srcp->xps_fd, &st) < 0 || !S_ISREG(st.st_mode))
+	return FALSE;
+
+    bzero(stampp, sizeof(*stampp));
+    stampp->xts_dev = st.st_dev;
+    stampp->xts_ino = st.st_ino;
+    stampp->xts_size = st.st_size;
+#if HAVE_MTIMESPEC
+    stampp->xts_mtime_sec = st.st_mtimespec.tv_sec;
+    stampp->xts_mtime_nsec = st.st_mtimespec.tv_nsec;
+#else /* HAVE_MTIMESPEC */
+    stampp->xts_mtime_sec = st.st_mtime;
+#endif /* HAVE_MTIMESPEC */
+    stampp->xts_flags = srcp->xps_flags;
+
+    return TRUE;
+}
+
+/*
+ * Look for a tree parsed from this same source in our mmap segment
+ * (which the caller opened from a file).  If we find one, we throw
+ * away the empty root xi_parse_open() made and use the cached tree.
+ * Otherwise we invalidate the stamp and let xi_parse() build the
+ * tree, stamping it when it reaches EOF.  The name index and extents
+ * live in memory, so we don't cache trees that want them.  Note that
+ * a stale tree isn't reclaimed; its nodes stay in the segment.
+ */
+
+/*
+ * Does the segment's stamp match our source's (in 'curp')?  If so,
+ * return the cached root node.
+ */
+static xi_node_t *
+xi_parse_cache_match (xi_parse_t *parsep, xi_tree_stamp_t *curp)
+{
+    xi_tree_t *xtp = parsep->xp_insert->xi_tree;
+    xi_tree_stamp_t *stampp = &xtp->xt_infop->xti_stamp;
+    xi_node_t *nodep;
+
+    curp->xts_root = stampp->xts_root;
+    if (curp->xts_root == PA_NULL_ATOM
+	    || memcmp(curp, stampp, sizeof(*curp)) != 0)
+	return NULL;
+
+    nodep = xi_node_addr(xtp->xt_workspace, curp->xts_root);
+    return (nodep && nodep->xn_type == XI_TYPE_ROOT) ? nodep : NULL;
+}
+
+xi_boolean_t
+xi_parse_cache_current (xi_parse_t *parsep)
+{
+    xi_tree_stamp_t cur;
+
+    if (parsep->xp_insert->xi_tree->xt_infop == NULL
+	    || !xi_parse_stamp_source(parsep, &cur))
+	return FALSE;
+
+    return xi_parse_cache_match(parsep, &cur) ? TRUE : FALSE;
+}
+
+static xi_boolean_t
+xi_parse_cache_attach (xi_parse_t *parsep)
+{
+    xi_insert_t *xip = parsep->xp_insert;
+    xi_tree_t *xtp = xip->xi_tree;
+    xi_workspace_t *xwp = xtp->xt_workspace;
+    xi_tree_stamp_t *stampp = &xtp->xt_infop->xti_stamp;
+    xi_tree_stamp_t cur;
+    xi_node_t *nodep;
+
+    parsep->xp_flags &= ~XI_PF_CACHE;
+
+    if (parsep->xp_flags & (XI_PF_NAME_INDEX | XI_PF_EXTENTS))
+	return FALSE;
+
+    if (!xi_parse_stamp_source(parsep, &cur))
+	return FALSE;
+
+    nodep = xi_parse_cache_match(parsep, &cur);
+    if (nodep) {
+	xi_node_free(xwp, xtp->xt_root);
+
+	xtp->xt_root = cur.xts_root;
+	xip->xi_stack[0].xs_atom = cur.xts_root;
+	xip->xi_stack[0].xs_node = nodep;
+
+	parsep->xp_flags |= XI_PF_CACHED;
+	return TRUE;
+    }
+
+    /* Invalidate the stamp until we've parsed the whole thing */
+    cur.xts_root = PA_NULL_ATOM;
+    *stampp = cur;
+    parsep->xp_flags |= XI_PF_CACHE_FILL;
+
+    return FALSE;
+}
+
+/*
+ * Save what we need to resume parsing a growing file, in the workspace
+ */
+static void
+xi_parse_resume_save (xi_parse_t *parsep)
+{
+    xi_insert_t *xip = parsep->xp_insert;
+    xi_tree_t *xtp = xip->xi_tree;
+    pa_mmap_t *pmp = xtp->xt_workspace->xw_mmap;
+    xi_source_t *srcp = parsep->xp_srcp;
+    xi_resume_info_t *xrip;
+    xi_tree_stamp_t stamp;
+    xi_istack_t *xsp;
+    xi_resume_frame_t *xrfp;
+    unsigned i;
+
+    if (!xi_parse_stamp_source(parsep, &stamp))
+	return;
+
+    if (pa_mmap_is_null(xtp->xt_infop->xti_resume)) {
+	xtp->xt_infop->xti_resume = pa_mmap_alloc(pmp, sizeof(*xrip));
+	if (pa_mmap_is_null(xtp->xt_infop->xti_resume))
+	    return;
+    }
+
+    xrip = pa_mmap_addr(pmp, xtp->xt_infop->xti_resume);
+    if (xrip == NULL)
+	return;
+
+    bzero(xrip, sizeof(*xrip));
+    xrip->xri_dev = stamp.xts_dev;
+    xrip->xri_ino = stamp.xts_ino;
+    xrip->xri_offset = srcp->xps_offset;
+    xrip->xri_lineno = srcp->xps_lineno;
+    xrip->xri_root = xtp->xt_root;
+    xrip->xri_last_atom = xip->xi_last_atom;
+    xrip->xri_depth = xip->xi_depth;
+    xrip->xri_maxdepth = xip->xi_maxdepth;
+
+    for (i = 0; i <= xip->xi_depth; i++) {
+	xsp = &xip->xi_stack[i];
+	xrfp = &xrip->xri_stack[i];
+
+	xrfp->xrf_atom = xsp->xs_atom;
+	xrfp->xrf_last_atom = xsp->xs_last_atom;
+	xrfp->xrf_old_name = xsp->xs_old_name;
+	xrfp->xrf_state = xsp->xs_statep ? xsp->xs_statep->xrbs_id
+	    : XI_STATE_EOL;
+	xrfp->xrf_action = xsp->xs_action;
+    }
+}
+
+/*
+ * Look for a tree we paused while following this same file.  If the
+ * file hasn't been replaced or truncated, we throw away the empty
+ * root xi_parse_open() made, restore the insertion stack, and seek
+ * past the input we've already seen.  The rulebook (if any) must be
+ * set before we're called, since the stack records state numbers.
+ */
+static void
+xi_parse_resume_attach (xi_parse_t *parsep)
+{
+    xi_insert_t *xip = parsep->xp_insert;
+    xi_tree_t *xtp = xip->xi_tree;
+    xi_workspace_t *xwp = xtp->xt_workspace;
+    xi_resume_info_t *xrip;
+    xi_tree_stamp_t stamp;
+    xi_istack_t *xsp;
+    xi_resume_frame_t *xrfp;
+    xi_node_t *nodep;
+    unsigned i;
+
+    /* The name index and extents live in memory, so they'd be lost */
+    if (parsep->xp_flags & (XI_PF_NAME_INDEX | XI_PF_EXTENTS))
+	return;
+
+    xrip = pa_mmap_addr(xwp->xw_mmap, xtp->xt_infop->xti_resume);
+    if (xrip == NULL || !xi_parse_stamp_source(parsep, &stamp))
+	return;
+
+    if (xrip->xri_dev != stamp.xts_dev || xrip->xri_ino != stamp.xts_ino
+	    || xrip->xri_offset > stamp.xts_size
+	    || xrip->xri_depth >= XI_DEPTH_MAX)
+	return;
+
+    nodep = xi_node_addr(xwp, xrip->xri_root);
+    if (nodep == NULL || nodep->xn_type != XI_TYPE_ROOT)
+	return;
+
+    if (xi_source_seek(parsep->xp_srcp, xrip->xri_offset,
+		       xrip->xri_lineno) < 0)
+	return;
+
+    xi_node_free(xwp, xtp->xt_root);
+    xtp->xt_root = xrip->xri_root;
+
+    xip->xi_last_atom = xrip->xri_last_atom;
+    xip->xi_depth = xrip->xri_depth;
+    xip->xi_maxdepth = xrip->xri_maxdepth;
+
+    for (i = 0; i <= xip->xi_depth; i++) {
+	xsp = &xip->xi_stack[i];
+	xrfp = &xrip->xri_stack[i];
+
+	xsp->xs_atom = xrfp->xrf_atom;
+	xsp->xs_node = xi_node_addr(xwp, xrfp->xrf_atom);
+	xsp->xs_last_atom = xrfp->xrf_last_atom;
+	xsp->xs_last_node = xi_node_addr(xwp, xrfp->xrf_last_atom);
+	xsp->xs_old_name = xrfp->xrf_old_name;
+	xsp->xs_action = xrfp->xrf_action;
+	xsp->xs_statep = (parsep->xp_rulebook
+			  && xrfp->xrf_state != XI_STATE_EOL)
+	    ? xi_rulebook_state(parsep->xp_rulebook, xrfp->xrf_state) : NULL;
     }
 }
 
@@ -807,38 +1201,103 @@ xi_parse (xi_parse_t *parsep)
     char *data, *rest, *localp;
     xi_node_type_t type;
     xi_boolean_t opt_quiet = PSU_BIT_TEST(parsep->xp_flags, XI_PF_DEBUG);
-    xi_boolean_t opt_unescape = 0;
+    xi_boolean_t opt_unescape
+	= PSU_BIT_TEST(parsep->xp_flags, XI_PF_UNESCAPE);
+    size_t len;
     pa_atom_t name_atom;
     xi_rule_t *rulep;
     xi_insert_t *xip = parsep->xp_insert;
 
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_CACHE))
+	xi_parse_cache_attach(parsep);
+
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_CACHED))
+	return 0;
+
+    /*
+     * When following a growing file, our first call looks for a
+     * paused tree to resume, and later ones pick up where the last
+     * one paused.
+     */
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_FOLLOW)) {
+	srcp->xps_flags |= XPSF_FOLLOW;
+
+	if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_FOLLOWING))
+	    xi_source_follow(srcp);
+	else
+	    xi_parse_resume_attach(parsep);
+
+	parsep->xp_flags |= XI_PF_FOLLOWING;
+    }
+
+    /* Splitting needs the whole input, so we can't follow it */
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_PARALLEL)
+	    && !PSU_BIT_TEST(parsep->xp_flags, XI_PF_FOLLOW)
+	    && parsep->xp_split == NULL)
+	parsep->xp_split = xi_split_create(srcp, 0);
+
+    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_NAME_INDEX)
+	    && !PSU_BIT_TEST(parsep->xp_flags, XI_PF_INDEXING)) {
+	xi_workspace_t *xwp = xip->xi_tree->xt_workspace;
+
+	if (xwp->xw_name_index == NULL)
+	    xwp->xw_name_index = xi_name_index_create(xwp);
+
+	if (xwp->xw_name_index) {
+	    xi_name_index_add_tree(xwp->xw_name_index, xip->xi_tree->xt_root);
+	    parsep->xp_flags |= XI_PF_INDEXING;
+	}
+    }
+
     for (;;) {
 
-	type = xi_source_next_token(srcp, &data, &rest);
+	type = xi_parse_next_token(parsep, &data, &rest);
+
+	/* Inside a discarded element, nothing gets near the tree */
+	if (parsep->xp_discard && xi_parse_discard_token(parsep, type))
+	    continue;
 
 	switch (type) {
 	case XI_TYPE_NONE:	/* Unknown type */
 	    return 1;
 
 	case XI_TYPE_EOF:	/* End of file */
+	    /* The root's subtree is everything we've inserted */
+	    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_EXTENTS)
+		    && xi_node_set_extent(xip->xi_tree->xt_workspace,
+					  xip->xi_tree->xt_root,
+					  xip->xi_last_atom))
+		slaxLog("xi_parse: extent failed");
+
+	    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_FOLLOW))
+		xi_parse_resume_save(parsep);
+
+	    if (PSU_BIT_TEST(parsep->xp_flags, XI_PF_CACHE_FILL)) {
+		xip->xi_tree->xt_infop->xti_stamp.xts_root
+		    = xip->xi_tree->xt_root;
+		parsep->xp_flags &= ~XI_PF_CACHE_FILL;
+	    }
 	    return 0;
 
 	case XI_TYPE_FAIL:	/* Failure mode */
 	    return -1;
 
 	case XI_TYPE_TEXT:	/* Text content */
-	    type = XI_TYPE_UNESC; /* UNESC (aka CDATA) is unescaped text */
-	    if (!opt_quiet) {
-		int len;
-		if (opt_unescape && data && rest) {
-		    len = xi_source_unescape(srcp, data, rest - data);
-		    type = XI_TYPE_TEXT; /* TEXT is escaped */
-		} else {
-		    len = rest - data;
-		}
-		slaxLog("text [%.*s] (%u)", len, data, type);
+	    /*
+	     * By default we keep text in its original form (UNESC,
+	     * meaning "not unescaped"), so it can be written back out
+	     * untouched.  With XI_PF_UNESCAPE, we decode the entities
+	     * and store it as TEXT, which the emitter escapes again.
+	     */
+	    type = XI_TYPE_UNESC;
+	    len = rest - data;
+	    if (opt_unescape && data && rest) {
+		len = xi_source_unescape(srcp, data, len);
+		type = XI_TYPE_TEXT;
 	    }
-	    xi_insert_text(parsep, data, rest - data, type);
+	    if (!opt_quiet)
+		slaxLog("text [%.*s] (%u)", (int) len, data, type);
+	    xi_insert_text(parsep, data, len, type);
 	    break;
 
 	case XI_TYPE_OPEN:	/* Open tag */
@@ -854,8 +1313,7 @@ xi_parse (xi_parse_t *parsep)
 	    }
 
 	    /* We need an atom to do the indexing to find rules */
-	    name_atom = xi_namepool_atom(xip->xi_tree->xt_workspace,
-					 localp, TRUE);
+	    name_atom = xi_parse_name_atom(parsep, localp, TRUE);
 
 	    /*
 	     * We've got incoming data; find out what to do with it
@@ -869,15 +1327,23 @@ xi_parse (xi_parse_t *parsep)
 	     * No rule (or no rulebook) means use the default rule, which
 	     * will likely make us save everything, just in case.
 	     */
+	    if (rulep == NULL && statep && statep->xrbs_default_rule)
+		rulep = xi_rulebook_rule(parsep->xp_rulebook,
+					 statep->xrbs_default_rule);
 	    if (rulep == NULL)
 		rulep = &parsep->xp_default_rule;
 
 	    /*
 	     * This is where the real work is done, performing any
-	     * action described in the rule.
+	     * action described in the rule.  A discarded open tag
+	     * means skipping tokens until its close.
 	     */
-	    xi_parse_handle_rule(parsep, name_atom, data, localp,
-				 rest, rulep);
+	    if (!xi_parse_handle_rule(parsep, name_atom, data, localp,
+				      rest, rulep)) {
+		if (type == XI_TYPE_OPEN)
+		    parsep->xp_discard = 1;
+		break;
+	    }
 
 	    /*
 	     * An empty tag is an open and a close, since we've already
@@ -959,8 +1425,8 @@ xi_node_dump (xi_workspace_t *xwp, xi_node_type_t op,
     if (nodep == NULL)
 	return;
 
-    const char *name = xi_namepool_string(xwp, nodep->xn_name);
-    xi_ns_map_t *ns_map = xi_ns_map_addr(xwp, nodep->xn_ns_map);
+    const char *name = xi_namepool_string(xwp, xi_node_name(xwp, nodep));
+    xi_ns_map_t *ns_map = xi_ns_map_addr(xwp, xi_node_ns_map(xwp, nodep));
     const char *pref = ns_map ?
 	xi_namepool_string(xwp, ns_map->xnm_prefix) : NULL;
     const char *uri = ns_map ? xi_namepool_string(xwp, ns_map->xnm_uri) : NULL;
@@ -974,9 +1440,10 @@ xi_node_dump (xi_workspace_t *xwp, xi_node_type_t op,
 	    "ns-map %u [%s]=[%s], next %u, contents %u",
 	    (op > 0) ? "Op: " : "", (op > 0) ? opname : "",
 	    (op > 0) ? ", " : "",
-	    atom, nodep, nodep->xn_type, type, nodep->xn_name, name ?: "",
+	    atom, nodep, nodep->xn_type, type, xi_node_name(xwp, nodep),
+	    name ?: "",
 	    nodep->xn_depth, nodep->xn_flags,
-	    nodep->xn_ns_map, pref ?: "", uri ?: "", 
+	    xi_node_ns_map(xwp, nodep), pref ?: "", uri ?: "", 
 	    nodep->xn_next, nodep->xn_contents);
 }
 
@@ -998,8 +1465,8 @@ xi_parse_dump_cb (xi_parse_t *parsep, xi_node_type_t type,
 
     case XI_TYPE_ELT:
 	slaxLog("element: [%s]", data ?: "[error]");
-	if (nodep->xn_ns_map != PA_NULL_ATOM) {
-	    ns_map = xi_ns_map_addr(xwp, nodep->xn_ns_map);
+	if (xi_node_ns_map(xwp, nodep) != PA_NULL_ATOM) {
+	    ns_map = xi_ns_map_addr(xwp, xi_node_ns_map(xwp, nodep));
 	    if (ns_map != NULL) {
 		const char *pref = xi_namepool_string(xwp, ns_map->xnm_prefix);
 		const char *uri = xi_namepool_string(xwp, ns_map->xnm_uri);
@@ -1020,7 +1487,7 @@ xi_parse_dump_cb (xi_parse_t *parsep, xi_node_type_t type,
 	break;
 
     case XI_TYPE_ATTRIB:
-	cp = xi_parse_namepool_string(parsep, nodep->xn_name);
+	cp = xi_parse_namepool_string(parsep, xi_node_name(xwp, nodep));
 	slaxLog("attrib: [%s=\"%s\"]", cp, data);
 	break;
 
@@ -1063,53 +1530,81 @@ xi_parse_dump (xi_parse_t *parsep)
 }
 
 typedef struct xi_xml_output_s {
-    FILE *xx_out;		/* Output file descriptor */
+    xi_writer_t *xx_writer;	/* Where our output goes */
     unsigned xx_indent;		/* Current indent amount */
     unsigned xx_incr;		/* Indent increment */
     xi_node_type_t xx_last_type; /* Last type seen */
 } xi_xml_output_t;
 
+/*
+ * Write an element's (or attribute's) prefix and colon, if it has one
+ */
+static void
+xi_parse_emit_xml_prefix (xi_writer_t *out, xi_workspace_t *xwp,
+			  xi_node_t *nodep)
+{
+    xi_ns_map_t *ns_map;
+    const char *pref;
+
+    if (xi_node_ns_map(xwp, nodep) == PA_NULL_ATOM)
+	return;
+
+    ns_map = xi_ns_map_addr(xwp, xi_node_ns_map(xwp, nodep));
+    if (ns_map == NULL)
+	return;
+
+    pref = xi_namepool_string(xwp, ns_map->xnm_prefix);
+    if (pref) {
+	xi_writer_puts(out, pref);
+	xi_writer_putc(out, ':');
+    }
+}
+
+/*
+ * Text and attribute values come from the tree, which won't change
+ * while we're emitting it, so we can let the writer reference them.
+ * XI_TYPE_TEXT has been unescaped (XI_PF_UNESCAPE) and needs to be
+ * escaped again, but XI_TYPE_UNESC is still in its original (escaped)
+ * form.  Attribute values are also in their original form, but might
+ * have been quoted with apostrophes, so we escape any double quotes
+ * (and stray '<'s), leaving existing entities alone.  Namespace URIs
+ * come from attributes, so they get the same treatment.
+ */
 static int
 xi_parse_emit_xml_cb (xi_parse_t *parsep, xi_node_type_t type,
 		      pa_atom_t node_atom UNUSED, xi_node_t *nodep,
 		      const char *data, void *opaque)
 {
     xi_xml_output_t *xmlp = opaque;
-    FILE *out = xmlp->xx_out;
+    xi_writer_t *out = xmlp->xx_writer;
     xi_workspace_t *xwp = parsep->xp_insert->xi_tree->xt_workspace;
     xi_ns_map_t *ns_map;
     const char *cp;
-    int indent;
     const char *pref, *uri;
 
     switch (type) {
     case XI_TYPE_ROOT:
-	fprintf(out, "<!-- start of output>\n");
+	xi_writer_puts(out, "<!-- start of output>\n");
 	break;
 
     case XI_TYPE_OPEN:
 	if (xmlp->xx_last_type != XI_TYPE_ROOT
 	    && xmlp->xx_last_type != XI_TYPE_CLOSE)
-	    fprintf(out, "\n");
-
-	pref = NULL;
-	if (nodep->xn_ns_map != PA_NULL_ATOM) {
-	    ns_map = xi_ns_map_addr(xwp, nodep->xn_ns_map);
-	    if (ns_map != NULL)
-		pref = xi_namepool_string(xwp, ns_map->xnm_prefix);
-	}
+	    xi_writer_putc(out, '\n');
 
-	fprintf(out, "%*s<%s%s%s", xmlp->xx_indent, "",
-		pref ?: "", pref ? ":" : "", data);
+	xi_writer_indent(out, xmlp->xx_indent);
+	xi_writer_putc(out, '<');
+	xi_parse_emit_xml_prefix(out, xwp, nodep);
+	xi_writer_puts(out, data);
 	xmlp->xx_indent += xmlp->xx_incr;
 	break;
 
     case XI_TYPE_EOL_ATTRIB:
-	fprintf(out, ">");
+	xi_writer_putc(out, '>');
 	break;
 
     case XI_TYPE_EOL_EMPTY:
-	fprintf(out, "/>\n");
+	xi_writer_puts(out, "/>\n");
 	break;
 
     case XI_TYPE_CLOSE:
@@ -1117,35 +1612,40 @@ xi_parse_emit_xml_cb (xi_parse_t *parsep, xi_node_type_t type,
 
 	if (data != NULL) {
 	    if (xmlp->xx_last_type != XI_TYPE_EOL_EMPTY) {
-		pref = NULL;
-
-		if (nodep->xn_ns_map != PA_NULL_ATOM) {
-		    ns_map = xi_ns_map_addr(xwp, nodep->xn_ns_map);
-		    if (ns_map != NULL)
-			pref = xi_namepool_string(xwp, ns_map->xnm_prefix);
-		}
-
-		indent = (xmlp->xx_last_type == XI_TYPE_CLOSE)
-		    ? xmlp->xx_indent : 0;
-		fprintf(out, "%*s</%s%s%s>\n", indent, "",
-			pref ?: "", pref ? ":" : "", data);
+		if (xmlp->xx_last_type == XI_TYPE_CLOSE)
+		    xi_writer_indent(out, xmlp->xx_indent);
+		xi_writer_puts(out, "</");
+		xi_parse_emit_xml_prefix(out, xwp, nodep);
+		xi_writer_puts(out, data);
+		xi_writer_puts(out, ">\n");
 	    }
 	}
 	break;
 
-    case XI_TYPE_TEXT:		/* XXX Text needs to be escaped */
+    case XI_TYPE_TEXT:
+	xi_writer_escape_ref(out, data, strlen(data), XI_WRITER_ESC_TEXT);
+	break;
+
     case XI_TYPE_UNESC:
-	fprintf(out, "%s", data);
+	xi_writer_write_ref(out, data, strlen(data));
 	break;
 
     case XI_TYPE_ATSTR:
-	fprintf(out, " %s", data);
+	xi_writer_putc(out, ' ');
+	xi_writer_write_ref(out, data, strlen(data));
 	break;
 
     case XI_TYPE_ATTRIB:
 	cp = xi_namepool_string(parsep->xp_insert->xi_tree->xt_workspace,
-				     nodep->xn_name);
-	fprintf(out, " %s=\"%s\"", cp, data);
+				     xi_node_name(xwp, nodep));
+	xi_writer_putc(out, ' ');
+	xi_parse_emit_xml_prefix(out, xwp, nodep);
+	xi_writer_puts(out, cp);
+	xi_writer_puts(out, "=\"");
+	if (data)
+	    xi_writer_escape_ref(out, data, strlen(data),
+				 XI_SCAN_LT | XI_SCAN_QUOT);
+	xi_writer_putc(out, '"');
 	break;
 
     case XI_TYPE_NS:
@@ -1153,15 +1653,23 @@ xi_parse_emit_xml_cb (xi_parse_t *parsep, xi_node_type_t type,
 	if (ns_map) {
 	    pref = xi_namepool_string(xwp, ns_map->xnm_prefix);
 	    uri = xi_namepool_string(xwp, ns_map->xnm_uri);
-	    fprintf(out, " xmlns%s%s=\"%s\"",
-		    pref ? ":" : "", pref ?: "", uri ?: "");
+	    xi_writer_puts(out, " xmlns");
+	    if (pref) {
+		xi_writer_putc(out, ':');
+		xi_writer_puts(out, pref);
+	    }
+	    xi_writer_puts(out, "=\"");
+	    if (uri)
+		xi_writer_escape(out, uri, strlen(uri),
+				 XI_SCAN_LT | XI_SCAN_QUOT);
+	    xi_writer_putc(out, '"');
 	} else {
 	    slaxLog("namespace: [null]");
 	}
 	break;
 
     case XI_TYPE_EOF:
-	fprintf(out, "<!-- end of output>\n");
+	xi_writer_puts(out, "<!-- end of output>\n");
 	break;
     }
 
@@ -1169,16 +1677,46 @@ xi_parse_emit_xml_cb (xi_parse_t *parsep, xi_node_type_t type,
     return 0;
 }
 
-void
-xi_parse_emit_xml (xi_parse_t *parsep, FILE *out)
+int
+xi_parse_emit_xml_writer (xi_parse_t *parsep, xi_writer_t *out)
 {
     xi_xml_output_t xml;
 
     bzero(&xml, sizeof(xml));
-    xml.xx_out = out;
+    xml.xx_writer = out;
     xml.xx_incr = 3;
 
     xi_parse_emit(parsep, xi_parse_emit_xml_cb, &xml);
+
+    /* Referenced text must go out while the tree is still ours */
+    xi_writer_flush(out);
+
+    return xi_writer_failed(out) ? -1 : 0;
+}
+
+void
+xi_parse_emit_xml (xi_parse_t *parsep, FILE *out)
+{
+    xi_writer_t *xwrp = xi_writer_open_file(out);
+    if (xwrp == NULL)
+	return;
+
+    xi_parse_emit_xml_writer(parsep, xwrp);
+    xi_writer_close(xwrp);
+}
+
+int
+xi_parse_emit_xml_fd (xi_parse_t *parsep, int fd)
+{
+    xi_writer_t *xwrp = xi_writer_open_fd(fd);
+    if (xwrp == NULL)
+	return -1;
+
+    int rc = xi_parse_emit_xml_writer(parsep, xwrp);
+    if (xi_writer_close(xwrp))
+	rc = -1;
+
+    return rc;
 }
 
 void
@@ -1217,7 +1755,7 @@ xi_parse_emit (xi_parse_t *parsep, xi_parse_emit_fn func, void *opaque)
 
 	/* We're looking at the first step out of layer of hierarchy */
 	if (last_depth && last_depth > nodep->xn_depth) {
-	    cp = xi_namepool_string(xwp, nodep->xn_name);
+	    cp = xi_namepool_string(xwp, xi_node_name(xwp, nodep));
 	    func(parsep, XI_TYPE_CLOSE, node_atom, nodep, cp, opaque);
 	    node_atom = nodep->xn_next;
 	    last_depth = nodep->xn_depth;
@@ -1231,7 +1769,7 @@ xi_parse_emit (xi_parse_t *parsep, xi_parse_emit_fn func, void *opaque)
 	    func(parsep, nodep->xn_type, node_atom, nodep, NULL, opaque);
 
 	} else if (nodep->xn_type == XI_TYPE_ELT) {
-	    cp = xi_namepool_string(xwp, nodep->xn_name);
+	    cp = xi_namepool_string(xwp, xi_node_name(xwp, nodep));
 	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
 
 	    /*
@@ -1257,13 +1795,13 @@ xi_parse_emit (xi_parse_t *parsep, xi_parse_emit_fn func, void *opaque)
 	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
 
 	} else if (nodep->xn_type == XI_TYPE_ATSTR) {
-	    cp = pa_arb_atom_addr(xwp->xw_textpool, nodep->xn_contents);
+	    cp = xi_textpool_string(xwp, nodep->xn_contents);
 	    next_node_atom = nodep->xn_next;
 	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
 	    need_eol_attrib = TRUE;
 
 	} else if (nodep->xn_type == XI_TYPE_ATTRIB) {
-	    cp = pa_arb_atom_addr(xwp->xw_textpool, nodep->xn_contents);
+	    cp = xi_textpool_string(xwp, nodep->xn_contents);
 	    next_node_atom = nodep->xn_next;
 	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
 	    need_eol_attrib = TRUE;
@@ -1285,114 +1823,100 @@ xi_parse_emit (xi_parse_t *parsep, xi_parse_emit_fn func, void *opaque)
     func(parsep, XI_TYPE_EOF, PA_NULL_ATOM, NULL, NULL, opaque);
 }
 
-#if 0
-typedef struct xi_parse_as_source_s {
-    xi_node_type_t xps_type;	/* Current type (XI_TYPE_*) */
-    pa_atom_t xps_atom;		/* Current atom number */
-    pa_atom_t xps_next_atom;	/* Next atom number */
-    xi_node_t *xps_nodep;	/* Current node */
-    const char *xps_string;	/* String value */
-    xi_depth_t xps_last_depth;	/* Previous depth */
-} xi_parse_as_source_t;
-
+void
+xi_parse_as_source_init (xi_parse_as_source_t *datap, pa_atom_t root)
 {
-    xi_parse_as_source_t data;
-
-    for (type = xi_parse_as_source(parsep, xwp, XI_TYPE_INIT, &data);
-	 type != XI_TYPE_EOF;
-	 type = xi_parse_as_source(parsep, xwp, type, &data)) {
-	continue;
-    }
+    bzero(datap, sizeof(*datap));
+    datap->xpas_next = root;
 }
 
+/*
+ * Return the next token from a tree, with the same structure as
+ * xi_parse_emit(), but one call at a time, so the caller drives it.
+ * Each element gives an XI_TYPE_OPEN, its attributes and namespaces,
+ * its children, and an XI_TYPE_CLOSE.
+ */
 xi_node_type_t
-xi_parse_as_source (xi_parse_t *parsep, xi_workspace_t *xwp,
-		    xi_node_type_t type, xi_parse_as_source_t *datap)
+xi_parse_as_source (xi_workspace_t *xwp, xi_parse_as_source_t *datap)
 {
-    if (type == XI_TYPE_INIT) {
-	bzero(datap, sizeof(*datap));
-	datap->xps_atom = parsep->xp_insert->xi_tree->xt_root;
+    xi_node_t *nodep;
+    pa_atom_t atom;
+
+    datap->xpas_string = NULL;
+
+    /* An empty element is closed directly after it's opened */
+    if (datap->xpas_flags & XPASF_CLOSE_PENDING) {
+	datap->xpas_flags &= ~XPASF_CLOSE_PENDING;
+	return XI_TYPE_CLOSE;
     }
-    
-    pa_atom_t node_atom = *datap->xps_atom;
 
-    while (node_atom != PA_NULL_ATOM) {
-	nodep = xi_node_addr(xwp, node_atom);
-	if (nodep == NULL) {
-	    slaxLog("xi_parse_emit sees a null atom!");
-	    break;
-	}
+    for (;;) {
+	atom = datap->xpas_next;
+	if (atom == PA_NULL_ATOM)
+	    return XI_TYPE_EOF;
 
-	/* We're looking at the first step out of layer of hierarchy */
-	if (last_depth && last_depth > nodep->xn_depth) {
-	    cp = xi_namepool_string(xwp, nodep->xn_name);
-	    func(parsep, XI_TYPE_CLOSE, node_atom, nodep, cp, opaque);
-	    node_atom = nodep->xn_next;
-	    last_depth = nodep->xn_depth;
-	    continue;
+	nodep = xi_node_addr(xwp, atom);
+	if (nodep == NULL) {
+	    slaxLog("xi_parse_as_source sees a null atom!");
+	    datap->xpas_next = PA_NULL_ATOM;
+	    return XI_TYPE_FAIL;
 	}
 
-	need_eol_attrib = FALSE; /* Don't need it (yet) */
-
-	if (nodep->xn_type == XI_TYPE_ROOT) {
-	    next_node_atom = nodep->xn_contents ?: nodep->xn_next;
-	    func(parsep, nodep->xn_type, node_atom, nodep, NULL, opaque);
+	datap->xpas_atom = atom;
+	datap->xpas_nodep = nodep;
+	datap->xpas_name = NULL;
 
-	} else if (nodep->xn_type == XI_TYPE_ELT) {
-	    cp = xi_namepool_string(xwp, nodep->xn_name);
-	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
+	/* We're looking at the first step out of layer of hierarchy */
+	if (datap->xpas_last_depth > nodep->xn_depth) {
+	    datap->xpas_last_depth = nodep->xn_depth;
+	    datap->xpas_next = nodep->xn_next;
 
-	    /*
-	     * If an ELT's contents are NULL, then this is an empty ELT.
-	     * Otherwise we follow them to visit the children.  We have
-	     * to handle this case explicitly, since there's not depth
-	     * change to trigger the normal EMPTY logic above.
-	     */
-	    if (nodep->xn_contents == PA_NULL_ATOM) {
-		next_node_atom = nodep->xn_next;
-		func(parsep, XI_TYPE_EOL_EMPTY, node_atom, nodep,
-		     NULL, opaque);
-		func(parsep, XI_TYPE_CLOSE, node_atom, nodep, NULL, opaque);
-	    } else {
-		need_eol_attrib = TRUE;
-		next_node_atom = nodep->xn_contents;
+	    if (nodep->xn_type == XI_TYPE_ROOT) {
+		datap->xpas_next = PA_NULL_ATOM;
+		return XI_TYPE_EOF;
 	    }
 
-	} else if (nodep->xn_type == XI_TYPE_TEXT
-		   || nodep->xn_type == XI_TYPE_UNESC) {
-	    cp = xi_textpool_string(xwp, nodep->xn_contents);
-	    next_node_atom = nodep->xn_next;
-	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
-
-	} else if (nodep->xn_type == XI_TYPE_ATSTR) {
-	    cp = pa_arb_atom_addr(xwp->xw_textpool, nodep->xn_contents);
-	    next_node_atom = nodep->xn_next;
-	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
-	    need_eol_attrib = TRUE;
-
-	} else if (nodep->xn_type == XI_TYPE_ATTRIB) {
-	    cp = pa_arb_atom_addr(xwp->xw_textpool, nodep->xn_contents);
-	    next_node_atom = nodep->xn_next;
-	    func(parsep, nodep->xn_type, node_atom, nodep, cp, opaque);
-	    need_eol_attrib = TRUE;
-
-	} else if (nodep->xn_type == XI_TYPE_NS) {
-	    next_node_atom = nodep->xn_next;
-	    func(parsep, nodep->xn_type, node_atom, nodep, NULL, opaque);
-	    need_eol_attrib = TRUE;
+	    datap->xpas_name = xi_namepool_string(xwp,
+						   xi_node_name(xwp, nodep));
+	    return XI_TYPE_CLOSE;
+	}
 
-	} else {
+	datap->xpas_last_depth = nodep->xn_depth;
+	datap->xpas_next = nodep->xn_next;
+
+	switch (nodep->xn_type) {
+	case XI_TYPE_ROOT:
+	    datap->xpas_next = nodep->xn_contents;
+	    return XI_TYPE_ROOT;
+
+	case XI_TYPE_ELT:
+	    datap->xpas_name = xi_namepool_string(xwp,
+						   xi_node_name(xwp, nodep));
+	    if (nodep->xn_contents == PA_NULL_ATOM)
+		datap->xpas_flags |= XPASF_CLOSE_PENDING;
+	    else
+		datap->xpas_next = nodep->xn_contents;
+	    return XI_TYPE_ELT;
+
+	case XI_TYPE_ATTRIB:
+	    datap->xpas_name = xi_namepool_string(xwp,
+						   xi_node_name(xwp, nodep));
+	    /* FALLTHRU */
+
+	case XI_TYPE_TEXT:
+	case XI_TYPE_UNESC:
+	case XI_TYPE_ATSTR:
+	    datap->xpas_string = xi_textpool_string(xwp, nodep->xn_contents);
+	    return nodep->xn_type;
+
+	case XI_TYPE_NS:
+	    return XI_TYPE_NS;
+
+	default:
 	    slaxLog("unhandled node: %u", nodep->xn_type);
-	    next_node_atom = PA_NULL_ATOM;
 	}
-
-	node_atom = next_node_atom;
-	last_depth = nodep->xn_depth;
     }
-
-    func(parsep, XI_TYPE_EOF, PA_NULL_ATOM, NULL, NULL, opaque);
 }
-#endif
 
 void
 xi_parse_set_rulebook (xi_parse_t *parsep, xi_rulebook_t *rulebook)
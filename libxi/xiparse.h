@@ -12,6 +12,37 @@
 #ifndef LIBSLAX_XI_PARSE_H
 #define LIBSLAX_XI_PARSE_H
 
+/*
+ * Documents use a few dozen names over and over, so each parser keeps
+ * a small direct-mapped cache of name atoms in front of the namepool.
+ * Entries are keyed by a hash of the name's bytes and its length; a
+ * hit is confirmed against the namepool string, which is just an
+ * address calculation, so a collision costs a miss, not a wrong atom.
+ */
+#define XI_NAME_CACHE_SIZE	64 /* Number of entries (power of two) */
+
+typedef struct xi_name_cache_s {
+    uint32_t xnc_hash;		/* Hash of the name */
+    uint32_t xnc_len;		/* Length of the name */
+    pa_atom_t xnc_atom;		/* Atom in the namepool (or PA_NULL_ATOM) */
+} xi_name_cache_t;
+
+/*
+ * Namespace-heavy documents repeat a handful of prefixes on every
+ * element, so we remember where each prefix last resolved: the
+ * mapping, and the element (and stack depth) that declared it.  An
+ * entry is good as long as that element is still open at that depth.
+ * Declaring the prefix again (shadowing it) drops the entry.
+ */
+#define XI_PREFIX_CACHE_SIZE	8 /* Number of entries */
+
+typedef struct xi_prefix_cache_s {
+    pa_atom_t xpc_prefix;	/* Prefix atom (PA_NULL_ATOM if unused) */
+    pa_atom_t xpc_ns_map;	/* Namespace mapping it resolved to */
+    pa_atom_t xpc_owner;	/* Element declaring the mapping */
+    xi_depth_t xpc_depth;	/* Owner's depth on the insertion stack */
+} xi_prefix_cache_t;
+
 /*
  * The state of the parser, meant to be both a handle to parsing
  * functionality as well as a means of restarting parsing.
@@ -22,10 +53,25 @@ typedef struct xi_parse_s {
     xi_rulebook_t *xp_rulebook;	/* Current set of rules */
     xi_rule_t xp_default_rule;	/* Default rule for parsing */
     xi_insert_t *xp_insert;	/* Insertion point */
+    struct xi_split_s *xp_split; /* Pre-tokenized input (XI_PF_PARALLEL) */
+    xi_name_cache_t xp_name_cache[XI_NAME_CACHE_SIZE]; /* Hot names */
+    xi_prefix_cache_t xp_prefix_cache[XI_PREFIX_CACHE_SIZE]; /* Prefixes */
+    unsigned xp_prefix_next;	/* Next xp_prefix_cache slot to replace */
+    unsigned xp_discard;	/* Depth inside a discarded element */
 } xi_parse_t;
 
 /* Flags for xp_flags: */
 #define XI_PF_DEBUG		(1<<0) /* Make some debug output */
+#define XI_PF_PARALLEL		(1<<1) /* Tokenize mmap'd input in parallel */
+#define XI_PF_NAME_INDEX	(1<<2) /* Build a per-name element index */
+#define XI_PF_INDEXING		(1<<3) /* Tree is in the index (internal) */
+#define XI_PF_EXTENTS		(1<<4) /* Record each element's extent */
+#define XI_PF_CACHE		(1<<5) /* Reuse a tree cached in the mmap file */
+#define XI_PF_CACHE_FILL	(1<<6) /* Stamp the tree at EOF (internal) */
+#define XI_PF_CACHED		(1<<7) /* Tree came from the cache (internal) */
+#define XI_PF_FOLLOW		(1<<8) /* Input grows; EOF is only a pause */
+#define XI_PF_FOLLOWING		(1<<9) /* Paused at least once (internal) */
+#define XI_PF_UNESCAPE		(1<<10) /* Store text unescaped (XI_TYPE_TEXT) */
 
 #define XI_STATE_EOL		0 /* Indicates end-of-list/invalid state */
 #define XI_STATE_INITIAL	1 /* Initial parser state */
@@ -60,6 +106,18 @@ xi_parse_emit (xi_parse_t *parsep, xi_parse_emit_fn func, void *opaque);
 void
 xi_parse_emit_xml (xi_parse_t *parsep, FILE *out);
 
+/*
+ * Emit XML straight to a file descriptor, using writev(), or to a
+ * caller's writer (xiwriter.h); both return non-zero on failure.
+ */
+struct xi_writer_s;
+
+int
+xi_parse_emit_xml_fd (xi_parse_t *parsep, int fd);
+
+int
+xi_parse_emit_xml_writer (xi_parse_t *parsep, struct xi_writer_s *out);
+
 void
 xi_parse_set_rulebook (xi_parse_t *parsep, xi_rulebook_t *rulebook);
 
@@ -72,15 +130,75 @@ xi_parse_workspace (xi_parse_t *parsep)
     return parsep->xp_insert->xi_tree->xt_workspace;
 }
 
+/*
+ * Return the root node of the tree we're building
+ */
+static inline pa_atom_t
+xi_parse_root (xi_parse_t *parsep)
+{
+    return parsep->xp_insert->xi_tree->xt_root;
+}
+
+/*
+ * Did xi_parse() find the tree in the cache (XI_PF_CACHE), rather
+ * than parsing the input?
+ */
+static inline xi_boolean_t
+xi_parse_is_cached (xi_parse_t *parsep)
+{
+    return PSU_BIT_TEST(parsep->xp_flags, XI_PF_CACHED);
+}
+
+/*
+ * Does the mmap segment already hold a tree parsed from our source,
+ * as XI_PF_CACHE would find it?  This only looks; nothing changes.
+ */
+xi_boolean_t
+xi_parse_cache_current (xi_parse_t *parsep);
+
 pa_atom_t
 xi_parse_namepool_atom (xi_parse_t *parsep, const char *name);
 
+/*
+ * Find a name atom via the parser's name cache, falling back to the
+ * namepool (and creating the name if 'createp' is set).
+ */
+pa_atom_t
+xi_parse_name_atom (xi_parse_t *parsep, const char *name,
+		    xi_boolean_t createp);
+
 const char *
 xi_parse_namepool_string (xi_parse_t *parsep, pa_atom_t atom);
 
 void
 xi_parse_set_rulebook (xi_parse_t *parsep, xi_rulebook_t *rulebook);
 
+/*
+ * The state of a walk through a tree by xi_parse_as_source()
+ */
+typedef struct xi_parse_as_source_s {
+    pa_atom_t xpas_atom;	/* Node for the current token */
+    xi_node_t *xpas_nodep;	/* Node for the current token (pointer) */
+    pa_atom_t xpas_next;	/* Next node to visit */
+    const char *xpas_name;	/* Name (for elements and attributes) */
+    const char *xpas_string;	/* String value (for text and attributes) */
+    xi_depth_t xpas_last_depth;	/* Previous depth */
+    uint8_t xpas_flags;		/* Flags (XPASF_*) */
+} xi_parse_as_source_t;
+
+/* Flags for xpas_flags */
+#define XPASF_CLOSE_PENDING (1<<0) /* Last token opened an empty element */
+
+void
+xi_parse_as_source_init (xi_parse_as_source_t *datap, pa_atom_t root);
+
+/*
+ * Return the next token of the tree (XI_TYPE_EOF at the end), with
+ * the node, name and string value in 'datap'.
+ */
+xi_node_type_t
+xi_parse_as_source (xi_workspace_t *xwp, xi_parse_as_source_t *datap);
+
 void
 xi_node_dump (xi_workspace_t *xwp, xi_node_type_t op,
 	      xi_node_t *nodep, xi_node_id_t atom);
@@ -29,8 +29,8 @@
 #include <limits.h>
 
 #include "slaxconfig.h"
-#include <libslax/slaxdef.h>
-#include <libslax/slax.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
@@ -127,9 +127,9 @@ xi_rule_bitmap_add (xi_rulebook_t *xrbp, xi_rule_t *xrp, const char *tag)
 	return;
 
     /* We need to allocate a bitmap for this rule, if we haven't already */
-    if (xrp->xr_bitmap == PA_NULL_ATOM) {
+    if (pa_bitmap_is_null(xrp->xr_bitmap)) {
 	xrp->xr_bitmap = pa_bitmap_alloc(xrbp->xrb_bitmaps);
-	if (xrp->xr_bitmap == PA_NULL_ATOM)
+	if (pa_bitmap_is_null(xrp->xr_bitmap))
 	    return;
     }
 
@@ -196,9 +196,9 @@ xi_rulebook_prep_cb (xi_parse_t *parsep, xi_node_type_t type,
 
     switch (type) {
     case XI_TYPE_OPEN:
-	if (nodep->xn_name == prep->xrp_atom_script) {
+	if (xi_node_name(xwp, nodep) == prep->xrp_atom_script) {
 	    slaxLog("prep: open: script: %s", data);
-	} else if (nodep->xn_name == prep->xrp_atom_state) {
+	} else if (xi_node_name(xwp, nodep) == prep->xrp_atom_state) {
 	    slaxLog("prep: open: state: %s", data);
 	    id = GET_ATTRIB(xrp_atom_id);
 	    action = GET_ATTRIB(xrp_atom_action);
@@ -217,6 +217,7 @@ xi_rulebook_prep_cb (xi_parse_t *parsep, xi_node_type_t type,
 	    statep = pa_fixed_element(xrbp->xrb_states, sid);
 	    if (statep) {
 		bzero(statep, sizeof(*statep));
+		statep->xrbs_id = sid;
 
 		/* Set the stack "next" point to the first rule of the state */
 		stackp->xrps_nextp = &statep->xrbs_first_rule;
@@ -241,7 +242,7 @@ xi_rulebook_prep_cb (xi_parse_t *parsep, xi_node_type_t type,
 	    if (sid > xrbp->xrb_infop->xrsi_max_state)
 		xrbp->xrb_infop->xrsi_max_state = sid;
 
-	} else if (nodep->xn_name == prep->xrp_atom_rule) {
+	} else if (xi_node_name(xwp, nodep) == prep->xrp_atom_rule) {
 	    slaxLog("prep: open: rule: %s", data);
 	    tag = GET_ATTRIB(xrp_atom_tag);
 	    action = GET_ATTRIB(xrp_atom_action);
@@ -307,9 +308,134 @@ xi_rulebook_prep (xi_parse_t *input, const char *name)
 
     xi_parse_emit(input, xi_rulebook_prep_cb, &prep);
 
+    if (xi_rulebook_compile(xrbp))
+	slaxLog("rulebook: compile failed; using rule chains");
+
     return xrbp;
 }
 
+static void
+xi_rulebook_dfa_free (xi_rulebook_dfa_t *dfap)
+{
+    if (dfap == NULL)
+	return;
+
+    if (dfap->xrd_columns)
+	free(dfap->xrd_columns);
+    if (dfap->xrd_cells)
+	free(dfap->xrd_cells);
+    free(dfap);
+}
+
+/*
+ * Build the (state x name) table.  The first pass gives a column to
+ * each name that appears in any rule's bitmap; the second fills each
+ * state's row, walking the rule chain in order so that, as with
+ * xi_rulebook_find(), the first matching rule wins.
+ */
+int
+xi_rulebook_compile (xi_rulebook_t *xrbp)
+{
+    xi_state_id_t sid, max_state = xrbp->xrb_infop->xrsi_max_state;
+    pa_bitmap_t *pbp = xrbp->xrb_bitmaps;
+    xi_rulebook_dfa_t *dfap;
+    xi_rstate_t *statep;
+    xi_rule_id_t rid, *cellp;
+    xi_rule_t *xrp;
+    pa_bitnumber_t num;
+    int pass;
+
+    xi_rulebook_dfa_free(xrbp->xrb_dfa);
+    xrbp->xrb_dfa = NULL;
+
+    dfap = calloc(1, sizeof(*dfap));
+    if (dfap == NULL)
+	return -1;
+
+    dfap->xrd_max_state = max_state;
+    dfap->xrd_num_columns = 1;	/* Column zero is "no rule" */
+
+    for (pass = 0; pass < 2; pass++) {
+	if (pass == 1) {
+	    dfap->xrd_cells = calloc((max_state + 1) * dfap->xrd_num_columns,
+				     sizeof(*dfap->xrd_cells));
+	    if (dfap->xrd_cells == NULL)
+		goto fail;
+	}
+
+	for (sid = 1; sid <= max_state; sid++) {
+	    statep = xi_rulebook_state(xrbp, sid);
+	    if (statep == NULL)
+		continue;
+
+	    for (rid = statep->xrbs_first_rule; rid != PA_NULL_ATOM;
+		 rid = xrp->xr_next) {
+		xrp = xi_rulebook_rule(xrbp, rid);
+		if (xrp == NULL)
+		    break;
+
+		if (pa_bitmap_is_null(xrp->xr_bitmap))
+		    continue;
+
+		for (num = pa_bitmap_find_next(pbp, xrp->xr_bitmap,
+					       PA_BITMAP_FIND_START);
+		     num != PA_BITMAP_FIND_DONE;
+		     num = pa_bitmap_find_next(pbp, xrp->xr_bitmap, num)) {
+		    if (pass == 1) {
+			cellp = &dfap->xrd_cells[sid * dfap->xrd_num_columns
+						 + dfap->xrd_columns[num]];
+			if (*cellp == PA_NULL_ATOM)
+			    *cellp = rid; /* First match wins */
+			continue;
+		    }
+
+		    if (num >= dfap->xrd_max_name) {
+			uint32_t max = dfap->xrd_max_name ?: 64;
+			while (max <= num)
+			    max <<= 1;
+
+			xi_rulebook_column_t *cols;
+			cols = realloc(dfap->xrd_columns, max * sizeof(*cols));
+			if (cols == NULL)
+			    goto fail;
+
+			bzero(cols + dfap->xrd_max_name,
+			      (max - dfap->xrd_max_name) * sizeof(*cols));
+			dfap->xrd_columns = cols;
+			dfap->xrd_max_name = max;
+		    }
+
+		    if (dfap->xrd_columns[num] == 0) {
+			if (dfap->xrd_num_columns >= XI_RULEBOOK_MAX_COLUMNS)
+			    goto fail;
+			dfap->xrd_columns[num] = dfap->xrd_num_columns++;
+		    }
+		}
+	    }
+	}
+    }
+
+    slaxLog("rulebook: compiled %u states x %u columns",
+	    max_state, dfap->xrd_num_columns);
+
+    xrbp->xrb_dfa = dfap;
+    return 0;
+
+ fail:
+    xi_rulebook_dfa_free(dfap);
+    return -1;
+}
+
+void
+xi_rulebook_close (xi_rulebook_t *xrbp)
+{
+    if (xrbp == NULL)
+	return;
+
+    xi_rulebook_dfa_free(xrbp->xrb_dfa);
+    free(xrbp);
+}
+
 /*
  * Find the appropriate rule to process incoming data
  */
@@ -328,6 +454,20 @@ xi_rulebook_find (xi_parse_t *parsep UNUSED, xi_rulebook_t *xrbp,
 
     xi_rule_id_t rid;
     xi_rule_t *xrp;
+
+    /* With a compiled table, it's a simple lookup */
+    xi_rulebook_dfa_t *dfap = xrbp->xrb_dfa;
+    if (dfap) {
+	if (statep->xrbs_id > dfap->xrd_max_state
+		|| name_atom >= dfap->xrd_max_name)
+	    return NULL;
+
+	rid = dfap->xrd_cells[statep->xrbs_id * dfap->xrd_num_columns
+			      + dfap->xrd_columns[name_atom]];
+
+	return (rid == PA_NULL_ATOM) ? NULL : xi_rulebook_rule(xrbp, rid);
+    }
+
     for (rid = statep->xrbs_first_rule; rid != PA_NULL_ATOM;
 	 rid = xrp->xr_next) {
 	xrp = xi_rulebook_rule(xrbp, rid);
@@ -439,4 +579,30 @@ xi_rulebook_dump (xi_rulebook_t *xrbp)
 	if (statep->xrbs_default_rule != PA_NULL_ATOM)
 	    xi_rulebook_dump_rule(xrbp, statep->xrbs_default_rule, "default ");
     }
+
+    xi_rulebook_dfa_t *dfap = xrbp->xrb_dfa;
+    if (dfap == NULL)
+	return;
+
+    slaxLog("compiled table: %u states x %u columns",
+	    dfap->xrd_max_state, dfap->xrd_num_columns);
+
+    uint32_t num;
+    const char *str;
+
+    for (sid = 1; sid <= dfap->xrd_max_state; sid++) {
+	for (num = 0; num < dfap->xrd_max_name; num++) {
+	    if (dfap->xrd_columns[num] == 0)
+		continue;
+
+	    rid = dfap->xrd_cells[sid * dfap->xrd_num_columns
+				  + dfap->xrd_columns[num]];
+	    if (rid == PA_NULL_ATOM)
+		continue;
+
+	    str = xi_parse_namepool_string(xrbp->xrb_script, num);
+	    slaxLog("    state %u, name %u (%s): rule %u",
+		    sid, num, str ?: "", rid);
+	}
+    }
 }
@@ -61,6 +61,7 @@ typedef struct xi_rstate_s {
     xi_rule_id_t xrbs_first_rule; /* Number of first rule (in xb_rules) */
     xi_rule_id_t xrbs_default_rule; /* Number of default rule (in xb_rules) */
     uint16_t xrbs_flags;	/* Flags for this state */
+    xi_state_id_t xrbs_id;	/* Our own state number */
 } xi_rstate_t;
 
 /* Flags for xrbs_flags */
@@ -71,6 +72,26 @@ typedef struct xi_rulebook_info_s {
     xi_state_id_t xrsi_max_state;     /* Maximum allocated (seen) state */
 } xi_rulebook_info_t;
 
+/*
+ * The compiled form of a rulebook is a dense table with a row per
+ * state and a column per name mentioned in any rule, where each cell
+ * holds the rule that matches (which gives the action and new
+ * state).  Column zero is for names no rule mentions, so the column
+ * map can stay small and the table is only as wide as the script.
+ * Finding a rule is then two array lookups instead of a walk down
+ * the state's rule chain, testing a bitmap for each rule.
+ */
+typedef uint16_t xi_rulebook_column_t; /* Column in the table */
+#define XI_RULEBOOK_MAX_COLUMNS	(1<<16)	/* Limit on named columns */
+
+typedef struct xi_rulebook_dfa_s {
+    xi_rulebook_column_t *xrd_columns; /* Column number, by name atom */
+    uint32_t xrd_max_name;	/* Number of entries in xrd_columns */
+    uint32_t xrd_num_columns;	/* Number of columns (including zero) */
+    xi_state_id_t xrd_max_state; /* Highest state (row) number */
+    xi_rule_id_t *xrd_cells;	/* Matching rule, by state and column */
+} xi_rulebook_dfa_t;
+
 /*
  * A rule set is an optimized set of rules
  */
@@ -81,6 +102,7 @@ typedef struct xi_rulebook_s {
     pa_fixed_t *xrb_rules;	  /* List of rules (xi_rule_t) */
     pa_fixed_t *xrb_states;	  /* List of states (xi_rule_state_t) */
     pa_bitmap_t *xrb_bitmaps;	  /* Pool of bitmaps */
+    xi_rulebook_dfa_t *xrb_dfa;	  /* Compiled table (if built) */
 } xi_rulebook_t;
 
 static inline xi_rstate_t *
@@ -92,7 +114,7 @@ xi_rulebook_state (xi_rulebook_t *xrbp, xi_state_id_t sid)
 static inline xi_rule_t *
 xi_rulebook_rule (xi_rulebook_t *xrbp, xi_rule_id_t rid)
 {
-    return pa_fixed_atom_addr(xrbp->xrb_rules, rid);
+    return pa_fixed_atom_addr(xrbp->xrb_rules, pa_fixed_atom(rid));
 }
 
 xi_rulebook_t *
@@ -112,10 +134,19 @@ xi_rulebook_find (xi_parse_t *parsep, xi_rulebook_t *xrbp, xi_rstate_t *statep,
 xi_rulebook_t *
 xi_rulebook_prep (xi_parse_t *input, const char *name);
 
+/*
+ * Build the compiled table for a rulebook; xi_rulebook_prep() does
+ * this for us, but it needs redone if rules are added by hand.
+ * Returns zero on success; on failure, xi_rulebook_find() just walks
+ * the rule chains.
+ */
+int
+xi_rulebook_compile (xi_rulebook_t *xrbp);
+
 void
 xi_rulebook_dump (xi_rulebook_t *xrbp);
 
-PA_FIXED_FUNCTIONS(xi_rule_id_t, xi_rule_t, xi_rulebook_t, xrb_rules,
+XI_FIXED_FUNCTIONS(xi_rule_t, xi_rulebook_t, xrb_rules,
 		   xi_rule_alloc, xi_rule_free, xi_rule_addr);
 
 #endif /* LIBSLAX_XI_RULES_H */
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+/*
+ * Structural character scanner.  The tokenizer spends most of its
+ * life looking for the next '<' or '>', counting newlines, and
+ * hunting for '&'.  libc's memchr is fine for a single character,
+ * but we often want several classes at once (or a count of them),
+ * so we build a 64-bit mask per 64-byte block and let the callers
+ * walk the bits.
+ *
+ * Each kernel must produce identical masks; the scalar one is the
+ * reference.  The choice is made once, at first use, by psudispatch,
+ * so PSU_DISPATCH=xi-scan=scalar (or "-avx2") can override it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psucpu.h>
+#include <libpsu/psudispatch.h>
+#include <libxi/xiscan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__SSE2__)
+#define XI_SCAN_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#if defined(__GNUC__)
+#define XI_SCAN_HAVE_AVX2 1
+#include <immintrin.h>
+#endif /* __GNUC__ */
+#endif /* _X86_ */
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define XI_SCAN_HAVE_NEON 1
+#include <arm_neon.h>
+#endif /* __aarch64__ */
+
+typedef uint64_t (*xi_scan_func_t)(const char *cp, xi_scan_class_t classes);
+
+/* Map each byte to its class bit; everything else is zero */
+static const uint8_t xi_scan_table[256] = {
+    ['<'] = XI_SCAN_LT,
+    ['>'] = XI_SCAN_GT,
+    ['&'] = XI_SCAN_AMP,
+    ['"'] = XI_SCAN_QUOT,
+    ['\n'] = XI_SCAN_NL,
+};
+
+static uint64_t
+xi_scan_block_scalar (const char *cp, xi_scan_class_t classes)
+{
+    const uint8_t *up = (const uint8_t *) cp;
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < XI_SCAN_BLOCK; i++)
+	if (xi_scan_table[up[i]] & classes)
+	    mask |= ((uint64_t) 1) << i;
+
+    return mask;
+}
+
+#ifdef XI_SCAN_HAVE_SSE2
+static inline __m128i
+xi_scan_match_sse2 (__m128i v, xi_scan_class_t classes)
+{
+    __m128i m = _mm_setzero_si128();
+
+    if (classes & XI_SCAN_LT)
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    if (classes & XI_SCAN_GT)
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    if (classes & XI_SCAN_AMP)
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+    if (classes & XI_SCAN_QUOT)
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    if (classes & XI_SCAN_NL)
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+    return m;
+}
+
+static uint64_t
+xi_scan_block_sse2 (const char *cp, xi_scan_class_t classes)
+{
+    const __m128i *vp = (const __m128i *) cp;
+    uint64_t m0, m1, m2, m3;
+
+    m0 = (uint16_t) _mm_movemask_epi8(xi_scan_match_sse2(
+				_mm_loadu_si128(vp + 0), classes));
+    m1 = (uint16_t) _mm_movemask_epi8(xi_scan_match_sse2(
+				_mm_loadu_si128(vp + 1), classes));
+    m2 = (uint16_t) _mm_movemask_epi8(xi_scan_match_sse2(
+				_mm_loadu_si128(vp + 2), classes));
+    m3 = (uint16_t) _mm_movemask_epi8(xi_scan_match_sse2(
+				_mm_loadu_si128(vp + 3), classes));
+
+    return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+#endif /* XI_SCAN_HAVE_SSE2 */
+
+#ifdef XI_SCAN_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i
+xi_scan_match_avx2 (__m256i v, xi_scan_class_t classes)
+{
+    __m256i m = _mm256_setzero_si256();
+
+    if (classes & XI_SCAN_LT)
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+    if (classes & XI_SCAN_GT)
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+    if (classes & XI_SCAN_AMP)
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+    if (classes & XI_SCAN_QUOT)
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+    if (classes & XI_SCAN_NL)
+	m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+    return m;
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+xi_scan_block_avx2 (const char *cp, xi_scan_class_t classes)
+{
+    const __m256i *vp = (const __m256i *) cp;
+    uint64_t lo, hi;
+
+    lo = (uint32_t) _mm256_movemask_epi8(xi_scan_match_avx2(
+				_mm256_loadu_si256(vp + 0), classes));
+    hi = (uint32_t) _mm256_movemask_epi8(xi_scan_match_avx2(
+				_mm256_loadu_si256(vp + 1), classes));
+
+    return lo | (hi << 32);
+}
+#endif /* XI_SCAN_HAVE_AVX2 */
+
+#ifdef XI_SCAN_HAVE_NEON
+static inline uint8x16_t
+xi_scan_match_neon (uint8x16_t v, xi_scan_class_t classes)
+{
+    uint8x16_t m = vdupq_n_u8(0);
+
+    if (classes & XI_SCAN_LT)
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('<')));
+    if (classes & XI_SCAN_GT)
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('>')));
+    if (classes & XI_SCAN_AMP)
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('&')));
+    if (classes & XI_SCAN_QUOT)
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+    if (classes & XI_SCAN_NL)
+	m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\n')));
+
+    return m;
+}
+
+/*
+ * NEON has no movemask, so we weight each lane by its bit position
+ * and fold the four vectors together with pairwise adds.
+ */
+static uint64_t
+xi_scan_block_neon (const char *cp, xi_scan_class_t classes)
+{
+    static const uint8_t weights[16] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+    };
+    const uint8_t *up = (const uint8_t *) cp;
+    uint8x16_t bits = vld1q_u8(weights);
+    uint8x16_t m0, m1, m2, m3;
+
+    m0 = vandq_u8(xi_scan_match_neon(vld1q_u8(up + 0), classes), bits);
+    m1 = vandq_u8(xi_scan_match_neon(vld1q_u8(up + 16), classes), bits);
+    m2 = vandq_u8(xi_scan_match_neon(vld1q_u8(up + 32), classes), bits);
+    m3 = vandq_u8(xi_scan_match_neon(vld1q_u8(up + 48), classes), bits);
+
+    m0 = vpaddq_u8(m0, m1);
+    m2 = vpaddq_u8(m2, m3);
+    m0 = vpaddq_u8(m0, m2);
+    m0 = vpaddq_u8(m0, m0);
+
+    return vgetq_lane_u64(vreinterpretq_u64_u8(m0), 0);
+}
+#endif /* XI_SCAN_HAVE_NEON */
+
+/* Listed in order of preference; last one always works */
+static const psu_dispatch_variant_t xi_scan_variants[] = {
+#ifdef XI_SCAN_HAVE_AVX2
+    { "avx2", PSU_CPU_F_AVX2, PSU_DISPATCH_FUNC(xi_scan_block_avx2) },
+#endif /* XI_SCAN_HAVE_AVX2 */
+#ifdef XI_SCAN_HAVE_SSE2
+    { "sse2", PSU_CPU_F_SSE2, PSU_DISPATCH_FUNC(xi_scan_block_sse2) },
+#endif /* XI_SCAN_HAVE_SSE2 */
+#ifdef XI_SCAN_HAVE_NEON
+    { "neon", PSU_CPU_F_NEON, PSU_DISPATCH_FUNC(xi_scan_block_neon) },
+#endif /* XI_SCAN_HAVE_NEON */
+    { "scalar", 0, PSU_DISPATCH_FUNC(xi_scan_block_scalar) },
+    { NULL, 0, NULL }
+};
+
+static psu_dispatch_t xi_scan_dispatch
+    = PSU_DISPATCH_INIT("xi-scan", xi_scan_variants);
+
+static uint64_t xi_scan_block_resolve (const char *, xi_scan_class_t);
+
+/*
+ * The current kernel.  We start with a stub that binds the real one
+ * on first use; the race between threads doing this is benign,
+ * since they'll all get the same answer.
+ */
+static xi_scan_func_t xi_scan_func = xi_scan_block_resolve;
+
+static uint64_t
+xi_scan_block_resolve (const char *cp, xi_scan_class_t classes)
+{
+    xi_scan_func = (xi_scan_func_t) psu_dispatch_bind(&xi_scan_dispatch);
+    return xi_scan_func(cp, classes);
+}
+
+int
+xi_scan_select (const char *name)
+{
+    psu_dispatch_func_t func = psu_dispatch_select(&xi_scan_dispatch, name);
+
+    if (func == NULL)
+	return -1;
+
+    xi_scan_func = (xi_scan_func_t) func;
+    return 0;
+}
+
+const char *
+xi_scan_kernel_name (void)
+{
+    return psu_dispatch_name(&xi_scan_dispatch);
+}
+
+uint64_t
+xi_scan_block (const char *cp, xi_scan_class_t classes)
+{
+    return xi_scan_func(cp, classes);
+}
+
+const char *
+xi_scan_find (const char *cp, size_t len, xi_scan_class_t classes)
+{
+    xi_scan_func_t func = xi_scan_func;
+    uint64_t mask;
+
+    for ( ; len >= XI_SCAN_BLOCK; cp += XI_SCAN_BLOCK, len -= XI_SCAN_BLOCK) {
+	mask = func(cp, classes);
+	if (mask)
+	    return cp + __builtin_ctzll(mask);
+
+	func = xi_scan_func;	/* In case the stub just resolved it */
+    }
+
+    /* Finish the tail a byte at a time */
+    for ( ; len > 0; cp++, len--)
+	if (xi_scan_table[(uint8_t) *cp] & classes)
+	    return cp;
+
+    return NULL;
+}
+
+size_t
+xi_scan_count (const char *cp, size_t len, xi_scan_class_t classes)
+{
+    xi_scan_func_t func = xi_scan_func;
+    size_t count = 0;
+
+    for ( ; len >= XI_SCAN_BLOCK; cp += XI_SCAN_BLOCK, len -= XI_SCAN_BLOCK) {
+	count += __builtin_popcountll(func(cp, classes));
+	func = xi_scan_func;
+    }
+
+    for ( ; len > 0; cp++, len--)
+	if (xi_scan_table[(uint8_t) *cp] & classes)
+	    count += 1;
+
+    return count;
+}
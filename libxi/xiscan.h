@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#ifndef LIBXI_XISCAN_H
+#define LIBXI_XISCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Structural scanner for the tokenizer.  We classify a 64-byte block
+ * of input at a time, returning a bitmask with bit N set if byte N is
+ * one of the requested classes of structural character.  The kernel
+ * used (scalar, SSE2, AVX2, NEON) is picked at runtime, based on
+ * what the CPU can do.
+ */
+
+#define XI_SCAN_BLOCK	64	/* Bytes per block (bits per mask) */
+
+typedef unsigned xi_scan_class_t; /* Classes of characters */
+
+#define XI_SCAN_LT	(1<<0)	/* '<' */
+#define XI_SCAN_GT	(1<<1)	/* '>' */
+#define XI_SCAN_AMP	(1<<2)	/* '&' */
+#define XI_SCAN_QUOT	(1<<3)	/* '"' */
+#define XI_SCAN_NL	(1<<4)	/* '\n' */
+
+#define XI_SCAN_ALL \
+    (XI_SCAN_LT | XI_SCAN_GT | XI_SCAN_AMP | XI_SCAN_QUOT | XI_SCAN_NL)
+
+/*
+ * Return the mask of matching bytes in the XI_SCAN_BLOCK bytes at
+ * 'cp'.  The caller guarantees that all XI_SCAN_BLOCK bytes are
+ * readable; no alignment is required.
+ */
+uint64_t
+xi_scan_block (const char *cp, xi_scan_class_t classes);
+
+/*
+ * Return a pointer to the first byte in (cp, len) that matches any of
+ * 'classes', or NULL if there isn't one.
+ */
+const char *
+xi_scan_find (const char *cp, size_t len, xi_scan_class_t classes);
+
+/*
+ * Return the number of bytes in (cp, len) that match any of 'classes'.
+ */
+size_t
+xi_scan_count (const char *cp, size_t len, xi_scan_class_t classes);
+
+/*
+ * Return the class for a single character, or zero if it isn't one
+ * the scanner knows about.
+ */
+static inline xi_scan_class_t
+xi_scan_class (int ch)
+{
+    switch (ch) {
+    case '<':
+	return XI_SCAN_LT;
+    case '>':
+	return XI_SCAN_GT;
+    case '&':
+	return XI_SCAN_AMP;
+    case '"':
+	return XI_SCAN_QUOT;
+    case '\n':
+	return XI_SCAN_NL;
+    }
+
+    return 0;
+}
+
+/*
+ * Force the use of a particular kernel ("scalar", "sse2", "avx2",
+ * "neon"), mostly for testing.  Passing NULL restores the default
+ * runtime choice (which honors the PSU_DISPATCH environment
+ * variable, using the kernel name "xi-scan").  Returns non-zero if the kernel isn't available,
+ * in which case the current kernel is left unchanged.
+ */
+int
+xi_scan_select (const char *name);
+
+/*
+ * Return the name of the kernel currently in use.
+ */
+const char *
+xi_scan_kernel_name (void);
+
+#endif /* LIBXI_XISCAN_H */
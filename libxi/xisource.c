@@ -36,11 +36,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <errno.h>
 
 #include <libpsu/psucommon.h>
+#include <libpsu/psuzio.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 #include <parrotdb/pacommon.h>
 #include <libxi/xicommon.h>
 #include <libxi/xisource.h>
+#include <libxi/xiscan.h>
 
 #define XI_PI	"processing instruction"
 
@@ -61,12 +67,12 @@ xi_source_failure (xi_source_t *srcp, int errnum, const char *fmt, ...)
 
     if (srcp) {
 	if (srcp->xps_flags & XPSF_LINE_NO) {
-	    fprintf(stderr, "%s:%u:(%u): ",
-		    srcp->xps_filename ?: "input",
-		    srcp->xps_lineno, srcp->xps_offset);
+	    fprintf(stderr, "%s:%u:(%llu): ",
+		    srcp->xps_filename ?: "input", srcp->xps_lineno,
+		    (unsigned long long) srcp->xps_offset);
 	} else {
-	    fprintf(stderr, "%s:(%u): ",
-		    srcp->xps_filename ?: "input", srcp->xps_offset);
+	    fprintf(stderr, "%s:(%llu): ", srcp->xps_filename ?: "input",
+		    (unsigned long long) srcp->xps_offset);
 	}
     }
 
@@ -79,6 +85,195 @@ xi_source_failure (xi_source_t *srcp, int errnum, const char *fmt, ...)
     va_end(vap);
 }
 
+/*
+ * Map a regular file whole, so tokens can point straight into the
+ * page cache without read() or memmove().  The tokenizer NUL-terminates
+ * names in place, so the mapping is private and writable; only pages
+ * we actually touch get copied.  We reserve an extra anonymous page
+ * past the end of the file, so scans that peek one byte beyond the
+ * end see a NUL rather than a SIGBUS.
+ */
+static void
+xi_source_map (xi_source_t *srcp)
+{
+    struct stat st;
+
+    /* A compressed file has to be read through its stream */
+    if (psu_zio_active(srcp->xps_fd))
+	return;
+
+    if (fstat(srcp->xps_fd, &st) < 0 || !S_ISREG(st.st_mode)
+	    || st.st_size <= 0)
+	return;
+
+    size_t pagesize = getpagesize();
+    size_t mapsize = (st.st_size + pagesize) & ~(pagesize - 1);
+
+    void *base = mmap(NULL, mapsize, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+	return;
+
+    void *addr = mmap(base, st.st_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_FIXED, srcp->xps_fd, 0);
+    if (addr == MAP_FAILED) {
+	munmap(base, mapsize);
+	return;
+    }
+
+    srcp->xps_flags |= XPSF_MMAP_INPUT | XPSF_NO_READ;
+    srcp->xps_bufp = srcp->xps_curp = addr;
+    srcp->xps_len = st.st_size;
+    srcp->xps_size = mapsize;
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+/*
+ * Asynchronous reading for pipes and sockets.  A helper thread
+ * read()s into a second buffer while the tokenizer chews on the
+ * first; xi_source_read then copies from that buffer instead of
+ * blocking in read() itself.  The handoff is a simple full/empty
+ * flag: the helper only touches its buffer while it's empty, and
+ * the tokenizer only while it's full.
+ */
+typedef struct xi_source_async_s {
+    pthread_t xsa_thread;	/* Reader thread */
+    pthread_mutex_t xsa_mutex;	/* Protects everything below */
+    pthread_cond_t xsa_cond;	/* Signalled on every state change */
+    int xsa_fd;			/* File being read */
+    char *xsa_bufp;		/* Second buffer */
+    unsigned xsa_size;		/* Size of xsa_bufp */
+    unsigned xsa_len;		/* Bytes of data in xsa_bufp (0 == empty) */
+    unsigned xsa_off;		/* Bytes already handed to the tokenizer */
+    int xsa_eof;		/* Reader has seen EOF or an error */
+    int xsa_errno;		/* Error from read(), if any */
+} xi_source_async_t;
+
+static void *
+xi_source_async_main (void *arg)
+{
+    xi_source_async_t *xsap = arg;
+    ssize_t rc;
+
+    pthread_mutex_lock(&xsap->xsa_mutex);
+    for (;;) {
+	while (xsap->xsa_len != 0)
+	    pthread_cond_wait(&xsap->xsa_cond, &xsap->xsa_mutex);
+
+	pthread_mutex_unlock(&xsap->xsa_mutex);
+	rc = psu_zio_read(xsap->xsa_fd, xsap->xsa_bufp, xsap->xsa_size);
+	pthread_mutex_lock(&xsap->xsa_mutex);
+
+	if (rc <= 0) {
+	    xsap->xsa_eof = TRUE;
+	    xsap->xsa_errno = (rc < 0) ? errno : 0;
+	    pthread_cond_broadcast(&xsap->xsa_cond);
+	    break;
+	}
+
+	xsap->xsa_len = rc;
+	xsap->xsa_off = 0;
+	pthread_cond_broadcast(&xsap->xsa_cond);
+    }
+    pthread_mutex_unlock(&xsap->xsa_mutex);
+
+    return NULL;
+}
+
+/*
+ * Hand over up to 'size' bytes of data; returns like read(2)
+ */
+static ssize_t
+xi_source_async_read (xi_source_async_t *xsap, char *buf, size_t size)
+{
+    ssize_t rc;
+
+    pthread_mutex_lock(&xsap->xsa_mutex);
+    while (xsap->xsa_len == 0 && !xsap->xsa_eof)
+	pthread_cond_wait(&xsap->xsa_cond, &xsap->xsa_mutex);
+
+    if (xsap->xsa_len == 0) {
+	rc = xsap->xsa_errno ? -1 : 0;
+	errno = xsap->xsa_errno;
+
+    } else {
+	rc = xsap->xsa_len - xsap->xsa_off;
+	if ((size_t) rc > size)
+	    rc = size;
+
+	memcpy(buf, xsap->xsa_bufp + xsap->xsa_off, rc);
+	xsap->xsa_off += rc;
+	if (xsap->xsa_off == xsap->xsa_len) {
+	    /* Drained; let the reader refill it */
+	    xsap->xsa_len = xsap->xsa_off = 0;
+	    pthread_cond_broadcast(&xsap->xsa_cond);
+	}
+    }
+    pthread_mutex_unlock(&xsap->xsa_mutex);
+
+    return rc;
+}
+
+static void
+xi_source_async_start (xi_source_t *srcp)
+{
+    struct stat st;
+
+    /*
+     * Regular files don't block, so there's nothing to overlap,
+     * unless they're compressed, where the reader has the work of
+     * decompressing them
+     */
+    if (fstat(srcp->xps_fd, &st) < 0
+	    || (S_ISREG(st.st_mode) && !psu_zio_active(srcp->xps_fd)))
+	return;
+
+    xi_source_async_t *xsap = calloc(1, sizeof(*xsap));
+    if (xsap == NULL)
+	return;
+
+    xsap->xsa_fd = srcp->xps_fd;
+    xsap->xsa_size = XI_BUFSIZ;
+    xsap->xsa_bufp = malloc(xsap->xsa_size);
+    if (xsap->xsa_bufp == NULL) {
+	free(xsap);
+	return;
+    }
+
+    pthread_mutex_init(&xsap->xsa_mutex, NULL);
+    pthread_cond_init(&xsap->xsa_cond, NULL);
+
+    if (pthread_create(&xsap->xsa_thread, NULL,
+		       xi_source_async_main, xsap) != 0) {
+	pthread_cond_destroy(&xsap->xsa_cond);
+	pthread_mutex_destroy(&xsap->xsa_mutex);
+	free(xsap->xsa_bufp);
+	free(xsap);
+	return;
+    }
+
+    srcp->xps_async = xsap;
+    srcp->xps_flags |= XPSF_ASYNC_READ;
+}
+
+static void
+xi_source_async_stop (xi_source_t *srcp)
+{
+    xi_source_async_t *xsap = srcp->xps_async;
+
+    /* The reader may be sitting in read(), which is a cancellation point */
+    pthread_cancel(xsap->xsa_thread);
+    pthread_join(xsap->xsa_thread, NULL);
+
+    pthread_cond_destroy(&xsap->xsa_cond);
+    pthread_mutex_destroy(&xsap->xsa_mutex);
+    free(xsap->xsa_bufp);
+    free(xsap);
+
+    srcp->xps_async = NULL;
+}
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
 /*
  * Open an xi_source_t for the given file descriptor.
  */
@@ -90,25 +285,21 @@ xi_source_create (int fd, xi_source_flags_t flags)
     srcp = calloc(1, sizeof(*srcp));
     if (srcp != NULL) {
 	srcp->xps_fd = fd;
-	srcp->xps_flags = flags & ~XPSF_MMAP_INPUT;
+	srcp->xps_flags = flags & ~(XPSF_MMAP_INPUT | XPSF_ASYNC_READ);
 	srcp->xps_lineno = 1;	/* Start on line 1 */
 
 	/*
 	 * The mmap flag asks us to try to mmap the file; if it fails,
 	 * we fall back to normal behavior.
 	 */
-	if (flags & XPSF_MMAP_INPUT) {
-	    struct stat st;
-
-	    if (fstat(fd, &st) >= 0 && st.st_size > 0) {
-		void *addr = mmap(NULL, st.st_size, PROT_READ, 0, fd, 0);
-		if (addr) {
-		    srcp->xps_flags |= XPSF_MMAP_INPUT | XPSF_NO_READ;
-		    srcp->xps_bufp = srcp->xps_curp = addr;
-		    srcp->xps_size = st.st_size;
-		}
-	    }
-	}
+	if (flags & XPSF_MMAP_INPUT)
+	    xi_source_map(srcp);
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+	/* Overlap reads of pipes and sockets with tokenizing */
+	if ((flags & XPSF_ASYNC_READ) && srcp->xps_bufp == NULL)
+	    xi_source_async_start(srcp);
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
 
 	/* If needed, allocate an initial buffer */
 	if (srcp->xps_bufp == NULL) {
@@ -122,12 +313,13 @@ xi_source_create (int fd, xi_source_flags_t flags)
 }
 
 /*
- * Open an xi_source_t for the given file.
+ * Open an xi_source_t for the given file.  gzip and zstd files are
+ * decompressed as they are read.
  */
 xi_source_t *
 xi_source_open (const char *filename, xi_source_flags_t flags)
 {
-    int fd = open(filename, O_RDONLY);
+    int fd = psu_zio_open(filename, O_RDONLY, PZF_AUTO, 0);
     if (fd < 0)
 	return NULL;
 
@@ -139,6 +331,30 @@ xi_source_open (const char *filename, xi_source_flags_t flags)
     return srcp;
 }
 
+/*
+ * Open an xi_source_t over a buffer that's already in memory.  The
+ * buffer belongs to the caller, but its contents will be modified
+ * as we tokenize (names are NUL-terminated in place).
+ */
+xi_source_t *
+xi_source_create_buffer (char *buf, xi_offset_t len, xi_source_flags_t flags)
+{
+    xi_source_t *srcp;
+
+    srcp = calloc(1, sizeof(*srcp));
+    if (srcp != NULL) {
+	srcp->xps_fd = -1;
+	srcp->xps_flags = (flags & ~(XPSF_MMAP_INPUT | XPSF_ASYNC_READ
+				     | XPSF_CLOSE_FD))
+	    | XPSF_NO_READ | XPSF_NO_FREE;
+	srcp->xps_lineno = 1;
+	srcp->xps_bufp = srcp->xps_curp = buf;
+	srcp->xps_len = srcp->xps_size = len;
+    }
+
+    return srcp;
+}
+
 /*
  * Destroy an xi_source_t, releasing all resource, including the
  * file descriptor if XPSF_CLOSE_FD is set.  Any further referencing
@@ -150,88 +366,272 @@ xi_source_destroy (xi_source_t *srcp)
     if (srcp->xps_filename != NULL)
 	free(srcp->xps_filename);
 
-    if (srcp->xps_curp != NULL)
-	free(srcp->xps_curp);
+    if (srcp->xps_flags & XPSF_NO_FREE)
+	;			/* Not ours to free */
+    else if (srcp->xps_flags & XPSF_MMAP_INPUT)
+	munmap(srcp->xps_bufp, srcp->xps_size);
+    else if (srcp->xps_bufp != NULL)
+	free(srcp->xps_bufp);
+
+    if (srcp->xps_unescp != NULL)
+	free(srcp->xps_unescp);
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+    if (srcp->xps_async != NULL)
+	xi_source_async_stop(srcp);
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
 
     if (srcp->xps_flags & XPSF_CLOSE_FD)
-	close(srcp->xps_fd);
+	psu_zio_close(srcp->xps_fd);
 
     free(srcp);
 }
 
+int
+xi_source_seek (xi_source_t *srcp, xi_offset_t offset, unsigned lineno)
+{
+    if (srcp->xps_flags & (XPSF_NO_READ | XPSF_MMAP_INPUT))
+	return -1;
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+    if (srcp->xps_async != NULL)
+	return -1;
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+    if (psu_zio_active(srcp->xps_fd))
+	return -1;
+
+    if (lseek(srcp->xps_fd, offset, SEEK_SET) < 0)
+	return -1;
+
+    /* Discard anything we've buffered */
+    srcp->xps_curp = srcp->xps_bufp;
+    srcp->xps_len = 0;
+    srcp->xps_offset = offset;
+    srcp->xps_lineno = lineno;
+    srcp->xps_last = XI_TYPE_NONE;
+    srcp->xps_flags &= ~XPSF_EOF_SEEN;
+
+    return 0;
+}
+
+/*
+ * Decode a character reference ("#65" or "#x41", without the '&' and
+ * ';') into UTF-8 at 'out', returning the number of bytes written, or
+ * zero if it's not valid.  The encoding is never longer than the
+ * reference, so this can be done in place.
+ */
+static size_t
+xi_source_unescape_charref (char *out, const char *cp, const char *ep)
+{
+    unsigned long word = 0;
+    int base = 10, digit;
+
+    if (++cp < ep && (*cp == 'x' || *cp == 'X')) {
+	base = 16;
+	cp += 1;
+    }
+
+    if (cp == ep)
+	return 0;
+
+    for ( ; cp < ep; cp++) {
+	if (*cp >= '0' && *cp <= '9')
+	    digit = *cp - '0';
+	else if (base == 16 && *cp >= 'a' && *cp <= 'f')
+	    digit = *cp - 'a' + 10;
+	else if (base == 16 && *cp >= 'A' && *cp <= 'F')
+	    digit = *cp - 'A' + 10;
+	else
+	    return 0;
+
+	word = word * base + digit;
+	if (word > 0x10ffff)
+	    return 0;
+    }
+
+    if (word == 0)
+	return 0;
+
+    if (word <= 0x7f) {
+	out[0] = word;
+	return 1;
+    }
+
+    if (word <= 0x7ff) {
+	out[0] = 0xc0 | (word >> 6);
+	out[1] = 0x80 | (word & 0x3f);
+	return 2;
+    }
+
+    if (word <= 0xffff) {
+	out[0] = 0xe0 | (word >> 12);
+	out[1] = 0x80 | ((word >> 6) & 0x3f);
+	out[2] = 0x80 | (word & 0x3f);
+	return 3;
+    }
+
+    out[0] = 0xf0 | (word >> 18);
+    out[1] = 0x80 | ((word >> 12) & 0x3f);
+    out[2] = 0x80 | ((word >> 6) & 0x3f);
+    out[3] = 0x80 | (word & 0x3f);
+    return 4;
+}
+
 /*
- * Unescape XML text data.  This is not done automatically since
- * if the caller is just copying data from input to output, there's
- * no reason to unescape data that will need escaping.
+ * Unescape XML text data, in place, returning the new length.  This
+ * is not done automatically since if the caller is just copying data
+ * from input to output, there's no reason to unescape data that will
+ * need escaping.  Entities we can't decode are left as they are.
  */
 size_t
 xi_source_unescape (xi_source_t *srcp, char *start, unsigned len)
 {
-    /* First byte is the unescaped form; the rest is the entity form */
+    /* First byte is the unescaped form; the rest is the entity name */
     static const char *entities[] = {
-	"&amp;", "<lt;", ">gt;", "'&apos;", "\"quot;", NULL
+	"&amp", "<lt", ">gt", "'apos", "\"quot", NULL
     };
 
-    size_t rc = len, elen = 0;
-    char *cur = start, *ins = NULL, *from = cur;
-    const char **ep;
-
-    while (len > 0) {
-	cur = psu_memchr(cur, '&', len);
-	if (cur == NULL)
-	    break;
-
-	len -= cur - from;
-	for (ep = entities; *ep; ep++) {
-	    elen = strlen(*ep + 1);
-	    if (memcmp(*ep + 1, cur + 1, elen) == 0)
-		break;
+    char *ep = start + len, *cp, *out, *semi;
+    const char **xp;
+    size_t elen, run;
+
+    cp = psu_memchr(start, '&', len);
+    if (cp == NULL)
+	return len;
+
+    for (out = cp; cp < ep; ) {
+	if (*cp != '&') {
+	    semi = psu_memchr(cp, '&', ep - cp);
+	    run = (semi ? semi : ep) - cp;
+	    memmove(out, cp, run);
+	    out += run;
+	    cp += run;
+	    continue;
 	}
 
-	if (*ep == NULL) {
-	    /* We didn't find the entity; bummer */
-	    xi_source_failure(srcp, 0, "could not decode entity");
+	/* None of the entities we know is longer than "&#x10ffff;" */
+	elen = ep - cp - 1;
+	semi = psu_memchr(cp + 1, ';', elen < 10 ? elen : 10);
+	elen = semi ? (size_t) (semi - cp - 1) : 0;
 
-	    char *xp = psu_memchr(cur + 1, ';', len);
-	    if (xp != NULL) {
-		/*
-		 * Okay, the entity is trash, but at least we found a
-		 * semi-colon.  Move along, discarding the broken entity.
-		 */
-		ins = cur;
-		cur = from = xp;
-	    } else {
-		len -= 1;	/* Skip single character ('&') */
-		cur += 1;
+	if (elen > 0 && cp[1] == '#') {
+	    run = xi_source_unescape_charref(out, cp + 1, semi);
+	    if (run > 0) {
+		out += run;
+		cp = semi + 1;
+		continue;
 	    }
-	    continue;
 
+	} else if (elen > 0) {
+	    for (xp = entities; *xp; xp++) {
+		if (strlen(*xp + 1) == elen && memcmp(*xp + 1, cp + 1, elen) == 0)
+		    break;
+	    }
+
+	    if (*xp) {
+		*out++ = **xp;
+		cp = semi + 1;
+		continue;
+	    }
 	}
 
-	if (ins == NULL) {
-	    *cur++ = **ep;	/* Replace '&' with unencoded form */
-	    ins = cur;		/* Point where we'll copy data (next time) */
+	/* We didn't find the entity; bummer */
+	xi_source_failure(srcp, 0, "could not decode entity");
+	*out++ = *cp++;
+    }
 
-	} else {
-	    size_t plen = cur - from; /* Length of uncopied data */
-	    memcpy(ins, from, plen);
-	    ins += plen;
-	    *ins++ = **ep;	/* Insert unencoded form */
-	    cur += 1;		/* Skip '&' */
+    return out - start;
+}
+
+/*
+ * Unescape XML text data without touching the input buffer.  If
+ * there's no '&', the data is returned as-is; otherwise it's decoded
+ * into a side buffer owned by the source, which remains valid until
+ * the next call.  The decoded length is returned via 'lenp'.
+ */
+char *
+xi_source_unescape_text (xi_source_t *srcp, char *start, unsigned len,
+			 unsigned *lenp)
+{
+    if (psu_memchr(start, '&', len) == NULL) {
+	*lenp = len;
+	return start;
+    }
+
+    if (srcp->xps_unesc_size < len) {
+	unsigned size = srcp->xps_unesc_size ?: XI_BUFSIZ_FAIL;
+	while (size < len)
+	    size <<= 1;
+
+	char *cp = realloc(srcp->xps_unescp, size);
+	if (cp == NULL) {
+	    *lenp = len;
+	    return start;	/* Best we can do is the raw data */
 	}
 
-	/* Pointer maintenance */
-	cur += elen;		/* Skip over the rest of  */
-	from = cur;		/* Point where we'll copy from */
-	len -= elen + 1;
-	rc -= elen;
+	srcp->xps_unescp = cp;
+	srcp->xps_unesc_size = size;
     }
 
-    /* If there's anything left over, copy it */
-    if (ins != NULL && len > 0)
-	memcpy(ins, from, len);
+    memcpy(srcp->xps_unescp, start, len);
+    *lenp = xi_source_unescape(srcp, srcp->xps_unescp, len);
 
-    return rc;
+    return srcp->xps_unescp;
+}
+
+/*
+ * Find the next name="value" pair in an attribute string, leaving
+ * *content just past it (or NULL at the end of the string).  Neither
+ * the name nor the value is NUL-terminated or unescaped.  Returns
+ * NULL for success, or static error message text
+ */
+const char *
+xi_source_next_attrib (char **content, char *endp,
+		       char **namep, size_t *namelenp,
+		       char **valuep, size_t *valuelenp)
+{
+    char *cp = *content;
+
+    if (cp == NULL)
+	return NULL;		/* Should not occur */
+
+    char *name = xi_skipws(cp, endp - cp, 1);
+    if (name == NULL) {		/* End of attributes */
+	*content = NULL;	/* Mark end of attributes */
+	return NULL;
+    }
+
+    cp = memchr(name, '=', endp - name);
+    if (cp == NULL)
+	return "invalid attribute; missing '='";
+
+    /* Trim space off end of attribute name */
+    size_t namelen = cp - name;
+    char *sp = cp - 1;
+    sp = xi_skipws(sp, sp - name, -1); /* Trim trailing ws */
+    if (sp != NULL)
+	namelen = &sp[1] - name;
+
+    cp += 1;			/* Move over '=' */
+
+    char *value = xi_skipws(cp, cp - endp, 1);
+    if (value == NULL || value[1] == '\0')
+	return "invalid attribute; missing value";
+
+    char quote = *value++; /* Record and skip leading quote character */
+    cp = memchr(value, quote, value - endp);
+    if (cp == NULL)
+	return "invalid attribute; missing trailing quote";
+
+    /* Fill in the caller's value */
+    *valuelenp = cp - value;
+    *valuep = value;
+    *content = cp + 1;		/* Move over the closing quote */
+    *namep = name;
+    *namelenp = namelen;
+
+    return NULL;
 }
 
 static void
@@ -240,15 +640,8 @@ xi_source_move_curp (xi_source_t *srcp, char *newp)
     char *cp = srcp->xps_curp;
 
     srcp->xps_offset += newp - cp;
-    if (srcp->xps_flags & XPSF_LINE_NO) {
-	while (cp < newp) {
-	    cp = psu_memchr(cp, '\n', newp - cp);
-	    if (cp == NULL)
-		break;
-	    srcp->xps_lineno += 1;
-	    cp += 1;
-	}
-    }
+    if (srcp->xps_flags & XPSF_LINE_NO)
+	srcp->xps_lineno += xi_scan_count(cp, newp - cp, XI_SCAN_NL);
 
     srcp->xps_curp = newp;
 }
@@ -263,8 +656,8 @@ xi_source_read (xi_source_t *srcp, int min)
     if (srcp->xps_flags & (XPSF_NO_READ | XPSF_EOF_SEEN))
 	return -1;
 
-    unsigned seen = srcp->xps_curp - srcp->xps_bufp;
-    unsigned left = srcp->xps_len - seen;
+    xi_offset_t seen = srcp->xps_curp - srcp->xps_bufp;
+    xi_offset_t left = srcp->xps_len - seen;
 
     if (left == 0) {
 	/* If we've consumed all data, reset it to initial state */
@@ -286,7 +679,7 @@ xi_source_read (xi_source_t *srcp, int min)
     /* If there's not enough room, expand the buffer */
     xi_offset_t space = srcp->xps_size - srcp->xps_len;
     if (space < XI_BUFSIZ_MIN) {
-	unsigned size = srcp->xps_size << 1; /* Double the buffer size */
+	xi_offset_t size = srcp->xps_size << 1; /* Double the buffer size */
 	char *cp = realloc(srcp->xps_bufp, size);
 	if (cp != NULL) {
 	    /* Record new buffer pointer values */
@@ -302,9 +695,19 @@ xi_source_read (xi_source_t *srcp, int min)
      * Read as much data as we can, remembering that we may have existing
      * data already in the buffer.  The first 'xps_len' bytes are precious.
      */
-    int rc = read(srcp->xps_fd, srcp->xps_bufp + srcp->xps_len,
+    int rc;
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+    if (srcp->xps_async != NULL)
+	rc = xi_source_async_read(srcp->xps_async,
+			srcp->xps_bufp + srcp->xps_len,
+			srcp->xps_size - srcp->xps_len);
+    else
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+	rc = psu_zio_read(srcp->xps_fd, srcp->xps_bufp + srcp->xps_len,
 		  srcp->xps_size - srcp->xps_len);
     if (rc <= 0) {
+	if (rc < 0)
+	    xi_source_failure(srcp, errno, "read failed");
 	srcp->xps_flags |= XPSF_EOF_SEEN;
 	return -1;
     }
@@ -765,18 +1168,81 @@ xi_source_token_text (xi_source_t *srcp, char **datap, char **restp)
     return XI_TYPE_TEXT;
 }
 
+/*
+ * In follow mode, the input may end in the middle of a token, which
+ * we leave in the buffer until more data arrives.  Returns TRUE if a
+ * complete token is waiting for us.  Text is complete when we see the
+ * next '<'; everything else when we find its closing '>'.
+ */
+static xi_boolean_t
+xi_source_follow_ready (xi_source_t *srcp)
+{
+    const char *tail = "";	/* What must come before our '>' */
+    xi_offset_t off;
+    char *cp;
+
+    if (srcp->xps_curp[0] != '<')
+	return (xi_source_find(srcp, '<', xi_source_offset(srcp)) >= 0);
+
+    xi_source_avail(srcp, 4);	/* Might move our buffer */
+    off = xi_source_offset(srcp);
+
+    xi_offset_t left = xi_source_left(srcp);
+    if (left < 2)
+	return FALSE;
+
+    cp = srcp->xps_curp;
+    if (cp[1] == '!') {
+	if (left < 4)
+	    return FALSE;
+
+	if (cp[2] == '-' && cp[3] == '-') {
+	    tail = "--";
+	    off += 4;		/* Skip "<!--" */
+	} else if (cp[2] == '[') {
+	    tail = "]]";
+	    off += 3;		/* Skip "<![" */
+	}
+
+    } else if (cp[1] == '?') {
+	tail = "?";
+	off += 2;		/* Skip "<?" */
+    }
+
+    size_t tlen = strlen(tail);
+
+    for (;;) {
+	off = xi_source_find(srcp, '>', off);
+	if (off < 0)
+	    return FALSE;
+
+	cp = &srcp->xps_bufp[off];
+	if (memcmp(cp - tlen, tail, tlen) == 0)
+	    return TRUE;
+
+	off += 1;
+    }
+}
+
 static void
 xi_source_ignorews (xi_source_t *srcp)
 {
-    xi_offset_t off = xi_source_offset(srcp); /* Starting point */
+    xi_offset_t seen = 0;	/* Bytes of whitespace past curp */
     char *cp;
 
-    for (cp = &srcp->xps_bufp[off]; xi_isspace(*cp); cp++, off++) {
-	if (off >= srcp->xps_len) {
+    for (;; seen++) {
+	/*
+	 * Check for the end of our data before looking at it.  Reading
+	 * can move our buffer, so we count from curp.
+	 */
+	if (seen >= xi_source_left(srcp)) {
 	    if (xi_source_read(srcp, 0) < 0)
 		return;
-	    cp = &srcp->xps_bufp[off]; /* Refresh */
 	}
+
+	cp = srcp->xps_curp + seen;
+	if (!xi_isspace(*cp))
+	    break;
     }
 
     if (*cp != '<')
@@ -810,6 +1276,10 @@ xi_source_next_token (xi_source_t *srcp, char **datap, char **restp)
 		return XI_TYPE_EOF;
 	}
 
+	/* Don't start a token we can't finish until more data arrives */
+	if ((srcp->xps_flags & XPSF_FOLLOW) && !xi_source_follow_ready(srcp))
+	    return XI_TYPE_EOF;
+
 	if (srcp->xps_curp[0] != '<') {
 	    /* Text data */
 	    token = xi_source_token_text(srcp, datap, restp);
@@ -32,12 +32,15 @@ struct xi_source_s {
     int xps_fd;			/* File being read */
     char *xps_filename;		/* Filename */
     unsigned xps_lineno;	/* Line number of input */
-    unsigned xps_offset;	/* Offset in the file */
+    xi_offset_t xps_offset;	/* Offset in the file */
     xi_source_flags_t xps_flags; /* Flags for this source */
-    char *xps_bufp;		/* Input buffer */
+    char *xps_bufp;		/* Input buffer (or mapping) */
     char *xps_curp;		/* Current data point */
-    unsigned xps_len;		/* Number of bytes in the input buffer */
-    unsigned xps_size;		/* Size of the input buffer (max) */
+    xi_offset_t xps_len;	/* Number of bytes in the input buffer */
+    xi_offset_t xps_size;	/* Size of the input buffer (or mapping) */
+    char *xps_unescp;		/* Side buffer for unescaped text */
+    unsigned xps_unesc_size;	/* Size of xps_unescp */
+    struct xi_source_async_s *xps_async; /* Reader thread (XPSF_ASYNC_READ) */
     xi_node_type_t xps_last;	/* Type of last token returned */
 }; /* xi_source_t */
 
@@ -53,6 +56,9 @@ struct xi_source_s {
 #define XPSF_LINE_NO	(1<<8)	/* Track line numbers for input */
 #define XPSF_IGNORE_COMMENTS (1<<9) /* Discard comments */
 #define XPSF_IGNORE_DTD (1<<10) /* Discard DTDs */
+#define XPSF_ASYNC_READ (1<<11) /* Read pipes/sockets from a helper thread */
+#define XPSF_NO_FREE	(1<<12)	/* Buffer belongs to the caller */
+#define XPSF_FOLLOW	(1<<13)	/* Input grows; EOF is only a pause */
 
 xi_source_t *
 xi_source_create (int fd, xi_source_flags_t flags);
@@ -60,15 +66,53 @@ xi_source_create (int fd, xi_source_flags_t flags);
 xi_source_t *
 xi_source_open (const char *path, xi_source_flags_t flags);
 
+xi_source_t *
+xi_source_create_buffer (char *buf, xi_offset_t len, xi_source_flags_t flags);
+
 void
 xi_source_destroy (xi_source_t *srcp);
 
 xi_node_type_t
 xi_source_next_token (xi_source_t *srcp, char **datap, char **restp);
 
+/*
+ * In follow mode (XPSF_FOLLOW), a token that's cut off by the end of
+ * the input is left in the buffer and we return XI_TYPE_EOF.  Calling
+ * xi_source_follow() lets the next xi_source_next_token() try to
+ * read() more data, picking up where we paused.  This needs input we
+ * read(); mapped input and buffers don't grow.
+ */
+static inline void
+xi_source_follow (xi_source_t *srcp)
+{
+    srcp->xps_flags &= ~XPSF_EOF_SEEN;
+}
+
+/*
+ * Restart reading at the given offset (and line number) of the file.
+ * Returns zero on success.
+ */
+int
+xi_source_seek (xi_source_t *srcp, xi_offset_t offset, unsigned lineno);
+
 size_t
 xi_source_unescape (xi_source_t *srcp, char *start, unsigned len);
 
+char *
+xi_source_unescape_text (xi_source_t *srcp, char *start, unsigned len,
+			 unsigned *lenp);
+
+/*
+ * Find the next name="value" pair in an attribute string (the 'rest'
+ * of an open tag token, ending at 'endp').  Returns NULL on success,
+ * setting *content to NULL at the end of the attributes, or an error
+ * message.
+ */
+const char *
+xi_source_next_attrib (char **content, char *endp,
+		       char **namep, size_t *namelenp,
+		       char **valuep, size_t *valuelenp);
+
 void
 xi_source_failure (xi_source_t *srcp, int errnum, const char *fmt, ...);
 
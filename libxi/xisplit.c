@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+/*
+ * Parallel tokenizing for large in-memory documents.  Our tokenizer
+ * needs no context beyond "we're at a '<'", so the only hard part is
+ * finding '<'s that are real token starts.  Those inside comments,
+ * CDATA sections, processing instructions, and DTDs aren't, and the
+ * only way to know is to walk from the front.  That walk just hops
+ * from '<' to '<' (and over the odd "-->"), so it's a small fraction
+ * of the cost of tokenizing, which is what we farm out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psustring.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#include <parrotdb/pacommon.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xiscan.h>
+#include <libxi/xisplit.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+#define XI_SPLIT_THREADS 1
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+typedef struct xi_split_chunk_s {
+    xi_source_t *xsc_srcp;	/* Source covering just this chunk */
+    xi_split_token_t *xsc_tokens; /* Tokens found in this chunk */
+    unsigned xsc_count;		/* Number of tokens */
+    unsigned xsc_max;		/* Number of slots in xsc_tokens */
+#ifdef XI_SPLIT_THREADS
+    pthread_t xsc_thread;	/* Thread doing the work */
+    int xsc_started;		/* Thread was started */
+#endif /* XI_SPLIT_THREADS */
+} xi_split_chunk_t;
+
+/*
+ * Find 'term' at or after 'cp', returning a pointer just past it,
+ * or NULL if it's not there.
+ */
+static char *
+xi_split_skip (char *cp, char *end, const char *term)
+{
+    size_t tlen = strlen(term);
+
+    while (cp + tlen <= end) {
+	cp = memchr(cp, term[0], end - cp - tlen + 1);
+	if (cp == NULL)
+	    return NULL;
+	if (memcmp(cp, term, tlen) == 0)
+	    return cp + tlen;
+	cp += 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Fill in 'bounds' with up to count-1 cut points, each a '<' that
+ * starts a real token.  Returns the number of chunks we ended up with.
+ */
+static unsigned
+xi_split_boundaries (char *start, char *end, unsigned count, char **bounds)
+{
+    xi_offset_t len = end - start;
+    char *cp = start, *target;
+    unsigned i = 1;
+
+    target = start + len / count;
+
+    while (i < count && cp < end) {
+	cp = (char *) xi_scan_find(cp, end - cp, XI_SCAN_LT);
+	if (cp == NULL || cp + 1 >= end)
+	    break;
+
+	if (cp[1] == '!') {
+	    if (end - cp >= 4 && memcmp(cp, "<!--", 4) == 0)
+		cp = xi_split_skip(cp + 4, end, "-->");
+	    else if (end - cp >= 9 && memcmp(cp, "<![CDATA[", 9) == 0)
+		cp = xi_split_skip(cp + 9, end, "]]>");
+	    else {
+		/* DTD; may have an internal subset in brackets */
+		char *hit = psu_memchr2(cp, '>', '[', end - cp);
+		if (hit && *hit == '[')
+		    cp = xi_split_skip(hit, end, "]>");
+		else
+		    cp = hit ? hit + 1 : NULL;
+	    }
+
+	} else if (cp[1] == '?') {
+	    cp = xi_split_skip(cp + 2, end, "?>");
+
+	} else {
+	    /* A real tag; use it if we've reached the next target */
+	    if (cp >= target && cp > start) {
+		bounds[i++] = cp;
+		target = start + (len / count) * i;
+	    }
+	    cp += 1;
+	}
+
+	if (cp == NULL)		/* Unterminated; leave it for the tokenizer */
+	    break;
+    }
+
+    return i;
+}
+
+static int
+xi_split_add (xi_split_chunk_t *xscp, xi_node_type_t type,
+	      char *data, char *rest)
+{
+    if (xscp->xsc_count >= xscp->xsc_max) {
+	unsigned max = xscp->xsc_max ? xscp->xsc_max << 1 : 1024;
+	xi_split_token_t *tp = realloc(xscp->xsc_tokens, max * sizeof(*tp));
+	if (tp == NULL)
+	    return -1;
+
+	xscp->xsc_tokens = tp;
+	xscp->xsc_max = max;
+    }
+
+    xi_split_token_t *tp = &xscp->xsc_tokens[xscp->xsc_count++];
+    tp->xst_type = type;
+    tp->xst_data = data;
+    tp->xst_rest = rest;
+
+    return 0;
+}
+
+/*
+ * Tokenize one chunk, stopping at EOF or failure (which we record)
+ */
+static void *
+xi_split_main (void *arg)
+{
+    xi_split_chunk_t *xscp = arg;
+    xi_node_type_t type;
+    char *data, *rest;
+
+    for (;;) {
+	type = xi_source_next_token(xscp->xsc_srcp, &data, &rest);
+	if (xi_split_add(xscp, type, data, rest) < 0) {
+	    /* Out of memory; make sure the reader sees a failure */
+	    if (xscp->xsc_count > 0) {
+		xi_split_token_t *tp = &xscp->xsc_tokens[xscp->xsc_count - 1];
+		tp->xst_type = XI_TYPE_FAIL;
+		tp->xst_data = tp->xst_rest = NULL;
+	    }
+	    break;
+	}
+
+	if (type == XI_TYPE_EOF || type == XI_TYPE_FAIL
+		|| type == XI_TYPE_NONE)
+	    break;
+    }
+
+    return NULL;
+}
+
+xi_split_t *
+xi_split_create (xi_source_t *srcp, unsigned count)
+{
+    /* We need the whole input in hand */
+    if (!(srcp->xps_flags & XPSF_MMAP_INPUT))
+	return NULL;
+
+    char *start = srcp->xps_curp;
+    char *end = srcp->xps_bufp + srcp->xps_len;
+    xi_offset_t len = end - start;
+
+    if (count == 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	count = (ncpu > 0) ? ncpu : 1;
+	if (len / count < XI_SPLIT_MIN_CHUNK)
+	    count = len / XI_SPLIT_MIN_CHUNK;
+    }
+    if (count < 1 || len < (xi_offset_t) count)
+	count = 1;
+
+    xi_split_t *xsp = calloc(1, sizeof(*xsp));
+    char **bounds = calloc(count + 1, sizeof(*bounds));
+    if (xsp == NULL || bounds == NULL)
+	goto fail;
+
+    xsp->xs_srcp = srcp;
+
+    bounds[0] = start;
+    count = xi_split_boundaries(start, end, count, bounds);
+    bounds[count] = end;
+
+    xsp->xs_chunks = calloc(count, sizeof(*xsp->xs_chunks));
+    if (xsp->xs_chunks == NULL)
+	goto fail;
+    xsp->xs_count = count;
+
+    unsigned i, lineno = srcp->xps_lineno;
+    xi_split_chunk_t *xscp;
+
+    for (i = 0, xscp = xsp->xs_chunks; i < count; i++, xscp++) {
+	xi_source_t *csrcp;
+
+	csrcp = xi_source_create_buffer(bounds[i], bounds[i + 1] - bounds[i],
+					srcp->xps_flags);
+	if (csrcp == NULL)
+	    goto fail;
+
+	csrcp->xps_filename = srcp->xps_filename; /* Borrowed */
+	csrcp->xps_offset = srcp->xps_offset + (bounds[i] - start);
+	csrcp->xps_last = (i == 0) ? srcp->xps_last : XI_TYPE_NONE;
+
+	/* Each chunk needs to know where it starts, for error messages */
+	if (srcp->xps_flags & XPSF_LINE_NO) {
+	    csrcp->xps_lineno = lineno;
+	    lineno += xi_scan_count(bounds[i], bounds[i + 1] - bounds[i],
+				    XI_SCAN_NL);
+	}
+
+	xscp->xsc_srcp = csrcp;
+    }
+
+    for (i = 0, xscp = xsp->xs_chunks; i < count; i++, xscp++) {
+#ifdef XI_SPLIT_THREADS
+	/* Chunk zero runs here, in our own thread */
+	if (i > 0 && pthread_create(&xscp->xsc_thread, NULL,
+				    xi_split_main, xscp) == 0) {
+	    xscp->xsc_started = TRUE;
+	    continue;
+	}
+#endif /* XI_SPLIT_THREADS */
+	if (i > 0)
+	    xi_split_main(xscp);
+    }
+
+    xi_split_main(&xsp->xs_chunks[0]);
+
+#ifdef XI_SPLIT_THREADS
+    for (i = 0, xscp = xsp->xs_chunks; i < count; i++, xscp++)
+	if (xscp->xsc_started)
+	    pthread_join(xscp->xsc_thread, NULL);
+#endif /* XI_SPLIT_THREADS */
+
+    free(bounds);
+    return xsp;
+
+ fail:
+    if (bounds)
+	free(bounds);
+    if (xsp)
+	xi_split_destroy(xsp);
+    return NULL;
+}
+
+/*
+ * Move the original source to where the given chunk left off, so
+ * offsets and line numbers look like a serial parse just finished.
+ */
+static void
+xi_split_sync (xi_split_t *xsp, xi_split_chunk_t *xscp)
+{
+    xi_source_t *srcp = xsp->xs_srcp, *csrcp = xscp->xsc_srcp;
+
+    srcp->xps_curp = csrcp->xps_curp;
+    srcp->xps_offset = csrcp->xps_offset;
+    srcp->xps_lineno = csrcp->xps_lineno;
+    srcp->xps_last = csrcp->xps_last;
+}
+
+xi_node_type_t
+xi_split_next_token (xi_split_t *xsp, char **datap, char **restp)
+{
+    xi_split_chunk_t *xscp;
+    xi_split_token_t *tp;
+
+    while (xsp->xs_cur_chunk < xsp->xs_count) {
+	xscp = &xsp->xs_chunks[xsp->xs_cur_chunk];
+	if (xsp->xs_cur_token >= xscp->xsc_count) {
+	    xsp->xs_cur_chunk += 1;
+	    xsp->xs_cur_token = 0;
+	    continue;
+	}
+
+	tp = &xscp->xsc_tokens[xsp->xs_cur_token++];
+
+	/* The EOF at the end of each chunk but the last is artificial */
+	if (tp->xst_type == XI_TYPE_EOF
+		&& xsp->xs_cur_chunk + 1 < xsp->xs_count)
+	    continue;
+
+	*datap = tp->xst_data;
+	*restp = tp->xst_rest;
+
+	if (tp->xst_type == XI_TYPE_EOF || tp->xst_type == XI_TYPE_FAIL
+		|| tp->xst_type == XI_TYPE_NONE) {
+	    xi_split_sync(xsp, xscp);
+	    xsp->xs_cur_chunk = xsp->xs_count; /* Nothing more to say */
+	}
+
+	return tp->xst_type;
+    }
+
+    *datap = *restp = NULL;
+    return XI_TYPE_EOF;
+}
+
+void
+xi_split_destroy (xi_split_t *xsp)
+{
+    unsigned i;
+    xi_split_chunk_t *xscp;
+
+    if (xsp->xs_chunks) {
+	for (i = 0, xscp = xsp->xs_chunks; i < xsp->xs_count; i++, xscp++) {
+	    if (xscp->xsc_srcp) {
+		xscp->xsc_srcp->xps_filename = NULL; /* Borrowed */
+		xi_source_destroy(xscp->xsc_srcp);
+	    }
+	    if (xscp->xsc_tokens)
+		free(xscp->xsc_tokens);
+	}
+	free(xsp->xs_chunks);
+    }
+
+    free(xsp);
+}
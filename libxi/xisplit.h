@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#ifndef LIBXI_XISPLIT_H
+#define LIBXI_XISPLIT_H
+
+#include <libxi/xisource.h>
+
+/*
+ * Parallel tokenizing of a source that's entirely in memory (an
+ * XPSF_MMAP_INPUT source).  A quick serial pass over the structural
+ * characters finds '<'s that are outside comments, CDATA, PIs and
+ * DTDs; we cut the input at those points and tokenize each chunk on
+ * its own thread.  The caller then pulls tokens out in document
+ * order with xi_split_next_token(), exactly as if they'd come from
+ * xi_source_next_token() on the original source.
+ *
+ * Since each chunk starts at a token boundary, no chunk's tokens
+ * depend on its neighbors.  Tokens point into the original buffer,
+ * which is modified in place just as it would be by a serial parse.
+ * Failure messages for malformed input may appear out of order,
+ * since chunks report them as they find them.
+ */
+
+#define XI_SPLIT_MIN_CHUNK	(256 * 1024) /* Smallest chunk worth a thread */
+
+typedef struct xi_split_token_s {
+    xi_node_type_t xst_type;	/* Type of token (XI_TYPE_*) */
+    char *xst_data;		/* Data pointer */
+    char *xst_rest;		/* Rest pointer */
+} xi_split_token_t;
+
+struct xi_split_chunk_s;	/* Opaque; private to xisplit.c */
+
+typedef struct xi_split_s {
+    xi_source_t *xs_srcp;	/* Original source */
+    unsigned xs_count;		/* Number of chunks */
+    struct xi_split_chunk_s *xs_chunks; /* Chunks of input */
+    unsigned xs_cur_chunk;	/* Chunk we're returning tokens from */
+    unsigned xs_cur_token;	/* Next token in that chunk */
+} xi_split_t;
+
+/*
+ * Split and tokenize the remaining input of 'srcp'.  If 'count' is
+ * zero, we pick one chunk per CPU, but never chunks smaller than
+ * XI_SPLIT_MIN_CHUNK.  Returns NULL if the source isn't entirely in
+ * memory, in which case the caller should just read tokens from
+ * the source as usual.
+ */
+xi_split_t *
+xi_split_create (xi_source_t *srcp, unsigned count);
+
+/*
+ * Return the next token, with the same semantics as
+ * xi_source_next_token().
+ */
+xi_node_type_t
+xi_split_next_token (xi_split_t *xsp, char **datap, char **restp);
+
+/*
+ * Return the number of chunks the input was split into
+ */
+static inline unsigned
+xi_split_count (xi_split_t *xsp)
+{
+    return xsp->xs_count;
+}
+
+void
+xi_split_destroy (xi_split_t *xsp);
+
+#endif /* LIBXI_XISPLIT_H */
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Text pool storage for workspaces.  Without XWF_COMPRESS_TEXT, a
+ * string is simply copied into the pa_arb pool.  With it, each string
+ * starts with a tag byte saying how it's stored: short strings (and
+ * ones that don't shrink) are kept as is, after the tag, so reading
+ * them costs nothing; longer ones are deflated, behind their lengths.
+ * Deflate's window covers repetition inside a string; a dictionary,
+ * shared by all the strings in the workspace, covers the repetition
+ * between them (field names, timestamps, the usual log chatter).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#define XI_TEXTPOOL_ZLIB
+#include <zlib.h>
+#endif
+
+/* Tag bytes, at the start of each string in a compressed text pool */
+#define XI_TEXT_PLAIN	0	/* NUL-terminated string follows */
+#define XI_TEXT_DEFLATE	1	/* Lengths (uint32_t), then raw deflate */
+
+/* Tag, then the length of the string and of its deflated form */
+#define XI_TEXT_HDR_LEN	(1 + 2 * sizeof(uint32_t))
+#define XI_TEXT_MIN_DEFLATE 64	/* Shorter strings aren't worth it */
+
+typedef struct xi_textbuf_s {
+    pa_atom_t xtb_atom;		/* Atom expanded into this buffer */
+    char *xtb_data;		/* Expanded string */
+    size_t xtb_size;		/* Bytes allocated for xtb_data */
+} xi_textbuf_t;
+
+typedef struct xi_textzip_s {
+#ifdef XI_TEXTPOOL_ZLIB
+    z_stream xtz_deflate;	/* Compression state */
+    z_stream xtz_inflate;	/* Decompression state */
+#endif
+    psu_boolean_t xtz_deflate_ready; /* xtz_deflate is initialized */
+    psu_boolean_t xtz_inflate_ready; /* xtz_inflate is initialized */
+    psu_boolean_t xtz_failed;	/* zlib failed us; store strings plain */
+    psu_byte_t *xtz_dict;	/* Dictionary (or NULL) */
+    size_t xtz_dict_len;	/* Length of xtz_dict */
+    psu_byte_t *xtz_out;	/* Scratch buffer for deflate output */
+    size_t xtz_out_size;	/* Bytes allocated for xtz_out */
+    xi_textbuf_t xtz_ring[XI_TEXTPOOL_RING]; /* Expanded strings */
+    unsigned xtz_next;		/* Next slot in xtz_ring to reuse */
+    xi_textpool_stats_t xtz_stats; /* What we've done */
+} xi_textzip_t;
+
+xi_textzip_t *
+xi_textzip_create (void)
+{
+    return calloc(1, sizeof(xi_textzip_t));
+}
+
+void
+xi_textzip_destroy (xi_textzip_t *xtzp)
+{
+    unsigned i;
+
+    if (xtzp == NULL)
+	return;
+
+#ifdef XI_TEXTPOOL_ZLIB
+    if (xtzp->xtz_deflate_ready)
+	deflateEnd(&xtzp->xtz_deflate);
+    if (xtzp->xtz_inflate_ready)
+	inflateEnd(&xtzp->xtz_inflate);
+#endif
+
+    for (i = 0; i < XI_TEXTPOOL_RING; i++)
+	free(xtzp->xtz_ring[i].xtb_data);
+
+    free(xtzp->xtz_dict);
+    free(xtzp->xtz_out);
+    free(xtzp);
+}
+
+int
+xi_textpool_set_dictionary (xi_workspace_t *xwp, const char *data,
+			    size_t len)
+{
+    xi_textzip_t *xtzp = xwp->xw_textzip;
+    psu_byte_t *dict;
+
+    if (xtzp == NULL || xtzp->xtz_stats.xts_strings != 0)
+	return -1;
+
+#ifndef XI_TEXTPOOL_ZLIB
+    if (len != 0)
+	return -1;
+#endif
+
+    dict = NULL;
+    if (len != 0) {
+	dict = malloc(len);
+	if (dict == NULL)
+	    return -1;
+	memcpy(dict, data, len);
+    }
+
+    free(xtzp->xtz_dict);
+    xtzp->xtz_dict = dict;
+    xtzp->xtz_dict_len = len;
+
+    return 0;
+}
+
+void
+xi_textpool_stats (xi_workspace_t *xwp, xi_textpool_stats_t *statsp)
+{
+    if (xwp->xw_textzip)
+	*statsp = xwp->xw_textzip->xtz_stats;
+    else
+	bzero(statsp, sizeof(*statsp));
+}
+
+#ifdef XI_TEXTPOOL_ZLIB
+/*
+ * Deflate a string into xtz_out, returning the compressed length, or
+ * zero if it didn't come out smaller than the string itself
+ */
+static size_t
+xi_textpool_deflate (xi_textzip_t *xtzp, const char *data, size_t len)
+{
+    z_stream *zsp = &xtzp->xtz_deflate;
+    size_t size;
+
+    if (!xtzp->xtz_deflate_ready) {
+	if (deflateInit2(zsp, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+	    xtzp->xtz_failed = TRUE;
+	    return 0;
+	}
+	xtzp->xtz_deflate_ready = TRUE;
+
+    } else if (deflateReset(zsp) != Z_OK) {
+	return 0;
+    }
+
+    if (xtzp->xtz_dict_len != 0
+	    && deflateSetDictionary(zsp, xtzp->xtz_dict,
+				    xtzp->xtz_dict_len) != Z_OK)
+	return 0;
+
+    size = deflateBound(zsp, len);
+    if (size > xtzp->xtz_out_size) {
+	psu_byte_t *out = realloc(xtzp->xtz_out, size);
+	if (out == NULL)
+	    return 0;
+	xtzp->xtz_out = out;
+	xtzp->xtz_out_size = size;
+    }
+
+    zsp->next_in = (Bytef *) data;
+    zsp->avail_in = len;
+    zsp->next_out = xtzp->xtz_out;
+    zsp->avail_out = xtzp->xtz_out_size;
+
+    if (deflate(zsp, Z_FINISH) != Z_STREAM_END)
+	return 0;
+
+    /* It has to pay for its header, or there's no point */
+    if (zsp->total_out + XI_TEXT_HDR_LEN >= len + 2)
+	return 0;
+
+    return zsp->total_out;
+}
+
+/*
+ * Inflate a deflated string into a buffer from the ring
+ */
+static const char *
+xi_textpool_inflate (xi_textzip_t *xtzp, pa_atom_t atom,
+		     const psu_byte_t *cp)
+{
+    z_stream *zsp = &xtzp->xtz_inflate;
+    xi_textbuf_t *xtbp;
+    uint32_t len, clen;
+
+    memcpy(&len, cp + 1, sizeof(len));
+    memcpy(&clen, cp + 1 + sizeof(len), sizeof(clen));
+
+    if (!xtzp->xtz_inflate_ready) {
+	if (inflateInit2(zsp, -MAX_WBITS) != Z_OK)
+	    return NULL;
+	xtzp->xtz_inflate_ready = TRUE;
+
+    } else if (inflateReset(zsp) != Z_OK) {
+	return NULL;
+    }
+
+    if (xtzp->xtz_dict_len != 0
+	    && inflateSetDictionary(zsp, xtzp->xtz_dict,
+				    xtzp->xtz_dict_len) != Z_OK)
+	return NULL;
+
+    xtbp = &xtzp->xtz_ring[xtzp->xtz_next];
+    if (len + 1 > xtbp->xtb_size) {
+	char *data = realloc(xtbp->xtb_data, len + 1);
+	if (data == NULL)
+	    return NULL;
+	xtbp->xtb_data = data;
+	xtbp->xtb_size = len + 1;
+    }
+
+    /* The slot's old string is gone, whatever happens next */
+    xtbp->xtb_atom = PA_NULL_ATOM;
+
+    zsp->next_in = (Bytef *) cp + XI_TEXT_HDR_LEN;
+    zsp->avail_in = clen;
+    zsp->next_out = (Bytef *) xtbp->xtb_data;
+    zsp->avail_out = len;
+
+    if (inflate(zsp, Z_FINISH) != Z_STREAM_END || zsp->total_out != len) {
+	psu_log("xi_textpool_inflate: atom %u is corrupt", atom);
+	return NULL;
+    }
+
+    xtbp->xtb_data[len] = '\0';
+    xtbp->xtb_atom = atom;
+    xtzp->xtz_next = (xtzp->xtz_next + 1) % XI_TEXTPOOL_RING;
+    xtzp->xtz_stats.xts_expands += 1;
+
+    return xtbp->xtb_data;
+}
+#endif /* XI_TEXTPOOL_ZLIB */
+
+pa_atom_t
+xi_textpool_alloc (xi_workspace_t *xwp, const char *data, size_t len)
+{
+    xi_textzip_t *xtzp = xwp->xw_textzip;
+    pa_arb_t *prp = xwp->xw_textpool;
+    pa_arb_atom_t atom;
+    psu_byte_t *cp;
+
+    if (!(xwp->xw_flags & XWF_COMPRESS_TEXT)) {
+	atom = pa_arb_alloc(prp, len + 1);
+	cp = pa_arb_atom_addr(prp, atom);
+	if (cp == NULL)
+	    return PA_NULL_ATOM;
+
+	memcpy(cp, data, len);
+	cp[len] = '\0';
+	return pa_arb_atom_of(atom);
+    }
+
+    xtzp->xtz_stats.xts_strings += 1;
+    xtzp->xtz_stats.xts_bytes += len + 1;
+
+#ifdef XI_TEXTPOOL_ZLIB
+    size_t clen = 0;
+
+    if (len >= XI_TEXT_MIN_DEFLATE && len <= UINT32_MAX
+	    && !xtzp->xtz_failed)
+	clen = xi_textpool_deflate(xtzp, data, len);
+
+    if (clen != 0) {
+	uint32_t len32 = len, clen32 = clen;
+
+	atom = pa_arb_alloc(prp, XI_TEXT_HDR_LEN + clen);
+	cp = pa_arb_atom_addr(prp, atom);
+	if (cp == NULL)
+	    return PA_NULL_ATOM;
+
+	cp[0] = XI_TEXT_DEFLATE;
+	memcpy(cp + 1, &len32, sizeof(len32));
+	memcpy(cp + 1 + sizeof(len32), &clen32, sizeof(clen32));
+	memcpy(cp + XI_TEXT_HDR_LEN, xtzp->xtz_out, clen);
+
+	xtzp->xtz_stats.xts_compressed += 1;
+	xtzp->xtz_stats.xts_stored += XI_TEXT_HDR_LEN + clen;
+	return pa_arb_atom_of(atom);
+    }
+#endif /* XI_TEXTPOOL_ZLIB */
+
+    atom = pa_arb_alloc(prp, len + 2);
+    cp = pa_arb_atom_addr(prp, atom);
+    if (cp == NULL)
+	return PA_NULL_ATOM;
+
+    cp[0] = XI_TEXT_PLAIN;
+    memcpy(cp + 1, data, len);
+    cp[len + 1] = '\0';
+
+    xtzp->xtz_stats.xts_stored += len + 2;
+    return pa_arb_atom_of(atom);
+}
+
+void
+xi_textpool_free (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    xi_textzip_t *xtzp = xwp->xw_textzip;
+    unsigned i;
+
+    if (atom == PA_NULL_ATOM)
+	return;
+
+    /* The atom may be reused, so forget any expanded copy */
+    if (xtzp) {
+	for (i = 0; i < XI_TEXTPOOL_RING; i++)
+	    if (xtzp->xtz_ring[i].xtb_atom == atom)
+		xtzp->xtz_ring[i].xtb_atom = PA_NULL_ATOM;
+    }
+
+    pa_arb_free_atom(xwp->xw_textpool, pa_arb_atom(atom));
+}
+
+const char *
+xi_textpool_expand (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    xi_textzip_t *xtzp = xwp->xw_textzip;
+    const psu_byte_t *cp;
+    unsigned i;
+
+    cp = pa_arb_atom_addr(xwp->xw_textpool, pa_arb_atom(atom));
+    if (cp == NULL)
+	return NULL;
+
+    if (cp[0] == XI_TEXT_PLAIN)
+	return (const char *) cp + 1;
+
+    if (cp[0] != XI_TEXT_DEFLATE || xtzp == NULL)
+	return NULL;
+
+    /* Strings tend to be read a few times in a row */
+    for (i = 0; i < XI_TEXTPOOL_RING; i++)
+	if (xtzp->xtz_ring[i].xtb_atom == atom)
+	    return xtzp->xtz_ring[i].xtb_data;
+
+#ifdef XI_TEXTPOOL_ZLIB
+    return xi_textpool_inflate(xtzp, atom, cp);
+#else
+    psu_log("xi_textpool_expand: atom %u needs zlib", atom);
+    return NULL;
+#endif
+}
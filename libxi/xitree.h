@@ -15,6 +15,7 @@
 #define LIBSLAX_XI_TREE_H
 
 #define XI_MAX_ATOMS	(1<<26)	/* Max number of nodes in a document */
+#define XI_MAX_ATOMS_WIDE (1<<30) /* Max number of nodes, with wide nodes */
 #define XI_SHIFT	12	/* Bit shift for packed array paging */
 #define XI_ISTR_SHIFT	2	/* Bit shift for immutable string storage */
 
@@ -39,6 +40,25 @@ typedef struct xi_node_s {
     xi_node_id_t xn_contents;	/* Child node or data (in this tree or data) */
 } xi_node_t;
 
+/*
+ * The compact node packs the name and namespace map into 32 bits,
+ * which limits a workspace to about a million name atoms and 4096
+ * namespace mappings.  A workspace opened with XWF_WIDE_NODES uses
+ * the wide node instead, which appends full-sized fields (leaving
+ * the packed ones zero), and allows more nodes.  Since everything
+ * else is at the same offset, code only needs to care when it's
+ * touching the name or namespace map, which is done through
+ * xi_node_name() and friends (in xiworkspace.h).
+ */
+typedef struct xi_node_wide_s {
+    xi_node_t xnw_node;		/* Compact node (name and ns unused) */
+    xi_name_id_t xnw_name;	/* Name of this node (in name db) */
+    xi_ns_id_t xnw_ns_map;	/* Namespace map for this node (in ns_map) */
+} xi_node_wide_t;
+
+#define XI_NAME_MAX_COMPACT	((1<<20) - 1) /* Largest packed xn_name */
+#define XI_NS_MAX_COMPACT	((1<<12) - 1) /* Largest packed xn_ns_map */
+
 #define XI_DEPTH_MIN	1	/* Depth of top of tree (origin 1) */
 #define XI_DEPTH_MAX	254	/* Max depth of tree */
 
@@ -46,6 +66,22 @@ typedef struct xi_node_s {
 #define XNF_ATTRIBS_PRESENT	(1<<0) /* Attributes available */
 #define XNF_ATTRIBS_EXTRACTED	(1<<1) /* Attributes aleady extracted */
 
+/*
+ * The identity of the source a tree was parsed from, so a tree in a
+ * file-backed mmap segment can be reused (XI_PF_CACHE) when the same,
+ * unchanged file is parsed again.  A null xts_root means the stamp
+ * is invalid.
+ */
+typedef struct xi_tree_stamp_s {
+    uint64_t xts_dev;		/* Device of the source file */
+    uint64_t xts_ino;		/* Inode of the source file */
+    uint64_t xts_size;		/* Size of the source file */
+    uint64_t xts_mtime_sec;	/* Modification time (seconds) */
+    uint64_t xts_mtime_nsec;	/* Modification time (nanoseconds) */
+    uint32_t xts_flags;		/* Source flags (XPSF_*) used in parsing */
+    xi_node_id_t xts_root;	/* Root of the parsed tree */
+} xi_tree_stamp_t;
+
 /*
  * Each tree (document or RTF) is represented as a tree.  The
  * xi_tree_info_t is the information that needs to persist in
@@ -54,14 +90,45 @@ typedef struct xi_node_s {
 typedef struct xi_tree_info_s {
     xi_node_id_t xti_root;	/* Number of the root node */
     xi_depth_t xti_max_depth;	/* Max depth of the tree */
+    xi_tree_stamp_t xti_stamp;	/* Source of the cached tree */
+    pa_mmap_atom_t xti_resume;	/* Resume state (xi_resume_info_t) */
 } xi_tree_info_t;
 
+/*
+ * When following a growing file (XI_PF_FOLLOW), each pause saves
+ * what we need to continue parsing, so a later parser (even in
+ * another process) can pick up where we stopped.  The insertion
+ * stack is saved as atoms and state numbers, rather than pointers.
+ */
+typedef struct xi_resume_frame_s {
+    xi_node_id_t xrf_atom;	/* Our node */
+    xi_node_id_t xrf_last_atom;	/* Last child we appended */
+    pa_atom_t xrf_old_name;	/* Old (original) name atom */
+    pa_atom_t xrf_state;	/* Rulebook state (or XI_STATE_EOL) */
+    xi_action_type_t xrf_action; /* Action being taken (XIA_*) */
+    uint8_t xrf_padding[3];	/* Padding this by hand */
+} xi_resume_frame_t;
+
+typedef struct xi_resume_info_s {
+    uint64_t xri_dev;		/* Device of the source file */
+    uint64_t xri_ino;		/* Inode of the source file */
+    uint64_t xri_offset;	/* Bytes of input consumed */
+    uint32_t xri_lineno;	/* Line number at xri_offset */
+    xi_node_id_t xri_root;	/* Root of the tree */
+    xi_node_id_t xri_last_atom;	/* Last node we inserted */
+    xi_depth_t xri_depth;	/* Current depth in hierarchy */
+    xi_depth_t xri_maxdepth;	/* Maximum depth seen */
+    uint8_t xri_padding[2];	/* Padding this by hand */
+    xi_resume_frame_t xri_stack[XI_DEPTH_MAX]; /* Insertion points */
+} xi_resume_info_t;
+
 /*
  * The in-memory representation of a tree
  */
 typedef struct xi_tree_s {
     xi_tree_info_t *xt_infop;	/* Base information */
     xi_workspace_t *xt_workspace; /* Our workspace */
+    xi_tree_info_t xt_info;	/* Our info block, for unnamed trees */
 } xi_tree_t;
 
 #define xt_root xt_infop->xti_root
@@ -89,6 +156,7 @@ typedef struct xi_insert_s {
     xi_depth_t xi_depth;	/* Current depth in hierarchy */
     xi_depth_t xi_maxdepth;	/* Maximum depth seen */
     unsigned xi_relation;	/* How to handle the next insertion */
+    xi_node_id_t xi_last_atom;	/* Last node we inserted (for extents) */
     xi_istack_t xi_stack[XI_DEPTH_MAX]; /* Insertion points */
 } xi_insert_t;
 
@@ -9,184 +9,428 @@
  * Phil Shafer <phil@>, September 2016
  */
 
-typedef xi_node_type_t (*xi_whiffle_source_next_token_func_t)
-	(void *opaque_state, char **datap, char **restp);
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
 
-typedef xi_node_type_t (*xi_whiffle_dest_next_token_func_t)
-	(void *opaque_state, xi_node_type_t type);
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xiwhiffle.h>
 
-typedef struct xi_whiffle_s {
-    void *xwf_source_state;
-    xi_whiffle_source_next_token_func_t xwf_source_func;
-    void *xwf_dest_state;
-    xi_whiffle_dest_next_token_func_t xwf_dest_func;
-} xi_whiffle_t;
+xi_whiffle_t *
+xi_whiffle_open (xi_rulebook_t *rulebook)
+{
+    xi_whiffle_t *xwfp = calloc(1, sizeof(*xwfp));
+    if (xwfp == NULL)
+	return NULL;
 
-static inline void
-xi_whiffle_set_source (xi_whiffle_t *xwfp,
-		       xi_whiffle_source_next_token_func_t func, void *data)
+    xwfp->xwf_rulebook = rulebook;
+    xwfp->xwf_default_action = XIA_SAVE;
+    xwfp->xwf_fd = -1;
+
+    if (rulebook)
+	xwfp->xwf_stack[0].xwff_statep
+	    = xi_rulebook_state(rulebook, XI_STATE_INITIAL);
+
+    return xwfp;
+}
+
+void
+xi_whiffle_close (xi_whiffle_t *xwfp)
+{
+    free(xwfp);
+}
+
+static xi_node_type_t
+xi_whiffle_source_file (void *opaque, char **datap, char **restp)
+{
+    return xi_source_next_token(opaque, datap, restp);
+}
+
+void
+xi_whiffle_set_source_file (xi_whiffle_t *xwfp, xi_source_t *srcp)
+{
+    xi_whiffle_set_source(xwfp, xi_whiffle_source_file, srcp);
+}
+
+static int
+xi_whiffle_write_fd (void *opaque, const char *buf, size_t len,
+		     xi_boolean_t done)
+{
+    xi_whiffle_t *xwfp = opaque;
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = write(xwfp->xwf_fd, buf, len);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	buf += rc;
+	len -= rc;
+    }
+
+    if (done && write(xwfp->xwf_fd, "\n", 1) != 1)
+	return -1;
+
+    return 0;
+}
+
+void
+xi_whiffle_set_fd (xi_whiffle_t *xwfp, int fd)
 {
-    xwfp->xwf_source_func = func;
-    xwfp->xwf_source_state = data;
+    xwfp->xwf_fd = fd;
+    xi_whiffle_set_output(xwfp, xi_whiffle_write_fd, xwfp);
+}
+
+static void
+xi_whiffle_flush (xi_whiffle_t *xwfp, xi_boolean_t done)
+{
+    if (xwfp->xwf_output_func && !(xwfp->xwf_flags & XWFF_FAILED)
+	    && xwfp->xwf_output_func(xwfp->xwf_output_state, xwfp->xwf_buf,
+				     xwfp->xwf_len, done))
+	xwfp->xwf_flags |= XWFF_FAILED;
+
+    xwfp->xwf_len = 0;
+}
+
+static void
+xi_whiffle_write (xi_whiffle_t *xwfp, const char *data, size_t len)
+{
+    size_t room;
+
+    while (len > 0) {
+	room = sizeof(xwfp->xwf_buf) - xwfp->xwf_len;
+	if (room == 0) {
+	    xi_whiffle_flush(xwfp, FALSE);
+	    continue;
+	}
+
+	if (room > len)
+	    room = len;
+
+	memcpy(xwfp->xwf_buf + xwfp->xwf_len, data, room);
+	xwfp->xwf_len += room;
+	data += room;
+	len -= room;
+    }
 }
 
 static inline void
-xi_whiffle_set_dest (xi_whiffle_t *xwfp,
-		     xi_whiffle_dest_next_token_func_t func, void *data)
+xi_whiffle_puts (xi_whiffle_t *xwfp, const char *str)
 {
-    xwfp->xwf_dest_func = func;
-    xwfp->xwf_dest_state = data;
+    xi_whiffle_write(xwfp, str, strlen(str));
 }
 
 static void
-xi_whiffle_process_token (xi_whiffle_t *xwfp, xi_node_type_t type)
+xi_whiffle_fragment_done (xi_whiffle_t *xwfp)
 {
-    ;
+    xwfp->xwf_fragments += 1;
+    xi_whiffle_flush(xwfp, TRUE);
 }
 
-static inline xi_node_type_t
-xi_whiffle_next_token (xi_whiffle_t *xwfp)
+static const char *
+xi_whiffle_tag (xi_whiffle_t *xwfp, pa_atom_t use_tag, const char *name)
 {
-    return xwfp->xwf_source_func(xwfp->xwf_source_state, xwfp);
+    const char *str = NULL;
+
+    if (use_tag != PA_NULL_ATOM)
+	str = xi_parse_namepool_string(xwfp->xwf_rulebook->xrb_script,
+				       use_tag);
+
+    return str ?: name;
 }
 
+/*
+ * Write a token to our output, as XML
+ */
 static void
-xi_whiffle_process (xi_whiffle_t *xwfp)
+xi_whiffle_emit (xi_whiffle_t *xwfp, xi_node_type_t type,
+		 const char *name, char *data, char *rest)
 {
-    xi_node_type_t type;
+    switch (type) {
+    case XI_TYPE_OPEN:
+    case XI_TYPE_EMPTY:
+	xi_whiffle_puts(xwfp, "<");
+	xi_whiffle_puts(xwfp, name);
+	if (rest) {
+	    xi_whiffle_puts(xwfp, " ");
+	    xi_whiffle_puts(xwfp, rest);
+	}
+	xi_whiffle_puts(xwfp, (type == XI_TYPE_EMPTY) ? "/>" : ">");
+	break;
+
+    case XI_TYPE_CLOSE:
+	xi_whiffle_puts(xwfp, "</");
+	xi_whiffle_puts(xwfp, name);
+	xi_whiffle_puts(xwfp, ">");
+	break;
+
+    case XI_TYPE_TEXT:
+	xi_whiffle_write(xwfp, data, rest - data);
+	break;
+
+    case XI_TYPE_CDATA:
+	xi_whiffle_puts(xwfp, "<![CDATA[");
+	xi_whiffle_write(xwfp, data, rest - data);
+	xi_whiffle_puts(xwfp, "]]>");
+	break;
 
-    for (type = xi_whiffle_next_token(xwfp); type != XI_TYPE_EOF;
-	 type = xi_whiffle_next_token(xwfp)) {
-	xi_whiffle_process_token(xwfp, type);
+    case XI_TYPE_COMMENT:
+	xi_whiffle_puts(xwfp, "<!--");
+	xi_whiffle_puts(xwfp, data);
+	xi_whiffle_puts(xwfp, "-->");
+	break;
+
+    case XI_TYPE_PI:
+	xi_whiffle_puts(xwfp, "<?");
+	xi_whiffle_puts(xwfp, data);
+	if (rest) {
+	    xi_whiffle_puts(xwfp, " ");
+	    xi_whiffle_puts(xwfp, rest);
+	}
+	xi_whiffle_puts(xwfp, "?>");
+	break;
     }
 }
 
-static inline xi_boolean_t
-xi_whiffle_ignore_child (xi_node_t *nodep)
+/*
+ * Find the rule for an open tag.  The name is looked up (without
+ * creating it) in the script's namepool, since that's where the
+ * rules' names live; a name that's not there can't match a rule.
+ */
+static xi_rule_t *
+xi_whiffle_find_rule (xi_whiffle_t *xwfp, xi_rstate_t *statep,
+		      const char *name, char *attribs)
 {
-    switch (nodep->xn_type) {
-    case XI_TYPE_ROOT:
-    case XI_TYPE_ELT:
-	return FALSE;
-    }
+    xi_rulebook_t *xrbp = xwfp->xwf_rulebook;
+    xi_rule_t *xrp = NULL;
 
-    return TRUE;
+    if (xrbp == NULL || statep == NULL)
+	return NULL;
+
+    const char *localp = strchr(name, ':');
+    localp = localp ? localp + 1 : name;
+
+    pa_atom_t name_atom = xi_parse_name_atom(xrbp->xrb_script, localp, FALSE);
+    if (name_atom != PA_NULL_ATOM)
+	xrp = xi_rulebook_find(xrbp->xrb_script, xrbp, statep, name_atom,
+			       NULL, localp, attribs);
+
+    if (xrp == NULL && statep->xrbs_default_rule != PA_NULL_ATOM)
+	xrp = xi_rulebook_rule(xrbp, statep->xrbs_default_rule);
+
+    return xrp;
 }
 
-typedef struct xi_whiffle_parse_as_source_s {
-    pa_atom_t xwps_first_atom;	/* First atom returned */
-    pa_atom_t xwps_last_atom;	/* Last atom returned */
-    xi_depth_t xwps_last_depth;	/* Depth of last node */
-    uint8_t xwps_direction;	/* Direction to proceed */
-    xi_node_t *xwps_last_nodep;	/* Last results */
-} xi_whiffle_parse_as_source_t;
+/*
+ * Handle a token while we're inside an element that's being copied
+ * or discarded whole, so no rules apply
+ */
+static void
+xi_whiffle_skip_token (xi_whiffle_t *xwfp, xi_node_type_t type,
+		       char *data, char *rest)
+{
+    xi_boolean_t copy = (xwfp->xwf_flags & XWFF_SKIP_COPY) ? TRUE : FALSE;
+    const char *name = data;
 
-/* Values for xwps_direction */
-#define XI_DIR_INIT	0	/* Fresh source */
-#define XI_DIR_SELF	1	/* Return self */
-#define XI_DIR_CHILD	2	/* Return child atom */
-#define XI_DIR_NEXT	3	/* Return next atom */
-#define XI_DIR_EOF	4	/* Return EOF */
+    if (type == XI_TYPE_OPEN) {
+	xwfp->xwf_skip_depth += 1;
 
-static xi_node_type_t
-xi_whiffle_parse_as_source (void *opaque, xi_whiffle_t *xwfp,
-			    xi_workspace_t *xwp)
-{
-    xi_whiffle_parse_as_source_t *xwpsp = opaque;
-
-    /* If we're at EOF, then we're done (and boring) */
-    if (xwpsp->xwps_direction = XI_TYPE_EOF) 
-	return XI_TYPE_EOF;
-
-    xi_node_type_t type = XI_TYPE_EOF;
-    uint8_t new_dir = XI_DIR_CHILD;
-    pa_atom_t atom = xwpsp->xwps_last_atom, new_atom = PA_NULL_ATOM;
-    xi_depth_t new_depth = xwpsp->xwps_last_depth;
-    xi_node_t *nodep = xwpsp->xwps_last_nodep;
-    xi_node_t *new_nodep = NULL;
-
-    if (nodep == NULL) {
-	/* Should not occur, but if it does ... */
-	new_dir = XI_DIR_EOF;
-	return XI_DIR_EOF;
+    } else if (type == XI_TYPE_CLOSE) {
+	if (--xwfp->xwf_skip_depth == 0)
+	    name = xi_whiffle_tag(xwfp, xwfp->xwf_skip_tag, data);
     }
 
-    /* The direction tells us our state and where we are heading next */
-    switch (xwpsp->xwps_direction) {
-    case XI_DIR_INIT:
-    case XI_DIR_SELF:
-	new_atom = xwpsp->xwps_first_atom;
-	break;
+    if (!copy)
+	return;
+
+    xi_whiffle_emit(xwfp, type, name, data, rest);
+
+    /* If we were the whole fragment, we're done with it */
+    if (xwfp->xwf_skip_depth == 0
+	    && !(xwfp->xwf_stack[xwfp->xwf_depth].xwff_flags & XWFFF_EMITTING))
+	xi_whiffle_fragment_done(xwfp);
+}
+
+/*
+ * Handle an open (or empty) tag by finding and acting on its rule.
+ * Returns -1 on failure, 1 for XIA_RETURN, and zero otherwise.
+ */
+static int
+xi_whiffle_open_tag (xi_whiffle_t *xwfp, xi_node_type_t type,
+		     char *data, char *rest)
+{
+    xi_whiffle_frame_t *framep = &xwfp->xwf_stack[xwfp->xwf_depth];
+    xi_boolean_t emitting = (framep->xwff_flags & XWFFF_EMITTING)
+	? TRUE : FALSE;
+    xi_rule_t *xrp;
+    xi_action_type_t act;
+    pa_atom_t use_tag;
+    int rc = 0;
+
+    xrp = xi_whiffle_find_rule(xwfp, framep->xwff_statep, data, rest);
+    act = xrp ? xrp->xr_action : xwfp->xwf_default_action;
+    use_tag = xrp ? xrp->xr_use_tag : PA_NULL_ATOM;
 
-    case XI_DIR_CHILD:
-	if (nodep->xn_contents != PA_NULL_ATOM) {
-	    new_atom = nodep->xn_contents;
-	    new_dir = XI_DIR_CHILD;
-	    type = XI_TYPE_OPEN;
-	    break;
+    switch (act) {
+    case XIA_DISCARD:
+	if (type == XI_TYPE_OPEN) {
+	    xwfp->xwf_flags &= ~XWFF_SKIP_COPY;
+	    xwfp->xwf_skip_depth = 1;
 	}
-	/* fallthru */
+	return 0;
+
+    case XIA_RETURN:
+	rc = 1;
+	break;
+
+    case XIA_EMIT:
+	/* Without a new state, there's nothing to look at inside */
+	if (xrp && xrp->xr_new_state == XI_STATE_EOL) {
+	    if (type == XI_TYPE_OPEN) {
+		xwfp->xwf_flags |= XWFF_SKIP_COPY;
+		xwfp->xwf_skip_depth = 1;
+		xwfp->xwf_skip_tag = use_tag;
+	    }
 
-    case XI_DIR_NEXT:
-	if (nodep->xn_next == PA_NULL_ATOM
-	    || nodep->xn_next == xwpsp->xwps_last_atom) {
-	    new_atom = PA_NULL_ATOM;
-	    break;
+	    xi_whiffle_emit(xwfp, type, xi_whiffle_tag(xwfp, use_tag, data),
+			    data, rest);
+	    if (type == XI_TYPE_EMPTY && !emitting)
+		xi_whiffle_fragment_done(xwfp);
+	    return 0;
 	}
 
-	new_atom = nodep->xn_next;
+	emitting = TRUE;
 	break;
     }
 
-    new_nodep = xi_node_addr(xwp, new_atom);
-    if (new_nodep == NULL)
-	new_depth = 0;
-    else {
-	if (new_dir == XI_DIR_CHILD && xi_whiffle_ignore_child(new_nodep))
-	    new_dir = XI_DIR_NEXT;
-
-	new_depth = new_nodep->xn_depth;
-	if (new_depth < xwpsp->xwps_last_depth) {
-	    /*
-	     * We're done with our parent's children; send a close event and
-	     * move to the next item;
-	     */
-	    new_dir = XI_DIR_NEXT;
-	    type = XI_TYPE_CLOSE;
-	} else {
-	    type = new_nodep->xn_type;
-	}
+    if (emitting)
+	xi_whiffle_emit(xwfp, type, xi_whiffle_tag(xwfp, use_tag, data),
+			data, rest);
+
+    if (type == XI_TYPE_EMPTY) {
+	if (emitting && !(framep->xwff_flags & XWFFF_EMITTING))
+	    xi_whiffle_fragment_done(xwfp);
+	return rc;
     }
 
-    slaxLog("parse-as-source: last: %d/%d/%p(%d) -> new: %d/%d/%p(%d) -> %d",
-	    xwpsp->xwps_direction, atom, nodep, xwpsp->xwps_last_depth,
-	    new_dir, new_atom, new_nodep, new_depth,
-	    type);
+    if (xwfp->xwf_depth + 1 >= XI_DEPTH_MAX) {
+	pa_warning(0, "whiffle: maximum depth exceeded: %s", data);
+	return -1;
+    }
 
-    /* Record results */
-    xwpsp->xwps_direction = new_dir;
-    xwpsp->xwps_last_atom = new_atom;
-    xwpsp->xwps_last_nodep = new_nodep;
-    xwpsp->xwps_last_depth = new_depth;
-    return type;
+    xi_whiffle_frame_t *newp = &xwfp->xwf_stack[++xwfp->xwf_depth];
+    newp->xwff_statep = framep->xwff_statep;
+    if (xrp && xrp->xr_new_state != XI_STATE_EOL)
+	newp->xwff_statep = xi_rulebook_state(xwfp->xwf_rulebook,
+					      xrp->xr_new_state);
+    newp->xwff_use_tag = emitting ? use_tag : PA_NULL_ATOM;
+    newp->xwff_flags = 0;
+    if (emitting) {
+	newp->xwff_flags |= XWFFF_EMITTING;
+	if (!(framep->xwff_flags & XWFFF_EMITTING))
+	    newp->xwff_flags |= XWFFF_FRAGMENT;
+    }
+
+    return rc;
 }
 
-typedef struct xi_whiffle_parse_as_dest_s {
-} xi_whiffle_parse_as_dest_t;
+static int
+xi_whiffle_process_token (xi_whiffle_t *xwfp, xi_node_type_t type,
+			  char *data, char *rest)
+{
+    xi_whiffle_frame_t *framep;
 
-void
-xi_whiffle_test (xi_parse_t *parsep)
+    if (xwfp->xwf_skip_depth > 0) {
+	xi_whiffle_skip_token(xwfp, type, data, rest);
+	return 0;
+    }
+
+    framep = &xwfp->xwf_stack[xwfp->xwf_depth];
+
+    switch (type) {
+    case XI_TYPE_OPEN:
+    case XI_TYPE_EMPTY:
+	return xi_whiffle_open_tag(xwfp, type, data, rest);
+
+    case XI_TYPE_CLOSE:
+	if (xwfp->xwf_depth == 0) {
+	    pa_warning(0, "whiffle: close for open that doesn't exist: %s",
+		       data);
+	    return -1;
+	}
+
+	if (framep->xwff_flags & XWFFF_EMITTING) {
+	    xi_whiffle_emit(xwfp, type,
+			    xi_whiffle_tag(xwfp, framep->xwff_use_tag, data),
+			    data, rest);
+	    if (framep->xwff_flags & XWFFF_FRAGMENT)
+		xi_whiffle_fragment_done(xwfp);
+	}
+
+	bzero(framep, sizeof(*framep));
+	xwfp->xwf_depth -= 1;
+	break;
+
+    default:
+	if (framep->xwff_flags & XWFFF_EMITTING)
+	    xi_whiffle_emit(xwfp, type, NULL, data, rest);
+	break;
+    }
+
+    return 0;
+}
+
+int
+xi_whiffle_process (xi_whiffle_t *xwfp)
 {
-    xi_whiffle_t xwf;
-    xi_whiffle_parse_as_source_t source;
-    xi_whiffle_parse_as_dest_t dest;
+    xi_node_type_t type;
+    char *data, *rest;
+    int rc;
+
+    if (xwfp->xwf_source_func == NULL)
+	return -1;
 
-    bzero(&xwf, sizeof(xwf));
-    bzero(&source, sizeof(source));
-    bzero(&dest, sizeof(dest));
+    for (;;) {
+	type = xwfp->xwf_source_func(xwfp->xwf_source_state, &data, &rest);
 
-    xi_whiffle_set_source(&xwf, xi_whiffle_parse_as_source, &source);
-    xi_whiffle_set_dest(&xwf, xi_whiffle_parse_as_dest, &dest);
+	switch (type) {
+	case XI_TYPE_NONE:
+	case XI_TYPE_FAIL:
+	    return -1;
 
-    xi_whiffle_process(&xwf);
+	case XI_TYPE_EOF:
+	    if (xwfp->xwf_len)
+		xi_whiffle_flush(xwfp, TRUE);
+	    return (xwfp->xwf_flags & XWFF_FAILED) ? -1 : 0;
+	}
+
+	rc = xi_whiffle_process_token(xwfp, type, data, rest);
+	if (rc == 0 && (xwfp->xwf_flags & XWFF_FAILED))
+	    rc = -1;
+	if (rc != 0)
+	    return rc;
+    }
 }
@@ -7,12 +7,127 @@
  * LICENSE.
  *
  * Phil Shafer <phil@>, September 2016
+ *
+ * "Whiffling" runs a rulebook directly against the token stream,
+ * without building a tree.  Elements that hit an XIA_EMIT rule are
+ * written (as XML) to an output callback, elements that hit
+ * XIA_DISCARD are skipped, and everything else is passed through,
+ * with rules applied to its children.  We only keep a frame per
+ * open element that rules are still looking at, so memory use doesn't
+ * grow with the size of the input, just its depth.
+ *
+ * Inside an emitted element, children are copied verbatim, unless
+ * the rule gave a new-state, in which case that state's rules are
+ * applied to the children, discarding those that hit XIA_DISCARD.
+ * Unlike xi_parse(), a state's default rule is honored when no other
+ * rule matches.
  */
 
 #ifndef LIBSLAX_XI_WHIFFLE_H
 #define LIBSLAX_XI_WHIFFLE_H
 
+/*
+ * Source of tokens; same contract as xi_source_next_token()
+ */
+typedef xi_node_type_t (*xi_whiffle_source_func_t)
+	(void *opaque, char **datap, char **restp);
+
+/*
+ * Destination for emitted XML.  A fragment may arrive in several
+ * pieces; 'done' is set on the last one.  Returns zero on success.
+ */
+typedef int (*xi_whiffle_output_func_t)
+	(void *opaque, const char *buf, size_t len, xi_boolean_t done);
+
+#define XI_WHIFFLE_BUFSIZ	(64 * 1024) /* Output buffer size */
+
+/*
+ * A frame for each element whose children we're applying rules to
+ */
+typedef struct xi_whiffle_frame_s {
+    xi_rstate_t *xwff_statep;	/* State for our children */
+    pa_atom_t xwff_use_tag;	/* Tag we emitted instead (in script) */
+    uint8_t xwff_flags;		/* Flags (XWFFF_*) */
+} xi_whiffle_frame_t;
+
+/* Flags for xwff_flags */
+#define XWFFF_EMITTING	(1<<0)	/* We're inside an emitted element */
+#define XWFFF_FRAGMENT	(1<<1)	/* We're the top of the emitted fragment */
+
+typedef struct xi_whiffle_s {
+    void *xwf_source_state;	/* Opaque data for source function */
+    xi_whiffle_source_func_t xwf_source_func; /* Source of tokens */
+    void *xwf_output_state;	/* Opaque data for output function */
+    xi_whiffle_output_func_t xwf_output_func; /* Destination for output */
+    xi_rulebook_t *xwf_rulebook; /* Rules to apply */
+    xi_action_type_t xwf_default_action; /* When no rule matches */
+    unsigned xwf_flags;		/* Flags (XWFF_*) */
+    int xwf_fd;			/* File descriptor, for xi_whiffle_set_fd() */
+    xi_depth_t xwf_depth;	/* Depth of our frame stack */
+    uint32_t xwf_skip_depth;	/* Depth inside a copied/discarded element */
+    pa_atom_t xwf_skip_tag;	/* Tag to emit for copied element's close */
+    uint64_t xwf_fragments;	/* Number of fragments emitted */
+    size_t xwf_len;		/* Bytes used in xwf_buf */
+    char xwf_buf[XI_WHIFFLE_BUFSIZ]; /* Output buffer */
+    xi_whiffle_frame_t xwf_stack[XI_DEPTH_MAX]; /* Open elements */
+} xi_whiffle_t;
+
+/* Flags for xwf_flags */
+#define XWFF_SKIP_COPY	(1<<0)	/* xwf_skip_depth is copying, not discarding */
+#define XWFF_FAILED	(1<<1)	/* Output failed */
+
+xi_whiffle_t *
+xi_whiffle_open (xi_rulebook_t *rulebook);
+
 void
-xi_whiffle_test (xi_parse_t *parsep);
+xi_whiffle_close (xi_whiffle_t *xwfp);
+
+static inline void
+xi_whiffle_set_source (xi_whiffle_t *xwfp,
+		       xi_whiffle_source_func_t func, void *data)
+{
+    xwfp->xwf_source_func = func;
+    xwfp->xwf_source_state = data;
+}
+
+static inline void
+xi_whiffle_set_output (xi_whiffle_t *xwfp,
+		       xi_whiffle_output_func_t func, void *data)
+{
+    xwfp->xwf_output_func = func;
+    xwfp->xwf_output_state = data;
+}
+
+static inline void
+xi_whiffle_set_default_action (xi_whiffle_t *xwfp, xi_action_type_t action)
+{
+    xwfp->xwf_default_action = action;
+}
+
+static inline uint64_t
+xi_whiffle_fragments (xi_whiffle_t *xwfp)
+{
+    return xwfp->xwf_fragments;
+}
+
+/*
+ * Read tokens from an xi_source_t
+ */
+void
+xi_whiffle_set_source_file (xi_whiffle_t *xwfp, xi_source_t *srcp);
+
+/*
+ * Write emitted fragments to a file descriptor, one per line
+ */
+void
+xi_whiffle_set_fd (xi_whiffle_t *xwfp, int fd);
+
+/*
+ * Run tokens through the rules until EOF (returning zero), failure
+ * (returning -1), or an XIA_RETURN rule (returning 1, after which
+ * xi_whiffle_process() can be called again to pick up where we left off).
+ */
+int
+xi_whiffle_process (xi_whiffle_t *xwfp);
 
 #endif /* LIBSLAX_XI_WHIFFLE_H */
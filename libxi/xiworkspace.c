@@ -29,8 +29,8 @@
 #include <limits.h>
 
 #include "slaxconfig.h"
-#include <libslax/slaxdef.h>
-#include <libslax/slax.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
@@ -46,45 +46,91 @@
 #include <libxi/xiworkspace.h>
 #include <libxi/xinodeset.h>
 #include <libxi/xiparse.h>
+#include <libxi/xiindex.h>
 
 xi_workspace_t *
 xi_workspace_open (pa_mmap_t *pmp, const char *name)
 {
-    pa_istr_t *names = NULL;
-    pa_pat_t *names_index = NULL;
-    pa_fixed_t *ns_map = NULL;
-    pa_pat_t *ns_map_index = NULL;
-    pa_istr_t *pip = NULL;
+    return xi_workspace_open_flags(pmp, name, 0);
+}
+
+xi_workspace_t *
+xi_workspace_open_flags (pa_mmap_t *pmp, const char *name, unsigned flags)
+{
+    /* Our namepool is our own, and shares our name */
+    xi_namepool_t *xnpp = xi_namepool_create(pmp, name);
+    if (xnpp == NULL)
+	return NULL;
+
+    xi_workspace_t *workp = xi_workspace_open_shared(pmp, name, xnpp, flags);
+    xi_namepool_release(xnpp);	/* The workspace has its own reference */
+
+    return workp;
+}
+
+/*
+ * Build the header name for one of our pools.  Anonymous workspaces
+ * have headerless pools, so we return NULL for them.
+ */
+static inline const char *
+xi_workspace_pool_name (char *namebuf, const char *name, const char *ext)
+{
+    return name ? xi_mk_name(namebuf, name, ext) : NULL;
+}
+
+/*
+ * Close the pools of a workspace.  No one can find the data of an
+ * anonymous workspace again, so we give its memory back.
+ */
+static void
+xi_workspace_close_pools (psu_boolean_t anonymous, pa_fixed_t *nodes,
+			  pa_arb_t *pap, pa_fixed_t *nodeset_chunks,
+			  pa_fixed_t *nodeset_info)
+{
+    void (*fixed_close)(pa_fixed_t *)
+	= anonymous ? pa_fixed_release : pa_fixed_close;
+
+    if (nodeset_chunks != NULL)
+	fixed_close(nodeset_chunks);
+    if (nodeset_info != NULL)
+	fixed_close(nodeset_info);
+    if (pap != NULL) {
+	if (anonymous)
+	    pa_arb_release(pap);
+	else pa_arb_close(pap);
+    }
+    if (nodes != NULL)
+	fixed_close(nodes);
+}
+
+xi_workspace_t *
+xi_workspace_open_shared (pa_mmap_t *pmp, const char *name,
+			  xi_namepool_t *xnpp, unsigned flags)
+{
     pa_arb_t *pap = NULL;
-    pa_pat_t *ppp = NULL;
     xi_node_t *nodep = NULL;
     pa_fixed_t *nodes = NULL;
     xi_workspace_t *workp = NULL;
     char namebuf[PA_MMAP_HEADER_NAME_LEN];
     pa_fixed_t *nodeset_chunks = NULL, *nodeset_info = NULL;
 
-    /* Holds the names of our elements, attributes, etc */
-    xi_mk_name(namebuf, name, "names");
-    xi_namepool_open(pmp, namebuf, &names, &names_index);
-    if (names == NULL)
-	goto fail;
-
-    xi_mk_name(namebuf, name, "namespaces");
-    xi_ns_open(pmp, namebuf, &ns_map, &ns_map_index);
-    if (ns_map == NULL)
-	goto fail;
-
-    nodes = pa_fixed_open(pmp, xi_mk_name(namebuf, name, "nodes"), XI_SHIFT,
-			 sizeof(*nodep), XI_MAX_ATOMS);
+    if (flags & XWF_WIDE_NODES)
+	nodes = pa_fixed_open(pmp, xi_workspace_pool_name(namebuf, name, "nodes"),
+			      XI_SHIFT, sizeof(xi_node_wide_t),
+			      XI_MAX_ATOMS_WIDE);
+    else
+	nodes = pa_fixed_open(pmp, xi_workspace_pool_name(namebuf, name, "nodes"),
+			      XI_SHIFT, sizeof(*nodep), XI_MAX_ATOMS);
     if (nodes == NULL)
 	goto fail;
 
-    pap = pa_arb_open(pmp, xi_mk_name(namebuf, name, "data"));
+    pap = pa_arb_open(pmp, xi_workspace_pool_name(namebuf, name, "data"));
     if (pap == NULL)
 	goto fail;
 
     nodeset_chunks = pa_fixed_open(pmp,
-			xi_mk_name(namebuf, name, "nodeset-chunks"), XI_SHIFT,
+			xi_workspace_pool_name(namebuf, name, "nodeset-chunks"),
+			XI_SHIFT,
 			XI_NODESET_CHUNK_SIZE, XI_MAX_ATOMS);
     if (nodeset_chunks == NULL)
 	goto fail;
@@ -93,7 +139,8 @@ xi_workspace_open (pa_mmap_t *pmp, const char *name)
     pa_fixed_set_flags(nodeset_chunks, PFF_INIT_ZERO);
 
     nodeset_info = pa_fixed_open(pmp,
-			xi_mk_name(namebuf, name, "nodeset-info"), XI_SHIFT,
+			xi_workspace_pool_name(namebuf, name, "nodeset-info"),
+			XI_SHIFT,
 			sizeof(xi_nodeset_info_t), XI_MAX_ATOMS);
     if (nodeset_info == NULL)
 	goto fail;
@@ -105,12 +152,24 @@ xi_workspace_open (pa_mmap_t *pmp, const char *name)
     if (workp == NULL)
 	goto fail;
 
+    if (flags & XWF_COMPRESS_TEXT) {
+	workp->xw_textzip = xi_textzip_create();
+	if (workp->xw_textzip == NULL) {
+	    free(workp);
+	    goto fail;
+	}
+    }
+
     workp->xw_mmap = pmp;
+    workp->xw_flags = flags;
+    if (name == NULL)
+	workp->xw_flags |= XWF_ANONYMOUS;
+    workp->xw_namepool = xi_namepool_ref(xnpp);
     workp->xw_nodes = nodes;
-    workp->xw_names = names;
-    workp->xw_names_index = names_index;
-    workp->xw_ns_map = ns_map;
-    workp->xw_ns_map_index = ns_map_index;
+    workp->xw_names = xnpp->xnp_names;
+    workp->xw_names_index = xnpp->xnp_names_index;
+    workp->xw_ns_map = xnpp->xnp_ns_map;
+    workp->xw_ns_map_index = xnpp->xnp_ns_map_index;
     workp->xw_textpool = pap;
     workp->xw_nodeset_chunks = nodeset_chunks;
     workp->xw_nodeset_info = nodeset_info;
@@ -118,30 +177,80 @@ xi_workspace_open (pa_mmap_t *pmp, const char *name)
     return workp;
 
  fail:
-    if (nodeset_chunks != NULL)
-	pa_fixed_close(nodeset_chunks);
-    if (nodeset_info != NULL)
-	pa_fixed_close(nodeset_info);
-    if (pap != NULL)
-	pa_arb_close(pap);
-    if (pip != NULL)
-	pa_istr_close(pip);
-    if (ppp != NULL)
-	pa_pat_close(ppp);
-    if (nodes != NULL)
-	pa_fixed_close(nodes);
-    if (names != NULL)
-	pa_istr_close(names);
-    if (names_index != NULL)
-	pa_pat_close(names_index);
-    if (ns_map != NULL)
-	pa_fixed_close(ns_map);
-    if (ns_map_index != NULL)
-	pa_pat_close(ns_map_index);
+    xi_workspace_close_pools(name == NULL, nodes, pap,
+			     nodeset_chunks, nodeset_info);
 
     return NULL;
 }
 
+void
+xi_workspace_close (xi_workspace_t *xwp)
+{
+    if (xwp == NULL)
+	return;
+
+    if (xwp->xw_name_index)
+	xi_name_index_destroy(xwp->xw_name_index);
+
+    free(xwp->xw_extents);
+    xi_textzip_destroy(xwp->xw_textzip);
+
+    xi_workspace_close_pools(xwp->xw_flags & XWF_ANONYMOUS,
+			     xwp->xw_nodes, xwp->xw_textpool,
+			     xwp->xw_nodeset_chunks, xwp->xw_nodeset_info);
+
+    xi_namepool_release(xwp->xw_namepool);
+    free(xwp);
+}
+
+xi_namepool_t *
+xi_namepool_create (pa_mmap_t *pmp, const char *name)
+{
+    char namebuf[PA_MMAP_HEADER_NAME_LEN];
+    xi_namepool_t *xnpp = calloc(1, sizeof(*xnpp));
+
+    if (xnpp == NULL)
+	return NULL;
+
+    /* Holds the names of our elements, attributes, etc */
+    xi_mk_name(namebuf, name, "names");
+    xi_namepool_open(pmp, namebuf, &xnpp->xnp_names, &xnpp->xnp_names_index);
+    if (xnpp->xnp_names == NULL)
+	goto fail;
+
+    xi_mk_name(namebuf, name, "namespaces");
+    xi_ns_open(pmp, namebuf, &xnpp->xnp_ns_map, &xnpp->xnp_ns_map_index);
+    if (xnpp->xnp_ns_map == NULL)
+	goto fail;
+
+    xnpp->xnp_mmap = pmp;
+    xnpp->xnp_refcount = 1;
+
+    return xnpp;
+
+ fail:
+    if (xnpp->xnp_names != NULL)
+	pa_istr_close(xnpp->xnp_names);
+    if (xnpp->xnp_names_index != NULL)
+	pa_pat_close(xnpp->xnp_names_index);
+    free(xnpp);
+
+    return NULL;
+}
+
+void
+xi_namepool_release (xi_namepool_t *xnpp)
+{
+    if (xnpp == NULL || --xnpp->xnp_refcount > 0)
+	return;
+
+    pa_pat_close(xnpp->xnp_names_index);
+    pa_istr_close(xnpp->xnp_names);
+    pa_pat_close(xnpp->xnp_ns_map_index);
+    pa_fixed_close(xnpp->xnp_ns_map);
+    free(xnpp);
+}
+
 void
 xi_namepool_open (pa_mmap_t *pmap, const char *basename,
 		  pa_istr_t **namesp, pa_pat_t **names_indexp)
@@ -164,14 +273,18 @@ xi_namepool_open (pa_mmap_t *pmap, const char *basename,
 	return;
     }
 
+    /* The hash index is an accelerator; we can live without it */
+    pa_istr_hash_open(pip, xi_mk_name(namebuf, basename, "hash"), 0);
+
     *namesp = pip;
     *names_indexp = ppp;
 }
 
 static const uint8_t *
-xi_ns_key_func (pa_pat_t *pp, pa_pat_node_t *node)
+xi_ns_key_func (pa_pat_t *pp, pa_pat_data_atom_t datom)
 {
-    return pa_fixed_atom_addr(pp->pp_data, node->ppn_data);
+    return pa_fixed_atom_addr(pp->pp_data,
+			      pa_fixed_atom(pa_pat_data_atom_of(datom)));
 }
 
 void
@@ -200,38 +313,79 @@ xi_ns_open (pa_mmap_t *pmap, const char *basename,
     *ns_indexp = ppp;
 }
 
+int
+xi_node_set_extent (xi_workspace_t *xwp, pa_atom_t node_atom,
+		    pa_atom_t extent)
+{
+    if (node_atom >= xwp->xw_extents_max) {
+	uint32_t max = xwp->xw_extents_max ?: 1024;
+	while (max <= node_atom)
+	    max <<= 1;
+
+	pa_atom_t *extents = realloc(xwp->xw_extents, max * sizeof(*extents));
+	if (extents == NULL)
+	    return -1;
+
+	bzero(extents + xwp->xw_extents_max,
+	      (max - xwp->xw_extents_max) * sizeof(*extents));
+	xwp->xw_extents = extents;
+	xwp->xw_extents_max = max;
+    }
+
+    xwp->xw_extents[node_atom] = extent;
+    return 0;
+}
+
 /*
  * Return a name atom for a string in the name pool.  Our patricia tree
  * has data atoms that are istr atoms, which we turn into name atoms.
  * It's some ugly "atom smashing" that keeps us type safe.  Think of it
  * as lead shielding.
+ *
+ * The istr hash index (when present) answers most lookups without a
+ * tree descent; the tree remains the authority, so names that predate
+ * the hash index are found there and then added to the hash.
  */
-xi_name_atom_t
+pa_atom_t
 xi_namepool_atom (xi_workspace_t *xwp, const char *data, xi_boolean_t createp)
 {
-    uint16_t len = strlen(data) + 1;
+    size_t slen = strlen(data);
+    uint16_t len = slen + 1;
     pa_pat_t *ppp = xwp->xw_names_index;
+    pa_istr_t *pip = xwp->xw_names;
+    psu_boolean_t hashed = (pip->pi_hashp != NULL && slen > 1);
+
+    if (hashed) {
+	pa_istr_atom_t iatom = pa_istr_hash_find(pip, data, slen);
+	if (!pa_istr_is_null(iatom))
+	    return pa_istr_atom_of(iatom);
+    }
 
     pa_pat_data_atom_t datom = pa_pat_get_atom(ppp, len, data);
-    if (pa_pat_data_is_null(datom) && createp) {
-	/* Allocate the name from our pool and add it to the tree */
-	pa_istr_atom_t iatom = pa_istr_string(xwp->xw_names, data);
-	datom = pa_pat_data_atom(pa_istr_atom_of(iatom));
-	if (pa_istr_is_null(atom))
-	    pa_warning(0, "namepool create key failed for key '%s'", data);
-	else if (!pa_pat_add(ppp, datom, len))
-	    pa_warning(0, "duplicate key: %s", data);
+    if (pa_pat_data_is_null(datom)) {
+	if (createp) {
+	    /* Allocate the name from our pool and add it to the tree */
+	    pa_istr_atom_t iatom = pa_istr_string(pip, data);
+	    datom = pa_pat_data_atom(pa_istr_atom_of(iatom));
+	    if (pa_istr_is_null(iatom))
+		pa_warning(0, "namepool create key failed for key '%s'", data);
+	    else if (!pa_pat_add(ppp, datom, len))
+		pa_warning(0, "duplicate key: %s", data);
+	    else if (hashed)
+		pa_istr_hash_add(pip, iatom);
+	}
+
+    } else if (hashed) {
+	pa_istr_hash_add(pip, pa_istr_atom(pa_pat_data_atom_of(datom)));
     }
 
-    xi_name_atom_t atom = xi_name_atom_t(pa_pat_data_atom_of(datom));
-    return atom;
+    return pa_pat_data_atom_of(datom);
 }
 
 pa_atom_t
 xi_get_attrib (xi_workspace_t *xwp, xi_node_t *nodep, pa_atom_t name_atom)
 {
     pa_atom_t node_atom;
-    int attrib_seen = FALSE;
     xi_depth_t depth = nodep->xn_depth;
 
     if (!(nodep->xn_flags & XNF_ATTRIBS_PRESENT))
@@ -254,9 +408,7 @@ xi_get_attrib (xi_workspace_t *xwp, xi_node_t *nodep, pa_atom_t name_atom)
 	if (nodep->xn_type != XI_TYPE_ATTRIB)
 	    continue;
 
-	attrib_seen = TRUE;
-
-	if (nodep->xn_name == name_atom)
+	if (xi_node_name(xwp, nodep) == name_atom)
 	    return nodep->xn_contents;
     }
 
@@ -300,7 +452,7 @@ xi_ns_find (xi_workspace_t *xwp, const char *prefix, const char *uri,
 
     pa_pat_t *ppp = xwp->xw_ns_map_index;
     xi_ns_map_t ns = { prefix_atom, uri_atom };
-    pa_atom_t atom = pa_pat_get_atom(ppp, sizeof(ns), &ns);
+    pa_atom_t atom = pa_pat_data_atom_of(pa_pat_get_atom(ppp, sizeof(ns), &ns));
     if (atom == PA_NULL_ATOM && createp) {
 	xi_ns_map_t *nsp = xi_ns_map_alloc(xwp, &atom);
 	if (nsp == NULL) {
@@ -312,7 +464,7 @@ xi_ns_find (xi_workspace_t *xwp, const char *prefix, const char *uri,
 	*nsp = ns;		/* Initialize newly allocated ns_map entry */
 
 	/* Add it to the patricia tree */
-	if (!pa_pat_add(ppp, atom, sizeof(ns))) {
+	if (!pa_pat_add(ppp, pa_pat_data_atom(atom), sizeof(ns))) {
 	    xi_ns_map_free(xwp, atom);
 
 	    pa_warning(0, "duplicate key failure for namespace '%s%s%s'",
@@ -33,21 +33,94 @@ typedef struct xi_ns_map_s {
     pa_atom_t xnm_uri;		/* Atom of URL string (in namepool) */
 } xi_ns_map_t;
 
+/*
+ * The names (element, attribute, prefix, URI) and namespace mappings
+ * of a workspace.  Many small documents can share one set, so each
+ * new document only needs node and text storage of its own.  The
+ * sharers hold references; the last release closes it.  Name and
+ * mapping atoms are then comparable across those documents.
+ */
+typedef struct xi_namepool_s {
+    pa_mmap_t *xnp_mmap;	/* Memory holding our pools */
+    pa_istr_t *xnp_names;	/* Array of names (element, attr, etc) */
+    pa_pat_t *xnp_names_index;	/* Patricia tree for names */
+    pa_fixed_t *xnp_ns_map;	/* Map from prefixes to URLs (xi_ns_map_t) */
+    pa_pat_t *xnp_ns_map_index;	/* Index of xnp_ns_map entries */
+    unsigned xnp_refcount;	/* Number of holders */
+} xi_namepool_t;
+
 typedef struct xi_workspace_s {
     pa_mmap_t *xw_mmap;	/* Base memory information */
+    xi_namepool_t *xw_namepool;	/* Our names (maybe shared) */
     pa_fixed_t *xw_nodes;	/* Pool of nodes (xi_node_t) */
     pa_istr_t *xw_names;	/* Array of names (element, attr, etc) */
     pa_pat_t *xw_names_index;	/* Patricia tree for names */
     pa_fixed_t *xw_ns_map; /* Map from prefixes to URLs (xi_ns_map_t) */
     pa_pat_t *xw_ns_map_index;	/* Index of xw_ns_map entries */
     pa_arb_t *xw_textpool;	/* Text data values */
+    struct xi_textzip_s *xw_textzip; /* Compression (XWF_COMPRESS_TEXT) */
     pa_fixed_t *xw_nodeset_chunks; /* Pool of chunks for nodesets node lists */
     pa_fixed_t *xw_nodeset_info; /* Pool of chunks for nodeset "info" data */
+    struct xi_name_index_s *xw_name_index; /* Per-name index (XI_PF_NAME_INDEX) */
+    pa_atom_t *xw_extents;	/* Last descendant, by node (XI_PF_EXTENTS) */
+    uint32_t xw_extents_max;	/* Number of entries in xw_extents */
+    unsigned xw_flags;		/* Flags (XWF_*) */
 } xi_workspace_t;
 
+/* Flags for xw_flags */
+#define XWF_WIDE_NODES	(1<<0)	/* Nodes are xi_node_wide_t */
+#define XWF_ANONYMOUS	(1<<1)	/* No name; pools are headerless */
+#define XWF_COMPRESS_TEXT (1<<2) /* Text pool holds compressed strings */
+
 xi_workspace_t *
 xi_workspace_open (pa_mmap_t *pmp, const char *name);
 
+/*
+ * Open a workspace with flags (XWF_*), which choose the node layout
+ */
+xi_workspace_t *
+xi_workspace_open_flags (pa_mmap_t *pmp, const char *name, unsigned flags);
+
+/*
+ * Open a workspace with a namepool that other workspaces may also be
+ * using.  We take our own reference to the namepool.  With a NULL
+ * name, the workspace is anonymous: its pools take no space in the
+ * mmap header, so there can be any number of them, but they can't be
+ * found again once the workspace is closed.
+ */
+xi_workspace_t *
+xi_workspace_open_shared (pa_mmap_t *pmp, const char *name,
+			  xi_namepool_t *xnpp, unsigned flags);
+
+/*
+ * Close a workspace, releasing its namepool.  The node and text data
+ * of a named workspace stay in the mmap segment (and are found again
+ * by opening the same name); an anonymous workspace gives its memory
+ * back to the segment.
+ */
+void
+xi_workspace_close (xi_workspace_t *xwp);
+
+/*
+ * Open the namepool (names and namespace mappings) called 'name',
+ * with one reference, for the caller.
+ */
+xi_namepool_t *
+xi_namepool_create (pa_mmap_t *pmp, const char *name);
+
+static inline xi_namepool_t *
+xi_namepool_ref (xi_namepool_t *xnpp)
+{
+    xnpp->xnp_refcount += 1;
+    return xnpp;
+}
+
+/*
+ * Drop a reference, closing the namepool when it's the last one
+ */
+void
+xi_namepool_release (xi_namepool_t *xnpp);
+
 void
 xi_namepool_open (pa_mmap_t *pmap, const char *basename,
 		  pa_istr_t **namesp, pa_pat_t **names_indexp);
@@ -60,25 +133,145 @@ pa_atom_t
 xi_ns_find (xi_workspace_t *xwp, const char *prefix, const char *uri,
 	    xi_boolean_t createp);
 
-PA_FIXED_FUNCTIONS(xi_node_atom_t, xi_node_t, xi_workspace_t, xw_nodes,
+XI_FIXED_FUNCTIONS(xi_node_t, xi_workspace_t, xw_nodes,
 		   xi_node_alloc, xi_node_free, xi_node_addr);
 
+/*
+ * Accessors for the fields that differ between compact and wide
+ * nodes.  The setters return -1 if the value won't fit.
+ */
+static inline xi_name_id_t
+xi_node_name (xi_workspace_t *xwp, xi_node_t *nodep)
+{
+    if (xwp->xw_flags & XWF_WIDE_NODES)
+	return ((xi_node_wide_t *) nodep)->xnw_name;
+    return nodep->xn_name;
+}
+
+static inline int
+xi_node_set_name (xi_workspace_t *xwp, xi_node_t *nodep, xi_name_id_t name)
+{
+    if (xwp->xw_flags & XWF_WIDE_NODES) {
+	((xi_node_wide_t *) nodep)->xnw_name = name;
+	nodep->xn_name = PA_NULL_ATOM;
+	return 0;
+    }
+
+    nodep->xn_name = name;
+    return (name > XI_NAME_MAX_COMPACT) ? -1 : 0;
+}
+
+static inline xi_ns_id_t
+xi_node_ns_map (xi_workspace_t *xwp, xi_node_t *nodep)
+{
+    if (xwp->xw_flags & XWF_WIDE_NODES)
+	return ((xi_node_wide_t *) nodep)->xnw_ns_map;
+    return nodep->xn_ns_map;
+}
+
+static inline int
+xi_node_set_ns_map (xi_workspace_t *xwp, xi_node_t *nodep, xi_ns_id_t ns_map)
+{
+    if (xwp->xw_flags & XWF_WIDE_NODES) {
+	((xi_node_wide_t *) nodep)->xnw_ns_map = ns_map;
+	nodep->xn_ns_map = PA_NULL_ATOM;
+	return 0;
+    }
+
+    nodep->xn_ns_map = ns_map;
+    return (ns_map > XI_NS_MAX_COMPACT) ? -1 : 0;
+}
+
 pa_atom_t
 xi_namepool_atom (xi_workspace_t *xwp, const char *data, xi_boolean_t createp);
 
+/*
+ * Since node atoms are allocated in document order, the subtree
+ * under a closed element is the range of atoms from the element to
+ * its "extent", the last node inserted before it closed.  Extents are
+ * only recorded when parsing with XI_PF_EXTENTS; for other nodes (and
+ * for leaf nodes, which are their own extent), we return PA_NULL_ATOM
+ * and the caller has to walk the tree.
+ */
+static inline pa_atom_t
+xi_node_extent (xi_workspace_t *xwp, pa_atom_t node_atom)
+{
+    if (node_atom >= xwp->xw_extents_max)
+	return PA_NULL_ATOM;
+
+    return xwp->xw_extents[node_atom];
+}
+
+int
+xi_node_set_extent (xi_workspace_t *xwp, pa_atom_t node_atom,
+		    pa_atom_t extent);
+
 static inline const char *
 xi_namepool_string (xi_workspace_t *xwp, pa_atom_t name_atom)
 {
-    return pa_istr_atom_string(xwp->xw_names, name_atom);
+    return pa_istr_atom_string(xwp->xw_names, pa_istr_atom(name_atom));
 }
 
 pa_atom_t
 xi_get_attrib (xi_workspace_t *xwp, xi_node_t *nodep, pa_atom_t name_atom);
 
+/*
+ * The text pool holds the values of text nodes and attributes.  With
+ * XWF_COMPRESS_TEXT, each string is stored behind a one-byte tag, and
+ * long strings are deflated (using the dictionary, if one is set).
+ * These are expanded when they are read, into a small ring of
+ * buffers, so a string from a compressed workspace is only good until
+ * XI_TEXTPOOL_RING more strings have been expanded.  A workspace must
+ * always be opened with the same XWF_COMPRESS_TEXT setting and, if
+ * there is one, the same dictionary.
+ */
+#define XI_TEXTPOOL_RING	8 /* Expanded strings kept at one time */
+
+pa_atom_t
+xi_textpool_alloc (xi_workspace_t *xwp, const char *data, size_t len);
+
+void
+xi_textpool_free (xi_workspace_t *xwp, pa_atom_t atom);
+
+const char *
+xi_textpool_expand (xi_workspace_t *xwp, pa_atom_t atom);
+
+/*
+ * Set the dictionary used to compress text, typically a sample of
+ * the sort of content the workspace will hold.  It must be set
+ * before any text is stored; returns -1 if it can't be used.
+ */
+int
+xi_textpool_set_dictionary (xi_workspace_t *xwp, const char *data,
+			    size_t len);
+
+typedef struct xi_textpool_stats_s {
+    uint64_t xts_strings;	/* Strings stored */
+    uint64_t xts_compressed;	/* Strings stored compressed */
+    uint64_t xts_bytes;		/* Bytes given to us */
+    uint64_t xts_stored;	/* Bytes allocated to hold them */
+    uint64_t xts_expands;	/* Strings inflated when read */
+} xi_textpool_stats_t;
+
+/*
+ * Report what's been stored since the workspace was opened
+ */
+void
+xi_textpool_stats (xi_workspace_t *xwp, xi_textpool_stats_t *statsp);
+
+struct xi_textzip_s *
+xi_textzip_create (void);
+
+void
+xi_textzip_destroy (struct xi_textzip_s *xtzp);
+
 static inline const char *
 xi_textpool_string (xi_workspace_t *xwp, pa_atom_t atom)
 {
-    return pa_arb_atom_addr(xwp->xw_textpool, atom);
+    if (xwp->xw_flags & XWF_COMPRESS_TEXT)
+	return xi_textpool_expand(xwp, atom);
+
+    return pa_arb_atom_addr(xwp->xw_textpool, pa_arb_atom(atom));
 }
 
 static inline const char *
@@ -89,12 +282,8 @@ xi_get_attrib_string (xi_workspace_t *xwp, xi_node_t *nodep,
     return (atom == PA_NULL_ATOM) ? NULL : xi_textpool_string(xwp, atom);
 }
 
-PA_ATOM_TYPE(xi_ns_map_id_t, xi_ns_map_id_s, xnm_atom, xi_ns_map_id_is_null,
-	     xi_ns_map_id, xi_ns_map_null_atom);
-
-PA_FIXED_FUNCTIONS(xi_ns_map_id_t, xi_ns_map_t, xi_workspace_t, xw_ns_map,
-		   xi_ns_map_alloc, xi_ns_map_free, xi_ns_map_addr,
-		   xi_ns_map_id_is_null, xi_ns_map_id);
+XI_FIXED_FUNCTIONS(xi_ns_map_t, xi_workspace_t, xw_ns_map,
+		   xi_ns_map_alloc, xi_ns_map_free, xi_ns_map_addr);
 
 #endif /* LIBSLAX_XI_WORKSPACE_H */
 
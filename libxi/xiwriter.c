@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <parrotdb/pacommon.h>
+#include <libxi/xicommon.h>
+#include <libxi/xiscan.h>
+#include <libxi/xiwriter.h>
+
+static xi_writer_t *
+xi_writer_alloc (void)
+{
+    xi_writer_t *xwrp = malloc(sizeof(*xwrp));
+    if (xwrp == NULL)
+	return NULL;
+
+    /* Skip zeroing the buffer; it's most of our size */
+    bzero(xwrp, offsetof(xi_writer_t, xwr_buf));
+    xwrp->xwr_fd = -1;
+
+    return xwrp;
+}
+
+xi_writer_t *
+xi_writer_open_fd (int fd)
+{
+    xi_writer_t *xwrp = xi_writer_alloc();
+    if (xwrp)
+	xwrp->xwr_fd = fd;
+
+    return xwrp;
+}
+
+xi_writer_t *
+xi_writer_open_file (FILE *fp)
+{
+    xi_writer_t *xwrp = xi_writer_alloc();
+    if (xwrp)
+	xwrp->xwr_fp = fp;
+
+    return xwrp;
+}
+
+xi_writer_t *
+xi_writer_open_func (xi_writer_func_t func, void *opaque)
+{
+    xi_writer_t *xwrp = xi_writer_alloc();
+    if (xwrp) {
+	xwrp->xwr_func = func;
+	xwrp->xwr_opaque = opaque;
+    }
+
+    return xwrp;
+}
+
+int
+xi_writer_close (xi_writer_t *xwrp)
+{
+    if (xwrp == NULL)
+	return 0;
+
+    xi_writer_flush(xwrp);
+
+    int rc = xi_writer_failed(xwrp) ? -1 : 0;
+
+    if ((xwrp->xwr_flags & XWRF_CLOSE_FD) && xwrp->xwr_fd >= 0)
+	close(xwrp->xwr_fd);
+
+    free(xwrp);
+    return rc;
+}
+
+/*
+ * Turn the buffered bytes we haven't covered yet into an iovec
+ */
+static inline void
+xi_writer_mark (xi_writer_t *xwrp)
+{
+    if (xwrp->xwr_len > xwrp->xwr_mark) {
+	struct iovec *iovp = &xwrp->xwr_iov[xwrp->xwr_iovcnt++];
+
+	iovp->iov_base = xwrp->xwr_buf + xwrp->xwr_mark;
+	iovp->iov_len = xwrp->xwr_len - xwrp->xwr_mark;
+	xwrp->xwr_mark = xwrp->xwr_len;
+    }
+}
+
+/*
+ * Write our iovecs to the descriptor, coping with short writes
+ */
+static int
+xi_writer_flush_fd (xi_writer_t *xwrp)
+{
+    struct iovec *iovp = xwrp->xwr_iov;
+    int cnt = xwrp->xwr_iovcnt;
+    ssize_t rc;
+
+    while (cnt > 0) {
+	rc = writev(xwrp->xwr_fd, iovp, cnt);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	xwrp->xwr_bytes += rc;
+
+	/* Skip the pieces we've finished, and trim a partial one */
+	while (cnt > 0 && (size_t) rc >= iovp->iov_len) {
+	    rc -= iovp->iov_len;
+	    iovp += 1;
+	    cnt -= 1;
+	}
+
+	if (cnt > 0) {
+	    iovp->iov_base = (char *) iovp->iov_base + rc;
+	    iovp->iov_len -= rc;
+	}
+    }
+
+    return 0;
+}
+
+void
+xi_writer_flush (xi_writer_t *xwrp)
+{
+    int rc = 0;
+
+    if (xwrp->xwr_fd >= 0) {
+	xi_writer_mark(xwrp);
+	if (xwrp->xwr_iovcnt > 0 && !xi_writer_failed(xwrp))
+	    rc = xi_writer_flush_fd(xwrp);
+
+    } else if (xwrp->xwr_len > 0 && !xi_writer_failed(xwrp)) {
+	if (xwrp->xwr_fp) {
+	    if (fwrite(xwrp->xwr_buf, 1, xwrp->xwr_len, xwrp->xwr_fp)
+		    != xwrp->xwr_len)
+		rc = -1;
+	} else if (xwrp->xwr_func) {
+	    rc = xwrp->xwr_func(xwrp->xwr_opaque,
+				xwrp->xwr_buf, xwrp->xwr_len);
+	}
+
+	if (rc == 0)
+	    xwrp->xwr_bytes += xwrp->xwr_len;
+    }
+
+    if (rc)
+	xwrp->xwr_flags |= XWRF_FAILED;
+
+    xwrp->xwr_flushes += 1;
+    xwrp->xwr_len = xwrp->xwr_mark = 0;
+    xwrp->xwr_iovcnt = 0;
+}
+
+void
+xi_writer_write (xi_writer_t *xwrp, const char *buf, size_t len)
+{
+    size_t room;
+
+    while (len > 0) {
+	room = sizeof(xwrp->xwr_buf) - xwrp->xwr_len;
+	if (room == 0) {
+	    xi_writer_flush(xwrp);
+	    continue;
+	}
+
+	if (room > len)
+	    room = len;
+
+	memcpy(xwrp->xwr_buf + xwrp->xwr_len, buf, room);
+	xwrp->xwr_len += room;
+	buf += room;
+	len -= room;
+    }
+}
+
+void
+xi_writer_write_ref (xi_writer_t *xwrp, const char *buf, size_t len)
+{
+    /* Small runs (and non-fd destinations) are cheaper to copy */
+    if (xwrp->xwr_fd < 0 || len < XI_WRITER_REF_MIN) {
+	xi_writer_write(xwrp, buf, len);
+	return;
+    }
+
+    /*
+     * We need room for the buffered piece before us, ours, and
+     * whatever gets buffered after us
+     */
+    if (xwrp->xwr_iovcnt + 3 > XI_WRITER_IOV_MAX)
+	xi_writer_flush(xwrp);
+
+    xi_writer_mark(xwrp);
+
+    struct iovec *iovp = &xwrp->xwr_iov[xwrp->xwr_iovcnt++];
+    iovp->iov_base = (char *) buf;
+    iovp->iov_len = len;
+}
+
+static const char *
+xi_writer_entity (int ch)
+{
+    switch (ch) {
+    case '<':
+	return "&lt;";
+    case '>':
+	return "&gt;";
+    case '&':
+	return "&amp;";
+    case '"':
+	return "&quot;";
+    case '\n':
+	return "&#10;";
+    }
+
+    return NULL;
+}
+
+static void
+xi_writer_escape_common (xi_writer_t *xwrp, const char *buf, size_t len,
+			 xi_scan_class_t classes, xi_boolean_t ref)
+{
+    const char *cp = buf, *ep = buf + len, *hit;
+    size_t run;
+
+    while (cp < ep) {
+	hit = xi_scan_find(cp, ep - cp, classes);
+	run = (hit ? hit : ep) - cp;
+
+	if (run) {
+	    if (ref)
+		xi_writer_write_ref(xwrp, cp, run);
+	    else
+		xi_writer_write(xwrp, cp, run);
+	}
+
+	if (hit == NULL)
+	    break;
+
+	xi_writer_puts(xwrp, xi_writer_entity(*hit));
+	cp = hit + 1;
+    }
+}
+
+void
+xi_writer_escape (xi_writer_t *xwrp, const char *buf, size_t len,
+		  xi_scan_class_t classes)
+{
+    xi_writer_escape_common(xwrp, buf, len, classes, FALSE);
+}
+
+void
+xi_writer_escape_ref (xi_writer_t *xwrp, const char *buf, size_t len,
+		      xi_scan_class_t classes)
+{
+    xi_writer_escape_common(xwrp, buf, len, classes, TRUE);
+}
+
+void
+xi_writer_indent (xi_writer_t *xwrp, unsigned count)
+{
+    static const char spaces[] = "                                "
+	"                                ";
+    unsigned len;
+
+    while (count > 0) {
+	len = (count < sizeof(spaces) - 1) ? count : sizeof(spaces) - 1;
+	xi_writer_write(xwrp, spaces, len);
+	count -= len;
+    }
+}
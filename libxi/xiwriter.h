@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A buffered writer for serializing XML.  Output collects in a large
+ * buffer and goes out in big writes, to a FILE, a callback, or a file
+ * descriptor.  With a descriptor, long runs of data that will stay
+ * put until the next flush (like text from a tree) can be referenced
+ * in place rather than copied, and everything is sent with writev().
+ *
+ * Escaping uses the structural scanner (xiscan.h) to find the
+ * characters that need it, so clean runs are copied whole.
+ */
+
+#ifndef LIBXI_XIWRITER_H
+#define LIBXI_XIWRITER_H
+
+#include <sys/uio.h>
+
+#define XI_WRITER_BUFSIZ	(128 * 1024) /* Output buffer size */
+#define XI_WRITER_IOV_MAX	64	/* Pieces per writev() */
+#define XI_WRITER_REF_MIN	512	/* Smallest run worth referencing */
+
+/*
+ * Destination for output; returns zero on success
+ */
+typedef int (*xi_writer_func_t)(void *opaque, const char *buf, size_t len);
+
+typedef struct xi_writer_s {
+    unsigned xwr_flags;		/* Flags (XWRF_*) */
+    int xwr_fd;			/* File descriptor (or -1) */
+    FILE *xwr_fp;		/* stdio stream (or NULL) */
+    xi_writer_func_t xwr_func;	/* Callback (or NULL) */
+    void *xwr_opaque;		/* Opaque data for xwr_func */
+    uint64_t xwr_bytes;		/* Bytes handed to the destination */
+    uint64_t xwr_flushes;	/* Number of flushes */
+    size_t xwr_len;		/* Bytes used in xwr_buf */
+    size_t xwr_mark;		/* Start of xwr_buf not yet in xwr_iov */
+    unsigned xwr_iovcnt;	/* Entries used in xwr_iov */
+    struct iovec xwr_iov[XI_WRITER_IOV_MAX]; /* Pending pieces (fd only) */
+    char xwr_buf[XI_WRITER_BUFSIZ]; /* Output buffer */
+} xi_writer_t;
+
+/* Flags for xwr_flags */
+#define XWRF_FAILED	(1<<0)	/* Output failed; discard the rest */
+#define XWRF_CLOSE_FD	(1<<1)	/* Close xwr_fd when we're closed */
+
+xi_writer_t *
+xi_writer_open_fd (int fd);
+
+xi_writer_t *
+xi_writer_open_file (FILE *fp);
+
+xi_writer_t *
+xi_writer_open_func (xi_writer_func_t func, void *opaque);
+
+/*
+ * Flush and free the writer.  Returns non-zero if any output failed.
+ */
+int
+xi_writer_close (xi_writer_t *xwrp);
+
+/*
+ * Send everything we've buffered to the destination
+ */
+void
+xi_writer_flush (xi_writer_t *xwrp);
+
+/*
+ * Copy data into the output
+ */
+void
+xi_writer_write (xi_writer_t *xwrp, const char *buf, size_t len);
+
+/*
+ * Write data the caller promises won't move or change until the next
+ * flush (or close), which lets us hand it to writev() in place.
+ */
+void
+xi_writer_write_ref (xi_writer_t *xwrp, const char *buf, size_t len);
+
+/*
+ * Write data, replacing the characters in 'classes' (XI_SCAN_*) with
+ * their entities.  The "_ref" flavor references the clean runs, like
+ * xi_writer_write_ref().
+ */
+void
+xi_writer_escape (xi_writer_t *xwrp, const char *buf, size_t len,
+		  xi_scan_class_t classes);
+
+void
+xi_writer_escape_ref (xi_writer_t *xwrp, const char *buf, size_t len,
+		      xi_scan_class_t classes);
+
+/*
+ * Write 'count' spaces
+ */
+void
+xi_writer_indent (xi_writer_t *xwrp, unsigned count);
+
+static inline void
+xi_writer_puts (xi_writer_t *xwrp, const char *str)
+{
+    xi_writer_write(xwrp, str, strlen(str));
+}
+
+static inline void
+xi_writer_putc (xi_writer_t *xwrp, char ch)
+{
+    if (xwrp->xwr_len >= sizeof(xwrp->xwr_buf))
+	xi_writer_flush(xwrp);
+
+    xwrp->xwr_buf[xwrp->xwr_len++] = ch;
+}
+
+static inline xi_boolean_t
+xi_writer_failed (xi_writer_t *xwrp)
+{
+    return (xwrp->xwr_flags & XWRF_FAILED) ? TRUE : FALSE;
+}
+
+/* Classes to escape for text content and for quoted attribute values */
+#define XI_WRITER_ESC_TEXT	(XI_SCAN_LT | XI_SCAN_GT | XI_SCAN_AMP)
+#define XI_WRITER_ESC_ATTRIB	(XI_WRITER_ESC_TEXT | XI_SCAN_QUOT)
+
+#endif /* LIBXI_XIWRITER_H */
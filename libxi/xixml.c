@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Building libxml2 documents from xi trees (see xixml.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xixml.h>
+
+/*
+ * Find (or make) the xmlNs for an xi namespace mapping, as seen
+ * from 'node'.  Since attributes are unordered, we might see a
+ * prefixed name before its xmlns attribute; if so, we make the
+ * declaration on 'node' now, and the xmlns attribute, when it comes,
+ * finds it already there.
+ */
+static xmlNsPtr
+xi_xml_ns (xi_workspace_t *xwp, xmlDocPtr docp, xmlNodePtr node,
+	   xi_ns_id_t ns_atom)
+{
+    xi_ns_map_t *ns_map = xi_ns_map_addr(xwp, ns_atom);
+    const char *prefix, *uri;
+    xmlNsPtr nsp;
+
+    if (ns_map == NULL)
+	return NULL;
+
+    prefix = xi_namepool_string(xwp, ns_map->xnm_prefix);
+    uri = xi_namepool_string(xwp, ns_map->xnm_uri);
+    if (uri == NULL)
+	return NULL;
+
+    nsp = xmlSearchNs(docp, node, (const xmlChar *) prefix);
+    if (nsp && nsp->href && streq((const char *) nsp->href, uri))
+	return nsp;
+
+    return xmlNewNs(node, (const xmlChar *) uri, (const xmlChar *) prefix);
+}
+
+/*
+ * Walk the tree from 'atom', making nodes under 'parent'.  For a
+ * whole document, we walk until the end; for a subtree, we stop
+ * when we're back where we started, since xi_parse_as_source()
+ * would otherwise carry on through the rest of the document.
+ * Returns zero on success.
+ */
+static int
+xi_xml_build (xi_workspace_t *xwp, xmlDocPtr docp, xmlNodePtr parent,
+	      pa_atom_t atom, xi_boolean_t subtree)
+{
+    xi_parse_as_source_t data;
+    xi_node_type_t type;
+    xmlNodePtr stack[XI_DEPTH_MAX + 1];
+    xmlNodePtr node, top;
+    xmlAttrPtr attr;
+    xmlNsPtr nsp;
+    xi_boolean_t unmapped = FALSE; /* Top element has no ns mapping */
+    xi_boolean_t text_ok = subtree; /* Text allowed at depth zero */
+    xi_depth_t depth = 0;
+
+    stack[0] = top = parent;
+    xi_parse_as_source_init(&data, atom);
+
+    for (;;) {
+	type = xi_parse_as_source(xwp, &data);
+
+	switch (type) {
+	case XI_TYPE_EOF:
+	    return 0;
+
+	case XI_TYPE_FAIL:
+	    return -1;
+
+	case XI_TYPE_ROOT:
+	    text_ok = FALSE;	/* Top-level text isn't part of a document */
+	    continue;
+
+	case XI_TYPE_ELT:
+	    if (depth >= XI_DEPTH_MAX)
+		return -1;
+
+	    node = xmlNewDocNode(docp, NULL,
+				 (const xmlChar *) data.xpas_name, NULL);
+	    if (node == NULL)
+		return -1;
+
+	    xmlAddChild(top, node);
+	    stack[++depth] = top = node;
+
+	    /*
+	     * xi only maps prefixed names, so an element without a
+	     * mapping picks up the default namespace that's in scope.
+	     */
+	    if (xi_node_ns_map(xwp, data.xpas_nodep) != PA_NULL_ATOM)
+		xmlSetNs(node, xi_xml_ns(xwp, docp, node,
+				xi_node_ns_map(xwp, data.xpas_nodep)));
+	    else
+		xmlSetNs(node, xmlSearchNs(docp, top, NULL));
+	    unmapped = (xi_node_ns_map(xwp, data.xpas_nodep) == PA_NULL_ATOM);
+	    continue;		/* Never the end of a subtree */
+
+	case XI_TYPE_CLOSE:
+	    if (depth == 0)
+		return -1;
+	    top = stack[--depth];
+	    break;
+
+	case XI_TYPE_NS:
+	    if (depth == 0)
+		break;
+
+	    /* Our namespaces follow our open, so we may need a new default */
+	    nsp = xi_xml_ns(xwp, docp, top, data.xpas_nodep->xn_contents);
+	    if (nsp && nsp->prefix == NULL && unmapped)
+		xmlSetNs(top, nsp);
+	    break;
+
+	case XI_TYPE_ATTRIB:
+	    /*
+	     * An attribute on its own (a subtree) becomes its value,
+	     * since there's no element to hang it on.  xi keeps values
+	     * in their escaped form; libxml2 decodes the entities.
+	     */
+	    if (depth == 0) {
+		node = xmlStringGetNodeList(docp,
+				(const xmlChar *) (data.xpas_string ?: ""));
+		if (node)
+		    xmlAddChildList(top, node);
+		break;
+	    }
+
+	    attr = xmlNewDocProp(docp, (const xmlChar *) data.xpas_name,
+				 (const xmlChar *) (data.xpas_string ?: ""));
+	    if (attr == NULL)
+		return -1;
+
+	    xmlAddChild(top, (xmlNodePtr) attr);
+
+	    if (xi_node_ns_map(xwp, data.xpas_nodep) != PA_NULL_ATOM)
+		attr->ns = xi_xml_ns(xwp, docp, top,
+				     xi_node_ns_map(xwp, data.xpas_nodep));
+	    break;
+
+	case XI_TYPE_TEXT:
+	    if (data.xpas_string == NULL || (depth == 0 && !text_ok))
+		break;
+
+	    /* Already unescaped (XI_PF_UNESCAPE) */
+	    node = xmlNewDocText(docp, (const xmlChar *) data.xpas_string);
+	    if (node)
+		xmlAddChild(top, node);
+	    break;
+
+	case XI_TYPE_UNESC:
+	    if (data.xpas_string == NULL || (depth == 0 && !text_ok))
+		break;
+
+	    /* Text is still escaped, so let libxml2 decode it */
+	    node = xmlStringGetNodeList(docp,
+					(const xmlChar *) data.xpas_string);
+	    if (node)
+		xmlAddChildList(top, node);
+	    break;
+
+	default:
+	    /* Unparsed attributes (ATSTR) have no libxml2 equivalent */
+	    break;
+	}
+
+	if (subtree && depth == 0)
+	    return 0;
+    }
+}
+
+xmlDocPtr
+xi_xml_build_doc (xi_workspace_t *xwp, pa_atom_t root)
+{
+    xmlDocPtr docp;
+
+    docp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
+    if (docp == NULL)
+	return NULL;
+
+    if (xi_xml_build(xwp, docp, (xmlNodePtr) docp, root, FALSE)) {
+	xmlFreeDoc(docp);
+	return NULL;
+    }
+
+    return docp;
+}
+
+int
+xi_xml_build_node (xi_workspace_t *xwp, xmlDocPtr docp, xmlNodePtr parent,
+		   pa_atom_t atom)
+{
+    return xi_xml_build(xwp, docp, parent, atom, TRUE);
+}
+
+/*
+ * Are all the entities in this string ones that xi_source_unescape()
+ * knows?  libxml2 would expand (or complain about) any others.
+ */
+static xi_boolean_t
+xi_xml_entities_ok (const char *cp, const char *ep)
+{
+    static const char *known[] = { "amp;", "lt;", "gt;", "apos;", "quot;",
+				   NULL };
+    const char **kp;
+    size_t left, klen;
+
+    for (;;) {
+	cp = psu_memchr((void *) cp, '&', ep - cp);
+	if (cp == NULL)
+	    return TRUE;
+
+	cp += 1;
+	left = ep - cp;
+	if (left > 0 && *cp == '#')
+	    continue;		/* Character references are fine */
+
+	for (kp = known; *kp; kp++) {
+	    klen = strlen(*kp);
+	    if (left >= klen && memcmp(cp, *kp, klen) == 0)
+		break;
+	}
+
+	if (*kp == NULL)
+	    return FALSE;
+    }
+}
+
+/*
+ * Handle the attributes of an open tag.  Namespace declarations go
+ * first, so prefixes on the element and its attributes can be found
+ * regardless of order.  Returns zero on success.
+ */
+static int
+xi_xml_fragment_attribs (xi_source_t *srcp, xmlDocPtr docp, xmlNodePtr node,
+			 char *rest)
+{
+    char *cp, *endp, *name, *value, *local;
+    size_t namelen, valuelen;
+    xmlChar *prefix, *uri;
+    xmlNsPtr nsp;
+    xmlAttrPtr attr;
+    xi_boolean_t is_ns;
+    int pass;
+
+    if (rest == NULL)
+	return 0;
+
+    endp = rest + strlen(rest);
+
+    for (pass = 0; pass < 2; pass++) {
+	for (cp = rest; cp; ) {
+	    if (xi_source_next_attrib(&cp, endp, &name, &namelen,
+				      &value, &valuelen) != NULL)
+		return -1;
+	    if (cp == NULL)
+		break;
+
+	    if (!xi_xml_entities_ok(value, value + valuelen)
+		    || psu_memchr(value, '<', valuelen))
+		return -1;
+
+	    is_ns = (namelen >= 5 && memcmp(name, "xmlns", 5) == 0
+		     && (namelen == 5 || name[5] == ':'));
+
+	    if (pass == 0) {
+		if (!is_ns)
+		    continue;
+
+		/* Leave the text alone, since we'll be back for pass two */
+		uri = xmlStrndup((const xmlChar *) value, valuelen);
+		prefix = (namelen > 6)
+		    ? xmlStrndup((const xmlChar *) name + 6, namelen - 6) : NULL;
+		nsp = xmlNewNs(node, uri, prefix);
+		xmlFree(uri);
+		xmlFree(prefix);
+		if (nsp == NULL)
+		    return -1;
+		continue;
+	    }
+
+	    if (is_ns)
+		continue;
+
+	    name[namelen] = '\0';
+	    value[xi_source_unescape(srcp, value, valuelen)] = '\0';
+
+	    /* Attribute values have their white space normalized */
+	    for (local = value; *local; local++)
+		if (*local == '\t' || *local == '\n')
+		    *local = ' ';
+
+	    nsp = NULL;
+	    local = strchr(name, ':');
+	    if (local) {
+		*local++ = '\0';
+		nsp = xmlSearchNs(docp, node, (const xmlChar *) name);
+		if (nsp == NULL)
+		    return -1;
+	    } else {
+		local = name;
+	    }
+
+	    if (xmlHasNsProp(node, (const xmlChar *) local,
+			     nsp ? nsp->href : NULL))
+		return -1;	/* Duplicate attributes are an error */
+
+	    attr = xmlNewNsProp(node, nsp, (const xmlChar *) local,
+				(const xmlChar *) value);
+	    if (attr == NULL)
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+xmlNodePtr
+xi_xml_parse_fragment (xmlDocPtr docp, char *buf, size_t len)
+{
+    xi_source_t *srcp;
+    xi_node_type_t type;
+    xmlNodePtr stack[XI_DEPTH_MAX + 1];
+    char *names[XI_DEPTH_MAX + 1];
+    xmlNodePtr node, top = NULL;
+    xmlNodePtr root = NULL;
+    char *data, *rest, *cp, *local;
+    unsigned depth = 0, tlen;
+    xi_boolean_t started = FALSE; /* Seen anything but an XML declaration */
+    xmlNsPtr nsp;
+
+    /* libxml2 turns CRLF into LF; leave that to it */
+    if (psu_memchr(buf, '\r', len))
+	return NULL;
+
+    srcp = xi_source_create_buffer(buf, len, 0);
+    if (srcp == NULL)
+	return NULL;
+
+    for (;;) {
+	type = xi_source_next_token(srcp, &data, &rest);
+
+	switch (type) {
+	case XI_TYPE_OPEN:
+	case XI_TYPE_EMPTY:
+	    started = TRUE;
+	    if (depth >= XI_DEPTH_MAX || (depth == 0 && root))
+		goto fail;	/* Too deep, or a second top element */
+
+	    if (strpbrk(data, "\t\n") != NULL)
+		goto fail;	/* The tokenizer only splits on spaces */
+
+	    local = strchr(data, ':');
+	    node = xmlNewDocNode(docp, NULL,
+				 (const xmlChar *) (local ? local + 1 : data),
+				 NULL);
+	    if (node == NULL)
+		goto fail;
+
+	    if (depth == 0)
+		root = node;
+	    else
+		xmlAddChild(top, node);
+
+	    if (xi_xml_fragment_attribs(srcp, docp, node, rest) < 0)
+		goto fail;
+
+	    if (local) {
+		*local = '\0';
+		nsp = xmlSearchNs(docp, node, (const xmlChar *) data);
+		*local = ':';
+		if (nsp == NULL)
+		    goto fail;
+	    } else {
+		nsp = xmlSearchNs(docp, node, NULL);
+	    }
+	    xmlSetNs(node, nsp);
+
+	    if (type == XI_TYPE_EMPTY)
+		break;
+
+	    names[++depth] = data;
+	    stack[depth] = top = node;
+	    break;
+
+	case XI_TYPE_CLOSE:
+	    if (depth == 0 || !streq(data, names[depth]))
+		goto fail;
+
+	    top = (--depth > 0) ? stack[depth] : NULL;
+	    break;
+
+	case XI_TYPE_TEXT:
+	    if (depth == 0) {
+		/* Only white space is allowed outside the element */
+		started = TRUE;
+		for (cp = data; cp < rest; cp++)
+		    if (*cp != ' ' && *cp != '\t' && *cp != '\n')
+			goto fail;
+		break;
+	    }
+
+	    if (!xi_xml_entities_ok(data, rest))
+		goto fail;
+
+	    cp = xi_source_unescape_text(srcp, data, rest - data, &tlen);
+	    node = xmlNewDocTextLen(docp, (const xmlChar *) cp, tlen);
+	    if (node == NULL)
+		goto fail;
+	    xmlAddChild(top, node);
+	    break;
+
+	case XI_TYPE_CDATA:
+	    if (depth == 0)
+		goto fail;
+
+	    node = xmlNewCDataBlock(docp, (const xmlChar *) data, rest - data);
+	    if (node == NULL)
+		goto fail;
+	    xmlAddChild(top, node);
+	    break;
+
+	case XI_TYPE_PI:
+	    /* Allow an XML declaration first, as long as it's UTF-8 */
+	    if (started || !streq(data, "xml"))
+		goto fail;
+	    if (rest && strstr(rest, "encoding")
+		    && strcasestr(rest, "utf-8") == NULL)
+		goto fail;
+	    break;
+
+	case XI_TYPE_EOF:
+	    if (depth != 0 || root == NULL)
+		goto fail;
+
+	    xi_source_destroy(srcp);
+	    return root;
+
+	default:
+	    /* Comments, DTDs, and failures */
+	    goto fail;
+	}
+    }
+
+ fail:
+    if (root)
+	xmlFreeNode(root);
+    xi_source_destroy(srcp);
+    return NULL;
+}
+
+xmlDocPtr
+xi_xml_read_file (const char *filename, xi_source_flags_t flags)
+{
+    return xi_xml_read_file_rules(filename, flags, NULL);
+}
+
+xmlDocPtr
+xi_xml_read_file_rules (const char *filename, xi_source_flags_t flags,
+			const char *rules)
+{
+    xmlDocPtr docp = NULL;
+    pa_mmap_t *pmp;
+    xi_workspace_t *xwp = NULL;
+    xi_parse_t *parsep, *script = NULL;
+    xi_rulebook_t *rb = NULL;
+
+    pmp = pa_mmap_open(NULL, "xi-xml", 0, 0644);
+    if (pmp == NULL)
+	return NULL;
+
+    xwp = xi_workspace_open(pmp, "xml");
+    if (xwp == NULL)
+	goto done;
+
+    if (rules) {
+	/* The rulebook is itself XML, parsed into the same workspace */
+	script = xi_parse_open(pmp, xwp, "rules", rules,
+			       XPSF_IGNORE_WS | XPSF_IGNORE_COMMENTS);
+	if (script == NULL)
+	    goto done;
+
+	xi_parse_set_default_rule(script, XIA_SAVE_ATTRIB);
+	if (xi_parse(script) != 0) {
+	    slaxLog("xi_xml_read_file: rulebook parse failed: %s", rules);
+	    goto done;
+	}
+
+	rb = xi_rulebook_prep(script, "rulebook");
+	if (rb == NULL)
+	    goto done;
+    }
+
+    parsep = xi_parse_open(pmp, xwp, "xml", filename, flags);
+    if (parsep == NULL)
+	goto done;
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    if (rb)
+	xi_parse_set_rulebook(parsep, rb);
+
+    if (xi_parse(parsep) == 0)
+	docp = xi_xml_build_doc(xwp, xi_parse_root(parsep));
+
+    if (docp && docp->URL == NULL)
+	docp->URL = xmlStrdup((const xmlChar *) filename);
+
+    xi_parse_destroy(parsep);
+
+ done:
+    if (rb)
+	xi_rulebook_close(rb);
+    if (script)
+	xi_parse_destroy(script);
+    xi_workspace_close(xwp);
+    pa_mmap_close(pmp);
+    return docp;
+}
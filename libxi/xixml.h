@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A bridge from xi trees to libxml2, so documents parsed by libxi
+ * can be handed to libxslt.  libxslt walks the children, next,
+ * and properties fields of xmlNode directly, with no hook where a
+ * node could be made on first touch, so we can't be lazy about
+ * building the document.  Instead we walk the xi tree once (via
+ * xi_parse_as_source()), making nodes as we go, which skips
+ * libxml2's own tokenizer and lets a rulebook discard the parts of
+ * the input a script won't visit before any xmlNode is made.
+ */
+
+#ifndef LIBSLAX_XI_XML_H
+#define LIBSLAX_XI_XML_H
+
+#include <libxml/tree.h>
+
+/*
+ * Build a libxml2 document from the tree under 'root'.  The document
+ * doesn't refer to the workspace, which can be closed afterwards.
+ * Returns NULL on failure.
+ */
+xmlDocPtr
+xi_xml_build_doc (xi_workspace_t *xwp, pa_atom_t root);
+
+/*
+ * Copy the subtree at 'atom' (an element, text, or the root) into
+ * 'docp' as the last children of 'parent'.  An attribute is copied
+ * as its value, in a text node.  Returns zero on success; on failure,
+ * the caller should discard whatever was copied.
+ */
+int
+xi_xml_build_node (xi_workspace_t *xwp, xmlDocPtr docp, xmlNodePtr parent,
+		   pa_atom_t atom);
+
+/*
+ * Parse a file with libxi and turn it into a libxml2 document
+ */
+xmlDocPtr
+xi_xml_read_file (const char *filename, xi_source_flags_t flags);
+
+/*
+ * Parse a file with libxi, letting the rulebook in the file 'rules'
+ * decide which elements are kept.  Elements hitting a "discard" rule
+ * are skipped, along with everything under them, while the input is
+ * tokenized, so they never become xi nodes or xmlNodes; "emit" means
+ * the same as "save-with-attributes".  A state's own "action" is used
+ * for elements with no rule of their own.  With 'rules' NULL, this is
+ * xi_xml_read_file().
+ */
+xmlDocPtr
+xi_xml_read_file_rules (const char *filename, xi_source_flags_t flags,
+			const char *rules);
+
+/*
+ * Parse a small XML string (a single element, with optional XML
+ * declaration and leading or trailing white space) straight from
+ * libxi's tokens into nodes in 'docp', skipping both the libxml2
+ * parser and the xi tree.  The buffer is modified.  Returns the
+ * (unlinked) element, or NULL if the input uses something we leave
+ * to libxml2 (DTDs, comments and PIs inside the element, entities
+ * other than the predefined ones and character references, CRs,
+ * unknown namespace prefixes) or isn't well-formed; the caller should
+ * then hand the original string to libxml2, which will parse it or
+ * report the error.
+ */
+xmlNodePtr
+xi_xml_parse_fragment (xmlDocPtr docp, char *buf, size_t len);
+
+#endif /* LIBSLAX_XI_XML_H */
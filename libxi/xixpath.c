@@ -7,24 +7,2572 @@
  * LICENSE.
  *
  * Phil Shafer (phil@) August 2016
+ *
+ * XPath compilation and evaluation over xi trees.  Compilation is a
+ * simple recursive descent parser over the XPath 1.0 grammar that
+ * builds a vector of xi_xpath_op_t's.  Evaluation walks those ops,
+ * using the xn_contents/xn_next links of the nodes directly, and
+ * keeps node sets as sorted vectors of node atoms.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xinodeset.h>
+#include <libxi/xiindex.h>
+#include <libxi/xixpath.h>
+
+/* Functions (for xpo_type in XI_OP_FUNCTION) */
+#define XI_FN_LAST		1
+#define XI_FN_POSITION		2
+#define XI_FN_COUNT		3
+#define XI_FN_NAME		4
+#define XI_FN_LOCAL_NAME	5
+#define XI_FN_STRING		6
+#define XI_FN_CONCAT		7
+#define XI_FN_CONTAINS		8
+#define XI_FN_STARTS_WITH	9
+#define XI_FN_STRING_LENGTH	10
+#define XI_FN_NORMALIZE_SPACE	11
+#define XI_FN_TRUE		12
+#define XI_FN_FALSE		13
+#define XI_FN_BOOLEAN		14
+#define XI_FN_NUMBER		15
+#define XI_FN_SUM		16
+#define XI_FN_NOT		17
+
+#define XI_ARGS_ANY	255	/* No maximum number of arguments */
+
+typedef struct xi_xpath_func_s {
+    const char *xxf_name;	/* Function name */
+    uint8_t xxf_id;		/* Function identifier (XI_FN_*) */
+    uint8_t xxf_min;		/* Minimum number of arguments */
+    uint8_t xxf_max;		/* Maximum number of arguments */
+} xi_xpath_func_t;
+
+static const xi_xpath_func_t xi_xpath_functions[] = {
+    { "last", XI_FN_LAST, 0, 0 },
+    { "position", XI_FN_POSITION, 0, 0 },
+    { "count", XI_FN_COUNT, 1, 1 },
+    { "name", XI_FN_NAME, 0, 1 },
+    { "local-name", XI_FN_LOCAL_NAME, 0, 1 },
+    { "string", XI_FN_STRING, 0, 1 },
+    { "concat", XI_FN_CONCAT, 2, XI_ARGS_ANY },
+    { "contains", XI_FN_CONTAINS, 2, 2 },
+    { "starts-with", XI_FN_STARTS_WITH, 2, 2 },
+    { "string-length", XI_FN_STRING_LENGTH, 0, 1 },
+    { "normalize-space", XI_FN_NORMALIZE_SPACE, 0, 1 },
+    { "true", XI_FN_TRUE, 0, 0 },
+    { "false", XI_FN_FALSE, 0, 0 },
+    { "boolean", XI_FN_BOOLEAN, 1, 1 },
+    { "number", XI_FN_NUMBER, 0, 1 },
+    { "sum", XI_FN_SUM, 1, 1 },
+    { "not", XI_FN_NOT, 1, 1 },
+    { NULL, 0, 0, 0 }
+};
+
+static const char *xi_xpath_axis_names[] = {
+    "child",
+    "attribute",
+    "self",
+    "parent",
+    "descendant",
+    "descendant-or-self",
+    "ancestor",
+    "ancestor-or-self",
+    "following-sibling",
+    "preceding-sibling",
+    NULL
+};
+
+static const char *xi_xpath_node_types[] = {
+    "node",
+    "text",
+    "comment",
+    "processing-instruction",
+    NULL
+};
+
+/* Tokens, as seen by the compiler */
+typedef uint8_t xi_xpath_token_t;
+#define XT_EOF		0	/* End of input */
+#define XT_NAME		1	/* Name-test (NCName or QName) */
+#define XT_STAR		2	/* Name-test "*" */
+#define XT_PREFIX_STAR	3	/* Name-test "prefix:*" */
+#define XT_NUMBER	4	/* Numeric literal */
+#define XT_LITERAL	5	/* String literal */
+#define XT_FUNCTION	6	/* Function name (followed by '(') */
+#define XT_NODETYPE	7	/* Node type (followed by '(') */
+#define XT_AXIS		8	/* Axis name (with the "::") */
+#define XT_SLASH	9	/* "/" */
+#define XT_DSLASH	10	/* "//" */
+#define XT_LBRACKET	11	/* "[" */
+#define XT_RBRACKET	12	/* "]" */
+#define XT_LPAREN	13	/* "(" */
+#define XT_RPAREN	14	/* ")" */
+#define XT_AT		15	/* "@" */
+#define XT_DOT		16	/* "." */
+#define XT_DDOT		17	/* ".." */
+#define XT_COMMA	18	/* "," */
+#define XT_PIPE		19	/* "|" */
+#define XT_PLUS		20	/* "+" */
+#define XT_MINUS	21	/* "-" */
+#define XT_MULT		22	/* "*" (as an operator) */
+#define XT_EQ		23	/* "=" */
+#define XT_NE		24	/* "!=" */
+#define XT_LT		25	/* "<" */
+#define XT_LE		26	/* "<=" */
+#define XT_GT		27	/* ">" */
+#define XT_GE		28	/* ">=" */
+#define XT_AND		29	/* "and" */
+#define XT_OR		30	/* "or" */
+#define XT_DIV		31	/* "div" */
+#define XT_MOD		32	/* "mod" */
+
+/*
+ * The state of the compiler
+ */
 typedef struct xi_xpath_prep_s {
     xi_xpath_t *xxp_xpath;	/* Current XPath */
-    xi_parse_t *xxp_script;	/* Parsed script "workspace" */
-    pa_atom_t xxp_atom_name;
-    pa_atom_t xxp_atom_type;
+    const char *xxp_expr;	/* Expression being compiled */
+    const char *xxp_cur;	/* Next input character */
+    xi_xpath_token_t xxp_token;	/* Current token (XT_*) */
+    xi_xpath_token_t xxp_last;	/* Previous token */
+    const char *xxp_text;	/* Text of the current token */
+    size_t xxp_len;		/* Length of that text */
+    size_t xxp_prefix_len;	/* Length of the prefix in an XT_NAME */
+    double xxp_number;		/* Value of an XT_NUMBER */
+    int xxp_error;		/* Seen an error */
 } xi_xpath_prep_t;
 
-pa_atom_t
-xi_xpath_prep (xi_parse_t *input, const char *name)
+static inline xi_xpath_op_t *
+xi_xpath_op (xi_xpath_t *xpp, xi_xpath_op_id_t id)
+{
+    return (id == 0) ? NULL : &xpp->xp_ops[id];
+}
+
+static xi_xpath_op_id_t
+xi_xpath_fail (xi_xpath_prep_t *prep, const char *msg)
+{
+    if (!prep->xxp_error)
+	pa_warning(0, "xpath: %s at offset %u in '%s'", msg,
+		   (unsigned) (prep->xxp_text - prep->xxp_expr),
+		   prep->xxp_expr);
+
+    prep->xxp_error = TRUE;
+    return 0;
+}
+
+/*
+ * An NCName is close enough to C's notion, plus '-' and '.'
+ * after the first character.  Non-ASCII characters are
+ * allowed, since they'll be UTF-8 name characters.
+ */
+static inline int
+xi_xpath_name_start (int ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+	|| ch == '_' || (ch & 0x80);
+}
+
+static inline int
+xi_xpath_name_char (int ch)
+{
+    return xi_xpath_name_start(ch) || (ch >= '0' && ch <= '9')
+	|| ch == '-' || ch == '.';
+}
+
+static const char *
+xi_xpath_skip_name (const char *cp)
+{
+    while (xi_xpath_name_char((unsigned char) *cp))
+	cp += 1;
+    return cp;
+}
+
+static const char *
+xi_xpath_skip_ws (const char *cp)
+{
+    while (*cp && xi_isspace(*cp))
+	cp += 1;
+    return cp;
+}
+
+static int
+xi_xpath_lookup (const char **names, const char *text, size_t len)
+{
+    int i;
+
+    for (i = 0; names[i]; i++)
+	if (strlen(names[i]) == len && strncmp(names[i], text, len) == 0)
+	    return i;
+
+    return -1;
+}
+
+/*
+ * XPath's lexical disambiguation rule: if there's a previous token
+ * and it's not one of '@', '::', '(', '[', ',' or an operator, then
+ * '*' is multiplication and a name is an operator name.
+ */
+static int
+xi_xpath_operator_expected (xi_xpath_token_t last)
+{
+    switch (last) {
+    case XT_NAME:
+    case XT_STAR:
+    case XT_PREFIX_STAR:
+    case XT_NUMBER:
+    case XT_LITERAL:
+    case XT_RPAREN:
+    case XT_RBRACKET:
+    case XT_DOT:
+    case XT_DDOT:
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+static xi_xpath_token_t
+xi_xpath_lex (xi_xpath_prep_t *prep)
+{
+    const char *cp = xi_xpath_skip_ws(prep->xxp_cur);
+    xi_xpath_token_t token;
+    size_t len = 1;
+    int ch = (unsigned char) *cp;
+
+    prep->xxp_last = prep->xxp_token;
+    prep->xxp_text = cp;
+    prep->xxp_prefix_len = 0;
+
+    switch (ch) {
+    case '\0':
+	token = XT_EOF;
+	len = 0;
+	break;
+
+    case '(':
+	token = XT_LPAREN;
+	break;
+
+    case ')':
+	token = XT_RPAREN;
+	break;
+
+    case '[':
+	token = XT_LBRACKET;
+	break;
+
+    case ']':
+	token = XT_RBRACKET;
+	break;
+
+    case ',':
+	token = XT_COMMA;
+	break;
+
+    case '|':
+	token = XT_PIPE;
+	break;
+
+    case '+':
+	token = XT_PLUS;
+	break;
+
+    case '-':
+	token = XT_MINUS;
+	break;
+
+    case '=':
+	token = XT_EQ;
+	break;
+
+    case '@':
+	token = XT_AT;
+	break;
+
+    case '!':
+	if (cp[1] != '=') {
+	    xi_xpath_fail(prep, "invalid character");
+	    return prep->xxp_token = XT_EOF;
+	}
+	token = XT_NE;
+	len = 2;
+	break;
+
+    case '<':
+    case '>':
+	if (cp[1] == '=') {
+	    token = (ch == '<') ? XT_LE : XT_GE;
+	    len = 2;
+	} else {
+	    token = (ch == '<') ? XT_LT : XT_GT;
+	}
+	break;
+
+    case '/':
+	if (cp[1] == '/') {
+	    token = XT_DSLASH;
+	    len = 2;
+	} else {
+	    token = XT_SLASH;
+	}
+	break;
+
+    case '*':
+	token = xi_xpath_operator_expected(prep->xxp_last) ? XT_MULT : XT_STAR;
+	break;
+
+    case '"':
+    case '\'': {
+	const char *ep = strchr(cp + 1, ch);
+	if (ep == NULL) {
+	    xi_xpath_fail(prep, "unterminated literal");
+	    return prep->xxp_token = XT_EOF;
+	}
+	token = XT_LITERAL;
+	len = ep + 1 - cp;
+	break;
+    }
+
+    case '$':
+	xi_xpath_fail(prep, "variables are not supported");
+	return prep->xxp_token = XT_EOF;
+
+    case '.':
+	if (cp[1] == '.') {
+	    token = XT_DDOT;
+	    len = 2;
+	    break;
+	} else if (!(cp[1] >= '0' && cp[1] <= '9')) {
+	    token = XT_DOT;
+	    break;
+	}
+	/* FALLTHRU */
+
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9': {
+	const char *ep = cp;
+	while (*ep >= '0' && *ep <= '9')
+	    ep += 1;
+	if (*ep == '.') {
+	    ep += 1;
+	    while (*ep >= '0' && *ep <= '9')
+		ep += 1;
+	}
+	token = XT_NUMBER;
+	len = ep - cp;
+	prep->xxp_number = strtod(cp, NULL);
+	break;
+    }
+
+    default:
+	if (!xi_xpath_name_start(ch)) {
+	    xi_xpath_fail(prep, "invalid character");
+	    return prep->xxp_token = XT_EOF;
+	}
+
+	const char *ep = xi_xpath_skip_name(cp);
+
+	if (xi_xpath_operator_expected(prep->xxp_last)) {
+	    /* Must be an operator name */
+	    len = ep - cp;
+	    if (len == 3 && strncmp(cp, "and", len) == 0)
+		token = XT_AND;
+	    else if (len == 2 && strncmp(cp, "or", len) == 0)
+		token = XT_OR;
+	    else if (len == 3 && strncmp(cp, "div", len) == 0)
+		token = XT_DIV;
+	    else if (len == 3 && strncmp(cp, "mod", len) == 0)
+		token = XT_MOD;
+	    else {
+		xi_xpath_fail(prep, "expected operator");
+		return prep->xxp_token = XT_EOF;
+	    }
+	    break;
+	}
+
+	token = XT_NAME;
+	if (ep[0] == ':' && ep[1] == '*') {
+	    token = XT_PREFIX_STAR;
+	    prep->xxp_prefix_len = ep - cp;
+	    ep += 2;
+
+	} else if (ep[0] == ':' && ep[1] != ':'
+		   && xi_xpath_name_start((unsigned char) ep[1])) {
+	    prep->xxp_prefix_len = ep - cp;
+	    ep = xi_xpath_skip_name(ep + 1);
+	}
+
+	len = ep - cp;
+
+	/* Look ahead to see if it's a function, node type, or axis */
+	if (token == XT_NAME) {
+	    const char *np = xi_xpath_skip_ws(ep);
+	    if (*np == '(') {
+		if (xi_xpath_lookup(xi_xpath_node_types, cp, len) >= 0)
+		    token = XT_NODETYPE;
+		else
+		    token = XT_FUNCTION;
+	    } else if (np[0] == ':' && np[1] == ':'
+		       && prep->xxp_prefix_len == 0) {
+		token = XT_AXIS;
+		prep->xxp_cur = np + 2;
+		prep->xxp_len = len;
+		return prep->xxp_token = token;
+	    }
+	}
+	break;
+    }
+
+    prep->xxp_cur = cp + len;
+    prep->xxp_len = len;
+    return prep->xxp_token = token;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_op_new (xi_xpath_prep_t *prep, xi_xpath_opcode_t opcode)
+{
+    xi_xpath_t *xpp = prep->xxp_xpath;
+
+    if (prep->xxp_error)
+	return 0;
+
+    if (xpp->xp_count >= xpp->xp_max) {
+	xi_xpath_op_id_t max = xpp->xp_max ? xpp->xp_max << 1 : 16;
+	xi_xpath_op_t *ops = realloc(xpp->xp_ops, max * sizeof(*ops));
+	if (ops == NULL)
+	    return xi_xpath_fail(prep, "out of memory");
+
+	xpp->xp_ops = ops;
+	xpp->xp_max = max;
+    }
+
+    xi_xpath_op_id_t id = xpp->xp_count++;
+    xi_xpath_op_t *opp = &xpp->xp_ops[id];
+
+    bzero(opp, sizeof(*opp));
+    opp->xpo_op = opcode;
+
+    return id;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_op_binary (xi_xpath_prep_t *prep, xi_xpath_opcode_t opcode,
+		    xi_xpath_op_id_t left, xi_xpath_op_id_t right)
+{
+    if (left == 0 || right == 0)
+	return 0;
+
+    xi_xpath_op_id_t id = xi_xpath_op_new(prep, opcode);
+    if (id) {
+	xi_xpath_op_t *opp = xi_xpath_op(prep->xxp_xpath, id);
+	opp->xpo_child = left;
+	opp->xpo_right = right;
+    }
+
+    return id;
+}
+
+static int
+xi_xpath_expect (xi_xpath_prep_t *prep, xi_xpath_token_t token,
+		 const char *msg)
+{
+    if (prep->xxp_token != token) {
+	xi_xpath_fail(prep, msg);
+	return FALSE;
+    }
+
+    xi_xpath_lex(prep);
+    return TRUE;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_expr (xi_xpath_prep_t *prep);
+
+/*
+ * Parse any predicates, returning the first one (linked by xpo_next)
+ */
+static xi_xpath_op_id_t
+xi_xpath_parse_predicates (xi_xpath_prep_t *prep)
+{
+    xi_xpath_op_id_t first = 0, last = 0, id, expr;
+
+    while (prep->xxp_token == XT_LBRACKET && !prep->xxp_error) {
+	xi_xpath_lex(prep);
+
+	expr = xi_xpath_parse_expr(prep);
+	if (expr == 0)
+	    return 0;
+
+	if (!xi_xpath_expect(prep, XT_RBRACKET, "expected ']'"))
+	    return 0;
+
+	id = xi_xpath_op_new(prep, XI_OP_PREDICATE);
+	if (id == 0)
+	    return 0;
+
+	xi_xpath_op(prep->xxp_xpath, id)->xpo_child = expr;
+	if (last)
+	    xi_xpath_op(prep->xxp_xpath, last)->xpo_next = id;
+	else
+	    first = id;
+	last = id;
+    }
+
+    return first;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_step (xi_xpath_prep_t *prep)
+{
+    xi_workspace_t *xwp = prep->xxp_xpath->xp_workspace;
+    xi_xpath_axis_t axis = XI_AXIS_CHILD;
+    xi_xpath_op_id_t id;
+    xi_xpath_op_t *opp;
+    char name[prep->xxp_len + 1];
+
+    if (prep->xxp_token == XT_DOT || prep->xxp_token == XT_DDOT) {
+	id = xi_xpath_op_new(prep, XI_OP_TYPE);
+	if (id == 0)
+	    return 0;
+
+	opp = xi_xpath_op(prep->xxp_xpath, id);
+	opp->xpo_axis = (prep->xxp_token == XT_DOT)
+	    ? XI_AXIS_SELF : XI_AXIS_PARENT;
+	opp->xpo_type = XI_NT_NODE;
+	xi_xpath_lex(prep);
+	return id;
+    }
+
+    if (prep->xxp_token == XT_AT) {
+	axis = XI_AXIS_ATTRIBUTE;
+	xi_xpath_lex(prep);
+
+    } else if (prep->xxp_token == XT_AXIS) {
+	int val = xi_xpath_lookup(xi_xpath_axis_names,
+				  prep->xxp_text, prep->xxp_len);
+	if (val < 0)
+	    return xi_xpath_fail(prep, "unknown axis");
+
+	axis = val;
+	xi_xpath_lex(prep);
+    }
+
+    switch (prep->xxp_token) {
+    case XT_STAR:
+    case XT_NAME:
+    case XT_PREFIX_STAR:
+	id = xi_xpath_op_new(prep, XI_OP_NAME);
+	if (id == 0)
+	    return 0;
+
+	opp = xi_xpath_op(prep->xxp_xpath, id);
+	opp->xpo_axis = axis;
+
+	if (prep->xxp_prefix_len) {
+	    memcpy(name, prep->xxp_text, prep->xxp_prefix_len);
+	    name[prep->xxp_prefix_len] = '\0';
+	    opp->xpo_prefix = xi_namepool_atom(xwp, name, TRUE);
+	}
+
+	if (prep->xxp_token == XT_NAME) {
+	    size_t skip = prep->xxp_prefix_len ? prep->xxp_prefix_len + 1 : 0;
+	    size_t len = prep->xxp_len - skip;
+
+	    memcpy(name, prep->xxp_text + skip, len);
+	    name[len] = '\0';
+	    opp->xpo_name = xi_namepool_atom(xwp, name, TRUE);
+	    if (opp->xpo_name == PA_NULL_ATOM)
+		return xi_xpath_fail(prep, "name create failed");
+	}
+
+	xi_xpath_lex(prep);
+	break;
+
+    case XT_NODETYPE:
+	id = xi_xpath_op_new(prep, XI_OP_TYPE);
+	if (id == 0)
+	    return 0;
+
+	opp = xi_xpath_op(prep->xxp_xpath, id);
+	opp->xpo_axis = axis;
+	opp->xpo_type = xi_xpath_lookup(xi_xpath_node_types,
+					prep->xxp_text, prep->xxp_len);
+
+	xi_xpath_lex(prep);
+	if (!xi_xpath_expect(prep, XT_LPAREN, "expected '('"))
+	    return 0;
+
+	/* processing-instruction('target'); we don't record targets */
+	if (prep->xxp_token == XT_LITERAL)
+	    xi_xpath_lex(prep);
+
+	if (!xi_xpath_expect(prep, XT_RPAREN, "expected ')'"))
+	    return 0;
+	break;
+
+    default:
+	return xi_xpath_fail(prep, "expected node test");
+    }
+
+    xi_xpath_op_id_t preds = xi_xpath_parse_predicates(prep);
+    if (prep->xxp_error)
+	return 0;
+
+    xi_xpath_op(prep->xxp_xpath, id)->xpo_child = preds;
+    return id;
+}
+
+static int
+xi_xpath_step_start (xi_xpath_token_t token)
+{
+    switch (token) {
+    case XT_NAME:
+    case XT_STAR:
+    case XT_PREFIX_STAR:
+    case XT_AT:
+    case XT_DOT:
+    case XT_DDOT:
+    case XT_AXIS:
+    case XT_NODETYPE:
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Parse a location path, or the steps following a filter expression
+ * (given as 'start').
+ */
+static xi_xpath_op_id_t
+xi_xpath_parse_location (xi_xpath_prep_t *prep, xi_xpath_op_id_t start)
+{
+    xi_xpath_t *xpp = prep->xxp_xpath;
+    xi_xpath_op_id_t path, step, last = 0;
+    int need_sep = (start != 0);
+
+    path = xi_xpath_op_new(prep, XI_OP_PATH);
+    if (path == 0)
+	return 0;
+
+    xi_xpath_op(xpp, path)->xpo_right = start;
+
+    if (start == 0) {
+	if (prep->xxp_token == XT_SLASH) {
+	    xi_xpath_op(xpp, path)->xpo_flags |= XPOF_ABSOLUTE;
+	    xi_xpath_lex(prep);
+	    if (!xi_xpath_step_start(prep->xxp_token))
+		return path;	/* Just "/" */
+
+	} else if (prep->xxp_token == XT_DSLASH) {
+	    xi_xpath_op(xpp, path)->xpo_flags |= XPOF_ABSOLUTE;
+	    need_sep = TRUE;
+	}
+    }
+
+    for (;;) {
+	int descend = FALSE;
+
+	if (need_sep) {
+	    if (prep->xxp_token == XT_DSLASH)
+		descend = TRUE;
+	    else if (prep->xxp_token != XT_SLASH)
+		break;
+	    xi_xpath_lex(prep);
+	}
+	need_sep = TRUE;
+
+	step = xi_xpath_parse_step(prep);
+	if (step == 0)
+	    return 0;
+
+	if (descend) {
+	    xi_xpath_op_t *opp = xi_xpath_op(xpp, step);
+
+	    /*
+	     * "//name" is "/descendant-or-self::node()/child::name",
+	     * which (without predicates, which count positions among
+	     * siblings) is just "/descendant::name".  That's one walk
+	     * instead of building the set of every node in the tree.
+	     */
+	    if (opp->xpo_axis == XI_AXIS_CHILD && opp->xpo_child == 0) {
+		opp->xpo_axis = XI_AXIS_DESCENDANT;
+
+	    } else {
+		xi_xpath_op_id_t dos = xi_xpath_op_new(prep, XI_OP_TYPE);
+		if (dos == 0)
+		    return 0;
+
+		opp = xi_xpath_op(xpp, dos);
+		opp->xpo_axis = XI_AXIS_DESCENDANT_OR_SELF;
+		opp->xpo_type = XI_NT_NODE;
+
+		if (last)
+		    xi_xpath_op(xpp, last)->xpo_next = dos;
+		else
+		    xi_xpath_op(xpp, path)->xpo_child = dos;
+		last = dos;
+	    }
+	}
+
+	if (last)
+	    xi_xpath_op(xpp, last)->xpo_next = step;
+	else
+	    xi_xpath_op(xpp, path)->xpo_child = step;
+	last = step;
+    }
+
+    return path;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_function (xi_xpath_prep_t *prep)
+{
+    xi_xpath_t *xpp = prep->xxp_xpath;
+    const xi_xpath_func_t *xfp;
+    xi_xpath_op_id_t id, arg, first = 0, last = 0;
+    unsigned count = 0;
+
+    for (xfp = xi_xpath_functions; xfp->xxf_name; xfp++)
+	if (strlen(xfp->xxf_name) == prep->xxp_len
+	    && strncmp(xfp->xxf_name, prep->xxp_text, prep->xxp_len) == 0)
+	    break;
+
+    if (xfp->xxf_name == NULL)
+	return xi_xpath_fail(prep, "unknown function");
+
+    xi_xpath_lex(prep);
+    if (!xi_xpath_expect(prep, XT_LPAREN, "expected '('"))
+	return 0;
+
+    if (prep->xxp_token != XT_RPAREN) {
+	for (;;) {
+	    arg = xi_xpath_parse_expr(prep);
+	    if (arg == 0)
+		return 0;
+
+	    if (last)
+		xi_xpath_op(xpp, last)->xpo_next = arg;
+	    else
+		first = arg;
+	    last = arg;
+	    count += 1;
+
+	    if (prep->xxp_token != XT_COMMA)
+		break;
+	    xi_xpath_lex(prep);
+	}
+    }
+
+    if (!xi_xpath_expect(prep, XT_RPAREN, "expected ')'"))
+	return 0;
+
+    if (count < xfp->xxf_min || count > xfp->xxf_max)
+	return xi_xpath_fail(prep, "wrong number of arguments");
+
+    id = xi_xpath_op_new(prep, (xfp->xxf_id == XI_FN_NOT)
+			 ? XI_OP_NOT : XI_OP_FUNCTION);
+    if (id == 0)
+	return 0;
+
+    xi_xpath_op_t *opp = xi_xpath_op(xpp, id);
+    opp->xpo_type = xfp->xxf_id;
+    opp->xpo_child = first;
+
+    return id;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_primary (xi_xpath_prep_t *prep)
+{
+    xi_xpath_op_id_t id;
+    xi_xpath_op_t *opp;
+
+    switch (prep->xxp_token) {
+    case XT_LITERAL:
+	id = xi_xpath_op_new(prep, XI_OP_LITERAL);
+	if (id == 0)
+	    return 0;
+
+	opp = xi_xpath_op(prep->xxp_xpath, id);
+	opp->xpo_string = strndup(prep->xxp_text + 1, prep->xxp_len - 2);
+	if (opp->xpo_string == NULL)
+	    return xi_xpath_fail(prep, "out of memory");
+
+	xi_xpath_lex(prep);
+	return id;
+
+    case XT_NUMBER:
+	id = xi_xpath_op_new(prep, XI_OP_NUMBER);
+	if (id == 0)
+	    return 0;
+
+	xi_xpath_op(prep->xxp_xpath, id)->xpo_number = prep->xxp_number;
+	xi_xpath_lex(prep);
+	return id;
+
+    case XT_LPAREN:
+	xi_xpath_lex(prep);
+	id = xi_xpath_parse_expr(prep);
+	if (id == 0)
+	    return 0;
+
+	if (!xi_xpath_expect(prep, XT_RPAREN, "expected ')'"))
+	    return 0;
+	return id;
+
+    case XT_FUNCTION:
+	return xi_xpath_parse_function(prep);
+    }
+
+    return xi_xpath_fail(prep, "expected expression");
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_path (xi_xpath_prep_t *prep)
+{
+    xi_xpath_op_id_t id, preds;
+
+    if (prep->xxp_token == XT_SLASH || prep->xxp_token == XT_DSLASH
+	    || xi_xpath_step_start(prep->xxp_token))
+	return xi_xpath_parse_location(prep, 0);
+
+    id = xi_xpath_parse_primary(prep);
+    if (id == 0)
+	return 0;
+
+    preds = xi_xpath_parse_predicates(prep);
+    if (prep->xxp_error)
+	return 0;
+
+    if (preds) {
+	xi_xpath_op_id_t filter = xi_xpath_op_new(prep, XI_OP_FILTER);
+	if (filter == 0)
+	    return 0;
+
+	xi_xpath_op_t *opp = xi_xpath_op(prep->xxp_xpath, filter);
+	opp->xpo_child = preds;
+	opp->xpo_right = id;
+	id = filter;
+    }
+
+    if (prep->xxp_token == XT_SLASH || prep->xxp_token == XT_DSLASH)
+	id = xi_xpath_parse_location(prep, id);
+
+    return id;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_union (xi_xpath_prep_t *prep)
+{
+    xi_xpath_op_id_t left = xi_xpath_parse_path(prep);
+
+    while (left && prep->xxp_token == XT_PIPE) {
+	xi_xpath_lex(prep);
+	left = xi_xpath_op_binary(prep, XI_OP_UNION, left,
+				  xi_xpath_parse_path(prep));
+    }
+
+    return left;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_unary (xi_xpath_prep_t *prep)
+{
+    if (prep->xxp_token != XT_MINUS)
+	return xi_xpath_parse_union(prep);
+
+    xi_xpath_lex(prep);
+
+    xi_xpath_op_id_t child = xi_xpath_parse_unary(prep);
+    if (child == 0)
+	return 0;
+
+    xi_xpath_op_id_t id = xi_xpath_op_new(prep, XI_OP_NEGATE);
+    if (id)
+	xi_xpath_op(prep->xxp_xpath, id)->xpo_child = child;
+
+    return id;
+}
+
+/*
+ * The binary operators, from loosest to tightest binding.  Each
+ * level is left-associative and parses operands at the next level.
+ */
+typedef struct xi_xpath_binop_s {
+    xi_xpath_token_t xxb_token; /* Token (XT_*) */
+    xi_xpath_opcode_t xxb_op;	/* Operation (XI_OP_*) */
+    uint8_t xxb_level;		/* Precedence level */
+} xi_xpath_binop_t;
+
+static const xi_xpath_binop_t xi_xpath_binops[] = {
+    { XT_OR, XI_OP_OR, 0 },
+    { XT_AND, XI_OP_AND, 1 },
+    { XT_EQ, XI_OP_EQ, 2 },
+    { XT_NE, XI_OP_NE, 2 },
+    { XT_LT, XI_OP_LT, 3 },
+    { XT_LE, XI_OP_LE, 3 },
+    { XT_GT, XI_OP_GT, 3 },
+    { XT_GE, XI_OP_GE, 3 },
+    { XT_PLUS, XI_OP_PLUS, 4 },
+    { XT_MINUS, XI_OP_MINUS, 4 },
+    { XT_MULT, XI_OP_MULT, 5 },
+    { XT_DIV, XI_OP_DIV, 5 },
+    { XT_MOD, XI_OP_MOD, 5 },
+};
+
+#define XI_XPATH_LEVEL_MAX	6 /* Past the tightest binary level */
+
+static xi_xpath_op_id_t
+xi_xpath_parse_level (xi_xpath_prep_t *prep, unsigned level)
+{
+    const xi_xpath_binop_t *xbp;
+    unsigned i;
+
+    if (level >= XI_XPATH_LEVEL_MAX)
+	return xi_xpath_parse_unary(prep);
+
+    xi_xpath_op_id_t left = xi_xpath_parse_level(prep, level + 1);
+
+    while (left) {
+	for (i = 0, xbp = xi_xpath_binops;
+	     i < PSU_NUM_ELTS(xi_xpath_binops); i++, xbp++)
+	    if (xbp->xxb_level == level && xbp->xxb_token == prep->xxp_token)
+		break;
+
+	if (i >= PSU_NUM_ELTS(xi_xpath_binops))
+	    break;
+
+	xi_xpath_lex(prep);
+	left = xi_xpath_op_binary(prep, xbp->xxb_op, left,
+				  xi_xpath_parse_level(prep, level + 1));
+    }
+
+    return left;
+}
+
+static xi_xpath_op_id_t
+xi_xpath_parse_expr (xi_xpath_prep_t *prep)
+{
+    return xi_xpath_parse_level(prep, 0);
+}
+
+xi_xpath_t *
+xi_xpath_compile (xi_workspace_t *xwp, const char *expr)
 {
     xi_xpath_prep_t prep;
+    xi_xpath_t *xpp = calloc(1, sizeof(*xpp));
+
+    if (xpp == NULL)
+	return NULL;
+
+    xpp->xp_workspace = xwp;
+    xpp->xp_count = 1;		/* Op zero is the null op */
 
     bzero(&prep, sizeof(prep));
-    prep.xxp_atom_name = xi_parse_namepool_atom(input, "name");
-    prep.xxp_atom_type = xi_parse_namepool_atom(input, "type");
+    prep.xxp_xpath = xpp;
+    prep.xxp_expr = prep.xxp_cur = expr;
+
+    xi_xpath_lex(&prep);
+    xpp->xp_root = xi_xpath_parse_expr(&prep);
+
+    if (xpp->xp_root && prep.xxp_token != XT_EOF)
+	xi_xpath_fail(&prep, "unexpected input");
+
+    if (prep.xxp_error) {
+	xi_xpath_free(xpp);
+	return NULL;
+    }
+
+    return xpp;
+}
+
+void
+xi_xpath_free (xi_xpath_t *xpp)
+{
+    xi_xpath_op_id_t i;
+
+    if (xpp == NULL)
+	return;
+
+    for (i = 1; i < xpp->xp_count; i++)
+	if (xpp->xp_ops[i].xpo_string)
+	    free(xpp->xp_ops[i].xpo_string);
+
+    if (xpp->xp_ops)
+	free(xpp->xp_ops);
+    free(xpp);
+}
+
+/*
+ * Evaluation.  Values are kept in an xi_xpath_value_t, with node
+ * sets as vectors of node atoms in document order (and hence sorted
+ * and unique).  We only build an xi_nodeset_t for the final result.
+ */
+typedef struct xi_xpath_value_s {
+    uint8_t xv_type;		/* Type of value (XI_XPR_*) */
+    xi_boolean_t xv_boolean;	/* Value for XI_XPR_BOOLEAN */
+    double xv_number;		/* Value for XI_XPR_NUMBER */
+    char *xv_string;		/* Value for XI_XPR_STRING (allocated) */
+    pa_atom_t *xv_nodes;	/* Value for XI_XPR_NODESET (allocated) */
+    uint32_t xv_count;		/* Number of nodes in xv_nodes */
+    uint32_t xv_max;		/* Number of slots in xv_nodes */
+} xi_xpath_value_t;
+
+typedef struct xi_xpath_eval_s {
+    xi_xpath_t *xe_xpath;	/* Compiled expression */
+    xi_workspace_t *xe_workspace; /* Workspace holding the nodes */
+} xi_xpath_eval_t;
+
+static void
+xi_xpath_value_clean (xi_xpath_value_t *vp)
+{
+    if (vp->xv_string)
+	free(vp->xv_string);
+    if (vp->xv_nodes)
+	free(vp->xv_nodes);
+    bzero(vp, sizeof(*vp));
+}
+
+static int
+xi_xpath_value_add (xi_xpath_value_t *vp, pa_atom_t atom)
+{
+    if (vp->xv_count >= vp->xv_max) {
+	uint32_t max = vp->xv_max ? vp->xv_max << 1 : 64;
+	pa_atom_t *nodes = realloc(vp->xv_nodes, max * sizeof(*nodes));
+	if (nodes == NULL)
+	    return -1;
+
+	vp->xv_nodes = nodes;
+	vp->xv_max = max;
+    }
+
+    vp->xv_nodes[vp->xv_count++] = atom;
+    return 0;
+}
+
+static int
+xi_xpath_atom_compare (const void *xp, const void *yp)
+{
+    pa_atom_t x = *(const pa_atom_t *) xp, y = *(const pa_atom_t *) yp;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/*
+ * Put a node set back into document order, dropping duplicates
+ */
+static void
+xi_xpath_value_sort (xi_xpath_value_t *vp)
+{
+    uint32_t i, j;
+
+    if (vp->xv_count < 2)
+	return;
+
+    qsort(vp->xv_nodes, vp->xv_count, sizeof(vp->xv_nodes[0]),
+	  xi_xpath_atom_compare);
+
+    for (i = j = 1; i < vp->xv_count; i++)
+	if (vp->xv_nodes[i] != vp->xv_nodes[j - 1])
+	    vp->xv_nodes[j++] = vp->xv_nodes[i];
+
+    vp->xv_count = j;
+}
+
+static inline int
+xi_xpath_is_attrib_type (xi_node_type_t type)
+{
+    return type == XI_TYPE_ATTRIB || type == XI_TYPE_NS
+	|| type == XI_TYPE_ATSTR || type == XI_TYPE_NSPREF;
+}
 
-    
-    
+/*
+ * Return the first child (which may be an attribute) of a node.
+ * Only elements and the root have children; a text node's contents
+ * are its data.
+ */
+static inline pa_atom_t
+xi_xpath_first_child (xi_node_t *nodep)
+{
+    if (nodep->xn_type != XI_TYPE_ELT && nodep->xn_type != XI_TYPE_ROOT)
+	return PA_NULL_ATOM;
+
+    return nodep->xn_contents;
+}
+
+/*
+ * The last sibling's xn_next points at the parent, which we can spot
+ * by its depth.
+ */
+static inline pa_atom_t
+xi_xpath_next_sibling (xi_workspace_t *xwp, xi_node_t *nodep)
+{
+    xi_node_t *nextp = xi_node_addr(xwp, nodep->xn_next);
+
+    return (nextp && nextp->xn_depth == nodep->xn_depth)
+	? nodep->xn_next : PA_NULL_ATOM;
+}
+
+static pa_atom_t
+xi_xpath_parent (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, atom);
+    xi_depth_t depth;
+
+    if (nodep == NULL)
+	return PA_NULL_ATOM;
+
+    depth = nodep->xn_depth;
+    for (atom = nodep->xn_next; atom != PA_NULL_ATOM; atom = nodep->xn_next) {
+	nodep = xi_node_addr(xwp, atom);
+	if (nodep == NULL)
+	    break;		/* Should not occur */
+
+	if (nodep->xn_depth < depth)
+	    return atom;
+    }
+
+    return PA_NULL_ATOM;
+}
+
+static pa_atom_t
+xi_xpath_root (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    pa_atom_t parent;
+
+    while ((parent = xi_xpath_parent(xwp, atom)) != PA_NULL_ATOM)
+	atom = parent;
+
+    return atom;
+}
+
+/*
+ * Does the node pass the step's node test?
+ */
+static int
+xi_xpath_test (xi_workspace_t *xwp, xi_xpath_op_t *opp, xi_node_t *nodep)
+{
+    xi_node_type_t type = nodep->xn_type;
+
+    if (opp->xpo_op == XI_OP_NAME) {
+	xi_node_type_t principal = (opp->xpo_axis == XI_AXIS_ATTRIBUTE)
+	    ? XI_TYPE_ATTRIB : XI_TYPE_ELT;
+
+	if (type != principal)
+	    return FALSE;
+
+	if (opp->xpo_name != PA_NULL_ATOM
+		&& xi_node_name(xwp, nodep) != opp->xpo_name)
+	    return FALSE;
+
+	if (opp->xpo_prefix != PA_NULL_ATOM) {
+	    xi_ns_map_t *ns_map = xi_ns_map_addr(xwp,
+						 xi_node_ns_map(xwp, nodep));
+	    if (ns_map == NULL || ns_map->xnm_prefix != opp->xpo_prefix)
+		return FALSE;
+	}
+
+	return TRUE;
+    }
+
+    switch (opp->xpo_type) {
+    case XI_NT_NODE:
+	return type != XI_TYPE_NS && type != XI_TYPE_ATSTR
+	    && type != XI_TYPE_NSPREF;
+
+    case XI_NT_TEXT:
+	return type == XI_TYPE_TEXT || type == XI_TYPE_UNESC;
+
+    case XI_NT_COMMENT:
+	return type == XI_TYPE_COMMENT;
+
+    case XI_NT_PI:
+	return type == XI_TYPE_PI;
+    }
+
+    return FALSE;
+}
+
+static int
+xi_xpath_descend (xi_workspace_t *xwp, xi_xpath_op_t *opp,
+		  xi_node_t *nodep, xi_xpath_value_t *outp)
+{
+    pa_atom_t atom;
+    xi_node_t *childp;
+
+    for (atom = xi_xpath_first_child(nodep); atom != PA_NULL_ATOM;
+	 atom = xi_xpath_next_sibling(xwp, childp)) {
+	childp = xi_node_addr(xwp, atom);
+	if (childp == NULL)
+	    break;		/* Should not occur */
+
+	if (xi_xpath_is_attrib_type(childp->xn_type))
+	    continue;
+
+	if (xi_xpath_test(xwp, opp, childp) && xi_xpath_value_add(outp, atom))
+	    return -1;
+
+	if (childp->xn_type == XI_TYPE_ELT
+	        && childp->xn_contents != PA_NULL_ATOM
+	        && xi_xpath_descend(xwp, opp, childp, outp))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the atom just past the subtree under 'atom', which is the
+ * atom of the first node following it (its next sibling, or that of
+ * its nearest ancestor that has one).  Returns PA_NULL_ATOM if the
+ * subtree runs to the end of the tree.
+ */
+static pa_atom_t
+xi_xpath_subtree_end (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    xi_node_t *nodep;
+    pa_atom_t next;
+
+    for (; atom != PA_NULL_ATOM; atom = xi_xpath_parent(xwp, atom)) {
+	nodep = xi_node_addr(xwp, atom);
+	if (nodep == NULL)
+	    break;		/* Should not occur */
+
+	next = xi_xpath_next_sibling(xwp, nodep);
+	if (next != PA_NULL_ATOM)
+	    return next;
+    }
+
+    return PA_NULL_ATOM;
+}
+
+static int
+xi_xpath_is_ancestor (xi_workspace_t *xwp, pa_atom_t ancestor,
+		      pa_atom_t atom)
+{
+    xi_node_t *ancp = xi_node_addr(xwp, ancestor), *nodep;
+
+    if (ancp == NULL)
+	return FALSE;
+
+    /* With an extent, the descendants are a range of atoms */
+    pa_atom_t extent = xi_node_extent(xwp, ancestor);
+    if (extent != PA_NULL_ATOM)
+	return (atom > ancestor && atom <= extent);
+
+    for (atom = xi_xpath_parent(xwp, atom); atom != PA_NULL_ATOM;
+	 atom = xi_xpath_parent(xwp, atom)) {
+	if (atom == ancestor)
+	    return TRUE;
+
+	nodep = xi_node_addr(xwp, atom);
+	if (nodep == NULL || nodep->xn_depth <= ancp->xn_depth)
+	    break;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Find named descendants using the workspace's name index, if it
+ * covers this tree.  Since atoms are in document order, the
+ * descendants are the listed atoms between 'atom' and the end of its
+ * subtree.  If the subtree runs to the end, a later tree in the same
+ * workspace might have later atoms, so we have to check ancestry.
+ * Returns 1 if the index wasn't usable, so the caller walks the tree.
+ */
+static int
+xi_xpath_descend_index (xi_workspace_t *xwp, xi_xpath_op_t *opp,
+			pa_atom_t atom, xi_xpath_value_t *outp)
+{
+    xi_name_index_t *xnip = xwp->xw_name_index;
+    xi_nodeset_t nodeset;
+    xi_nodeset_iter_t iter;
+    xi_node_t *nodep;
+    pa_atom_t end, hit;
+
+    if (xnip == NULL || opp->xpo_op != XI_OP_NAME
+	    || opp->xpo_axis == XI_AXIS_ATTRIBUTE
+	    || opp->xpo_name == PA_NULL_ATOM
+	    || !xi_name_index_covers(xnip, xi_xpath_root(xwp, atom)))
+	return 1;
+
+    if (!xi_name_index_lookup(xnip, opp->xpo_name, &nodeset))
+	return 0;		/* No such elements */
+
+    /*
+     * An extent gives us the end of the subtree directly; otherwise
+     * we find the node that follows it.
+     */
+    pa_atom_t extent = xi_node_extent(xwp, atom);
+    end = (extent != PA_NULL_ATOM) ? extent + 1
+	: xi_xpath_subtree_end(xwp, atom);
+
+    xi_nodeset_iter_init(&nodeset, &iter);
+    while ((hit = xi_nodeset_iter_next(&nodeset, &iter)) != PA_NULL_ATOM) {
+	if (hit <= atom)
+	    continue;
+	if (end != PA_NULL_ATOM && hit >= end)
+	    break;
+
+	if (end == PA_NULL_ATOM && xnip->xni_trees > 1
+		&& !xi_xpath_is_ancestor(xwp, atom, hit))
+	    continue;
+
+	nodep = xi_node_addr(xwp, hit);
+	if (nodep && xi_xpath_test(xwp, opp, nodep)
+		&& xi_xpath_value_add(outp, hit))
+	    return -1;
+    }
+
+    return 0;
+}
+
+static inline int
+xi_xpath_reverse_axis (xi_xpath_axis_t axis)
+{
+    return axis == XI_AXIS_ANCESTOR || axis == XI_AXIS_ANCESTOR_OR_SELF
+	|| axis == XI_AXIS_PRECEDING_SIBLING;
+}
+
+/*
+ * Add the nodes along the step's axis from 'atom' that pass the node
+ * test, in proximity order (which is reversed for reverse axes).
+ */
+static int
+xi_xpath_axis (xi_workspace_t *xwp, xi_xpath_op_t *opp, pa_atom_t atom,
+	       xi_xpath_value_t *outp)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, atom), *childp;
+    pa_atom_t child;
+    uint32_t base;
+
+    if (nodep == NULL)
+	return 0;
+
+    switch (opp->xpo_axis) {
+    case XI_AXIS_CHILD:
+    case XI_AXIS_ATTRIBUTE:
+	for (child = xi_xpath_first_child(nodep); child != PA_NULL_ATOM;
+	     child = xi_xpath_next_sibling(xwp, childp)) {
+	    childp = xi_node_addr(xwp, child);
+	    if (childp == NULL)
+		break;		/* Should not occur */
+
+	    /* Attributes come first, so we can stop at the first child */
+	    if (xi_xpath_is_attrib_type(childp->xn_type)) {
+		if (opp->xpo_axis == XI_AXIS_CHILD)
+		    continue;
+	    } else if (opp->xpo_axis == XI_AXIS_ATTRIBUTE) {
+		break;
+	    }
+
+	    if (xi_xpath_test(xwp, opp, childp)
+		    && xi_xpath_value_add(outp, child))
+		return -1;
+	}
+	break;
+
+    case XI_AXIS_SELF:
+	if (xi_xpath_test(xwp, opp, nodep) && xi_xpath_value_add(outp, atom))
+	    return -1;
+	break;
+
+    case XI_AXIS_PARENT:
+	child = xi_xpath_parent(xwp, atom);
+	childp = xi_node_addr(xwp, child);
+	if (childp && xi_xpath_test(xwp, opp, childp)
+		&& xi_xpath_value_add(outp, child))
+	    return -1;
+	break;
+
+    case XI_AXIS_DESCENDANT_OR_SELF:
+	if (xi_xpath_test(xwp, opp, nodep) && xi_xpath_value_add(outp, atom))
+	    return -1;
+	/* FALLTHRU */
+
+    case XI_AXIS_DESCENDANT: {
+	int rc = xi_xpath_descend_index(xwp, opp, atom, outp);
+	if (rc <= 0)
+	    return rc;
+
+	return xi_xpath_descend(xwp, opp, nodep, outp);
+    }
+
+    case XI_AXIS_ANCESTOR_OR_SELF:
+	if (xi_xpath_test(xwp, opp, nodep) && xi_xpath_value_add(outp, atom))
+	    return -1;
+	/* FALLTHRU */
+
+    case XI_AXIS_ANCESTOR:
+	for (child = xi_xpath_parent(xwp, atom); child != PA_NULL_ATOM;
+	     child = xi_xpath_parent(xwp, child)) {
+	    childp = xi_node_addr(xwp, child);
+	    if (childp && xi_xpath_test(xwp, opp, childp)
+		    && xi_xpath_value_add(outp, child))
+		return -1;
+	}
+	break;
+
+    case XI_AXIS_FOLLOWING_SIBLING:
+	if (xi_xpath_is_attrib_type(nodep->xn_type))
+	    break;
+
+	for (child = xi_xpath_next_sibling(xwp, nodep); child != PA_NULL_ATOM;
+	     child = xi_xpath_next_sibling(xwp, childp)) {
+	    childp = xi_node_addr(xwp, child);
+	    if (childp == NULL)
+		break;		/* Should not occur */
+
+	    if (xi_xpath_test(xwp, opp, childp)
+		    && xi_xpath_value_add(outp, child))
+		return -1;
+	}
+	break;
+
+    case XI_AXIS_PRECEDING_SIBLING:
+	if (xi_xpath_is_attrib_type(nodep->xn_type))
+	    break;
+
+	/* Walk from the first sibling, then reverse what we found */
+	childp = xi_node_addr(xwp, xi_xpath_parent(xwp, atom));
+	if (childp == NULL)
+	    break;
+
+	base = outp->xv_count;
+	for (child = xi_xpath_first_child(childp);
+	     child != PA_NULL_ATOM && child != atom;
+	     child = xi_xpath_next_sibling(xwp, childp)) {
+	    childp = xi_node_addr(xwp, child);
+	    if (childp == NULL)
+		break;		/* Should not occur */
+
+	    if (xi_xpath_is_attrib_type(childp->xn_type))
+		continue;
+
+	    if (xi_xpath_test(xwp, opp, childp)
+		    && xi_xpath_value_add(outp, child))
+		return -1;
+	}
+
+	uint32_t i, j;
+	for (i = base, j = outp->xv_count - 1; i < j; i++, j--) {
+	    pa_atom_t tmp = outp->xv_nodes[i];
+	    outp->xv_nodes[i] = outp->xv_nodes[j];
+	    outp->xv_nodes[j] = tmp;
+	}
+	break;
+    }
+
+    return 0;
+}
+
+/*
+ * A growable string, used for string-values
+ */
+typedef struct xi_xpath_buf_s {
+    char *xb_data;		/* Data */
+    size_t xb_len;		/* Length of data */
+    size_t xb_size;		/* Size of allocation */
+} xi_xpath_buf_t;
+
+static int
+xi_xpath_buf_append (xi_xpath_buf_t *xbp, const char *str, size_t len)
+{
+    if (xbp->xb_len + len + 1 > xbp->xb_size) {
+	size_t size = xbp->xb_size ? xbp->xb_size : 64;
+	while (xbp->xb_len + len + 1 > size)
+	    size <<= 1;
+
+	char *data = realloc(xbp->xb_data, size);
+	if (data == NULL)
+	    return -1;
+
+	xbp->xb_data = data;
+	xbp->xb_size = size;
+    }
+
+    memcpy(xbp->xb_data + xbp->xb_len, str, len);
+    xbp->xb_len += len;
+    xbp->xb_data[xbp->xb_len] = '\0';
+
+    return 0;
+}
+
+static int
+xi_xpath_text_append (xi_workspace_t *xwp, xi_node_t *nodep,
+		      xi_xpath_buf_t *xbp)
+{
+    pa_atom_t atom;
+    xi_node_t *childp;
+    const char *cp;
+
+    for (atom = xi_xpath_first_child(nodep); atom != PA_NULL_ATOM;
+	 atom = xi_xpath_next_sibling(xwp, childp)) {
+	childp = xi_node_addr(xwp, atom);
+	if (childp == NULL)
+	    break;		/* Should not occur */
+
+	if (childp->xn_type == XI_TYPE_TEXT
+		|| childp->xn_type == XI_TYPE_UNESC) {
+	    cp = xi_textpool_string(xwp, childp->xn_contents);
+	    if (cp && xi_xpath_buf_append(xbp, cp, strlen(cp)))
+		return -1;
+
+	} else if (childp->xn_type == XI_TYPE_ELT) {
+	    if (xi_xpath_text_append(xwp, childp, xbp))
+		return -1;
+	}
+    }
+
+    return 0;
+}
+
+char *
+xi_xpath_node_string (xi_workspace_t *xwp, pa_atom_t node_atom)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, node_atom);
+    const char *cp = NULL;
+
+    if (nodep == NULL)
+	return strdup("");
+
+    switch (nodep->xn_type) {
+    case XI_TYPE_ROOT:
+    case XI_TYPE_ELT: {
+	xi_xpath_buf_t buf = { NULL, 0, 0 };
+
+	if (xi_xpath_text_append(xwp, nodep, &buf)) {
+	    if (buf.xb_data)
+		free(buf.xb_data);
+	    return NULL;
+	}
+
+	return buf.xb_data ?: strdup("");
+    }
+
+    case XI_TYPE_TEXT:
+    case XI_TYPE_UNESC:
+    case XI_TYPE_ATTRIB:
+    case XI_TYPE_COMMENT:
+    case XI_TYPE_PI:
+	cp = xi_textpool_string(xwp, nodep->xn_contents);
+	break;
+    }
+
+    return strdup(cp ?: "");
+}
+
+static char *
+xi_xpath_node_name (xi_workspace_t *xwp, pa_atom_t atom, int local)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, atom);
+    const char *name, *prefix = NULL;
+
+    if (nodep == NULL || (nodep->xn_type != XI_TYPE_ELT
+			  && nodep->xn_type != XI_TYPE_ATTRIB))
+	return strdup("");
+
+    name = xi_namepool_string(xwp, xi_node_name(xwp, nodep)) ?: "";
+
+    if (!local) {
+	xi_ns_map_t *ns_map = xi_ns_map_addr(xwp,
+					     xi_node_ns_map(xwp, nodep));
+	if (ns_map)
+	    prefix = xi_namepool_string(xwp, ns_map->xnm_prefix);
+    }
+
+    if (prefix == NULL)
+	return strdup(name);
+
+    size_t plen = strlen(prefix), nlen = strlen(name);
+    char *cp = malloc(plen + nlen + 2);
+    if (cp) {
+	memcpy(cp, prefix, plen);
+	cp[plen] = ':';
+	memcpy(cp + plen + 1, name, nlen + 1);
+    }
+
+    return cp;
+}
+
+static double
+xi_xpath_string_number (const char *str)
+{
+    const char *cp = xi_xpath_skip_ws(str), *start = cp;
+    int digits = 0;
+
+    if (*cp == '-')
+	cp += 1;
+    for (; *cp >= '0' && *cp <= '9'; cp++)
+	digits += 1;
+    if (*cp == '.')
+	for (cp += 1; *cp >= '0' && *cp <= '9'; cp++)
+	    digits += 1;
+
+    if (digits == 0 || *xi_xpath_skip_ws(cp) != '\0')
+	return NAN;
+
+    return strtod(start, NULL);
+}
+
+static char *
+xi_xpath_number_string (double num)
+{
+    char buf[64];
+
+    if (isnan(num))
+	return strdup("NaN");
+    if (isinf(num))
+	return strdup((num < 0) ? "-Infinity" : "Infinity");
+    if (num == 0)
+	return strdup("0");
+
+    if (num == floor(num) && fabs(num) < 1e15)
+	snprintf(buf, sizeof(buf), "%.0f", num);
+    else
+	snprintf(buf, sizeof(buf), "%.15g", num);
+
+    return strdup(buf);
+}
+
+static int
+xi_xpath_to_boolean (xi_xpath_value_t *vp)
+{
+    switch (vp->xv_type) {
+    case XI_XPR_NODESET:
+	return vp->xv_count != 0;
+    case XI_XPR_STRING:
+	return vp->xv_string && vp->xv_string[0] != '\0';
+    case XI_XPR_NUMBER:
+	return vp->xv_number != 0 && !isnan(vp->xv_number);
+    case XI_XPR_BOOLEAN:
+	return vp->xv_boolean;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Return the string value of a value, always allocated
+ */
+static char *
+xi_xpath_to_string (xi_xpath_eval_t *ep, xi_xpath_value_t *vp)
+{
+    switch (vp->xv_type) {
+    case XI_XPR_NODESET:
+	if (vp->xv_count == 0)
+	    return strdup("");
+	return xi_xpath_node_string(ep->xe_workspace, vp->xv_nodes[0]);
+
+    case XI_XPR_STRING:
+	return strdup(vp->xv_string ?: "");
+
+    case XI_XPR_NUMBER:
+	return xi_xpath_number_string(vp->xv_number);
+
+    case XI_XPR_BOOLEAN:
+	return strdup(vp->xv_boolean ? "true" : "false");
+    }
+
+    return strdup("");
+}
+
+static double
+xi_xpath_to_number (xi_xpath_eval_t *ep, xi_xpath_value_t *vp)
+{
+    char *cp;
+    double num;
+
+    switch (vp->xv_type) {
+    case XI_XPR_NUMBER:
+	return vp->xv_number;
+
+    case XI_XPR_BOOLEAN:
+	return vp->xv_boolean ? 1 : 0;
+
+    case XI_XPR_STRING:
+	return xi_xpath_string_number(vp->xv_string ?: "");
+
+    case XI_XPR_NODESET:
+	cp = xi_xpath_to_string(ep, vp);
+	if (cp == NULL)
+	    return NAN;
+	num = xi_xpath_string_number(cp);
+	free(cp);
+	return num;
+    }
+
+    return NAN;
+}
+
+static void
+xi_xpath_set_boolean (xi_xpath_value_t *vp, int val)
+{
+    xi_xpath_value_clean(vp);
+    vp->xv_type = XI_XPR_BOOLEAN;
+    vp->xv_boolean = val ? TRUE : FALSE;
+}
+
+static void
+xi_xpath_set_number (xi_xpath_value_t *vp, double num)
+{
+    xi_xpath_value_clean(vp);
+    vp->xv_type = XI_XPR_NUMBER;
+    vp->xv_number = num;
+}
+
+static int
+xi_xpath_set_string (xi_xpath_value_t *vp, char *str)
+{
+    xi_xpath_value_clean(vp);
+    if (str == NULL)
+	return -1;
+
+    vp->xv_type = XI_XPR_STRING;
+    vp->xv_string = str;
+    return 0;
+}
+
+static int
+xi_xpath_compare_numbers (xi_xpath_opcode_t op, double x, double y)
+{
+    switch (op) {
+    case XI_OP_EQ:
+	return x == y;
+    case XI_OP_NE:
+	return x != y;
+    case XI_OP_LT:
+	return x < y;
+    case XI_OP_LE:
+	return x <= y;
+    case XI_OP_GT:
+	return x > y;
+    case XI_OP_GE:
+	return x >= y;
+    }
+
+    return FALSE;
+}
+
+static int
+xi_xpath_compare_strings (xi_xpath_opcode_t op, const char *x, const char *y)
+{
+    if (op == XI_OP_EQ)
+	return strcmp(x, y) == 0;
+    if (op == XI_OP_NE)
+	return strcmp(x, y) != 0;
+
+    return xi_xpath_compare_numbers(op, xi_xpath_string_number(x),
+				    xi_xpath_string_number(y));
+}
+
+/*
+ * Swap the sense of a relational operator, for when we swap operands
+ */
+static xi_xpath_opcode_t
+xi_xpath_compare_flip (xi_xpath_opcode_t op)
+{
+    switch (op) {
+    case XI_OP_LT:
+	return XI_OP_GT;
+    case XI_OP_LE:
+	return XI_OP_GE;
+    case XI_OP_GT:
+	return XI_OP_LT;
+    case XI_OP_GE:
+	return XI_OP_LE;
+    }
+
+    return op;
+}
+
+/*
+ * Compare a node set with another value, which is true if any member
+ * of the set satisfies the comparison.  Returns -1 on failure.
+ */
+static int
+xi_xpath_compare_nodeset (xi_xpath_eval_t *ep, xi_xpath_opcode_t op,
+			  xi_xpath_value_t *setp, xi_xpath_value_t *vp)
+{
+    xi_workspace_t *xwp = ep->xe_workspace;
+    char *other = NULL, *str;
+    double num = 0;
+    uint32_t i;
+    int rc = FALSE;
+
+    if (vp->xv_type == XI_XPR_BOOLEAN)
+	return xi_xpath_compare_numbers(op, xi_xpath_to_boolean(setp),
+					vp->xv_boolean);
+
+    if (vp->xv_type == XI_XPR_NUMBER)
+	num = vp->xv_number;
+    else if (vp->xv_type == XI_XPR_STRING)
+	other = vp->xv_string ?: "";
+
+    for (i = 0; i < setp->xv_count && !rc; i++) {
+	str = xi_xpath_node_string(xwp, setp->xv_nodes[i]);
+	if (str == NULL)
+	    return -1;
+
+	if (vp->xv_type == XI_XPR_NUMBER) {
+	    rc = xi_xpath_compare_numbers(op, xi_xpath_string_number(str),
+					  num);
+
+	} else if (vp->xv_type == XI_XPR_STRING) {
+	    rc = xi_xpath_compare_strings(op, str, other);
+
+	} else {
+	    /* Node set versus node set; compare against each member */
+	    uint32_t j;
+	    for (j = 0; j < vp->xv_count && !rc; j++) {
+		char *ostr = xi_xpath_node_string(xwp, vp->xv_nodes[j]);
+		if (ostr == NULL) {
+		    free(str);
+		    return -1;
+		}
+
+		rc = xi_xpath_compare_strings(op, str, ostr);
+		free(ostr);
+	    }
+	}
+
+	free(str);
+    }
+
+    return rc;
+}
+
+static int
+xi_xpath_compare (xi_xpath_eval_t *ep, xi_xpath_opcode_t op,
+		  xi_xpath_value_t *lp, xi_xpath_value_t *rp)
+{
+    int rc;
+
+    if (lp->xv_type == XI_XPR_NODESET)
+	return xi_xpath_compare_nodeset(ep, op, lp, rp);
+    if (rp->xv_type == XI_XPR_NODESET)
+	return xi_xpath_compare_nodeset(ep, xi_xpath_compare_flip(op), rp, lp);
+
+    if (op == XI_OP_EQ || op == XI_OP_NE) {
+	if (lp->xv_type == XI_XPR_BOOLEAN || rp->xv_type == XI_XPR_BOOLEAN)
+	    return xi_xpath_compare_numbers(op, xi_xpath_to_boolean(lp),
+					    xi_xpath_to_boolean(rp));
+
+	if (lp->xv_type == XI_XPR_STRING && rp->xv_type == XI_XPR_STRING)
+	    return xi_xpath_compare_strings(op, lp->xv_string ?: "",
+					    rp->xv_string ?: "");
+    }
+
+    rc = xi_xpath_compare_numbers(op, xi_xpath_to_number(ep, lp),
+				  xi_xpath_to_number(ep, rp));
+    return rc;
+}
+
+static int
+xi_xpath_eval_op (xi_xpath_eval_t *ep, xi_xpath_op_id_t id,
+		  xi_xpath_context_t *ctxp, xi_xpath_value_t *vp);
+
+/*
+ * Apply a chain of predicates to a node set (in proximity order)
+ */
+static int
+xi_xpath_filter (xi_xpath_eval_t *ep, xi_xpath_op_id_t pred,
+		 xi_xpath_value_t *setp)
+{
+    xi_xpath_t *xpp = ep->xe_xpath;
+    xi_xpath_op_t *predp, *exprp;
+    xi_xpath_context_t ctx;
+    xi_xpath_value_t val;
+    uint32_t i, j, size;
+    int keep;
+
+    for (; pred && setp->xv_count; pred = predp->xpo_next) {
+	predp = xi_xpath_op(xpp, pred);
+	exprp = xi_xpath_op(xpp, predp->xpo_child);
+	size = setp->xv_count;
+
+	/* "[N]" is common enough to deserve a shortcut */
+	if (exprp->xpo_op == XI_OP_NUMBER) {
+	    double num = exprp->xpo_number;
+
+	    if (num >= 1 && num <= size && num == floor(num)) {
+		setp->xv_nodes[0] = setp->xv_nodes[(uint32_t) num - 1];
+		setp->xv_count = 1;
+	    } else {
+		setp->xv_count = 0;
+	    }
+	    continue;
+	}
+
+	for (i = j = 0; i < size; i++) {
+	    ctx.xxc_node = setp->xv_nodes[i];
+	    ctx.xxc_position = i + 1;
+	    ctx.xxc_size = size;
+
+	    bzero(&val, sizeof(val));
+	    if (xi_xpath_eval_op(ep, predp->xpo_child, &ctx, &val)) {
+		xi_xpath_value_clean(&val);
+		return -1;
+	    }
+
+	    if (val.xv_type == XI_XPR_NUMBER)
+		keep = (val.xv_number == i + 1);
+	    else
+		keep = xi_xpath_to_boolean(&val);
+	    xi_xpath_value_clean(&val);
+
+	    if (keep)
+		setp->xv_nodes[j++] = setp->xv_nodes[i];
+	}
+
+	setp->xv_count = j;
+    }
+
+    return 0;
+}
+
+/*
+ * Apply one step to each node in 'inp', giving 'outp'
+ */
+static int
+xi_xpath_eval_step (xi_xpath_eval_t *ep, xi_xpath_op_id_t step,
+		    xi_xpath_value_t *inp, xi_xpath_value_t *outp)
+{
+    xi_xpath_op_t *opp = xi_xpath_op(ep->xe_xpath, step);
+    xi_xpath_value_t cand;
+    uint32_t i, j;
+    int rc = 0;
+
+    bzero(&cand, sizeof(cand));
+    outp->xv_type = XI_XPR_NODESET;
+
+    for (i = 0; i < inp->xv_count; i++) {
+	if (opp->xpo_child == 0) {
+	    /* Without predicates, we can collect straight into outp */
+	    rc = xi_xpath_axis(ep->xe_workspace, opp, inp->xv_nodes[i], outp);
+	    if (rc)
+		break;
+	    continue;
+	}
+
+	cand.xv_count = 0;
+	rc = xi_xpath_axis(ep->xe_workspace, opp, inp->xv_nodes[i], &cand);
+	if (rc == 0)
+	    rc = xi_xpath_filter(ep, opp->xpo_child, &cand);
+	for (j = 0; rc == 0 && j < cand.xv_count; j++)
+	    rc = xi_xpath_value_add(outp, cand.xv_nodes[j]);
+	if (rc)
+	    break;
+    }
+
+    xi_xpath_value_clean(&cand);
+
+    /*
+     * A single context node on a forward axis gives results in
+     * document order.  Otherwise we need to sort.
+     */
+    if (inp->xv_count > 1 || xi_xpath_reverse_axis(opp->xpo_axis))
+	xi_xpath_value_sort(outp);
+
+    return rc;
+}
+
+static int
+xi_xpath_eval_path (xi_xpath_eval_t *ep, xi_xpath_op_t *opp,
+		    xi_xpath_context_t *ctxp, xi_xpath_value_t *vp)
+{
+    xi_xpath_value_t next;
+    xi_xpath_op_id_t step;
+
+    if (opp->xpo_right) {
+	if (xi_xpath_eval_op(ep, opp->xpo_right, ctxp, vp))
+	    return -1;
+	if (vp->xv_type != XI_XPR_NODESET) {
+	    pa_warning(0, "xpath: path applied to a non-node-set");
+	    return -1;
+	}
+
+    } else {
+	pa_atom_t atom = ctxp->xxc_node;
+	if (opp->xpo_flags & XPOF_ABSOLUTE)
+	    atom = xi_xpath_root(ep->xe_workspace, atom);
+
+	vp->xv_type = XI_XPR_NODESET;
+	if (xi_xpath_value_add(vp, atom))
+	    return -1;
+    }
+
+    for (step = opp->xpo_child; step && vp->xv_count;
+	 step = xi_xpath_op(ep->xe_xpath, step)->xpo_next) {
+	bzero(&next, sizeof(next));
+	if (xi_xpath_eval_step(ep, step, vp, &next)) {
+	    xi_xpath_value_clean(&next);
+	    return -1;
+	}
+
+	xi_xpath_value_clean(vp);
+	*vp = next;
+    }
+
+    return 0;
+}
+
+static int
+xi_xpath_eval_function (xi_xpath_eval_t *ep, xi_xpath_op_t *opp,
+			xi_xpath_context_t *ctxp, xi_xpath_value_t *vp)
+{
+    xi_xpath_t *xpp = ep->xe_xpath;
+    xi_xpath_value_t args[2];
+    xi_xpath_op_id_t arg;
+    char *str, *cp, *sp;
+    unsigned i, nargs = 0;
+    int rc = 0;
+    double num;
+
+    bzero(args, sizeof(args));
+
+    /* Evaluate (up to) the first two arguments */
+    for (arg = opp->xpo_child; arg && nargs < PSU_NUM_ELTS(args);
+	 arg = xi_xpath_op(xpp, arg)->xpo_next, nargs++) {
+	if (xi_xpath_eval_op(ep, arg, ctxp, &args[nargs])) {
+	    rc = -1;
+	    goto done;
+	}
+    }
+
+    /* Functions with an optional argument default to the context node */
+    if (nargs == 0) {
+	switch (opp->xpo_type) {
+	case XI_FN_NAME:
+	case XI_FN_LOCAL_NAME:
+	case XI_FN_STRING:
+	case XI_FN_STRING_LENGTH:
+	case XI_FN_NORMALIZE_SPACE:
+	case XI_FN_NUMBER:
+	    args[0].xv_type = XI_XPR_NODESET;
+	    if (xi_xpath_value_add(&args[0], ctxp->xxc_node)) {
+		rc = -1;
+		goto done;
+	    }
+	    nargs = 1;
+	}
+    }
+
+    switch (opp->xpo_type) {
+    case XI_FN_LAST:
+	xi_xpath_set_number(vp, ctxp->xxc_size);
+	break;
+
+    case XI_FN_POSITION:
+	xi_xpath_set_number(vp, ctxp->xxc_position);
+	break;
+
+    case XI_FN_COUNT:
+    case XI_FN_SUM:
+	if (args[0].xv_type != XI_XPR_NODESET) {
+	    pa_warning(0, "xpath: count()/sum() need a node set");
+	    rc = -1;
+	    break;
+	}
+
+	if (opp->xpo_type == XI_FN_COUNT) {
+	    xi_xpath_set_number(vp, args[0].xv_count);
+	    break;
+	}
+
+	for (i = 0, num = 0; i < args[0].xv_count; i++) {
+	    str = xi_xpath_node_string(ep->xe_workspace, args[0].xv_nodes[i]);
+	    if (str == NULL) {
+		rc = -1;
+		break;
+	    }
+	    num += xi_xpath_string_number(str);
+	    free(str);
+	}
+	xi_xpath_set_number(vp, num);
+	break;
+
+    case XI_FN_NAME:
+    case XI_FN_LOCAL_NAME:
+	if (args[0].xv_type != XI_XPR_NODESET) {
+	    pa_warning(0, "xpath: name() needs a node set");
+	    rc = -1;
+	} else if (args[0].xv_count == 0) {
+	    rc = xi_xpath_set_string(vp, strdup(""));
+	} else {
+	    rc = xi_xpath_set_string(vp,
+			     xi_xpath_node_name(ep->xe_workspace,
+				args[0].xv_nodes[0],
+				opp->xpo_type == XI_FN_LOCAL_NAME));
+	}
+	break;
+
+    case XI_FN_STRING:
+	rc = xi_xpath_set_string(vp, xi_xpath_to_string(ep, &args[0]));
+	break;
+
+    case XI_FN_CONCAT: {
+	xi_xpath_buf_t buf = { NULL, 0, 0 };
+	xi_xpath_value_t val;
+
+	for (arg = opp->xpo_child; arg && rc == 0;
+	     arg = xi_xpath_op(xpp, arg)->xpo_next) {
+	    bzero(&val, sizeof(val));
+	    rc = xi_xpath_eval_op(ep, arg, ctxp, &val);
+	    str = rc ? NULL : xi_xpath_to_string(ep, &val);
+	    xi_xpath_value_clean(&val);
+
+	    if (str == NULL || xi_xpath_buf_append(&buf, str, strlen(str)))
+		rc = -1;
+	    if (str)
+		free(str);
+	}
+
+	if (rc == 0)
+	    rc = xi_xpath_set_string(vp, buf.xb_data ?: strdup(""));
+	else if (buf.xb_data)
+	    free(buf.xb_data);
+	break;
+    }
+
+    case XI_FN_CONTAINS:
+    case XI_FN_STARTS_WITH:
+	str = xi_xpath_to_string(ep, &args[0]);
+	cp = xi_xpath_to_string(ep, &args[1]);
+	if (str == NULL || cp == NULL) {
+	    rc = -1;
+	} else if (opp->xpo_type == XI_FN_CONTAINS) {
+	    xi_xpath_set_boolean(vp, strstr(str, cp) != NULL);
+	} else {
+	    xi_xpath_set_boolean(vp, strncmp(str, cp, strlen(cp)) == 0);
+	}
+	if (str)
+	    free(str);
+	if (cp)
+	    free(cp);
+	break;
+
+    case XI_FN_STRING_LENGTH:
+	str = xi_xpath_to_string(ep, &args[0]);
+	if (str == NULL) {
+	    rc = -1;
+	    break;
+	}
+
+	/* Count characters, not bytes, by skipping UTF-8 continuations */
+	for (cp = str, num = 0; *cp; cp++)
+	    if ((*cp & 0xc0) != 0x80)
+		num += 1;
+	free(str);
+	xi_xpath_set_number(vp, num);
+	break;
+
+    case XI_FN_NORMALIZE_SPACE:
+	str = xi_xpath_to_string(ep, &args[0]);
+	if (str == NULL) {
+	    rc = -1;
+	    break;
+	}
+
+	for (cp = sp = str; *cp; cp++) {
+	    if (!xi_isspace(*cp))
+		*sp++ = *cp;
+	    else if (sp != str && !xi_isspace(cp[1]) && cp[1] != '\0')
+		*sp++ = ' ';
+	}
+	*sp = '\0';
+	rc = xi_xpath_set_string(vp, str);
+	break;
+
+    case XI_FN_TRUE:
+    case XI_FN_FALSE:
+	xi_xpath_set_boolean(vp, opp->xpo_type == XI_FN_TRUE);
+	break;
+
+    case XI_FN_BOOLEAN:
+	xi_xpath_set_boolean(vp, xi_xpath_to_boolean(&args[0]));
+	break;
+
+    case XI_FN_NUMBER:
+	xi_xpath_set_number(vp, xi_xpath_to_number(ep, &args[0]));
+	break;
+
+    default:
+	rc = -1;
+    }
+
+ done:
+    for (i = 0; i < PSU_NUM_ELTS(args); i++)
+	xi_xpath_value_clean(&args[i]);
+
+    return rc;
+}
+
+static int
+xi_xpath_eval_op (xi_xpath_eval_t *ep, xi_xpath_op_id_t id,
+		  xi_xpath_context_t *ctxp, xi_xpath_value_t *vp)
+{
+    xi_xpath_op_t *opp = xi_xpath_op(ep->xe_xpath, id);
+    xi_xpath_value_t left, right;
+    double x, y;
+    int rc = 0;
+
+    if (opp == NULL)
+	return -1;
+
+    bzero(&left, sizeof(left));
+    bzero(&right, sizeof(right));
+
+    switch (opp->xpo_op) {
+    case XI_OP_PATH:
+	return xi_xpath_eval_path(ep, opp, ctxp, vp);
+
+    case XI_OP_FILTER:
+	if (xi_xpath_eval_op(ep, opp->xpo_right, ctxp, vp))
+	    return -1;
+	if (vp->xv_type != XI_XPR_NODESET) {
+	    pa_warning(0, "xpath: predicate applied to a non-node-set");
+	    return -1;
+	}
+	return xi_xpath_filter(ep, opp->xpo_child, vp);
+
+    case XI_OP_FUNCTION:
+	return xi_xpath_eval_function(ep, opp, ctxp, vp);
+
+    case XI_OP_LITERAL:
+	return xi_xpath_set_string(vp, strdup(opp->xpo_string));
+
+    case XI_OP_NUMBER:
+	xi_xpath_set_number(vp, opp->xpo_number);
+	return 0;
+
+    case XI_OP_NOT:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, &left);
+	if (rc == 0)
+	    xi_xpath_set_boolean(vp, !xi_xpath_to_boolean(&left));
+	break;
+
+    case XI_OP_NEGATE:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, &left);
+	if (rc == 0)
+	    xi_xpath_set_number(vp, -xi_xpath_to_number(ep, &left));
+	break;
+
+    case XI_OP_OR:
+    case XI_OP_AND:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, &left);
+	if (rc)
+	    break;
+
+	/* Short-circuit, as the spec requires */
+	int val = xi_xpath_to_boolean(&left);
+	if (val == (opp->xpo_op == XI_OP_OR)) {
+	    xi_xpath_set_boolean(vp, val);
+	    break;
+	}
+
+	rc = xi_xpath_eval_op(ep, opp->xpo_right, ctxp, &right);
+	if (rc == 0)
+	    xi_xpath_set_boolean(vp, xi_xpath_to_boolean(&right));
+	break;
+
+    case XI_OP_UNION:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, vp);
+	if (rc == 0)
+	    rc = xi_xpath_eval_op(ep, opp->xpo_right, ctxp, &right);
+	if (rc)
+	    break;
+
+	if (vp->xv_type != XI_XPR_NODESET || right.xv_type != XI_XPR_NODESET) {
+	    pa_warning(0, "xpath: union of non-node-sets");
+	    rc = -1;
+	    break;
+	}
+
+	uint32_t i;
+	for (i = 0; rc == 0 && i < right.xv_count; i++)
+	    rc = xi_xpath_value_add(vp, right.xv_nodes[i]);
+	xi_xpath_value_sort(vp);
+	break;
+
+    case XI_OP_EQ:
+    case XI_OP_NE:
+    case XI_OP_LT:
+    case XI_OP_LE:
+    case XI_OP_GT:
+    case XI_OP_GE:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, &left);
+	if (rc == 0)
+	    rc = xi_xpath_eval_op(ep, opp->xpo_right, ctxp, &right);
+	if (rc)
+	    break;
+
+	rc = xi_xpath_compare(ep, opp->xpo_op, &left, &right);
+	if (rc >= 0) {
+	    xi_xpath_set_boolean(vp, rc);
+	    rc = 0;
+	}
+	break;
+
+    case XI_OP_PLUS:
+    case XI_OP_MINUS:
+    case XI_OP_MULT:
+    case XI_OP_DIV:
+    case XI_OP_MOD:
+	rc = xi_xpath_eval_op(ep, opp->xpo_child, ctxp, &left);
+	if (rc == 0)
+	    rc = xi_xpath_eval_op(ep, opp->xpo_right, ctxp, &right);
+	if (rc)
+	    break;
+
+	x = xi_xpath_to_number(ep, &left);
+	y = xi_xpath_to_number(ep, &right);
+
+	switch (opp->xpo_op) {
+	case XI_OP_PLUS:
+	    x += y;
+	    break;
+	case XI_OP_MINUS:
+	    x -= y;
+	    break;
+	case XI_OP_MULT:
+	    x *= y;
+	    break;
+	case XI_OP_DIV:
+	    x /= y;
+	    break;
+	case XI_OP_MOD:
+	    x = fmod(x, y);
+	    break;
+	}
+
+	xi_xpath_set_number(vp, x);
+	break;
+
+    default:
+	pa_warning(0, "xpath: unknown op %u", opp->xpo_op);
+	rc = -1;
+    }
+
+    xi_xpath_value_clean(&left);
+    xi_xpath_value_clean(&right);
+
+    return rc;
+}
+
+int
+xi_xpath_eval (xi_xpath_t *xpp, pa_atom_t node_atom,
+	       xi_xpath_result_t *resp)
+{
+    xi_xpath_eval_t eval = { xpp, xpp->xp_workspace };
+    xi_xpath_context_t ctx = { node_atom, 1, 1 };
+    xi_xpath_value_t val;
+    int rc;
+
+    bzero(resp, sizeof(*resp));
+    bzero(&val, sizeof(val));
+
+    rc = xi_xpath_eval_op(&eval, xpp->xp_root, &ctx, &val);
+    if (rc)
+	goto done;
+
+    resp->xpr_type = val.xv_type;
+
+    switch (val.xv_type) {
+    case XI_XPR_NODESET:
+	/* Our node vectors are already sorted, so the result is too */
+	resp->xpr_nodeset = xi_nodeset_alloc(xpp->xp_workspace,
+					     XI_NSTYPE_NORMAL, XI_NSF_SORTED);
+	if (resp->xpr_nodeset == NULL
+		|| xi_nodeset_append(resp->xpr_nodeset, val.xv_nodes,
+				     val.xv_count))
+	    rc = -1;
+	break;
+
+    case XI_XPR_STRING:
+	resp->xpr_string = val.xv_string;
+	val.xv_string = NULL;
+	break;
+
+    case XI_XPR_NUMBER:
+	resp->xpr_number = val.xv_number;
+	break;
+
+    case XI_XPR_BOOLEAN:
+	resp->xpr_boolean = val.xv_boolean;
+	break;
+    }
+
+ done:
+    xi_xpath_value_clean(&val);
+    if (rc)
+	xi_xpath_result_clean(resp);
+
+    return rc;
+}
+
+void
+xi_xpath_result_clean (xi_xpath_result_t *resp)
+{
+    if (resp->xpr_string)
+	free(resp->xpr_string);
+    if (resp->xpr_nodeset)
+	xi_nodeset_free(resp->xpr_nodeset);
+
+    bzero(resp, sizeof(*resp));
+}
+
+xi_nodeset_t *
+xi_xpath_select (xi_xpath_t *xpp, pa_atom_t node_atom)
+{
+    xi_xpath_result_t res;
+
+    if (xi_xpath_eval(xpp, node_atom, &res))
+	return NULL;
+
+    if (res.xpr_type != XI_XPR_NODESET) {
+	xi_xpath_result_clean(&res);
+	return NULL;
+    }
+
+    return res.xpr_nodeset;
+}
+
+static const char *xi_xpath_op_names[] = {
+    "unknown",
+    "name",
+    "type",
+    "predicate",
+    "or",
+    "and",
+    "not",
+    "path",
+    "filter",
+    "union",
+    "=",
+    "!=",
+    "<",
+    "<=",
+    ">",
+    ">=",
+    "+",
+    "-",
+    "*",
+    "div",
+    "mod",
+    "negate",
+    "literal",
+    "number",
+    "function",
+    NULL
+};
+
+static void
+xi_xpath_dump_op (xi_xpath_t *xpp, xi_xpath_op_id_t id, unsigned indent)
+{
+    xi_workspace_t *xwp = xpp->xp_workspace;
+    xi_xpath_op_t *opp = xi_xpath_op(xpp, id);
+    const char *name = (opp->xpo_op < PSU_NUM_ELTS(xi_xpath_op_names) - 1)
+	? xi_xpath_op_names[opp->xpo_op] : "unknown";
+    xi_xpath_op_id_t kid;
+    const char *prefix;
+
+    switch (opp->xpo_op) {
+    case XI_OP_NAME:
+	prefix = opp->xpo_prefix
+	    ? xi_namepool_string(xwp, opp->xpo_prefix) : NULL;
+	slaxLog("%*s%u: step %s::%s%s%s", indent, "", id,
+		xi_xpath_axis_names[opp->xpo_axis],
+		prefix ?: "", prefix ? ":" : "",
+		opp->xpo_name ? xi_namepool_string(xwp, opp->xpo_name) : "*");
+	break;
+
+    case XI_OP_TYPE:
+	slaxLog("%*s%u: step %s::%s()", indent, "", id,
+		xi_xpath_axis_names[opp->xpo_axis],
+		xi_xpath_node_types[opp->xpo_type]);
+	break;
+
+    case XI_OP_PATH:
+	slaxLog("%*s%u: path%s", indent, "", id,
+		(opp->xpo_flags & XPOF_ABSOLUTE) ? " (absolute)" : "");
+	if (opp->xpo_right)
+	    xi_xpath_dump_op(xpp, opp->xpo_right, indent + 2);
+	for (kid = opp->xpo_child; kid; kid = xi_xpath_op(xpp, kid)->xpo_next)
+	    xi_xpath_dump_op(xpp, kid, indent + 2);
+	return;
+
+    case XI_OP_LITERAL:
+	slaxLog("%*s%u: literal '%s'", indent, "", id, opp->xpo_string);
+	return;
+
+    case XI_OP_NUMBER:
+	slaxLog("%*s%u: number %g", indent, "", id, opp->xpo_number);
+	return;
+
+    case XI_OP_FUNCTION: {
+	const xi_xpath_func_t *xfp;
+
+	for (xfp = xi_xpath_functions; xfp->xxf_name; xfp++)
+	    if (xfp->xxf_id == opp->xpo_type)
+		break;
+
+	slaxLog("%*s%u: function %s()", indent, "", id,
+		xfp->xxf_name ?: "unknown");
+	for (kid = opp->xpo_child; kid; kid = xi_xpath_op(xpp, kid)->xpo_next)
+	    xi_xpath_dump_op(xpp, kid, indent + 2);
+	return;
+    }
+
+    default:
+	slaxLog("%*s%u: %s", indent, "", id, name);
+	break;
+    }
+
+    /* Steps and predicates have predicates or an expression as a child */
+    for (kid = opp->xpo_child; kid; ) {
+	xi_xpath_dump_op(xpp, kid, indent + 2);
+
+	if (opp->xpo_op == XI_OP_NAME || opp->xpo_op == XI_OP_TYPE
+		|| opp->xpo_op == XI_OP_FILTER)
+	    kid = xi_xpath_op(xpp, kid)->xpo_next; /* Predicate chain */
+	else
+	    break;
+    }
+
+    if (opp->xpo_right)
+	xi_xpath_dump_op(xpp, opp->xpo_right, indent + 2);
+}
+
+void
+xi_xpath_dump (xi_xpath_t *xpp)
+{
+    if (xpp->xp_root)
+	xi_xpath_dump_op(xpp, xpp->xp_root, 0);
 }
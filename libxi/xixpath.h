@@ -19,12 +19,28 @@
  * multiple possibilities as we descend since we _really_ don't want
  * to descend again (though sometimes we may have to).  We call these
  * possibilities "hopes".
+ *
+ * We compile an expression into a small array of operations, linked
+ * by index, and evaluate them directly against the nodes in a
+ * workspace; there's no conversion to libxml2.  Names are compiled
+ * into namepool atoms, so a name-test is an integer compare.  Node
+ * atoms are allocated as the parser walks the document, so atom
+ * order is document order, which is how we keep result sets sorted.
+ *
+ * We handle the XPath 1.0 expression grammar (paths, predicates,
+ * unions, boolean, comparison and arithmetic operators) and the core
+ * functions that don't need more than the tree itself.  Variables
+ * and the namespace axis aren't supported yet.  Since there's no
+ * prefix mapping in the context yet, a prefixed name-test matches
+ * the prefix used in the document, and an unprefixed one matches any
+ * namespace.  Attributes are only visible if the parser extracted
+ * them (XIA_SAVE_ATTRIB).
  */
 
 #ifndef LIBSLAX_XI_XPATH_H
 #define LIBSLAX_XI_XPATH_H
 
-typedef uint16_t xi_xpath_op_t;	/* Operations */
+typedef uint16_t xi_xpath_opcode_t; /* Operations */
 #define XI_OP_UNKNOWN	0	/* Unknown */
 #define XI_OP_NAME	1	/* Location path step name-test */
 #define XI_OP_TYPE	2	/* Node-type test */
@@ -32,33 +48,88 @@ typedef uint16_t xi_xpath_op_t;	/* Operations */
 #define XI_OP_OR	4	/* Logical "OR" */
 #define XI_OP_AND	5	/* Logical "AND" */
 #define XI_OP_NOT	6	/* Logical "NOT" */
+#define XI_OP_PATH	7	/* Location path (list of steps) */
+#define XI_OP_FILTER	8	/* Primary expression with predicates */
+#define XI_OP_UNION	9	/* Union of node sets ("|") */
+#define XI_OP_EQ	10	/* "=" */
+#define XI_OP_NE	11	/* "!=" */
+#define XI_OP_LT	12	/* "<" */
+#define XI_OP_LE	13	/* "<=" */
+#define XI_OP_GT	14	/* ">" */
+#define XI_OP_GE	15	/* ">=" */
+#define XI_OP_PLUS	16	/* "+" */
+#define XI_OP_MINUS	17	/* "-" */
+#define XI_OP_MULT	18	/* "*" */
+#define XI_OP_DIV	19	/* "div" */
+#define XI_OP_MOD	20	/* "mod" */
+#define XI_OP_NEGATE	21	/* Unary "-" */
+#define XI_OP_LITERAL	22	/* String literal */
+#define XI_OP_NUMBER	23	/* Numeric literal */
+#define XI_OP_FUNCTION	24	/* Function call */
+
+typedef uint8_t xi_xpath_axis_t; /* Axis of a step */
+#define XI_AXIS_CHILD		0 /* child:: (the default) */
+#define XI_AXIS_ATTRIBUTE	1 /* attribute:: ("@") */
+#define XI_AXIS_SELF		2 /* self:: (".") */
+#define XI_AXIS_PARENT		3 /* parent:: ("..") */
+#define XI_AXIS_DESCENDANT	4 /* descendant:: */
+#define XI_AXIS_DESCENDANT_OR_SELF 5 /* descendant-or-self:: ("//") */
+#define XI_AXIS_ANCESTOR	6 /* ancestor:: */
+#define XI_AXIS_ANCESTOR_OR_SELF 7 /* ancestor-or-self:: */
+#define XI_AXIS_FOLLOWING_SIBLING 8 /* following-sibling:: */
+#define XI_AXIS_PRECEDING_SIBLING 9 /* preceding-sibling:: */
 
-#define XI_OPERAND_MAX	2	/* Number of operands per operator */
+/* Node-type tests (for xpo_type in XI_OP_TYPE) */
+#define XI_NT_NODE	0	/* node() */
+#define XI_NT_TEXT	1	/* text() */
+#define XI_NT_COMMENT	2	/* comment() */
+#define XI_NT_PI	3	/* processing-instruction() */
+
+#define XI_OPERAND_MAX	3	/* Number of operands per operator */
+
+typedef uint32_t xi_xpath_op_id_t; /* Index of an op (zero is null) */
 
 /*
  * A piece of a compiled XPath
  */
 typedef struct xi_xpath_op_s {
-    xi_xpath_op_t xpo_op;	/* Operation (XI_OP_*) */
-    pa_atom_t xpo_atom[XI_OPERAND_MAX]; /* Operands */
+    xi_xpath_opcode_t xpo_op;	/* Operation (XI_OP_*) */
+    xi_xpath_axis_t xpo_axis;	/* Axis (XI_AXIS_*), for steps */
+    uint8_t xpo_type;		/* Node-type (XI_NT_*) or function (XI_FN_*) */
+    uint8_t xpo_flags;		/* Flags (XPOF_*) */
+    xi_xpath_op_id_t xpo_atom[XI_OPERAND_MAX]; /* Operands */
+    pa_atom_t xpo_name;		/* Name-test local name (in namepool) */
+    pa_atom_t xpo_prefix;	/* Name-test prefix (in namepool) */
+    double xpo_number;		/* Value of XI_OP_NUMBER */
+    char *xpo_string;		/* Value of XI_OP_LITERAL */
 } xi_xpath_op_t;
 
 /* Conventions for atom fields */
-#define xpo_next xpo_atom[0]
-#define xpo_child xpo_atom[1]
+#define xpo_next xpo_atom[0]	/* Next step, predicate, or argument */
+#define xpo_child xpo_atom[1]	/* First step, predicate, or operand */
+#define xpo_right xpo_atom[2]	/* Second operand, or start of a path */
+
+/* Flags for xpo_flags */
+#define XPOF_ABSOLUTE	(1<<0)	/* Path starts at the root */
 
 /*
  * A compiled XPath
  */
 typedef struct xi_xpath_s {
-    pa_atom_t xp_root;		/* Root of the xpath expression */
+    xi_workspace_t *xp_workspace; /* Workspace for names */
+    xi_xpath_op_t *xp_ops;	/* Operations (indexed by xi_xpath_op_id_t) */
+    xi_xpath_op_id_t xp_count;	/* Number of operations in use */
+    xi_xpath_op_id_t xp_max;	/* Number of operations allocated */
+    xi_xpath_op_id_t xp_root;	/* Root of the xpath expression */
 } xi_xpath_t;
 
 /*
  * An evaluation context, which includes a set of variables.
  */
 typedef struct xi_xpath_context_s {
-    /* nothing yet */
+    pa_atom_t xxc_node;		/* Context node */
+    uint32_t xxc_position;	/* Context position (origin 1) */
+    uint32_t xxc_size;		/* Context size */
 } xi_xpath_context_t;
 
 /*
@@ -66,13 +137,58 @@ typedef struct xi_xpath_context_s {
  */
 typedef struct xi_xpath_result_s {
     uint16_t xpr_type;		/* Type of result */
-    pa_atom_t xpr_result;	/* Resulting atom */
+    xi_boolean_t xpr_boolean;	/* Value for XI_XPR_BOOLEAN */
+    double xpr_number;		/* Value for XI_XPR_NUMBER */
+    char *xpr_string;		/* Value for XI_XPR_STRING */
+    xi_nodeset_t *xpr_nodeset;	/* Value for XI_XPR_NODESET */
 } xi_xpath_result_t;
 
-/* Values for xpr_result */
+/* Values for xpr_type */
 #define XI_XPR_UNKNOWN	0	/* Unknown */
 #define XI_XPR_NODESET	1	/* Creating a nodeset */
 #define XI_XPR_STRING	2	/* Building a string */
 #define XI_XPR_BOOLEAN	3	/* Boolean result */
+#define XI_XPR_NUMBER	4	/* Numeric result */
+
+/*
+ * Compile an expression, resolving names against the given
+ * workspace.  Returns NULL (after a warning) on syntax errors.
+ */
+xi_xpath_t *
+xi_xpath_compile (xi_workspace_t *xwp, const char *expr);
+
+void
+xi_xpath_free (xi_xpath_t *xpp);
+
+/*
+ * Evaluate a compiled expression with 'node_atom' as the context
+ * node.  Node set results are returned as an xi_nodeset_t in the
+ * workspace, in document order (XI_NSF_SORTED).  Returns zero on success.
+ */
+int
+xi_xpath_eval (xi_xpath_t *xpp, pa_atom_t node_atom,
+	       xi_xpath_result_t *resp);
+
+/*
+ * Release anything held by a result
+ */
+void
+xi_xpath_result_clean (xi_xpath_result_t *resp);
+
+/*
+ * Evaluate an expression that must give a node set, returning it
+ * (or NULL on error or for other result types).
+ */
+xi_nodeset_t *
+xi_xpath_select (xi_xpath_t *xpp, pa_atom_t node_atom);
+
+/*
+ * Return the string-value of a node, as a freshly allocated string
+ */
+char *
+xi_xpath_node_string (xi_workspace_t *xwp, pa_atom_t node_atom);
+
+void
+xi_xpath_dump (xi_xpath_t *xpp);
 
 #endif /* LIBSLAX_XI_XPATH_H */
@@ -18,6 +18,8 @@
 #include <string.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <limits.h>
+#include <strings.h>
 
 #include <parrotdb/pacommon.h>
 #include <parrotdb/pammap.h>
@@ -72,6 +74,56 @@ pa_arb_build_atom (pa_arb_t *prp UNUSED, pa_mmap_atom_t matom,
     return pa_arb_atom(raw);
 }
 
+/*
+ * Headerless pools track the mmap memory they hold, so it can be
+ * given back by pa_arb_release()
+ */
+static inline psu_boolean_t
+pa_arb_is_headerless (pa_arb_t *prp)
+{
+    return (prp->pr_infop == &prp->pr_info);
+}
+
+static void
+pa_arb_hold (pa_arb_t *prp, pa_mmap_atom_t matom, uint32_t size)
+{
+    if (!pa_arb_is_headerless(prp))
+	return;
+
+    if (prp->pr_held_count >= prp->pr_held_max) {
+	unsigned max = prp->pr_held_max ? prp->pr_held_max * 2 : 64;
+	pa_arb_held_t *newp = psu_realloc(prp->pr_held, max * sizeof(*newp));
+	if (newp == NULL) {
+	    pa_warning(0, "pa_arb: can't track held memory");
+	    return;
+	}
+
+	prp->pr_held = newp;
+	prp->pr_held_max = max;
+    }
+
+    pa_arb_held_t *prhdp = &prp->pr_held[prp->pr_held_count++];
+    prhdp->prhd_matom = matom;
+    prhdp->prhd_size = size;
+}
+
+static void
+pa_arb_unhold (pa_arb_t *prp, pa_mmap_atom_t matom)
+{
+    unsigned i;
+
+    if (!pa_arb_is_headerless(prp))
+	return;
+
+    for (i = 0; i < prp->pr_held_count; i++) {
+	if (pa_mmap_atom_of(prp->pr_held[i].prhd_matom)
+		== pa_mmap_atom_of(matom)) {
+	    prp->pr_held[i] = prp->pr_held[--prp->pr_held_count];
+	    return;
+	}
+    }
+}
+
 static void
 pa_arb_make_page (pa_arb_t *prp, unsigned slot)
 {
@@ -80,6 +132,9 @@ pa_arb_make_page (pa_arb_t *prp, unsigned slot)
     if (pa_mmap_is_null(matom))
 	return;
 
+    prp->pr_infop->pri_pages += real_size >> PA_MMAP_ATOM_SHIFT;
+    pa_arb_hold(prp, matom, real_size);
+
     pa_arb_header_t *prhp;
     unsigned chunks_per_page = pa_arb_chunks_per_page(prp, slot);
     unsigned i, imax = chunks_per_page;
@@ -111,6 +166,8 @@ pa_arb_make_page (pa_arb_t *prp, unsigned slot)
  * in the page table, based on side rounded up to power-of-two.  Then
  * take at item off the free list for that size.  If the free list is empty,
  * we'll allocate more memory for that size, putting items on the free list.
+ * Allocations bigger than a page skip the slots and go directly to
+ * pa_mmap_alloc().
  */
 pa_arb_atom_t
 pa_arb_alloc (pa_arb_t *prp, size_t size)
@@ -121,7 +178,7 @@ pa_arb_alloc (pa_arb_t *prp, size_t size)
 
     pa_arb_atom_t atom = pa_arb_null_atom();
 
-    if (slot <= PA_ARB_MAX_POW2) {
+    if (slot <= PA_ARB_MAX_SMALL) {
 	/* "Small"-style allocation */
 	atom = prp->pr_infop->pri_free[slot];
 	if (pa_arb_is_null(atom)) {
@@ -137,6 +194,10 @@ pa_arb_alloc (pa_arb_t *prp, size_t size)
 
 	prhp = pa_arb_header(prp, atom);
 
+	/* The caller is about to fill in the chunk */
+	pa_mmap_touch(prp->pr_mmap, prhp,
+		      (size_t) 1 << (slot + PA_ARB_ATOM_SHIFT));
+
 	/* Pull out the next free atom and record in our slot */
 	prp->pr_infop->pri_free[slot] = prhp->prh_next_free[0];
 
@@ -149,6 +210,8 @@ pa_arb_alloc (pa_arb_t *prp, size_t size)
 	if (pa_mmap_is_null(matom))
 	    return pa_arb_null_atom();
 
+	pa_arb_hold(prp, matom, full_size);
+
 	/*
 	 * Since our atom numbers are just shifted matoms, we just
 	 * need to zero fill the low bits.
@@ -164,11 +227,15 @@ pa_arb_alloc (pa_arb_t *prp, size_t size)
 	 * the pa_arb_header.
 	 */
 	prhp->prh_size = full_size >> PA_MMAP_ATOM_SHIFT;
+	prp->pr_infop->pri_large += prhp->prh_size;
 
     } else {
 	pa_warning(0, "pa_arb: allocation size limit exceeded: %lu", size);
     }
 
+    if (prp->pr_counters && !pa_arb_is_null(atom))
+	prp->pr_counters->pmc_allocs += 1;
+
     return atom;
 }
 
@@ -176,6 +243,7 @@ static void
 pa_arb_free_atom_addr (pa_arb_t *prp, pa_arb_atom_t atom, void *addr)
 {
     pa_arb_header_t *prhp = addr;
+    pa_mmap_atom_t matom;
     size_t full_size;
     unsigned slot;
 
@@ -186,6 +254,7 @@ pa_arb_free_atom_addr (pa_arb_t *prp, pa_arb_atom_t atom, void *addr)
 	/* "Small"-style allocation */
 	slot = prhp->prh_slot;
 
+	pa_mmap_touch(prp->pr_mmap, prhp, sizeof(*prhp));
 	prhp->prh_next_free[0] = prp->pr_infop->pri_free[slot];
 	prp->pr_infop->pri_free[slot] = atom;
 	prhp->prh_magic = PRH_MAGIC_SMALL_FREE;
@@ -197,10 +266,11 @@ pa_arb_free_atom_addr (pa_arb_t *prp, pa_arb_atom_t atom, void *addr)
 	break;
 
     case PRH_MAGIC_LARGE_INUSE:
+	prp->pr_infop->pri_large -= prhp->prh_size;
 	full_size = prhp->prh_size << PA_MMAP_ATOM_SHIFT;
-	pa_mmap_free(prp->pr_mmap,
-		     pa_mmap_atom(pa_arb_atom_of(atom) >> PA_ARB_OFFSET_SHIFT),
-		     full_size);
+	matom = pa_mmap_atom(pa_arb_atom_of(atom) >> PA_ARB_OFFSET_SHIFT);
+	pa_arb_unhold(prp, matom);
+	pa_mmap_free(prp->pr_mmap, matom, full_size);
 	break;
 
     case PRH_MAGIC_LARGE_FREE:
@@ -224,9 +294,278 @@ pa_arb_free_atom (pa_arb_t *prp, pa_arb_atom_t atom)
     if (addr == NULL)		/* Should not occur */
 	return;
 
+    if (prp->pr_counters)
+	prp->pr_counters->pmc_frees += 1;
+
     pa_arb_free_atom_addr(prp, atom, addr);
 }
 
+static int
+pa_arb_atom_compare (const void *lp, const void *rp)
+{
+    pa_atom_t l = pa_arb_atom_of(*(const pa_arb_atom_t *) lp);
+    pa_atom_t r = pa_arb_atom_of(*(const pa_arb_atom_t *) rp);
+
+    return (l < r) ? -1 : (l > r) ? 1 : 0;
+}
+
+static int
+pa_arb_forward_compare (const void *lp, const void *rp)
+{
+    return pa_arb_atom_compare(&((const pa_arb_forward_t *) lp)->praf_old,
+			       &((const pa_arb_forward_t *) rp)->praf_old);
+}
+
+/*
+ * Information about one page of a slot, used during compaction
+ */
+typedef struct pa_arb_page_s {
+    pa_atom_t prpg_matom;	/* mmap atom of the page */
+    unsigned prpg_free;		/* Number of free chunks */
+    unsigned prpg_first;	/* Index of first free chunk in our list */
+    psu_boolean_t prpg_victim;	/* Moving chunks off this page */
+} pa_arb_page_t;
+
+static int
+pa_arb_page_compare (const void *lp, const void *rp)
+{
+    const pa_arb_page_t *l = lp, *r = rp;
+
+    /* Emptiest pages first */
+    if (l->prpg_free != r->prpg_free)
+	return (l->prpg_free > r->prpg_free) ? -1 : 1;
+    return (l->prpg_matom < r->prpg_matom) ? -1
+	: (l->prpg_matom > r->prpg_matom) ? 1 : 0;
+}
+
+/*
+ * Make sure the forwarding table has room for 'count' more entries
+ */
+static psu_boolean_t
+pa_arb_forward_reserve (pa_arb_compact_t *prcp, unsigned count)
+{
+    if (prcp->prc_count + count <= prcp->prc_max)
+	return TRUE;
+
+    unsigned max = prcp->prc_max ?: 64;
+    while (max < prcp->prc_count + count)
+	max *= 2;
+
+    pa_arb_forward_t *table;
+    table = psu_realloc(prcp->prc_table, max * sizeof(*table));
+    if (table == NULL)
+	return FALSE;
+
+    prcp->prc_table = table;
+    prcp->prc_max = max;
+    return TRUE;
+}
+
+/*
+ * Compact one slot.  We gather the free list, group it by page, and
+ * give back the pages that are wholly free.  Then we take the
+ * emptiest pages as victims and move their chunks into the free
+ * chunks of the fullest pages, recording each move.  Finally, the
+ * free list is rebuilt in address order, so later allocations fill
+ * pages densely.
+ */
+static void
+pa_arb_compact_slot (pa_arb_t *prp, unsigned slot, pa_arb_compact_t *prcp,
+		     unsigned *budgetp)
+{
+    unsigned per_page = pa_arb_chunks_per_page(prp, slot);
+    pa_arb_atom_t atom, *list = NULL;
+    pa_arb_page_t *pages = NULL;
+    pa_arb_header_t *prhp;
+    unsigned count = 0, max = 0, num_pages = 0, i, j;
+
+    /* Gather the free list */
+    for (atom = prp->pr_infop->pri_free[slot]; !pa_arb_is_null(atom);
+	 atom = prhp->prh_next_free[0]) {
+	prhp = pa_arb_header(prp, atom);
+	if (prhp == NULL || prhp->prh_magic != PRH_MAGIC_SMALL_FREE) {
+	    pa_warning(0, "pa_arb: bad free list in slot %u (%#x)",
+		       slot, pa_arb_atom_of(atom));
+	    goto done;
+	}
+
+	if (count >= max) {
+	    pa_arb_atom_t *newp;
+	    max = max ? max * 2 : 256;
+	    newp = psu_realloc(list, max * sizeof(*list));
+	    if (newp == NULL)
+		goto done;
+	    list = newp;
+	}
+
+	list[count++] = atom;
+    }
+
+    if (count == 0)
+	goto done;
+
+    qsort(list, count, sizeof(*list), pa_arb_atom_compare);
+
+    /* Group the free chunks by page */
+    pages = psu_calloc(count * sizeof(*pages));
+    if (pages == NULL)
+	goto done;
+
+    for (i = 0; i < count; i++) {
+	pa_atom_t matom = pa_arb_atom_of(list[i]) >> PA_ARB_OFFSET_SHIFT;
+	if (num_pages == 0 || pages[num_pages - 1].prpg_matom != matom) {
+	    pages[num_pages].prpg_matom = matom;
+	    pages[num_pages].prpg_first = i;
+	    num_pages += 1;
+	}
+	pages[num_pages - 1].prpg_free += 1;
+    }
+
+    qsort(pages, num_pages, sizeof(*pages), pa_arb_page_compare);
+
+    /*
+     * Pages are now emptiest first.  'lo' walks forward over the
+     * victims, while 'hi' walks backward over the pages receiving
+     * their chunks; 'next' is the next free chunk on page 'hi'.
+     */
+    unsigned lo, hi = num_pages;
+    unsigned next = 0, left = 0;
+    size_t chunk_size = 1 << (slot + PA_ARB_ATOM_SHIFT);
+
+    for (lo = 0; lo < num_pages; lo++) {
+	pa_arb_page_t *victim = &pages[lo];
+
+	if (victim->prpg_free == per_page) {
+	    victim->prpg_victim = TRUE; /* Wholly free; nothing to move */
+	    continue;
+	}
+
+	if (*budgetp == 0 || lo >= hi)
+	    break;
+
+	/* Count the free chunks on the pages that will take our chunks */
+	unsigned needed = per_page - victim->prpg_free;
+	unsigned avail = left;
+	for (j = hi; j > lo + 1 && avail < needed; j--)
+	    avail += pages[j - 1].prpg_free;
+	if (avail < needed || !pa_arb_forward_reserve(prcp, needed))
+	    break;
+
+	*budgetp -= 1;
+	victim->prpg_victim = TRUE;
+
+	/* Move each chunk that's in use */
+	for (i = 0; i < per_page; i++) {
+	    pa_mmap_atom_t vm = pa_mmap_atom(victim->prpg_matom);
+	    pa_arb_atom_t old_atom = pa_arb_build_atom(prp, vm, slot, i);
+	    pa_arb_header_t *oldp = pa_arb_header(prp, old_atom);
+
+	    if (oldp->prh_magic != PRH_MAGIC_SMALL_INUSE)
+		continue;
+
+	    while (left == 0) {
+		hi -= 1;
+		next = pages[hi].prpg_first;
+		left = pages[hi].prpg_free;
+	    }
+
+	    pa_arb_atom_t new_atom = list[next];
+	    pa_arb_header_t *newp = pa_arb_header(prp, new_atom);
+	    pa_arb_chunk_t chunk = newp->prh_chunk;
+
+	    pa_mmap_touch(prp->pr_mmap, newp, chunk_size);
+	    pa_mmap_touch(prp->pr_mmap, oldp, sizeof(*oldp));
+	    memcpy(newp, oldp, chunk_size);
+	    newp->prh_chunk = chunk;
+	    oldp->prh_magic = PRH_MAGIC_SMALL_FREE;
+
+	    list[next] = pa_arb_null_atom(); /* No longer free */
+	    next += 1;
+	    left -= 1;
+	    pages[hi].prpg_free -= 1;
+
+	    prcp->prc_table[prcp->prc_count].praf_old = old_atom;
+	    prcp->prc_table[prcp->prc_count].praf_new = new_atom;
+	    prcp->prc_count += 1;
+	}
+    }
+
+    /* Give back the victims, dropping their chunks from the list */
+    for (i = 0; i < num_pages; i++) {
+	if (!pages[i].prpg_victim)
+	    continue;
+
+	pa_atom_t matom = pages[i].prpg_matom;
+	for (j = pages[i].prpg_first; j < count; j++) {
+	    if (pa_arb_is_null(list[j]))
+		continue;
+	    if ((pa_arb_atom_of(list[j]) >> PA_ARB_OFFSET_SHIFT) != matom)
+		break;
+	    list[j] = pa_arb_null_atom();
+	}
+
+	pa_arb_unhold(prp, pa_mmap_atom(matom));
+	pa_mmap_free(prp->pr_mmap, pa_mmap_atom(matom),
+		     pa_arb_slot_to_size(prp, slot));
+	prp->pr_infop->pri_pages -= 1;
+	prcp->prc_pages += 1;
+    }
+
+    /* Rebuild the free list in address order */
+    pa_arb_atom_t *nextp = &prp->pr_infop->pri_free[slot];
+    for (i = 0; i < count; i++) {
+	if (pa_arb_is_null(list[i]))
+	    continue;
+
+	pa_mmap_touch(prp->pr_mmap, nextp, sizeof(*nextp));
+	*nextp = list[i];
+	nextp = &pa_arb_header(prp, list[i])->prh_next_free[0];
+    }
+    pa_mmap_touch(prp->pr_mmap, nextp, sizeof(*nextp));
+    *nextp = pa_arb_null_atom();
+
+ done:
+    psu_free(pages);
+    psu_free(list);
+}
+
+void
+pa_arb_compact (pa_arb_t *prp, unsigned max_pages, pa_arb_compact_t *prcp)
+{
+    unsigned slot, budget = max_pages ?: UINT_MAX;
+
+    bzero(prcp, sizeof(*prcp));
+
+    for (slot = 0; slot <= PA_ARB_MAX_SMALL; slot++)
+	pa_arb_compact_slot(prp, slot, prcp, &budget);
+
+    if (prcp->prc_count > 1)
+	qsort(prcp->prc_table, prcp->prc_count, sizeof(prcp->prc_table[0]),
+	      pa_arb_forward_compare);
+}
+
+pa_arb_atom_t
+pa_arb_forward (pa_arb_compact_t *prcp, pa_arb_atom_t atom)
+{
+    pa_arb_forward_t key, *fp;
+
+    if (prcp->prc_count == 0 || pa_arb_is_null(atom))
+	return atom;
+
+    key.praf_old = atom;
+    fp = bsearch(&key, prcp->prc_table, prcp->prc_count,
+		 sizeof(prcp->prc_table[0]), pa_arb_forward_compare);
+
+    return fp ? fp->praf_new : atom;
+}
+
+void
+pa_arb_compact_done (pa_arb_compact_t *prcp)
+{
+    psu_free(prcp->prc_table);
+    bzero(prcp, sizeof(*prcp));
+}
+
 void
 pa_arb_init (pa_mmap_t *pmp, pa_arb_t *prp)
 {
@@ -239,8 +578,11 @@ pa_arb_setup (pa_mmap_t *pmp, pa_arb_info_t *prip)
     pa_arb_t *prp = psu_calloc(sizeof(*prp));
 
     if (prp) {
-	prp->pr_infop = prip;
+	/* Without a header, we keep the info block in-process */
+	prp->pr_infop = prip ?: &prp->pr_info;
 	pa_arb_init(pmp, prp);
+	if (prip)
+	    prp->pr_counters = pa_mmap_counters(pmp, prip);
     }
 
     return prp;
@@ -266,9 +608,28 @@ pa_arb_open (pa_mmap_t *pmp, const char *name)
 void
 pa_arb_close (pa_arb_t *prp)
 {
+    if (prp == NULL)
+	return;
+
+    psu_free(prp->pr_held);
     psu_free(prp);
 }
 
+void
+pa_arb_release (pa_arb_t *prp)
+{
+    unsigned i;
+
+    if (prp == NULL)
+	return;
+
+    for (i = 0; i < prp->pr_held_count; i++)
+	pa_mmap_free(prp->pr_mmap, prp->pr_held[i].prhd_matom,
+		     prp->pr_held[i].prhd_size);
+
+    pa_arb_close(prp);
+}
+
 void
 pa_arb_dump (pa_arb_t *prp)
 {
@@ -40,10 +40,11 @@
  * not bytes, e.g. slot 9 is not 1<<9 (256), it's 1<<9<<4 (8192).
  * And yes, this comment is for "future me".
  *
- * For larger allocations, allocations (rounded up to page sizes) are
- * made directly from the underlaying allocator, with a header that
- * identifies them as such.  Freed blocks are free by the underlaying
- * allocator, at the cost of us recording their size.
+ * For larger allocations (more than one mmap page), allocations
+ * (rounded up to page sizes) are made directly from the underlaying
+ * allocator, with a header that identifies them as such.  Freed blocks
+ * are freed by the underlaying allocator, at the cost of us recording
+ * their size.
  */
 
 typedef uint8_t pa_arb_chunk_t;
@@ -83,6 +84,15 @@ typedef struct pa_arb_header_s {
 
 /* This is the largest power of two that can be handled by "small" */
 #define PA_ARB_MAX_POW2 	PA_ARB_PAGE_SHIFT
+
+/*
+ * Slots past a full mmap page would waste up to half of each
+ * allocation in power-of-two rounding, so anything bigger than a
+ * page goes directly to pa_mmap_alloc(), rounded up to whole pages.
+ * The slots above PA_ARB_MAX_SMALL are kept in pa_arb_info_t (for
+ * compatibility), but are never used.
+ */
+#define PA_ARB_MAX_SMALL	PA_ARB_OFFSET_SHIFT
 #define PA_ARB_MAX_LARGE	(1 << (PA_MMAP_ATOM_SHIFT + PA_NBBY * 2))
 
 #if 0
@@ -108,12 +118,28 @@ typedef struct pa_page_info_s {
  */
 typedef struct pa_arb_info_s {
     pa_arb_atom_t pri_free[PA_ARB_MAX_POW2 + 1]; /* The free list */
+    uint32_t pri_pages;		/* mmap atoms held for small allocations */
+    uint32_t pri_large;		/* mmap atoms held for large allocations */
 } pa_arb_info_t;
 
+/*
+ * A headerless pool (one opened without a name) can't be found again
+ * once it's closed, so it remembers the mmap memory it holds, allowing
+ * pa_arb_release() to give it all back.
+ */
+typedef struct pa_arb_held_s {
+    pa_mmap_atom_t prhd_matom;	/* mmap atom we're holding */
+    uint32_t prhd_size;		/* Size of that memory (in bytes) */
+} pa_arb_held_t;
+
 typedef struct pa_arb_s {
     pa_mmap_t *pr_mmap;		/* Underlaying memory file */
     pa_arb_info_t pr_info;	/* Our info structure, if needed */
     pa_arb_info_t *pr_infop;	/* A pointer to our info structure */
+    pa_mmap_counters_t *pr_counters; /* Counters for our header (or NULL) */
+    pa_arb_held_t *pr_held;	/* Memory we hold (headerless only) */
+    unsigned pr_held_count;	/* Number of entries used in pr_held */
+    unsigned pr_held_max;	/* Number of entries allocated in pr_held */
 } pa_arb_t;
 
 static inline void *
@@ -180,6 +206,38 @@ pa_arb_alloc_string (pa_arb_t *prp, const char *value)
 void
 pa_arb_free_atom (pa_arb_t *prp, pa_arb_atom_t atom);
 
+/*
+ * Compaction moves in-use chunks off sparse pages so those pages can
+ * be given back to the mmap segment.  Since callers hold atoms, every
+ * move is recorded in a forwarding table, and the caller must rewrite
+ * each atom it holds with pa_arb_forward() before the table is
+ * released with pa_arb_compact_done().  Pages that are wholly free
+ * are always given back; 'max_pages' limits the number of pages we
+ * move chunks off of in one pass (zero for no limit), so compaction
+ * can be done incrementally.  Large allocations are whole mmap pages
+ * and are never moved.
+ */
+typedef struct pa_arb_forward_s {
+    pa_arb_atom_t praf_old;	/* Old location */
+    pa_arb_atom_t praf_new;	/* New location */
+} pa_arb_forward_t;
+
+typedef struct pa_arb_compact_s {
+    pa_arb_forward_t *prc_table; /* Forwarding table (sorted by old) */
+    unsigned prc_count;		/* Number of entries in prc_table */
+    unsigned prc_max;		/* Size of prc_table */
+    unsigned prc_pages;		/* Number of pages given back */
+} pa_arb_compact_t;
+
+void
+pa_arb_compact (pa_arb_t *prp, unsigned max_pages, pa_arb_compact_t *prcp);
+
+pa_arb_atom_t
+pa_arb_forward (pa_arb_compact_t *prcp, pa_arb_atom_t atom);
+
+void
+pa_arb_compact_done (pa_arb_compact_t *prcp);
+
 void
 pa_arb_init (pa_mmap_t *pmp, pa_arb_t *prp);
 
@@ -192,6 +250,13 @@ pa_arb_open (pa_mmap_t *pmp, const char *name);
 void
 pa_arb_close (pa_arb_t *prp);
 
+/*
+ * Close a headerless pool, giving all its memory back to the mmap
+ * segment.  For named pools, this is just pa_arb_close().
+ */
+void
+pa_arb_release (pa_arb_t *prp);
+
 void
 pa_arb_dump (pa_arb_t *prp);
 
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Bulk operations on bitmaps.  The single-bit operations are inlines
+ * in pabitmap.h; these walk whole bitmaps, a chunk at a time.  The
+ * inner loops are simple enough for the compiler to vectorize.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+
+#include <libpsu/psualloc.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/pabitmap.h>
+
+typedef enum pa_bitmap_op_e {
+    PBO_OR,			/* dst |= src */
+    PBO_AND,			/* dst &= src */
+    PBO_ANDNOT,			/* dst &= ~src */
+} pa_bitmap_op_t;
+
+/*
+ * Release a chunk whose bits are all clear, so later scans can skip it
+ */
+static inline void
+pa_bitmap_chunk_release (pa_bitmap_t *pfp, pa_fixed_atom_t *chunkp,
+			 uint32_t chunknum)
+{
+    pa_fixed_free_atom(pfp->pb_data, chunkp[chunknum]);
+    pa_mmap_touch(pfp->pb_data->pf_mmap, &chunkp[chunknum],
+		  sizeof(chunkp[chunknum]));
+    chunkp[chunknum] = pa_fixed_null_atom();
+}
+
+static void
+pa_bitmap_op (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src,
+	      pa_bitmap_op_t op)
+{
+    pa_fixed_atom_t *dchunkp = pa_bitmap_chunk_addr(pfp, dst);
+    pa_fixed_atom_t *schunkp = pa_bitmap_chunk_addr(pfp, src);
+    pa_bitunit_t *ddata, *sdata, any;
+    uint32_t chunknum, i;
+
+    if (dchunkp == NULL || schunkp == NULL)
+	return;			/* Should not occur */
+
+    for (chunknum = 0; chunknum < PA_BITMAP_CHUNK_SIZE; chunknum++) {
+	pa_fixed_atom_t datom = dchunkp[chunknum];
+	pa_fixed_atom_t satom = schunkp[chunknum];
+
+	if (pa_fixed_is_null(satom)) {
+	    /* Nothing in src: only "and" changes dst, clearing it */
+	    if (op == PBO_AND && !pa_fixed_is_null(datom))
+		pa_bitmap_chunk_release(pfp, dchunkp, chunknum);
+	    continue;
+	}
+
+	if (pa_fixed_is_null(datom)) {
+	    /* Nothing in dst: only "or" changes dst, by copying src */
+	    if (op != PBO_OR)
+		continue;
+
+	    datom = pa_fixed_alloc_atom(pfp->pb_data);
+	    if (pa_fixed_is_null(datom))
+		return;		/* Out of memory */
+	    pa_mmap_touch(pfp->pb_data->pf_mmap, &dchunkp[chunknum],
+			  sizeof(datom));
+	    dchunkp[chunknum] = datom;
+	}
+
+	ddata = pa_fixed_atom_addr(pfp->pb_data, datom);
+	sdata = pa_fixed_atom_addr(pfp->pb_data, satom);
+	if (ddata == NULL || sdata == NULL)
+	    return;		/* Should not occur */
+
+	pa_mmap_touch(pfp->pb_data->pf_mmap, ddata,
+		      PA_BITMAP_UNITS_PER_CHUNK * sizeof(*ddata));
+	any = 0;
+	switch (op) {
+	case PBO_OR:
+	    for (i = 0; i < PA_BITMAP_UNITS_PER_CHUNK; i++)
+		ddata[i] |= sdata[i];
+	    continue;		/* Can't become empty */
+
+	case PBO_AND:
+	    for (i = 0; i < PA_BITMAP_UNITS_PER_CHUNK; i++)
+		any |= (ddata[i] &= sdata[i]);
+	    break;
+
+	case PBO_ANDNOT:
+	    for (i = 0; i < PA_BITMAP_UNITS_PER_CHUNK; i++)
+		any |= (ddata[i] &= ~sdata[i]);
+	    break;
+	}
+
+	if (any == 0)
+	    pa_bitmap_chunk_release(pfp, dchunkp, chunknum);
+    }
+}
+
+void
+pa_bitmap_or (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src)
+{
+    pa_bitmap_op(pfp, dst, src, PBO_OR);
+}
+
+void
+pa_bitmap_and (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src)
+{
+    pa_bitmap_op(pfp, dst, src, PBO_AND);
+}
+
+void
+pa_bitmap_andnot (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src)
+{
+    pa_bitmap_op(pfp, dst, src, PBO_ANDNOT);
+}
+
+pa_bitnumber_t
+pa_bitmap_count (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id)
+{
+    pa_fixed_atom_t *chunkp = pa_bitmap_chunk_addr(pfp, bitmap_id);
+    pa_bitnumber_t count = 0;
+    uint32_t chunknum, wordnum;
+
+    if (chunkp == NULL)
+	return 0;		/* Should not occur */
+
+    for (chunknum = 0; chunknum < PA_BITMAP_CHUNK_SIZE; chunknum++) {
+	if (pa_fixed_is_null(chunkp[chunknum]))
+	    continue;
+
+	pa_bitunit_t *data = pa_fixed_atom_addr(pfp->pb_data,
+						chunkp[chunknum]);
+	if (data == NULL)
+	    continue;		/* Should not occur */
+
+	for (wordnum = 0; wordnum < PA_BITMAP_WORDS_PER_CHUNK; wordnum++)
+	    count += pa_bitmap_popcount64(pa_bitmap_word(data, wordnum));
+    }
+
+    return count;
+}
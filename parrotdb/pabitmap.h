@@ -143,7 +143,7 @@ pa_bitmap_test (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id, pa_bitnumber_t num)
     if (data == NULL)
 	return FALSE;		/* Should not occur */
 
-    return (data[unitnum] & (1 << bitnum)) ? TRUE : FALSE;
+    return (data[unitnum] & (1U << bitnum)) ? TRUE : FALSE;
 }
 
 static inline void
@@ -166,6 +166,7 @@ pa_bitmap_set (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id, pa_bitnumber_t num)
 	atom = pa_fixed_alloc_atom(pfp->pb_data);
 	if (pa_fixed_is_null(atom))
 	    return;
+	pa_mmap_touch(pfp->pb_data->pf_mmap, &chunkp[chunknum], sizeof(atom));
 	chunkp[chunknum] = atom; /* Save into the chunk table */
     }
 
@@ -173,7 +174,8 @@ pa_bitmap_set (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id, pa_bitnumber_t num)
     if (data == NULL)
 	return;		/* Should not occur */
 
-    data[unitnum] |= 1 << bitnum;
+    pa_mmap_touch(pfp->pb_data->pf_mmap, &data[unitnum], sizeof(*data));
+    data[unitnum] |= 1U << bitnum;
 }
 
 static inline void
@@ -198,29 +200,74 @@ pa_bitmap_clear (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id, pa_bitnumber_t num)
     if (data == NULL)
 	return;		/* Should not occur */
 
-    data[unitnum] &= ~(1 << bitnum);
+    pa_mmap_touch(pfp->pb_data->pf_mmap, &data[unitnum], sizeof(*data));
+    data[unitnum] &= ~(1U << bitnum);
+}
+
+/*
+ * Scanning works a 64-bit word at a time.  We build each word from a
+ * pair of units, so the bit numbering (and the data) is unchanged; on
+ * little-endian machines the compiler turns this into a single load.
+ */
+#define PA_BITMAP_BITS_PER_WORD	64
+#define PA_BITMAP_WORDS_PER_CHUNK \
+    (PA_BITMAP_BITS_PER_CHUNK / PA_BITMAP_BITS_PER_WORD)
+
+static inline uint64_t
+pa_bitmap_word (const pa_bitunit_t *data, uint32_t wordnum)
+{
+    return data[wordnum * 2] | ((uint64_t) data[wordnum * 2 + 1] << 32);
+}
+
+/*
+ * Count trailing zeros (for a non-zero value)
+ */
+static inline unsigned
+pa_bitmap_ctz64 (uint64_t value)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(value);
+#else /* __GNUC__ */
+    unsigned count = 0;
+
+    if ((value & 0xffffffffULL) == 0) {
+	count += 32;
+	value >>= 32;
+    }
+
+    return count + ffs((uint32_t) value) - 1;
+#endif /* __GNUC__ */
+}
+
+static inline unsigned
+pa_bitmap_popcount64 (uint64_t value)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(value);
+#else /* __GNUC__ */
+    value = value - ((value >> 1) & 0x5555555555555555ULL);
+    value = (value & 0x3333333333333333ULL)
+	+ ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (value * 0x0101010101010101ULL) >> 56;
+#endif /* __GNUC__ */
 }
 
 static inline pa_bitnumber_t
 pa_bitmap_find_next (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id,
 		     pa_bitnumber_t num)
 {
-    uint32_t bitnum, unitnum, chunknum, bitmask;
+    uint32_t chunknum, wordnum;
     pa_fixed_atom_t *chunkp, atom;
-    pa_bitunit_t *data, value;
+    pa_bitunit_t *data;
+    uint64_t value;
 
     if (num == PA_BITMAP_FIND_START) {
 	num = 0;
-	bitmask = 0;
     } else {
 	num += 1;			/* Start looking at the next bit */
-	if (num == PA_BITMAP_MAX_BIT)
+	if (num >= PA_BITMAP_MAX_BIT)
 	    return PA_BITMAP_FIND_DONE;
-
-	/* We need to discard all the lower bits*/
-	bitnum = pa_bitmap_bitnum(pfp, num);
-	bitmask = (1 << bitnum) - 1;
-
     }
 
     /* Fetch the bitmap's chunk table */
@@ -228,62 +275,72 @@ pa_bitmap_find_next (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id,
     if (chunkp == NULL)
 	return PA_BITMAP_FIND_DONE; /* Should not occur */
 
- restart:
-    chunknum = pa_bitmap_chunknum(pfp, num);
-
-    atom = chunkp[chunknum];
-    if (pa_fixed_is_null(atom)) {
+    for (chunknum = pa_bitmap_chunknum(pfp, num);
+	 chunknum < PA_BITMAP_CHUNK_SIZE;
+	 chunknum++, num = chunknum * PA_BITMAP_BITS_PER_CHUNK) {
 	/*
-	 * Since this chunk hasn't been allocated, we know that
-	 * no bits in this range have been set, so we can skip to
-	 * the next chunk.
+	 * If this chunk hasn't been allocated, we know that no bits
+	 * in this range have been set, so we can skip to the next chunk.
 	 */
-	while (++chunknum < PA_BITMAP_CHUNK_SIZE) {
-	    if (!pa_fixed_is_null(chunkp[chunknum])) {
-		num = chunknum * PA_BITMAP_BITS_PER_CHUNK;
-		goto restart;
-	    }
-	}
+	atom = chunkp[chunknum];
+	if (pa_fixed_is_null(atom))
+	    continue;
 
-	return PA_BITMAP_FIND_DONE; /* End of bits */
-    }
+	data = pa_fixed_atom_addr(pfp->pb_data, atom);
+	if (data == NULL)
+	    return PA_BITMAP_FIND_DONE; /* Should not occur */
 
-    data = pa_fixed_atom_addr(pfp->pb_data, atom);
-    if (data == NULL)
-	return PA_BITMAP_FIND_DONE; /* Should not occur */
+	/* Turn off all bits below the one we're starting at */
+	num &= PA_BITMAP_BITS_PER_CHUNK - 1;
+	wordnum = num / PA_BITMAP_BITS_PER_WORD;
+	value = pa_bitmap_word(data, wordnum);
+	value &= ~0ULL << (num & (PA_BITMAP_BITS_PER_WORD - 1));
 
-    bitnum = pa_bitmap_bitnum(pfp, num);
-    unitnum = pa_bitmap_unitnum(pfp, num);
-    value = data[unitnum];
-
-    /* Turn off all bits below the last one that we returned */
-    value &= ~bitmask;
-    bitmask = 0;		/* Don't repeat it next time thru */
-
-    if (value == 0) {	/* All zeros */
-	while (++unitnum < PA_BITMAP_UNITS_PER_CHUNK) {
-	    if (data[unitnum] != 0) {
-		num = (chunknum * PA_BITMAP_BITS_PER_CHUNK)
-		    + (unitnum * PA_BITMAP_BITS_PER_UNIT);
-		goto restart;
-	    }
-	}
+	for (;;) {
+	    if (value != 0)
+		return (chunknum * PA_BITMAP_BITS_PER_CHUNK)
+		    + (wordnum * PA_BITMAP_BITS_PER_WORD)
+		    + pa_bitmap_ctz64(value);
+
+	    if (++wordnum >= PA_BITMAP_WORDS_PER_CHUNK)
+		break;
 
-	/* Move to next chunk */
-	num = (chunknum + 1) * PA_BITMAP_BITS_PER_CHUNK;
-	goto restart;
+	    value = pa_bitmap_word(data, wordnum);
+	}
     }
 
-    /* Current unit has something set */
-    int found = ffs(value);
-    if (found <= 0)
-	return PA_BITMAP_FIND_DONE; /* Should not occur */
+    return PA_BITMAP_FIND_DONE; /* End of bits */
+}
 
-    found -= 1;			/* ffs() numbers bits from 1, not 0 */
+/*
+ * Bulk operations between two bitmaps (in the same pa_bitmap_t).
+ * These work a chunk at a time, skipping chunks that aren't
+ * allocated, and release chunks that become empty.
+ */
 
-    return (chunknum * PA_BITMAP_BITS_PER_CHUNK)
-	+ (unitnum * PA_BITMAP_BITS_PER_UNIT) + found;
-}
+/**
+ * dst |= src
+ */
+void
+pa_bitmap_or (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src);
+
+/**
+ * dst &= src
+ */
+void
+pa_bitmap_and (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src);
+
+/**
+ * dst &= ~src
+ */
+void
+pa_bitmap_andnot (pa_bitmap_t *pfp, pa_bitmap_id_t dst, pa_bitmap_id_t src);
+
+/**
+ * Return the number of bits set in a bitmap
+ */
+pa_bitnumber_t
+pa_bitmap_count (pa_bitmap_t *pfp, pa_bitmap_id_t bitmap_id);
 
 static inline pa_bitmap_t *
 pa_bitmap_open (pa_mmap_t *pmp, const char *name)
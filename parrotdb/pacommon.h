@@ -100,8 +100,9 @@ typedef uint8_t pa_boolean_t;	/* Simple boolean */
 #define PA_TYPE_OPAQUE		6 /* Opaque header (can't decode) */
 #define PA_TYPE_TREE		7 /* Tree (xi_tree_t) */
 #define PA_TYPE_BITMAP		8 /* Bitmap (pa_bitmap_t) */
+#define PA_TYPE_ISTR_HASH	9 /* Hash index for pa_istr_t */
 
-#define PA_TYPE_MAX		9
+#define PA_TYPE_MAX		10
 
 /*
  * A page number is the number of the page containing an atom,
@@ -150,6 +151,19 @@ pa_atom (void *base, void *cur, pa_shift_t shift)
     return delta >> shift;
 }
 
+/*
+ * Hint that we'll soon be reading the given address
+ */
+static inline void
+pa_prefetch (const void *addr)
+{
+#ifdef __GNUC__
+    __builtin_prefetch(addr, 0, 3);
+#else /* __GNUC__ */
+    (void) addr;
+#endif /* __GNUC__ */
+}
+
 /*
  * Cheesy breakpoint for memory allocation failure
  */
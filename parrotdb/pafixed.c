@@ -16,12 +16,33 @@
 #include <sys/types.h>
 #include <assert.h>
 #include <stddef.h>
+#include <sched.h>
 
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
 #include <parrotdb/pafixed.h>
 #include <libpsu/psualloc.h>
+#include <libpsu/psuthread.h>
+
+/*
+ * A magazine is a thread's private cache of atoms for one pa_fixed_t.
+ * Each thread has a short list of magazines, one per pa_fixed_t that
+ * it has used with magazines enabled.  Each pa_fixed_t also keeps a
+ * list of all its magazines (under pf_lock), so closing it can take
+ * back atoms from every thread.  A magazine that's been taken back
+ * has a NULL pfm_fixed, and is freed when its thread next walks its
+ * list.
+ */
+typedef struct pa_fixed_mag_s {
+    struct pa_fixed_mag_s *pfm_next; /* Next magazine for this thread */
+    struct pa_fixed_mag_s *pfm_peer; /* Next magazine for pfm_fixed */
+    pa_fixed_t *pfm_fixed;	/* pa_fixed_t that owns our atoms */
+    unsigned pfm_count;		/* Number of atoms in pfm_atoms */
+    pa_fixed_atom_t pfm_atoms[PA_FIXED_MAG_MAX]; /* Cached atoms */
+} pa_fixed_mag_t;
+
+static THREAD_LOCAL(pa_fixed_mag_t *) pa_fixed_mags;
 
 /*
  * Allocate the page to which the given atom belongs; mark them all free
@@ -104,9 +125,11 @@ pa_fixed_init (pa_mmap_t *pmp, pa_fixed_t *pfp, const char *name,
 	       pa_shift_t shift, uint16_t atom_size, uint32_t max_atoms)
 {
     /* Overload the value with config values */
-    shift = pa_config_value32(name, "shift", shift);
-    atom_size = pa_config_value32_min(name, "atom-size", atom_size);
-    max_atoms = pa_config_value32(name, "max-atoms", max_atoms);
+    if (name) {
+	shift = pa_config_value32(name, "shift", shift);
+	atom_size = pa_config_value32_min(name, "atom-size", atom_size);
+	max_atoms = pa_config_value32(name, "max-atoms", max_atoms);
+    }
 
     /* The atom must be able to hold a free node id */
     if (atom_size < sizeof(pa_atom_t))
@@ -118,8 +141,15 @@ pa_fixed_init (pa_mmap_t *pmp, pa_fixed_t *pfp, const char *name,
     /* Round max_atoms up to the next page size */
     max_atoms = pa_roundup_shift32(max_atoms, shift);
 
-    /* No base is NULL, allocate it, zero it and init the free list */
-    if (pfp->pf_base == NULL) {
+    /*
+     * If the info block already has a page table (we're reopening an
+     * existing mmap file), attach to it.  Otherwise allocate one,
+     * zero it and init the free list.
+     */
+    if (pfp->pf_base == NULL && !pa_mmap_is_null(pfp->pf_infop->pfi_base)) {
+	pfp->pf_base = pa_mmap_addr(pmp, pfp->pf_infop->pfi_base);
+
+    } else if (pfp->pf_base == NULL) {
 	size_t size = (max_atoms >> shift) * sizeof(uint8_t *);
 
 	pa_mmap_atom_t atom = pa_mmap_alloc(pmp, size);
@@ -137,10 +167,17 @@ pa_fixed_init (pa_mmap_t *pmp, pa_fixed_t *pfp, const char *name,
 	pfp->pf_free = pa_fixed_atom(1);
     }
 
-    /* Fill in the rest of fhe fields from the argument list */
-    pfp->pf_shift = shift;
-    pfp->pf_atom_size = atom_size;
-    pfp->pf_max_atoms = max_atoms;
+    /*
+     * Fill in the rest of fhe fields from the argument list.  A
+     * read-only reader can't store into the info block, so only
+     * touch fields that actually change.
+     */
+    if (pfp->pf_shift != shift)
+	pfp->pf_shift = shift;
+    if (pfp->pf_atom_size != atom_size)
+	pfp->pf_atom_size = atom_size;
+    if (pfp->pf_max_atoms != max_atoms)
+	pfp->pf_max_atoms = max_atoms;
     pfp->pf_mmap = pmp;
 }
 
@@ -151,8 +188,11 @@ pa_fixed_setup (pa_mmap_t *pmp, pa_fixed_info_t *pfip, const char *name,
     pa_fixed_t *pfp = psu_calloc(sizeof(*pfp));
 
     if (pfp) {
-	pfp->pf_infop = pfip;
+	/* Without a header, we keep the info block in-process */
+	pfp->pf_infop = pfip ?: &pfp->pf_info;
 	pa_fixed_init(pmp, pfp, name, shift, atom_size, max_atoms);
+	if (pfip)
+	    pfp->pf_counters = pa_mmap_counters(pmp, pfip);
     }
 
     return pfp;
@@ -175,8 +215,250 @@ pa_fixed_open (pa_mmap_t *pmp, const char *name, pa_shift_t shift,
     return pa_fixed_setup(pmp, pfip, name, shift, atom_size, max_atoms);
 }
 
+static inline void
+pa_fixed_lock (pa_fixed_t *pfp)
+{
+    while (__atomic_exchange_n(&pfp->pf_lock, 1, __ATOMIC_ACQUIRE))
+	sched_yield();
+}
+
+static inline void
+pa_fixed_unlock (pa_fixed_t *pfp)
+{
+    __atomic_store_n(&pfp->pf_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find this thread's magazine for pfp, making one if needed.  The
+ * magazine we used last is kept at the head of the list.  Magazines
+ * that a pa_fixed_close() has taken back are freed as we pass them.
+ */
+static pa_fixed_mag_t *
+pa_fixed_mag_find (pa_fixed_t *pfp, psu_boolean_t create)
+{
+    pa_fixed_mag_t *pfmp, **lastp = &pa_fixed_mags;
+    pa_fixed_t *owner;
+
+    for (pfmp = *lastp; pfmp; pfmp = *lastp) {
+	owner = __atomic_load_n(&pfmp->pfm_fixed, __ATOMIC_ACQUIRE);
+	if (owner == NULL) {
+	    *lastp = pfmp->pfm_next;
+	    psu_free(pfmp);
+	    continue;
+	}
+
+	if (owner == pfp) {
+	    if (lastp != &pa_fixed_mags) {
+		*lastp = pfmp->pfm_next;
+		pfmp->pfm_next = pa_fixed_mags;
+		pa_fixed_mags = pfmp;
+	    }
+	    return pfmp;
+	}
+
+	lastp = &pfmp->pfm_next;
+    }
+
+    if (!create)
+	return NULL;
+
+    pfmp = psu_calloc(sizeof(*pfmp));
+    if (pfmp) {
+	pfmp->pfm_fixed = pfp;
+	pfmp->pfm_next = pa_fixed_mags;
+	pa_fixed_mags = pfmp;
+
+	pa_fixed_lock(pfp);
+	pfmp->pfm_peer = pfp->pf_mags;
+	pfp->pf_mags = pfmp;
+	pa_fixed_unlock(pfp);
+    }
+
+    return pfmp;
+}
+
+pa_fixed_atom_t
+pa_fixed_mag_alloc (pa_fixed_t *pfp)
+{
+    pa_fixed_mag_t *pfmp = pa_fixed_mag_find(pfp, TRUE);
+    pa_fixed_atom_t atom;
+
+    if (pfmp == NULL) {
+	pa_fixed_lock(pfp);
+	atom = pa_fixed_alloc_atom_list(pfp);
+	pa_fixed_unlock(pfp);
+	return atom;
+    }
+
+    if (pfmp->pfm_count == 0) {
+	/* Refill half the magazine from the shared free list */
+	unsigned want = (pfp->pf_mag_size + 1) / 2;
+
+	pa_fixed_lock(pfp);
+	while (pfmp->pfm_count < want) {
+	    atom = pa_fixed_alloc_atom_list(pfp);
+	    if (pa_fixed_is_null(atom))
+		break;
+	    pfmp->pfm_atoms[pfmp->pfm_count++] = atom;
+	}
+	pa_fixed_unlock(pfp);
+
+	if (pfmp->pfm_count == 0)
+	    return pa_fixed_null_atom();
+
+	/*
+	 * We hand out atoms from the top of the magazine, so reverse
+	 * them to keep the order of the free list.
+	 */
+	unsigned i, j;
+	for (i = 0, j = pfmp->pfm_count - 1; i < j; i++, j--) {
+	    atom = pfmp->pfm_atoms[i];
+	    pfmp->pfm_atoms[i] = pfmp->pfm_atoms[j];
+	    pfmp->pfm_atoms[j] = atom;
+	}
+    }
+
+    /* pa_fixed_alloc_atom_list() and pa_fixed_mag_free() zero atoms */
+    atom = pfmp->pfm_atoms[--pfmp->pfm_count];
+
+    /* The atom may have been cached in an earlier transaction */
+    pa_mmap_touch(pfp->pf_mmap, pa_fixed_atom_addr(pfp, atom),
+		  pfp->pf_atom_size);
+
+    return atom;
+}
+
+void
+pa_fixed_mag_free (pa_fixed_t *pfp, pa_fixed_atom_t atom)
+{
+    if (pa_fixed_is_null(atom))
+	return;
+
+    pa_fixed_mag_t *pfmp = pa_fixed_mag_find(pfp, TRUE);
+    if (pfmp == NULL) {
+	pa_fixed_lock(pfp);
+	pa_fixed_free_atom_list(pfp, atom);
+	pa_fixed_unlock(pfp);
+	return;
+    }
+
+    if (pfmp->pfm_count >= pfp->pf_mag_size) {
+	/* Flush the older half of the magazine */
+	unsigned i, half = pfmp->pfm_count / 2;
+
+	pa_fixed_lock(pfp);
+	for (i = 0; i < half; i++)
+	    pa_fixed_free_atom_list(pfp, pfmp->pfm_atoms[i]);
+	pa_fixed_unlock(pfp);
+
+	pfmp->pfm_count -= half;
+	memmove(&pfmp->pfm_atoms[0], &pfmp->pfm_atoms[half],
+		pfmp->pfm_count * sizeof(pfmp->pfm_atoms[0]));
+    }
+
+    /* Zero now, since we return it directly from the magazine */
+    if (pfp->pf_flags & PFF_INIT_ZERO) {
+	void *addr = pa_fixed_atom_addr(pfp, atom);
+	if (addr) {
+	    pa_mmap_touch(pfp->pf_mmap, addr, pfp->pf_atom_size);
+	    bzero(addr, pfp->pf_atom_size);
+	}
+    }
+
+    pfmp->pfm_atoms[pfmp->pfm_count++] = atom;
+}
+
+void
+pa_fixed_mag_flush (pa_fixed_t *pfp)
+{
+    pa_fixed_mag_t *pfmp = pa_fixed_mag_find(pfp, FALSE);
+    pa_fixed_mag_t **lastp;
+
+    if (pfmp == NULL)
+	return;
+
+    pa_fixed_lock(pfp);
+    while (pfmp->pfm_count > 0)
+	pa_fixed_free_atom_list(pfp, pfmp->pfm_atoms[--pfmp->pfm_count]);
+
+    for (lastp = &pfp->pf_mags; *lastp; lastp = &(*lastp)->pfm_peer) {
+	if (*lastp == pfmp) {
+	    *lastp = pfmp->pfm_peer;
+	    break;
+	}
+    }
+    pa_fixed_unlock(pfp);
+
+    /* pa_fixed_mag_find moved our magazine to the head of the list */
+    pa_fixed_mags = pfmp->pfm_next;
+    psu_free(pfmp);
+}
+
+/*
+ * Take back the atoms in every thread's magazine for pfp.  The other
+ * threads must have stopped using pfp; their magazines are left on
+ * their lists with a NULL pfm_fixed, for pa_fixed_mag_find to free.
+ */
+static void
+pa_fixed_mag_detach (pa_fixed_t *pfp)
+{
+    pa_fixed_mag_t *pfmp;
+
+    pa_fixed_mag_flush(pfp);
+
+    pa_fixed_lock(pfp);
+    while ((pfmp = pfp->pf_mags) != NULL) {
+	pfp->pf_mags = pfmp->pfm_peer;
+
+	while (pfmp->pfm_count > 0)
+	    pa_fixed_free_atom_list(pfp, pfmp->pfm_atoms[--pfmp->pfm_count]);
+
+	pfmp->pfm_peer = NULL;
+	__atomic_store_n(&pfmp->pfm_fixed, NULL, __ATOMIC_RELEASE);
+    }
+    pa_fixed_unlock(pfp);
+}
+
+void
+pa_fixed_mag_enable (pa_fixed_t *pfp, unsigned size)
+{
+    if (size > PA_FIXED_MAG_MAX)
+	size = PA_FIXED_MAG_MAX;
+
+    if (size == 0)
+	pa_fixed_mag_detach(pfp);
+
+    pfp->pf_mag_size = size;
+}
+
 void
 pa_fixed_close (pa_fixed_t *pfp)
 {
+    pa_fixed_mag_detach(pfp);
+    psu_free(pfp);
+}
+
+void
+pa_fixed_release (pa_fixed_t *pfp)
+{
+    if (pfp == NULL)
+	return;
+
+    pa_fixed_mag_detach(pfp);
+
+    if (pfp->pf_base) {
+	pa_page_t page, max_page = pfp->pf_max_atoms >> pfp->pf_shift;
+	unsigned size = (1 << pfp->pf_shift) * pfp->pf_atom_size;
+
+	for (page = 0; page < max_page; page++)
+	    if (!pa_mmap_is_null(pfp->pf_base[page]))
+		pa_mmap_free(pfp->pf_mmap, pfp->pf_base[page], size);
+
+	pa_mmap_free(pfp->pf_mmap, pfp->pf_infop->pfi_base,
+		     max_page * sizeof(uint8_t *));
+	pfp->pf_infop->pfi_base = pa_mmap_null_atom();
+	pfp->pf_base = NULL;
+    }
+
     psu_free(pfp);
 }
@@ -65,8 +65,24 @@ typedef struct pa_fixed_s {
     pa_mmap_t *pf_mmap;		   /* Mmap overhead declarations */
     pa_fixed_info_t *pf_infop;	   /* Pointer to real block */
     pa_mmap_atom_t *pf_base;	   /* Pointer to base of page table */
+    unsigned pf_mag_size;	   /* Per-thread magazine size (or 0) */
+    uint32_t pf_lock;		   /* Guards pf_free when using magazines */
+    struct pa_fixed_mag_s *pf_mags; /* Every thread's magazine (pf_lock) */
+    pa_mmap_counters_t *pf_counters; /* Counters for our header (or NULL) */
+    pa_fixed_info_t pf_info;	   /* Our info block, if we're headerless */
 } pa_fixed_t;
 
+/*
+ * When multiple threads allocate from the same pa_fixed_t, each
+ * thread can keep a "magazine" of atoms that it has claimed from
+ * the shared free list.  Allocations and frees work on the magazine,
+ * which is refilled or flushed in batches of half its size, so the
+ * (locked) shared free list is touched only once per batch.  New
+ * pages come from pa_mmap_alloc() while holding that lock, so other
+ * threads must not use the same pa_mmap_t without their own locking.
+ */
+#define PA_FIXED_MAG_MAX	256 /* Largest magazine size */
+
 /* Simplification macros, so we don't need to think about pf_infop */
 #define pf_shift	pf_infop->pfi_shift
 #define pf_atom_size	pf_infop->pfi_atom_size
@@ -97,6 +113,7 @@ static inline void
 pa_fixed_page_set (pa_fixed_t *pfp, pa_page_t page,
 		   pa_mmap_atom_t matom, void *addr UNUSED)
 {
+    pa_mmap_touch(pfp->pf_mmap, &pfp->pf_base[page], sizeof(matom));
     pfp->pf_base[page] = matom;
 }
 
@@ -146,10 +163,11 @@ void
 pa_fixed_element_setup_page (pa_fixed_t *pfp, pa_fixed_atom_t atom);
 
 /*
- * Allocate a new atom, returning the atom number
+ * Allocate a new atom from the shared free list, returning the atom
+ * number.  Callers using magazines must hold pf_lock.
  */
 static inline pa_fixed_atom_t
-pa_fixed_alloc_atom (pa_fixed_t *pfp)
+pa_fixed_alloc_atom_list (pa_fixed_t *pfp)
 {
     if (pfp->pf_base == NULL)
 	return pa_fixed_null_atom();
@@ -182,6 +200,9 @@ pa_fixed_alloc_atom (pa_fixed_t *pfp)
 	return pa_fixed_null_atom();
     }
 
+    /* The caller is about to fill in the atom */
+    pa_mmap_touch(pfp->pf_mmap, addr, pfp->pf_atom_size);
+
     /* Fetch the next free atom, which is stored at the start of this atom */
     pfp->pf_free = *(pa_fixed_atom_t *) addr;
 
@@ -232,10 +253,11 @@ pa_fixed_element_if_exists (pa_fixed_t *pfp, uint32_t num)
 }
 
 /*
- * Put a fixed atom on our free list
+ * Put a fixed atom on our shared free list.  Callers using magazines
+ * must hold pf_lock.
  */
 static inline void
-pa_fixed_free_atom (pa_fixed_t *pfp, pa_fixed_atom_t atom)
+pa_fixed_free_atom_list (pa_fixed_t *pfp, pa_fixed_atom_t atom)
 {
     if (pa_fixed_is_null(atom))
 	return;
@@ -246,10 +268,65 @@ pa_fixed_free_atom (pa_fixed_t *pfp, pa_fixed_atom_t atom)
 	return;
 
     /* Add the atom to the front of the free list */
+    pa_mmap_touch(pfp->pf_mmap, addr, sizeof(*addr));
     *addr = pfp->pf_free;
     pfp->pf_free = atom;
 }
 
+pa_fixed_atom_t
+pa_fixed_mag_alloc (pa_fixed_t *pfp);
+
+void
+pa_fixed_mag_free (pa_fixed_t *pfp, pa_fixed_atom_t atom);
+
+/*
+ * Allocate a new atom, returning the atom number
+ */
+static inline pa_fixed_atom_t
+pa_fixed_alloc_atom (pa_fixed_t *pfp)
+{
+    if (pfp->pf_counters)
+	pa_mmap_count(&pfp->pf_counters->pmc_allocs, pfp->pf_mag_size != 0);
+
+    if (pfp->pf_mag_size)
+	return pa_fixed_mag_alloc(pfp);
+
+    return pa_fixed_alloc_atom_list(pfp);
+}
+
+/*
+ * Put a fixed atom on our free list
+ */
+static inline void
+pa_fixed_free_atom (pa_fixed_t *pfp, pa_fixed_atom_t atom)
+{
+    if (pfp->pf_counters)
+	pa_mmap_count(&pfp->pf_counters->pmc_frees, pfp->pf_mag_size != 0);
+
+    if (pfp->pf_mag_size)
+	pa_fixed_mag_free(pfp, atom);
+    else
+	pa_fixed_free_atom_list(pfp, atom);
+}
+
+/*
+ * Turn on per-thread magazines of the given size (zero to disable).
+ * This must be done before any other threads use the pa_fixed_t.
+ * Disabling takes back the atoms in every thread's magazine.
+ */
+void
+pa_fixed_mag_enable (pa_fixed_t *pfp, unsigned size);
+
+/*
+ * Return the calling thread's magazine atoms to the shared free list.
+ * Each thread should call this before it exits or stops using pfp.
+ * pa_fixed_close() and pa_fixed_release() take back the atoms in
+ * any magazines left behind, but other threads must have stopped
+ * using pfp by then.
+ */
+void
+pa_fixed_mag_flush (pa_fixed_t *pfp);
+
 void
 pa_fixed_init_from_block (pa_fixed_t *pfp, void *base,
 			  pa_fixed_info_t *infop);
@@ -269,6 +346,14 @@ pa_fixed_open (pa_mmap_t *pmp, const char *name, pa_shift_t shift,
 void
 pa_fixed_close (pa_fixed_t *pfp);
 
+/*
+ * Close the fixed pool and hand all its pages (and the page table)
+ * back to the mmap segment.  Only meaningful for headerless pools
+ * (opened with a NULL name), since nothing else can find them again.
+ */
+void
+pa_fixed_release (pa_fixed_t *pfp);
+
 static inline void
 pa_fixed_set_flags (pa_fixed_t *pfp, pa_fixed_flags_t flags)
 {
@@ -35,8 +35,32 @@
  * just need a single page.  Either way, we allocate a number of
  * pages, record the leftovers, and return the first atom.
  */
-pa_istr_atom_t
-pa_istr_nstring_alloc (pa_istr_t *pip, const char *string, size_t len)
+/*
+ * Return the number of bytes allocated for a data page whose first
+ * string is 'len' bytes long.  Long strings get their own pages,
+ * rounded up to the page size.
+ */
+static size_t
+pa_istr_page_size (pa_istr_t *pip, size_t len)
+{
+    pa_atom_t count = 1 << pip->pi_shift; /* Atoms per page */
+    size_t bytes_per_page = count << pip->pi_atom_shift;
+
+    size_t size = pa_roundup32(len + 1, bytes_per_page);
+
+    /* Make sure we're a full page for the underlaying allocator */
+    if (pip->pi_shift > PA_MMAP_ATOM_SHIFT)
+	size = pa_roundup_shift32(size, PA_MMAP_ATOM_SHIFT);
+
+    return size;
+}
+
+/*
+ * Allocate a new data page, store the string at the start of it, and
+ * use any remaining space for future strings.
+ */
+static pa_istr_data_atom_t
+pa_istr_data_alloc (pa_istr_t *pip, const char *string, size_t len)
 {
     unsigned max_page = pip->pi_max_atoms >> pip->pi_shift;
     unsigned slot;
@@ -45,25 +69,21 @@ pa_istr_nstring_alloc (pa_istr_t *pip, const char *string, size_t len)
 	    break;
 
     if (slot >= max_page)	/* If we're out of slots, we're done */
-	return pa_istr_null_atom();
+	return pa_istr_data_null_atom();
 
     unsigned len_atoms = pa_items_shift32(len + 1, pip->pi_atom_shift);
 
     pa_atom_t count = 1 << pip->pi_shift; /* Atoms per page */
     size_t bytes_per_page = count << pip->pi_atom_shift;
 
-    size_t size = pa_roundup32(len + 1, bytes_per_page);
-
-    /* Make sure we're a full page for the underlaying allocator */
-    if (pip->pi_shift > PA_MMAP_ATOM_SHIFT)
-	size = pa_roundup_shift32(size, PA_MMAP_ATOM_SHIFT);
+    size_t size = pa_istr_page_size(pip, len);
 
     /* Number of atoms needed to cover the allocation */
     unsigned num_atoms = size >> pip->pi_atom_shift;
 
     pa_mmap_atom_t matom = pa_mmap_alloc(pip->pi_mmap, size);
     if (pa_mmap_is_null(matom))
-	return pa_istr_null_atom();
+	return pa_istr_data_null_atom();
 
     /* Fill in the page table */
     pa_istr_page_set(pip, slot, matom);
@@ -83,6 +103,16 @@ pa_istr_nstring_alloc (pa_istr_t *pip, const char *string, size_t len)
 	data[len] = '\0';
     }
 
+    return atom;
+}
+
+pa_istr_atom_t
+pa_istr_nstring_alloc (pa_istr_t *pip, const char *string, size_t len)
+{
+    pa_istr_data_atom_t atom = pa_istr_data_alloc(pip, string, len);
+    if (pa_istr_data_is_null(atom))
+	return pa_istr_null_atom();
+
     return pa_istr_atom_to_index(pip, atom);
 }
 
@@ -109,8 +139,11 @@ pa_istr_init (pa_mmap_t *pmp, pa_istr_t *pip, const char *name,
     /* Round max_atoms up to the next page size */
     max_atoms = pa_roundup_shift32(max_atoms, shift);
 
-    /* No base is NULL, allocate it, zero it and init the free list */
-    if (pip->pi_base == NULL) {
+    /* Attach to an existing page table, or allocate and zero one */
+    if (pip->pi_base == NULL && !pa_mmap_is_null(pip->pi_datap->pid_base)) {
+	pip->pi_base = pa_mmap_addr(pmp, pip->pi_datap->pid_base);
+
+    } else if (pip->pi_base == NULL) {
 	size_t size = (max_atoms >> shift) * sizeof(uint8_t *);
 
 	pa_mmap_atom_t atom = pa_mmap_alloc(pmp, size);
@@ -179,6 +212,357 @@ pa_istr_open (pa_mmap_t *pmp, const char *name, pa_shift_t shift,
     return pa_istr_setup(pmp, piip, name, shift, atom_shift, max_atoms);
 }
 
+static inline pa_istr_hash_slot_t *
+pa_istr_hash_table (pa_istr_t *pip)
+{
+    return pa_mmap_addr(pip->pi_mmap, pip->pi_hashp->pihi_table);
+}
+
+/*
+ * Put an atom into an empty slot in the given table.  The table is
+ * never full, since we grow it well before that can happen.
+ */
+static void
+pa_istr_hash_insert (pa_istr_t *pip, pa_istr_hash_slot_t *table,
+		     uint32_t mask, uint32_t hash, pa_istr_atom_t atom)
+{
+    uint32_t i;
+
+    for (i = hash & mask; !pa_istr_is_null(table[i].pihs_atom);
+	 i = (i + 1) & mask)
+	continue;
+
+    pa_mmap_touch(pip->pi_mmap, &table[i], sizeof(table[i]));
+    table[i].pihs_hash = hash;
+    table[i].pihs_atom = atom;
+}
+
+/*
+ * Allocate a new table of (1 << shift) slots and move our existing
+ * entries into it.  The stored hash values mean we never need to look
+ * at the strings themselves.
+ */
+static psu_boolean_t
+pa_istr_hash_resize (pa_istr_t *pip, pa_shift_t shift)
+{
+    pa_istr_hash_info_t *pihp = pip->pi_hashp;
+    size_t size = ((size_t) 1 << shift) * sizeof(pa_istr_hash_slot_t);
+
+    pa_mmap_atom_t matom = pa_mmap_alloc(pip->pi_mmap, size);
+    pa_istr_hash_slot_t *table = pa_mmap_addr(pip->pi_mmap, matom);
+    if (table == NULL)
+	return FALSE;
+
+    bzero(table, size);
+
+    pa_istr_hash_slot_t *old = pa_istr_hash_table(pip);
+    if (old) {
+	uint32_t i, count = 1U << pihp->pihi_shift;
+	uint32_t mask = (1U << shift) - 1;
+
+	/* Strings freed since the last resize are dropped here */
+	pihp->pihi_count = 0;
+	for (i = 0; i < count; i++) {
+	    if (pa_istr_is_null(old[i].pihs_atom)
+		    || pa_istr_atom_string(pip, old[i].pihs_atom) == NULL)
+		continue;
+
+	    pa_istr_hash_insert(pip, table, mask, old[i].pihs_hash,
+				old[i].pihs_atom);
+	    pihp->pihi_count += 1;
+	}
+
+	pa_mmap_free(pip->pi_mmap, pihp->pihi_table,
+		     count * sizeof(pa_istr_hash_slot_t));
+    }
+
+    pihp->pihi_table = matom;
+    pihp->pihi_shift = shift;
+    return TRUE;
+}
+
+psu_boolean_t
+pa_istr_hash_open (pa_istr_t *pip, const char *name, pa_shift_t shift)
+{
+    pa_istr_hash_info_t *pihp;
+
+    pihp = pa_mmap_header(pip->pi_mmap, name, PA_TYPE_ISTR_HASH, 0,
+			  sizeof(*pihp));
+    if (pihp == NULL) {
+	pa_warning(0, "pa_istr hash header not found: %s", name);
+	return FALSE;
+    }
+
+    pip->pi_hashp = pihp;
+
+    /* An existing table is simply reused */
+    if (!pa_mmap_is_null(pihp->pihi_table))
+	return TRUE;
+
+    shift = pa_config_value32(name, "shift",
+			      shift ?: PA_ISTR_HASH_SHIFT_MIN);
+    if (shift < PA_ISTR_HASH_SHIFT_MIN)
+	shift = PA_ISTR_HASH_SHIFT_MIN;
+    else if (shift > PA_ISTR_HASH_SHIFT_MAX)
+	shift = PA_ISTR_HASH_SHIFT_MAX;
+
+    pihp->pihi_count = 0;
+    if (!pa_istr_hash_resize(pip, shift)) {
+	pip->pi_hashp = NULL;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+pa_istr_atom_t
+pa_istr_hash_find (pa_istr_t *pip, const char *string, size_t len)
+{
+    if (string == NULL)
+	return pa_istr_null_atom();
+
+    /* Short strings have fixed atoms and never appear in the table */
+    if (len <= 1)
+	return pa_istr_atom(pa_short_string_atom(string));
+
+    if (pip->pi_hashp == NULL)
+	return pa_istr_null_atom();
+
+    pa_istr_hash_slot_t *table = pa_istr_hash_table(pip);
+    if (table == NULL)
+	return pa_istr_null_atom();
+
+    uint32_t hash = pa_istr_hash_value(string, len);
+    uint32_t mask = (1U << pip->pi_hashp->pihi_shift) - 1;
+    uint32_t i;
+
+    for (i = hash & mask; !pa_istr_is_null(table[i].pihs_atom);
+	 i = (i + 1) & mask) {
+	if (table[i].pihs_hash != hash)
+	    continue;
+
+	const char *cp = pa_istr_atom_string(pip, table[i].pihs_atom);
+	if (cp && memcmp(cp, string, len) == 0 && cp[len] == '\0')
+	    return table[i].pihs_atom;
+    }
+
+    return pa_istr_null_atom();
+}
+
+psu_boolean_t
+pa_istr_hash_add (pa_istr_t *pip, pa_istr_atom_t atom)
+{
+    pa_istr_hash_info_t *pihp = pip->pi_hashp;
+
+    if (pihp == NULL || pa_istr_is_null(atom))
+	return FALSE;
+
+    if (pa_istr_atom_of(atom) < PA_SHORT_STRINGS_MAX)
+	return TRUE;		/* Short strings don't need the table */
+
+    const char *string = pa_istr_atom_string(pip, atom);
+    if (string == NULL)
+	return FALSE;
+
+    /* Keep the load factor under 3/4 */
+    uint32_t slots = 1U << pihp->pihi_shift;
+    if ((pihp->pihi_count + 1) * 4 > slots * 3) {
+	if (pihp->pihi_shift >= PA_ISTR_HASH_SHIFT_MAX
+		|| !pa_istr_hash_resize(pip, pihp->pihi_shift + 1)) {
+	    pa_warning(0, "pa_istr hash index full");
+	    return FALSE;
+	}
+    }
+
+    pa_istr_hash_slot_t *table = pa_istr_hash_table(pip);
+    if (table == NULL)
+	return FALSE;
+
+    pa_istr_hash_insert(pip, table, (1U << pihp->pihi_shift) - 1,
+			pa_istr_hash_value(string, strlen(string)), atom);
+    pihp->pihi_count += 1;
+
+    return TRUE;
+}
+
+void
+pa_istr_free (pa_istr_t *pip, pa_istr_atom_t iatom)
+{
+    if (pa_istr_is_null(iatom) || iatom.pia_atom < PA_SHORT_STRINGS_MAX)
+	return;
+
+    pa_fixed_atom_t fa = pa_istr_to_fixed(iatom);
+    fa.pfa_atom -= PA_SHORT_STRINGS_MAX; /* Skip over short strings */
+
+    pa_istr_data_atom_t *ap = pa_fixed_atom_addr(pip->pi_index, fa);
+    if (ap) {
+	pa_mmap_touch(pip->pi_mmap, ap, sizeof(*ap));
+	*ap = pa_istr_data_null_atom();
+    }
+
+    if (pip->pi_index->pf_counters)
+	pip->pi_index->pf_counters->pmc_frees += 1;
+}
+
+/*
+ * Return the address of the index entry for the given fixed atom,
+ * if the string it refers to is still live.
+ */
+static pa_istr_data_atom_t *
+pa_istr_index_entry (pa_istr_t *pip, pa_atom_t raw)
+{
+    pa_istr_data_atom_t *ap;
+
+    ap = pa_fixed_atom_addr(pip->pi_index, pa_fixed_atom(raw));
+    if (ap == NULL || pa_istr_data_is_null(*ap))
+	return NULL;
+
+    return ap;
+}
+
+/*
+ * Copy a string into the current data page (or a new one), as
+ * pa_istr_nstring() does, but without making a new index entry.
+ */
+static pa_istr_data_atom_t
+pa_istr_data_copy (pa_istr_t *pip, const char *string, size_t len)
+{
+    unsigned num_atoms = pa_items_shift32(len + 1, pip->pi_atom_shift);
+    if (num_atoms > pip->pi_left)
+	return pa_istr_data_alloc(pip, string, len);
+
+    pip->pi_left -= num_atoms;
+
+    pa_istr_data_atom_t atom = pip->pi_free;
+    atom.pida_atom += pip->pi_left;
+
+    char *data = pa_istr_data_atom_addr(pip, atom);
+    if (data) {
+	pa_mmap_touch(pip->pi_mmap, data, len + 1);
+	memcpy(data, string, len);
+	data[len] = '\0';
+    }
+
+    return atom;
+}
+
+unsigned
+pa_istr_compact (pa_istr_t *pip, unsigned max_pages)
+{
+    unsigned max_page = pip->pi_max_atoms >> pip->pi_shift;
+    pa_atom_t max_index;
+    pa_atom_t raw;
+    unsigned slot, moving = 0, freed = 0;
+    pa_istr_data_atom_t *ap;
+
+    if (pip->pi_base == NULL)
+	return 0;
+
+    /*
+     * Index entries are handed out in order and never recycled, so
+     * every entry below the index's free atom has been handed out.
+     */
+    pa_fixed_t *pfp = pip->pi_index;
+    max_index = pa_fixed_is_null(pfp->pf_free) ? pfp->pf_max_atoms
+	: pa_fixed_atom_of(pfp->pf_free);
+
+    /* Per-page counts of live atoms, and the sizes of the pages */
+    pa_atom_t *live = psu_calloc(max_page * sizeof(*live));
+    size_t *sizes = psu_calloc(max_page * sizeof(*sizes));
+    if (live == NULL || sizes == NULL) {
+	psu_free(live);
+	psu_free(sizes);
+	return 0;
+    }
+
+    /* Count the live data on each page */
+    for (raw = 1; raw < max_index; raw++) {
+	ap = pa_istr_index_entry(pip, raw);
+	if (ap == NULL)
+	    continue;
+
+	const char *cp = pa_istr_data_atom_addr(pip, *ap);
+	if (cp)
+	    live[pa_istr_data_atom_of(*ap) >> pip->pi_shift]
+		+= pa_items_shift32(strlen(cp) + 1, pip->pi_atom_shift);
+    }
+
+    /* The page we're currently filling is never a victim */
+    unsigned fill = (pip->pi_left && !pa_istr_data_is_null(pip->pi_free))
+	? pa_istr_data_atom_of(pip->pi_free) >> pip->pi_shift : 0;
+
+    /*
+     * Pick the victims: empty pages, and pages that are at most half
+     * full.  The first string on a page tells us the page's size.
+     * sizes[slot] is non-zero for each victim.
+     */
+    for (slot = 1; slot < max_page; slot++) {
+	const char *start = pa_istr_page_get(pip, slot);
+	if (start == NULL || slot == fill)
+	    continue;
+
+	size_t size = pa_istr_page_size(pip, strlen(start));
+	if (live[slot] != 0) {
+	    if (live[slot] * 2 > (size >> pip->pi_atom_shift))
+		continue;
+	    if (max_pages && moving >= max_pages)
+		continue;
+	    moving += 1;
+	}
+
+	sizes[slot] = size;
+    }
+
+    /*
+     * Move the live strings off the victims.  The index turns istr
+     * atoms into data atoms, so it's our forwarding table: callers
+     * keep their istr atoms, but must not hold string pointers across
+     * a compaction.
+     */
+    if (moving) {
+	for (raw = 1; raw < max_index; raw++) {
+	    ap = pa_istr_index_entry(pip, raw);
+	    if (ap == NULL)
+		continue;
+
+	    slot = pa_istr_data_atom_of(*ap) >> pip->pi_shift;
+	    if (sizes[slot] == 0 || live[slot] == 0)
+		continue;
+
+	    const char *cp = pa_istr_data_atom_addr(pip, *ap);
+	    if (cp == NULL)
+		continue;
+
+	    pa_istr_data_atom_t atom = pa_istr_data_copy(pip, cp, strlen(cp));
+	    if (pa_istr_data_is_null(atom)) {
+		pa_warning(0, "pa_istr compaction ran out of space");
+		break;
+	    }
+
+	    pa_mmap_touch(pip->pi_mmap, ap, sizeof(*ap));
+	    *ap = atom;
+	}
+    }
+
+    /* Give the victims back, unless we failed to empty them */
+    for (slot = 1; slot < max_page; slot++) {
+	if (sizes[slot] == 0)
+	    continue;
+
+	if (raw < max_index && live[slot] != 0)
+	    continue;
+
+	pa_mmap_free(pip->pi_mmap, pip->pi_base[slot], sizes[slot]);
+	pa_istr_page_set(pip, slot, pa_mmap_null_atom());
+	freed += 1;
+    }
+
+    psu_free(live);
+    psu_free(sizes);
+
+    return freed;
+}
+
 void
 pa_istr_close (pa_istr_t *pip)
 {
@@ -201,6 +585,11 @@ pa_istr_dump (pa_istr_t *pip, psu_boolean_t full UNUSED)
 	    pa_istr_data_atom_of(pidp->pid_free), pidp->pid_left,
 	    pa_mmap_atom_of(pidp->pid_base));
 
+    if (pip->pi_hashp)
+	psu_log("hash: shift %u, count %u, table-atom %#x",
+		pip->pi_hashp->pihi_shift, pip->pi_hashp->pihi_count,
+		pa_mmap_atom_of(pip->pi_hashp->pihi_table));
+
     psu_log("end pa_istr dump of %p", pidp);
 }
 
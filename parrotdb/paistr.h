@@ -72,12 +72,35 @@ typedef struct pa_istr_info_s {
     pa_istr_data_info_t pii_data; /* String data */
 } pa_istr_info_t;
 
+/*
+ * The optional hash index is an open-addressing (linear probe) table
+ * of istr atoms, kept in its own mmap allocation and described by a
+ * named header that lives next to the istr's header.  Each slot
+ * records the full hash value, so most probes never touch string
+ * data.  An atom of zero marks an empty slot.
+ */
+typedef struct pa_istr_hash_slot_s {
+    uint32_t pihs_hash;		/* Full hash value of the string */
+    pa_istr_atom_t pihs_atom;	/* Atom of the string (or null) */
+} pa_istr_hash_slot_t;
+
+typedef struct pa_istr_hash_info_s {
+    pa_mmap_atom_t pihi_table;	/* Slot table (in mmap atoms) */
+    pa_shift_t pihi_shift;	/* Log2 of the number of slots */
+    uint8_t pihi_padding[3];	/* Padding this by hand */
+    uint32_t pihi_count;	/* Number of slots in use */
+} pa_istr_hash_info_t;
+
+#define PA_ISTR_HASH_SHIFT_MIN	8 /* Smallest table we'll build */
+#define PA_ISTR_HASH_SHIFT_MAX	28 /* Largest table we'll build */
+
 typedef struct pa_istr_s {
     pa_mmap_t *pi_mmap;		   /* Mmap pointer */
     pa_istr_info_t *pi_infop;	   /* Pointer to header */
     pa_istr_data_info_t *pi_datap; /* Data header (for pii_data) */
     pa_fixed_t *pi_index;	   /* Index of strings (for pii_index) */
     pa_mmap_atom_t *pi_base;	   /* Base of page table (in mmap atoms) */
+    pa_istr_hash_info_t *pi_hashp; /* Hash index header (or NULL) */
 } pa_istr_t;
 
 /* Simplification macros, so we don't need to think about pi_datap */
@@ -118,6 +141,7 @@ pa_istr_page_get (pa_istr_t *pip, pa_page_t page)
 static inline void
 pa_istr_page_set (pa_istr_t *pip, pa_page_t page, pa_mmap_atom_t matom)
 {
+    pa_mmap_touch(pip->pi_mmap, &pip->pi_base[page], sizeof(matom));
     pip->pi_base[page] = matom;
 }
 
@@ -236,6 +260,7 @@ pa_istr_nstring (pa_istr_t *pip, const char *string, size_t len)
 
 	char *data = pa_istr_data_atom_addr(pip, atom);
 	if (data) {
+	    pa_mmap_touch(pip->pi_mmap, data, len + 1);
 	    memcpy(data, string, len);
 	    data[len] = '\0';
 	}
@@ -269,6 +294,85 @@ pa_istr_new (pa_istr_t *pip, const char *string, pa_istr_atom_t *atomp)
     return pa_istr_atom_string(pip, atom);
 }
 
+/*
+ * Hash a string for the hash index (32-bit FNV-1a)
+ */
+static inline uint32_t
+pa_istr_hash_value (const char *string, size_t len)
+{
+    const psu_byte_t *cp = (const psu_byte_t *) string;
+    uint32_t hash = 2166136261U;
+
+    for ( ; len > 0; len--, cp++) {
+	hash ^= *cp;
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Build (or reattach to) the hash index for an istr table.  The index
+ * is optional; until this is called, the hash functions below find
+ * nothing and add nothing.
+ *
+ * @param[in] pip istr table
+ * @param[in] name name of the hash index header
+ * @param[in] shift log2 of the initial number of slots (zero for default)
+ * @return TRUE if the index is available
+ */
+psu_boolean_t
+pa_istr_hash_open (pa_istr_t *pip, const char *name, pa_shift_t shift);
+
+/**
+ * Find a string in the hash index.
+ *
+ * @param[in] pip istr table
+ * @param[in] string string to find (not necessarily NUL terminated)
+ * @param[in] len number of bytes in the string
+ * @return atom of the interned string, or null if not found
+ */
+pa_istr_atom_t
+pa_istr_hash_find (pa_istr_t *pip, const char *string, size_t len);
+
+/**
+ * Record an existing istr atom in the hash index.  The caller is
+ * responsible for not adding the same string twice.
+ *
+ * @param[in] pip istr table
+ * @param[in] atom atom to record
+ * @return TRUE on success
+ */
+psu_boolean_t
+pa_istr_hash_add (pa_istr_t *pip, pa_istr_atom_t atom);
+
+/*
+ * Intern a string: return the existing atom if we have one, otherwise
+ * allocate a new string and record it in the hash index.  Without
+ * a hash index, this is simply pa_istr_nstring().
+ */
+static inline pa_istr_atom_t
+pa_istr_hash_nstring (pa_istr_t *pip, const char *string, size_t len)
+{
+    if (string == NULL || len <= 1 || pip->pi_hashp == NULL)
+	return pa_istr_nstring(pip, string, len);
+
+    pa_istr_atom_t atom = pa_istr_hash_find(pip, string, len);
+    if (pa_istr_is_null(atom)) {
+	atom = pa_istr_nstring(pip, string, len);
+	if (!pa_istr_is_null(atom))
+	    pa_istr_hash_add(pip, atom);
+    }
+
+    return atom;
+}
+
+static inline pa_istr_atom_t
+pa_istr_hash_string (pa_istr_t *pip, const char *string)
+{
+    return pa_istr_hash_nstring(pip, string, string ? strlen(string) : 0);
+}
+
 void
 pa_istr_init_from_block (pa_istr_t *pip, void *base, pa_istr_info_t *infop);
 
@@ -284,6 +388,28 @@ pa_istr_t *
 pa_istr_open (pa_mmap_t *pmp, const char *name, pa_shift_t shift,
 	       uint16_t atom_shift, uint32_t max_atoms);
 
+/*
+ * Release a string.  The atom must not be used afterwards; its index
+ * entry is retired and its data is reclaimed by pa_istr_compact().
+ */
+void
+pa_istr_free (pa_istr_t *pip, pa_istr_atom_t atom);
+
+/**
+ * Compact the string data: pages with no live strings are returned
+ * to the mmap segment, and the strings on pages that are at most
+ * half full are moved to denser pages, after which those pages are
+ * returned as well.  Atoms are unchanged, but string pointers from
+ * pa_istr_atom_string() are invalid after this call.
+ *
+ * @param[in] pip istr table
+ * @param[in] max_pages maximum number of pages to move strings off of
+ *            (zero for no limit), to bound the work done in one pass
+ * @return number of pages returned to the mmap segment
+ */
+unsigned
+pa_istr_compact (pa_istr_t *pip, unsigned max_pages);
+
 void
 pa_istr_close (pa_istr_t *pip);
 
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <libpsu/psualloc.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pajournal.h>
+
+#define PA_JOURNAL_MAGIC	0x4A524E4C /* "JRNL" */
+#define PA_JOURNAL_MAX_PAGES	(1U << 20) /* Sanity check for replay */
+
+#define PA_JOURNAL_GROUP	8  /* Default records per fsync */
+#define PA_JOURNAL_LIMIT	(16U << 20) /* Default journal size limit */
+
+#define PA_JOURNAL_MAP_SHIFT	5  /* log2(bits in a dirty map word) */
+#define PA_JOURNAL_MAP_BITS	(1U << PA_JOURNAL_MAP_SHIFT)
+
+/*
+ * Each record is this header, followed by the page numbers (padded
+ * to eight bytes), followed by an image of each page.  The checksum
+ * covers all of it, with pjr_sum itself taken as zero.
+ */
+typedef struct pa_journal_record_s {
+    uint32_t pjr_magic;		/* PA_JOURNAL_MAGIC */
+    uint32_t pjr_count;		/* Number of pages */
+    uint64_t pjr_seq;		/* Sequence number */
+    uint32_t pjr_sum;		/* Checksum (FNV-1a) */
+    uint32_t pjr_pad;		/* Zero */
+} pa_journal_record_t;
+
+static inline size_t
+pa_journal_list_size (unsigned count)
+{
+    return pa_roundup32(count * sizeof(pa_atom_t), sizeof(uint64_t));
+}
+
+static inline size_t
+pa_journal_record_size (unsigned count)
+{
+    return sizeof(pa_journal_record_t) + pa_journal_list_size(count)
+	+ ((size_t) count << PA_MMAP_ATOM_SHIFT);
+}
+
+static uint32_t
+pa_journal_sum_bytes (uint32_t sum, const psu_byte_t *cp, size_t len)
+{
+    const psu_byte_t *ep = cp + len;
+
+    for ( ; cp < ep; cp++) {
+	sum ^= *cp;
+	sum *= 16777619U;	/* FNV prime */
+    }
+
+    return sum;
+}
+
+static uint32_t
+pa_journal_checksum (pa_journal_record_t *recp, const psu_byte_t *body,
+		     size_t len)
+{
+    uint32_t saved = recp->pjr_sum;
+    uint32_t sum = 2166136261U;	/* FNV offset basis */
+
+    recp->pjr_sum = 0;
+    sum = pa_journal_sum_bytes(sum, (void *) recp, sizeof(*recp));
+    sum = pa_journal_sum_bytes(sum, body, len);
+    recp->pjr_sum = saved;
+
+    return sum;
+}
+
+/*
+ * Copy each good record into the data file, stopping at the first
+ * one that is short, torn, or out of sequence.  Returns the number
+ * of records applied, or -1 if the data file can't be written.
+ */
+static int
+pa_journal_replay (pa_journal_t *pjp)
+{
+    pa_journal_record_t rec;
+    psu_byte_t *buf = NULL;
+    size_t buf_size = 0;
+    off_t off = 0;
+    int count = 0;
+    unsigned i;
+
+    for (;;) {
+	if (pread(pjp->pj_fd, &rec, sizeof(rec), off) != sizeof(rec))
+	    break;
+
+	if (rec.pjr_magic != PA_JOURNAL_MAGIC || rec.pjr_count == 0
+		|| rec.pjr_count > PA_JOURNAL_MAX_PAGES)
+	    break;
+
+	if (count > 0 && rec.pjr_seq != pjp->pj_seq)
+	    break;
+
+	size_t len = pa_journal_record_size(rec.pjr_count) - sizeof(rec);
+	if (len > buf_size) {
+	    psu_byte_t *newp = psu_realloc(buf, len);
+	    if (newp == NULL) {
+		pa_warning(errno, "journal: cannot allocate replay buffer");
+		count = -1;
+		goto done;
+	    }
+	    buf = newp;
+	    buf_size = len;
+	}
+
+	if (pread(pjp->pj_fd, buf, len, off + sizeof(rec)) != (ssize_t) len)
+	    break;
+
+	if (pa_journal_checksum(&rec, buf, len) != rec.pjr_sum)
+	    break;
+
+	pa_atom_t *pages = (void *) buf;
+	psu_byte_t *images = buf + pa_journal_list_size(rec.pjr_count);
+
+	for (i = 0; i < rec.pjr_count; i++) {
+	    off_t where = (off_t) pages[i] << PA_MMAP_ATOM_SHIFT;
+	    if (pwrite(pjp->pj_data_fd, images + (i << PA_MMAP_ATOM_SHIFT),
+		       PA_MMAP_ATOM_SIZE, where) != PA_MMAP_ATOM_SIZE) {
+		pa_warning(errno, "journal: cannot write page %u", pages[i]);
+		count = -1;
+		goto done;
+	    }
+	}
+
+	pjp->pj_seq = rec.pjr_seq + 1;
+	off += sizeof(rec) + len;
+	count += 1;
+    }
+
+    if (count > 0 && fsync(pjp->pj_data_fd) < 0) {
+	pa_warning(errno, "journal: fsync of data file failed");
+	count = -1;
+    }
+
+ done:
+    psu_free(buf);
+    return count;
+}
+
+/*
+ * Apply everything in the journal file, then empty it.  The data
+ * file is synced before the journal is truncated, so a crash in
+ * between just replays the same pages again.
+ */
+static int
+pa_journal_empty (pa_journal_t *pjp)
+{
+    if (pa_journal_replay(pjp) < 0)
+	return -1;
+
+    if (ftruncate(pjp->pj_fd, 0) < 0 || fsync(pjp->pj_fd) < 0) {
+	pa_warning(errno, "journal: cannot truncate journal");
+	return -1;
+    }
+
+    pjp->pj_size = 0;
+    return 0;
+}
+
+pa_journal_t *
+pa_journal_open (const char *filename, const char *base, int data_fd,
+		 psu_boolean_t fresh)
+{
+    pa_journal_t *pjp = psu_calloc(sizeof(*pjp));
+    if (pjp == NULL)
+	return NULL;
+
+    pjp->pj_data_fd = data_fd;
+    pjp->pj_group = pa_config_value32(base, "journal-group",
+				      PA_JOURNAL_GROUP);
+    if (pjp->pj_group == 0)
+	pjp->pj_group = 1;
+    pjp->pj_limit = pa_config_value32(base, "journal-size",
+				      PA_JOURNAL_LIMIT);
+
+    pjp->pj_fd = open(filename, O_RDWR | O_CREAT,
+		      pa_config_value32(base, "perm", 0644));
+    if (pjp->pj_fd < 0) {
+	pa_warning(errno, "could not open journal: '%s'", filename);
+	psu_free(pjp);
+	return NULL;
+    }
+
+    /* A new data file can't use anything in an old journal */
+    if (!fresh) {
+	int count = pa_journal_replay(pjp);
+	if (count < 0) {
+	    pa_journal_close(pjp);
+	    return NULL;
+	}
+	pjp->pj_replayed = count;
+    }
+
+    if (pa_journal_empty(pjp) < 0) {
+	pa_journal_close(pjp);
+	return NULL;
+    }
+
+    return pjp;
+}
+
+static int
+pa_journal_map_grow (pa_journal_t *pjp, size_t bits)
+{
+    size_t old_words = pa_items_shift32(pjp->pj_dirty_bits,
+					PA_JOURNAL_MAP_SHIFT);
+    size_t new_words;
+
+    bits = pa_roundup32(bits, 1U << 10); /* Grow in 1k page steps */
+    new_words = pa_items_shift32(bits, PA_JOURNAL_MAP_SHIFT);
+
+    uint32_t *map = psu_realloc(pjp->pj_dirty_map, new_words * sizeof(*map));
+    if (map == NULL)
+	return -1;
+
+    bzero(&map[old_words], (new_words - old_words) * sizeof(*map));
+    pjp->pj_dirty_map = map;
+    pjp->pj_dirty_bits = bits;
+    return 0;
+}
+
+void
+pa_journal_mark (pa_journal_t *pjp, pa_atom_t first, pa_atom_t last)
+{
+    pa_atom_t page;
+
+    for (page = first; page <= last; page++) {
+	if (page >= pjp->pj_dirty_bits && pa_journal_map_grow(pjp, page + 1))
+	    goto fail;
+
+	uint32_t *wp = &pjp->pj_dirty_map[page >> PA_JOURNAL_MAP_SHIFT];
+	uint32_t bit = 1U << (page % PA_JOURNAL_MAP_BITS);
+	if (*wp & bit)
+	    continue;
+
+	if (pjp->pj_dirty_count >= pjp->pj_dirty_max) {
+	    unsigned max = pjp->pj_dirty_max ? pjp->pj_dirty_max * 2 : 64;
+	    pa_atom_t *newp = psu_realloc(pjp->pj_dirty,
+					  max * sizeof(*newp));
+	    if (newp == NULL)
+		goto fail;
+
+	    pjp->pj_dirty = newp;
+	    pjp->pj_dirty_max = max;
+	}
+
+	*wp |= bit;
+	pjp->pj_dirty[pjp->pj_dirty_count++] = page;
+    }
+
+    return;
+
+ fail:
+    /* We can't record this change, so we mustn't commit a partial one */
+    if (!pjp->pj_failed)
+	pa_warning(errno, "journal: cannot track changed pages");
+    pjp->pj_failed = TRUE;
+}
+
+int
+pa_journal_commit (pa_journal_t *pjp, const psu_byte_t *base)
+{
+    unsigned count = pjp->pj_dirty_count;
+    unsigned i;
+
+    if (pjp->pj_failed) {
+	pa_warning(0, "journal: changes were not tracked; cannot commit");
+	return -1;
+    }
+
+    if (count == 0)
+	return 0;
+
+    size_t len = pa_journal_record_size(count);
+    if (pjp->pj_buf_len + len > pjp->pj_buf_size) {
+	size_t size = pjp->pj_buf_size ?: len;
+
+	while (size < pjp->pj_buf_len + len)
+	    size *= 2;
+
+	psu_byte_t *newp = psu_realloc(pjp->pj_buf, size);
+	if (newp == NULL) {
+	    pa_warning(errno, "journal: cannot allocate group buffer");
+	    return -1;
+	}
+
+	pjp->pj_buf = newp;
+	pjp->pj_buf_size = size;
+    }
+
+    /* Record sizes are multiples of eight, so this stays aligned */
+    pa_journal_record_t *recp = (void *) (pjp->pj_buf + pjp->pj_buf_len);
+    pa_atom_t *pages = (void *) &recp[1];
+    psu_byte_t *images = (psu_byte_t *) pages + pa_journal_list_size(count);
+
+    recp->pjr_magic = PA_JOURNAL_MAGIC;
+    recp->pjr_count = count;
+    recp->pjr_seq = pjp->pj_seq++;
+    recp->pjr_pad = 0;
+
+    bzero(pages, pa_journal_list_size(count));
+    for (i = 0; i < count; i++) {
+	pa_atom_t page = pjp->pj_dirty[i];
+
+	pages[i] = page;
+	memcpy(images + (i << PA_MMAP_ATOM_SHIFT),
+	       base + ((size_t) page << PA_MMAP_ATOM_SHIFT),
+	       PA_MMAP_ATOM_SIZE);
+	pjp->pj_dirty_map[page >> PA_JOURNAL_MAP_SHIFT]
+	    &= ~(1U << (page % PA_JOURNAL_MAP_BITS));
+    }
+
+    recp->pjr_sum = pa_journal_checksum(recp, (psu_byte_t *) pages,
+					len - sizeof(*recp));
+
+    pjp->pj_dirty_count = 0;
+    pjp->pj_buf_len += len;
+    pjp->pj_waiting += 1;
+    pjp->pj_commits += 1;
+    pjp->pj_pages += count;
+
+    if (pjp->pj_waiting >= pjp->pj_group)
+	return pa_journal_sync(pjp);
+
+    return 0;
+}
+
+int
+pa_journal_sync (pa_journal_t *pjp)
+{
+    size_t done = 0;
+
+    if (pjp->pj_buf_len == 0)
+	return 0;
+
+    /* A failed write leaves the group buffered, to be retried */
+    while (done < pjp->pj_buf_len) {
+	ssize_t rc = pwrite(pjp->pj_fd, pjp->pj_buf + done,
+			    pjp->pj_buf_len - done, pjp->pj_size + done);
+	if (rc <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    pa_warning(errno, "journal: write failed");
+	    return -1;
+	}
+	done += rc;
+    }
+
+    if (fsync(pjp->pj_fd) < 0) {
+	pa_warning(errno, "journal: fsync failed");
+	return -1;
+    }
+
+    pjp->pj_size += pjp->pj_buf_len;
+    pjp->pj_buf_len = 0;
+    pjp->pj_waiting = 0;
+    pjp->pj_syncs += 1;
+
+    if (pjp->pj_size >= pjp->pj_limit)
+	return pa_journal_empty(pjp);
+
+    return 0;
+}
+
+int
+pa_journal_apply (pa_journal_t *pjp)
+{
+    if (pa_journal_sync(pjp) < 0)
+	return -1;
+
+    return pa_journal_empty(pjp);
+}
+
+void
+pa_journal_dump (pa_journal_t *pjp)
+{
+    psu_log("journal: seq %llu, replayed %u, group %u, waiting %u, "
+	    "dirty %u%s",
+	    (unsigned long long) pjp->pj_seq, pjp->pj_replayed,
+	    pjp->pj_group, pjp->pj_waiting, pjp->pj_dirty_count,
+	    pjp->pj_failed ? " (failed)" : "");
+    psu_log("journal: %llu commits, %llu syncs, %llu pages, size %lld",
+	    (unsigned long long) pjp->pj_commits,
+	    (unsigned long long) pjp->pj_syncs,
+	    (unsigned long long) pjp->pj_pages, (long long) pjp->pj_size);
+}
+
+void
+pa_journal_close (pa_journal_t *pjp)
+{
+    if (pjp == NULL)
+	return;
+
+    if (pjp->pj_fd >= 0)
+	close(pjp->pj_fd);
+
+    psu_free(pjp->pj_dirty_map);
+    psu_free(pjp->pj_dirty);
+    psu_free(pjp->pj_buf);
+    psu_free(pjp);
+}
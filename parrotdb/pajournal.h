@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ */
+
+#ifndef PARROTDB_PAJOURNAL_H
+#define PARROTDB_PAJOURNAL_H
+
+/*
+ * A redo journal for a pa_mmap segment.  The segment tells us which
+ * pages it touches; a commit copies those pages into a transaction
+ * record, and records are written to the journal file in groups,
+ * with one fsync per group.  Records carry a sequence number and a
+ * checksum, so replay stops cleanly at a torn or stale record.
+ * Applying the journal copies the page images into the data file
+ * then empties the journal.  Page images make replay idempotent, so
+ * a crash while applying just means we apply again.
+ *
+ * The segment is responsible for keeping changes out of the data
+ * file until they've been journaled (pa_mmap maps it MAP_PRIVATE).
+ */
+
+typedef struct pa_journal_s {
+    int pj_fd;			/* Journal file */
+    int pj_data_fd;		/* Data file that the journal applies to */
+    psu_boolean_t pj_failed;	/* Lost track of a change; can't commit */
+    uint64_t pj_seq;		/* Sequence number for the next record */
+    uint32_t *pj_dirty_map;	/* Bitmap of pages touched since commit */
+    size_t pj_dirty_bits;	/* Number of bits in pj_dirty_map */
+    pa_atom_t *pj_dirty;	/* List of pages touched since commit */
+    unsigned pj_dirty_count;	/* Number of entries in pj_dirty */
+    unsigned pj_dirty_max;	/* Number of slots in pj_dirty */
+    psu_byte_t *pj_buf;		/* Records waiting to be written */
+    size_t pj_buf_len;		/* Bytes used in pj_buf */
+    size_t pj_buf_size;		/* Bytes allocated for pj_buf */
+    unsigned pj_waiting;	/* Number of records in pj_buf */
+    unsigned pj_group;		/* Records per group commit */
+    off_t pj_size;		/* Bytes in the journal file */
+    off_t pj_limit;		/* Apply the journal past this size */
+    unsigned pj_replayed;	/* Records replayed when we were opened */
+    uint64_t pj_commits;	/* Number of commits (records) */
+    uint64_t pj_syncs;		/* Number of group writes (fsyncs) */
+    uint64_t pj_pages;		/* Number of page images written */
+} pa_journal_t;
+
+/*
+ * Open (or create) a journal for the data file 'data_fd'.  Unless
+ * 'fresh' is set (the data file was just created), any transactions
+ * left in the journal are replayed into the data file first.
+ * Configuration values are looked up under 'base': "journal-group"
+ * (records per fsync) and "journal-size" (bytes before the journal
+ * is applied and emptied).
+ */
+pa_journal_t *
+pa_journal_open (const char *filename, const char *base, int data_fd,
+		 psu_boolean_t fresh);
+
+/*
+ * Record that pages [first, last] have changed since the last commit
+ */
+void
+pa_journal_mark (pa_journal_t *pjp, pa_atom_t first, pa_atom_t last);
+
+static inline psu_boolean_t
+pa_journal_dirty (pa_journal_t *pjp)
+{
+    return (pjp->pj_dirty_count != 0) ? TRUE : FALSE;
+}
+
+/*
+ * Commit: make a record of the marked pages (copied from 'base',
+ * the start of the segment), writing the group if it's full
+ */
+int
+pa_journal_commit (pa_journal_t *pjp, const psu_byte_t *base);
+
+/*
+ * Write and fsync the records waiting in the group buffer
+ */
+int
+pa_journal_sync (pa_journal_t *pjp);
+
+/*
+ * Copy the journal into the data file and empty the journal
+ */
+int
+pa_journal_apply (pa_journal_t *pjp);
+
+void
+pa_journal_dump (pa_journal_t *pjp);
+
+void
+pa_journal_close (pa_journal_t *pjp);
+
+#endif /* PARROTDB_PAJOURNAL_H */
@@ -20,19 +20,29 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <stddef.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sched.h>
 
 #include <libpsu/psualloc.h>
 #include <libpsu/psulog.h>
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
+#include <parrotdb/palog2.h>
+#include <parrotdb/pajournal.h>
 #include <libpsu/psualloc.h>
 
-#define PA_VERS_MAJOR		1 /* Major numbers are mutually incompatible */
+#define PA_VERS_MAJOR		4 /* Major numbers are mutually incompatible */
 #define PA_VERS_MINOR		0 /* Minor numbers are compatible */
 
 #define PA_MMAP_FREE_MAGIC	0xCABB1E16 /* Denoted free atoms */
 
+#define PA_MMAP_NUM_BINS	32 /* Number of free bins (log2 of size) */
+#define PA_MMAP_MAP_SHIFT	5  /* log2(bits in a free map word) */
+#define PA_MMAP_MAP_BITS	(1U << PA_MMAP_MAP_SHIFT)
+
 /*
  * The magic number allow us to "know" that the file is our's as well
  * as knowing that it's in the correct endian-ness.  Allows us to report
@@ -55,15 +65,33 @@ struct pa_mmap_info_s {
     uint32_t pmi_max_size;	/* Maximum size (or 0) */
     uint32_t pmi_num_headers;	/* Number of named headers following ours */
     size_t pmi_len;		/* Current size */
-    pa_mmap_atom_t pmi_free;	/* First free memory segment */
+    uint32_t pmi_bin_mask;	/* Bit set for each non-empty bin */
+    pa_mmap_atom_t pmi_bins[PA_MMAP_NUM_BINS]; /* Free lists, by size */
+    uint32_t pmi_seq;		/* Sequence number (odd while writing) */
+    uint32_t pmi_epoch;		/* Count of completed write sections */
+    uint32_t pmi_state;		/* Checkpoint state (PMS_*) */
+    uint32_t pmi_generation;	/* Number of the last checkpoint */
+    size_t pmi_ckpt_len;	/* Segment length at the last checkpoint */
 }; /* pa_mmap_info_t */
 
+/* Values for pmi_state */
+#define PMS_CLEAN	0	/* Segment matches the last checkpoint */
+#define PMS_DIRTY	1	/* Segment has changed since the checkpoint */
+
+/* Header at the start of a free chunk */
 typedef struct pa_mmap_free_s {
     uint32_t pmf_magic;		/* Magic number */
     pa_atom_t pmf_size;		/* Number of atoms free here */
-    pa_mmap_atom_t pmf_next;	/* Free list */
+    pa_mmap_atom_t pmf_next;	/* Next chunk in this bin */
+    pa_mmap_atom_t pmf_prev;	/* Previous chunk in this bin */
 } pa_mmap_free_t;
 
+/* Tail at the end of the last atom of a free chunk */
+typedef struct pa_mmap_free_tail_s {
+    uint32_t pmft_magic;	/* Magic number */
+    pa_atom_t pmft_size;	/* Number of atoms free here */
+} pa_mmap_free_tail_t;
+
 typedef struct pa_mmap_header_s {
     char pmh_name[PA_MMAP_HEADER_NAME_LEN]; /* Simple text name */
     uint16_t pmh_type;		/* Type of data (PA_TYPE_*) */
@@ -86,30 +114,339 @@ static uint8_t *pa_mmap_next_address = (void *) PA_ADDR_DEFAULT;
 static ptrdiff_t pa_mmap_incr_address = PA_ADDR_DEFAULT_INCR;
 
 /*
- * Add an item from a free list.
+ * Turn our PMF_* flags into extra flags for mmap().  Note that
+ * MAP_HUGETLB only works for anonymous segments; file-backed segments
+ * must use transparent huge pages (PMF_HUGE_PAGES) via madvise.
+ */
+static int
+pa_mmap_flags_extra (pa_mmap_flags_t flags, int fd)
+{
+    int mmap_flags = 0;
+
+#ifdef MAP_POPULATE
+    if (flags & PMF_PREFAULT)
+	mmap_flags |= MAP_POPULATE;
+#endif /* MAP_POPULATE */
+
+#ifdef MAP_HUGETLB
+    if ((flags & PMF_HUGETLB) && fd < 0)
+	mmap_flags |= MAP_HUGETLB;
+#else /* MAP_HUGETLB */
+    (void) fd;
+#endif /* MAP_HUGETLB */
+
+    return mmap_flags;
+}
+
+/*
+ * Apply our access policy to a newly mapped range.  This is called
+ * for the initial mapping and again for each range added as the
+ * segment grows, so the whole segment keeps the same policy.  All
+ * advice is just advice; failures are not fatal.
  */
 static void
-pa_mmap_list_add (pa_mmap_t *pmp, pa_mmap_atom_t atom, unsigned size)
+pa_mmap_advise (pa_mmap_flags_t flags, void *addr, size_t len)
 {
-    pa_mmap_atom_t fa;		/* Free atom number */
-    pa_mmap_free_t *pmfp;
-    pa_mmap_atom_t *lastp = &pmp->pm_infop->pmi_free;
+#ifdef MADV_HUGEPAGE
+    if (flags & PMF_HUGE_PAGES)
+	if (madvise(addr, len, MADV_HUGEPAGE) < 0)
+	    pa_warning(errno, "madvise(huge-pages) failed");
+#endif /* MADV_HUGEPAGE */
+
+    if (flags & PMF_SEQUENTIAL)
+	madvise(addr, len, MADV_SEQUENTIAL);
+    else if (flags & PMF_RANDOM)
+	madvise(addr, len, MADV_RANDOM);
+
+    if (flags & PMF_WILLNEED)
+	madvise(addr, len, MADV_WILLNEED);
+
+#ifndef MAP_POPULATE
+    /* Without MAP_POPULATE, we touch each page to fault it in */
+    if (flags & PMF_PREFAULT) {
+	volatile psu_byte_t *cp = addr;
+	size_t off;
+
+	for (off = 0; off < len; off += PA_MMAP_ATOM_SIZE)
+	    (void) cp[off];
+    }
+#endif /* MAP_POPULATE */
+}
 
-    for (fa = *lastp; !pa_mmap_is_null(fa); fa = *lastp) {
-	pmfp = pa_mmap_addr(pmp, fa);
+/*
+ * Return the number of atoms by which we grow the segment, which
+ * must be a multiple of the huge page size for explicit huge pages.
+ */
+static inline unsigned
+pa_mmap_grow_count (pa_mmap_t *pmp)
+{
+    return (pmp->pm_flags & PMF_HUGETLB)
+	? PA_MMAP_HUGE_COUNT : PA_DEFAULT_COUNT;
+}
 
-	if (size <= pmfp->pmf_size)
-	    break;
+/*
+ * A segment opened with PMF_CHECKPOINT is marked dirty before its
+ * first change after a checkpoint, and the mark is forced to disk
+ * before the change can be.  If we crash before the next checkpoint,
+ * the mark is still there when the segment is reopened.
+ */
+static void
+pa_mmap_mark_dirty (pa_mmap_t *pmp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+
+    if (!(pmp->pm_flags & PMF_CHECKPOINT)
+	    || (pmp->pm_flags & (PMF_READ_ONLY | PMF_PRIVATE | PMF_JOURNAL))
+	    || pmp->pm_fd < 0 || pmip->pmi_state == PMS_DIRTY)
+	return;
+
+    pmip->pmi_state = PMS_DIRTY;
+    if (msync(pmp->pm_addr, PA_MMAP_ATOM_SIZE, MS_SYNC) < 0)
+	pa_warning(errno, "msync of segment header failed");
+}
+
+/*
+ * Free chunks are kept on segregated lists ("bins"), where bin N
+ * holds chunks of [2^N, 2^(N+1)) atoms.  pmi_bin_mask has a bit set
+ * for each non-empty bin, so finding a chunk that is big enough is
+ * a single ffs() on the mask.  Each free chunk has a header in its
+ * first atom and a tail in the last bytes of its last atom, so we
+ * can find the start of a free chunk that precedes a chunk being
+ * freed and coalesce them.
+ *
+ * We can't trust the contents of allocated memory, so the in-memory
+ * pm_free_map records which atoms are the first or last atom of a
+ * free chunk.  It isn't stored in the segment; we rebuild it from
+ * the bins at open time.
+ */
+static inline unsigned
+pa_mmap_bin (pa_atom_t size)
+{
+    return pa_log2(size) - 1;	/* floor(log2(size)) */
+}
+
+static inline pa_mmap_free_tail_t *
+pa_mmap_free_tail (pa_mmap_t *pmp, pa_atom_t atom, pa_atom_t size)
+{
+    psu_byte_t *cp = pa_pointer(pmp->pm_addr, atom + size,
+				PA_MMAP_ATOM_SHIFT);
+    return (void *) (cp - sizeof(pa_mmap_free_tail_t));
+}
+
+static inline psu_boolean_t
+pa_mmap_map_test (pa_mmap_t *pmp, pa_atom_t atom)
+{
+    if (atom >= pmp->pm_free_map_bits)
+	return FALSE;
+
+    return (pmp->pm_free_map[atom / PA_MMAP_MAP_BITS]
+	    & (1U << (atom % PA_MMAP_MAP_BITS))) ? TRUE : FALSE;
+}
+
+static inline void
+pa_mmap_map_set (pa_mmap_t *pmp, pa_atom_t atom, psu_boolean_t on)
+{
+    if (atom >= pmp->pm_free_map_bits)
+	return;
 
-	lastp = &pmfp->pmf_next; /* Move to next item on free list */
+    uint32_t bit = 1U << (atom % PA_MMAP_MAP_BITS);
+    if (on)
+	pmp->pm_free_map[atom / PA_MMAP_MAP_BITS] |= bit;
+    else
+	pmp->pm_free_map[atom / PA_MMAP_MAP_BITS] &= ~bit;
+}
+
+/*
+ * Make sure the free map covers the entire segment
+ */
+static int
+pa_mmap_map_grow (pa_mmap_t *pmp)
+{
+    size_t bits = pmp->pm_len >> PA_MMAP_ATOM_SHIFT;
+    size_t old_words = pa_items_shift32(pmp->pm_free_map_bits,
+					PA_MMAP_MAP_SHIFT);
+    size_t new_words = pa_items_shift32(bits, PA_MMAP_MAP_SHIFT);
+
+    if (new_words > old_words) {
+	uint32_t *map = psu_realloc(pmp->pm_free_map,
+				    new_words * sizeof(*map));
+	if (map == NULL) {
+	    pa_warning(errno, "could not grow free map");
+	    return -1;
+	}
+
+	bzero(&map[old_words], (new_words - old_words) * sizeof(*map));
+	pmp->pm_free_map = map;
     }
 
-    /* Insert atom into the chain */
-    pmfp = pa_mmap_addr(pmp, atom);
+    pmp->pm_free_map_bits = bits;
+    return 0;
+}
+
+/*
+ * Put a chunk on the head of the bin matching its size.  The chunk
+ * must not touch another free chunk.
+ */
+static void
+pa_mmap_bin_insert (pa_mmap_t *pmp, pa_mmap_atom_t atom, pa_atom_t size)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+    unsigned bin = pa_mmap_bin(size);
+    pa_mmap_free_t *pmfp = pa_mmap_addr(pmp, atom);
+    pa_mmap_free_tail_t *pmftp;
+
+    pa_mmap_touch(pmp, pmfp, sizeof(*pmfp));
     pmfp->pmf_magic = PA_MMAP_FREE_MAGIC;
     pmfp->pmf_size = size;
-    pmfp->pmf_next = *lastp;
-    *lastp = atom;
+    pmfp->pmf_prev = pa_mmap_null_atom();
+    pmfp->pmf_next = pmip->pmi_bins[bin];
+
+    if (!pa_mmap_is_null(pmfp->pmf_next)) {
+	pa_mmap_free_t *nextp = pa_mmap_addr(pmp, pmfp->pmf_next);
+	pa_mmap_touch(pmp, nextp, sizeof(*nextp));
+	nextp->pmf_prev = atom;
+    }
+
+    pmip->pmi_bins[bin] = atom;
+    pmip->pmi_bin_mask |= 1U << bin;
+
+    pmftp = pa_mmap_free_tail(pmp, pa_mmap_atom_of(atom), size);
+    pa_mmap_touch(pmp, pmftp, sizeof(*pmftp));
+    pmftp->pmft_magic = PA_MMAP_FREE_MAGIC;
+    pmftp->pmft_size = size;
+
+    pa_mmap_map_set(pmp, pa_mmap_atom_of(atom), TRUE);
+    pa_mmap_map_set(pmp, pa_mmap_atom_of(atom) + size - 1, TRUE);
+}
+
+/*
+ * Unlink a chunk from its bin
+ */
+static void
+pa_mmap_bin_remove (pa_mmap_t *pmp, pa_mmap_atom_t atom,
+		    pa_mmap_free_t *pmfp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+    unsigned bin = pa_mmap_bin(pmfp->pmf_size);
+
+    if (pa_mmap_is_null(pmfp->pmf_prev))
+	pmip->pmi_bins[bin] = pmfp->pmf_next;
+    else {
+	pa_mmap_free_t *prevp = pa_mmap_addr(pmp, pmfp->pmf_prev);
+	pa_mmap_touch(pmp, prevp, sizeof(*prevp));
+	prevp->pmf_next = pmfp->pmf_next;
+    }
+
+    if (!pa_mmap_is_null(pmfp->pmf_next)) {
+	pa_mmap_free_t *nextp = pa_mmap_addr(pmp, pmfp->pmf_next);
+	pa_mmap_touch(pmp, nextp, sizeof(*nextp));
+	nextp->pmf_prev = pmfp->pmf_prev;
+    }
+
+    if (pa_mmap_is_null(pmip->pmi_bins[bin]))
+	pmip->pmi_bin_mask &= ~(1U << bin);
+
+    pa_mmap_map_set(pmp, pa_mmap_atom_of(atom), FALSE);
+    pa_mmap_map_set(pmp, pa_mmap_atom_of(atom) + pmfp->pmf_size - 1, FALSE);
+    pa_mmap_touch(pmp, pmfp, sizeof(*pmfp));
+    pmfp->pmf_magic = 0;
+}
+
+/*
+ * Rebuild the free map from the contents of the bins
+ */
+static int
+pa_mmap_map_build (pa_mmap_t *pmp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+    pa_mmap_free_t *pmfp;
+    pa_mmap_atom_t fa;
+    unsigned bin;
+
+    if (pa_mmap_map_grow(pmp))
+	return -1;
+
+    for (bin = 0; bin < PA_MMAP_NUM_BINS; bin++) {
+	for (fa = pmip->pmi_bins[bin]; !pa_mmap_is_null(fa);
+	     fa = pmfp->pmf_next) {
+	    pmfp = pa_mmap_addr(pmp, fa);
+	    if (pmfp->pmf_magic != PA_MMAP_FREE_MAGIC
+		    || pa_mmap_bin(pmfp->pmf_size) != bin) {
+		pa_warning(0, "corrupt free list (bin %u, atom %#x)",
+			   bin, pa_mmap_atom_of(fa));
+		return -1;
+	    }
+
+	    pa_mmap_map_set(pmp, pa_mmap_atom_of(fa), TRUE);
+	    pa_mmap_map_set(pmp, pa_mmap_atom_of(fa) + pmfp->pmf_size - 1,
+			    TRUE);
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Add an item to the free lists, coalescing it with any free
+ * neighbors.
+ */
+static void
+pa_mmap_list_add (pa_mmap_t *pmp, pa_mmap_atom_t atom, unsigned size)
+{
+    pa_atom_t start = pa_mmap_atom_of(atom);
+    pa_mmap_free_t *pmfp;
+
+    /* If the chunk following us is free, absorb it */
+    if (pa_mmap_map_test(pmp, start + size)) {
+	pa_mmap_atom_t na = pa_mmap_atom(start + size);
+
+	pmfp = pa_mmap_addr(pmp, na);
+	size += pmfp->pmf_size;
+	pa_mmap_bin_remove(pmp, na, pmfp);
+    }
+
+    /* If the chunk preceding us is free, it absorbs us */
+    if (start > 1 && pa_mmap_map_test(pmp, start - 1)) {
+	pa_mmap_free_tail_t *pmftp = pa_mmap_free_tail(pmp, start, 0);
+	pa_mmap_atom_t pa = pa_mmap_atom(start - pmftp->pmft_size);
+
+	pmfp = pa_mmap_addr(pmp, pa);
+	size += pmfp->pmf_size;
+	pa_mmap_bin_remove(pmp, pa, pmfp);
+	atom = pa;
+    }
+
+    pa_mmap_bin_insert(pmp, atom, size);
+}
+
+/*
+ * Find a free chunk of at least 'count' atoms.  Any chunk in a bin
+ * above ceil(log2(count)) will do, so that's our O(1) path.  If
+ * there's nothing there, we look thru the bin for floor(log2(count))
+ * before we give up and grow the segment.
+ */
+static pa_mmap_atom_t
+pa_mmap_bin_find (pa_mmap_t *pmp, unsigned count)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+    unsigned bin = (count > 1) ? pa_log2(count - 1) : 0;
+    uint32_t mask = (bin < PA_MMAP_NUM_BINS)
+	? pmip->pmi_bin_mask & ~((1U << bin) - 1) : 0;
+    pa_mmap_free_t *pmfp;
+    pa_mmap_atom_t fa;
+
+    if (mask)
+	return pmip->pmi_bins[ffs(mask) - 1];
+
+    bin = pa_mmap_bin(count);
+    for (fa = pmip->pmi_bins[bin]; !pa_mmap_is_null(fa);
+	 fa = pmfp->pmf_next) {
+	pmfp = pa_mmap_addr(pmp, fa);
+	if (pmfp->pmf_size >= count)
+	    return fa;
+    }
+
+    return pa_mmap_null_atom();
 }
 
 /*
@@ -127,38 +464,42 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
     unsigned count = (size + PA_MMAP_ATOM_SIZE - 1) >> PA_MMAP_ATOM_SHIFT;
     unsigned new_count;
     pa_mmap_free_t *pmfp;
-    pa_mmap_atom_t *lastp = &pmp->pm_infop->pmi_free;
 
-    for (fa = *lastp; !pa_mmap_is_null(fa); fa = *lastp) {
+    pa_mmap_mark_dirty(pmp);
+    pmp->pm_counters.pmc_allocs += 1;
+
+    fa = pa_mmap_bin_find(pmp, count);
+    if (!pa_mmap_is_null(fa)) {
 	pmfp = pa_mmap_addr(pmp, fa);
+	pa_atom_t left = pmfp->pmf_size - count;
 
-	if (pmfp->pmf_size >= count) {
-	    /*
-	     * We "cheat", allocating from the end so we don't need to
-	     * touch the current by_addr list.  We'll still have to mung
-	     * the by_size list.
-	     */
-	    if (count < pmfp->pmf_size) {
-		pmfp->pmf_size -= count;
-		fa.pma_atom += pmfp->pmf_size; /* Reference end of the chunk */
-	    } else
-		*lastp = pmfp->pmf_next; /* Unlink this chunk */
+	pa_mmap_bin_remove(pmp, fa, pmfp);
 
-	    return fa;		/* Return offset */
+	/*
+	 * We allocate from the end of the chunk, so the remainder
+	 * keeps its header (but may land in a different bin).
+	 */
+	if (left) {
+	    pa_mmap_bin_insert(pmp, fa, left);
+	    fa.pma_atom += left; /* Reference end of the chunk */
 	}
 
-	lastp = &pmfp->pmf_next;
+	/* The caller is about to fill in the chunk */
+	pa_mmap_touch(pmp, pa_mmap_addr(pmp, fa),
+		      (size_t) count << PA_MMAP_ATOM_SHIFT);
+
+	return fa;		/* Return offset */
     }
 
     /*
-     * Okay, so there's nothing but enough to fit this, but we do
-     * know that *lastp is the end of the free list.  So we grow our
-     * database, and toss the excess onto the free list.
+     * Okay, so there's nothing big enough to fit this, so we grow
+     * our database, and toss the excess onto the free list.
      */
-    if (count < PA_DEFAULT_COUNT)
-	new_count = PA_DEFAULT_COUNT;
+    unsigned grow_count = pa_mmap_grow_count(pmp);
+    if (count < grow_count)
+	new_count = grow_count;
     else
-	new_count = pa_roundup32(count, PA_DEFAULT_COUNT);
+	new_count = pa_roundup32(count, grow_count);
 
     size_t new_len = pmp->pm_len + (new_count << PA_MMAP_ATOM_SHIFT);
     size_t old_len = pmp->pm_len;
@@ -169,8 +510,14 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
 	return pa_mmap_null_atom();
     }
 
-    /* If we've got a file attached, we need to extend the file */
-    if (pmp->pm_fd > 0) {
+    /*
+     * If we've got a file attached, we need to extend the file.  A
+     * private segment leaves the file alone and grows like an
+     * anonymous one.  A journaled segment extends the file, but maps
+     * the new piece on its own, since remapping the whole file would
+     * throw away our uncommitted (copy-on-write) pages.
+     */
+    if (pmp->pm_fd > 0 && !(pmp->pm_flags & (PMF_PRIVATE | PMF_JOURNAL))) {
 	if (ftruncate(pmp->pm_fd, new_len) < 0) {
 	    pa_warning(errno, "cannot extend memory file to %d", new_len);
 	    return pa_mmap_null_atom();
@@ -178,8 +525,7 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
 
 	/* Re-mmap the segment */
 	void *addr = mmap(pmp->pm_addr, new_len, pmp->pm_mmap_prot,
-			  pmp->pm_mmap_flags | MAP_FIXED | MAP_SHARED,
-			  pmp->pm_fd, 0);
+			  pmp->pm_mmap_flags | MAP_FIXED, pmp->pm_fd, 0);
 	if (addr == NULL || addr == MAP_FAILED) {
 	    pa_warning(errno, "mmap failed");
 	    return pa_mmap_null_atom();
@@ -190,6 +536,9 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
 	    return pa_mmap_null_atom();
 	}
 
+	pa_mmap_advise(pmp->pm_flags, pmp->pm_addr + old_len,
+		       new_len - old_len);
+
     } else {
 	/*
 	 * With mmap and no file, we can't extend our mapping, so
@@ -200,9 +549,24 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
 	uint8_t *target = pmp->pm_addr;
 	target += old_len;
 
+	int mflags = pmp->pm_mmap_flags | MAP_FIXED;
+	int fd = pmp->pm_fd;
+	off_t off = 0;
+
+	if (pmp->pm_flags & PMF_PRIVATE) {
+	    mflags = (mflags & ~MAP_FILE) | MAP_ANON;
+	    fd = -1;
+
+	} else if (pmp->pm_flags & PMF_JOURNAL) {
+	    if (ftruncate(fd, new_len) < 0) {
+		pa_warning(errno, "cannot extend memory file to %d", new_len);
+		return pa_mmap_null_atom();
+	    }
+	    off = old_len;
+	}
+
 	void *addr = mmap(target, new_len - old_len, pmp->pm_mmap_prot,
-			  pmp->pm_mmap_flags | MAP_FIXED | MAP_SHARED,
-			  pmp->pm_fd, 0);
+			  mflags, fd, off);
 	if (addr == NULL || addr == MAP_FAILED) {
 	    pa_warning(errno, "mmap failed");
 	    return pa_mmap_null_atom();
@@ -214,6 +578,8 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
 	    return pa_mmap_null_atom();
 	}
 
+	pa_mmap_advise(pmp->pm_flags, target, new_len - old_len);
+
 	pa_mmap_record_t *pmrp = psu_calloc(sizeof(*pmrp));
 	if (pmrp) {
 	    pmrp->pmr_addr = target;
@@ -224,19 +590,21 @@ pa_mmap_alloc (pa_mmap_t *pmp, size_t size)
     }
 
     pmp->pm_len = new_len;	/* Record our new length */
+    pa_mmap_map_grow(pmp);
+
+    /* Publish the new length last, so readers can follow us */
+    __atomic_store_n(&pmp->pm_infop->pmi_len, new_len, __ATOMIC_RELEASE);
+
     /* We'll use the first chunk for this allocation */
     fa = pa_mmap_atom(old_len >> PA_MMAP_ATOM_SHIFT);
+    pa_mmap_touch(pmp, pa_mmap_addr(pmp, fa),
+		  (size_t) count << PA_MMAP_ATOM_SHIFT);
 
     if (new_count > count) {
 	/* Put the rest on the free list */
 	pa_mmap_atom_t na = { fa.pma_atom + count };
 
-	pmfp = pa_mmap_addr(pmp, na);
-	pmfp->pmf_magic = PA_MMAP_FREE_MAGIC;
-	pmfp->pmf_size = new_count - count;
-	pmfp->pmf_next = pa_mmap_null_atom();
-
-	*lastp = na;		/* Add 'na' to the free list */
+	pa_mmap_bin_insert(pmp, na, new_count - count);
     }
 
     return fa;
@@ -256,27 +624,80 @@ pa_mmap_free (pa_mmap_t *pmp, pa_mmap_atom_t atom, unsigned size)
 	return;
     }
 
+    pa_mmap_mark_dirty(pmp);
+    pmp->pm_counters.pmc_frees += 1;
     pa_mmap_list_add(pmp, atom, count);
 }
 
+/*
+ * Once the journal has been replayed, find the file's length,
+ * trimming anything past the segment length in its header
+ */
+static int
+pa_mmap_journal_trim (int fd, unsigned *lenp)
+{
+    pa_mmap_info_t info;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+	pa_warning(errno, "could not stat journaled file");
+	return -1;
+    }
+
+    *lenp = st.st_size;
+
+    /* If it's not a segment, the usual header checks will complain */
+    if (pread(fd, &info, sizeof(info), 0) != sizeof(info)
+	    || info.pmi_magic != PA_MAGIC_NUMBER)
+	return 0;
+
+    if (info.pmi_len >= PA_MMAP_ATOM_SIZE && info.pmi_len < *lenp) {
+	if (ftruncate(fd, info.pmi_len) < 0) {
+	    pa_warning(errno, "could not trim file length (%zu)",
+		       info.pmi_len);
+	    return -1;
+	}
+	*lenp = info.pmi_len;
+    }
+
+    return 0;
+}
+
 pa_mmap_t *
 pa_mmap_open (const char *filename, const char *base,
 	      pa_mmap_flags_t flags, unsigned mode)
 {
-    int mmap_flags = MAP_SHARED | MAP_FIXED;
+    int mmap_flags;
     int fd = 0;
     int oflags;
     int prot = PROT_READ | PROT_WRITE;
     struct stat st;
     pa_mmap_info_t *pmip = NULL;
     pa_mmap_t *pmp = NULL;
-    int created = 0;
+    pa_journal_t *pjp = NULL;
+    int created = 0, new_file = 0;
     unsigned len = 0;
     psu_byte_t *addr = NULL;
 
+    /* A reader sees the last checkpoint; the journal is the writer's */
+    if (flags & PMF_READ_ONLY)
+	flags &= ~PMF_JOURNAL;
+
+    if ((flags & PMF_JOURNAL)
+	    && (filename == NULL || (flags & (PMF_SHARED | PMF_PRIVATE)))) {
+	pa_warning(0, "a journaled segment needs a file of its own");
+	return NULL;
+    }
+
+    /* Journaled changes must not reach the file until committed */
+    mmap_flags = ((flags & (PMF_PRIVATE | PMF_JOURNAL))
+		  ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED;
+
     if (flags & PMF_READ_ONLY) {
 	prot = PROT_READ;
 	oflags = O_RDONLY;
+    } else if (flags & PMF_PRIVATE) {
+	oflags = O_RDONLY;	/* Our changes never reach the file */
     } else {
 	oflags = O_RDWR;
     }
@@ -287,7 +708,7 @@ pa_mmap_open (const char *filename, const char *base,
 
 	fd = open(filename, oflags, mode);
 	if (fd < 0) {
-	    if (flags & PMF_READ_ONLY) {
+	    if (flags & (PMF_READ_ONLY | PMF_PRIVATE)) {
 		pa_warning(errno, "could not open (read-only) file: '%s'",
 			   filename);
 		goto fail;
@@ -299,13 +720,7 @@ pa_mmap_open (const char *filename, const char *base,
 		goto fail;
 	    }
 
-	    len = pa_config_value32(base, "size", PA_DEFAULT_SIZE);
-	    if (ftruncate(fd, len) < 0) {
-		pa_warning(errno, "could not extend file length (%d)", len);
-		goto fail;
-	    }
-
-	    created = 1;
+	    created = new_file = 1;
 
 	} else {
 	    if (fstat(fd, &st)) {
@@ -313,7 +728,56 @@ pa_mmap_open (const char *filename, const char *base,
 		goto fail;
 	    }
 
+	    /*
+	     * An empty file is a new segment, so a caller can create
+	     * (and lock) the file before we set it up.
+	     */
 	    len = st.st_size;
+	    if (len == 0 && !(flags & (PMF_READ_ONLY | PMF_PRIVATE)))
+		created = 1;
+	}
+
+#ifdef LOCK_EX
+	/*
+	 * A shared segment has exactly one writer; readers don't lock
+	 * at all, but use the sequence number in the segment header.
+	 * A journaled segment has one writer and no readers.
+	 */
+	if ((flags & (PMF_SHARED | PMF_READ_ONLY)) == PMF_SHARED
+		|| (flags & PMF_JOURNAL)) {
+	    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		pa_warning(errno, "segment already has a writer: '%s'",
+			   filename);
+		goto fail;
+	    }
+	}
+#endif /* LOCK_EX */
+
+	/*
+	 * Bring the file up to date from its journal before we look
+	 * at it.  We grow the file before the growth is committed, so
+	 * a crash can leave it longer than the segment; trim it back.
+	 */
+	if (flags & PMF_JOURNAL) {
+	    char jname[MAXPATHLEN];
+
+	    snprintf(jname, sizeof(jname), "%s.journal", filename);
+	    pjp = pa_journal_open(jname, base, fd, new_file);
+	    if (pjp == NULL)
+		goto fail;
+
+	    if (!new_file && pa_mmap_journal_trim(fd, &len) < 0)
+		goto fail;
+
+	    created = (len == 0);
+	}
+
+	if (created) {
+	    len = pa_config_value32(base, "size", PA_DEFAULT_SIZE);
+	    if (ftruncate(fd, len) < 0) {
+		pa_warning(errno, "could not extend file length (%d)", len);
+		goto fail;
+	    }
 	}
 
 	mmap_flags |= MAP_FILE;
@@ -326,16 +790,37 @@ pa_mmap_open (const char *filename, const char *base,
 	created = 1;
     }
 
+    if (flags & PMF_HUGETLB) {
+	if (fd >= 0) {
+	    pa_warning(0, "huge pages (hugetlb) need an anonymous segment; "
+		       "using transparent huge pages for '%s'", filename);
+	    flags = (flags & ~PMF_HUGETLB) | PMF_HUGE_PAGES;
+	} else {
+	    len = pa_roundup32(len, 1U << PA_MMAP_HUGE_SHIFT);
+	}
+    }
+
+    mmap_flags |= pa_mmap_flags_extra(flags, fd);
+
     for (;;) {
 	if (pa_mmap_next_address > (psu_byte_t *) PA_ADDR_MAX)
 	    goto fail;
 
-	addr = mmap(pa_mmap_next_address, len, prot, mmap_flags | MAP_SHARED,
-		    fd, 0);
+	addr = mmap(pa_mmap_next_address, len, prot, mmap_flags, fd, 0);
 	if (addr == pa_mmap_next_address) /* Success */
 	    break;
 
 	if (addr == NULL || addr == MAP_FAILED) {
+	    int extra = pa_mmap_flags_extra(PMF_HUGETLB, -1);
+	    if (extra && (mmap_flags & extra)) {
+		/* No huge pages reserved; fall back to normal pages */
+		pa_warning(errno, "mmap with huge pages failed; "
+			   "using normal pages");
+		mmap_flags &= ~extra;
+		flags &= ~PMF_HUGETLB;
+		continue;
+	    }
+
 	    pa_warning(errno, "mmap failed (%p.vs.%p)",
 		       addr, pa_mmap_next_address);
 	    if (errno != EINVAL)
@@ -352,6 +837,8 @@ pa_mmap_open (const char *filename, const char *base,
 
     pa_mmap_next_address += pa_mmap_incr_address;
 
+    pa_mmap_advise(flags, addr, len);
+
     pmip = (void *) addr;
     if (created) {
 	pmip->pmi_magic = PA_MAGIC_NUMBER;
@@ -359,16 +846,8 @@ pa_mmap_open (const char *filename, const char *base,
 	pmip->pmi_vers_minor = PA_VERS_MINOR;
 	pmip->pmi_len = len;
 	pmip->pmi_max_size = pa_config_value32(base, "max-size", 0);
-
-	/* We waste the rest of the first atom, but we're atom aligned */
-	pmip->pmi_free = pa_mmap_atom(1);
-
-	/* Make the first entry in the free list */
-	pa_mmap_free_t *pmfp;
-	pmfp = pa_pointer(addr, 1, PA_MMAP_ATOM_SHIFT);
-	pmfp->pmf_magic = PA_MMAP_FREE_MAGIC;
-	pmfp->pmf_size = (len >> PA_MMAP_ATOM_SHIFT) - 1;
-
+	pmip->pmi_bin_mask = 0;
+	bzero(pmip->pmi_bins, sizeof(pmip->pmi_bins));
 
     } else {
 	/* Check header fields */
@@ -396,6 +875,20 @@ pa_mmap_open (const char *filename, const char *base,
 	} else {
 	    /* Success!! */
 	}
+
+	/*
+	 * A writer can only trust a checkpointed segment if nothing
+	 * changed after the last checkpoint.  Otherwise the segment
+	 * may hold half a change, and the caller must rebuild it.
+	 * Readers (and private views) don't modify the file, so we
+	 * let them in.
+	 */
+	if ((flags & (PMF_CHECKPOINT | PMF_READ_ONLY | PMF_PRIVATE))
+		== PMF_CHECKPOINT && pmip->pmi_state != PMS_CLEAN) {
+	    pa_warning(0, "segment '%s' changed since checkpoint %u",
+		       filename, pmip->pmi_generation);
+	    goto fail;
+	}
     }
 
     /*
@@ -415,8 +908,25 @@ pa_mmap_open (const char *filename, const char *base,
     pmp->pm_infop = pmip;
     pmp->pm_mmap_flags = mmap_flags;
     pmp->pm_mmap_prot = prot;
+    pmp->pm_journal = pjp;
+
+    if (pa_mmap_map_grow(pmp))
+	goto fail;
 
-    if (fd < 0) {
+    if (created) {
+	/*
+	 * Make the first entry in the free list.  We waste the rest
+	 * of the first atom, but we're atom aligned.
+	 */
+	pa_mmap_bin_insert(pmp, pa_mmap_atom(1),
+			   (len >> PA_MMAP_ATOM_SHIFT) - 1);
+
+    } else if (pa_mmap_map_build(pmp)) {
+	goto fail;
+    }
+
+    /* Private and journaled segments grow in pieces, so record them */
+    if (fd < 0 || (flags & (PMF_PRIVATE | PMF_JOURNAL))) {
 	pa_mmap_record_t *pmrp = psu_calloc(sizeof(*pmrp));
 	if (pmrp) {
 	    pmrp->pmr_addr = addr;
@@ -425,9 +935,20 @@ pa_mmap_open (const char *filename, const char *base,
 	}
     }
 
+    /* A new journaled segment isn't there until it's committed */
+    if (pjp && created && (pa_mmap_commit(pmp) || pa_mmap_sync(pmp))) {
+	psu_free(pmp->pm_record);
+	goto fail;
+    }
+
     return pmp;
 
  fail:
+    if (pmp) {
+	psu_free(pmp->pm_free_map);
+	psu_free(pmp);
+    }
+    pa_journal_close(pjp);
     if (addr != NULL)
 	munmap(addr, len);
     if (fd > 0)
@@ -436,12 +957,229 @@ pa_mmap_open (const char *filename, const char *base,
     return NULL;
 }
 
+/*
+ * A reader's mapping is sized when it is opened, but the writer may
+ * grow the segment at any time.  Extend our mapping to cover the
+ * segment's current length.
+ */
+int
+pa_mmap_refresh (pa_mmap_t *pmp)
+{
+    size_t len = __atomic_load_n(&pmp->pm_infop->pmi_len, __ATOMIC_ACQUIRE);
+
+    if (len <= pmp->pm_len)
+	return 0;
+
+    /* Anonymous segments can't be shared, and private ones aren't */
+    if (pmp->pm_fd < 0 || (pmp->pm_flags & PMF_PRIVATE))
+	return 0;
+
+    void *addr = mmap(pmp->pm_addr, len, pmp->pm_mmap_prot,
+		      pmp->pm_mmap_flags | MAP_FIXED, pmp->pm_fd, 0);
+    if (addr == NULL || addr == MAP_FAILED) {
+	pa_warning(errno, "mmap failed");
+	return -1;
+    }
+
+    if (addr != pmp->pm_addr) {
+	pa_warning(0, "mmap was moved (%p:%p)", pmp->pm_addr, addr);
+	return -1;
+    }
+
+    pa_mmap_advise(pmp->pm_flags, pmp->pm_addr + pmp->pm_len,
+		   len - pmp->pm_len);
+
+    pmp->pm_len = len;
+    return pa_mmap_map_grow(pmp);
+}
+
+/*
+ * Start a series of changes to the segment.  Readers that overlap
+ * with this write section will see an odd sequence number (or a
+ * changed one) and retry.  The writer never waits for readers.
+ */
+void
+pa_mmap_write_begin (pa_mmap_t *pmp)
+{
+    pa_mmap_mark_dirty(pmp);
+    __atomic_add_fetch(&pmp->pm_infop->pmi_seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Complete a write section, publishing its changes to readers.
+ */
+void
+pa_mmap_write_end (pa_mmap_t *pmp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pmip->pmi_epoch += 1;
+    __atomic_add_fetch(&pmip->pmi_seq, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a read section, returning the sequence number that must be
+ * handed to pa_mmap_read_retry().  If a writer is active, we wait
+ * for it to finish.
+ */
+uint32_t
+pa_mmap_read_begin (pa_mmap_t *pmp)
+{
+    uint32_t seq;
+
+    for (;;) {
+	seq = __atomic_load_n(&pmp->pm_infop->pmi_seq, __ATOMIC_ACQUIRE);
+	if ((seq & 1) == 0)
+	    break;
+	sched_yield();
+    }
+
+    pa_mmap_refresh(pmp);	/* Follow any growth */
+
+    return seq;
+}
+
+/*
+ * Finish a read section.  If the return value is true, a writer
+ * changed the segment while we were reading, and the caller must
+ * discard what it read and try again.
+ */
+psu_boolean_t
+pa_mmap_read_retry (pa_mmap_t *pmp, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&pmp->pm_infop->pmi_seq, __ATOMIC_RELAXED) != seq)
+	? TRUE : FALSE;
+}
+
+/*
+ * Return the number of completed write sections
+ */
+uint32_t
+pa_mmap_epoch (pa_mmap_t *pmp)
+{
+    return __atomic_load_n(&pmp->pm_infop->pmi_epoch, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Checkpoint the segment: flush every dirty page to the file, then
+ * record a new generation number in the segment header and mark it
+ * clean.  The data is on disk before the header says it's clean, so
+ * a crash at any point leaves either the old state or the new one.
+ * Returns zero on success.
+ */
+int
+pa_mmap_checkpoint (pa_mmap_t *pmp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+
+    if (pmp->pm_flags & PMF_READ_ONLY) {
+	pa_warning(0, "cannot checkpoint a read-only segment");
+	return -1;
+    }
+
+    /* The file only changes thru the journal, so apply it */
+    if (pmp->pm_journal) {
+	if (pa_mmap_commit(pmp) < 0)
+	    return -1;
+	return pa_journal_apply(pmp->pm_journal);
+    }
+
+    /* msync only writes pages that are dirty, so this is incremental */
+    if (pmp->pm_fd >= 0 && msync(pmp->pm_addr, pmp->pm_len, MS_SYNC) < 0) {
+	pa_warning(errno, "msync of segment failed");
+	return -1;
+    }
+
+    pmip->pmi_generation += 1;
+    pmip->pmi_ckpt_len = pmip->pmi_len;
+    pmip->pmi_state = PMS_CLEAN;
+
+    if (pmp->pm_fd >= 0
+	    && msync(pmp->pm_addr, PA_MMAP_ATOM_SIZE, MS_SYNC) < 0) {
+	pa_warning(errno, "msync of segment header failed");
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Mark the pages under [ptr, ptr + len) as changed.  Pointers outside
+ * the segment (such as a headerless allocator's in-process info
+ * block) are ignored.
+ */
+void
+pa_mmap_touch_pages (pa_mmap_t *pmp, const void *ptr, size_t len)
+{
+    const psu_byte_t *cp = ptr;
+
+    if (len == 0 || cp < pmp->pm_addr || cp >= pmp->pm_addr + pmp->pm_len)
+	return;
+
+    size_t off = cp - pmp->pm_addr;
+    size_t end = off + len - 1;
+
+    if (end >= pmp->pm_len)
+	end = pmp->pm_len - 1;
+
+    pa_journal_mark(pmp->pm_journal, off >> PA_MMAP_ATOM_SHIFT,
+		    end >> PA_MMAP_ATOM_SHIFT);
+}
+
+/*
+ * End a transaction.  The segment header and the allocators' named
+ * headers share page 0, which nearly every change touches, so we
+ * always take it rather than asking each allocator to mark it.
+ */
+int
+pa_mmap_commit (pa_mmap_t *pmp)
+{
+    pa_journal_t *pjp = pmp->pm_journal;
+
+    if (pjp == NULL || !pa_journal_dirty(pjp))
+	return 0;
+
+    pa_journal_mark(pjp, 0, 0);
+    return pa_journal_commit(pjp, pmp->pm_addr);
+}
+
+/*
+ * Make every committed transaction durable now, rather than waiting
+ * for the group to fill
+ */
+int
+pa_mmap_sync (pa_mmap_t *pmp)
+{
+    return pmp->pm_journal ? pa_journal_sync(pmp->pm_journal) : 0;
+}
+
+/*
+ * Return the number of the last checkpoint taken on this segment
+ */
+uint32_t
+pa_mmap_generation (pa_mmap_t *pmp)
+{
+    return pmp->pm_infop->pmi_generation;
+}
+
 /*
  * Close the pmap, releasing any resources associated with it.
  */
 void
 pa_mmap_close (pa_mmap_t *pmp)
 {
+    if (pmp->pm_journal) {
+	pa_mmap_checkpoint(pmp);
+	pa_journal_close(pmp->pm_journal);
+    }
+
+    if ((pmp->pm_flags & (PMF_CHECKPOINT | PMF_READ_ONLY | PMF_PRIVATE))
+	    == PMF_CHECKPOINT && pmp->pm_infop->pmi_state != PMS_CLEAN)
+	pa_mmap_checkpoint(pmp);
+
     if (pmp->pm_record) {
 	pa_mmap_record_t *pmrp = pmp->pm_record, *nextp;
 	for (; pmrp; pmrp = nextp) {
@@ -457,6 +1195,8 @@ pa_mmap_close (pa_mmap_t *pmp)
     if (pmp->pm_fd > 0)
 	close(pmp->pm_fd);
 
+    psu_free(pmp->pm_free_map);
+    psu_free(pmp->pm_header_counters);
     psu_free(pmp);
 }
 
@@ -508,6 +1248,8 @@ pa_mmap_header (pa_mmap_t *pmp, const char *name,
     }
 
     /* Setup the header and return the content */
+    pa_mmap_mark_dirty(pmp);
+    pa_mmap_touch(pmp, pmhp, sizeof(*pmhp) + size);
     strncpy(pmhp->pmh_name, name, sizeof(pmhp->pmh_name));
     pmhp->pmh_size = size;
     pmhp->pmh_type = type;
@@ -518,6 +1260,10 @@ pa_mmap_header (pa_mmap_t *pmp, const char *name,
     return &pmhp->pmh_content[0];
 }
 
+/*
+ * Return the header after the given one (which is the content pointer
+ * returned by pa_mmap_header), or the first header if 'header' is NULL.
+ */
 void *
 pa_mmap_next_header (pa_mmap_t *pmp, void *header)
 {
@@ -525,14 +1271,17 @@ pa_mmap_next_header (pa_mmap_t *pmp, void *header)
     uint8_t *base = pmp->pm_addr;
     uint32_t i;
 
-    base -= sizeof(*pmhp);
     base += sizeof(*pmp->pm_infop); /* Named headers start after ours */
 
     for (i = 0; i < pmp->pm_infop->pmi_num_headers; i++) {
 	pmhp = (void *) base;
+	if (header == NULL)
+	    return &pmhp->pmh_content[0];
+
 	base += sizeof(*pmhp) + pmhp->pmh_size;
-	if ((header == NULL || header == &pmhp->pmh_content[0])
-	    && i < pmp->pm_infop->pmi_num_headers - 1) {
+	if (header == &pmhp->pmh_content[0]) {
+	    if (i + 1 >= pmp->pm_infop->pmi_num_headers)
+		break;
 	    pmhp = (void *) base;
 	    return &pmhp->pmh_content[0];
 	}
@@ -541,6 +1290,94 @@ pa_mmap_next_header (pa_mmap_t *pmp, void *header)
     return NULL;
 }
 
+static inline pa_mmap_header_t *
+pa_mmap_header_of (void *header)
+{
+    psu_byte_t *cp = header;
+    return (void *) (cp - offsetof(pa_mmap_header_t, pmh_content));
+}
+
+const char *
+pa_mmap_header_name (pa_mmap_t *pmp UNUSED, void *header)
+{
+    return pa_mmap_header_of(header)->pmh_name;
+}
+
+uint16_t
+pa_mmap_header_type (pa_mmap_t *pmp UNUSED, void *header)
+{
+    return pa_mmap_header_of(header)->pmh_type;
+}
+
+/*
+ * Headers live in page 0, so there can't be more than this many
+ */
+#define PA_MMAP_MAX_HEADERS \
+    (PA_MMAP_ATOM_SIZE / (sizeof(pa_mmap_header_t) + sizeof(long long)))
+
+pa_mmap_counters_t *
+pa_mmap_counters (pa_mmap_t *pmp, const void *ptr)
+{
+    pa_mmap_header_t *pmhp;
+    const uint8_t *base = pmp->pm_addr;
+    const uint8_t *cp = ptr;
+    uint32_t i;
+
+    base += sizeof(*pmp->pm_infop); /* Named headers start after ours */
+
+    for (i = 0; i < pmp->pm_infop->pmi_num_headers; i++) {
+	pmhp = (void *) base;
+	base += sizeof(*pmhp) + pmhp->pmh_size;
+
+	if (cp < &pmhp->pmh_content[0] || cp >= base)
+	    continue;
+
+	if (i >= PA_MMAP_MAX_HEADERS)
+	    return NULL;
+
+	/* The array never moves, so callers can keep the pointer */
+	if (pmp->pm_header_counters == NULL) {
+	    pmp->pm_header_counters = psu_calloc(PA_MMAP_MAX_HEADERS
+					 * sizeof(pa_mmap_counters_t));
+	    if (pmp->pm_header_counters == NULL)
+		return NULL;
+	}
+
+	return &pmp->pm_header_counters[i];
+    }
+
+    return NULL;
+}
+
+void
+pa_mmap_free_space (pa_mmap_t *pmp, uint32_t *atomsp, uint32_t *chunksp,
+		    uint32_t *largestp)
+{
+    pa_mmap_info_t *pmip = pmp->pm_infop;
+    uint32_t atoms = 0, chunks = 0, largest = 0;
+    unsigned bin;
+    pa_mmap_atom_t fa;
+    pa_mmap_free_t *pmfp;
+
+    for (bin = 0; bin < PA_MMAP_NUM_BINS; bin++) {
+	for (fa = pmip->pmi_bins[bin]; !pa_mmap_is_null(fa);
+	     fa = pmfp->pmf_next) {
+	    pmfp = pa_mmap_addr(pmp, fa);
+	    atoms += pmfp->pmf_size;
+	    chunks += 1;
+	    if (pmfp->pmf_size > largest)
+		largest = pmfp->pmf_size;
+	}
+    }
+
+    if (atomsp)
+	*atomsp = atoms;
+    if (chunksp)
+	*chunksp = chunks;
+    if (largestp)
+	*largestp = largest;
+}
+
 /**
  * Dump the internal state of a pa_mmap table
  */
@@ -550,10 +1387,31 @@ pa_mmap_dump (pa_mmap_t *pmp, psu_boolean_t full)
     pa_mmap_info_t *pmip = pmp->pm_infop;
 
     psu_log("begin pa_mmap dump of %p", pmip);
-    psu_log("magic %#x, version %d.%03d, max-size %u, len %zu, free %#x",
+    psu_log("magic %#x, version %d.%03d, max-size %u, len %zu, bins %#x",
 	    pmip->pmi_magic, pmip->pmi_vers_major, pmip->pmi_vers_minor,
-	    pmip->pmi_max_size, pmip->pmi_len,
-	    pa_mmap_atom_of(pmip->pmi_free));
+	    pmip->pmi_max_size, pmip->pmi_len, pmip->pmi_bin_mask);
+    psu_log("checkpoint %u (%s), len %zu",
+	    pmip->pmi_generation,
+	    (pmip->pmi_state == PMS_CLEAN) ? "clean" : "dirty",
+	    pmip->pmi_ckpt_len);
+
+    if (pmp->pm_journal)
+	pa_journal_dump(pmp->pm_journal);
+
+    if (full) {
+	unsigned bin;
+	pa_mmap_atom_t fa;
+	pa_mmap_free_t *pmfp;
+
+	for (bin = 0; bin < PA_MMAP_NUM_BINS; bin++) {
+	    for (fa = pmip->pmi_bins[bin]; !pa_mmap_is_null(fa);
+		 fa = pmfp->pmf_next) {
+		pmfp = pa_mmap_addr(pmp, fa);
+		psu_log("free bin %u: atom %#x, size %u",
+			bin, pa_mmap_atom_of(fa), pmfp->pmf_size);
+	    }
+	}
+    }
 
     psu_log("dumping headers: (%d)", pmip->pmi_num_headers);
 
@@ -14,10 +14,11 @@
 
 /*
  * Support for memory allocation over mmap()'d sections of memory.
- * Since paged arrays use only offset, this is mostly trivial.  In
- * particular, we don't provide a means of freeing memory.  We just
- * grow the memory segment and gives pages out of that delta between
+ * Since paged arrays use only offset, this is mostly trivial.  We
+ * grow the memory segment and give pages out of that delta between
  * the top of the memory segment and the top of allocated memory.
+ * Freed pages are coalesced with free neighbors and kept on free
+ * lists binned by power-of-two page count.
  *
  * On top of this facility, there are a number of distinct memory
  * allocators, each with different parameters and behaviors, and
@@ -39,6 +40,24 @@ typedef struct pa_mmap_info_s pa_mmap_info_t; /* Opaque type */
 typedef uint32_t pa_mmap_flags_t; /* Flag values */
 /* Flags for pa_mmap_flags_t */
 #define PMF_READ_ONLY	(1<<0)	/* Open read-only */
+#define PMF_HUGE_PAGES	(1<<1)	/* Ask for transparent huge pages */
+#define PMF_HUGETLB	(1<<2)	/* Use explicit huge pages (anonymous only) */
+#define PMF_PREFAULT	(1<<3)	/* Prefault pages when mapped */
+#define PMF_SEQUENTIAL	(1<<4)	/* Advise: sequential access */
+#define PMF_RANDOM	(1<<5)	/* Advise: random access */
+#define PMF_WILLNEED	(1<<6)	/* Advise: will need pages soon */
+#define PMF_SHARED	(1<<7)	/* Single writer, many reader processes */
+#define PMF_CHECKPOINT	(1<<8)	/* Track changes since pa_mmap_checkpoint */
+#define PMF_PRIVATE	(1<<9)	/* Copy-on-write view of an existing file */
+#define PMF_JOURNAL	(1<<10)	/* Make changes durable with a journal */
+
+/*
+ * Explicit huge pages need mappings that are a multiple of the huge
+ * page size, so segments opened with PMF_HUGETLB grow in units of
+ * PA_MMAP_HUGE_COUNT atoms instead of the normal default.
+ */
+#define PA_MMAP_HUGE_SHIFT	21 /* 2MB huge pages */
+#define PA_MMAP_HUGE_COUNT	(1U << (PA_MMAP_HUGE_SHIFT - PA_MMAP_ATOM_SHIFT))
 
 /* Record of mmap'd segments */
 typedef struct pa_mmap_record_s {
@@ -47,6 +66,18 @@ typedef struct pa_mmap_record_s {
     size_t pmr_len;
 } pa_mmap_record_t;
 
+/*
+ * Allocation counters, kept for the segment and for each named
+ * header.  These live in the pa_mmap_t, not in the segment, so
+ * they count only this process's activity.
+ */
+typedef struct pa_mmap_counters_s {
+    uint64_t pmc_allocs;	/* Number of allocations */
+    uint64_t pmc_frees;		/* Number of frees */
+} pa_mmap_counters_t;
+
+struct pa_journal_s;		/* Redo journal (see pajournal.h) */
+
 /*
  * This structure defines the in-memory information needed for
  * a mmap'd segment.  pm_addr == pm_infop, just a untyped.
@@ -60,6 +91,11 @@ typedef struct pa_mmap_s {
     size_t pm_len;		/* Current mapped len */
     pa_mmap_info_t *pm_infop;	/* Mmap segment header */
     pa_mmap_record_t *pm_record; /* Record of mmap'd segments */
+    uint32_t *pm_free_map;	/* Bitmap of free chunk boundaries */
+    size_t pm_free_map_bits;	/* Number of bits in pm_free_map */
+    pa_mmap_counters_t pm_counters; /* Counters for the segment itself */
+    pa_mmap_counters_t *pm_header_counters; /* Counters, by header */
+    struct pa_journal_s *pm_journal; /* Journal, for PMF_JOURNAL */
 } pa_mmap_t;
 
 static inline void *
@@ -92,7 +128,134 @@ pa_mmap_header (pa_mmap_t *pmp, const char *name,
 void *
 pa_mmap_next_header (pa_mmap_t *pmp, void *header);
 
+const char *
+pa_mmap_header_name (pa_mmap_t *pmp, void *header);
+
+uint16_t
+pa_mmap_header_type (pa_mmap_t *pmp, void *header);
+
+/*
+ * Return the counters for the named header whose content holds 'ptr',
+ * or NULL if there's no such header.  Allocators keep the pointer
+ * and bump the counters as they go.
+ */
+pa_mmap_counters_t *
+pa_mmap_counters (pa_mmap_t *pmp, const void *ptr);
+
+/*
+ * Bump a counter; magazine users may be counting from many threads.
+ */
+static inline void
+pa_mmap_count (uint64_t *counterp, psu_boolean_t shared)
+{
+    if (shared)
+	__atomic_add_fetch(counterp, 1, __ATOMIC_RELAXED);
+    else
+	*counterp += 1;
+}
+
+/*
+ * Report on free space in the segment: the number of free atoms,
+ * the number of free chunks, and the size of the largest one.
+ */
+void
+pa_mmap_free_space (pa_mmap_t *pmp, uint32_t *atomsp, uint32_t *chunksp,
+		    uint32_t *largestp);
+
 void
 pa_mmap_dump (pa_mmap_t *pmp, psu_boolean_t full);
 
+/*
+ * A segment opened with PMF_SHARED has one writer (which holds an
+ * exclusive flock on the file) and any number of readers, opened
+ * with PMF_SHARED | PMF_READ_ONLY.  The writer brackets its changes
+ * with pa_mmap_write_begin/end, which bump a sequence number in
+ * the segment header.  Readers use a seqlock pattern:
+ *
+ *     do {
+ *         seq = pa_mmap_read_begin(pmp);
+ *         ... look at the segment ...
+ *     } while (pa_mmap_read_retry(pmp, seq));
+ *
+ * Readers never block the writer.
+ */
+void
+pa_mmap_write_begin (pa_mmap_t *pmp);
+
+void
+pa_mmap_write_end (pa_mmap_t *pmp);
+
+uint32_t
+pa_mmap_read_begin (pa_mmap_t *pmp);
+
+psu_boolean_t
+pa_mmap_read_retry (pa_mmap_t *pmp, uint32_t seq);
+
+uint32_t
+pa_mmap_epoch (pa_mmap_t *pmp);
+
+int
+pa_mmap_refresh (pa_mmap_t *pmp);
+
+/*
+ * A segment opened with PMF_PRIVATE is a copy-on-write view of an
+ * existing file: it can be written and grown like any segment, but
+ * the changes (and any growth, which comes from anonymous memory)
+ * stay in this process, and the file itself is never touched.  Pages
+ * we haven't written are shared with the file, so many processes
+ * can use a large segment while only paying for what they change.
+ * Changes made to the file while we have it open may or may not be
+ * seen, so the caller should keep writers away (e.g. with flock).
+ */
+
+/*
+ * A segment opened with PMF_CHECKPOINT records whether it has changed
+ * since the last call to pa_mmap_checkpoint().  A writer that opens
+ * a segment that was not checkpointed after its last change (e.g.
+ * after a crash) gets a failure, and should rebuild the segment.
+ * Changes made directly to allocated memory are only seen if they
+ * are bracketed by pa_mmap_write_begin/end, or follow an allocation
+ * made since the last checkpoint.  pa_mmap_close() checkpoints an
+ * unclean segment.
+ */
+int
+pa_mmap_checkpoint (pa_mmap_t *pmp);
+
+uint32_t
+pa_mmap_generation (pa_mmap_t *pmp);
+
+/*
+ * A segment opened with PMF_JOURNAL keeps a redo journal in
+ * "<filename>.journal".  The file is mapped copy-on-write, so our
+ * changes reach it only thru the journal.  Every page changed since
+ * the last pa_mmap_commit() must be marked with pa_mmap_touch(); a
+ * commit turns those pages into one transaction.  Transactions are
+ * written in groups ("journal-group" of them) with a single fsync,
+ * or when pa_mmap_sync() is called.  pa_mmap_checkpoint() commits,
+ * syncs and copies the journal into the file, which also happens at
+ * pa_mmap_open() and when the journal reaches "journal-size" bytes.
+ * A crash loses the transactions that weren't synced, but never
+ * part of one.
+ *
+ * The allocators mark the pages they change, but callers must mark
+ * changes they make to allocated memory themselves.  A journaled
+ * segment has a single writer and can't be PMF_SHARED or PMF_PRIVATE;
+ * PMF_READ_ONLY ignores the journal and sees the last checkpoint.
+ */
+void
+pa_mmap_touch_pages (pa_mmap_t *pmp, const void *ptr, size_t len);
+
+static inline void
+pa_mmap_touch (pa_mmap_t *pmp, const void *ptr, size_t len)
+{
+    if (pmp->pm_journal)
+	pa_mmap_touch_pages(pmp, ptr, len);
+}
+
+int
+pa_mmap_commit (pa_mmap_t *pmp);
+
+int
+pa_mmap_sync (pa_mmap_t *pmp);
+
 #endif /* PARROTDB_PAMMAP_H */
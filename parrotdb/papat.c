@@ -143,8 +143,12 @@ pa_pat_search (pa_pat_t *root, uint16_t keylen, const uint8_t *key)
     uint16_t bit = PA_PAT_NOBIT;
     pa_pat_atom_t atom = root->pp_root;
     pa_pat_node_t *node = pa_pat_node(root, atom);
+    psu_boolean_t prefetch = (root->pp_flags & PPF_PREFETCH);
 
     while (bit < node->ppn_bit) {
+	if (prefetch)
+	    pa_pat_prefetch_children(root, node);
+
 	bit = node->ppn_bit;
 	if (bit < keylen && pat_key_test(key, bit)) {
 	    atom = node->ppn_right;
@@ -233,9 +237,13 @@ pa_pat_root_init (pa_pat_t *root, pa_pat_info_t *ppip, pa_mmap_t *pmp,
 	root = pa_pat_root_alloc();
 
     if (root) {
+	/*
+	 * A fresh header is zeroed, so the root is already null; if
+	 * we're reopening an existing file, we want to keep it.
+	 */
 	root->pp_infop = ppip;
-	root->pp_root = pa_pat_null_atom();
-	root->pp_key_bytes = klen;
+	if (root->pp_key_bytes != klen) /* Header may be read-only */
+	    root->pp_key_bytes = klen;
 
 	root->pp_mmap = pmp;
 	root->pp_nodes = nodes;
@@ -247,10 +255,10 @@ pa_pat_root_init (pa_pat_t *root, pa_pat_info_t *ppip, pa_mmap_t *pmp,
 }
 
 const uint8_t *
-pa_pat_istr_key_func (pa_pat_t *pp, pa_pat_node_t *node)
+pa_pat_istr_key_func (pa_pat_t *pp, pa_pat_data_atom_t datom)
 {
     /* Need to "convert" the data atom to an istr data */
-    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(node->ppn_data));
+    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(datom));
     return (const uint8_t *) pa_istr_atom_string(pp->pp_data, atom);
 }
 
@@ -362,6 +370,9 @@ pa_pat_add_node (pa_pat_t *root, pa_pat_atom_t atom, pa_pat_node_t *node)
     assert((node->ppn_bit == PA_PAT_NOBIT) &&
 	   pa_pat_is_null(node->ppn_right) &&
 	   pa_pat_is_null(node->ppn_left));
+
+    /* We change the new node and one link above it */
+    pa_mmap_touch(root->pp_mmap, node, sizeof(*node));
   
     if (node->ppn_length == PA_PAT_NOBIT)
 	node->ppn_length = pa_pat_length_to_bit(root->pp_key_bytes);
@@ -433,6 +444,7 @@ pa_pat_add_node (pa_pat_t *root, pa_pat_atom_t atom, pa_pat_node_t *node)
 	node->ppn_left = atom;
     }
 
+    pa_mmap_touch(root->pp_mmap, ptr, sizeof(*ptr));
     *ptr = atom;
     return TRUE;
 }
@@ -451,6 +463,167 @@ pa_pat_add (pa_pat_t *root, pa_pat_data_atom_t datom, uint16_t key_bytes)
     return pa_pat_add_node(root, atom, node);
 }
 
+/*
+ * pa_pat_bulk_load()
+ * Build a tree from an array of data atoms whose keys are sorted in
+ * ascending tree order (memcmp order; for strings, strcmp order).
+ * The tree must be empty.  Instead of a search and mismatch per key,
+ * we need a single mismatch between each pair of neighbors: the bit
+ * where keys i and i+1 first differ is where the tree splits them.
+ * The splits form a Cartesian tree (smallest bit on top), which we
+ * build with a stack in one pass.  The split between i and i+1 lives
+ * in key i+1's node, which is always inside that split's subtree, and
+ * key 0's node becomes the no-bit node.
+ *
+ * With PPF_PACKED, nodes are allocated in breadth-first order, so
+ * sibling nodes are neighbors and share a cache line.
+ *
+ * 'lengths' gives the key length for each atom; if NULL, the root's
+ * key length is used for all of them.  Returns FALSE if the keys are
+ * not strictly ascending (or are prefixes of one another) or if we
+ * run out of nodes, leaving the tree empty.
+ */
+psu_boolean_t
+pa_pat_bulk_load (pa_pat_t *root, const pa_pat_data_atom_t *datoms,
+		  const uint16_t *lengths, uint32_t count)
+{
+    pa_pat_atom_t *atoms = NULL;
+    uint16_t *bits = NULL;
+    uint32_t *left = NULL, *right = NULL, *stack = NULL;
+    uint32_t i, depth = 0, top;
+    psu_boolean_t rc = FALSE;
+
+    if (!pa_pat_is_null(root->pp_root))
+	return FALSE;
+    if (count == 0)
+	return TRUE;
+
+    /*
+     * Child links are key numbers (for leaves) or split numbers (for
+     * internal nodes); the high bit tells which.  Split j lives in
+     * node j+1; leaf k is node k.
+     */
+#define PAT_BULK_SPLIT 0x80000000U
+#define PAT_BULK_NODE(_l) \
+    (((_l) & ~PAT_BULK_SPLIT) + !!((_l) & PAT_BULK_SPLIT))
+#define PAT_BULK_LEN(_i) \
+    pa_pat_length_to_bit(lengths ? lengths[_i] : root->pp_key_bytes)
+
+    atoms = psu_calloc(count * sizeof(*atoms));
+    bits = psu_calloc(count * sizeof(*bits));
+    left = psu_calloc(count * sizeof(*left));
+    right = psu_calloc(count * sizeof(*right));
+    stack = psu_calloc(count * sizeof(*stack));
+    if (!atoms || !bits || !left || !right || !stack)
+	goto done;
+
+    for (i = 0; i < count; i++)
+	if (pa_pat_data_is_null(datoms[i]))
+	    goto done;
+
+    for (i = 0; i + 1 < count; i++) {
+	uint16_t l1 = PAT_BULK_LEN(i), l2 = PAT_BULK_LEN(i + 1);
+	uint16_t bit = (l1 < l2) ? l1 : l2;
+	const uint8_t *k1 = root->pp_key_func(root, datoms[i]);
+	const uint8_t *k2 = root->pp_key_func(root, datoms[i + 1]);
+	if (k1 == NULL || k2 == NULL)
+	    goto done;
+
+	/* Duplicates, prefixes, or out of order keys are fatal */
+	uint16_t diff_bit = pa_pat_mismatch(k1, k2, bit);
+	if (diff_bit >= bit || !pat_key_test(k2, diff_bit))
+	    goto done;
+
+	/* Pop splits that test later bits; they sit to our left */
+	bits[i] = diff_bit;
+	left[i] = i;
+	while (depth > 0 && bits[stack[depth - 1]] > diff_bit)
+	    left[i] = stack[--depth] | PAT_BULK_SPLIT;
+
+	if (depth > 0)
+	    right[stack[depth - 1]] = i | PAT_BULK_SPLIT;
+
+	right[i] = i + 1;
+	stack[depth++] = i;
+    }
+
+    top = (count == 1) ? 0 : stack[0] + 1; /* Node at the top of the tree */
+
+    /*
+     * Allocate our nodes.  For a packed tree, we walk the splits
+     * breadth first (using the stack as a queue), so that each pair
+     * of internal children is allocated together.
+     */
+    if (root->pp_flags & PPF_PACKED) {
+	uint32_t head = 0, tail = 0;
+
+	stack[tail++] = top;
+	while (head < tail) {
+	    uint32_t n = stack[head++];
+
+	    if (pa_pat_node_alloc(root, datoms[n],
+				  lengths ? lengths[n] : 0, &atoms[n]) == NULL)
+		goto fail;
+
+	    if (n == 0)
+		continue;	/* The no-bit node has no children */
+
+	    if (left[n - 1] & PAT_BULK_SPLIT)
+		stack[tail++] = PAT_BULK_NODE(left[n - 1]);
+	    if (right[n - 1] & PAT_BULK_SPLIT)
+		stack[tail++] = PAT_BULK_NODE(right[n - 1]);
+	}
+
+	/* The no-bit node is a leaf; it goes last, unless it's on top */
+	if (top != 0 && pa_pat_node_alloc(root, datoms[0],
+			      lengths ? lengths[0] : 0, &atoms[0]) == NULL)
+	    goto fail;
+
+    } else {
+	for (i = 0; i < count; i++)
+	    if (pa_pat_node_alloc(root, datoms[i],
+				  lengths ? lengths[i] : 0, &atoms[i]) == NULL)
+		goto fail;
+    }
+
+    /* Now turn our splits into links between nodes */
+    for (i = 0; i + 1 < count; i++) {
+	pa_pat_node_t *node = pa_pat_node(root, atoms[i + 1]);
+
+	node->ppn_length = PAT_BULK_LEN(i + 1);
+	node->ppn_bit = bits[i];
+	node->ppn_left = atoms[PAT_BULK_NODE(left[i])];
+	node->ppn_right = atoms[PAT_BULK_NODE(right[i])];
+    }
+
+    /* Key zero is the no-bit node, which links to itself */
+    pa_pat_node_t *node = pa_pat_node(root, atoms[0]);
+    node->ppn_length = PAT_BULK_LEN(0);
+    node->ppn_left = node->ppn_right = atoms[0];
+    node->ppn_bit = PA_PAT_NOBIT;
+
+    root->pp_root = atoms[top];
+    rc = TRUE;
+    goto done;
+
+ fail:
+    for (i = 0; i < count; i++)
+	if (!pa_pat_is_null(atoms[i]))
+	    pa_fixed_free_atom(root->pp_nodes, pa_pat_to_fixed(atoms[i]));
+
+ done:
+    psu_free(stack);
+    psu_free(right);
+    psu_free(left);
+    psu_free(bits);
+    psu_free(atoms);
+
+#undef PAT_BULK_LEN
+#undef PAT_BULK_NODE
+#undef PAT_BULK_SPLIT
+    return rc;
+}
+
 /*
  * pa_pat_get()
  * Given a key and its length, find a node which matches.
@@ -461,27 +634,27 @@ pa_pat_get (pa_pat_t *root, uint16_t key_bytes, const void *key)
     return pa_pat_get_inline(root, key_bytes, key);
 }
 
-#ifdef NOT_YET
 /*
- * pa_pat_delete()
- * Delete a node from a patricia tree.
+ * Remove a node from a patricia tree, returning the atom it lived in
+ * (or a null atom if it wasn't found).  The node itself isn't freed.
  */
-psu_boolean_t
-pa_pat_delete_node (pa_pat_t *root, pa_atom_t atom)
+static pa_pat_atom_t
+pa_pat_unlink (pa_pat_t *root, pa_pat_node_t *node)
 {
     uint16_t bit;
     const uint8_t *key;
-    pa_atom_t *downptr, *upptr, *parent, current;
-    pa_pat_node_t *node = pa_pat_node(root, atom);
+    pa_pat_atom_t *downptr, *upptr, *parent, current, upatom;
+    pa_pat_node_t *cur_node, *up_node;
 
     /*
      * Is there even a tree?  Is the node in a tree?
      */
-    assert(node->ppn_left && node->ppn_right);
+    assert(!pa_pat_is_null(node->ppn_left)
+	   && !pa_pat_is_null(node->ppn_right));
 
     current = root->pp_root;
-    if (!current)
-	return FALSE;
+    if (pa_pat_is_null(current))
+	return pa_pat_null_atom();
 
     /*
      * Waltz down the tree, finding our node.  There should be two pointers
@@ -497,27 +670,28 @@ pa_pat_delete_node (pa_pat_t *root, pa_atom_t atom)
     parent = &root->pp_root;
     bit = PA_PAT_NOBIT;
     key = pa_pat_key(root, node);
+    cur_node = pa_pat_node(root, current);
 
-    while (bit < current->ppn_bit) {
-	bit = current->ppn_bit;
-	if (current == node) {
+    while (bit < cur_node->ppn_bit) {
+	bit = cur_node->ppn_bit;
+	if (cur_node == node)
 	    downptr = parent;
-	}
 	upptr = parent;
 	if (bit < node->ppn_length && pat_key_test(key, bit)) {
-	    parent = &current->ppn_right;
+	    parent = &cur_node->ppn_right;
 	} else {
-	    parent = &current->ppn_left;
+	    parent = &cur_node->ppn_left;
 	}
 	current = *parent;
+	cur_node = pa_pat_node(root, current);
     }
 
     /*
      * If the guy we found, `current', is not our node then it isn't
      * in the tree.
      */
-    if (current != node)
-	return FALSE;
+    if (cur_node != node)
+	return pa_pat_null_atom();
 
     /*
      * If there's no upptr we're the only thing in the tree.
@@ -525,7 +699,8 @@ pa_pat_delete_node (pa_pat_t *root, pa_atom_t atom)
      */
     if (upptr == NULL) {
 	assert(node->ppn_bit == PA_PAT_NOBIT);
-	root->pp_root = NULL;
+	root->pp_root = pa_pat_null_atom();
+
     } else {
 	/*
 	 * One pointer in the node upptr points at points at us,
@@ -536,49 +711,115 @@ pa_pat_delete_node (pa_pat_t *root, pa_atom_t atom)
 	 * we're trying to remove, in which case we're all done.  If
 	 * not, however, we'll catch that below.
 	 */
-	current = *upptr;
-	if (parent == &current->ppn_left) {
-	    *upptr = current->ppn_right;
+	upatom = *upptr;
+	up_node = pa_pat_node(root, upatom);
+	pa_mmap_touch(root->pp_mmap, upptr, sizeof(*upptr));
+	pa_mmap_touch(root->pp_mmap, up_node, sizeof(*up_node));
+	if (parent == &up_node->ppn_left) {
+	    *upptr = up_node->ppn_right;
 	} else {
-	    *upptr = current->ppn_left;
+	    *upptr = up_node->ppn_left;
 	}
 
-	if (!downptr) {
+	if (downptr == NULL) {
 	    /*
 	     * We were the no-bit node.  We make our parent the
 	     * no-bit node.
 	     */
 	    assert(node->ppn_bit == PA_PAT_NOBIT);
-	    current->ppn_left = current->ppn_right = current;
-	    current->ppn_bit = PA_PAT_NOBIT;
+	    up_node->ppn_left = up_node->ppn_right = upatom;
+	    up_node->ppn_bit = PA_PAT_NOBIT;
 
-	} else if (current != node) {
+	} else if (up_node != node) {
 	    /*
 	     * We were not our own `up node', which means we need to
 	     * remove ourselves from the tree as in internal node.  Replace
-	     * us with `current', which we freed above.
+	     * us with `up_node', which we freed above.
 	     */
-	    current->ppn_left = node->ppn_left;
-	    current->ppn_right = node->ppn_right;
-	    current->ppn_bit = node->ppn_bit;
-	    *downptr = current;
+	    up_node->ppn_left = node->ppn_left;
+	    up_node->ppn_right = node->ppn_right;
+	    up_node->ppn_bit = node->ppn_bit;
+	    pa_mmap_touch(root->pp_mmap, downptr, sizeof(*downptr));
+	    *downptr = upatom;
 	}
     }
 
     /*
      * Clean out the node.
      */
-    node->ppn_left = node->ppn_right = NULL;
+    pa_mmap_touch(root->pp_mmap, node, sizeof(*node));
+    node->ppn_left = node->ppn_right = pa_pat_null_atom();
     node->ppn_bit = PA_PAT_NOBIT;
 
-    return TRUE;
+    return current;
 }
 
+/*
+ * pa_pat_delete()
+ * Delete a node from a patricia tree.
+ */
 psu_boolean_t
-pa_pat_delete (pa_pat_t *root, void *key, uint16_t key_bytes)
+pa_pat_delete (pa_pat_t *root, pa_pat_node_t *node)
 {
+    return !pa_pat_is_null(pa_pat_unlink(root, node));
+}
+
+/*
+ * Compare a node's key with a given key, in tree order.
+ */
+static int
+pa_pat_compare_key (pa_pat_t *root, pa_pat_node_t *node,
+		    uint16_t key_bytes, const uint8_t *key)
+{
+    uint16_t bit_len = pa_pat_length_to_bit(key_bytes);
+    uint16_t bit = (node->ppn_length < bit_len) ? node->ppn_length : bit_len;
+    const uint8_t *node_key = pa_pat_key(root, node);
+    uint16_t diff_bit = pa_pat_mismatch(node_key, key, bit);
+
+    if (diff_bit >= bit) {
+	if (node->ppn_length == bit_len)
+	    return 0;
+	return (node->ppn_length < bit_len) ? -1 : 1;
+    }
+
+    return pat_key_test(node_key, diff_bit) ? 1 : -1;
+}
+
+/*
+ * pa_pat_delete_range()
+ * Delete (and free) every node whose key lies between lo and hi,
+ * inclusive.  A NULL lo starts at the beginning of the tree; a NULL
+ * hi runs to the end.  Returns the number of nodes deleted.
+ */
+uint32_t
+pa_pat_delete_range (pa_pat_t *root, uint16_t lo_bytes, const void *lo,
+		     uint16_t hi_bytes, const void *hi)
+{
+    pa_pat_node_t *node, *next;
+    pa_pat_atom_t atom;
+    uint32_t count = 0;
+
+    node = lo ? pa_pat_getnext(root, lo_bytes, lo, TRUE)
+	: pa_pat_find_next(root, NULL);
+
+    while (node != NULL) {
+	if (hi && pa_pat_compare_key(root, node, hi_bytes, hi) > 0)
+	    break;
+
+	/* Find our successor before we tear the node out */
+	next = pa_pat_find_next(root, node);
+
+	atom = pa_pat_unlink(root, node);
+	if (pa_pat_is_null(atom))
+	    break;		/* Should not occur */
+
+	pa_fixed_free_atom(root->pp_nodes, pa_pat_to_fixed(atom));
+	count += 1;
+	node = next;
+    }
+
+    return count;
 }
-#endif /* 0 */
 
 /*
  * pa_pat_find_next()
@@ -873,6 +1114,189 @@ pa_pat_subtree_next (pa_pat_t *root, pa_pat_node_t *node, uint16_t plen)
 				pa_pat_node(root, node->ppn_right));
 }
 
+/*
+ * Cursors.  The stack holds the right-hand subtrees we passed on the
+ * way down, deepest last; the in-order successor of a leaf is the
+ * leftmost node of the subtree on top, exactly as pa_pat_find_next()
+ * finds it from the last left turn.  Bits strictly increase along any
+ * path, so the stack can't be deeper than the number of bits in the
+ * longest key.
+ */
+static psu_boolean_t
+pa_pat_cursor_init (pa_pat_cursor_t *ppcp, pa_pat_t *root)
+{
+    bzero(ppcp, sizeof(*ppcp));
+    ppcp->ppc_root = root;
+    ppcp->ppc_max = root->pp_key_bytes * PA_NBBY + 1;
+    ppcp->ppc_stack = psu_calloc(ppcp->ppc_max * sizeof(*ppcp->ppc_stack));
+
+    return (ppcp->ppc_stack != NULL);
+}
+
+static inline void
+pa_pat_cursor_push (pa_pat_cursor_t *ppcp, pa_pat_atom_t atom, uint16_t bit)
+{
+    assert(ppcp->ppc_depth < ppcp->ppc_max);
+
+    ppcp->ppc_stack[ppcp->ppc_depth].ppcf_atom = atom;
+    ppcp->ppc_stack[ppcp->ppc_depth].ppcf_bit = bit;
+    ppcp->ppc_depth += 1;
+}
+
+/*
+ * Walk down the left edge of a subtree, stacking the right turns we
+ * don't take, and return the leftmost node.
+ */
+static inline pa_pat_node_t *
+pa_pat_cursor_descend (pa_pat_cursor_t *ppcp, pa_pat_atom_t atom,
+		       uint16_t bit)
+{
+    pa_pat_t *root = ppcp->ppc_root;
+    pa_pat_node_t *node = pa_pat_node(root, atom);
+
+    while (node && bit < node->ppn_bit) {
+	pa_prefetch(pa_pat_node(root, node->ppn_left));
+	pa_pat_cursor_push(ppcp, node->ppn_right, node->ppn_bit);
+	bit = node->ppn_bit;
+	node = pa_pat_node(root, node->ppn_left);
+    }
+
+    return node;
+}
+
+/*
+ * Build the stack for a walk starting at "target", by searching down
+ * for it and stacking each right turn we don't take
+ */
+static void
+pa_pat_cursor_seek (pa_pat_cursor_t *ppcp, pa_pat_node_t *target)
+{
+    pa_pat_t *root = ppcp->ppc_root;
+    pa_pat_node_t *cur_node = pa_pat_node(root, root->pp_root);
+    const uint8_t *key = pa_pat_key(root, target);
+    uint16_t bit = PA_PAT_NOBIT;
+
+    while (bit < cur_node->ppn_bit) {
+	bit = cur_node->ppn_bit;
+	if (bit < target->ppn_length && pat_key_test(key, bit)) {
+	    cur_node = pa_pat_node(root, cur_node->ppn_right);
+	} else {
+	    pa_pat_cursor_push(ppcp, cur_node->ppn_right, bit);
+	    cur_node = pa_pat_node(root, cur_node->ppn_left);
+	}
+    }
+
+    assert(cur_node == target);
+    ppcp->ppc_next = target;
+}
+
+psu_boolean_t
+pa_pat_cursor_range (pa_pat_cursor_t *ppcp, pa_pat_t *root,
+		     uint16_t lo_bytes, const void *lo,
+		     uint16_t hi_bytes, const void *hi)
+{
+    pa_pat_node_t *node;
+
+    if (!pa_pat_cursor_init(ppcp, root))
+	return FALSE;
+
+    if (hi) {
+	assert(hi_bytes && hi_bytes <= PA_PAT_MAXKEY);
+	memcpy(ppcp->ppc_hi, hi, hi_bytes);
+	ppcp->ppc_hi_bytes = hi_bytes;
+    }
+
+    if (pa_pat_is_null(root->pp_root))
+	return TRUE;
+
+    if (lo == NULL) {
+	ppcp->ppc_next = pa_pat_cursor_descend(ppcp, root->pp_root,
+					       PA_PAT_NOBIT);
+	return TRUE;
+    }
+
+    node = pa_pat_getnext(root, lo_bytes, lo, TRUE);
+    if (node)
+	pa_pat_cursor_seek(ppcp, node);
+
+    return TRUE;
+}
+
+psu_boolean_t
+pa_pat_cursor_subtree (pa_pat_cursor_t *ppcp, pa_pat_t *root,
+		       uint16_t plen, const void *prefix)
+{
+    pa_pat_node_t *node;
+
+    if (!pa_pat_cursor_init(ppcp, root))
+	return FALSE;
+
+    ppcp->ppc_prefix_bit = pa_pat_plen_to_bit(plen);
+
+    node = pa_pat_subtree_match(root, plen, prefix);
+    if (node)
+	pa_pat_cursor_seek(ppcp, node);
+
+    return TRUE;
+}
+
+unsigned
+pa_pat_cursor_next (pa_pat_cursor_t *ppcp, pa_pat_data_atom_t *datoms,
+		    unsigned max)
+{
+    pa_pat_t *root = ppcp->ppc_root;
+    pa_pat_node_t *node = ppcp->ppc_next;
+    pa_pat_cursor_frame_t *framep;
+    unsigned count = 0;
+
+    while (node && count < max) {
+	if (ppcp->ppc_hi_bytes
+		&& pa_pat_compare_key(root, node, ppcp->ppc_hi_bytes,
+				      ppcp->ppc_hi) > 0) {
+	    node = NULL;
+	    break;
+	}
+
+	datoms[count++] = node->ppn_data;
+
+	/*
+	 * Off to the next subtree.  A turn at a bit inside the prefix
+	 * leads out of the subtree, and so does everything under it.
+	 */
+	if (ppcp->ppc_depth == 0) {
+	    node = NULL;
+	    break;
+	}
+
+	framep = &ppcp->ppc_stack[--ppcp->ppc_depth];
+	if (framep->ppcf_bit < ppcp->ppc_prefix_bit) {
+	    ppcp->ppc_depth = 0;
+	    node = NULL;
+	    break;
+	}
+
+	node = pa_pat_cursor_descend(ppcp, framep->ppcf_atom,
+				     framep->ppcf_bit);
+
+	/* Start on the subtree after this one while the caller is busy */
+	if (ppcp->ppc_depth)
+	    pa_prefetch(pa_pat_node(root,
+			ppcp->ppc_stack[ppcp->ppc_depth - 1].ppcf_atom));
+    }
+
+    ppcp->ppc_next = node;
+    return count;
+}
+
+void
+pa_pat_cursor_close (pa_pat_cursor_t *ppcp)
+{
+    psu_free(ppcp->ppc_stack);
+    ppcp->ppc_stack = NULL;
+    ppcp->ppc_depth = ppcp->ppc_max = 0;
+    ppcp->ppc_next = NULL;
+}
+
 
 /*
  * pa_pat_getnext()
@@ -958,6 +1382,7 @@ pa_pat_getnext (pa_pat_t *root, uint16_t klen,
 	if (lastleft_node && lastleft_node->ppn_bit > diff_bit) {
 	    bit = PA_PAT_NOBIT;
 	    current = root->pp_root;
+	    cur_node = pa_pat_node(root, current);
 	    lastleft = pa_pat_null_atom();
 	    while (bit < cur_node->ppn_bit && cur_node->ppn_bit < diff_bit) {
 		bit = cur_node->ppn_bit;
@@ -77,8 +77,13 @@ typedef struct pa_pat_node_s {
 typedef struct pa_pat_info_s {
     pa_pat_atom_t ppi_root;	/**< root patricia node (atom) */
     uint16_t ppi_key_bytes;	/**< (maximum) key length in bytes */
+    uint16_t ppi_flags;		/**< Flags (in the padding) */
 } pa_pat_info_t;
 
+/* Flags for ppi_flags: */
+#define PPF_PREFETCH	(1<<0)	/* Prefetch child nodes during lookups */
+#define PPF_PACKED	(1<<1)	/* Bulk loads lay out nodes breadth first */
+
 struct pa_pat_s;		/* Forward declaration */
 typedef const psu_byte_t *(*pa_pat_key_func_t)(struct pa_pat_s *,
 					       pa_pat_data_atom_t);
@@ -94,6 +99,19 @@ typedef struct pa_pat_s {
 /* Shorthand for fields */
 #define pp_root pp_infop->ppi_root
 #define pp_key_bytes pp_infop->ppi_key_bytes
+#define pp_flags pp_infop->ppi_flags
+
+static inline void
+pa_pat_set_flags (pa_pat_t *ppp, uint16_t flags)
+{
+    ppp->pp_flags |= flags;
+}
+
+static inline void
+pa_pat_clear_flags (pa_pat_t *ppp, uint16_t flags)
+{
+    ppp->pp_flags &= ~flags;
+}
 
 static inline pa_fixed_atom_t
 pa_pat_to_fixed (pa_pat_atom_t atom)
@@ -135,6 +153,18 @@ pa_pat_node_data (pa_pat_t *root UNUSED, pa_pat_node_t *node)
     return node ? node->ppn_data : pa_pat_data_null_atom();
 }
 
+/*
+ * Start pulling both children of a node into the cache.  Whichever
+ * way the next bit test goes, its node will be on the way; this
+ * overlaps the dependent miss with the work at the current level.
+ */
+static inline void
+pa_pat_prefetch_children (pa_pat_t *root, pa_pat_node_t *node)
+{
+    pa_prefetch(pa_pat_node(root, node->ppn_left));
+    pa_prefetch(pa_pat_node(root, node->ppn_right));
+}
+
 /**
  * @brief
  * Initializes a patricia tree root.
@@ -158,7 +188,7 @@ pa_pat_root_init (pa_pat_t *root, pa_pat_info_t *ppip, pa_mmap_t *pmp,
 		  pa_pat_key_func_t key_func, uint16_t klen);
 
 const psu_byte_t *
-pa_pat_istr_key_func (pa_pat_t *pp, pa_pat_node_t *node);
+pa_pat_istr_key_func (pa_pat_t *pp, pa_pat_data_atom_t datom);
 
 /*
  * Add a node to the patricia tree.
@@ -229,6 +259,53 @@ pa_pat_add (pa_pat_t *root, pa_pat_data_atom_t datom, uint16_t key_bytes);
 psu_boolean_t
 pa_pat_delete (pa_pat_t *root, pa_pat_node_t *node);
 
+/**
+ * @brief
+ * Deletes all nodes with keys between @c lo and @c hi (inclusive),
+ * freeing the patricia nodes.  The data atoms are untouched.
+ *
+ * @param[in] root
+ *     Pointer to patricia tree root
+ * @param[in] lo_bytes
+ *     Number of bytes in the low key
+ * @param[in] lo
+ *     Low key, or NULL to start at the smallest key
+ * @param[in] hi_bytes
+ *     Number of bytes in the high key
+ * @param[in] hi
+ *     High key, or NULL to run to the largest key
+ *
+ * @return
+ *     The number of nodes deleted.
+ */
+uint32_t
+pa_pat_delete_range (pa_pat_t *root, uint16_t lo_bytes, const void *lo,
+		     uint16_t hi_bytes, const void *hi);
+
+/**
+ * @brief
+ * Builds a tree in one pass from data atoms whose keys are sorted in
+ * ascending order.  The tree must be empty.
+ *
+ * @param[in] root
+ *     Pointer to patricia tree root
+ * @param[in] datoms
+ *     Array of data atoms, sorted by key
+ * @param[in] lengths
+ *     Key length (in bytes) of each atom, or NULL to use the root's
+ *     key length for all of them
+ * @param[in] count
+ *     Number of atoms
+ *
+ * @return
+ *     @c TRUE if the tree was built;
+ *     @c FALSE if the keys aren't strictly ascending (or overlap), or
+ *     nodes can't be allocated, in which case the tree is left empty.
+ */
+psu_boolean_t
+pa_pat_bulk_load (pa_pat_t *root, const pa_pat_data_atom_t *datoms,
+		  const uint16_t *lengths, uint32_t count);
+
 /**
  * @brief
  * Given a node in the tree, find the node with the next numerically larger
@@ -318,6 +395,105 @@ pa_pat_node_t *
 pa_pat_subtree_next (pa_pat_t *root, pa_pat_node_t *node,
 		     uint16_t prefix_len);
 
+/**
+ * @brief
+ * A cursor for walking a key range or a prefix subtree in order.
+ *
+ * pa_pat_find_next() and pa_pat_subtree_next() search down from the
+ * root for every node they return.  A cursor instead keeps the right
+ * turns it hasn't taken yet on a stack, so each step is a pop and a
+ * walk down the left edge of one subtree, and it prefetches the next
+ * subtree while the caller works on this batch.  The cursor is only
+ * good while the tree is unchanged; adding or deleting nodes means
+ * opening it again (from the last key seen, for a range).
+ */
+typedef struct pa_pat_cursor_frame_s {
+    pa_pat_atom_t ppcf_atom;	/**< Subtree still to be visited */
+    uint16_t ppcf_bit;		/**< Bit tested by its parent */
+} pa_pat_cursor_frame_t;
+
+typedef struct pa_pat_cursor_s {
+    pa_pat_t *ppc_root;		/**< Tree being walked */
+    pa_pat_node_t *ppc_next;	/**< Next node to return (or NULL) */
+    pa_pat_cursor_frame_t *ppc_stack; /**< Right turns not yet taken */
+    unsigned ppc_depth;		/**< Frames on ppc_stack */
+    unsigned ppc_max;		/**< Frames allocated */
+    uint16_t ppc_prefix_bit;	/**< Subtree's prefix (patricia bit format) */
+    uint16_t ppc_hi_bytes;	/**< Length of ppc_hi (zero for no limit) */
+    uint8_t ppc_hi[PA_PAT_MAXKEY]; /**< Last key in the range */
+} pa_pat_cursor_t;
+
+/**
+ * @brief
+ * Opens a cursor on the nodes with keys between @c lo and @c hi
+ * (inclusive).
+ *
+ * @param[out] ppcp
+ *     Cursor to initialize
+ * @param[in] root
+ *     Pointer to patricia tree root
+ * @param[in] lo_bytes
+ *     Number of bytes in the low key
+ * @param[in] lo
+ *     Low key, or NULL to start at the smallest key
+ * @param[in] hi_bytes
+ *     Number of bytes in the high key
+ * @param[in] hi
+ *     High key, or NULL to run to the largest key
+ *
+ * @return
+ *     @c TRUE on success; @c FALSE if memory for the cursor can't be had.
+ */
+psu_boolean_t
+pa_pat_cursor_range (pa_pat_cursor_t *ppcp, pa_pat_t *root,
+		     uint16_t lo_bytes, const void *lo,
+		     uint16_t hi_bytes, const void *hi);
+
+/**
+ * @brief
+ * Opens a cursor on the nodes whose keys start with the given prefix
+ *
+ * @param[out] ppcp
+ *     Cursor to initialize
+ * @param[in] root
+ *     Pointer to patricia tree root
+ * @param[in] prefix_len
+ *     Length of prefix, in bits
+ * @param[in] prefix
+ *     Pointer to prefix
+ *
+ * @return
+ *     @c TRUE on success; @c FALSE if memory for the cursor can't be had.
+ */
+psu_boolean_t
+pa_pat_cursor_subtree (pa_pat_cursor_t *ppcp, pa_pat_t *root,
+		       uint16_t prefix_len, const void *prefix);
+
+/**
+ * @brief
+ * Returns the data atoms of up to @c max more nodes, in key order.
+ *
+ * @param[in] ppcp
+ *     The cursor
+ * @param[out] datoms
+ *     Where to put the data atoms
+ * @param[in] max
+ *     Room in @c datoms
+ *
+ * @return
+ *     The number of atoms returned; zero once the walk is done.
+ */
+unsigned
+pa_pat_cursor_next (pa_pat_cursor_t *ppcp, pa_pat_data_atom_t *datoms,
+		    unsigned max);
+
+/**
+ * @brief
+ * Releases a cursor's stack.  The cursor may be opened again.
+ */
+void
+pa_pat_cursor_close (pa_pat_cursor_t *ppcp);
+
 /**
  * @brief
  * Looks up a node having the specified key and key length in bytes.  
@@ -644,12 +820,16 @@ pa_pat_get_inline (pa_pat_t *root, uint16_t key_bytes, const void *v_key)
      */
     bit = PA_PAT_NOBIT;
     bit_len = pa_pat_length_to_bit(key_bytes);
+    psu_boolean_t prefetch = (root->pp_flags & PPF_PREFETCH);
 
     pa_pat_node_t *node = pa_pat_node(root, current);
     while (bit < node->ppn_bit) {
 	if (node == NULL)
 	    return NULL;
 
+	if (prefetch)
+	    pa_pat_prefetch_children(root, node);
+
 	bit = node->ppn_bit;
 	if (bit < bit_len && pat_key_test(key, bit)) {
 	    current = node->ppn_right;
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Machine-readable statistics for a parrotdb segment.  We decode
+ * each named header from its persistent info, so no open handles
+ * are needed; only the counters come from the pa_mmap_t.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <stddef.h>
+
+#include <libpsu/psualloc.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/pastats.h>
+
+static const char *pa_stats_type_names[PA_TYPE_MAX] = {
+    [PA_TYPE_UNKNOWN] = "unknown",
+    [PA_TYPE_MMAP] = "mmap",
+    [PA_TYPE_FIXED] = "fixed",
+    [PA_TYPE_ARB] = "arb",
+    [PA_TYPE_ISTR] = "istr",
+    [PA_TYPE_PAT] = "pat",
+    [PA_TYPE_OPAQUE] = "opaque",
+    [PA_TYPE_TREE] = "tree",
+    [PA_TYPE_BITMAP] = "bitmap",
+    [PA_TYPE_ISTR_HASH] = "istr-hash",
+};
+
+const char *
+pa_stats_type_name (uint16_t type)
+{
+    const char *name = (type < PA_TYPE_MAX) ? pa_stats_type_names[type] : NULL;
+    return name ?: "unknown";
+}
+
+static inline unsigned
+pa_stats_percent (uint64_t part, uint64_t whole)
+{
+    return whole ? (unsigned) ((part * 100) / whole) : 0;
+}
+
+static inline uint64_t
+pa_stats_pages (uint64_t bytes)
+{
+    return (bytes + PA_MMAP_ATOM_SIZE - 1) >> PA_MMAP_ATOM_SHIFT;
+}
+
+/*
+ * Return the address of a fixed atom, using only the persistent info
+ */
+static void *
+pa_stats_fixed_addr (pa_mmap_t *pmp, pa_fixed_info_t *pfip, pa_atom_t atom)
+{
+    pa_mmap_atom_t *base = pa_mmap_addr(pmp, pfip->pfi_base);
+    pa_page_t page = atom >> pfip->pfi_shift;
+
+    if (base == NULL || atom >= pfip->pfi_max_atoms
+	    || pa_mmap_is_null(base[page]))
+	return NULL;
+
+    psu_byte_t *addr = pa_mmap_addr(pmp, base[page]);
+    return addr + (atom & ((1U << pfip->pfi_shift) - 1)) * pfip->pfi_atom_size;
+}
+
+static void
+pa_stats_fixed (pa_mmap_t *pmp, pa_fixed_info_t *pfip, pa_stats_t *psp)
+{
+    pa_mmap_atom_t *base = pa_mmap_addr(pmp, pfip->pfi_base);
+    if (base == NULL)
+	return;
+
+    pa_page_t page, max_page = pfip->pfi_max_atoms >> pfip->pfi_shift;
+    uint64_t per_page = 1U << pfip->pfi_shift;
+    uint64_t page_bytes = per_page * pfip->pfi_atom_size;
+    uint64_t held = 0;
+
+    for (page = 0; page < max_page; page++)
+	if (!pa_mmap_is_null(base[page]))
+	    held += 1;
+
+    /* Walk the free list; it ends at the first atom of an unheld page */
+    uint64_t capacity = held * per_page, free = 0;
+    pa_fixed_atom_t atom = pfip->pfi_free;
+    pa_fixed_atom_t *addr;
+
+    while (!pa_fixed_is_null(atom) && free < capacity) {
+	addr = pa_stats_fixed_addr(pmp, pfip, pa_fixed_atom_of(atom));
+	if (addr == NULL)
+	    break;
+	free += 1;
+	atom = *addr;
+    }
+
+    /* Atom zero is never handed out */
+    uint64_t reserved = (held && !pa_mmap_is_null(base[0])) ? 1 : 0;
+
+    psp->ps_in_use = capacity - free - reserved;
+    psp->ps_free = free;
+    psp->ps_pages = held * pa_stats_pages(page_bytes);
+    psp->ps_bytes = psp->ps_pages << PA_MMAP_ATOM_SHIFT;
+    psp->ps_frag = pa_stats_percent(free, capacity);
+}
+
+static void
+pa_stats_arb (pa_mmap_t *pmp, pa_arb_info_t *prip, pa_stats_t *psp)
+{
+    pa_arb_t arb = { .pr_infop = prip };
+    pa_arb_header_t *prhp;
+    pa_arb_atom_t atom;
+    uint64_t free = 0;
+    unsigned slot;
+
+    pa_arb_init(pmp, &arb);
+
+    for (slot = 0; slot <= PA_ARB_MAX_SMALL; slot++) {
+	for (atom = prip->pri_free[slot]; !pa_arb_is_null(atom);
+	     atom = prhp->prh_next_free[0]) {
+	    prhp = pa_arb_header(&arb, atom);
+	    if (prhp == NULL || prhp->prh_magic != PRH_MAGIC_SMALL_FREE)
+		break;
+	    free += 1U << (slot + PA_ARB_ATOM_SHIFT);
+	}
+    }
+
+    uint64_t small = (uint64_t) prip->pri_pages << PA_MMAP_ATOM_SHIFT;
+
+    psp->ps_pages = prip->pri_pages + prip->pri_large;
+    psp->ps_bytes = psp->ps_pages << PA_MMAP_ATOM_SHIFT;
+    psp->ps_free = free;
+    psp->ps_in_use = psp->ps_bytes - free;
+    psp->ps_frag = pa_stats_percent(free, small);
+}
+
+static void
+pa_stats_istr (pa_mmap_t *pmp, pa_istr_info_t *piip, pa_stats_t *psp)
+{
+    pa_istr_data_info_t *pidp = &piip->pii_data;
+    pa_fixed_info_t *pfip = &piip->pii_index;
+    pa_mmap_atom_t *base = pa_mmap_addr(pmp, pidp->pid_base);
+    uint64_t page_bytes = 1U << (pidp->pid_shift + pidp->pid_atom_shift);
+    pa_page_t page, max_page = pidp->pid_max_atoms >> pidp->pid_shift;
+    uint64_t bytes = 0, live_bytes = 0, live = 0, dead = 0;
+
+    if (base == NULL)
+	return;
+
+    /* The first string on each data page tells us the page's size */
+    for (page = 1; page < max_page; page++) {
+	if (pa_mmap_is_null(base[page]))
+	    continue;
+
+	const char *start = pa_mmap_addr(pmp, base[page]);
+	uint64_t size = pa_roundup32(strlen(start) + 1, page_bytes);
+	if (pidp->pid_shift > PA_MMAP_ATOM_SHIFT)
+	    size = pa_roundup_shift32(size, PA_MMAP_ATOM_SHIFT);
+
+	bytes += size;
+	psp->ps_pages += pa_stats_pages(size);
+    }
+
+    /* Index entries are handed out in order, up to the free atom */
+    pa_atom_t raw, max_index = pa_fixed_is_null(pfip->pfi_free)
+	? pfip->pfi_max_atoms : pa_fixed_atom_of(pfip->pfi_free);
+    pa_istr_data_atom_t *ap;
+
+    for (raw = 1; raw < max_index; raw++) {
+	ap = pa_stats_fixed_addr(pmp, pfip, raw);
+	if (ap == NULL)
+	    continue;
+
+	pa_atom_t da = pa_istr_data_atom_of(*ap);
+	if (pa_istr_data_is_null(*ap) || da >= pidp->pid_max_atoms
+		|| pa_mmap_is_null(base[da >> pidp->pid_shift])) {
+	    dead += 1;
+	    continue;
+	}
+
+	psu_byte_t *addr = pa_mmap_addr(pmp, base[da >> pidp->pid_shift]);
+	addr += (da & ((1U << pidp->pid_shift) - 1)) << pidp->pid_atom_shift;
+
+	live += 1;
+	live_bytes += pa_items_shift32(strlen((char *) addr) + 1,
+				       pidp->pid_atom_shift)
+	    << pidp->pid_atom_shift;
+    }
+
+    /* Count the index's own pages too */
+    pa_stats_t index;
+    bzero(&index, sizeof(index));
+    pa_stats_fixed(pmp, pfip, &index);
+
+    psp->ps_in_use = live;
+    psp->ps_free = dead;
+    psp->ps_pages += index.ps_pages;
+    psp->ps_bytes = psp->ps_pages << PA_MMAP_ATOM_SHIFT;
+    psp->ps_frag = bytes ? 100 - pa_stats_percent(live_bytes, bytes) : 0;
+}
+
+static void
+pa_stats_istr_hash (pa_mmap_t *pmp UNUSED, pa_istr_hash_info_t *pihp,
+		    pa_stats_t *psp)
+{
+    if (pa_mmap_is_null(pihp->pihi_table))
+	return;
+
+    uint64_t slots = 1U << pihp->pihi_shift;
+
+    psp->ps_in_use = pihp->pihi_count;
+    psp->ps_free = slots - pihp->pihi_count;
+    psp->ps_pages = pa_stats_pages(slots * sizeof(pa_istr_hash_slot_t));
+    psp->ps_bytes = psp->ps_pages << PA_MMAP_ATOM_SHIFT;
+    psp->ps_frag = pa_stats_percent(psp->ps_free, slots);
+}
+
+static void
+pa_stats_segment (pa_mmap_t *pmp, pa_stats_t *psp)
+{
+    uint32_t free, largest;
+
+    pa_mmap_free_space(pmp, &free, NULL, &largest);
+
+    psp->ps_type = PA_TYPE_MMAP;
+    psp->ps_bytes = pmp->pm_len;
+    psp->ps_pages = pmp->pm_len >> PA_MMAP_ATOM_SHIFT;
+    psp->ps_free = free;
+    psp->ps_in_use = psp->ps_pages - free;
+    psp->ps_frag = pa_stats_percent(free - largest, free);
+    psp->ps_allocs = pmp->pm_counters.pmc_allocs;
+    psp->ps_frees = pmp->pm_counters.pmc_frees;
+}
+
+pa_stats_t *
+pa_stats_collect (pa_mmap_t *pmp, unsigned *countp)
+{
+    unsigned count = 1, i;
+    void *header;
+
+    for (header = pa_mmap_next_header(pmp, NULL); header;
+	 header = pa_mmap_next_header(pmp, header))
+	count += 1;
+
+    pa_stats_t *stats = psu_calloc(count * sizeof(*stats));
+    if (stats == NULL)
+	return NULL;
+
+    pa_stats_segment(pmp, &stats[0]);
+
+    for (i = 1, header = pa_mmap_next_header(pmp, NULL); header && i < count;
+	 i++, header = pa_mmap_next_header(pmp, header)) {
+	pa_stats_t *psp = &stats[i];
+
+	strncpy(psp->ps_name, pa_mmap_header_name(pmp, header),
+		sizeof(psp->ps_name) - 1);
+	psp->ps_type = pa_mmap_header_type(pmp, header);
+
+	switch (psp->ps_type) {
+	case PA_TYPE_FIXED:
+	case PA_TYPE_BITMAP:
+	    pa_stats_fixed(pmp, header, psp);
+	    break;
+
+	case PA_TYPE_ARB:
+	    pa_stats_arb(pmp, header, psp);
+	    break;
+
+	case PA_TYPE_ISTR:
+	    pa_stats_istr(pmp, header, psp);
+	    break;
+
+	case PA_TYPE_ISTR_HASH:
+	    pa_stats_istr_hash(pmp, header, psp);
+	    break;
+
+	default:
+	    /* pa_pat nodes live in their own pa_fixed header */
+	    break;
+	}
+
+	pa_mmap_counters_t *pmcp = pa_mmap_counters(pmp, header);
+	if (pmcp) {
+	    psp->ps_allocs = pmcp->pmc_allocs;
+	    psp->ps_frees = pmcp->pmc_frees;
+	}
+    }
+
+    *countp = i;
+    return stats;
+}
+
+static void
+pa_stats_json_string (FILE *fp, const char *str, size_t max)
+{
+    const char *cp;
+
+    fputc('"', fp);
+    for (cp = str; *cp && cp < str + max; cp++) {
+	if (*cp == '"' || *cp == '\\')
+	    fprintf(fp, "\\%c", *cp);
+	else if ((unsigned char) *cp < 0x20)
+	    fprintf(fp, "\\u%04x", (unsigned char) *cp);
+	else
+	    fputc(*cp, fp);
+    }
+    fputc('"', fp);
+}
+
+void
+pa_stats_json (FILE *fp, const pa_stats_t *stats, unsigned count)
+{
+    unsigned i;
+
+    fprintf(fp, "{\n  \"parrotdb-stats\": [\n");
+
+    for (i = 0; i < count; i++) {
+	const pa_stats_t *psp = &stats[i];
+
+	fprintf(fp, "    { \"name\": ");
+	pa_stats_json_string(fp, psp->ps_name, sizeof(psp->ps_name));
+	fprintf(fp, ", \"type\": \"%s\", \"in-use\": %llu, \"free\": %llu, "
+		"\"pages\": %llu, \"bytes\": %llu, \"fragmentation\": %u, "
+		"\"allocs\": %llu, \"frees\": %llu }%s\n",
+		pa_stats_type_name(psp->ps_type),
+		(unsigned long long) psp->ps_in_use,
+		(unsigned long long) psp->ps_free,
+		(unsigned long long) psp->ps_pages,
+		(unsigned long long) psp->ps_bytes,
+		psp->ps_frag,
+		(unsigned long long) psp->ps_allocs,
+		(unsigned long long) psp->ps_frees,
+		(i + 1 < count) ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n}\n");
+}
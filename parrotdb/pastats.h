@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Machine-readable statistics for a parrotdb segment.
+ */
+
+#ifndef PARROTDB_PASTATS_H
+#define PARROTDB_PASTATS_H
+
+/*
+ * One record for the segment itself (with type PA_TYPE_MMAP and an
+ * empty name) and one for each named header.  Counts are in the
+ * allocator's own units: atoms for pa_mmap and pa_fixed, bytes for
+ * pa_arb, strings for pa_istr (where "free" counts freed strings) and
+ * slots for a pa_istr hash index.
+ * Fragmentation is the percentage of held memory that is free, except
+ * for the segment, where it's the percentage of free atoms outside the
+ * largest free chunk.  The alloc/free counters are kept in memory, so
+ * they only cover the calling process.
+ */
+typedef struct pa_stats_s {
+    char ps_name[PA_MMAP_HEADER_NAME_LEN]; /* Header name */
+    uint16_t ps_type;		/* Type of header (PA_TYPE_*) */
+    uint64_t ps_in_use;		/* Number of units in use */
+    uint64_t ps_free;		/* Number of units free */
+    uint64_t ps_pages;		/* Number of mmap atoms (pages) held */
+    uint64_t ps_bytes;		/* Number of bytes held (in whole pages) */
+    unsigned ps_frag;		/* Fragmentation (percent) */
+    uint64_t ps_allocs;		/* Number of allocations */
+    uint64_t ps_frees;		/* Number of frees */
+} pa_stats_t;
+
+/**
+ * Collect statistics for the segment and each of its named headers.
+ *
+ * @param[in] pmp mmap segment
+ * @param[out] countp number of records returned
+ * @return array of records, which the caller must psu_free(), or NULL
+ */
+pa_stats_t *
+pa_stats_collect (pa_mmap_t *pmp, unsigned *countp);
+
+/**
+ * Write statistics records as a JSON object
+ *
+ * @param[in] fp output file
+ * @param[in] stats records from pa_stats_collect()
+ * @param[in] count number of records
+ */
+void
+pa_stats_json (FILE *fp, const pa_stats_t *stats, unsigned count);
+
+const char *
+pa_stats_type_name (uint16_t type);
+
+#endif /* PARROTDB_PASTATS_H */
@@ -24,11 +24,31 @@
 #include <libslax/slaxdata.h>
 #include <libslax/jsonlexer.h>
 #include <libslax/jsonwriter.h>
+#include <parrotdb/pacommon.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xixml.h>
+#include <libpsu/psutime.h>
+#include <libpsu/psualloc.h>
+#include <libpsu/psuarena.h>
+#include <libpsu/psuzio.h>
 
 #include <err.h>
+#include <glob.h>
+#include <signal.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static slax_data_list_t plist;
 static int nbparams;
@@ -48,6 +68,8 @@ static char *opt_show_select;   /* Expression (in script) to show */
 static char *opt_xpath;		/* XPath expresion to match on */
 
 static int opt_html;		/* Parse input as HTML */
+static int opt_xi;		/* Parse input with libxi */
+static char *opt_xi_rules;	/* Rulebook for pruning libxi input */
 static int opt_indent;		/* Indent the output (pretty print) */
 static int opt_partial;		/* Parse partial contents */
 static int opt_debugger;	/* Invoke the debugger */
@@ -55,7 +77,22 @@ static int opt_empty_input;	/* Use an empty input file */
 static int opt_slax_output;	/* Make output in SLAX format */
 static int opt_json_tagging;	/* Tag JSON output */
 static int opt_json_flags;	/* Flags for JSON conversion */
+static int opt_json_records;	/* Convert each JSON record separately */
+static int opt_stream;		/* Convert without building a document */
+static int opt_in_place;	/* Rewrite --format inputs in place */
+static psu_zio_format_t opt_compress = PZF_AUTO; /* Output compression */
+static int opt_compress_level;	/* Compression level (zero for default) */
 static int opt_keep_text;	/* Don't add a rule to discard text values */
+static int opt_stats;		/* Dump engine counters at exit */
+static int opt_trace_ring;	/* Records in the binary trace ring */
+static unsigned opt_jobs;	/* Number of workers (--batch, --server) */
+static unsigned opt_benchmark;	/* Iterations for --benchmark */
+static int opt_benchmark_json;	/* Report --benchmark results in JSON */
+static int opt_arena;		/* Allocate from an arena (--arena) */
+static char *opt_socket;	/* Socket for --server and --client */
+static slax_data_list_t client_params; /* Raw --param values (--client) */
+static int trace_dump_fd = 2;	/* Where the trace ring is dumped */
+static int trace_dump_on_error;	/* Dump the ring if the script fails */
 
 static const char *
 get_filename (const char *filename, char ***pargv, int outp)
@@ -72,13 +109,208 @@ get_filename (const char *filename, char ***pargv, int outp)
     return filename;
 }
 
+/*
+ * Route libxml2's allocations (and libpsu's) through the arena.  This
+ * has to happen before anything is allocated, which is why main()
+ * looks for --arena before parsing the other options.  Pointers that
+ * predate the arena are still handed to free(3), so this is belt and
+ * braces rather than a strict requirement.
+ */
+static void
+arena_enable (void)
+{
+    if (psu_arena_init(0) < 0) {
+	warn("--arena: cannot reserve memory; ignored");
+	return;
+    }
+
+    if (xmlMemSetup(psu_arena_free, psu_arena_malloc, psu_arena_realloc,
+		    psu_arena_strdup)) {
+	warnx("--arena: cannot set the libxml2 allocator; ignored");
+	psu_arena_release();
+	return;
+    }
+
+    psu_set_allocator(psu_arena_realloc, psu_arena_free);
+    opt_arena = TRUE;
+}
+
+/*
+ * The one-shot modes free their documents and script on the way out.
+ * Under --arena, we skip that walk over every node, since exiting
+ * gives back the whole arena at once.
+ */
+static void
+teardown_doc (xmlDocPtr docp)
+{
+    if (!opt_arena)
+	xmlFreeDoc(docp);
+}
+
+static void
+teardown_script (xsltStylesheetPtr script)
+{
+    if (!opt_arena)
+	xsltFreeStylesheet(script);
+}
+
+/*
+ * Find the compression for an output file: the --compress format, or
+ * by default, the one its extension asks for
+ */
+static psu_zio_format_t
+output_format (const char *output)
+{
+    if (opt_compress != PZF_AUTO)
+	return opt_compress;
+    if (output == NULL || slaxFilenameIsStd(output))
+	return PZF_NONE;
+    return psu_zio_format_by_name(output);
+}
+
+/*
+ * Open an output file descriptor, for the writers that work on
+ * descriptors.  A compressed stream is attached as needed; the
+ * writers all go through psu_zio_write(), so they compress as they
+ * flush their buffers.
+ */
+static int
+open_output_fd (const char *output)
+{
+    psu_zio_format_t format = output_format(output);
+    int fd;
+
+    if (output == NULL || slaxFilenameIsStd(output)) {
+	fflush(stdout);
+	fd = fileno(stdout);
+	if (psu_zio_attach(fd, O_WRONLY, format, opt_compress_level) < 0)
+	    err(1, "could not compress standard output");
+	return fd;
+    }
+
+    fd = psu_zio_open(output, O_WRONLY, format, opt_compress_level);
+    if (fd < 0)
+	err(1, "could not open file: '%s'", output);
+
+    return fd;
+}
+
+static void
+close_output_fd (int fd)
+{
+    int rc;
+
+    if (fd == fileno(stdout))
+	rc = psu_zio_detach(fd);
+    else
+	rc = psu_zio_close(fd);
+
+    if (rc < 0)
+	err(1, "could not write output");
+}
+
+/*
+ * Open an output file as a stdio stream, compressing as needed
+ */
+static FILE *
+open_output (const char *output)
+{
+    psu_zio_format_t format = output_format(output);
+    FILE *fp;
+
+    if (output == NULL || slaxFilenameIsStd(output)) {
+	if (format == PZF_NONE)
+	    return stdout;
+
+	fflush(stdout);
+	if (psu_zio_attach(fileno(stdout), O_WRONLY, format,
+			   opt_compress_level) < 0)
+	    err(1, "could not compress standard output");
+	fp = psu_zio_fdopen(fileno(stdout), "w", FALSE);
+	if (fp == NULL)
+	    err(1, "could not compress standard output");
+	return fp;
+    }
+
+    fp = psu_zio_fopen(output, "w", format, opt_compress_level);
+    if (fp == NULL)
+	err(1, "could not open file: '%s'", output);
+
+    return fp;
+}
+
+static void
+close_output (FILE *fp)
+{
+    if (fp == stdout)
+	return;
+
+    if (fclose(fp) == EOF)
+	err(1, "could not write output");
+}
+
+static int
+read_xml_io (void *opaque, char *buf, int len)
+{
+    return psu_zio_read((int) (long) opaque, buf, len);
+}
+
+static int
+read_xml_close (void *opaque)
+{
+    int fd = (int) (long) opaque;
+
+    return (fd == 0) ? psu_zio_detach(fd) : psu_zio_close(fd);
+}
+
+/*
+ * Parse an XML (or HTML) file.  gzip and zstd files are decompressed
+ * as libxml2 reads them; other files are left to libxml2 itself.
+ */
+static xmlDocPtr
+read_xml_file (const char *input, int html, const char *enc, int opts)
+{
+    int fd;
+
+    if (slaxFilenameIsStd(input)) {
+	fd = 0;
+	if (psu_zio_attach(fd, O_RDONLY, PZF_AUTO, 0) < 0) {
+	    warn("cannot read standard input");
+	    return NULL;
+	}
+    } else {
+	/* If we can't open it, let libxml2 try (and complain) */
+	fd = psu_zio_open(input, O_RDONLY, PZF_AUTO, 0);
+    }
+
+    if (fd < 0 || !psu_zio_active(fd)) {
+	if (fd > 0)
+	    close(fd);
+	return html ? htmlReadFile(input, enc, opts)
+	    : xmlReadFile(input, enc, opts);
+    }
+
+    if (html)
+	return htmlReadIO(read_xml_io, read_xml_close, (void *) (long) fd,
+			  input, enc, opts);
+    return xmlReadIO(read_xml_io, read_xml_close, (void *) (long) fd,
+		     input, enc, opts);
+}
+
+static int convert_many (const char *output);
+static int do_convert_many (const char *output, char **argv, int xslt);
+
 static int
 do_format (const char *name UNUSED, const char *output,
 		 const char *input, char **argv)
 {
-    FILE *infile = NULL, *outfile;
+    FILE *infile = NULL;
+    int outfd;
     xmlDocPtr docp;
 
+    if (convert_many(output))
+	return do_convert_many(output, argv, FALSE);
+
     if (mini_docp == NULL)
 	input = get_filename(input, &argv, -1);
     output = get_filename(output, &argv, -1);
@@ -89,7 +321,7 @@ do_format (const char *name UNUSED, const char *output,
 	if (slaxFilenameIsStd(input))
 	    infile = stdin;
 	else {
-	    infile = fopen(input, "r");
+	    infile = psu_zio_fopen(input, "r", PZF_AUTO, 0);
 	    if (infile == NULL)
 		err(1, "file open failed for '%s'", input);
 	}
@@ -103,21 +335,11 @@ do_format (const char *name UNUSED, const char *output,
 	    errx(1, "cannot parse file: '%s'", input);
     }
 
-    if (output == NULL || slaxFilenameIsStd(output))
-	outfile = stdout;
-    else {
-	outfile = fopen(output, "w");
-	if (outfile == NULL)
-	    err(1, "could not open output file: '%s'", output);
-    }
+    outfd = open_output_fd(output);
+    slaxWriteDocFd(outfd, docp, opt_partial, opt_version);
+    close_output_fd(outfd);
 
-    slaxWriteDoc((slaxWriterFunc_t) fprintf, outfile, docp,
-		 opt_partial, opt_version);
-
-    if (outfile != stdout)
-	fclose(outfile);
-
-    xmlFreeDoc(docp);
+    teardown_doc(docp);
 
     return 0;
 }
@@ -126,7 +348,8 @@ static int
 do_slax_to_xslt (const char *name UNUSED, const char *output,
 		 const char *input, char **argv)
 {
-    FILE *infile = NULL, *outfile;
+    FILE *infile = NULL;
+    int outfd;
     xmlDocPtr docp;
 
     if (opt_expression) {
@@ -138,6 +361,9 @@ do_slax_to_xslt (const char *name UNUSED, const char *output,
 	return res ? 0 : -1;
     }
 
+    if (convert_many(output))
+	return do_convert_many(output, argv, TRUE);
+
     if (mini_docp == NULL)
 	input = get_filename(input, &argv, -1);
     output = get_filename(output, &argv, -1);
@@ -148,7 +374,7 @@ do_slax_to_xslt (const char *name UNUSED, const char *output,
 	if (slaxFilenameIsStd(input))
 	    infile = stdin;
 	else {
-	    infile = fopen(input, "r");
+	    infile = psu_zio_fopen(input, "r", PZF_AUTO, 0);
 	    if (infile == NULL)
 		err(1, "file open failed for '%s'", input);
 	}
@@ -162,20 +388,11 @@ do_slax_to_xslt (const char *name UNUSED, const char *output,
 	    errx(1, "cannot parse file: '%s'", input);
     }
 
-    if (output == NULL || slaxFilenameIsStd(output))
-	outfile = stdout;
-    else {
-	outfile = fopen(output, "w");
-	if (outfile == NULL)
-	    err(1, "could not open output file: '%s'", output);
-    }
+    outfd = open_output_fd(output);
+    slaxDumpToFd(outfd, docp, opt_partial);
+    close_output_fd(outfd);
 
-    slaxDumpToFd(fileno(outfile), docp, opt_partial);
-
-    if (outfile != stdout)
-	fclose(outfile);
-
-    xmlFreeDoc(docp);
+    teardown_doc(docp);
 
     return 0;
 }
@@ -185,7 +402,7 @@ do_xslt_to_slax (const char *name UNUSED, const char *output,
 		 const char *input, char **argv)
 {
     xmlDocPtr docp;
-    FILE *outfile;
+    int outfd;
 
     if (opt_expression) {
 	char *res = slaxConvertExpression(opt_expression, FALSE);
@@ -200,28 +417,45 @@ do_xslt_to_slax (const char *name UNUSED, const char *output,
     input = get_filename(input, &argv, -1);
     output = get_filename(output, &argv, -1);
 
-    docp = xmlReadFile(input, NULL, XSLT_PARSE_OPTIONS);
+    docp = read_xml_file(input, FALSE, NULL, XSLT_PARSE_OPTIONS);
     if (docp == NULL) {
 	errx(1, "cannot parse file: '%s'", input);
         return -1;
     }
 
-    if (output == NULL || slaxFilenameIsStd(output))
-	outfile = stdout;
-    else {
-	outfile = fopen(output, "w");
-	if (outfile == NULL)
-	    err(1, "could not open file: '%s'", output);
-    }
+    outfd = open_output_fd(output);
+    slaxWriteDocFd(outfd, docp, opt_partial, opt_version);
+    close_output_fd(outfd);
 
-    slaxWriteDoc((slaxWriterFunc_t) fprintf, outfile, docp,
-		 opt_partial, opt_version);
+    teardown_doc(docp);
 
-    if (outfile != stdout)
-	fclose(outfile);
+    return 0;
+}
 
-    xmlFreeDoc(docp);
+/*
+ * Write the root element of each JSON record, for --json-records
+ */
+typedef struct json_record_out_s {
+    xmlSaveCtxtPtr jro_handle;	/* Save context for output */
+    int jro_fd;			/* Output file descriptor */
+} json_record_out_t;
+
+static int
+json_record_write (void *opaque, xmlDocPtr docp, unsigned recno UNUSED)
+{
+    json_record_out_t *jrop = opaque;
+    xmlNodePtr nodep = xmlDocGetRootElement(docp);
+
+    if (nodep) {
+	xmlSaveTree(jrop->jro_handle, nodep);
+	xmlSaveFlush(jrop->jro_handle);
+	if (psu_zio_write(jrop->jro_fd, "\n", 1) < 0) {
+	    xmlFreeDoc(docp);
+	    return -1;
+	}
+    }
 
+    xmlFreeDoc(docp);
     return 0;
 }
 
@@ -230,282 +464,1798 @@ do_json_to_xml (const char *name UNUSED, const char *output,
 		 const char *input, char **argv)
 {
     xmlDocPtr docp;
-    FILE *outfile;
+    int outfd;
 
     input = get_filename(input, &argv, 0);
     output = get_filename(output, &argv, -1);
 
+    if (opt_json_records) {
+	json_record_out_t jro;
+	int rc;
+
+	jro.jro_fd = open_output_fd(output);
+	jro.jro_handle = slaxSaveToFd(jro.jro_fd, "UTF-8",
+				      XML_SAVE_FORMAT | XML_SAVE_NO_DECL);
+	if (jro.jro_handle == NULL)
+	    errx(1, "could not make save context");
+	rc = slaxJsonFileToXmlRecords(input, NULL, opt_json_flags,
+				      json_record_write, &jro);
+	xmlSaveClose(jro.jro_handle);
+	close_output_fd(jro.jro_fd);
+
+	if (rc < 0)
+	    errx(1, "cannot parse file: '%s'", input);
+
+	/* Bad records were reported and skipped, but still count */
+	if (rc > 0)
+	    slaxSetExitCode(1);
+
+	return rc ? -1 : 0;
+    }
+
+    if (opt_stream) {
+	int rc;
+
+	outfd = open_output_fd(output);
+	rc = slaxJsonStreamToXml(input, outfd, NULL,
+				 opt_json_flags, opt_partial);
+	close_output_fd(outfd);
+
+	if (rc < 0)
+	    errx(1, "cannot parse file: '%s'", input);
+
+	return 0;
+    }
+
     docp = slaxJsonFileToXml(input, NULL, opt_json_flags);
     if (docp == NULL) {
 	errx(1, "cannot parse file: '%s'", input);
         return -1;
     }
 
-    if (output == NULL || slaxFilenameIsStd(output))
-	outfile = stdout;
+    outfd = open_output_fd(output);
+    slaxDumpToFd(outfd, docp, opt_partial);
+    close_output_fd(outfd);
+
+    teardown_doc(docp);
+
+    return 0;
+}
+
+/*
+ * Turn an XML file into JSON as it's read, feeding libxi's tokens to
+ * the streaming JSON writer.  Returns -1 if the input is bad.
+ */
+static int
+stream_xml_to_json (const char *input, int fd)
+{
+    xi_source_t *srcp;
+    slax_json_writer_t *jwp;
+    xi_node_type_t type;
+    char *data, *rest, *cp, *endp, *name, *value, *jname, *jtype;
+    size_t namelen, valuelen;
+    unsigned len;
+    int rc = 0;
+
+    srcp = xi_source_open(slaxFilenameIsStd(input) ? "/dev/stdin" : input,
+			  XPSF_IGNORE_DTD);
+    if (srcp == NULL)
+	return -1;
+
+    jwp = slaxJsonWriterOpen(fd, opt_indent ? JWF_PRETTY : 0);
+    if (jwp == NULL) {
+	xi_source_destroy(srcp);
+	return -1;
+    }
+
+    for (;;) {
+	type = xi_source_next_token(srcp, &data, &rest);
+
+	switch (type) {
+	case XI_TYPE_OPEN:
+	case XI_TYPE_EMPTY:
+	    /* The writer wants the local name, or the "name" attribute */
+	    cp = strchr(data, ':');
+	    jname = cp ? cp + 1 : data;
+	    jtype = NULL;
+
+	    for (cp = rest, endp = rest ? rest + strlen(rest) : NULL; cp; ) {
+		if (xi_source_next_attrib(&cp, endp, &name, &namelen,
+					  &value, &valuelen) != NULL) {
+		    rc = -1;
+		    break;
+		}
+		if (cp == NULL)
+		    break;
+
+		name[namelen] = '\0';
+		value[xi_source_unescape(srcp, value, valuelen)] = '\0';
+
+		if (streq(name, ATT_NAME))
+		    jname = value;
+		else if (streq(name, ATT_TYPE))
+		    jtype = value;
+	    }
+
+	    slaxJsonWriterElementOpen(jwp, jname, jtype);
+	    if (type == XI_TYPE_EMPTY)
+		slaxJsonWriterElementClose(jwp);
+	    break;
+
+	case XI_TYPE_CLOSE:
+	    slaxJsonWriterElementClose(jwp);
+	    break;
+
+	case XI_TYPE_TEXT:
+	    cp = xi_source_unescape_text(srcp, data, rest - data, &len);
+	    slaxJsonWriterText(jwp, cp, len);
+	    break;
+
+	case XI_TYPE_UNESC:
+	    slaxJsonWriterText(jwp, data, rest - data);
+	    break;
+
+	case XI_TYPE_PI:
+	case XI_TYPE_COMMENT:
+	    slaxJsonWriterMarkup(jwp);
+	    break;
+
+	case XI_TYPE_EOF:
+	    goto done;
+
+	case XI_TYPE_NONE:
+	case XI_TYPE_FAIL:
+	    rc = -1;
+	    goto done;
+	}
+    }
+
+ done:
+    if (slaxJsonWriterClose(jwp) < 0)
+	rc = -1;
+    xi_source_destroy(srcp);
+
+    return rc;
+}
+
+static int
+do_xml_to_json (const char *name UNUSED, const char *output,
+		 const char *input, char **argv)
+{
+    xmlDocPtr docp;
+    int outfd;
+
+    input = get_filename(input, &argv, 0);
+    output = get_filename(output, &argv, -1);
+
+    if (opt_stream) {
+	int rc;
+
+	outfd = open_output_fd(output);
+	rc = stream_xml_to_json(input, outfd);
+	close_output_fd(outfd);
+
+	if (rc < 0)
+	    errx(1, "cannot parse file: '%s'", input);
+
+	return 0;
+    }
+
+    docp = read_xml_file(input, FALSE, NULL, XSLT_PARSE_OPTIONS);
+    if (docp == NULL) {
+	errx(1, "cannot parse file: '%s'", input);
+        return -1;
+    }
+
+    outfd = open_output_fd(output);
+    slaxJsonWriteDocFd(outfd, docp, opt_indent ? JWF_PRETTY : 0);
+    close_output_fd(outfd);
+
+    teardown_doc(docp);
+
+    return 0;
+}
+
+static int
+do_show_select (const char *name UNUSED, const char *output,
+                  const char *input, char **argv)
+{
+    FILE *infile;
+    int outfd;
+    xmlDocPtr docp, newdocp;
+    xmlNodePtr root, newroot;
+    xmlXPathContextPtr xpath_context;
+    xmlXPathObjectPtr objp;
+    xmlNodeSetPtr nsp;
+    int i;
+
+    input = get_filename(input, &argv, -1);
+    output = get_filename(output, &argv, -1);
+
+    if (slaxFilenameIsStd(input))
+	infile = stdin;
     else {
-	outfile = fopen(output, "w");
-	if (outfile == NULL)
-	    err(1, "could not open file: '%s'", output);
+	infile = psu_zio_fopen(input, "r", PZF_AUTO, 0);
+	if (infile == NULL)
+	    err(1, "file open failed for '%s'", input);
     }
 
-    slaxDumpToFd(fileno(outfile), docp, opt_partial);
+    docp = slaxLoadFile(input, infile, xmlDictCreate(), opt_partial);
+    if (docp == NULL)
+	errx(1, "cannot parse file: '%s'", input);
 
-    if (outfile != stdout)
-	fclose(outfile);
+    if (infile != stdin)
+	fclose(infile);
 
-    xmlFreeDoc(docp);
+    root = xmlDocGetRootElement(docp);
+    if (root == NULL)
+        err(1, "invalid document (no root node)");
+
+    /* Setup a context in which the expression can be evaluated */
+    xpath_context = xmlXPathNewContext(docp);
+    if (xpath_context == NULL)
+        err(1, "xpath context creation failed");
+
+    xmlXPathRegisterNs(xpath_context, (const xmlChar *) XSL_PREFIX,
+                       (const xmlChar *) XSL_URI);
+
+    /* Evaluate with our document's root node as "." */
+    xpath_context->node = root;
+
+    newdocp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
+    if (newdocp == NULL)
+        err(1, "document context creation failed");
+
+    newdocp->standalone = 1;
+    newdocp->dict = xmlDictCreate();
+
+    newroot = xmlNewDocNode(newdocp, NULL, (const xmlChar *) "select", NULL);
+    if (newroot == NULL)
+        err(1, "document context creation failed");
+
+    xmlDocSetRootElement(newdocp, newroot);
+
+    outfd = open_output_fd(output);
+
+    objp = xmlXPathEvalExpression((const xmlChar *) opt_show_select,
+                                  xpath_context);
+    if (objp->type == XPATH_NODESET) {
+        nsp = objp->nodesetval;
+        if (nsp && nsp->nodeNr > 0) {
+
+            for (i = 0; i < nsp->nodeNr; i++) {
+		xmlNodePtr newp = xmlDocCopyNode(nsp->nodeTab[i], newdocp, 1);
+		if (newp)
+		    xmlAddChild(newroot, newp);
+            }
+        }
+    }
+
+    slaxDumpToFd(outfd, newdocp, opt_partial);
+    close_output_fd(outfd);
+
+    xmlXPathFreeContext(xpath_context);
+    teardown_doc(newdocp);
+    teardown_doc(docp);
 
     return 0;
 }
 
-static int
-do_xml_to_json (const char *name UNUSED, const char *output,
-		 const char *input, char **argv)
+static int
+do_show_variable (const char *name UNUSED, const char *output,
+                  const char *input, char **argv)
+{
+    char select_argument[BUFSIZ];
+
+    if (opt_show_variable == NULL)
+        errx(1, "no variable name");
+
+    if (opt_show_variable[0] == '$')
+        opt_show_variable += 1;
+
+    snprintf(select_argument, sizeof(select_argument),
+            "xsl:variable[@name='%s']", opt_show_variable);
+    opt_show_select = select_argument;
+
+    return do_show_select(name, output, input, argv);
+}
+
+static xmlDocPtr
+buildEmptyFile (void)
+{
+    xmlDocPtr docp;
+
+    docp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
+    if (docp) {
+	docp->standalone = 1;
+    }
+
+    return docp;
+}
+
+/*
+ * Run the script, counting what it does if we've been asked to
+ */
+static xmlDocPtr
+apply_stylesheet (xsltStylesheetPtr script, xmlDocPtr indoc)
+{
+    xsltTransformContextPtr tctxt;
+    xmlDocPtr res;
+
+    if (!opt_stats) {
+	res = xsltApplyStylesheet(script, indoc, params);
+
+    } else {
+	tctxt = xsltNewTransformContext(script, indoc);
+	if (tctxt == NULL)
+	    errx(1, "could not make transform context");
+
+	slaxStatsStart(tctxt);
+	res = xsltApplyStylesheetUser(script, indoc, params,
+				      NULL, NULL, tctxt);
+	slaxStatsFinish(tctxt);
+	xsltFreeTransformContext(tctxt);
+    }
+
+    /* Show how we got here */
+    if (res == NULL && trace_dump_on_error)
+	slaxTraceRingDump(trace_dump_fd);
+
+    return res;
+}
+
+static void
+trace_ring_signal (int sig UNUSED)
+{
+    slaxTraceRingDump(trace_dump_fd);
+}
+
+/*
+ * Load and compile the script (or the mini-template), reporting
+ * failures and returning NULL
+ */
+static xsltStylesheetPtr
+compile_script (const char *scriptname)
+{
+    xmlDocPtr scriptdoc;
+    FILE *scriptfile;
+    xsltStylesheetPtr script;
+    char buf[BUFSIZ];
+
+    if (mini_docp) {
+	scriptdoc = mini_docp;
+	scriptname = "mini-template";
+    } else {
+	if (slaxFilenameIsStd(scriptname)) {
+	    warnx("script file cannot be stdin");
+	    return NULL;
+	}
+
+	scriptfile = slaxFindIncludeFile(scriptname, buf, sizeof(buf));
+	if (scriptfile == NULL) {
+	    warn("file open failed for '%s'", scriptname);
+	    return NULL;
+	}
+
+	scriptdoc = slaxLoadFile(scriptname, scriptfile, NULL, 0);
+	if (scriptfile != stdin)
+	    fclose(scriptfile);
+	if (scriptdoc == NULL) {
+	    warnx("cannot parse: '%s'", scriptname);
+	    return NULL;
+	}
+    }
+
+    script = xsltParseStylesheetDoc(scriptdoc);
+    if (script == NULL || script->errors != 0) {
+	warnx("%d errors parsing script: '%s'",
+	      script ? script->errors : 1, scriptname);
+	if (script)
+	    xsltFreeStylesheet(script);
+	return NULL;
+    }
+
+    if (opt_indent)
+	script->indent = 1;
+
+    return script;
+}
+
+/*
+ * Load and compile the script (or the mini-template), or die trying
+ */
+static xsltStylesheetPtr
+load_script (const char *scriptname)
+{
+    xsltStylesheetPtr script = compile_script(scriptname);
+
+    if (script == NULL)
+	exit(1);
+
+    return script;
+}
+
+/*
+ * Quote a string parameter so XSLT sees it as a string literal
+ * (caller must xmlFree the result)
+ */
+static char *
+quote_param (const char *pvalue)
+{
+    char *tvalue;
+    char quote;
+    int plen;
+
+    plen = strlen(pvalue);
+    tvalue = xmlMalloc(plen + 3);
+    if (tvalue == NULL)
+	return NULL;
+
+    quote = strrchr(pvalue, '\"') ? '\'' : '\"';
+    tvalue[0] = quote;
+    memcpy(tvalue + 1, pvalue, plen);
+    tvalue[plen + 1] = quote;
+    tvalue[plen + 2] = '\0';
+
+    return tvalue;
+}
+
+/*
+ * Read an input document, honoring --empty, --html and --xi
+ */
+static xmlDocPtr
+read_input (const char *input)
+{
+    if (opt_empty_input)
+	return buildEmptyFile();
+    if (opt_xi)
+	return xi_xml_read_file_rules(slaxFilenameIsStd(input)
+				      ? "/dev/stdin" : input, 0, opt_xi_rules);
+    return read_xml_file(input, opt_html, encoding, options);
+}
+
+/*
+ * Write a result document; returns non-zero if the file can't be opened
+ */
+static int
+write_result (const char *output, xmlDocPtr res, xsltStylesheetPtr script)
+{
+    FILE *outfile;
+    int rc = 0;
+
+    if (output == NULL || slaxFilenameIsStd(output))
+	outfile = open_output(output);
+    else {
+	outfile = psu_zio_fopen(output, "w", output_format(output),
+				opt_compress_level);
+	if (outfile == NULL)
+	    return -1;
+    }
+
+    if (opt_slax_output)
+	slaxWriteDoc((slaxWriterFunc_t) fprintf, outfile, res,
+		     TRUE, opt_version);
+    else
+	xsltSaveResultToFile(outfile, res, script);
+
+    if (outfile != stdout && fclose(outfile) == EOF)
+	rc = -1;
+
+    return rc;
+}
+
+static int
+do_run (const char *name, const char *output, const char *input, char **argv)
+{
+    const char *scriptname;
+    xmlDocPtr indoc;
+    xsltStylesheetPtr script;
+    xmlDocPtr res = NULL;
+
+    scriptname = get_filename(name, &argv, -1);
+    if (!opt_empty_input)
+	input = get_filename(input, &argv, -1);
+    output = get_filename(output, &argv, -1);
+
+    script = load_script(scriptname);
+    if (mini_docp)
+	scriptname = "mini-template";
+
+    indoc = read_input(input);
+    if (indoc == NULL)
+	errx(1, "unable to parse: '%s'", input);
+
+    if (opt_debugger) {
+	slaxDebugInit();
+	slaxDebugSetStylesheet(script);
+	if (mini_docp)
+	    slaxDebugSetScriptBuffer(mini_buffer);
+
+	res = slaxDebugApplyStylesheet(scriptname, script,
+				 slaxFilenameIsStd(input) ? NULL : input,
+				 indoc, params);
+    } else {
+	res = apply_stylesheet(script, indoc);
+    }
+
+    if (res) {
+	if (write_result(output, res, script))
+	    err(1, "could not open file: '%s'", output);
+
+	teardown_doc(res);
+    }
+
+    teardown_doc(indoc);
+    teardown_script(script);
+
+    return 0;
+}
+
+/*
+ * --benchmark <n>: run the whole of --run (load the script, compile
+ * it, read the input, transform, serialize) <n> times in this process
+ * and report each phase's wall clock and CPU time, so startup costs
+ * stay out of the numbers.  The results are discarded; the report is
+ * written to the output file.
+ */
+enum {
+    BENCH_LOAD,			/* Read and parse the script */
+    BENCH_COMPILE,		/* xsltParseStylesheetDoc */
+    BENCH_INPUT,		/* Read and parse the input */
+    BENCH_TRANSFORM,		/* Apply the script */
+    BENCH_SERIALIZE,		/* Turn the result into text */
+    BENCH_MAX
+};
+
+static const char *bench_phase_names[BENCH_MAX] = {
+    "load", "compile", "input", "transform", "serialize",
+};
+
+typedef struct bench_sample_s {
+    psu_time_usecs_t bs_wall;	/* Wall clock time */
+    psu_time_usecs_t bs_cpu;	/* CPU time (user + system) */
+} bench_sample_t;
+
+typedef struct bench_clock_s {
+    psu_ticks_t bc_wall;	/* Tick counter at the start of the phase */
+    psu_time_usecs_t bc_cpu;	/* CPU time at the start of the phase */
+} bench_clock_t;
+
+static psu_time_usecs_t
+bench_cpu_now (void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return psu_timeval_to_usecs(&ru.ru_utime)
+	+ psu_timeval_to_usecs(&ru.ru_stime);
+}
+
+static void
+bench_start (bench_clock_t *bcp)
+{
+    bcp->bc_wall = psu_ticks();
+    bcp->bc_cpu = bench_cpu_now();
+}
+
+/*
+ * Record the time since bench_start and start the next phase
+ */
+static void
+bench_stop (bench_clock_t *bcp, bench_sample_t *bsp)
+{
+    bench_clock_t now;
+
+    bench_start(&now);
+    bsp->bs_wall = psu_ticks_to_usecs(now.bc_wall - bcp->bc_wall);
+    bsp->bs_cpu = now.bc_cpu - bcp->bc_cpu;
+    *bcp = now;
+}
+
+static int
+bench_compare (const void *av, const void *bv)
+{
+    psu_time_usecs_t a = *(const psu_time_usecs_t *) av;
+    psu_time_usecs_t b = *(const psu_time_usecs_t *) bv;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+/*
+ * Compute min, median and p99 (nearest rank) for one column
+ */
+static void
+bench_stats (bench_sample_t *samples, unsigned count, int cpu,
+	     psu_time_usecs_t *scratch, psu_time_usecs_t *out)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++)
+	scratch[i] = cpu ? samples[i].bs_cpu : samples[i].bs_wall;
+
+    qsort(scratch, count, sizeof(scratch[0]), bench_compare);
+
+    out[0] = scratch[0];
+    out[1] = scratch[(count - 1) / 2];
+    out[2] = scratch[(count * 99 + 99) / 100 - 1];
+}
+
+static void
+bench_report (FILE *fp, const char *scriptname, unsigned count,
+	      bench_sample_t **samples)
+{
+    psu_time_usecs_t *scratch, wall[3], cpu[3];
+    bench_sample_t *total;
+    struct rusage ru;
+    unsigned i, p;
+
+    scratch = alloca(count * sizeof(*scratch));
+    total = alloca(count * sizeof(*total));
+    bzero(total, count * sizeof(*total));
+
+    for (i = 0; i < count; i++) {
+	for (p = 0; p < BENCH_MAX; p++) {
+	    total[i].bs_wall += samples[p][i].bs_wall;
+	    total[i].bs_cpu += samples[p][i].bs_cpu;
+	}
+    }
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    if (opt_benchmark_json) {
+	fprintf(fp, "{\n    \"script\": \"%s\",\n    \"iterations\": %u,\n"
+		"    \"units\": \"usecs\",\n    \"phases\": {\n",
+		scriptname, count);
+    } else {
+	fprintf(fp, "benchmark: %u iterations of '%s' (usecs)\n",
+		count, scriptname);
+	fprintf(fp, "%-10s %10s %10s %10s %10s %10s %10s\n", "phase",
+		"wall-min", "wall-med", "wall-p99",
+		"cpu-min", "cpu-med", "cpu-p99");
+    }
+
+    for (p = 0; p <= BENCH_MAX; p++) {
+	bench_sample_t *bsp = (p < BENCH_MAX) ? samples[p] : total;
+	const char *name = (p < BENCH_MAX) ? bench_phase_names[p] : "total";
+
+	bench_stats(bsp, count, FALSE, scratch, wall);
+	bench_stats(bsp, count, TRUE, scratch, cpu);
+
+	if (opt_benchmark_json)
+	    fprintf(fp, "        \"%s\": { "
+		    "\"wall\": { \"min\": %lu, \"median\": %lu, \"p99\": %lu }, "
+		    "\"cpu\": { \"min\": %lu, \"median\": %lu, \"p99\": %lu } }"
+		    "%s\n", name, wall[0], wall[1], wall[2],
+		    cpu[0], cpu[1], cpu[2], (p < BENCH_MAX) ? "," : "");
+	else
+	    fprintf(fp, "%-10s %10lu %10lu %10lu %10lu %10lu %10lu\n", name,
+		    wall[0], wall[1], wall[2], cpu[0], cpu[1], cpu[2]);
+    }
+
+    /* ru_maxrss is in kilobytes on Linux and bytes on BSD/macOS */
+#if defined(__APPLE__)
+    ru.ru_maxrss /= 1024;
+#endif
+
+    if (opt_benchmark_json)
+	fprintf(fp, "    },\n    \"peak-rss-kb\": %ld\n}\n", (long) ru.ru_maxrss);
+    else
+	fprintf(fp, "peak rss: %ld KB\n", (long) ru.ru_maxrss);
+}
+
+static int
+do_benchmark (const char *name, const char *output,
+	      const char *input, char **argv)
+{
+    const char *scriptname;
+    bench_sample_t *samples[BENCH_MAX];
+    bench_clock_t clock;
+    xmlDocPtr scriptdoc, indoc, res;
+    xsltStylesheetPtr script;
+    xmlChar *text;
+    int textlen;
+    FILE *scriptfile, *outfile;
+    char buf[BUFSIZ];
+    unsigned i, p;
+
+    scriptname = get_filename(name, &argv, -1);
+    if (!opt_empty_input)
+	input = get_filename(input, &argv, -1);
+    output = get_filename(output, &argv, -1);
+
+    if (mini_docp)
+	scriptname = "mini-template";
+    else if (slaxFilenameIsStd(scriptname))
+	errx(1, "script file cannot be stdin");
+    if (!opt_empty_input && slaxFilenameIsStd(input))
+	errx(1, "input for --benchmark cannot be stdin");
+
+    for (p = 0; p < BENCH_MAX; p++) {
+	samples[p] = calloc(opt_benchmark, sizeof(*samples[p]));
+	if (samples[p] == NULL)
+	    errx(1, "out of memory");
+    }
+
+    /* Calibrate the tick counter now, rather than in the first phase */
+    psu_ticks_per_sec();
+
+    for (i = 0; i < opt_benchmark; i++) {
+	bench_start(&clock);
+
+	if (mini_docp) {
+	    scriptdoc = xmlCopyDoc(mini_docp, 1);
+	} else {
+	    scriptfile = slaxFindIncludeFile(scriptname, buf, sizeof(buf));
+	    if (scriptfile == NULL)
+		err(1, "file open failed for '%s'", scriptname);
+	    scriptdoc = slaxLoadFile(scriptname, scriptfile, NULL, 0);
+	    fclose(scriptfile);
+	}
+	if (scriptdoc == NULL)
+	    errx(1, "cannot parse: '%s'", scriptname);
+	bench_stop(&clock, &samples[BENCH_LOAD][i]);
+
+	script = xsltParseStylesheetDoc(scriptdoc);
+	if (script == NULL || script->errors != 0)
+	    errx(1, "%d errors parsing script: '%s'",
+		 script ? script->errors : 1, scriptname);
+	if (opt_indent)
+	    script->indent = 1;
+	bench_stop(&clock, &samples[BENCH_COMPILE][i]);
+
+	indoc = read_input(input);
+	if (indoc == NULL)
+	    errx(1, "unable to parse: '%s'", input);
+	bench_stop(&clock, &samples[BENCH_INPUT][i]);
+
+	res = apply_stylesheet(script, indoc);
+	if (res == NULL)
+	    errx(1, "transform failed");
+	bench_stop(&clock, &samples[BENCH_TRANSFORM][i]);
+
+	text = NULL;
+	xsltSaveResultToString(&text, &textlen, res, script);
+	xmlFreeAndEasy(text);
+	bench_stop(&clock, &samples[BENCH_SERIALIZE][i]);
+
+	xmlFreeDoc(res);
+	xmlFreeDoc(indoc);
+	xsltFreeStylesheet(script);
+    }
+
+    outfile = open_output(output);
+    bench_report(outfile, scriptname, opt_benchmark, samples);
+    close_output(outfile);
+
+    for (p = 0; p < BENCH_MAX; p++)
+	free(samples[p]);
+
+    return 0;
+}
+
+/*
+ * --batch: the list of inputs, gathered from the arguments
+ */
+typedef struct batch_inputs_s {
+    char **bi_names;		/* Input file names */
+    unsigned bi_count;		/* Number of names */
+    unsigned bi_size;		/* Number of names allocated */
+} batch_inputs_t;
+
+/*
+ * Shared between the workers for --batch --jobs
+ */
+typedef struct batch_shared_s {
+    unsigned long bs_next;	/* Next input to process */
+    unsigned long bs_failures;	/* Number of inputs that failed */
+} batch_shared_t;
+
+static void
+batch_add_input (batch_inputs_t *bip, const char *name)
+{
+    if (bip->bi_count == bip->bi_size) {
+	bip->bi_size = bip->bi_size ? bip->bi_size * 2 : 64;
+	bip->bi_names = realloc(bip->bi_names,
+				bip->bi_size * sizeof(bip->bi_names[0]));
+	if (bip->bi_names == NULL)
+	    errx(1, "out of memory");
+    }
+
+    bip->bi_names[bip->bi_count] = strdup(name);
+    if (bip->bi_names[bip->bi_count] == NULL)
+	errx(1, "out of memory");
+    bip->bi_count += 1;
+}
+
+/*
+ * Gather inputs: each argument is a file name or a glob pattern, and
+ * "-" reads a list of file names (one per line) from stdin
+ */
+static void
+batch_gather_inputs (batch_inputs_t *bip, char **argv)
+{
+    char line[MAXPATHLEN], *cp;
+    glob_t gl;
+    size_t i;
+
+    for ( ; *argv; argv++) {
+	if (slaxFilenameIsStd(*argv)) {
+	    while (fgets(line, sizeof(line), stdin)) {
+		cp = line + strlen(line);
+		while (cp > line && (cp[-1] == '\n' || cp[-1] == '\r'))
+		    *--cp = '\0';
+		if (*line)
+		    batch_add_input(bip, line);
+	    }
+	    continue;
+	}
+
+	if (strpbrk(*argv, "*?[") == NULL) {
+	    batch_add_input(bip, *argv);
+	    continue;
+	}
+
+	if (glob(*argv, 0, NULL, &gl) != 0) {
+	    warnx("no files match '%s'", *argv);
+	    continue;
+	}
+
+	for (i = 0; i < gl.gl_pathc; i++)
+	    batch_add_input(bip, gl.gl_pathv[i]);
+	globfree(&gl);
+    }
+}
+
+/*
+ * Expand the output template for an input file:
+ *   %p: the input path        %d: its directory
+ *   %f: its file name         %b: the file name without its extension
+ *   %n: the input's position in the list (from one)
+ *   %%: a percent sign
+ */
+static int
+batch_output_name (char *buf, size_t bufsiz, const char *tmpl,
+		   const char *input, unsigned long seq)
+{
+    const char *base, *dot, *cp;
+    size_t len = 0;
+    int rc;
+
+    base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    dot = strrchr(base, '.');
+    if (dot == NULL || dot == base)
+	dot = base + strlen(base);
+
+    for (cp = tmpl; *cp && len < bufsiz; cp++) {
+	if (*cp != '%' || cp[1] == '\0') {
+	    buf[len++] = *cp;
+	    continue;
+	}
+
+	switch (*++cp) {
+	case 'p':
+	    rc = snprintf(buf + len, bufsiz - len, "%s", input);
+	    break;
+
+	case 'd':
+	    if (base == input)
+		rc = snprintf(buf + len, bufsiz - len, ".");
+	    else
+		rc = snprintf(buf + len, bufsiz - len, "%.*s",
+			      (int) (base - input - 1), input);
+	    break;
+
+	case 'f':
+	    rc = snprintf(buf + len, bufsiz - len, "%s", base);
+	    break;
+
+	case 'b':
+	    rc = snprintf(buf + len, bufsiz - len, "%.*s",
+			  (int) (dot - base), base);
+	    break;
+
+	case 'n':
+	    rc = snprintf(buf + len, bufsiz - len, "%lu", seq);
+	    break;
+
+	case '%':
+	    rc = snprintf(buf + len, bufsiz - len, "%%");
+	    break;
+
+	default:
+	    errx(1, "unknown escape '%%%c' in output template", *cp);
+	}
+
+	if (rc < 0)
+	    return -1;
+	len += rc;
+    }
+
+    if (len >= bufsiz)
+	return -1;
+
+    buf[len] = '\0';
+    return 0;
+}
+
+/*
+ * Work for one input; returns non-zero if the input failed
+ */
+typedef int (*batch_func_t)(void *opaque, const char *input,
+			    unsigned long seq);
+
+/*
+ * Process inputs until they're all taken.  Workers share "bsp", so
+ * each grabs the next unclaimed input, which keeps them all busy
+ * even when the inputs differ in size.
+ */
+static void
+batch_worker (batch_shared_t *bsp, batch_inputs_t *bip,
+	      batch_func_t func, void *opaque)
+{
+    unsigned long i;
+
+    for (;;) {
+	i = __atomic_fetch_add(&bsp->bs_next, 1, __ATOMIC_RELAXED);
+	if (i >= bip->bi_count)
+	    break;
+
+	if (func(opaque, bip->bi_names[i], i + 1))
+	    __atomic_fetch_add(&bsp->bs_failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Run "func" over all the inputs, in --jobs (forked) worker processes.
+ * Anything set up before the call (a compiled script, say) is shared
+ * by the workers.  Returns the number of inputs that failed.
+ */
+static unsigned long
+batch_run (batch_inputs_t *bip, batch_func_t func, void *opaque)
+{
+    batch_shared_t *bsp;
+    unsigned long failures;
+    unsigned i, jobs;
+    pid_t pid;
+    int status;
+
+    jobs = opt_jobs ? opt_jobs : 1;
+    if (jobs > bip->bi_count)
+	jobs = bip->bi_count;
+
+    bsp = mmap(NULL, sizeof(*bsp), PROT_READ | PROT_WRITE,
+	       MAP_SHARED | MAP_ANON, -1, 0);
+    if (bsp == MAP_FAILED)
+	err(1, "mmap failed");
+    bzero(bsp, sizeof(*bsp));
+
+    if (jobs <= 1) {
+	batch_worker(bsp, bip, func, opaque);
+
+    } else {
+	/* Don't let the workers inherit (and repeat) buffered output */
+	fflush(NULL);
+
+	for (i = 0; i < jobs; i++) {
+	    pid = fork();
+	    if (pid < 0)
+		err(1, "fork failed");
+
+	    if (pid == 0) {
+		batch_worker(bsp, bip, func, opaque);
+		exit(0);
+	    }
+	}
+
+	while (wait(&status) > 0)
+	    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+		warnx("worker failed (status %#x)", status);
+    }
+
+    failures = bsp->bs_failures;
+    munmap(bsp, sizeof(*bsp));
+
+    return failures;
+}
+
+static void
+batch_free_inputs (batch_inputs_t *bip)
+{
+    unsigned i;
+
+    for (i = 0; i < bip->bi_count; i++)
+	free(bip->bi_names[i]);
+    free(bip->bi_names);
+}
+
+/*
+ * What --batch workers need
+ */
+typedef struct batch_script_s {
+    xsltStylesheetPtr bsc_script; /* Compiled script */
+    const char *bsc_tmpl;	/* Output template */
+} batch_script_t;
+
+static int
+batch_one (void *opaque, const char *input, unsigned long seq)
+{
+    batch_script_t *bscp = opaque;
+    char output[MAXPATHLEN];
+    xmlDocPtr indoc, res;
+    int rc = 0;
+
+    if (batch_output_name(output, sizeof(output), bscp->bsc_tmpl,
+			  input, seq)) {
+	warnx("output name too long for '%s'", input);
+	return -1;
+    }
+
+    indoc = read_input(input);
+    if (indoc == NULL) {
+	warnx("unable to parse: '%s'", input);
+	return -1;
+    }
+
+    res = apply_stylesheet(bscp->bsc_script, indoc);
+    if (res == NULL) {
+	warnx("transform failed: '%s'", input);
+	rc = -1;
+    } else {
+	if (write_result(output, res, bscp->bsc_script)) {
+	    warn("could not open file: '%s'", output);
+	    rc = -1;
+	}
+	xmlFreeDoc(res);
+    }
+
+    xmlFreeDoc(indoc);
+    return rc;
+}
+
+/*
+ * --batch: compile the script once and run it over many inputs,
+ * optionally in several (forked) worker processes
+ */
+static int
+do_batch (const char *name, const char *output,
+	  const char *input UNUSED, char **argv)
+{
+    const char *scriptname;
+    batch_script_t bsc;
+    batch_inputs_t inputs;
+    unsigned long failures;
+
+    if (output == NULL)
+	errx(1, "--batch needs an output template (--output)");
+    if (opt_debugger)
+	errx(1, "--batch cannot be used with --debug");
+    if (opt_empty_input)
+	errx(1, "--batch cannot be used with --empty");
+
+    scriptname = mini_docp ? NULL : get_filename(name, &argv, -1);
+    bsc.bsc_script = load_script(scriptname);
+    bsc.bsc_tmpl = output;
+
+    bzero(&inputs, sizeof(inputs));
+    batch_gather_inputs(&inputs, argv);
+    if (inputs.bi_count == 0)
+	errx(1, "no inputs for --batch");
+
+    failures = batch_run(&inputs, batch_one, &bsc);
+    if (failures) {
+	warnx("%lu of %u inputs failed", failures, inputs.bi_count);
+	slaxSetExitCode(1);
+    }
+
+    batch_free_inputs(&inputs);
+    xsltFreeStylesheet(bsc.bsc_script);
+
+    return 0;
+}
+
+/*
+ * --format and --slax-to-xslt over many files, with --in-place or an
+ * --output template
+ */
+typedef struct convert_s {
+    const char *cv_tmpl;	/* Output template (or NULL for in place) */
+    int cv_xslt;		/* Write XSLT rather than SLAX */
+} convert_t;
+
+static mode_t cur_umask;	/* For the modes of new output files */
+
+static int
+convert_one (void *opaque, const char *input, unsigned long seq)
+{
+    convert_t *cvp = opaque;
+    char output[MAXPATHLEN], temp[MAXPATHLEN];
+    const char *target;
+    FILE *infile;
+    xmlDocPtr docp;
+    struct stat st;
+    int fd, rc = 0;
+
+    infile = psu_zio_fopen(input, "r", PZF_AUTO, 0);
+    if (infile == NULL) {
+	warn("file open failed for '%s'", input);
+	return -1;
+    }
+
+    /* Name generated variables as if this were the only file */
+    slaxResetNames();
+
+    docp = slaxLoadFile(input, infile, NULL, opt_partial);
+    if (docp == NULL) {
+	warnx("cannot parse file: '%s'", input);
+	fclose(infile);
+	return -1;
+    }
+
+    if (cvp->cv_tmpl) {
+	if (batch_output_name(output, sizeof(output), cvp->cv_tmpl,
+			      input, seq)) {
+	    warnx("output name too long for '%s'", input);
+	    rc = -1;
+	    goto done;
+	}
+	target = output;
+    } else {
+	target = input;
+    }
+
+    /*
+     * Write to a temporary file next to the target and rename it
+     * into place, so a failure never leaves half a file behind
+     * (and never leaves an in-place input truncated).
+     */
+    if (snprintf(temp, sizeof(temp), "%s.XXXXXX", target)
+		>= (int) sizeof(temp)) {
+	warnx("output name too long for '%s'", input);
+	rc = -1;
+	goto done;
+    }
+
+    fd = mkstemp(temp);
+    if (fd < 0) {
+	warn("could not open output file: '%s'", target);
+	rc = -1;
+	goto done;
+    }
+
+    if (cvp->cv_tmpl == NULL && fstat(fileno(infile), &st) == 0)
+	fchmod(fd, st.st_mode & 07777);
+    else
+	fchmod(fd, 0666 & ~cur_umask);
+
+    if (cvp->cv_xslt)
+	slaxDumpToFd(fd, docp, opt_partial);
+    else if (!slaxWriteDocFd(fd, docp, opt_partial, opt_version)) {
+	warnx("could not write output file: '%s'", target);
+	rc = -1;
+    }
+
+    if (close(fd) < 0 && rc == 0) {
+	warn("could not write output file: '%s'", target);
+	rc = -1;
+    }
+
+    if (rc == 0 && rename(temp, target) < 0) {
+	warn("could not rename output file: '%s'", target);
+	rc = -1;
+    }
+
+    if (rc)
+	unlink(temp);
+
+ done:
+    fclose(infile);
+    xmlFreeDoc(docp);
+    return rc;
+}
+
+static int
+do_convert_many (const char *output, char **argv, int xslt)
+{
+    convert_t cv;
+    batch_inputs_t inputs;
+    unsigned long failures;
+
+    if (mini_docp)
+	errx(1, "--mini-template cannot be used with many files");
+    if (opt_in_place && output)
+	errx(1, "--in-place cannot be used with --output");
+    if (opt_in_place && xslt)
+	errx(1, "--slax-to-xslt cannot write in place; use --output");
+
+    cv.cv_tmpl = opt_in_place ? NULL : output;
+    cv.cv_xslt = xslt;
+
+    bzero(&inputs, sizeof(inputs));
+    batch_gather_inputs(&inputs, argv);
+    if (inputs.bi_count == 0)
+	errx(1, "no input files");
+
+    cur_umask = umask(0);
+    umask(cur_umask);
+
+    failures = batch_run(&inputs, convert_one, &cv);
+    if (failures) {
+	warnx("%lu of %u files failed", failures, inputs.bi_count);
+	slaxSetExitCode(1);
+    }
+
+    batch_free_inputs(&inputs);
+
+    return 0;
+}
+
+/*
+ * Should --format or --slax-to-xslt treat its arguments as a list of
+ * files to convert, rather than as an input and an output?
+ */
+static int
+convert_many (const char *output)
+{
+    return opt_in_place || (output && strchr(output, '%'));
+}
+
+/*
+ * --server and --client: a persistent slaxproc that keeps compiled
+ * scripts warm, so each event costs a fork instead of a process
+ * start, extension loading and script compilation.
+ *
+ * The protocol is line-based.  A request is:
+ *
+ *     script <path>
+ *     param <name> <value>        (zero or more)
+ *     input <length>              (followed by <length> bytes of XML)
+ *   or
+ *     empty                       (use an empty input document)
+ *
+ * and the reply is:
+ *
+ *     status <code>
+ *     output <length>             (followed by the result document)
+ *     messages <length>           (followed by anything written to stderr)
+ *
+ * Each request is run in a child forked from the server, so scripts
+ * can't disturb each other or the server's cache, and a crash costs
+ * only that request.  libslax keeps per-process state, so forked
+ * children stand in for a thread pool; --jobs limits how many run
+ * at once.
+ */
+
+#define SERVER_SCRIPTS	32	/* Compiled scripts kept by the server */
+#define SERVER_JOBS	8	/* Default limit on running requests */
+#define SERVER_TIMEOUT	30	/* Seconds to wait for a client to talk */
+#define SERVER_LINE	(MAXPATHLEN + 64) /* Longest request line */
+#define SERVER_MAX_INPUT (64 * 1024 * 1024) /* Largest request input */
+
+typedef struct server_script_s {
+    TAILQ_ENTRY(server_script_s) ss_link; /* LRU list (most recent first) */
+    char *ss_path;		/* Script path (as the client gave it) */
+    struct timespec ss_mtime;	/* Modification time when compiled */
+    off_t ss_size;		/* Size when compiled */
+    xsltStylesheetPtr ss_script; /* Compiled script */
+} server_script_t;
+
+TAILQ_HEAD(server_script_list_s, server_script_s);
+
+static struct server_script_list_s server_scripts;
+static unsigned server_nscripts;
+
+static int
+full_write (int fd, const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = write(fd, buf, len);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    return -1;
+	buf += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+static int
+full_read (int fd, char *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len > 0) {
+	rc = read(fd, buf, len);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    return -1;
+	buf += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Read one request line (one byte at a time, so we don't read past
+ * the end of the line and into the document that follows)
+ */
+static int
+read_line (int fd, char *buf, size_t bufsiz)
+{
+    size_t len = 0;
+
+    for (;;) {
+	if (full_read(fd, buf + len, 1))
+	    return -1;
+	if (buf[len] == '\n')
+	    break;
+	if (++len >= bufsiz - 1)
+	    return -1;
+    }
+
+    if (len > 0 && buf[len - 1] == '\r')
+	len -= 1;
+    buf[len] = '\0';
+    return 0;
+}
+
+/*
+ * Write one section ("output", "messages") of a reply
+ */
+static int
+write_section (int fd, const char *name, const char *data, size_t len)
+{
+    char buf[SERVER_LINE];
+    int blen;
+
+    blen = snprintf(buf, sizeof(buf), "%s %lu\n", name, (unsigned long) len);
+    if (full_write(fd, buf, blen))
+	return -1;
+
+    return len ? full_write(fd, data, len) : 0;
+}
+
+/*
+ * Read one section of a reply, returning a malloc'd buffer
+ */
+static char *
+read_section (int fd, const char *name, size_t *lenp)
+{
+    char buf[SERVER_LINE], *cp, *data;
+    size_t nlen = strlen(name);
+    unsigned long len;
+
+    if (read_line(fd, buf, sizeof(buf)) || strncmp(buf, name, nlen) != 0
+	    || buf[nlen] != ' ')
+	return NULL;
+
+    len = strtoul(buf + nlen + 1, &cp, 10);
+    if (*cp != '\0')
+	return NULL;
+
+    data = malloc(len + 1);
+    if (data == NULL)
+	return NULL;
+
+    if (len && full_read(fd, data, len)) {
+	free(data);
+	return NULL;
+    }
+
+    data[len] = '\0';
+    *lenp = len;
+    return data;
+}
+
+static void
+server_script_free (server_script_t *ssp)
 {
-    xmlDocPtr docp;
-    FILE *outfile;
+    xsltFreeStylesheet(ssp->ss_script);
+    free(ssp->ss_path);
+    free(ssp);
+}
 
-    input = get_filename(input, &argv, 0);
-    output = get_filename(output, &argv, -1);
+/*
+ * Find the compiled script for a path, compiling it if it's not cached
+ * or has changed since we compiled it
+ */
+static xsltStylesheetPtr
+server_script (const char *path)
+{
+    server_script_t *ssp;
+    struct stat st;
+    xsltStylesheetPtr script;
 
-    docp = xmlReadFile(input, NULL, XSLT_PARSE_OPTIONS);
-    if (docp == NULL) {
-	errx(1, "cannot parse file: '%s'", input);
-        return -1;
+    if (stat(path, &st) < 0) {
+	warn("script '%s'", path);
+	return NULL;
     }
 
-    if (output == NULL || slaxFilenameIsStd(output))
-	outfile = stdout;
-    else {
-	outfile = fopen(output, "w");
-	if (outfile == NULL)
-	    err(1, "could not open file: '%s'", output);
+    TAILQ_FOREACH(ssp, &server_scripts, ss_link) {
+	if (!streq(ssp->ss_path, path))
+	    continue;
+
+	if (ssp->ss_size == st.st_size
+		&& ssp->ss_mtime.tv_sec == st.st_mtim.tv_sec
+		&& ssp->ss_mtime.tv_nsec == st.st_mtim.tv_nsec) {
+	    TAILQ_REMOVE(&server_scripts, ssp, ss_link);
+	    TAILQ_INSERT_HEAD(&server_scripts, ssp, ss_link);
+	    return ssp->ss_script;
+	}
+
+	/* It's changed, so out with the old */
+	TAILQ_REMOVE(&server_scripts, ssp, ss_link);
+	server_script_free(ssp);
+	server_nscripts -= 1;
+	break;
     }
 
-    slaxJsonWriteDoc((slaxWriterFunc_t) fprintf, outfile, docp,
-		     opt_indent ? JWF_PRETTY : 0);
+    script = compile_script(path);
+    if (script == NULL)
+	return NULL;
 
-    if (outfile != stdout)
-	fclose(outfile);
+    /* Load the extensions now, rather than in every child */
+    slaxDynLoadAll();
 
-    xmlFreeDoc(docp);
+    ssp = calloc(1, sizeof(*ssp));
+    if (ssp == NULL || (ssp->ss_path = strdup(path)) == NULL) {
+	free(ssp);
+	xsltFreeStylesheet(script);
+	return NULL;
+    }
 
-    return 0;
+    ssp->ss_mtime = st.st_mtim;
+    ssp->ss_size = st.st_size;
+    ssp->ss_script = script;
+    TAILQ_INSERT_HEAD(&server_scripts, ssp, ss_link);
+
+    if (++server_nscripts > SERVER_SCRIPTS) {
+	ssp = TAILQ_LAST(&server_scripts, server_script_list_s);
+	TAILQ_REMOVE(&server_scripts, ssp, ss_link);
+	server_script_free(ssp);
+	server_nscripts -= 1;
+    }
+
+    return script;
 }
 
-static int
-do_show_select (const char *name UNUSED, const char *output,
-                  const char *input, char **argv)
+/*
+ * Run a request in the child: the script is compiled, the input is
+ * read; apply one to the other and send the reply
+ */
+static void
+server_child (int fd, xsltStylesheetPtr script, const char **reqparams,
+	      char *input, size_t inlen)
 {
-    FILE *infile, *outfile = NULL;
-    xmlDocPtr docp, newdocp;
-    xmlNodePtr root, newroot;
-    xmlXPathContextPtr xpath_context;
-    xmlXPathObjectPtr objp;
-    xmlNodeSetPtr nsp;
-    int i;
+    xmlDocPtr indoc, res = NULL;
+    xmlChar *output = NULL;
+    int outlen = 0, status = 1;
+    char buf[SERVER_LINE], *messages = NULL;
+    FILE *errfp;
+    long errlen = 0;
+
+    /* Catch anything written to stderr, so we can send it back */
+    errfp = tmpfile();
+    if (errfp) {
+	fflush(stderr);
+	dup2(fileno(errfp), fileno(stderr));
+    }
 
-    input = get_filename(input, &argv, -1);
-    output = get_filename(output, &argv, -1);
+    if (input)
+	indoc = opt_html
+	    ? htmlReadMemory(input, inlen, "input", encoding, options)
+	    : xmlReadMemory(input, inlen, "input", encoding, options);
+    else
+	indoc = buildEmptyFile();
 
-    if (slaxFilenameIsStd(input))
-	infile = stdin;
-    else {
-	infile = fopen(input, "r");
-	if (infile == NULL)
-	    err(1, "file open failed for '%s'", input);
+    if (indoc == NULL) {
+	warnx("unable to parse input");
+    } else {
+	params = reqparams;
+	res = apply_stylesheet(script, indoc);
+	if (res) {
+	    if (xsltSaveResultToString(&output, &outlen, res, script) == 0)
+		status = slaxGetExitCode();
+	    xmlFreeDoc(res);
+	}
+	xmlFreeDoc(indoc);
     }
 
-    docp = slaxLoadFile(input, infile, xmlDictCreate(), opt_partial);
-    if (docp == NULL)
-	errx(1, "cannot parse file: '%s'", input);
+    fflush(stderr);
+    if (errfp) {
+	errlen = ftell(errfp);
+	if (errlen > 0 && (messages = malloc(errlen)) != NULL) {
+	    rewind(errfp);
+	    if (fread(messages, 1, errlen, errfp) != (size_t) errlen)
+		errlen = 0;
+	} else
+	    errlen = 0;
+    }
 
-    if (infile != stdin)
-	fclose(infile);
+    snprintf(buf, sizeof(buf), "status %d\n", status);
+    if (full_write(fd, buf, strlen(buf)) == 0
+	    && write_section(fd, "output", (char *) output, outlen) == 0)
+	write_section(fd, "messages", messages, errlen);
 
-    root = xmlDocGetRootElement(docp);
-    if (root == NULL)
-        err(1, "invalid document (no root node)");
+    _exit(status);
+}
 
-    /* Setup a context in which the expression can be evaluated */
-    xpath_context = xmlXPathNewContext(docp);
-    if (xpath_context == NULL)
-        err(1, "xpath context creation failed");
+/*
+ * Read a request from a client and start a child to run it
+ */
+static pid_t
+server_request (int fd)
+{
+    char line[SERVER_LINE], *cp, *input = NULL;
+    char *path = NULL, *tvalue;
+    xsltStylesheetPtr script;
+    slax_data_list_t reqlist;
+    slax_data_node_t *dnp;
+    const char **reqparams;
+    unsigned long inlen = 0;
+    int nreq = 0, i, done = FALSE;
+    pid_t pid = -1;
 
-    xmlXPathRegisterNs(xpath_context, (const xmlChar *) XSL_PREFIX,
-                       (const xmlChar *) XSL_URI);
+    slaxDataListInit(&reqlist);
 
-    /* Evaluate with our document's root node as "." */
-    xpath_context->node = root;
+    while (!done) {
+	if (read_line(fd, line, sizeof(line))) {
+	    warnx("incomplete request");
+	    goto fail;
+	}
 
-    newdocp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
-    if (newdocp == NULL)
-        err(1, "document context creation failed");
+	cp = strchr(line, ' ');
+	if (cp)
+	    *cp++ = '\0';
 
-    newdocp->standalone = 1;
-    newdocp->dict = xmlDictCreate();
+	if (streq(line, "script") && cp) {
+	    free(path);
+	    path = strdup(cp);
 
-    newroot = xmlNewDocNode(newdocp, NULL, (const xmlChar *) "select", NULL);
-    if (newroot == NULL)
-        err(1, "document context creation failed");
+	} else if (streq(line, "param") && cp && strchr(cp, ' ')) {
+	    char *value = strchr(cp, ' ');
+	    *value++ = '\0';
 
-    xmlDocSetRootElement(newdocp, newroot);
+	    tvalue = quote_param(value);
+	    if (tvalue == NULL)
+		goto fail;
+	    slaxDataListAddNul(&reqlist, cp);
+	    slaxDataListAddNul(&reqlist, tvalue);
+	    xmlFree(tvalue);
+	    nreq += 1;
+
+	} else if (streq(line, "input") && cp) {
+	    inlen = strtoul(cp, &cp, 10);
+	    if (*cp != '\0' || inlen > SERVER_MAX_INPUT) {
+		warnx("bad input length in request");
+		goto fail;
+	    }
+
+	    input = malloc(inlen + 1);
+	    if (input == NULL || full_read(fd, input, inlen)) {
+		warnx("bad input in request");
+		goto fail;
+	    }
+	    done = TRUE;
+
+	} else if (streq(line, "empty")) {
+	    done = TRUE;
 
-    if (output == NULL || slaxFilenameIsStd(output))
-        outfile = stdout;
-    else {
-        outfile = fopen(output, "w");
-        if (outfile == NULL)
-            err(1, "could not open file: '%s'", output);
+	} else {
+	    warnx("bad request line: '%s'", line);
+	    goto fail;
+	}
     }
 
-    objp = xmlXPathEvalExpression((const xmlChar *) opt_show_select,
-                                  xpath_context);
-    if (objp->type == XPATH_NODESET) {
-        nsp = objp->nodesetval;
-        if (nsp && nsp->nodeNr > 0) {
-
-            for (i = 0; i < nsp->nodeNr; i++) {
-		xmlNodePtr newp = xmlDocCopyNode(nsp->nodeTab[i], newdocp, 1);
-		if (newp)
-		    xmlAddChild(newroot, newp);
-            }
-        }
+    if (path == NULL) {
+	warnx("request has no script");
+	goto fail;
     }
 
-    slaxDumpToFd(fileno(outfile), newdocp, opt_partial);
-
-    if (outfile && outfile != stdout)
-	fclose(outfile);
-
-    xmlXPathFreeContext(xpath_context);
-    xmlFreeDoc(newdocp);
-    xmlFreeDoc(docp);
+    script = server_script(path);
+    if (script == NULL) {
+	const char failed[] = "status 1\noutput 0\nmessages 0\n";
+	full_write(fd, failed, sizeof(failed) - 1);
+	goto fail;
+    }
 
-    return 0;
+    reqparams = alloca((nreq * 2 + 1) * sizeof(*reqparams));
+    i = 0;
+    SLAXDATALIST_FOREACH(dnp, &reqlist) {
+	reqparams[i++] = dnp->dn_data;
+    }
+    reqparams[i] = NULL;
+
+    pid = fork();
+    if (pid == 0)
+	server_child(fd, script, reqparams, input, inlen);
+    if (pid < 0)
+	warn("fork failed");
+
+ fail:
+    slaxDataListClean(&reqlist);
+    free(input);
+    free(path);
+    return pid;
 }
 
 static int
-do_show_variable (const char *name UNUSED, const char *output,
-                  const char *input, char **argv)
+server_socket (const char *path, int listening)
 {
-    char select_argument[BUFSIZ];
-
-    if (opt_show_variable == NULL)
-        errx(1, "no variable name");
-
-    if (opt_show_variable[0] == '$')
-        opt_show_variable += 1;
+    struct sockaddr_un sun;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path))
+	errx(1, "socket path too long: '%s'", path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+	err(1, "socket failed");
+
+    bzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if (listening) {
+	/* Only a socket can be left over from a previous server */
+	if (lstat(path, &st) == 0) {
+	    if (!S_ISSOCK(st.st_mode))
+		errx(1, "'%s' exists and is not a socket", path);
+	    unlink(path);
+	}
 
-    snprintf(select_argument, sizeof(select_argument),
-            "xsl:variable[@name='%s']", opt_show_variable);
-    opt_show_select = select_argument;
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+	    err(1, "bind failed: '%s'", path);
+	if (listen(fd, 64) < 0)
+	    err(1, "listen failed");
+    } else {
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+	    err(1, "connect failed: '%s'", path);
+    }
 
-    return do_show_select(name, output, input, argv);
+    return fd;
 }
 
-static xmlDocPtr
-buildEmptyFile (void)
+/*
+ * --server <socket>: answer requests until killed
+ */
+static int
+do_server (const char *name UNUSED, const char *output UNUSED,
+	   const char *input UNUSED, char **argv UNUSED)
 {
-    xmlDocPtr docp;
+    struct timeval tv = { SERVER_TIMEOUT, 0 };
+    unsigned running = 0, jobs = opt_jobs ? opt_jobs : SERVER_JOBS;
+    int sock, fd;
+    pid_t pid;
+
+    TAILQ_INIT(&server_scripts);
+    signal(SIGPIPE, SIG_IGN);
+
+    sock = server_socket(opt_socket, TRUE);
+
+    for (;;) {
+	/* Reap finished children, and wait if we're at the limit */
+	while (running > 0
+	       && (pid = waitpid(-1, NULL,
+				 (running >= jobs) ? 0 : WNOHANG)) > 0)
+	    running -= 1;
+
+	fd = accept(sock, NULL, NULL);
+	if (fd < 0) {
+	    if (errno == EINTR)
+		continue;
+	    err(1, "accept failed");
+	}
 
-    docp = xmlNewDoc((const xmlChar *) XML_DEFAULT_VERSION);
-    if (docp) {
-	docp->standalone = 1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (server_request(fd) > 0)
+	    running += 1;
+	close(fd);
     }
 
-    return docp;
+    return 0;
 }
 
+/*
+ * --client <socket>: send a request to a server and show the reply
+ */
 static int
-do_run (const char *name, const char *output, const char *input, char **argv)
+do_client (const char *name, const char *output,
+	   const char *input, char **argv)
 {
-    xmlDocPtr scriptdoc;
+    char buf[SERVER_LINE], path[MAXPATHLEN], *data, *messages, *cp;
+    size_t len, mlen;
+    slax_data_node_t *dnp;
     const char *scriptname;
-    FILE *scriptfile, *outfile;
-    xmlDocPtr indoc;
-    xsltStylesheetPtr script;
-    xmlDocPtr res = NULL;
-    char buf[BUFSIZ];
+    int fd, status, blen;
+    FILE *fp;
 
     scriptname = get_filename(name, &argv, -1);
     if (!opt_empty_input)
 	input = get_filename(input, &argv, -1);
     output = get_filename(output, &argv, -1);
 
-    if (mini_docp) {
-	scriptdoc = mini_docp;
-	scriptname = "mini-template";
-    } else {
-	if (slaxFilenameIsStd(scriptname))
-	    errx(1, "script file cannot be stdin");
-
-	scriptfile = slaxFindIncludeFile(scriptname, buf, sizeof(buf));
-	if (scriptfile == NULL)
-	    err(1, "file open failed for '%s'", scriptname);
-
-	scriptdoc = slaxLoadFile(scriptname, scriptfile, NULL, 0);
-	if (scriptdoc == NULL)
-	    errx(1, "cannot parse: '%s'", scriptname);
-	if (scriptfile != stdin)
-	    fclose(scriptfile);
+    /* The server's working directory isn't ours */
+    if (realpath(scriptname, path) == NULL)
+	err(1, "script '%s'", scriptname);
+
+    fd = server_socket(opt_socket, FALSE);
+
+    blen = snprintf(buf, sizeof(buf), "script %s\n", path);
+    if (full_write(fd, buf, blen))
+	err(1, "write failed");
+
+    /* Send the raw values; the server quotes them */
+    SLAXDATALIST_FOREACH(dnp, &client_params) {
+	if (full_write(fd, "param ", 6)
+		|| full_write(fd, dnp->dn_data, strlen(dnp->dn_data)))
+	    err(1, "write failed");
+	dnp = TAILQ_NEXT(dnp, dn_link);
+	if (dnp == NULL || full_write(fd, " ", 1)
+		|| full_write(fd, dnp->dn_data, strlen(dnp->dn_data))
+		|| full_write(fd, "\n", 1))
+	    err(1, "write failed");
     }
 
-    script = xsltParseStylesheetDoc(scriptdoc);
-    if (script == NULL || script->errors != 0)
-	errx(1, "%d errors parsing script: '%s'",
-	     script ? script->errors : 1, scriptname);
-
-    if (opt_empty_input)
-	indoc = buildEmptyFile();
-    else if (opt_html)
-	indoc = htmlReadFile(input, encoding, options);
-    else
-	indoc = xmlReadFile(input, encoding, options);
-    if (indoc == NULL)
-	errx(1, "unable to parse: '%s'", input);
-
-    if (opt_indent)
-	script->indent = 1;
+    if (opt_empty_input) {
+	if (full_write(fd, "empty\n", 6))
+	    err(1, "write failed");
+    } else {
+	fp = slaxFilenameIsStd(input) ? stdin : fopen(input, "r");
+	if (fp == NULL)
+	    err(1, "file open failed for '%s'", input);
 
-    if (opt_debugger) {
-	slaxDebugInit();
-	slaxDebugSetStylesheet(script);
-	if (mini_docp)
-	    slaxDebugSetScriptBuffer(mini_buffer);
+	data = NULL;
+	len = 0;
+	for (;;) {
+	    data = realloc(data, len + BUFSIZ);
+	    if (data == NULL)
+		errx(1, "out of memory");
+	    blen = fread(data + len, 1, BUFSIZ, fp);
+	    if (blen <= 0)
+		break;
+	    len += blen;
+	}
+	if (fp != stdin)
+	    fclose(fp);
 
-	res = slaxDebugApplyStylesheet(scriptname, script,
-				 slaxFilenameIsStd(input) ? NULL : input,
-				 indoc, params);
-    } else {
-	res = xsltApplyStylesheet(script, indoc, params);
+	blen = snprintf(buf, sizeof(buf), "input %lu\n", (unsigned long) len);
+	if (full_write(fd, buf, blen) || full_write(fd, data, len))
+	    err(1, "write failed");
+	free(data);
     }
 
-    if (res) {
-	if (output == NULL || slaxFilenameIsStd(output))
-	    outfile = stdout;
-	else {
-	    outfile = fopen(output, "w");
-	    if (outfile == NULL)
-		err(1, "could not open file: '%s'", output);
-	}
+    if (read_line(fd, buf, sizeof(buf)) || strncmp(buf, "status ", 7) != 0)
+	errx(1, "bad reply from server");
+    status = strtol(buf + 7, &cp, 10);
 
-	if (opt_slax_output)
-	    slaxWriteDoc((slaxWriterFunc_t) fprintf, outfile, res,
-		 TRUE, opt_version);
-	else
-	    xsltSaveResultToFile(outfile, res, script);
+    data = read_section(fd, "output", &len);
+    messages = read_section(fd, "messages", &mlen);
+    if (data == NULL || messages == NULL)
+	errx(1, "bad reply from server");
+    close(fd);
 
-	if (outfile != stdout)
-	    fclose(outfile);
+    if (mlen)
+	fwrite(messages, 1, mlen, stderr);
 
-	xmlFreeDoc(res);
+    if (len) {
+	fp = open_output(output);
+	fwrite(data, 1, len, fp);
+	close_output(fp);
     }
 
-    xmlFreeDoc(indoc);
-    xsltFreeStylesheet(script);
+    free(data);
+    free(messages);
 
+    slaxSetExitCode(status);
     return 0;
 }
 
@@ -546,12 +2296,7 @@ do_xpath (const char *name UNUSED, const char *output,
 	errx(1, "%d errors parsing script: '%s'",
 	     script ? script->errors : 1, opt_xpath);
 
-    if (opt_empty_input)
-	indoc = buildEmptyFile();
-    else if (opt_html)
-	indoc = htmlReadFile(input, encoding, options);
-    else
-	indoc = xmlReadFile(input, encoding, options);
+    indoc = read_input(input);
     if (indoc == NULL)
 	errx(1, "unable to parse: '%s'", input);
 
@@ -565,17 +2310,11 @@ do_xpath (const char *name UNUSED, const char *output,
 				 slaxFilenameIsStd(input) ? NULL : input,
 				 indoc, params);
     } else {
-	res = xsltApplyStylesheet(script, indoc, params);
+	res = apply_stylesheet(script, indoc);
     }
 
     if (res) {
-	if (output == NULL || slaxFilenameIsStd(output))
-	    outfile = stdout;
-	else {
-	    outfile = fopen(output, "w");
-	    if (outfile == NULL)
-		err(1, "could not open file: '%s'", output);
-	}
+	outfile = open_output(output);
 
 	if (opt_slax_output)
 	    slaxWriteDoc((slaxWriterFunc_t) fprintf, outfile, res,
@@ -583,8 +2322,7 @@ do_xpath (const char *name UNUSED, const char *output,
 	else
 	    xsltSaveResultToFile(outfile, res, script);
 
-	if (outfile != stdout)
-	    fclose(outfile);
+	close_output(outfile);
 
 	xmlFreeDoc(res);
     }
@@ -609,7 +2347,7 @@ do_check (const char *name, const char *output UNUSED,
     if (slaxFilenameIsStd(scriptname))
 	errx(1, "script file cannot be stdin");
 
-    scriptfile = fopen(scriptname, "r");
+    scriptfile = psu_zio_fopen(scriptname, "r", PZF_AUTO, 0);
     if (scriptfile == NULL)
 	err(1, "file open failed for '%s'", scriptname);
 
@@ -698,10 +2436,13 @@ print_help (void)
     fprintf(stderr,
 "Usage: slaxproc [mode] [options] [script] [files]\n"
 "    Modes:\n"
+"\t--batch: run a SLAX script over many inputs (files, globs or '-')\n"
 "\t--check OR -c: check syntax and content for a SLAX script\n"
+"\t--client <socket>: run a SLAX script using a --server\n"
 "\t--format OR -F: format (pretty print) a SLAX script\n"
 "\t--json-to-xml: Turn JSON data into XML\n"
 "\t--run OR -r: run a SLAX script (the default mode)\n"
+"\t--server <socket>: run scripts for clients, keeping them compiled\n"
 "\t--show-select: show XPath selection from the input document\n"
 "\t--show-variable: show contents of a global variable\n"
 "\t--slax-to-xslt OR -x: turn SLAX into XSLT\n"
@@ -710,6 +2451,14 @@ print_help (void)
 "\t--xslt-to-slax OR -s: turn XSLT into SLAX\n"
 "\n"
 "    Options:\n"
+"\t--arena: allocate from an arena, skipping frees at exit\n"
+"\t--async-output: write slax:output and friends from a separate thread\n"
+"\t--benchmark <n>: run the script <n> times, reporting time per phase\n"
+"\t--benchmark-json: write the --benchmark report in JSON\n"
+"\t--cache-dir <dir>: cache compiled SLAX scripts in the given directory\n"
+"\t--compress <format>: compress output (gzip, zstd, none or auto)\n"
+"\t--compress-level <n>: use level <n> for --compress\n"
+"\t--dampen-shared: keep slax:dampen() records in shared memory\n"
 "\t--debug OR -d: enable the SLAX/XSLT debugger\n"
 "\t--empty OR -E: give an empty document for input\n"
 "\t--exslt OR -e: enable the EXSLT library\n"
@@ -717,26 +2466,36 @@ print_help (void)
 "\t--help OR -h: display this help message\n"
 "\t--html OR -H: Parse input data as HTML\n"
 "\t--ignore-arguments: Do not process any further arguments\n"
+"\t--in-place: --format rewrites each of the given files in place\n"
 "\t--include <dir> OR -I <dir>: search directory for includes/imports\n"
 "\t--indent OR -g: indent output ala output-method/indent\n"
 "\t--input <file> OR -i <file>: take input from the given file\n"
+"\t--jobs <n> OR -j <n>: use <n> workers (--batch, --format, --server)\n"
+"\t--json-records: --json-to-xml converts each JSON record separately\n"
 "\t--json-tagging: tag json-style input with the 'json' attribute\n"
 "\t--keep-text: mini-templates should not discard text\n"
 "\t--lib <dir> OR -L <dir>: search directory for extension libraries\n"
 "\t--log <file>: use given log file\n"
+"\t--log-async: write log messages from a separate thread\n"
 "\t--mini-template <code> OR -m <code>: wrap template code in a script\n"
 "\t--name <file> OR -n <file>: read the script from the given file\n"
 "\t--no-json-types: do not insert 'type' attribute for --json-to-xml\n"
 "\t--no-randomize: do not initialize the random number generator\n"
 "\t--no-tty: do not fall back to stdin for tty io\n"
+"\t--optimize: fold constants and simplify scripts after parsing them\n"
 "\t--output <file> OR -o <file>: make output into the given file\n"
 "\t--param <name> <value> OR -a <name> <value>: pass parameters\n"
 "\t--partial OR -p: allow partial SLAX input to --slax-to-xslt\n"
 "\t--slax-output OR -S: Write the result using SLAX-style XML (braces, etc)\n"
+"\t--stats: write engine counters (as JSON) to stderr at exit\n"
+"\t--stream: --json-to-xml and --xml-to-json convert as input is read\n"
 "\t--trace <file> OR -t <file>: write trace data to a file\n"
+"\t--trace-ring <count>: keep trace data in a ring of <count> records\n"
 "\t--verbose OR -v: enable debugging output (slaxLog())\n"
 "\t--version OR -V: show version information (and exit)\n"
 "\t--write-version <version> OR -w <version>: write in version\n"
+"\t--xi: parse input data with the libxi parser\n"
+"\t--xi-rules <file>: prune libxi input using the rulebook in <file>\n"
 "\nProject libslax home page: https://github.com/Juniper/libslax\n"
 "\n");
 }
@@ -771,8 +2530,18 @@ main (int argc UNUSED, char **argv)
     unsigned ioflags = 0;
     int opt_ignore_arguments = FALSE;
     char *opt_log_file = NULL;
+    int opt_log_async = FALSE;
+    const char *opt_cache_dir = NULL;
+
+    for (i = 1; argv[i] && !streq(argv[i], "--ignore-arguments"); i++) {
+	if (streq(argv[i], "--arena")) {
+	    arena_enable();
+	    break;
+	}
+    }
 
     slaxDataListInit(&plist);
+    slaxDataListInit(&client_params);
     slaxDataListInit(&mini_templates);
 
     opt_args = argv;
@@ -810,11 +2579,28 @@ main (int argc UNUSED, char **argv)
 		errx(1, "open one action allowed");
 	    func = do_json_to_xml;
 
+	} else if (streq(cp, "--batch")) {
+	    if (func)
+		errx(1, "open one action allowed");
+	    func = do_batch;
+
+	} else if (streq(cp, "--client")) {
+	    if (func)
+		errx(1, "open one action allowed");
+	    func = do_client;
+	    opt_socket = check_arg("socket", &argv);
+
 	} else if (streq(cp, "--run") || streq(cp, "-r")) {
 	    if (func)
 		errx(1, "open one action allowed");
 	    func = do_run;
 
+	} else if (streq(cp, "--server")) {
+	    if (func)
+		errx(1, "open one action allowed");
+	    func = do_server;
+	    opt_socket = check_arg("socket", &argv);
+
 	} else if (streq(cp, "--show-select")) {
 	    if (func)
 		errx(1, "open one action allowed");
@@ -843,6 +2629,37 @@ main (int argc UNUSED, char **argv)
 	    func = do_xslt_to_slax;
 
 /* Non-mode flags start here */
+	} else if (streq(cp, "--arena")) {
+	    /* Handled above, before anything was allocated */
+
+	} else if (streq(cp, "--async-output")) {
+	    ioflags |= SIF_ASYNC;
+
+	} else if (streq(cp, "--benchmark")) {
+	    opt_benchmark = atoi(check_arg("iteration count", &argv));
+	    if (opt_benchmark == 0)
+		errx(1, "invalid iteration count");
+
+	} else if (streq(cp, "--benchmark-json")) {
+	    opt_benchmark_json = TRUE;
+
+	} else if (streq(cp, "--cache-dir")) {
+	    opt_cache_dir = check_arg("directory", &argv);
+
+	} else if (streq(cp, "--compress")) {
+	    const char *format = check_arg("compression format", &argv);
+
+	    if (psu_zio_format_parse(format, &opt_compress) < 0)
+		errx(1, "unknown compression format: '%s'", format);
+	    if (!psu_zio_supported(opt_compress))
+		errx(1, "compression format not supported: '%s'", format);
+
+	} else if (streq(cp, "--compress-level")) {
+	    opt_compress_level = atoi(check_arg("compression level", &argv));
+
+	} else if (streq(cp, "--dampen-shared")) {
+	    slaxDampenSetShared(TRUE);
+
 	} else if (streq(cp, "--debug") || streq(cp, "-d")) {
 	    opt_debugger = TRUE;
 
@@ -867,6 +2684,9 @@ main (int argc UNUSED, char **argv)
 	    opt_ignore_arguments = TRUE;
 	    break;
 
+	} else if (streq(cp, "--in-place")) {
+	    opt_in_place = TRUE;
+
 	} else if (streq(cp, "--include") || streq(cp, "-I")) {
 	    slaxIncludeAdd(check_arg("include path", &argv));
 
@@ -876,6 +2696,14 @@ main (int argc UNUSED, char **argv)
 	} else if (streq(cp, "--input") || streq(cp, "-i")) {
 	    input = check_arg("input file", &argv);
 
+	} else if (streq(cp, "--jobs") || streq(cp, "-j")) {
+	    opt_jobs = atoi(check_arg("number of jobs", &argv));
+	    if (opt_jobs == 0)
+		errx(1, "invalid number of jobs");
+
+	} else if (streq(cp, "--json-records")) {
+	    opt_json_records = TRUE;
+
 	} else if (streq(cp, "--json-tagging")) {
 	    opt_json_tagging = TRUE;
 
@@ -887,6 +2715,8 @@ main (int argc UNUSED, char **argv)
 
 	} else if (streq(cp, "--log") || streq(cp, "-l")) {
 	    opt_log_file = check_arg("log file name", &argv);
+	} else if (streq(cp, "--log-async")) {
+	    opt_log_async = TRUE;
 
 	} else if (streq(cp, "--mini-template") || streq(cp, "-m")) {
 	    slaxDataListAdd(&mini_templates, check_arg("template", &argv));
@@ -903,30 +2733,27 @@ main (int argc UNUSED, char **argv)
 	} else if (streq(cp, "--no-tty")) {
 	    ioflags |= SIF_NO_TTY;
 
+	} else if (streq(cp, "--optimize")) {
+	    slaxOptimizeSetFlags(SLAXOPT_ALL);
+
 	} else if (streq(cp, "--output") || streq(cp, "-o")) {
 	    output = check_arg("output file name", &argv);
 
 	} else if (streq(cp, "--param") || streq(cp, "-a")) {
 	    char *pname = check_arg("parameter name", &argv);
 	    char *pvalue = check_arg("parameter value", &argv);
-	    char *tvalue;
-	    char quote;
-	    int plen;
+	    char *tvalue = quote_param(pvalue);
 
-	    plen = strlen(pvalue);
-	    tvalue = xmlMalloc(plen + 3);
 	    if (tvalue == NULL)
 		errx(1, "out of memory");
 
-	    quote = strrchr(pvalue, '\"') ? '\'' : '\"';
-	    tvalue[0] = quote;
-	    memcpy(tvalue + 1, pvalue, plen);
-	    tvalue[plen + 1] = quote;
-	    tvalue[plen + 2] = '\0';
-
 	    nbparams += 1;
 	    slaxDataListAddNul(&plist, pname);
 	    slaxDataListAddNul(&plist, tvalue);
+	    xmlFree(tvalue);
+
+	    slaxDataListAddNul(&client_params, pname);
+	    slaxDataListAddNul(&client_params, pvalue);
 
 	} else if (streq(cp, "--partial") || streq(cp, "-p")) {
 	    opt_partial = TRUE;
@@ -934,9 +2761,21 @@ main (int argc UNUSED, char **argv)
 	} else if (streq(cp, "--slax-output") || streq(cp, "-S")) {
 	    opt_slax_output = TRUE;
 
+	} else if (streq(cp, "--stats")) {
+	    opt_stats = TRUE;
+	    slaxStatsEnable();
+
+	} else if (streq(cp, "--stream")) {
+	    opt_stream = TRUE;
+
 	} else if (streq(cp, "--trace") || streq(cp, "-t")) {
 	    trace_file = check_arg("trace file name", &argv);
 
+	} else if (streq(cp, "--trace-ring")) {
+	    opt_trace_ring = atoi(check_arg("record count", &argv));
+	    if (opt_trace_ring <= 0)
+		errx(1, "invalid trace ring size");
+
 	} else if (streq(cp, "--verbose") || streq(cp, "-v")) {
 	    logger = TRUE;
 
@@ -947,6 +2786,13 @@ main (int argc UNUSED, char **argv)
 	} else if (streq(cp, "--write-version") || streq(cp, "-w")) {
 	    opt_version = check_arg("version number", &argv);
 
+	} else if (streq(cp, "--xi")) {
+	    opt_xi = TRUE;
+
+	} else if (streq(cp, "--xi-rules")) {
+	    opt_xi_rules = check_arg("rulebook", &argv);
+	    opt_xi = TRUE;
+
 	} else if (streq(cp, "--yydebug") || streq(cp, "-y")) {
 	    slaxYyDebug = TRUE;
 
@@ -971,6 +2817,11 @@ main (int argc UNUSED, char **argv)
     if (cp)
 	slaxIncludeAddPath(cp);
 
+    if (opt_cache_dir == NULL)
+	opt_cache_dir = getenv("SLAXCACHE");
+    if (opt_cache_dir)
+	slaxCacheSetDir(opt_cache_dir);
+
     params = alloca(nbparams * 2 * sizeof(*params) + 1);
     i = 0;
     SLAXDATALIST_FOREACH(dnp, &plist) {
@@ -981,6 +2832,14 @@ main (int argc UNUSED, char **argv)
     if (func == NULL)
 	func = do_run; /* the default action */
 
+    if (opt_benchmark) {
+	if (func != do_run)
+	    errx(1, "--benchmark can only be used with --run");
+	if (opt_debugger)
+	    errx(1, "--benchmark cannot be used with --debug");
+	func = do_benchmark;
+    }
+
     /*
      * Seed the random number generator.  This is optional to allow
      * test jigs to take advantage of the default stream of generated
@@ -1012,8 +2871,11 @@ main (int argc UNUSED, char **argv)
 	slaxLogEnable(TRUE);
     }
 
+    if (opt_log_async && psu_log_async_start() < 0)
+	warn("--log-async: cannot start log thread; ignored");
+
     if (use_exslt) {
-	exsltRegisterAll();
+	slaxExsltRegisterAll();
 	slaxDynMarkExslt();
     }
 
@@ -1028,6 +2890,23 @@ main (int argc UNUSED, char **argv)
 	slaxTraceToFile(trace_fp);
     }
 
+    /*
+     * The trace ring is dumped to the trace file at exit; without
+     * one, it's written to stderr if the script fails.  Either
+     * way, SIGUSR1 shows the ring so far.
+     */
+    if (opt_trace_ring) {
+	if (slaxTraceRingEnable(opt_trace_ring))
+	    errx(1, "could not allocate trace ring");
+
+	if (trace_fp)
+	    trace_dump_fd = fileno(trace_fp);
+	else
+	    trace_dump_on_error = TRUE;
+
+	signal(SIGUSR1, trace_ring_signal);
+    }
+
     if (opt_ignore_arguments) {
 	static char *null_argv[] = { NULL };
 	argv = null_argv;
@@ -1038,12 +2917,22 @@ main (int argc UNUSED, char **argv)
 
     func(name, output, input, argv);
 
+    if (opt_stats)
+	slaxStatsDump(stderr);
+
+    if (opt_trace_ring && trace_fp) {
+	fflush(trace_fp);
+	slaxTraceRingDump(trace_dump_fd);
+    }
+
     if (trace_fp && trace_fp != stderr)
 	fclose(trace_fp);
 
     slaxDynClean();
-    xsltCleanupGlobals();
-    xmlCleanupParser();
+    if (!opt_arena) {
+	xsltCleanupGlobals();
+	xmlCleanupParser();
+    }
 
     exit(slaxGetExitCode());
 }
@@ -0,0 +1,234 @@
+#!/bin/sh
+#
+# Copyright 2017, Juniper Networks, Inc.
+# All rights reserved.
+# This SOFTWARE is licensed under the LICENSE provided in the
+# ../Copyright file. By downloading, installing, copying, or otherwise
+# using the SOFTWARE, you agree to be bound by the terms of that
+# LICENSE.
+#
+# Performance regression checks for the tests/core and tests/examples
+# scripts.  Each script runs under "slaxproc --benchmark" against an
+# input made bigger by bench-scale.slax.  For each script we keep
+# the best total wall clock and CPU time over the iterations (the
+# least noisy figure on a busy machine) and the peak RSS.
+#
+#   record: write the results to the baseline file
+#   check:  compare the results against the baseline file.  A change
+#           larger than the threshold (in percent) is reported, and
+#           slowdowns and growth make the exit status non-zero.  A
+#           slowdown counts only if the CPU time grew with the wall
+#           clock time, so other load on the machine doesn't trip it.
+#           Changes smaller than the floor (in usecs) are ignored,
+#           since very short runs are mostly noise.
+#
+# Timings depend on the machine, so baselines are meant to be recorded
+# and checked on the same box; they are not saved in the tree.
+#
+
+SRCDIR=.
+EXAMPLES=
+SLAXPROC=slaxproc
+BASELINE=bench.baseline
+SCALE=10
+ITERATIONS=5
+THRESHOLD=20
+FLOOR=1000
+OUT=out/bench
+ECHO=/bin/echo
+
+while [ $# -gt 0 ]
+do
+    case "$1" in
+    -d) SRCDIR=$2; shift;;
+    -x) EXAMPLES=$2; shift;;
+    -p) SLAXPROC=$2; shift;;
+    -b) BASELINE=$2; shift;;
+    -s) SCALE=$2; shift;;
+    -n) ITERATIONS=$2; shift;;
+    -t) THRESHOLD=$2; shift;;
+    -f) FLOOR=$2; shift;;
+    -*) echo "unknown option: $1" >&2; exit 1;;
+    *) break;;
+    esac
+    shift
+done
+
+verb=$1
+
+SCALER=${SRCDIR}/../bench-scale.slax
+
+#
+# Run one script; append "name wall cpu rss" (or "name failed") to $2
+#
+bench_one () {
+    name=$1 results=$2 script=$3 input=$4
+    report=${OUT}/$name.json
+
+    ${ECHO} -n "... $name ..."
+
+    if [ -z "$input" ]; then
+	${SLAXPROC} --benchmark ${ITERATIONS} --benchmark-json \
+	    --exslt --indent -E $script $report \
+	    < /dev/null > /dev/null 2> ${OUT}/$name.err
+    else
+	${SLAXPROC} --benchmark ${ITERATIONS} --benchmark-json \
+	    --exslt --indent $script $input $report \
+	    < /dev/null > /dev/null 2> ${OUT}/$name.err
+    fi
+
+    if [ $? -ne 0 -o ! -s $report ]; then
+	${ECHO} " failed"
+	${ECHO} "$name failed" >> $results
+	return
+    fi
+
+    # The report's lines are regular enough for sed
+    total=`grep '"total"' $report`
+    wall=`${ECHO} "$total" | sed 's/.*"wall": { "min": \([0-9]*\).*/\1/'`
+    cpu=`${ECHO} "$total" | sed 's/.*"cpu": { "min": \([0-9]*\).*/\1/'`
+    rss=`sed -n 's/.*"peak-rss-kb": \([0-9]*\).*/\1/p' $report`
+
+    ${ECHO} " $wall usecs"
+    ${ECHO} "$name $wall $cpu $rss" >> $results
+}
+
+#
+# Make the scaled-up copy of an input (once per input)
+#
+scale_input () {
+    base=`basename $1 .xml`
+    scaled=${OUT}/$base.xml
+
+    if [ ! -f $scaled ]; then
+	${SLAXPROC} --run -a scale ${SCALE} ${SCALER} $1 $scaled \
+	    2> /dev/null || cp $1 $scaled
+    fi
+    ${ECHO} $scaled
+}
+
+bench_all () {
+    results=$1
+    : > $results
+
+    # tests/core: each X.xml is the input for the X-*.slax scripts
+    for data in ${SRCDIR}/*.xml; do
+	basedata=`basename $data .xml`
+	scaled=`scale_input $data`
+
+	for test in ${SRCDIR}/$basedata-*.slax; do
+	    [ -f $test ] || continue
+	    bench_one `basename $test .slax` $results $test $scaled
+	done
+    done
+
+    # tests/examples: X.slax runs against X.xml, or each X-*.xml, or
+    # no input at all.  Scripts that prompt for input are skipped.
+    [ -n "${EXAMPLES}" ] || return
+
+    for test in ${EXAMPLES}/*.slax; do
+	base=`basename $test .slax`
+	if grep -q 'get-input' $test; then
+	    continue
+	fi
+
+	found=
+	for data in ${EXAMPLES}/$base.xml ${EXAMPLES}/$base-*.xml; do
+	    [ -f $data ] || continue
+	    found=yes
+	    scaled=`scale_input $data`
+	    bench_one example-`basename $data .xml` $results $test $scaled
+	done
+
+	[ -n "$found" ] || bench_one example-$base $results $test ""
+    done
+}
+
+do_record () {
+    mkdir -p ${OUT}
+    bench_all ${OUT}/results
+
+    {
+	${ECHO} "# bench-tests: scale ${SCALE}, iterations ${ITERATIONS}"
+	${ECHO} "# name wall-usecs cpu-usecs peak-rss-kb (best of each)"
+	cat ${OUT}/results
+    } > ${BASELINE}
+
+    ${ECHO} "baseline recorded in ${BASELINE}"
+}
+
+do_check () {
+    if [ ! -f ${BASELINE} ]; then
+	${ECHO} "no baseline (${BASELINE}); run 'make bench-record' first" >&2
+	exit 1
+    fi
+
+    mkdir -p ${OUT}
+    bench_all ${OUT}/results
+
+    # Join on the test name and compare
+    grep -v '^#' ${BASELINE} | awk -v threshold=${THRESHOLD} \
+	    -v floor=${FLOOR} -v results=${OUT}/results '
+	function pct(old, new) {
+	    return old > 0 ? (new - old) * 100.0 / old : 0
+	}
+	{ base_wall[$1] = $2; base_cpu[$1] = $3; base_rss[$1] = $4 }
+	END {
+	    bad = 0
+	    while ((getline line < results) > 0) {
+		split(line, f, " ")
+		name = f[1]
+		if (!(name in base_wall)) {
+		    printf("%s: new (not in baseline)\n", name)
+		    continue
+		}
+		if (f[2] == "failed" || base_wall[name] == "failed") {
+		    if (f[2] != base_wall[name])
+			printf("%s: %s now, %s in baseline\n", name,
+			       f[2] == "failed" ? "failed" : "runs",
+			       base_wall[name] == "failed" ? "failed" : "ran")
+		    continue
+		}
+
+		wall = pct(base_wall[name], f[2])
+		cpu = pct(base_cpu[name], f[3])
+		rss = pct(base_rss[name], f[4])
+		delta = f[2] - base_wall[name]
+		if (delta < 0)
+		    delta = -delta
+
+		if (wall > threshold && cpu > threshold && delta > floor) {
+		    printf("%s: SLOWER %+.0f%% (%d -> %d usecs)\n",
+			   name, wall, base_wall[name], f[2])
+		    bad += 1
+		} else if (wall < -threshold && delta > floor) {
+		    printf("%s: faster %+.0f%% (%d -> %d usecs)\n",
+			   name, wall, base_wall[name], f[2])
+		}
+
+		if (rss > threshold) {
+		    printf("%s: BIGGER %+.0f%% (%d -> %d KB peak rss)\n",
+			   name, rss, base_rss[name], f[4])
+		    bad += 1
+		}
+	    }
+	    printf("%d regression%s over %d%%\n", bad,
+		   bad == 1 ? "" : "s", threshold)
+	    exit(bad ? 1 : 0)
+	}'
+}
+
+case $verb in
+    record)
+	do_record
+	;;
+
+    check)
+	do_check
+	;;
+
+    *)
+	${ECHO} "unknown verb: $verb" 1>&2
+	exit 1
+	;;
+esac
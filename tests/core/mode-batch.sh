@@ -0,0 +1,51 @@
+#
+# --batch: one compiled script over many inputs, with output templates,
+# --jobs workers, a list of names on stdin, and a bad input
+#
+cat > mark.slax <<'EOS'
+version 1.2;
+
+param $tag = "seen";
+
+match / {
+    <marked tag=$tag> {
+	copy-of *;
+    }
+}
+EOS
+
+mkdir in res
+echo '<a>1</a>' > in/one.xml
+echo '<b>2</b>' > in/two.xml
+echo '<c>3</c>' > in/three.xml
+
+show () {
+    for f in `ls res`; do
+	echo "-- $f"
+	cat res/$f
+    done
+    rm -f res/*
+}
+
+echo "== glob"
+${SLAXPROC} --batch -o 'res/%b.%n.xml' mark.slax 'in/*.xml'
+echo "exit $?"
+show
+
+echo "== jobs and params"
+${SLAXPROC} --batch -j 2 -a tag jobs -o 'res/%f' mark.slax 'in/*.xml'
+echo "exit $?"
+show
+
+echo "== names on stdin"
+printf 'in/two.xml\nin/one.xml\n' \
+    | ${SLAXPROC} --batch -o 'res/%n-%b%%.xml' mark.slax -
+echo "exit $?"
+show
+
+echo "== bad input"
+echo '<d>4</e>' > in/bad.xml
+${SLAXPROC} --batch -o 'res/%b.xml' mark.slax in/one.xml in/bad.xml \
+    in/missing.xml
+echo "exit $?"
+show
@@ -0,0 +1,44 @@
+#
+# --benchmark: the report's shape (times vary, so numbers are masked
+# after checking that min <= median <= p99), JSON output, --output,
+# and bad arguments
+#
+cat > count.slax <<'EOS'
+version 1.2;
+
+match / {
+    <count> count(//*);
+}
+EOS
+echo '<a><b/><c/></a>' > in.xml
+
+mask () {
+    sed -e 's/  *[0-9][0-9]*/ N/g'
+}
+
+# Check each phase's wall and cpu columns are in order
+ordered () {
+    awk 'NR > 2 && NF == 7 {
+	    if ($2 > $3 || $3 > $4 || $5 > $6 || $6 > $7)
+		print "out of order: " $0
+	}'
+}
+
+echo "== table"
+${SLAXPROC} --benchmark 5 count.slax in.xml > report.txt
+echo "exit $?"
+ordered < report.txt
+mask < report.txt
+
+echo "== json, to a file"
+${SLAXPROC} --benchmark 3 --benchmark-json --empty -o report.json count.slax
+echo "exit $?"
+mask < report.json
+
+echo "== stdin"
+${SLAXPROC} --benchmark 2 count.slax < in.xml
+echo "exit $?"
+
+echo "== bad count"
+${SLAXPROC} --benchmark 0 count.slax in.xml
+echo "exit $?"
@@ -0,0 +1,70 @@
+#
+# Compressed I/O: gzip'd scripts, data, JSON and stdin are read
+# directly, *.gz outputs and --compress are written compressed, and
+# truncated input is an error.  zstd is optional, so its checks only
+# print when something goes wrong.
+#
+cat > copy.slax <<'EOS'
+version 1.2;
+
+match / {
+    <copy> {
+	copy-of *;
+    }
+}
+EOS
+echo '<top><a>1</a><b>two</b></top>' > in.xml
+echo '{ "a": 1, "b": [ true, "x" ] }' > in.json
+
+gzip -c copy.slax > copy.slax.gz
+gzip -c in.xml > in.xml.gz
+gzip -c in.json > in.json.gz
+
+echo "== gzip'd script and data"
+${SLAXPROC} copy.slax.gz in.xml.gz
+echo "exit $?"
+
+echo "== gzip'd stdin"
+${SLAXPROC} copy.slax < in.xml.gz
+echo "exit $?"
+
+echo "== gzip'd json"
+${SLAXPROC} --json-to-xml in.json.gz
+echo "exit $?"
+
+echo "== output to .gz"
+${SLAXPROC} copy.slax in.xml out.xml.gz
+echo "exit $?"
+gzip -dc out.xml.gz
+
+echo "== --compress gzip to stdout"
+${SLAXPROC} --compress gzip --compress-level 9 --xml-to-json in.xml \
+    | gzip -dc
+echo
+
+echo "== --compress none"
+${SLAXPROC} --compress none copy.slax in.xml plain.xml.gz
+echo "exit $?"
+cat plain.xml.gz
+
+echo "== truncated"
+head -c 30 in.xml.gz > short.xml.gz
+${SLAXPROC} copy.slax short.xml.gz
+echo "exit $?"
+
+echo "== zstd"
+if ${SLAXPROC} --compress zstd --xml-to-json in.xml > out.zst 2> zstd.err
+then
+    ${SLAXPROC} --xml-to-json in.xml > out.json
+    ${SLAXPROC} --compress zstd copy.slax in.xml out.xml.zst
+    ${SLAXPROC} copy.slax out.xml.zst > zstd.xml
+    ${SLAXPROC} copy.slax in.xml > plain.xml
+    ${SLAXPROC} copy.slax plain.xml > twice.xml
+    cmp -s twice.xml zstd.xml || echo "zstd: reading output failed"
+    if command -v zstd > /dev/null; then
+	zstd -dcq out.zst | cmp -s - out.json \
+	    || echo "zstd: stdout is not valid zstd"
+    fi
+else
+    grep -v "compression format not supported" zstd.err
+fi
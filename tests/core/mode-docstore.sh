@@ -0,0 +1,69 @@
+#
+# The docstore extension: load, query and close, using the cache file
+# on later runs and rebuilding it when the source changes
+#
+cat > inv.xml <<'EOS'
+<inventory>
+  <chassis-module slot="0">
+    <name>FPC 0</name>
+    <description>MPC7E 3D</description>
+  </chassis-module>
+  <chassis-module slot="1">
+    <name>FPC 1</name>
+    <description>MPC10E 3D</description>
+  </chassis-module>
+  <chassis-module slot="2">
+    <name>PEM 0</name>
+    <description>DC power</description>
+  </chassis-module>
+</inventory>
+EOS
+
+cat > query.slax <<'EOS'
+version 1.2;
+
+ns docstore extension = "http://xml.libslax.org/docstore";
+
+match / {
+    <out> {
+	<load> docstore:load("inv", "inv.xml");
+	<count> docstore:query("inv", "count(//chassis-module)");
+	<match> {
+	    copy-of docstore:query("inv", "//chassis-module[name='FPC 1']");
+	}
+	<names> {
+	    for-each (docstore:query("inv",
+				     "//chassis-module[@slot > 0]/name")) {
+		<name> .;
+	    }
+	}
+	<slot> docstore:query("inv", "//chassis-module[2]/@slot");
+	<string> docstore:query("inv",
+				"string(//chassis-module[3]/description)");
+	<boolean> docstore:query("inv", "boolean(//chassis-module[4])");
+	<none count=count(docstore:query("inv", "//fan"))>;
+	expr docstore:close("inv");
+	<closed count=count(docstore:query("inv", "//name"))>;
+    }
+}
+EOS
+
+# The verbose log shows the tree being used from the cache file, which
+# load writes first if it is missing or stale
+run_query () {
+    ${SLAXPROC} --run --indent --empty --verbose query.slax 2> log.err
+    echo "exit $?"
+    grep "^docstore" log.err
+}
+
+echo "== first run"
+run_query
+test -f inv.xml.xi && echo "cache written"
+
+echo "== second run"
+run_query
+
+echo "== source changed"
+sleep 1
+sed 's/DC power/AC power/' inv.xml > inv.new && mv inv.new inv.xml
+run_query
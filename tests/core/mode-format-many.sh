@@ -0,0 +1,50 @@
+#
+# --format and --slax-to-xslt over many files: --in-place, --output
+# templates and --jobs, leaving files that don't parse untouched
+#
+mkdir src xsl
+
+cat > src/one.slax <<'EOS'
+version 1.2;
+match / { <one> {
+  if (a) { <a>; } else { <b>; }
+} }
+EOS
+
+cat > src/two.slax <<'EOS'
+version 1.2;
+var $x = 1 + 2;
+match /   { for-each (item) { <item> .; } }
+EOS
+
+cat > src/broken.slax <<'EOS'
+version 1.2;
+match / { <broken> {
+EOS
+cp src/broken.slax broken.orig
+chmod 755 src/two.slax
+
+echo "== format in place"
+${SLAXPROC} --format --in-place -j 2 'src/*.slax'
+echo "exit $?"
+for f in one two; do
+    echo "-- $f"
+    cat src/$f.slax
+done
+cmp -s broken.orig src/broken.slax && echo "broken.slax untouched"
+test -x src/two.slax && echo "two.slax kept its mode"
+
+echo "== format in place again (no change)"
+cp src/one.slax one.first
+${SLAXPROC} --format --in-place src/one.slax
+echo "exit $?"
+cmp -s one.first src/one.slax && echo "one.slax unchanged"
+
+echo "== slax-to-xslt to a template"
+rm src/broken.slax
+${SLAXPROC} --slax-to-xslt -j 2 -o 'xsl/%b.xsl' 'src/*.slax'
+echo "exit $?"
+for f in `ls xsl`; do
+    echo "-- $f"
+    cat xsl/$f
+done
@@ -0,0 +1,17 @@
+#
+# --json-to-xml --json-records: good and bad NDJSON, and the exit code
+#
+cp ${SRCDIR}/mode-ndjson-good.in good.json
+cp ${SRCDIR}/mode-ndjson-bad.in bad.json
+
+echo "== good"
+${SLAXPROC} --json-to-xml --json-records good.json
+echo "exit $?"
+
+echo "== bad"
+${SLAXPROC} --json-to-xml --json-records bad.json
+echo "exit $?"
+
+echo "== bad, without --json-records"
+${SLAXPROC} --json-to-xml bad.json
+echo "exit $?"
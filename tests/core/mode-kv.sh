@@ -0,0 +1,65 @@
+#
+# The kv extension: put, get, delete, scan and count, with the store
+# persisting from one run to the next
+#
+cat > first.slax <<'EOS'
+version 1.2;
+
+ns kv extension = "http://xml.libslax.org/kv";
+
+var $db = "state.kv";
+
+match / {
+    <first> {
+	<put> kv:put($db, "peer.b", "two");
+	<put> kv:put($db, "peer.a", "one");
+	<put> kv:put($db, "peer.c", "three");
+	<put> kv:put($db, "other", "four");
+	<put> kv:put($db, "peer.b", "deux");
+	<count> kv:count($db);
+	<get> kv:get($db, "peer.b");
+	<missing> kv:get($db, "peer.z");
+	<delete> kv:delete($db, "peer.c");
+	<delete-missing> kv:delete($db, "peer.c");
+	<prefix> {
+	    copy-of kv:scan($db, "peer.");
+	}
+    }
+}
+EOS
+
+cat > second.slax <<'EOS'
+version 1.2;
+
+ns kv extension = "http://xml.libslax.org/kv";
+
+var $db = "state.kv";
+
+match / {
+    <second> {
+	<count> kv:count($db);
+	<get> kv:get($db, "peer.a");
+	<get> kv:get($db, "peer.b");
+	<deleted> kv:get($db, "peer.c");
+	<all> {
+	    copy-of kv:scan($db);
+	}
+	<none count=count(kv:scan($db, "nothing."))>;
+	<delete> kv:delete($db, "other");
+	<count> kv:count($db);
+	expr kv:close($db);
+    }
+}
+EOS
+
+echo "== first run"
+${SLAXPROC} --run --indent --empty first.slax
+echo "exit $?"
+
+echo "== second run"
+${SLAXPROC} --run --indent --empty second.slax
+echo "exit $?"
+
+echo "== third run"
+${SLAXPROC} --run --indent --empty second.slax
+echo "exit $?"
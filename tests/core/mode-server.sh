@@ -0,0 +1,65 @@
+#
+# --server and --client: input, parameters, empty input, messages,
+# exit codes, and refusing to replace a file that isn't a socket
+#
+cat > hello.slax <<'EOS'
+version 1.2;
+
+param $who = "world";
+
+match / {
+    if ($who == "nobody") {
+	message "no one to greet";
+	terminate "giving up";
+    }
+    <hello who=$who> {
+	copy-of *;
+    }
+}
+EOS
+echo '<in><a>1</a></in>' > in.xml
+
+echo "== not a socket"
+echo "still here" > notsock
+${SLAXPROC} --server notsock
+echo "exit $?"
+cat notsock
+
+${SLAXPROC} --server sock 2> server.err &
+server=$!
+tries=0
+while [ ! -S sock ] && [ $tries -lt 100 ]; do
+    sleep 0.1
+    tries=`expr $tries + 1`
+done
+
+echo "== input"
+${SLAXPROC} --client sock hello.slax in.xml
+echo "exit $?"
+
+echo "== param and empty input"
+${SLAXPROC} --client sock --param who you --empty hello.slax
+echo "exit $?"
+
+echo "== terminate"
+${SLAXPROC} --client sock --param who nobody hello.slax in.xml
+echo "exit $?"
+
+echo "== no such script"
+${SLAXPROC} --client sock nosuch.slax in.xml
+echo "exit $?"
+
+kill $server
+wait $server 2> /dev/null
+
+echo "== stale socket is replaced"
+${SLAXPROC} --server sock 2> server.err &
+server=$!
+tries=0
+while [ $tries -lt 100 ] \
+	&& ! ${SLAXPROC} --client sock --empty hello.slax 2> /dev/null; do
+    sleep 0.1
+    tries=`expr $tries + 1`
+done
+kill $server
+wait $server 2> /dev/null
@@ -0,0 +1,61 @@
+#
+# --stream: streamed --json-to-xml and --xml-to-json must match the
+# document-building conversions, and report errors in what they read
+#
+cat > data.json <<'EOS'
+{
+    "name": "widget",
+    "count": 3,
+    "ok": true,
+    "none": null,
+    "tags": [ "a", "b", [ 1, 2 ], { "deep": "yes" } ],
+    "empty-object": { },
+    "empty-array": [ ],
+    "text": "quote \" and \\ and é and <tag> & more",
+    "object": { "x": 1.5, "y": -2e3 }
+}
+EOS
+
+cat > data.xml <<'EOS'
+<json>
+  <name>widget</name>
+  <count type="number">3</count>
+  <ok type="true">true</ok>
+  <tags type="array">
+    <member>a</member>
+    <member type="number">1</member>
+    <member type="member"><deep>yes</deep></member>
+  </tags>
+  <text>&lt;tag&gt; &amp; é</text>
+  <when>tomorrow</when>
+</json>
+EOS
+
+compare () {
+    ${SLAXPROC} $1 $2 > plain.out
+    echo "exit $?"
+    ${SLAXPROC} $1 --stream $2 > stream.out
+    echo "exit $?"
+    cmp -s plain.out stream.out && echo "same" || diff plain.out stream.out
+    cat stream.out
+}
+
+echo "== json to xml"
+compare --json-to-xml data.json
+
+echo "== xml to json"
+compare --xml-to-json data.xml
+
+echo "== bad json"
+echo '{ "a": 1, "b": [ 2, 3 }' > bad.json
+${SLAXPROC} --json-to-xml --stream bad.json
+status=$?
+echo
+echo "exit $status"
+
+echo "== extended json"
+echo "{ a: 'single' }" > ext.json
+${SLAXPROC} --json-to-xml --stream ext.json
+status=$?
+echo
+echo "exit $status"
@@ -0,0 +1,13 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" version="1.0">
+  <!-- 
+ * A script that starts with a UTF-8 BOM and a "#!" line
+ -->
+  <xsl:template match="/">
+    <op-script-results>
+      <output>
+        <xsl:value-of select="concat(&quot;line &quot;, 8)"/>
+      </output>
+    </op-script-results>
+  </xsl:template>
+</xsl:stylesheet>
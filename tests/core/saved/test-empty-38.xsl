@@ -0,0 +1,83 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:slax="http://xml.libslax.org/slax" version="1.0" extension-element-prefixes="slax">
+  <!-- 
+ * Sequences and broken lines used directly as loop selects, which
+ * are made one node at a time
+ -->
+  <xsl:variable name="text" select="&quot;one&#10;two&#13;&#10;three&#10;&#10;five&#10;&quot;"/>
+  <xsl:template match="/">
+    <top>
+      <xsl:variable name="slax-dot-1" select="."/>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(1, 3)">
+        <xsl:variable name="i" select="."/>
+        <xsl:for-each select="$slax-dot-1">
+          <item i="{$i}" name="{name($i)}" parent="{count($i/..)}">
+            <xsl:variable name="slax-dot-2" select="."/>
+            <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence($i, 1)">
+              <xsl:variable name="j" select="."/>
+              <xsl:for-each select="$slax-dot-2">
+                <sub>
+                  <xsl:value-of select="$j"/>
+                </sub>
+              </xsl:for-each>
+            </xsl:for-each>
+          </item>
+        </xsl:for-each>
+      </xsl:for-each>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(4, 2)">
+        <seq position="{position()}" last="{last()}">
+          <xsl:value-of select="."/>
+        </seq>
+      </xsl:for-each>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:break-lines($text)">
+        <line position="{position()}" last="{last()}" name="{name()}">
+          <xsl:value-of select="."/>
+        </line>
+      </xsl:for-each>
+      <xsl:variable name="slax-dot-3" select="."/>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:break-lines($text, &quot;six&#10;seven&quot;)">
+        <xsl:variable name="line" select="."/>
+        <xsl:for-each select="$slax-dot-3">
+          <line>
+            <xsl:value-of select="$line"/>
+          </line>
+        </xsl:for-each>
+      </xsl:for-each>
+      <!-- Bodies that look past the node still see the whole set -->
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(1, 3)">
+        <seq cnt="{count(../*)}" sum="{sum(../*)}">
+          <xsl:value-of select="."/>
+        </seq>
+      </xsl:for-each>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:break-lines(&quot;x&#10;y&quot;)">
+        <bl cnt="{count(../*)}" next="{following-sibling::*[1]}">
+          <xsl:value-of select="."/>
+        </bl>
+      </xsl:for-each>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(1, 2)">
+        <abs count="{count(/*)}" prev="{count(preceding-sibling::*)}">
+          <xsl:value-of select="."/>
+        </abs>
+      </xsl:for-each>
+      <xsl:variable name="slax-dot-4" select="."/>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(1, 2)">
+        <xsl:variable name="k" select="."/>
+        <xsl:for-each select="$slax-dot-4">
+          <xsl:variable name="slax-dot-5" select="."/>
+          <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:break-lines(&quot;p&#10;q&quot;)">
+            <xsl:variable name="m" select="."/>
+            <xsl:for-each select="$slax-dot-5">
+              <nested k="{$k}" m="{$m}" last="{last()}"/>
+            </xsl:for-each>
+          </xsl:for-each>
+        </xsl:for-each>
+      </xsl:for-each>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:break-lines($text)">
+        <xsl:sort select="." order="descending"/>
+        <sorted position="{position()}">
+          <xsl:value-of select="."/>
+        </sorted>
+      </xsl:for-each>
+    </top>
+  </xsl:template>
+</xsl:stylesheet>
@@ -0,0 +1,46 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:redirect="org.apache.xalan.xslt.extensions.Redirect" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" xmlns:slax="http://xml.libslax.org/slax" version="1.0" extension-element-prefixes="redirect slax-ext slax">
+  <!-- 
+ * slax:document() keeps recent documents cached, but must notice
+ * when they change
+ -->
+  <xsl:variable name="xml-temp-1">
+    <format>xml</format>
+  </xsl:variable>
+  <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="xml" select="slax-ext:node-set($xml-temp-1)"/>
+  <xsl:template match="/">
+    <top>
+      <redirect:write href="table.xml">
+        <table>
+          <entry key="one">first</entry>
+          <entry key="two">second</entry>
+        </table>
+      </redirect:write>
+      <xsl:variable name="slax-dot-1" select="."/>
+      <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:build-sequence(1, 2)">
+        <xsl:variable name="i" select="."/>
+        <xsl:for-each select="$slax-dot-1">
+          <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="table" select="slax:document(&quot;table.xml&quot;, $xml)"/>
+          <lookup i="{$i}" count="{count($table/table/entry)}">
+            <xsl:value-of select="$table/table/entry[@key = &quot;two&quot;]"/>
+          </lookup>
+          <text i="{$i}">
+            <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="string-length(slax:document(&quot;table.xml&quot;))"/>
+          </text>
+        </xsl:for-each>
+      </xsl:for-each>
+      <redirect:write href="table.xml">
+        <table>
+          <entry key="two">changed</entry>
+        </table>
+      </redirect:write>
+      <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="table" select="slax:document(&quot;table.xml&quot;, $xml)"/>
+      <lookup count="{count($table/table/entry)}">
+        <xsl:value-of select="$table/table/entry[@key = &quot;two&quot;]"/>
+      </lookup>
+      <missing>
+        <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="count(slax:document(&quot;no-such-table.xml&quot;, $xml))"/>
+      </missing>
+    </top>
+  </xsl:template>
+</xsl:stylesheet>
@@ -0,0 +1,33 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:xutil="http://xml.libslax.org/xutil" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" version="1.0" extension-element-prefixes="xutil slax-ext">
+  <xsl:template match="/">
+    <xsl:variable name="opts-temp-1">
+      <parser>xi</parser>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="opts" select="slax-ext:node-set($opts-temp-1)"/>
+    <xsl:variable name="in-temp-2">
+      <s>&lt;a&gt;hello&lt;/a&gt;</s>
+      <s>&lt;?xml version="1.0"?&gt;
+&lt;top x='1' y="a&amp;amp;b&amp;#65;"&gt;&lt;b&gt;one &amp;lt; two&lt;/b&gt;&lt;c/&gt;
+  &lt;d z='q	r'&gt;x&lt;![CDATA[&lt;raw&gt;]]&gt;y&lt;/d&gt;&lt;/top&gt;
+</s>
+      <s>&lt;p:a xmlns:p='urn:p' xmlns='urn:d' p:at='v'&gt;&lt;b/&gt;&lt;p:c&gt;t&lt;/p:c&gt;&lt;/p:a&gt;</s>
+      <s>&lt;a&gt;&lt;!-- handled by libxml2 --&gt;&lt;/a&gt;</s>
+      <s>&lt;a xml:lang='en'&gt;e&lt;/a&gt;</s>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="in" select="slax-ext:node-set($in-temp-2)"/>
+    <out>
+      <xsl:for-each select="$in/s">
+        <xi>
+          <xsl:copy-of select="xutil:string-to-xml(., $opts)"/>
+        </xi>
+        <libxml2>
+          <xsl:copy-of select="xutil:string-to-xml(.)"/>
+        </libxml2>
+      </xsl:for-each>
+      <multi>
+        <xsl:copy-of select="xutil:string-to-xml(&quot;&lt;a&gt;&quot;, &quot;&lt;b&gt;&quot;, &quot;c&quot;, &quot;&lt;/b&gt;&quot;, &quot;&lt;/a&gt;&quot;, $opts)"/>
+      </multi>
+    </out>
+  </xsl:template>
+</xsl:stylesheet>
@@ -0,0 +1,68 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:xutil="http://xml.libslax.org/xutil" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" version="1.0" extension-element-prefixes="xutil slax-ext">
+  <xsl:template match="/">
+    <xsl:variable name="big-temp-1">
+      <top>
+        <a>one</a>
+        <b>two</b>
+        <c>café crème</c>
+      </top>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="big" select="slax-ext:node-set($big-temp-1)"/>
+    <xsl:variable name="nodes-temp-2">
+      <max-bytes>
+        <xsl:value-of select="12"/>
+      </max-bytes>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="nodes" select="slax-ext:node-set($nodes-temp-2)"/>
+    <xsl:variable name="opts-temp-3">
+      <max-bytes>
+        <xsl:value-of select="10"/>
+      </max-bytes>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="opts" select="slax-ext:node-set($opts-temp-3)"/>
+    <xsl:variable name="utf8-temp-4">
+      <max-bytes>
+        <xsl:value-of select="12"/>
+      </max-bytes>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="utf8" select="slax-ext:node-set($utf8-temp-4)"/>
+    <xsl:variable name="word-temp-5">
+      <word>
+        <c>café</c>
+      </word>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="word" select="slax-ext:node-set($word-temp-5)"/>
+    <out>
+      <!-- A trailing <max-bytes> node set is content, not an option -->
+      <plain>
+        <xsl:value-of select="xutil:xml-to-string($big, $nodes)"/>
+      </plain>
+      <nodes>
+        <xsl:value-of select="xutil:xml-to-string($nodes)"/>
+      </nodes>
+      <full>
+        <xsl:value-of select="xutil:xml-to-string-limit(1000, $big)"/>
+      </full>
+      <cut>
+        <xsl:value-of select="xutil:xml-to-string-limit(12, $big)"/>
+      </cut>
+      <multi>
+        <xsl:value-of select="xutil:xml-to-string-limit(30, $nodes, $big)"/>
+      </multi>
+      <none>
+        <xsl:value-of select="xutil:xml-to-string-limit(8)"/>
+      </none>
+      <json>
+        <xsl:value-of select="xutil:xml-to-json($big, $opts)"/>
+      </json>
+      <!-- Never split a UTF-8 character -->
+      <utf8>
+        <xsl:value-of select="xutil:xml-to-json($word, $utf8)"/>
+      </utf8>
+      <utf8-full>
+        <xsl:value-of select="xutil:xml-to-json($word)"/>
+      </utf8-full>
+    </out>
+  </xsl:template>
+</xsl:stylesheet>
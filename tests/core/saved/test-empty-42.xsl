@@ -0,0 +1,97 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:set="http://exslt.org/sets" xmlns:str="http://exslt.org/strings" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" version="1.0" extension-element-prefixes="slax-ext">
+  <xsl:variable name="data-temp-1">
+    <list>
+      <a>pear</a>
+      <b>fig</b>
+      <c>pear</c>
+      <d>apple</d>
+      <e>fig</e>
+      <f>kiwi</f>
+      <g>
+        <xsl:text></xsl:text>
+      </g>
+      <h>
+        <xsl:text></xsl:text>
+      </h>
+    </list>
+  </xsl:variable>
+  <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="data" select="slax-ext:node-set($data-temp-1)"/>
+  <xsl:variable name="none-temp-2">
+    <list/>
+  </xsl:variable>
+  <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="none" select="slax-ext:node-set($none-temp-2)"/>
+  <xsl:template match="/">
+    <xsl:variable name="all" select="$data/list/*"/>
+    <xsl:variable name="odd" select="$all[position() mod 2 = 1]"/>
+    <xsl:variable name="tail" select="$all[position() &gt; 3]"/>
+    <xsl:variable name="empty" select="$none/list/*"/>
+    <out>
+      <distinct>
+        <xsl:for-each select="set:distinct($all)">
+          <n name="{name()}">
+            <xsl:value-of select="."/>
+          </n>
+        </xsl:for-each>
+      </distinct>
+      <!-- Duplicates in a union keep the first one, in document order -->
+      <distinct-order>
+        <xsl:for-each select="set:distinct($tail | $odd)">
+          <n name="{name()}">
+            <xsl:value-of select="."/>
+          </n>
+        </xsl:for-each>
+      </distinct-order>
+      <distinct-empty count="{count(set:distinct($empty))}"/>
+      <intersection>
+        <xsl:for-each select="set:intersection($odd, $tail)">
+          <n name="{name()}">
+            <xsl:value-of select="."/>
+          </n>
+        </xsl:for-each>
+      </intersection>
+      <intersection-empty count="{count(set:intersection($odd, $empty))}"/>
+      <intersection-self count="{count(set:intersection($all, $all))}"/>
+      <difference>
+        <xsl:for-each select="set:difference($all, $odd)">
+          <n name="{name()}">
+            <xsl:value-of select="."/>
+          </n>
+        </xsl:for-each>
+      </difference>
+      <difference-empty count="{count(set:difference($all, $empty))}"/>
+      <difference-none count="{count(set:difference($empty, $all))}"/>
+      <tokenize>
+        <xsl:for-each select="str:tokenize(&quot;a,b;;c, d&quot;, &quot;,;&quot;)">
+          <t>
+            <xsl:value-of select="."/>
+          </t>
+        </xsl:for-each>
+      </tokenize>
+      <tokenize-default>
+        <xsl:for-each select="str:tokenize(&quot;  one two&#9;three&#10; &quot;)">
+          <t>
+            <xsl:value-of select="."/>
+          </t>
+        </xsl:for-each>
+      </tokenize-default>
+      <!-- An empty delimiter string splits into characters -->
+      <tokenize-chars>
+        <xsl:for-each select="str:tokenize(&quot;abç&quot;, &quot;&quot;)">
+          <t>
+            <xsl:value-of select="."/>
+          </t>
+        </xsl:for-each>
+      </tokenize-chars>
+      <tokenize-empty count="{count(str:tokenize(&quot;&quot;, &quot;,&quot;))}"/>
+      <tokenize-only count="{count(str:tokenize(&quot;,,,&quot;, &quot;,&quot;))}"/>
+      <tokenize-wide>
+        <xsl:for-each select="str:tokenize(&quot;x→y→→z&quot;, &quot;→&quot;)">
+          <t>
+            <xsl:value-of select="."/>
+          </t>
+        </xsl:for-each>
+      </tokenize-wide>
+    </out>
+  </xsl:template>
+</xsl:stylesheet>
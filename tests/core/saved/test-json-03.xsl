@@ -0,0 +1,36 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:xutil="http://xml.libslax.org/xutil" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" version="1.0" extension-element-prefixes="xutil slax-ext">
+  <!-- 
+ * Plain JSON goes through the structural index; anything else (like
+ * "five", with its bare name and trailing comma) uses the grammar.
+ -->
+  <xsl:variable name="tests-temp-1">
+    <one>{"a": 1, "b": -2.5e+5, "c": 0, "d": true, "e": false, "f": null}</one>
+    <two>[[1, [2, []]], {}, [{}], "x"]</two>
+    <three>{"quote\"d": "back\\slash", "braces": "{[:,]}", "tab": "a\tb"}</three>
+    <four>{"bad name": 1, "": 2, "3com": {"ok": ["hat", "desk"]}}</four>
+    <five>{ a: [ 1, 2, ], }</five>
+    <six>{
+      "long": "0123456789012345678901234567890123456789012345678901234567890123456789",
+      "esc": "\\\"\\",
+      "tail": [ 1,
+                2 ]
+    }</six>
+  </xsl:variable>
+  <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="tests" select="slax-ext:node-set($tests-temp-1)"/>
+  <xsl:template match="/">
+    <top>
+      <xsl:for-each select="$tests/node()">
+        <xsl:element name="{name()}">
+          <xsl:variable name="x" select="xutil:json-to-xml(.)"/>
+          <xml>
+            <xsl:copy-of select="$x"/>
+          </xml>
+          <back>
+            <xsl:value-of select="xutil:xml-to-json($x)"/>
+          </back>
+        </xsl:element>
+      </xsl:for-each>
+    </top>
+  </xsl:template>
+</xsl:stylesheet>
@@ -0,0 +1,82 @@
+<?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+<xsl:stylesheet xmlns:xsl="http://www.w3.org/1999/XSL/Transform" xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" xmlns:slax="http://xml.libslax.org/slax" version="1.0" extension-element-prefixes="slax-ext slax">
+  <!-- 
+ * Joins using slax:build-index() and slax:lookup(), over the input
+ * document, an RTF and a mutable variable
+ -->
+  <xsl:variable name="managers-temp-1">
+    <manager division="north" region="cold">Alice</manager>
+    <manager division="south" region="warm">Bob</manager>
+    <manager division="east" region="warm">Carol</manager>
+    <manager division="east" region="cold">Dave</manager>
+  </xsl:variable>
+  <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="managers" select="slax-ext:node-set($managers-temp-1)"/>
+  <xsl:template match="/">
+    <xsl:variable name="targets-temp-2">
+      <target division="north">
+        <xsl:value-of select="100"/>
+      </target>
+      <target division="south">
+        <xsl:value-of select="250"/>
+      </target>
+      <target division="west">
+        <xsl:value-of select="80"/>
+      </target>
+      <target division="nowhere">
+        <xsl:value-of select="1"/>
+      </target>
+    </xsl:variable>
+    <xsl:variable xmlns:slax-ext="http://xmlsoft.org/XSLT/namespace" name="targets" select="slax-ext:node-set($targets-temp-2)"/>
+    <xsl:variable name="slax-extra" mvarname="extra"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="extra" mutable="yes" select="slax:mvar-init(&quot;extra&quot;, &quot;slax-extra&quot;, $slax-extra)" svarname="slax-extra"/>
+    <slax:set-variable xmlns:slax="http://xml.libslax.org/slax" name="extra" svarname="slax-extra">
+      <note division="west">new office</note>
+    </slax:set-variable>
+    <slax:append-to-variable xmlns:slax="http://xml.libslax.org/slax" name="extra" svarname="slax-extra">
+      <note division="north">moved</note>
+    </slax:append-to-variable>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="by-id" select="slax:build-index(sales/division, &quot;@id&quot;)"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="again" select="slax:build-index(sales/division, &quot;@id&quot;)"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="by-division" select="slax:build-index($managers/manager, &quot;@division&quot;)"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="by-region" select="slax:build-index($managers/manager, &quot;@region&quot;)"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="by-target" select="slax:build-index($targets/target, &quot;@division&quot;)"/>
+    <xsl:variable xmlns:slax="http://xml.libslax.org/slax" name="by-note" select="slax:build-index($extra/note, &quot;@division&quot;)"/>
+    <report same="{($by-id = $again)}">
+      <xsl:for-each select="sales/division">
+        <xsl:variable name="id" select="@id"/>
+        <division id="{$id}">
+          <revenue>
+            <xsl:value-of select="normalize-space(revenue)"/>
+          </revenue>
+          <target>
+            <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="slax:lookup($by-target, $id)"/>
+          </target>
+          <xsl:for-each xmlns:slax="http://xml.libslax.org/slax" select="slax:lookup($by-division, $id)">
+            <manager region="{@region}">
+              <xsl:value-of select="."/>
+            </manager>
+          </xsl:for-each>
+          <note>
+            <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="slax:lookup($by-note, $id)"/>
+          </note>
+        </division>
+      </xsl:for-each>
+      <xsl:for-each select="$targets/target">
+        <xsl:if xmlns:slax="http://xml.libslax.org/slax" test="not(slax:lookup($by-id, @division))">
+          <unknown>
+            <xsl:value-of select="@division"/>
+          </unknown>
+        </xsl:if>
+      </xsl:for-each>
+      <warm>
+        <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="count(slax:lookup($by-region, &quot;warm&quot;))"/>
+      </warm>
+      <both>
+        <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="count(slax:lookup($by-division, $managers/manager/@division))"/>
+      </both>
+      <revenue>
+        <xsl:value-of xmlns:slax="http://xml.libslax.org/slax" select="sum(slax:lookup($by-id, $targets/target/@division)/revenue)"/>
+      </revenue>
+    </report>
+  </xsl:template>
+</xsl:stylesheet>
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Memory numbers for the pa and xi test programs.  When run-tests.sh
+ * is checking memory budgets, it names a file in TEST_MEMSTATS, and
+ * we count psu allocations and write a line of "name value" pairs
+ * to that file at exit:
+ *
+ *   psu-allocs 42 psu-reallocs 3 psu-frees 40 psu-live 2 \
+ *       psu-bytes 81920 peak-rss-kb 1840
+ *
+ * "psu-live" is allocations not yet freed at exit.  Tests that leave
+ * by _exit() (to act out a crash) don't write anything.  Include
+ * this in one file per program, and call memstats_init() before
+ * anything allocates.
+ */
+
+#ifndef TESTS_MEMSTATS_H
+#define TESTS_MEMSTATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <libpsu/psualloc.h>
+
+static const char *memstats_file;
+
+static void
+memstats_report (void)
+{
+    psu_alloc_stats_t stats;
+    struct rusage ru;
+    FILE *fp;
+
+    fp = fopen(memstats_file, "w");
+    if (fp == NULL)
+	return;
+
+    psu_alloc_stats(&stats);
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+	ru.ru_maxrss = 0;
+
+    /* ru_maxrss is in kilobytes on Linux and bytes on macOS */
+#if defined(__APPLE__)
+    ru.ru_maxrss /= 1024;
+#endif
+
+    fprintf(fp, "psu-allocs %llu psu-reallocs %llu psu-frees %llu "
+	    "psu-live %llu psu-bytes %llu peak-rss-kb %ld\n",
+	    (unsigned long long) stats.pas_allocs,
+	    (unsigned long long) stats.pas_reallocs,
+	    (unsigned long long) stats.pas_frees,
+	    (unsigned long long) (stats.pas_allocs - stats.pas_frees),
+	    (unsigned long long) stats.pas_bytes,
+	    (long) ru.ru_maxrss);
+    fclose(fp);
+}
+
+static void
+memstats_init (void)
+{
+    memstats_file = getenv("TEST_MEMSTATS");
+    if (memstats_file == NULL || *memstats_file == '\0')
+	return;
+
+    psu_alloc_count();
+    atexit(memstats_report);
+}
+
+#endif /* TESTS_MEMSTATS_H */
@@ -39,9 +39,12 @@ test_init (void)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa01", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa01", opt_mmap_flags, 0644);
     assert(pmp != NULL);
 
+    if (opt_mmap_flags & PMF_CHECKPOINT)
+	printf("checkpoint %u\n", pa_mmap_generation(pmp));
+
     pfp = pa_fixed_open(pmp, "pa_01", opt_shift, opt_size, opt_max_atoms);
     assert(pfp != NULL);
 }
@@ -80,4 +83,5 @@ void
 test_close (void)
 {
     pa_fixed_close(pfp);
+    pa_mmap_close(pmp);
 }
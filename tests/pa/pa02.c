@@ -38,7 +38,7 @@ test_init (void)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa02", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa02", opt_mmap_flags, 0644);
     assert(pmp);
 }
 
@@ -38,7 +38,7 @@ test_init (void)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa03", 0, 0);
+    pmp = pa_mmap_open(opt_filename, "pa03", opt_mmap_flags, 0);
     assert(pmp != NULL);
 
     pfp = pa_fixed_open(pmp, "test", opt_shift, opt_size, opt_max_atoms);
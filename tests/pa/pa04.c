@@ -22,8 +22,11 @@
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
+#include <parrotdb/pastats.h>
 #include <parrotdb/paarb.h>
 
+#define NEED_COMPACT
+#define NEED_STATS
 #include "pamain.h"
 
 void
@@ -40,15 +43,19 @@ test_init (void)
 
 pa_mmap_t *pmp;
 pa_arb_t *prp;
+pa_arb_atom_t *atoms;		/* Atoms, by slot, for compaction */
 
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa04", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa04", opt_mmap_flags, 0644);
     assert(pmp);
 
     prp = pa_arb_open(pmp, "pa04");
     assert(prp);
+
+    atoms = calloc(opt_count, sizeof(*atoms));
+    assert(atoms);
 }
 
 void
@@ -61,6 +68,7 @@ test_alloc (unsigned slot, unsigned this_size)
 	this_size = sizeof(*tp);
 
     trec[slot] = tp;
+    atoms[slot] = atom;
     if (tp) {
 	memset(tp, opt_value, this_size);
 	tp->t_magic = opt_magic;
@@ -109,6 +117,7 @@ test_free (unsigned slot)
 		   slot, pa_arb_atom_of(atom), tp);
 	pa_arb_free_atom(prp, atom);
 	trec[slot] = NULL;
+	atoms[slot] = pa_arb_null_atom();
     } else {
 	printf("%u : free already\n", slot);
     }
@@ -130,6 +139,47 @@ test_print (unsigned slot)
     }
 }
 
+void
+test_compact (unsigned max_pages)
+{
+    pa_arb_compact_t prc;
+    unsigned slot;
+
+    pa_arb_compact(prp, max_pages, &prc);
+
+    /* Pointers into moved chunks are stale; rebuild them from atoms */
+    for (slot = 0; slot < opt_count; slot++) {
+	if (trec[slot] == NULL)
+	    continue;
+
+	pa_arb_atom_t atom = pa_arb_forward(&prc, atoms[slot]);
+	test_t *tp = pa_arb_atom_addr(prp, atom);
+
+	if (pa_arb_atom_of(atom) != pa_arb_atom_of(atoms[slot]) && !opt_quiet)
+	    printf("move %u : %#x -> %#x\n", slot,
+		   pa_arb_atom_of(atoms[slot]), pa_arb_atom_of(atom));
+
+	atoms[slot] = atom;
+	trec[slot] = tp;
+	tp->t_id = pa_arb_atom_of(atom);
+    }
+
+    printf("compact: moved %u, pages %u\n", prc.prc_count, prc.prc_pages);
+    pa_arb_compact_done(&prc);
+}
+
+void
+test_stats (void)
+{
+    unsigned count;
+    pa_stats_t *stats = pa_stats_collect(pmp, &count);
+
+    if (stats) {
+	pa_stats_json(stdout, stats, count);
+	psu_free(stats);
+    }
+}
+
 void
 test_close (void)
 {
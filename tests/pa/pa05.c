@@ -59,7 +59,7 @@ test_key_func (pa_pat_t *root, pa_pat_data_atom_t datom)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa05", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa05", opt_mmap_flags, 0644);
     assert(pmp);
 
     pip = pa_istr_open(pmp, "istr", opt_shift, 2, opt_max_atoms);
@@ -22,11 +22,14 @@
 #include <parrotdb/pacommon.h>
 #include <parrotdb/paconfig.h>
 #include <parrotdb/pammap.h>
+#include <parrotdb/pastats.h>
 #include <parrotdb/pafixed.h>
 #include <parrotdb/paistr.h>
 
 #define NEED_T_ATOM
 #define NEED_KEY
+#define NEED_COMPACT
+#define NEED_STATS
 #include "pamain.h"
 
 pa_mmap_t *pmp;
@@ -53,11 +56,14 @@ test_init (void)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa06", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa06", opt_mmap_flags, 0644);
     assert(pmp);
 
     pip = pa_istr_open(pmp, "istr", opt_shift, 2, opt_max_atoms);
     assert(pip);
+
+    if (opt_hash)
+	assert(pa_istr_hash_open(pip, "istr.hash", 0));
 }
 
 void
@@ -72,7 +78,8 @@ test_key (unsigned slot, const char *key)
     static unsigned id;
 
     unsigned len = key ? strlen(key) : 0;
-    pa_istr_atom_t atom = pa_istr_string(pip, key);
+    pa_istr_atom_t atom = opt_hash ? pa_istr_hash_string(pip, key)
+	: pa_istr_string(pip, key);
     if (pa_istr_is_null(atom))
 	return;
 
@@ -122,9 +129,27 @@ test_list (const char *key UNUSED)
 }
 
 void
-test_free (unsigned slot UNUSED)
+test_free (unsigned slot)
 {
-    return;
+    test_t *tp = trec[slot];
+
+    if (tp) {
+	pa_istr_free(pip, pa_istr_atom(tp->t_atom));
+	if (!opt_quiet)
+	    printf("free %u : %#x\n", slot, tp->t_atom);
+	free(tp);
+	trec[slot] = NULL;
+    } else {
+	printf("%u : free already\n", slot);
+    }
+}
+
+void
+test_compact (unsigned max_pages)
+{
+    unsigned pages = pa_istr_compact(pip, max_pages);
+
+    printf("compact: pages %u\n", pages);
 }
 
 void
@@ -145,8 +170,21 @@ test_print (unsigned slot)
     }
 }
 
+void
+test_stats (void)
+{
+    unsigned count;
+    pa_stats_t *stats = pa_stats_collect(pmp, &count);
+
+    if (stats) {
+	pa_stats_json(stdout, stats, count);
+	psu_free(stats);
+    }
+}
+
 void
 test_close (void)
 {
-    return;
+    if (opt_dump && opt_hash)
+	pa_istr_dump(pip, TRUE);
 }
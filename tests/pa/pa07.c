@@ -54,7 +54,7 @@ test_init (void)
 void
 test_open (void)
 {
-    pmp = pa_mmap_open(opt_filename, "pa07", 0, 0644);
+    pmp = pa_mmap_open(opt_filename, "pa07", opt_mmap_flags, 0644);
     assert(pmp != NULL);
 
     pbp = pa_bitmap_open(pmp, "pa07.bitmap");
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Bulk loading and range deletion for pa_pat trees.  Keys ("k")
+ * are collected, and the tree is built with pa_pat_bulk_load() the
+ * first time it's needed.  "f" deletes one key, "r lo hi" deletes
+ * a range.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+
+#define NEED_KEY
+#define NEED_RANGE
+#include "pamain.h"
+
+pa_mmap_t *pmp;
+pa_istr_t *pip;
+pa_pat_t *ppp;
+psu_boolean_t built;
+
+void
+test_init (void)
+{
+    return;
+}
+
+static const uint8_t *
+test_key_func (pa_pat_t *root, pa_pat_data_atom_t datom)
+{
+    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(datom));
+    return (const uint8_t *) pa_istr_atom_string(root->pp_data, atom);
+}
+
+static const char *
+test_string (pa_atom_t atom)
+{
+    return pa_istr_atom_string(pip, pa_istr_atom(atom));
+}
+
+static int
+test_compare (const void *v1, const void *v2)
+{
+    const pa_pat_data_atom_t *a1 = v1, *a2 = v2;
+
+    return strcmp(test_string(pa_pat_data_atom_of(*a1)),
+		  test_string(pa_pat_data_atom_of(*a2)));
+}
+
+/*
+ * Build the tree from all the keys we've seen
+ */
+static void
+test_build (void)
+{
+    pa_pat_data_atom_t *datoms;
+    uint16_t *lengths;
+    unsigned slot, count = 0, i, j;
+
+    if (built)
+	return;
+    built = TRUE;
+
+    datoms = calloc(opt_count, sizeof(*datoms));
+    lengths = calloc(opt_count, sizeof(*lengths));
+    assert(datoms && lengths);
+
+    for (slot = 0; slot < opt_count; slot++)
+	if (trec[slot])
+	    datoms[count++] = pa_pat_data_atom(trec[slot]->t_id);
+
+    qsort(datoms, count, sizeof(*datoms), test_compare);
+
+    /* Squeeze out duplicates, since the tree can't hold them */
+    for (i = j = 0; i < count; i++) {
+	if (j > 0 && test_compare(&datoms[j - 1], &datoms[i]) == 0)
+	    continue;
+	datoms[j] = datoms[i];
+	lengths[j] = strlen(test_string(pa_pat_data_atom_of(datoms[j]))) + 1;
+	j += 1;
+    }
+
+    psu_boolean_t rc = pa_pat_bulk_load(ppp, datoms, lengths, j);
+    printf("bulk load: %u keys: %s\n", j, rc ? "ok" : "failed");
+
+    /* Out of order input must be refused */
+    if (j > 1) {
+	pa_pat_t bad = *ppp;
+	pa_pat_info_t info = { pa_pat_null_atom(), ppp->pp_key_bytes, 0 };
+
+	bad.pp_infop = &info;
+	pa_pat_data_atom_t swap = datoms[0];
+	datoms[0] = datoms[1];
+	datoms[1] = swap;
+	uint16_t len = lengths[0];
+	lengths[0] = lengths[1];
+	lengths[1] = len;
+
+	rc = pa_pat_bulk_load(&bad, datoms, lengths, j);
+	printf("bulk load: unsorted: %s\n", rc ? "ok" : "failed");
+    }
+
+    free(lengths);
+    free(datoms);
+}
+
+void
+test_open (void)
+{
+    pmp = pa_mmap_open(opt_filename, "pa08", opt_mmap_flags, 0644);
+    assert(pmp);
+
+    pip = pa_istr_open(pmp, "istr", opt_shift, 2, opt_max_atoms);
+    assert(pip);
+
+    ppp = pa_pat_open(pmp, "pat", pip, test_key_func,
+		      PA_PAT_MAXKEY, opt_shift, opt_max_atoms);
+    assert(ppp);
+
+    pa_pat_set_flags(ppp, opt_pat_flags);
+}
+
+void
+test_alloc (unsigned slot UNUSED, unsigned this_size UNUSED)
+{
+    return;
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    size_t len = key ? strlen(key) : 0;
+
+    if (len == 0)
+	return;
+
+    test_t *tp = calloc(1, sizeof(*tp));
+
+    trec[slot] = tp;
+    if (tp) {
+	tp->t_magic = opt_magic;
+	tp->t_slot = slot;
+	tp->t_id = pa_istr_atom_of(pa_istr_string(pip, key));
+    }
+
+    if (!opt_quiet)
+	printf("in %u (%zu) : %s -> (%#x)\n", slot, len, key,
+	       tp ? tp->t_id : 0);
+}
+
+void
+test_list (const char *key)
+{
+    uint16_t plen = strlen(key) * PA_NBBY;
+    pa_pat_node_t *node;
+
+    test_build();
+
+    node = pa_pat_subtree_match(ppp, plen, key);
+    for ( ; node != NULL; node = pa_pat_subtree_next(ppp, node, plen))
+	printf("  [%s]\n", test_string(pa_pat_data_atom_of(node->ppn_data)));
+}
+
+void
+test_dump (void)
+{
+    pa_pat_node_t *node = NULL;
+    unsigned count = 0, missing = 0, slot;
+
+    test_build();
+
+    while ((node = pa_pat_find_next(ppp, node)) != NULL) {
+	printf("  [%s]\n", test_string(pa_pat_data_atom_of(node->ppn_data)));
+	count += 1;
+    }
+
+    /* Every key we still hold must be found via lookup */
+    for (slot = 0; slot < opt_count; slot++) {
+	if (trec[slot] == NULL)
+	    continue;
+
+	const char *key = test_string(trec[slot]->t_id);
+	if (pa_pat_get(ppp, strlen(key) + 1, key) == NULL) {
+	    printf("missing: %u [%s]\n", slot, key);
+	    missing += 1;
+	}
+    }
+
+    printf("dump: %u keys, %u missing\n", count, missing);
+}
+
+/*
+ * Forget any slot whose key is no longer in the tree
+ */
+static void
+test_forget (void)
+{
+    unsigned slot;
+
+    for (slot = 0; slot < opt_count; slot++) {
+	if (trec[slot] == NULL)
+	    continue;
+
+	const char *key = test_string(trec[slot]->t_id);
+	if (pa_pat_get(ppp, strlen(key) + 1, key) == NULL) {
+	    free(trec[slot]);
+	    trec[slot] = NULL;
+	}
+    }
+}
+
+void
+test_range (const char *lo, const char *hi)
+{
+    test_build();
+
+    uint32_t count = pa_pat_delete_range(ppp, lo ? strlen(lo) + 1 : 0, lo,
+					 hi ? strlen(hi) + 1 : 0, hi);
+    printf("range [%s] .. [%s]: deleted %u\n", lo ?: "-", hi ?: "-", count);
+
+    test_forget();
+}
+
+void
+test_free (unsigned slot)
+{
+    test_t *tp = trec[slot];
+
+    test_build();
+
+    if (tp == NULL) {
+	printf("%u : free\n", slot);
+	return;
+    }
+
+    const char *key = test_string(tp->t_id);
+    size_t len = strlen(key) + 1;
+    uint32_t count = pa_pat_delete_range(ppp, len, key, len, key);
+    printf("free %u [%s]: deleted %u\n", slot, key, count);
+
+    test_forget();
+}
+
+void
+test_print (unsigned slot)
+{
+    test_t *tp = trec[slot];
+
+    if (tp)
+	printf("%u : [%s]\n", slot, test_string(tp->t_id));
+    else
+	printf("%u : free\n", slot);
+}
+
+void
+test_close (void)
+{
+    return;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Bulk bitmap operations.  We keep two bitmaps, "a" and "b".  "k N a"
+ * sets bit N in a (or b); "f N" clears it in both; "l op" runs an
+ * operation (or, and, andnot) into a, using b as the source.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/pabitmap.h>
+
+#define NEED_KEY
+#include "pamain.h"
+
+pa_mmap_t *pmp;
+pa_bitmap_t *pbp;
+pa_bitmap_id_t bitmap_a, bitmap_b;
+
+void
+test_init (void)
+{
+    if (opt_count > PA_BITMAP_MAX_BIT)
+	opt_count = PA_BITMAP_MAX_BIT;
+}
+
+void
+test_open (void)
+{
+    pmp = pa_mmap_open(opt_filename, "pa09", opt_mmap_flags, 0644);
+    assert(pmp != NULL);
+
+    pbp = pa_bitmap_open(pmp, "pa09.bitmap");
+    assert(pbp != NULL);
+
+    bitmap_a = pa_bitmap_alloc(pbp);
+    bitmap_b = pa_bitmap_alloc(pbp);
+}
+
+void
+test_alloc (unsigned slot UNUSED, unsigned size UNUSED)
+{
+    return;
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    pa_bitmap_set(pbp, (*key == 'b') ? bitmap_b : bitmap_a, slot);
+}
+
+void
+test_free (unsigned slot)
+{
+    pa_bitmap_clear(pbp, bitmap_a, slot);
+    pa_bitmap_clear(pbp, bitmap_b, slot);
+}
+
+static void
+test_dump_one (const char *name, pa_bitmap_id_t bitmap_id)
+{
+    pa_bitnumber_t num = PA_BITMAP_FIND_START;
+    unsigned count = 0;
+
+    printf("%s:", name);
+    for (;;) {
+	num = pa_bitmap_find_next(pbp, bitmap_id, num);
+	if (num == PA_BITMAP_FIND_DONE)
+	    break;
+
+	printf(" %u", num);
+	count += 1;
+    }
+
+    printf("\n%s: count %u, found %u\n", name,
+	   pa_bitmap_count(pbp, bitmap_id), count);
+}
+
+void
+test_list (const char *op)
+{
+    if (strcmp(op, "or") == 0)
+	pa_bitmap_or(pbp, bitmap_a, bitmap_b);
+    else if (strcmp(op, "and") == 0)
+	pa_bitmap_and(pbp, bitmap_a, bitmap_b);
+    else if (strcmp(op, "andnot") == 0)
+	pa_bitmap_andnot(pbp, bitmap_a, bitmap_b);
+    else {
+	printf("unknown op: %s\n", op);
+	return;
+    }
+
+    printf("op: %s\n", op);
+    test_dump_one("a", bitmap_a);
+}
+
+void
+test_close (void)
+{
+    pa_bitmap_close(pbp);
+}
+
+void
+test_print (unsigned slot)
+{
+    printf("tst %u a:%s b:%s\n", slot,
+	   pa_bitmap_test(pbp, bitmap_a, slot) ? "on" : "off",
+	   pa_bitmap_test(pbp, bitmap_b, slot) ? "on" : "off");
+}
+
+void
+test_dump (void)
+{
+    test_dump_one("a", bitmap_a);
+    test_dump_one("b", bitmap_b);
+}
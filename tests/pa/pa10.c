@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * libpsu allocator objects.  "a N S" takes S bytes from a bump arena
+ * (through its allocator face); "k N pool" and "k N cache" take an
+ * object from a pool or a thread cache in front of it; "f N" frees
+ * a slot; "l mark" and "l release" mark and release the arena; "l
+ * grow N S" reallocs slot N to S bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <libpsu/psubump.h>
+#include <libpsu/psupool.h>
+
+#define NEED_KEY
+#include "pamain.h"
+
+#define KIND_BUMP	1
+#define KIND_POOL	2
+#define KIND_CACHE	3
+
+static const char *kind_names[] = { "none", "bump", "pool", "cache" };
+
+typedef struct slot_s {
+    unsigned s_kind;		/* KIND_* */
+    unsigned s_size;		/* Bytes requested */
+    unsigned s_gen;		/* Mark generation when allocated */
+    unsigned char *s_data;	/* The memory */
+} slot_t;
+
+slot_t *slots;
+psu_bump_t bump;
+psu_bump_mark_t mark;
+unsigned mark_gen, cur_gen;
+psu_pool_t pool;
+psu_tcache_t cache;
+
+void
+test_init (void)
+{
+    return;
+}
+
+void
+test_open (void)
+{
+    slots = calloc(opt_count, sizeof(*slots));
+    assert(slots != NULL);
+
+    /* Small blocks, so we cross them often */
+    psu_bump_init(&bump, NULL, 1024);
+
+    int rc = psu_pool_init(&pool, NULL, opt_size, 4, PSU_POOLF_SHARED);
+    assert(rc == 0);
+    psu_tcache_init(&cache, &pool, 4);
+}
+
+static void
+fill (slot_t *sp, unsigned slot, unsigned from)
+{
+    unsigned i;
+
+    for (i = from; i < sp->s_size; i++)
+	sp->s_data[i] = (unsigned char) (slot + i);
+}
+
+static int
+check (slot_t *sp, unsigned slot)
+{
+    unsigned i;
+
+    for (i = 0; i < sp->s_size; i++)
+	if (sp->s_data[i] != (unsigned char) (slot + i))
+	    return 0;
+    return 1;
+}
+
+void
+test_alloc (unsigned slot, unsigned size)
+{
+    slot_t *sp = &slots[slot];
+
+    if (sp->s_kind)
+	test_free(slot);
+
+    sp->s_data = psu_allocator_malloc(psu_bump_allocator(&bump), size);
+    assert(sp->s_data != NULL);
+    sp->s_kind = KIND_BUMP;
+    sp->s_size = size;
+    sp->s_gen = cur_gen;
+    fill(sp, slot, 0);
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    slot_t *sp = &slots[slot];
+
+    if (sp->s_kind)
+	test_free(slot);
+
+    if (strcmp(key, "pool") == 0) {
+	sp->s_data = psu_pool_get(&pool);
+	sp->s_kind = KIND_POOL;
+    } else if (strcmp(key, "cache") == 0) {
+	sp->s_data = psu_tcache_get(&cache);
+	sp->s_kind = KIND_CACHE;
+    } else {
+	printf("unknown kind: %s\n", key);
+	return;
+    }
+
+    assert(sp->s_data != NULL);
+    sp->s_size = pool.ppl_size;
+    fill(sp, slot, 0);
+}
+
+void
+test_list (const char *key)
+{
+    unsigned slot, size;
+
+    if (strcmp(key, "mark") == 0) {
+	mark = psu_bump_mark(&bump);
+	mark_gen = ++cur_gen;
+
+    } else if (strcmp(key, "release") == 0) {
+	psu_bump_release(&bump, &mark);
+
+	/* Forget everything allocated since the mark */
+	for (slot = 0; slot < opt_count; slot++)
+	    if (slots[slot].s_kind == KIND_BUMP
+		    && slots[slot].s_gen >= mark_gen)
+		memset(&slots[slot], 0, sizeof(slots[slot]));
+
+    } else if (sscanf(key, "grow %u %u", &slot, &size) == 2
+	       && slot < opt_count && slots[slot].s_kind == KIND_BUMP) {
+	slot_t *sp = &slots[slot];
+	unsigned char *old = sp->s_data;
+
+	sp->s_data = psu_allocator_realloc(psu_bump_allocator(&bump),
+					   sp->s_data, size);
+	assert(sp->s_data != NULL);
+	printf("grow %u: %u -> %u%s\n", slot, sp->s_size, size,
+	       (old == sp->s_data) ? " (in place)" : "");
+	if (size > sp->s_size) {
+	    unsigned from = sp->s_size;
+	    sp->s_size = size;
+	    fill(sp, slot, from);
+	} else {
+	    sp->s_size = size;
+	}
+
+    } else {
+	printf("unknown list command: %s\n", key);
+    }
+}
+
+void
+test_free (unsigned slot)
+{
+    slot_t *sp = &slots[slot];
+
+    switch (sp->s_kind) {
+    case KIND_BUMP:
+	psu_allocator_free(psu_bump_allocator(&bump), sp->s_data);
+	break;
+
+    case KIND_POOL:
+	psu_pool_put(&pool, sp->s_data);
+	break;
+
+    case KIND_CACHE:
+	psu_tcache_put(&cache, sp->s_data);
+	break;
+    }
+
+    memset(sp, 0, sizeof(*sp));
+}
+
+void
+test_print (unsigned slot)
+{
+    slot_t *sp = &slots[slot];
+
+    if (sp->s_kind == 0)
+	return;
+
+    printf("%u : %s [%u]%s\n", slot, kind_names[sp->s_kind], sp->s_size,
+	   check(sp, slot) ? "" : " bad-data");
+}
+
+void
+test_dump (void)
+{
+    unsigned slot;
+
+    printf("dumping: (%u)\n", opt_count);
+    for (slot = 0; slot < opt_count; slot++)
+	test_print(slot);
+
+    printf("pool: live %lu, cached %u\n", psu_pool_live(&pool),
+	   cache.ptc_count);
+}
+
+void
+test_close (void)
+{
+    psu_tcache_flush(&cache);
+    printf("pool: live %lu after flush\n", psu_pool_live(&pool));
+
+    psu_pool_cleanup(&pool);
+    psu_bump_cleanup(&bump);
+    printf("bump: %lu bytes after cleanup\n",
+	   (unsigned long) psu_bump_size(&bump));
+
+    free(slots);
+}
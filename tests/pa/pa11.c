@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * libpsu work pools.  The pool has "shift" workers.  "a N S" runs S
+ * tasks that add 1..S into slot N; "k N fib M" computes fib(M) with
+ * each call a task that waits on its two subcalls; "k N tree D W"
+ * makes a tree of tasks D deep and W wide, counting the leaves; "k N
+ * pin S" is "a" on a pool with pinned workers; "l default" runs on
+ * the process's shared pool; "f N" clears a slot.  Only the answers
+ * are printed, since which worker runs what varies from run to run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <libpsu/psuwork.h>
+
+#define NEED_KEY
+#include "pamain.h"
+
+typedef struct slot_s {
+    char s_what[32];		/* What we computed */
+    unsigned long s_value;	/* The answer */
+} slot_t;
+
+typedef struct sum_arg_s {
+    unsigned long *sa_sum;	/* Where to add */
+    unsigned sa_value;		/* What to add */
+} sum_arg_t;
+
+typedef struct fib_s {
+    psu_work_pool_t *f_pool;	/* Pool to run on */
+    unsigned f_n;		/* Argument */
+    unsigned long f_res;	/* Result */
+} fib_t;
+
+typedef struct tree_s {
+    psu_work_pool_t *t_pool;	/* Pool to run on */
+    unsigned t_depth;		/* Levels below us */
+    unsigned t_width;		/* Children of each node */
+    unsigned long *t_leaves;	/* Leaf count */
+} tree_t;
+
+slot_t *slots;
+psu_work_pool_t *pool;
+
+void
+test_init (void)
+{
+    return;
+}
+
+void
+test_open (void)
+{
+    slots = calloc(opt_count, sizeof(*slots));
+    assert(slots != NULL);
+
+    pool = psu_work_pool_create(opt_shift, 0);
+    assert(pool != NULL);
+    printf("pool: %u workers\n", psu_work_pool_size(pool));
+}
+
+static void
+sum_task (void *arg)
+{
+    sum_arg_t *sap = arg;
+
+    __atomic_add_fetch(sap->sa_sum, sap->sa_value, __ATOMIC_RELAXED);
+}
+
+static unsigned long
+run_sum (psu_work_pool_t *pwpp, unsigned count)
+{
+    sum_arg_t *args = calloc(count, sizeof(*args));
+    psu_work_group_t group;
+    unsigned long sum = 0;
+    unsigned i;
+
+    assert(args != NULL);
+    psu_work_group_init(&group);
+
+    for (i = 0; i < count; i++) {
+	args[i].sa_sum = &sum;
+	args[i].sa_value = i + 1;
+	if (psu_work_submit(pwpp, &group, sum_task, &args[i]) != 0)
+	    printf("submit failed\n");
+    }
+
+    psu_work_group_wait(pwpp, &group);
+    free(args);
+
+    return sum;
+}
+
+static void
+fib_task (void *arg)
+{
+    fib_t *fp = arg;
+    psu_work_group_t group;
+
+    if (fp->f_n < 2) {
+	fp->f_res = fp->f_n;
+	return;
+    }
+
+    fib_t a = { .f_pool = fp->f_pool, .f_n = fp->f_n - 1 };
+    fib_t b = { .f_pool = fp->f_pool, .f_n = fp->f_n - 2 };
+
+    psu_work_group_init(&group);
+    psu_work_submit(fp->f_pool, &group, fib_task, &a);
+    psu_work_submit(fp->f_pool, &group, fib_task, &b);
+    psu_work_group_wait(fp->f_pool, &group);
+
+    fp->f_res = a.f_res + b.f_res;
+}
+
+static void
+tree_task (void *arg)
+{
+    tree_t *tp = arg, *kids;
+    psu_work_group_t group;
+    unsigned i;
+
+    if (tp->t_depth == 0) {
+	__atomic_add_fetch(tp->t_leaves, 1, __ATOMIC_RELAXED);
+	return;
+    }
+
+    kids = calloc(tp->t_width, sizeof(*kids));
+    assert(kids != NULL);
+    psu_work_group_init(&group);
+
+    for (i = 0; i < tp->t_width; i++) {
+	kids[i] = *tp;
+	kids[i].t_depth -= 1;
+	psu_work_submit(tp->t_pool, &group, tree_task, &kids[i]);
+    }
+
+    psu_work_group_wait(tp->t_pool, &group);
+    free(kids);
+}
+
+void
+test_alloc (unsigned slot, unsigned size)
+{
+    slot_t *sp = &slots[slot];
+
+    snprintf(sp->s_what, sizeof(sp->s_what), "sum %u", size);
+    sp->s_value = run_sum(pool, size);
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    slot_t *sp = &slots[slot];
+    unsigned a, b;
+
+    if (sscanf(key, "fib %u", &a) == 1) {
+	fib_t fib = { .f_pool = pool, .f_n = a };
+
+	fib_task(&fib);
+	sp->s_value = fib.f_res;
+
+    } else if (sscanf(key, "tree %u %u", &a, &b) == 2) {
+	unsigned long leaves = 0;
+	tree_t tree = {
+	    .t_pool = pool, .t_depth = a, .t_width = b, .t_leaves = &leaves,
+	};
+
+	tree_task(&tree);
+	sp->s_value = leaves;
+
+    } else if (sscanf(key, "pin %u", &a) == 1) {
+	psu_work_pool_t *pinned = psu_work_pool_create(opt_shift,
+						       PSU_WORKF_PIN);
+
+	assert(pinned != NULL);
+	sp->s_value = run_sum(pinned, a);
+	psu_work_pool_destroy(pinned);
+
+    } else {
+	printf("unknown key: %s\n", key);
+	return;
+    }
+
+    snprintf(sp->s_what, sizeof(sp->s_what), "%s", key);
+}
+
+void
+test_list (const char *key)
+{
+    psu_work_pool_t *pwpp;
+
+    if (strcmp(key, "default") == 0) {
+	pwpp = psu_work_pool_default();
+	assert(pwpp != NULL);
+	printf("default: %s, same %s\n",
+	       run_sum(pwpp, 1000) == 500500 ? "ok" : "bad",
+	       pwpp == psu_work_pool_default() ? "yes" : "no");
+
+    } else if (strcmp(key, "self") == 0) {
+	printf("self: %d\n", psu_work_self(pool));
+
+    } else {
+	printf("unknown list command: %s\n", key);
+    }
+}
+
+void
+test_free (unsigned slot)
+{
+    memset(&slots[slot], 0, sizeof(slots[slot]));
+}
+
+void
+test_print (unsigned slot)
+{
+    slot_t *sp = &slots[slot];
+
+    if (sp->s_what[0] == '\0')
+	return;
+
+    printf("%u : %s = %lu\n", slot, sp->s_what, sp->s_value);
+}
+
+void
+test_dump (void)
+{
+    unsigned slot;
+
+    printf("dumping: (%u)\n", opt_count);
+    for (slot = 0; slot < opt_count; slot++)
+	test_print(slot);
+}
+
+void
+test_close (void)
+{
+    psu_work_pool_destroy(pool);
+    printf("pool: destroyed\n");
+
+    free(slots);
+}
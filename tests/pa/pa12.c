@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Range and subtree cursors for pa_pat trees.  "k" adds a key to the
+ * tree; "l prefix" lists a subtree and "r lo hi" lists a range, both
+ * through a cursor that returns "value" atoms per call (default 3,
+ * so batches break in odd places).  Each listing is checked against
+ * walking the tree with pa_pat_subtree_next() or pa_pat_find_next(),
+ * and "d" checks a cursor over the whole tree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+
+#define NEED_KEY
+#define NEED_RANGE
+#include "pamain.h"
+
+#define TEST_BATCH_MAX	64	/* Most atoms per cursor call */
+
+pa_mmap_t *pmp;
+pa_istr_t *pip;
+pa_pat_t *ppp;
+
+void
+test_init (void)
+{
+    return;
+}
+
+static const uint8_t *
+test_key_func (pa_pat_t *root, pa_pat_data_atom_t datom)
+{
+    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(datom));
+    return (const uint8_t *) pa_istr_atom_string(root->pp_data, atom);
+}
+
+static const char *
+test_string (pa_pat_data_atom_t datom)
+{
+    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(datom));
+    return pa_istr_atom_string(pip, atom);
+}
+
+void
+test_open (void)
+{
+    pmp = pa_mmap_open(opt_filename, "pa12", opt_mmap_flags, 0644);
+    assert(pmp);
+
+    pip = pa_istr_open(pmp, "istr", opt_shift, 2, opt_max_atoms);
+    assert(pip);
+
+    ppp = pa_pat_open(pmp, "pat", pip, test_key_func,
+		      PA_PAT_MAXKEY, opt_shift, opt_max_atoms);
+    assert(ppp);
+}
+
+void
+test_alloc (unsigned slot UNUSED, unsigned this_size UNUSED)
+{
+    return;
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    size_t len = key ? strlen(key) : 0;
+    pa_istr_atom_t atom;
+
+    if (len == 0)
+	return;
+
+    atom = pa_istr_string(pip, key);
+    if (!pa_pat_add(ppp, pa_pat_data_atom(pa_istr_atom_of(atom)), len + 1))
+	printf("add %u: [%s] is already there\n", slot, key);
+}
+
+/*
+ * Drain a cursor, printing what it returns and comparing it with
+ * "expect" (the nodes from the old-style walk)
+ */
+static void
+test_cursor (pa_pat_cursor_t *ppcp, pa_pat_node_t **expect, unsigned count)
+{
+    pa_pat_data_atom_t datoms[TEST_BATCH_MAX];
+    unsigned batch = (opt_value > 0) ? (unsigned) opt_value : 3;
+    unsigned got, i, seen = 0, bad = 0, calls = 0;
+
+    if (batch > TEST_BATCH_MAX)
+	batch = TEST_BATCH_MAX;
+
+    while ((got = pa_pat_cursor_next(ppcp, datoms, batch)) != 0) {
+	calls += 1;
+	for (i = 0; i < got; i++, seen++) {
+	    printf("  [%s]\n", test_string(datoms[i]));
+	    if (seen >= count
+		    || pa_pat_data_atom_of(datoms[i])
+		       != pa_pat_data_atom_of(expect[seen]->ppn_data))
+		bad += 1;
+	}
+    }
+
+    /* A finished cursor stays finished */
+    if (pa_pat_cursor_next(ppcp, datoms, batch) != 0)
+	bad += 1;
+
+    printf("cursor: %u keys in %u batches, %s\n", seen, calls,
+	   (bad || seen != count) ? "MISMATCH" : "ok");
+
+    pa_pat_cursor_close(ppcp);
+}
+
+void
+test_list (const char *key)
+{
+    uint16_t plen = strlen(key) * PA_NBBY;
+    pa_pat_node_t *node, **expect;
+    pa_pat_cursor_t cursor;
+    unsigned count = 0;
+
+    expect = calloc(opt_count, sizeof(*expect));
+    assert(expect);
+
+    node = pa_pat_subtree_match(ppp, plen, key);
+    for ( ; node && count < opt_count;
+	  node = pa_pat_subtree_next(ppp, node, plen))
+	expect[count++] = node;
+
+    printf("subtree [%s]:\n", key);
+    if (!pa_pat_cursor_subtree(&cursor, ppp, plen, key))
+	printf("cursor: failed\n");
+    else
+	test_cursor(&cursor, expect, count);
+
+    free(expect);
+}
+
+void
+test_range (const char *lo, const char *hi)
+{
+    uint16_t lo_bytes = lo ? strlen(lo) + 1 : 0;
+    uint16_t hi_bytes = hi ? strlen(hi) + 1 : 0;
+    pa_pat_node_t *node, **expect;
+    pa_pat_cursor_t cursor;
+    unsigned count = 0;
+
+    expect = calloc(opt_count, sizeof(*expect));
+    assert(expect);
+
+    /* The slow way: every node, checked against the bounds by hand */
+    for (node = pa_pat_find_next(ppp, NULL); node && count < opt_count;
+	 node = pa_pat_find_next(ppp, node)) {
+	const char *cp = test_string(node->ppn_data);
+
+	if (lo && strcmp(cp, lo) < 0)
+	    continue;
+	if (hi && strcmp(cp, hi) > 0)
+	    break;
+	expect[count++] = node;
+    }
+
+    printf("range [%s] .. [%s]:\n", lo ?: "-", hi ?: "-");
+    if (!pa_pat_cursor_range(&cursor, ppp, lo_bytes, lo, hi_bytes, hi))
+	printf("cursor: failed\n");
+    else
+	test_cursor(&cursor, expect, count);
+
+    free(expect);
+}
+
+void
+test_free (unsigned slot UNUSED)
+{
+    return;
+}
+
+void
+test_print (unsigned slot UNUSED)
+{
+    return;
+}
+
+void
+test_dump (void)
+{
+    test_range(NULL, NULL);
+}
+
+void
+test_close (void)
+{
+    return;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Journaled segments.  Each "k" (add a key) and "f" (delete one) is
+ * a transaction, committed as soon as it's made.  "value 1" ends the
+ * run by syncing the journal and exiting without closing anything,
+ * as a crash would; "value 2" crashes without the sync, losing the
+ * transactions still waiting for their group.  The next run (each
+ * .in file reuses the same segment) replays what was durable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+
+#define NEED_KEY
+#include "pamain.h"
+
+pa_mmap_t *pmp;
+pa_istr_t *pip;
+pa_pat_t *ppp;
+pa_istr_atom_t *keys;
+
+void
+test_init (void)
+{
+    return;
+}
+
+static const uint8_t *
+test_key_func (pa_pat_t *root, pa_pat_data_atom_t datom)
+{
+    pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(datom));
+    return (const uint8_t *) pa_istr_atom_string(root->pp_data, atom);
+}
+
+void
+test_open (void)
+{
+    pmp = pa_mmap_open(opt_filename, "pa13",
+		       opt_mmap_flags | PMF_JOURNAL, 0644);
+    assert(pmp);
+
+    pa_mmap_dump(pmp, FALSE);
+
+    pip = pa_istr_open(pmp, "istr", opt_shift, 2, opt_max_atoms);
+    assert(pip);
+
+    ppp = pa_pat_open(pmp, "pat", pip, test_key_func,
+		      PA_PAT_MAXKEY, opt_shift, opt_max_atoms);
+    assert(ppp);
+
+    keys = calloc(opt_count, sizeof(*keys));
+    assert(keys);
+
+    /* Opening the allocators the first time is a transaction too */
+    pa_mmap_commit(pmp);
+}
+
+void
+test_alloc (unsigned slot UNUSED, unsigned this_size UNUSED)
+{
+    return;
+}
+
+void
+test_key (unsigned slot, const char *key)
+{
+    size_t len = key ? strlen(key) : 0;
+    pa_istr_atom_t atom;
+
+    if (len == 0 || slot >= opt_count)
+	return;
+
+    atom = pa_istr_string(pip, key);
+    if (!pa_pat_add(ppp, pa_pat_data_atom(pa_istr_atom_of(atom)), len + 1))
+	printf("add %u: [%s] is already there\n", slot, key);
+
+    keys[slot] = atom;
+    pa_mmap_commit(pmp);
+}
+
+void
+test_free (unsigned slot)
+{
+    const char *key = pa_istr_atom_string(pip, keys[slot]);
+    uint16_t len;
+
+    if (key == NULL)
+	return;
+
+    len = strlen(key) + 1;
+    if (pa_pat_delete_range(ppp, len, key, len, key) != 1)
+	printf("delete %u: [%s] is not there\n", slot, key);
+
+    pa_mmap_commit(pmp);
+}
+
+void
+test_list (const char *key UNUSED)
+{
+    return;
+}
+
+void
+test_print (unsigned slot UNUSED)
+{
+    return;
+}
+
+void
+test_dump (void)
+{
+    pa_pat_node_t *node;
+    unsigned count = 0;
+
+    for (node = pa_pat_find_next(ppp, NULL); node;
+	 node = pa_pat_find_next(ppp, node)) {
+	pa_istr_atom_t atom = pa_istr_atom(pa_pat_data_atom_of(node->ppn_data));
+	printf("  [%s]\n", pa_istr_atom_string(pip, atom));
+	count += 1;
+    }
+
+    printf("%u keys\n", count);
+}
+
+void
+test_close (void)
+{
+    if (opt_value == 1 || opt_value == 2) {
+	if (opt_value == 1)
+	    pa_mmap_sync(pmp);
+
+	/* Leave everything as a crash would */
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+    }
+
+    pa_pat_close(ppp);
+    pa_istr_close(pip);
+    pa_mmap_close(pmp);
+    free(keys);
+}
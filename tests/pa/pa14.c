@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * A writer and a reader sharing a PMF_SHARED segment.  We fork a
+ * reader before opening the segment, then the writer runs the input:
+ * "a slot size" allocates "size" bytes, fills them with a new value
+ * and records the value twice in a header, all in one write section;
+ * "f slot" frees.  The reader loops over read sections, checking that
+ * the two copies of the value and the newest allocation agree, which
+ * makes it remap as the writer grows the segment.  A second writer
+ * must be refused by the writer's flock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <assert.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sched.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+
+#include "pamain.h"
+
+/* What the writer publishes; the reader checks it */
+typedef struct pa14_header_s {
+    uint32_t ph_value;		/* Value of the newest allocation */
+    uint32_t ph_check;		/* Copy of ph_value, set last */
+    pa_mmap_atom_t ph_latest;	/* Newest allocation */
+    uint32_t ph_done;		/* The writer is finished */
+} pa14_header_t;
+
+pa_mmap_t *pmp;
+pa14_header_t *php;
+pa_mmap_atom_t atoms[MAX_VAL];
+unsigned sizes[MAX_VAL];
+pid_t reader;
+int reader_go = -1;		/* Pipe to start the reader */
+int reader_ready = -1;		/* Pipe for the reader to say it's mapped */
+
+void
+test_init (void)
+{
+    if (opt_count > MAX_VAL)
+	opt_count = MAX_VAL;
+}
+
+/*
+ * The reader: loop until the writer is done, counting reads where
+ * the published data doesn't hang together
+ */
+static void
+test_reader (int fd, int ready)
+{
+    pa_mmap_t *rpmp;
+    pa14_header_t *rphp;
+    uint32_t seq, value, check, first = 0, done;
+    uint32_t *datap;
+    pa_mmap_atom_t latest;
+    unsigned torn = 0;
+    size_t start_len;
+    char ch;
+
+    if (read(fd, &ch, 1) != 1)
+	_exit(1);
+    close(fd);
+
+    rpmp = pa_mmap_open(opt_filename, "pa14", PMF_SHARED | PMF_READ_ONLY, 0);
+    if (rpmp == NULL)
+	_exit(1);
+
+    rphp = pa_mmap_header(rpmp, "pa14", PA_TYPE_OPAQUE, 0, 0);
+    if (rphp == NULL)
+	_exit(1);
+
+    start_len = rpmp->pm_len;
+
+    /* Let the writer start, so we see the segment grow */
+    if (write(ready, "", 1) != 1)
+	_exit(1);
+    close(ready);
+
+    for (;;) {
+	seq = pa_mmap_read_begin(rpmp);
+
+	value = rphp->ph_value;
+	check = rphp->ph_check;
+	done = rphp->ph_done;
+	latest = rphp->ph_latest;
+
+	/* A writer may have grown the segment past our mapping */
+	if (((size_t) pa_mmap_atom_of(latest) << PA_MMAP_ATOM_SHIFT)
+	        < rpmp->pm_len) {
+	    datap = pa_mmap_addr(rpmp, latest);
+	    first = datap ? datap[0] : value;
+	} else
+	    first = value;
+
+	if (pa_mmap_read_retry(rpmp, seq))
+	    continue;
+
+	if (value != check || first != value)
+	    torn += 1;
+
+	if (done)
+	    break;
+
+	sched_yield();
+    }
+
+    printf("reader: %u torn reads, final value %u, segment %s\n",
+	   torn, value, (rpmp->pm_len > start_len) ? "grew" : "did not grow");
+    fflush(stdout);
+
+    pa_mmap_close(rpmp);
+    _exit(torn ? 1 : 0);
+}
+
+void
+test_open (void)
+{
+    int fds[2], rfds[2];
+    char ch;
+
+    assert(opt_filename);
+
+    if (pipe(fds) < 0 || pipe(rfds) < 0)
+	abort();
+
+    fflush(stdout);
+    reader = fork();
+    if (reader == 0) {
+	close(fds[1]);
+	close(rfds[0]);
+	test_reader(fds[0], rfds[1]);
+    }
+    assert(reader > 0);
+
+    close(fds[0]);
+    close(rfds[1]);
+    reader_go = fds[1];
+    reader_ready = rfds[0];
+
+    pmp = pa_mmap_open(opt_filename, "pa14", opt_mmap_flags | PMF_SHARED,
+		       0644);
+    assert(pmp);
+
+    php = pa_mmap_header(pmp, "pa14", PA_TYPE_OPAQUE, 0, sizeof(*php));
+    assert(php);
+
+    /* The flock should keep out a second writer */
+    pa_mmap_t *second = pa_mmap_open(opt_filename, "pa14",
+				     opt_mmap_flags | PMF_SHARED, 0644);
+    printf("second writer: %s\n", second ? "allowed" : "refused");
+    if (second)
+	pa_mmap_close(second);
+
+    if (write(reader_go, "", 1) != 1 || read(reader_ready, &ch, 1) != 1)
+	abort();
+}
+
+void
+test_alloc (unsigned slot, unsigned size)
+{
+    static uint32_t value;
+    uint32_t *datap;
+    unsigned i;
+
+    if (size < sizeof(*datap))
+	size = sizeof(*datap);
+
+    pa_mmap_write_begin(pmp);
+
+    if (!pa_mmap_is_null(atoms[slot]))
+	pa_mmap_free(pmp, atoms[slot], sizes[slot]);
+
+    atoms[slot] = pa_mmap_alloc(pmp, size);
+    sizes[slot] = size;
+    datap = pa_mmap_addr(pmp, atoms[slot]);
+    if (datap == NULL) {
+	pa_mmap_write_end(pmp);
+	printf("alloc %u failed\n", slot);
+	return;
+    }
+
+    /* Spread the changes out, so readers have a chance to overlap them */
+    value += 1;
+    php->ph_value = value;
+    for (i = 0; i < size / sizeof(*datap); i++)
+	datap[i] = value;
+    sched_yield();
+    php->ph_latest = atoms[slot];
+    php->ph_check = value;
+
+    pa_mmap_write_end(pmp);
+
+    printf("in %u : %u bytes, value %u\n", slot, size, value);
+}
+
+void
+test_free (unsigned slot)
+{
+    if (pa_mmap_is_null(atoms[slot]))
+	return;
+
+    pa_mmap_write_begin(pmp);
+
+    /* Don't leave the reader looking at freed memory */
+    if (pa_mmap_atom_of(php->ph_latest) == pa_mmap_atom_of(atoms[slot]))
+	php->ph_latest = pa_mmap_null_atom();
+
+    pa_mmap_free(pmp, atoms[slot], sizes[slot]);
+    atoms[slot] = pa_mmap_null_atom();
+
+    pa_mmap_write_end(pmp);
+
+    printf("free %u\n", slot);
+}
+
+void
+test_print (unsigned slot)
+{
+    uint32_t *datap = pa_mmap_addr(pmp, atoms[slot]);
+
+    if (datap)
+	printf("%u : %u bytes, value %u\n", slot, sizes[slot], datap[0]);
+}
+
+void
+test_dump (void)
+{
+    unsigned slot;
+
+    for (slot = 0; slot < opt_count; slot++)
+	test_print(slot);
+}
+
+void
+test_close (void)
+{
+    int status;
+
+    pa_mmap_write_begin(pmp);
+    php->ph_done = 1;
+    pa_mmap_write_end(pmp);
+
+    fflush(stdout);
+    if (waitpid(reader, &status, 0) != reader || !WIFEXITED(status))
+	printf("reader: failed\n");
+    else
+	printf("reader: exit %d\n", WEXITSTATUS(status));
+
+    close(reader_go);
+    close(reader_ready);
+    pa_mmap_close(pmp);
+}
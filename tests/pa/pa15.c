@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * pa_fixed magazines.  "a slot" and "f slot" allocate and free
+ * through a small magazine, showing the shared free list only
+ * moving once per batch.  At close time, a second thread leaves
+ * atoms in its own magazine, and we check that pa_fixed_close()
+ * puts them back on the free list and that the thread doesn't use
+ * its stale magazine with the next pa_fixed_t.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <libpsu/psuthread.h>
+
+#define TEST_PRINT_DULL
+#include "pamain.h"
+
+#define MAG_SIZE	4	/* Small, so batches are easy to see */
+#define HELPER_ATOMS	3	/* Atoms our helper leaves in its magazine */
+
+pa_mmap_t *pmp;
+pa_fixed_t *pfp;
+
+void
+test_init (void)
+{
+    return;
+}
+
+static void
+test_fixed_open (void)
+{
+    pfp = pa_fixed_open(pmp, "pa15", opt_shift, opt_size, opt_max_atoms);
+    assert(pfp != NULL);
+
+    pa_fixed_mag_enable(pfp, MAG_SIZE);
+}
+
+void
+test_open (void)
+{
+    pmp = pa_mmap_open(opt_filename, "pa15", opt_mmap_flags, 0644);
+    assert(pmp != NULL);
+
+    test_fixed_open();
+}
+
+void
+test_alloc (unsigned slot, unsigned size UNUSED)
+{
+    pa_fixed_atom_t atom = pa_fixed_alloc_atom(pfp);
+    test_t *tp = pa_fixed_atom_addr(pfp, atom);
+    trec[slot] = tp;
+    if (tp) {
+	tp->t_magic = opt_magic;
+	tp->t_id = pa_fixed_atom_of(atom);
+	tp->t_slot = slot;
+	memset(tp->t_val, opt_value, opt_size - sizeof(*tp));
+    }
+
+    printf("in %u : %u (%u)\n", slot, pa_fixed_atom_of(atom),
+	   pa_fixed_atom_of(pfp->pf_free));
+}
+
+void
+test_free (unsigned slot)
+{
+    if (trec[slot] == NULL)
+	return;
+
+    pa_fixed_atom_t atom = pa_fixed_atom(trec[slot]->t_id);
+
+    pa_fixed_free_atom(pfp, atom);
+    trec[slot] = NULL;
+
+    printf("free %u : %u (%u)\n", slot, pa_fixed_atom_of(atom),
+	   pa_fixed_atom_of(pfp->pf_free));
+}
+
+/*
+ * Count the atoms on the shared free list, stopping at the first
+ * page that hasn't been allocated yet
+ */
+static unsigned
+test_free_count (void)
+{
+    pa_fixed_atom_t atom = pfp->pf_free;
+    pa_fixed_atom_t *addr;
+    unsigned count = 0;
+
+    while ((addr = pa_fixed_atom_addr(pfp, atom)) != NULL) {
+	count += 1;
+	atom = *addr;
+    }
+
+    return count;
+}
+
+/*
+ * The helper's two jobs: fill its magazine for the first pa_fixed_t,
+ * then take one atom from the second
+ */
+static void
+helper_fill (void)
+{
+    pa_fixed_atom_t atoms[HELPER_ATOMS];
+    unsigned i;
+
+    for (i = 0; i < HELPER_ATOMS; i++)
+	atoms[i] = pa_fixed_alloc_atom(pfp);
+    for (i = 0; i < HELPER_ATOMS; i++)
+	pa_fixed_free_atom(pfp, atoms[i]);
+}
+
+static void
+helper_alloc (void)
+{
+    pa_atom_t head = pa_fixed_atom_of(pfp->pf_free);
+    pa_fixed_atom_t atom = pa_fixed_alloc_atom(pfp);
+
+    printf("helper: atom %u, free list head was %u\n",
+	   pa_fixed_atom_of(atom), head);
+
+    pa_fixed_free_atom(pfp, atom);
+    pa_fixed_mag_flush(pfp);
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+int helper_go[2], helper_done[2];
+
+static void
+helper_wait (int fd)
+{
+    char ch;
+
+    if (read(fd, &ch, 1) != 1)
+	abort();
+}
+
+static void
+helper_signal (int fd)
+{
+    if (write(fd, "", 1) != 1)
+	abort();
+}
+
+static void *
+helper_main (void *arg UNUSED)
+{
+    helper_fill();
+    helper_signal(helper_done[1]);
+
+    /* Don't flush; pa_fixed_close() must take our atoms back */
+    helper_wait(helper_go[0]);
+
+    helper_alloc();
+    return NULL;
+}
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+void
+test_close (void)
+{
+    unsigned slot, live = 0;
+
+    for (slot = 0; slot < opt_count; slot++)
+	if (trec[slot])
+	    live += 1;
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+    pthread_t helper;
+
+    if (pipe(helper_go) < 0 || pipe(helper_done) < 0)
+	abort();
+    if (pthread_create(&helper, NULL, helper_main, NULL) != 0)
+	abort();
+    helper_wait(helper_done[0]);
+#else /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+    helper_fill();
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+    printf("before close: %u live, %u free\n", live, test_free_count());
+
+    /* Closing takes back every thread's magazine */
+    pa_fixed_close(pfp);
+    test_fixed_open();
+
+    printf("after close: %u live, %u free\n", live, test_free_count());
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD)
+    helper_signal(helper_go[1]);
+    pthread_join(helper, NULL);
+#else /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+    helper_alloc();
+#endif /* HAVE_PTHREAD_H && HAVE_LIBPTHREAD */
+
+    printf("after helper: %u live, %u free\n", live, test_free_count());
+
+    pa_fixed_close(pfp);
+    pa_mmap_close(pmp);
+}
@@ -11,6 +11,9 @@
 
 #include <libpsu/psulog.h>
 #include <libpsu/psualloc.h>
+#include <libpsu/psutime.h>
+
+#include "../memstats.h"
 
 #define MAX_VAL	100
 
@@ -43,14 +46,26 @@ unsigned opt_magic = 0x5e5e5e5e;
 const char *opt_filename;
 const char *opt_input;
 const char *opt_config;
-int opt_clean, opt_quiet, opt_dump, opt_top_dump;
+int opt_clean, opt_quiet, opt_dump, opt_top_dump, opt_hash, opt_timing;
 uint32_t opt_size = 8;
 int opt_value = -1;
 int opt_value_index = 2;
 int opt_bad_value_test = 1;
+pa_mmap_flags_t opt_mmap_flags;
+unsigned opt_pat_flags;
 
 FILE *infile;
 
+/*
+ * With "timing", we time each command and report on stderr at the
+ * end, so the saved output doesn't change
+ */
+enum { TIME_ALLOC, TIME_FREE, TIME_KEY, TIME_LIST, TIME_MAX };
+static const char *time_names[TIME_MAX] = { "alloc", "free", "key", "list" };
+psu_hist_t time_hist[TIME_MAX];
+
+#define TEST_TIME(_which) PSU_TIME_SCOPE(&time_hist[_which])
+
 void test_init(void);
 void test_open(void);
 void test_close(void);
@@ -62,6 +77,15 @@ void test_print(unsigned slot);
 void test_dump(void);
 void test_full_dump(psu_boolean_t);
 void test_other(char *buf);
+#ifdef NEED_RANGE
+void test_range(const char *lo, const char *hi);
+#endif /* NEED_RANGE */
+#ifdef NEED_COMPACT
+void test_compact(unsigned max_pages);
+#endif /* NEED_COMPACT */
+#ifdef NEED_STATS
+void test_stats(void);
+#endif /* NEED_STATS */
 
 static char *
 scan_uint32 (char *cp, uint32_t *valp)
@@ -85,6 +109,7 @@ scan_uint32 (char *cp, uint32_t *valp)
 int
 main (int argc UNUSED, char **argv UNUSED)
 {
+    memstats_init();
     psu_log_enable(TRUE);
 
     for (argc = 1; argv[argc]; argc++) {
@@ -112,6 +137,12 @@ main (int argc UNUSED, char **argv UNUSED)
 	} else if (strcmp(argv[argc], "value-indexn") == 0) {
 	    if (argv[argc + 1]) 
 		opt_value_index = atoi(argv[++argc]);
+	} else if (strcmp(argv[argc], "mmap-flags") == 0) {
+	    if (argv[argc + 1]) 
+		opt_mmap_flags = strtoul(argv[++argc], NULL, 0);
+	} else if (strcmp(argv[argc], "pat-flags") == 0) {
+	    if (argv[argc + 1]) 
+		opt_pat_flags = strtoul(argv[++argc], NULL, 0);
 	} else if (strcmp(argv[argc], "no-value-test") == 0) {
 	    opt_bad_value_test = 0;
 	} else if (strcmp(argv[argc], "file") == 0) {
@@ -121,6 +152,10 @@ main (int argc UNUSED, char **argv UNUSED)
 	    opt_clean = 1;
 	} else if (strcmp(argv[argc], "quiet") == 0) {
 	    opt_quiet = 1;
+	} else if (strcmp(argv[argc], "hash") == 0) {
+	    opt_hash = 1;
+	} else if (strcmp(argv[argc], "timing") == 0) {
+	    opt_timing = 1;
 	} else if (strcmp(argv[argc], "dump") == 0) {
 	    opt_dump = 1;
 	} else if (strcmp(argv[argc], "top-dump") == 0) {
@@ -152,11 +187,15 @@ main (int argc UNUSED, char **argv UNUSED)
     if (opt_size < sizeof(test_t))
 	opt_size = sizeof(test_t);
 
+    uint32_t slot, this_size;
+
     test_open();
 
+    for (slot = 0; slot < TIME_MAX; slot++)
+	psu_hist_init(&time_hist[slot]);
+
     char buf[128];
     char *cp;
-    uint32_t slot, this_size;
 
     for (;;) {
 	if (opt_top_dump)
@@ -193,7 +232,8 @@ main (int argc UNUSED, char **argv UNUSED)
 		break;
 	    }
 
-	    test_alloc(slot, this_size);
+	    TEST_TIME(TIME_ALLOC)
+		test_alloc(slot, this_size);
 	    break;
 
 	case 'd':
@@ -222,7 +262,8 @@ main (int argc UNUSED, char **argv UNUSED)
 		break;
 	    }
 
-	    test_free(slot);
+	    TEST_TIME(TIME_FREE)
+		test_free(slot);
 	    break;
 
 #ifdef NEED_KEY
@@ -239,7 +280,8 @@ main (int argc UNUSED, char **argv UNUSED)
 	    while (isspace((int) *cp))
 		cp += 1;
 
-	    test_key(slot, cp);
+	    TEST_TIME(TIME_KEY)
+		test_key(slot, cp);
 	    break;
 
 	case 'l':
@@ -251,10 +293,46 @@ main (int argc UNUSED, char **argv UNUSED)
 		break;
 	    }
 
-	    test_list(cp);
+	    TEST_TIME(TIME_LIST)
+		test_list(cp);
 	    break;
 #endif /* NEED_KEY */
 
+#ifdef NEED_RANGE
+	case 'r': {
+	    /* "r lo hi", where "-" means an open end */
+	    while (isspace((int) *cp))
+		cp += 1;
+
+	    char *hi = strchr(cp, ' ');
+	    if (hi == NULL) {
+		printf("missing range\n");
+		break;
+	    }
+
+	    *hi++ = '\0';
+	    test_range(strcmp(cp, "-") == 0 ? NULL : cp,
+		       strcmp(hi, "-") == 0 ? NULL : hi);
+	    break;
+	}
+#endif /* NEED_RANGE */
+
+#ifdef NEED_COMPACT
+	case 'c':
+	    /* "c [max-pages]" */
+	    if (scan_uint32(cp, &slot) == NULL)
+		slot = 0;
+
+	    test_compact(slot);
+	    break;
+#endif /* NEED_COMPACT */
+
+#ifdef NEED_STATS
+	case 's':
+	    test_stats();
+	    break;
+#endif /* NEED_STATS */
+
 	case 'p':
 	    cp = scan_uint32(cp, &slot);
 	    if (cp == NULL)
@@ -279,6 +357,14 @@ main (int argc UNUSED, char **argv UNUSED)
 
     test_close();
 
+    if (opt_timing) {
+	fprintf(stderr, "timing: %s, %llu ticks/sec\n", PSU_TICKS_SOURCE,
+		(unsigned long long) psu_ticks_per_sec());
+	for (slot = 0; slot < TIME_MAX; slot++)
+	    if (time_hist[slot].ph_count)
+		psu_hist_dump(stderr, time_names[slot], &time_hist[slot], TRUE);
+    }
+
     return 0;
 }
 
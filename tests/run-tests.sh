@@ -12,6 +12,9 @@
 GOODDIR=${SRCDIR}/saved
 S2O="sed 1,/@@/d"
 ECHO=/bin/echo
+MEMSTATS=
+ALLOC_SLACK=10
+RSS_SLACK=50
 
 run () {
     cmd="$1"
@@ -35,7 +38,13 @@ run_tests () {
     oname=$name.$ds
     out=out/$oname
     ${ECHO} -n "... $test ... $name ... $ds ..."
-    run "$test $data input $input > $out.out 2> $out.err"
+    if [ -n "$MEMSTATS" ]; then
+	rm -f $out.mem
+	run "TEST_MEMSTATS=$out.mem $test $data input $input \
+		> $out.out 2> $out.err"
+    else
+	run "$test $data input $input > $out.out 2> $out.err"
+    fi
     ${ECHO} "    done"
 
     run "diff -Nu ${SRCDIR}/saved/$oname.out out/$oname.out | ${S2O}"
@@ -93,17 +102,83 @@ do_accept () {
 }
 
 #
-# pa and xi tests do not work on linux yet
+# Memory budgets.  With TEST_MEMSTATS set, each test program writes
+# its allocation counts and peak RSS to out/<name>.mem (see
+# memstats.h).  The "budget" verb records limits for them in
+# saved/memory.budget, with some slack: ALLOC_SLACK percent for the
+# counts, which only change when the code does, and RSS_SLACK
+# percent for the RSS, which also depends on the machine.  Memory
+# still held at exit (psu-live) gets no slack, so a new leak shows.
+# The "memory" verb fails if any number is over its limit.
 #
-case `uname`-`basename $PWD` in
-    Linux-pa|Linux-xi) exit 0;;
-esac
+record_memory () {
+    oname=$name.$ds
+
+    [ -s out/$oname.mem ] || return
+    awk -v name=$oname -v aslack=${ALLOC_SLACK} -v rslack=${RSS_SLACK} '
+	function limit(val, slack) {
+	    return int(val + (val * slack + 99) / 100)
+	}
+	{
+	    for (i = 1; i < NF; i += 2)
+		have[$i] = $(i + 1)
+	    printf("%s psu-allocs %d psu-bytes %d psu-live %d",
+		   name, limit(have["psu-allocs"], aslack),
+		   limit(have["psu-bytes"], aslack), have["psu-live"])
+	    printf(" peak-rss-kb %d\n", limit(have["peak-rss-kb"], rslack))
+	}' out/$oname.mem >> out/memory.budget
+}
+
+check_memory () {
+    oname=$name.$ds
+
+    [ -s out/$oname.mem ] || return
+    ${ECHO} $oname >> out/memory.checked
+    budget=`grep "^$oname " ${BUDGET}`
+    if [ -z "$budget" ]; then
+	${ECHO} "$oname: no memory budget"
+	return
+    fi
+
+    ${ECHO} "$budget" | awk -v mem="`cat out/$oname.mem`" '
+	{
+	    n = split(mem, f, " ")
+	    for (i = 1; i < n; i += 2)
+		have[f[i]] = f[i + 1]
+	    for (i = 2; i < NF; i += 2) {
+		if (($i in have) && have[$i] + 0 > $(i + 1) + 0)
+		    printf("%s: %s %d is over budget (%d)\n",
+			   $1, $i, have[$i], $(i + 1))
+	    }
+	}' >> out/memory.over
+}
+
+do_memory () {
+    action=$1
+
+    for test in ${TESTS}; do
+	base=`basename $test .test`
+
+	for input in `echo ${SRCDIR}/${base}*.in`; do
+            if [ -f $input ]; then
+		name=`basename $input .in`
+		ds=1
+		grep '^#' $input | while read comment data ; do
+		    $action
+		    ds=`expr $ds + 1`
+		done
+	    fi
+	done
+    done
+}
 
 while [ $# -gt 0 ]
 do
     case "$1" in
     -d) SRCDIR=$2; shift;;
     -v) S2O=cat;;
+    -a) ALLOC_SLACK=$2; shift;;
+    -r) RSS_SLACK=$2; shift;;
     -*) echo "unknown option" >&2; exit;;
     *) break;;
     esac
@@ -113,6 +188,17 @@ done
 verb=$1
 shift
 
+BUDGET=${SRCDIR}/saved/memory.budget
+
+#
+# pa and xi tests do not work on linux yet.  Their memory use can
+# still be measured, so the memory verbs run anyway.
+#
+case `uname`-`basename $PWD`-$verb in
+    Linux-pa-memory|Linux-xi-memory|Linux-pa-budget|Linux-xi-budget) ;;
+    Linux-pa-*|Linux-xi-*) exit 0;;
+esac
+
 case $verb in
     run)
         TESTS="$@"
@@ -133,6 +219,35 @@ case $verb in
         do_accept
     ;;
 
+    memory)
+        TESTS="$@"
+        MEMSTATS=yes
+        do_run_tests
+        if [ ! -f ${BUDGET} ]; then
+            ${ECHO} "no memory budget (${BUDGET}); run the budget verb" 1>&2
+            exit 1
+        fi
+        : > out/memory.over
+        : > out/memory.checked
+        do_memory check_memory
+        if [ -s out/memory.over ]; then
+            cat out/memory.over
+            exit 1
+        fi
+        ${ECHO} "memory: `wc -l < out/memory.checked` runs within budget"
+    ;;
+
+    budget)
+        TESTS="$@"
+        MEMSTATS=yes
+        do_run_tests
+        ${ECHO} "# name limit ... (slack: allocs ${ALLOC_SLACK}%," \
+            "rss ${RSS_SLACK}%)" > out/memory.budget
+        do_memory record_memory
+        cp out/memory.budget ${BUDGET}
+        ${ECHO} "memory budget recorded in ${BUDGET}"
+    ;;
+
     *)
         ${ECHO} "unknown verb: $verb" 1>&2
 	;;
@@ -26,6 +26,10 @@
 #include <parrotdb/pacommon.h>
 #include <libxi/xicommon.h>
 #include <libxi/xisource.h>
+#include <libxi/xiscan.h>
+#include <libxi/xisplit.h>
+
+#include "../memstats.h"
 
 int
 main (int argc, char **argv)
@@ -34,9 +38,13 @@ main (int argc, char **argv)
     int opt_quiet = FALSE;
     int opt_log = FALSE;
     int opt_unescape = FALSE;
+    int opt_pipe = FALSE;
+    int opt_split = -1;
     int fd = 0;
     xi_source_flags_t flags = 0;
 
+    memstats_init();
+
     for (argc = 1; argv[argc]; argc++) {
 	if (strcmp(argv[argc], "file") == 0
 	    || strcmp(argv[argc], "input") == 0) {
@@ -48,8 +56,23 @@ main (int argc, char **argv)
 	    opt_unescape = TRUE;
 	} else if (strcmp(argv[argc], "line") == 0) {
 	    flags |= XPSF_LINE_NO;
+	} else if (strcmp(argv[argc], "async") == 0) {
+	    flags |= XPSF_ASYNC_READ;
+	} else if (strcmp(argv[argc], "pipe") == 0) {
+	    opt_pipe = TRUE;
+	} else if (strcmp(argv[argc], "split") == 0) {
+	    /* Split implies mmap, since we need the whole input */
+	    flags |= XPSF_MMAP_INPUT;
+	    if (argv[argc + 1])
+		opt_split = atoi(argv[++argc]);
+	} else if (strcmp(argv[argc], "mmap") == 0) {
+	    flags |= XPSF_MMAP_INPUT;
 	} else if (strcmp(argv[argc], "trim") == 0) {
 	    flags |= XPSF_TRIM_WS;
+	} else if (strcmp(argv[argc], "scan") == 0) {
+	    /* Quietly keep the default if this CPU can't do it */
+	    if (argv[argc + 1])
+		xi_scan_select(argv[++argc]);
 	} else if (strcmp(argv[argc], "log") == 0) {
 	    opt_log = TRUE;
 	} else if (strcmp(argv[argc], "ignore") == 0) {
@@ -70,14 +93,51 @@ main (int argc, char **argv)
 	    err(1, "could not open file: %s", opt_filename);
     }
 
+    if (opt_pipe) {
+	/* Feed the input through a pipe, a dribble at a time */
+	int pfd[2];
+	if (pipe(pfd) < 0)
+	    err(1, "pipe failed");
+
+	pid_t pid = fork();
+	if (pid < 0)
+	    err(1, "fork failed");
+
+	if (pid == 0) {
+	    char buf[100];
+	    ssize_t len;
+
+	    close(pfd[0]);
+	    while ((len = read(fd, buf, sizeof(buf))) > 0)
+		if (write(pfd[1], buf, len) != len)
+		    _exit(1);
+	    _exit(0);
+	}
+
+	close(pfd[1]);
+	close(fd);
+	fd = pfd[0];
+    }
+
     xi_source_t *srcp = xi_source_create(fd, flags);
     if (srcp == NULL)
 	errx(1, "failed to create source");
 
+    xi_split_t *xsp = NULL;
+    if (opt_split >= 0) {
+	xsp = xi_split_create(srcp, opt_split);
+	if (xsp == NULL)
+	    errx(1, "failed to split source");
+	printf("chunks %u\n", xi_split_count(xsp));
+    }
+
     char *data, *rest;
     xi_node_type_t type;
     for (;;) {
-	type = xi_source_next_token(srcp, &data, &rest);
+	if (xsp)
+	    type = xi_split_next_token(xsp, &data, &rest);
+	else
+	    type = xi_source_next_token(srcp, &data, &rest);
 	if (0)
 	    psu_log("new token: %u [%s] [%s]", type, data ?: "", rest ?: "");
 
@@ -86,6 +146,8 @@ main (int argc, char **argv)
 	    return 1;
 
 	case XI_TYPE_EOF:	/* End of file */
+	    if (flags & XPSF_LINE_NO)
+		printf("lines %u\n", srcp->xps_lineno);
 	    return 0;
 
 	case XI_TYPE_FAIL:	/* Failure mode */
@@ -93,11 +155,12 @@ main (int argc, char **argv)
 
 	case XI_TYPE_TEXT:	/* Text content */
 	    if (!opt_quiet) {
-		int len;
+		unsigned len;
 		if (opt_unescape && data && rest)
-		    len = xi_source_unescape(srcp, data, rest - data);
+		    data = xi_source_unescape_text(srcp, data,
+						   rest - data, &len);
 		else len = rest - data;
-		printf("data [%.*s]\n", len, data);
+		printf("data [%.*s]\n", (int) len, data);
 	    }
 	    break;
 
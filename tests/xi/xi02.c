@@ -41,6 +41,8 @@
 #include <libslax/xi_parse.h>
 #include <libslax/xi_nodeset.h>
 
+#include "../memstats.h"
+
 typedef struct test_data_s {
     xi_workspace_t *td_workp;
     xi_nodeset_t *td_nsp;
@@ -73,6 +75,8 @@ main (int argc, char **argv)
     int opt_clean = 0;
     xi_source_flags_t flags = 0;
 
+    memstats_init();
+
     for (argc = 1; argv[argc]; argc++) {
 	if (strcmp(argv[argc], "file") == 0
 	    || strcmp(argv[argc], "input") == 0) {
@@ -1,6 +1,4 @@
 /*
- * $Id$
- *
  * Copyright (c) 2016, Juniper Networks, Inc.
  * All rights reserved.
  * This SOFTWARE is licensed under the LICENSE provided in the
@@ -24,88 +22,73 @@
 #include <limits.h>
 
 #include "slaxconfig.h"
-#include <libslax/slax.h>
-#include <libslax/pa_common.h>
-#include <libslax/pa_config.h>
-#include <libslax/pa_mmap.h>
-#include <libslax/pa_fixed.h>
-#include <libslax/pa_arb.h>
-#include <libslax/pa_istr.h>
-#include <libslax/pa_pat.h>
-#include <libslax/pa_bitmap.h>
-#include <libslax/xi_common.h>
-#include <libslax/xi_source.h>
-#include <libslax/xi_rules.h>
-#include <libslax/xi_tree.h>
-#include <libslax/xi_workspace.h>
-#include <libslax/xi_parse.h>
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+
+#include "../memstats.h"
+
+/*
+ * Names to look up in each state: everything the script mentions,
+ * plus some it doesn't.
+ */
+static const char *test_names[] = {
+    "one", "two", "three", "authors", "author", "name", "protocol",
+    "top", "missing", NULL
+};
+
+static void
+test_rule_string (xi_rulebook_t *rb, xi_rule_t *xrp, char *buf, size_t len)
+{
+    if (xrp == NULL)
+	snprintf(buf, len, "none");
+    else
+	snprintf(buf, len, "action %u, new-state %u, use-tag %s",
+		 xrp->xr_action, xrp->xr_new_state,
+		 xrp->xr_use_tag
+		 ? xi_parse_namepool_string(rb->xrb_script, xrp->xr_use_tag)
+		 : "-");
+}
 
 int
 main (int argc, char **argv)
 {
     const char *opt_filename = NULL;
-    const char *opt_script = "script.xml";
-    const char *opt_rulebook = "rulebook.sxb";
-    const char *opt_database = "test.sxb";
-    const char *opt_config = NULL;
-    int opt_quiet = 0;
+    const char *opt_script = "script.in";
     int opt_dump = 0;
-    int opt_unescape = 0;
-    int opt_clean = 0;
-    xi_source_flags_t flags = 0;
+    xi_source_flags_t flags = XPSF_IGNORE_WS;
+
+    memstats_init();
 
     for (argc = 1; argv[argc]; argc++) {
 	if (strcmp(argv[argc], "file") == 0
 	    || strcmp(argv[argc], "input") == 0) {
 	    if (argv[argc + 1])
 		opt_filename = argv[++argc];
-	} else if (strcmp(argv[argc], "config") == 0) {
-	    if (argv[argc + 1])
-		opt_config = argv[++argc];
-	} else if (strcmp(argv[argc], "rulebook") == 0) {
-	    if (argv[argc + 1])
-		opt_rulebook = argv[++argc];
-	} else if (strcmp(argv[argc], "database") == 0) {
-	    if (argv[argc + 1])
-		opt_database = argv[++argc];
 	} else if (strcmp(argv[argc], "script") == 0) {
 	    if (argv[argc + 1])
 		opt_script = argv[++argc];
 	} else if (strcmp(argv[argc], "dump") == 0) {
 	    opt_dump = 1;
-	} else if (strcmp(argv[argc], "quiet") == 0) {
-	    opt_quiet = 1;
-	} else if (strcmp(argv[argc], "clean") == 0) {
-	    opt_clean = 1;
-	} else if (strcmp(argv[argc], "unescape") == 0) {
-	    opt_unescape = 1;
-	} else if (strcmp(argv[argc], "line") == 0) {
-	    flags |= XPSF_LINE_NO;
-	} else if (strcmp(argv[argc], "trim") == 0) {
-	    flags |= XPSF_TRIM_WS;
-	} else if (strcmp(argv[argc], "ignore") == 0) {
-	    flags |= XPSF_IGNORE_WS;
-	} else if (strcmp(argv[argc], "ignore-comments") == 0) {
-	    flags |= XPSF_IGNORE_COMMENTS;
-	} else if (strcmp(argv[argc], "ignore-dtd") == 0) {
-	    flags |= XPSF_IGNORE_DTD;
 	}
     }
 
-    if (!opt_quiet)
-	slaxLogEnable(1);
-
-    if (opt_clean) {
-	unlink(opt_rulebook);
-	unlink(opt_database);
-    }
-
-    assert (opt_database != NULL && opt_filename != NULL);
+    assert(opt_filename != NULL);
 
-    if (opt_config)
-	pa_config_read(opt_config);
-
-    pa_mmap_t *pmp = pa_mmap_open(opt_database, 0, 0644);
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi03", 0, 0644);
     assert(pmp);
 
     xi_workspace_t *workp = xi_workspace_open(pmp, "test");
@@ -120,35 +103,64 @@ main (int argc, char **argv)
 
     xi_parse(script);
 
-    if (opt_dump) {
-	if (!opt_quiet)
-	    slaxLogEnable(1);
-	xi_parse_dump(script);
-	xi_parse_emit_xml(script, stdout);
-    }
-
     /* We prep the rulebook to build our states and rules */
     xi_rulebook_t *rb = xi_rulebook_prep(script, "rulebook");
     assert(rb);
 
-    xi_rulebook_dump(rb);
+    if (opt_dump) {
+	slaxLogEnable(1);
+	xi_rulebook_dump(rb);
+	slaxLogEnable(0);
+    }
+
+    /* Compare the compiled table against walking the rule chains */
+    xi_rulebook_dfa_t *dfap = rb->xrb_dfa;
+    xi_state_id_t sid;
+    xi_rstate_t *statep;
+    xi_rule_t *xrp, *chainp;
+    pa_atom_t name_atom;
+    char buf[BUFSIZ], cbuf[BUFSIZ];
+    int i;
+
+    printf("compiled: %s\n", dfap ? "yes" : "no");
+
+    for (sid = 1; sid <= rb->xrb_infop->xrsi_max_state; sid++) {
+	statep = xi_rulebook_state(rb, sid);
+	if (statep == NULL)
+	    continue;
+
+	for (i = 0; test_names[i]; i++) {
+	    name_atom = xi_parse_namepool_atom(script, test_names[i]);
+
+	    xrp = xi_rulebook_find(script, rb, statep, name_atom,
+				   NULL, test_names[i], NULL);
+
+	    rb->xrb_dfa = NULL;
+	    chainp = xi_rulebook_find(script, rb, statep, name_atom,
+				      NULL, test_names[i], NULL);
+	    rb->xrb_dfa = dfap;
+
+	    test_rule_string(rb, xrp, buf, sizeof(buf));
+	    test_rule_string(rb, chainp, cbuf, sizeof(cbuf));
+	    printf("state %u, %s: %s%s\n", sid, test_names[i], buf,
+		   (xrp == chainp) ? "" : " (MISMATCH with chain)");
+	    if (xrp != chainp)
+		printf("    chain: %s\n", cbuf);
+	}
+    }
 
+    /* Now use the rulebook to parse the input */
     xi_parse_t *parsep = xi_parse_open(pmp, workp, "test",
 				       opt_filename, flags);
     assert(parsep);
 
     xi_parse_set_rulebook(parsep, rb);
-
     xi_parse(parsep);
-
-    if (opt_dump) {
-	if (!opt_quiet)
-	    slaxLogEnable(1);
-	xi_parse_dump(parsep);
-	xi_parse_emit_xml(parsep, stdout);
-    }
+    xi_parse_emit_xml(parsep, stdout);
 
     xi_parse_destroy(parsep);
+    xi_rulebook_close(rb);
+    pa_mmap_close(pmp);
 
     return 0;
 }
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Test XPath evaluation over a parsed document:
+ *	xi04.test input FILE [index] [extents] [wide] xpath EXPR [xpath EXPR ...] [dump]
+ * "compress" stores text compressed (with "dict STRING" as the
+ * dictionary) and reports how much space it took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xinodeset.h>
+#include <libxi/xixpath.h>
+
+#include "../memstats.h"
+
+static void
+test_xpath (xi_workspace_t *xwp, pa_atom_t root, const char *expr,
+	    int opt_dump)
+{
+    xi_xpath_result_t res;
+    xi_nodeset_iter_t iter;
+    pa_atom_t atom;
+    xi_node_t *nodep;
+    const char *name;
+    char *str;
+
+    printf("xpath: %s\n", expr);
+
+    xi_xpath_t *xpp = xi_xpath_compile(xwp, expr);
+    if (xpp == NULL) {
+	printf("    compile failed\n");
+	return;
+    }
+
+    if (opt_dump)
+	xi_xpath_dump(xpp);
+
+    if (xi_xpath_eval(xpp, root, &res)) {
+	printf("    eval failed\n");
+	xi_xpath_free(xpp);
+	return;
+    }
+
+    switch (res.xpr_type) {
+    case XI_XPR_NODESET:
+	printf("    nodeset (%u)\n", xi_nodeset_count(res.xpr_nodeset));
+
+	xi_nodeset_iter_init(res.xpr_nodeset, &iter);
+	while ((atom = xi_nodeset_iter_next(res.xpr_nodeset, &iter))
+	       != PA_NULL_ATOM) {
+	    nodep = xi_node_addr(xwp, atom);
+	    name = (nodep->xn_type == XI_TYPE_ELT
+		    || nodep->xn_type == XI_TYPE_ATTRIB)
+		? xi_namepool_string(xwp, xi_node_name(xwp, nodep)) : NULL;
+	    str = xi_xpath_node_string(xwp, atom);
+
+	    printf("    [%u] %s '%s'\n", atom,
+		   name ?: (nodep->xn_type == XI_TYPE_ROOT) ? "(root)"
+		   : "(text)", str ?: "");
+	    if (str)
+		free(str);
+	}
+	break;
+
+    case XI_XPR_STRING:
+	printf("    string '%s'\n", res.xpr_string);
+	break;
+
+    case XI_XPR_NUMBER:
+	printf("    number %g\n", res.xpr_number);
+	break;
+
+    case XI_XPR_BOOLEAN:
+	printf("    boolean %s\n", res.xpr_boolean ? "true" : "false");
+	break;
+    }
+
+    xi_xpath_result_clean(&res);
+    xi_xpath_free(xpp);
+}
+
+/*
+ * Find the last node under 'atom' the slow way, following the last
+ * child down until we reach a leaf
+ */
+static pa_atom_t
+test_last_descendant (xi_workspace_t *xwp, pa_atom_t atom)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, atom), *childp;
+    pa_atom_t child;
+
+    while (nodep && (nodep->xn_type == XI_TYPE_ELT
+		     || nodep->xn_type == XI_TYPE_ROOT)
+	   && nodep->xn_contents != PA_NULL_ATOM) {
+	for (child = nodep->xn_contents; ; child = childp->xn_next) {
+	    childp = xi_node_addr(xwp, child);
+	    if (childp->xn_next == atom)
+		break;
+	}
+
+	atom = child;
+	nodep = childp;
+    }
+
+    return atom;
+}
+
+/*
+ * Check every element's recorded extent against its last descendant
+ */
+static void
+test_extents (xi_workspace_t *xwp, pa_atom_t atom, unsigned *goodp,
+	      unsigned *badp)
+{
+    xi_node_t *nodep = xi_node_addr(xwp, atom), *childp;
+    pa_atom_t child;
+
+    if (nodep == NULL || (nodep->xn_type != XI_TYPE_ELT
+			  && nodep->xn_type != XI_TYPE_ROOT))
+	return;
+
+    if (xi_node_extent(xwp, atom) == test_last_descendant(xwp, atom))
+	*goodp += 1;
+    else
+	*badp += 1;
+
+    if (nodep->xn_contents == PA_NULL_ATOM)
+	return;
+
+    for (child = nodep->xn_contents; child != atom; child = childp->xn_next) {
+	childp = xi_node_addr(xwp, child);
+	test_extents(xwp, child, goodp, badp);
+    }
+}
+
+/*
+ * Parse the input into a cache file, so the next parse can use it
+ */
+static void
+test_cache (const char *cache, const char *filename, unsigned wflags,
+	    const char *dict)
+{
+    pa_mmap_t *pmp = pa_mmap_open(cache, "xi04", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open_flags(pmp, "test", wflags);
+    assert(xwp);
+
+    if (dict && xi_textpool_set_dictionary(xwp, dict, strlen(dict)))
+	printf("dict: failed\n");
+
+    xi_parse_t *parsep = xi_parse_open(pmp, xwp, "test",
+				       filename, XPSF_IGNORE_WS);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    parsep->xp_flags |= XI_PF_CACHE;
+    xi_parse(parsep);
+
+    printf("cache: %s\n", xi_parse_is_cached(parsep) ? "hit" : "miss");
+
+    xi_parse_destroy(parsep);
+    pa_mmap_close(pmp);
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    const char *exprs[argc];
+    int opt_dump = 0;
+    int opt_index = 0;
+    int opt_extents = 0;
+    const char *opt_cache = NULL;
+    const char *opt_dict = NULL;
+    unsigned opt_wflags = 0;
+    int i, count = 0;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "xpath") == 0) {
+	    if (argv[argc + 1])
+		exprs[count++] = argv[++argc];
+	} else if (strcmp(argv[argc], "dump") == 0) {
+	    opt_dump = 1;
+	} else if (strcmp(argv[argc], "index") == 0) {
+	    opt_index = 1;
+	} else if (strcmp(argv[argc], "extents") == 0) {
+	    opt_extents = 1;
+	} else if (strcmp(argv[argc], "wide") == 0) {
+	    opt_wflags |= XWF_WIDE_NODES;
+	} else if (strcmp(argv[argc], "compress") == 0) {
+	    opt_wflags |= XWF_COMPRESS_TEXT;
+	} else if (strcmp(argv[argc], "dict") == 0) {
+	    if (argv[argc + 1])
+		opt_dict = argv[++argc];
+	} else if (strcmp(argv[argc], "cache") == 0) {
+	    if (argv[argc + 1])
+		opt_cache = argv[++argc];
+	}
+    }
+
+    assert(opt_filename != NULL);
+
+    /*
+     * With a cache file, we start from scratch and parse the input
+     * once to fill the cache, so the real parse below can reuse it.
+     */
+    if (opt_cache) {
+	unlink(opt_cache);
+	test_cache(opt_cache, opt_filename, opt_wflags, opt_dict);
+    }
+
+    pa_mmap_t *pmp = pa_mmap_open(opt_cache, "xi04", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open_flags(pmp, "test", opt_wflags);
+    assert(xwp);
+
+    if (opt_dict
+	    && xi_textpool_set_dictionary(xwp, opt_dict, strlen(opt_dict)))
+	printf("dict: failed\n");
+
+    xi_parse_t *parsep = xi_parse_open(pmp, xwp, "test",
+				       opt_filename, XPSF_IGNORE_WS);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    if (opt_index)
+	parsep->xp_flags |= XI_PF_NAME_INDEX;
+    if (opt_extents)
+	parsep->xp_flags |= XI_PF_EXTENTS;
+    if (opt_cache)
+	parsep->xp_flags |= XI_PF_CACHE;
+    xi_parse(parsep);
+
+    if (opt_cache)
+	printf("cache: %s\n", xi_parse_is_cached(parsep) ? "hit" : "miss");
+
+    if (opt_extents) {
+	unsigned good = 0, bad = 0;
+
+	test_extents(xwp, xi_parse_root(parsep), &good, &bad);
+	printf("extents: %u good, %u bad\n", good, bad);
+    }
+
+    /* Dumps go to the log, which is stderr */
+    if (opt_dump)
+	slaxLogEnable(1);
+
+    for (i = 0; i < count; i++)
+	test_xpath(xwp, xi_parse_root(parsep), exprs[i], opt_dump);
+
+    if (opt_wflags & XWF_COMPRESS_TEXT) {
+	xi_textpool_stats_t stats;
+
+	xi_textpool_stats(xwp, &stats);
+	printf("text: %llu strings (%llu compressed), %llu bytes "
+	       "stored in %llu, %llu expanded\n",
+	       (unsigned long long) stats.xts_strings,
+	       (unsigned long long) stats.xts_compressed,
+	       (unsigned long long) stats.xts_bytes,
+	       (unsigned long long) stats.xts_stored,
+	       (unsigned long long) stats.xts_expands);
+    }
+
+    xi_parse_destroy(parsep);
+    pa_mmap_close(pmp);
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Test sorted nodesets and their set operations:
+ *	xi05.test left START:END:STEP right START:END:STEP [shuffle]
+ * "shuffle" adds the left set's members in a scrambled order, to
+ * exercise insertion into the middle of a sorted set.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xinodeset.h>
+
+#include "../memstats.h"
+
+typedef struct test_range_s {
+    unsigned tr_start;		/* First member */
+    unsigned tr_end;		/* Last possible member */
+    unsigned tr_step;		/* Distance between members */
+} test_range_t;
+
+static void
+test_parse_range (const char *str, test_range_t *trp)
+{
+    trp->tr_step = 1;
+    if (sscanf(str, "%u:%u:%u", &trp->tr_start, &trp->tr_end,
+	       &trp->tr_step) < 2 || trp->tr_start == 0 || trp->tr_step == 0) {
+	fprintf(stderr, "invalid range: %s\n", str);
+	exit(1);
+    }
+}
+
+static int
+test_in_range (test_range_t *trp, pa_atom_t atom)
+{
+    return atom >= trp->tr_start && atom <= trp->tr_end
+	&& (atom - trp->tr_start) % trp->tr_step == 0;
+}
+
+/*
+ * Check that a nodeset holds exactly the atoms in [1, max] that
+ * satisfy the operation 'op', in order.
+ */
+static void
+test_check (const char *title, xi_nodeset_t *nsp, pa_atom_t max,
+	    test_range_t *left, test_range_t *right, int op)
+{
+    xi_nodeset_iter_t iter;
+    pa_atom_t want, got;
+    unsigned count = 0, errors = 0;
+    int in_left, in_right, member;
+
+    if (nsp == NULL) {
+	printf("%s: failed\n", title);
+	return;
+    }
+
+    xi_nodeset_iter_init(nsp, &iter);
+    got = xi_nodeset_iter_next(nsp, &iter);
+
+    for (want = 1; want <= max; want++) {
+	in_left = test_in_range(left, want);
+	in_right = right ? test_in_range(right, want) : 0;
+
+	switch (op) {
+	case 'u':
+	    member = in_left || in_right;
+	    break;
+	case 'i':
+	    member = in_left && in_right;
+	    break;
+	case 'd':
+	    member = in_left && !in_right;
+	    break;
+	default:
+	    member = in_left;
+	}
+
+	if (!member)
+	    continue;
+
+	count += 1;
+	if (got != want)
+	    errors += 1;
+	else
+	    got = xi_nodeset_iter_next(nsp, &iter);
+    }
+
+    if (got != PA_NULL_ATOM)
+	errors += 1;		/* Extra members */
+
+    printf("%s: %u members (count %u), %s\n", title, count,
+	   xi_nodeset_count(nsp), errors ? "MISMATCH" : "ok");
+}
+
+int
+main (int argc, char **argv)
+{
+    test_range_t left = { 1, 1, 1 }, right = { 1, 1, 1 };
+    int opt_shuffle = 0;
+    pa_atom_t atom, max;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "left") == 0) {
+	    if (argv[argc + 1])
+		test_parse_range(argv[++argc], &left);
+	} else if (strcmp(argv[argc], "right") == 0) {
+	    if (argv[argc + 1])
+		test_parse_range(argv[++argc], &right);
+	} else if (strcmp(argv[argc], "shuffle") == 0) {
+	    opt_shuffle = 1;
+	}
+    }
+
+    max = (left.tr_end > right.tr_end) ? left.tr_end : right.tr_end;
+
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi05", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open(pmp, "test");
+    assert(xwp);
+
+    xi_nodeset_t *lp = xi_nodeset_alloc(xwp, XI_NSTYPE_NORMAL, XI_NSF_SORTED);
+    xi_nodeset_t *rp = xi_nodeset_alloc(xwp, XI_NSTYPE_NORMAL, XI_NSF_SORTED);
+    assert(lp && rp);
+
+    if (opt_shuffle) {
+	/* Odd members descending, then even ones ascending, then again */
+	unsigned i, n = (left.tr_end - left.tr_start) / left.tr_step + 1;
+	for (i = n; i-- > 0; )
+	    if (i & 1)
+		xi_nodeset_add(lp, left.tr_start + i * left.tr_step);
+	for (i = 0; i < n; i++)
+	    if (!(i & 1))
+		xi_nodeset_add(lp, left.tr_start + i * left.tr_step);
+	for (i = 0; i < n; i++)
+	    xi_nodeset_add(lp, left.tr_start + i * left.tr_step);
+    } else {
+	for (atom = left.tr_start; atom <= left.tr_end; atom += left.tr_step)
+	    xi_nodeset_add(lp, atom);
+    }
+
+    for (atom = right.tr_start; atom <= right.tr_end; atom += right.tr_step)
+	xi_nodeset_add(rp, atom);
+
+    test_check("left", lp, max, &left, NULL, 0);
+    test_check("right", rp, max, &right, NULL, 0);
+
+    xi_nodeset_t *nsp;
+
+    nsp = xi_nodeset_union(lp, rp);
+    test_check("union", nsp, max, &left, &right, 'u');
+    xi_nodeset_free(nsp);
+
+    nsp = xi_nodeset_intersect(lp, rp);
+    test_check("intersect", nsp, max, &left, &right, 'i');
+    xi_nodeset_free(nsp);
+
+    nsp = xi_nodeset_difference(lp, rp);
+    test_check("difference", nsp, max, &left, &right, 'd');
+    xi_nodeset_free(nsp);
+
+    printf("contains: %s %s\n",
+	   xi_nodeset_contains(lp, left.tr_start) ? "yes" : "no",
+	   xi_nodeset_contains(lp, max + 1) ? "yes" : "no");
+
+    xi_nodeset_free(lp);
+    xi_nodeset_free(rp);
+    pa_mmap_close(pmp);
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Streaming a document through a rulebook (xiwhiffle.c)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xiwhiffle.h>
+
+#include "../memstats.h"
+
+static int
+test_output (void *opaque, const char *buf, size_t len, xi_boolean_t done)
+{
+    unsigned *countp = opaque;
+
+    printf("%s%.*s%s", *countp ? "" : "fragment: [", (int) len, buf,
+	   done ? "]\n" : "");
+    *countp = done ? 0 : *countp + 1;
+
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    const char *opt_script = NULL;
+    int opt_callback = 0;
+    xi_action_type_t opt_default = XIA_SAVE;
+    xi_source_flags_t flags = XPSF_IGNORE_WS | XPSF_IGNORE_COMMENTS;
+    xi_rulebook_t *rb = NULL;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "script") == 0) {
+	    if (argv[argc + 1])
+		opt_script = argv[++argc];
+	} else if (strcmp(argv[argc], "callback") == 0) {
+	    opt_callback = 1;
+	} else if (strcmp(argv[argc], "discard") == 0) {
+	    opt_default = XIA_DISCARD;
+	} else if (strcmp(argv[argc], "emit") == 0) {
+	    opt_default = XIA_EMIT;
+	}
+    }
+
+    assert(opt_filename != NULL);
+
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi06", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *workp = xi_workspace_open(pmp, "test");
+    assert(workp);
+
+    if (opt_script) {
+	xi_parse_t *script = xi_parse_open(pmp, workp, "script",
+					   opt_script, flags);
+	assert(script);
+
+	xi_parse_set_default_rule(script, XIA_SAVE_ATTRIB);
+	xi_parse(script);
+
+	rb = xi_rulebook_prep(script, "rulebook");
+	assert(rb);
+    }
+
+    xi_source_t *srcp = xi_source_open(opt_filename, flags);
+    assert(srcp);
+
+    xi_whiffle_t *xwfp = xi_whiffle_open(rb);
+    assert(xwfp);
+
+    unsigned count = 0;
+
+    xi_whiffle_set_source_file(xwfp, srcp);
+    xi_whiffle_set_default_action(xwfp, opt_default);
+    if (opt_callback)
+	xi_whiffle_set_output(xwfp, test_output, &count);
+    else
+	xi_whiffle_set_fd(xwfp, fileno(stdout));
+
+    int rc = xi_whiffle_process(xwfp);
+    while (rc == 1) {
+	fflush(stdout);
+	printf("return\n");
+	fflush(stdout);
+	rc = xi_whiffle_process(xwfp);
+    }
+
+    fflush(stdout);
+    printf("rc %d, fragments %lu\n", rc,
+	   (unsigned long) xi_whiffle_fragments(xwfp));
+
+    xi_whiffle_close(xwfp);
+    xi_source_destroy(srcp);
+    if (rb)
+	xi_rulebook_close(rb);
+    pa_mmap_close(pmp);
+
+    return 0;
+}
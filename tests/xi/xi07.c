@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Turning xi trees into libxml2 documents (xixml.c)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xixml.h>
+
+#include "../memstats.h"
+
+static const char *test_types[] = {
+    [XI_TYPE_ROOT] = "root",
+    [XI_TYPE_TEXT] = "text",
+    [XI_TYPE_UNESC] = "text",
+    [XI_TYPE_OPEN] = "open",
+    [XI_TYPE_CLOSE] = "close",
+    [XI_TYPE_ATTRIB] = "attrib",
+    [XI_TYPE_NS] = "ns",
+};
+
+/*
+ * Show the tokens xi_parse_as_source() gives for our tree
+ */
+static void
+test_tokens (xi_workspace_t *xwp, pa_atom_t root)
+{
+    xi_parse_as_source_t data;
+    xi_node_type_t type;
+
+    xi_parse_as_source_init(&data, root);
+
+    while ((type = xi_parse_as_source(xwp, &data)) != XI_TYPE_EOF) {
+	if (type == XI_TYPE_FAIL) {
+	    printf("failed\n");
+	    break;
+	}
+
+	printf("%s [%u]%s%s%s%s\n",
+	       (type < sizeof(test_types) / sizeof(test_types[0])
+		&& test_types[type]) ? test_types[type] : "other",
+	       data.xpas_atom,
+	       data.xpas_name ? " " : "", data.xpas_name ?: "",
+	       data.xpas_string ? " = " : "", data.xpas_string ?: "");
+    }
+}
+
+/*
+ * Show the namespace of each element and attribute in the document
+ */
+static void
+test_namespaces (xmlNodePtr node, int indent)
+{
+    xmlAttrPtr attr;
+
+    for ( ; node; node = node->next) {
+	if (node->type != XML_ELEMENT_NODE)
+	    continue;
+
+	printf("%*s%s {%s}\n", indent, "", node->name,
+	       node->ns ? (const char *) node->ns->href : "");
+
+	for (attr = node->properties; attr; attr = attr->next)
+	    printf("%*s@%s {%s}\n", indent + 2, "", attr->name,
+		   attr->ns ? (const char *) attr->ns->href : "");
+
+	test_namespaces(node->children, indent + 2);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    int opt_tokens = 0;
+    xi_source_flags_t flags = 0;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "tokens") == 0) {
+	    opt_tokens = 1;
+	} else if (strcmp(argv[argc], "ignore-ws") == 0) {
+	    flags |= XPSF_IGNORE_WS;
+	}
+    }
+
+    assert(opt_filename != NULL);
+
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi07", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open(pmp, "test");
+    assert(xwp);
+
+    xi_parse_t *parsep = xi_parse_open(pmp, xwp, "test",
+				       opt_filename, flags);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    xi_parse(parsep);
+
+    if (opt_tokens)
+	test_tokens(xwp, xi_parse_root(parsep));
+
+    xmlDocPtr docp = xi_xml_build_doc(xwp, xi_parse_root(parsep));
+    assert(docp);
+
+    xi_parse_destroy(parsep);
+    pa_mmap_close(pmp);
+
+    /* The document stands on its own, once the workspace is gone */
+    xmlDocDump(stdout, docp);
+    test_namespaces(docp->children, 0);
+    xmlFreeDoc(docp);
+
+    return 0;
+}
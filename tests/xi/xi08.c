@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Following a growing file (XI_PF_FOLLOW).  We copy our input into a
+ * data file a piece at a time, parsing after each piece, and compare
+ * the result with parsing the whole input at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+
+#include "../memstats.h"
+
+#define TEST_DATA	"out/xi08.data"	/* File we grow */
+#define TEST_DB		"out/xi08.db"	/* Workspace, for "reopen" */
+
+static xi_source_flags_t test_flags = XPSF_IGNORE_WS;
+
+/*
+ * Emit a tree as XML into a freshly allocated string
+ */
+static char *
+test_emit (xi_parse_t *parsep)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buf, &len);
+
+    assert(fp);
+    xi_parse_emit_xml(parsep, fp);
+    fclose(fp);
+
+    return buf;
+}
+
+/*
+ * Parse the whole input at once, as our reference.  We follow it
+ * too, since following holds back trailing text (which might not
+ * be complete yet), and we need to do the same.
+ */
+static char *
+test_whole (const char *filename)
+{
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi08-whole", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open(pmp, "whole");
+    assert(xwp);
+
+    xi_parse_t *parsep = xi_parse_open(pmp, xwp, "whole",
+				       filename, test_flags);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    parsep->xp_flags |= XI_PF_FOLLOW;
+    xi_parse(parsep);
+
+    char *res = test_emit(parsep);
+
+    xi_parse_destroy(parsep);
+    pa_mmap_close(pmp);
+
+    return res;
+}
+
+static xi_parse_t *
+test_open (pa_mmap_t **pmpp, const char *db)
+{
+    pa_mmap_t *pmp = pa_mmap_open(db, "xi08", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *xwp = xi_workspace_open(pmp, "test");
+    assert(xwp);
+
+    xi_parse_t *parsep = xi_parse_open(pmp, xwp, "test",
+				       TEST_DATA, test_flags);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    parsep->xp_flags |= XI_PF_FOLLOW;
+
+    *pmpp = pmp;
+    return parsep;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    unsigned opt_steps = 4;
+    int opt_reopen = 0;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "steps") == 0) {
+	    if (argv[argc + 1])
+		opt_steps = atoi(argv[++argc]);
+	} else if (strcmp(argv[argc], "reopen") == 0) {
+	    opt_reopen = 1;
+	}
+    }
+
+    assert(opt_filename != NULL && opt_steps > 0);
+
+    /* Read our input, which we'll dribble into the data file */
+    int fd = open(opt_filename, O_RDONLY);
+    assert(fd >= 0);
+
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+
+    size_t len = st.st_size;
+    char *input = malloc(len);
+    assert(input && read(fd, input, len) == (ssize_t) len);
+    close(fd);
+
+    unlink(TEST_DATA);
+    unlink(TEST_DB);
+
+    int dfd = open(TEST_DATA, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(dfd >= 0);
+
+    pa_mmap_t *pmp = NULL;
+    xi_parse_t *parsep = NULL;
+    char *res = NULL;
+    unsigned i;
+
+    if (!opt_reopen)
+	parsep = test_open(&pmp, NULL);
+
+    for (i = 1; i <= opt_steps; i++) {
+	size_t start = len * (i - 1) / opt_steps, end = len * i / opt_steps;
+
+	assert(write(dfd, input + start, end - start)
+	       == (ssize_t) (end - start));
+
+	if (opt_reopen)
+	    parsep = test_open(&pmp, TEST_DB);
+
+	int rc = xi_parse(parsep);
+	printf("step %u: %lu bytes, rc %d, offset %llu, depth %u\n",
+	       i, (unsigned long) end, rc,
+	       (unsigned long long) parsep->xp_srcp->xps_offset,
+	       parsep->xp_insert->xi_depth);
+
+	if (i == opt_steps)
+	    res = test_emit(parsep);
+
+	if (opt_reopen) {
+	    xi_parse_destroy(parsep);
+	    pa_mmap_close(pmp);
+	}
+    }
+
+    if (!opt_reopen) {
+	xi_parse_destroy(parsep);
+	pa_mmap_close(pmp);
+    }
+
+    close(dfd);
+
+    char *whole = test_whole(opt_filename);
+    printf("%s", res);
+    printf("result: %s\n", strcmp(res, whole) == 0 ? "match" : "MISMATCH");
+
+    free(whole);
+    free(res);
+    free(input);
+
+    return 0;
+}
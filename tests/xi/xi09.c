@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Serializing trees through the buffered writer (xiwriter.c).  We emit
+ * via stdio, a file descriptor (writev), or a callback, and check that
+ * each gives the same bytes as stdio.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <libxi/xiscan.h>
+#include <libxi/xiwriter.h>
+
+#include "../memstats.h"
+
+#define TEST_FD_FILE	"out/xi09.fd"	/* Output of the "fd" flavor */
+
+typedef struct test_func_s {
+    FILE *tf_fp;		/* Where we copy our output */
+    unsigned tf_calls;		/* Number of calls */
+} test_func_t;
+
+static int
+test_func (void *opaque, const char *buf, size_t len)
+{
+    test_func_t *tfp = opaque;
+
+    tfp->tf_calls += 1;
+    return (fwrite(buf, 1, len, tfp->tf_fp) == len) ? 0 : -1;
+}
+
+/*
+ * Emit via stdio into a string, as our reference
+ */
+static char *
+test_emit_file (xi_parse_t *parsep)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buf, &len);
+
+    assert(fp);
+    xi_parse_emit_xml(parsep, fp);
+    fclose(fp);
+
+    return buf;
+}
+
+static char *
+test_read_file (const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    assert(fp);
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mp = open_memstream(&buf, &len);
+    char tmp[BUFSIZ];
+    size_t rc;
+
+    assert(mp);
+    while ((rc = fread(tmp, 1, sizeof(tmp), fp)) > 0)
+	fwrite(tmp, 1, rc, mp);
+
+    fclose(mp);
+    fclose(fp);
+
+    return buf;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    int opt_fd = 0;
+    int opt_func = 0;
+    unsigned pflags = 0;
+    xi_source_flags_t flags = XPSF_IGNORE_WS | XPSF_IGNORE_COMMENTS;
+    char *res = NULL;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "unescape") == 0) {
+	    pflags |= XI_PF_UNESCAPE;
+	} else if (strcmp(argv[argc], "fd") == 0) {
+	    opt_fd = 1;
+	} else if (strcmp(argv[argc], "func") == 0) {
+	    opt_func = 1;
+	}
+    }
+
+    assert(opt_filename != NULL);
+
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi09", 0, 0644);
+    assert(pmp);
+
+    xi_workspace_t *workp = xi_workspace_open(pmp, "test");
+    assert(workp);
+
+    xi_parse_t *parsep = xi_parse_open(pmp, workp, "test",
+				       opt_filename, flags);
+    assert(parsep);
+
+    xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+    parsep->xp_flags |= pflags;
+    xi_parse(parsep);
+
+    char *ref = test_emit_file(parsep);
+
+    if (opt_fd) {
+	FILE *fp = fopen(TEST_FD_FILE, "w");
+	assert(fp);
+
+	int rc = xi_parse_emit_xml_fd(parsep, fileno(fp));
+	fclose(fp);
+
+	printf("fd: rc %d\n", rc);
+	res = test_read_file(TEST_FD_FILE);
+
+    } else if (opt_func) {
+	test_func_t tf = { NULL, 0 };
+	size_t len = 0;
+
+	tf.tf_fp = open_memstream(&res, &len);
+	assert(tf.tf_fp);
+
+	xi_writer_t *xwrp = xi_writer_open_func(test_func, &tf);
+	assert(xwrp);
+
+	int rc = xi_parse_emit_xml_writer(parsep, xwrp);
+	printf("func: rc %d, bytes %llu, calls %u\n", rc,
+	       (unsigned long long) xwrp->xwr_bytes, tf.tf_calls);
+
+	xi_writer_close(xwrp);
+	fclose(tf.tf_fp);
+    }
+
+    printf("%s", ref);
+
+    if (res) {
+	printf("result: %s\n", strcmp(res, ref) == 0 ? "match" : "MISMATCH");
+	free(res);
+    }
+
+    free(ref);
+    xi_parse_destroy(parsep);
+    pa_mmap_close(pmp);
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * Many small documents sharing one namepool (xi_workspace_open_shared).
+ * Each document gets its own anonymous workspace; names and namespace
+ * mappings must come out as the same atoms in all of them, and closing
+ * the workspaces must give their memory back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#include "slaxconfig.h"
+#include <libpsu/psucommon.h>
+#include <libpsu/psulog.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+
+#include "../memstats.h"
+
+#define TEST_DOCS_MAX	64	/* Most documents we'll hold open */
+
+static char *
+test_emit (xi_parse_t *parsep)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buf, &len);
+
+    assert(fp);
+    xi_parse_emit_xml(parsep, fp);
+    fclose(fp);
+
+    return buf;
+}
+
+/*
+ * Parse the input into each of 'count' anonymous workspaces, checking
+ * each against the first.  Returns our first document's output.
+ */
+static char *
+test_round (pa_mmap_t *pmp, xi_namepool_t *xnpp, xi_workspace_t **docs,
+	    unsigned count, const char *filename, xi_source_flags_t flags,
+	    psu_boolean_t verbose)
+{
+    char *first = NULL;
+    pa_atom_t first_root = PA_NULL_ATOM;
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+	docs[i] = xi_workspace_open_shared(pmp, NULL, xnpp, 0);
+	assert(docs[i]);
+
+	xi_parse_t *parsep = xi_parse_open(pmp, docs[i], NULL,
+					   filename, flags);
+	assert(parsep);
+
+	xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+	xi_parse(parsep);
+
+	/* The name of the top element, as an atom */
+	xi_node_t *rootp = xi_node_addr(docs[i],
+					xi_node_addr(docs[i],
+						     xi_parse_root(parsep))
+					->xn_contents);
+	pa_atom_t root_name = rootp ? xi_node_name(docs[i], rootp)
+	    : PA_NULL_ATOM;
+
+	char *res = test_emit(parsep);
+
+	if (first == NULL) {
+	    first = res;
+	    first_root = root_name;
+	    if (verbose)
+		printf("%s", first);
+	} else {
+	    if (verbose)
+		printf("doc%u: output %s, top name %s, refcount %u\n", i,
+		       strcmp(first, res) == 0 ? "same" : "DIFFERENT",
+		       (root_name == first_root) ? "same" : "DIFFERENT",
+		       xnpp->xnp_refcount);
+	    free(res);
+	}
+
+	xi_parse_destroy(parsep);
+    }
+
+    return first;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *opt_filename = NULL;
+    unsigned opt_docs = 4;
+    xi_source_flags_t flags = XPSF_IGNORE_WS | XPSF_IGNORE_COMMENTS;
+    xi_workspace_t *docs[TEST_DOCS_MAX];
+    uint32_t free_before, free_after, chunks, largest;
+    unsigned i;
+
+    memstats_init();
+
+    for (argc = 1; argv[argc]; argc++) {
+	if (strcmp(argv[argc], "file") == 0
+	    || strcmp(argv[argc], "input") == 0) {
+	    if (argv[argc + 1])
+		opt_filename = argv[++argc];
+	} else if (strcmp(argv[argc], "docs") == 0) {
+	    if (argv[argc + 1])
+		opt_docs = atoi(argv[++argc]);
+	}
+    }
+
+    assert(opt_filename != NULL);
+    assert(opt_docs > 0 && opt_docs <= TEST_DOCS_MAX);
+
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xi10", 0, 0644);
+    assert(pmp);
+
+    xi_namepool_t *xnpp = xi_namepool_create(pmp, "shared");
+    assert(xnpp);
+
+    char *first = test_round(pmp, xnpp, docs, opt_docs,
+			     opt_filename, flags, TRUE);
+
+    /* The namepool holds each name once, however many documents */
+    pa_atom_t atom = xi_namepool_atom(docs[0], "interface", FALSE);
+    for (i = 1; i < opt_docs; i++)
+	if (xi_namepool_atom(docs[i], "interface", FALSE) != atom)
+	    break;
+    printf("interface: %s\n", (atom != PA_NULL_ATOM && i == opt_docs)
+	   ? "one atom" : "MISSING OR DUPLICATED");
+
+    for (i = 0; i < opt_docs; i++)
+	xi_workspace_close(docs[i]);
+
+    printf("refcount after close: %u\n", xnpp->xnp_refcount);
+
+    /*
+     * Closing anonymous workspaces gives their memory back, so a
+     * second round should fit in the same space as the first.
+     */
+    pa_mmap_free_space(pmp, &free_before, &chunks, &largest);
+
+    char *again = test_round(pmp, xnpp, docs, opt_docs,
+			     opt_filename, flags, FALSE);
+    printf("second round: output %s\n",
+	   strcmp(first, again) == 0 ? "same" : "DIFFERENT");
+
+    for (i = 0; i < opt_docs; i++)
+	xi_workspace_close(docs[i]);
+
+    pa_mmap_free_space(pmp, &free_after, &chunks, &largest);
+    printf("second round: free space %s\n",
+	   (free_before == free_after) ? "same" : "DIFFERENT");
+
+    xi_namepool_release(xnpp);
+    free(again);
+    free(first);
+    pa_mmap_close(pmp);
+
+    return 0;
+}
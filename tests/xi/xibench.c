@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2017, Juniper Networks, Inc.
+ * All rights reserved.
+ * This SOFTWARE is licensed under the LICENSE provided in the
+ * ../Copyright file. By downloading, installing, copying, or otherwise
+ * using the SOFTWARE, you agree to be bound by the terms of that
+ * LICENSE.
+ *
+ * xibench -- parser throughput: libxi vs libxml2 vs libslax's JSON
+ *
+ * We generate four corpora, each as XML and as the equivalent JSON:
+ * "deep" (nested configuration groups), "wide" (flat records of many
+ * small leaves), "attrs" (empty elements carrying all their data in
+ * attributes), and "text" (long paragraphs with a few entities).  The
+ * generator is deterministic, so a given "bytes" gives the same input
+ * on every machine.  "input FILE" adds a corpus of your own (XML
+ * only, so it's skipped by the JSON parser).
+ *
+ * Each corpus is parsed "iterations" times by each parser, building
+ * the parser's own tree:  xi_parse() into a fresh workspace (saving
+ * attributes), xmlReadMemory() into a libxml2 document, and
+ * slaxJsonDataToXml() from the JSON form.  We report MB/s (best and
+ * median), and the number and size of allocations made through
+ * xmlMalloc and friends for one parse.  libxi keeps its tree in its
+ * segment rather than on the heap, so for it we report the size of
+ * the segment as well.  Freeing the tree isn't timed.
+ *
+ * xi_parse() reads from a file, so the corpora are written to "dir"
+ * (default ".") and removed afterwards unless "keep" is given.
+ * Results are written as JSON.  "make bench" runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include <libpsu/psucommon.h>
+#include <libpsu/psualloc.h>
+#include <libpsu/psustring.h>
+#include <libpsu/psutime.h>
+#include <parrotdb/pacommon.h>
+#include <parrotdb/paconfig.h>
+#include <parrotdb/pammap.h>
+#include <parrotdb/pafixed.h>
+#include <parrotdb/paarb.h>
+#include <parrotdb/paistr.h>
+#include <parrotdb/papat.h>
+#include <parrotdb/pabitmap.h>
+#include <libxi/xicommon.h>
+#include <libxi/xisource.h>
+#include <libxi/xirules.h>
+#include <libxi/xitree.h>
+#include <libxi/xiworkspace.h>
+#include <libxi/xiparse.h>
+#include <sys/queue.h>
+#include "slaxinternals.h"
+#include <libslax/slaxdata.h>
+#include <libslax/jsonlexer.h>
+
+#define BENCH_MAX_CORPORA	16	/* Generated plus "input" files */
+#define BENCH_MAX_ITERATIONS	1000
+#define BENCH_DEEP_LEVELS	12	/* Nesting in each "deep" group */
+
+typedef struct corpus_s {
+    const char *c_name;		/* Name (or file name for "input") */
+    char *c_path;		/* File holding the XML */
+    char *c_xml;		/* The XML, in memory */
+    size_t c_xml_len;		/* Length of c_xml */
+    char *c_json;		/* The JSON, or NULL if we don't have it */
+    size_t c_json_len;		/* Length of c_json */
+    int c_generated;		/* We made c_path (so we remove it) */
+} corpus_t;
+
+typedef struct bench_result_s {
+    uint64_t br_nsecs[BENCH_MAX_ITERATIONS]; /* Time for each parse */
+    unsigned long br_allocs;	/* Allocations in the last parse */
+    unsigned long br_alloc_bytes; /* Bytes requested in the last parse */
+    size_t br_segment;		/* Segment size (libxi only) */
+    int br_failed;		/* A parse failed */
+} bench_result_t;
+
+typedef void (*corpus_gen_t)(psu_strbuf_t *xml, psu_strbuf_t *json,
+			     unsigned item);
+
+size_t opt_bytes = 4 * 1024 * 1024;
+unsigned opt_iterations = 5;
+const char *opt_dir = ".";
+const char *opt_only;		/* Corpora to run (comma-separated) */
+int opt_keep;
+const char *opt_output;
+
+corpus_t corpora[BENCH_MAX_CORPORA];
+unsigned ncorpora;
+
+FILE *outfp;
+int results;			/* Results written (for commas) */
+
+/*
+ * Counting wrappers for xmlMalloc and friends.  We count calls (a
+ * realloc is a call to the allocator too) and bytes requested.
+ */
+unsigned long bench_allocs, bench_alloc_bytes;
+
+static void *
+bench_malloc (size_t size)
+{
+    bench_allocs += 1;
+    bench_alloc_bytes += size;
+    return malloc(size);
+}
+
+static void *
+bench_realloc (void *ptr, size_t size)
+{
+    bench_allocs += 1;
+    bench_alloc_bytes += size;
+    return realloc(ptr, size);
+}
+
+static char *
+bench_strdup (const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *cp = bench_malloc(len);
+
+    if (cp)
+	memcpy(cp, str, len);
+    return cp;
+}
+
+static void
+bench_alloc_reset (void)
+{
+    bench_allocs = bench_alloc_bytes = 0;
+}
+
+/*
+ * The corpora.  Each generator adds one item to both forms; the
+ * caller supplies the enclosing element/object and the commas.
+ */
+static void
+gen_deep (psu_strbuf_t *xml, psu_strbuf_t *json, unsigned item)
+{
+    static const char *levels[BENCH_DEEP_LEVELS] = {
+	"system", "services", "ssh", "protocol", "options", "limits",
+	"session", "timers", "keepalive", "interval", "range", "bound",
+    };
+    int i;
+
+    psu_strbuf_printf(xml, "<group><name>group-%u</name>", item);
+    psu_strbuf_printf(json, "{\"name\": \"group-%u\"", item);
+
+    for (i = 0; i < BENCH_DEEP_LEVELS; i++) {
+	psu_strbuf_printf(xml, "<%s><level>%d</level>", levels[i], i);
+	psu_strbuf_printf(json, ", \"%s\": {\"level\": %d", levels[i], i);
+    }
+
+    psu_strbuf_printf(xml, "<value>%u</value>", item * 7);
+    psu_strbuf_printf(json, ", \"value\": %u", item * 7);
+
+    for (i = BENCH_DEEP_LEVELS - 1; i >= 0; i--) {
+	psu_strbuf_printf(xml, "</%s>", levels[i]);
+	psu_strbuf_append_char(json, '}');
+    }
+
+    psu_strbuf_append_string(xml, "</group>");
+    psu_strbuf_append_char(json, '}');
+}
+
+static void
+gen_wide (psu_strbuf_t *xml, psu_strbuf_t *json, unsigned item)
+{
+    psu_strbuf_printf(xml, "<record><name>ge-0/%u/%u</name>"
+		      "<address>10.%u.%u.%u</address><port>%u</port>"
+		      "<state>%s</state><mtu>%u</mtu><speed>10g</speed>"
+		      "<vlan>%u</vlan><description>uplink %u</description>"
+		      "</record>",
+		      item / 48, item % 48, (item >> 16) & 0xff,
+		      (item >> 8) & 0xff, item & 0xff, 1024 + item % 60000,
+		      (item % 5) ? "up" : "down", 1500 + (item % 3) * 7500,
+		      item % 4094 + 1, item);
+    psu_strbuf_printf(json, "{\"name\": \"ge-0/%u/%u\", "
+		      "\"address\": \"10.%u.%u.%u\", \"port\": %u, "
+		      "\"state\": \"%s\", \"mtu\": %u, \"speed\": \"10g\", "
+		      "\"vlan\": %u, \"description\": \"uplink %u\"}",
+		      item / 48, item % 48, (item >> 16) & 0xff,
+		      (item >> 8) & 0xff, item & 0xff, 1024 + item % 60000,
+		      (item % 5) ? "up" : "down", 1500 + (item % 3) * 7500,
+		      item % 4094 + 1, item);
+}
+
+static void
+gen_attrs (psu_strbuf_t *xml, psu_strbuf_t *json, unsigned item)
+{
+    psu_strbuf_printf(xml, "<item id=\"%u\" name=\"ge-0/%u/%u\" "
+		      "type=\"ethernet\" state=\"%s\" mtu=\"%u\" "
+		      "speed=\"10g\" vlan=\"%u\" flags=\"0x%x\"/>",
+		      item, item / 48, item % 48, (item % 5) ? "up" : "down",
+		      1500 + (item % 3) * 7500, item % 4094 + 1, item & 0x1f);
+    psu_strbuf_printf(json, "{\"id\": %u, \"name\": \"ge-0/%u/%u\", "
+		      "\"type\": \"ethernet\", \"state\": \"%s\", "
+		      "\"mtu\": %u, \"speed\": \"10g\", \"vlan\": %u, "
+		      "\"flags\": \"0x%x\"}",
+		      item, item / 48, item % 48, (item % 5) ? "up" : "down",
+		      1500 + (item % 3) * 7500, item % 4094 + 1, item & 0x1f);
+}
+
+static void
+gen_text (psu_strbuf_t *xml, psu_strbuf_t *json, unsigned item)
+{
+    static const char *words[] = {
+	"the", "quick", "parser", "reads", "each", "byte", "once", "and",
+	"never", "looks", "back", "while", "building", "its", "tree",
+	"from", "configuration", "data", "that", "operators", "write",
+    };
+    const unsigned nwords = sizeof(words) / sizeof(words[0]);
+    unsigned i, w = item;
+
+    psu_strbuf_append_string(xml, "<para>");
+    psu_strbuf_append_string(json, "\"");
+
+    for (i = 0; i < 64; i++) {
+	w = w * 1103515245 + 12345;
+	if (i) {
+	    psu_strbuf_append_char(xml, ' ');
+	    psu_strbuf_append_char(json, ' ');
+	}
+	psu_strbuf_append_string(xml, words[(w >> 16) % nwords]);
+	psu_strbuf_append_string(json, words[(w >> 16) % nwords]);
+
+	/* Something to unescape now and then */
+	if (i % 16 == 15) {
+	    psu_strbuf_append_string(xml, " &amp; &lt;more&gt;");
+	    psu_strbuf_append_string(json, " & <more>");
+	}
+    }
+
+    psu_strbuf_printf(xml, " (%u).</para>", item);
+    psu_strbuf_printf(json, " (%u).\"", item);
+}
+
+static const struct {
+    const char *cg_name;	/* Corpus name */
+    corpus_gen_t cg_func;	/* Generator */
+    const char *cg_root;	/* Enclosing element */
+    const char *cg_item;	/* Name of each item (the JSON array) */
+} generators[] = {
+    { "deep", gen_deep, "configuration", "group" },
+    { "wide", gen_wide, "records", "record" },
+    { "attrs", gen_attrs, "items", "item" },
+    { "text", gen_text, "docs", "para" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static int
+bench_wanted (const char *name)
+{
+    const char *cp;
+    size_t len = strlen(name);
+
+    if (opt_only == NULL)
+	return TRUE;
+
+    for (cp = opt_only; (cp = strstr(cp, name)) != NULL; cp += len)
+	if ((cp == opt_only || cp[-1] == ',')
+		&& (cp[len] == '\0' || cp[len] == ','))
+	    return TRUE;
+
+    return FALSE;
+}
+
+static char *
+bench_path (const char *name)
+{
+    char *path = NULL;
+
+    if (asprintf(&path, "%s/xibench-%s.xml", opt_dir, name) < 0)
+	err(1, "asprintf");
+    return path;
+}
+
+static void
+corpus_write (corpus_t *cp)
+{
+    int fd = open(cp->c_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+	err(1, "could not create corpus: %s", cp->c_path);
+    if (write(fd, cp->c_xml, cp->c_xml_len) != (ssize_t) cp->c_xml_len)
+	err(1, "could not write corpus: %s", cp->c_path);
+    close(fd);
+}
+
+static void
+corpus_generate (unsigned gen)
+{
+    psu_strbuf_t xml, json;
+    corpus_t *cp;
+    unsigned item;
+
+    if (ncorpora >= BENCH_MAX_CORPORA)
+	return;
+
+    psu_strbuf_init(&xml, NULL, opt_bytes + BUFSIZ);
+    psu_strbuf_init(&json, NULL, opt_bytes + BUFSIZ);
+
+    psu_strbuf_printf(&xml, "<%s>", generators[gen].cg_root);
+    psu_strbuf_printf(&json, "{\"%s\": {\"%s\": [",
+		      generators[gen].cg_root, generators[gen].cg_item);
+
+    for (item = 0; psu_strbuf_len(&xml) < opt_bytes; item++) {
+	if (item)
+	    psu_strbuf_append_string(&json, ", ");
+	generators[gen].cg_func(&xml, &json, item);
+    }
+
+    psu_strbuf_printf(&xml, "</%s>\n", generators[gen].cg_root);
+    psu_strbuf_append_string(&json, "]}}\n");
+
+    if (xml.psb_failed || json.psb_failed)
+	errx(1, "out of memory generating corpus '%s'",
+	     generators[gen].cg_name);
+
+    cp = &corpora[ncorpora++];
+    cp->c_name = generators[gen].cg_name;
+    cp->c_xml = psu_strbuf_detach(&xml, &cp->c_xml_len);
+    cp->c_json = psu_strbuf_detach(&json, &cp->c_json_len);
+    cp->c_path = bench_path(cp->c_name);
+    cp->c_generated = TRUE;
+
+    corpus_write(cp);
+}
+
+static void
+corpus_input (const char *path)
+{
+    struct stat st;
+    corpus_t *cp;
+    int fd;
+
+    if (ncorpora >= BENCH_MAX_CORPORA)
+	return;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+	err(1, "could not open input: %s", path);
+
+    cp = &corpora[ncorpora++];
+    cp->c_name = path;
+    cp->c_path = strdup(path);
+    cp->c_xml_len = st.st_size;
+    cp->c_xml = psu_malloc(cp->c_xml_len + 1);
+    if (cp->c_path == NULL || cp->c_xml == NULL)
+	errx(1, "out of memory");
+    if (read(fd, cp->c_xml, cp->c_xml_len) != (ssize_t) cp->c_xml_len)
+	err(1, "could not read input: %s", path);
+    cp->c_xml[cp->c_xml_len] = '\0';
+    close(fd);
+}
+
+static void
+corpus_cleanup (corpus_t *cp)
+{
+    if (cp->c_generated && !opt_keep)
+	unlink(cp->c_path);
+
+    free(cp->c_path);
+    psu_free(cp->c_xml);
+    if (cp->c_json)
+	psu_free(cp->c_json);
+}
+
+/*
+ * The parsers.  Each parses the corpus once, recording the time in
+ * slot "iter" of the result.
+ */
+static void
+parse_xi (corpus_t *cp, bench_result_t *brp, unsigned iter)
+{
+    pa_mmap_t *pmp = pa_mmap_open(NULL, "xibench", 0, 0644);
+    xi_workspace_t *workp;
+    xi_parse_t *parsep;
+    psu_ticks_t start;
+
+    assert(pmp != NULL);
+    workp = xi_workspace_open(pmp, "bench");
+    assert(workp != NULL);
+
+    bench_alloc_reset();
+    start = psu_ticks_fenced();
+
+    parsep = xi_parse_open(pmp, workp, "bench", cp->c_path, XPSF_MMAP_INPUT);
+    if (parsep) {
+	xi_parse_set_default_rule(parsep, XIA_SAVE_ATTRIB);
+	if (xi_parse(parsep) < 0)
+	    brp->br_failed = TRUE;
+    } else {
+	brp->br_failed = TRUE;
+    }
+
+    brp->br_nsecs[iter] = psu_ticks_to_nsecs(psu_ticks_fenced() - start);
+    brp->br_allocs = bench_allocs;
+    brp->br_alloc_bytes = bench_alloc_bytes;
+    brp->br_segment = pmp->pm_len;
+
+    xi_parse_destroy(parsep);
+    xi_workspace_close(workp);
+    pa_mmap_close(pmp);
+}
+
+static void
+parse_libxml2 (corpus_t *cp, bench_result_t *brp, unsigned iter)
+{
+    psu_ticks_t start;
+    xmlDocPtr docp;
+
+    bench_alloc_reset();
+    start = psu_ticks_fenced();
+
+    docp = xmlReadMemory(cp->c_xml, cp->c_xml_len, cp->c_name, NULL, 0);
+
+    brp->br_nsecs[iter] = psu_ticks_to_nsecs(psu_ticks_fenced() - start);
+    brp->br_allocs = bench_allocs;
+    brp->br_alloc_bytes = bench_alloc_bytes;
+
+    if (docp)
+	xmlFreeDoc(docp);
+    else
+	brp->br_failed = TRUE;
+}
+
+static void
+parse_json (corpus_t *cp, bench_result_t *brp, unsigned iter)
+{
+    psu_ticks_t start;
+    xmlDocPtr docp;
+
+    bench_alloc_reset();
+    start = psu_ticks_fenced();
+
+    docp = slaxJsonDataToXml(cp->c_json, NULL, 0);
+
+    brp->br_nsecs[iter] = psu_ticks_to_nsecs(psu_ticks_fenced() - start);
+    brp->br_allocs = bench_allocs;
+    brp->br_alloc_bytes = bench_alloc_bytes;
+
+    if (docp)
+	xmlFreeDoc(docp);
+    else
+	brp->br_failed = TRUE;
+}
+
+static const struct {
+    const char *p_name;		/* Parser */
+    const char *p_form;		/* Which form of the corpus it reads */
+    void (*p_func)(corpus_t *, bench_result_t *, unsigned);
+} parsers[] = {
+    { "xi", "xml", parse_xi },
+    { "libxml2", "xml", parse_libxml2 },
+    { "slax-json", "json", parse_json },
+    { NULL, NULL, NULL }
+};
+
+static int
+bench_compare (const void *av, const void *bv)
+{
+    uint64_t a = *(const uint64_t *) av, b = *(const uint64_t *) bv;
+
+    return (a < b) ? -1 : (a > b);
+}
+
+static double
+bench_mbps (size_t bytes, uint64_t nsecs)
+{
+    return nsecs ? (double) bytes * 1e3 / nsecs : 0; /* 1e6 bytes/1e9 ns */
+}
+
+static void
+bench_report (corpus_t *cp, const char *parser, const char *form,
+	      size_t bytes, bench_result_t *brp)
+{
+    uint64_t best, median;
+
+    qsort(brp->br_nsecs, opt_iterations, sizeof(brp->br_nsecs[0]),
+	  bench_compare);
+    best = brp->br_nsecs[0];
+    median = brp->br_nsecs[opt_iterations / 2];
+
+    fprintf(outfp, "%s        { \"corpus\": \"%s\", \"parser\": \"%s\", "
+	    "\"form\": \"%s\", \"bytes\": %zu,\n"
+	    "          \"ok\": %s, \"usecs\": { \"best\": %lu, "
+	    "\"median\": %lu },\n"
+	    "          \"mb-per-sec\": { \"best\": %.1f, \"median\": %.1f },\n"
+	    "          \"allocs\": %lu, \"alloc-bytes\": %lu",
+	    results++ ? ",\n" : "", cp->c_name, parser, form, bytes,
+	    brp->br_failed ? "false" : "true",
+	    (unsigned long) (best / 1000), (unsigned long) (median / 1000),
+	    bench_mbps(bytes, best), bench_mbps(bytes, median),
+	    brp->br_allocs, brp->br_alloc_bytes);
+
+    if (brp->br_segment)
+	fprintf(outfp, ", \"segment-bytes\": %zu", brp->br_segment);
+
+    fprintf(outfp, " }");
+}
+
+int
+main (int argc UNUSED, char **argv)
+{
+    bench_result_t *brp;
+    corpus_t *cp;
+    unsigned c, p, i;
+    size_t bytes;
+
+    for (argc = 1; argv[argc]; argc++) {
+	const char *opt = argv[argc];
+
+	if (strcmp(opt, "keep") == 0) {
+	    opt_keep = TRUE;
+	    continue;
+	}
+
+	const char *val = argv[argc + 1];
+	if (val == NULL)
+	    errx(1, "missing value for '%s'", opt);
+	argc += 1;
+
+	if (strcmp(opt, "bytes") == 0) {
+	    opt_bytes = strtoul(val, NULL, 0);
+	} else if (strcmp(opt, "iterations") == 0) {
+	    opt_iterations = atoi(val);
+	} else if (strcmp(opt, "only") == 0) {
+	    opt_only = val;
+	} else if (strcmp(opt, "dir") == 0) {
+	    opt_dir = val;
+	} else if (strcmp(opt, "input") == 0) {
+	    corpus_input(val);
+	} else if (strcmp(opt, "output") == 0) {
+	    opt_output = val;
+	} else {
+	    errx(1, "unknown option '%s'", opt);
+	}
+    }
+
+    if (opt_iterations < 1)
+	opt_iterations = 1;
+    else if (opt_iterations > BENCH_MAX_ITERATIONS)
+	opt_iterations = BENCH_MAX_ITERATIONS;
+
+    /* Must precede any libxml2 allocation */
+    if (xmlMemSetup(free, bench_malloc, bench_realloc, bench_strdup) != 0)
+	errx(1, "xmlMemSetup failed");
+    xmlInitParser();
+
+    for (i = 0; generators[i].cg_name; i++)
+	if (bench_wanted(generators[i].cg_name))
+	    corpus_generate(i);
+
+    outfp = opt_output ? fopen(opt_output, "w") : stdout;
+    if (outfp == NULL)
+	err(1, "could not open output: %s", opt_output);
+
+    /* Calibrate before anything is timed */
+    psu_ticks_per_sec();
+
+    brp = calloc(1, sizeof(*brp));
+    assert(brp != NULL);
+
+    fprintf(outfp, "{\n    \"benchmark\": \"xibench\",\n"
+	    "    \"ticks\": \"%s\",\n    \"iterations\": %u,\n"
+	    "    \"results\": [\n", PSU_TICKS_SOURCE, opt_iterations);
+
+    for (c = 0; c < ncorpora; c++) {
+	cp = &corpora[c];
+
+	for (p = 0; parsers[p].p_name; p++) {
+	    if (strcmp(parsers[p].p_form, "json") == 0) {
+		if (cp->c_json == NULL)
+		    continue;
+		bytes = cp->c_json_len;
+	    } else {
+		bytes = cp->c_xml_len;
+	    }
+
+	    bzero(brp, sizeof(*brp));
+
+	    /* One untimed pass to warm the caches (and the page cache) */
+	    parsers[p].p_func(cp, brp, 0);
+
+	    for (i = 0; i < opt_iterations; i++)
+		parsers[p].p_func(cp, brp, i);
+
+	    bench_report(cp, parsers[p].p_name, parsers[p].p_form, bytes, brp);
+	    fflush(outfp);
+	}
+    }
+
+    fprintf(outfp, "\n    ]\n}\n");
+
+    if (outfp != stdout)
+	fclose(outfp);
+
+    for (c = 0; c < ncorpora; c++)
+	corpus_cleanup(&corpora[c]);
+    free(brp);
+    xmlCleanupParser();
+
+    return 0;
+}